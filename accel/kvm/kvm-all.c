@@ -42,10 +42,12 @@
 #include "qapi/visitor.h"
 #include "qapi/qapi-types-common.h"
 #include "qapi/qapi-visit-common.h"
+#include "qapi/qapi-commands-machine.h"
 #include "sysemu/reset.h"
 #include "qemu/guest-random.h"
 #include "sysemu/hw_accel.h"
 #include "kvm-cpus.h"
+#include "sysemu/dirtylimit.h"
 
 #include "hw/boards.h"
 //#include "qemu/intercept-interrupt.h"
@@ -140,6 +142,9 @@ struct KVMState
         KVMMemoryListener *ml;
         AddressSpace *as;
     } *as;
+    uint64_t kvm_dirty_ring_bytes;  /* Size of the per-vcpu dirty ring */
+    uint32_t kvm_dirty_ring_size;   /* Number of dirty GFNs per ring */
+    struct KVMDirtyRingReaper reaper;
 };
 
 KVMState *kvm_state;
@@ -162,6 +167,9 @@ bool kvm_msi_use_devid;
 static bool kvm_immediate_exit;
 static hwaddr kvm_max_slot_size = ~0;
 
+static void kvm_exit_stats_init(CPUState *cpu);
+static void kvm_exit_stats_free(CPUState *cpu);
+
 /******************************************************************************
  ****************************************************************************** 
 ******************************************************************************/
@@ -226,8 +234,15 @@ typedef struct KVMResampleFd KVMResampleFd;
 static QLIST_HEAD(, KVMResampleFd) kvm_resample_fd_list =
     QLIST_HEAD_INITIALIZER(kvm_resample_fd_list);
 
-#define kvm_slots_lock(kml)      qemu_mutex_lock(&(kml)->slots_lock)
-#define kvm_slots_unlock(kml)    qemu_mutex_unlock(&(kml)->slots_lock)
+/*
+ * Protects the slots of all KVMMemoryListeners.  A single lock is used
+ * because the dirty ring reaper needs to look up slots of every address
+ * space at once.
+ */
+static QemuMutex kml_slots_lock;
+
+#define kvm_slots_lock()    qemu_mutex_lock(&kml_slots_lock)
+#define kvm_slots_unlock()  qemu_mutex_unlock(&kml_slots_lock)
 
 static inline void kvm_resample_fd_remove(int gsi)
 {
@@ -272,7 +287,7 @@ int kvm_get_max_memslots(void)
     return s->nr_slots;
 }
 
-/* Called with KVMMemoryListener.slots_lock held */
+/* Called with kvm_slots_lock() held */
 static KVMSlot *kvm_get_free_slot(KVMMemoryListener *kml)
 {
     KVMState *s = kvm_state;
@@ -293,14 +308,14 @@ bool kvm_has_free_slot(MachineState *ms)
     bool result;
     KVMMemoryListener *kml = &s->memory_listener;
 
-    kvm_slots_lock(kml);
+    kvm_slots_lock();
     result = !!kvm_get_free_slot(kml);
-    kvm_slots_unlock(kml);
+    kvm_slots_unlock();
 
     return result;
 }
 
-/* Called with KVMMemoryListener.slots_lock held */
+/* Called with kvm_slots_lock() held */
 static KVMSlot *kvm_alloc_slot(KVMMemoryListener *kml)
 {
     KVMSlot *slot = kvm_get_free_slot(kml);
@@ -313,19 +328,85 @@ static KVMSlot *kvm_alloc_slot(KVMMemoryListener *kml)
     abort();
 }
 
+/* Registered slots never overlap, so ordering them by range is total */
+static gint kvm_slot_compare(gconstpointer a, gconstpointer b, gpointer data)
+{
+    const KVMSlot *m1 = a, *m2 = b;
+
+    if (m1->start_addr + m1->memory_size <= m2->start_addr) {
+        return -1;
+    }
+    if (m2->start_addr + m2->memory_size <= m1->start_addr) {
+        return 1;
+    }
+    return 0;
+}
+
+/* Called with kvm_slots_lock() held */
+static void kvm_slot_index_insert(KVMMemoryListener *kml, KVMSlot *mem)
+{
+    if (mem->memory_size) {
+        g_tree_insert(kml->slot_index, mem, mem);
+    }
+}
+
+/* Called with kvm_slots_lock() held, before @mem's range changes */
+static void kvm_slot_index_remove(KVMMemoryListener *kml, KVMSlot *mem)
+{
+    if (mem->memory_size) {
+        g_tree_remove(kml->slot_index, mem);
+    }
+}
+
+typedef struct KVMSlotSearch {
+    hwaddr addr;
+    KVMSlot *next;
+} KVMSlotSearch;
+
+static gint kvm_slot_search(gconstpointer key, gconstpointer data)
+{
+    const KVMSlot *mem = key;
+    KVMSlotSearch *search = (KVMSlotSearch *)data;
+
+    if (search->addr < mem->start_addr) {
+        /* Each step to the left gets closer to @addr */
+        search->next = (KVMSlot *)mem;
+        return -1;
+    }
+    if (search->addr >= mem->start_addr + mem->memory_size) {
+        return 1;
+    }
+    return 0;
+}
+
+/*
+ * Return the slot containing @addr or, if there is none, the first slot
+ * above it.  Called with kvm_slots_lock() held.
+ */
+static KVMSlot *kvm_slot_lookup_next(KVMMemoryListener *kml, hwaddr addr)
+{
+    KVMSlotSearch search = { .addr = addr };
+    KVMSlot *mem = g_tree_search(kml->slot_index, kvm_slot_search, &search);
+
+    return mem ? mem : search.next;
+}
+
+/* Return the slot containing @addr.  Called with kvm_slots_lock() held */
+static KVMSlot *kvm_slot_lookup(KVMMemoryListener *kml, hwaddr addr)
+{
+    KVMSlot *mem = kvm_slot_lookup_next(kml, addr);
+
+    return mem && addr >= mem->start_addr ? mem : NULL;
+}
+
 static KVMSlot *kvm_lookup_matching_slot(KVMMemoryListener *kml,
                                          hwaddr start_addr,
                                          hwaddr size)
 {
-    KVMState *s = kvm_state;
-    int i;
+    KVMSlot *mem = kvm_slot_lookup(kml, start_addr);
 
-    for (i = 0; i < s->nr_slots; i++) {
-        KVMSlot *mem = &kml->slots[i];
-
-        if (start_addr == mem->start_addr && size == mem->memory_size) {
-            return mem;
-        }
+    if (mem && start_addr == mem->start_addr && size == mem->memory_size) {
+        return mem;
     }
 
     return NULL;
@@ -361,7 +442,7 @@ int kvm_physical_memory_addr_from_host(KVMState *s, void *ram,
     KVMMemoryListener *kml = &s->memory_listener;
     int i, ret = 0;
 
-    kvm_slots_lock(kml);
+    kvm_slots_lock();
     for (i = 0; i < s->nr_slots; i++) {
         KVMSlot *mem = &kml->slots[i];
 
@@ -371,7 +452,7 @@ int kvm_physical_memory_addr_from_host(KVMState *s, void *ram,
             break;
         }
     }
-    kvm_slots_unlock(kml);
+    kvm_slots_unlock();
 
     return ret;
 }
@@ -383,22 +464,16 @@ int kvm_physical_memory_addr_from_host(KVMState *s, void *ram,
 void *kvm_physical_memory_addr_to_host(KVMState *s, hwaddr guest_physical)
 {
     KVMMemoryListener *kml = &s->memory_listener;
-    int i;
+    KVMSlot *mem;
     void *host_virtual = NULL;
 
-    kvm_slots_lock(kml);
-    for (i = 0; i < s->nr_slots; i++) {
-        KVMSlot *mem = &kml->slots[i];
-
-        if (guest_physical >= mem->start_addr && 
-                guest_physical < mem->start_addr + mem->memory_size){
-            
-            host_virtual = (void *)
-                (mem->ram + guest_physical - mem->start_addr);
-            break;
-        }
+    kvm_slots_lock();
+    mem = kvm_slot_lookup(kml, guest_physical);
+    if (mem) {
+        host_virtual = (void *)
+            (mem->ram + guest_physical - mem->start_addr);
     }
-    kvm_slots_unlock(kml);
+    kvm_slots_unlock();
 
     return host_virtual;
 }
@@ -455,6 +530,7 @@ static int do_kvm_destroy_vcpu(CPUState *cpu)
     if (ret < 0) {
         goto err;
     }
+    kvm_exit_stats_free(cpu);
 
     mmap_size = kvm_ioctl(s, KVM_GET_VCPU_MMAP_SIZE, 0);
     if (mmap_size < 0) {
@@ -468,6 +544,13 @@ static int do_kvm_destroy_vcpu(CPUState *cpu)
         goto err;
     }
 
+    if (cpu->kvm_dirty_gfns) {
+        ret = munmap(cpu->kvm_dirty_gfns, s->kvm_dirty_ring_bytes);
+        if (ret < 0) {
+            goto err;
+        }
+    }
+
     vcpu = g_malloc0(sizeof(*vcpu));
     vcpu->vcpu_id = kvm_arch_vcpu_id(cpu);
     vcpu->kvm_fd = cpu->kvm_fd;
@@ -544,12 +627,29 @@ int kvm_init_vcpu(CPUState *cpu, Error **errp)
             (void *)cpu->kvm_run + s->coalesced_mmio * PAGE_SIZE;
     }
 
+    if (s->kvm_dirty_ring_size) {
+        /* Use MAP_SHARED to share pages with the kernel */
+        cpu->kvm_dirty_gfns = mmap(NULL, s->kvm_dirty_ring_bytes,
+                                   PROT_READ | PROT_WRITE, MAP_SHARED,
+                                   cpu->kvm_fd,
+                                   PAGE_SIZE * KVM_DIRTY_LOG_PAGE_OFFSET);
+        if (cpu->kvm_dirty_gfns == MAP_FAILED) {
+            ret = -errno;
+            error_setg_errno(errp, -ret,
+                             "kvm_init_vcpu: mmap'ing dirty ring failed (%lu)",
+                             kvm_arch_vcpu_id(cpu));
+            goto err;
+        }
+    }
+
     ret = kvm_arch_init_vcpu(cpu);
     if (ret < 0) {
         error_setg_errno(errp, -ret,
                          "kvm_init_vcpu: kvm_arch_init_vcpu failed (%lu)",
                          kvm_arch_vcpu_id(cpu));
+        goto err;
     }
+    kvm_exit_stats_init(cpu);
 err:
     return ret;
 }
@@ -572,7 +672,7 @@ static int kvm_mem_flags(MemoryRegion *mr)
     return flags;
 }
 
-/* Called with KVMMemoryListener.slots_lock held */
+/* Called with kvm_slots_lock() held */
 static int kvm_slot_update_flags(KVMMemoryListener *kml, KVMSlot *mem,
                                  MemoryRegion *mr)
 {
@@ -598,7 +698,7 @@ static int kvm_section_update_flags(KVMMemoryListener *kml,
         return 0;
     }
 
-    kvm_slots_lock(kml);
+    kvm_slots_lock();
 
     while (size && !ret) {
         slot_size = MIN(kvm_max_slot_size, size);
@@ -614,7 +714,7 @@ static int kvm_section_update_flags(KVMMemoryListener *kml,
     }
 
 out:
-    kvm_slots_unlock(kml);
+    kvm_slots_unlock();
     return ret;
 }
 
@@ -697,7 +797,7 @@ static void kvm_memslot_init_dirty_bitmap(KVMSlot *mem)
  * This function will first try to fetch dirty bitmap from the kernel,
  * and then updates qemu's dirty bitmap.
  *
- * NOTE: caller must be with kml->slots_lock held.
+ * NOTE: caller must hold kvm_slots_lock().
  *
  * @kml: the KVM memory listener object
  * @section: the memory section to sync the dirty bitmap with
@@ -751,6 +851,186 @@ out:
     return ret;
 }
 
+/* Must be called with kvm_slots_lock() held */
+static void kvm_dirty_ring_mark_page(KVMState *s, uint32_t as_id,
+                                     uint32_t slot_id, uint64_t offset)
+{
+    KVMMemoryListener *kml;
+    KVMSlot *mem;
+    uint8_t clients;
+
+    if (as_id >= s->nr_as || !s->as[as_id].ml) {
+        return;
+    }
+
+    kml = s->as[as_id].ml;
+    if (slot_id >= s->nr_slots) {
+        return;
+    }
+    mem = &kml->slots[slot_id];
+
+    if (!mem->memory_size ||
+        offset >= (mem->memory_size / qemu_real_host_page_size)) {
+        return;
+    }
+
+    clients = tcg_enabled() ? DIRTY_CLIENTS_ALL : DIRTY_CLIENTS_NOCODE;
+    if (!global_dirty_log) {
+        clients &= ~(1 << DIRTY_MEMORY_MIGRATION);
+    }
+
+    /*
+     * Mark the page directly in ram_list so that the cost of a sync is
+     * proportional to the number of dirty pages, not to the slot size.
+     */
+    cpu_physical_memory_set_dirty_range(mem->ram_start_offset +
+                                        offset * qemu_real_host_page_size,
+                                        qemu_real_host_page_size, clients);
+}
+
+static bool dirty_gfn_is_dirtied(struct kvm_dirty_gfn *gfn)
+{
+    return qatomic_load_acquire(&gfn->flags) == KVM_DIRTY_GFN_F_DIRTY;
+}
+
+static void dirty_gfn_set_collected(struct kvm_dirty_gfn *gfn)
+{
+    qatomic_store_release(&gfn->flags, KVM_DIRTY_GFN_F_RESET);
+}
+
+/*
+ * Must be called with kvm_slots_lock() held.  Returns the number of dirty
+ * pages collected from this vcpu's dirty ring.
+ */
+static uint32_t kvm_dirty_ring_reap_one(KVMState *s, CPUState *cpu)
+{
+    struct kvm_dirty_gfn *dirty_gfns = cpu->kvm_dirty_gfns, *cur;
+    uint32_t ring_size = s->kvm_dirty_ring_size;
+    uint32_t count = 0, fetch = cpu->kvm_fetch_index;
+
+    if (!dirty_gfns) {
+        /* The vcpu has not been initialized yet */
+        return 0;
+    }
+    trace_kvm_dirty_ring_reap_vcpu(cpu->cpu_index);
+
+    while (true) {
+        cur = &dirty_gfns[fetch % ring_size];
+        if (!dirty_gfn_is_dirtied(cur)) {
+            break;
+        }
+        kvm_dirty_ring_mark_page(s, cur->slot >> 16, cur->slot & 0xffff,
+                                 cur->offset);
+        dirty_gfn_set_collected(cur);
+        trace_kvm_dirty_ring_page(cpu->cpu_index, fetch, cur->offset);
+        fetch++;
+        count++;
+    }
+    cpu->kvm_fetch_index = fetch;
+    qatomic_add(&cpu->dirty_pages, count);
+
+    return count;
+}
+
+/* Must be called with kvm_slots_lock() held */
+static uint64_t kvm_dirty_ring_reap_locked(KVMState *s)
+{
+    int ret;
+    CPUState *cpu;
+    uint64_t total = 0;
+    int64_t stamp;
+
+    stamp = get_clock();
+
+    CPU_FOREACH(cpu) {
+        total += kvm_dirty_ring_reap_one(s, cpu);
+    }
+
+    if (total) {
+        ret = kvm_vm_ioctl(s, KVM_RESET_DIRTY_RINGS);
+        assert(ret == total);
+    }
+
+    stamp = get_clock() - stamp;
+
+    if (total) {
+        trace_kvm_dirty_ring_reap(total, stamp / 1000);
+    }
+
+    return total;
+}
+
+/*
+ * Currently for simplicity, we must hold BQL before calling this.  We can
+ * consider to drop the BQL if we're clear with all the race conditions.
+ */
+static uint64_t kvm_dirty_ring_reap(KVMState *s)
+{
+    uint64_t total;
+
+    /*
+     * We need to lock all kvm slots for all address spaces here,
+     * because:
+     *
+     * (1) We need to look up slots of multiple address spaces for
+     *     tons of pages, so it's better to take the lock here once
+     *     rather than once per page.  And more importantly,
+     *
+     * (2) The slots must not go away under our feet while the rings
+     *     still hold entries referring to them, otherwise we could
+     *     mark the wrong ram_addr_t range dirty.
+     */
+    kvm_slots_lock();
+    total = kvm_dirty_ring_reap_locked(s);
+    kvm_slots_unlock();
+
+    return total;
+}
+
+static void do_kvm_cpu_synchronize_kick(CPUState *cpu, run_on_cpu_data arg)
+{
+    /* No need to do anything */
+}
+
+/*
+ * Kick all vcpus out in a synchronized way.  When returned, we
+ * guarantee that every vcpu has been kicked and at least returned to
+ * userspace once.
+ */
+static void kvm_cpu_synchronize_kick_all(void)
+{
+    CPUState *cpu;
+
+    CPU_FOREACH(cpu) {
+        run_on_cpu(cpu, do_kvm_cpu_synchronize_kick, RUN_ON_CPU_NULL);
+    }
+}
+
+/*
+ * Flush all the existing dirty pages to QEMU's dirty bitmaps.  When
+ * this call returns, we guarantee that all the pages touched before
+ * calling this function have been marked dirty in ram_list.
+ *
+ * This function must be called with BQL held.
+ */
+static void kvm_dirty_ring_flush(void)
+{
+    trace_kvm_dirty_ring_flush(0);
+    /*
+     * The function needs to be serialized.  Since this function
+     * should always be with BQL held, serialization is guaranteed.
+     * However, let's be sure of it.
+     */
+    assert(qemu_mutex_iothread_locked());
+    /*
+     * First make sure to flush the hardware buffers by kicking all
+     * vcpus out in a synchronous way.
+     */
+    kvm_cpu_synchronize_kick_all();
+    kvm_dirty_ring_reap(kvm_state);
+    trace_kvm_dirty_ring_flush(1);
+}
+
 /* Alignment requirement for KVM_CLEAR_DIRTY_LOG - 64 pages */
 #define KVM_CLEAR_LOG_SHIFT  6
 #define KVM_CLEAR_LOG_ALIGN  (qemu_real_host_page_size << KVM_CLEAR_LOG_SHIFT)
@@ -887,7 +1167,7 @@ static int kvm_physical_log_clear(KVMMemoryListener *kml,
     KVMState *s = kvm_state;
     uint64_t start, size, offset, count;
     KVMSlot *mem;
-    int ret = 0, i;
+    int ret = 0;
 
     if (!s->manual_dirty_log_protect) {
         /* No need to do explicit clear */
@@ -902,16 +1182,11 @@ static int kvm_physical_log_clear(KVMMemoryListener *kml,
         return ret;
     }
 
-    kvm_slots_lock(kml);
+    kvm_slots_lock();
 
-    for (i = 0; i < s->nr_slots; i++) {
-        mem = &kml->slots[i];
-        /* Discard slots that are empty or do not overlap the section */
-        if (!mem->memory_size ||
-            mem->start_addr > start + size - 1 ||
-            start > mem->start_addr + mem->memory_size - 1) {
-            continue;
-        }
+    mem = kvm_slot_lookup_next(kml, start);
+    while (mem && mem->start_addr <= start + size - 1) {
+        hwaddr next = mem->start_addr + mem->memory_size;
 
         if (start >= mem->start_addr) {
             /* The slot starts before section or is aligned to it.  */
@@ -926,9 +1201,11 @@ static int kvm_physical_log_clear(KVMMemoryListener *kml,
         if (ret < 0) {
             break;
         }
+        /* a slot that ends at the top of the address space is the last */
+        mem = next ? kvm_slot_lookup_next(kml, next) : NULL;
     }
 
-    kvm_slots_unlock(kml);
+    kvm_slots_unlock();
 
     return ret;
 }
@@ -1204,6 +1481,50 @@ void kvm_set_max_memslot_size(hwaddr max_slot_size)
     kvm_max_slot_size = max_slot_size;
 }
 
+/* Called with kvm_slots_lock() held */
+static void kvm_slot_unregister(KVMMemoryListener *kml, KVMSlot *mem)
+{
+    int err;
+
+    kvm_slot_index_remove(kml, mem);
+    if (mem->pending_del) {
+        mem->pending_del = false;
+        kml->nr_pending_del--;
+    }
+    g_free(mem->dirty_bmap);
+    mem->dirty_bmap = NULL;
+    mem->memory_size = 0;
+    mem->flags = 0;
+    err = kvm_set_user_memory_region(kml, mem, false);
+    if (err) {
+        fprintf(stderr, "%s: error unregistering slot: %s\n",
+                __func__, strerror(-err));
+        abort();
+    }
+}
+
+/*
+ * Unregister the slots whose removal was deferred and that overlap
+ * [@start, @start + @size - 1].  Called with kvm_slots_lock() held.
+ */
+static void kvm_slots_unregister_pending(KVMMemoryListener *kml,
+                                         hwaddr start, hwaddr size)
+{
+    hwaddr last = start + size - 1;
+    KVMSlot *mem;
+
+    mem = kml->nr_pending_del ? kvm_slot_lookup_next(kml, start) : NULL;
+    while (mem && mem->start_addr <= last) {
+        hwaddr next = mem->start_addr + mem->memory_size;
+
+        if (mem->pending_del) {
+            kvm_slot_unregister(kml, mem);
+        }
+        mem = next && kml->nr_pending_del ?
+              kvm_slot_lookup_next(kml, next) : NULL;
+    }
+}
+
 static void kvm_set_phys_mem(KVMMemoryListener *kml,
                              MemoryRegionSection *section, bool add)
 {
@@ -1212,6 +1533,7 @@ static void kvm_set_phys_mem(KVMMemoryListener *kml,
     MemoryRegion *mr = section->mr;
     bool writeable = !mr->readonly && !mr->rom_device;
     hwaddr start_addr, size, slot_size;
+    ram_addr_t ram_start_offset;
     void *ram;
 
     if (!memory_region_is_ram(mr)) {
@@ -1229,11 +1551,14 @@ static void kvm_set_phys_mem(KVMMemoryListener *kml,
         return;
     }
 
-    /* use aligned delta to align the ram address */
+    /* use aligned delta to align the ram address and offset */
+    ram_start_offset = memory_region_get_ram_addr(mr) +
+                       section->offset_within_region +
+                       (start_addr - section->offset_within_address_space);
     ram = memory_region_get_ram_ptr(mr) + section->offset_within_region +
           (start_addr - section->offset_within_address_space);
 
-    kvm_slots_lock(kml);
+    kvm_slots_lock();
 
     if (!add) {
         do {
@@ -1243,19 +1568,24 @@ static void kvm_set_phys_mem(KVMMemoryListener *kml,
                 goto out;
             }
             if (mem->flags & KVM_MEM_LOG_DIRTY_PAGES) {
-                kvm_physical_sync_dirty_bitmap(kml, section);
+                if (kvm_state->kvm_dirty_ring_size) {
+                    /*
+                     * Collect whatever the rings hold for this slot
+                     * before it goes away; the reap already marks
+                     * the pages straight into ram_list.
+                     */
+                    kvm_dirty_ring_reap_locked(kvm_state);
+                } else {
+                    kvm_physical_sync_dirty_bitmap(kml, section);
+                }
             }
 
-            /* unregister the slot */
-            g_free(mem->dirty_bmap);
-            mem->dirty_bmap = NULL;
-            mem->memory_size = 0;
-            mem->flags = 0;
-            err = kvm_set_user_memory_region(kml, mem, false);
-            if (err) {
-                fprintf(stderr, "%s: error unregistering slot: %s\n",
-                        __func__, strerror(-err));
-                abort();
+            if (kml->in_transaction) {
+                /* Leave it to the commit, in case it comes back unchanged */
+                mem->pending_del = true;
+                kml->nr_pending_del++;
+            } else {
+                kvm_slot_unregister(kml, mem);
             }
             start_addr += slot_size;
             size -= slot_size;
@@ -1266,13 +1596,30 @@ static void kvm_set_phys_mem(KVMMemoryListener *kml,
     /* register the new slot */
     do {
         slot_size = MIN(kvm_max_slot_size, size);
+        mem = kvm_lookup_matching_slot(kml, start_addr, slot_size);
+        if (mem && mem->pending_del && mem->ram == ram &&
+            mem->ram_start_offset == ram_start_offset &&
+            mem->flags == kvm_mem_flags(mr)) {
+            /* Removed and added back by one transaction: keep it as is */
+            mem->pending_del = false;
+            kml->nr_pending_del--;
+            goto next;
+        }
+
+        /* Whatever overlaps the new slot has to leave KVM first */
+        kvm_slots_unregister_pending(kml, start_addr, slot_size);
+        if (!kvm_get_free_slot(kml)) {
+            kvm_slots_unregister_pending(kml, 0, HWADDR_MAX);
+        }
         mem = kvm_alloc_slot(kml);
         mem->memory_size = slot_size;
         mem->start_addr = start_addr;
         mem->ram = ram;
+        mem->ram_start_offset = ram_start_offset;
         mem->flags = kvm_mem_flags(mr);
 
-        if (mem->flags & KVM_MEM_LOG_DIRTY_PAGES) {
+        if ((mem->flags & KVM_MEM_LOG_DIRTY_PAGES) &&
+            !kvm_state->kvm_dirty_ring_size) {
             /*
              * Reallocate the bmap; it means it doesn't disappear in
              * middle of a migrate.
@@ -1285,13 +1632,16 @@ static void kvm_set_phys_mem(KVMMemoryListener *kml,
                     strerror(-err));
             abort();
         }
+        kvm_slot_index_insert(kml, mem);
+next:
         start_addr += slot_size;
+        ram_start_offset += slot_size;
         ram += slot_size;
         size -= slot_size;
     } while (size);
 
 out:
-    kvm_slots_unlock(kml);
+    kvm_slots_unlock();
 }
 
 static void kvm_region_add(MemoryListener *listener,
@@ -1312,20 +1662,43 @@ static void kvm_region_del(MemoryListener *listener,
     memory_region_unref(section->mr);
 }
 
+static void kvm_region_begin(MemoryListener *listener)
+{
+    KVMMemoryListener *kml = container_of(listener, KVMMemoryListener, listener);
+
+    kml->in_transaction = true;
+}
+
+static void kvm_region_commit(MemoryListener *listener)
+{
+    KVMMemoryListener *kml = container_of(listener, KVMMemoryListener, listener);
+
+    kvm_slots_lock();
+    kvm_slots_unregister_pending(kml, 0, HWADDR_MAX);
+    kml->in_transaction = false;
+    kvm_slots_unlock();
+}
+
 static void kvm_log_sync(MemoryListener *listener,
                          MemoryRegionSection *section)
 {
     KVMMemoryListener *kml = container_of(listener, KVMMemoryListener, listener);
     int r;
 
-    kvm_slots_lock(kml);
+    kvm_slots_lock();
     r = kvm_physical_sync_dirty_bitmap(kml, section);
-    kvm_slots_unlock(kml);
+    kvm_slots_unlock();
     if (r < 0) {
         abort();
     }
 }
 
+static void kvm_log_sync_global(MemoryListener *l)
+{
+    /* Flush all kernel dirty addresses into ram_list dirty bitmaps */
+    kvm_dirty_ring_flush();
+}
+
 static void kvm_log_clear(MemoryListener *listener,
                           MemoryRegionSection *section)
 {
@@ -1420,22 +1793,29 @@ void kvm_memory_listener_register(KVMState *s, KVMMemoryListener *kml,
 {
     int i;
 
-    qemu_mutex_init(&kml->slots_lock);
     kml->slots = g_malloc0(s->nr_slots * sizeof(KVMSlot));
+    kml->slot_index = g_tree_new_full(kvm_slot_compare, NULL, NULL, NULL);
     kml->as_id = as_id;
 
     for (i = 0; i < s->nr_slots; i++) {
         kml->slots[i].slot = i;
     }
 
+    kml->listener.begin = kvm_region_begin;
+    kml->listener.commit = kvm_region_commit;
     kml->listener.region_add = kvm_region_add;
     kml->listener.region_del = kvm_region_del;
     kml->listener.log_start = kvm_log_start;
     kml->listener.log_stop = kvm_log_stop;
-    kml->listener.log_sync = kvm_log_sync;
     kml->listener.log_clear = kvm_log_clear;
     kml->listener.priority = 10;
 
+    if (s->kvm_dirty_ring_size) {
+        kml->listener.log_sync_global = kvm_log_sync_global;
+    } else {
+        kml->listener.log_sync = kvm_log_sync;
+    }
+
     memory_listener_register(&kml->listener, as);
 
     for (i = 0; i < s->nr_as; ++i) {
@@ -1480,6 +1860,17 @@ typedef struct KVMMSIRoute {
     QTAILQ_ENTRY(KVMMSIRoute) entry;
 } KVMMSIRoute;
 
+/* Messages raised inside kvm_irqchip_batch_begin/end on this thread */
+#define KVM_MSI_BATCH_SIZE 64
+
+typedef struct KVMMSIBatch {
+    int depth;
+    int n;
+    MSIMessage msg[KVM_MSI_BATCH_SIZE];
+} KVMMSIBatch;
+
+static __thread KVMMSIBatch kvm_msi_batch;
+
 static void set_gsi(KVMState *s, unsigned int gsi)
 {
     set_bit(gsi, s->used_gsi_bitmap);
@@ -1688,7 +2079,7 @@ static KVMMSIRoute *kvm_lookup_msi_route(KVMState *s, MSIMessage msg)
     return NULL;
 }
 
-int kvm_irqchip_send_msi(KVMState *s, MSIMessage msg)
+static int kvm_irqchip_deliver_msi(KVMState *s, MSIMessage msg)
 {
     struct kvm_msi msi;
     KVMMSIRoute *route;
@@ -1732,6 +2123,66 @@ int kvm_irqchip_send_msi(KVMState *s, MSIMessage msg)
     return kvm_set_irq(s, route->kroute.gsi, 1);
 }
 
+static void kvm_irqchip_flush_msi(KVMState *s, KVMMSIBatch *batch)
+{
+    int i, ret;
+
+    trace_kvm_irqchip_flush_msi(batch->n);
+    for (i = 0; i < batch->n; i++) {
+        ret = kvm_irqchip_deliver_msi(s, batch->msg[i]);
+        if (ret < 0) {
+            error_report("KVM: injection failed, MSI lost (%s)",
+                         strerror(-ret));
+        }
+    }
+    batch->n = 0;
+}
+
+int kvm_irqchip_send_msi(KVMState *s, MSIMessage msg)
+{
+    KVMMSIBatch *batch = &kvm_msi_batch;
+    int i;
+
+    /*
+     * Only KVM_SIGNAL_MSI is safe to defer: the routing fallback
+     * needs the BQL, which the batch may not be flushed with.
+     */
+    if (!batch->depth || !kvm_direct_msi_allowed) {
+        return kvm_irqchip_deliver_msi(s, msg);
+    }
+
+    /*
+     * The guest cannot tell apart two edge-triggered messages that
+     * arrive before it services the first, so send each one once.
+     */
+    for (i = 0; i < batch->n; i++) {
+        if (batch->msg[i].address == msg.address &&
+            batch->msg[i].data == msg.data) {
+            return 0;
+        }
+    }
+    if (batch->n == KVM_MSI_BATCH_SIZE) {
+        kvm_irqchip_flush_msi(s, batch);
+    }
+    batch->msg[batch->n++] = msg;
+    return 0;
+}
+
+void kvm_irqchip_batch_begin(void)
+{
+    kvm_msi_batch.depth++;
+}
+
+void kvm_irqchip_batch_end(void)
+{
+    KVMMSIBatch *batch = &kvm_msi_batch;
+
+    assert(batch->depth > 0);
+    if (--batch->depth == 0 && batch->n) {
+        kvm_irqchip_flush_msi(kvm_state, batch);
+    }
+}
+
 int kvm_irqchip_add_msi_route(KVMState *s, int vector, PCIDevice *dev)
 {
     struct kvm_irq_routing_entry kroute = {};
@@ -1933,6 +2384,14 @@ int kvm_irqchip_send_msi(KVMState *s, MSIMessage msg)
     abort();
 }
 
+void kvm_irqchip_batch_begin(void)
+{
+}
+
+void kvm_irqchip_batch_end(void)
+{
+}
+
 int kvm_irqchip_add_msi_route(KVMState *s, int vector, PCIDevice *dev)
 {
     return -ENOSYS;
@@ -2075,6 +2534,82 @@ bool kvm_vcpu_id_is_valid(int vcpu_id)
     return vcpu_id >= 0 && vcpu_id < kvm_max_vcpu_id(s);
 }
 
+/*
+ * The reaper runs once a second while the rings fill slowly.  While each
+ * round collects at least half a ring's worth of pages, it runs more
+ * often, so that vcpus rarely have to exit with KVM_EXIT_DIRTY_RING_FULL.
+ */
+#define KVM_DIRTY_RING_REAP_MIN_MS  10
+#define KVM_DIRTY_RING_REAP_MAX_MS  1000
+
+static void *kvm_dirty_ring_reaper_thread(void *data)
+{
+    KVMState *s = data;
+    struct KVMDirtyRingReaper *r = &s->reaper;
+    int interval = KVM_DIRTY_RING_REAP_MAX_MS;
+    uint64_t total;
+
+    rcu_register_thread();
+
+    trace_kvm_dirty_ring_reaper("init");
+
+    while (true) {
+        r->reaper_state = KVM_DIRTY_RING_REAPER_WAIT;
+        trace_kvm_dirty_ring_reaper("wait");
+        qemu_sem_timedwait(&r->reaper_sem, interval);
+        if (qatomic_read(&r->reaper_quit)) {
+            break;
+        }
+
+        trace_kvm_dirty_ring_reaper("wakeup");
+        r->reaper_state = KVM_DIRTY_RING_REAPER_REAPING;
+
+        qemu_mutex_lock_iothread();
+        total = kvm_dirty_ring_reap(s);
+        qemu_mutex_unlock_iothread();
+
+        if (total >= s->kvm_dirty_ring_size / 2) {
+            interval = MAX(interval / 2, KVM_DIRTY_RING_REAP_MIN_MS);
+        } else {
+            interval = MIN(interval * 2, KVM_DIRTY_RING_REAP_MAX_MS);
+        }
+        r->reaper_iteration++;
+    }
+
+    trace_kvm_dirty_ring_reaper("exit");
+
+    rcu_unregister_thread();
+
+    return NULL;
+}
+
+/*
+ * Only tell the reaper to exit: it may be waiting for the BQL, which the
+ * exiting thread can hold, so it is not joined.
+ */
+static void kvm_dirty_ring_reaper_exit(Notifier *n, void *data)
+{
+    struct KVMDirtyRingReaper *r =
+        container_of(n, struct KVMDirtyRingReaper, exit_notifier);
+
+    qatomic_set(&r->reaper_quit, true);
+    qemu_sem_post(&r->reaper_sem);
+}
+
+static int kvm_dirty_ring_reaper_init(KVMState *s)
+{
+    struct KVMDirtyRingReaper *r = &s->reaper;
+
+    qemu_sem_init(&r->reaper_sem, 0);
+    r->exit_notifier.notify = kvm_dirty_ring_reaper_exit;
+    qemu_add_exit_notifier(&r->exit_notifier);
+    qemu_thread_create(&r->reaper_thr, "kvm-reaper",
+                       kvm_dirty_ring_reaper_thread,
+                       s, QEMU_THREAD_JOINABLE);
+
+    return 0;
+}
+
 static int kvm_init(MachineState *ms)
 {
     MachineClass *mc = MACHINE_GET_CLASS(ms);
@@ -2098,6 +2633,8 @@ static int kvm_init(MachineState *ms)
 
     s = KVM_STATE(ms->accelerator);
 
+    qemu_mutex_init(&kml_slots_lock);
+
     /*
      * On systems where the kernel can support different base page
      * sizes, host page size may be different from TARGET_PAGE_SIZE,
@@ -2218,12 +2755,54 @@ static int kvm_init(MachineState *ms)
     s->coalesced_pio = s->coalesced_mmio &&
                        kvm_check_extension(s, KVM_CAP_COALESCED_PIO);
 
+    /*
+     * Enable KVM dirty ring if supported, otherwise fall back to
+     * dirty logging mode
+     */
+    if (s->kvm_dirty_ring_size > 0) {
+        uint64_t ring_bytes;
+
+        ring_bytes = s->kvm_dirty_ring_size * sizeof(struct kvm_dirty_gfn);
+
+        /* Read the max supported pages */
+        ret = kvm_vm_check_extension(s, KVM_CAP_DIRTY_LOG_RING);
+        if (ret > 0) {
+            if (ring_bytes > ret) {
+                error_report("KVM dirty ring size %" PRIu32 " too big "
+                             "(maximum is %ld).  Please use a smaller value.",
+                             s->kvm_dirty_ring_size,
+                             (long)(ret / sizeof(struct kvm_dirty_gfn)));
+                ret = -EINVAL;
+                goto err;
+            }
+
+            ret = kvm_vm_enable_cap(s, KVM_CAP_DIRTY_LOG_RING, 0, ring_bytes);
+            if (ret) {
+                error_report("Enabling of KVM dirty ring failed: %s. "
+                             "Suggested minimum value is 1024.",
+                             strerror(-ret));
+                goto err;
+            }
+
+            s->kvm_dirty_ring_bytes = ring_bytes;
+        } else {
+            warn_report("KVM dirty ring not available, using bitmap method");
+            s->kvm_dirty_ring_size = 0;
+        }
+    }
+
+    /*
+     * KVM_CAP_DIRTY_LOG_RING and KVM_CAP_MANUAL_DIRTY_LOG_PROTECT2 are
+     * enabled together only if KVM_CAP_DIRTY_LOG_RING_WITH_BITMAP is
+     * available, which we do not use.  The dirty ring does not need
+     * explicit clearing, so only try the manual protect with bitmaps.
+     */
     dirty_log_manual_caps =
         kvm_check_extension(s, KVM_CAP_MANUAL_DIRTY_LOG_PROTECT2);
     dirty_log_manual_caps &= (KVM_DIRTY_LOG_MANUAL_PROTECT_ENABLE |
                               KVM_DIRTY_LOG_INITIALLY_SET);
     s->manual_dirty_log_protect = dirty_log_manual_caps;
-    if (dirty_log_manual_caps) {
+    if (!s->kvm_dirty_ring_size && dirty_log_manual_caps) {
         ret = kvm_vm_enable_cap(s, KVM_CAP_MANUAL_DIRTY_LOG_PROTECT2, 0,
                                    dirty_log_manual_caps);
         if (ret) {
@@ -2317,6 +2896,14 @@ static int kvm_init(MachineState *ms)
         ret = ram_block_discard_disable(true);
         assert(!ret);
     }
+
+    if (s->kvm_dirty_ring_size) {
+        ret = kvm_dirty_ring_reaper_init(s);
+        if (ret) {
+            goto err;
+        }
+    }
+
     return 0;
 
 err:
@@ -2337,6 +2924,247 @@ void kvm_set_sigmask_len(KVMState *s, unsigned int sigmask_len)
     s->sigmask_len = sigmask_len;
 }
 
+/*
+ * Exit accounting.  Each vCPU thread counts its exits by reason and, when
+ * kvm_exit_profile is set, its MMIO and port I/O exits by the memory region
+ * that handled them.  Regions are identified by the address at which their
+ * offset 0 is mapped, so that the data survives their removal.
+ */
+#define KVM_EXIT_STATS_REASONS  64
+#define KVM_EXIT_REGION_IO      (1ULL << 63)
+
+static const char *const kvm_exit_reason_names[] = {
+    [KVM_EXIT_UNKNOWN] = "unknown",
+    [KVM_EXIT_EXCEPTION] = "exception",
+    [KVM_EXIT_IO] = "io",
+    [KVM_EXIT_HYPERCALL] = "hypercall",
+    [KVM_EXIT_DEBUG] = "debug",
+    [KVM_EXIT_HLT] = "hlt",
+    [KVM_EXIT_MMIO] = "mmio",
+    [KVM_EXIT_IRQ_WINDOW_OPEN] = "irq-window-open",
+    [KVM_EXIT_SHUTDOWN] = "shutdown",
+    [KVM_EXIT_FAIL_ENTRY] = "fail-entry",
+    [KVM_EXIT_INTR] = "intr",
+    [KVM_EXIT_SET_TPR] = "set-tpr",
+    [KVM_EXIT_TPR_ACCESS] = "tpr-access",
+    [KVM_EXIT_S390_SIEIC] = "s390-sieic",
+    [KVM_EXIT_S390_RESET] = "s390-reset",
+    [KVM_EXIT_NMI] = "nmi",
+    [KVM_EXIT_INTERNAL_ERROR] = "internal-error",
+    [KVM_EXIT_OSI] = "osi",
+    [KVM_EXIT_PAPR_HCALL] = "papr-hcall",
+    [KVM_EXIT_S390_UCONTROL] = "s390-ucontrol",
+    [KVM_EXIT_WATCHDOG] = "watchdog",
+    [KVM_EXIT_S390_TSCH] = "s390-tsch",
+    [KVM_EXIT_EPR] = "epr",
+    [KVM_EXIT_SYSTEM_EVENT] = "system-event",
+    [KVM_EXIT_S390_STSI] = "s390-stsi",
+    [KVM_EXIT_IOAPIC_EOI] = "ioapic-eoi",
+    [KVM_EXIT_HYPERV] = "hyperv",
+    [KVM_EXIT_ARM_NISV] = "arm-nisv",
+    [KVM_EXIT_X86_RDMSR] = "x86-rdmsr",
+    [KVM_EXIT_X86_WRMSR] = "x86-wrmsr",
+    [KVM_EXIT_DIRTY_RING_FULL] = "dirty-ring-full",
+};
+
+typedef struct KVMExitRegion {
+    uint64_t key;
+    char *name;
+    uint64_t count;
+    uint64_t ns;
+} KVMExitRegion;
+
+typedef struct KVMExitStats {
+    /* Reasons above the last one are accounted with it */
+    Stat64 count[KVM_EXIT_STATS_REASONS];
+    Stat64 ns[KVM_EXIT_STATS_REASONS];
+    /* Protects regions against the monitor */
+    QemuSpin lock;
+    GHashTable *regions;
+} KVMExitStats;
+
+static bool kvm_exit_profile;
+
+static void kvm_exit_region_free(gpointer data)
+{
+    KVMExitRegion *r = data;
+
+    g_free(r->name);
+    g_free(r);
+}
+
+static void kvm_exit_stats_init(CPUState *cpu)
+{
+    KVMExitStats *s = g_new0(KVMExitStats, 1);
+
+    qemu_spin_init(&s->lock);
+    s->regions = g_hash_table_new_full(g_int64_hash, g_int64_equal, NULL,
+                                       kvm_exit_region_free);
+    cpu->kvm_exit_stats = s;
+}
+
+static void kvm_exit_stats_free(CPUState *cpu)
+{
+    KVMExitStats *s = cpu->kvm_exit_stats;
+
+    if (s) {
+        g_hash_table_destroy(s->regions);
+        g_free(s);
+        cpu->kvm_exit_stats = NULL;
+    }
+}
+
+/* Account an MMIO or port I/O exit to the region at @addr in @as */
+static void kvm_exit_stats_region(KVMExitStats *s, AddressSpace *as,
+                                  hwaddr addr, uint64_t flags, int64_t ns)
+{
+    MemoryRegion *mr;
+    KVMExitRegion *r;
+    hwaddr xlat, len = 1;
+    uint64_t key;
+
+    RCU_READ_LOCK_GUARD();
+    mr = address_space_translate(as, addr, &xlat, &len, false,
+                                 MEMTXATTRS_UNSPECIFIED);
+    key = (addr - xlat) | flags;
+
+    qemu_spin_lock(&s->lock);
+    r = g_hash_table_lookup(s->regions, &key);
+    if (!r) {
+        r = g_new0(KVMExitRegion, 1);
+        r->key = key;
+        r->name = g_strdup(memory_region_name(mr));
+        g_hash_table_insert(s->regions, &r->key, r);
+    }
+    r->count++;
+    r->ns += MAX(ns, 0);
+    qemu_spin_unlock(&s->lock);
+}
+
+static void kvm_exit_stats_add(CPUState *cpu, struct kvm_run *run, int64_t ns)
+{
+    KVMExitStats *s = cpu->kvm_exit_stats;
+    unsigned reason = MIN(run->exit_reason, KVM_EXIT_STATS_REASONS - 1);
+
+    stat64_add(&s->count[reason], 1);
+    event_loop_stats_add(&s->ns[reason], ns);
+
+    if (!qatomic_read(&kvm_exit_profile)) {
+        return;
+    }
+    if (run->exit_reason == KVM_EXIT_IO) {
+        kvm_exit_stats_region(s, &address_space_io, run->io.port,
+                              KVM_EXIT_REGION_IO, ns);
+    } else if (run->exit_reason == KVM_EXIT_MMIO) {
+        kvm_exit_stats_region(s, &address_space_memory, run->mmio.phys_addr,
+                              0, ns);
+    }
+}
+
+static void kvm_exit_stats_reset(KVMExitStats *s)
+{
+    int i;
+
+    for (i = 0; i < KVM_EXIT_STATS_REASONS; i++) {
+        stat64_init(&s->count[i], 0);
+        stat64_init(&s->ns[i], 0);
+    }
+    qemu_spin_lock(&s->lock);
+    g_hash_table_remove_all(s->regions);
+    qemu_spin_unlock(&s->lock);
+}
+
+KvmExitStatsList *qmp_query_kvm_exits(bool has_reset, bool reset,
+                                      Error **errp)
+{
+    KvmExitStatsList *head = NULL, **tail = &head;
+    CPUState *cpu;
+
+    if (!kvm_enabled()) {
+        error_setg(errp, "KVM is not enabled");
+        return NULL;
+    }
+
+    CPU_FOREACH(cpu) {
+        KVMExitStats *s = cpu->kvm_exit_stats;
+        KvmExitReasonStatsList **reasons;
+        KvmExitRegionStatsList **regions;
+        KvmExitStats *info;
+        GHashTableIter iter;
+        KVMExitRegion *r;
+        int i;
+
+        if (!s) {
+            continue;
+        }
+        info = g_new0(KvmExitStats, 1);
+        info->cpu_index = cpu->cpu_index;
+        reasons = &info->reasons;
+        regions = &info->regions;
+
+        for (i = 0; i < KVM_EXIT_STATS_REASONS; i++) {
+            KvmExitReasonStats *reason;
+
+            if (!stat64_get(&s->count[i])) {
+                continue;
+            }
+            reason = g_new0(KvmExitReasonStats, 1);
+            reason->reason = i;
+            if (i < ARRAY_SIZE(kvm_exit_reason_names) &&
+                kvm_exit_reason_names[i]) {
+                reason->has_name = true;
+                reason->name = g_strdup(kvm_exit_reason_names[i]);
+            }
+            reason->count = stat64_get(&s->count[i]);
+            reason->handler_ns = stat64_get(&s->ns[i]);
+            QAPI_LIST_APPEND(reasons, reason);
+        }
+
+        qemu_spin_lock(&s->lock);
+        g_hash_table_iter_init(&iter, s->regions);
+        while (g_hash_table_iter_next(&iter, NULL, (gpointer *)&r)) {
+            KvmExitRegionStats *region = g_new0(KvmExitRegionStats, 1);
+
+            region->region = g_strdup(r->name);
+            region->io = r->key & KVM_EXIT_REGION_IO;
+            region->base = r->key & ~KVM_EXIT_REGION_IO;
+            region->count = r->count;
+            region->handler_ns = r->ns;
+            QAPI_LIST_APPEND(regions, region);
+        }
+        qemu_spin_unlock(&s->lock);
+
+        if (has_reset && reset) {
+            kvm_exit_stats_reset(s);
+        }
+        QAPI_LIST_APPEND(tail, info);
+    }
+    return head;
+}
+
+void qmp_kvm_exit_profile(bool enable, Error **errp)
+{
+    CPUState *cpu;
+
+    if (!kvm_enabled()) {
+        error_setg(errp, "KVM is not enabled");
+        return;
+    }
+
+    if (enable && !kvm_exit_profile) {
+        CPU_FOREACH(cpu) {
+            KVMExitStats *s = cpu->kvm_exit_stats;
+
+            if (s) {
+                qemu_spin_lock(&s->lock);
+                g_hash_table_remove_all(s->regions);
+                qemu_spin_unlock(&s->lock);
+            }
+        }
+    }
+    qatomic_set(&kvm_exit_profile, enable);
+}
+
 static void kvm_handle_io(uint16_t port, MemTxAttrs attrs, void *data, int direction,
                           int size, uint32_t count)
 {
@@ -2377,9 +3205,38 @@ static int kvm_handle_internal_error(CPUState *cpu, struct kvm_run *run)
     return -1;
 }
 
+/* Maximum number of coalesced writes passed to a device at once */
+#define KVM_COALESCED_BATCH 64
+
+/*
+ * Return the region that a coalesced write goes to, with the offset in
+ * @xlat, if it can be passed to the write_batch callback of the region.
+ * Called within RCU critical section.
+ */
+static MemoryRegion *kvm_coalesced_batch_region(struct kvm_coalesced_mmio *ent,
+                                                hwaddr *xlat)
+{
+    AddressSpace *as = ent->pio == 1 ? &address_space_io
+                                     : &address_space_memory;
+    hwaddr len = ent->len;
+    MemoryRegion *mr;
+
+    mr = address_space_translate(as, ent->phys_addr, xlat, &len, true,
+                                 MEMTXATTRS_UNSPECIFIED);
+    if (len < ent->len || memory_access_is_direct(mr, true) ||
+        !memory_region_can_write_batch(mr, *xlat, ent->len,
+                                       MEMTXATTRS_UNSPECIFIED)) {
+        return NULL;
+    }
+    return mr;
+}
+
 void kvm_flush_coalesced_mmio_buffer(void)
 {
     KVMState *s = kvm_state;
+    MemoryRegionBatchWrite batch[KVM_COALESCED_BATCH];
+    MemoryRegion *batch_mr = NULL;
+    unsigned n = 0;
 
     if (s->coalesced_flush_in_progress) {
         return;
@@ -2389,12 +3246,36 @@ void kvm_flush_coalesced_mmio_buffer(void)
 
     if (s->coalesced_mmio_ring) {
         struct kvm_coalesced_mmio_ring *ring = s->coalesced_mmio_ring;
+
+        RCU_READ_LOCK_GUARD();
+
+        /*
+         * Consecutive writes to a region with a write_batch callback are
+         * passed in one go, everything else goes through the address
+         * space.  The batch is submitted before any other write so that
+         * the order of writes is kept.
+         */
         while (ring->first != ring->last) {
             struct kvm_coalesced_mmio *ent;
+            MemoryRegion *mr;
+            hwaddr xlat;
 
             ent = &ring->coalesced_mmio[ring->first];
+            mr = kvm_coalesced_batch_region(ent, &xlat);
+
+            if (batch_mr && (mr != batch_mr || n == KVM_COALESCED_BATCH)) {
+                memory_region_dispatch_write_batch(batch_mr, batch, n);
+                batch_mr = NULL;
+                n = 0;
+            }
 
-            if (ent->pio == 1) {
+            if (mr) {
+                batch[n].addr = xlat;
+                batch[n].data = ldn_he_p(ent->data, ent->len);
+                batch[n].size = ent->len;
+                batch_mr = mr;
+                n++;
+            } else if (ent->pio == 1) {
                 address_space_write(&address_space_io, ent->phys_addr,
                                     MEMTXATTRS_UNSPECIFIED, ent->data,
                                     ent->len);
@@ -2404,6 +3285,10 @@ void kvm_flush_coalesced_mmio_buffer(void)
             smp_wmb();
             ring->first = (ring->first + 1) % KVM_COALESCED_MMIO_MAX;
         }
+
+        if (batch_mr) {
+            memory_region_dispatch_write_batch(batch_mr, batch, n);
+        }
     }
 
     s->coalesced_flush_in_progress = false;
@@ -2531,22 +3416,15 @@ static bool within(hwaddr target, hwaddr addr1, hwaddr addr2)
 static KVMSlot *find_slot_containing(hwaddr gpa, KVMState *s)
 {
     KVMMemoryListener *kml = &s->memory_listener;
-    KVMSlot *slot = NULL;
-    int i;
-    kvm_slots_lock(kml);
-    for (i = 0; i < s->nr_slots; i++) {
-        KVMSlot *mem = &kml->slots[i];
-        if (gpa >= mem->start_addr && 
-                gpa < mem->start_addr + mem->memory_size){
-            slot = mem;
-            break;
-        }
-    }
-    kvm_slots_unlock(kml);
+    KVMSlot *slot;
+
+    kvm_slots_lock();
+    slot = kvm_slot_lookup(kml, gpa);
+    kvm_slots_unlock();
     return slot;
 }
 
-/* Called with KVMMemoryListener.slots_lock held */
+/* Called with kvm_slots_lock() held */
 static void kvm_free_slot(KVMSlot *slot)
 {
     struct kvm_userspace_memory_region mem;
@@ -2555,6 +3433,7 @@ static void kvm_free_slot(KVMSlot *slot)
     mem.guest_phys_addr = slot->start_addr;
     mem.memory_size = 0; /* Slots can be deleted by setting 0 as memory size */
     mem.userspace_addr = (__u64)slot->ram;
+    kvm_slot_index_remove(&kvm_state->memory_listener, slot);
     slot->memory_size = 0; /* This way, it can be alloc'ed again */
     kvm_vm_ioctl(kvm_state, KVM_SET_USER_MEMORY_REGION, &mem);
 }
@@ -2569,6 +3448,7 @@ static void kvm_set_slot(KVMSlot *slot)
     mem.userspace_addr = (__u64)slot->ram;
     slot->memory_size = slot->memory_size; 
     kvm_vm_ioctl(kvm_state, KVM_SET_USER_MEMORY_REGION, &mem);
+    kvm_slot_index_insert(&kvm_state->memory_listener, slot);
 }
 
 static hwaddr kvm_translate(CPUState *cpu, unsigned long long gva)
@@ -2705,7 +3585,7 @@ static KVMSlot *make_read_only_memory_slot(hwaddr gpa,
     int i;
     uint64_t total_size;
 
-    kvm_slots_lock(kml);
+    kvm_slots_lock();
 
     total_size = current_slot->memory_size;
     kvm_free_slot(current_slot);
@@ -2743,7 +3623,7 @@ static KVMSlot *make_read_only_memory_slot(hwaddr gpa,
         new_slots[2]->memory_size
     );
 
-    kvm_slots_unlock(kml);
+    kvm_slots_unlock();
     return new_slots[1];
 }
 
@@ -2927,6 +3807,7 @@ int kvm_cpu_exec(CPUState *cpu)
 {
     struct kvm_run *run = cpu->kvm_run;
     int ret, run_ret;
+    int64_t entered, exited;
     void *hva;
 
     DPRINTF("kvm_cpu_exec()\n");
@@ -2968,7 +3849,10 @@ int kvm_cpu_exec(CPUState *cpu)
         if(start_monitor)
             check_idtr_gdtr(cpu);
 
+        entered = get_clock();
         run_ret = kvm_vcpu_ioctl(cpu, KVM_RUN, 0);
+        exited = get_clock();
+        event_loop_stats_add(&cpu->kvm_stats.guest_ns, exited - entered);
 
         attrs = kvm_arch_post_run(cpu, run);
 
@@ -3004,6 +3888,7 @@ int kvm_cpu_exec(CPUState *cpu)
         }
 
         trace_kvm_run_exit(cpu->cpu_index, run->exit_reason);
+        kvm_irqchip_batch_begin();
         switch (run->exit_reason) {
         case KVM_EXIT_IO:
             DPRINTF("handle_io\n");
@@ -3049,6 +3934,18 @@ int kvm_cpu_exec(CPUState *cpu)
                 }
             }
             break;
+        case KVM_EXIT_DIRTY_RING_FULL:
+            /*
+             * We shouldn't continue if the dirty ring of this vcpu is
+             * still full.  Got kicked by KVM_RESET_DIRTY_RINGS.
+             */
+            trace_kvm_dirty_ring_full(cpu->cpu_index);
+            qemu_mutex_lock_iothread();
+            kvm_dirty_ring_reap(kvm_state);
+            qemu_mutex_unlock_iothread();
+            dirtylimit_vcpu_execute(cpu);
+            ret = 0;
+            break;
         case KVM_EXIT_IRQ_WINDOW_OPEN:
             DPRINTF("irq_window_open\n");
             ret = EXCP_INTERRUPT;
@@ -3094,6 +3991,14 @@ int kvm_cpu_exec(CPUState *cpu)
             ret = kvm_arch_handle_exit(cpu, run);
             break;
         }
+        kvm_irqchip_batch_end();
+
+        entered = get_clock();
+        event_loop_stats_add(
+            &cpu->kvm_stats.dispatch_ns[EVENT_LOOP_DISPATCH_KVM_EXIT],
+            entered - exited);
+        event_loop_stats_latency(&cpu->kvm_stats, entered - exited);
+        kvm_exit_stats_add(cpu, run, entered - exited);
     } while (ret == 0);
 
     cpu_exec_end(cpu);
@@ -3698,6 +4603,44 @@ bool kvm_kernel_irqchip_split(void)
     return kvm_state->kernel_irqchip_split == ON_OFF_AUTO_ON;
 }
 
+bool kvm_dirty_ring_enabled(void)
+{
+    return kvm_state->kvm_dirty_ring_size ? true : false;
+}
+
+uint32_t kvm_dirty_ring_size(void)
+{
+    return kvm_state->kvm_dirty_ring_size;
+}
+
+static void kvm_get_dirty_ring_size(Object *obj, Visitor *v,
+                                    const char *name, void *opaque,
+                                    Error **errp)
+{
+    KVMState *s = KVM_STATE(obj);
+    uint32_t value = s->kvm_dirty_ring_size;
+
+    visit_type_uint32(v, name, &value, errp);
+}
+
+static void kvm_set_dirty_ring_size(Object *obj, Visitor *v,
+                                    const char *name, void *opaque,
+                                    Error **errp)
+{
+    KVMState *s = KVM_STATE(obj);
+    uint32_t value;
+
+    if (!visit_type_uint32(v, name, &value, errp)) {
+        return;
+    }
+    if (value & (value - 1)) {
+        error_setg(errp, "dirty-ring-size must be a power of 2.");
+        return;
+    }
+
+    s->kvm_dirty_ring_size = value;
+}
+
 static void kvm_accel_instance_init(Object *obj)
 {
     KVMState *s = KVM_STATE(obj);
@@ -3705,6 +4648,8 @@ static void kvm_accel_instance_init(Object *obj)
     s->kvm_shadow_mem = -1;
     s->kernel_irqchip_allowed = true;
     s->kernel_irqchip_split = ON_OFF_AUTO_AUTO;
+    /* KVM dirty ring is by default off */
+    s->kvm_dirty_ring_size = 0;
 }
 
 static void kvm_accel_class_init(ObjectClass *oc, void *data)
@@ -3726,6 +4671,12 @@ static void kvm_accel_class_init(ObjectClass *oc, void *data)
         NULL, NULL);
     object_class_property_set_description(oc, "kvm-shadow-mem",
         "KVM shadow MMU size");
+
+    object_class_property_add(oc, "dirty-ring-size", "uint32",
+        kvm_get_dirty_ring_size, kvm_set_dirty_ring_size,
+        NULL, NULL);
+    object_class_property_set_description(oc, "dirty-ring-size",
+        "Size of KVM dirty page ring buffer (default: 0, i.e. use bitmap)");
 }
 
 static const TypeInfo kvm_accel_type = {
@@ -16,6 +16,8 @@
 
 #ifndef CONFIG_USER_ONLY
 #include "hw/pci/msi.h"
+#include "qapi/error.h"
+#include "qapi/qapi-commands-machine.h"
 #endif
 
 KVMState *kvm_state;
@@ -139,6 +141,16 @@ bool kvm_has_free_slot(MachineState *ms)
     return false;
 }
 
+bool kvm_dirty_ring_enabled(void)
+{
+    return false;
+}
+
+uint32_t kvm_dirty_ring_size(void)
+{
+    return 0;
+}
+
 void kvm_init_cpu_signals(CPUState *cpu)
 {
     abort();
@@ -149,3 +161,17 @@ bool kvm_arm_supports_user_irq(void)
     return false;
 }
 #endif
+
+#ifndef CONFIG_USER_ONLY
+KvmExitStatsList *qmp_query_kvm_exits(bool has_reset, bool reset,
+                                      Error **errp)
+{
+    error_setg(errp, "KVM is not enabled");
+    return NULL;
+}
+
+void qmp_kvm_exit_profile(bool enable, Error **errp)
+{
+    error_setg(errp, "KVM is not enabled");
+}
+#endif
@@ -372,13 +372,40 @@ void tb_set_jmp_target(TranslationBlock *tb, int n, uintptr_t addr)
     }
 }
 
+/*
+ * Jump 0 of a TB is only ever chained to the pc it was first chained
+ * to.  For direct jumps this is always the case; for the inline cache
+ * of translator_indirect_jump() it keeps the cached pc and the chained
+ * TB in agreement when several vCPUs race to fill it.
+ */
+static bool tb_claim_jump(TranslationBlock *tb, target_ulong pc)
+{
+    bool ok;
+
+    if (pc == (target_ulong)-1) {
+        return false;
+    }
+    qemu_spin_lock(&tb_ctx.ibc_lock);
+    if (tb->ibc_pc == (target_ulong)-1) {
+        tb->ibc_pc = pc;
+    }
+    ok = tb->ibc_pc == pc;
+    qemu_spin_unlock(&tb_ctx.ibc_lock);
+    return ok;
+}
+
 static inline void tb_add_jump(TranslationBlock *tb, int n,
                                TranslationBlock *tb_next)
 {
     uintptr_t old;
 
-    qemu_thread_jit_write();
     assert(n < ARRAY_SIZE(tb->jmp_list_next));
+    if (qatomic_read(&tb->jmp_dest[n]) ||
+        (n == 0 && !tb_claim_jump(tb, tb_next->pc))) {
+        return;
+    }
+
+    qemu_thread_jit_write();
     qemu_spin_lock(&tb_next->jmp_lock);
 
     /* make sure the destination TB is valid */
@@ -426,7 +453,7 @@ static inline TranslationBlock *tb_find(CPUState *cpu,
 
     tb = tb_lookup(cpu, pc, cs_base, flags, cflags);
     if (tb == NULL) {
-        mmap_lock();
+        mmap_lock_pc(pc);
         tb = tb_gen_code(cpu, pc, cs_base, flags, cflags);
         mmap_unlock();
         /* We add the TB in the virtual pc hash table for the fast lookup */
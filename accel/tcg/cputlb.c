@@ -238,8 +238,10 @@ static void tlb_mmu_flush_locked(CPUTLBDesc *desc, CPUTLBDescFast *fast)
     desc->large_page_addr = -1;
     desc->large_page_mask = -1;
     desc->vindex = 0;
+    desc->lindex = 0;
     memset(fast->table, -1, sizeof_tlb(fast));
     memset(desc->vtable, -1, sizeof(desc->vtable));
+    memset(desc->ltable, -1, sizeof(desc->ltable));
 }
 
 static void tlb_flush_one_mmuidx_locked(CPUArchState *env, int mmu_idx,
@@ -341,6 +343,23 @@ void tlb_flush_counts(size_t *pfull, size_t *ppart, size_t *pelide)
     *pelide = elide;
 }
 
+void tlb_victim_counts(size_t *phit, size_t *pmiss, size_t *plarge)
+{
+    CPUState *cpu;
+    size_t hit = 0, miss = 0, large = 0;
+
+    CPU_FOREACH(cpu) {
+        CPUArchState *env = cpu->env_ptr;
+
+        hit += qatomic_read(&env_tlb(env)->c.vtlb_hit_count);
+        miss += qatomic_read(&env_tlb(env)->c.vtlb_miss_count);
+        large += qatomic_read(&env_tlb(env)->c.ltlb_hit_count);
+    }
+    *phit = hit;
+    *pmiss = miss;
+    *plarge = large;
+}
+
 static void tlb_flush_by_mmuidx_async_work(CPUState *cpu, run_on_cpu_data data)
 {
     CPUArchState *env = cpu->env_ptr;
@@ -455,6 +474,20 @@ static inline bool tlb_entry_is_empty(const CPUTLBEntry *te)
     return te->addr_read == -1 && te->addr_write == -1 && te->addr_code == -1;
 }
 
+/* Return the page mapped by a non-empty entry, whatever its protection.  */
+static inline target_ulong tlb_entry_page(const CPUTLBEntry *te)
+{
+    target_ulong addr = te->addr_read;
+
+    if (addr == -1) {
+        addr = te->addr_write;
+    }
+    if (addr == -1) {
+        addr = te->addr_code;
+    }
+    return addr & TARGET_PAGE_MASK;
+}
+
 /* Called with tlb_c.lock held */
 static bool tlb_flush_entry_mask_locked(CPUTLBEntry *tlb_entry,
                                         target_ulong page,
@@ -473,16 +506,30 @@ static inline bool tlb_flush_entry_locked(CPUTLBEntry *tlb_entry,
     return tlb_flush_entry_mask_locked(tlb_entry, page, -1);
 }
 
+/* Return the first victim tlb entry of the set that PAGE hashes to.  */
+static inline size_t vtlb_set_index(target_ulong page)
+{
+    uint64_t vpn = (uint64_t)page >> TARGET_PAGE_BITS;
+    uint32_t h = (uint32_t)(vpn ^ (vpn >> 32)) * 0x9e3779b9u;
+
+    return (h >> (32 - CPU_VTLB_SETS_BITS)) << CPU_VTLB_WAYS_BITS;
+}
+
 /* Called with tlb_c.lock held */
 static void tlb_flush_vtlb_page_mask_locked(CPUArchState *env, int mmu_idx,
                                             target_ulong page,
                                             target_ulong mask)
 {
     CPUTLBDesc *d = &env_tlb(env)->d[mmu_idx];
-    int k;
+    int k, first = 0, last = CPU_VTLB_SIZE;
 
     assert_cpu_is_self(env_cpu(env));
-    for (k = 0; k < CPU_VTLB_SIZE; k++) {
+    if (mask == (target_ulong)-1) {
+        /* An exact page can only live in its own set.  */
+        first = vtlb_set_index(page);
+        last = first + CPU_VTLB_WAYS;
+    }
+    for (k = first; k < last; k++) {
         if (tlb_flush_entry_mask_locked(&d->vtable[k], page, mask)) {
             tlb_n_used_entries_dec(env, mmu_idx);
         }
@@ -1004,6 +1051,26 @@ static inline void copy_tlb_helper_locked(CPUTLBEntry *d, const CPUTLBEntry *s)
     *d = *s;
 }
 
+/* Called with tlb_c.lock held */
+static void tlb_vtlb_insert_locked(CPUTLBDesc *desc, const CPUTLBEntry *te,
+                                   const CPUIOTLBEntry *io)
+{
+    size_t set = vtlb_set_index(tlb_entry_page(te));
+    size_t way;
+
+    /* Prefer a free way; otherwise replace round-robin.  */
+    for (way = 0; way < CPU_VTLB_WAYS; way++) {
+        if (tlb_entry_is_empty(&desc->vtable[set + way])) {
+            break;
+        }
+    }
+    if (way == CPU_VTLB_WAYS) {
+        way = desc->vindex++ % CPU_VTLB_WAYS;
+    }
+    copy_tlb_helper_locked(&desc->vtable[set + way], te);
+    desc->viotlb[set + way] = *io;
+}
+
 /* This is a cross vCPU call (i.e. another vCPU resetting the flags of
  * the target vCPU).
  * We must take tlb_c.lock to avoid racing with another vCPU update. The only
@@ -1091,6 +1158,89 @@ static void tlb_add_large_page(CPUArchState *env, int mmu_idx,
     env_tlb(env)->d[mmu_idx].large_page_mask = lp_mask;
 }
 
+/*
+ * Remember the translation of a large page, so that misses on the
+ * other target pages it covers need not go through tlb_fill.
+ * The table is flushed together with the rest of the mmu_idx: any
+ * flush of a page inside a large page flushes the whole mmu_idx.
+ */
+static void tlb_add_large_entry(CPUArchState *env, int mmu_idx,
+                                target_ulong vaddr, hwaddr paddr,
+                                MemTxAttrs attrs, int prot,
+                                target_ulong size)
+{
+    CPUTLBDesc *desc = &env_tlb(env)->d[mmu_idx];
+    target_ulong mask = ~(size - 1);
+    target_ulong offset = vaddr & ~mask & TARGET_PAGE_MASK;
+    CPULTLBEntry *le = NULL;
+    int i;
+
+    vaddr &= mask;
+    for (i = 0; i < CPU_LTLB_SIZE; i++) {
+        if (desc->ltable[i].addr == vaddr && desc->ltable[i].mask == mask) {
+            le = &desc->ltable[i];
+            break;
+        }
+    }
+    if (!le) {
+        le = &desc->ltable[desc->lindex++ % CPU_LTLB_SIZE];
+    }
+    le->addr = vaddr;
+    le->mask = mask;
+    le->paddr = (paddr & TARGET_PAGE_MASK) - offset;
+    le->attrs = attrs;
+    le->prot = prot;
+}
+
+/*
+ * Try to refill the tlb for ADDR from the large page table.  Only
+ * succeed if the recorded protection allows ACCESS_TYPE, so that the
+ * target still sees faults and e.g. sets dirty bits through tlb_fill.
+ */
+static bool tlb_fill_large(CPUState *cpu, target_ulong addr,
+                           MMUAccessType access_type, int mmu_idx)
+{
+    CPUArchState *env = cpu->env_ptr;
+    CPUTLBDesc *desc = &env_tlb(env)->d[mmu_idx];
+    int need;
+    int i;
+
+    if ((addr & desc->large_page_mask) != desc->large_page_addr) {
+        return false;
+    }
+
+    switch (access_type) {
+    case MMU_DATA_LOAD:
+        need = PAGE_READ;
+        break;
+    case MMU_DATA_STORE:
+        need = PAGE_WRITE;
+        break;
+    case MMU_INST_FETCH:
+        need = PAGE_EXEC;
+        break;
+    default:
+        g_assert_not_reached();
+    }
+
+    for (i = 0; i < CPU_LTLB_SIZE; i++) {
+        CPULTLBEntry *le = &desc->ltable[i];
+
+        if ((addr & le->mask) == le->addr && (le->prot & need)) {
+            target_ulong offset = addr & ~le->mask & TARGET_PAGE_MASK;
+            CPULTLBEntry copy = *le;
+
+            tlb_set_page_with_attrs(cpu, addr & TARGET_PAGE_MASK,
+                                    copy.paddr + offset, copy.attrs,
+                                    copy.prot, mmu_idx, ~copy.mask + 1);
+            qatomic_set(&env_tlb(env)->c.ltlb_hit_count,
+                        env_tlb(env)->c.ltlb_hit_count + 1);
+            return true;
+        }
+    }
+    return false;
+}
+
 /* Add a new TLB entry. At most one entry for a given virtual address
  * is permitted. Only a single TARGET_PAGE_SIZE region is mapped, the
  * supplied size is only used by tlb_flush_page.
@@ -1123,6 +1273,7 @@ void tlb_set_page_with_attrs(CPUState *cpu, target_ulong vaddr,
         sz = TARGET_PAGE_SIZE;
     } else {
         tlb_add_large_page(env, mmu_idx, vaddr, size);
+        tlb_add_large_entry(env, mmu_idx, vaddr, paddr, attrs, prot, size);
         sz = size;
     }
     vaddr_page = vaddr & TARGET_PAGE_MASK;
@@ -1210,12 +1361,8 @@ void tlb_set_page_with_attrs(CPUState *cpu, target_ulong vaddr,
      * different page; otherwise just overwrite the stale data.
      */
     if (!tlb_hit_page_anyprot(te, vaddr_page) && !tlb_entry_is_empty(te)) {
-        unsigned vidx = desc->vindex++ % CPU_VTLB_SIZE;
-        CPUTLBEntry *tv = &desc->vtable[vidx];
-
         /* Evict the old entry into the victim tlb.  */
-        copy_tlb_helper_locked(tv, te);
-        desc->viotlb[vidx] = desc->iotlb[index];
+        tlb_vtlb_insert_locked(desc, te, &desc->iotlb[index]);
         tlb_n_used_entries_dec(env, mmu_idx);
     }
 
@@ -1302,6 +1449,10 @@ static void tlb_fill(CPUState *cpu, target_ulong addr, int size,
     CPUClass *cc = CPU_GET_CLASS(cpu);
     bool ok;
 
+    if (tlb_fill_large(cpu, addr, access_type, mmu_idx)) {
+        return;
+    }
+
     /*
      * This is not a probe, so only valid return is success; failure
      * should result in exception + longjmp to the cpu loop.
@@ -1357,7 +1508,8 @@ static uint64_t io_readx(CPUArchState *env, CPUIOTLBEntry *iotlbentry,
         cpu_io_recompile(cpu, retaddr);
     }
 
-    if (!qemu_mutex_iothread_locked()) {
+    if (memory_region_needs_global_locking(mr) &&
+        !qemu_mutex_iothread_locked()) {
         qemu_mutex_lock_iothread();
         locked = true;
     }
@@ -1418,7 +1570,8 @@ static void io_writex(CPUArchState *env, CPUIOTLBEntry *iotlbentry,
      */
     save_iotlb_data(cpu, iotlbentry->addr, section, mr_offset);
 
-    if (!qemu_mutex_iothread_locked()) {
+    if (memory_region_needs_global_locking(mr) &&
+        !qemu_mutex_iothread_locked()) {
         qemu_mutex_lock_iothread();
         locked = true;
     }
@@ -1452,10 +1605,11 @@ static inline target_ulong tlb_read_ofs(CPUTLBEntry *entry, size_t ofs)
 static bool victim_tlb_hit(CPUArchState *env, size_t mmu_idx, size_t index,
                            size_t elt_ofs, target_ulong page)
 {
+    size_t set = vtlb_set_index(page);
     size_t vidx;
 
     assert_cpu_is_self(env_cpu(env));
-    for (vidx = 0; vidx < CPU_VTLB_SIZE; ++vidx) {
+    for (vidx = set; vidx < set + CPU_VTLB_WAYS; ++vidx) {
         CPUTLBEntry *vtlb = &env_tlb(env)->d[mmu_idx].vtable[vidx];
         target_ulong cmp;
 
@@ -1467,21 +1621,31 @@ static bool victim_tlb_hit(CPUArchState *env, size_t mmu_idx, size_t index,
 #endif
 
         if (cmp == page) {
-            /* Found entry in victim tlb, swap tlb and iotlb.  */
+            /*
+             * Found entry in victim tlb: move it to the main tlb, and
+             * the displaced entry into the victim set it hashes to.
+             */
+            CPUTLBDesc *desc = &env_tlb(env)->d[mmu_idx];
             CPUTLBEntry tmptlb, *tlb = &env_tlb(env)->f[mmu_idx].table[index];
+            CPUIOTLBEntry tmpio, *io = &desc->iotlb[index];
 
             qemu_spin_lock(&env_tlb(env)->c.lock);
             copy_tlb_helper_locked(&tmptlb, tlb);
+            tmpio = *io;
             copy_tlb_helper_locked(tlb, vtlb);
-            copy_tlb_helper_locked(vtlb, &tmptlb);
+            *io = desc->viotlb[vidx];
+            memset(vtlb, -1, sizeof(*vtlb));
+            if (!tlb_entry_is_empty(&tmptlb)) {
+                tlb_vtlb_insert_locked(desc, &tmptlb, &tmpio);
+            }
             qemu_spin_unlock(&env_tlb(env)->c.lock);
-
-            CPUIOTLBEntry tmpio, *io = &env_tlb(env)->d[mmu_idx].iotlb[index];
-            CPUIOTLBEntry *vio = &env_tlb(env)->d[mmu_idx].viotlb[vidx];
-            tmpio = *io; *io = *vio; *vio = tmpio;
+            qatomic_set(&env_tlb(env)->c.vtlb_hit_count,
+                        env_tlb(env)->c.vtlb_hit_count + 1);
             return true;
         }
     }
+    qatomic_set(&env_tlb(env)->c.vtlb_miss_count,
+                env_tlb(env)->c.vtlb_miss_count + 1);
     return false;
 }
 
@@ -1604,7 +1768,8 @@ static int probe_access_internal(CPUArchState *env, target_ulong addr,
             CPUState *cs = env_cpu(env);
             CPUClass *cc = CPU_GET_CLASS(cs);
 
-            if (!cc->tcg_ops->tlb_fill(cs, addr, fault_size, access_type,
+            if (!tlb_fill_large(cs, addr, access_type, mmu_idx) &&
+                !cc->tcg_ops->tlb_fill(cs, addr, fault_size, access_type,
                                        mmu_idx, nonfault, retaddr)) {
                 /* Non-faulting page table read failed.  */
                 *phost = NULL;
@@ -1772,7 +1937,9 @@ static void *atomic_mmu_lookup(CPUArchState *env, target_ulong addr,
     }
 
     /* Enforce qemu required alignment.  */
-    if (unlikely(addr & ((1 << s_bits) - 1))) {
+    if (unlikely(addr & ((1 << s_bits) - 1)) &&
+        /* the host address has the same offset within the page */
+        !atomic_unaligned_ok(addr, 1 << s_bits)) {
         /* We get here if guest alignment was not requested,
            or was not enforced by cpu_unaligned_access above.
            We might widen the access and emulate, but for now
@@ -16,5 +16,52 @@ TranslationBlock *tb_gen_code(CPUState *cpu, target_ulong pc,
                               int cflags);
 
 void QEMU_NORETURN cpu_io_recompile(CPUState *cpu, uintptr_t retaddr);
+int tb_io_hint_lookup(target_ulong pc);
+
+bool tb_smc_unchanged(const TranslationBlock *tb);
+
+/*
+ * Return true if an atomic access of @size bytes at the unaligned host
+ * address @haddr can still use a host atomic instruction, instead of
+ * stopping all other vCPUs.  x86 hosts perform locked operations on any
+ * address atomically; only those that span two cache lines take a bus
+ * lock, which costs as much as stopping the world and may be trapped.
+ */
+static inline bool atomic_unaligned_ok(uintptr_t haddr, int size)
+{
+#if defined(__i386__) || defined(__x86_64__)
+    return size <= 8 && (haddr & 63) + size <= 64;
+#else
+    return false;
+#endif
+}
+
+#ifdef CONFIG_SOFTMMU
+void tb_cache_open(const char *path);
+void *tb_cache_buffer_hint(void);
+void tb_cache_load(void *buffer);
+TranslationBlock *tb_cache_lookup(CPUState *cpu, tb_page_addr_t phys_pc,
+                                  target_ulong pc, target_ulong cs_base,
+                                  uint32_t flags, uint32_t cflags,
+                                  tb_page_addr_t *phys_page2);
+void tb_cache_flush(void);
+#else
+static inline void *tb_cache_buffer_hint(void)
+{
+    return NULL;
+}
+
+static inline TranslationBlock *
+tb_cache_lookup(CPUState *cpu, tb_page_addr_t phys_pc, target_ulong pc,
+                target_ulong cs_base, uint32_t flags, uint32_t cflags,
+                tb_page_addr_t *phys_page2)
+{
+    return NULL;
+}
+
+static inline void tb_cache_flush(void)
+{
+}
+#endif
 
 #endif /* ACCEL_TCG_INTERNAL_H */
@@ -0,0 +1,215 @@
+/*
+ * Describe translated code to host profilers
+ *
+ * perf attributes samples in anonymous executable memory to symbols
+ * found in /tmp/perf-<pid>.map, one "start size name" line per range.
+ * The jitdump format goes further: it also carries a copy of the code,
+ * so that "perf inject -j" can build an ELF image for each translation
+ * block and "perf annotate" can disassemble it.  Each translation block
+ * is named after the guest address it was translated from and, when
+ * the guest binary has symbols, the guest function containing it.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/error-report.h"
+#include "elf.h"
+#include "exec/exec-all.h"
+#include "disas/disas.h"
+#include "tcg/perf.h"
+
+#define JITDUMP_MAGIC           0x4A695444
+#define JITDUMP_VERSION         1
+#define JIT_CODE_LOAD           0
+#define JIT_CODE_CLOSE          3
+
+struct jitheader {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t total_size;
+    uint32_t elf_mach;
+    uint32_t pad1;
+    uint32_t pid;
+    uint64_t timestamp;
+    uint64_t flags;
+};
+
+struct jr_prefix {
+    uint32_t id;
+    uint32_t total_size;
+    uint64_t timestamp;
+};
+
+struct jr_code_load {
+    struct jr_prefix p;
+    uint32_t pid;
+    uint32_t tid;
+    uint64_t vma;
+    uint64_t code_addr;
+    uint64_t code_size;
+    uint64_t code_index;
+};
+
+static FILE *perfmap;
+static FILE *jitdump;
+static void *jitdump_marker;
+static size_t jitdump_marker_size;
+static uint64_t jitdump_code_index;
+
+static FILE *perf_open(const char *path)
+{
+    FILE *f = fopen(path, "w+");
+
+    if (!f) {
+        warn_report("Could not open %s: %s, proceeding without it",
+                    path, strerror(errno));
+    }
+    return f;
+}
+
+void perf_enable_perfmap(void)
+{
+    g_autofree char *path = g_strdup_printf("/tmp/perf-%d.map", getpid());
+
+    perfmap = perf_open(path);
+}
+
+/* perf's clock for jitdump timestamps is CLOCK_MONOTONIC, see "perf record -k" */
+static uint64_t jitdump_timestamp(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * NANOSECONDS_PER_SECOND + ts.tv_nsec;
+}
+
+/* The host ELF machine, which tells perf inject how to disassemble */
+static uint32_t jitdump_elf_machine(void)
+{
+    Elf64_Half machine = EM_NONE;
+    int fd = open("/proc/self/exe", O_RDONLY);
+
+    if (fd >= 0) {
+        if (pread(fd, &machine, sizeof(machine),
+                  offsetof(Elf64_Ehdr, e_machine)) != sizeof(machine)) {
+            machine = EM_NONE;
+        }
+        close(fd);
+    }
+    return machine;
+}
+
+void perf_enable_jitdump(void)
+{
+    g_autofree char *path = g_strdup_printf("%s/jit-%d.dump",
+                                            g_get_tmp_dir(), getpid());
+    struct jitheader header;
+
+    jitdump = perf_open(path);
+    if (!jitdump) {
+        return;
+    }
+
+    /*
+     * perf record finds the dump through the executable mapping of
+     * its file, so keep one page of it mapped until the end.
+     */
+    jitdump_marker_size = qemu_real_host_page_size;
+    jitdump_marker = mmap(NULL, jitdump_marker_size, PROT_READ | PROT_EXEC,
+                          MAP_PRIVATE, fileno(jitdump), 0);
+    if (jitdump_marker == MAP_FAILED) {
+        warn_report("Could not map %s: %s, proceeding without it",
+                    path, strerror(errno));
+        jitdump_marker = NULL;
+        fclose(jitdump);
+        jitdump = NULL;
+        return;
+    }
+
+    memset(&header, 0, sizeof(header));
+    header.magic = JITDUMP_MAGIC;
+    header.version = JITDUMP_VERSION;
+    header.total_size = sizeof(header);
+    header.elf_mach = jitdump_elf_machine();
+    header.pid = getpid();
+    header.timestamp = jitdump_timestamp();
+    fwrite(&header, sizeof(header), 1, jitdump);
+}
+
+static void perf_report(const void *start, size_t size, const char *name)
+{
+    if (perfmap) {
+        flockfile(perfmap);
+        fprintf(perfmap, "%"PRIxPTR" %zx %s\n",
+                (uintptr_t)start, size, name);
+        funlockfile(perfmap);
+    }
+
+    if (jitdump) {
+        struct jr_code_load record;
+        size_t name_size = strlen(name) + 1;
+
+        record.p.id = JIT_CODE_LOAD;
+        record.p.total_size = sizeof(record) + name_size + size;
+        record.p.timestamp = jitdump_timestamp();
+        record.pid = getpid();
+        record.tid = qemu_get_thread_id();
+        record.vma = (uintptr_t)start;
+        record.code_addr = (uintptr_t)start;
+        record.code_size = size;
+
+        flockfile(jitdump);
+        record.code_index = jitdump_code_index++;
+        fwrite(&record, sizeof(record), 1, jitdump);
+        fwrite(name, name_size, 1, jitdump);
+        fwrite(start, size, 1, jitdump);
+        funlockfile(jitdump);
+    }
+}
+
+void perf_report_prologue(const void *start, size_t size)
+{
+    perf_report(start, size, "tcg-prologue-buffer");
+}
+
+void perf_report_code(uint64_t guest_pc, const void *start, size_t size)
+{
+    const char *symbol;
+    g_autofree char *name = NULL;
+
+    if (!perfmap && !jitdump) {
+        return;
+    }
+
+    symbol = lookup_symbol(guest_pc);
+    if (symbol[0]) {
+        name = g_strdup_printf("guest %s [0x%"PRIx64"]", symbol, guest_pc);
+    } else {
+        name = g_strdup_printf("guest 0x%"PRIx64, guest_pc);
+    }
+    perf_report(start, size, name);
+}
+
+void perf_exit(void)
+{
+    if (perfmap) {
+        fclose(perfmap);
+        perfmap = NULL;
+    }
+
+    if (jitdump) {
+        struct jr_prefix record = {
+            .id = JIT_CODE_CLOSE,
+            .total_size = sizeof(record),
+            .timestamp = jitdump_timestamp(),
+        };
+
+        fwrite(&record, sizeof(record), 1, jitdump);
+        munmap(jitdump_marker, jitdump_marker_size);
+        jitdump_marker = NULL;
+        fclose(jitdump);
+        jitdump = NULL;
+    }
+}
@@ -126,20 +126,12 @@ static void gen_empty_udata_cb(void)
 }
 
 /*
- * For now we only support addi_i64.
- * When we support more ops, we can generate one empty inline cb for each.
+ * Inline ops contain no helper call, so rather than being copied from an
+ * empty template they are generated when injecting them (see
+ * append_inline_cb); the empty callback only marks the insertion point.
  */
 static void gen_empty_inline_cb(void)
 {
-    TCGv_i64 val = tcg_temp_new_i64();
-    TCGv_ptr ptr = tcg_const_ptr(NULL); /* overwritten later */
-
-    tcg_gen_ld_i64(val, ptr, 0);
-    /* pass an immediate != 0 so that it doesn't get optimized away */
-    tcg_gen_addi_i64(val, val, 0xdeadface);
-    tcg_gen_st_i64(val, ptr, 0);
-    tcg_temp_free_ptr(ptr);
-    tcg_temp_free_i64(val);
 }
 
 static void gen_empty_mem_cb(TCGv addr, uint32_t info)
@@ -332,19 +324,6 @@ static TCGOp *copy_extu_tl_i64(TCGOp **begin_op, TCGOp *op)
     return op;
 }
 
-static TCGOp *copy_ld_i64(TCGOp **begin_op, TCGOp *op)
-{
-    if (TCG_TARGET_REG_BITS == 32) {
-        /* 2x ld_i32 */
-        op = copy_op(begin_op, op, INDEX_op_ld_i32);
-        op = copy_op(begin_op, op, INDEX_op_ld_i32);
-    } else {
-        /* ld_i64 */
-        op = copy_op(begin_op, op, INDEX_op_ld_i64);
-    }
-    return op;
-}
-
 static TCGOp *copy_st_i64(TCGOp **begin_op, TCGOp *op)
 {
     if (TCG_TARGET_REG_BITS == 32) {
@@ -358,21 +337,6 @@ static TCGOp *copy_st_i64(TCGOp **begin_op, TCGOp *op)
     return op;
 }
 
-static TCGOp *copy_add_i64(TCGOp **begin_op, TCGOp *op, uint64_t v)
-{
-    if (TCG_TARGET_REG_BITS == 32) {
-        /* all 32-bit backends must implement add2_i32 */
-        g_assert(TCG_TARGET_HAS_add2_i32);
-        op = copy_op(begin_op, op, INDEX_op_add2_i32);
-        op->args[4] = tcgv_i32_arg(tcg_constant_i32(v));
-        op->args[5] = tcgv_i32_arg(tcg_constant_i32(v >> 32));
-    } else {
-        op = copy_op(begin_op, op, INDEX_op_add_i64);
-        op->args[2] = tcgv_i64_arg(tcg_constant_i64(v));
-    }
-    return op;
-}
-
 static TCGOp *copy_st_ptr(TCGOp **begin_op, TCGOp *op)
 {
     if (UINTPTR_MAX == UINT32_MAX) {
@@ -418,6 +382,141 @@ static TCGOp *copy_call(TCGOp **begin_op, TCGOp *op, void *empty_func,
     return op;
 }
 
+/*
+ * Move the ops generated after @last, i.e. at the end of the op stream,
+ * to right after @op.  Returns the last op moved.
+ */
+static TCGOp *move_ops_after(TCGOp *op, TCGOp *last)
+{
+    TCGOp *next = QTAILQ_NEXT(last, link);
+    TCGOp *moved;
+
+    if (op == last) {
+        return tcg_last_op();
+    }
+    while (next) {
+        moved = next;
+        next = QTAILQ_NEXT(moved, link);
+        QTAILQ_REMOVE(&tcg_ctx->ops, moved, link);
+        QTAILQ_INSERT_AFTER(&tcg_ctx->ops, op, moved, link);
+        op = moved;
+    }
+    return op;
+}
+
+/* Load the address of the executing vCPU's @entry */
+static TCGv_ptr gen_plugin_u64_ptr(qemu_plugin_u64 entry)
+{
+    struct qemu_plugin_scoreboard *score = entry.score;
+    TCGv_ptr ptr = tcg_temp_new_ptr();
+    TCGv_ptr data = tcg_const_ptr(&score->data);
+    TCGv_i32 cpu_index = tcg_temp_new_i32();
+
+    tcg_gen_ld_i32(cpu_index, cpu_env,
+                   -offsetof(ArchCPU, env) + offsetof(CPUState, cpu_index));
+    tcg_gen_muli_i32(cpu_index, cpu_index, score->stride);
+    tcg_gen_ext_i32_ptr(ptr, cpu_index);
+    tcg_gen_ld_ptr(data, data, 0);
+    tcg_gen_add_ptr(ptr, ptr, data);
+    tcg_gen_addi_ptr(ptr, ptr, entry.offset);
+
+    tcg_temp_free_i32(cpu_index);
+    tcg_temp_free_ptr(data);
+    return ptr;
+}
+
+static void gen_inline_op(const struct qemu_plugin_dyn_cb *cb)
+{
+    TCGv_i64 val = tcg_temp_new_i64();
+    TCGv_ptr ptr;
+
+    if (cb->inline_insn.entry.score) {
+        ptr = gen_plugin_u64_ptr(cb->inline_insn.entry);
+    } else {
+        ptr = tcg_const_ptr(cb->userp);
+    }
+
+    switch (cb->inline_insn.op) {
+    case QEMU_PLUGIN_INLINE_ADD_U64:
+        tcg_gen_ld_i64(val, ptr, 0);
+        tcg_gen_addi_i64(val, val, cb->inline_insn.imm);
+        tcg_gen_st_i64(val, ptr, 0);
+        break;
+    case QEMU_PLUGIN_INLINE_STORE_U64:
+        if (cb->inline_insn.ring_slots) {
+            TCGv_i64 idx = tcg_temp_new_i64();
+            TCGv_ptr slot = tcg_temp_new_ptr();
+
+            /* the ring's slots follow its count of stores */
+            tcg_gen_ld_i64(val, ptr, 0);
+            tcg_gen_andi_i64(idx, val, cb->inline_insn.ring_slots - 1);
+            tcg_gen_shli_i64(idx, idx, 3);
+            tcg_gen_trunc_i64_ptr(slot, idx);
+            tcg_gen_add_ptr(slot, slot, ptr);
+            tcg_gen_addi_i64(val, val, 1);
+            tcg_gen_st_i64(val, ptr, 0);
+            tcg_gen_movi_i64(val, cb->inline_insn.imm);
+            tcg_gen_st_i64(val, slot, sizeof(uint64_t));
+            tcg_temp_free_ptr(slot);
+            tcg_temp_free_i64(idx);
+        } else {
+            tcg_gen_movi_i64(val, cb->inline_insn.imm);
+            tcg_gen_st_i64(val, ptr, 0);
+        }
+        break;
+    default:
+        g_assert_not_reached();
+    }
+
+    tcg_temp_free_ptr(ptr);
+    tcg_temp_free_i64(val);
+}
+
+static TCGCond plugin_cond_to_tcgcond(enum qemu_plugin_cond cond)
+{
+    switch (cond) {
+    case QEMU_PLUGIN_COND_EQ:
+        return TCG_COND_EQ;
+    case QEMU_PLUGIN_COND_NE:
+        return TCG_COND_NE;
+    case QEMU_PLUGIN_COND_LT:
+        return TCG_COND_LTU;
+    case QEMU_PLUGIN_COND_LE:
+        return TCG_COND_LEU;
+    case QEMU_PLUGIN_COND_GT:
+        return TCG_COND_GTU;
+    case QEMU_PLUGIN_COND_GE:
+        return TCG_COND_GEU;
+    default:
+        g_assert_not_reached();
+    }
+}
+
+/* Branch to @skip unless the condition of @cb holds */
+static void gen_cond_skip(const struct qemu_plugin_dyn_cb *cb, TCGLabel *skip)
+{
+    TCGv_ptr ptr = gen_plugin_u64_ptr(cb->cond.entry);
+    TCGv_i64 val = tcg_temp_new_i64();
+    TCGCond cond = plugin_cond_to_tcgcond(cb->cond.cond);
+
+    tcg_gen_ld_i64(val, ptr, 0);
+    tcg_gen_brcondi_i64(tcg_invert_cond(cond), val, cb->cond.imm, skip);
+
+    tcg_temp_free_i64(val);
+    tcg_temp_free_ptr(ptr);
+}
+
+/*
+ * State shared by the callbacks injected for one event: where the helper
+ * pointer sits in a call op's args[], and whether the vCPU index loaded by
+ * a previous callback can be reused.  It cannot once a conditional
+ * callback has branched around it.
+ */
+struct inject_state {
+    int cb_idx;
+    bool have_cpu_index;
+};
+
 /*
  * When we append/replace ops here we are sensitive to changing patterns of
  * TCGOps generated by the tcg_gen_FOO calls when we generated the
@@ -425,47 +524,58 @@ static TCGOp *copy_call(TCGOp **begin_op, TCGOp *op, void *empty_func,
  * we assert the ops we are replacing are the correct ones.
  */
 static TCGOp *append_udata_cb(const struct qemu_plugin_dyn_cb *cb,
-                              TCGOp *begin_op, TCGOp *op, int *cb_idx)
+                              TCGOp *begin_op, TCGOp *op,
+                              struct inject_state *s)
 {
+    bool cond = cb->cond.cond != QEMU_PLUGIN_COND_ALWAYS;
+    TCGLabel *skip = NULL;
+    TCGOp *last;
+
+    if (cond) {
+        last = tcg_last_op();
+        skip = gen_new_label();
+        gen_cond_skip(cb, skip);
+        op = move_ops_after(op, last);
+    }
+
     /* const_ptr */
     op = copy_const_ptr(&begin_op, op, cb->userp);
 
-    /* copy the ld_i32, but note that we only have to copy it once */
+    /* copy the ld_i32, but note that we usually only have to copy it once */
     begin_op = QTAILQ_NEXT(begin_op, link);
     tcg_debug_assert(begin_op && begin_op->opc == INDEX_op_ld_i32);
-    if (*cb_idx == -1) {
+    if (!s->have_cpu_index || cond) {
         op = tcg_op_insert_after(tcg_ctx, op, INDEX_op_ld_i32);
         memcpy(op->args, begin_op->args, sizeof(op->args));
     }
+    s->have_cpu_index = !cond;
 
     /* call */
     op = copy_call(&begin_op, op, HELPER(plugin_vcpu_udata_cb),
-                   cb->f.vcpu_udata, cb->tcg_flags, cb_idx);
+                   cb->f.vcpu_udata, cb->tcg_flags, &s->cb_idx);
+
+    if (cond) {
+        last = tcg_last_op();
+        gen_set_label(skip);
+        op = move_ops_after(op, last);
+    }
 
     return op;
 }
 
 static TCGOp *append_inline_cb(const struct qemu_plugin_dyn_cb *cb,
                                TCGOp *begin_op, TCGOp *op,
-                               int *unused)
+                               struct inject_state *s)
 {
-    /* const_ptr */
-    op = copy_const_ptr(&begin_op, op, cb->userp);
+    TCGOp *last = tcg_last_op();
 
-    /* ld_i64 */
-    op = copy_ld_i64(&begin_op, op);
-
-    /* add_i64 */
-    op = copy_add_i64(&begin_op, op, cb->inline_insn.imm);
-
-    /* st_i64 */
-    op = copy_st_i64(&begin_op, op);
-
-    return op;
+    gen_inline_op(cb);
+    return move_ops_after(op, last);
 }
 
 static TCGOp *append_mem_cb(const struct qemu_plugin_dyn_cb *cb,
-                            TCGOp *begin_op, TCGOp *op, int *cb_idx)
+                            TCGOp *begin_op, TCGOp *op,
+                            struct inject_state *s)
 {
     enum plugin_gen_cb type = begin_op->args[1];
 
@@ -480,9 +590,10 @@ static TCGOp *append_mem_cb(const struct qemu_plugin_dyn_cb *cb,
     /* copy the ld_i32, but note that we only have to copy it once */
     begin_op = QTAILQ_NEXT(begin_op, link);
     tcg_debug_assert(begin_op && begin_op->opc == INDEX_op_ld_i32);
-    if (*cb_idx == -1) {
+    if (!s->have_cpu_index) {
         op = tcg_op_insert_after(tcg_ctx, op, INDEX_op_ld_i32);
         memcpy(op->args, begin_op->args, sizeof(op->args));
+        s->have_cpu_index = true;
     }
 
     /* extu_tl_i64 */
@@ -491,14 +602,15 @@ static TCGOp *append_mem_cb(const struct qemu_plugin_dyn_cb *cb,
     if (type == PLUGIN_GEN_CB_MEM) {
         /* call */
         op = copy_call(&begin_op, op, HELPER(plugin_vcpu_mem_cb),
-                       cb->f.vcpu_udata, cb->tcg_flags, cb_idx);
+                       cb->f.vcpu_udata, cb->tcg_flags, &s->cb_idx);
     }
 
     return op;
 }
 
 typedef TCGOp *(*inject_fn)(const struct qemu_plugin_dyn_cb *cb,
-                            TCGOp *begin_op, TCGOp *op, int *intp);
+                            TCGOp *begin_op, TCGOp *op,
+                            struct inject_state *s);
 typedef bool (*op_ok_fn)(const TCGOp *op, const struct qemu_plugin_dyn_cb *cb);
 
 static bool op_ok(const TCGOp *op, const struct qemu_plugin_dyn_cb *cb)
@@ -518,9 +630,9 @@ static inline
 void inject_cb_type(const GArray *cbs, TCGOp *begin_op, inject_fn inject,
                     op_ok_fn ok)
 {
+    struct inject_state state = { .cb_idx = -1 };
     TCGOp *end_op;
     TCGOp *op;
-    int cb_idx = -1;
     int i;
 
     if (!cbs || cbs->len == 0) {
@@ -539,7 +651,7 @@ void inject_cb_type(const GArray *cbs, TCGOp *begin_op, inject_fn inject,
         if (!ok(begin_op, cb)) {
             continue;
         }
-        op = inject(cb, begin_op, op, &cb_idx);
+        op = inject(cb, begin_op, op, &state);
     }
     rm_ops_range(begin_op, end_op);
 }
@@ -0,0 +1,496 @@
+/*
+ * Persistent translation block cache
+ *
+ * The host code generated for the guest is written to a file when QEMU
+ * exits, and copied back into the code generation buffer on the next
+ * start.  Generated code embeds absolute host addresses (helpers, the
+ * epilogue, other TBs, the CPU state), so the image is only reused when
+ * the buffer and the QEMU binary end up at the very same addresses,
+ * i.e. when host address space randomization is disabled.  A block is
+ * adopted only if the guest code it was translated from is byte-for-byte
+ * identical to what the guest is now executing at that physical address,
+ * and the CPU state flags match.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/error-report.h"
+#include "qemu/cacheflush.h"
+#include "qemu/atomic.h"
+#include "qemu/rcu.h"
+#include "qemu/bitops.h"
+#include "cpu.h"
+#include "exec/exec-all.h"
+#include "exec/tb-hash.h"
+#include "tcg/tcg.h"
+#include "sysemu/sysemu.h"
+#include "sysemu/tcg.h"
+#include "internal.h"
+
+#define TB_CACHE_MAGIC      "QEMUTBC"
+#define TB_CACHE_VERSION    1
+
+typedef struct TBCacheHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t nb_entries;
+    char qemu_version[32];
+    char target[16];
+    char cpu_type[64];
+    /* Addresses used to detect a different binary or memory layout */
+    uint64_t code_ref;
+    uint64_t data_ref;
+    uint64_t env_ptr;
+    uint64_t buffer;
+    uint64_t buffer_size;
+    uint64_t prologue_size;
+    uint64_t image_size;
+} TBCacheHeader;
+
+/*
+ * The header is followed by the prologue, by @image_size bytes of code
+ * starting right after it, and by @nb_entries TBCacheEntry, each one
+ * followed by the @size bytes of guest code the TB was translated from.
+ */
+typedef struct TBCacheEntry {
+    uint64_t tb;
+    uint64_t pc;
+    uint64_t cs_base;
+    uint64_t page_addr[2];
+    uint32_t flags;
+    uint32_t cflags;
+    uint32_t trace_vcpu_dstate;
+    uint32_t size;
+} TBCacheEntry;
+
+typedef struct TBCacheRecord {
+    TBCacheEntry e;
+    bool used;
+    uint8_t code[];
+} TBCacheRecord;
+
+static struct {
+    char *path;
+    gchar *data;
+    gsize len;
+    void *buffer;
+    size_t buffer_size;
+    void *base;
+    size_t limit;
+    GHashTable *records;
+    uint64_t env_ptr;
+    char cpu_type[64];
+    /* 0: not checked yet, 1: CPUs match the saved ones, -1: mismatch */
+    int cpu_state;
+    Notifier exit_notifier;
+} tb_cache;
+
+static uint32_t tb_cache_record_hash(const TBCacheRecord *rec)
+{
+    target_ulong pc = rec->e.pc;
+    tb_page_addr_t phys_pc = rec->e.page_addr[0] | (pc & ~TARGET_PAGE_MASK);
+
+    return tb_hash_func(phys_pc, pc, rec->e.flags, rec->e.cflags,
+                        rec->e.trace_vcpu_dstate);
+}
+
+static guint tb_cache_hash(gconstpointer key)
+{
+    return tb_cache_record_hash(key);
+}
+
+static gboolean tb_cache_equal(gconstpointer a, gconstpointer b)
+{
+    const TBCacheEntry *ea = &((const TBCacheRecord *)a)->e;
+    const TBCacheEntry *eb = &((const TBCacheRecord *)b)->e;
+
+    return ea->pc == eb->pc &&
+        ea->cs_base == eb->cs_base &&
+        ea->flags == eb->flags &&
+        ea->cflags == eb->cflags &&
+        ea->trace_vcpu_dstate == eb->trace_vcpu_dstate &&
+        ea->page_addr[0] == eb->page_addr[0];
+}
+
+static void tb_cache_discard(void)
+{
+    g_free(tb_cache.data);
+    tb_cache.data = NULL;
+    tb_cache.len = 0;
+}
+
+static const TBCacheHeader *tb_cache_header(void)
+{
+    const TBCacheHeader *hdr = (const TBCacheHeader *)tb_cache.data;
+
+    if (tb_cache.len < sizeof(*hdr) ||
+        memcmp(hdr->magic, TB_CACHE_MAGIC, sizeof(hdr->magic)) ||
+        hdr->version != TB_CACHE_VERSION) {
+        warn_report("tb-cache: %s is not a translation cache, ignoring it",
+                    tb_cache.path);
+        return NULL;
+    }
+    if (strncmp(hdr->qemu_version, QEMU_VERSION, sizeof(hdr->qemu_version)) ||
+        strncmp(hdr->target, TARGET_NAME, sizeof(hdr->target))) {
+        warn_report("tb-cache: %s was saved by a different QEMU, ignoring it",
+                    tb_cache.path);
+        return NULL;
+    }
+    if (hdr->code_ref != (uintptr_t)tcg_exec_init ||
+        hdr->data_ref != (uintptr_t)&tcg_init_ctx) {
+        warn_report("tb-cache: %s was saved with a different memory layout, "
+                    "ignoring it", tb_cache.path);
+        error_printf("Host address space randomization must be disabled "
+                     "to reuse the translation cache (e.g. setarch -R)\n");
+        return NULL;
+    }
+    if (hdr->prologue_size > tb_cache.len - sizeof(*hdr) ||
+        hdr->image_size > tb_cache.len - sizeof(*hdr) - hdr->prologue_size) {
+        warn_report("tb-cache: %s is truncated, ignoring it", tb_cache.path);
+        return NULL;
+    }
+    return hdr;
+}
+
+static void tb_cache_save(Notifier *n, void *unused);
+
+void tb_cache_open(const char *path)
+{
+    GError *err = NULL;
+
+    tb_cache.path = g_strdup(path);
+    tb_cache.exit_notifier.notify = tb_cache_save;
+    qemu_add_exit_notifier(&tb_cache.exit_notifier);
+
+    if (!g_file_get_contents(path, &tb_cache.data, &tb_cache.len, &err)) {
+        if (!g_error_matches(err, G_FILE_ERROR, G_FILE_ERROR_NOENT)) {
+            warn_report("tb-cache: %s", err->message);
+        }
+        g_error_free(err);
+        return;
+    }
+    if (!tb_cache_header()) {
+        tb_cache_discard();
+    }
+}
+
+void *tb_cache_buffer_hint(void)
+{
+    const TBCacheHeader *hdr = (const TBCacheHeader *)tb_cache.data;
+
+    return hdr ? (void *)(uintptr_t)hdr->buffer : NULL;
+}
+
+static void tb_cache_load_entries(const TBCacheHeader *hdr, const uint8_t *p)
+{
+    const uint8_t *end = (const uint8_t *)tb_cache.data + tb_cache.len;
+    uintptr_t image = (uintptr_t)tb_cache.base;
+    uint32_t i;
+
+    tb_cache.records = g_hash_table_new_full(tb_cache_hash, tb_cache_equal,
+                                             g_free, NULL);
+    for (i = 0; i < hdr->nb_entries; i++) {
+        TBCacheEntry e;
+        TBCacheRecord *rec;
+
+        if (end - p < sizeof(e)) {
+            break;
+        }
+        memcpy(&e, p, sizeof(e));
+        p += sizeof(e);
+        if (end - p < e.size || e.size == 0 || e.size > TARGET_PAGE_SIZE) {
+            break;
+        }
+        if (e.tb >= image &&
+            e.tb + sizeof(TranslationBlock) <= image + hdr->image_size) {
+            rec = g_malloc(sizeof(*rec) + e.size);
+            rec->e = e;
+            rec->used = false;
+            memcpy(rec->code, p, e.size);
+            g_hash_table_replace(tb_cache.records, rec, rec);
+        }
+        p += e.size;
+    }
+}
+
+void tb_cache_load(void *buffer)
+{
+    TCGContext *s = &tcg_init_ctx;
+    const TBCacheHeader *hdr;
+    const uint8_t *prologue, *image;
+    size_t prologue_size;
+
+    if (!tb_cache.path) {
+        return;
+    }
+    if (tcg_splitwx_diff) {
+        warn_report("tb-cache: not supported with split-wx, disabling it");
+        qemu_remove_exit_notifier(&tb_cache.exit_notifier);
+        g_free(tb_cache.path);
+        tb_cache.path = NULL;
+        tb_cache_discard();
+        return;
+    }
+
+    prologue_size = (uintptr_t)s->code_gen_buffer - (uintptr_t)buffer;
+    tb_cache.buffer = buffer;
+    tb_cache.buffer_size = s->code_gen_buffer_size + prologue_size;
+    tb_cache.base = s->code_gen_buffer;
+    tb_cache.limit = s->code_gen_buffer_size / 2;
+
+    hdr = (const TBCacheHeader *)tb_cache.data;
+    if (!hdr) {
+        return;
+    }
+    prologue = (const uint8_t *)(hdr + 1);
+    image = prologue + hdr->prologue_size;
+    if (hdr->buffer != (uintptr_t)buffer ||
+        hdr->buffer_size != tb_cache.buffer_size ||
+        hdr->prologue_size != prologue_size ||
+        hdr->image_size > tb_cache.limit ||
+        memcmp(buffer, prologue, prologue_size)) {
+        warn_report("tb-cache: code buffer layout of %s does not match, "
+                    "ignoring it", tb_cache.path);
+        tb_cache_discard();
+        return;
+    }
+
+    memcpy(tb_cache.base, image, hdr->image_size);
+    flush_idcache_range((uintptr_t)tb_cache.base, (uintptr_t)tb_cache.base,
+                        hdr->image_size);
+    tb_cache_load_entries(hdr, image + hdr->image_size);
+
+    /*
+     * The image stays at the start of region 0, so that its TBs belong to
+     * that region's tree, but code is only generated after it.  The space
+     * is given back when tb_flush() drops the cache.
+     */
+    tcg_region_reserve(hdr->image_size);
+
+    tb_cache.env_ptr = hdr->env_ptr;
+    pstrcpy(tb_cache.cpu_type, sizeof(tb_cache.cpu_type), hdr->cpu_type);
+    tb_cache.cpu_state = 0;
+    tb_cache_discard();
+}
+
+static bool tb_cache_cpu_matches(void)
+{
+    int state = qatomic_read(&tb_cache.cpu_state);
+
+    /* The CPUs did not exist yet when the cache was loaded */
+    if (state == 0) {
+        if (first_cpu &&
+            (uintptr_t)first_cpu->env_ptr == tb_cache.env_ptr &&
+            !strcmp(object_get_typename(OBJECT(first_cpu)),
+                    tb_cache.cpu_type)) {
+            state = 1;
+        } else {
+            warn_report("tb-cache: %s was saved for a different CPU "
+                        "configuration, ignoring it", tb_cache.path);
+            state = -1;
+        }
+        qatomic_set(&tb_cache.cpu_state, state);
+    }
+    return state > 0;
+}
+
+static bool tb_cache_code_matches(CPUState *cpu, const TBCacheRecord *rec,
+                                  tb_page_addr_t phys_pc,
+                                  tb_page_addr_t *phys_page2)
+{
+    target_ulong pc = rec->e.pc;
+    size_t len = MIN(rec->e.size, TARGET_PAGE_SIZE - (pc & ~TARGET_PAGE_MASK));
+    target_ulong virt_page2;
+
+    *phys_page2 = -1;
+    if (memcmp(qemu_map_ram_ptr(NULL, phys_pc), rec->code, len)) {
+        return false;
+    }
+    if (len == rec->e.size) {
+        return true;
+    }
+    virt_page2 = (pc + rec->e.size - 1) & TARGET_PAGE_MASK;
+    *phys_page2 = get_page_addr_code(cpu->env_ptr, virt_page2);
+    if (*phys_page2 != rec->e.page_addr[1]) {
+        return false;
+    }
+    return !memcmp(qemu_map_ram_ptr(NULL, *phys_page2), rec->code + len,
+                   rec->e.size - len);
+}
+
+TranslationBlock *tb_cache_lookup(CPUState *cpu, tb_page_addr_t phys_pc,
+                                  target_ulong pc, target_ulong cs_base,
+                                  uint32_t flags, uint32_t cflags,
+                                  tb_page_addr_t *phys_page2)
+{
+    TBCacheRecord key, *rec;
+
+    /* The table is only modified at startup and in tb_flush() */
+    if (!tb_cache.records || !tb_cache_cpu_matches()) {
+        return NULL;
+    }
+    if (cpu->singlestep_enabled || singlestep ||
+        !QTAILQ_EMPTY(&cpu->breakpoints)) {
+        return NULL;
+    }
+#ifdef CONFIG_PLUGIN
+    if (test_bit(QEMU_PLUGIN_EV_VCPU_TB_TRANS, cpu->plugin_mask)) {
+        return NULL;
+    }
+#endif
+
+    memset(&key, 0, sizeof(key));
+    key.e.pc = pc;
+    key.e.cs_base = cs_base;
+    key.e.flags = flags;
+    key.e.cflags = cflags;
+    key.e.trace_vcpu_dstate = *cpu->trace_dstate;
+    key.e.page_addr[0] = phys_pc & TARGET_PAGE_MASK;
+
+    rec = g_hash_table_lookup(tb_cache.records, &key);
+    if (!rec || qatomic_read(&rec->used) ||
+        !tb_cache_code_matches(cpu, rec, phys_pc, phys_page2)) {
+        return NULL;
+    }
+    /* Each block is handed out at most once */
+    if (qatomic_xchg(&rec->used, true)) {
+        return NULL;
+    }
+    return (TranslationBlock *)(uintptr_t)rec->e.tb;
+}
+
+/* Call from a safe-work context, before tcg_region_reset_all() */
+void tb_cache_flush(void)
+{
+    if (tb_cache.records) {
+        g_hash_table_destroy(tb_cache.records);
+        tb_cache.records = NULL;
+        tcg_region_reserve(0);
+    }
+}
+
+static gboolean tb_cache_collect(gpointer key, gpointer value, gpointer data)
+{
+    TranslationBlock *tb = value;
+    GPtrArray *tbs = data;
+    uintptr_t base = (uintptr_t)tb_cache.base;
+
+    if ((uintptr_t)tb >= base && (uintptr_t)tb < base + tb_cache.limit) {
+        g_ptr_array_add(tbs, tb);
+    }
+    return false;
+}
+
+static gint tb_cache_cmp(gconstpointer a, gconstpointer b)
+{
+    uintptr_t ta = (uintptr_t)*(TranslationBlock * const *)a;
+    uintptr_t tb = (uintptr_t)*(TranslationBlock * const *)b;
+
+    return ta < tb ? -1 : ta > tb;
+}
+
+static bool tb_cache_savable(const TranslationBlock *tb)
+{
+    target_ulong page2 = (tb->pc + tb->size - 1) & TARGET_PAGE_MASK;
+
+    if (tb_cflags(tb) & CF_INVALID || tb->page_addr[0] == -1 ||
+        tb->size == 0) {
+        return false;
+    }
+    /* The copy that self-checking TBs compare against is not saved */
+    if (tb->smc_copy) {
+        return false;
+    }
+    return (tb->pc & TARGET_PAGE_MASK) == page2 || tb->page_addr[1] != -1;
+}
+
+static void tb_cache_write_entry(FILE *f, const TranslationBlock *tb)
+{
+    target_ulong pc = tb->pc;
+    size_t len = MIN(tb->size, TARGET_PAGE_SIZE - (pc & ~TARGET_PAGE_MASK));
+    TBCacheEntry e = {
+        .tb = (uintptr_t)tb,
+        .pc = pc,
+        .cs_base = tb->cs_base,
+        .page_addr = { tb->page_addr[0], tb->page_addr[1] },
+        .flags = tb->flags,
+        .cflags = tb_cflags(tb),
+        .trace_vcpu_dstate = tb->trace_vcpu_dstate,
+        .size = tb->size,
+    };
+
+    fwrite(&e, sizeof(e), 1, f);
+    fwrite(qemu_map_ram_ptr(NULL, tb->page_addr[0] | (pc & ~TARGET_PAGE_MASK)),
+           len, 1, f);
+    if (len < tb->size) {
+        fwrite(qemu_map_ram_ptr(NULL, tb->page_addr[1]), tb->size - len, 1, f);
+    }
+}
+
+static void tb_cache_save(Notifier *n, void *unused)
+{
+    g_autoptr(GPtrArray) tbs = g_ptr_array_new();
+    g_autofree char *tmp = NULL;
+    TBCacheHeader hdr = { .magic = TB_CACHE_MAGIC };
+    uintptr_t end = (uintptr_t)tb_cache.base;
+    FILE *f;
+    guint i;
+
+    if (!tb_cache.base || !first_cpu) {
+        return;
+    }
+
+    tcg_tb_foreach(tb_cache_collect, tbs);
+    g_ptr_array_sort(tbs, tb_cache_cmp);
+
+    /*
+     * The code and search data of a TB extend up to the next TB; the
+     * last one is left out since we do not know where it ends.
+     */
+    for (i = 0; i + 1 < tbs->len; i++) {
+        if (tb_cache_savable(g_ptr_array_index(tbs, i))) {
+            hdr.nb_entries++;
+            end = (uintptr_t)g_ptr_array_index(tbs, i + 1);
+        }
+    }
+
+    hdr.version = TB_CACHE_VERSION;
+    pstrcpy(hdr.qemu_version, sizeof(hdr.qemu_version), QEMU_VERSION);
+    pstrcpy(hdr.target, sizeof(hdr.target), TARGET_NAME);
+    pstrcpy(hdr.cpu_type, sizeof(hdr.cpu_type),
+            object_get_typename(OBJECT(first_cpu)));
+    hdr.code_ref = (uintptr_t)tcg_exec_init;
+    hdr.data_ref = (uintptr_t)&tcg_init_ctx;
+    hdr.env_ptr = (uintptr_t)first_cpu->env_ptr;
+    hdr.buffer = (uintptr_t)tb_cache.buffer;
+    hdr.buffer_size = tb_cache.buffer_size;
+    hdr.prologue_size = (uintptr_t)tb_cache.base - (uintptr_t)tb_cache.buffer;
+    hdr.image_size = end - (uintptr_t)tb_cache.base;
+
+    tmp = g_strdup_printf("%s.tmp", tb_cache.path);
+    f = fopen(tmp, "wb");
+    if (!f) {
+        warn_report("tb-cache: cannot create %s: %s", tmp, strerror(errno));
+        return;
+    }
+    fwrite(&hdr, sizeof(hdr), 1, f);
+    fwrite(tb_cache.buffer, hdr.prologue_size, 1, f);
+    fwrite(tb_cache.base, hdr.image_size, 1, f);
+
+    WITH_RCU_READ_LOCK_GUARD() {
+        for (i = 0; i + 1 < tbs->len; i++) {
+            TranslationBlock *tb = g_ptr_array_index(tbs, i);
+
+            if (tb_cache_savable(tb)) {
+                tb_cache_write_entry(f, tb);
+            }
+        }
+    }
+
+    if (ferror(f) | fclose(f) || rename(tmp, tb_cache.path)) {
+        warn_report("tb-cache: cannot write %s", tb_cache.path);
+        unlink(tmp);
+    }
+}
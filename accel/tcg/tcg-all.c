@@ -32,6 +32,9 @@
 #include "qemu/error-report.h"
 #include "qemu/accel.h"
 #include "qapi/qapi-builtin-visit.h"
+#include "exec/translator.h"
+#include "tcg/perf.h"
+#include "internal.h"
 
 struct TCGState {
     AccelState parent_obj;
@@ -39,6 +42,9 @@ struct TCGState {
     bool mttcg_enabled;
     int splitwx_enabled;
     unsigned long tb_size;
+    uint32_t hot_threshold;
+    char *tb_cache;
+    char *perf;
 };
 typedef struct TCGState TCGState;
 
@@ -109,8 +115,23 @@ static int tcg_init(MachineState *ms)
 {
     TCGState *s = TCG_STATE(current_accel());
 
+#ifndef CONFIG_USER_ONLY
+    if (s->tb_cache) {
+        tb_cache_open(s->tb_cache);
+    }
+#endif
+    if (g_strcmp0(s->perf, "map") == 0) {
+        perf_enable_perfmap();
+    } else if (g_strcmp0(s->perf, "jitdump") == 0) {
+        perf_enable_jitdump();
+    }
+#ifndef CONFIG_USER_ONLY
+    /* linux-user calls perf_exit() itself, as the guest exits with _exit() */
+    atexit(perf_exit);
+#endif
     tcg_exec_init(s->tb_size * 1024 * 1024, s->splitwx_enabled);
     mttcg_enabled = s->mttcg_enabled;
+    tb_hot_threshold = s->hot_threshold;
 
     /*
      * Initialize TCG regions only for softmmu.
@@ -184,6 +205,30 @@ static void tcg_set_tb_size(Object *obj, Visitor *v,
     s->tb_size = value;
 }
 
+static void tcg_get_hot_threshold(Object *obj, Visitor *v,
+                                  const char *name, void *opaque,
+                                  Error **errp)
+{
+    TCGState *s = TCG_STATE(obj);
+    uint32_t value = s->hot_threshold;
+
+    visit_type_uint32(v, name, &value, errp);
+}
+
+static void tcg_set_hot_threshold(Object *obj, Visitor *v,
+                                  const char *name, void *opaque,
+                                  Error **errp)
+{
+    TCGState *s = TCG_STATE(obj);
+    uint32_t value;
+
+    if (!visit_type_uint32(v, name, &value, errp)) {
+        return;
+    }
+
+    s->hot_threshold = value;
+}
+
 static bool tcg_get_splitwx(Object *obj, Error **errp)
 {
     TCGState *s = TCG_STATE(obj);
@@ -196,6 +241,43 @@ static void tcg_set_splitwx(Object *obj, bool value, Error **errp)
     s->splitwx_enabled = value;
 }
 
+#ifndef CONFIG_USER_ONLY
+static char *tcg_get_tb_cache(Object *obj, Error **errp)
+{
+    TCGState *s = TCG_STATE(obj);
+
+    return g_strdup(s->tb_cache);
+}
+
+static void tcg_set_tb_cache(Object *obj, const char *value, Error **errp)
+{
+    TCGState *s = TCG_STATE(obj);
+
+    g_free(s->tb_cache);
+    s->tb_cache = g_strdup(value);
+}
+#endif
+
+static char *tcg_get_perf(Object *obj, Error **errp)
+{
+    TCGState *s = TCG_STATE(obj);
+
+    return g_strdup(s->perf ? s->perf : "off");
+}
+
+static void tcg_set_perf(Object *obj, const char *value, Error **errp)
+{
+    TCGState *s = TCG_STATE(obj);
+
+    if (strcmp(value, "off") && strcmp(value, "map") &&
+        strcmp(value, "jitdump")) {
+        error_setg(errp, "Invalid 'perf' setting %s", value);
+        return;
+    }
+    g_free(s->perf);
+    s->perf = g_strdup(value);
+}
+
 static void tcg_accel_class_init(ObjectClass *oc, void *data)
 {
     AccelClass *ac = ACCEL_CLASS(oc);
@@ -213,10 +295,30 @@ static void tcg_accel_class_init(ObjectClass *oc, void *data)
     object_class_property_set_description(oc, "tb-size",
         "TCG translation block cache size");
 
+    object_class_property_add(oc, "hot-threshold", "int",
+        tcg_get_hot_threshold, tcg_set_hot_threshold,
+        NULL, NULL);
+    object_class_property_set_description(oc, "hot-threshold",
+        "Executions after which a block is translated again as a trace");
+
     object_class_property_add_bool(oc, "split-wx",
         tcg_get_splitwx, tcg_set_splitwx);
     object_class_property_set_description(oc, "split-wx",
         "Map jit pages into separate RW and RX regions");
+
+    object_class_property_add_str(oc, "perf",
+                                  tcg_get_perf,
+                                  tcg_set_perf);
+    object_class_property_set_description(oc, "perf",
+        "Describe translated code to perf (off, map or jitdump)");
+
+#ifndef CONFIG_USER_ONLY
+    object_class_property_add_str(oc, "tb-cache",
+                                  tcg_get_tb_cache,
+                                  tcg_set_tb_cache);
+    object_class_property_set_description(oc, "tb-cache",
+        "File keeping translated code across runs");
+#endif
 }
 
 static const TypeInfo tcg_accel_type = {
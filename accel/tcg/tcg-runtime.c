@@ -31,6 +31,7 @@
 #include "exec/log.h"
 #include "tcg/tcg.h"
 #include "exec/tb-lookup.h"
+#include "internal.h"
 
 /* 32-bit helpers */
 
@@ -170,3 +171,45 @@ void HELPER(exit_atomic)(CPUArchState *env)
 {
     cpu_loop_exit_atomic(env_cpu(env), GETPC());
 }
+
+/*
+ * Called on entry to a TB that has run tb_hot_threshold times.  Nothing
+ * of it has been executed yet, so drop it and have the main loop
+ * translate the same code again as a trace.
+ */
+void HELPER(tb_hot)(CPUArchState *env, void *ptr)
+{
+    CPUState *cpu = env_cpu(env);
+    TranslationBlock *tb = ptr;
+    uint32_t cflags = tb_cflags(tb) & ~CF_INVALID;
+
+    cpu_restore_state(cpu, GETPC(), true);
+    mmap_lock();
+    tb_phys_invalidate(tb, -1);
+    mmap_unlock();
+
+    cpu->cflags_next_tb = cflags | CF_TRACE;
+    cpu_loop_exit_noexc(cpu);
+}
+
+/*
+ * Called on entry to a TB translated with CF_SMC_CHECK.  If its guest
+ * code was overwritten since translation, drop it before anything of it
+ * has run and have the main loop translate the new code.
+ */
+void HELPER(tb_smc_check)(CPUArchState *env, void *ptr)
+{
+    CPUState *cpu;
+    TranslationBlock *tb = ptr;
+
+    if (likely(tb_smc_unchanged(tb))) {
+        return;
+    }
+
+    cpu = env_cpu(env);
+    cpu_restore_state(cpu, GETPC(), true);
+    mmap_lock();
+    tb_phys_invalidate(tb, -1);
+    mmap_unlock();
+    cpu_loop_exit_noexc(cpu);
+}
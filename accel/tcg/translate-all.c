@@ -27,6 +27,7 @@
 #include "disas/disas.h"
 #include "exec/exec-all.h"
 #include "tcg/tcg.h"
+#include "tcg/perf.h"
 #if defined(CONFIG_USER_ONLY)
 #include "qemu.h"
 #if defined(__FreeBSD__) || defined(__FreeBSD_kernel__)
@@ -94,7 +95,8 @@
 /* Access to the various translations structures need to be serialised via locks
  * for consistency.
  * In user-mode emulation access to the memory related structures are protected
- * with mmap_lock.
+ * with mmap_lock, which covers either the whole address space or, when taken
+ * with mmap_lock_pc() or mmap_lock_range(), the part of it being worked on.
  * In !user-mode we use per-page locks.
  */
 #ifdef CONFIG_SOFTMMU
@@ -103,7 +105,16 @@
 #define assert_memory_lock() tcg_debug_assert(have_mmap_lock())
 #endif
 
-#define SMC_BITMAP_USE_THRESHOLD 10
+/*
+ * Build the code bitmap of a page on the first write to it: writes to
+ * data sharing a page with code then only cost a bitmap test.
+ */
+#define SMC_BITMAP_USE_THRESHOLD 1
+/*
+ * After this many writes that hit translated code, a page is only
+ * translated with CF_SMC_CHECK and no longer write-protected.
+ */
+#define SMC_SELFCHECK_THRESHOLD 64
 
 typedef struct PageDesc {
     /* list of TBs intersecting this ram page */
@@ -113,6 +124,10 @@ typedef struct PageDesc {
        of lookups we do to a given page to use a bitmap */
     unsigned long *code_bitmap;
     unsigned int code_write_count;
+    /* writes that invalidated code, and whether that made the page
+       switch to self-checking translations */
+    unsigned int smc_write_count;
+    bool smc_selfcheck;
 #else
     unsigned long flags;
     void *target_data;
@@ -220,6 +235,14 @@ static int v_l2_levels;
 
 static void *l1_map[V_L1_MAX_SIZE];
 
+/*
+ * The bottom-level table that page_find_alloc found last, for each thread.
+ * Those tables are never freed, so consecutive lookups of nearby pages,
+ * such as page_check_range over a syscall buffer, skip the radix walk.
+ */
+static __thread tb_page_addr_t page_leaf_index = -1;
+static __thread PageDesc *page_leaf;
+
 /* code generation context */
 TCGContext tcg_init_ctx;
 __thread TCGContext *tcg_ctx;
@@ -338,6 +361,8 @@ static int encode_search(TranslationBlock *tb, uint8_t *block)
 /* The cpu state corresponding to 'searched_pc' is restored.
  * When reset_icount is true, current TB will be interrupted and
  * icount should be recalculated.
+ * Returns the index in @tb of the instruction at @searched_pc,
+ * or -1 if it is not found.
  */
 static int cpu_restore_state_from_tb(CPUState *cpu, TranslationBlock *tb,
                                      uintptr_t searched_pc, bool reset_icount)
@@ -385,12 +410,13 @@ static int cpu_restore_state_from_tb(CPUState *cpu, TranslationBlock *tb,
                 prof->restore_time + profile_getclock() - ti);
     qatomic_set(&prof->restore_count, prof->restore_count + 1);
 #endif
-    return 0;
+    return i;
 }
 
 void tb_destroy(TranslationBlock *tb)
 {
     qemu_spin_destroy(&tb->jmp_lock);
+    g_free(tb->smc_copy);
 }
 
 bool cpu_restore_state(CPUState *cpu, uintptr_t host_pc, bool will_exit)
@@ -492,6 +518,10 @@ static PageDesc *page_find_alloc(tb_page_addr_t index, int alloc)
     void **lp;
     int i;
 
+    if (likely((index >> V_L2_BITS) == page_leaf_index)) {
+        return page_leaf + (index & (V_L2_SIZE - 1));
+    }
+
     /* Level 1.  Always allocated.  */
     lp = l1_map + ((index >> v_l1_shift) & (v_l1_size - 1));
 
@@ -549,6 +579,8 @@ static PageDesc *page_find_alloc(tb_page_addr_t index, int alloc)
         }
     }
 
+    page_leaf_index = index >> V_L2_BITS;
+    page_leaf = pd;
     return pd + (index & (V_L2_SIZE - 1));
 }
 
@@ -660,7 +692,10 @@ static inline void page_unlock__debug(const PageDesc *pd)
 static inline void page_lock(PageDesc *pd)
 {
     page_lock__debug(pd);
-    qemu_spin_lock(&pd->lock);
+    if (unlikely(qemu_spin_trylock(&pd->lock))) {
+        qatomic_inc(&tb_ctx.page_lock_contended);
+        qemu_spin_lock(&pd->lock);
+    }
 }
 
 static inline void page_unlock(PageDesc *pd)
@@ -1079,7 +1114,8 @@ static bool alloc_code_gen_buffer_anon(size_t size, int prot,
 {
     void *buf;
 
-    buf = mmap(NULL, size, prot, flags, -1, 0);
+    /* A persistent TB cache is only usable at the address it was saved at */
+    buf = mmap(tb_cache_buffer_hint(), size, prot, flags, -1, 0);
     if (buf == MAP_FAILED) {
         error_setg_errno(errp, errno,
                          "allocate %zu bytes for jit buffer", size);
@@ -1334,15 +1370,21 @@ void tcg_exec_init(unsigned long tb_size, int splitwx)
     cpu_gen_init();
     page_init();
     tb_htable_init();
+    qemu_spin_init(&tb_ctx.ibc_lock);
 
     ok = alloc_code_gen_buffer(size_code_gen_buffer(tb_size),
                                splitwx, &error_fatal);
     assert(ok);
 
 #if defined(CONFIG_SOFTMMU)
-    /* There's no guest base to take into account, so go ahead and
-       initialize the prologue now.  */
-    tcg_prologue_init(tcg_ctx);
+    {
+        void *buf = tcg_ctx->code_gen_buffer;
+
+        /* There's no guest base to take into account, so go ahead and
+           initialize the prologue now.  */
+        tcg_prologue_init(tcg_ctx);
+        tb_cache_load(buf);
+    }
 #endif
 }
 
@@ -1372,6 +1414,10 @@ static void page_flush_tb_1(int level, void **lp)
             page_lock(&pd[i]);
             pd[i].first_tb = (uintptr_t)NULL;
             invalidate_page_bitmap(pd + i);
+#ifdef CONFIG_SOFTMMU
+            pd[i].smc_write_count = 0;
+            qatomic_set(&pd[i].smc_selfcheck, false);
+#endif
             page_unlock(&pd[i]);
         }
     } else {
@@ -1431,6 +1477,7 @@ static void do_tb_flush(CPUState *cpu, run_on_cpu_data tb_flush_count)
     qht_reset_size(&tb_ctx.htable, CODE_GEN_HTABLE_SIZE);
     page_flush_tb();
 
+    tb_cache_flush();
     tcg_region_reset_all();
     /* XXX: flush processor icache at this point if cache flush is
        expensive */
@@ -1457,6 +1504,44 @@ void tb_flush(CPUState *cpu)
     }
 }
 
+/*
+ * Make room in the code buffer by evicting its oldest region.  Falls back
+ * to a full flush if there is no region that can be evicted, which is
+ * always the case in user-mode where there is a single region.
+ */
+static void do_tb_evict(CPUState *cpu, run_on_cpu_data tb_flush_count)
+{
+    int ret;
+
+    mmap_lock();
+    /* A full flush in the meantime made room already */
+    if (tb_ctx.tb_flush_count != tb_flush_count.host_int) {
+        mmap_unlock();
+        return;
+    }
+    ret = tcg_region_evict();
+    if (ret > 0) {
+        qatomic_set(&tb_ctx.tb_evict_count, tb_ctx.tb_evict_count + 1);
+    }
+    mmap_unlock();
+
+    if (ret < 0) {
+        do_tb_flush(cpu, tb_flush_count);
+    }
+}
+
+static void tb_evict(CPUState *cpu)
+{
+    unsigned tb_flush_count = qatomic_mb_read(&tb_ctx.tb_flush_count);
+
+    if (cpu_in_exclusive_context(cpu)) {
+        do_tb_evict(cpu, RUN_ON_CPU_HOST_INT(tb_flush_count));
+    } else {
+        async_safe_run_on_cpu(cpu, do_tb_evict,
+                              RUN_ON_CPU_HOST_INT(tb_flush_count));
+    }
+}
+
 /*
  * Formerly ifdef DEBUG_TB_CHECK. These debug functions are user-mode-only,
  * so in order to prevent bit rot we compile them unconditionally in user-mode,
@@ -1766,7 +1851,12 @@ static inline void tb_page_add(PageDesc *p, TranslationBlock *tb,
     /* if some code is already present, then the pages are already
        protected. So we handle the case where only the first TB is
        allocated in a physical page */
-    if (!page_already_protected) {
+    if (p->smc_selfcheck) {
+        /* self-checking TBs leave the page writable, others may not */
+        if (!tb->smc_copy) {
+            tlb_protect_code(page_addr);
+        }
+    } else if (!page_already_protected) {
         tlb_protect_code(page_addr);
     }
 #endif
@@ -1795,6 +1885,27 @@ tb_link_page(TranslationBlock *tb, tb_page_addr_t phys_pc,
     assert_memory_lock();
     tcg_debug_assert(!(tb->cflags & CF_INVALID));
 
+    h = tb_hash_func(phys_pc, tb->pc, tb->flags, tb->cflags,
+                     tb->trace_vcpu_dstate);
+
+#ifndef CONFIG_USER_ONLY
+    /*
+     * vCPU threads translate concurrently into their own regions, so
+     * during a boot storm several of them often translate the same
+     * block.  Check for an already published copy without taking the
+     * page locks; if there is one, the caller discards ours.
+     */
+    tb->page_addr[0] = phys_pc & TARGET_PAGE_MASK;
+    tb->page_addr[1] = phys_page2;
+    existing_tb = qht_lookup(&tb_ctx.htable, tb, h);
+    if (existing_tb &&
+        !(tb_cflags((TranslationBlock *)existing_tb) & CF_INVALID)) {
+        qatomic_inc(&tb_ctx.tb_lost_races);
+        return existing_tb;
+    }
+    existing_tb = NULL;
+#endif
+
     /*
      * Add the TB to the page list, acquiring first the pages's locks.
      * We keep the locks held until after inserting the TB in the hash table,
@@ -1812,12 +1923,11 @@ tb_link_page(TranslationBlock *tb, tb_page_addr_t phys_pc,
     }
 
     /* add in the hash table */
-    h = tb_hash_func(phys_pc, tb->pc, tb->flags, tb->cflags,
-                     tb->trace_vcpu_dstate);
     qht_insert(&tb_ctx.htable, tb, h, &existing_tb);
 
     /* remove TB from the page(s) if we couldn't insert it */
     if (unlikely(existing_tb)) {
+        qatomic_inc(&tb_ctx.tb_lost_races);
         tb_page_remove(p, tb);
         invalidate_page_bitmap(p);
         if (p2) {
@@ -1840,6 +1950,134 @@ tb_link_page(TranslationBlock *tb, tb_page_addr_t phys_pc,
     return tb;
 }
 
+/*
+ * Reuse the host code of a block from the persistent TB cache.  The TB
+ * and its code are already in place so only the runtime state, which
+ * was not meaningful when the cache was saved, is set up again.
+ */
+static TranslationBlock *
+tb_cache_adopt(CPUState *cpu, tb_page_addr_t phys_pc, target_ulong pc,
+               target_ulong cs_base, uint32_t flags, int cflags)
+{
+    TranslationBlock *tb, *existing_tb;
+    tb_page_addr_t phys_page2;
+
+    tb = tb_cache_lookup(cpu, phys_pc, pc, cs_base, flags, cflags,
+                         &phys_page2);
+    if (!tb) {
+        return NULL;
+    }
+
+    tb->cflags = cflags;
+    tb->trace_vcpu_dstate = *cpu->trace_dstate;
+    tb->exec_count = 0;
+    tb->ibc_pc = -1;
+    tb->smc_copy = NULL;
+    qemu_spin_init(&tb->jmp_lock);
+    tb->jmp_list_head = (uintptr_t)NULL;
+    tb->jmp_list_next[0] = (uintptr_t)NULL;
+    tb->jmp_list_next[1] = (uintptr_t)NULL;
+    tb->jmp_dest[0] = (uintptr_t)NULL;
+    tb->jmp_dest[1] = (uintptr_t)NULL;
+
+    /* Undo the chaining that was in place when the cache was saved */
+    if (tb->jmp_reset_offset[0] != TB_JMP_RESET_OFFSET_INVALID) {
+        tb_reset_jump(tb, 0);
+    }
+    if (tb->jmp_reset_offset[1] != TB_JMP_RESET_OFFSET_INVALID) {
+        tb_reset_jump(tb, 1);
+    }
+
+    existing_tb = tb_link_page(tb, phys_pc, phys_page2);
+    if (unlikely(existing_tb != tb)) {
+        return existing_tb;
+    }
+    tcg_tb_insert(tb);
+    return tb;
+}
+
+#ifdef CONFIG_SOFTMMU
+static bool tb_page_is_selfcheck(tb_page_addr_t phys_pc)
+{
+    PageDesc *p = page_find(phys_pc >> TARGET_PAGE_BITS);
+
+    return p && qatomic_read(&p->smc_selfcheck);
+}
+
+/* Calls @fn on the one or two host ranges holding the guest code of @tb */
+static bool tb_smc_foreach(const TranslationBlock *tb, tb_page_addr_t phys_pc,
+                           tb_page_addr_t phys_page2,
+                           bool (*fn)(void *host, void *copy, size_t len))
+{
+    size_t len1 = TARGET_PAGE_SIZE - (phys_pc & ~TARGET_PAGE_MASK);
+    uint8_t *copy = tb->smc_copy;
+
+    len1 = MIN(len1, tb->size);
+    if (!fn(qemu_map_ram_ptr(NULL, phys_pc), copy, len1)) {
+        return false;
+    }
+    if (len1 < tb->size) {
+        return fn(qemu_map_ram_ptr(NULL, phys_page2), copy + len1,
+                  tb->size - len1);
+    }
+    return true;
+}
+
+static bool tb_smc_copy_range(void *host, void *copy, size_t len)
+{
+    memcpy(copy, host, len);
+    return true;
+}
+
+static bool tb_smc_cmp_range(void *host, void *copy, size_t len)
+{
+    return memcmp(host, copy, len) == 0;
+}
+
+/*
+ * Remember the guest code of @tb, which was translated with CF_SMC_CHECK.
+ * As with write-protected pages, a store from another vCPU racing with
+ * the translation is only noticed if the guest synchronizes with us.
+ */
+static void tb_smc_snapshot(TranslationBlock *tb, tb_page_addr_t phys_pc,
+                            tb_page_addr_t phys_page2)
+{
+    tb->smc_copy = g_malloc(tb->size);
+    tb_smc_foreach(tb, phys_pc, phys_page2, tb_smc_copy_range);
+}
+
+/* Return true if the guest code of a CF_SMC_CHECK @tb was not modified */
+bool tb_smc_unchanged(const TranslationBlock *tb)
+{
+    tb_page_addr_t phys_pc = tb->page_addr[0] + (tb->pc & ~TARGET_PAGE_MASK);
+
+    return tb_smc_foreach(tb, phys_pc, tb->page_addr[1], tb_smc_cmp_range);
+}
+#else
+static inline bool tb_page_is_selfcheck(tb_page_addr_t phys_pc)
+{
+    return false;
+}
+
+static inline void tb_smc_snapshot(TranslationBlock *tb,
+                                   tb_page_addr_t phys_pc,
+                                   tb_page_addr_t phys_page2)
+{
+}
+
+bool tb_smc_unchanged(const TranslationBlock *tb)
+{
+    return true;
+}
+#endif
+
+/* Translations are rare enough that they can always be accounted */
+static void tb_gen_account(int64_t start)
+{
+    qatomic_inc(&tb_ctx.tb_gen_count);
+    stat64_add(&tb_ctx.tb_gen_time, get_clock() - start);
+}
+
 /* Called with mmap_lock held for user mode emulation.  */
 TranslationBlock *tb_gen_code(CPUState *cpu,
                               target_ulong pc, target_ulong cs_base,
@@ -1851,6 +2089,7 @@ TranslationBlock *tb_gen_code(CPUState *cpu,
     target_ulong virt_page2;
     tcg_insn_unit *gen_code_buf;
     int gen_code_size, search_size, max_insns;
+    int64_t gen_start;
 #ifdef CONFIG_PROFILER
     TCGProfile *prof = &tcg_ctx->prof;
     int64_t ti;
@@ -1877,11 +2116,25 @@ TranslationBlock *tb_gen_code(CPUState *cpu,
         max_insns = 1;
     }
 
+    /* A cached block may run past an I/O access that it now must end at */
+    if (phys_pc != -1 &&
+        !((cflags & CF_USE_ICOUNT) && tb_io_hint_lookup(pc))) {
+        tb = tb_cache_adopt(cpu, phys_pc, pc, cs_base, flags, cflags);
+        if (tb) {
+            return tb;
+        }
+        if (tb_page_is_selfcheck(phys_pc)) {
+            cflags |= CF_SMC_CHECK;
+        }
+    }
+
+    gen_start = get_clock();
+
  buffer_overflow:
     tb = tcg_tb_alloc(tcg_ctx);
     if (unlikely(!tb)) {
-        /* flush must be done */
-        tb_flush(cpu);
+        /* eviction (or, failing that, a flush) must be done */
+        tb_evict(cpu);
         mmap_unlock();
         /* Make the execution loop process the flush as soon as possible.  */
         cpu->exception_index = EXCP_INTERRUPT;
@@ -1893,8 +2146,10 @@ TranslationBlock *tb_gen_code(CPUState *cpu,
     tb->pc = pc;
     tb->cs_base = cs_base;
     tb->flags = flags;
-    tb->cflags = cflags;
+    tb->cflags = cflags & ~(CF_TRACE | CF_SMC_CHECK);
     tb->trace_vcpu_dstate = *cpu->trace_dstate;
+    tb->ibc_pc = -1;
+    tb->smc_copy = NULL;
     tcg_ctx->tb_cflags = cflags;
  tb_overflow:
 
@@ -1983,6 +2238,7 @@ TranslationBlock *tb_gen_code(CPUState *cpu,
         goto buffer_overflow;
     }
     tb->tc.size = gen_code_size;
+    perf_report_code(pc, tb->tc.ptr, gen_code_size);
 
 #ifdef CONFIG_PROFILER
     qatomic_set(&prof->code_time, prof->code_time + profile_getclock() - ti);
@@ -2073,6 +2329,8 @@ TranslationBlock *tb_gen_code(CPUState *cpu,
         tb_reset_jump(tb, 1);
     }
 
+    tb_gen_account(gen_start);
+
     /*
      * If the TB is not associated with a physical RAM page then
      * it must be a temporary one-insn TB, and we have nothing to do
@@ -2090,6 +2348,9 @@ TranslationBlock *tb_gen_code(CPUState *cpu,
     if ((pc & TARGET_PAGE_MASK) != virt_page2) {
         phys_page2 = get_page_addr_code(env, virt_page2);
     }
+    if (cflags & CF_SMC_CHECK) {
+        tb_smc_snapshot(tb, phys_pc, phys_page2);
+    }
     /*
      * No explicit memory barrier is required -- tb_link_page() makes the
      * TB visible in a consistent state.
@@ -2291,6 +2552,18 @@ void tb_invalidate_phys_page_fast(struct page_collection *pages,
         nr = start & ~TARGET_PAGE_MASK;
         b = p->code_bitmap[BIT_WORD(nr)] >> (nr & (BITS_PER_LONG - 1));
         if (b & ((1 << len) - 1)) {
+            if (!p->smc_selfcheck &&
+                ++p->smc_write_count >= SMC_SELFCHECK_THRESHOLD) {
+                /*
+                 * The guest keeps rewriting code here, e.g. a JIT:
+                 * drop every TB of the page so that it becomes
+                 * writable, and translate it with self-checks from
+                 * now on.
+                 */
+                qatomic_set(&p->smc_selfcheck, true);
+                start &= TARGET_PAGE_MASK;
+                len = TARGET_PAGE_SIZE;
+            }
             goto do_invalidate;
         }
     } else {
@@ -2397,7 +2670,53 @@ void tb_check_watchpoint(CPUState *cpu, uintptr_t retaddr)
     }
 }
 
+/*
+ * With icount, an instruction doing device I/O must be the last of its
+ * TB, and cpu_io_recompile() rewinds any TB where that is not the case
+ * to run the access again in a TB of its own.  The number of
+ * instructions up to and including the access is remembered here by the
+ * start PC of the block, so that the next translation of the block ends
+ * at the access and doesn't pay for the rewind each time it runs.
+ *
+ * The table is only used with icount, where all vCPUs run in one thread.
+ * Entries may be overwritten by other blocks or outlive the code they
+ * describe; at worst a block is cut short.
+ */
+#define TB_IO_HINT_BITS 10
+
+typedef struct TBIOHint {
+    target_ulong pc;
+    int insns;
+} TBIOHint;
+
+static TBIOHint tb_io_hints[1 << TB_IO_HINT_BITS];
+
+static TBIOHint *tb_io_hint_entry(target_ulong pc)
+{
+    return &tb_io_hints[(pc ^ (pc >> TB_IO_HINT_BITS)) &
+                        ((1 << TB_IO_HINT_BITS) - 1)];
+}
+
+/*
+ * Returns the number of instructions after which the block at @pc must
+ * end to do I/O, or 0.
+ */
+int tb_io_hint_lookup(target_ulong pc)
+{
+    TBIOHint *hint = tb_io_hint_entry(pc);
+
+    return hint->pc == pc ? hint->insns : 0;
+}
+
 #ifndef CONFIG_USER_ONLY
+static void tb_io_hint_set(target_ulong pc, int insns)
+{
+    TBIOHint *hint = tb_io_hint_entry(pc);
+
+    hint->pc = pc;
+    hint->insns = insns;
+}
+
 /*
  * In deterministic execution mode, instructions doing device I/Os
  * must be at the end of the TB.
@@ -2409,13 +2728,14 @@ void cpu_io_recompile(CPUState *cpu, uintptr_t retaddr)
     TranslationBlock *tb;
     CPUClass *cc;
     uint32_t n;
+    int i;
 
     tb = tcg_tb_lookup(retaddr);
     if (!tb) {
         cpu_abort(cpu, "cpu_io_recompile: could not find TB for pc=%p",
                   (void *)retaddr);
     }
-    cpu_restore_state_from_tb(cpu, tb, retaddr, true);
+    i = cpu_restore_state_from_tb(cpu, tb, retaddr, true);
 
     /*
      * Some guests must re-execute the branch when re-executing a delay
@@ -2438,6 +2758,18 @@ void cpu_io_recompile(CPUState *cpu, uintptr_t retaddr)
      */
     cpu->cflags_next_tb = curr_cflags(cpu) | CF_MEMI_ONLY | CF_LAST_IO | n;
 
+    /*
+     * Have the block retranslated to end with the access.  This is not
+     * done when the branch before a delay slot must be replayed, since the
+     * block can't end between the two, nor when the hint is already there
+     * but was not followed, as by targets without translator_loop().
+     */
+    if (n == 1 && i >= 0 && !(tb_cflags(tb) & CF_LAST_IO) &&
+        tb_io_hint_lookup(tb->pc) != i + 1) {
+        tb_io_hint_set(tb->pc, i + 1);
+        tb_phys_invalidate(tb, -1);
+    }
+
     qemu_log_mask_and_addr(CPU_LOG_EXEC, tb->pc,
                            "cpu_io_recompile: rewound execution of TB to "
                            TARGET_FMT_lx "\n", tb->pc);
@@ -2445,130 +2777,6 @@ void cpu_io_recompile(CPUState *cpu, uintptr_t retaddr)
     cpu_loop_exit_noexc(cpu);
 }
 
-static void print_qht_statistics(struct qht_stats hst)
-{
-    uint32_t hgram_opts;
-    size_t hgram_bins;
-    char *hgram;
-
-    if (!hst.head_buckets) {
-        return;
-    }
-    qemu_printf("TB hash buckets     %zu/%zu (%0.2f%% head buckets used)\n",
-                hst.used_head_buckets, hst.head_buckets,
-                (double)hst.used_head_buckets / hst.head_buckets * 100);
-
-    hgram_opts =  QDIST_PR_BORDER | QDIST_PR_LABELS;
-    hgram_opts |= QDIST_PR_100X   | QDIST_PR_PERCENT;
-    if (qdist_xmax(&hst.occupancy) - qdist_xmin(&hst.occupancy) == 1) {
-        hgram_opts |= QDIST_PR_NODECIMAL;
-    }
-    hgram = qdist_pr(&hst.occupancy, 10, hgram_opts);
-    qemu_printf("TB hash occupancy   %0.2f%% avg chain occ. Histogram: %s\n",
-                qdist_avg(&hst.occupancy) * 100, hgram);
-    g_free(hgram);
-
-    hgram_opts = QDIST_PR_BORDER | QDIST_PR_LABELS;
-    hgram_bins = qdist_xmax(&hst.chain) - qdist_xmin(&hst.chain);
-    if (hgram_bins > 10) {
-        hgram_bins = 10;
-    } else {
-        hgram_bins = 0;
-        hgram_opts |= QDIST_PR_NODECIMAL | QDIST_PR_NOBINRANGE;
-    }
-    hgram = qdist_pr(&hst.chain, hgram_bins, hgram_opts);
-    qemu_printf("TB hash avg chain   %0.3f buckets. Histogram: %s\n",
-                qdist_avg(&hst.chain), hgram);
-    g_free(hgram);
-}
-
-struct tb_tree_stats {
-    size_t nb_tbs;
-    size_t host_size;
-    size_t target_size;
-    size_t max_target_size;
-    size_t direct_jmp_count;
-    size_t direct_jmp2_count;
-    size_t cross_page;
-};
-
-static gboolean tb_tree_stats_iter(gpointer key, gpointer value, gpointer data)
-{
-    const TranslationBlock *tb = value;
-    struct tb_tree_stats *tst = data;
-
-    tst->nb_tbs++;
-    tst->host_size += tb->tc.size;
-    tst->target_size += tb->size;
-    if (tb->size > tst->max_target_size) {
-        tst->max_target_size = tb->size;
-    }
-    if (tb->page_addr[1] != -1) {
-        tst->cross_page++;
-    }
-    if (tb->jmp_reset_offset[0] != TB_JMP_RESET_OFFSET_INVALID) {
-        tst->direct_jmp_count++;
-        if (tb->jmp_reset_offset[1] != TB_JMP_RESET_OFFSET_INVALID) {
-            tst->direct_jmp2_count++;
-        }
-    }
-    return false;
-}
-
-void dump_exec_info(void)
-{
-    struct tb_tree_stats tst = {};
-    struct qht_stats hst;
-    size_t nb_tbs, flush_full, flush_part, flush_elide;
-
-    tcg_tb_foreach(tb_tree_stats_iter, &tst);
-    nb_tbs = tst.nb_tbs;
-    /* XXX: avoid using doubles ? */
-    qemu_printf("Translation buffer state:\n");
-    /*
-     * Report total code size including the padding and TB structs;
-     * otherwise users might think "-accel tcg,tb-size" is not honoured.
-     * For avg host size we use the precise numbers from tb_tree_stats though.
-     */
-    qemu_printf("gen code size       %zu/%zu\n",
-                tcg_code_size(), tcg_code_capacity());
-    qemu_printf("TB count            %zu\n", nb_tbs);
-    qemu_printf("TB avg target size  %zu max=%zu bytes\n",
-                nb_tbs ? tst.target_size / nb_tbs : 0,
-                tst.max_target_size);
-    qemu_printf("TB avg host size    %zu bytes (expansion ratio: %0.1f)\n",
-                nb_tbs ? tst.host_size / nb_tbs : 0,
-                tst.target_size ? (double)tst.host_size / tst.target_size : 0);
-    qemu_printf("cross page TB count %zu (%zu%%)\n", tst.cross_page,
-                nb_tbs ? (tst.cross_page * 100) / nb_tbs : 0);
-    qemu_printf("direct jump count   %zu (%zu%%) (2 jumps=%zu %zu%%)\n",
-                tst.direct_jmp_count,
-                nb_tbs ? (tst.direct_jmp_count * 100) / nb_tbs : 0,
-                tst.direct_jmp2_count,
-                nb_tbs ? (tst.direct_jmp2_count * 100) / nb_tbs : 0);
-
-    qht_statistics_init(&tb_ctx.htable, &hst);
-    print_qht_statistics(hst);
-    qht_statistics_destroy(&hst);
-
-    qemu_printf("\nStatistics:\n");
-    qemu_printf("TB flush count      %u\n",
-                qatomic_read(&tb_ctx.tb_flush_count));
-    qemu_printf("TB invalidate count %zu\n",
-                tcg_tb_phys_invalidate_count());
-
-    tlb_flush_counts(&flush_full, &flush_part, &flush_elide);
-    qemu_printf("TLB full flushes    %zu\n", flush_full);
-    qemu_printf("TLB partial flushes %zu\n", flush_part);
-    qemu_printf("TLB elided flushes  %zu\n", flush_elide);
-    tcg_dump_info();
-}
-
-void dump_opcount_info(void)
-{
-    tcg_dump_op_count();
-}
-
 #else /* CONFIG_USER_ONLY */
 
 void cpu_interrupt(CPUState *cpu, int mask)
@@ -2890,6 +3098,151 @@ int page_unprotect(target_ulong address, uintptr_t pc)
 }
 #endif /* CONFIG_USER_ONLY */
 
+static void print_qht_statistics(struct qht_stats hst)
+{
+    uint32_t hgram_opts;
+    size_t hgram_bins;
+    char *hgram;
+
+    if (!hst.head_buckets) {
+        return;
+    }
+    qemu_printf("TB hash buckets     %zu/%zu (%0.2f%% head buckets used)\n",
+                hst.used_head_buckets, hst.head_buckets,
+                (double)hst.used_head_buckets / hst.head_buckets * 100);
+
+    hgram_opts =  QDIST_PR_BORDER | QDIST_PR_LABELS;
+    hgram_opts |= QDIST_PR_100X   | QDIST_PR_PERCENT;
+    if (qdist_xmax(&hst.occupancy) - qdist_xmin(&hst.occupancy) == 1) {
+        hgram_opts |= QDIST_PR_NODECIMAL;
+    }
+    hgram = qdist_pr(&hst.occupancy, 10, hgram_opts);
+    qemu_printf("TB hash occupancy   %0.2f%% avg chain occ. Histogram: %s\n",
+                qdist_avg(&hst.occupancy) * 100, hgram);
+    g_free(hgram);
+
+    hgram_opts = QDIST_PR_BORDER | QDIST_PR_LABELS;
+    hgram_bins = qdist_xmax(&hst.chain) - qdist_xmin(&hst.chain);
+    if (hgram_bins > 10) {
+        hgram_bins = 10;
+    } else {
+        hgram_bins = 0;
+        hgram_opts |= QDIST_PR_NODECIMAL | QDIST_PR_NOBINRANGE;
+    }
+    hgram = qdist_pr(&hst.chain, hgram_bins, hgram_opts);
+    qemu_printf("TB hash avg chain   %0.3f buckets. Histogram: %s\n",
+                qdist_avg(&hst.chain), hgram);
+    g_free(hgram);
+}
+
+struct tb_tree_stats {
+    size_t nb_tbs;
+    size_t host_size;
+    size_t target_size;
+    size_t max_target_size;
+    size_t direct_jmp_count;
+    size_t direct_jmp2_count;
+    size_t cross_page;
+};
+
+static gboolean tb_tree_stats_iter(gpointer key, gpointer value, gpointer data)
+{
+    const TranslationBlock *tb = value;
+    struct tb_tree_stats *tst = data;
+
+    tst->nb_tbs++;
+    tst->host_size += tb->tc.size;
+    tst->target_size += tb->size;
+    if (tb->size > tst->max_target_size) {
+        tst->max_target_size = tb->size;
+    }
+    if (tb->page_addr[1] != -1) {
+        tst->cross_page++;
+    }
+    if (tb->jmp_reset_offset[0] != TB_JMP_RESET_OFFSET_INVALID) {
+        tst->direct_jmp_count++;
+        if (tb->jmp_reset_offset[1] != TB_JMP_RESET_OFFSET_INVALID) {
+            tst->direct_jmp2_count++;
+        }
+    }
+    return false;
+}
+
+void dump_exec_info(void)
+{
+    struct tb_tree_stats tst = {};
+    struct qht_stats hst;
+    size_t nb_tbs, gen_count;
+#ifndef CONFIG_USER_ONLY
+    size_t flush_full, flush_part, flush_elide;
+    size_t vtlb_hit, vtlb_miss, ltlb_hit;
+#endif
+
+    tcg_tb_foreach(tb_tree_stats_iter, &tst);
+    nb_tbs = tst.nb_tbs;
+    /* XXX: avoid using doubles ? */
+    qemu_printf("Translation buffer state:\n");
+    /*
+     * Report total code size including the padding and TB structs;
+     * otherwise users might think "-accel tcg,tb-size" is not honoured.
+     * For avg host size we use the precise numbers from tb_tree_stats though.
+     */
+    qemu_printf("gen code size       %zu/%zu\n",
+                tcg_code_size(), tcg_code_capacity());
+    qemu_printf("TB count            %zu\n", nb_tbs);
+    qemu_printf("TB avg target size  %zu max=%zu bytes\n",
+                nb_tbs ? tst.target_size / nb_tbs : 0,
+                tst.max_target_size);
+    qemu_printf("TB avg host size    %zu bytes (expansion ratio: %0.1f)\n",
+                nb_tbs ? tst.host_size / nb_tbs : 0,
+                tst.target_size ? (double)tst.host_size / tst.target_size : 0);
+    qemu_printf("cross page TB count %zu (%zu%%)\n", tst.cross_page,
+                nb_tbs ? (tst.cross_page * 100) / nb_tbs : 0);
+    qemu_printf("direct jump count   %zu (%zu%%) (2 jumps=%zu %zu%%)\n",
+                tst.direct_jmp_count,
+                nb_tbs ? (tst.direct_jmp_count * 100) / nb_tbs : 0,
+                tst.direct_jmp2_count,
+                nb_tbs ? (tst.direct_jmp2_count * 100) / nb_tbs : 0);
+
+    qht_statistics_init(&tb_ctx.htable, &hst);
+    print_qht_statistics(hst);
+    qht_statistics_destroy(&hst);
+
+    qemu_printf("\nStatistics:\n");
+    qemu_printf("TB flush count      %u\n",
+                qatomic_read(&tb_ctx.tb_flush_count));
+    qemu_printf("TB region evictions %u\n",
+                qatomic_read(&tb_ctx.tb_evict_count));
+    qemu_printf("TB invalidate count %zu\n",
+                tcg_tb_phys_invalidate_count());
+    qemu_printf("TB page lock waits  %zu\n",
+                qatomic_read(&tb_ctx.page_lock_contended));
+    qemu_printf("TB lost races       %zu\n",
+                qatomic_read(&tb_ctx.tb_lost_races));
+    gen_count = qatomic_read(&tb_ctx.tb_gen_count);
+    qemu_printf("TB translations     %zu (%0.3f s, avg %0.1f us)\n", gen_count,
+                stat64_get(&tb_ctx.tb_gen_time) / 1e9,
+                gen_count ? stat64_get(&tb_ctx.tb_gen_time) / 1e3 / gen_count
+                          : 0);
+
+#ifndef CONFIG_USER_ONLY
+    tlb_flush_counts(&flush_full, &flush_part, &flush_elide);
+    qemu_printf("TLB full flushes    %zu\n", flush_full);
+    qemu_printf("TLB partial flushes %zu\n", flush_part);
+    qemu_printf("TLB elided flushes  %zu\n", flush_elide);
+    tlb_victim_counts(&vtlb_hit, &vtlb_miss, &ltlb_hit);
+    qemu_printf("TLB victim hits     %zu\n", vtlb_hit);
+    qemu_printf("TLB victim misses   %zu\n", vtlb_miss);
+    qemu_printf("TLB large page hits %zu\n", ltlb_hit);
+#endif
+    tcg_dump_info();
+}
+
+void dump_opcount_info(void)
+{
+    tcg_dump_op_count();
+}
+
 /* This is a wrapper for common code that can not use CONFIG_SOFTMMU */
 void tcg_flush_softmmu_tlb(CPUState *cs)
 {
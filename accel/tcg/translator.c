@@ -14,10 +14,13 @@
 #include "tcg/tcg-op.h"
 #include "exec/exec-all.h"
 #include "exec/gen-icount.h"
+#include "exec/helper-proto.h"
+#include "exec/helper-gen.h"
 #include "exec/log.h"
 #include "exec/translator.h"
 #include "exec/plugin-gen.h"
 #include "sysemu/replay.h"
+#include "internal.h"
 
 /* Pairs with tcg_clear_temp_count.
    To be called by #TranslatorOps.{translate_insn,tb_stop} if
@@ -32,11 +35,96 @@ void translator_loop_temp_check(DisasContextBase *db)
     }
 }
 
+unsigned int tb_hot_threshold;
+
+bool translator_follow_jump(DisasContextBase *db, target_ulong next,
+                            target_ulong dest)
+{
+    return (tcg_ctx->tb_cflags & CF_TRACE) &&
+        !db->singlestep_enabled &&
+        dest > next &&
+        (dest & TARGET_PAGE_MASK) == (db->pc_first & TARGET_PAGE_MASK) &&
+        db->num_insns < db->max_insns;
+}
+
+void translator_indirect_jump(DisasContextBase *db, TCGv dest)
+{
+    TCGLabel *chain, *miss;
+    TCGv pc, cached;
+    TCGv_ptr ptr;
+
+    if (!TCG_TARGET_HAS_goto_ptr || qemu_loglevel_mask(CPU_LOG_TB_NOCHAIN)) {
+        tcg_gen_lookup_and_goto_ptr();
+        return;
+    }
+
+    chain = gen_new_label();
+    miss = gen_new_label();
+    pc = tcg_temp_local_new();
+    cached = tcg_temp_local_new();
+    tcg_gen_mov_tl(pc, dest);
+
+    ptr = tcg_const_ptr(db->tb);
+    tcg_gen_ld_tl(cached, ptr, offsetof(TranslationBlock, ibc_pc));
+    tcg_temp_free_ptr(ptr);
+    tcg_gen_brcond_tl(TCG_COND_EQ, cached, pc, chain);
+
+    /*
+     * Another target owns the cache.  Otherwise the cache is empty, and
+     * the main loop records @pc when it chains jump 0 (see tb_add_jump()).
+     */
+    tcg_gen_brcondi_tl(TCG_COND_NE, cached, -1, miss);
+#ifndef CONFIG_USER_ONLY
+    /* As with goto_tb, only chain to TBs on the same page */
+    tcg_gen_xori_tl(cached, pc, db->pc_first);
+    tcg_gen_andi_tl(cached, cached, TARGET_PAGE_MASK);
+    tcg_gen_brcondi_tl(TCG_COND_NE, cached, 0, miss);
+#endif
+
+    gen_set_label(chain);
+    tcg_gen_goto_tb(0);
+    tcg_gen_exit_tb(db->tb, 0);
+
+    gen_set_label(miss);
+    tcg_gen_lookup_and_goto_ptr();
+
+    tcg_temp_free(cached);
+    tcg_temp_free(pc);
+}
+
+static bool translator_count_tb(void)
+{
+    return tb_hot_threshold &&
+        !(tcg_ctx->tb_cflags & (CF_TRACE | CF_COUNT_MASK | CF_LAST_IO |
+                                CF_MEMI_ONLY | CF_USE_ICOUNT));
+}
+
+/* Count the executions of @tb and hand it to helper_tb_hot() when hot */
+static void gen_tb_hot_check(TranslationBlock *tb)
+{
+    TCGLabel *cold = gen_new_label();
+    TCGv_ptr ptr = tcg_const_ptr(tb);
+    TCGv_i32 count = tcg_temp_new_i32();
+
+    tcg_gen_ld_i32(count, ptr, offsetof(TranslationBlock, exec_count));
+    tcg_gen_addi_i32(count, count, 1);
+    tcg_gen_st_i32(count, ptr, offsetof(TranslationBlock, exec_count));
+    tcg_gen_brcondi_i32(TCG_COND_LTU, count, tb_hot_threshold, cold);
+    tcg_temp_free_i32(count);
+    tcg_temp_free_ptr(ptr);
+
+    ptr = tcg_const_ptr(tb);
+    gen_helper_tb_hot(cpu_env, ptr);
+    tcg_temp_free_ptr(ptr);
+    gen_set_label(cold);
+}
+
 void translator_loop(const TranslatorOps *ops, DisasContextBase *db,
                      CPUState *cpu, TranslationBlock *tb, int max_insns)
 {
     int bp_insn = 0;
     bool plugin_enabled;
+    bool io_last = tb_cflags(tb) & CF_LAST_IO;
 
     /* Initialize DisasContext */
     db->tb = tb;
@@ -47,6 +135,16 @@ void translator_loop(const TranslatorOps *ops, DisasContextBase *db,
     db->max_insns = max_insns;
     db->singlestep_enabled = cpu->singlestep_enabled;
 
+    /* End the block at an instruction known to do I/O, see cpu_io_recompile */
+    if (!io_last && (tb_cflags(tb) & CF_USE_ICOUNT)) {
+        int io_insns = tb_io_hint_lookup(tb->pc);
+
+        if (io_insns && io_insns <= db->max_insns) {
+            db->max_insns = io_insns;
+            io_last = true;
+        }
+    }
+
     ops->init_disas_context(db, cpu);
     tcg_debug_assert(db->is_jmp == DISAS_NEXT);  /* no early exit */
 
@@ -58,6 +156,18 @@ void translator_loop(const TranslatorOps *ops, DisasContextBase *db,
     ops->tb_start(db, cpu);
     tcg_debug_assert(db->is_jmp == DISAS_NEXT);  /* no early exit */
 
+    if (tcg_ctx->tb_cflags & CF_SMC_CHECK) {
+        TCGv_ptr ptr = tcg_const_ptr(tb);
+
+        gen_helper_tb_smc_check(cpu_env, ptr);
+        tcg_temp_free_ptr(ptr);
+    }
+
+    tb->exec_count = 0;
+    if (translator_count_tb()) {
+        gen_tb_hot_check(tb);
+    }
+
     plugin_enabled = plugin_gen_tb_start(cpu, tb,
                                          tb_cflags(db->tb) & CF_MEMI_ONLY);
 
@@ -95,8 +205,7 @@ void translator_loop(const TranslatorOps *ops, DisasContextBase *db,
            update db->pc_next and db->is_jmp to indicate what should be
            done next -- either exiting this loop or locate the start of
            the next instruction.  */
-        if (db->num_insns == db->max_insns
-            && (tb_cflags(db->tb) & CF_LAST_IO)) {
+        if (db->num_insns == db->max_insns && io_last) {
             /* Accept I/O on the last instruction.  */
             gen_io_start();
             ops->translate_insn(db, cpu);
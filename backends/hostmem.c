@@ -169,11 +169,7 @@ static void host_memory_backend_set_merge(Object *obj, bool value, Error **errp)
     }
 
     if (value != backend->merge) {
-        void *ptr = memory_region_get_ram_ptr(&backend->mr);
-        uint64_t sz = memory_region_size(&backend->mr);
-
-        qemu_madvise(ptr, sz,
-                     value ? QEMU_MADV_MERGEABLE : QEMU_MADV_UNMERGEABLE);
+        qemu_ram_set_mergeable(backend->mr.ram_block, value);
         backend->merge = value;
     }
 }
@@ -204,6 +200,26 @@ static void host_memory_backend_set_dump(Object *obj, bool value, Error **errp)
     }
 }
 
+/*
+ * Touch all pages of the backend, from threads running on the host nodes
+ * its policy allocates from, if any.
+ */
+static void host_memory_backend_prealloc(HostMemoryBackend *backend,
+                                         void *ptr, uint64_t sz,
+                                         Error **errp)
+{
+    unsigned long maxnode = 0;
+
+    if (backend->policy != HOST_MEM_POLICY_DEFAULT) {
+        maxnode = find_last_bit(backend->host_nodes, MAX_NODES) + 1;
+        /* find_last_bit() returns MAX_NODES for an empty bitmap */
+        maxnode %= MAX_NODES + 1;
+    }
+    os_mem_prealloc_nodes(memory_region_get_fd(&backend->mr), ptr, sz,
+                          backend->prealloc_threads, backend->host_nodes,
+                          maxnode, errp);
+}
+
 static bool host_memory_backend_get_prealloc(Object *obj, Error **errp)
 {
     HostMemoryBackend *backend = MEMORY_BACKEND(obj);
@@ -223,11 +239,10 @@ static void host_memory_backend_set_prealloc(Object *obj, bool value,
     }
 
     if (value && !backend->prealloc) {
-        int fd = memory_region_get_fd(&backend->mr);
         void *ptr = memory_region_get_ram_ptr(&backend->mr);
         uint64_t sz = memory_region_size(&backend->mr);
 
-        os_mem_prealloc(fd, ptr, sz, backend->prealloc_threads, &local_err);
+        host_memory_backend_prealloc(backend, ptr, sz, &local_err);
         if (local_err) {
             error_propagate(errp, local_err);
             return;
@@ -336,7 +351,7 @@ host_memory_backend_memory_complete(UserCreatable *uc, Error **errp)
         sz = memory_region_size(&backend->mr);
 
         if (backend->merge) {
-            qemu_madvise(ptr, sz, QEMU_MADV_MERGEABLE);
+            qemu_ram_set_mergeable(backend->mr.ram_block, true);
         }
         if (!backend->dump) {
             qemu_madvise(ptr, sz, QEMU_MADV_DONTDUMP);
@@ -387,8 +402,7 @@ host_memory_backend_memory_complete(UserCreatable *uc, Error **errp)
          * specified NUMA policy in place.
          */
         if (backend->prealloc) {
-            os_mem_prealloc(memory_region_get_fd(&backend->mr), ptr, sz,
-                            backend->prealloc_threads, &local_err);
+            host_memory_backend_prealloc(backend, ptr, sz, &local_err);
             if (local_err) {
                 goto out;
             }
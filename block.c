@@ -384,6 +384,8 @@ BlockDriverState *bdrv_new(void)
     notifier_with_return_list_init(&bs->before_write_notifiers);
     qemu_co_mutex_init(&bs->reqs_lock);
     qemu_mutex_init(&bs->dirty_bitmap_mutex);
+    qemu_mutex_init(&bs->chain_status_lock);
+    QTAILQ_INIT(&bs->chain_status_lru);
     bs->refcnt = 1;
     bs->aio_context = qemu_get_aio_context();
 
@@ -2563,6 +2565,11 @@ static void bdrv_replace_child_noperm(BdrvChild *child,
 
     child->bs = new_bs;
 
+    /* What the backing chain of the parent allocates may have changed */
+    if (child->klass->parent_is_bds) {
+        bdrv_chain_status_invalidate(child->opaque, 0, INT64_MAX);
+    }
+
     if (new_bs) {
         QLIST_INSERT_HEAD(&new_bs->parents, child, next_parent);
 
@@ -4424,6 +4431,7 @@ static void bdrv_close(BlockDriverState *bs)
         bdrv_unref_child(bs, child);
     }
 
+    bdrv_chain_status_invalidate(bs, 0, INT64_MAX);
     bs->backing = NULL;
     bs->file = NULL;
     g_free(bs->opaque);
@@ -4692,6 +4700,7 @@ static void bdrv_delete(BlockDriverState *bs)
 
     bdrv_close(bs);
 
+    qemu_mutex_destroy(&bs->chain_status_lock);
     g_free(bs);
 }
 
@@ -5148,6 +5157,25 @@ bool bdrv_is_sg(BlockDriverState *bs)
     return bs->sg;
 }
 
+/**
+ * Return whether requests to @bs may be submitted from any AioContext,
+ * which requires every node below it to support that too.
+ */
+bool bdrv_supports_multiqueue(BlockDriverState *bs)
+{
+    BdrvChild *child;
+
+    if (!bs->drv || !bs->drv->supports_multiqueue) {
+        return false;
+    }
+    QLIST_FOREACH(child, &bs->children, next) {
+        if (!bdrv_supports_multiqueue(child->bs)) {
+            return false;
+        }
+    }
+    return true;
+}
+
 /**
  * Return whether the given node supports compressed writes.
  */
@@ -5601,6 +5629,20 @@ BlockStatsSpecific *bdrv_get_specific_stats(BlockDriverState *bs)
     return drv->bdrv_get_specific_stats(bs);
 }
 
+/*
+ * Return a host file descriptor holding the data of @bs, shifted by
+ * *@fd_offset bytes, for zero-copy transfers that bypass the block layer;
+ * or -ENOTSUP if there is no such file.
+ */
+int bdrv_get_host_fd(BlockDriverState *bs, int64_t *fd_offset)
+{
+    BlockDriver *drv = bs->drv;
+    if (!drv || !drv->bdrv_get_host_fd) {
+        return -ENOTSUP;
+    }
+    return drv->bdrv_get_host_fd(bs, fd_offset);
+}
+
 void bdrv_debug_event(BlockDriverState *bs, BlkdebugEvent event)
 {
     if (!bs || !bs->drv || !bs->drv->bdrv_debug_event) {
@@ -5853,6 +5895,9 @@ int coroutine_fn bdrv_co_invalidate_cache(BlockDriverState *bs, Error **errp)
             error_setg_errno(errp, -ret, "Could not refresh total sector count");
             return ret;
         }
+
+        /* Another process may have written to the image meanwhile */
+        bdrv_chain_status_invalidate(bs, 0, INT64_MAX);
     }
 
     QLIST_FOREACH(parent, &bs->parents, next_parent) {
@@ -7121,6 +7166,7 @@ int bdrv_make_empty(BdrvChild *c, Error **errp)
     }
 
     ret = drv->bdrv_make_empty(c->bs);
+    bdrv_chain_status_invalidate(c->bs, 0, INT64_MAX);
     if (ret < 0) {
         error_setg_errno(errp, -ret, "Failed to empty %s",
                          c->bs->filename);
@@ -26,6 +26,7 @@
 #include "qemu/osdep.h"
 #include "block/accounting.h"
 #include "block/block_int.h"
+#include "qemu/host-utils.h"
 #include "qemu/timer.h"
 #include "sysemu/qtest.h"
 
@@ -182,6 +183,79 @@ void block_latency_histograms_clear(BlockAcctStats *stats)
     }
 }
 
+/* Index of the bin of the log-linear histogram that covers @latency_ns */
+static int block_latency_log_index(int64_t latency_ns)
+{
+    uint64_t v = MAX(latency_ns, 0);
+    int msb;
+
+    if (v < (1 << BLOCK_LATENCY_LOG_SUB_BITS)) {
+        return v;
+    }
+
+    msb = 63 - clz64(v);
+    if (msb >= BLOCK_LATENCY_LOG_MAX_BITS) {
+        return BLOCK_LATENCY_LOG_NBINS - 1;
+    }
+
+    /* The bits below the most significant one pick the bin in the octave */
+    return ((msb - BLOCK_LATENCY_LOG_SUB_BITS + 1) <<
+            BLOCK_LATENCY_LOG_SUB_BITS) +
+           (v >> (msb - BLOCK_LATENCY_LOG_SUB_BITS)) -
+           (1 << BLOCK_LATENCY_LOG_SUB_BITS);
+}
+
+/* Highest latency that falls in bin @index */
+static uint64_t block_latency_log_upper_bound(int index)
+{
+    int octave = index >> BLOCK_LATENCY_LOG_SUB_BITS;
+    uint64_t sub = index & ((1 << BLOCK_LATENCY_LOG_SUB_BITS) - 1);
+    int shift;
+
+    if (octave == 0) {
+        return sub;
+    }
+
+    shift = octave - 1;
+    return (((1ULL << BLOCK_LATENCY_LOG_SUB_BITS) + sub + 1) << shift) - 1;
+}
+
+/* block_acct_latency_percentile:
+ * Return the latency in nanoseconds below which @percentile percent of the
+ * requests of type @type completed, or 0 if there were none.  The number of
+ * requests in the histogram is stored in @count.
+ */
+uint64_t block_acct_latency_percentile(BlockAcctStats *stats,
+                                       enum BlockAcctType type,
+                                       double percentile,
+                                       uint64_t *count)
+{
+    BlockLatencyLogHistogram *hist = &stats->latency_log[type];
+    uint64_t rank, seen = 0;
+    int i;
+
+    assert(type < BLOCK_MAX_IOTYPE);
+
+    QEMU_LOCK_GUARD(&stats->lock);
+    *count = hist->count;
+    if (!hist->count) {
+        return 0;
+    }
+
+    rank = hist->count * percentile / 100;
+    if (rank < hist->count * percentile / 100 || !rank) {
+        rank++;
+    }
+    for (i = 0; i < BLOCK_LATENCY_LOG_NBINS; i++) {
+        seen += hist->bins[i];
+        if (seen >= rank) {
+            return block_latency_log_upper_bound(i);
+        }
+    }
+
+    g_assert_not_reached();
+}
+
 static void block_account_one_io(BlockAcctStats *stats, BlockAcctCookie *cookie,
                                  bool failed)
 {
@@ -213,6 +287,9 @@ static void block_account_one_io(BlockAcctStats *stats, BlockAcctCookie *cookie,
         if (!failed || stats->account_failed) {
             stats->total_time_ns[cookie->type] += latency_ns;
             stats->last_access_time_ns = time_ns;
+            stats->latency_log[cookie->type].count++;
+            stats->latency_log[cookie->type]
+                .bins[block_latency_log_index(latency_ns)]++;
 
             QSLIST_FOREACH(s, &stats->intervals, entries) {
                 timed_average_account(&s->latency[cookie->type], latency_ns);
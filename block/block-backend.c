@@ -78,12 +78,15 @@ struct BlockBackend {
 
     bool allow_aio_context_change;
     bool allow_write_beyond_eof;
+    bool multiqueue;
 
     NotifierList remove_bs_notifiers, insert_bs_notifiers;
     QLIST_HEAD(, BlockBackendAioNotifier) aio_notifiers;
 
+    /* Accessed with atomic ops, requests may run in several iothreads */
     int quiesce_counter;
     CoQueue queued_requests;
+    QemuMutex queued_requests_lock; /* protects queued_requests */
     bool disable_request_queuing;
 
     VMChangeStateEntry *vmsh;
@@ -95,6 +98,10 @@ struct BlockBackend {
      * Accessed with atomic ops.
      */
     unsigned int in_flight;
+
+    /* Counts requests to pick the ones that are traced, accessed with
+     * atomic ops. */
+    unsigned int trace_sample;
 };
 
 typedef struct BlockBackendAIOCB {
@@ -348,6 +355,7 @@ BlockBackend *blk_new(AioContext *ctx, uint64_t perm, uint64_t shared_perm)
     block_acct_init(&blk->stats);
 
     qemu_co_queue_init(&blk->queued_requests);
+    qemu_mutex_init(&blk->queued_requests_lock);
     notifier_list_init(&blk->remove_bs_notifiers);
     notifier_list_init(&blk->insert_bs_notifiers);
     QLIST_INIT(&blk->aio_notifiers);
@@ -456,6 +464,7 @@ static void blk_delete(BlockBackend *blk)
     QTAILQ_REMOVE(&block_backends, blk, link);
     drive_info_del(blk->legacy_dinfo);
     block_acct_cleanup(&blk->stats);
+    qemu_mutex_destroy(&blk->queued_requests_lock);
     g_free(blk);
 }
 
@@ -975,7 +984,7 @@ void blk_set_dev_ops(BlockBackend *blk, const BlockDevOps *ops,
     blk->dev_opaque = opaque;
 
     /* Are we currently quiesced? Should we enforce this right now? */
-    if (blk->quiesce_counter && ops->drained_begin) {
+    if (qatomic_read(&blk->quiesce_counter) && ops->drained_begin) {
         ops->drained_begin(opaque);
     }
 }
@@ -1057,6 +1066,21 @@ bool blk_dev_is_tray_open(BlockBackend *blk)
     return false;
 }
 
+/*
+ * Ask @blk's attached device model to process its requests in other
+ * iothreads.  See BlockDevOps.set_iothread_cb for the arguments.
+ */
+void blk_dev_set_iothread(BlockBackend *blk, const char *iothread,
+                          const char *iothread_vq_mapping, Error **errp)
+{
+    if (!blk->dev_ops || !blk->dev_ops->set_iothread_cb) {
+        error_setg(errp, "Device does not support changing its iothread");
+        return;
+    }
+    blk->dev_ops->set_iothread_cb(blk->dev_opaque, iothread,
+                                  iothread_vq_mapping, errp);
+}
+
 /*
  * Does @blk's attached device model have the medium locked?
  * %false if the device model has no such lock.
@@ -1138,6 +1162,33 @@ void blk_set_disable_request_queuing(BlockBackend *blk, bool disable)
     blk->disable_request_queuing = disable;
 }
 
+/*
+ * Let asynchronous requests run in the AioContext that submits them
+ * instead of in the one of @blk, so that several iothreads can submit
+ * to it at once.  Only allowed if every node supports that.
+ */
+bool blk_set_multiqueue(BlockBackend *blk, bool multiqueue, Error **errp)
+{
+    BlockDriverState *bs = blk_bs(blk);
+
+    if (multiqueue && (!bs || !bdrv_supports_multiqueue(bs))) {
+        error_setg(errp, "Block node '%s' does not support requests from "
+                   "several iothreads", bs ? bdrv_get_node_name(bs) : "");
+        return false;
+    }
+    blk->multiqueue = multiqueue;
+    return true;
+}
+
+/* Return the AioContext in which asynchronous requests to @blk run */
+static AioContext *blk_aio_request_context(BlockBackend *blk)
+{
+    if (blk->multiqueue) {
+        return qemu_get_current_aio_context();
+    }
+    return blk_get_aio_context(blk);
+}
+
 static int blk_check_byte_request(BlockBackend *blk, int64_t offset,
                                   size_t size)
 {
@@ -1174,10 +1225,46 @@ static void coroutine_fn blk_wait_while_drained(BlockBackend *blk)
 {
     assert(blk->in_flight > 0);
 
-    if (blk->quiesce_counter && !blk->disable_request_queuing) {
+    if (qatomic_read(&blk->quiesce_counter) &&
+        !blk->disable_request_queuing) {
+        /*
+         * Take the lock before dropping in_flight, so that drained_end
+         * cannot miss this request once blk_root_drained_poll() has
+         * seen it gone.
+         */
+        qemu_mutex_lock(&blk->queued_requests_lock);
         blk_dec_in_flight(blk);
-        qemu_co_queue_wait(&blk->queued_requests, NULL);
+        qemu_co_queue_wait(&blk->queued_requests, &blk->queued_requests_lock);
         blk_inc_in_flight(blk);
+        qemu_mutex_unlock(&blk->queued_requests_lock);
+    }
+}
+
+/* Start tracing one request in BDRV_TRACE_SAMPLE_INTERVAL */
+static bool coroutine_fn blk_trace_start(BlockBackend *blk,
+                                         BdrvTraceFrame *frame)
+{
+    /* Requests made as part of a traced request are already traced */
+    if (qemu_coroutine_get_trace() ||
+        qatomic_fetch_inc(&blk->trace_sample) % BDRV_TRACE_SAMPLE_INTERVAL) {
+        return false;
+    }
+
+    bdrv_trace_start(frame);
+    return true;
+}
+
+static void coroutine_fn blk_co_throttle(BlockBackend *blk,
+                                         BlockDriverState *bs,
+                                         int64_t bytes, bool is_write,
+                                         bool traced)
+{
+    int64_t start_ns = traced ? get_clock() : 0;
+
+    throttle_group_co_io_limits_intercept(&blk->public.throttle_group_member,
+                                          bytes, is_write);
+    if (traced) {
+        stat64_add(&bs->trace_stats.throttle_wait_ns, get_clock() - start_ns);
     }
 }
 
@@ -1188,6 +1275,8 @@ blk_do_preadv(BlockBackend *blk, int64_t offset, unsigned int bytes,
 {
     int ret;
     BlockDriverState *bs;
+    BdrvTraceFrame trace;
+    bool traced;
 
     blk_wait_while_drained(blk);
 
@@ -1201,14 +1290,17 @@ blk_do_preadv(BlockBackend *blk, int64_t offset, unsigned int bytes,
     }
 
     bdrv_inc_in_flight(bs);
+    traced = blk_trace_start(blk, &trace);
 
     /* throttling disk I/O */
     if (blk->public.throttle_group_member.throttle_state) {
-        throttle_group_co_io_limits_intercept(&blk->public.throttle_group_member,
-                bytes, false);
+        blk_co_throttle(blk, bs, bytes, false, traced);
     }
 
     ret = bdrv_co_preadv(blk->root, offset, bytes, qiov, flags);
+    if (traced) {
+        bdrv_trace_end(&trace);
+    }
     bdrv_dec_in_flight(bs);
     return ret;
 }
@@ -1234,6 +1326,8 @@ blk_do_pwritev_part(BlockBackend *blk, int64_t offset, unsigned int bytes,
 {
     int ret;
     BlockDriverState *bs;
+    BdrvTraceFrame trace;
+    bool traced;
 
     blk_wait_while_drained(blk);
 
@@ -1247,10 +1341,11 @@ blk_do_pwritev_part(BlockBackend *blk, int64_t offset, unsigned int bytes,
     }
 
     bdrv_inc_in_flight(bs);
+    traced = blk_trace_start(blk, &trace);
+
     /* throttling disk I/O */
     if (blk->public.throttle_group_member.throttle_state) {
-        throttle_group_co_io_limits_intercept(&blk->public.throttle_group_member,
-                bytes, true);
+        blk_co_throttle(blk, bs, bytes, true, traced);
     }
 
     if (!blk->enable_write_cache) {
@@ -1259,6 +1354,9 @@ blk_do_pwritev_part(BlockBackend *blk, int64_t offset, unsigned int bytes,
 
     ret = bdrv_co_pwritev_part(blk->root, offset, bytes, qiov, qiov_offset,
                                flags);
+    if (traced) {
+        bdrv_trace_end(&trace);
+    }
     bdrv_dec_in_flight(bs);
     return ret;
 }
@@ -1422,6 +1520,47 @@ static void blk_aio_complete_bh(void *opaque)
     blk_aio_complete(acb);
 }
 
+static void blk_aio_read_entry(void *opaque);
+static void blk_aio_write_entry(void *opaque);
+
+static void blk_aio_direct_cb(void *opaque, int ret)
+{
+    BlkAioEmAIOCB *acb = opaque;
+
+    acb->rwco.ret = ret;
+    blk_aio_complete(acb);
+}
+
+/*
+ * Plain reads and writes, with no throttling and nothing in the graph
+ * that needs the generic request path, go straight to the AIO engine of
+ * the leaf node instead of being run in a coroutine.
+ */
+static bool blk_aio_try_direct(BlkAioEmAIOCB *acb, CoroutineEntry co_entry)
+{
+    BlkRwCo *rwco = &acb->rwco;
+    BlockBackend *blk = rwco->blk;
+    QEMUIOVector *qiov = rwco->iobuf;
+    bool is_write = co_entry == blk_aio_write_entry;
+
+    if ((co_entry != blk_aio_read_entry && !is_write) || !qiov ||
+        rwco->flags || replay_mode != REPLAY_MODE_NONE) {
+        return false;
+    }
+    if (!blk->root || qatomic_read(&blk->quiesce_counter) ||
+        blk->public.throttle_group_member.throttle_state ||
+        (is_write && !blk->enable_write_cache)) {
+        return false;
+    }
+    if (blk_check_byte_request(blk, rwco->offset, acb->bytes) < 0) {
+        return false;
+    }
+
+    return bdrv_aio_prw_direct(blk->root, rwco->offset, qiov, is_write,
+                               blk_aio_request_context(blk),
+                               blk_aio_direct_cb, acb) == 0;
+}
+
 static BlockAIOCB *blk_aio_prwv(BlockBackend *blk, int64_t offset, int bytes,
                                 void *iobuf, CoroutineEntry co_entry,
                                 BdrvRequestFlags flags,
@@ -1442,12 +1581,14 @@ static BlockAIOCB *blk_aio_prwv(BlockBackend *blk, int64_t offset, int bytes,
     acb->bytes = bytes;
     acb->has_returned = false;
 
-    co = qemu_coroutine_create(co_entry, acb);
-    bdrv_coroutine_enter(blk_bs(blk), co);
+    if (!blk_aio_try_direct(acb, co_entry)) {
+        co = qemu_coroutine_create(co_entry, acb);
+        aio_co_enter(blk_aio_request_context(blk), co);
+    }
 
     acb->has_returned = true;
     if (acb->rwco.ret != NOT_DONE) {
-        replay_bh_schedule_oneshot_event(blk_get_aio_context(blk),
+        replay_bh_schedule_oneshot_event(blk_aio_request_context(blk),
                                          blk_aio_complete_bh, acb);
     }
 
@@ -1956,6 +2097,30 @@ int blk_get_max_iov(BlockBackend *blk)
     return blk->root->bs->bl.max_iov;
 }
 
+/*
+ * Return a host file descriptor holding the data of @blk, shifted by
+ * *@fd_offset bytes, for zero-copy transfers that bypass the block layer;
+ * or -ENOTSUP.  Only a chain of nodes that all implement
+ * .bdrv_get_host_fd qualifies, that is a host file, possibly below raw
+ * format nodes, with no filter in between; and only while no throttling
+ * or drained section needs to see the requests.
+ *
+ * The caller must hold an in-flight reference (blk_inc_in_flight()) from
+ * before calling this until it is done with the descriptor, so that the
+ * graph cannot change under it.
+ */
+int blk_get_host_fd(BlockBackend *blk, int64_t *fd_offset)
+{
+    BlockDriverState *bs = blk_bs(blk);
+
+    assert(qatomic_read(&blk->in_flight) > 0);
+    if (!bs || qatomic_read(&blk->quiesce_counter) ||
+        blk->public.throttle_group_member.throttle_state) {
+        return -ENOTSUP;
+    }
+    return bdrv_get_host_fd(bs, fd_offset);
+}
+
 void blk_set_guest_block_size(BlockBackend *blk, int align)
 {
     blk->guest_block_size = align;
@@ -2060,6 +2225,28 @@ int blk_set_aio_context(BlockBackend *blk, AioContext *new_context,
     return blk_do_set_aio_context(blk, new_context, true, errp);
 }
 
+/*
+ * Check, without changing anything, whether blk_set_aio_context() would
+ * succeed in moving @blk and the nodes below it to @new_context.
+ */
+bool blk_can_set_aio_context(BlockBackend *blk, AioContext *new_context,
+                             Error **errp)
+{
+    BlockDriverState *bs = blk_bs(blk);
+    GSList *ignore;
+    bool ret;
+
+    if (!bs) {
+        return true;
+    }
+
+    ignore = g_slist_prepend(NULL, blk->root);
+    ret = bdrv_can_set_aio_context(bs, new_context, &ignore, errp);
+    g_slist_free(ignore);
+
+    return ret;
+}
+
 static bool blk_root_can_set_aio_ctx(BdrvChild *child, AioContext *ctx,
                                      GSList **ignore, Error **errp)
 {
@@ -2361,7 +2548,7 @@ static void blk_root_drained_begin(BdrvChild *child)
     BlockBackend *blk = child->opaque;
     ThrottleGroupMember *tgm = &blk->public.throttle_group_member;
 
-    if (++blk->quiesce_counter == 1) {
+    if (qatomic_fetch_inc(&blk->quiesce_counter) == 0) {
         if (blk->dev_ops && blk->dev_ops->drained_begin) {
             blk->dev_ops->drained_begin(blk->dev_opaque);
         }
@@ -2378,25 +2565,31 @@ static void blk_root_drained_begin(BdrvChild *child)
 static bool blk_root_drained_poll(BdrvChild *child)
 {
     BlockBackend *blk = child->opaque;
-    assert(blk->quiesce_counter);
-    return !!blk->in_flight;
+    assert(qatomic_read(&blk->quiesce_counter));
+    return !!qatomic_read(&blk->in_flight);
 }
 
 static void blk_root_drained_end(BdrvChild *child, int *drained_end_counter)
 {
     BlockBackend *blk = child->opaque;
-    assert(blk->quiesce_counter);
+    assert(qatomic_read(&blk->quiesce_counter));
 
     assert(blk->public.throttle_group_member.io_limits_disabled);
     qatomic_dec(&blk->public.throttle_group_member.io_limits_disabled);
 
-    if (--blk->quiesce_counter == 0) {
+    if (qatomic_fetch_dec(&blk->quiesce_counter) == 1) {
         if (blk->dev_ops && blk->dev_ops->drained_end) {
             blk->dev_ops->drained_end(blk->dev_opaque);
         }
-        while (qemu_co_enter_next(&blk->queued_requests, NULL)) {
+        /*
+         * Queued requests may come from several iothreads; resume each in
+         * its own AioContext rather than in whichever thread ends the drain.
+         */
+        qemu_mutex_lock(&blk->queued_requests_lock);
+        while (qemu_co_queue_schedule_next(&blk->queued_requests)) {
             /* Resume all queued requests */
         }
+        qemu_mutex_unlock(&blk->queued_requests_lock);
     }
 }
 
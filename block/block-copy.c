@@ -20,10 +20,13 @@
 #include "sysemu/block-backend.h"
 #include "qemu/units.h"
 #include "qemu/coroutine.h"
+#include "qemu/interval-tree.h"
 #include "block/aio_task.h"
 
 #define BLOCK_COPY_MAX_COPY_RANGE (16 * MiB)
 #define BLOCK_COPY_MAX_BUFFER (1 * MiB)
+#define BLOCK_COPY_MAX_ADAPTIVE_BUFFER (16 * MiB)
+#define BLOCK_COPY_TUNE_INTERVAL (500 * SCALE_MS) /* ns of busy time */
 #define BLOCK_COPY_MAX_MEM (128 * MiB)
 #define BLOCK_COPY_MAX_WORKERS 64
 #define BLOCK_COPY_SLICE_TIME 100000000ULL /* ns */
@@ -64,8 +67,9 @@ typedef struct BlockCopyTask {
     BlockCopyCallState *call_state;
     int64_t offset;
     int64_t bytes;
+    int64_t mem_bytes; /* taken from BlockCopyState.mem */
     bool zeroes;
-    QLIST_ENTRY(BlockCopyTask) list;
+    IntervalTreeNode node; /* in BlockCopyState.tasks */
     CoQueue wait_queue; /* coroutines blocked on this task */
 } BlockCopyTask;
 
@@ -88,7 +92,7 @@ typedef struct BlockCopyState {
     bool use_copy_range;
     int64_t copy_size;
     uint64_t len;
-    QLIST_HEAD(, BlockCopyTask) tasks; /* All tasks from all block-copy calls */
+    IntervalTreeRoot tasks; /* All tasks from all block-copy calls */
     QLIST_HEAD(, BlockCopyCallState) calls;
 
     BdrvRequestFlags write_flags;
@@ -115,20 +119,37 @@ typedef struct BlockCopyState {
 
     uint64_t speed;
     RateLimit rate_limit;
+
+    /*
+     * Buffered copies size their chunks by climbing towards the best
+     * throughput, measured over each BLOCK_COPY_TUNE_INTERVAL of time with
+     * copies in flight.  Over a high-latency link, few large requests do
+     * much better than many small ones.  See block_copy_tune().
+     */
+    bool tune_copy_size;
+    int tune_in_flight;
+    int64_t tune_last_event;
+    int64_t tune_busy_ns;
+    int64_t tune_bytes;
+    uint64_t tune_last_rate;
+    bool tune_shrink;
 } BlockCopyState;
 
+static void task_insert(BlockCopyTask *task)
+{
+    task->node.start = task->offset;
+    task->node.last = task_end(task) - 1;
+    interval_tree_insert(&task->node, &task->s->tasks);
+}
+
 static BlockCopyTask *find_conflicting_task(BlockCopyState *s,
                                             int64_t offset, int64_t bytes)
 {
-    BlockCopyTask *t;
+    IntervalTreeNode *node;
 
-    QLIST_FOREACH(t, &s->tasks, list) {
-        if (offset + bytes > t->offset && offset < t->offset + t->bytes) {
-            return t;
-        }
-    }
+    node = interval_tree_iter_first(&s->tasks, offset, offset + bytes - 1);
 
-    return NULL;
+    return node ? container_of(node, BlockCopyTask, node) : NULL;
 }
 
 /*
@@ -185,7 +206,7 @@ static BlockCopyTask *block_copy_task_create(BlockCopyState *s,
         .bytes = bytes,
     };
     qemu_co_queue_init(&task->wait_queue);
-    QLIST_INSERT_HEAD(&s->tasks, task, list);
+    task_insert(task);
 
     return task;
 }
@@ -210,7 +231,9 @@ static void coroutine_fn block_copy_task_shrink(BlockCopyTask *task,
     bdrv_set_dirty_bitmap(task->s->copy_bitmap,
                           task->offset + new_bytes, task->bytes - new_bytes);
 
+    interval_tree_remove(&task->node, &task->s->tasks);
     task->bytes = new_bytes;
+    task_insert(task);
     qemu_co_queue_restart_all(&task->wait_queue);
 }
 
@@ -220,7 +243,7 @@ static void coroutine_fn block_copy_task_end(BlockCopyTask *task, int ret)
     if (ret < 0) {
         bdrv_set_dirty_bitmap(task->s->copy_bitmap, task->offset, task->bytes);
     }
-    QLIST_REMOVE(task, list);
+    interval_tree_remove(&task->node, &task->s->tasks);
     qemu_co_queue_restart_all(&task->wait_queue);
 }
 
@@ -287,9 +310,10 @@ BlockCopyState *block_copy_state_new(BdrvChild *source, BdrvChild *target,
          */
         s->use_copy_range = use_copy_range;
         s->copy_size = MAX(s->cluster_size, BLOCK_COPY_MAX_BUFFER);
+        s->tune_copy_size = true;
     }
 
-    QLIST_INIT(&s->tasks);
+    s->tasks = (IntervalTreeRoot)INTERVAL_TREE_ROOT_INIT;
     QLIST_INIT(&s->calls);
 
     return s;
@@ -321,7 +345,7 @@ static coroutine_fn int block_copy_task_run(AioTaskPool *pool,
 
     aio_task_pool_wait_slot(pool);
     if (aio_task_pool_status(pool) < 0) {
-        co_put_to_shres(task->s->mem, task->bytes);
+        co_put_to_shres(task->s->mem, task->mem_bytes);
         block_copy_task_end(task, -ECANCELED);
         g_free(task);
         return -ECANCELED;
@@ -332,6 +356,51 @@ static coroutine_fn int block_copy_task_run(AioTaskPool *pool,
     return 0;
 }
 
+/* Account the time since the last event to the busy time if it was busy */
+static void block_copy_tune_account(BlockCopyState *s)
+{
+    int64_t now = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+
+    if (s->tune_in_flight) {
+        s->tune_busy_ns += now - s->tune_last_event;
+    }
+    s->tune_last_event = now;
+}
+
+/*
+ * Double or halve copy_size, going on in the same direction as long as
+ * the throughput does not get noticeably worse than in the previous
+ * interval.
+ */
+static void block_copy_tune(BlockCopyState *s)
+{
+    uint64_t rate = muldiv64(s->tune_bytes, NANOSECONDS_PER_SECOND,
+                             s->tune_busy_ns);
+    int64_t copy_size;
+
+    s->tune_bytes = 0;
+    s->tune_busy_ns = 0;
+
+    /* Rate limiting or copy offloading make the measurement meaningless */
+    if (!s->tune_copy_size || s->speed || s->use_copy_range) {
+        s->tune_last_rate = 0;
+        return;
+    }
+
+    if (rate < s->tune_last_rate / 100 * 95) {
+        s->tune_shrink = !s->tune_shrink;
+    }
+    s->tune_last_rate = rate;
+
+    copy_size = s->tune_shrink ? s->copy_size / 2 : s->copy_size * 2;
+    copy_size = MAX(copy_size, s->cluster_size);
+    copy_size = MIN(copy_size, MAX(s->cluster_size,
+                                   BLOCK_COPY_MAX_ADAPTIVE_BUFFER));
+    s->copy_size = copy_size;
+
+    trace_block_copy_tune(s, rate, copy_size);
+}
+
 /*
  * block_copy_do_copy
  *
@@ -340,11 +409,16 @@ static coroutine_fn int block_copy_task_run(AioTaskPool *pool,
  *
  * No sync here: nor bitmap neighter intersecting requests handling, only copy.
  *
+ * @mem_bytes is the memory already taken from s->mem for this chunk.  If
+ * copy offloading fails, the memory for the bounce buffer is taken and
+ * added to it; the caller returns @mem_bytes to s->mem when done.
+ *
  * Returns 0 on success.
  */
 static int coroutine_fn block_copy_do_copy(BlockCopyState *s,
                                            int64_t offset, int64_t bytes,
-                                           bool zeroes, bool *error_is_read)
+                                           bool zeroes, int64_t *mem_bytes,
+                                           bool *error_is_read)
 {
     int ret;
     int64_t nbytes = MIN(offset + bytes, s->len) - offset;
@@ -406,21 +480,35 @@ static int coroutine_fn block_copy_do_copy(BlockCopyState *s,
      * after first successful copy_range.
      */
 
+    if (*mem_bytes < bytes) {
+        co_get_from_shres(s->mem, bytes - *mem_bytes);
+        *mem_bytes = bytes;
+    }
     bounce_buffer = qemu_blockalign(s->source->bs, nbytes);
 
+    block_copy_tune_account(s);
+    s->tune_in_flight++;
+
     ret = bdrv_co_pread(s->source, offset, nbytes, bounce_buffer, 0);
     if (ret < 0) {
         trace_block_copy_read_fail(s, offset, ret);
         *error_is_read = true;
-        goto out;
+    } else {
+        ret = bdrv_co_pwrite(s->target, offset, nbytes, bounce_buffer,
+                             s->write_flags);
+        if (ret < 0) {
+            trace_block_copy_write_fail(s, offset, ret);
+            *error_is_read = false;
+        }
     }
 
-    ret = bdrv_co_pwrite(s->target, offset, nbytes, bounce_buffer,
-                         s->write_flags);
-    if (ret < 0) {
-        trace_block_copy_write_fail(s, offset, ret);
-        *error_is_read = false;
-        goto out;
+    block_copy_tune_account(s);
+    s->tune_in_flight--;
+    if (ret >= 0) {
+        s->tune_bytes += nbytes;
+        if (s->tune_busy_ns >= BLOCK_COPY_TUNE_INTERVAL) {
+            block_copy_tune(s);
+        }
     }
 
 out:
@@ -436,14 +524,14 @@ static coroutine_fn int block_copy_task_entry(AioTask *task)
     int ret;
 
     ret = block_copy_do_copy(t->s, t->offset, t->bytes, t->zeroes,
-                             &error_is_read);
+                             &t->mem_bytes, &error_is_read);
     if (ret < 0 && !t->call_state->ret) {
         t->call_state->ret = ret;
         t->call_state->error_is_read = error_is_read;
     } else {
         progress_work_done(t->s->progress, t->bytes);
     }
-    co_put_to_shres(t->s->mem, t->bytes);
+    co_put_to_shres(t->s->mem, t->mem_bytes);
     block_copy_task_end(t, ret);
 
     return ret;
@@ -634,7 +722,14 @@ block_copy_dirty_clusters(BlockCopyCallState *call_state)
 
         trace_block_copy_process(s, task->offset);
 
-        co_get_from_shres(s->mem, task->bytes);
+        /*
+         * Only buffered copies need memory.  If copy offloading falls back
+         * to a buffer, block_copy_do_copy() takes the memory then.
+         */
+        if (!task->zeroes && !s->use_copy_range) {
+            task->mem_bytes = task->bytes;
+        }
+        co_get_from_shres(s->mem, task->mem_bytes);
 
         offset = task_end(task);
         bytes = end - offset;
@@ -31,13 +31,27 @@
 #include "qemu/module.h"
 #include "qemu/option.h"
 #include "qemu/cutils.h"
+#include "qemu/units.h"
+#include "block/thread-pool.h"
 #include "crypto.h"
 
 typedef struct BlockCrypto BlockCrypto;
 
+/*
+ * Number of threads that encrypt or decrypt at once, including the
+ * coroutine that runs small requests inline
+ */
+#define BLOCK_CRYPTO_MAX_THREADS 4
+/* Requests below this size are not worth splitting across threads */
+#define BLOCK_CRYPTO_THREAD_MIN_SIZE (64 * KiB)
+
 struct BlockCrypto {
     QCryptoBlock *block;
     bool updating_keys;
+
+    CoMutex lock;
+    CoQueue thread_task_queue;
+    int nb_threads;
 };
 
 
@@ -294,7 +308,7 @@ static int block_crypto_open_generic(QCryptoBlockFormat format,
                                        block_crypto_read_func,
                                        bs,
                                        cflags,
-                                       1,
+                                       BLOCK_CRYPTO_MAX_THREADS,
                                        errp);
 
     if (!crypto->block) {
@@ -303,6 +317,8 @@ static int block_crypto_open_generic(QCryptoBlockFormat format,
     }
 
     bs->encrypted = true;
+    qemu_co_mutex_init(&crypto->lock);
+    qemu_co_queue_init(&crypto->thread_task_queue);
 
     ret = 0;
  cleanup:
@@ -396,6 +412,105 @@ static int block_crypto_reopen_prepare(BDRVReopenState *state,
  */
 #define BLOCK_CRYPTO_MAX_IO_SIZE (1024 * 1024)
 
+typedef int BlockCryptoEncDecFunc(QCryptoBlock *block, uint64_t offset,
+                                  uint8_t *buf, size_t len, Error **errp);
+
+typedef struct BlockCryptoTaskGroup {
+    Coroutine *co;
+    int pending;
+    int ret;
+} BlockCryptoTaskGroup;
+
+typedef struct BlockCryptoTask {
+    BlockCryptoTaskGroup *group;
+    QCryptoBlock *block;
+    BlockCryptoEncDecFunc *func;
+    uint64_t offset;
+    uint8_t *buf;
+    size_t len;
+} BlockCryptoTask;
+
+static int block_crypto_task_func(void *opaque)
+{
+    BlockCryptoTask *task = opaque;
+
+    return task->func(task->block, task->offset, task->buf, task->len, NULL);
+}
+
+static void block_crypto_task_done(void *opaque, int ret)
+{
+    BlockCryptoTask *task = opaque;
+    BlockCryptoTaskGroup *group = task->group;
+
+    if (ret < 0) {
+        group->ret = ret;
+    }
+    if (--group->pending == 0) {
+        aio_co_wake(group->co);
+    }
+}
+
+/*
+ * Encrypt or decrypt @len bytes of @buf in place.  Large requests are
+ * split in sector aligned slices that worker threads process in parallel,
+ * each with its own cipher, so that one disk is not bound to the AES
+ * throughput of one core.  Returns -1 on error.
+ */
+static int coroutine_fn
+block_crypto_co_encdec(BlockDriverState *bs, uint64_t offset,
+                       uint8_t *buf, size_t len, BlockCryptoEncDecFunc *func)
+{
+    BlockCrypto *crypto = bs->opaque;
+    uint64_t sector_size = qcrypto_block_get_sector_size(crypto->block);
+    BlockCryptoTask tasks[BLOCK_CRYPTO_MAX_THREADS];
+    BlockCryptoTaskGroup group = { .co = qemu_coroutine_self() };
+    int n = len < BLOCK_CRYPTO_THREAD_MIN_SIZE ? 1 : BLOCK_CRYPTO_MAX_THREADS;
+    size_t slice = QEMU_ALIGN_UP(DIV_ROUND_UP(len, n), sector_size);
+    int ret, i;
+
+    /* Every thread needs a cipher of its own */
+    qemu_co_mutex_lock(&crypto->lock);
+    while (crypto->nb_threads + n > BLOCK_CRYPTO_MAX_THREADS) {
+        qemu_co_queue_wait(&crypto->thread_task_queue, &crypto->lock);
+    }
+    crypto->nb_threads += n;
+    qemu_co_mutex_unlock(&crypto->lock);
+
+    if (n == 1) {
+        ret = func(crypto->block, offset, buf, len, NULL);
+    } else {
+        ThreadPool *pool = aio_get_thread_pool(bdrv_get_aio_context(bs));
+
+        for (i = 0; i * slice < len; i++) {
+            tasks[i] = (BlockCryptoTask) {
+                .group = &group,
+                .block = crypto->block,
+                .func = func,
+                .offset = offset + i * slice,
+                .buf = buf + i * slice,
+                .len = MIN(slice, len - i * slice),
+            };
+            group.pending++;
+        }
+        for (i = 0; i * slice < len; i++) {
+            thread_pool_submit_aio(pool, block_crypto_task_func, &tasks[i],
+                                   block_crypto_task_done, &tasks[i]);
+        }
+
+        /* Completions run in this AioContext, only once we yield */
+        qemu_coroutine_yield();
+        assert(group.pending == 0);
+        ret = group.ret;
+    }
+
+    qemu_co_mutex_lock(&crypto->lock);
+    crypto->nb_threads -= n;
+    qemu_co_queue_restart_all(&crypto->thread_task_queue);
+    qemu_co_mutex_unlock(&crypto->lock);
+
+    return ret;
+}
+
 static coroutine_fn int
 block_crypto_co_preadv(BlockDriverState *bs, uint64_t offset, uint64_t bytes,
                        QEMUIOVector *qiov, int flags)
@@ -439,8 +554,8 @@ block_crypto_co_preadv(BlockDriverState *bs, uint64_t offset, uint64_t bytes,
             goto cleanup;
         }
 
-        if (qcrypto_block_decrypt(crypto->block, offset + bytes_done,
-                                  cipher_data, cur_bytes, NULL) < 0) {
+        if (block_crypto_co_encdec(bs, offset + bytes_done, cipher_data,
+                                   cur_bytes, qcrypto_block_decrypt) < 0) {
             ret = -EIO;
             goto cleanup;
         }
@@ -495,8 +610,8 @@ block_crypto_co_pwritev(BlockDriverState *bs, uint64_t offset, uint64_t bytes,
 
         qemu_iovec_to_buf(qiov, bytes_done, cipher_data, cur_bytes);
 
-        if (qcrypto_block_encrypt(crypto->block, offset + bytes_done,
-                                  cipher_data, cur_bytes, NULL) < 0) {
+        if (block_crypto_co_encdec(bs, offset + bytes_done, cipher_data,
+                                   cur_bytes, qcrypto_block_encrypt) < 0) {
             ret = -EIO;
             goto cleanup;
         }
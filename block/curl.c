@@ -27,7 +27,9 @@
 #include "qemu/error-report.h"
 #include "qemu/module.h"
 #include "qemu/option.h"
+#include "qemu/units.h"
 #include "block/block_int.h"
+#include "block/aio_task.h"
 #include "qapi/qmp/qdict.h"
 #include "qapi/qmp/qstring.h"
 #include "crypto/secret.h"
@@ -44,6 +46,13 @@
 #define CURL_NUM_ACB    8
 #define CURL_TIMEOUT_MAX 10000
 
+/*
+ * Large reads are split in chunks fetched in parallel, each with its own
+ * range request.  Leave some states for other requests.
+ */
+#define CURL_CHUNK_SIZE  (256 * KiB)
+#define CURL_MAX_CHUNKS  (CURL_NUM_STATES / 2)
+
 #define CURL_BLOCK_OPT_URL       "url"
 #define CURL_BLOCK_OPT_READAHEAD "readahead"
 #define CURL_BLOCK_OPT_SSLVERIFY "sslverify"
@@ -70,15 +79,31 @@ typedef struct CURLAIOCB {
 
     uint64_t offset;
     uint64_t bytes;
+    size_t readahead;
     int ret;
 
     size_t start;
     size_t end;
 } CURLAIOCB;
 
+typedef struct CURLChunkTask {
+    AioTask task;
+    BlockDriverState *bs;
+    QEMUIOVector *qiov;
+    size_t qiov_offset;
+    uint64_t offset;
+    uint64_t bytes;
+    size_t readahead;
+} CURLChunkTask;
+
+/*
+ * Sockets belong to the BDRVCURLState rather than to the transfer that
+ * opened them: connections are reused, and with HTTP/2 shared, by other
+ * transfers.
+ */
 typedef struct CURLSocket {
     int fd;
-    struct CURLState *state;
+    struct BDRVCURLState *s;
     QLIST_ENTRY(CURLSocket) next;
 } CURLSocket;
 
@@ -87,7 +112,6 @@ typedef struct CURLState
     struct BDRVCURLState *s;
     CURLAIOCB *acb[CURL_NUM_ACB];
     CURL *curl;
-    QLIST_HEAD(, CURLSocket) sockets;
     char *orig_buf;
     uint64_t buf_start;
     size_t buf_off;
@@ -102,6 +126,7 @@ typedef struct BDRVCURLState {
     QEMUTimer timer;
     uint64_t len;
     CURLState states[CURL_NUM_STATES];
+    QLIST_HEAD(, CURLSocket) sockets;
     char *url;
     size_t readahead_size;
     bool sslverify;
@@ -147,7 +172,7 @@ static int curl_sock_cb(CURL *curl, curl_socket_t fd, int action,
     curl_easy_getinfo(curl, CURLINFO_PRIVATE, (char **)&state);
     s = state->s;
 
-    QLIST_FOREACH(socket, &state->sockets, next) {
+    QLIST_FOREACH(socket, &s->sockets, next) {
         if (socket->fd == fd) {
             break;
         }
@@ -155,8 +180,8 @@ static int curl_sock_cb(CURL *curl, curl_socket_t fd, int action,
     if (!socket) {
         socket = g_new0(CURLSocket, 1);
         socket->fd = fd;
-        socket->state = state;
-        QLIST_INSERT_HEAD(&state->sockets, socket, next);
+        socket->s = s;
+        QLIST_INSERT_HEAD(&s->sockets, socket, next);
     }
 
     trace_curl_sock_cb(action, (int)fd);
@@ -385,7 +410,7 @@ static void curl_multi_check_completion(BDRVCURLState *s)
 /* Called with s->mutex held.  */
 static void curl_multi_do_locked(CURLSocket *socket)
 {
-    BDRVCURLState *s = socket->state->s;
+    BDRVCURLState *s = socket->s;
     int running;
     int r;
 
@@ -401,7 +426,7 @@ static void curl_multi_do_locked(CURLSocket *socket)
 static void curl_multi_do(void *arg)
 {
     CURLSocket *socket = arg;
-    BDRVCURLState *s = socket->state->s;
+    BDRVCURLState *s = socket->s;
 
     qemu_mutex_lock(&s->mutex);
     curl_multi_do_locked(socket);
@@ -466,6 +491,15 @@ static int curl_init_state(BDRVCURLState *s, CURLState *state)
         curl_easy_setopt(state->curl, CURLOPT_NOSIGNAL, 1);
         curl_easy_setopt(state->curl, CURLOPT_ERRORBUFFER, state->errmsg);
         curl_easy_setopt(state->curl, CURLOPT_FAILONERROR, 1);
+#if LIBCURL_VERSION_NUM >= 0x072f00
+        /* Use HTTP/2 where the server offers it, for multiplexing */
+        curl_easy_setopt(state->curl, CURLOPT_HTTP_VERSION,
+                         (long)CURL_HTTP_VERSION_2TLS);
+#endif
+#if LIBCURL_VERSION_NUM >= 0x072b00
+        /* Rather wait for a connection to multiplex on than open one */
+        curl_easy_setopt(state->curl, CURLOPT_PIPEWAIT, 1L);
+#endif
 
         if (s->username) {
             curl_easy_setopt(state->curl, CURLOPT_USERNAME, s->username);
@@ -498,7 +532,6 @@ static int curl_init_state(BDRVCURLState *s, CURLState *state)
 #endif
     }
 
-    QLIST_INIT(&state->sockets);
     state->s = s;
 
     return 0;
@@ -515,13 +548,6 @@ static void curl_clean_state(CURLState *s)
     if (s->s->multi)
         curl_multi_remove_handle(s->s->multi, s->curl);
 
-    while (!QLIST_EMPTY(&s->sockets)) {
-        CURLSocket *socket = QLIST_FIRST(&s->sockets);
-
-        QLIST_REMOVE(socket, next);
-        g_free(socket);
-    }
-
     s->in_use = 0;
 
     qemu_co_enter_next(&s->s->free_state_waitq, &s->s->mutex);
@@ -554,6 +580,14 @@ static void curl_detach_aio_context(BlockDriverState *bs)
             curl_multi_cleanup(s->multi);
             s->multi = NULL;
         }
+        while (!QLIST_EMPTY(&s->sockets)) {
+            CURLSocket *socket = QLIST_FIRST(&s->sockets);
+
+            aio_set_fd_handler(s->aio_context, socket->fd, false,
+                               NULL, NULL, NULL, NULL);
+            QLIST_REMOVE(socket, next);
+            g_free(socket);
+        }
     }
 
     timer_del(&s->timer);
@@ -574,6 +608,9 @@ static void curl_attach_aio_context(BlockDriverState *bs,
     curl_multi_setopt(s->multi, CURLMOPT_SOCKETFUNCTION, curl_sock_cb);
     curl_multi_setopt(s->multi, CURLMOPT_TIMERDATA, s);
     curl_multi_setopt(s->multi, CURLMOPT_TIMERFUNCTION, curl_timer_cb);
+#if LIBCURL_VERSION_NUM >= 0x072b00
+    curl_multi_setopt(s->multi, CURLMOPT_PIPELINING, (long)CURLPIPE_MULTIPLEX);
+#endif
 }
 
 static QemuOptsList runtime_opts = {
@@ -861,7 +898,7 @@ static void curl_setup_preadv(BlockDriverState *bs, CURLAIOCB *acb)
     state->buf_off = 0;
     g_free(state->orig_buf);
     state->buf_start = start;
-    state->buf_len = MIN(acb->end + s->readahead_size, s->len - start);
+    state->buf_len = MIN(acb->end + acb->readahead, s->len - start);
     end = start + state->buf_len - 1;
     state->orig_buf = g_try_malloc(state->buf_len);
     if (state->buf_len && state->orig_buf == NULL) {
@@ -890,24 +927,81 @@ out:
     qemu_mutex_unlock(&s->mutex);
 }
 
-static int coroutine_fn curl_co_preadv(BlockDriverState *bs,
-        uint64_t offset, uint64_t bytes, QEMUIOVector *qiov, int flags)
+static int coroutine_fn curl_co_preadv_chunk(BlockDriverState *bs,
+                                             uint64_t offset, uint64_t bytes,
+                                             QEMUIOVector *qiov,
+                                             size_t qiov_offset,
+                                             size_t readahead)
 {
+    QEMUIOVector local_qiov;
     CURLAIOCB acb = {
         .co = qemu_coroutine_self(),
         .ret = -EINPROGRESS,
-        .qiov = qiov,
+        .qiov = &local_qiov,
         .offset = offset,
-        .bytes = bytes
+        .bytes = bytes,
+        .readahead = readahead,
     };
 
+    qemu_iovec_init_slice(&local_qiov, qiov, qiov_offset, bytes);
     curl_setup_preadv(bs, &acb);
     while (acb.ret == -EINPROGRESS) {
         qemu_coroutine_yield();
     }
+    qemu_iovec_destroy(&local_qiov);
     return acb.ret;
 }
 
+static int coroutine_fn curl_co_preadv_task_entry(AioTask *task)
+{
+    CURLChunkTask *t = container_of(task, CURLChunkTask, task);
+
+    return curl_co_preadv_chunk(t->bs, t->offset, t->bytes, t->qiov,
+                                t->qiov_offset, t->readahead);
+}
+
+static int coroutine_fn curl_co_preadv(BlockDriverState *bs,
+        uint64_t offset, uint64_t bytes, QEMUIOVector *qiov, int flags)
+{
+    BDRVCURLState *s = bs->opaque;
+    AioTaskPool *aio = NULL;
+    size_t qiov_offset = 0;
+    int ret = 0;
+
+    if (bytes <= CURL_CHUNK_SIZE) {
+        return curl_co_preadv_chunk(bs, offset, bytes, qiov, 0,
+                                    s->readahead_size);
+    }
+
+    /* Only the last chunk reads ahead, the others are contiguous to it */
+    aio = aio_task_pool_new(CURL_MAX_CHUNKS);
+    while (bytes && aio_task_pool_status(aio) == 0) {
+        uint64_t cur_bytes = MIN(bytes, CURL_CHUNK_SIZE);
+        CURLChunkTask *t = g_new(CURLChunkTask, 1);
+
+        *t = (CURLChunkTask) {
+            .task.func = curl_co_preadv_task_entry,
+            .bs = bs,
+            .qiov = qiov,
+            .qiov_offset = qiov_offset,
+            .offset = offset,
+            .bytes = cur_bytes,
+            .readahead = cur_bytes == bytes ? s->readahead_size : 0,
+        };
+        aio_task_pool_start_task(aio, &t->task);
+
+        bytes -= cur_bytes;
+        offset += cur_bytes;
+        qiov_offset += cur_bytes;
+    }
+
+    aio_task_pool_wait_all(aio);
+    ret = aio_task_pool_status(aio);
+    aio_task_pool_free(aio);
+
+    return ret;
+}
+
 static void curl_close(BlockDriverState *bs)
 {
     BDRVCURLState *s = bs->opaque;
@@ -913,6 +913,12 @@ bool bdrv_dirty_bitmap_next_dirty_area(BdrvDirtyBitmap *bitmap,
                                    dirty_start, dirty_count);
 }
 
+int64_t bdrv_dirty_bitmap_next_run(BdrvDirtyBitmap *bitmap, int64_t start,
+                                   int64_t end, bool *dirty)
+{
+    return hbitmap_next_run(bitmap->bitmap, start, end, dirty);
+}
+
 /**
  * bdrv_merge_dirty_bitmap: merge src into dest.
  * Ensures permissions on bitmaps are reasonable; use for public API.
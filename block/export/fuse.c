@@ -24,9 +24,13 @@
 #include "block/export.h"
 #include "block/fuse.h"
 #include "block/qapi.h"
+#include "block/thread-pool.h"
 #include "qapi/error.h"
 #include "qapi/qapi-commands-block.h"
+#include "qemu/coroutine.h"
+#include "qemu/sockets.h"
 #include "sysemu/block-backend.h"
+#include "sysemu/iothread.h"
 
 #include <fuse.h>
 #include <fuse_lowlevel.h>
@@ -35,14 +39,41 @@
 /* Prevent overly long bounce buffer allocations */
 #define FUSE_MAX_BOUNCE_BYTES (MIN(BDRV_REQUEST_MAX_BYTES, 64 * 1024 * 1024))
 
+/* Request buffers that each FuseQueue keeps for reuse */
+#define FUSE_MAX_FREE_REQUESTS 16
+
+
+typedef struct FuseQueue FuseQueue;
+
+/* A FUSE request, processed in its own coroutine */
+typedef struct FuseRequest {
+    FuseQueue *queue;
+    struct fuse_buf buf;
+    QSLIST_ENTRY(FuseRequest) next;
+} FuseRequest;
+
+/* An AioContext that picks up requests from the FUSE session fd */
+struct FuseQueue {
+    struct FuseExport *exp;
+    AioContext *ctx;
+    IOThread *iothread; /* NULL if ctx is the export's AioContext */
+
+    /* Only accessed in ctx */
+    QSLIST_HEAD(, FuseRequest) free_reqs;
+    unsigned nr_free_reqs;
+};
 
 typedef struct FuseExport {
     BlockExport common;
 
     struct fuse_session *fuse_session;
-    struct fuse_buf fuse_buf;
     bool mounted, fd_handler_set_up;
 
+    FuseQueue *queues;
+    size_t nr_queues;
+    bool multiqueue;
+    unsigned in_flight; /* Requests being processed, accessed atomically */
+
     char *mountpoint;
     bool writable;
     bool growable;
@@ -56,6 +87,8 @@ static void fuse_export_delete(BlockExport *exp);
 
 static void init_exports_table(void);
 
+static int setup_fuse_queues(FuseExport *exp, BlockExportOptionsFuse *args,
+                             Error **errp);
 static int setup_fuse_export(FuseExport *exp, const char *mountpoint,
                              Error **errp);
 static void read_from_fuse_export(void *opaque);
@@ -118,6 +151,11 @@ static int fuse_export_create(BlockExport *blk_exp,
     exp->writable = blk_exp_args->writable;
     exp->growable = args->growable;
 
+    ret = setup_fuse_queues(exp, args, errp);
+    if (ret < 0) {
+        goto fail;
+    }
+
     ret = setup_fuse_export(exp, args->mountpoint, errp);
     if (ret < 0) {
         goto fail;
@@ -142,6 +180,50 @@ static void init_exports_table(void)
     exports = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
 }
 
+/**
+ * Set up exp->queues: either the export's own AioContext, or one queue
+ * for each of the iothreads in @args.
+ */
+static int setup_fuse_queues(FuseExport *exp, BlockExportOptionsFuse *args,
+                             Error **errp)
+{
+    strList *iothreads;
+    size_t i;
+
+    if (!args->has_iothreads || !args->iothreads) {
+        exp->queues = g_new0(FuseQueue, 1);
+        exp->nr_queues = 1;
+        exp->queues[0].exp = exp;
+        exp->queues[0].ctx = exp->common.ctx;
+        return 0;
+    }
+
+    if (!blk_set_multiqueue(exp->common.blk, true, errp)) {
+        return -EINVAL;
+    }
+    exp->multiqueue = true;
+
+    for (iothreads = args->iothreads; iothreads; iothreads = iothreads->next) {
+        exp->nr_queues++;
+    }
+    exp->queues = g_new0(FuseQueue, exp->nr_queues);
+    for (i = 0, iothreads = args->iothreads; iothreads;
+         i++, iothreads = iothreads->next) {
+        IOThread *iothread = iothread_by_id(iothreads->value);
+
+        if (!iothread) {
+            error_setg(errp, "IOThread '%s' not found", iothreads->value);
+            return -ENOENT;
+        }
+        object_ref(OBJECT(iothread));
+        exp->queues[i].exp = exp;
+        exp->queues[i].ctx = iothread_get_aio_context(iothread);
+        exp->queues[i].iothread = iothread;
+    }
+
+    return 0;
+}
+
 /**
  * Create exp->fuse_session and mount it.
  */
@@ -151,6 +233,7 @@ static int setup_fuse_export(FuseExport *exp, const char *mountpoint,
     const char *fuse_argv[4];
     char *mount_opts;
     struct fuse_args fuse_args;
+    size_t i;
     int ret;
 
     /* Needs to match what fuse_init() sets.  Only max_read must be supplied. */
@@ -181,9 +264,16 @@ static int setup_fuse_export(FuseExport *exp, const char *mountpoint,
 
     g_hash_table_insert(exports, g_strdup(mountpoint), NULL);
 
-    aio_set_fd_handler(exp->common.ctx,
-                       fuse_session_fd(exp->fuse_session), true,
-                       read_from_fuse_export, NULL, NULL, exp);
+    /*
+     * All queues wait for the same fd, and whichever reads a request
+     * first processes it.  The others then just see EAGAIN.
+     */
+    qemu_set_nonblock(fuse_session_fd(exp->fuse_session));
+    for (i = 0; i < exp->nr_queues; i++) {
+        aio_set_fd_handler(exp->queues[i].ctx,
+                           fuse_session_fd(exp->fuse_session), true,
+                           read_from_fuse_export, NULL, NULL, &exp->queues[i]);
+    }
     exp->fd_handler_set_up = true;
 
     return 0;
@@ -193,43 +283,106 @@ fail:
     return ret;
 }
 
+static FuseRequest *fuse_queue_get_request(FuseQueue *q)
+{
+    FuseRequest *req = QSLIST_FIRST(&q->free_reqs);
+
+    if (req) {
+        QSLIST_REMOVE_HEAD(&q->free_reqs, next);
+        q->nr_free_reqs--;
+    } else {
+        req = g_new0(FuseRequest, 1);
+        req->queue = q;
+    }
+    return req;
+}
+
+static void fuse_queue_put_request(FuseQueue *q, FuseRequest *req)
+{
+    if (q->nr_free_reqs >= FUSE_MAX_FREE_REQUESTS) {
+        free(req->buf.mem);
+        g_free(req);
+        return;
+    }
+    QSLIST_INSERT_HEAD(&q->free_reqs, req, next);
+    q->nr_free_reqs++;
+}
+
+static void fuse_dec_in_flight(FuseExport *exp)
+{
+    if (qatomic_fetch_dec(&exp->in_flight) == 1) {
+        aio_wait_kick();
+    }
+}
+
+/**
+ * Process one request.  The fuse_lowlevel_ops callbacks therefore all
+ * run in coroutine context and can yield for I/O, so that other
+ * requests can be received in the meantime.
+ */
+static void coroutine_fn fuse_co_process_request(void *opaque)
+{
+    FuseRequest *req = opaque;
+    FuseQueue *q = req->queue;
+    FuseExport *exp = q->exp;
+
+    fuse_session_process_buf(exp->fuse_session, &req->buf);
+
+    fuse_queue_put_request(q, req);
+    fuse_dec_in_flight(exp);
+}
+
 /**
  * Callback to be invoked when the FUSE session FD can be read from.
  * (This is basically the FUSE event loop.)
  */
 static void read_from_fuse_export(void *opaque)
 {
-    FuseExport *exp = opaque;
+    FuseQueue *q = opaque;
+    FuseExport *exp = q->exp;
+    FuseRequest *req = fuse_queue_get_request(q);
+    Coroutine *co;
     int ret;
 
-    blk_exp_ref(&exp->common);
+    /*
+     * Count the request before it is received, so that shutdown cannot
+     * miss one that another queue has already taken off the fd.
+     */
+    qatomic_inc(&exp->in_flight);
 
     do {
-        ret = fuse_session_receive_buf(exp->fuse_session, &exp->fuse_buf);
+        ret = fuse_session_receive_buf(exp->fuse_session, &req->buf);
     } while (ret == -EINTR);
-    if (ret < 0) {
-        goto out;
+    if (ret <= 0) {
+        /* -EAGAIN if another queue was faster */
+        fuse_queue_put_request(q, req);
+        fuse_dec_in_flight(exp);
+        return;
     }
 
-    fuse_session_process_buf(exp->fuse_session, &exp->fuse_buf);
-
-out:
-    blk_exp_unref(&exp->common);
+    co = qemu_coroutine_create(fuse_co_process_request, req);
+    qemu_coroutine_enter(co);
 }
 
 static void fuse_export_shutdown(BlockExport *blk_exp)
 {
     FuseExport *exp = container_of(blk_exp, FuseExport, common);
+    size_t i;
 
     if (exp->fuse_session) {
         fuse_session_exit(exp->fuse_session);
 
         if (exp->fd_handler_set_up) {
-            aio_set_fd_handler(exp->common.ctx,
-                               fuse_session_fd(exp->fuse_session), true,
-                               NULL, NULL, NULL, NULL);
+            for (i = 0; i < exp->nr_queues; i++) {
+                aio_set_fd_handler(exp->queues[i].ctx,
+                                   fuse_session_fd(exp->fuse_session), true,
+                                   NULL, NULL, NULL, NULL);
+            }
             exp->fd_handler_set_up = false;
         }
+
+        /* Requests do not hold references to the export */
+        AIO_WAIT_WHILE(exp->common.ctx, qatomic_read(&exp->in_flight) > 0);
     }
 
     if (exp->mountpoint) {
@@ -244,6 +397,7 @@ static void fuse_export_shutdown(BlockExport *blk_exp)
 static void fuse_export_delete(BlockExport *blk_exp)
 {
     FuseExport *exp = container_of(blk_exp, FuseExport, common);
+    size_t i;
 
     if (exp->fuse_session) {
         if (exp->mounted) {
@@ -253,7 +407,24 @@ static void fuse_export_delete(BlockExport *blk_exp)
         fuse_session_destroy(exp->fuse_session);
     }
 
-    free(exp->fuse_buf.mem);
+    for (i = 0; i < exp->nr_queues; i++) {
+        FuseQueue *q = &exp->queues[i];
+        FuseRequest *req;
+
+        while ((req = QSLIST_FIRST(&q->free_reqs))) {
+            QSLIST_REMOVE_HEAD(&q->free_reqs, next);
+            free(req->buf.mem);
+            g_free(req);
+        }
+        if (q->iothread) {
+            object_unref(OBJECT(q->iothread));
+        }
+    }
+    g_free(exp->queues);
+    if (exp->multiqueue) {
+        blk_set_multiqueue(exp->common.blk, false, NULL);
+    }
+
     g_free(exp->mountpoint);
 }
 
@@ -295,6 +466,14 @@ static void fuse_init(void *userdata, struct fuse_conn_info *conn)
     conn->max_read = FUSE_MAX_BOUNCE_BYTES;
 
     conn->max_write = MIN_NON_ZERO(BDRV_REQUEST_MAX_BYTES, conn->max_write);
+
+    /*
+     * Let the kernel move request and reply payloads through pipes:
+     * fuse_write_buf() then gets write data in a pipe, and fuse_read()
+     * can splice from the image file.
+     */
+    conn->want |= conn->capable & (FUSE_CAP_SPLICE_READ |
+                                   FUSE_CAP_SPLICE_WRITE);
 }
 
 /**
@@ -353,17 +532,22 @@ static void fuse_getattr(fuse_req_t req, fuse_ino_t inode,
     fuse_reply_attr(req, &statbuf, 1.);
 }
 
-static int fuse_do_truncate(const FuseExport *exp, int64_t size,
-                            bool req_zero_write, PreallocMode prealloc)
+static int coroutine_fn fuse_do_truncate(const FuseExport *exp, int64_t size,
+                                         bool req_zero_write,
+                                         PreallocMode prealloc)
 {
     uint64_t blk_perm, blk_shared_perm;
     BdrvRequestFlags truncate_flags = 0;
+    AioContext *queue_ctx = qemu_get_current_aio_context();
     int ret;
 
     if (req_zero_write) {
         truncate_flags |= BDRV_REQ_ZERO_WRITE;
     }
 
+    /* Permission changes belong in the export's AioContext, not a queue's */
+    aio_co_reschedule_self(exp->common.ctx);
+
     /* Growable exports have a permanent RESIZE permission */
     if (!exp->growable) {
         blk_get_perm(exp->common.blk, &blk_perm, &blk_shared_perm);
@@ -371,7 +555,7 @@ static int fuse_do_truncate(const FuseExport *exp, int64_t size,
         ret = blk_set_perm(exp->common.blk, blk_perm | BLK_PERM_RESIZE,
                            blk_shared_perm, NULL);
         if (ret < 0) {
-            return ret;
+            goto out;
         }
     }
 
@@ -383,6 +567,8 @@ static int fuse_do_truncate(const FuseExport *exp, int64_t size,
         blk_set_perm(exp->common.blk, blk_perm, blk_shared_perm, &error_abort);
     }
 
+out:
+    aio_co_reschedule_self(queue_ctx);
     return ret;
 }
 
@@ -423,6 +609,55 @@ static void fuse_open(fuse_req_t req, fuse_ino_t inode,
     fuse_reply_open(req, fi);
 }
 
+typedef struct FuseSpliceReadData {
+    fuse_req_t req;
+    struct fuse_bufvec bufv;
+} FuseSpliceReadData;
+
+static int fuse_splice_read_worker(void *opaque)
+{
+    FuseSpliceReadData *data = opaque;
+
+    return fuse_reply_data(data->req, &data->bufv, 0);
+}
+
+/**
+ * Reply to a read directly from the file holding the image data, if
+ * there is one.  libfuse splices the data from the file to /dev/fuse
+ * if the kernel allows it, and falls back to a copy otherwise.  This
+ * bypasses the block layer like the NBD server's sendfile() path, so
+ * it has the same restrictions (see blk_get_host_fd()).
+ */
+static bool coroutine_fn fuse_co_splice_read(FuseExport *exp, fuse_req_t req,
+                                             size_t size, off_t offset)
+{
+    BlockBackend *blk = exp->common.blk;
+    FuseSpliceReadData data;
+    int64_t fd_offset;
+    int fd;
+
+    blk_inc_in_flight(blk);
+    fd = blk_get_host_fd(blk, &fd_offset);
+    if (fd < 0) {
+        blk_dec_in_flight(blk);
+        return false;
+    }
+
+    data = (FuseSpliceReadData) {
+        .req    = req,
+        .bufv   = FUSE_BUFVEC_INIT(size),
+    };
+    data.bufv.buf[0].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+    data.bufv.buf[0].fd = fd;
+    data.bufv.buf[0].pos = fd_offset + offset;
+
+    /* fuse_reply_data() reports errors to the client itself */
+    thread_pool_submit_co(aio_get_thread_pool(qemu_get_current_aio_context()),
+                          fuse_splice_read_worker, &data);
+    blk_dec_in_flight(blk);
+    return true;
+}
+
 /**
  * Handle client reads from the exported image.
  */
@@ -454,6 +689,10 @@ static void fuse_read(fuse_req_t req, fuse_ino_t inode,
         size = length - offset;
     }
 
+    if (fuse_co_splice_read(exp, req, size, offset)) {
+        return;
+    }
+
     buf = qemu_try_blockalign(blk_bs(exp->common.blk), size);
     if (!buf) {
         fuse_reply_err(req, ENOMEM);
@@ -471,13 +710,20 @@ static void fuse_read(fuse_req_t req, fuse_ino_t inode,
 }
 
 /**
- * Handle client writes to the exported image.
+ * Handle client writes to the exported image.  The data may still be in
+ * a pipe that libfuse spliced it into; copy it straight into an aligned
+ * buffer, which the block layer can then use without bouncing it again.
  */
-static void fuse_write(fuse_req_t req, fuse_ino_t inode, const char *buf,
-                       size_t size, off_t offset, struct fuse_file_info *fi)
+static void fuse_write_buf(fuse_req_t req, fuse_ino_t inode,
+                           struct fuse_bufvec *in_buf, off_t offset,
+                           struct fuse_file_info *fi)
 {
     FuseExport *exp = fuse_req_userdata(req);
+    size_t size = fuse_buf_size(in_buf);
+    struct fuse_bufvec out_buf;
     int64_t length;
+    ssize_t copied;
+    void *buf;
     int ret;
 
     /* Limited by max_write, should not happen */
@@ -491,6 +737,24 @@ static void fuse_write(fuse_req_t req, fuse_ino_t inode, const char *buf,
         return;
     }
 
+    buf = qemu_try_blockalign(blk_bs(exp->common.blk), size);
+    if (!buf) {
+        fuse_reply_err(req, ENOMEM);
+        return;
+    }
+
+    /*
+     * The pipe belongs to this thread and will be reused for the next
+     * request, so this must happen before anything can yield.
+     */
+    out_buf = (struct fuse_bufvec)FUSE_BUFVEC_INIT(size);
+    out_buf.buf[0].mem = buf;
+    copied = fuse_buf_copy(&out_buf, in_buf, 0);
+    if (copied < 0 || (size_t)copied != size) {
+        fuse_reply_err(req, copied < 0 ? -copied : EIO);
+        goto out;
+    }
+
     /**
      * Clients will expect short writes at EOF, so we have to limit
      * offset+size to the image length.
@@ -498,7 +762,7 @@ static void fuse_write(fuse_req_t req, fuse_ino_t inode, const char *buf,
     length = blk_getlength(exp->common.blk);
     if (length < 0) {
         fuse_reply_err(req, -length);
-        return;
+        goto out;
     }
 
     if (offset + size > length) {
@@ -506,7 +770,7 @@ static void fuse_write(fuse_req_t req, fuse_ino_t inode, const char *buf,
             ret = fuse_do_truncate(exp, offset + size, true, PREALLOC_MODE_OFF);
             if (ret < 0) {
                 fuse_reply_err(req, -ret);
-                return;
+                goto out;
             }
         } else {
             size = length - offset;
@@ -519,6 +783,9 @@ static void fuse_write(fuse_req_t req, fuse_ino_t inode, const char *buf,
     } else {
         fuse_reply_err(req, -ret);
     }
+
+out:
+    qemu_vfree(buf);
 }
 
 /**
@@ -708,7 +975,7 @@ static const struct fuse_lowlevel_ops fuse_ops = {
     .setattr    = fuse_setattr,
     .open       = fuse_open,
     .read       = fuse_read,
-    .write      = fuse_write,
+    .write_buf  = fuse_write_buf,
     .fallocate  = fuse_fallocate,
     .flush      = fuse_flush,
     .fsync      = fuse_fsync,
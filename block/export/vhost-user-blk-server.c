@@ -18,6 +18,7 @@
 #include "qapi/error.h"
 #include "qom/object_interfaces.h"
 #include "sysemu/block-backend.h"
+#include "sysemu/iothread.h"
 #include "util/block-helpers.h"
 
 /*
@@ -54,17 +55,24 @@ typedef struct {
     QIOChannelSocket *sioc;
     struct virtio_blk_config blkcfg;
     bool writable;
+
+    /* With iothread-vq-mapping, the IOThread of each virtqueue */
+    uint16_t num_queues;
+    IOThread **vq_iothread;
+    AioContext **vq_ctx;
 } VuBlkExport;
 
 static void vu_blk_req_complete(VuBlkReq *req)
 {
-    VuDev *vu_dev = &req->server->vu_dev;
+    VuServer *server = req->server;
+    VuDev *vu_dev = &server->vu_dev;
 
     /* IO size with 1 extra status byte */
     vu_queue_push(vu_dev, req->vq, &req->elem, req->size + 1);
     vu_queue_notify(vu_dev, req->vq);
 
     free(req);
+    vhost_user_server_dec_in_flight(server);
 }
 
 static bool vu_blk_sect_range_ok(VuBlkExport *vexp, uint64_t sector,
@@ -283,6 +291,7 @@ static void coroutine_fn vu_blk_virtio_process_req(void *opaque)
 
 err:
     free(req);
+    vhost_user_server_dec_in_flight(server);
 }
 
 static void vu_blk_process_vq(VuDev *vu_dev, int idx)
@@ -300,6 +309,7 @@ static void vu_blk_process_vq(VuDev *vu_dev, int idx)
 
         req->server = server;
         req->vq = vq;
+        vhost_user_server_inc_in_flight(server);
 
         Coroutine *co =
             qemu_coroutine_create(vu_blk_virtio_process_req, req);
@@ -453,6 +463,65 @@ vu_blk_initialize_config(BlockDriverState *bs,
     config->max_write_zeroes_seg = cpu_to_le32(1);
 }
 
+/* Look up the iothread-vq-mapping IOThreads for each of the virtqueues */
+static int vu_blk_exp_map_iothreads(VuBlkExport *vexp, strList *mapping,
+                                    Error **errp)
+{
+    strList *entry;
+    uint16_t i;
+
+    if (!blk_set_multiqueue(vexp->export.blk, true, errp)) {
+        return -EINVAL;
+    }
+
+    vexp->vq_iothread = g_new0(IOThread *, vexp->num_queues);
+    vexp->vq_ctx = g_new0(AioContext *, vexp->num_queues);
+    for (i = 0, entry = mapping; i < vexp->num_queues; i++) {
+        IOThread *iothread = iothread_by_id(entry->value);
+
+        if (!iothread) {
+            error_setg(errp, "iothread-vq-mapping: no iothread '%s'",
+                       entry->value);
+            return -ENOENT;
+        }
+        object_ref(OBJECT(iothread));
+        vexp->vq_iothread[i] = iothread;
+        vexp->vq_ctx[i] = iothread_get_aio_context(iothread);
+
+        entry = entry->next ?: mapping;
+    }
+    return 0;
+}
+
+/* Wait for the requests of all virtqueues around guest memory changes */
+static void coroutine_fn vu_blk_exp_drained(VuServer *server, bool begin)
+{
+    VuBlkExport *vexp = container_of(server, VuBlkExport, vu_server);
+
+    if (begin) {
+        bdrv_drained_begin(blk_bs(vexp->export.blk));
+    } else {
+        bdrv_drained_end(blk_bs(vexp->export.blk));
+    }
+}
+
+static void vu_blk_exp_unmap_iothreads(VuBlkExport *vexp)
+{
+    uint16_t i;
+
+    if (!vexp->vq_iothread) {
+        return;
+    }
+    for (i = 0; i < vexp->num_queues && vexp->vq_iothread[i]; i++) {
+        object_unref(OBJECT(vexp->vq_iothread[i]));
+    }
+    g_free(vexp->vq_iothread);
+    g_free(vexp->vq_ctx);
+    vexp->vq_iothread = NULL;
+    vexp->vq_ctx = NULL;
+    blk_set_multiqueue(vexp->export.blk, false, NULL);
+}
+
 static void vu_blk_exp_request_shutdown(BlockExport *exp)
 {
     VuBlkExport *vexp = container_of(exp, VuBlkExport, export);
@@ -468,6 +537,7 @@ static int vu_blk_exp_create(BlockExport *exp, BlockExportOptions *opts,
     Error *local_err = NULL;
     uint64_t logical_block_size;
     uint16_t num_queues = VHOST_USER_BLK_NUM_QUEUES_DEFAULT;
+    int ret;
 
     vexp->writable = opts->writable;
     vexp->blkcfg.wce = 0;
@@ -494,6 +564,21 @@ static int vu_blk_exp_create(BlockExport *exp, BlockExportOptions *opts,
         return -EINVAL;
     }
 
+    vexp->num_queues = num_queues;
+
+    if (vu_opts->has_iothread_vq_mapping) {
+        if (!vu_opts->iothread_vq_mapping) {
+            error_setg(errp, "iothread-vq-mapping must not be empty");
+            return -EINVAL;
+        }
+        ret = vu_blk_exp_map_iothreads(vexp, vu_opts->iothread_vq_mapping,
+                                       errp);
+        if (ret < 0) {
+            vu_blk_exp_unmap_iothreads(vexp);
+            return ret;
+        }
+    }
+
     vu_blk_initialize_config(blk_bs(exp->blk), &vexp->blkcfg,
                              logical_block_size, num_queues);
 
@@ -504,8 +589,13 @@ static int vu_blk_exp_create(BlockExport *exp, BlockExportOptions *opts,
                                  num_queues, &vu_blk_iface, errp)) {
         blk_remove_aio_context_notifier(exp->blk, blk_aio_attached,
                                         blk_aio_detach, vexp);
+        vu_blk_exp_unmap_iothreads(vexp);
         return -EADDRNOTAVAIL;
     }
+    if (vexp->vq_ctx) {
+        vhost_user_server_set_queue_ctx(&vexp->vu_server, vexp->vq_ctx,
+                                        vu_blk_exp_drained);
+    }
 
     return 0;
 }
@@ -516,6 +606,7 @@ static void vu_blk_exp_delete(BlockExport *exp)
 
     blk_remove_aio_context_notifier(exp->blk, blk_aio_attached, blk_aio_detach,
                                     vexp);
+    vu_blk_exp_unmap_iothreads(vexp);
 }
 
 const BlockExportDriver blk_exp_vhost_user_blk = {
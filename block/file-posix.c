@@ -160,8 +160,11 @@ typedef struct BDRVRawState {
     bool discard_zeroes:1;
     bool use_linux_aio:1;
     bool use_linux_io_uring:1;
+    bool use_io_uring_fixed:1;
+    unsigned int luring_flags;  /* LURING_* flags of the io_uring ring */
     bool page_cache_inconsistent:1;
     bool has_fallocate;
+    bool has_clone_range;
     bool needs_alignment;
     bool drop_cache;
     bool check_cache_dropped;
@@ -519,6 +522,26 @@ static QemuOptsList raw_runtime_opts = {
             .type = QEMU_OPT_STRING,
             .help = "host AIO implementation (threads, native, io_uring)",
         },
+#ifdef CONFIG_LINUX_IO_URING
+        {
+            .name = "aio-fixed",
+            .type = QEMU_OPT_BOOL,
+            .help = "register guest memory and the file with io_uring "
+                    "(default: off)",
+        },
+        {
+            .name = "aio-sqpoll",
+            .type = QEMU_OPT_BOOL,
+            .help = "let a kernel thread poll the io_uring submission queue "
+                    "(default: off)",
+        },
+        {
+            .name = "aio-iopoll",
+            .type = QEMU_OPT_BOOL,
+            .help = "busy-poll for io_uring completions, requires "
+                    "cache.direct=on (default: off)",
+        },
+#endif
         {
             .name = "locking",
             .type = QEMU_OPT_STRING,
@@ -691,8 +714,29 @@ static int raw_open_common(BlockDriverState *bs, QDict *options,
 #endif /* !defined(CONFIG_LINUX_AIO) */
 
 #ifdef CONFIG_LINUX_IO_URING
+    if (qemu_opt_get_bool(opts, "aio-sqpoll", false)) {
+        s->luring_flags |= LURING_SQPOLL;
+    }
+    if (qemu_opt_get_bool(opts, "aio-iopoll", false)) {
+        s->luring_flags |= LURING_IOPOLL;
+    }
+    if ((qemu_opt_get_bool(opts, "aio-fixed", false) || s->luring_flags) &&
+        !s->use_linux_io_uring) {
+        error_setg(errp, "aio-fixed, aio-sqpoll and aio-iopoll require "
+                         "aio=io_uring");
+        ret = -EINVAL;
+        goto fail;
+    }
+    /* Polled completions are only implemented for direct I/O */
+    if ((s->luring_flags & LURING_IOPOLL) && !(s->open_flags & O_DIRECT)) {
+        error_setg(errp, "aio-iopoll was specified, but it requires "
+                         "cache.direct=on, which was not specified.");
+        ret = -EINVAL;
+        goto fail;
+    }
     if (s->use_linux_io_uring) {
-        if (!aio_setup_linux_io_uring(bdrv_get_aio_context(bs), errp)) {
+        if (!aio_setup_linux_io_uring(bdrv_get_aio_context(bs),
+                                      s->luring_flags, errp)) {
             error_prepend(errp, "Unable to use io_uring: ");
             goto fail;
         }
@@ -708,6 +752,7 @@ static int raw_open_common(BlockDriverState *bs, QDict *options,
 
     s->has_discard = true;
     s->has_write_zeroes = true;
+    s->has_clone_range = true;
     if ((bs->open_flags & BDRV_O_NOCACHE) != 0 && !dio_byte_aligned(s->fd)) {
         s->needs_alignment = true;
     }
@@ -784,6 +829,16 @@ static int raw_open_common(BlockDriverState *bs, QDict *options,
         /* When extending regular files, we get zeros from the OS */
         bs->supported_truncate_flags = BDRV_REQ_ZERO_WRITE;
     }
+
+#ifdef CONFIG_LINUX_IO_URING
+    if (qemu_opt_get_bool(opts, "aio-fixed", false)) {
+        if (!luring_register_guest_ram(errp)) {
+            ret = -EINVAL;
+            goto fail;
+        }
+        s->use_io_uring_fixed = true;
+    }
+#endif
     ret = 0;
 fail:
     if (ret < 0 && s->fd != -1) {
@@ -1146,6 +1201,11 @@ static void raw_reopen_commit(BDRVReopenState *state)
     s->check_cache_dropped = rs->check_cache_dropped;
     s->open_flags = rs->open_flags;
 
+#ifdef CONFIG_LINUX_IO_URING
+    if (s->use_io_uring_fixed) {
+        luring_forget_fd(s->fd);
+    }
+#endif
     qemu_close(s->fd);
     s->fd = rs->fd;
 
@@ -1742,6 +1802,36 @@ static off_t copy_file_range(int in_fd, off_t *in_off, int out_fd,
 }
 #endif
 
+#ifdef FICLONERANGE
+/*
+ * If both files live on a filesystem that can share extents, make the
+ * target reference the source data instead of copying it.  Ranges that
+ * are not aligned to the filesystem block size fail with EINVAL and take
+ * the copy path instead.
+ */
+static bool raw_try_clone_range(RawPosixAIOData *aiocb)
+{
+    BDRVRawState *s = aiocb->bs->opaque;
+    struct file_clone_range fcr = {
+        .src_fd = aiocb->aio_fildes,
+        .src_offset = aiocb->aio_offset,
+        .src_length = aiocb->aio_nbytes,
+        .dest_offset = aiocb->copy_range.aio_offset2,
+    };
+
+    if (!s->has_clone_range) {
+        return false;
+    }
+    if (ioctl(aiocb->copy_range.aio_fd2, FICLONERANGE, &fcr) == 0) {
+        return true;
+    }
+    if (errno == EOPNOTSUPP || errno == ENOTTY || errno == EXDEV) {
+        s->has_clone_range = false;
+    }
+    return false;
+}
+#endif
+
 static int handle_aiocb_copy_range(void *opaque)
 {
     RawPosixAIOData *aiocb = opaque;
@@ -1749,6 +1839,12 @@ static int handle_aiocb_copy_range(void *opaque)
     off_t in_off = aiocb->aio_offset;
     off_t out_off = aiocb->copy_range.aio_offset2;
 
+#ifdef FICLONERANGE
+    if (raw_try_clone_range(aiocb)) {
+        return 0;
+    }
+#endif
+
     while (bytes) {
         ssize_t ret = copy_file_range(aiocb->aio_fildes, &in_off,
                                       aiocb->copy_range.aio_fd2, &out_off,
@@ -1983,19 +2079,91 @@ out:
     return result;
 }
 
+/*
+ * Requests go to the thread pool, Linux AIO or io_uring context of the
+ * AioContext that submits them rather than to those of the node's own
+ * context, so that several iothreads can drive the same node at once.
+ */
 static int coroutine_fn raw_thread_pool_submit(BlockDriverState *bs,
+                                               ThreadPoolPriority prio,
                                                ThreadPoolFunc func, void *arg)
 {
-    /* @bs can be NULL, bdrv_get_aio_context() returns the main context then */
-    ThreadPool *pool = aio_get_thread_pool(bdrv_get_aio_context(bs));
-    return thread_pool_submit_co(pool, func, arg);
+    ThreadPool *pool = aio_get_thread_pool(qemu_get_current_aio_context());
+    return thread_pool_submit_co_prio(pool, prio, func, arg);
+}
+
+#ifdef CONFIG_LINUX_AIO
+static LinuxAioState *raw_get_linux_aio_in(BDRVRawState *s,
+                                            AioContext *ctx)
+{
+    Error *local_err = NULL;
+    LinuxAioState *aio;
+
+    if (!s->use_linux_aio) {
+        return NULL;
+    }
+
+    aio = aio_setup_linux_aio(ctx, &local_err);
+    if (!aio) {
+        error_reportf_err(local_err, "Unable to use native AIO, "
+                                     "falling back to thread pool: ");
+        s->use_linux_aio = false;
+    }
+    return aio;
+}
+
+static LinuxAioState *raw_get_linux_aio(BDRVRawState *s)
+{
+    return raw_get_linux_aio_in(s, qemu_get_current_aio_context());
+}
+#endif
+
+#ifdef CONFIG_LINUX_IO_URING
+/*
+ * IOPOLL rings cannot run fsync, so pass flush = true to get a ring
+ * with interrupt-driven completions for it.
+ */
+static LuringState *raw_get_linux_io_uring_in(BDRVRawState *s,
+                                              AioContext *ctx, bool flush)
+{
+    Error *local_err = NULL;
+    unsigned int flags = s->luring_flags;
+    LuringState *aio;
+
+    if (!s->use_linux_io_uring) {
+        return NULL;
+    }
+
+    if (flush) {
+        flags &= ~LURING_IOPOLL;
+    }
+    aio = aio_setup_linux_io_uring(ctx, flags, &local_err);
+    if (!aio) {
+        error_reportf_err(local_err, "Unable to use linux io_uring, "
+                                     "falling back to thread pool: ");
+        s->use_linux_io_uring = false;
+    }
+    return aio;
+}
+
+static LuringState *raw_get_linux_io_uring(BDRVRawState *s, bool flush)
+{
+    return raw_get_linux_io_uring_in(s, qemu_get_current_aio_context(),
+                                     flush);
 }
+#endif
 
 static int coroutine_fn raw_co_prw(BlockDriverState *bs, uint64_t offset,
                                    uint64_t bytes, QEMUIOVector *qiov, int type)
 {
     BDRVRawState *s = bs->opaque;
     RawPosixAIOData acb;
+#ifdef CONFIG_LINUX_IO_URING
+    LuringState *luring;
+#endif
+#ifdef CONFIG_LINUX_AIO
+    LinuxAioState *laio;
+#endif
 
     if (fd_open(bs) < 0)
         return -EIO;
@@ -2009,16 +2177,15 @@ static int coroutine_fn raw_co_prw(BlockDriverState *bs, uint64_t offset,
     if (s->needs_alignment && !bdrv_qiov_is_aligned(bs, qiov)) {
         type |= QEMU_AIO_MISALIGNED;
 #ifdef CONFIG_LINUX_IO_URING
-    } else if (s->use_linux_io_uring) {
-        LuringState *aio = aio_get_linux_io_uring(bdrv_get_aio_context(bs));
+    } else if ((luring = raw_get_linux_io_uring(s, false))) {
         assert(qiov->size == bytes);
-        return luring_co_submit(bs, aio, s->fd, offset, qiov, type);
+        return luring_co_submit(bs, luring, s->fd, offset, qiov, type,
+                                s->use_io_uring_fixed);
 #endif
 #ifdef CONFIG_LINUX_AIO
-    } else if (s->use_linux_aio) {
-        LinuxAioState *aio = aio_get_linux_aio(bdrv_get_aio_context(bs));
+    } else if ((laio = raw_get_linux_aio(s))) {
         assert(qiov->size == bytes);
-        return laio_co_submit(bs, aio, s->fd, offset, qiov, type);
+        return laio_co_submit(bs, laio, s->fd, offset, qiov, type);
 #endif
     }
 
@@ -2035,7 +2202,8 @@ static int coroutine_fn raw_co_prw(BlockDriverState *bs, uint64_t offset,
     };
 
     assert(qiov->size == bytes);
-    return raw_thread_pool_submit(bs, handle_aiocb_rw, &acb);
+    return raw_thread_pool_submit(bs, THREAD_POOL_PRIO_BULK,
+                                  handle_aiocb_rw, &acb);
 }
 
 static int coroutine_fn raw_co_preadv(BlockDriverState *bs, uint64_t offset,
@@ -2053,19 +2221,62 @@ static int coroutine_fn raw_co_pwritev(BlockDriverState *bs, uint64_t offset,
     return raw_co_prw(bs, offset, bytes, qiov, QEMU_AIO_WRITE);
 }
 
+/*
+ * Fast path for aligned requests that Linux AIO or io_uring can take
+ * without a coroutine; everything else goes through raw_co_prw().
+ */
+static int raw_aio_prw_direct(BlockDriverState *bs, uint64_t offset,
+                              QEMUIOVector *qiov, bool is_write,
+                              AioContext *ctx,
+                              BlockCompletionFunc *cb, void *opaque)
+{
+    BDRVRawState *s = bs->opaque;
+#ifdef CONFIG_LINUX_IO_URING
+    LuringState *luring;
+#endif
+#ifdef CONFIG_LINUX_AIO
+    LinuxAioState *laio;
+#endif
+
+    if (fd_open(bs) < 0 || bs->sg ||
+        (s->needs_alignment && !bdrv_qiov_is_aligned(bs, qiov))) {
+        return -ENOTSUP;
+    }
+
+#ifdef CONFIG_LINUX_IO_URING
+    if ((luring = raw_get_linux_io_uring_in(s, ctx, false))) {
+        return luring_submit(bs, luring, s->fd, offset, qiov,
+                             is_write ? QEMU_AIO_WRITE : QEMU_AIO_READ,
+                             s->use_io_uring_fixed, cb, opaque);
+    }
+#endif
+#ifdef CONFIG_LINUX_AIO
+    if ((laio = raw_get_linux_aio_in(s, ctx))) {
+        return laio_submit(bs, laio, s->fd, offset, qiov,
+                           is_write ? QEMU_AIO_WRITE : QEMU_AIO_READ,
+                           cb, opaque);
+    }
+#endif
+    return -ENOTSUP;
+}
+
 static void raw_aio_plug(BlockDriverState *bs)
 {
     BDRVRawState __attribute__((unused)) *s = bs->opaque;
 #ifdef CONFIG_LINUX_AIO
     if (s->use_linux_aio) {
-        LinuxAioState *aio = aio_get_linux_aio(bdrv_get_aio_context(bs));
-        laio_io_plug(bs, aio);
+        LinuxAioState *aio = raw_get_linux_aio(s);
+        if (aio) {
+            laio_io_plug(bs, aio);
+        }
     }
 #endif
 #ifdef CONFIG_LINUX_IO_URING
     if (s->use_linux_io_uring) {
-        LuringState *aio = aio_get_linux_io_uring(bdrv_get_aio_context(bs));
-        luring_io_plug(bs, aio);
+        LuringState *aio = raw_get_linux_io_uring(s, false);
+        if (aio) {
+            luring_io_plug(bs, aio);
+        }
     }
 #endif
 }
@@ -2075,14 +2286,18 @@ static void raw_aio_unplug(BlockDriverState *bs)
     BDRVRawState __attribute__((unused)) *s = bs->opaque;
 #ifdef CONFIG_LINUX_AIO
     if (s->use_linux_aio) {
-        LinuxAioState *aio = aio_get_linux_aio(bdrv_get_aio_context(bs));
-        laio_io_unplug(bs, aio);
+        LinuxAioState *aio = raw_get_linux_aio(s);
+        if (aio) {
+            laio_io_unplug(bs, aio);
+        }
     }
 #endif
 #ifdef CONFIG_LINUX_IO_URING
     if (s->use_linux_io_uring) {
-        LuringState *aio = aio_get_linux_io_uring(bdrv_get_aio_context(bs));
-        luring_io_unplug(bs, aio);
+        LuringState *aio = raw_get_linux_io_uring(s, false);
+        if (aio) {
+            luring_io_unplug(bs, aio);
+        }
     }
 #endif
 }
@@ -2106,11 +2321,15 @@ static int raw_co_flush_to_disk(BlockDriverState *bs)
 
 #ifdef CONFIG_LINUX_IO_URING
     if (s->use_linux_io_uring) {
-        LuringState *aio = aio_get_linux_io_uring(bdrv_get_aio_context(bs));
-        return luring_co_submit(bs, aio, s->fd, 0, NULL, QEMU_AIO_FLUSH);
+        LuringState *aio = raw_get_linux_io_uring(s, true);
+        if (aio) {
+            return luring_co_submit(bs, aio, s->fd, 0, NULL, QEMU_AIO_FLUSH,
+                                    s->use_io_uring_fixed);
+        }
     }
 #endif
-    return raw_thread_pool_submit(bs, handle_aiocb_flush, &acb);
+    return raw_thread_pool_submit(bs, THREAD_POOL_PRIO_LATENCY,
+                                  handle_aiocb_flush, &acb);
 }
 
 static void raw_aio_attach_aio_context(BlockDriverState *bs,
@@ -2130,7 +2349,8 @@ static void raw_aio_attach_aio_context(BlockDriverState *bs,
 #ifdef CONFIG_LINUX_IO_URING
     if (s->use_linux_io_uring) {
         Error *local_err = NULL;
-        if (!aio_setup_linux_io_uring(new_context, &local_err)) {
+        if (!aio_setup_linux_io_uring(new_context, s->luring_flags,
+                                      &local_err)) {
             error_reportf_err(local_err, "Unable to use linux io_uring, "
                                          "falling back to thread pool: ");
             s->use_linux_io_uring = false;
@@ -2143,12 +2363,41 @@ static void raw_close(BlockDriverState *bs)
 {
     BDRVRawState *s = bs->opaque;
 
+#ifdef CONFIG_LINUX_IO_URING
+    if (s->use_io_uring_fixed) {
+        luring_unregister_guest_ram();
+        if (s->fd >= 0) {
+            luring_forget_fd(s->fd);
+        }
+        s->use_io_uring_fixed = false;
+    }
+#endif
     if (s->fd >= 0) {
         qemu_close(s->fd);
         s->fd = -1;
     }
 }
 
+#ifdef CONFIG_LINUX_IO_URING
+static void raw_register_buf(BlockDriverState *bs, void *host, size_t size)
+{
+    BDRVRawState *s = bs->opaque;
+
+    if (s->use_io_uring_fixed) {
+        luring_register_buf(host, size);
+    }
+}
+
+static void raw_unregister_buf(BlockDriverState *bs, void *host)
+{
+    BDRVRawState *s = bs->opaque;
+
+    if (s->use_io_uring_fixed) {
+        luring_unregister_buf(host);
+    }
+}
+#endif
+
 /**
  * Truncates the given regular file @fd to @offset and, when growing, fills the
  * new space according to @prealloc.
@@ -2172,7 +2421,8 @@ raw_regular_truncate(BlockDriverState *bs, int fd, int64_t offset,
         },
     };
 
-    return raw_thread_pool_submit(bs, handle_aiocb_truncate, &acb);
+    return raw_thread_pool_submit(bs, THREAD_POOL_PRIO_BULK,
+                                  handle_aiocb_truncate, &acb);
 }
 
 static int coroutine_fn raw_co_truncate(BlockDriverState *bs, int64_t offset,
@@ -2922,7 +3172,8 @@ raw_do_pdiscard(BlockDriverState *bs, int64_t offset, int bytes, bool blkdev)
         acb.aio_type |= QEMU_AIO_BLKDEV;
     }
 
-    ret = raw_thread_pool_submit(bs, handle_aiocb_discard, &acb);
+    ret = raw_thread_pool_submit(bs, THREAD_POOL_PRIO_LATENCY,
+                                 handle_aiocb_discard, &acb);
     raw_account_discard(s, bytes, ret);
     return ret;
 }
@@ -2940,6 +3191,7 @@ raw_do_pwrite_zeroes(BlockDriverState *bs, int64_t offset, int bytes,
     BDRVRawState *s = bs->opaque;
     RawPosixAIOData acb;
     ThreadPoolFunc *handler;
+    ThreadPoolPriority prio = THREAD_POOL_PRIO_BULK;
 
 #ifdef CONFIG_FALLOCATE
     if (offset + bytes > bs->total_sectors * BDRV_SECTOR_SIZE) {
@@ -2997,7 +3249,17 @@ raw_do_pwrite_zeroes(BlockDriverState *bs, int64_t offset, int bytes,
         handler = handle_aiocb_write_zeroes;
     }
 
-    return raw_thread_pool_submit(bs, handler, &acb);
+    /*
+     * Unless it may fall back to writing, this is a single fallocate().
+     * On block devices BLKZEROOUT may write the zeroes physically even
+     * when unmapping is allowed.
+     */
+    if ((flags & BDRV_REQ_NO_FALLBACK) ||
+        ((flags & BDRV_REQ_MAY_UNMAP) && !blkdev)) {
+        prio = THREAD_POOL_PRIO_LATENCY;
+    }
+
+    return raw_thread_pool_submit(bs, prio, handler, &acb);
 }
 
 static int coroutine_fn raw_co_pwrite_zeroes(
@@ -3012,6 +3274,14 @@ static int raw_get_info(BlockDriverState *bs, BlockDriverInfo *bdi)
     return 0;
 }
 
+static int raw_get_host_fd(BlockDriverState *bs, int64_t *fd_offset)
+{
+    BDRVRawState *s = bs->opaque;
+
+    *fd_offset = 0;
+    return s->fd;
+}
+
 static BlockStatsSpecificFile get_blockstats_specific_file(BlockDriverState *bs)
 {
     BDRVRawState *s = bs->opaque;
@@ -3215,7 +3485,8 @@ static int coroutine_fn raw_co_copy_range_to(BlockDriverState *bs,
         },
     };
 
-    return raw_thread_pool_submit(bs, handle_aiocb_copy_range, &acb);
+    return raw_thread_pool_submit(bs, THREAD_POOL_PRIO_BULK,
+                                  handle_aiocb_copy_range, &acb);
 }
 
 BlockDriver bdrv_file = {
@@ -3240,18 +3511,25 @@ BlockDriver bdrv_file = {
 
     .bdrv_co_preadv         = raw_co_preadv,
     .bdrv_co_pwritev        = raw_co_pwritev,
+    .bdrv_aio_prw_direct    = raw_aio_prw_direct,
     .bdrv_co_flush_to_disk  = raw_co_flush_to_disk,
     .bdrv_co_pdiscard       = raw_co_pdiscard,
     .bdrv_co_copy_range_from = raw_co_copy_range_from,
     .bdrv_co_copy_range_to  = raw_co_copy_range_to,
     .bdrv_refresh_limits = raw_refresh_limits,
+    .supports_multiqueue = true,
     .bdrv_io_plug = raw_aio_plug,
     .bdrv_io_unplug = raw_aio_unplug,
+#ifdef CONFIG_LINUX_IO_URING
+    .bdrv_register_buf = raw_register_buf,
+    .bdrv_unregister_buf = raw_unregister_buf,
+#endif
     .bdrv_attach_aio_context = raw_aio_attach_aio_context,
 
     .bdrv_co_truncate = raw_co_truncate,
     .bdrv_getlength = raw_getlength,
     .bdrv_get_info = raw_get_info,
+    .bdrv_get_host_fd = raw_get_host_fd,
     .bdrv_get_allocated_file_size
                         = raw_get_allocated_file_size,
     .bdrv_get_specific_stats = raw_get_specific_stats,
@@ -3553,7 +3831,8 @@ hdev_co_ioctl(BlockDriverState *bs, unsigned long int req, void *buf)
         },
     };
 
-    return raw_thread_pool_submit(bs, handle_aiocb_ioctl, &acb);
+    return raw_thread_pool_submit(bs, THREAD_POOL_PRIO_BULK,
+                                  handle_aiocb_ioctl, &acb);
 }
 #endif /* linux */
 
@@ -3614,18 +3893,25 @@ static BlockDriver bdrv_host_device = {
 
     .bdrv_co_preadv         = raw_co_preadv,
     .bdrv_co_pwritev        = raw_co_pwritev,
+    .bdrv_aio_prw_direct    = raw_aio_prw_direct,
     .bdrv_co_flush_to_disk  = raw_co_flush_to_disk,
     .bdrv_co_pdiscard       = hdev_co_pdiscard,
     .bdrv_co_copy_range_from = raw_co_copy_range_from,
     .bdrv_co_copy_range_to  = raw_co_copy_range_to,
     .bdrv_refresh_limits = raw_refresh_limits,
+    .supports_multiqueue = true,
     .bdrv_io_plug = raw_aio_plug,
     .bdrv_io_unplug = raw_aio_unplug,
+#ifdef CONFIG_LINUX_IO_URING
+    .bdrv_register_buf = raw_register_buf,
+    .bdrv_unregister_buf = raw_unregister_buf,
+#endif
     .bdrv_attach_aio_context = raw_aio_attach_aio_context,
 
     .bdrv_co_truncate       = raw_co_truncate,
     .bdrv_getlength	= raw_getlength,
     .bdrv_get_info = raw_get_info,
+    .bdrv_get_host_fd = raw_get_host_fd,
     .bdrv_get_allocated_file_size
                         = raw_get_allocated_file_size,
     .bdrv_get_specific_stats = hdev_get_specific_stats,
@@ -707,10 +707,23 @@ static void tracked_request_end(BdrvTrackedRequest *req)
 
     qemu_co_mutex_lock(&req->bs->reqs_lock);
     QLIST_REMOVE(req, list);
+    interval_tree_remove(&req->overlap_node, &req->bs->tracked_overlaps);
     qemu_co_queue_restart_all(&req->wait_queue);
     qemu_co_mutex_unlock(&req->bs->reqs_lock);
 }
 
+/*
+ * Key the overlap range of @req in the interval tree.  Zero-length
+ * requests are keyed as one byte: that can only report more candidates,
+ * which tracked_request_overlaps() then filters out.
+ */
+static void tracked_request_set_overlap_node(BdrvTrackedRequest *req)
+{
+    req->overlap_node.start = req->overlap_offset;
+    req->overlap_node.last = req->overlap_offset +
+                             MAX(req->overlap_bytes, 1) - 1;
+}
+
 /**
  * Add an active request to the tracked requests list
  */
@@ -734,9 +747,11 @@ static void tracked_request_begin(BdrvTrackedRequest *req,
     };
 
     qemu_co_queue_init(&req->wait_queue);
+    tracked_request_set_overlap_node(req);
 
     qemu_co_mutex_lock(&bs->reqs_lock);
     QLIST_INSERT_HEAD(&bs->tracked_requests, req, list);
+    interval_tree_insert(&req->overlap_node, &bs->tracked_overlaps);
     qemu_co_mutex_unlock(&bs->reqs_lock);
 }
 
@@ -760,9 +775,16 @@ static bool tracked_request_overlaps(BdrvTrackedRequest *req,
 static BdrvTrackedRequest *
 bdrv_find_conflicting_request(BdrvTrackedRequest *self)
 {
-    BdrvTrackedRequest *req;
+    IntervalTreeNode *node;
+    uint64_t start = self->overlap_node.start;
+    uint64_t last = self->overlap_node.last;
+
+    for (node = interval_tree_iter_first(&self->bs->tracked_overlaps,
+                                         start, last);
+         node; node = interval_tree_iter_next(node, start, last)) {
+        BdrvTrackedRequest *req =
+            container_of(node, BdrvTrackedRequest, overlap_node);
 
-    QLIST_FOREACH(req, &self->bs->tracked_requests, list) {
         if (req == self || (!req->serialising && !self->serialising)) {
             continue;
         }
@@ -790,20 +812,94 @@ bdrv_find_conflicting_request(BdrvTrackedRequest *self)
     return NULL;
 }
 
+/*
+ * Start tracing the request run by the current coroutine.  The trace
+ * covers everything until the matching bdrv_trace_end().
+ */
+void coroutine_fn bdrv_trace_start(BdrvTraceFrame *frame)
+{
+    *frame = (BdrvTraceFrame) {
+        .start_ns = get_clock(),
+    };
+    qemu_coroutine_set_trace(&frame->co_trace);
+}
+
+/*
+ * Enter @bs in the trace of the current request, if it is being traced.
+ * Return true if it is; bdrv_trace_end() must then be called when the
+ * request to @bs is complete.
+ */
+bool coroutine_fn bdrv_trace_begin(BdrvTraceFrame *frame,
+                                   BlockDriverState *bs)
+{
+    CoroutineTrace *co_trace = qemu_coroutine_get_trace();
+
+    if (!co_trace) {
+        return false;
+    }
+
+    *frame = (BdrvTraceFrame) {
+        .bs = bs,
+        .start_ns = get_clock(),
+        .parent = container_of(co_trace, BdrvTraceFrame, co_trace),
+    };
+    qemu_coroutine_set_trace(&frame->co_trace);
+    return true;
+}
+
+void coroutine_fn bdrv_trace_end(BdrvTraceFrame *frame)
+{
+    int64_t total_ns = get_clock() - frame->start_ns;
+    BlockDriverState *bs = frame->bs;
+
+    if (bs) {
+        BdrvTraceStats *stats = &bs->trace_stats;
+        int64_t self_ns = total_ns - frame->child_ns -
+                          frame->serialising_wait_ns -
+                          frame->co_trace.lock_wait_ns;
+
+        stat64_add(&stats->requests, 1);
+        stat64_add(&stats->total_ns, total_ns);
+        stat64_add(&stats->self_ns, MAX(self_ns, 0));
+        stat64_add(&stats->serialising_wait_ns, frame->serialising_wait_ns);
+        stat64_add(&stats->lock_wait_ns, frame->co_trace.lock_wait_ns);
+    }
+
+    if (frame->parent) {
+        frame->parent->child_ns += total_ns;
+    }
+    qemu_coroutine_set_trace(frame->parent ? &frame->parent->co_trace : NULL);
+}
+
 /* Called with self->bs->reqs_lock held */
 static bool coroutine_fn
 bdrv_wait_serialising_requests_locked(BdrvTrackedRequest *self)
 {
+    CoroutineTrace *co_trace = qemu_coroutine_get_trace();
     BdrvTrackedRequest *req;
     bool waited = false;
+    int64_t start_ns = 0, lock_wait_ns = 0;
 
     while ((req = bdrv_find_conflicting_request(self))) {
+        if (co_trace && !waited) {
+            start_ns = get_clock();
+            lock_wait_ns = co_trace->lock_wait_ns;
+        }
         self->waiting_for = req;
         qemu_co_queue_wait(&req->wait_queue, &self->bs->reqs_lock);
         self->waiting_for = NULL;
         waited = true;
     }
 
+    if (co_trace && waited) {
+        BdrvTraceFrame *frame = container_of(co_trace, BdrvTraceFrame,
+                                             co_trace);
+
+        /* Taking reqs_lock again is already accounted as a lock wait */
+        frame->serialising_wait_ns += get_clock() - start_ns -
+                                      (co_trace->lock_wait_ns - lock_wait_ns);
+    }
+
     return waited;
 }
 
@@ -822,8 +918,15 @@ static void tracked_request_set_serialising(BdrvTrackedRequest *req,
         req->serialising = true;
     }
 
-    req->overlap_offset = MIN(req->overlap_offset, overlap_offset);
-    req->overlap_bytes = MAX(req->overlap_bytes, overlap_bytes);
+    if (overlap_offset < req->overlap_offset ||
+        overlap_bytes > req->overlap_bytes) {
+        req->overlap_offset = MIN(req->overlap_offset, overlap_offset);
+        req->overlap_bytes = MAX(req->overlap_bytes, overlap_bytes);
+
+        interval_tree_remove(&req->overlap_node, &req->bs->tracked_overlaps);
+        tracked_request_set_overlap_node(req);
+        interval_tree_insert(&req->overlap_node, &req->bs->tracked_overlaps);
+    }
 }
 
 /**
@@ -1434,6 +1537,9 @@ static int coroutine_fn bdrv_co_do_copy_on_readv(BdrvChild *child,
                                           BDRV_REQ_WRITE_UNCHANGED);
             }
 
+            /* The range is now allocated in @bs rather than below it */
+            bdrv_chain_status_invalidate(bs, cluster_offset, pnum);
+
             if (ret < 0) {
                 /* It might be okay to ignore write errors for guest
                  * requests.  If this is a deliberate copy-on-read
@@ -1774,6 +1880,8 @@ int coroutine_fn bdrv_co_preadv_part(BdrvChild *child,
     BlockDriverState *bs = child->bs;
     BdrvTrackedRequest req;
     BdrvRequestPadding pad;
+    BdrvTraceFrame frame;
+    bool traced;
     int ret;
 
     trace_bdrv_co_preadv_part(bs, offset, bytes, flags);
@@ -1812,11 +1920,15 @@ int coroutine_fn bdrv_co_preadv_part(BdrvChild *child,
         return ret;
     }
 
+    traced = bdrv_trace_begin(&frame, bs);
     tracked_request_begin(&req, bs, offset, bytes, BDRV_TRACKED_READ);
     ret = bdrv_aligned_preadv(child, &req, offset, bytes,
                               bs->bl.request_alignment,
                               qiov, qiov_offset, flags);
     tracked_request_end(&req);
+    if (traced) {
+        bdrv_trace_end(&frame);
+    }
     bdrv_dec_in_flight(bs);
 
     bdrv_padding_destroy(&pad);
@@ -2002,6 +2114,12 @@ bdrv_co_write_req_finish(BdrvChild *child, int64_t offset, int64_t bytes,
 
     qatomic_inc(&bs->write_gen);
 
+    if (req->type == BDRV_TRACKED_TRUNCATE) {
+        bdrv_chain_status_invalidate(bs, 0, INT64_MAX);
+    } else {
+        bdrv_chain_status_invalidate(bs, offset, bytes);
+    }
+
     /*
      * Discard cannot extend the image, but in error handling cases, such as
      * when reverting a qcow2 cluster allocation, the discarded range can pass
@@ -2201,6 +2319,8 @@ int coroutine_fn bdrv_co_pwritev_part(BdrvChild *child,
     BdrvTrackedRequest req;
     uint64_t align = bs->bl.request_alignment;
     BdrvRequestPadding pad;
+    BdrvTraceFrame frame;
+    bool traced;
     int ret;
     bool padded = false;
 
@@ -2248,6 +2368,7 @@ int coroutine_fn bdrv_co_pwritev_part(BdrvChild *child,
     }
 
     bdrv_inc_in_flight(bs);
+    traced = bdrv_trace_begin(&frame, bs);
     tracked_request_begin(&req, bs, offset, bytes, BDRV_TRACKED_WRITE);
 
     if (flags & BDRV_REQ_ZERO_WRITE) {
@@ -2274,6 +2395,9 @@ int coroutine_fn bdrv_co_pwritev_part(BdrvChild *child,
 
 out:
     tracked_request_end(&req);
+    if (traced) {
+        bdrv_trace_end(&frame);
+    }
     bdrv_dec_in_flight(bs);
 
     return ret;
@@ -2292,6 +2416,75 @@ int coroutine_fn bdrv_co_pwrite_zeroes(BdrvChild *child, int64_t offset,
                            BDRV_REQ_ZERO_WRITE | flags);
 }
 
+/*
+ * Can a request skip tracking, serialisation, padding and the write
+ * notifiers of @child's node?  Requests aligned to a request_alignment of
+ * at most one sector never need read-modify-write, so they cannot
+ * interact with serialising requests started after them.
+ */
+static bool bdrv_can_prw_direct(BdrvChild *child, int64_t offset,
+                                int64_t bytes, bool is_write)
+{
+    BlockDriverState *bs = child->bs;
+    uint64_t align = bs->bl.request_alignment;
+
+    if (!bs->drv || !bs->drv->bdrv_aio_prw_direct ||
+        (bs->open_flags & (BDRV_O_INACTIVE | BDRV_O_NO_IO))) {
+        return false;
+    }
+    if (align > BDRV_SECTOR_SIZE || !QEMU_IS_ALIGNED(offset | bytes, align) ||
+        (bs->bl.max_transfer && bytes > bs->bl.max_transfer) ||
+        offset + bytes > bs->total_sectors * BDRV_SECTOR_SIZE) {
+        return false;
+    }
+    if (qatomic_read(&bs->quiesce_counter) ||
+        qatomic_read(&bs->copy_on_read) ||
+        qatomic_read(&bs->serialising_in_flight)) {
+        return false;
+    }
+    if (is_write &&
+        (!(child->perm & BLK_PERM_WRITE) ||
+         bs->detect_zeroes != BLOCKDEV_DETECT_ZEROES_OPTIONS_OFF ||
+         !QLIST_EMPTY(&bs->before_write_notifiers.notifiers) ||
+         !QLIST_EMPTY(&bs->dirty_bitmaps))) {
+        return false;
+    }
+    return true;
+}
+
+/*
+ * Start a read or write of @qiov at @offset on @child without a coroutine,
+ * if neither the node nor the request need anything from the generic
+ * request path.  The request completes in @ctx, where @cb is called; @cb
+ * may also be called before the function returns.
+ *
+ * The caller must keep its parent from being drained until @cb runs; the
+ * request is not counted in the node's in_flight.
+ *
+ * Returns 0 if @cb will be called, or -ENOTSUP if the request must go
+ * through bdrv_co_preadv() or bdrv_co_pwritev() instead.
+ */
+int bdrv_aio_prw_direct(BdrvChild *child, int64_t offset,
+                        QEMUIOVector *qiov, bool is_write, AioContext *ctx,
+                        BlockCompletionFunc *cb, void *opaque)
+{
+    BlockDriverState *bs = child->bs;
+
+    if (!bdrv_can_prw_direct(child, offset, qiov->size, is_write)) {
+        return -ENOTSUP;
+    }
+
+    trace_bdrv_aio_prw_direct(bs, offset, qiov->size, is_write);
+    if (is_write) {
+        /* What bdrv_co_write_req_finish() does, minus growing the image */
+        qatomic_inc(&bs->write_gen);
+        bdrv_chain_status_invalidate(bs, offset, qiov->size);
+        stat64_max(&bs->wr_highest_offset, offset + qiov->size);
+    }
+    return bs->drv->bdrv_aio_prw_direct(bs, offset, qiov, is_write, ctx,
+                                        cb, opaque);
+}
+
 /*
  * Flush ALL BDSes regardless of if they are reachable via a BlkBackend or not.
  */
@@ -2519,6 +2712,212 @@ early_out:
     return ret;
 }
 
+/*
+ * In a deep backing chain, bdrv_co_common_block_status_above() queries
+ * every layer down to the one that owns a range, which for data that was
+ * never overwritten costs one metadata lookup per layer.  Each node thus
+ * remembers where earlier walks from it ended, and later queries of a
+ * covered offset only ask that layer.  Writes, discards and graph changes
+ * anywhere in the chain drop the entries they may have made stale.
+ */
+
+/* Shallower walks are about as cheap as asking the cache */
+#define BDRV_CHAIN_STATUS_MIN_DEPTH 3
+#define BDRV_CHAIN_STATUS_MAX_ENTRIES 256
+
+typedef struct BdrvChainStatus {
+    IntervalTreeNode node;          /* in BlockDriverState.chain_status */
+    QTAILQ_ENTRY(BdrvChainStatus) lru;
+    BlockDriverState *layer;        /* Layer the walk ended at */
+    bool allocated;                 /* false if no layer allocates the range */
+} BdrvChainStatus;
+
+/* Called with bs->chain_status_lock held */
+static void bdrv_chain_status_drop(BlockDriverState *bs,
+                                   BdrvChainStatus *entry)
+{
+    interval_tree_remove(&entry->node, &bs->chain_status);
+    QTAILQ_REMOVE(&bs->chain_status_lru, entry, lru);
+    bs->chain_status_entries--;
+    g_free(entry);
+}
+
+/* Called with bs->chain_status_lock held */
+static BdrvChainStatus *bdrv_chain_status_find(BlockDriverState *bs,
+                                               int64_t offset)
+{
+    IntervalTreeNode *node;
+
+    node = interval_tree_iter_first(&bs->chain_status, offset, offset);
+    return node ? container_of(node, BdrvChainStatus, node) : NULL;
+}
+
+/*
+ * Record that a walk from @bs that started when chain_status_gen was @gen
+ * ended at @layer, at @depth, for [@offset, @offset + @bytes).
+ */
+static void bdrv_chain_status_add(BlockDriverState *bs, unsigned int gen,
+                                  int64_t offset, int64_t bytes,
+                                  BlockDriverState *layer, bool allocated,
+                                  int depth)
+{
+    BdrvChainStatus *entry;
+    IntervalTreeNode *node;
+    uint64_t last = offset + bytes - 1;
+
+    if (depth < BDRV_CHAIN_STATUS_MIN_DEPTH || bytes <= 0) {
+        return;
+    }
+
+    QEMU_LOCK_GUARD(&bs->chain_status_lock);
+
+    /* A write or graph change raced with the walk, its result may be stale */
+    if (qatomic_read(&bs->chain_status_gen) != gen) {
+        return;
+    }
+
+    while ((node = interval_tree_iter_first(&bs->chain_status,
+                                            offset, last))) {
+        bdrv_chain_status_drop(bs, container_of(node, BdrvChainStatus, node));
+    }
+
+    /* Sequential walks such as qemu-img map extend the previous entry */
+    entry = offset ? bdrv_chain_status_find(bs, offset - 1) : NULL;
+    if (entry && entry->layer == layer && entry->allocated == allocated) {
+        interval_tree_remove(&entry->node, &bs->chain_status);
+        entry->node.last = last;
+        interval_tree_insert(&entry->node, &bs->chain_status);
+        QTAILQ_REMOVE(&bs->chain_status_lru, entry, lru);
+        QTAILQ_INSERT_HEAD(&bs->chain_status_lru, entry, lru);
+        return;
+    }
+
+    if (bs->chain_status_entries == BDRV_CHAIN_STATUS_MAX_ENTRIES) {
+        bdrv_chain_status_drop(bs, QTAILQ_LAST(&bs->chain_status_lru));
+    }
+
+    entry = g_new(BdrvChainStatus, 1);
+    *entry = (BdrvChainStatus) {
+        .node.start = offset,
+        .node.last = last,
+        .layer = layer,
+        .allocated = allocated,
+    };
+    interval_tree_insert(&entry->node, &bs->chain_status);
+    QTAILQ_INSERT_HEAD(&bs->chain_status_lru, entry, lru);
+    bs->chain_status_entries++;
+}
+
+void bdrv_chain_status_invalidate(BlockDriverState *bs, int64_t offset,
+                                  int64_t bytes)
+{
+    IntervalTreeNode *node;
+    BdrvChild *c;
+
+    if (bytes <= 0) {
+        return;
+    }
+
+    qatomic_inc(&bs->chain_status_gen);
+    if (qatomic_read(&bs->chain_status_entries)) {
+        uint64_t last = offset + bytes - 1;
+
+        qemu_mutex_lock(&bs->chain_status_lock);
+        while ((node = interval_tree_iter_first(&bs->chain_status,
+                                                offset, last))) {
+            bdrv_chain_status_drop(bs,
+                                   container_of(node, BdrvChainStatus, node));
+        }
+        qemu_mutex_unlock(&bs->chain_status_lock);
+    }
+
+    /* Offsets are the same in all layers of a chain */
+    QLIST_FOREACH(c, &bs->parents, next_parent) {
+        if (c->klass->parent_is_bds &&
+            (c->role & (BDRV_CHILD_COW | BDRV_CHILD_FILTERED))) {
+            bdrv_chain_status_invalidate(c->opaque, offset, bytes);
+        }
+    }
+}
+
+/*
+ * Answer a block status query above @bs by asking only the layer that its
+ * cache says owns @offset.  Return true and set *@ret if that was
+ * possible, false if the whole chain must be walked.
+ */
+static bool coroutine_fn
+bdrv_co_chain_status_cached(BlockDriverState *bs, BlockDriverState *base,
+                            bool include_base, bool want_zero,
+                            int64_t offset, int64_t bytes, int64_t *pnum,
+                            int64_t *map, BlockDriverState **file,
+                            int *depth, int *ret)
+{
+    BdrvChainStatus *entry;
+    BlockDriverState *layer, *p, *target = NULL;
+    bool allocated;
+    int64_t total_size;
+    int d;
+
+    if (!qatomic_read(&bs->chain_status_entries)) {
+        return false;
+    }
+
+    WITH_QEMU_LOCK_GUARD(&bs->chain_status_lock) {
+        entry = bdrv_chain_status_find(bs, offset);
+        if (!entry) {
+            return false;
+        }
+        layer = entry->layer;
+        allocated = entry->allocated;
+        bytes = MIN(bytes, (int64_t)(entry->node.last + 1 - offset));
+        QTAILQ_REMOVE(&bs->chain_status_lru, entry, lru);
+        QTAILQ_INSERT_HEAD(&bs->chain_status_lru, entry, lru);
+    }
+
+    /*
+     * Find the layer to ask without any I/O.  If @base comes first, the
+     * range is unallocated above it and the last layer before it answers.
+     */
+    for (p = bs, d = 1; p; p = bdrv_filter_or_cow_bs(p), d++) {
+        if (p == base && !include_base) {
+            break;
+        }
+        target = p;
+        *depth = d;
+        if (p == layer || p == base) {
+            break;
+        }
+    }
+    if (!p) {
+        return false;
+    }
+
+    total_size = bdrv_getlength(bs);
+    if (total_size < 0 || offset >= total_size) {
+        return false;
+    }
+    bytes = MIN(bytes, total_size - offset);
+
+    *ret = bdrv_co_block_status(target, want_zero, offset, bytes, pnum, map,
+                                file);
+    if (*ret < 0) {
+        return true;
+    }
+    if (*pnum == 0 ||
+        !!(*ret & BDRV_BLOCK_ALLOCATED) != (target == layer && allocated)) {
+        return false;
+    }
+
+    /* Same BDRV_BLOCK_EOF handling as the full walk */
+    if (*ret & BDRV_BLOCK_ALLOCATED) {
+        *ret &= ~BDRV_BLOCK_EOF;
+    }
+    if (offset + *pnum == total_size) {
+        *ret |= BDRV_BLOCK_EOF;
+    }
+    return true;
+}
+
 int coroutine_fn
 bdrv_co_common_block_status_above(BlockDriverState *bs,
                                   BlockDriverState *base,
@@ -2534,6 +2933,7 @@ bdrv_co_common_block_status_above(BlockDriverState *bs,
     int ret;
     BlockDriverState *p;
     int64_t eof = 0;
+    unsigned int gen;
     int dummy;
 
     assert(!include_base || base); /* Can't include NULL base */
@@ -2548,6 +2948,13 @@ bdrv_co_common_block_status_above(BlockDriverState *bs,
         return 0;
     }
 
+    if (bdrv_co_chain_status_cached(bs, base, include_base, want_zero,
+                                    offset, bytes, pnum, map, file, depth,
+                                    &ret)) {
+        return ret;
+    }
+    gen = qatomic_read(&bs->chain_status_gen);
+
     ret = bdrv_co_block_status(bs, want_zero, offset, bytes, pnum, map, file);
     ++*depth;
     if (ret < 0 || *pnum == 0 || ret & BDRV_BLOCK_ALLOCATED || bs == base) {
@@ -2597,6 +3004,7 @@ bdrv_co_common_block_status_above(BlockDriverState *bs,
              * below.
              */
             ret &= ~BDRV_BLOCK_EOF;
+            bdrv_chain_status_add(bs, gen, offset, *pnum, p, true, *depth);
             break;
         }
 
@@ -2605,6 +3013,11 @@ bdrv_co_common_block_status_above(BlockDriverState *bs,
             break;
         }
 
+        if (!bdrv_filter_or_cow_bs(p)) {
+            /* No layer of the chain allocates the range */
+            bdrv_chain_status_add(bs, gen, offset, *pnum, p, false, *depth);
+        }
+
         /*
          * OK, [offset, offset + *pnum) region is unallocated on this layer,
          * let's continue the diving.
@@ -3151,7 +3564,8 @@ void bdrv_io_plug(BlockDriverState *bs)
         bdrv_io_plug(child->bs);
     }
 
-    if (qatomic_fetch_inc(&bs->io_plugged) == 0) {
+    if (qatomic_fetch_inc(&bs->io_plugged) == 0 ||
+        (bs->drv && bs->drv->supports_multiqueue)) {
         BlockDriver *drv = bs->drv;
         if (drv && drv->bdrv_io_plug) {
             drv->bdrv_io_plug(bs);
@@ -3164,7 +3578,8 @@ void bdrv_io_unplug(BlockDriverState *bs)
     BdrvChild *child;
 
     assert(bs->io_plugged);
-    if (qatomic_fetch_dec(&bs->io_plugged) == 1) {
+    if (qatomic_fetch_dec(&bs->io_plugged) == 1 ||
+        (bs->drv && bs->drv->supports_multiqueue)) {
         BlockDriver *drv = bs->drv;
         if (drv && drv->bdrv_io_unplug) {
             drv->bdrv_io_unplug(bs);
@@ -10,20 +10,83 @@
  */
 #include "qemu/osdep.h"
 #include <liburing.h>
+#include <sys/syscall.h>
 #include "qemu-common.h"
 #include "block/aio.h"
 #include "qemu/queue.h"
 #include "block/block.h"
 #include "block/raw-aio.h"
 #include "qemu/coroutine.h"
+#include "qemu/thread.h"
+#include "qemu/atomic.h"
 #include "qapi/error.h"
+#include "exec/ramlist.h"
+#include "exec/cpu-common.h"
+#include "exec/memory.h"
 #include "trace.h"
 
 /* io_uring ring size */
 #define MAX_ENTRIES 128
 
+/* How long the SQPOLL thread keeps spinning after the last submission */
+#define LURING_SQPOLL_IDLE_MS 100
+
+/* Not defined by liburing before 2.0 */
+#ifndef IORING_FEAT_SQPOLL_NONFIXED
+#define IORING_FEAT_SQPOLL_NONFIXED (1U << 7)
+#endif
+
+/* Fixed file slots per ring */
+#define LURING_FIXED_FILES 16
+
+/* Limits of the kernel on registered buffers */
+#define LURING_FIXED_BUF_MAX_SIZE (1ULL << 30)
+#define LURING_FIXED_BUF_MAX_COUNT 1024
+
+/*
+ * Memory registered with luring_register_buf() becomes fixed buffers of
+ * every ring, and the fds of requests submitted with @fixed become fixed
+ * files of the ring that runs them.  This saves the kernel from looking
+ * up the file and pinning the pages for each request.
+ *
+ * A ring can only change its tables when it has no request in flight,
+ * because queued and running requests refer to them by index.  So the
+ * global state only bumps a generation number; each ring rebuilds its
+ * tables the next time it is idle, and until then uses the regular
+ * opcodes for everything.
+ */
+typedef struct LuringFixedBuf {
+    struct iovec iov;
+    void *region;               /* host address passed to luring_register_buf */
+} LuringFixedBuf;
+
+static QemuMutex luring_fixed_lock;
+/* LuringFixedBuf sorted by address, protected by luring_fixed_lock */
+static GArray *luring_fixed_bufs;
+static unsigned int luring_fixed_bufs_gen;
+static unsigned int luring_fixed_files_gen;
+
+static void __attribute__((__constructor__)) luring_fixed_init(void)
+{
+    qemu_mutex_init(&luring_fixed_lock);
+    luring_fixed_bufs = g_array_new(false, false, sizeof(LuringFixedBuf));
+}
+
+typedef struct LuringFixed {
+    unsigned int bufs_gen;
+    struct iovec *bufs;
+    unsigned int nbufs;
+
+    unsigned int files_gen;
+    bool files_registered;
+    bool files_failed;
+    int files[LURING_FIXED_FILES];
+} LuringFixed;
+
 typedef struct LuringAIOCB {
     Coroutine *co;
+    BlockCompletionFunc *cb;    /* used instead of co by luring_submit() */
+    void *opaque;
     struct io_uring_sqe sqeq;
     ssize_t ret;
     QEMUIOVector *qiov;
@@ -50,12 +113,19 @@ typedef struct LuringState {
     AioContext *aio_context;
 
     struct io_uring ring;
+    unsigned int flags;     /* LURING_* setup flags */
 
     /* io queue for submit at batch.  Protected by AioContext lock. */
     LuringQueue io_q;
 
+    /* Submission of io_q shared with other devices in the AioContext */
+    AioDeferredSubmit deferred_submit;
+
     /* I/O completion processing.  Only runs in I/O thread.  */
     QEMUBH *completion_bh;
+
+    /* Fixed buffers and files.  Protected by AioContext lock. */
+    LuringFixed fixed;
 } LuringState;
 
 /**
@@ -102,6 +172,12 @@ static void luring_resubmit_short_read(LuringState *s, LuringAIOCB *luringcb,
     qemu_iovec_concat(resubmit_qiov, luringcb->qiov, luringcb->total_read,
                       remaining);
 
+    /* A fixed buffer cannot describe the remainder, use an iovec instead */
+    if (luringcb->sqeq.opcode == IORING_OP_READ_FIXED) {
+        luringcb->sqeq.opcode = IORING_OP_READV;
+        luringcb->sqeq.buf_index = 0;
+    }
+
     /* Update sqe */
     luringcb->sqeq.off = nread;
     luringcb->sqeq.addr = (__u64)(uintptr_t)luringcb->resubmit_qiov.iov;
@@ -110,6 +186,25 @@ static void luring_resubmit_short_read(LuringState *s, LuringAIOCB *luringcb,
     luring_resubmit(s, luringcb);
 }
 
+/*
+ * Without SQPOLL, an IOPOLL ring only posts completions when it is
+ * entered with IORING_ENTER_GETEVENTS; interrupts do not complete its
+ * requests and the ring fd never becomes readable.
+ */
+static bool luring_needs_reap(LuringState *s)
+{
+    return (s->flags & (LURING_IOPOLL | LURING_SQPOLL)) == LURING_IOPOLL;
+}
+
+static void luring_reap(LuringState *s)
+{
+    if (luring_needs_reap(s) && s->io_q.in_flight &&
+        !io_uring_cq_ready(&s->ring)) {
+        syscall(__NR_io_uring_enter, s->ring.ring_fd, 0, 0,
+                IORING_ENTER_GETEVENTS, NULL, 0);
+    }
+}
+
 /**
  * luring_process_completions:
  * @s: AIO state
@@ -144,6 +239,7 @@ static void luring_process_completions(LuringState *s)
      */
     qemu_bh_schedule(s->completion_bh);
 
+    luring_reap(s);
     while (io_uring_peek_cqe(&s->ring, &cqes) == 0) {
         LuringAIOCB *luringcb;
         int ret;
@@ -194,6 +290,12 @@ end:
         luringcb->ret = ret;
         qemu_iovec_destroy(&luringcb->resubmit_qiov);
 
+        if (luringcb->cb) {
+            luringcb->cb(luringcb->opaque, ret);
+            g_free(luringcb);
+            continue;
+        }
+
         /*
          * If the coroutine is already entered it must be in ioq_submit()
          * and will notice luringcb->ret has been filled in when it
@@ -204,7 +306,14 @@ end:
             aio_co_wake(luringcb->co);
         }
     }
-    qemu_bh_cancel(s->completion_bh);
+
+    /*
+     * Keep polling an IOPOLL ring from the BH for as long as requests are
+     * in flight, since nothing else would wake up the event loop.
+     */
+    if (!luring_needs_reap(s) || !s->io_q.in_flight) {
+        qemu_bh_cancel(s->completion_bh);
+    }
 }
 
 static int ioq_submit(LuringState *s)
@@ -278,6 +387,7 @@ static bool qemu_luring_poll_cb(void *opaque)
 {
     LuringState *s = opaque;
 
+    luring_reap(s);
     if (io_uring_cq_ready(&s->ring)) {
         luring_process_completions_and_submit(s);
         return true;
@@ -295,6 +405,17 @@ static void ioq_init(LuringQueue *io_q)
     io_q->blocked = false;
 }
 
+static void luring_deferred_submit(void *opaque)
+{
+    LuringState *s = opaque;
+
+    aio_context_acquire(s->aio_context);
+    if (!s->io_q.plugged && !s->io_q.blocked && s->io_q.in_queue > 0) {
+        ioq_submit(s);
+    }
+    aio_context_release(s->aio_context);
+}
+
 void luring_io_plug(BlockDriverState *bs, LuringState *s)
 {
     trace_luring_io_plug(s);
@@ -308,7 +429,314 @@ void luring_io_unplug(BlockDriverState *bs, LuringState *s)
                            s->io_q.in_queue, s->io_q.in_flight);
     if (--s->io_q.plugged == 0 &&
         !s->io_q.blocked && s->io_q.in_queue > 0) {
-        ioq_submit(s);
+        /*
+         * Other devices in the AioContext are likely to queue requests in
+         * the same event loop iteration, submit them all at once.
+         */
+        if (!aio_defer_submit(s->aio_context, &s->deferred_submit)) {
+            ioq_submit(s);
+        }
+    }
+}
+
+/*
+ * Add [@host, @host + @size) to the memory that rings register as fixed
+ * buffers, split in pieces that the kernel accepts.
+ */
+void luring_register_buf(void *host, size_t size)
+{
+    uint8_t *start = host;
+    uint8_t *end = start + size;
+    unsigned int i;
+
+    qemu_mutex_lock(&luring_fixed_lock);
+    while (start < end) {
+        LuringFixedBuf buf = {
+            .iov.iov_base = start,
+            .iov.iov_len = MIN(end - start, LURING_FIXED_BUF_MAX_SIZE),
+            .region = host,
+        };
+
+        if (luring_fixed_bufs->len >= LURING_FIXED_BUF_MAX_COUNT) {
+            trace_luring_register_buf_full(start, end - start);
+            break;
+        }
+        for (i = 0; i < luring_fixed_bufs->len; i++) {
+            if (g_array_index(luring_fixed_bufs, LuringFixedBuf,
+                              i).iov.iov_base > buf.iov.iov_base) {
+                break;
+            }
+        }
+        g_array_insert_val(luring_fixed_bufs, i, buf);
+        start += buf.iov.iov_len;
+    }
+    qatomic_inc(&luring_fixed_bufs_gen);
+    qemu_mutex_unlock(&luring_fixed_lock);
+}
+
+/* Remove the memory registered at @host from the fixed buffers */
+void luring_unregister_buf(void *host)
+{
+    unsigned int i = 0;
+
+    qemu_mutex_lock(&luring_fixed_lock);
+    while (i < luring_fixed_bufs->len) {
+        if (g_array_index(luring_fixed_bufs, LuringFixedBuf,
+                          i).region == host) {
+            g_array_remove_index(luring_fixed_bufs, i);
+        } else {
+            i++;
+        }
+    }
+    qatomic_inc(&luring_fixed_bufs_gen);
+    qemu_mutex_unlock(&luring_fixed_lock);
+}
+
+/*
+ * Must be called before closing an fd that was submitted with @fixed,
+ * so that no ring keeps using its slot once the number is reused.
+ */
+void luring_forget_fd(int fd)
+{
+    qatomic_inc(&luring_fixed_files_gen);
+}
+
+static void luring_fixed_ram_block_added(RAMBlockNotifier *n, void *host,
+                                         size_t size)
+{
+    luring_register_buf(host, size);
+}
+
+static void luring_fixed_ram_block_removed(RAMBlockNotifier *n, void *host,
+                                           size_t size)
+{
+    luring_unregister_buf(host);
+}
+
+static RAMBlockNotifier luring_fixed_ram_notifier = {
+    .ram_block_added = luring_fixed_ram_block_added,
+    .ram_block_removed = luring_fixed_ram_block_removed,
+};
+static unsigned int luring_fixed_ram_users;
+
+static int luring_fixed_add_ramblock(RAMBlock *rb, void *opaque)
+{
+    void *host = qemu_ram_get_host_addr(rb);
+
+    if (host) {
+        luring_register_buf(host, qemu_ram_get_used_length(rb));
+    }
+    return 0;
+}
+
+static int luring_fixed_remove_ramblock(RAMBlock *rb, void *opaque)
+{
+    void *host = qemu_ram_get_host_addr(rb);
+
+    if (host) {
+        luring_unregister_buf(host);
+    }
+    return 0;
+}
+
+/*
+ * Register all guest RAM as fixed buffers until the matching
+ * luring_unregister_guest_ram().  The kernel pins registered memory,
+ * so RAM discards are disabled meanwhile.
+ *
+ * Called with the BQL held.
+ */
+bool luring_register_guest_ram(Error **errp)
+{
+    int ret;
+
+    if (luring_fixed_ram_users++) {
+        return true;
+    }
+
+    ret = ram_block_discard_disable(true);
+    if (ret) {
+        error_setg_errno(errp, -ret, "Cannot set discarding of RAM broken");
+        luring_fixed_ram_users--;
+        return false;
+    }
+    ram_block_notifier_add(&luring_fixed_ram_notifier);
+    qemu_ram_foreach_block(luring_fixed_add_ramblock, NULL);
+    return true;
+}
+
+void luring_unregister_guest_ram(void)
+{
+    assert(luring_fixed_ram_users);
+    if (--luring_fixed_ram_users) {
+        return;
+    }
+
+    ram_block_notifier_remove(&luring_fixed_ram_notifier);
+    qemu_ram_foreach_block(luring_fixed_remove_ramblock, NULL);
+    ram_block_discard_disable(false);
+}
+
+/* Rebuild the fixed tables of @s if they are stale and it is idle */
+static void luring_fixed_update(LuringState *s)
+{
+    LuringFixed *fixed = &s->fixed;
+    unsigned int bufs_gen = qatomic_read(&luring_fixed_bufs_gen);
+    unsigned int files_gen = qatomic_read(&luring_fixed_files_gen);
+    int ret;
+
+    if (s->io_q.in_flight || s->io_q.in_queue) {
+        return;
+    }
+
+    if (fixed->bufs_gen != bufs_gen) {
+        if (fixed->nbufs) {
+            io_uring_unregister_buffers(&s->ring);
+            g_free(fixed->bufs);
+            fixed->bufs = NULL;
+            fixed->nbufs = 0;
+        }
+
+        qemu_mutex_lock(&luring_fixed_lock);
+        bufs_gen = qatomic_read(&luring_fixed_bufs_gen);
+        fixed->nbufs = luring_fixed_bufs->len;
+        if (fixed->nbufs) {
+            unsigned int i;
+
+            fixed->bufs = g_new(struct iovec, fixed->nbufs);
+            for (i = 0; i < fixed->nbufs; i++) {
+                fixed->bufs[i] = g_array_index(luring_fixed_bufs,
+                                               LuringFixedBuf, i).iov;
+            }
+        }
+        qemu_mutex_unlock(&luring_fixed_lock);
+
+        if (fixed->nbufs) {
+            ret = io_uring_register_buffers(&s->ring, fixed->bufs,
+                                            fixed->nbufs);
+            trace_luring_fixed_register_buffers(s, fixed->nbufs, ret);
+            if (ret < 0) {
+                g_free(fixed->bufs);
+                fixed->bufs = NULL;
+                fixed->nbufs = 0;
+            }
+        }
+        fixed->bufs_gen = bufs_gen;
+    }
+
+    if (fixed->files_gen != files_gen) {
+        if (fixed->files_registered) {
+            io_uring_unregister_files(&s->ring);
+            fixed->files_registered = false;
+        }
+        fixed->files_failed = false;
+        fixed->files_gen = files_gen;
+    }
+}
+
+/* Return the index of the fixed buffer that contains @iov, or -1 */
+static int luring_fixed_find_buf(LuringState *s, struct iovec *iov)
+{
+    LuringFixed *fixed = &s->fixed;
+    uint8_t *base = iov->iov_base;
+    int lo = 0, hi = fixed->nbufs;
+
+    if (fixed->bufs_gen != qatomic_read(&luring_fixed_bufs_gen)) {
+        return -1;
+    }
+
+    /* Find the last buffer that starts at or before base */
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+
+        if ((uint8_t *)fixed->bufs[mid].iov_base <= base) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    if (lo == 0) {
+        return -1;
+    }
+    lo--;
+    if (base + iov->iov_len >
+        (uint8_t *)fixed->bufs[lo].iov_base + fixed->bufs[lo].iov_len) {
+        return -1;
+    }
+    return lo;
+}
+
+/* Return the fixed file slot of @fd in @s, registering it if needed, or -1 */
+static int luring_fixed_get_file(LuringState *s, int fd)
+{
+    LuringFixed *fixed = &s->fixed;
+    int i, free_slot = -1;
+    int ret;
+
+    if (fixed->files_gen != qatomic_read(&luring_fixed_files_gen) ||
+        fixed->files_failed) {
+        return -1;
+    }
+
+    if (!fixed->files_registered) {
+        for (i = 0; i < LURING_FIXED_FILES; i++) {
+            fixed->files[i] = -1;
+        }
+        ret = io_uring_register_files(&s->ring, fixed->files,
+                                      LURING_FIXED_FILES);
+        trace_luring_fixed_register_files(s, ret);
+        if (ret < 0) {
+            fixed->files_failed = true;
+            return -1;
+        }
+        fixed->files_registered = true;
+    }
+
+    for (i = 0; i < LURING_FIXED_FILES; i++) {
+        if (fixed->files[i] == fd) {
+            return i;
+        }
+        if (fixed->files[i] == -1 && free_slot < 0) {
+            free_slot = i;
+        }
+    }
+    if (free_slot < 0) {
+        return -1;
+    }
+
+    ret = io_uring_register_files_update(&s->ring, free_slot, &fd, 1);
+    if (ret != 1) {
+        return -1;
+    }
+    fixed->files[free_slot] = fd;
+    return free_slot;
+}
+
+/*
+ * Switch the prepared @sqe to the fixed file and, for single-buffer
+ * reads and writes, to the fixed buffer variant of its opcode.
+ */
+static void luring_prep_fixed(LuringState *s, struct io_uring_sqe *sqe,
+                              int fd, QEMUIOVector *qiov, int type)
+{
+    int slot, buf;
+
+    luring_fixed_update(s);
+
+    slot = luring_fixed_get_file(s, fd);
+    if (slot >= 0) {
+        sqe->fd = slot;
+        sqe->flags |= IOSQE_FIXED_FILE;
+    }
+
+    if ((type == QEMU_AIO_READ || type == QEMU_AIO_WRITE) &&
+        qiov->niov == 1 &&
+        (buf = luring_fixed_find_buf(s, &qiov->iov[0])) >= 0) {
+        sqe->opcode = type == QEMU_AIO_READ ? IORING_OP_READ_FIXED :
+                                              IORING_OP_WRITE_FIXED;
+        sqe->addr = (__u64)(uintptr_t)qiov->iov[0].iov_base;
+        sqe->len = qiov->iov[0].iov_len;
+        sqe->buf_index = buf;
     }
 }
 
@@ -324,7 +752,7 @@ void luring_io_unplug(BlockDriverState *bs, LuringState *s)
  *
  */
 static int luring_do_submit(int fd, LuringAIOCB *luringcb, LuringState *s,
-                            uint64_t offset, int type)
+                            uint64_t offset, int type, bool fixed)
 {
     int ret;
     struct io_uring_sqe *sqes = &luringcb->sqeq;
@@ -346,6 +774,9 @@ static int luring_do_submit(int fd, LuringAIOCB *luringcb, LuringState *s,
                         __func__, type);
         abort();
     }
+    if (fixed) {
+        luring_prep_fixed(s, sqes, fd, luringcb->qiov, type);
+    }
     io_uring_sqe_set_data(sqes, luringcb);
 
     QSIMPLEQ_INSERT_TAIL(&s->io_q.submit_queue, luringcb, next);
@@ -363,7 +794,8 @@ static int luring_do_submit(int fd, LuringAIOCB *luringcb, LuringState *s,
 }
 
 int coroutine_fn luring_co_submit(BlockDriverState *bs, LuringState *s, int fd,
-                                  uint64_t offset, QEMUIOVector *qiov, int type)
+                                  uint64_t offset, QEMUIOVector *qiov, int type,
+                                  bool fixed)
 {
     int ret;
     LuringAIOCB luringcb = {
@@ -374,7 +806,7 @@ int coroutine_fn luring_co_submit(BlockDriverState *bs, LuringState *s, int fd,
     };
     trace_luring_co_submit(bs, s, &luringcb, fd, offset, qiov ? qiov->size : 0,
                            type);
-    ret = luring_do_submit(fd, &luringcb, s, offset, type);
+    ret = luring_do_submit(fd, &luringcb, s, offset, type, fixed);
 
     if (ret < 0) {
         return ret;
@@ -386,8 +818,36 @@ int coroutine_fn luring_co_submit(BlockDriverState *bs, LuringState *s, int fd,
     return luringcb.ret;
 }
 
+/*
+ * Like luring_co_submit(), but call @cb when the request completes instead
+ * of waking up a coroutine.  @cb may run before the function returns.
+ */
+int luring_submit(BlockDriverState *bs, LuringState *s, int fd,
+                  uint64_t offset, QEMUIOVector *qiov, int type, bool fixed,
+                  BlockCompletionFunc *cb, void *opaque)
+{
+    LuringAIOCB *luringcb = g_new0(LuringAIOCB, 1);
+
+    luringcb->cb = cb;
+    luringcb->opaque = opaque;
+    luringcb->ret = -EINPROGRESS;
+    luringcb->qiov = qiov;
+    luringcb->is_read = (type == QEMU_AIO_READ);
+    trace_luring_co_submit(bs, s, luringcb, fd, offset, qiov->size, type);
+
+    /*
+     * A refused io_uring_submit() leaves the request in the queue to be
+     * retried, so it must not be freed here.
+     */
+    luring_do_submit(fd, luringcb, s, offset, type, fixed);
+    return 0;
+}
+
 void luring_detach_aio_context(LuringState *s, AioContext *old_context)
 {
+    if (aio_cancel_deferred_submit(old_context, &s->deferred_submit)) {
+        luring_deferred_submit(s);
+    }
     aio_set_fd_handler(old_context, s->ring.ring_fd, false, NULL, NULL, NULL,
                        s);
     qemu_bh_delete(s->completion_bh);
@@ -402,22 +862,57 @@ void luring_attach_aio_context(LuringState *s, AioContext *new_context)
                        qemu_luring_completion_cb, NULL, qemu_luring_poll_cb, s);
 }
 
-LuringState *luring_init(Error **errp)
+LuringState *luring_init(unsigned int flags, LuringState *sq_share,
+                         Error **errp)
 {
     int rc;
     LuringState *s = g_new0(LuringState, 1);
     struct io_uring *ring = &s->ring;
+    struct io_uring_params params = {};
+
+    trace_luring_init_state(s, sizeof(*s), flags);
+
+retry:
+    if (flags & LURING_SQPOLL) {
+        params.flags |= IORING_SETUP_SQPOLL;
+        params.sq_thread_idle = LURING_SQPOLL_IDLE_MS;
+        if (sq_share) {
+            /* Let the kernel run both rings from the same thread */
+            params.flags |= IORING_SETUP_ATTACH_WQ;
+            params.wq_fd = sq_share->ring.ring_fd;
+        }
+    }
+    if (flags & LURING_IOPOLL) {
+        params.flags |= IORING_SETUP_IOPOLL;
+    }
 
-    trace_luring_init_state(s, sizeof(*s));
-
-    rc = io_uring_queue_init(MAX_ENTRIES, ring, 0);
+    rc = io_uring_queue_init_params(MAX_ENTRIES, ring, &params);
     if (rc < 0) {
-        error_setg_errno(errp, errno, "failed to init linux io_uring ring");
+        error_setg_errno(errp, -rc, "failed to init linux io_uring ring%s%s",
+                         flags & LURING_SQPOLL ? " (SQPOLL)" : "",
+                         flags & LURING_IOPOLL ? " (IOPOLL)" : "");
         g_free(s);
         return NULL;
     }
 
+    /*
+     * Before Linux 5.11 the SQPOLL thread only accepts requests on fixed
+     * files, but fixed file slots are limited and may fail to register.
+     * Use a ring without SQPOLL on those kernels.
+     */
+    if ((flags & LURING_SQPOLL) &&
+        !(params.features & IORING_FEAT_SQPOLL_NONFIXED)) {
+        trace_luring_sqpoll_fallback(s);
+        io_uring_queue_exit(ring);
+        flags &= ~LURING_SQPOLL;
+        memset(&params, 0, sizeof(params));
+        goto retry;
+    }
+    s->flags = flags;
+
     ioq_init(&s->io_q);
+    s->deferred_submit.cb = luring_deferred_submit;
+    s->deferred_submit.opaque = s;
     return s;
 
 }
@@ -425,6 +920,7 @@ LuringState *luring_init(Error **errp)
 void luring_cleanup(LuringState *s)
 {
     io_uring_queue_exit(&s->ring);
+    g_free(s->fixed.bufs);
     trace_luring_cleanup_state(s);
     g_free(s);
 }
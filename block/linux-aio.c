@@ -30,6 +30,8 @@
 
 struct qemu_laiocb {
     Coroutine *co;
+    BlockCompletionFunc *cb;    /* used instead of co by laio_submit() */
+    void *opaque;
     LinuxAioState *ctx;
     struct iocb iocb;
     ssize_t ret;
@@ -56,6 +58,9 @@ struct LinuxAioState {
     /* io queue for submit at batch.  Protected by AioContext lock. */
     LaioQueue io_q;
 
+    /* Submission of io_q shared with other devices in the AioContext */
+    AioDeferredSubmit deferred_submit;
+
     /* I/O completion processing.  Only runs in I/O thread.  */
     QEMUBH *completion_bh;
     int event_idx;
@@ -93,6 +98,12 @@ static void qemu_laio_process_completion(struct qemu_laiocb *laiocb)
 
     laiocb->ret = ret;
 
+    if (laiocb->cb) {
+        laiocb->cb(laiocb->opaque, ret);
+        g_free(laiocb);
+        return;
+    }
+
     /*
      * If the coroutine is already entered it must be in ioq_submit() and
      * will notice laio->ret has been filled in when it eventually runs
@@ -331,6 +342,18 @@ static void ioq_submit(LinuxAioState *s)
     }
 }
 
+static void laio_deferred_submit(void *opaque)
+{
+    LinuxAioState *s = opaque;
+
+    aio_context_acquire(s->aio_context);
+    if (!s->io_q.plugged &&
+        !s->io_q.blocked && !QSIMPLEQ_EMPTY(&s->io_q.pending)) {
+        ioq_submit(s);
+    }
+    aio_context_release(s->aio_context);
+}
+
 void laio_io_plug(BlockDriverState *bs, LinuxAioState *s)
 {
     s->io_q.plugged++;
@@ -341,7 +364,13 @@ void laio_io_unplug(BlockDriverState *bs, LinuxAioState *s)
     assert(s->io_q.plugged);
     if (--s->io_q.plugged == 0 &&
         !s->io_q.blocked && !QSIMPLEQ_EMPTY(&s->io_q.pending)) {
-        ioq_submit(s);
+        /*
+         * Other devices in the AioContext are likely to queue requests in
+         * the same event loop iteration, submit them all at once.
+         */
+        if (!aio_defer_submit(s->aio_context, &s->deferred_submit)) {
+            ioq_submit(s);
+        }
     }
 }
 
@@ -402,8 +431,39 @@ int coroutine_fn laio_co_submit(BlockDriverState *bs, LinuxAioState *s, int fd,
     return laiocb.ret;
 }
 
+/*
+ * Like laio_co_submit(), but call @cb when the request completes instead
+ * of waking up a coroutine.  @cb may run before the function returns.
+ */
+int laio_submit(BlockDriverState *bs, LinuxAioState *s, int fd,
+                uint64_t offset, QEMUIOVector *qiov, int type,
+                BlockCompletionFunc *cb, void *opaque)
+{
+    struct qemu_laiocb *laiocb = g_new(struct qemu_laiocb, 1);
+    int ret;
+
+    *laiocb = (struct qemu_laiocb) {
+        .cb         = cb,
+        .opaque     = opaque,
+        .nbytes     = qiov->size,
+        .ctx        = s,
+        .ret        = -EINPROGRESS,
+        .is_read    = (type == QEMU_AIO_READ),
+        .qiov       = qiov,
+    };
+
+    ret = laio_do_submit(fd, laiocb, offset, type);
+    if (ret < 0) {
+        g_free(laiocb);
+    }
+    return ret;
+}
+
 void laio_detach_aio_context(LinuxAioState *s, AioContext *old_context)
 {
+    if (aio_cancel_deferred_submit(old_context, &s->deferred_submit)) {
+        laio_deferred_submit(s);
+    }
     aio_set_event_notifier(old_context, &s->e, false, NULL, NULL);
     qemu_bh_delete(s->completion_bh);
     s->aio_context = NULL;
@@ -437,6 +497,8 @@ LinuxAioState *laio_init(Error **errp)
     }
 
     ioq_init(&s->io_q);
+    s->deferred_submit.cb = laio_deferred_submit;
+    s->deferred_submit.opaque = s;
 
     return s;
 
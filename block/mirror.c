@@ -27,6 +27,8 @@
 #define MAX_IN_FLIGHT 16
 #define MAX_IO_BYTES (1 << 20) /* 1 Mb */
 #define DEFAULT_MIRROR_BUF_SIZE (MAX_IN_FLIGHT * MAX_IO_BYTES)
+/* How many busy or hot dirty chunks one iteration may skip over */
+#define MAX_SKIPPED_CHUNKS 64
 
 /* The mirroring buffer is a list of granularity-sized chunks.
  * Free chunks are organized in a list.
@@ -73,8 +75,12 @@ typedef struct MirrorBlockJob {
 
     uint64_t last_pause_ns;
     unsigned long *in_flight_bitmap;
+    /* Chunks written by the guest since the dirty iterator last wrapped */
+    unsigned long *hot_bitmap;
     int in_flight;
     int64_t bytes_in_flight;
+    /* Bytes written to the source whose write-async copy is still pending */
+    int64_t active_lag_bytes;
     QTAILQ_HEAD(, MirrorOp) ops_in_flight;
     int ret;
     bool unmap;
@@ -82,6 +88,8 @@ typedef struct MirrorBlockJob {
     int max_iov;
     bool initial_zeroing_ongoing;
     int in_active_write_counter;
+    /* Active writes whose guest request has already completed */
+    int in_async_write_counter;
     bool prepared;
     bool in_drain;
 } MirrorBlockJob;
@@ -91,6 +99,12 @@ typedef struct MirrorBDSOpaque {
     bool stop;
 } MirrorBDSOpaque;
 
+typedef enum MirrorMethod {
+    MIRROR_METHOD_COPY,
+    MIRROR_METHOD_ZERO,
+    MIRROR_METHOD_DISCARD,
+} MirrorMethod;
+
 struct MirrorOp {
     MirrorBlockJob *s;
     QEMUIOVector qiov;
@@ -107,15 +121,14 @@ struct MirrorOp {
     CoQueue waiting_requests;
     Coroutine *co;
 
+    /* Used by active writes that complete asynchronously (write-async) */
+    MirrorMethod method;
+    int flags;
+    void *bounce_buf;
+
     QTAILQ_ENTRY(MirrorOp) next;
 };
 
-typedef enum MirrorMethod {
-    MIRROR_METHOD_COPY,
-    MIRROR_METHOD_ZERO,
-    MIRROR_METHOD_DISCARD,
-} MirrorMethod;
-
 static BlockErrorAction mirror_error_action(MirrorBlockJob *s, bool read,
                                             int error)
 {
@@ -454,6 +467,57 @@ static unsigned mirror_perform(MirrorBlockJob *s, int64_t offset,
     return bytes_handled;
 }
 
+/*
+ * Return the offset of the next dirty chunk to copy.  Chunks that are
+ * being copied already would only make us wait for that operation, and
+ * chunks the guest wrote recently are likely to be dirtied again, so we
+ * skip a bounded number of both in favour of later dirty chunks.  The
+ * skipped chunks are picked up on the next pass over the bitmap.
+ *
+ * Called with the dirty bitmap lock held.
+ */
+static int64_t mirror_next_dirty_offset(MirrorBlockJob *s)
+{
+    int64_t fallback = -1;
+    bool restarted = false;
+    int skipped = 0;
+
+    for (;;) {
+        int64_t offset = bdrv_dirty_iter_next(s->dbi);
+        int64_t chunk;
+
+        if (offset < 0) {
+            if (restarted) {
+                break;
+            }
+            bdrv_set_dirty_iter(s->dbi, 0);
+            trace_mirror_restart_iter(s, bdrv_get_dirty_count(s->dirty_bitmap));
+            if (s->hot_bitmap) {
+                bitmap_zero(s->hot_bitmap,
+                            DIV_ROUND_UP(s->bdev_length, s->granularity));
+            }
+            restarted = true;
+            continue;
+        }
+
+        chunk = offset / s->granularity;
+        if (!test_bit(chunk, s->in_flight_bitmap) &&
+            !(s->hot_bitmap && test_bit(chunk, s->hot_bitmap)))
+        {
+            return offset;
+        }
+        if (fallback < 0) {
+            fallback = offset;
+        }
+        if (++skipped >= MAX_SKIPPED_CHUNKS) {
+            break;
+        }
+    }
+
+    assert(fallback >= 0);
+    return fallback;
+}
+
 static uint64_t coroutine_fn mirror_iteration(MirrorBlockJob *s)
 {
     BlockDriverState *source = s->mirror_top_bs->backing->bs;
@@ -466,13 +530,7 @@ static uint64_t coroutine_fn mirror_iteration(MirrorBlockJob *s)
     int max_io_bytes = MAX(s->buf_size / MAX_IN_FLIGHT, MAX_IO_BYTES);
 
     bdrv_dirty_bitmap_lock(s->dirty_bitmap);
-    offset = bdrv_dirty_iter_next(s->dbi);
-    if (offset < 0) {
-        bdrv_set_dirty_iter(s->dbi, 0);
-        offset = bdrv_dirty_iter_next(s->dbi);
-        trace_mirror_restart_iter(s, bdrv_get_dirty_count(s->dirty_bitmap));
-        assert(offset >= 0);
-    }
+    offset = mirror_next_dirty_offset(s);
     bdrv_dirty_bitmap_unlock(s->dirty_bitmap);
 
     mirror_wait_on_conflicts(NULL, s, offset, 1);
@@ -528,6 +586,9 @@ static uint64_t coroutine_fn mirror_iteration(MirrorBlockJob *s)
     QTAILQ_INSERT_TAIL(&s->ops_in_flight, pseudo_op, next);
 
     bitmap_set(s->in_flight_bitmap, offset / s->granularity, nb_chunks);
+    if (s->hot_bitmap) {
+        bitmap_clear(s->hot_bitmap, offset / s->granularity, nb_chunks);
+    }
     while (nb_chunks > 0 && offset < s->bdev_length) {
         int ret;
         int64_t io_bytes;
@@ -927,6 +988,9 @@ static int coroutine_fn mirror_run(Job *job, Error **errp)
 
     length = DIV_ROUND_UP(s->bdev_length, s->granularity);
     s->in_flight_bitmap = bitmap_new(length);
+    if (s->copy_mode == MIRROR_COPY_MODE_BACKGROUND) {
+        s->hot_bitmap = bitmap_new(length);
+    }
 
     /* If we have no backing file yet in the destination, we cannot let
      * the destination do COW.  Instead, we copy sectors around the
@@ -970,8 +1034,9 @@ static int coroutine_fn mirror_run(Job *job, Error **errp)
         bool should_complete;
 
         /* Do not start passive operations while there are active
-         * writes in progress */
-        while (s->in_active_write_counter) {
+         * writes in progress, except for write-async copies that the
+         * guest is no longer waiting for */
+        while (s->in_active_write_counter > s->in_async_write_counter) {
             mirror_wait_for_any_operation(s, true);
         }
 
@@ -1089,10 +1154,17 @@ immediate_exit:
         mirror_wait_for_all_io(s);
     }
 
+    /* write-async copies still use in_flight_bitmap */
+    while (s->in_async_write_counter) {
+        mirror_wait_for_any_operation(s, true);
+    }
+
     assert(s->in_flight == 0);
     qemu_vfree(s->buf);
     g_free(s->cow_bitmap);
     g_free(s->in_flight_bitmap);
+    g_free(s->hot_bitmap);
+    s->hot_bitmap = NULL;
     bdrv_dirty_iter_free(s->dbi);
 
     if (need_drain) {
@@ -1377,9 +1449,43 @@ static void coroutine_fn active_write_settle(MirrorOp *op)
     bitmap_clear(op->s->in_flight_bitmap, start_chunk, end_chunk - start_chunk);
     QTAILQ_REMOVE(&op->s->ops_in_flight, op, next);
     qemu_co_queue_restart_all(&op->waiting_requests);
+    if (op->bounce_buf) {
+        qemu_iovec_destroy(&op->qiov);
+        qemu_vfree(op->bounce_buf);
+    }
     g_free(op);
 }
 
+/*
+ * In write-async mode, the guest may run ahead of the target by at most
+ * buf_size bytes; beyond that, new writes wait for older copies to finish.
+ */
+static void coroutine_fn mirror_wait_for_active_lag(MirrorBlockJob *s,
+                                                    uint64_t bytes)
+{
+    while (s->active_lag_bytes > 0 &&
+           s->active_lag_bytes + bytes > s->buf_size)
+    {
+        trace_mirror_yield_active_lag(s, s->active_lag_bytes);
+        mirror_wait_for_any_operation(s, true);
+    }
+}
+
+static void coroutine_fn mirror_co_async_target_write(void *opaque)
+{
+    MirrorOp *op = opaque;
+    MirrorBlockJob *s = op->s;
+    BlockDriverState *mirror_top_bs = s->mirror_top_bs;
+
+    do_sync_target_write(s, op->method, op->offset, op->bytes,
+                         op->bounce_buf ? &op->qiov : NULL, op->flags);
+
+    s->active_lag_bytes -= op->bytes;
+    s->in_async_write_counter--;
+    active_write_settle(op);
+    bdrv_dec_in_flight(mirror_top_bs);
+}
+
 static int coroutine_fn bdrv_mirror_top_preadv(BlockDriverState *bs,
     uint64_t offset, uint64_t bytes, QEMUIOVector *qiov, int flags)
 {
@@ -1393,15 +1499,39 @@ static int coroutine_fn bdrv_mirror_top_do_write(BlockDriverState *bs,
     MirrorOp *op = NULL;
     MirrorBDSOpaque *s = bs->opaque;
     int ret = 0;
-    bool copy_to_target;
+    bool copy_to_target, async;
 
     copy_to_target = s->job->ret >= 0 &&
-                     s->job->copy_mode == MIRROR_COPY_MODE_WRITE_BLOCKING;
+                     s->job->copy_mode != MIRROR_COPY_MODE_BACKGROUND;
+    async = copy_to_target &&
+            s->job->copy_mode == MIRROR_COPY_MODE_WRITE_ASYNC;
+
+    if (s->job->hot_bitmap) {
+        uint64_t start_chunk = offset / s->job->granularity;
+        uint64_t end_chunk = DIV_ROUND_UP(offset + bytes, s->job->granularity);
+
+        bitmap_set(s->job->hot_bitmap, start_chunk, end_chunk - start_chunk);
+    }
 
     if (copy_to_target) {
+        if (async) {
+            mirror_wait_for_active_lag(s->job, bytes);
+        }
         op = active_write_prepare(s->job, offset, bytes);
     }
 
+    if (async && qiov) {
+        /* The copy to the target outlives the guest request, so it needs
+         * its own buffer.  Writing the source from that same buffer also
+         * keeps both sides identical if the guest modifies the data
+         * concurrently. */
+        op->bounce_buf = qemu_blockalign(bs, bytes);
+        qemu_iovec_to_buf(qiov, 0, op->bounce_buf, bytes);
+        qemu_iovec_init(&op->qiov, 1);
+        qemu_iovec_add(&op->qiov, op->bounce_buf, bytes);
+        qiov = &op->qiov;
+    }
+
     switch (method) {
     case MIRROR_METHOD_COPY:
         ret = bdrv_co_pwritev(bs->backing, offset, bytes, qiov, flags);
@@ -1423,6 +1553,19 @@ static int coroutine_fn bdrv_mirror_top_do_write(BlockDriverState *bs,
         goto out;
     }
 
+    if (async) {
+        /* The guest request completes now; the op stays in flight, so
+         * conflicting requests and the job still wait for the copy */
+        op->method = method;
+        op->flags = flags;
+        s->job->active_lag_bytes += bytes;
+        s->job->in_async_write_counter++;
+        bdrv_inc_in_flight(bs);
+        op->co = qemu_coroutine_create(mirror_co_async_target_write, op);
+        aio_co_enter(bdrv_get_aio_context(bs), op->co);
+        return ret;
+    }
+
     if (copy_to_target) {
         do_sync_target_write(s->job, method, offset, bytes, qiov, flags);
     }
@@ -1729,7 +1872,7 @@ static BlockJob *mirror_start_job(
     if (!s->dirty_bitmap) {
         goto fail;
     }
-    if (s->copy_mode == MIRROR_COPY_MODE_WRITE_BLOCKING) {
+    if (s->copy_mode != MIRROR_COPY_MODE_BACKGROUND) {
         bdrv_disable_dirty_bitmap(s->dirty_bitmap);
     }
 
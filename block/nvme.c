@@ -32,6 +32,8 @@
 #define NVME_CQ_ENTRY_BYTES 16
 #define NVME_QUEUE_SIZE 128
 #define NVME_DOORBELL_SIZE 4096
+#define NVME_MAX_IO_QUEUES 4
+#define NVME_BOUNCE_BUFS 8
 
 /*
  * We have to leave one slot empty as that is the full queue case where
@@ -45,7 +47,11 @@ typedef struct BDRVNVMeState BDRVNVMeState;
 #define INDEX_ADMIN     0
 #define INDEX_IO(n)     (1 + n)
 
-/* This driver shares a single MSIX IRQ for the admin and I/O queues */
+/*
+ * The admin queue and the first I/O queue, which serves the node's own
+ * AioContext, share one MSIX IRQ.  Further I/O queues serve other
+ * AioContexts and have an IRQ of their own in NVMeQueuePair.
+ */
 enum {
     MSIX_SHARED_IRQ_IDX = 0,
     MSIX_IRQ_COUNT = 1
@@ -62,6 +68,7 @@ typedef struct {
 typedef struct {
     BlockCompletionFunc *cb;
     void *opaque;
+    uint32_t *result; /* if not NULL, receives dword 0 of the completion */
     int cid;
     void *prp_list_page;
     uint64_t prp_list_iova;
@@ -86,6 +93,18 @@ typedef struct {
     NVMeRequest reqs[NVME_NUM_REQS];
     int         need_kick;
     int         inflight;
+    int         plugged;
+
+    /*
+     * AioContext that processes completions.  Always the node's context for
+     * the admin queue and the first I/O queue; the other I/O queues are
+     * claimed by the first context submitting to them, under
+     * BDRVNVMeState.queue_lock.
+     */
+    AioContext  *aio_context;
+
+    /* Only used by I/O queues with an IRQ of their own */
+    EventNotifier irq_notifier;
 
     /* Thread-safe, no lock necessary */
     QEMUBH      *completion_bh;
@@ -106,6 +125,8 @@ struct BDRVNVMeState {
      */
     NVMeQueuePair **queues;
     unsigned queue_count;
+    /* Protects the assignment of I/O queues to AioContexts */
+    QemuMutex queue_lock;
     size_t page_size;
     /* How many uint32_t elements does each doorbell entry take. */
     size_t doorbell_scale;
@@ -117,7 +138,18 @@ struct BDRVNVMeState {
     int blkshift;
 
     uint64_t max_transfer;
-    bool plugged;
+
+    /*
+     * Bounce buffers for unaligned requests.  They stay DMA mapped for
+     * the lifetime of the device so that buffered requests do not create
+     * and tear down temporary IOVA mappings.  Allocated lazily, up to
+     * NVME_BOUNCE_BUFS of them, and protected by bounce_lock.
+     */
+    QemuMutex bounce_lock;
+    void *bounce_bufs[NVME_BOUNCE_BUFS];
+    unsigned bounce_count;      /* Allocated entries of bounce_bufs */
+    void *bounce_free[NVME_BOUNCE_BUFS];
+    unsigned bounce_free_count;
 
     bool supports_write_zeroes;
     bool supports_discard;
@@ -184,12 +216,26 @@ static bool nvme_init_queue(BDRVNVMeState *s, NVMeQueue *q,
     return true;
 }
 
+static bool nvme_queue_has_own_irq(NVMeQueuePair *q)
+{
+    return q->index > INDEX_IO(0);
+}
+
+static EventNotifier *nvme_queue_irq_notifier(NVMeQueuePair *q)
+{
+    if (nvme_queue_has_own_irq(q)) {
+        return &q->irq_notifier;
+    }
+    return &q->s->irq_notifier[MSIX_SHARED_IRQ_IDX];
+}
+
 static void nvme_free_queue_pair(NVMeQueuePair *q)
 {
     trace_nvme_free_queue_pair(q->index, q);
     if (q->completion_bh) {
         qemu_bh_delete(q->completion_bh);
     }
+    event_notifier_cleanup(&q->irq_notifier);
     qemu_vfree(q->prp_list_pages);
     qemu_vfree(q->sq.queue);
     qemu_vfree(q->cq.queue);
@@ -222,8 +268,16 @@ static NVMeQueuePair *nvme_create_queue_pair(BDRVNVMeState *s,
     if (!q) {
         return NULL;
     }
+    q->s = s;
+    q->index = idx;
+    if (nvme_queue_has_own_irq(q) && event_notifier_init(&q->irq_notifier, 0)) {
+        error_setg(errp, "Failed to init event notifier");
+        g_free(q);
+        return NULL;
+    }
     trace_nvme_create_queue_pair(idx, q, size, aio_context,
-                                 event_notifier_get_fd(s->irq_notifier));
+                                 event_notifier_get_fd(
+                                     nvme_queue_irq_notifier(q)));
     bytes = QEMU_ALIGN_UP(s->page_size * NVME_NUM_REQS,
                           qemu_real_host_page_size);
     q->prp_list_pages = qemu_try_memalign(qemu_real_host_page_size, bytes);
@@ -232,10 +286,12 @@ static NVMeQueuePair *nvme_create_queue_pair(BDRVNVMeState *s,
     }
     memset(q->prp_list_pages, 0, bytes);
     qemu_mutex_init(&q->lock);
-    q->s = s;
-    q->index = idx;
     qemu_co_queue_init(&q->free_req_queue);
-    q->completion_bh = aio_bh_new(aio_context, nvme_process_completion_bh, q);
+    q->aio_context = aio_context;
+    if (aio_context) {
+        q->completion_bh = aio_bh_new(aio_context,
+                                      nvme_process_completion_bh, q);
+    }
     r = qemu_vfio_dma_map(s->vfio, q->prp_list_pages, bytes,
                           false, &prp_list_iova);
     if (r) {
@@ -272,7 +328,7 @@ static void nvme_kick(NVMeQueuePair *q)
 {
     BDRVNVMeState *s = q->s;
 
-    if (s->plugged || !q->need_kick) {
+    if (q->plugged || !q->need_kick) {
         return;
     }
     trace_nvme_kick(s, q->index);
@@ -323,7 +379,7 @@ static void nvme_put_free_req_locked(NVMeQueuePair *q, NVMeRequest *req)
 static void nvme_wake_free_req_locked(NVMeQueuePair *q)
 {
     if (!qemu_co_queue_empty(&q->free_req_queue)) {
-        replay_bh_schedule_oneshot_event(q->s->aio_context,
+        replay_bh_schedule_oneshot_event(q->aio_context,
                 nvme_free_req_queue_cb, q);
     }
 }
@@ -369,7 +425,7 @@ static bool nvme_process_completion(NVMeQueuePair *q)
     NvmeCqe *c;
 
     trace_nvme_process_completion(s, q->index, q->inflight);
-    if (s->plugged) {
+    if (q->plugged) {
         trace_nvme_process_completion_queue_plugged(s, q->index);
         return false;
     }
@@ -395,7 +451,7 @@ static bool nvme_process_completion(NVMeQueuePair *q)
         }
         ret = nvme_translate_error(c);
         if (ret) {
-            s->stats.completion_errors++;
+            qatomic_inc(&s->stats.completion_errors);
         }
         q->cq.head = (q->cq.head + 1) % NVME_QUEUE_SIZE;
         if (!q->cq.head) {
@@ -412,8 +468,12 @@ static bool nvme_process_completion(NVMeQueuePair *q)
         req = *preq;
         assert(req.cid == cid);
         assert(req.cb);
+        if (req.result) {
+            *req.result = le32_to_cpu(c->result);
+        }
         nvme_put_free_req_locked(q, preq);
         preq->cb = preq->opaque = NULL;
+        preq->result = NULL;
         q->inflight--;
         qemu_mutex_unlock(&q->lock);
         req.cb(req.opaque, ret);
@@ -490,7 +550,9 @@ static void nvme_admin_cmd_sync_cb(void *opaque, int ret)
     aio_wait_kick();
 }
 
-static int nvme_admin_cmd_sync(BlockDriverState *bs, NvmeCmd *cmd)
+/* If @result is not NULL, it receives dword 0 of the completion entry */
+static int nvme_admin_cmd_sync_result(BlockDriverState *bs, NvmeCmd *cmd,
+                                      uint32_t *result)
 {
     BDRVNVMeState *s = bs->opaque;
     NVMeQueuePair *q = s->queues[INDEX_ADMIN];
@@ -501,12 +563,18 @@ static int nvme_admin_cmd_sync(BlockDriverState *bs, NvmeCmd *cmd)
     if (!req) {
         return -EBUSY;
     }
+    req->result = result;
     nvme_submit_command(q, req, cmd, nvme_admin_cmd_sync_cb, &ret);
 
     AIO_WAIT_WHILE(aio_context, ret == -EINPROGRESS);
     return ret;
 }
 
+static int nvme_admin_cmd_sync(BlockDriverState *bs, NvmeCmd *cmd)
+{
+    return nvme_admin_cmd_sync_result(bs, cmd, NULL);
+}
+
 /* Returns true on success, false on failure. */
 static bool nvme_identify(BlockDriverState *bs, int namespace, Error **errp)
 {
@@ -625,12 +693,13 @@ static bool nvme_poll_queue(NVMeQueuePair *q)
     return progress;
 }
 
+/* Poll the queues that share MSIX_SHARED_IRQ_IDX */
 static bool nvme_poll_queues(BDRVNVMeState *s)
 {
     bool progress = false;
     int i;
 
-    for (i = 0; i < s->queue_count; i++) {
+    for (i = 0; i < MIN(s->queue_count, INDEX_IO(1)); i++) {
         if (nvme_poll_queue(s->queues[i])) {
             progress = true;
         }
@@ -648,6 +717,84 @@ static void nvme_handle_event(EventNotifier *n)
     nvme_poll_queues(s);
 }
 
+static void nvme_handle_io_queue_event(EventNotifier *n)
+{
+    NVMeQueuePair *q = container_of(n, NVMeQueuePair, irq_notifier);
+
+    trace_nvme_handle_event(q->s);
+    event_notifier_test_and_clear(n);
+    nvme_poll_queue(q);
+}
+
+static bool nvme_io_queue_poll_cb(void *opaque)
+{
+    EventNotifier *e = opaque;
+    NVMeQueuePair *q = container_of(e, NVMeQueuePair, irq_notifier);
+
+    return nvme_poll_queue(q);
+}
+
+/* Process the completions of @q in @ctx, with s->queue_lock held */
+static void nvme_io_queue_attach(NVMeQueuePair *q, AioContext *ctx)
+{
+    assert(nvme_queue_has_own_irq(q) && !q->aio_context);
+
+    trace_nvme_io_queue_attach(q->s, q->index, ctx);
+    q->completion_bh = aio_bh_new(ctx, nvme_process_completion_bh, q);
+    aio_set_event_notifier(ctx, &q->irq_notifier, false,
+                           nvme_handle_io_queue_event, nvme_io_queue_poll_cb);
+    qatomic_store_release(&q->aio_context, ctx);
+}
+
+static void nvme_io_queue_detach(NVMeQueuePair *q)
+{
+    if (!q->aio_context) {
+        return;
+    }
+    aio_set_event_notifier(q->aio_context, &q->irq_notifier, false,
+                           NULL, NULL);
+    qemu_bh_delete(q->completion_bh);
+    q->completion_bh = NULL;
+    q->aio_context = NULL;
+}
+
+/*
+ * Return the I/O queue for requests submitted from the current AioContext.
+ * The node's own context uses the first I/O queue.  Other contexts claim
+ * one of the remaining queues on first use, or share one once all of them
+ * are taken; nvme_rw_cb() hands each completion back to the submitter.
+ */
+static NVMeQueuePair *nvme_get_io_queue(BDRVNVMeState *s)
+{
+    AioContext *ctx = qemu_get_current_aio_context();
+    NVMeQueuePair *q;
+    unsigned i;
+
+    if (ctx == s->aio_context || s->queue_count <= INDEX_IO(1)) {
+        return s->queues[INDEX_IO(0)];
+    }
+
+    for (i = INDEX_IO(1); i < s->queue_count; i++) {
+        if (qatomic_load_acquire(&s->queues[i]->aio_context) == ctx) {
+            return s->queues[i];
+        }
+    }
+
+    QEMU_LOCK_GUARD(&s->queue_lock);
+    for (i = INDEX_IO(1); i < s->queue_count; i++) {
+        q = s->queues[i];
+        if (q->aio_context == ctx) {
+            return q;
+        }
+        if (!q->aio_context) {
+            nvme_io_queue_attach(q, ctx);
+            return q;
+        }
+    }
+    i = ((uintptr_t)ctx >> 6) % (s->queue_count - INDEX_IO(1));
+    return s->queues[INDEX_IO(1) + i];
+}
+
 static bool nvme_add_io_queue(BlockDriverState *bs, Error **errp)
 {
     BDRVNVMeState *s = bs->opaque;
@@ -655,9 +802,12 @@ static bool nvme_add_io_queue(BlockDriverState *bs, Error **errp)
     NVMeQueuePair *q;
     NvmeCmd cmd;
     unsigned queue_size = NVME_QUEUE_SIZE;
+    /* I/O queue n has IRQ n - 1, the first one shares IRQ 0 with admin */
+    unsigned irq = n - INDEX_IO(0);
 
     assert(n <= UINT16_MAX);
-    q = nvme_create_queue_pair(s, bdrv_get_aio_context(bs),
+    q = nvme_create_queue_pair(s, n == INDEX_IO(0) ? bdrv_get_aio_context(bs)
+                                                   : NULL,
                                n, queue_size, errp);
     if (!q) {
         return false;
@@ -666,7 +816,7 @@ static bool nvme_add_io_queue(BlockDriverState *bs, Error **errp)
         .opcode = NVME_ADM_CMD_CREATE_CQ,
         .dptr.prp1 = cpu_to_le64(q->cq.iova),
         .cdw10 = cpu_to_le32(((queue_size - 1) << 16) | n),
-        .cdw11 = cpu_to_le32(NVME_CQ_IEN | NVME_CQ_PC),
+        .cdw11 = cpu_to_le32((irq << 16) | NVME_CQ_IEN | NVME_CQ_PC),
     };
     if (nvme_admin_cmd_sync(bs, &cmd)) {
         error_setg(errp, "Failed to create CQ io queue [%u]", n);
@@ -691,6 +841,68 @@ out_error:
     return false;
 }
 
+/*
+ * Create the I/O queue of the node's AioContext, plus one for other
+ * AioContexts per MSIX IRQ that the device has to spare.  The number of
+ * queues must be negotiated before any is created, and the controller
+ * may grant fewer than asked for.  Extra queues are best effort; we stop
+ * at the first one that cannot be created.
+ */
+static bool nvme_add_io_queues(BlockDriverState *bs, Error **errp)
+{
+    BDRVNVMeState *s = bs->opaque;
+    EventNotifier *notifiers[NVME_MAX_IO_QUEUES];
+    Error *local_err = NULL;
+    unsigned nr_queues, i;
+    uint32_t result;
+    int irq_count;
+    NvmeCmd cmd;
+
+    irq_count = qemu_vfio_pci_get_irq_count(s->vfio, VFIO_PCI_MSIX_IRQ_INDEX,
+                                            errp);
+    if (irq_count < 0) {
+        return false;
+    }
+    nr_queues = MIN(NVME_MAX_IO_QUEUES, MAX(irq_count, 1));
+
+    cmd = (NvmeCmd) {
+        .opcode = NVME_ADM_CMD_SET_FEATURES,
+        .cdw10 = cpu_to_le32(NVME_NUMBER_OF_QUEUES),
+        .cdw11 = cpu_to_le32(((nr_queues - 1) << 16) | (nr_queues - 1)),
+    };
+    if (nvme_admin_cmd_sync_result(bs, &cmd, &result)) {
+        /* Mandatory, but try to get along with a single queue pair */
+        nr_queues = 1;
+    } else {
+        /* NSQA in bits 15:0 and NCQA in bits 31:16, both 0's based */
+        nr_queues = MIN(nr_queues, MIN((result & 0xffff) + 1,
+                                       (result >> 16) + 1));
+    }
+    trace_nvme_set_num_queues(s, nr_queues);
+
+    if (!nvme_add_io_queue(bs, errp)) {
+        return false;
+    }
+    for (i = 1; i < nr_queues; i++) {
+        if (!nvme_add_io_queue(bs, &local_err)) {
+            trace_nvme_add_io_queue_failed(s, i, error_get_pretty(local_err));
+            error_free(local_err);
+            break;
+        }
+    }
+    if (s->queue_count <= INDEX_IO(1)) {
+        return true;
+    }
+
+    notifiers[0] = &s->irq_notifier[MSIX_SHARED_IRQ_IDX];
+    for (i = INDEX_IO(1); i < s->queue_count; i++) {
+        notifiers[i - INDEX_IO(0)] = &s->queues[i]->irq_notifier;
+    }
+    return !qemu_vfio_pci_init_irqs(s->vfio, notifiers,
+                                    s->queue_count - INDEX_IO(0),
+                                    VFIO_PCI_MSIX_IRQ_INDEX, errp);
+}
+
 static bool nvme_poll_cb(void *opaque)
 {
     EventNotifier *e = opaque;
@@ -715,6 +927,8 @@ static int nvme_init(BlockDriverState *bs, const char *device, int namespace,
 
     qemu_co_mutex_init(&s->dma_map_lock);
     qemu_co_queue_init(&s->dma_flush_queue);
+    qemu_mutex_init(&s->queue_lock);
+    qemu_mutex_init(&s->bounce_lock);
     s->device = g_strdup(device);
     s->nsid = namespace;
     s->aio_context = bdrv_get_aio_context(bs);
@@ -840,7 +1054,7 @@ static int nvme_init(BlockDriverState *bs, const char *device, int namespace,
     }
 
     /* Set up command queues. */
-    if (!nvme_add_io_queue(bs, errp)) {
+    if (!nvme_add_io_queues(bs, errp)) {
         ret = -EIO;
     }
 out:
@@ -912,9 +1126,18 @@ static void nvme_close(BlockDriverState *bs)
     BDRVNVMeState *s = bs->opaque;
 
     for (unsigned i = 0; i < s->queue_count; ++i) {
+        if (nvme_queue_has_own_irq(s->queues[i])) {
+            nvme_io_queue_detach(s->queues[i]);
+        }
         nvme_free_queue_pair(s->queues[i]);
     }
     g_free(s->queues);
+    qemu_mutex_destroy(&s->queue_lock);
+    for (unsigned i = 0; i < s->bounce_count; i++) {
+        qemu_vfio_dma_unmap(s->vfio, s->bounce_bufs[i]);
+        qemu_vfree(s->bounce_bufs[i]);
+    }
+    qemu_mutex_destroy(&s->bounce_lock);
     aio_set_event_notifier(bdrv_get_aio_context(bs),
                            &s->irq_notifier[MSIX_SHARED_IRQ_IDX],
                            false, NULL, NULL);
@@ -1119,7 +1342,7 @@ static coroutine_fn int nvme_co_prw_aligned(BlockDriverState *bs,
 {
     int r;
     BDRVNVMeState *s = bs->opaque;
-    NVMeQueuePair *ioq = s->queues[INDEX_IO(0)];
+    NVMeQueuePair *ioq = nvme_get_io_queue(s);
     NVMeRequest *req;
 
     uint32_t cdw12 = (((bytes >> s->blkshift) - 1) & 0xFFFF) |
@@ -1132,7 +1355,7 @@ static coroutine_fn int nvme_co_prw_aligned(BlockDriverState *bs,
         .cdw12 = cpu_to_le32(cdw12),
     };
     NVMeCoData data = {
-        .ctx = bdrv_get_aio_context(bs),
+        .ctx = qemu_get_current_aio_context(),
         .ret = -EINPROGRESS,
     };
 
@@ -1184,24 +1407,67 @@ static inline bool nvme_qiov_aligned(BlockDriverState *bs,
     return true;
 }
 
+/*
+ * Take a bounce buffer of s->max_transfer bytes from the pool, allocating
+ * and mapping a new one if the pool is not full yet.  Return NULL if all
+ * buffers are in use or a new one cannot be mapped.
+ */
+static void *nvme_get_bounce_buf(BDRVNVMeState *s)
+{
+    size_t len = QEMU_ALIGN_UP(s->max_transfer, qemu_real_host_page_size);
+    void *buf;
+
+    QEMU_LOCK_GUARD(&s->bounce_lock);
+    if (s->bounce_free_count) {
+        return s->bounce_free[--s->bounce_free_count];
+    }
+    if (s->bounce_count == NVME_BOUNCE_BUFS) {
+        return NULL;
+    }
+
+    buf = qemu_try_memalign(qemu_real_host_page_size, len);
+    if (!buf) {
+        return NULL;
+    }
+    if (qemu_vfio_dma_map(s->vfio, buf, len, false, NULL)) {
+        qemu_vfree(buf);
+        return NULL;
+    }
+    trace_nvme_bounce_buf_alloc(s, s->bounce_count, buf);
+    s->bounce_bufs[s->bounce_count++] = buf;
+    return buf;
+}
+
+static void nvme_put_bounce_buf(BDRVNVMeState *s, void *buf)
+{
+    QEMU_LOCK_GUARD(&s->bounce_lock);
+    assert(s->bounce_free_count < s->bounce_count);
+    s->bounce_free[s->bounce_free_count++] = buf;
+}
+
 static int nvme_co_prw(BlockDriverState *bs, uint64_t offset, uint64_t bytes,
                        QEMUIOVector *qiov, bool is_write, int flags)
 {
     BDRVNVMeState *s = bs->opaque;
     int r;
     uint8_t *buf = NULL;
+    bool pooled;
     QEMUIOVector local_qiov;
     size_t len = QEMU_ALIGN_UP(bytes, qemu_real_host_page_size);
     assert(QEMU_IS_ALIGNED(offset, s->page_size));
     assert(QEMU_IS_ALIGNED(bytes, s->page_size));
     assert(bytes <= s->max_transfer);
     if (nvme_qiov_aligned(bs, qiov)) {
-        s->stats.aligned_accesses++;
+        qatomic_inc(&s->stats.aligned_accesses);
         return nvme_co_prw_aligned(bs, offset, bytes, qiov, is_write, flags);
     }
-    s->stats.unaligned_accesses++;
+    qatomic_inc(&s->stats.unaligned_accesses);
     trace_nvme_prw_buffered(s, offset, bytes, qiov->niov, is_write);
-    buf = qemu_try_memalign(qemu_real_host_page_size, len);
+    buf = nvme_get_bounce_buf(s);
+    pooled = buf;
+    if (!buf) {
+        buf = qemu_try_memalign(qemu_real_host_page_size, len);
+    }
 
     if (!buf) {
         return -ENOMEM;
@@ -1216,7 +1482,11 @@ static int nvme_co_prw(BlockDriverState *bs, uint64_t offset, uint64_t bytes,
     if (!r && !is_write) {
         qemu_iovec_from_buf(qiov, 0, buf, bytes);
     }
-    qemu_vfree(buf);
+    if (pooled) {
+        nvme_put_bounce_buf(s, buf);
+    } else {
+        qemu_vfree(buf);
+    }
     return r;
 }
 
@@ -1237,14 +1507,14 @@ static coroutine_fn int nvme_co_pwritev(BlockDriverState *bs,
 static coroutine_fn int nvme_co_flush(BlockDriverState *bs)
 {
     BDRVNVMeState *s = bs->opaque;
-    NVMeQueuePair *ioq = s->queues[INDEX_IO(0)];
+    NVMeQueuePair *ioq = nvme_get_io_queue(s);
     NVMeRequest *req;
     NvmeCmd cmd = {
         .opcode = NVME_CMD_FLUSH,
         .nsid = cpu_to_le32(s->nsid),
     };
     NVMeCoData data = {
-        .ctx = bdrv_get_aio_context(bs),
+        .ctx = qemu_get_current_aio_context(),
         .ret = -EINPROGRESS,
     };
 
@@ -1268,7 +1538,7 @@ static coroutine_fn int nvme_co_pwrite_zeroes(BlockDriverState *bs,
                                               BdrvRequestFlags flags)
 {
     BDRVNVMeState *s = bs->opaque;
-    NVMeQueuePair *ioq = s->queues[INDEX_IO(0)];
+    NVMeQueuePair *ioq = nvme_get_io_queue(s);
     NVMeRequest *req;
 
     uint32_t cdw12 = ((bytes >> s->blkshift) - 1) & 0xFFFF;
@@ -1285,7 +1555,7 @@ static coroutine_fn int nvme_co_pwrite_zeroes(BlockDriverState *bs,
     };
 
     NVMeCoData data = {
-        .ctx = bdrv_get_aio_context(bs),
+        .ctx = qemu_get_current_aio_context(),
         .ret = -EINPROGRESS,
     };
 
@@ -1321,7 +1591,7 @@ static int coroutine_fn nvme_co_pdiscard(BlockDriverState *bs,
                                          int bytes)
 {
     BDRVNVMeState *s = bs->opaque;
-    NVMeQueuePair *ioq = s->queues[INDEX_IO(0)];
+    NVMeQueuePair *ioq = nvme_get_io_queue(s);
     NVMeRequest *req;
     NvmeDsmRange *buf;
     QEMUIOVector local_qiov;
@@ -1335,7 +1605,7 @@ static int coroutine_fn nvme_co_pdiscard(BlockDriverState *bs,
     };
 
     NVMeCoData data = {
-        .ctx = bdrv_get_aio_context(bs),
+        .ctx = qemu_get_current_aio_context(),
         .ret = -EINPROGRESS,
     };
 
@@ -1449,6 +1719,11 @@ static void nvme_detach_aio_context(BlockDriverState *bs)
     for (unsigned i = 0; i < s->queue_count; i++) {
         NVMeQueuePair *q = s->queues[i];
 
+        if (nvme_queue_has_own_irq(q)) {
+            /* Claimed again by whichever context submits next */
+            nvme_io_queue_detach(q);
+            continue;
+        }
         qemu_bh_delete(q->completion_bh);
         q->completion_bh = NULL;
     }
@@ -1467,33 +1742,41 @@ static void nvme_attach_aio_context(BlockDriverState *bs,
     aio_set_event_notifier(new_context, &s->irq_notifier[MSIX_SHARED_IRQ_IDX],
                            false, nvme_handle_event, nvme_poll_cb);
 
-    for (unsigned i = 0; i < s->queue_count; i++) {
+    for (unsigned i = 0; i < MIN(s->queue_count, INDEX_IO(1)); i++) {
         NVMeQueuePair *q = s->queues[i];
 
+        q->aio_context = new_context;
         q->completion_bh =
             aio_bh_new(new_context, nvme_process_completion_bh, q);
     }
 }
 
+/*
+ * Called for every nesting level (supports_multiqueue), so each I/O queue
+ * counts the plugs of the contexts that submit to it.
+ */
 static void nvme_aio_plug(BlockDriverState *bs)
 {
     BDRVNVMeState *s = bs->opaque;
-    assert(!s->plugged);
-    s->plugged = true;
+    NVMeQueuePair *q = nvme_get_io_queue(s);
+
+    qemu_mutex_lock(&q->lock);
+    q->plugged++;
+    qemu_mutex_unlock(&q->lock);
 }
 
 static void nvme_aio_unplug(BlockDriverState *bs)
 {
     BDRVNVMeState *s = bs->opaque;
-    assert(s->plugged);
-    s->plugged = false;
-    for (unsigned i = INDEX_IO(0); i < s->queue_count; i++) {
-        NVMeQueuePair *q = s->queues[i];
-        qemu_mutex_lock(&q->lock);
+    NVMeQueuePair *q = nvme_get_io_queue(s);
+
+    qemu_mutex_lock(&q->lock);
+    assert(q->plugged);
+    if (!--q->plugged) {
         nvme_kick(q);
         nvme_process_completion(q);
-        qemu_mutex_unlock(&q->lock);
     }
+    qemu_mutex_unlock(&q->lock);
 }
 
 static void nvme_register_buf(BlockDriverState *bs, void *host, size_t size)
@@ -1543,6 +1826,7 @@ static BlockDriver bdrv_nvme = {
     .format_name              = "nvme",
     .protocol_name            = "nvme",
     .instance_size            = sizeof(BDRVNVMeState),
+    .supports_multiqueue      = true,
 
     .bdrv_co_create_opts      = bdrv_co_create_opts_simple,
     .create_opts              = &bdrv_create_opts_simple,
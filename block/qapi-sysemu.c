@@ -588,3 +588,42 @@ void qmp_block_latency_histogram_set(
         }
     }
 }
+
+void qmp_x_device_set_iothread(const char *id,
+                               bool has_iothread, const char *iothread,
+                               bool has_iothread_vq_mapping,
+                               strList *iothread_vq_mapping,
+                               Error **errp)
+{
+    BlockBackend *blk;
+    g_autoptr(GString) mapping = NULL;
+    strList *l;
+
+    if (has_iothread && has_iothread_vq_mapping) {
+        error_setg(errp, "iothread and iothread-vq-mapping cannot be used "
+                   "together");
+        return;
+    }
+
+    blk = blk_by_qdev_id(id, errp);
+    if (!blk) {
+        return;
+    }
+
+    if (has_iothread_vq_mapping) {
+        if (!iothread_vq_mapping) {
+            error_setg(errp, "iothread-vq-mapping must not be empty");
+            return;
+        }
+        /* IOThread ids are well-formed ids, they never contain a colon */
+        mapping = g_string_new(NULL);
+        for (l = iothread_vq_mapping; l; l = l->next) {
+            g_string_append_printf(mapping, "%s%s",
+                                   l == iothread_vq_mapping ? "" : ":",
+                                   l->value);
+        }
+    }
+
+    blk_dev_set_iothread(blk, has_iothread ? iothread : NULL,
+                         mapping ? mapping->str : NULL, errp);
+}
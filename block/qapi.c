@@ -430,6 +430,26 @@ static void bdrv_latency_histogram_stats(BlockLatencyHistogram *hist,
     }
 }
 
+static void bdrv_latency_percentiles_stats(BlockAcctStats *stats,
+                                           enum BlockAcctType type,
+                                           bool *not_null,
+                                           BlockLatencyPercentiles **info)
+{
+    uint64_t count;
+    uint64_t p50 = block_acct_latency_percentile(stats, type, 50, &count);
+
+    *not_null = count > 0;
+    if (*not_null) {
+        *info = g_new0(BlockLatencyPercentiles, 1);
+
+        (*info)->p50 = p50;
+        (*info)->p99 = block_acct_latency_percentile(stats, type, 99, &count);
+        (*info)->p999 = block_acct_latency_percentile(stats, type, 99.9,
+                                                      &count);
+        (*info)->count = count;
+    }
+}
+
 static void bdrv_query_blk_stats(BlockDeviceStats *ds, BlockBackend *blk)
 {
     BlockAcctStats *stats = blk_get_stats(blk);
@@ -508,6 +528,36 @@ static void bdrv_query_blk_stats(BlockDeviceStats *ds, BlockBackend *blk)
     bdrv_latency_histogram_stats(&stats->latency_histogram[BLOCK_ACCT_FLUSH],
                                  &ds->has_flush_latency_histogram,
                                  &ds->flush_latency_histogram);
+
+    bdrv_latency_percentiles_stats(stats, BLOCK_ACCT_READ,
+                                   &ds->has_rd_latency_percentiles,
+                                   &ds->rd_latency_percentiles);
+    bdrv_latency_percentiles_stats(stats, BLOCK_ACCT_WRITE,
+                                   &ds->has_wr_latency_percentiles,
+                                   &ds->wr_latency_percentiles);
+    bdrv_latency_percentiles_stats(stats, BLOCK_ACCT_FLUSH,
+                                   &ds->has_flush_latency_percentiles,
+                                   &ds->flush_latency_percentiles);
+}
+
+static BlockLatencyBreakdown *bdrv_query_trace_stats(BlockDriverState *bs)
+{
+    BdrvTraceStats *stats = &bs->trace_stats;
+    BlockLatencyBreakdown *info;
+
+    if (!stat64_get(&stats->requests)) {
+        return NULL;
+    }
+
+    info = g_new0(BlockLatencyBreakdown, 1);
+    info->requests = stat64_get(&stats->requests);
+    info->total_ns = stat64_get(&stats->total_ns);
+    info->self_ns = stat64_get(&stats->self_ns);
+    info->serialising_wait_ns = stat64_get(&stats->serialising_wait_ns);
+    info->lock_wait_ns = stat64_get(&stats->lock_wait_ns);
+    info->throttle_wait_ns = stat64_get(&stats->throttle_wait_ns);
+
+    return info;
 }
 
 static BlockStats *bdrv_query_bds_stats(BlockDriverState *bs,
@@ -543,6 +593,9 @@ static BlockStats *bdrv_query_bds_stats(BlockDriverState *bs,
         s->has_driver_specific = true;
     }
 
+    s->latency_breakdown = bdrv_query_trace_stats(bs);
+    s->has_latency_breakdown = s->latency_breakdown != NULL;
+
     parent_child = bdrv_primary_child(bs);
     if (!parent_child ||
         !(parent_child->role & (BDRV_CHILD_DATA | BDRV_CHILD_FILTERED)))
@@ -28,6 +28,7 @@
 #include "qemu/osdep.h"
 #include "qapi/error.h"
 #include "qemu/cutils.h"
+#include "qemu/units.h"
 
 #include "qcow2.h"
 
@@ -45,6 +46,9 @@
 /* Size of bitmap table entries */
 #define BME_TABLE_ENTRY_SIZE (sizeof(uint64_t))
 
+/* Bitmap data clusters contiguous in the image are read/written in one go */
+#define BME_MAX_IO_SIZE (4 * MiB)
+
 QEMU_BUILD_BUG_ON(BME_MAX_NAME_SIZE != BDRV_BITMAP_MAX_NAME_SIZE);
 
 #if BME_MAX_TABLE_SIZE * 8ULL > INT_MAX
@@ -291,7 +295,7 @@ static int load_bitmap_data(BlockDriverState *bs,
     uint64_t offset, limit;
     uint64_t bm_size = bdrv_dirty_bitmap_size(bitmap);
     uint8_t *buf = NULL;
-    uint64_t i, tab_size =
+    uint64_t i, j, n, max_clusters, tab_size =
             size_to_clusters(s,
                 bdrv_dirty_bitmap_serialization_size(bitmap, 0, bm_size));
 
@@ -299,15 +303,17 @@ static int load_bitmap_data(BlockDriverState *bs,
         return -EINVAL;
     }
 
-    buf = g_malloc(s->cluster_size);
+    max_clusters = MAX(BME_MAX_IO_SIZE / s->cluster_size, 1);
+    buf = g_malloc(MIN(tab_size, max_clusters) * s->cluster_size);
     limit = bdrv_dirty_bitmap_serialization_coverage(s->cluster_size, bitmap);
-    for (i = 0, offset = 0; i < tab_size; ++i, offset += limit) {
+    for (i = 0, offset = 0; i < tab_size; i += n, offset += n * limit) {
         uint64_t count = MIN(bm_size - offset, limit);
         uint64_t entry = bitmap_table[i];
         uint64_t data_offset = entry & BME_TABLE_ENTRY_OFFSET_MASK;
 
         assert(check_table_entry(entry, s->cluster_size) == 0);
 
+        n = 1;
         if (data_offset == 0) {
             if (entry & BME_TABLE_ENTRY_FLAG_ALL_ONES) {
                 bdrv_dirty_bitmap_deserialize_ones(bitmap, offset, count,
@@ -316,12 +322,27 @@ static int load_bitmap_data(BlockDriverState *bs,
                 /* No need to deserialize zeros because the dirty bitmap is
                  * already cleared */
             }
-        } else {
-            ret = bdrv_pread(bs->file, data_offset, buf, s->cluster_size);
-            if (ret < 0) {
-                goto finish;
-            }
-            bdrv_dirty_bitmap_deserialize_part(bitmap, buf, offset, count,
+            continue;
+        }
+
+        /* Gather the following entries stored right after this one */
+        while (n < max_clusters && i + n < tab_size &&
+               (bitmap_table[i + n] & BME_TABLE_ENTRY_OFFSET_MASK) ==
+               data_offset + n * s->cluster_size) {
+            assert(check_table_entry(bitmap_table[i + n],
+                                     s->cluster_size) == 0);
+            n++;
+        }
+
+        ret = bdrv_pread(bs->file, data_offset, buf, n * s->cluster_size);
+        if (ret < 0) {
+            goto finish;
+        }
+        for (j = 0; j < n; j++) {
+            count = MIN(bm_size - (offset + j * limit), limit);
+            bdrv_dirty_bitmap_deserialize_part(bitmap,
+                                               buf + j * s->cluster_size,
+                                               offset + j * limit, count,
                                                false);
         }
     }
@@ -1267,8 +1288,8 @@ static uint64_t *store_bitmap_data(BlockDriverState *bs,
 {
     int ret;
     BDRVQcow2State *s = bs->opaque;
-    int64_t offset;
-    uint64_t limit;
+    int64_t offset, next;
+    uint64_t limit, max_clusters;
     uint64_t bm_size = bdrv_dirty_bitmap_size(bitmap);
     const char *bm_name = bdrv_dirty_bitmap_name(bitmap);
     uint8_t *buf = NULL;
@@ -1290,57 +1311,72 @@ static uint64_t *store_bitmap_data(BlockDriverState *bs,
         return NULL;
     }
 
-    buf = g_malloc(s->cluster_size);
+    max_clusters = MAX(BME_MAX_IO_SIZE / s->cluster_size, 1);
+    buf = g_malloc(MIN(tb_size, max_clusters) * s->cluster_size);
     limit = bdrv_dirty_bitmap_serialization_coverage(s->cluster_size, bitmap);
     assert(DIV_ROUND_UP(bm_size, limit) == tb_size);
 
-    offset = 0;
-    while ((offset = bdrv_dirty_bitmap_next_dirty(bitmap, offset, INT64_MAX))
-           >= 0)
-    {
-        uint64_t cluster = offset / limit;
-        uint64_t end, write_size;
+    next = bdrv_dirty_bitmap_next_dirty(bitmap, 0, INT64_MAX);
+    while (next >= 0) {
+        uint64_t cluster, end, write_size, n, j;
         int64_t off;
 
         /*
          * We found the first dirty offset, but want to write out the
          * entire cluster of the bitmap that includes that offset,
-         * including any leading zero bits.
+         * including any leading zero bits.  Following clusters that also
+         * have dirty bits are written along with it.
          */
-        offset = QEMU_ALIGN_DOWN(offset, limit);
+        offset = QEMU_ALIGN_DOWN(next, limit);
+        cluster = offset / limit;
         end = MIN(bm_size, offset + limit);
-        write_size = bdrv_dirty_bitmap_serialization_size(bitmap, offset,
-                                                          end - offset);
-        assert(write_size <= s->cluster_size);
+        n = 1;
+        for (;;) {
+            next = bdrv_dirty_bitmap_next_dirty(bitmap, end, INT64_MAX);
+            if (next < 0 || next >= end + limit || n == max_clusters) {
+                break;
+            }
+            end = MIN(bm_size, end + limit);
+            n++;
+        }
 
-        off = qcow2_alloc_clusters(bs, s->cluster_size);
+        off = qcow2_alloc_clusters(bs, n * s->cluster_size);
         if (off < 0) {
             error_setg_errno(errp, -off,
                              "Failed to allocate clusters for bitmap '%s'",
                              bm_name);
             goto fail;
         }
-        tb[cluster] = off;
 
-        bdrv_dirty_bitmap_serialize_part(bitmap, buf, offset, end - offset);
-        if (write_size < s->cluster_size) {
-            memset(buf + write_size, 0, s->cluster_size - write_size);
+        for (j = 0; j < n; j++) {
+            uint64_t start = offset + j * limit;
+            uint64_t count = MIN(bm_size - start, limit);
+            uint8_t *p = buf + j * s->cluster_size;
+
+            tb[cluster + j] = off + j * s->cluster_size;
+
+            write_size = bdrv_dirty_bitmap_serialization_size(bitmap, start,
+                                                              count);
+            assert(write_size <= s->cluster_size);
+            bdrv_dirty_bitmap_serialize_part(bitmap, p, start, count);
+            if (write_size < s->cluster_size) {
+                memset(p + write_size, 0, s->cluster_size - write_size);
+            }
         }
 
-        ret = qcow2_pre_write_overlap_check(bs, 0, off, s->cluster_size, false);
+        ret = qcow2_pre_write_overlap_check(bs, 0, off, n * s->cluster_size,
+                                            false);
         if (ret < 0) {
             error_setg_errno(errp, -ret, "Qcow2 overlap check failed");
             goto fail;
         }
 
-        ret = bdrv_pwrite(bs->file, off, buf, s->cluster_size);
+        ret = bdrv_pwrite(bs->file, off, buf, n * s->cluster_size);
         if (ret < 0) {
             error_setg_errno(errp, -ret, "Failed to write bitmap '%s' to file",
                              bm_name);
             goto fail;
         }
-
-        offset = end;
     }
 
     *bitmap_table_size = tb_size;
@@ -26,11 +26,26 @@
 #include "qcow2.h"
 #include "trace.h"
 
+/*
+ * Cached tables are found through a hash table of offsets whose chains
+ * are threaded through the entries themselves, so a lookup costs O(1)
+ * however large the cache is.  Entries that are not in use are evicted
+ * in CLOCK order: a hand sweeps over the entries, giving a second
+ * chance to those that were used since it last passed.
+ *
+ * Lookups with qcow2_cache_lookup() never yield and may be done without
+ * holding s->lock.  To keep them safe, an entry is pinned with an extra
+ * reference while it is being written back or refilled, and is removed
+ * from the hash table before its contents are replaced.
+ */
+
 typedef struct Qcow2CachedTable {
     int64_t  offset;
     uint64_t lru_counter;
     int      ref;
+    int      hash_next;     /* Next entry in the same hash chain, or -1 */
     bool     dirty;
+    bool     referenced;    /* Used since the CLOCK hand last passed */
 } Qcow2CachedTable;
 
 struct Qcow2Cache {
@@ -40,8 +55,12 @@ struct Qcow2Cache {
     int                     table_size;
     bool                    depends_on_flush;
     void                   *table_array;
+    bool                    table_array_large;
     uint64_t                lru_counter;
     uint64_t                cache_clean_lru_counter;
+    int                    *buckets;
+    int                     hash_bits;
+    int                     clock_hand;
 };
 
 static inline void *qcow2_cache_get_table_addr(Qcow2Cache *c, int table)
@@ -57,6 +76,66 @@ static inline int qcow2_cache_get_table_idx(Qcow2Cache *c, void *table)
     return idx;
 }
 
+static inline unsigned qcow2_cache_hash(Qcow2Cache *c, uint64_t offset)
+{
+    return (offset / c->table_size * 0x9e3779b97f4a7c15ULL) >>
+           (64 - c->hash_bits);
+}
+
+static void qcow2_cache_hash_insert(Qcow2Cache *c, int i)
+{
+    unsigned h = qcow2_cache_hash(c, c->entries[i].offset);
+
+    c->entries[i].hash_next = c->buckets[h];
+    c->buckets[h] = i;
+}
+
+static void qcow2_cache_hash_remove(Qcow2Cache *c, int i)
+{
+    int *link = &c->buckets[qcow2_cache_hash(c, c->entries[i].offset)];
+
+    while (*link != i) {
+        assert(*link != -1);
+        link = &c->entries[*link].hash_next;
+    }
+    *link = c->entries[i].hash_next;
+    c->entries[i].hash_next = -1;
+}
+
+static void qcow2_cache_hash_reset(Qcow2Cache *c)
+{
+    int i;
+
+    for (i = 0; i < (1 << c->hash_bits); i++) {
+        c->buckets[i] = -1;
+    }
+    for (i = 0; i < c->size; i++) {
+        c->entries[i].hash_next = -1;
+    }
+}
+
+/* Return the index of the entry caching @offset, or -1 */
+static int qcow2_cache_hash_lookup(Qcow2Cache *c, uint64_t offset)
+{
+    int i = c->buckets[qcow2_cache_hash(c, offset)];
+
+    while (i != -1 && c->entries[i].offset != offset) {
+        i = c->entries[i].hash_next;
+    }
+    return i;
+}
+
+/* Unhash entry @i and mark it as free */
+static void qcow2_cache_entry_clear(Qcow2Cache *c, int i)
+{
+    if (c->entries[i].offset) {
+        qcow2_cache_hash_remove(c, i);
+    }
+    c->entries[i].offset = 0;
+    c->entries[i].lru_counter = 0;
+    c->entries[i].referenced = false;
+}
+
 static inline const char *qcow2_cache_get_name(BDRVQcow2State *s, Qcow2Cache *c)
 {
     if (c == s->refcount_block_cache) {
@@ -104,8 +183,7 @@ void qcow2_cache_clean_unused(Qcow2Cache *c)
 
         /* And count how many we can clean in a row */
         while (i < c->size && can_clean_entry(c, i)) {
-            c->entries[i].offset = 0;
-            c->entries[i].lru_counter = 0;
+            qcow2_cache_entry_clear(c, i);
             i++;
             to_clean++;
         }
@@ -118,10 +196,20 @@ void qcow2_cache_clean_unused(Qcow2Cache *c)
     c->cache_clean_lru_counter = c->lru_counter;
 }
 
+static void qcow2_cache_free_tables(Qcow2Cache *c)
+{
+    if (c->table_array_large) {
+        qemu_free_large(c->table_array, (size_t) c->size * c->table_size);
+    } else {
+        qemu_vfree(c->table_array);
+    }
+}
+
 Qcow2Cache *qcow2_cache_create(BlockDriverState *bs, int num_tables,
                                unsigned table_size)
 {
     BDRVQcow2State *s = bs->opaque;
+    size_t pool_size = (size_t) num_tables * table_size;
     Qcow2Cache *c;
 
     assert(num_tables > 0);
@@ -133,14 +221,32 @@ Qcow2Cache *qcow2_cache_create(BlockDriverState *bs, int num_tables,
     c->size = num_tables;
     c->table_size = table_size;
     c->entries = g_try_new0(Qcow2CachedTable, num_tables);
-    c->table_array = qemu_try_blockalign(bs->file->bs,
-                                         (size_t) num_tables * c->table_size);
 
-    if (!c->entries || !c->table_array) {
-        qemu_vfree(c->table_array);
+    /*
+     * Tables are accessed at random, so big caches benefit from huge pages.
+     * The page alignment of qemu_try_alloc_large() is enough for I/O on
+     * the file unless it needs more.
+     */
+    c->table_array_large =
+        bdrv_opt_mem_align(bs->file->bs) <= qemu_real_host_page_size;
+    if (c->table_array_large) {
+        c->table_array = qemu_try_alloc_large(pool_size);
+    } else {
+        c->table_array = qemu_try_blockalign(bs->file->bs, pool_size);
+    }
+
+    /* Keep the load factor of the hash table at or below 1/2 */
+    c->hash_bits = ctz64(pow2ceil((uint64_t) num_tables * 2));
+    c->buckets = g_try_new(int, 1 << c->hash_bits);
+
+    if (!c->entries || !c->table_array || !c->buckets) {
+        qcow2_cache_free_tables(c);
+        g_free(c->buckets);
         g_free(c->entries);
         g_free(c);
         c = NULL;
+    } else {
+        qcow2_cache_hash_reset(c);
     }
 
     return c;
@@ -154,7 +260,8 @@ int qcow2_cache_destroy(Qcow2Cache *c)
         assert(c->entries[i].ref == 0);
     }
 
-    qemu_vfree(c->table_array);
+    qcow2_cache_free_tables(c);
+    g_free(c->buckets);
     g_free(c->entries);
     g_free(c);
 
@@ -188,6 +295,19 @@ static int qcow2_cache_entry_flush(BlockDriverState *bs, Qcow2Cache *c, int i)
     trace_qcow2_cache_entry_flush(qemu_coroutine_self(),
                                   c == s->l2_table_cache, i);
 
+    if (s->journal_size) {
+        /*
+         * This commits every dirty table of both caches, including this one.
+         * -ENOSPC means that they do not fit into the journal; it has been
+         * checkpointed then, so write the table in place as usual.
+         */
+        ret = qcow2_journal_commit(bs);
+        if (ret != -ENOSPC) {
+            return ret;
+        }
+        ret = 0;
+    }
+
     if (c->depends) {
         ret = qcow2_cache_flush_dependency(bs, c);
     } else if (c->depends_on_flush) {
@@ -307,24 +427,54 @@ int qcow2_cache_empty(BlockDriverState *bs, Qcow2Cache *c)
         assert(c->entries[i].ref == 0);
         c->entries[i].offset = 0;
         c->entries[i].lru_counter = 0;
+        c->entries[i].referenced = false;
     }
 
+    qcow2_cache_hash_reset(c);
     qcow2_cache_table_release(c, 0, c->size);
 
     c->lru_counter = 0;
+    c->clock_hand = 0;
 
     return 0;
 }
 
+/*
+ * Advance the CLOCK hand to an entry that is not in use and has not been
+ * used since the hand last passed it.  Return its index, or -1 if every
+ * entry is in use.
+ */
+static int qcow2_cache_find_victim(Qcow2Cache *c)
+{
+    int n;
+
+    /* The first sweep clears all reference bits, so two are enough */
+    for (n = 0; n < 2 * c->size; n++) {
+        int i = c->clock_hand;
+        Qcow2CachedTable *t = &c->entries[i];
+
+        if (++c->clock_hand == c->size) {
+            c->clock_hand = 0;
+        }
+        if (t->ref > 0) {
+            continue;
+        }
+        if (t->referenced && t->offset != 0) {
+            t->referenced = false;
+            continue;
+        }
+        return i;
+    }
+    return -1;
+}
+
 static int qcow2_cache_do_get(BlockDriverState *bs, Qcow2Cache *c,
     uint64_t offset, void **table, bool read_from_disk)
 {
     BDRVQcow2State *s = bs->opaque;
+    int64_t read_offset;
     int i;
     int ret;
-    int lookup_index;
-    uint64_t min_lru_counter = UINT64_MAX;
-    int min_lru_index = -1;
 
     assert(offset != 0);
 
@@ -339,58 +489,69 @@ static int qcow2_cache_do_get(BlockDriverState *bs, Qcow2Cache *c,
     }
 
     /* Check if the table is already cached */
-    i = lookup_index = (offset / c->table_size * 4) % c->size;
+    i = qcow2_cache_hash_lookup(c, offset);
+    if (i != -1) {
+        goto found;
+    }
+
     do {
-        const Qcow2CachedTable *t = &c->entries[i];
-        if (t->offset == offset) {
-            goto found;
-        }
-        if (t->ref == 0 && t->lru_counter < min_lru_counter) {
-            min_lru_counter = t->lru_counter;
-            min_lru_index = i;
+        i = qcow2_cache_find_victim(c);
+        if (i == -1) {
+            /* This can't happen in current synchronous code, but leave the
+             * check here as a reminder for whoever starts using AIO with the
+             * cache */
+            abort();
         }
-        if (++i == c->size) {
-            i = 0;
-        }
-    } while (i != lookup_index);
 
-    if (min_lru_index == -1) {
-        /* This can't happen in current synchronous code, but leave the check
-         * here as a reminder for whoever starts using AIO with the cache */
-        abort();
-    }
+        /* Cache miss: write a table back and replace it */
+        trace_qcow2_cache_get_replace_entry(qemu_coroutine_self(),
+                                            c == s->l2_table_cache, i);
 
-    /* Cache miss: write a table back and replace it */
-    i = min_lru_index;
-    trace_qcow2_cache_get_replace_entry(qemu_coroutine_self(),
-                                        c == s->l2_table_cache, i);
+        c->entries[i].ref++;
+        ret = qcow2_cache_entry_flush(bs, c, i);
+        c->entries[i].ref--;
+        if (ret < 0) {
+            return ret;
+        }
 
-    ret = qcow2_cache_entry_flush(bs, c, i);
-    if (ret < 0) {
-        return ret;
-    }
+        /*
+         * A lock-free lookup that had to signal corruption may still be
+         * holding the entry; pick another one then.
+         */
+    } while (c->entries[i].ref > 0);
 
     trace_qcow2_cache_get_read(qemu_coroutine_self(),
                                c == s->l2_table_cache, i);
-    c->entries[i].offset = 0;
+    qcow2_cache_entry_clear(c, i);
     if (read_from_disk) {
         if (c == s->l2_table_cache) {
             BLKDBG_EVENT(bs->file, BLKDBG_L2_LOAD);
         }
 
-        ret = bdrv_pread(bs->file, offset,
+        c->entries[i].ref++;
+        read_offset = offset;
+        if (s->journal_size) {
+            /* The latest copy of the table may still be in the journal */
+            read_offset = qcow2_journal_table_offset(bs, offset,
+                                                     c->table_size);
+        }
+        ret = read_offset < 0 ? read_offset :
+              bdrv_pread(bs->file, read_offset,
                          qcow2_cache_get_table_addr(c, i),
                          c->table_size);
+        c->entries[i].ref--;
         if (ret < 0) {
             return ret;
         }
     }
 
     c->entries[i].offset = offset;
+    qcow2_cache_hash_insert(c, i);
 
     /* And return the right table */
 found:
     c->entries[i].ref++;
+    c->entries[i].referenced = true;
     *table = qcow2_cache_get_table_addr(c, i);
 
     trace_qcow2_cache_get_done(qemu_coroutine_self(),
@@ -411,6 +572,19 @@ int qcow2_cache_get_empty(BlockDriverState *bs, Qcow2Cache *c, uint64_t offset,
     return qcow2_cache_do_get(bs, c, offset, table, false);
 }
 
+void *qcow2_cache_lookup(Qcow2Cache *c, uint64_t offset)
+{
+    int i = qcow2_cache_hash_lookup(c, offset);
+
+    if (i == -1) {
+        return NULL;
+    }
+
+    c->entries[i].ref++;
+    c->entries[i].referenced = true;
+    return qcow2_cache_get_table_addr(c, i);
+}
+
 void qcow2_cache_put(Qcow2Cache *c, void **table)
 {
     int i = qcow2_cache_get_table_idx(c, *table);
@@ -434,14 +608,9 @@ void qcow2_cache_entry_mark_dirty(Qcow2Cache *c, void *table)
 
 void *qcow2_cache_is_table_offset(Qcow2Cache *c, uint64_t offset)
 {
-    int i;
+    int i = qcow2_cache_hash_lookup(c, offset);
 
-    for (i = 0; i < c->size; i++) {
-        if (c->entries[i].offset == offset) {
-            return qcow2_cache_get_table_addr(c, i);
-        }
-    }
-    return NULL;
+    return i == -1 ? NULL : qcow2_cache_get_table_addr(c, i);
 }
 
 void qcow2_cache_discard(Qcow2Cache *c, void *table)
@@ -450,9 +619,50 @@ void qcow2_cache_discard(Qcow2Cache *c, void *table)
 
     assert(c->entries[i].ref == 0);
 
-    c->entries[i].offset = 0;
-    c->entries[i].lru_counter = 0;
+    qcow2_cache_entry_clear(c, i);
     c->entries[i].dirty = false;
 
     qcow2_cache_table_release(c, i, 1);
 }
+
+int qcow2_cache_journal_add(Qcow2Cache *c, QEMUIOVector *qiov,
+                            GArray *entries)
+{
+    int i, n = 0;
+
+    for (i = 0; i < c->size; i++) {
+        Qcow2JournalEntry entry;
+
+        if (!c->entries[i].dirty || !c->entries[i].offset) {
+            continue;
+        }
+
+        entry = (Qcow2JournalEntry) {
+            .offset = c->entries[i].offset,
+            .size   = c->table_size,
+        };
+        g_array_append_val(entries, entry);
+        qemu_iovec_add(qiov, qcow2_cache_get_table_addr(c, i), c->table_size);
+        n++;
+    }
+
+    return n;
+}
+
+void qcow2_cache_journal_done(Qcow2Cache *c)
+{
+    int i;
+
+    for (i = 0; i < c->size; i++) {
+        c->entries[i].dirty = false;
+    }
+
+    /* A transaction is atomic, so ordering against other caches is moot */
+    c->depends = NULL;
+    c->depends_on_flush = false;
+}
+
+bool qcow2_cache_journal_needs_flush(Qcow2Cache *c)
+{
+    return c->depends_on_flush;
+}
@@ -0,0 +1,564 @@
+/*
+ * Metadata journal for the QCOW2 format
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+/*
+ * Without a journal, the L2 table and refcount block caches have to be
+ * written back in a certain order, with a flush between each step, so that
+ * the image stays consistent if the host crashes halfway: data before the L2
+ * tables that point to it, refcount blocks before the L2 tables that use the
+ * clusters they count.  A single guest flush can therefore cost several
+ * flushes of the image file.
+ *
+ * With a journal, all dirty tables of both caches are appended to the
+ * journal area as one transaction instead, which a single flush makes
+ * durable as a whole.  Tables are only written to their place when the
+ * journal is full or the image is closed (a "checkpoint").  Until then,
+ * cache misses read the latest copy of a table from the journal, and after
+ * a crash, the next read-write open replays the journal.
+ *
+ * A cluster that held a journaled table must not be reused before the next
+ * checkpoint, because replaying the journal would overwrite it.
+ */
+
+#include "qemu/osdep.h"
+#include "qapi/error.h"
+#include "qemu/crc32c.h"
+#include "qcow2.h"
+#include "trace.h"
+
+typedef struct Qcow2JournalTable {
+    uint64_t offset;            /* Where the table belongs */
+    uint64_t journal_offset;    /* Where its latest copy is */
+    uint32_t size;
+} Qcow2JournalTable;
+
+static bool journal_can_write(BlockDriverState *bs)
+{
+    return !bdrv_is_read_only(bs) && !(bdrv_get_flags(bs) & BDRV_O_INACTIVE);
+}
+
+static void journal_reset(BDRVQcow2State *s)
+{
+    s->journal_pos = 0;
+    /* Make it unlikely that a stale transaction continues the sequence */
+    s->journal_seq = ((uint64_t)g_random_int() << 32) | g_random_int();
+    s->journal_need_checkpoint = false;
+    g_hash_table_remove_all(s->journal_tables);
+    g_hash_table_remove_all(s->journal_clusters);
+}
+
+static void journal_init(BDRVQcow2State *s)
+{
+    s->journal_tables = g_hash_table_new_full(g_int64_hash, g_int64_equal,
+                                              NULL, g_free);
+    s->journal_clusters = g_hash_table_new_full(g_int64_hash, g_int64_equal,
+                                                g_free, NULL);
+    journal_reset(s);
+}
+
+static void journal_add_table(BDRVQcow2State *s, uint64_t offset,
+                              uint64_t journal_offset, uint32_t size)
+{
+    Qcow2JournalTable *t = g_new(Qcow2JournalTable, 1);
+    uint64_t cluster = start_of_cluster(s, offset);
+
+    *t = (Qcow2JournalTable) {
+        .offset         = offset,
+        .journal_offset = journal_offset,
+        .size           = size,
+    };
+    /* The key lives in the value, so it must be replaced together with it */
+    g_hash_table_replace(s->journal_tables, &t->offset, t);
+
+    if (!g_hash_table_contains(s->journal_clusters, &cluster)) {
+        g_hash_table_insert(s->journal_clusters,
+                            g_memdup(&cluster, sizeof(cluster)),
+                            GUINT_TO_POINTER(size));
+    }
+}
+
+/* Return the size of the descriptor of a transaction with @nb_entries */
+static uint64_t journal_descriptor_size(uint32_t nb_entries)
+{
+    return ROUND_UP(sizeof(Qcow2JournalHeader) +
+                    (uint64_t)nb_entries * sizeof(Qcow2JournalEntry),
+                    QCOW2_JOURNAL_BLOCK_SIZE);
+}
+
+/*
+ * Read the transaction at @pos of the journal.  Return its total size, 0 if
+ * there is no valid transaction with sequence number @seq there (any
+ * sequence number if @first), or a negative errno on I/O errors.
+ */
+static int64_t journal_read_transaction(BlockDriverState *bs, uint64_t pos,
+                                        bool first, uint64_t *seq)
+{
+    BDRVQcow2State *s = bs->opaque;
+    Qcow2JournalHeader hdr;
+    Qcow2JournalEntry *entries;
+    uint64_t desc_size, payload_size, journal_offset;
+    uint32_t nb_entries, checksum;
+    uint8_t *buf, *payload;
+    int64_t ret;
+    int i;
+
+    if (s->journal_size - pos < QCOW2_JOURNAL_BLOCK_SIZE) {
+        return 0;
+    }
+
+    ret = bdrv_pread(bs->file, s->journal_offset + pos, &hdr, sizeof(hdr));
+    if (ret < 0) {
+        return ret;
+    }
+
+    nb_entries = be32_to_cpu(hdr.nb_entries);
+    desc_size = be32_to_cpu(hdr.descriptor_size);
+    if (be32_to_cpu(hdr.magic) != QCOW2_JOURNAL_MAGIC ||
+        (!first && be64_to_cpu(hdr.sequence) != *seq) ||
+        nb_entries == 0 ||
+        desc_size != journal_descriptor_size(nb_entries) ||
+        desc_size > s->journal_size - pos)
+    {
+        return 0;
+    }
+
+    buf = qemu_try_blockalign(bs->file->bs, desc_size);
+    if (buf == NULL) {
+        return -ENOMEM;
+    }
+
+    ret = bdrv_pread(bs->file, s->journal_offset + pos, buf, desc_size);
+    if (ret < 0) {
+        goto out;
+    }
+
+    entries = (Qcow2JournalEntry *)(buf + sizeof(hdr));
+    payload_size = 0;
+    for (i = 0; i < nb_entries; i++) {
+        uint64_t offset = be64_to_cpu(entries[i].offset);
+        uint32_t size = be32_to_cpu(entries[i].size);
+
+        if (offset == 0 || size == 0 || size > s->cluster_size ||
+            !QEMU_IS_ALIGNED(size, QCOW2_JOURNAL_BLOCK_SIZE) ||
+            !QEMU_IS_ALIGNED(offset, size) ||
+            start_of_cluster(s, offset) !=
+            start_of_cluster(s, offset + size - 1) ||
+            (offset < s->journal_offset + s->journal_size &&
+             offset + size > s->journal_offset))
+        {
+            ret = 0;
+            goto out;
+        }
+        payload_size += size;
+    }
+    if (payload_size > s->journal_size - pos - desc_size) {
+        ret = 0;
+        goto out;
+    }
+
+    /* The checksum covers the descriptor and the tables together */
+    payload = qemu_try_blockalign(bs->file->bs, desc_size + payload_size);
+    if (payload == NULL) {
+        ret = -ENOMEM;
+        goto out;
+    }
+    memcpy(payload, buf, desc_size);
+    qemu_vfree(buf);
+    buf = payload;
+    entries = (Qcow2JournalEntry *)(buf + sizeof(hdr));
+
+    ret = bdrv_pread(bs->file, s->journal_offset + pos + desc_size,
+                     buf + desc_size, payload_size);
+    if (ret < 0) {
+        goto out;
+    }
+
+    checksum = be32_to_cpu(((Qcow2JournalHeader *)buf)->checksum);
+    ((Qcow2JournalHeader *)buf)->checksum = 0;
+    if (crc32c(0xffffffff, buf, desc_size + payload_size) != checksum) {
+        ret = 0;
+        goto out;
+    }
+
+    journal_offset = s->journal_offset + pos + desc_size;
+    for (i = 0; i < nb_entries; i++) {
+        uint32_t size = be32_to_cpu(entries[i].size);
+
+        journal_add_table(s, be64_to_cpu(entries[i].offset), journal_offset,
+                          size);
+        journal_offset += size;
+    }
+
+    *seq = be64_to_cpu(hdr.sequence) + 1;
+    ret = desc_size + payload_size;
+    trace_qcow2_journal_replay(bs, *seq - 1, nb_entries);
+
+out:
+    qemu_vfree(buf);
+    return ret;
+}
+
+/* Rebuild the map of journaled tables from the valid transactions */
+static int journal_scan(BlockDriverState *bs)
+{
+    BDRVQcow2State *s = bs->opaque;
+    uint64_t pos = 0, seq = 0;
+    int64_t ret;
+
+    while ((ret = journal_read_transaction(bs, pos, pos == 0, &seq)) > 0) {
+        pos += ret;
+    }
+    if (ret < 0) {
+        return ret;
+    }
+
+    if (pos > 0) {
+        s->journal_pos = pos;
+        s->journal_seq = seq;
+    }
+    return 0;
+}
+
+int qcow2_journal_open(BlockDriverState *bs, int flags, Error **errp)
+{
+    BDRVQcow2State *s = bs->opaque;
+    int ret;
+
+    if (s->journal_offset == 0 ||
+        offset_into_cluster(s, s->journal_offset) ||
+        offset_into_cluster(s, s->journal_size) ||
+        s->journal_size < QCOW2_JOURNAL_MIN_SIZE ||
+        s->journal_size > QCOW2_JOURNAL_MAX_SIZE ||
+        s->journal_offset > INT64_MAX - s->journal_size)
+    {
+        error_setg(errp, "Invalid metadata journal (offset %#" PRIx64
+                   ", size %#" PRIx64 ")", s->journal_offset,
+                   s->journal_size);
+        s->journal_size = 0;
+        return -EINVAL;
+    }
+
+    journal_init(s);
+
+    /* Another process may still be writing to the journal */
+    if (flags & BDRV_O_INACTIVE) {
+        return 0;
+    }
+
+    ret = journal_scan(bs);
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Could not read the metadata journal");
+        return ret;
+    }
+
+    if (s->journal_pos && !bs->read_only) {
+        ret = qcow2_journal_checkpoint(bs);
+        if (ret < 0) {
+            error_setg_errno(errp, -ret, "Could not replay the metadata "
+                             "journal");
+            return ret;
+        }
+    }
+
+    return 0;
+}
+
+void qcow2_journal_close(BlockDriverState *bs)
+{
+    BDRVQcow2State *s = bs->opaque;
+
+    if (s->journal_tables) {
+        g_hash_table_destroy(s->journal_tables);
+        g_hash_table_destroy(s->journal_clusters);
+        s->journal_tables = NULL;
+        s->journal_clusters = NULL;
+    }
+}
+
+int qcow2_journal_create(BlockDriverState *bs, uint64_t size, Error **errp)
+{
+    BDRVQcow2State *s = bs->opaque;
+    int64_t offset;
+    int ret;
+
+    size = ROUND_UP(size, s->cluster_size);
+    if (size < QCOW2_JOURNAL_MIN_SIZE || size > QCOW2_JOURNAL_MAX_SIZE) {
+        error_setg(errp, "Metadata journal size must be between %" PRIu64
+                   " and %" PRIu64, (uint64_t)QCOW2_JOURNAL_MIN_SIZE,
+                   (uint64_t)QCOW2_JOURNAL_MAX_SIZE);
+        return -EINVAL;
+    }
+
+    offset = qcow2_alloc_clusters(bs, size);
+    if (offset < 0) {
+        error_setg_errno(errp, -offset, "Could not allocate the metadata "
+                         "journal");
+        return offset;
+    }
+
+    /* An empty journal starts with an invalid transaction */
+    ret = bdrv_pwrite_zeroes(bs->file, offset, size, 0);
+    if (ret >= 0) {
+        ret = bdrv_flush(bs->file->bs);
+    }
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Could not initialize the metadata "
+                         "journal");
+        goto fail;
+    }
+
+    s->journal_offset = offset;
+    s->journal_size = size;
+    s->incompatible_features |= QCOW2_INCOMPAT_JOURNAL;
+    journal_init(s);
+
+    ret = qcow2_update_header(bs);
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Could not update qcow2 header");
+        qcow2_journal_close(bs);
+        s->incompatible_features &= ~QCOW2_INCOMPAT_JOURNAL;
+        s->journal_offset = 0;
+        s->journal_size = 0;
+        goto fail;
+    }
+
+    return 0;
+
+fail:
+    qcow2_free_clusters(bs, offset, size, QCOW2_DISCARD_NEVER);
+    return ret;
+}
+
+/*
+ * Write all dirty tables of the L2 table and refcount block caches to the
+ * journal as one transaction.  They are durable once bs->file is flushed.
+ *
+ * Return -ENOSPC if they do not fit into the journal at all.  The journal is
+ * empty then, so the caller can write them in place instead.
+ */
+int qcow2_journal_commit(BlockDriverState *bs)
+{
+    BDRVQcow2State *s = bs->opaque;
+    g_autoptr(GArray) entries = NULL;
+    Qcow2JournalHeader *hdr;
+    Qcow2JournalEntry *desc_entries;
+    QEMUIOVector qiov;
+    uint64_t desc_size, total_size, journal_offset;
+    uint8_t *buf = NULL;
+    int i, n, ret;
+
+    entries = g_array_new(false, false, sizeof(Qcow2JournalEntry));
+    qemu_iovec_init(&qiov, 16);
+    n = qcow2_cache_journal_add(s->refcount_block_cache, &qiov, entries);
+    n += qcow2_cache_journal_add(s->l2_table_cache, &qiov, entries);
+    if (n == 0) {
+        ret = 0;
+        goto out;
+    }
+
+    desc_size = journal_descriptor_size(n);
+    total_size = desc_size + qiov.size;
+    if (total_size > s->journal_size) {
+        ret = qcow2_journal_checkpoint(bs);
+        if (ret == 0) {
+            ret = -ENOSPC;
+        }
+        goto out;
+    }
+    if (total_size > s->journal_size - s->journal_pos) {
+        ret = qcow2_journal_checkpoint(bs);
+        if (ret < 0) {
+            goto out;
+        }
+    }
+
+    /* Data written for COW must be on disk before the tables pointing to it */
+    if (qcow2_cache_journal_needs_flush(s->l2_table_cache) ||
+        qcow2_cache_journal_needs_flush(s->refcount_block_cache))
+    {
+        ret = bdrv_flush(bs->file->bs);
+        if (ret < 0) {
+            goto out;
+        }
+    }
+
+    buf = qemu_try_blockalign0(bs->file->bs, total_size);
+    if (buf == NULL) {
+        ret = -ENOMEM;
+        goto out;
+    }
+
+    hdr = (Qcow2JournalHeader *)buf;
+    *hdr = (Qcow2JournalHeader) {
+        .magic           = cpu_to_be32(QCOW2_JOURNAL_MAGIC),
+        .sequence        = cpu_to_be64(s->journal_seq),
+        .descriptor_size = cpu_to_be32(desc_size),
+        .nb_entries      = cpu_to_be32(n),
+    };
+    desc_entries = (Qcow2JournalEntry *)(buf + sizeof(*hdr));
+    for (i = 0; i < n; i++) {
+        Qcow2JournalEntry *e = &g_array_index(entries, Qcow2JournalEntry, i);
+
+        desc_entries[i].offset = cpu_to_be64(e->offset);
+        desc_entries[i].size = cpu_to_be32(e->size);
+    }
+    qemu_iovec_to_buf(&qiov, 0, buf + desc_size, qiov.size);
+    hdr->checksum = cpu_to_be32(crc32c(0xffffffff, buf, total_size));
+
+    trace_qcow2_journal_commit(bs, s->journal_seq, n, s->journal_pos);
+    ret = bdrv_pwrite(bs->file, s->journal_offset + s->journal_pos, buf,
+                      total_size);
+    if (ret < 0) {
+        goto out;
+    }
+
+    journal_offset = s->journal_offset + s->journal_pos + desc_size;
+    for (i = 0; i < n; i++) {
+        Qcow2JournalEntry *e = &g_array_index(entries, Qcow2JournalEntry, i);
+
+        journal_add_table(s, e->offset, journal_offset, e->size);
+        journal_offset += e->size;
+    }
+    s->journal_pos += total_size;
+    s->journal_seq++;
+
+    qcow2_cache_journal_done(s->refcount_block_cache);
+    qcow2_cache_journal_done(s->l2_table_cache);
+    ret = 0;
+
+out:
+    qemu_vfree(buf);
+    qemu_iovec_destroy(&qiov);
+    return ret;
+}
+
+/*
+ * Write the latest copy of every journaled table to its place and empty the
+ * journal.
+ */
+int qcow2_journal_checkpoint(BlockDriverState *bs)
+{
+    BDRVQcow2State *s = bs->opaque;
+    GHashTableIter iter;
+    Qcow2JournalTable *t;
+    uint8_t *buf;
+    int ret;
+
+    if (!s->journal_size || s->journal_pos == 0) {
+        s->journal_need_checkpoint = false;
+        return 0;
+    }
+
+    /* A read-only image keeps reading the tables from the journal */
+    if (!journal_can_write(bs)) {
+        return 0;
+    }
+
+    trace_qcow2_journal_checkpoint(bs, g_hash_table_size(s->journal_tables));
+
+    /* The transactions must be complete before tables are overwritten */
+    ret = bdrv_flush(bs->file->bs);
+    if (ret < 0) {
+        return ret;
+    }
+
+    buf = qemu_try_blockalign(bs->file->bs, s->cluster_size);
+    if (buf == NULL) {
+        return -ENOMEM;
+    }
+
+    g_hash_table_iter_init(&iter, s->journal_tables);
+    while (g_hash_table_iter_next(&iter, NULL, (void **)&t)) {
+        ret = bdrv_pread(bs->file, t->journal_offset, buf, t->size);
+        if (ret < 0) {
+            goto out;
+        }
+        ret = bdrv_pwrite(bs->file, t->offset, buf, t->size);
+        if (ret < 0) {
+            goto out;
+        }
+    }
+
+    ret = bdrv_flush(bs->file->bs);
+    if (ret < 0) {
+        goto out;
+    }
+
+    ret = bdrv_pwrite_zeroes(bs->file, s->journal_offset,
+                             QCOW2_JOURNAL_BLOCK_SIZE, 0);
+    if (ret < 0) {
+        goto out;
+    }
+    ret = bdrv_flush(bs->file->bs);
+    if (ret < 0) {
+        goto out;
+    }
+
+    journal_reset(s);
+    ret = 0;
+
+out:
+    qemu_vfree(buf);
+    return ret;
+}
+
+/*
+ * Return the offset from which the table at @offset should be read into a
+ * cache entry of @size bytes: that of its latest copy in the journal, or
+ * @offset itself.
+ */
+int64_t qcow2_journal_table_offset(BlockDriverState *bs, uint64_t offset,
+                                   int size)
+{
+    BDRVQcow2State *s = bs->opaque;
+    uint64_t cluster = start_of_cluster(s, offset);
+    Qcow2JournalTable *t;
+    void *cluster_size;
+    int ret;
+
+    if (!s->journal_tables) {
+        return offset;
+    }
+
+    t = g_hash_table_lookup(s->journal_tables, &offset);
+    if (t && t->size == size) {
+        return t->journal_offset;
+    }
+
+    if (!t) {
+        cluster_size = g_hash_table_lookup(s->journal_clusters, &cluster);
+        if (!cluster_size || GPOINTER_TO_UINT(cluster_size) == size) {
+            return offset;
+        }
+    }
+
+    /*
+     * The cluster was journaled in slices of another size, which cannot be
+     * merged here; the cache entry size was different when it was written.
+     */
+    if (!journal_can_write(bs)) {
+        return -ENOTSUP;
+    }
+    ret = qcow2_journal_checkpoint(bs);
+    return ret < 0 ? ret : offset;
+}
+
+/*
+ * Called when the refcount of @cluster_offset drops to zero.  If a table in
+ * that cluster is journaled, a checkpoint must happen before the cluster is
+ * allocated again.
+ */
+void qcow2_journal_revoke(BlockDriverState *bs, uint64_t cluster_offset)
+{
+    BDRVQcow2State *s = bs->opaque;
+
+    if (s->journal_clusters &&
+        g_hash_table_contains(s->journal_clusters, &cluster_offset))
+    {
+        s->journal_need_checkpoint = true;
+    }
+}
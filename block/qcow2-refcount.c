@@ -899,6 +899,10 @@ static int QEMU_WARN_UNUSED_RESULT update_refcount(BlockDriverState *bs,
                 qcow2_cache_discard(s->l2_table_cache, table);
             }
 
+            qcow2_journal_revoke(bs, cluster_offset);
+            qcow2_decompress_cache_invalidate(bs, cluster_offset,
+                                              s->cluster_size);
+
             if (s->discard_passthrough[type]) {
                 update_refcount_discard(bs, cluster_offset, s->cluster_size);
             }
@@ -975,6 +979,14 @@ static int64_t alloc_clusters_noref(BlockDriverState *bs, uint64_t size,
         qcow2_process_discards(bs, 0);
     }
 
+    /* Nor if a journal replay may still overwrite them */
+    if (s->journal_need_checkpoint) {
+        ret = qcow2_journal_checkpoint(bs);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+
     nb_clusters = size_to_clusters(s, size);
 retry:
     for(i = 0; i < nb_clusters; i++) {
@@ -1039,6 +1051,13 @@ int64_t qcow2_alloc_clusters_at(BlockDriverState *bs, uint64_t offset,
         return 0;
     }
 
+    if (s->journal_need_checkpoint) {
+        ret = qcow2_journal_checkpoint(bs);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+
     do {
         /* Check how many clusters there are free */
         cluster_index = offset >> s->cluster_bits;
@@ -1063,6 +1082,71 @@ int64_t qcow2_alloc_clusters_at(BlockDriverState *bs, uint64_t offset,
     return i;
 }
 
+/*
+ * Allocate up to *nb_clusters contiguous clusters for guest data.  If @offset
+ * is not INV_OFFSET, clusters are only allocated starting at @offset.
+ *
+ * Clusters are taken from a reserved extent of at least
+ * QCOW2_ALLOC_EXTENT_SIZE, so that a sequence of small allocating writes
+ * costs one refcount update per extent rather than one per write.
+ *
+ * Return the offset of the first cluster and set *nb_clusters to the number
+ * of clusters allocated (which can be 0 if @offset was given), or -errno.
+ */
+int64_t qcow2_alloc_data_clusters(BlockDriverState *bs, uint64_t offset,
+                                  uint64_t *nb_clusters)
+{
+    BDRVQcow2State *s = bs->opaque;
+    uint64_t n;
+    int64_t ret;
+
+    if (offset != INV_OFFSET &&
+        (offset != s->alloc_extent_offset || !s->alloc_extent_clusters))
+    {
+        ret = qcow2_alloc_clusters_at(bs, offset, *nb_clusters);
+        if (ret < 0) {
+            return ret;
+        }
+        *nb_clusters = ret;
+        return offset;
+    }
+
+    if (!s->alloc_extent_clusters) {
+        n = MAX(*nb_clusters, QCOW2_ALLOC_EXTENT_SIZE >> s->cluster_bits);
+        ret = qcow2_alloc_clusters(bs, n << s->cluster_bits);
+        if (ret < 0) {
+            return ret;
+        }
+        s->alloc_extent_offset = ret;
+        s->alloc_extent_clusters = n;
+    }
+
+    n = MIN(*nb_clusters, s->alloc_extent_clusters);
+    offset = s->alloc_extent_offset;
+    s->alloc_extent_offset += n << s->cluster_bits;
+    s->alloc_extent_clusters -= n;
+
+    *nb_clusters = n;
+    return offset;
+}
+
+/*
+ * Free the clusters reserved by qcow2_alloc_data_clusters() that have not
+ * been handed out, so that they do not show up as leaks.
+ */
+void qcow2_release_alloc_extent(BlockDriverState *bs)
+{
+    BDRVQcow2State *s = bs->opaque;
+
+    if (s->alloc_extent_clusters) {
+        qcow2_free_clusters(bs, s->alloc_extent_offset,
+                            s->alloc_extent_clusters << s->cluster_bits,
+                            QCOW2_DISCARD_NEVER);
+    }
+    s->alloc_extent_offset = 0;
+    s->alloc_extent_clusters = 0;
+}
+
 /* only used to allocate compressed sectors. We try to allocate
    contiguous sectors. size must be <= cluster_size */
 int64_t qcow2_alloc_bytes(BlockDriverState *bs, int size)
@@ -2186,6 +2270,15 @@ static int calculate_refcounts(BlockDriverState *bs, BdrvCheckResult *res,
         }
     }
 
+    /* metadata journal */
+    if (s->journal_size) {
+        ret = qcow2_inc_refcounts_imrt(bs, res, refcount_table, nb_clusters,
+                                       s->journal_offset, s->journal_size);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+
     /* bitmaps */
     ret = qcow2_check_bitmaps_refcounts(bs, res, refcount_table, nb_clusters);
     if (ret < 0) {
@@ -3132,6 +3225,8 @@ int qcow2_change_refcount_order(BlockDriverState *bs, int refcount_order,
     assert(s->qcow_version >= 3);
     assert(refcount_order >= 0 && refcount_order <= 6);
 
+    qcow2_release_alloc_extent(bs);
+
     /* see qcow2_open() */
     new_refblock_size = 1 << (s->cluster_bits - (refcount_order - 3));
 
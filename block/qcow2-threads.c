@@ -173,6 +173,53 @@ static ssize_t qcow2_zlib_decompress(void *dest, size_t dest_size,
 
 #ifdef CONFIG_ZSTD
 
+/*
+ * Creating a zstd context allocates and initializes several hundred KiB, so
+ * each thread pool worker keeps one context of each kind and resets it for
+ * every cluster.
+ */
+static __thread ZSTD_CCtx *qcow2_zstd_cctx;
+static __thread ZSTD_DCtx *qcow2_zstd_dctx;
+static __thread Notifier qcow2_zstd_cleanup_notifier;
+
+static void qcow2_zstd_cleanup(Notifier *n, void *value)
+{
+    ZSTD_freeCCtx(qcow2_zstd_cctx);
+    ZSTD_freeDCtx(qcow2_zstd_dctx);
+    qcow2_zstd_cctx = NULL;
+    qcow2_zstd_dctx = NULL;
+}
+
+static void qcow2_zstd_init_cleanup(void)
+{
+    if (!qcow2_zstd_cleanup_notifier.notify) {
+        qcow2_zstd_cleanup_notifier.notify = qcow2_zstd_cleanup;
+        qemu_thread_atexit_add(&qcow2_zstd_cleanup_notifier);
+    }
+}
+
+static ZSTD_CCtx *qcow2_zstd_get_cctx(void)
+{
+    if (qcow2_zstd_cctx) {
+        ZSTD_CCtx_reset(qcow2_zstd_cctx, ZSTD_reset_session_only);
+    } else {
+        qcow2_zstd_init_cleanup();
+        qcow2_zstd_cctx = ZSTD_createCCtx();
+    }
+    return qcow2_zstd_cctx;
+}
+
+static ZSTD_DCtx *qcow2_zstd_get_dctx(void)
+{
+    if (qcow2_zstd_dctx) {
+        ZSTD_DCtx_reset(qcow2_zstd_dctx, ZSTD_reset_session_only);
+    } else {
+        qcow2_zstd_init_cleanup();
+        qcow2_zstd_dctx = ZSTD_createDCtx();
+    }
+    return qcow2_zstd_dctx;
+}
+
 /*
  * qcow2_zstd_compress()
  *
@@ -188,7 +235,6 @@ static ssize_t qcow2_zlib_decompress(void *dest, size_t dest_size,
 static ssize_t qcow2_zstd_compress(void *dest, size_t dest_size,
                                    const void *src, size_t src_size)
 {
-    ssize_t ret;
     size_t zstd_ret;
     ZSTD_outBuffer output = {
         .dst = dest,
@@ -200,7 +246,7 @@ static ssize_t qcow2_zstd_compress(void *dest, size_t dest_size,
         .size = src_size,
         .pos = 0
     };
-    ZSTD_CCtx *cctx = ZSTD_createCCtx();
+    ZSTD_CCtx *cctx = qcow2_zstd_get_cctx();
 
     if (!cctx) {
         return -EIO;
@@ -226,19 +272,15 @@ static ssize_t qcow2_zstd_compress(void *dest, size_t dest_size,
 
     if (zstd_ret) {
         if (zstd_ret > output.size - output.pos) {
-            ret = -ENOMEM;
+            return -ENOMEM;
         } else {
-            ret = -EIO;
+            return -EIO;
         }
-        goto out;
     }
 
     /* make sure that zstd didn't overflow the dest buffer */
     assert(output.pos <= dest_size);
-    ret = output.pos;
-out:
-    ZSTD_freeCCtx(cctx);
-    return ret;
+    return output.pos;
 }
 
 /*
@@ -268,7 +310,7 @@ static ssize_t qcow2_zstd_decompress(void *dest, size_t dest_size,
         .size = src_size,
         .pos = 0
     };
-    ZSTD_DCtx *dctx = ZSTD_createDCtx();
+    ZSTD_DCtx *dctx = qcow2_zstd_get_dctx();
 
     if (!dctx) {
         return -EIO;
@@ -319,7 +361,6 @@ static ssize_t qcow2_zstd_decompress(void *dest, size_t dest_size,
         ret = -EIO;
     }
 
-    ZSTD_freeDCtx(dctx);
     assert(ret == 0 || ret == -EIO);
     return ret;
 }
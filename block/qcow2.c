@@ -71,6 +71,7 @@ typedef struct {
 #define  QCOW2_EXT_MAGIC_CRYPTO_HEADER 0x0537be77
 #define  QCOW2_EXT_MAGIC_BITMAPS 0x23852875
 #define  QCOW2_EXT_MAGIC_DATA_FILE 0x44415441
+#define  QCOW2_EXT_MAGIC_JOURNAL 0x4a524e4c
 
 static int coroutine_fn
 qcow2_co_preadv_compressed(BlockDriverState *bs,
@@ -79,6 +80,7 @@ qcow2_co_preadv_compressed(BlockDriverState *bs,
                            uint64_t bytes,
                            QEMUIOVector *qiov,
                            size_t qiov_offset);
+static void qcow2_decompress_cache_free(BDRVQcow2State *s);
 
 static int qcow2_probe(const uint8_t *buf, int buf_size, const char *filename)
 {
@@ -427,6 +429,34 @@ static int qcow2_read_extensions(BlockDriverState *bs, uint64_t start_offset,
             break;
         }
 
+        case QCOW2_EXT_MAGIC_JOURNAL:
+        {
+            Qcow2JournalHeaderExt journal_ext;
+
+            if (ext.len != sizeof(journal_ext)) {
+                error_setg(errp, "journal_ext: Invalid extension length");
+                return -EINVAL;
+            }
+
+            ret = bdrv_pread(bs->file, offset, &journal_ext, ext.len);
+            if (ret < 0) {
+                error_setg_errno(errp, -ret, "journal_ext: "
+                                 "Could not read ext header");
+                return ret;
+            }
+
+            /* Validated by qcow2_journal_open() */
+            s->journal_offset = be64_to_cpu(journal_ext.journal_offset);
+            s->journal_size = be64_to_cpu(journal_ext.journal_size);
+
+#ifdef DEBUG_EXT
+            printf("Qcow2: Got metadata journal extension: "
+                   "offset=%" PRIu64 " size=%" PRIu64 "\n",
+                   s->journal_offset, s->journal_size);
+#endif
+            break;
+        }
+
         default:
             /* unknown magic - save it in case we need to rewrite the header */
             /* If you add a new feature, make sure to also update the fast
@@ -605,12 +635,31 @@ static int coroutine_fn qcow2_co_check_locked(BlockDriverState *bs,
                                               BdrvCheckResult *result,
                                               BdrvCheckMode fix)
 {
+    BDRVQcow2State *s = bs->opaque;
     BdrvCheckResult snapshot_res = {};
     BdrvCheckResult refcount_res = {};
     int ret;
 
     memset(result, 0, sizeof(*result));
 
+    /* Reserved but unused data clusters would be reported as leaks */
+    qcow2_release_alloc_extent(bs);
+
+    /* The checks read all tables from their place, not from the journal */
+    ret = qcow2_journal_checkpoint(bs);
+    if (ret < 0) {
+        result->check_errors++;
+        return ret;
+    }
+    if (s->journal_pos) {
+        /* Only possible read-only; 'check -r' opens the image read/write */
+        error_report("The metadata journal has not been replayed; repair "
+                     "the image with 'qemu-img check -r' or open it "
+                     "read/write");
+        result->check_errors++;
+        return 0;
+    }
+
     ret = qcow2_check_read_snapshot_table(bs, &snapshot_res, fix);
     if (ret < 0) {
         qcow2_add_check_result(result, &snapshot_res, false);
@@ -1041,6 +1090,14 @@ static int qcow2_update_options_prepare(BlockDriverState *bs,
         }
     }
 
+    /* The new caches may read the journaled tables in slices of another size */
+    ret = qcow2_journal_checkpoint(bs);
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Failed to checkpoint the metadata "
+                         "journal");
+        goto fail;
+    }
+
     r->l2_slice_size = l2_cache_entry_size / l2_entry_size(s);
     r->l2_table_cache = qcow2_cache_create(bs, l2_cache_size,
                                            l2_cache_entry_size);
@@ -1717,6 +1774,22 @@ static int coroutine_fn qcow2_do_open(BlockDriverState *bs, QDict *options,
         }
     }
 
+    /* Replays the journal unless the image is opened read-only */
+    if (s->incompatible_features & QCOW2_INCOMPAT_JOURNAL) {
+        if (!s->journal_size) {
+            error_setg(errp, "Image has a metadata journal, but no journal "
+                       "header extension");
+            ret = -EINVAL;
+            goto fail;
+        }
+        ret = qcow2_journal_open(bs, flags, errp);
+        if (ret < 0) {
+            goto fail;
+        }
+    } else {
+        s->journal_size = 0;
+    }
+
     /* Clear unknown autoclear feature bits */
     update_header |= s->autoclear_features & ~QCOW2_AUTOCLEAR_MASK;
     update_header =
@@ -1831,10 +1904,15 @@ static int coroutine_fn qcow2_do_open(BlockDriverState *bs, QDict *options,
 #endif
 
     qemu_co_queue_init(&s->thread_task_queue);
+    qemu_co_queue_init(&s->decompress_queue);
+    s->decompress_cache_size =
+        MAX(2, MIN(QCOW2_DECOMPRESS_CACHE_MAX,
+                   QCOW2_DECOMPRESS_CACHE_BYTES / s->cluster_size));
 
     return ret;
 
  fail:
+    qcow2_journal_close(bs);
     g_free(s->image_data_file);
     if (has_data_file(bs)) {
         bdrv_unref_child(bs, s->data_file);
@@ -1943,11 +2021,20 @@ static int qcow2_reopen_prepare(BDRVReopenState *state,
             goto fail;
         }
 
+        qcow2_release_alloc_extent(state->bs);
+
         ret = bdrv_flush(state->bs);
         if (ret < 0) {
             goto fail;
         }
 
+        ret = qcow2_journal_checkpoint(state->bs);
+        if (ret < 0) {
+            error_setg_errno(errp, -ret, "Failed to checkpoint the metadata "
+                             "journal");
+            goto fail;
+        }
+
         ret = qcow2_mark_clean(state->bs);
         if (ret < 0) {
             goto fail;
@@ -2038,6 +2125,28 @@ static void qcow2_join_options(QDict *options, QDict *old_options)
     }
 }
 
+/*
+ * Look up @offset without taking s->lock when its L2 slice is cached, and
+ * under the lock otherwise.
+ */
+static int coroutine_fn qcow2_co_get_host_offset(BlockDriverState *bs,
+                                                 uint64_t offset,
+                                                 unsigned int *bytes,
+                                                 uint64_t *host_offset,
+                                                 QCow2SubclusterType *type)
+{
+    BDRVQcow2State *s = bs->opaque;
+    int ret;
+
+    ret = qcow2_try_get_host_offset(bs, offset, bytes, host_offset, type);
+    if (ret == -EAGAIN) {
+        qemu_co_mutex_lock(&s->lock);
+        ret = qcow2_get_host_offset(bs, offset, bytes, host_offset, type);
+        qemu_co_mutex_unlock(&s->lock);
+    }
+    return ret;
+}
+
 static int coroutine_fn qcow2_co_block_status(BlockDriverState *bs,
                                               bool want_zero,
                                               int64_t offset, int64_t count,
@@ -2050,17 +2159,18 @@ static int coroutine_fn qcow2_co_block_status(BlockDriverState *bs,
     QCow2SubclusterType type;
     int ret, status = 0;
 
-    qemu_co_mutex_lock(&s->lock);
-
     if (!s->metadata_preallocation_checked) {
-        ret = qcow2_detect_metadata_preallocation(bs);
-        s->metadata_preallocation = (ret == 1);
-        s->metadata_preallocation_checked = true;
+        qemu_co_mutex_lock(&s->lock);
+        if (!s->metadata_preallocation_checked) {
+            ret = qcow2_detect_metadata_preallocation(bs);
+            s->metadata_preallocation = (ret == 1);
+            s->metadata_preallocation_checked = true;
+        }
+        qemu_co_mutex_unlock(&s->lock);
     }
 
     bytes = MIN(INT_MAX, count);
-    ret = qcow2_get_host_offset(bs, offset, &bytes, &host_offset, &type);
-    qemu_co_mutex_unlock(&s->lock);
+    ret = qcow2_co_get_host_offset(bs, offset, &bytes, &host_offset, &type);
     if (ret < 0) {
         return ret;
     }
@@ -2298,10 +2408,8 @@ static coroutine_fn int qcow2_co_preadv_part(BlockDriverState *bs,
                             QCOW_MAX_CRYPT_CLUSTERS * s->cluster_size);
         }
 
-        qemu_co_mutex_lock(&s->lock);
-        ret = qcow2_get_host_offset(bs, offset, &cur_bytes,
-                                    &host_offset, &type);
-        qemu_co_mutex_unlock(&s->lock);
+        ret = qcow2_co_get_host_offset(bs, offset, &cur_bytes,
+                                       &host_offset, &type);
         if (ret < 0) {
             goto out;
         }
@@ -2660,6 +2768,8 @@ static int qcow2_inactivate(BlockDriverState *bs)
                           bdrv_get_device_or_node_name(bs));
     }
 
+    qcow2_release_alloc_extent(bs);
+
     ret = qcow2_cache_flush(bs, s->l2_table_cache);
     if (ret) {
         result = ret;
@@ -2674,6 +2784,13 @@ static int qcow2_inactivate(BlockDriverState *bs)
                      strerror(-ret));
     }
 
+    ret = qcow2_journal_checkpoint(bs);
+    if (ret) {
+        result = ret;
+        error_report("Failed to checkpoint the metadata journal: %s",
+                     strerror(-ret));
+    }
+
     if (result == 0) {
         qcow2_mark_clean(bs);
     }
@@ -2695,6 +2812,8 @@ static void qcow2_close(BlockDriverState *bs)
     cache_clean_timer_del(bs);
     qcow2_cache_destroy(s->l2_table_cache);
     qcow2_cache_destroy(s->refcount_block_cache);
+    qcow2_journal_close(bs);
+    qcow2_decompress_cache_free(s);
 
     qcrypto_block_free(s->crypto);
     s->crypto = NULL;
@@ -2951,6 +3070,11 @@ int qcow2_update_header(BlockDriverState *bs)
                 .bit  = QCOW2_INCOMPAT_EXTL2_BITNR,
                 .name = "extended L2 entries",
             },
+            {
+                .type = QCOW2_FEAT_TYPE_INCOMPATIBLE,
+                .bit  = QCOW2_INCOMPAT_JOURNAL_BITNR,
+                .name = "metadata journal",
+            },
             {
                 .type = QCOW2_FEAT_TYPE_COMPATIBLE,
                 .bit  = QCOW2_COMPAT_LAZY_REFCOUNTS_BITNR,
@@ -2977,6 +3101,22 @@ int qcow2_update_header(BlockDriverState *bs)
         buflen -= ret;
     }
 
+    /* Metadata journal extension */
+    if (s->journal_size) {
+        Qcow2JournalHeaderExt journal_header = {
+            .journal_offset = cpu_to_be64(s->journal_offset),
+            .journal_size   = cpu_to_be64(s->journal_size),
+        };
+        ret = header_ext_add(buf, QCOW2_EXT_MAGIC_JOURNAL,
+                             &journal_header, sizeof(journal_header),
+                             buflen);
+        if (ret < 0) {
+            goto fail;
+        }
+        buf += ret;
+        buflen -= ret;
+    }
+
     /* Bitmap extension */
     if (s->nb_bitmaps > 0) {
         Qcow2BitmapHeaderExt bitmaps_header = {
@@ -3464,6 +3604,16 @@ qcow2_co_create(BlockdevCreateOptions *create_options, Error **errp)
         goto out;
     }
 
+    if (qcow2_opts->has_journal_size && qcow2_opts->journal_size &&
+        version < 3)
+    {
+        error_setg(errp, "Metadata journals are only supported with "
+                   "compatibility level 1.1 and above (use version=v3 or "
+                   "greater)");
+        ret = -EINVAL;
+        goto out;
+    }
+
     if (!qcow2_opts->has_lazy_refcounts) {
         qcow2_opts->lazy_refcounts = false;
     }
@@ -3662,6 +3812,15 @@ qcow2_co_create(BlockdevCreateOptions *create_options, Error **errp)
         goto out;
     }
 
+    /* Want a metadata journal? There you go. */
+    if (qcow2_opts->has_journal_size && qcow2_opts->journal_size) {
+        ret = qcow2_journal_create(blk_bs(blk), qcow2_opts->journal_size,
+                                   errp);
+        if (ret < 0) {
+            goto out;
+        }
+    }
+
     /* Okay, now that we have a valid image, let's give it the right size */
     ret = blk_truncate(blk, qcow2_opts->size, false, qcow2_opts->preallocation,
                        0, errp);
@@ -3776,6 +3935,7 @@ static int coroutine_fn qcow2_co_create_opts(BlockDriver *drv,
         { BLOCK_OPT_CLUSTER_SIZE,       "cluster-size" },
         { BLOCK_OPT_LAZY_REFCOUNTS,     "lazy-refcounts" },
         { BLOCK_OPT_EXTL2,              "extended-l2" },
+        { BLOCK_OPT_JOURNAL_SIZE,       "journal-size" },
         { BLOCK_OPT_REFCOUNT_BITS,      "refcount-bits" },
         { BLOCK_OPT_ENCRYPT,            BLOCK_OPT_ENCRYPT_FORMAT },
         { BLOCK_OPT_COMPAT_LEVEL,       "version" },
@@ -4180,6 +4340,9 @@ static int coroutine_fn qcow2_co_truncate(BlockDriverState *bs, int64_t offset,
             goto fail;
         }
 
+        /* Reserved data clusters could keep the image file from shrinking */
+        qcow2_release_alloc_extent(bs);
+
         ret = qcow2_cluster_discard(bs, ROUND_UP(offset, s->cluster_size),
                                     old_length - ROUND_UP(offset,
                                                           s->cluster_size),
@@ -4631,32 +4794,20 @@ qcow2_co_pwritev_compressed_part(BlockDriverState *bs,
     return ret;
 }
 
+/* Read and decompress a compressed cluster into @out_buf */
 static int coroutine_fn
-qcow2_co_preadv_compressed(BlockDriverState *bs,
-                           uint64_t cluster_descriptor,
-                           uint64_t offset,
-                           uint64_t bytes,
-                           QEMUIOVector *qiov,
-                           size_t qiov_offset)
+qcow2_co_read_compressed(BlockDriverState *bs, uint64_t coffset, int csize,
+                         uint8_t *out_buf)
 {
     BDRVQcow2State *s = bs->opaque;
-    int ret = 0, csize, nb_csectors;
-    uint64_t coffset;
-    uint8_t *buf, *out_buf;
-    int offset_in_cluster = offset_into_cluster(s, offset);
-
-    coffset = cluster_descriptor & s->cluster_offset_mask;
-    nb_csectors = ((cluster_descriptor >> s->csize_shift) & s->csize_mask) + 1;
-    csize = nb_csectors * QCOW2_COMPRESSED_SECTOR_SIZE -
-        (coffset & ~QCOW2_COMPRESSED_SECTOR_MASK);
+    uint8_t *buf;
+    int ret;
 
     buf = g_try_malloc(csize);
     if (!buf) {
         return -ENOMEM;
     }
 
-    out_buf = qemu_blockalign(bs, s->cluster_size);
-
     BLKDBG_EVENT(bs->file, BLKDBG_READ_COMPRESSED);
     ret = bdrv_co_pread(bs->file, coffset, csize, buf, 0);
     if (ret < 0) {
@@ -4668,12 +4819,245 @@ qcow2_co_preadv_compressed(BlockDriverState *bs,
         goto fail;
     }
 
-    qemu_iovec_from_buf(qiov, qiov_offset, out_buf + offset_in_cluster, bytes);
-
 fail:
-    qemu_vfree(out_buf);
     g_free(buf);
+    return ret;
+}
+
+static void qcow2_parse_compressed_descriptor(BDRVQcow2State *s,
+                                              uint64_t cluster_descriptor,
+                                              uint64_t *coffset, int *csize)
+{
+    int nb_csectors;
+
+    *coffset = cluster_descriptor & s->cluster_offset_mask;
+    nb_csectors = ((cluster_descriptor >> s->csize_shift) & s->csize_mask) + 1;
+    *csize = nb_csectors * QCOW2_COMPRESSED_SECTOR_SIZE -
+        (*coffset & ~QCOW2_COMPRESSED_SECTOR_MASK);
+}
+
+static Qcow2DecompressedCluster *
+qcow2_decompress_cache_find(BDRVQcow2State *s, uint64_t coffset)
+{
+    int i;
+
+    for (i = 0; i < s->decompress_cache_size; i++) {
+        if (s->decompress_cache[i].coffset == coffset) {
+            return &s->decompress_cache[i];
+        }
+    }
+    return NULL;
+}
+
+/* Return the least recently used entry that is not busy, or NULL */
+static Qcow2DecompressedCluster *
+qcow2_decompress_cache_victim(BDRVQcow2State *s)
+{
+    Qcow2DecompressedCluster *victim = NULL;
+    int i;
+
+    for (i = 0; i < s->decompress_cache_size; i++) {
+        Qcow2DecompressedCluster *e = &s->decompress_cache[i];
+
+        if (e->busy) {
+            continue;
+        }
+        if (!victim || e->lru_counter < victim->lru_counter) {
+            victim = e;
+        }
+    }
+    return victim;
+}
+
+/*
+ * Read the compressed cluster at @coffset into the cache entry @e.  Readers
+ * of the same cluster wait until it is done.
+ */
+static int coroutine_fn
+qcow2_co_decompress_cache_fill(BlockDriverState *bs,
+                               Qcow2DecompressedCluster *e,
+                               uint64_t coffset, int csize)
+{
+    BDRVQcow2State *s = bs->opaque;
+    int ret;
+
+    if (!e->buf) {
+        e->buf = qemu_try_blockalign(bs, s->cluster_size);
+        if (!e->buf) {
+            return -ENOMEM;
+        }
+    }
+
+    e->coffset = coffset;
+    e->csize = csize;
+    e->busy = true;
+
+    ret = qcow2_co_read_compressed(bs, coffset, csize, e->buf);
+
+    /* The clusters may have been freed meanwhile, which clears e->coffset */
+    e->busy = false;
+    if (ret < 0) {
+        e->coffset = 0;
+    }
+    e->lru_counter = ++s->decompress_lru_counter;
+    qemu_co_queue_restart_all(&s->decompress_queue);
+
+    return ret;
+}
+
+void qcow2_decompress_cache_invalidate(BlockDriverState *bs, uint64_t offset,
+                                       uint64_t bytes)
+{
+    BDRVQcow2State *s = bs->opaque;
+    int i;
+
+    for (i = 0; i < s->decompress_cache_size; i++) {
+        Qcow2DecompressedCluster *e = &s->decompress_cache[i];
+
+        if (e->coffset && e->coffset < offset + bytes &&
+            e->coffset + e->csize > offset)
+        {
+            e->coffset = 0;
+        }
+    }
+}
+
+static void qcow2_decompress_cache_free(BDRVQcow2State *s)
+{
+    int i;
+
+    for (i = 0; i < QCOW2_DECOMPRESS_CACHE_MAX; i++) {
+        qemu_vfree(s->decompress_cache[i].buf);
+        s->decompress_cache[i].buf = NULL;
+        s->decompress_cache[i].coffset = 0;
+    }
+}
+
+typedef struct Qcow2ReadaheadCo {
+    BlockDriverState *bs;
+    uint64_t offset;
+} Qcow2ReadaheadCo;
+
+static void coroutine_fn qcow2_co_compressed_readahead_entry(void *opaque)
+{
+    Qcow2ReadaheadCo *rc = opaque;
+    BlockDriverState *bs = rc->bs;
+    BDRVQcow2State *s = bs->opaque;
+    Qcow2DecompressedCluster *e;
+    QCow2SubclusterType type;
+    uint64_t host_offset, coffset;
+    unsigned int bytes = s->cluster_size;
+    int csize, ret;
+
+    /* Read-ahead is not worth waiting for s->lock or an L2 table load */
+    ret = qcow2_try_get_host_offset(bs, rc->offset, &bytes, &host_offset,
+                                    &type);
+    if (ret < 0 || type != QCOW2_SUBCLUSTER_COMPRESSED) {
+        goto out;
+    }
+
+    qcow2_parse_compressed_descriptor(s, host_offset, &coffset, &csize);
+    if (qcow2_decompress_cache_find(s, coffset)) {
+        goto out;
+    }
+
+    e = qcow2_decompress_cache_victim(s);
+    if (e) {
+        trace_qcow2_compressed_readahead(bs, rc->offset, coffset);
+        qcow2_co_decompress_cache_fill(bs, e, coffset, csize);
+    }
+
+out:
+    bdrv_dec_in_flight(bs);
+    g_free(rc);
+}
+
+/*
+ * Start reading and decompressing the clusters following the one at
+ * @offset in the background if the guest reads compressed clusters
+ * sequentially.
+ */
+static void qcow2_compressed_readahead(BlockDriverState *bs, uint64_t offset)
+{
+    BDRVQcow2State *s = bs->opaque;
+    uint64_t cluster = start_of_cluster(s, offset);
+    uint64_t start, end;
+    bool sequential = cluster == s->compressed_ra_next;
+
+    s->compressed_ra_next = cluster + s->cluster_size;
+    if (!sequential) {
+        /* What was read ahead before the seek says nothing about here */
+        s->compressed_ra_end = 0;
+        return;
+    }
+
+    start = MAX(cluster + s->cluster_size, s->compressed_ra_end);
+    end = MIN(cluster + (1 + s->decompress_cache_size / 2) * s->cluster_size,
+              bs->total_sectors * BDRV_SECTOR_SIZE);
+
+    for (offset = start; offset < end; offset += s->cluster_size) {
+        Qcow2ReadaheadCo *rc = g_new(Qcow2ReadaheadCo, 1);
+        Coroutine *co;
+
+        *rc = (Qcow2ReadaheadCo) {
+            .bs     = bs,
+            .offset = offset,
+        };
+        co = qemu_coroutine_create(qcow2_co_compressed_readahead_entry, rc);
+        bdrv_inc_in_flight(bs);
+        aio_co_enter(bdrv_get_aio_context(bs), co);
+    }
+    s->compressed_ra_end = MAX(s->compressed_ra_end, end);
+}
+
+static int coroutine_fn
+qcow2_co_preadv_compressed(BlockDriverState *bs,
+                           uint64_t cluster_descriptor,
+                           uint64_t offset,
+                           uint64_t bytes,
+                           QEMUIOVector *qiov,
+                           size_t qiov_offset)
+{
+    BDRVQcow2State *s = bs->opaque;
+    Qcow2DecompressedCluster *e;
+    int ret = 0, csize;
+    uint64_t coffset;
+    uint8_t *out_buf;
+    int offset_in_cluster = offset_into_cluster(s, offset);
 
+    qcow2_parse_compressed_descriptor(s, cluster_descriptor, &coffset, &csize);
+
+    while ((e = qcow2_decompress_cache_find(s, coffset)) && e->busy) {
+        qemu_co_queue_wait(&s->decompress_queue, NULL);
+    }
+
+    if (!e) {
+        e = qcow2_decompress_cache_victim(s);
+        if (e) {
+            ret = qcow2_co_decompress_cache_fill(bs, e, coffset, csize);
+        }
+    }
+
+    if (e) {
+        if (ret == 0) {
+            e->lru_counter = ++s->decompress_lru_counter;
+            qemu_iovec_from_buf(qiov, qiov_offset, e->buf + offset_in_cluster,
+                                bytes);
+        }
+    } else {
+        /* All entries are being filled, so do without the cache */
+        out_buf = qemu_blockalign(bs, s->cluster_size);
+        ret = qcow2_co_read_compressed(bs, coffset, csize, out_buf);
+        if (ret == 0) {
+            qemu_iovec_from_buf(qiov, qiov_offset, out_buf + offset_in_cluster,
+                                bytes);
+        }
+        qemu_vfree(out_buf);
+    }
+
+    if (ret == 0) {
+        qcow2_compressed_readahead(bs, offset);
+    }
     return ret;
 }
 
@@ -4701,6 +5085,8 @@ static int make_completely_empty(BlockDriverState *bs)
         goto fail;
     }
 
+    qcow2_decompress_cache_invalidate(bs, 0, INT64_MAX);
+
     /* Refcounts will be broken utterly */
     ret = qcow2_mark_dirty(bs);
     if (ret < 0) {
@@ -4788,6 +5174,8 @@ static int make_completely_empty(BlockDriverState *bs)
     s->refcount_table[0] = 2 * s->cluster_size;
 
     s->free_cluster_index = 0;
+    s->alloc_extent_offset = 0;
+    s->alloc_extent_clusters = 0;
     assert(3 + l1_clusters <= s->refcount_block_size);
     offset = qcow2_alloc_clusters(bs, 3 * s->cluster_size + l1_size2);
     if (offset < 0) {
@@ -4840,12 +5228,13 @@ static int qcow2_make_empty(BlockDriverState *bs)
     if (s->qcow_version >= 3 && !s->snapshots && !s->nb_bitmaps &&
         3 + l1_clusters <= s->refcount_block_size &&
         s->crypt_method_header != QCOW_CRYPT_LUKS &&
-        !has_data_file(bs)) {
+        !has_data_file(bs) && !s->journal_size) {
         /* The following function only works for qcow2 v3 images (it
          * requires the dirty flag) and only as long as there are no
          * features that reserve extra clusters (such as snapshots,
-         * LUKS header, or persistent bitmaps), because it completely
-         * empties the image.  Furthermore, the L1 table and three
+         * LUKS header, persistent bitmaps, or a metadata journal),
+         * because it completely empties the image.  Furthermore, the
+         * L1 table and three
          * additional clusters (image header, refcount table, one
          * refcount block) have to fit inside one refcount block. It
          * only resets the image file, i.e. does not work with an
@@ -4894,6 +5283,7 @@ static BlockMeasureInfo *qcow2_measure(QemuOpts *opts, BlockDriverState *in_bs,
     uint64_t refcount_bits;
     uint64_t l2_tables;
     uint64_t luks_payload_size = 0;
+    uint64_t journal_size;
     size_t cluster_size;
     int version;
     char *optstr;
@@ -4922,6 +5312,9 @@ static BlockMeasureInfo *qcow2_measure(QemuOpts *opts, BlockDriverState *in_bs,
         goto err;
     }
 
+    journal_size = ROUND_UP(qemu_opt_get_size_del(opts, BLOCK_OPT_JOURNAL_SIZE,
+                                                  0), cluster_size);
+
     optstr = qemu_opt_get_del(opts, BLOCK_OPT_PREALLOC);
     prealloc = qapi_enum_parse(&PreallocMode_lookup, optstr,
                                PREALLOC_MODE_OFF, &local_err);
@@ -5028,7 +5421,7 @@ static BlockMeasureInfo *qcow2_measure(QemuOpts *opts, BlockDriverState *in_bs,
     }
 
     info = g_new0(BlockMeasureInfo, 1);
-    info->fully_allocated = luks_payload_size +
+    info->fully_allocated = luks_payload_size + journal_size +
         qcow2_calc_prealloc_size(virtual_size, cluster_size,
                                  ctz32(refcount_bits), extended_l2);
 
@@ -5515,6 +5908,14 @@ static int qcow2_amend_options(BlockDriverState *bs, QemuOpts *opts,
                             (encryption_update == true)
     };
 
+    /* Some operations below rewrite metadata behind the caches' back */
+    ret = qcow2_journal_checkpoint(bs);
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Failed to checkpoint the metadata "
+                         "journal");
+        return ret;
+    }
+
     /* Upgrade first (some features may require compat=1.1) */
     if (new_version > old_version) {
         helper_cb_info.current_operation = QCOW2_UPGRADING;
@@ -5838,6 +6239,11 @@ static QemuOptsList qcow2_create_opts = {
             .help = "Extended L2 tables",                               \
             .def_value_str = "off"                                      \
         },                                                              \
+        {                                                               \
+            .name = BLOCK_OPT_JOURNAL_SIZE,                             \
+            .type = QEMU_OPT_SIZE,                                      \
+            .help = "Size of the metadata journal"                      \
+        },                                                              \
         {                                                               \
             .name = BLOCK_OPT_PREALLOC,                                 \
             .type = QEMU_OPT_STRING,                                    \
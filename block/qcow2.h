@@ -129,6 +129,9 @@
 
 #define DEFAULT_CLUSTER_SIZE 65536
 
+/* Data clusters are reserved in extents of this size, see alloc_extent_* */
+#define QCOW2_ALLOC_EXTENT_SIZE (1 * MiB)
+
 #define QCOW2_OPT_DATA_FILE "data-file"
 #define QCOW2_OPT_LAZY_REFCOUNTS "lazy-refcounts"
 #define QCOW2_OPT_DISCARD_REQUEST "pass-discard-request"
@@ -256,17 +259,20 @@ enum {
     QCOW2_INCOMPAT_DATA_FILE_BITNR  = 2,
     QCOW2_INCOMPAT_COMPRESSION_BITNR = 3,
     QCOW2_INCOMPAT_EXTL2_BITNR      = 4,
+    QCOW2_INCOMPAT_JOURNAL_BITNR    = 5,
     QCOW2_INCOMPAT_DIRTY            = 1 << QCOW2_INCOMPAT_DIRTY_BITNR,
     QCOW2_INCOMPAT_CORRUPT          = 1 << QCOW2_INCOMPAT_CORRUPT_BITNR,
     QCOW2_INCOMPAT_DATA_FILE        = 1 << QCOW2_INCOMPAT_DATA_FILE_BITNR,
     QCOW2_INCOMPAT_COMPRESSION      = 1 << QCOW2_INCOMPAT_COMPRESSION_BITNR,
     QCOW2_INCOMPAT_EXTL2            = 1 << QCOW2_INCOMPAT_EXTL2_BITNR,
+    QCOW2_INCOMPAT_JOURNAL          = 1 << QCOW2_INCOMPAT_JOURNAL_BITNR,
 
     QCOW2_INCOMPAT_MASK             = QCOW2_INCOMPAT_DIRTY
                                     | QCOW2_INCOMPAT_CORRUPT
                                     | QCOW2_INCOMPAT_DATA_FILE
                                     | QCOW2_INCOMPAT_COMPRESSION
-                                    | QCOW2_INCOMPAT_EXTL2,
+                                    | QCOW2_INCOMPAT_EXTL2
+                                    | QCOW2_INCOMPAT_JOURNAL,
 };
 
 /* Compatible feature bits */
@@ -322,8 +328,50 @@ typedef struct Qcow2BitmapHeaderExt {
     uint64_t bitmap_directory_offset;
 } QEMU_PACKED Qcow2BitmapHeaderExt;
 
+typedef struct Qcow2JournalHeaderExt {
+    uint64_t journal_offset;
+    uint64_t journal_size;
+} QEMU_PACKED Qcow2JournalHeaderExt;
+
+/* Metadata journal transaction descriptor, see docs/interop/qcow2.txt */
+#define QCOW2_JOURNAL_MAGIC 0x514a5458 /* "QJTX" */
+#define QCOW2_JOURNAL_BLOCK_SIZE 512
+#define QCOW2_JOURNAL_MIN_SIZE (64 * KiB)
+#define QCOW2_JOURNAL_MAX_SIZE (1 * GiB)
+
+typedef struct Qcow2JournalHeader {
+    uint32_t magic;
+    uint32_t checksum;
+    uint64_t sequence;
+    uint32_t descriptor_size;
+    uint32_t nb_entries;
+    uint64_t reserved;
+} QEMU_PACKED Qcow2JournalHeader;
+
+typedef struct Qcow2JournalEntry {
+    uint64_t offset;
+    uint32_t size;
+    uint32_t reserved;
+} QEMU_PACKED Qcow2JournalEntry;
+
 #define QCOW2_MAX_THREADS 4
 
+/*
+ * Decompressed compressed clusters are kept in a small cache so that
+ * partial reads of the same cluster and read-ahead do not decompress it
+ * again.  It holds this many bytes, but at least two clusters.
+ */
+#define QCOW2_DECOMPRESS_CACHE_BYTES (1 * MiB)
+#define QCOW2_DECOMPRESS_CACHE_MAX 16
+
+typedef struct Qcow2DecompressedCluster {
+    uint64_t coffset;       /* Of the compressed data, 0 if unused */
+    int csize;
+    uint8_t *buf;
+    uint64_t lru_counter;
+    bool busy;              /* Being read and decompressed */
+} Qcow2DecompressedCluster;
+
 typedef struct BDRVQcow2State {
     int cluster_bits;
     int cluster_size;
@@ -357,6 +405,14 @@ typedef struct BDRVQcow2State {
     uint64_t free_cluster_index;
     uint64_t free_byte_offset;
 
+    /*
+     * Data clusters whose refcount is already 1 but that have not been handed
+     * out to a write request yet.  Allocating from this extent saves a
+     * refcount update per allocating write.
+     */
+    uint64_t alloc_extent_offset;
+    uint64_t alloc_extent_clusters;
+
     CoMutex lock;
 
     Qcow2CryptoHeaderExtension crypto_header; /* QCow2 header extension */
@@ -409,6 +465,13 @@ typedef struct BDRVQcow2State {
     CoQueue thread_task_queue;
     int nb_threads;
 
+    Qcow2DecompressedCluster decompress_cache[QCOW2_DECOMPRESS_CACHE_MAX];
+    int decompress_cache_size;
+    uint64_t decompress_lru_counter;
+    CoQueue decompress_queue;   /* Waiting for a busy entry */
+    uint64_t compressed_ra_next;
+    uint64_t compressed_ra_end;
+
     BdrvChild *data_file;
 
     bool metadata_preallocation_checked;
@@ -420,6 +483,21 @@ typedef struct BDRVQcow2State {
      * is to convert the image with the desired compression type set.
      */
     Qcow2CompressionType compression_type;
+
+    /*
+     * Metadata journal, see qcow2-journal.c.  journal_size is 0 if the image
+     * has none.  journal_tables maps the offset of every table written to
+     * the journal since the last checkpoint to its latest copy in the
+     * journal; journal_clusters maps the clusters containing those tables
+     * to the size with which they were written.
+     */
+    uint64_t journal_offset;
+    uint64_t journal_size;
+    uint64_t journal_pos;
+    uint64_t journal_seq;
+    GHashTable *journal_tables;
+    GHashTable *journal_clusters;
+    bool journal_need_checkpoint;
 } BDRVQcow2State;
 
 typedef struct Qcow2COWRegion {
@@ -844,6 +922,9 @@ int qcow2_validate_table(BlockDriverState *bs, uint64_t offset,
                          int64_t max_size_bytes, const char *table_name,
                          Error **errp);
 
+void qcow2_decompress_cache_invalidate(BlockDriverState *bs, uint64_t offset,
+                                       uint64_t bytes);
+
 /* qcow2-refcount.c functions */
 int qcow2_refcount_init(BlockDriverState *bs);
 void qcow2_refcount_close(BlockDriverState *bs);
@@ -863,6 +944,9 @@ int64_t qcow2_refcount_area(BlockDriverState *bs, uint64_t offset,
 int64_t qcow2_alloc_clusters(BlockDriverState *bs, uint64_t size);
 int64_t qcow2_alloc_clusters_at(BlockDriverState *bs, uint64_t offset,
                                 int64_t nb_clusters);
+int64_t qcow2_alloc_data_clusters(BlockDriverState *bs, uint64_t offset,
+                                  uint64_t *nb_clusters);
+void qcow2_release_alloc_extent(BlockDriverState *bs);
 int64_t qcow2_alloc_bytes(BlockDriverState *bs, int size);
 void qcow2_free_clusters(BlockDriverState *bs,
                           int64_t offset, int64_t size,
@@ -907,6 +991,9 @@ int qcow2_encrypt_sectors(BDRVQcow2State *s, int64_t sector_num,
 int qcow2_get_host_offset(BlockDriverState *bs, uint64_t offset,
                           unsigned int *bytes, uint64_t *host_offset,
                           QCow2SubclusterType *subcluster_type);
+int qcow2_try_get_host_offset(BlockDriverState *bs, uint64_t offset,
+                              unsigned int *bytes, uint64_t *host_offset,
+                              QCow2SubclusterType *subcluster_type);
 int qcow2_alloc_host_offset(BlockDriverState *bs, uint64_t offset,
                             unsigned int *bytes, uint64_t *host_offset,
                             QCowL2Meta **m);
@@ -970,10 +1057,26 @@ int qcow2_cache_get(BlockDriverState *bs, Qcow2Cache *c, uint64_t offset,
     void **table);
 int qcow2_cache_get_empty(BlockDriverState *bs, Qcow2Cache *c, uint64_t offset,
     void **table);
+void *qcow2_cache_lookup(Qcow2Cache *c, uint64_t offset);
 void qcow2_cache_put(Qcow2Cache *c, void **table);
 void *qcow2_cache_is_table_offset(Qcow2Cache *c, uint64_t offset);
 void qcow2_cache_discard(Qcow2Cache *c, void *table);
 
+int qcow2_cache_journal_add(Qcow2Cache *c, QEMUIOVector *qiov,
+                            GArray *entries);
+void qcow2_cache_journal_done(Qcow2Cache *c);
+bool qcow2_cache_journal_needs_flush(Qcow2Cache *c);
+
+/* qcow2-journal.c functions */
+int qcow2_journal_open(BlockDriverState *bs, int flags, Error **errp);
+void qcow2_journal_close(BlockDriverState *bs);
+int qcow2_journal_create(BlockDriverState *bs, uint64_t size, Error **errp);
+int qcow2_journal_commit(BlockDriverState *bs);
+int qcow2_journal_checkpoint(BlockDriverState *bs);
+int64_t qcow2_journal_table_offset(BlockDriverState *bs, uint64_t offset,
+                                   int size);
+void qcow2_journal_revoke(BlockDriverState *bs, uint64_t cluster_offset);
+
 /* qcow2-bitmap.c functions */
 int qcow2_check_bitmaps_refcounts(BlockDriverState *bs, BdrvCheckResult *res,
                                   void **refcount_table,
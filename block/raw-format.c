@@ -216,6 +216,24 @@ static int coroutine_fn raw_co_preadv(BlockDriverState *bs, uint64_t offset,
     return bdrv_co_preadv(bs->file, offset, bytes, qiov, flags);
 }
 
+static int raw_aio_prw_direct(BlockDriverState *bs, uint64_t offset,
+                              QEMUIOVector *qiov, bool is_write,
+                              AioContext *ctx,
+                              BlockCompletionFunc *cb, void *opaque)
+{
+    /* Writes to a probed image must be checked by raw_co_pwritev() */
+    if (is_write && bs->probed) {
+        return -ENOTSUP;
+    }
+    if (raw_adjust_offset(bs, &offset, qiov->size, is_write)) {
+        return -ENOTSUP;
+    }
+
+    BLKDBG_EVENT(bs->file, is_write ? BLKDBG_WRITE_AIO : BLKDBG_READ_AIO);
+    return bdrv_aio_prw_direct(bs->file, offset, qiov, is_write, ctx,
+                               cb, opaque);
+}
+
 static int coroutine_fn raw_co_pwritev(BlockDriverState *bs, uint64_t offset,
                                        uint64_t bytes, QEMUIOVector *qiov,
                                        int flags)
@@ -369,6 +387,23 @@ static int raw_get_info(BlockDriverState *bs, BlockDriverInfo *bdi)
     return bdrv_get_info(bs->file->bs, bdi);
 }
 
+static int raw_get_host_fd(BlockDriverState *bs, int64_t *fd_offset)
+{
+    BDRVRawState *s = bs->opaque;
+    int fd;
+
+    fd = bdrv_get_host_fd(bs->file->bs, fd_offset);
+    if (fd < 0) {
+        return fd;
+    }
+    /* Requests are already limited to s->size by the block layer */
+    if (*fd_offset > INT64_MAX - s->offset) {
+        return -ENOTSUP;
+    }
+    *fd_offset += s->offset;
+    return fd;
+}
+
 static void raw_refresh_limits(BlockDriverState *bs, Error **errp)
 {
     if (bs->probed) {
@@ -592,6 +627,7 @@ BlockDriver bdrv_raw = {
     .bdrv_co_create_opts  = &raw_co_create_opts,
     .bdrv_co_preadv       = &raw_co_preadv,
     .bdrv_co_pwritev      = &raw_co_pwritev,
+    .bdrv_aio_prw_direct  = &raw_aio_prw_direct,
     .bdrv_co_pwrite_zeroes = &raw_co_pwrite_zeroes,
     .bdrv_co_pdiscard     = &raw_co_pdiscard,
     .bdrv_co_block_status = &raw_co_block_status,
@@ -601,8 +637,10 @@ BlockDriver bdrv_raw = {
     .bdrv_getlength       = &raw_getlength,
     .is_format            = true,
     .has_variable_length  = true,
+    .supports_multiqueue  = true,
     .bdrv_measure         = &raw_measure,
     .bdrv_get_info        = &raw_get_info,
+    .bdrv_get_host_fd     = &raw_get_host_fd,
     .bdrv_refresh_limits  = &raw_refresh_limits,
     .bdrv_probe_blocksizes = &raw_probe_blocksizes,
     .bdrv_probe_geometry  = &raw_probe_geometry,
@@ -0,0 +1,560 @@
+/*
+ * Shared read cache filter driver
+ *
+ * Many VMs on a host often overlay the same read-only base image.  This
+ * filter is inserted above such a base and keeps the clusters read from
+ * it in a memory segment that all QEMU processes opening the same segment
+ * file share, so each cluster of the base is read once per host instead
+ * of once per VM.  Backing the segment with a file on hugetlbfs puts the
+ * cache in the hugepage pool.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include <sys/file.h>
+#include <sys/mman.h>
+
+#include "qapi/error.h"
+#include "qemu/atomic.h"
+#include "qemu/mmap-alloc.h"
+#include "qemu/module.h"
+#include "qemu/option.h"
+#include "qemu/units.h"
+#include "block/block_int.h"
+#include "trace.h"
+
+/*
+ * Segment layout: a header page, an array of slot descriptors and then
+ * the cluster data of each slot, page aligned.  A cluster of an image can
+ * only live in one slot, chosen by hashing the image id and the cluster
+ * offset, and a newer cluster simply replaces the previous tenant.
+ *
+ * Processes only synchronize through the sequence number of each slot.
+ * It is odd while the slot is being filled; a filler claims it with a
+ * compare-and-swap and gives up if another process got there first.
+ * Readers check that the sequence number is even and unchanged around
+ * their copy of the data, and treat the slot as a miss otherwise.  A
+ * process that dies in the middle of a fill leaves its slot unusable
+ * until the segment file is recreated.
+ *
+ * The filter only caches guest-visible data of its child, which must not
+ * change while any process uses the segment.  The node is therefore
+ * read-only, and the child may not be written by anyone.
+ */
+
+#define SHARED_CACHE_MAGIC      0x5152454144434143ULL /* "QREADCAC" */
+#define SHARED_CACHE_VERSION    1
+#define SHARED_CACHE_HEADER_SIZE 4096
+
+typedef struct SharedCacheHeader {
+    uint64_t magic;
+    uint32_t version;
+    uint32_t cluster_size;
+    uint64_t nb_slots;
+} SharedCacheHeader;
+
+typedef struct SharedCacheSlot {
+    uint64_t image_id;
+    uint64_t offset;
+    uint32_t seq;
+    uint32_t reserved;
+} SharedCacheSlot;
+
+typedef struct BDRVSharedCacheState {
+    int fd;
+    void *segment;
+    size_t segment_size;
+
+    SharedCacheSlot *slots;
+    uint8_t *data;
+    uint64_t nb_slots;
+    uint32_t cluster_size;
+
+    uint64_t image_id;
+} BDRVSharedCacheState;
+
+#define SHARED_CACHE_OPT_PATH           "path"
+#define SHARED_CACHE_OPT_SIZE           "size"
+#define SHARED_CACHE_OPT_CLUSTER_SIZE   "cluster-size"
+#define SHARED_CACHE_OPT_IMAGE_ID       "image-id"
+
+static QemuOptsList runtime_opts = {
+    .name = "shared-read-cache",
+    .head = QTAILQ_HEAD_INITIALIZER(runtime_opts.head),
+    .desc = {
+        {
+            .name = SHARED_CACHE_OPT_PATH,
+            .type = QEMU_OPT_STRING,
+            .help = "file backing the shared cache segment",
+        },
+        {
+            .name = SHARED_CACHE_OPT_SIZE,
+            .type = QEMU_OPT_SIZE,
+            .help = "size of the cache if the segment is created, "
+                "default 256M",
+        },
+        {
+            .name = SHARED_CACHE_OPT_CLUSTER_SIZE,
+            .type = QEMU_OPT_SIZE,
+            .help = "caching granularity if the segment is created, "
+                "default 64k",
+        },
+        {
+            .name = SHARED_CACHE_OPT_IMAGE_ID,
+            .type = QEMU_OPT_STRING,
+            .help = "identifies the cached image across processes, "
+                "default is derived from its file name, size and the "
+                "identity and modification time of the host file",
+        },
+        { /* end of list */ }
+    },
+};
+
+/* 64-bit FNV-1a; never returns 0, which marks unused slots */
+static uint64_t shared_cache_image_id(const char *str)
+{
+    uint64_t hash = 0xcbf29ce484222325ULL;
+
+    for (; *str; str++) {
+        hash ^= (uint8_t)*str;
+        hash *= 0x100000001b3ULL;
+    }
+    return hash ?: 1;
+}
+
+/*
+ * Default image id.  The file name and size alone would not notice an
+ * image that was replaced or rewritten at the same path, so also include
+ * device, inode and modification time of the host file below @bs, if
+ * there is one.
+ */
+static char *shared_cache_default_id(BlockDriverState *bs, int64_t length)
+{
+    BlockDriverState *child;
+    GString *id = g_string_new(NULL);
+
+    g_string_printf(id, "%s:%" PRId64, bs->filename, length);
+    for (child = bs; child; child = bdrv_primary_bs(child)) {
+        int64_t fd_offset;
+        int fd = bdrv_get_host_fd(child, &fd_offset);
+        struct stat st;
+        long mtime_nsec = 0;
+
+        if (fd < 0) {
+            continue;
+        }
+        if (fstat(fd, &st) == 0) {
+#ifdef CONFIG_LINUX
+            mtime_nsec = st.st_mtim.tv_nsec;
+#endif
+            g_string_append_printf(id, ":%" PRIu64 ":%" PRIu64 ":%" PRId64
+                                   ".%09ld",
+                                   (uint64_t)st.st_dev, (uint64_t)st.st_ino,
+                                   (int64_t)st.st_mtime, mtime_nsec);
+        }
+        break;
+    }
+    return g_string_free(id, false);
+}
+
+static SharedCacheSlot *shared_cache_slot(BDRVSharedCacheState *s,
+                                          uint64_t offset, uint8_t **data)
+{
+    uint64_t index;
+
+    index = (s->image_id ^ (offset / s->cluster_size) * 0x9e3779b97f4a7c15ULL)
+            % s->nb_slots;
+    *data = s->data + index * s->cluster_size;
+    return &s->slots[index];
+}
+
+static size_t shared_cache_data_offset(uint64_t nb_slots)
+{
+    return ROUND_UP(SHARED_CACHE_HEADER_SIZE +
+                    nb_slots * sizeof(SharedCacheSlot),
+                    qemu_real_host_page_size);
+}
+
+/*
+ * Map the segment in @path, formatting it first if it is new.  The
+ * geometry of an existing segment wins over @size and @cluster_size.
+ */
+static int shared_cache_map(BDRVSharedCacheState *s, const char *path,
+                            uint64_t size, uint64_t cluster_size,
+                            Error **errp)
+{
+    SharedCacheHeader *header;
+    struct stat st;
+    uint64_t nb_slots;
+    size_t pagesize;
+    int ret;
+
+    s->fd = qemu_create(path, O_RDWR, 0600, errp);
+    if (s->fd < 0) {
+        return -errno;
+    }
+    pagesize = qemu_fd_getpagesize(s->fd);
+
+    /* Serialize formatting against other processes opening the segment */
+    if (flock(s->fd, LOCK_EX) < 0) {
+        ret = -errno;
+        error_setg_errno(errp, errno, "Could not lock '%s'", path);
+        goto fail;
+    }
+
+    if (fstat(s->fd, &st) < 0) {
+        ret = -errno;
+        error_setg_errno(errp, errno, "Could not stat '%s'", path);
+        goto fail;
+    }
+
+    if (st.st_size == 0) {
+        nb_slots = size / cluster_size;
+        if (!nb_slots) {
+            error_setg(errp, "Shared read cache size must be at least %"
+                       PRIu64 " bytes", cluster_size);
+            ret = -EINVAL;
+            goto fail;
+        }
+        s->segment_size = ROUND_UP(shared_cache_data_offset(nb_slots) +
+                                   nb_slots * cluster_size, pagesize);
+        ret = ftruncate(s->fd, s->segment_size);
+        if (ret < 0) {
+            ret = -errno;
+            error_setg_errno(errp, errno, "Could not resize '%s'", path);
+            goto fail;
+        }
+    } else if (st.st_size < SHARED_CACHE_HEADER_SIZE) {
+        error_setg(errp, "'%s' is not a shared read cache segment", path);
+        ret = -EINVAL;
+        goto fail;
+    } else {
+        s->segment_size = st.st_size;
+    }
+
+    s->segment = mmap(NULL, s->segment_size, PROT_READ | PROT_WRITE,
+                      MAP_SHARED, s->fd, 0);
+    if (s->segment == MAP_FAILED) {
+        s->segment = NULL;
+        ret = -errno;
+        error_setg_errno(errp, errno, "Could not map '%s'", path);
+        goto fail;
+    }
+
+    header = s->segment;
+    if (st.st_size == 0) {
+        /* A fresh file reads as zeroes, so only the header needs writing */
+        header->version = SHARED_CACHE_VERSION;
+        header->cluster_size = cluster_size;
+        header->nb_slots = nb_slots;
+        smp_wmb();
+        header->magic = SHARED_CACHE_MAGIC;
+    } else if (header->magic != SHARED_CACHE_MAGIC ||
+               header->version != SHARED_CACHE_VERSION) {
+        error_setg(errp, "'%s' is not a shared read cache segment", path);
+        ret = -EINVAL;
+        goto fail;
+    }
+
+    s->cluster_size = header->cluster_size;
+    s->nb_slots = header->nb_slots;
+    if (!is_power_of_2(s->cluster_size) || s->cluster_size < BDRV_SECTOR_SIZE ||
+        s->cluster_size > 2 * MiB || !s->nb_slots ||
+        shared_cache_data_offset(s->nb_slots) +
+            s->nb_slots * s->cluster_size > s->segment_size) {
+        error_setg(errp, "Shared read cache segment '%s' is corrupt", path);
+        ret = -EINVAL;
+        goto fail;
+    }
+    s->slots = (SharedCacheSlot *)((uint8_t *)s->segment +
+                                   SHARED_CACHE_HEADER_SIZE);
+    s->data = (uint8_t *)s->segment + shared_cache_data_offset(s->nb_slots);
+
+    flock(s->fd, LOCK_UN);
+    return 0;
+
+fail:
+    if (s->segment) {
+        munmap(s->segment, s->segment_size);
+        s->segment = NULL;
+    }
+    qemu_close(s->fd);
+    s->fd = -1;
+    return ret;
+}
+
+static int shared_cache_open(BlockDriverState *bs, QDict *options, int flags,
+                             Error **errp)
+{
+    BDRVSharedCacheState *s = bs->opaque;
+    QemuOpts *opts;
+    const char *path, *image_id;
+    g_autofree char *default_id = NULL;
+    uint64_t size, cluster_size;
+    int64_t length;
+    int ret;
+
+    if (flags & BDRV_O_RDWR) {
+        error_setg(errp, "The shared-read-cache driver only supports "
+                   "read-only nodes");
+        return -EINVAL;
+    }
+
+    bs->file = bdrv_open_child(NULL, options, "file", bs, &child_of_bds,
+                               BDRV_CHILD_FILTERED | BDRV_CHILD_PRIMARY,
+                               false, errp);
+    if (!bs->file) {
+        return -EINVAL;
+    }
+
+    opts = qemu_opts_create(&runtime_opts, NULL, 0, &error_abort);
+    if (!qemu_opts_absorb_qdict(opts, options, errp)) {
+        ret = -EINVAL;
+        goto out;
+    }
+
+    path = qemu_opt_get(opts, SHARED_CACHE_OPT_PATH);
+    if (!path) {
+        error_setg(errp, "The shared-read-cache driver requires a path");
+        ret = -EINVAL;
+        goto out;
+    }
+
+    size = qemu_opt_get_size(opts, SHARED_CACHE_OPT_SIZE, 256 * MiB);
+    cluster_size = qemu_opt_get_size(opts, SHARED_CACHE_OPT_CLUSTER_SIZE,
+                                     64 * KiB);
+    if (!is_power_of_2(cluster_size) || cluster_size < BDRV_SECTOR_SIZE ||
+        cluster_size > 2 * MiB) {
+        error_setg(errp, "cluster-size must be a power of two between "
+                   "%llu and %llu bytes", BDRV_SECTOR_SIZE, 2 * MiB);
+        ret = -EINVAL;
+        goto out;
+    }
+
+    image_id = qemu_opt_get(opts, SHARED_CACHE_OPT_IMAGE_ID);
+    if (!image_id) {
+        length = bdrv_getlength(bs->file->bs);
+        if (length < 0) {
+            error_setg_errno(errp, -length, "Could not get image size");
+            ret = length;
+            goto out;
+        }
+        default_id = shared_cache_default_id(bs->file->bs, length);
+        image_id = default_id;
+    }
+    s->image_id = shared_cache_image_id(image_id);
+
+    ret = shared_cache_map(s, path, size, cluster_size, errp);
+    if (ret < 0) {
+        goto out;
+    }
+
+    bs->supported_read_flags = BDRV_REQ_PREFETCH;
+    ret = 0;
+
+out:
+    qemu_opts_del(opts);
+    return ret;
+}
+
+static void shared_cache_close(BlockDriverState *bs)
+{
+    BDRVSharedCacheState *s = bs->opaque;
+
+    munmap(s->segment, s->segment_size);
+    qemu_close(s->fd);
+}
+
+static int shared_cache_reopen_prepare(BDRVReopenState *reopen_state,
+                                       BlockReopenQueue *queue, Error **errp)
+{
+    if (reopen_state->flags & BDRV_O_RDWR) {
+        error_setg(errp, "The shared-read-cache driver only supports "
+                   "read-only nodes");
+        return -EINVAL;
+    }
+    return 0;
+}
+
+static void shared_cache_child_perm(BlockDriverState *bs, BdrvChild *c,
+                                    BdrvChildRole role,
+                                    BlockReopenQueue *reopen_queue,
+                                    uint64_t perm, uint64_t shared,
+                                    uint64_t *nperm, uint64_t *nshared)
+{
+    bdrv_default_perms(bs, c, role, reopen_queue, perm, shared,
+                       nperm, nshared);
+
+    /* Other processes keep serving what we cached, so it must not change */
+    *nshared &= ~(BLK_PERM_WRITE | BLK_PERM_RESIZE);
+}
+
+static int64_t shared_cache_getlength(BlockDriverState *bs)
+{
+    return bdrv_getlength(bs->file->bs);
+}
+
+/*
+ * Copy the cluster at @offset from the cache into @qiov, skipping the
+ * first @skip bytes of the cluster.  Return false on a miss.
+ */
+static bool shared_cache_lookup(BDRVSharedCacheState *s, uint64_t offset,
+                                uint64_t skip, uint64_t bytes,
+                                QEMUIOVector *qiov, size_t qiov_offset)
+{
+    SharedCacheSlot *slot;
+    uint8_t *data;
+    uint32_t seq;
+
+    slot = shared_cache_slot(s, offset, &data);
+    seq = qatomic_load_acquire(&slot->seq);
+    if ((seq & 1) || slot->image_id != s->image_id || slot->offset != offset) {
+        return false;
+    }
+
+    if (qiov) {
+        qemu_iovec_from_buf(qiov, qiov_offset, data + skip, bytes);
+    }
+
+    /* Did a filler replace the slot under our feet? */
+    smp_rmb();
+    return qatomic_read(&slot->seq) == seq;
+}
+
+/* Publish the cluster at @offset, whose data is in @qiov or @buf */
+static void shared_cache_fill(BDRVSharedCacheState *s, uint64_t offset,
+                              QEMUIOVector *qiov, size_t qiov_offset,
+                              const uint8_t *buf)
+{
+    SharedCacheSlot *slot;
+    uint8_t *data;
+    uint32_t seq;
+
+    slot = shared_cache_slot(s, offset, &data);
+    seq = qatomic_read(&slot->seq);
+    if ((seq & 1) || qatomic_cmpxchg(&slot->seq, seq, seq + 1) != seq) {
+        /* Somebody else is filling it, let them */
+        return;
+    }
+
+    if (qiov) {
+        qemu_iovec_to_buf(qiov, qiov_offset, data, s->cluster_size);
+    } else {
+        memcpy(data, buf, s->cluster_size);
+    }
+    slot->image_id = s->image_id;
+    slot->offset = offset;
+    qatomic_store_release(&slot->seq, seq + 2);
+}
+
+static int coroutine_fn shared_cache_co_preadv_part(BlockDriverState *bs,
+                                                    uint64_t offset,
+                                                    uint64_t bytes,
+                                                    QEMUIOVector *qiov,
+                                                    size_t qiov_offset,
+                                                    int flags)
+{
+    BDRVSharedCacheState *s = bs->opaque;
+    g_autofree uint8_t *bounce = NULL;
+    int64_t length;
+    int ret;
+
+    length = bdrv_getlength(bs->file->bs);
+    if (length < 0) {
+        return length;
+    }
+
+    while (bytes) {
+        uint64_t cluster_offset = QEMU_ALIGN_DOWN(offset, s->cluster_size);
+        uint64_t skip = offset - cluster_offset;
+        uint64_t n = MIN(bytes, s->cluster_size - skip);
+        QEMUIOVector *dst = (flags & BDRV_REQ_PREFETCH) ? NULL : qiov;
+
+        if (cluster_offset + s->cluster_size > length) {
+            /* The cache only holds whole clusters */
+            ret = bdrv_co_preadv_part(bs->file, offset, n, qiov, qiov_offset,
+                                      flags);
+        } else if (shared_cache_lookup(s, cluster_offset, skip, n, dst,
+                                       qiov_offset)) {
+            trace_shared_read_cache_hit(bs, cluster_offset);
+            ret = 0;
+        } else if (n == s->cluster_size && dst) {
+            trace_shared_read_cache_miss(bs, cluster_offset);
+            ret = bdrv_co_preadv_part(bs->file, offset, n, qiov, qiov_offset,
+                                      0);
+            if (ret >= 0) {
+                shared_cache_fill(s, cluster_offset, qiov, qiov_offset, NULL);
+            }
+        } else {
+            trace_shared_read_cache_miss(bs, cluster_offset);
+            if (!bounce) {
+                bounce = qemu_try_blockalign(bs->file->bs, s->cluster_size);
+                if (!bounce) {
+                    return -ENOMEM;
+                }
+            }
+            ret = bdrv_co_pread(bs->file, cluster_offset, s->cluster_size,
+                                bounce, 0);
+            if (ret >= 0) {
+                shared_cache_fill(s, cluster_offset, NULL, 0, bounce);
+                if (dst) {
+                    qemu_iovec_from_buf(qiov, qiov_offset, bounce + skip, n);
+                }
+            }
+        }
+        if (ret < 0) {
+            return ret;
+        }
+
+        offset += n;
+        bytes -= n;
+        qiov_offset += n;
+    }
+
+    return 0;
+}
+
+static void shared_cache_eject(BlockDriverState *bs, bool eject_flag)
+{
+    bdrv_eject(bs->file->bs, eject_flag);
+}
+
+static void shared_cache_lock_medium(BlockDriverState *bs, bool locked)
+{
+    bdrv_lock_medium(bs->file->bs, locked);
+}
+
+static const char *const shared_cache_strong_runtime_opts[] = {
+    SHARED_CACHE_OPT_IMAGE_ID,
+
+    NULL
+};
+
+static BlockDriver bdrv_shared_read_cache = {
+    .format_name                        = "shared-read-cache",
+    .instance_size                      = sizeof(BDRVSharedCacheState),
+
+    .bdrv_open                          = shared_cache_open,
+    .bdrv_close                         = shared_cache_close,
+    .bdrv_reopen_prepare                = shared_cache_reopen_prepare,
+    .bdrv_child_perm                    = shared_cache_child_perm,
+
+    .bdrv_getlength                     = shared_cache_getlength,
+
+    .bdrv_co_preadv_part                = shared_cache_co_preadv_part,
+
+    .bdrv_eject                         = shared_cache_eject,
+    .bdrv_lock_medium                   = shared_cache_lock_medium,
+
+    .strong_runtime_opts                = shared_cache_strong_runtime_opts,
+    .is_filter                          = true,
+};
+
+static void bdrv_shared_read_cache_init(void)
+{
+    bdrv_register(&bdrv_shared_read_cache);
+}
+
+block_init(bdrv_shared_read_cache_init);
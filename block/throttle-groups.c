@@ -35,6 +35,10 @@
 #include "qom/object.h"
 #include "qom/object_interfaces.h"
 
+/* How much I/O a member can take ahead of time, in terms of time at the
+ * configured limits */
+#define THROTTLE_GROUP_LEASE_NS (5 * SCALE_MS)
+
 static void throttle_group_obj_init(Object *obj);
 static void throttle_group_obj_complete(UserCreatable *obj, Error **errp);
 static void timer_cb(ThrottleGroupMember *tgm, bool is_write);
@@ -62,6 +66,12 @@ static void timer_cb(ThrottleGroupMember *tgm, bool is_write);
  * blk_set_aio_context()). Therefore in this file a thread will
  * access some other ThrottleGroupMember's timers only after verifying that
  * that ThrottleGroupMember has throttled requests in the queue.
+ *
+ * The lease fields of a ThrottleGroupMember are the exception: they are
+ * only replenished under the lock, but its own requests spend them with
+ * atomic operations and without taking the lock at all.  A lease is
+ * accounted in the ThrottleState when it is handed out, so the limits of
+ * the group hold no matter which AioContext ends up using it.
  */
 struct ThrottleGroup {
     Object parent_obj;
@@ -349,6 +359,98 @@ static void schedule_next_request(ThrottleGroupMember *tgm, bool is_write)
     }
 }
 
+/* Try to pay for a request with the member's lease, without taking the
+ * ThrottleGroup lock.
+ *
+ * @tgm:       the ThrottleGroupMember that is sending the request
+ * @bytes:     the size of the request
+ * @is_write:  the type of operation (read/write)
+ * @ret:       true if the request was covered by the lease
+ */
+static bool throttle_group_take_lease(ThrottleGroupMember *tgm,
+                                      int64_t bytes, bool is_write)
+{
+    int old, cur;
+
+    if (bytes > qatomic_read(&tgm->lease_op_size)) {
+        return false;
+    }
+
+    if (qatomic_fetch_dec(&tgm->lease_ops[is_write]) <= 0) {
+        qatomic_inc(&tgm->lease_ops[is_write]);
+        return false;
+    }
+
+    /* Never go below zero, so that concurrent requests cannot underflow */
+    cur = qatomic_read(&tgm->lease_bytes[is_write]);
+    do {
+        old = cur;
+        if (old < bytes) {
+            qatomic_inc(&tgm->lease_ops[is_write]);
+            return false;
+        }
+        cur = qatomic_cmpxchg(&tgm->lease_bytes[is_write], old, old - bytes);
+    } while (cur != old);
+
+    return true;
+}
+
+/* Add a new lease of @n >= 0 to @lease.  At most one lease worth of
+ * what is left of the previous one is carried over, so that a member
+ * that leaves its lease unused cannot save up for a burst past the
+ * limits; the rest was accounted already and is dropped.  The result
+ * saturates at INT_MAX, which is what an unlimited lease is anyway.
+ */
+static void throttle_group_add_lease(int *lease, int n)
+{
+    int old, cur = qatomic_read(lease);
+
+    do {
+        int carry;
+
+        old = cur;
+        carry = MIN(old, n);
+        cur = qatomic_cmpxchg(lease, old,
+                              carry > INT_MAX - n ? INT_MAX : carry + n);
+    } while (cur != old);
+}
+
+/* Give a member a new lease once it has used up the previous one, if
+ * there is spare capacity in the group.  This must be called with the
+ * ThrottleGroup lock held.
+ *
+ * @tgm:       the ThrottleGroupMember
+ * @is_write:  the type of operation (read/write)
+ */
+static void throttle_group_renew_lease(ThrottleGroupMember *tgm,
+                                       bool is_write)
+{
+    ThrottleState *ts = tgm->throttle_state;
+    ThrottleGroup *tg = container_of(ts, ThrottleGroup, ts);
+    uint64_t op_size = ts->cfg.op_size;
+    int ops, bytes;
+
+    if (tgm->pending_reqs[is_write] || tg->any_timer_armed[is_write] ||
+        qatomic_read(&tgm->io_limits_disabled)) {
+        return;
+    }
+
+    if (qatomic_read(&tgm->lease_ops[is_write]) > 0 &&
+        qatomic_read(&tgm->lease_bytes[is_write]) > 0) {
+        return;
+    }
+
+    if (!throttle_lease(ts, tg->clock_type, is_write,
+                        THROTTLE_GROUP_LEASE_NS, &ops, &bytes)) {
+        return;
+    }
+
+    qatomic_set(&tgm->lease_op_size,
+                op_size ? MIN(op_size, INT_MAX) : INT_MAX);
+    throttle_group_add_lease(&tgm->lease_ops[is_write], ops);
+    throttle_group_add_lease(&tgm->lease_bytes[is_write], bytes);
+}
+
 /* Check if an I/O request needs to be throttled, wait and set a timer
  * if necessary, and schedule the next request using a round robin
  * algorithm.
@@ -367,6 +469,13 @@ void coroutine_fn throttle_group_co_io_limits_intercept(ThrottleGroupMember *tgm
 
     assert(bytes >= 0);
 
+    /* Requests covered by the lease don't need the lock, as long as
+     * they don't overtake throttled requests of the same type */
+    if (!qatomic_read(&tgm->pending_reqs[is_write]) &&
+        throttle_group_take_lease(tgm, bytes, is_write)) {
+        return;
+    }
+
     qemu_mutex_lock(&tg->lock);
 
     /* First we check if this I/O has to be throttled. */
@@ -391,6 +500,9 @@ void coroutine_fn throttle_group_co_io_limits_intercept(ThrottleGroupMember *tgm
     /* Schedule the next request */
     schedule_next_request(tgm, is_write);
 
+    /* If nothing else is waiting, take some I/O ahead of time */
+    throttle_group_renew_lease(tgm, is_write);
+
     qemu_mutex_unlock(&tg->lock);
 }
 
@@ -473,8 +585,18 @@ void throttle_group_config(ThrottleGroupMember *tgm, ThrottleConfig *cfg)
 {
     ThrottleState *ts = tgm->throttle_state;
     ThrottleGroup *tg = container_of(ts, ThrottleGroup, ts);
+    ThrottleGroupMember *member;
+    int i;
+
     qemu_mutex_lock(&tg->lock);
     throttle_config(ts, tg->clock_type, cfg);
+    /* The levels have been reset, so outstanding leases are void */
+    QLIST_FOREACH(member, &tg->head, round_robin) {
+        for (i = 0; i < 2; i++) {
+            qatomic_set(&member->lease_ops[i], 0);
+            qatomic_set(&member->lease_bytes[i], 0);
+        }
+    }
     qemu_mutex_unlock(&tg->lock);
 
     throttle_group_restart_tgm(tgm);
@@ -548,6 +670,11 @@ void throttle_group_register_tgm(ThrottleGroupMember *tgm,
     tgm->throttle_state = ts;
     tgm->aio_context = ctx;
     qatomic_set(&tgm->restart_pending, 0);
+    for (i = 0; i < 2; i++) {
+        qatomic_set(&tgm->lease_ops[i], 0);
+        qatomic_set(&tgm->lease_bytes[i], 0);
+    }
+    qatomic_set(&tgm->lease_op_size, 0);
 
     QEMU_LOCK_GUARD(&tg->lock);
     /* If the ThrottleGroup is new set this ThrottleGroupMember as the token */
@@ -35,6 +35,11 @@ void mmap_lock(void)
     }
 }
 
+void mmap_lock_pc(target_ulong pc)
+{
+    mmap_lock();
+}
+
 void mmap_unlock(void)
 {
     if (--mmap_lock_count == 0) {
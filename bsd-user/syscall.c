@@ -26,6 +26,7 @@
 
 #include "qemu.h"
 #include "qemu-common.h"
+#include "exec/exec-all.h"
 #include "user/syscall-trace.h"
 
 //#define DEBUG
@@ -574,3 +575,11 @@ abi_long do_openbsd_syscall(void *cpu_env, int num, abi_long arg1,
 void syscall_init(void)
 {
 }
+
+#ifdef TARGET_X86_64
+bool user_fast_syscall(CPUArchState *env, int num, target_ulong arg1,
+                       target_ulong arg2, target_ulong *ret)
+{
+    return false;
+}
+#endif
@@ -45,9 +45,17 @@ typedef struct {
     uint64_t writes;
 } PageCounters;
 
+typedef struct {
+    uint64_t page;
+    uint64_t is_store;
+} PageAccess;
+
 static GMutex lock;
 static GHashTable *pages;
 
+/* accesses are queued per vCPU and counted by a consumer thread */
+static struct qemu_plugin_trace_buffer *accesses;
+
 static gint cmp_access_count(gconstpointer a, gconstpointer b)
 {
     PageCounters *ea = (PageCounters *) a;
@@ -79,6 +87,8 @@ static void plugin_exit(qemu_plugin_id_t id, void *p)
     int i;
     GList *counts;
 
+    qemu_plugin_trace_buffer_stop_consumer(accesses);
+
     counts = g_hash_table_get_values(pages);
     if (counts && g_list_next(counts)) {
         GList *it;
@@ -106,12 +116,48 @@ static void plugin_init(void)
     pages = g_hash_table_new(NULL, g_direct_equal);
 }
 
+/* called with lock held */
+static void count_access(unsigned int cpu_index, const PageAccess *access)
+{
+    PageCounters *count;
+
+    count = (PageCounters *) g_hash_table_lookup(pages,
+                                                 GUINT_TO_POINTER(access->page));
+
+    if (!count) {
+        count = g_new0(PageCounters, 1);
+        count->page_address = access->page;
+        g_hash_table_insert(pages, GUINT_TO_POINTER(access->page),
+                            (gpointer) count);
+    }
+    if (access->is_store) {
+        count->writes++;
+        count->cpu_write |= (1 << cpu_index);
+    } else {
+        count->reads++;
+        count->cpu_read |= (1 << cpu_index);
+    }
+}
+
+static void count_accesses(unsigned int cpu_index, const void *records,
+                           size_t n_records, void *udata)
+{
+    const PageAccess *access = records;
+    size_t i;
+
+    g_mutex_lock(&lock);
+    for (i = 0; i < n_records; i++) {
+        count_access(cpu_index, &access[i]);
+    }
+    g_mutex_unlock(&lock);
+}
+
 static void vcpu_haddr(unsigned int cpu_index, qemu_plugin_meminfo_t meminfo,
                        uint64_t vaddr, void *udata)
 {
     struct qemu_plugin_hwaddr *hwaddr = qemu_plugin_get_hwaddr(meminfo, vaddr);
     uint64_t page;
-    PageCounters *count;
+    PageAccess access;
 
     /* We only get a hwaddr for system emulation */
     if (track_io) {
@@ -129,23 +175,12 @@ static void vcpu_haddr(unsigned int cpu_index, qemu_plugin_meminfo_t meminfo,
     }
     page &= ~page_mask;
 
-    g_mutex_lock(&lock);
-    count = (PageCounters *) g_hash_table_lookup(pages, GUINT_TO_POINTER(page));
-
-    if (!count) {
-        count = g_new0(PageCounters, 1);
-        count->page_address = page;
-        g_hash_table_insert(pages, GUINT_TO_POINTER(page), (gpointer) count);
-    }
-    if (qemu_plugin_mem_is_store(meminfo)) {
-        count->writes++;
-        count->cpu_write |= (1 << cpu_index);
-    } else {
-        count->reads++;
-        count->cpu_read |= (1 << cpu_index);
+    access.page = page;
+    access.is_store = qemu_plugin_mem_is_store(meminfo);
+    if (!qemu_plugin_trace_buffer_push(accesses, cpu_index, &access)) {
+        /* the consumer is lagging behind, count this one directly */
+        count_accesses(cpu_index, &access, 1, NULL);
     }
-
-    g_mutex_unlock(&lock);
 }
 
 static void vcpu_tb_trans(qemu_plugin_id_t id, struct qemu_plugin_tb *tb)
@@ -186,6 +221,8 @@ int qemu_plugin_install(qemu_plugin_id_t id, const qemu_info_t *info,
     }
 
     plugin_init();
+    accesses = qemu_plugin_trace_buffer_new(sizeof(PageAccess), 1 << 14);
+    qemu_plugin_trace_buffer_start_consumer(accesses, count_accesses, 10, NULL);
 
     qemu_plugin_register_vcpu_tb_trans_cb(id, vcpu_tb_trans);
     qemu_plugin_register_atexit_cb(id, plugin_exit, NULL);
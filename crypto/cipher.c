@@ -158,6 +158,10 @@ qcrypto_cipher_munge_des_rfb_key(const uint8_t *key,
 #include "cipher-builtin.c.inc"
 #endif
 
+#ifdef CONFIG_AVX2_OPT
+#include "cipher-aesni.c.inc"
+#endif
+
 QCryptoCipher *qcrypto_cipher_new(QCryptoCipherAlgorithm alg,
                                   QCryptoCipherMode mode,
                                   const uint8_t *key, size_t nkey,
@@ -168,6 +172,11 @@ QCryptoCipher *qcrypto_cipher_new(QCryptoCipherAlgorithm alg,
 #ifdef CONFIG_AF_ALG
     cipher = qcrypto_afalg_cipher_ctx_new(alg, mode, key, nkey, NULL);
 #endif
+#ifdef CONFIG_AVX2_OPT
+    if (!cipher) {
+        cipher = qcrypto_aesni_cipher_ctx_new(alg, mode, key, nkey);
+    }
+#endif
 
     if (!cipher) {
         cipher = qcrypto_cipher_ctx_new(alg, mode, key, nkey, errp);
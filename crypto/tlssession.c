@@ -32,6 +32,18 @@
 
 #include <gnutls/x509.h>
 
+#ifdef HAVE_LINUX_TLS_H
+#include <netinet/tcp.h>
+#include <linux/tls.h>
+
+#ifndef SOL_TLS
+#define SOL_TLS 282
+#endif
+#ifndef TCP_ULP
+#define TCP_ULP 31
+#endif
+#endif
+
 
 struct QCryptoTLSSession {
     QCryptoTLSCreds *creds;
@@ -39,6 +51,7 @@ struct QCryptoTLSSession {
     char *hostname;
     char *authzid;
     bool handshakeComplete;
+    bool ktlsTx;
     QCryptoTLSSessionWriteFunc writeFunc;
     QCryptoTLSSessionReadFunc readFunc;
     void *opaque;
@@ -72,6 +85,16 @@ qcrypto_tls_session_push(void *opaque, const void *buf, size_t len)
         return -1;
     };
 
+    /*
+     * Once the kernel encrypts outgoing data, anything GnuTLS still
+     * sends by itself (alerts, TLS 1.3 key update replies) would be
+     * encrypted a second time as application data by the kernel.
+     */
+    if (session->ktlsTx) {
+        errno = EIO;
+        return -1;
+    }
+
     return session->writeFunc(buf, len, session->opaque);
 }
 
@@ -521,6 +544,131 @@ qcrypto_tls_session_get_handshake_status(QCryptoTLSSession *session)
 }
 
 
+#ifdef HAVE_LINUX_TLS_H
+/*
+ * Fill a tls12_crypto_info_* structure for AES-GCM from the GnuTLS write
+ * state.  The IV from GnuTLS is the 4 byte salt for TLS 1.2, whose
+ * explicit nonce is taken from the record sequence number, and the salt
+ * followed by the 8 byte IV for TLS 1.3.
+ */
+#define QCRYPTO_KTLS_FILL(ci, type, vers, iv, key, seq)                  \
+    ({                                                                   \
+        bool ok_ = (key).size == TLS_CIPHER_##type##_KEY_SIZE &&         \
+            (iv).size == TLS_CIPHER_##type##_SALT_SIZE +                 \
+                ((vers) == TLS_1_3_VERSION ? TLS_CIPHER_##type##_IV_SIZE \
+                                           : 0);                         \
+        if (ok_) {                                                       \
+            (ci).info.version = (vers);                                  \
+            (ci).info.cipher_type = TLS_CIPHER_##type;                   \
+            memcpy((ci).key, (key).data, TLS_CIPHER_##type##_KEY_SIZE);  \
+            memcpy((ci).salt, (iv).data, TLS_CIPHER_##type##_SALT_SIZE); \
+            memcpy((ci).iv, (vers) == TLS_1_3_VERSION ?                  \
+                   (iv).data + TLS_CIPHER_##type##_SALT_SIZE : (seq),    \
+                   TLS_CIPHER_##type##_IV_SIZE);                         \
+            memcpy((ci).rec_seq, (seq), TLS_CIPHER_##type##_REC_SEQ_SIZE); \
+        }                                                                \
+        ok_;                                                             \
+    })
+
+int
+qcrypto_tls_session_enable_ktls_tx(QCryptoTLSSession *session,
+                                   int fd,
+                                   Error **errp)
+{
+    union {
+        struct tls12_crypto_info_aes_gcm_128 aes_gcm_128;
+#ifdef TLS_CIPHER_AES_GCM_256
+        struct tls12_crypto_info_aes_gcm_256 aes_gcm_256;
+#endif
+    } info;
+    gnutls_protocol_t protocol = gnutls_protocol_get_version(session->handle);
+    gnutls_cipher_algorithm_t cipher = gnutls_cipher_get(session->handle);
+    gnutls_datum_t iv, key;
+    unsigned char seq[8];
+    uint16_t version;
+    socklen_t len;
+    bool ok;
+    int ret = -1;
+
+    if (!session->handshakeComplete) {
+        error_setg(errp, "TLS handshake is not complete");
+        return -1;
+    }
+
+    switch (protocol) {
+    case GNUTLS_TLS1_2:
+        version = TLS_1_2_VERSION;
+        break;
+    case GNUTLS_TLS1_3:
+        version = TLS_1_3_VERSION;
+        break;
+    default:
+        error_setg(errp, "Kernel TLS does not support %s",
+                   gnutls_protocol_get_name(protocol));
+        return -1;
+    }
+
+    if (gnutls_record_get_state(session->handle, 0, NULL, &iv, &key,
+                                seq) < 0) {
+        error_setg(errp, "Cannot get the TLS session keys");
+        return -1;
+    }
+
+    memset(&info, 0, sizeof(info));
+    switch (cipher) {
+    case GNUTLS_CIPHER_AES_128_GCM:
+        ok = QCRYPTO_KTLS_FILL(info.aes_gcm_128, AES_GCM_128, version,
+                               iv, key, seq);
+        len = sizeof(info.aes_gcm_128);
+        break;
+#ifdef TLS_CIPHER_AES_GCM_256
+    case GNUTLS_CIPHER_AES_256_GCM:
+        ok = QCRYPTO_KTLS_FILL(info.aes_gcm_256, AES_GCM_256, version,
+                               iv, key, seq);
+        len = sizeof(info.aes_gcm_256);
+        break;
+#endif
+    default:
+        error_setg(errp, "Kernel TLS does not support cipher %s",
+                   gnutls_cipher_get_name(cipher));
+        return -1;
+    }
+    if (!ok) {
+        error_setg(errp, "Unexpected TLS key sizes");
+        goto cleanup;
+    }
+
+    /*
+     * If the ULP can be attached but TLS_TX fails, the socket keeps
+     * working as a plain socket so GnuTLS can still be used.
+     */
+    if (setsockopt(fd, SOL_TCP, TCP_ULP, "tls", sizeof("tls")) < 0) {
+        error_setg_errno(errp, errno, "Cannot enable kernel TLS");
+        goto cleanup;
+    }
+    if (setsockopt(fd, SOL_TLS, TLS_TX, &info, len) < 0) {
+        error_setg_errno(errp, errno, "Cannot set kernel TLS keys");
+        goto cleanup;
+    }
+    session->ktlsTx = true;
+    ret = 0;
+
+ cleanup:
+    memset(&info, 0, sizeof(info));
+    return ret;
+}
+#else
+int
+qcrypto_tls_session_enable_ktls_tx(QCryptoTLSSession *session,
+                                   int fd,
+                                   Error **errp)
+{
+    error_setg(errp, "Kernel TLS is not supported on this host");
+    return -1;
+}
+#endif
+
+
 int
 qcrypto_tls_session_get_key_size(QCryptoTLSSession *session,
                                  Error **errp)
@@ -624,6 +772,16 @@ qcrypto_tls_session_get_handshake_status(QCryptoTLSSession *sess)
 }
 
 
+int
+qcrypto_tls_session_enable_ktls_tx(QCryptoTLSSession *sess,
+                                   int fd,
+                                   Error **errp)
+{
+    error_setg(errp, "TLS requires GNUTLS support");
+    return -1;
+}
+
+
 int
 qcrypto_tls_session_get_key_size(QCryptoTLSSession *sess,
                                  Error **errp)
@@ -14,6 +14,7 @@
 #include "qemu/osdep.h"
 #include "qemu-common.h"
 #include "qemu/cutils.h"
+#include "qemu/units.h"
 #include "elf.h"
 #include "cpu.h"
 #include "exec/hwaddr.h"
@@ -48,6 +49,12 @@
 
 #define MAX_GUEST_NOTE_SIZE (1 << 20) /* 1MB should be enough */
 
+#define DUMP_MAX_THREADS    8
+#define DUMP_MAX_JOBS       (2 * DUMP_MAX_THREADS)
+#define DUMP_WRITE_SIZE     (1 * MiB)
+#define DUMP_CHUNK_SIZE     (64 * MiB)
+#define DUMP_BATCH_PAGES    256
+
 #define ELF_NOTE_SIZE(hdr_size, name_size, desc_size)   \
     ((DIV_ROUND_UP((hdr_size), 4) +                     \
       DIV_ROUND_UP((name_size), 4) +                    \
@@ -383,30 +390,197 @@ static void write_data(DumpState *s, void *buf, int length, Error **errp)
     }
 }
 
-/* write the memory to vmcore. 1 page per I/O. */
+/* write the memory to vmcore, at most DUMP_WRITE_SIZE per I/O. */
 static void write_memory(DumpState *s, GuestPhysBlock *block, ram_addr_t start,
                          int64_t size, Error **errp)
 {
-    int64_t i;
+    int64_t done, len;
     Error *local_err = NULL;
 
-    for (i = 0; i < size / s->dump_info.page_size; i++) {
-        write_data(s, block->host_addr + start + i * s->dump_info.page_size,
-                   s->dump_info.page_size, &local_err);
+    for (done = 0; done < size; done += len) {
+        len = MIN(size - done, DUMP_WRITE_SIZE);
+        write_data(s, block->host_addr + start + done, len, &local_err);
         if (local_err) {
             error_propagate(errp, local_err);
             return;
         }
     }
+}
 
-    if ((size % s->dump_info.page_size) != 0) {
-        write_data(s, block->host_addr + start + i * s->dump_info.page_size,
-                   size % s->dump_info.page_size, &local_err);
-        if (local_err) {
-            error_propagate(errp, local_err);
+/*
+ * Parallel dump
+ *
+ * Guest memory is cut into jobs that a few worker threads process while
+ * the dump thread prepares the next ones: with the ELF format each job
+ * writes a chunk of memory at its final place in the file, with the kdump
+ * format each job compresses a batch of pages and the dump thread writes
+ * the results in order.
+ */
+
+struct DumpJob {
+    QSIMPLEQ_ENTRY(DumpJob) next;
+    void (*fn)(DumpState *s, DumpJob *job, void *wrkmem);
+    bool done;
+    int ret;
+};
+
+static void *dump_worker(void *opaque)
+{
+    DumpState *s = opaque;
+    DumpWorkers *w = &s->workers;
+    void *wrkmem = NULL;
+    DumpJob *job;
+
+#ifdef CONFIG_LZO
+    wrkmem = g_malloc(LZO1X_1_MEM_COMPRESS);
+#endif
+
+    qemu_mutex_lock(&w->lock);
+    for (;;) {
+        while (QSIMPLEQ_EMPTY(&w->jobs) && !w->quit) {
+            qemu_cond_wait(&w->work_cond, &w->lock);
+        }
+        job = QSIMPLEQ_FIRST(&w->jobs);
+        if (!job) {
+            break;
+        }
+        QSIMPLEQ_REMOVE_HEAD(&w->jobs, next);
+        qemu_mutex_unlock(&w->lock);
+
+        job->fn(s, job, wrkmem);
+
+        qemu_mutex_lock(&w->lock);
+        job->done = true;
+        qemu_cond_broadcast(&w->done_cond);
+    }
+    qemu_mutex_unlock(&w->lock);
+
+    g_free(wrkmem);
+    return NULL;
+}
+
+static void dump_workers_start(DumpState *s)
+{
+    DumpWorkers *w = &s->workers;
+    long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int i;
+
+    qemu_mutex_init(&w->lock);
+    qemu_cond_init(&w->work_cond);
+    qemu_cond_init(&w->done_cond);
+    QSIMPLEQ_INIT(&w->jobs);
+    w->quit = false;
+    w->nthreads = MAX(1, MIN(ncpus, DUMP_MAX_THREADS));
+    w->threads = g_new(QemuThread, w->nthreads);
+    for (i = 0; i < w->nthreads; i++) {
+        qemu_thread_create(&w->threads[i], "dump-worker", dump_worker, s,
+                           QEMU_THREAD_JOINABLE);
+    }
+}
+
+static void dump_workers_stop(DumpState *s)
+{
+    DumpWorkers *w = &s->workers;
+    int i;
+
+    qemu_mutex_lock(&w->lock);
+    w->quit = true;
+    qemu_cond_broadcast(&w->work_cond);
+    qemu_mutex_unlock(&w->lock);
+
+    for (i = 0; i < w->nthreads; i++) {
+        qemu_thread_join(&w->threads[i]);
+    }
+    g_free(w->threads);
+    w->threads = NULL;
+    qemu_cond_destroy(&w->done_cond);
+    qemu_cond_destroy(&w->work_cond);
+    qemu_mutex_destroy(&w->lock);
+}
+
+static void dump_job_submit(DumpState *s, DumpJob *job)
+{
+    DumpWorkers *w = &s->workers;
+
+    job->done = false;
+    job->ret = 0;
+    qemu_mutex_lock(&w->lock);
+    QSIMPLEQ_INSERT_TAIL(&w->jobs, job, next);
+    qemu_cond_signal(&w->work_cond);
+    qemu_mutex_unlock(&w->lock);
+}
+
+static void dump_job_wait(DumpState *s, DumpJob *job)
+{
+    DumpWorkers *w = &s->workers;
+
+    qemu_mutex_lock(&w->lock);
+    while (!job->done) {
+        qemu_cond_wait(&w->done_cond, &w->lock);
+    }
+    qemu_mutex_unlock(&w->lock);
+}
+
+typedef struct DumpMemoryChunk {
+    DumpJob job;
+    uint8_t *host;
+    size_t size;
+    off_t offset;
+} DumpMemoryChunk;
+
+static int dump_pwrite(int fd, const uint8_t *buf, size_t size, off_t offset)
+{
+    while (size) {
+        ssize_t ret = pwrite(fd, buf, size, offset);
+
+        if (ret < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -errno;
+        }
+        buf += ret;
+        size -= ret;
+        offset += ret;
+    }
+    return 0;
+}
+
+/* Write a chunk of memory, leaving holes in the file for zero pages */
+static void dump_memory_chunk(DumpState *s, DumpJob *job, void *wrkmem)
+{
+    DumpMemoryChunk *c = container_of(job, DumpMemoryChunk, job);
+    size_t page_size = s->dump_info.page_size;
+    size_t pos = 0, run = 0, len;
+
+    while (pos + run < c->size) {
+        len = MIN(page_size, c->size - pos - run);
+        if (!buffer_is_zero(c->host + pos + run, len)) {
+            run += len;
+            if (run < DUMP_WRITE_SIZE) {
+                continue;
+            }
+        } else if (!run) {
+            pos += len;
+            continue;
+        }
+        job->ret = dump_pwrite(s->fd, c->host + pos, run, c->offset + pos);
+        if (job->ret) {
             return;
         }
+        pos += run;
+        run = 0;
     }
+    if (run) {
+        job->ret = dump_pwrite(s->fd, c->host + pos, run, c->offset + pos);
+    }
+}
+
+static bool dump_fd_is_file(DumpState *s)
+{
+    struct stat st;
+
+    return !fstat(s->fd, &st) && S_ISREG(st.st_mode);
 }
 
 /* get the memory's offset and size in the vmcore */
@@ -638,6 +812,92 @@ static int get_next_block(DumpState *s, GuestPhysBlock *block)
     }
 }
 
+/*
+ * Write all memory to a regular file from the worker threads.  Each chunk
+ * goes to its place in the file and zero pages are skipped, so the file
+ * is sparse.
+ */
+static void dump_iterate_parallel(DumpState *s, Error **errp)
+{
+    DumpMemoryChunk chunks[DUMP_MAX_JOBS];
+    unsigned int head = 0, count = 0;
+    GuestPhysBlock *block;
+    off_t offset, end;
+    int64_t size, pos;
+    int ret = 0;
+
+    /*
+     * Zero pages are skipped, so drop whatever the file held past the
+     * headers (e.g. for a file passed with fd:) to make them read as zero.
+     */
+    offset = lseek(s->fd, 0, SEEK_CUR);
+    if (offset < 0 || ftruncate(s->fd, offset) < 0) {
+        error_setg_errno(errp, errno, "dump: failed to save memory");
+        return;
+    }
+
+    dump_workers_start(s);
+
+    do {
+        block = s->next_block;
+
+        size = block->target_end - block->target_start;
+        if (s->has_filter) {
+            size -= s->start;
+            if (s->begin + s->length < block->target_end) {
+                size -= block->target_end - (s->begin + s->length);
+            }
+        }
+
+        for (pos = 0; pos < size && !ret; pos += DUMP_CHUNK_SIZE) {
+            DumpMemoryChunk *c;
+
+            if (count == DUMP_MAX_JOBS) {
+                c = &chunks[head];
+                dump_job_wait(s, &c->job);
+                ret = c->job.ret;
+                s->written_size += c->size;
+                head = (head + 1) % DUMP_MAX_JOBS;
+                count--;
+                if (ret) {
+                    break;
+                }
+            }
+
+            c = &chunks[(head + count) % DUMP_MAX_JOBS];
+            c->job.fn = dump_memory_chunk;
+            c->host = block->host_addr + s->start + pos;
+            c->size = MIN(size - pos, DUMP_CHUNK_SIZE);
+            c->offset = offset;
+            offset += c->size;
+            dump_job_submit(s, &c->job);
+            count++;
+        }
+    } while (!ret && !get_next_block(s, block));
+
+    for (; count; count--, head = (head + 1) % DUMP_MAX_JOBS) {
+        dump_job_wait(s, &chunks[head].job);
+        if (!ret) {
+            ret = chunks[head].job.ret;
+        }
+        s->written_size += chunks[head].size;
+    }
+
+    dump_workers_stop(s);
+
+    if (ret) {
+        error_setg_errno(errp, -ret, "dump: failed to save memory");
+        return;
+    }
+
+    /* Trailing zero pages were skipped, give the file its full size */
+    end = lseek(s->fd, 0, SEEK_END);
+    if (end < 0 || (end < offset && ftruncate(s->fd, offset) < 0) ||
+        lseek(s->fd, offset, SEEK_SET) < 0) {
+        error_setg_errno(errp, errno, "dump: failed to save memory");
+    }
+}
+
 /* write all memory to vmcore */
 static void dump_iterate(DumpState *s, Error **errp)
 {
@@ -645,6 +905,11 @@ static void dump_iterate(DumpState *s, Error **errp)
     int64_t size;
     Error *local_err = NULL;
 
+    if (dump_fd_is_file(s)) {
+        dump_iterate_parallel(s, errp);
+        return;
+    }
+
     do {
         block = s->next_block;
 
@@ -1298,20 +1563,138 @@ static inline bool is_zero_page(const uint8_t *buf, size_t page_size)
     return buffer_is_zero(buf, page_size);
 }
 
+typedef struct DumpPageBatch {
+    DumpJob job;
+    unsigned int n;
+    size_t len_buf_out;
+    uint8_t *data;                          /* room for compressed pages */
+    uint8_t *pages[DUMP_BATCH_PAGES];
+    const uint8_t *out[DUMP_BATCH_PAGES];   /* what to write for the page */
+    size_t size[DUMP_BATCH_PAGES];          /* 0 for a zero page */
+    uint32_t flags[DUMP_BATCH_PAGES];
+} DumpPageBatch;
+
+/*
+ * Compress the page in buf.  Only one compression format will be used
+ * here, for s->flag_compress is set.  But when compression fails to work,
+ * we fall back to save in plaintext, and *out points to buf.
+ *
+ * Returns the flags for the page descriptor.
+ */
+static uint32_t dump_compress_page(DumpState *s, uint8_t *buf,
+                                   uint8_t *buf_out, size_t len_buf_out,
+                                   const uint8_t **out, size_t *size,
+                                   void *wrkmem)
+{
+    size_t size_out = len_buf_out;
+
+    *out = buf_out;
+    if ((s->flag_compress & DUMP_DH_COMPRESSED_ZLIB) &&
+        (compress2(buf_out, (uLongf *)&size_out, buf,
+                   s->dump_info.page_size, Z_BEST_SPEED) == Z_OK) &&
+        (size_out < s->dump_info.page_size)) {
+        *size = size_out;
+        return DUMP_DH_COMPRESSED_ZLIB;
+    }
+#ifdef CONFIG_LZO
+    size_out = len_buf_out;
+    if ((s->flag_compress & DUMP_DH_COMPRESSED_LZO) &&
+        (lzo1x_1_compress(buf, s->dump_info.page_size, buf_out,
+                          (lzo_uint *)&size_out, wrkmem) == LZO_E_OK) &&
+        (size_out < s->dump_info.page_size)) {
+        *size = size_out;
+        return DUMP_DH_COMPRESSED_LZO;
+    }
+#endif
+#ifdef CONFIG_SNAPPY
+    size_out = len_buf_out;
+    if ((s->flag_compress & DUMP_DH_COMPRESSED_SNAPPY) &&
+        (snappy_compress((char *)buf, s->dump_info.page_size,
+                         (char *)buf_out, &size_out) == SNAPPY_OK) &&
+        (size_out < s->dump_info.page_size)) {
+        *size = size_out;
+        return DUMP_DH_COMPRESSED_SNAPPY;
+    }
+#endif
+
+    *out = buf;
+    *size = s->dump_info.page_size;
+    return 0;
+}
+
+/* Runs in a worker thread */
+static void dump_compress_batch(DumpState *s, DumpJob *job, void *wrkmem)
+{
+    DumpPageBatch *b = container_of(job, DumpPageBatch, job);
+    unsigned int i;
+
+    for (i = 0; i < b->n; i++) {
+        if (is_zero_page(b->pages[i], s->dump_info.page_size)) {
+            b->size[i] = 0;
+            continue;
+        }
+        b->flags[i] = dump_compress_page(s, b->pages[i],
+                                         b->data + i * b->len_buf_out,
+                                         b->len_buf_out, &b->out[i],
+                                         &b->size[i], wrkmem);
+    }
+}
+
+/*
+ * Write the data and descriptors of a compressed batch.  Zero pages all
+ * share the page data written first, described by pd_zero.
+ */
+static int dump_write_batch(DumpState *s, DumpPageBatch *b,
+                            DataCache *page_desc, DataCache *page_data,
+                            PageDescriptor *pd_zero, off_t *offset_data,
+                            Error **errp)
+{
+    PageDescriptor pd;
+    unsigned int i;
+
+    for (i = 0; i < b->n; i++) {
+        if (!b->size[i]) {
+            if (write_cache(page_desc, pd_zero, sizeof(PageDescriptor),
+                            false) < 0) {
+                error_setg(errp, "dump: failed to write page desc");
+                return -1;
+            }
+        } else {
+            if (write_cache(page_data, b->out[i], b->size[i], false) < 0) {
+                error_setg(errp, "dump: failed to write page data");
+                return -1;
+            }
+
+            pd.flags = cpu_to_dump32(s, b->flags[i]);
+            pd.size = cpu_to_dump32(s, b->size[i]);
+            pd.page_flags = cpu_to_dump64(s, 0);
+            pd.offset = cpu_to_dump64(s, *offset_data);
+            *offset_data += b->size[i];
+
+            if (write_cache(page_desc, &pd, sizeof(PageDescriptor),
+                            false) < 0) {
+                error_setg(errp, "dump: failed to write page desc");
+                return -1;
+            }
+        }
+        s->written_size += s->dump_info.page_size;
+    }
+    return 0;
+}
+
 static void write_dump_pages(DumpState *s, Error **errp)
 {
     int ret = 0;
     DataCache page_desc, page_data;
-    size_t len_buf_out, size_out;
-#ifdef CONFIG_LZO
-    lzo_bytep wrkmem = NULL;
-#endif
-    uint8_t *buf_out = NULL;
+    size_t len_buf_out;
     off_t offset_desc, offset_data;
-    PageDescriptor pd, pd_zero;
+    PageDescriptor pd_zero;
     uint8_t *buf;
     GuestPhysBlock *block_iter = NULL;
     uint64_t pfn_iter;
+    DumpPageBatch *batches, *b;
+    unsigned int i, head = 0, count = 0;
+    bool more = true;
 
     /* get offset of page_desc and page_data in dump file */
     offset_desc = s->offset_page;
@@ -1324,12 +1707,6 @@ static void write_dump_pages(DumpState *s, Error **errp)
     len_buf_out = get_len_buf_out(s->dump_info.page_size, s->flag_compress);
     assert(len_buf_out != 0);
 
-#ifdef CONFIG_LZO
-    wrkmem = g_malloc(LZO1X_1_MEM_COMPRESS);
-#endif
-
-    buf_out = g_malloc(len_buf_out);
-
     /*
      * init zero page's page_desc and page_data, because every zero page
      * uses the same page_data
@@ -1343,106 +1720,52 @@ static void write_dump_pages(DumpState *s, Error **errp)
     g_free(buf);
     if (ret < 0) {
         error_setg(errp, "dump: failed to write page data (zero page)");
-        goto out;
+        free_data_cache(&page_desc);
+        free_data_cache(&page_data);
+        return;
     }
 
     offset_data += s->dump_info.page_size;
 
+    batches = g_new0(DumpPageBatch, DUMP_MAX_JOBS);
+    for (i = 0; i < DUMP_MAX_JOBS; i++) {
+        batches[i].job.fn = dump_compress_batch;
+        batches[i].len_buf_out = len_buf_out;
+        batches[i].data = g_malloc(len_buf_out * DUMP_BATCH_PAGES);
+    }
+    dump_workers_start(s);
+
     /*
      * dump memory to vmcore page by page. zero page will all be resided in the
-     * first page of page section
+     * first page of page section.  Batches of pages are compressed by the
+     * workers, and written in order while the next ones are compressed.
      */
-    while (get_next_page(&block_iter, &pfn_iter, &buf, s)) {
-        /* check zero page */
-        if (is_zero_page(buf, s->dump_info.page_size)) {
-            ret = write_cache(&page_desc, &pd_zero, sizeof(PageDescriptor),
-                              false);
-            if (ret < 0) {
-                error_setg(errp, "dump: failed to write page desc");
-                goto out;
-            }
-        } else {
-            /*
-             * not zero page, then:
-             * 1. compress the page
-             * 2. write the compressed page into the cache of page_data
-             * 3. get page desc of the compressed page and write it into the
-             *    cache of page_desc
-             *
-             * only one compression format will be used here, for
-             * s->flag_compress is set. But when compression fails to work,
-             * we fall back to save in plaintext.
-             */
-             size_out = len_buf_out;
-             if ((s->flag_compress & DUMP_DH_COMPRESSED_ZLIB) &&
-                    (compress2(buf_out, (uLongf *)&size_out, buf,
-                               s->dump_info.page_size, Z_BEST_SPEED) == Z_OK) &&
-                    (size_out < s->dump_info.page_size)) {
-                pd.flags = cpu_to_dump32(s, DUMP_DH_COMPRESSED_ZLIB);
-                pd.size  = cpu_to_dump32(s, size_out);
-
-                ret = write_cache(&page_data, buf_out, size_out, false);
-                if (ret < 0) {
-                    error_setg(errp, "dump: failed to write page data");
-                    goto out;
-                }
-#ifdef CONFIG_LZO
-            } else if ((s->flag_compress & DUMP_DH_COMPRESSED_LZO) &&
-                    (lzo1x_1_compress(buf, s->dump_info.page_size, buf_out,
-                    (lzo_uint *)&size_out, wrkmem) == LZO_E_OK) &&
-                    (size_out < s->dump_info.page_size)) {
-                pd.flags = cpu_to_dump32(s, DUMP_DH_COMPRESSED_LZO);
-                pd.size  = cpu_to_dump32(s, size_out);
-
-                ret = write_cache(&page_data, buf_out, size_out, false);
-                if (ret < 0) {
-                    error_setg(errp, "dump: failed to write page data");
-                    goto out;
-                }
-#endif
-#ifdef CONFIG_SNAPPY
-            } else if ((s->flag_compress & DUMP_DH_COMPRESSED_SNAPPY) &&
-                    (snappy_compress((char *)buf, s->dump_info.page_size,
-                    (char *)buf_out, &size_out) == SNAPPY_OK) &&
-                    (size_out < s->dump_info.page_size)) {
-                pd.flags = cpu_to_dump32(s, DUMP_DH_COMPRESSED_SNAPPY);
-                pd.size  = cpu_to_dump32(s, size_out);
-
-                ret = write_cache(&page_data, buf_out, size_out, false);
-                if (ret < 0) {
-                    error_setg(errp, "dump: failed to write page data");
-                    goto out;
-                }
-#endif
-            } else {
-                /*
-                 * fall back to save in plaintext, size_out should be
-                 * assigned the target's page size
-                 */
-                pd.flags = cpu_to_dump32(s, 0);
-                size_out = s->dump_info.page_size;
-                pd.size = cpu_to_dump32(s, size_out);
-
-                ret = write_cache(&page_data, buf,
-                                  s->dump_info.page_size, false);
-                if (ret < 0) {
-                    error_setg(errp, "dump: failed to write page data");
-                    goto out;
+    while (more || count) {
+        if (more && count < DUMP_MAX_JOBS) {
+            b = &batches[(head + count) % DUMP_MAX_JOBS];
+            for (b->n = 0; b->n < DUMP_BATCH_PAGES; b->n++) {
+                if (!get_next_page(&block_iter, &pfn_iter, &buf, s)) {
+                    more = false;
+                    break;
                 }
+                b->pages[b->n] = buf;
             }
-
-            /* get and write page desc here */
-            pd.page_flags = cpu_to_dump64(s, 0);
-            pd.offset = cpu_to_dump64(s, offset_data);
-            offset_data += size_out;
-
-            ret = write_cache(&page_desc, &pd, sizeof(PageDescriptor), false);
-            if (ret < 0) {
-                error_setg(errp, "dump: failed to write page desc");
-                goto out;
+            if (b->n) {
+                dump_job_submit(s, &b->job);
+                count++;
             }
+            continue;
         }
-        s->written_size += s->dump_info.page_size;
+
+        b = &batches[head];
+        dump_job_wait(s, &b->job);
+        ret = dump_write_batch(s, b, &page_desc, &page_data, &pd_zero,
+                               &offset_data, errp);
+        if (ret < 0) {
+            goto out;
+        }
+        head = (head + 1) % DUMP_MAX_JOBS;
+        count--;
     }
 
     ret = write_cache(&page_desc, NULL, 0, true);
@@ -1457,14 +1780,14 @@ static void write_dump_pages(DumpState *s, Error **errp)
     }
 
 out:
+    /* lets the workers finish the jobs that are still queued */
+    dump_workers_stop(s);
+    for (i = 0; i < DUMP_MAX_JOBS; i++) {
+        g_free(batches[i].data);
+    }
+    g_free(batches);
     free_data_cache(&page_desc);
     free_data_cache(&page_data);
-
-#ifdef CONFIG_LZO
-    g_free(wrkmem);
-#endif
-
-    g_free(buf_out);
 }
 
 static void create_kdump_vmcore(DumpState *s, Error **errp)
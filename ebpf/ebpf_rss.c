@@ -0,0 +1,456 @@
+/*
+ * eBPF RSS steering for tap devices
+ *
+ * The steering program is attached to the tap device with
+ * TUNSETSTEERINGEBPF and its return value selects the queue a packet is
+ * delivered to.  It parses the Ethernet, IPv4/IPv6 and TCP/UDP headers,
+ * computes the Toeplitz hash that virtio-net would compute in software and
+ * looks the queue up in the indirection table.  Everything that depends on
+ * the guest's RSS configuration lives in a single-entry array map, so that
+ * reconfiguring RSS is a single map update.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include <sys/syscall.h>
+#include <linux/bpf.h>
+
+#include "ebpf/ebpf_rss.h"
+#include "standard-headers/linux/virtio_net.h"
+#include "trace.h"
+
+/*
+ * Toeplitz input is at most an IPv6 4-tuple: two 16-byte addresses and two
+ * 16-bit ports.  Rather than walking the input bit by bit, the program XORs
+ * one precomputed 256-entry table per input byte position.
+ */
+#define EBPF_RSS_INPUT_WORDS       9
+#define EBPF_RSS_INPUT_BYTES       (EBPF_RSS_INPUT_WORDS * 4)
+
+typedef struct EBPFRSSMap {
+    uint32_t hash_types;
+    uint16_t indirections_mask;
+    uint16_t default_queue;
+    uint16_t indirections_table[EBPF_RSS_INDIRECTION_TABLE_SIZE];
+    uint32_t toeplitz[EBPF_RSS_INPUT_BYTES][256];
+} EBPFRSSMap;
+
+#define EBPF_RSS_MAX_INSNS         512
+
+enum {
+    L_NO_VLAN,
+    L_IPV4,
+    L_IPV6,
+    L_V4_UDP,
+    L_V4_L3,
+    L_V4_L3_OK,
+    L_V4_L4,
+    L_V6_UDP,
+    L_V6_L3,
+    L_V6_L3_OK,
+    L_V6_L4,
+    L_HASH,
+    L_DONE,
+    L_DEFAULT,
+    L_MAX,
+};
+
+typedef struct EBPFProgram {
+    struct bpf_insn insns[EBPF_RSS_MAX_INSNS];
+    int len;
+    int labels[L_MAX];
+    struct {
+        int insn;
+        int label;
+    } fixups[EBPF_RSS_MAX_INSNS];
+    int nfixups;
+} EBPFProgram;
+
+/* Stack layout, relative to the frame pointer */
+#define STK_INPUT   (-EBPF_RSS_INPUT_BYTES)   /* Toeplitz input words */
+#define STK_IHL     (STK_INPUT - 4)           /* IPv4 header length */
+#define STK_PROTO   (STK_INPUT - 8)           /* L4 protocol */
+#define STK_FRAG    (STK_INPUT - 12)          /* IPv4 MF flag and offset */
+#define STK_KEY     (STK_INPUT - 16)          /* map key */
+
+static void emit(EBPFProgram *p, uint8_t code, uint8_t dst, uint8_t src,
+                 int16_t off, int32_t imm)
+{
+    assert(p->len < EBPF_RSS_MAX_INSNS);
+    p->insns[p->len++] = (struct bpf_insn) {
+        .code = code,
+        .dst_reg = dst,
+        .src_reg = src,
+        .off = off,
+        .imm = imm,
+    };
+}
+
+static void emit_jmp(EBPFProgram *p, uint8_t op, uint8_t dst, int32_t imm,
+                     int label)
+{
+    p->fixups[p->nfixups].insn = p->len;
+    p->fixups[p->nfixups].label = label;
+    p->nfixups++;
+    emit(p, BPF_JMP | op | BPF_K, dst, 0, 0, imm);
+}
+
+static void emit_label(EBPFProgram *p, int label)
+{
+    p->labels[label] = p->len;
+}
+
+static void mov_imm(EBPFProgram *p, uint8_t dst, int32_t imm)
+{
+    emit(p, BPF_ALU64 | BPF_MOV | BPF_K, dst, 0, 0, imm);
+}
+
+static void mov_reg(EBPFProgram *p, uint8_t dst, uint8_t src)
+{
+    emit(p, BPF_ALU64 | BPF_MOV | BPF_X, dst, src, 0, 0);
+}
+
+static void alu_imm(EBPFProgram *p, uint8_t op, uint8_t dst, int32_t imm)
+{
+    emit(p, BPF_ALU64 | op | BPF_K, dst, 0, 0, imm);
+}
+
+static void alu_reg(EBPFProgram *p, uint8_t op, uint8_t dst, uint8_t src)
+{
+    emit(p, BPF_ALU64 | op | BPF_X, dst, src, 0, 0);
+}
+
+/* Packet loads return the value in host byte order in r0 */
+static void ld_abs(EBPFProgram *p, uint8_t size, int32_t off)
+{
+    emit(p, BPF_LD | size | BPF_ABS, 0, 0, 0, off);
+}
+
+static void ld_ind(EBPFProgram *p, uint8_t size, uint8_t src, int32_t off)
+{
+    emit(p, BPF_LD | size | BPF_IND, 0, src, 0, off);
+}
+
+static void ldx(EBPFProgram *p, uint8_t size, uint8_t dst, uint8_t src,
+                int16_t off)
+{
+    emit(p, BPF_LDX | size | BPF_MEM, dst, src, off, 0);
+}
+
+static void stx(EBPFProgram *p, uint8_t size, uint8_t dst, int16_t off,
+                uint8_t src)
+{
+    emit(p, BPF_STX | size | BPF_MEM, dst, src, off, 0);
+}
+
+static void st_imm(EBPFProgram *p, uint8_t size, uint8_t dst, int16_t off,
+                   int32_t imm)
+{
+    emit(p, BPF_ST | size | BPF_MEM, dst, 0, off, imm);
+}
+
+static void ld_map_fd(EBPFProgram *p, uint8_t dst, int fd)
+{
+    emit(p, BPF_LD | BPF_DW | BPF_IMM, dst, BPF_PSEUDO_MAP_FD, 0, fd);
+    emit(p, 0, 0, 0, 0, 0);
+}
+
+static void exit_insn(EBPFProgram *p)
+{
+    emit(p, BPF_JMP | BPF_EXIT, 0, 0, 0, 0);
+}
+
+/*
+ * Registers: r6 = skb, r7 = map value, r8 = hash, r9 = L3 offset and
+ * then the number of Toeplitz input words.  Packet loads clobber r0-r5.
+ */
+static void ebpf_rss_build(EBPFProgram *p, int map_fd)
+{
+    int k, j, i;
+
+    mov_reg(p, BPF_REG_6, BPF_REG_1);
+
+    /* r7 = map[0], or steer to queue 0 if the lookup fails */
+    st_imm(p, BPF_W, BPF_REG_10, STK_KEY, 0);
+    ld_map_fd(p, BPF_REG_1, map_fd);
+    mov_reg(p, BPF_REG_2, BPF_REG_10);
+    alu_imm(p, BPF_ADD, BPF_REG_2, STK_KEY);
+    emit(p, BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_map_lookup_elem);
+    emit(p, BPF_JMP | BPF_JNE | BPF_K, BPF_REG_0, 0, 2, 0);
+    mov_imm(p, BPF_REG_0, 0);
+    exit_insn(p);
+    mov_reg(p, BPF_REG_7, BPF_REG_0);
+
+    for (k = 0; k < EBPF_RSS_INPUT_WORDS; k++) {
+        st_imm(p, BPF_W, BPF_REG_10, STK_INPUT + 4 * k, 0);
+    }
+
+    /* Skip a single VLAN tag */
+    mov_imm(p, BPF_REG_9, 14);
+    ld_abs(p, BPF_H, 12);
+    emit_jmp(p, BPF_JNE, BPF_REG_0, 0x8100, L_NO_VLAN);
+    mov_imm(p, BPF_REG_9, 18);
+    ld_abs(p, BPF_H, 16);
+    emit_label(p, L_NO_VLAN);
+    emit_jmp(p, BPF_JEQ, BPF_REG_0, 0x0800, L_IPV4);
+    emit_jmp(p, BPF_JEQ, BPF_REG_0, 0x86dd, L_IPV6);
+    emit_jmp(p, BPF_JA, 0, 0, L_DEFAULT);
+
+    /* IPv4 */
+    emit_label(p, L_IPV4);
+    ld_ind(p, BPF_B, BPF_REG_9, 0);
+    alu_imm(p, BPF_AND, BPF_REG_0, 0xf);
+    alu_imm(p, BPF_LSH, BPF_REG_0, 2);
+    stx(p, BPF_W, BPF_REG_10, STK_IHL, BPF_REG_0);
+    ld_ind(p, BPF_H, BPF_REG_9, 6);
+    alu_imm(p, BPF_AND, BPF_REG_0, 0x3fff);
+    stx(p, BPF_W, BPF_REG_10, STK_FRAG, BPF_REG_0);
+    ld_ind(p, BPF_B, BPF_REG_9, 9);
+    stx(p, BPF_W, BPF_REG_10, STK_PROTO, BPF_REG_0);
+    ld_ind(p, BPF_W, BPF_REG_9, 12);
+    stx(p, BPF_W, BPF_REG_10, STK_INPUT, BPF_REG_0);
+    ld_ind(p, BPF_W, BPF_REG_9, 16);
+    stx(p, BPF_W, BPF_REG_10, STK_INPUT + 4, BPF_REG_0);
+
+    ldx(p, BPF_W, BPF_REG_1, BPF_REG_7, offsetof(EBPFRSSMap, hash_types));
+    ldx(p, BPF_W, BPF_REG_2, BPF_REG_10, STK_FRAG);
+    emit_jmp(p, BPF_JNE, BPF_REG_2, 0, L_V4_L3);
+    ldx(p, BPF_W, BPF_REG_2, BPF_REG_10, STK_PROTO);
+    emit_jmp(p, BPF_JNE, BPF_REG_2, IPPROTO_TCP, L_V4_UDP);
+    emit_jmp(p, BPF_JSET, BPF_REG_1, VIRTIO_NET_RSS_HASH_TYPE_TCPv4, L_V4_L4);
+    emit_jmp(p, BPF_JA, 0, 0, L_V4_L3);
+    emit_label(p, L_V4_UDP);
+    emit_jmp(p, BPF_JNE, BPF_REG_2, IPPROTO_UDP, L_V4_L3);
+    emit_jmp(p, BPF_JSET, BPF_REG_1, VIRTIO_NET_RSS_HASH_TYPE_UDPv4, L_V4_L4);
+    emit_label(p, L_V4_L3);
+    emit_jmp(p, BPF_JSET, BPF_REG_1, VIRTIO_NET_RSS_HASH_TYPE_IPv4,
+             L_V4_L3_OK);
+    emit_jmp(p, BPF_JA, 0, 0, L_DEFAULT);
+    emit_label(p, L_V4_L3_OK);
+    mov_imm(p, BPF_REG_9, 2);
+    emit_jmp(p, BPF_JA, 0, 0, L_HASH);
+    emit_label(p, L_V4_L4);
+    ldx(p, BPF_W, BPF_REG_0, BPF_REG_10, STK_IHL);
+    alu_reg(p, BPF_ADD, BPF_REG_9, BPF_REG_0);
+    ld_ind(p, BPF_W, BPF_REG_9, 0);
+    stx(p, BPF_W, BPF_REG_10, STK_INPUT + 8, BPF_REG_0);
+    mov_imm(p, BPF_REG_9, 3);
+    emit_jmp(p, BPF_JA, 0, 0, L_HASH);
+
+    /* IPv6, without parsing extension headers */
+    emit_label(p, L_IPV6);
+    ld_ind(p, BPF_B, BPF_REG_9, 6);
+    stx(p, BPF_W, BPF_REG_10, STK_PROTO, BPF_REG_0);
+    for (k = 0; k < 8; k++) {
+        ld_ind(p, BPF_W, BPF_REG_9, 8 + 4 * k);
+        stx(p, BPF_W, BPF_REG_10, STK_INPUT + 4 * k, BPF_REG_0);
+    }
+
+    ldx(p, BPF_W, BPF_REG_1, BPF_REG_7, offsetof(EBPFRSSMap, hash_types));
+    ldx(p, BPF_W, BPF_REG_2, BPF_REG_10, STK_PROTO);
+    emit_jmp(p, BPF_JNE, BPF_REG_2, IPPROTO_TCP, L_V6_UDP);
+    emit_jmp(p, BPF_JSET, BPF_REG_1,
+             VIRTIO_NET_RSS_HASH_TYPE_TCPv6 | VIRTIO_NET_RSS_HASH_TYPE_TCP_EX,
+             L_V6_L4);
+    emit_jmp(p, BPF_JA, 0, 0, L_V6_L3);
+    emit_label(p, L_V6_UDP);
+    emit_jmp(p, BPF_JNE, BPF_REG_2, IPPROTO_UDP, L_V6_L3);
+    emit_jmp(p, BPF_JSET, BPF_REG_1,
+             VIRTIO_NET_RSS_HASH_TYPE_UDPv6 | VIRTIO_NET_RSS_HASH_TYPE_UDP_EX,
+             L_V6_L4);
+    emit_label(p, L_V6_L3);
+    emit_jmp(p, BPF_JSET, BPF_REG_1,
+             VIRTIO_NET_RSS_HASH_TYPE_IPv6 | VIRTIO_NET_RSS_HASH_TYPE_IP_EX,
+             L_V6_L3_OK);
+    emit_jmp(p, BPF_JA, 0, 0, L_DEFAULT);
+    emit_label(p, L_V6_L3_OK);
+    mov_imm(p, BPF_REG_9, 8);
+    emit_jmp(p, BPF_JA, 0, 0, L_HASH);
+    emit_label(p, L_V6_L4);
+    ld_ind(p, BPF_W, BPF_REG_9, 40);
+    stx(p, BPF_W, BPF_REG_10, STK_INPUT + 32, BPF_REG_0);
+    mov_imm(p, BPF_REG_9, 9);
+
+    /* Toeplitz hash of the first r9 input words, one table per byte */
+    emit_label(p, L_HASH);
+    mov_imm(p, BPF_REG_8, 0);
+    for (k = 0; k < EBPF_RSS_INPUT_WORDS; k++) {
+        emit_jmp(p, BPF_JEQ, BPF_REG_9, k, L_DONE);
+        ldx(p, BPF_W, BPF_REG_0, BPF_REG_10, STK_INPUT + 4 * k);
+        for (j = 0; j < 4; j++) {
+            i = 4 * k + j;
+            mov_reg(p, BPF_REG_1, BPF_REG_0);
+            alu_imm(p, BPF_RSH, BPF_REG_1, 24 - 8 * j);
+            alu_imm(p, BPF_AND, BPF_REG_1, 0xff);
+            alu_imm(p, BPF_LSH, BPF_REG_1, 2);
+            /* The table offset does not fit the 16-bit ldx offset */
+            mov_reg(p, BPF_REG_2, BPF_REG_7);
+            alu_imm(p, BPF_ADD, BPF_REG_2,
+                    offsetof(EBPFRSSMap, toeplitz) + i * 256 * 4);
+            alu_reg(p, BPF_ADD, BPF_REG_2, BPF_REG_1);
+            ldx(p, BPF_W, BPF_REG_1, BPF_REG_2, 0);
+            alu_reg(p, BPF_XOR, BPF_REG_8, BPF_REG_1);
+        }
+    }
+    emit_label(p, L_DONE);
+
+    /* r0 = indirections_table[hash & mask] */
+    ldx(p, BPF_H, BPF_REG_1, BPF_REG_7,
+        offsetof(EBPFRSSMap, indirections_mask));
+    alu_reg(p, BPF_AND, BPF_REG_8, BPF_REG_1);
+    alu_imm(p, BPF_AND, BPF_REG_8, EBPF_RSS_INDIRECTION_TABLE_SIZE - 1);
+    alu_imm(p, BPF_LSH, BPF_REG_8, 1);
+    alu_reg(p, BPF_ADD, BPF_REG_7, BPF_REG_8);
+    ldx(p, BPF_H, BPF_REG_0, BPF_REG_7,
+        offsetof(EBPFRSSMap, indirections_table));
+    exit_insn(p);
+
+    emit_label(p, L_DEFAULT);
+    ldx(p, BPF_H, BPF_REG_0, BPF_REG_7, offsetof(EBPFRSSMap, default_queue));
+    exit_insn(p);
+
+    for (i = 0; i < p->nfixups; i++) {
+        int insn = p->fixups[i].insn;
+
+        p->insns[insn].off = p->labels[p->fixups[i].label] - insn - 1;
+    }
+}
+
+static int ebpf_rss_sys(int cmd, union bpf_attr *attr)
+{
+#ifdef __NR_bpf
+    return syscall(__NR_bpf, cmd, attr, sizeof(*attr));
+#else
+    errno = ENOSYS;
+    return -1;
+#endif
+}
+
+void ebpf_rss_init(EBPFRSSContext *ctx)
+{
+    ctx->program_fd = -1;
+    ctx->map_configuration = -1;
+}
+
+bool ebpf_rss_is_loaded(EBPFRSSContext *ctx)
+{
+    return ctx->program_fd >= 0;
+}
+
+bool ebpf_rss_load(EBPFRSSContext *ctx)
+{
+    g_autofree EBPFProgram *prog = NULL;
+    union bpf_attr attr;
+    int map_fd, prog_fd;
+
+    if (ebpf_rss_is_loaded(ctx)) {
+        return false;
+    }
+
+    memset(&attr, 0, sizeof(attr));
+    attr.map_type = BPF_MAP_TYPE_ARRAY;
+    attr.key_size = sizeof(uint32_t);
+    attr.value_size = sizeof(EBPFRSSMap);
+    attr.max_entries = 1;
+    map_fd = ebpf_rss_sys(BPF_MAP_CREATE, &attr);
+    if (map_fd < 0) {
+        trace_ebpf_error("eBPF RSS", "can not create map");
+        return false;
+    }
+
+    prog = g_new0(EBPFProgram, 1);
+    ebpf_rss_build(prog, map_fd);
+
+    memset(&attr, 0, sizeof(attr));
+    attr.prog_type = BPF_PROG_TYPE_SOCKET_FILTER;
+    attr.insns = (uintptr_t)prog->insns;
+    attr.insn_cnt = prog->len;
+    attr.license = (uintptr_t)"GPL";
+    prog_fd = ebpf_rss_sys(BPF_PROG_LOAD, &attr);
+    if (prog_fd < 0) {
+        trace_ebpf_error("eBPF RSS", "can not load program");
+        close(map_fd);
+        return false;
+    }
+
+    ctx->program_fd = prog_fd;
+    ctx->map_configuration = map_fd;
+    return true;
+}
+
+/* The 32 key bits starting at bit @bit, which must be below 288 */
+static uint32_t ebpf_rss_toeplitz_window(const uint8_t *key, int bit)
+{
+    uint64_t v = 0;
+    int i;
+
+    for (i = 0; i < 5; i++) {
+        v = (v << 8) | key[bit / 8 + i];
+    }
+    return v >> (8 - bit % 8);
+}
+
+bool ebpf_rss_set_all(EBPFRSSContext *ctx, struct EBPFRSSConfig *config,
+                      uint16_t *indirections_table, uint8_t *toeplitz_key)
+{
+    g_autofree EBPFRSSMap *map = NULL;
+    union bpf_attr attr;
+    uint32_t key = 0;
+    int pos, b, bit;
+
+    if (!ebpf_rss_is_loaded(ctx) || !config->indirections_len ||
+        config->indirections_len > EBPF_RSS_INDIRECTION_TABLE_SIZE ||
+        (config->indirections_len & (config->indirections_len - 1))) {
+        return false;
+    }
+
+    map = g_new0(EBPFRSSMap, 1);
+    map->hash_types = config->hash_types;
+    map->indirections_mask = config->indirections_len - 1;
+    map->default_queue = config->default_queue;
+    memcpy(map->indirections_table, indirections_table,
+           config->indirections_len * sizeof(uint16_t));
+
+    for (pos = 0; pos < EBPF_RSS_INPUT_BYTES; pos++) {
+        uint32_t windows[8];
+
+        for (bit = 0; bit < 8; bit++) {
+            windows[bit] = ebpf_rss_toeplitz_window(toeplitz_key,
+                                                    pos * 8 + bit);
+        }
+        for (b = 0; b < 256; b++) {
+            uint32_t h = 0;
+
+            for (bit = 0; bit < 8; bit++) {
+                if (b & (0x80 >> bit)) {
+                    h ^= windows[bit];
+                }
+            }
+            map->toeplitz[pos][b] = h;
+        }
+    }
+
+    memset(&attr, 0, sizeof(attr));
+    attr.map_fd = ctx->map_configuration;
+    attr.key = (uintptr_t)&key;
+    attr.value = (uintptr_t)map;
+    attr.flags = BPF_ANY;
+    if (ebpf_rss_sys(BPF_MAP_UPDATE_ELEM, &attr) < 0) {
+        trace_ebpf_error("eBPF RSS", "can not update map");
+        return false;
+    }
+    return true;
+}
+
+void ebpf_rss_unload(EBPFRSSContext *ctx)
+{
+    if (!ebpf_rss_is_loaded(ctx)) {
+        return;
+    }
+
+    close(ctx->program_fd);
+    close(ctx->map_configuration);
+    ebpf_rss_init(ctx);
+}
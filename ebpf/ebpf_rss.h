@@ -0,0 +1,37 @@
+/*
+ * eBPF RSS steering for tap devices
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#ifndef QEMU_EBPF_RSS_H
+#define QEMU_EBPF_RSS_H
+
+#define EBPF_RSS_KEY_SIZE          40
+#define EBPF_RSS_INDIRECTION_TABLE_SIZE 128
+
+typedef struct EBPFRSSContext {
+    int program_fd;
+    int map_configuration;
+} EBPFRSSContext;
+
+/* The hash_types bits are the VIRTIO_NET_RSS_HASH_TYPE_* ones */
+struct EBPFRSSConfig {
+    uint32_t hash_types;
+    uint16_t indirections_len;
+    uint16_t default_queue;
+};
+
+void ebpf_rss_init(EBPFRSSContext *ctx);
+
+bool ebpf_rss_is_loaded(EBPFRSSContext *ctx);
+
+bool ebpf_rss_load(EBPFRSSContext *ctx);
+
+bool ebpf_rss_set_all(EBPFRSSContext *ctx, struct EBPFRSSConfig *config,
+                      uint16_t *indirections_table, uint8_t *toeplitz_key);
+
+void ebpf_rss_unload(EBPFRSSContext *ctx);
+
+#endif /* QEMU_EBPF_RSS_H */
@@ -1885,6 +1885,162 @@ float64_div(float64 a, float64 b, float_status *s)
                         f64_div_pre, f64_div_post);
 }
 
+/*
+ * Packed operations on @n elements, for the vector helpers of targets.
+ *
+ * The elements are processed in chunks.  Within a chunk, if the host FPU
+ * can be used for every element (the same conditions as float32_gen2),
+ * the operation is done in straight loops over host floats that the
+ * compiler can vectorize.  A chunk with any input that is not zero or
+ * normal goes through the scalar operation instead, as does each result
+ * that needs softfloat to get the underflow flags right.
+ */
+#define FLOAT_VEC_CHUNK 16
+
+static inline void
+float32_gen2_vec(float32 *d, const float32 *a, const float32 *b, size_t n,
+                 float_status *s, hard_f32_op2_fn hard, soft_f32_op2_fn soft,
+                 soft_f32_op2_fn scalar, f32_check_fn pre, f32_check_fn post)
+{
+    union_float32 ua[FLOAT_VEC_CHUNK], ub[FLOAT_VEC_CHUNK];
+    union_float32 ur[FLOAT_VEC_CHUNK];
+    size_t i, j, m;
+
+    for (j = 0; j < n; j += m) {
+        bool hw = can_use_fpu(s);
+
+        m = MIN(n - j, FLOAT_VEC_CHUNK);
+        for (i = 0; i < m; i++) {
+            ua[i].s = a[j + i];
+            ub[i].s = b[j + i];
+            hw &= pre(ua[i], ub[i]);
+        }
+        if (unlikely(!hw)) {
+            for (i = 0; i < m; i++) {
+                d[j + i] = scalar(ua[i].s, ub[i].s, s);
+            }
+            continue;
+        }
+
+        for (i = 0; i < m; i++) {
+            ur[i].h = hard(ua[i].h, ub[i].h);
+        }
+        for (i = 0; i < m; i++) {
+            if (unlikely(f32_is_inf(ur[i]))) {
+                s->float_exception_flags |= float_flag_overflow;
+            } else if (unlikely(fabsf(ur[i].h) <= FLT_MIN) &&
+                       post(ua[i], ub[i])) {
+                ur[i].s = soft(ua[i].s, ub[i].s, s);
+            }
+            d[j + i] = ur[i].s;
+        }
+    }
+}
+
+static inline void
+float64_gen2_vec(float64 *d, const float64 *a, const float64 *b, size_t n,
+                 float_status *s, hard_f64_op2_fn hard, soft_f64_op2_fn soft,
+                 soft_f64_op2_fn scalar, f64_check_fn pre, f64_check_fn post)
+{
+    union_float64 ua[FLOAT_VEC_CHUNK], ub[FLOAT_VEC_CHUNK];
+    union_float64 ur[FLOAT_VEC_CHUNK];
+    size_t i, j, m;
+
+    for (j = 0; j < n; j += m) {
+        bool hw = can_use_fpu(s);
+
+        m = MIN(n - j, FLOAT_VEC_CHUNK);
+        for (i = 0; i < m; i++) {
+            ua[i].s = a[j + i];
+            ub[i].s = b[j + i];
+            hw &= pre(ua[i], ub[i]);
+        }
+        if (unlikely(!hw)) {
+            for (i = 0; i < m; i++) {
+                d[j + i] = scalar(ua[i].s, ub[i].s, s);
+            }
+            continue;
+        }
+
+        for (i = 0; i < m; i++) {
+            ur[i].h = hard(ua[i].h, ub[i].h);
+        }
+        for (i = 0; i < m; i++) {
+            if (unlikely(f64_is_inf(ur[i]))) {
+                s->float_exception_flags |= float_flag_overflow;
+            } else if (unlikely(fabs(ur[i].h) <= DBL_MIN) &&
+                       post(ua[i], ub[i])) {
+                ur[i].s = soft(ua[i].s, ub[i].s, s);
+            }
+            d[j + i] = ur[i].s;
+        }
+    }
+}
+
+void QEMU_FLATTEN
+float32_add_vec(float32 *d, const float32 *a, const float32 *b,
+                size_t n, float_status *s)
+{
+    float32_gen2_vec(d, a, b, n, s, hard_f32_add, soft_f32_add,
+                     float32_add, f32_is_zon2, f32_addsubmul_post);
+}
+
+void QEMU_FLATTEN
+float32_sub_vec(float32 *d, const float32 *a, const float32 *b,
+                size_t n, float_status *s)
+{
+    float32_gen2_vec(d, a, b, n, s, hard_f32_sub, soft_f32_sub,
+                     float32_sub, f32_is_zon2, f32_addsubmul_post);
+}
+
+void QEMU_FLATTEN
+float32_mul_vec(float32 *d, const float32 *a, const float32 *b,
+                size_t n, float_status *s)
+{
+    float32_gen2_vec(d, a, b, n, s, hard_f32_mul, soft_f32_mul,
+                     float32_mul, f32_is_zon2, f32_addsubmul_post);
+}
+
+void QEMU_FLATTEN
+float32_div_vec(float32 *d, const float32 *a, const float32 *b,
+                size_t n, float_status *s)
+{
+    float32_gen2_vec(d, a, b, n, s, hard_f32_div, soft_f32_div,
+                     float32_div, f32_div_pre, f32_div_post);
+}
+
+void QEMU_FLATTEN
+float64_add_vec(float64 *d, const float64 *a, const float64 *b,
+                size_t n, float_status *s)
+{
+    float64_gen2_vec(d, a, b, n, s, hard_f64_add, soft_f64_add,
+                     float64_add, f64_is_zon2, f64_addsubmul_post);
+}
+
+void QEMU_FLATTEN
+float64_sub_vec(float64 *d, const float64 *a, const float64 *b,
+                size_t n, float_status *s)
+{
+    float64_gen2_vec(d, a, b, n, s, hard_f64_sub, soft_f64_sub,
+                     float64_sub, f64_is_zon2, f64_addsubmul_post);
+}
+
+void QEMU_FLATTEN
+float64_mul_vec(float64 *d, const float64 *a, const float64 *b,
+                size_t n, float_status *s)
+{
+    float64_gen2_vec(d, a, b, n, s, hard_f64_mul, soft_f64_mul,
+                     float64_mul, f64_is_zon2, f64_addsubmul_post);
+}
+
+void QEMU_FLATTEN
+float64_div_vec(float64 *d, const float64 *a, const float64 *b,
+                size_t n, float_status *s)
+{
+    float64_gen2_vec(d, a, b, n, s, hard_f64_div, soft_f64_div,
+                     float64_div, f64_div_pre, f64_div_post);
+}
+
 /*
  * Returns the result of dividing the bfloat16
  * value `a' by the corresponding value `b'.
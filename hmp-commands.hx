@@ -609,17 +609,21 @@ SRST
 ERST
     {
         .name       = "sync-profile",
-        .args_type  = "op:s?",
-        .params     = "[on|off|reset]",
+        .args_type  = "op:s?,period:i?",
+        .params     = "[on [period]|off|reset]",
         .help       = "enable, disable or reset synchronization profiling. "
+                      "With 'on', profile one in every 'period' operations. "
                       "With no arguments, prints whether profiling is on or off.",
         .cmd        = hmp_sync_profile,
     },
 
 SRST
-``sync-profile [on|off|reset]``
+``sync-profile [on [``\ *period*\ ``]|off|reset]``
   Enable, disable or reset synchronization profiling. With no arguments, prints
-  whether profiling is on or off.
+  whether profiling is on or off.  If *period* is given, only one in every
+  *period* operations of each thread is profiled, which makes it cheap enough
+  to leave on.  The data is also available with the ``query-sync-profile`` QMP
+  command.
 ERST
 
     {
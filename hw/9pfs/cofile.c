@@ -249,7 +249,7 @@ int coroutine_fn v9fs_co_pwritev(V9fsPDU *pdu, V9fsFidState *fidp,
         return -EINTR;
     }
     fsdev_co_throttle_request(s->ctx.fst, true, iov, iovcnt);
-    v9fs_co_run_in_worker(
+    v9fs_co_run_bulk_in_worker(
         {
             err = s->ops->pwritev(&s->ctx, &fidp->fs, iov, iovcnt, offset);
             if (err < 0) {
@@ -269,7 +269,7 @@ int coroutine_fn v9fs_co_preadv(V9fsPDU *pdu, V9fsFidState *fidp,
         return -EINTR;
     }
     fsdev_co_throttle_request(s->ctx.fst, false, iov, iovcnt);
-    v9fs_co_run_in_worker(
+    v9fs_co_run_bulk_in_worker(
         {
             err = s->ops->preadv(&s->ctx, &fidp->fs, iov, iovcnt, offset);
             if (err < 0) {
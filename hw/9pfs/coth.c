@@ -34,6 +34,15 @@ static int coroutine_enter_func(void *arg)
 }
 
 void co_run_in_worker_bh(void *opaque)
+{
+    Coroutine *co = opaque;
+    thread_pool_submit_aio_prio(aio_get_thread_pool(qemu_get_aio_context()),
+                                THREAD_POOL_PRIO_LATENCY,
+                                coroutine_enter_func, co, coroutine_enter_cb,
+                                co);
+}
+
+void co_run_bulk_in_worker_bh(void *opaque)
 {
     Coroutine *co = opaque;
     thread_pool_submit_aio(aio_get_thread_pool(qemu_get_aio_context()),
@@ -38,12 +38,19 @@
  * fs driver request on a background I/O thread (bottom half) in one rush
  * first and then eventually assembling the final response from that data
  * on main I/O thread (top half).
+ *
+ * Most requests only touch metadata and are queued ahead of reads and
+ * writes, which use v9fs_co_run_bulk_in_worker() instead.
  */
 #define v9fs_co_run_in_worker(code_block)                               \
+    v9fs_co_run_in_worker_bh(co_run_in_worker_bh, code_block)
+#define v9fs_co_run_bulk_in_worker(code_block)                          \
+    v9fs_co_run_in_worker_bh(co_run_bulk_in_worker_bh, code_block)
+
+#define v9fs_co_run_in_worker_bh(bh_fn, code_block)                     \
     do {                                                                \
         QEMUBH *co_bh;                                                  \
-        co_bh = qemu_bh_new(co_run_in_worker_bh,                        \
-                            qemu_coroutine_self());                     \
+        co_bh = qemu_bh_new(bh_fn, qemu_coroutine_self());              \
         qemu_bh_schedule(co_bh);                                        \
         /*                                                              \
          * yield in qemu thread and re-enter back                       \
@@ -57,8 +64,8 @@
     } while (0)
 
 void co_run_in_worker_bh(void *);
+void co_run_bulk_in_worker_bh(void *);
 int coroutine_fn v9fs_co_readlink(V9fsPDU *, V9fsPath *, V9fsString *);
-int coroutine_fn v9fs_co_readdir(V9fsPDU *, V9fsFidState *, struct dirent **);
 int coroutine_fn v9fs_co_readdir_many(V9fsPDU *, V9fsFidState *,
                                       struct V9fsDirEnt **, off_t, int32_t,
                                       bool);
@@ -206,13 +206,25 @@ static void virtio_9p_device_realize(DeviceState *dev, Error **errp)
         fse->export_flags |= V9FS_NO_PERF_WARN;
     }
 
+    /*
+     * A request is a single descriptor chain, so the queue size also
+     * limits the msize a guest can use.
+     */
+    if (!is_power_of_2(v->queue_size) || v->queue_size < 4 ||
+        v->queue_size > VIRTQUEUE_MAX_SIZE) {
+        error_setg(errp, "invalid queue-size property (%" PRIu16 "), "
+                   "must be a power of 2 (4 to %d)",
+                   v->queue_size, VIRTQUEUE_MAX_SIZE);
+        return;
+    }
+
     if (v9fs_device_realize_common(s, &virtio_9p_transport, errp)) {
         return;
     }
 
     v->config_size = sizeof(struct virtio_9p_config) + strlen(s->fsconf.tag);
     virtio_init(vdev, "virtio-9p", VIRTIO_ID_9P, v->config_size);
-    v->vq = virtio_add_queue(vdev, MAX_REQ, handle_9p_output);
+    v->vq = virtio_add_queue(vdev, v->queue_size, handle_9p_output);
 }
 
 static void virtio_9p_device_unrealize(DeviceState *dev)
@@ -241,6 +253,7 @@ static const VMStateDescription vmstate_virtio_9p = {
 static Property virtio_9p_properties[] = {
     DEFINE_PROP_STRING("mount_tag", V9fsVirtioState, state.fsconf.tag),
     DEFINE_PROP_STRING("fsdev", V9fsVirtioState, state.fsconf.fsdev_id),
+    DEFINE_PROP_UINT16("queue-size", V9fsVirtioState, queue_size, MAX_REQ),
     DEFINE_PROP_END_OF_LIST(),
 };
 
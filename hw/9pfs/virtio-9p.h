@@ -9,6 +9,7 @@
 struct V9fsVirtioState {
     VirtIODevice parent_obj;
     VirtQueue *vq;
+    uint16_t queue_size;
     size_t config_size;
     VirtQueueElement *elems[MAX_REQ];
     V9fsState state;
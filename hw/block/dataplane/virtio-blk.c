@@ -43,6 +43,11 @@ struct VirtIOBlockDataPlane {
      */
     IOThread *iothread;
     AioContext *ctx;
+
+    /* With iothread-vq-mapping, the IOThread of each virtqueue */
+    IOThread **vq_iothread;
+    /* The AioContext that handles each virtqueue while started */
+    AioContext **vq_aio_context;
 };
 
 /* Raise an interrupt to signal guest, if necessary */
@@ -80,6 +85,56 @@ static void notify_guest_bh(void *opaque)
     }
 }
 
+static void virtio_blk_data_plane_unref_vq_iothreads(VirtIOBlockDataPlane *s)
+{
+    unsigned i;
+
+    if (!s->vq_iothread) {
+        return;
+    }
+    for (i = 0; i < s->conf->num_queues; i++) {
+        if (s->vq_iothread[i]) {
+            object_unref(OBJECT(s->vq_iothread[i]));
+        }
+    }
+    g_free(s->vq_iothread);
+    s->vq_iothread = NULL;
+}
+
+/*
+ * Parse iothread-vq-mapping, a colon-separated list of IOThread ids.
+ * Virtqueue i is handled by entry i modulo the length of the list, so
+ * "io0:io1" alternates between two iothreads while a list with one
+ * entry per virtqueue pins each of them explicitly.
+ */
+static bool virtio_blk_data_plane_map_vqs(VirtIOBlockDataPlane *s,
+                                          const char *mapping, Error **errp)
+{
+    g_auto(GStrv) ids = g_strsplit(mapping, ":", -1);
+    unsigned nids = g_strv_length(ids);
+    unsigned i;
+
+    if (!nids) {
+        error_setg(errp, "iothread-vq-mapping must not be empty");
+        return false;
+    }
+
+    s->vq_iothread = g_new0(IOThread *, s->conf->num_queues);
+    for (i = 0; i < s->conf->num_queues; i++) {
+        IOThread *iothread = iothread_by_id(ids[i % nids]);
+
+        if (!iothread) {
+            error_setg(errp, "iothread-vq-mapping: no iothread '%s'",
+                       ids[i % nids]);
+            virtio_blk_data_plane_unref_vq_iothreads(s);
+            return false;
+        }
+        object_ref(OBJECT(iothread));
+        s->vq_iothread[i] = iothread;
+    }
+    return true;
+}
+
 /* Context: QEMU global mutex held */
 bool virtio_blk_data_plane_create(VirtIODevice *vdev, VirtIOBlkConf *conf,
                                   VirtIOBlockDataPlane **dataplane,
@@ -91,7 +146,13 @@ bool virtio_blk_data_plane_create(VirtIODevice *vdev, VirtIOBlkConf *conf,
 
     *dataplane = NULL;
 
-    if (conf->iothread) {
+    if (conf->iothread && conf->iothread_vq_mapping) {
+        error_setg(errp, "iothread and iothread-vq-mapping cannot be used "
+                   "together");
+        return false;
+    }
+
+    if (conf->iothread || conf->iothread_vq_mapping) {
         if (!k->set_guest_notifiers || !k->ioeventfd_assign) {
             error_setg(errp,
                        "device is incompatible with iothread "
@@ -120,7 +181,14 @@ bool virtio_blk_data_plane_create(VirtIODevice *vdev, VirtIOBlkConf *conf,
     s->vdev = vdev;
     s->conf = conf;
 
-    if (conf->iothread) {
+    if (conf->iothread_vq_mapping) {
+        if (!virtio_blk_data_plane_map_vqs(s, conf->iothread_vq_mapping,
+                                           errp)) {
+            g_free(s);
+            return false;
+        }
+        s->ctx = iothread_get_aio_context(s->vq_iothread[0]);
+    } else if (conf->iothread) {
         s->iothread = conf->iothread;
         object_ref(OBJECT(s->iothread));
         s->ctx = iothread_get_aio_context(s->iothread);
@@ -129,12 +197,79 @@ bool virtio_blk_data_plane_create(VirtIODevice *vdev, VirtIOBlkConf *conf,
     }
     s->bh = aio_bh_new(s->ctx, notify_guest_bh, s);
     s->batch_notify_vqs = bitmap_new(conf->num_queues);
+    s->vq_aio_context = g_new(AioContext *, conf->num_queues);
 
     *dataplane = s;
 
     return true;
 }
 
+/*
+ * Switch to @iothread, to the iothreads in @vq_mapping, or to the main loop
+ * if both are NULL.  The new AioContexts are used on the next start.  Fails
+ * without changing anything if the BlockBackend cannot follow.
+ *
+ * Context: QEMU global mutex held, dataplane stopped
+ */
+bool virtio_blk_data_plane_set_iothread(VirtIOBlockDataPlane *s,
+                                        IOThread *iothread,
+                                        const char *vq_mapping,
+                                        Error **errp)
+{
+    IOThread **old_vq_iothread = s->vq_iothread;
+    IOThread **new_vq_iothread;
+    AioContext *new_ctx;
+
+    assert(!VIRTIO_BLK(s->vdev)->dataplane_started);
+
+    s->vq_iothread = NULL;
+    if (vq_mapping && !virtio_blk_data_plane_map_vqs(s, vq_mapping, errp)) {
+        s->vq_iothread = old_vq_iothread;
+        return false;
+    }
+    new_vq_iothread = s->vq_iothread;
+
+    if (new_vq_iothread) {
+        new_ctx = iothread_get_aio_context(new_vq_iothread[0]);
+    } else if (iothread) {
+        new_ctx = iothread_get_aio_context(iothread);
+    } else {
+        new_ctx = qemu_get_aio_context();
+    }
+    if (!blk_can_set_aio_context(s->conf->conf.blk, new_ctx, errp)) {
+        virtio_blk_data_plane_unref_vq_iothreads(s);
+        s->vq_iothread = old_vq_iothread;
+        return false;
+    }
+    s->vq_iothread = old_vq_iothread;
+    virtio_blk_data_plane_unref_vq_iothreads(s);
+    s->vq_iothread = new_vq_iothread;
+
+    if (iothread) {
+        object_ref(OBJECT(iothread));
+    }
+    if (s->iothread) {
+        object_unref(OBJECT(s->iothread));
+    }
+    s->iothread = iothread;
+
+    s->ctx = new_ctx;
+
+    /* The stop path has already flushed any pending notification */
+    qemu_bh_delete(s->bh);
+    s->bh = aio_bh_new(s->ctx, notify_guest_bh, s);
+
+    trace_virtio_blk_data_plane_set_iothread(s, s->ctx);
+    return true;
+}
+
+/* The AioContext that processes @vq, while the dataplane is started */
+AioContext *virtio_blk_data_plane_get_vq_aio_context(VirtIOBlockDataPlane *s,
+                                                     VirtQueue *vq)
+{
+    return s->vq_aio_context[virtio_get_queue_index(vq)];
+}
+
 /* Context: QEMU global mutex held */
 void virtio_blk_data_plane_destroy(VirtIOBlockDataPlane *s)
 {
@@ -151,6 +286,8 @@ void virtio_blk_data_plane_destroy(VirtIOBlockDataPlane *s)
     if (s->iothread) {
         object_unref(OBJECT(s->iothread));
     }
+    virtio_blk_data_plane_unref_vq_iothreads(s);
+    g_free(s->vq_aio_context);
     g_free(s);
 }
 
@@ -176,6 +313,7 @@ int virtio_blk_data_plane_start(VirtIODevice *vdev)
     unsigned i;
     unsigned nvqs = s->conf->num_queues;
     Error *local_err = NULL;
+    bool multiqueue = false;
     int r;
 
     if (vblk->dataplane_started || s->starting) {
@@ -184,7 +322,29 @@ int virtio_blk_data_plane_start(VirtIODevice *vdev)
 
     s->starting = true;
 
-    if (!virtio_vdev_has_feature(vdev, VIRTIO_RING_F_EVENT_IDX)) {
+    /*
+     * The nodes below the device may have changed since it was created,
+     * so check again that they accept requests from several iothreads.
+     */
+    if (s->vq_iothread) {
+        multiqueue = blk_set_multiqueue(s->conf->conf.blk, true, &local_err);
+        if (!multiqueue) {
+            warn_report_err(local_err);
+            local_err = NULL;
+            warn_report("virtio-blk: handling all virtqueues in one iothread");
+        }
+    }
+    for (i = 0; i < nvqs; i++) {
+        s->vq_aio_context[i] = multiqueue ?
+            iothread_get_aio_context(s->vq_iothread[i]) : s->ctx;
+    }
+
+    /*
+     * Batched notifications are flushed by a BH in s->ctx, which would
+     * race with completions in the other iothreads.
+     */
+    if (!multiqueue &&
+        !virtio_vdev_has_feature(vdev, VIRTIO_RING_F_EVENT_IDX)) {
         s->batch_notifications = true;
     } else {
         s->batch_notifications = false;
@@ -235,14 +395,15 @@ int virtio_blk_data_plane_start(VirtIODevice *vdev)
     }
 
     /* Get this show started by hooking up our callbacks */
-    aio_context_acquire(s->ctx);
     for (i = 0; i < nvqs; i++) {
         VirtQueue *vq = virtio_get_queue(s->vdev, i);
+        AioContext *ctx = s->vq_aio_context[i];
 
-        virtio_queue_aio_set_host_notifier_handler(vq, s->ctx,
+        aio_context_acquire(ctx);
+        virtio_queue_aio_set_host_notifier_handler(vq, ctx,
                 virtio_blk_data_plane_handle_output);
+        aio_context_release(ctx);
     }
-    aio_context_release(s->ctx);
     return 0;
 
   fail_guest_notifiers:
@@ -251,6 +412,7 @@ int virtio_blk_data_plane_start(VirtIODevice *vdev)
      * processed on the main context.
      */
     virtio_blk_process_queued_requests(vblk, false);
+    blk_set_multiqueue(s->conf->conf.blk, false, NULL);
     vblk->dataplane_disabled = true;
     s->starting = false;
     vblk->dataplane_started = true;
@@ -259,18 +421,14 @@ int virtio_blk_data_plane_start(VirtIODevice *vdev)
 
 /* Stop notifications for new requests from guest.
  *
- * Context: BH in IOThread
+ * Context: BH in the IOThread of the virtqueue
  */
 static void virtio_blk_data_plane_stop_bh(void *opaque)
 {
-    VirtIOBlockDataPlane *s = opaque;
-    unsigned i;
+    VirtQueue *vq = opaque;
 
-    for (i = 0; i < s->conf->num_queues; i++) {
-        VirtQueue *vq = virtio_get_queue(s->vdev, i);
-
-        virtio_queue_aio_set_host_notifier_handler(vq, s->ctx, NULL);
-    }
+    virtio_queue_aio_set_host_notifier_handler(vq,
+            qemu_get_current_aio_context(), NULL);
 }
 
 /* Context: QEMU global mutex held */
@@ -296,12 +454,29 @@ void virtio_blk_data_plane_stop(VirtIODevice *vdev)
     s->stopping = true;
     trace_virtio_blk_data_plane_stop(s);
 
+    for (i = 0; i < nvqs; i++) {
+        AioContext *ctx = s->vq_aio_context[i];
+
+        aio_context_acquire(ctx);
+        aio_wait_bh_oneshot(ctx, virtio_blk_data_plane_stop_bh,
+                            virtio_get_queue(s->vdev, i));
+        aio_context_release(ctx);
+    }
+
     aio_context_acquire(s->ctx);
-    aio_wait_bh_oneshot(s->ctx, virtio_blk_data_plane_stop_bh, s);
+
+    /* The merge window timer belongs to the iothread, don't keep it */
+    virtio_blk_flush_merge_window(vblk);
+    if (vblk->merge_timer) {
+        timer_free(vblk->merge_timer);
+        vblk->merge_timer = NULL;
+        vblk->merge_timer_ctx = NULL;
+    }
 
     /* Drain and try to switch bs back to the QEMU main loop. If other users
      * keep the BlockBackend in the iothread, that's ok */
     blk_set_aio_context(s->conf->conf.blk, qemu_get_aio_context(), NULL);
+    blk_set_multiqueue(s->conf->conf.blk, false, NULL);
 
     aio_context_release(s->ctx);
 
@@ -22,7 +22,9 @@
  *              [pmrdev=<mem_backend_file_id>,] \
  *              max_ioqpairs=<N[optional]>, \
  *              aerl=<N[optional]>, aer_max_queued=<N[optional]>, \
- *              mdts=<N[optional]>,zoned.append_size_limit=<N[optional]> \
+ *              mdts=<N[optional]>,zoned.append_size_limit=<N[optional]>, \
+ *              iothread=<iothread_id[optional]>, \
+ *              ioeventfd=<true|false[optional]> \
  *      -device nvme-ns,drive=<drive_id>,bus=<bus_name>,nsid=<nsid>,\
  *              zoned=<true|false[optional]>
  *
@@ -59,6 +61,19 @@
  *   data size being in effect. By setting this property to 0, users can make
  *   ZASL to be equal to MDTS. This property only affects zoned namespaces.
  *
+ * - `iothread`
+ *   Process the queues in the given iothread instead of the main loop.  The
+ *   admin queue and enabling or disabling the controller are handled there
+ *   too; interrupts raised from the iothread are delivered through the main
+ *   loop.
+ *
+ * - `ioeventfd`
+ *   Once the host has set up shadow doorbells with the Doorbell Buffer Config
+ *   command, back the doorbell registers of the I/O queues with ioeventfds.
+ *   The doorbell values are then only read from the shadow doorbell buffer
+ *   and a doorbell write does not trap into the device model. Default is
+ *   false.
+ *
  * Setting `zoned` to true selects Zoned Command Set at the namespace.
  * In this case, the following namespace properties are available to configure
  * zoned operation:
@@ -88,6 +103,7 @@
 #include "qemu/osdep.h"
 #include "qemu/units.h"
 #include "qemu/error-report.h"
+#include "qemu/main-loop.h"
 #include "hw/block/block.h"
 #include "hw/pci/msix.h"
 #include "hw/pci/pci.h"
@@ -98,10 +114,12 @@
 #include "qapi/visitor.h"
 #include "sysemu/hostmem.h"
 #include "sysemu/block-backend.h"
+#include "block/aio-wait.h"
 #include "exec/memory.h"
 #include "qemu/log.h"
 #include "qemu/module.h"
 #include "qemu/cutils.h"
+#include "qemu/lockable.h"
 #include "trace.h"
 #include "nvme.h"
 #include "nvme-ns.h"
@@ -142,6 +160,8 @@ static const uint32_t nvme_feature_cap[NVME_FID_MAX] = {
     [NVME_ERROR_RECOVERY]           = NVME_FEAT_CAP_CHANGE | NVME_FEAT_CAP_NS,
     [NVME_VOLATILE_WRITE_CACHE]     = NVME_FEAT_CAP_CHANGE,
     [NVME_NUMBER_OF_QUEUES]         = NVME_FEAT_CAP_CHANGE,
+    [NVME_INTERRUPT_COALESCING]     = NVME_FEAT_CAP_CHANGE,
+    [NVME_INTERRUPT_VECTOR_CONF]    = NVME_FEAT_CAP_CHANGE,
     [NVME_ASYNCHRONOUS_EVENT_CONF]  = NVME_FEAT_CAP_CHANGE,
     [NVME_TIMESTAMP]                = NVME_FEAT_CAP_CHANGE,
 };
@@ -157,6 +177,7 @@ static const uint32_t nvme_cse_acs[256] = {
     [NVME_ADM_CMD_SET_FEATURES]     = NVME_CMD_EFF_CSUPP,
     [NVME_ADM_CMD_GET_FEATURES]     = NVME_CMD_EFF_CSUPP,
     [NVME_ADM_CMD_ASYNC_EV_REQ]     = NVME_CMD_EFF_CSUPP,
+    [NVME_ADM_CMD_DBBUF_CONFIG]     = NVME_CMD_EFF_CSUPP,
 };
 
 static const uint32_t nvme_cse_iocs_none[256];
@@ -369,16 +390,17 @@ static void nvme_irq_check(NvmeCtrl *n)
     }
 }
 
-static void nvme_irq_assert(NvmeCtrl *n, NvmeCQueue *cq)
+static void nvme_irq_vector_assert(NvmeCtrl *n, uint16_t vector,
+                                   bool irq_enabled)
 {
-    if (cq->irq_enabled) {
+    if (irq_enabled) {
         if (msix_enabled(&(n->parent_obj))) {
-            trace_pci_nvme_irq_msix(cq->vector);
-            msix_notify(&(n->parent_obj), cq->vector);
+            trace_pci_nvme_irq_msix(vector);
+            msix_notify(&(n->parent_obj), vector);
         } else {
             trace_pci_nvme_irq_pin();
-            assert(cq->vector < 32);
-            n->irq_status |= 1 << cq->vector;
+            assert(vector < 32);
+            n->irq_status |= 1 << vector;
             nvme_irq_check(n);
         }
     } else {
@@ -386,17 +408,236 @@ static void nvme_irq_assert(NvmeCtrl *n, NvmeCQueue *cq)
     }
 }
 
+static void nvme_irq_vector_deassert(NvmeCtrl *n, uint16_t vector,
+                                     bool irq_enabled)
+{
+    if (irq_enabled && !msix_enabled(&(n->parent_obj))) {
+        assert(vector < 32);
+        n->irq_status &= ~(1 << vector);
+        nvme_irq_check(n);
+    }
+}
+
+#define NVME_IRQ_VECTOR     0xffff
+#define NVME_IRQ_ENABLED    (1u << 16)
+#define NVME_IRQ_LEVEL      (1u << 17)
+
+/*
+ * Interrupts can only be raised under the BQL.  With an iothread, queues
+ * never hold it, so have the main loop apply the new level.  Only the
+ * latest level matters if the queue changes it again in the meantime.
+ */
+static bool nvme_irq_bounce(NvmeCtrl *n, NvmeCQueue *cq, bool level)
+{
+    NvmeQueueNotifier *qn;
+
+    if (!n->iothread) {
+        return false;
+    }
+
+    qn = &n->irq_notifiers[cq->cqid];
+    qatomic_set(&qn->irq, cq->vector |
+                (cq->irq_enabled ? NVME_IRQ_ENABLED : 0) |
+                (level ? NVME_IRQ_LEVEL : 0));
+    event_notifier_set(&qn->notifier);
+    return true;
+}
+
+static void nvme_irq_assert(NvmeCtrl *n, NvmeCQueue *cq)
+{
+    if (nvme_irq_bounce(n, cq, true)) {
+        return;
+    }
+
+    nvme_irq_vector_assert(n, cq->vector, cq->irq_enabled);
+}
+
 static void nvme_irq_deassert(NvmeCtrl *n, NvmeCQueue *cq)
 {
-    if (cq->irq_enabled) {
-        if (msix_enabled(&(n->parent_obj))) {
+    if (!cq->irq_enabled || msix_enabled(&(n->parent_obj))) {
+        return;
+    }
+    if (nvme_irq_bounce(n, cq, false)) {
+        return;
+    }
+
+    nvme_irq_vector_deassert(n, cq->vector, cq->irq_enabled);
+}
+
+/*
+ * Map the ring of a queue once, the way virtio maps its vrings, instead of
+ * translating the address for every entry.  Rings in the CMB or PMR keep
+ * going through nvme_addr_read() and pci_dma_write().
+ *
+ * The mappings are redone by nvme_dma_listener_commit() whenever the bus
+ * master address space changes, which includes toggling Bus Master Enable.
+ * Behind a vIOMMU, translations can also change through IOMMU
+ * invalidations, which no listener sees, so rings are not cached there.
+ */
+static NvmeRing *nvme_ring_new(NvmeCtrl *n, hwaddr addr, hwaddr len,
+                               bool is_write)
+{
+    PCIDevice *pci_dev = &n->parent_obj;
+    NvmeRing *ring;
+    int64_t ret;
+
+    if (nvme_addr_is_cmb(n, addr) || nvme_addr_is_pmr(n, addr) ||
+        pci_device_iommu_address_space(pci_dev) != &address_space_memory) {
+        return NULL;
+    }
+
+    ring = g_new0(NvmeRing, 1);
+    ret = address_space_cache_init(&ring->cache,
+                                   pci_get_address_space(pci_dev),
+                                   addr, len, is_write);
+    if (ret < (int64_t)len) {
+        address_space_cache_destroy(&ring->cache);
+        g_free(ring);
+        return NULL;
+    }
+
+    return ring;
+}
+
+static void nvme_ring_free_rcu(NvmeRing *ring)
+{
+    address_space_cache_destroy(&ring->cache);
+    g_free(ring);
+}
+
+/* Readers may still use the old mapping until the grace period ends */
+static void nvme_ring_set(NvmeRing **pring, NvmeRing *ring)
+{
+    NvmeRing *old = *pring;
+
+    qatomic_rcu_set(pring, ring);
+    if (old) {
+        call_rcu(old, nvme_ring_free_rcu, rcu);
+    }
+}
+
+static void nvme_dma_remap(void *opaque)
+{
+    NvmeCtrl *n = opaque;
+    int i;
+
+    aio_context_acquire(n->ctx);
+    for (i = 0; i <= n->params.max_ioqpairs; i++) {
+        NvmeSQueue *sq = n->sq[i];
+        NvmeCQueue *cq = n->cq[i];
+
+        if (sq) {
+            nvme_ring_set(&sq->ring,
+                          nvme_ring_new(n, sq->dma_addr,
+                                        sq->size * n->sqe_size, false));
+        }
+        if (cq) {
+            nvme_ring_set(&cq->ring,
+                          nvme_ring_new(n, cq->dma_addr,
+                                        cq->size * n->cqe_size, true));
+        }
+    }
+    aio_context_release(n->ctx);
+}
+
+static void nvme_dma_listener_commit(MemoryListener *listener)
+{
+    NvmeCtrl *n = container_of(listener, NvmeCtrl, dma_listener);
+
+    /* The queues belong to the iothread, let it remap them */
+    if (n->iothread) {
+        qemu_bh_schedule(n->dma_bh);
+    } else {
+        nvme_dma_remap(n);
+    }
+}
+
+static int nvme_read_sqe(NvmeCtrl *n, NvmeSQueue *sq, NvmeCmd *cmd)
+{
+    hwaddr offset = sq->head * n->sqe_size;
+    NvmeRing *ring;
+
+    RCU_READ_LOCK_GUARD();
+
+    ring = qatomic_rcu_read(&sq->ring);
+    if (ring) {
+        return address_space_read_cached(&ring->cache, offset, cmd,
+                                         sizeof(*cmd)) != MEMTX_OK;
+    }
+
+    return nvme_addr_read(n, sq->dma_addr + offset, cmd, sizeof(*cmd));
+}
+
+static int nvme_write_cqe(NvmeCtrl *n, NvmeCQueue *cq, NvmeCqe *cqe)
+{
+    hwaddr offset = cq->tail * n->cqe_size;
+    NvmeRing *ring;
+
+    RCU_READ_LOCK_GUARD();
+
+    ring = qatomic_rcu_read(&cq->ring);
+    if (ring) {
+        if (address_space_write_cached(&ring->cache, offset, cqe,
+                                       sizeof(*cqe)) != MEMTX_OK) {
+            return -1;
+        }
+        address_space_cache_invalidate(&ring->cache, offset, sizeof(*cqe));
+        return 0;
+    }
+
+    return pci_dma_write(&n->parent_obj, cq->dma_addr + offset, cqe,
+                         sizeof(*cqe));
+}
+
+static bool nvme_cq_coalescing(NvmeCtrl *n, NvmeCQueue *cq)
+{
+    /* the admin completion queue is never coalesced */
+    if (!cq->cqid || !NVME_INTC_TIME(n->features.int_coalescing)) {
+        return false;
+    }
+
+    return cq->vector >= n->params.max_ioqpairs + 1 ||
+           !test_bit(cq->vector, n->features.int_vc_cd);
+}
+
+/*
+ * Signal the interrupt of @cq for @posted new entries.  With Interrupt
+ * Coalescing, the interrupt is held back until the aggregation threshold
+ * is reached or the aggregation time has passed, whichever comes first.
+ */
+static void nvme_cq_notify(NvmeCtrl *n, NvmeCQueue *cq, uint32_t posted)
+{
+    uint32_t intc = n->features.int_coalescing;
+
+    if (nvme_cq_coalescing(n, cq)) {
+        cq->irq_pending += posted;
+        if (cq->irq_pending <= NVME_INTC_THR(intc)) {
+            trace_pci_nvme_irq_coalesced(cq->cqid, cq->irq_pending);
+            if (!timer_pending(cq->irq_timer)) {
+                timer_mod(cq->irq_timer,
+                          qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) +
+                          NVME_INTC_TIME(intc) * 100 * SCALE_US);
+            }
             return;
-        } else {
-            assert(cq->vector < 32);
-            n->irq_status &= ~(1 << cq->vector);
-            nvme_irq_check(n);
         }
     }
+
+    cq->irq_pending = 0;
+    timer_del(cq->irq_timer);
+    nvme_irq_assert(n, cq);
+}
+
+static void nvme_cq_irq_timer_cb(void *opaque)
+{
+    NvmeCQueue *cq = opaque;
+    NvmeCtrl *n = cq->ctrl;
+
+    aio_context_acquire(n->ctx);
+    cq->irq_pending = 0;
+    if (cq->tail != cq->head) {
+        nvme_irq_assert(n, cq);
+    }
+    aio_context_release(n->ctx);
 }
 
 static void nvme_req_clear(NvmeRequest *req)
@@ -407,7 +648,27 @@ static void nvme_req_clear(NvmeRequest *req)
     req->status = NVME_SUCCESS;
 }
 
+/*
+ * Drop the mappings of a request, but keep the arrays allocated so that the
+ * next command using the same request slot does not have to allocate them
+ * again.  Whether a request is mapped is told by qsg->nsg and iov->niov.
+ */
+static void nvme_sg_reset(QEMUSGList *qsg, QEMUIOVector *iov)
+{
+    qsg->nsg = 0;
+    qsg->size = 0;
+
+    if (iov->iov) {
+        qemu_iovec_reset(iov);
+    }
+}
+
 static void nvme_req_exit(NvmeRequest *req)
+{
+    nvme_sg_reset(&req->qsg, &req->iov);
+}
+
+static void nvme_req_free(NvmeRequest *req)
 {
     if (req->qsg.sg) {
         qemu_sglist_destroy(&req->qsg);
@@ -470,7 +731,7 @@ static uint16_t nvme_map_addr(NvmeCtrl *n, QEMUSGList *qsg, QEMUIOVector *iov,
     }
 
     if (cmb || pmr) {
-        if (qsg && qsg->sg) {
+        if (qsg && qsg->nsg) {
             return NVME_INVALID_USE_OF_CMB | NVME_DNR;
         }
 
@@ -487,7 +748,7 @@ static uint16_t nvme_map_addr(NvmeCtrl *n, QEMUSGList *qsg, QEMUIOVector *iov,
         }
     }
 
-    if (iov && iov->iov) {
+    if (iov && iov->niov) {
         return NVME_INVALID_USE_OF_CMB | NVME_DNR;
     }
 
@@ -497,6 +758,20 @@ static uint16_t nvme_map_addr(NvmeCtrl *n, QEMUSGList *qsg, QEMUIOVector *iov,
         pci_dma_sglist_init(qsg, &n->parent_obj, 1);
     }
 
+    /*
+     * Guest buffers are often physically contiguous across pages; merging
+     * them saves a mapping and an iovec entry per page in dma_blk_io().
+     */
+    if (qsg->nsg) {
+        ScatterGatherEntry *last = &qsg->sg[qsg->nsg - 1];
+
+        if (last->base + last->len == addr) {
+            last->len += len;
+            qsg->size += len;
+            return NVME_SUCCESS;
+        }
+    }
+
     qemu_sglist_add(qsg, addr, len);
 
     return NVME_SUCCESS;
@@ -517,8 +792,10 @@ static uint16_t nvme_map_prp(NvmeCtrl *n, uint64_t prp1, uint64_t prp2,
     trace_pci_nvme_map_prp(trans_len, len, prp1, prp2, num_prps);
 
     if (nvme_addr_is_cmb(n, prp1) || (nvme_addr_is_pmr(n, prp1))) {
-        qemu_iovec_init(iov, num_prps);
-    } else {
+        if (!iov->iov) {
+            qemu_iovec_init(iov, num_prps);
+        }
+    } else if (!qsg->sg) {
         pci_dma_sglist_init(qsg, &n->parent_obj, num_prps);
     }
 
@@ -804,13 +1081,7 @@ out:
     return NVME_SUCCESS;
 
 unmap:
-    if (iov->iov) {
-        qemu_iovec_destroy(iov);
-    }
-
-    if (qsg->sg) {
-        qemu_sglist_destroy(qsg);
-    }
+    nvme_sg_reset(qsg, iov);
 
     return status;
 }
@@ -819,6 +1090,8 @@ static uint16_t nvme_map_dptr(NvmeCtrl *n, size_t len, NvmeRequest *req)
 {
     uint64_t prp1, prp2;
 
+    nvme_sg_reset(&req->qsg, &req->iov);
+
     switch (NVME_CMD_FLAGS_PSDT(req->cmd.flags)) {
     case NVME_PSDT_PRP:
         prp1 = le64_to_cpu(req->cmd.dptr.prp1);
@@ -883,17 +1156,97 @@ static uint16_t nvme_dma(NvmeCtrl *n, uint8_t *ptr, uint32_t len,
     return status;
 }
 
+/*
+ * Read a shadow doorbell.  Values beyond the end of the queue are ignored,
+ * just like invalid doorbell register writes.
+ */
+static void nvme_dbbuf_read(NvmeCtrl *n, uint64_t addr, uint32_t size,
+                            uint32_t *val)
+{
+    uint32_t v;
+
+    if (pci_dma_read(&n->parent_obj, addr, &v, sizeof(v))) {
+        return;
+    }
+
+    v = le32_to_cpu(v);
+    if (v < size) {
+        *val = v;
+    }
+}
+
+static void nvme_dbbuf_write(NvmeCtrl *n, uint64_t addr, uint32_t val)
+{
+    uint32_t v = cpu_to_le32(val);
+
+    pci_dma_write(&n->parent_obj, addr, &v, sizeof(v));
+}
+
+static void nvme_update_sq_tail(NvmeSQueue *sq)
+{
+    nvme_dbbuf_read(sq->ctrl, sq->db_addr, sq->size, &sq->tail);
+}
+
+/*
+ * Ask the host to ring the doorbell again once it moves the tail past the
+ * entries we have fetched, then pick up anything it queued in the meantime.
+ */
+static void nvme_update_sq_eventidx(NvmeSQueue *sq)
+{
+    nvme_dbbuf_write(sq->ctrl, sq->ei_addr, sq->tail);
+    smp_mb();
+    nvme_update_sq_tail(sq);
+}
+
+static void nvme_update_cq_head(NvmeCQueue *cq)
+{
+    nvme_dbbuf_read(cq->ctrl, cq->db_addr, cq->size, &cq->head);
+}
+
+static void nvme_cq_set_head(NvmeCtrl *n, NvmeCQueue *cq, uint32_t new_head)
+{
+    bool start_sqs = nvme_cq_full(cq);
+
+    cq->head = new_head;
+    if (start_sqs) {
+        NvmeSQueue *sq;
+        QTAILQ_FOREACH(sq, &cq->sq_list, entry) {
+            timer_mod(sq->timer, qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) + 500);
+        }
+        timer_mod(cq->timer, qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) + 500);
+    }
+
+    if (cq->tail == cq->head) {
+        /* the host has reaped everything, drop any coalesced interrupt */
+        cq->irq_pending = 0;
+        timer_del(cq->irq_timer);
+        nvme_irq_deassert(n, cq);
+    }
+}
+
 static void nvme_post_cqes(void *opaque)
 {
     NvmeCQueue *cq = opaque;
     NvmeCtrl *n = cq->ctrl;
     NvmeRequest *req, *next;
+    uint32_t posted = 0;
     int ret;
 
+    aio_context_acquire(n->ctx);
+
+    if (cq->db_addr) {
+        /* the host rings the head doorbell when it consumes these entries */
+        nvme_update_cq_head(cq);
+        nvme_dbbuf_write(n, cq->ei_addr, cq->head);
+    }
+
     QTAILQ_FOREACH_SAFE(req, &cq->req_list, entry, next) {
         NvmeSQueue *sq;
         hwaddr addr;
 
+        if (nvme_cq_full(cq) && cq->db_addr) {
+            nvme_update_cq_head(cq);
+        }
         if (nvme_cq_full(cq)) {
             break;
         }
@@ -903,8 +1256,7 @@ static void nvme_post_cqes(void *opaque)
         req->cqe.sq_id = cpu_to_le16(sq->sqid);
         req->cqe.sq_head = cpu_to_le16(sq->head);
         addr = cq->dma_addr + cq->tail * n->cqe_size;
-        ret = pci_dma_write(&n->parent_obj, addr, (void *)&req->cqe,
-                            sizeof(req->cqe));
+        ret = nvme_write_cqe(n, cq, &req->cqe);
         if (ret) {
             trace_pci_nvme_err_addr_write(addr);
             trace_pci_nvme_err_cfs();
@@ -914,11 +1266,23 @@ static void nvme_post_cqes(void *opaque)
         QTAILQ_REMOVE(&cq->req_list, req, entry);
         nvme_inc_cq_tail(cq);
         nvme_req_exit(req);
+        posted++;
+
+        /*
+         * A submission queue that ran out of requests has fetched its
+         * tail already, so with shadow doorbells the host may never ring
+         * again; restart it here.
+         */
+        if (QTAILQ_EMPTY(&sq->req_list) && !nvme_sq_empty(sq)) {
+            timer_mod(sq->timer, qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) + 500);
+        }
         QTAILQ_INSERT_TAIL(&sq->req_list, req, entry);
     }
     if (cq->tail != cq->head) {
-        nvme_irq_assert(n, cq);
+        nvme_cq_notify(n, cq, posted);
     }
+
+    aio_context_release(n->ctx);
 }
 
 static void nvme_enqueue_req_completion(NvmeCQueue *cq, NvmeRequest *req)
@@ -1375,9 +1739,12 @@ static void nvme_rw_cb(void *opaque, int ret)
     BlockBackend *blk = ns->blkconf.blk;
     BlockAcctCookie *acct = &req->acct;
     BlockAcctStats *stats = blk_get_stats(blk);
+    AioContext *ctx = nvme_ctrl(req)->ctx;
 
     trace_pci_nvme_rw_cb(nvme_cid(req), blk_name(blk));
 
+    aio_context_acquire(ctx);
+
     if (ns->params.zoned && nvme_is_write(req)) {
         nvme_finalize_zoned_write(ns, req, ret != 0);
     }
@@ -1390,26 +1757,31 @@ static void nvme_rw_cb(void *opaque, int ret)
     }
 
     nvme_enqueue_req_completion(nvme_cq(req), req);
+
+    aio_context_release(ctx);
 }
 
 static void nvme_aio_discard_cb(void *opaque, int ret)
 {
     NvmeRequest *req = opaque;
     uintptr_t *discards = (uintptr_t *)&req->opaque;
+    AioContext *ctx = nvme_ctrl(req)->ctx;
 
     trace_pci_nvme_aio_discard_cb(nvme_cid(req));
 
+    aio_context_acquire(ctx);
+
     if (ret) {
         nvme_aio_err(req, ret);
     }
 
     (*discards)--;
 
-    if (*discards) {
-        return;
+    if (!*discards) {
+        nvme_enqueue_req_completion(nvme_cq(req), req);
     }
 
-    nvme_enqueue_req_completion(nvme_cq(req), req);
+    aio_context_release(ctx);
 }
 
 struct nvme_zone_reset_ctx {
@@ -1424,11 +1796,14 @@ static void nvme_aio_zone_reset_cb(void *opaque, int ret)
     NvmeNamespace *ns = req->ns;
     NvmeZone *zone = ctx->zone;
     uintptr_t *resets = (uintptr_t *)&req->opaque;
+    AioContext *aio_context = nvme_ctrl(req)->ctx;
 
     g_free(ctx);
 
     trace_pci_nvme_aio_zone_reset_cb(nvme_cid(req), zone->d.zslba);
 
+    aio_context_acquire(aio_context);
+
     if (!ret) {
         switch (nvme_get_zone_state(zone)) {
         case NVME_ZONE_STATE_EXPLICITLY_OPEN:
@@ -1452,11 +1827,11 @@ static void nvme_aio_zone_reset_cb(void *opaque, int ret)
 
     (*resets)--;
 
-    if (*resets) {
-        return;
+    if (!*resets) {
+        nvme_enqueue_req_completion(nvme_cq(req), req);
     }
 
-    nvme_enqueue_req_completion(nvme_cq(req), req);
+    aio_context_release(aio_context);
 }
 
 struct nvme_compare_ctx {
@@ -1471,10 +1846,13 @@ static void nvme_compare_cb(void *opaque, int ret)
     NvmeNamespace *ns = req->ns;
     struct nvme_compare_ctx *ctx = req->opaque;
     g_autofree uint8_t *buf = NULL;
+    AioContext *aio_context = nvme_ctrl(req)->ctx;
     uint16_t status;
 
     trace_pci_nvme_compare_cb(nvme_cid(req));
 
+    aio_context_acquire(aio_context);
+
     if (!ret) {
         block_acct_done(blk_get_stats(ns->blkconf.blk), &req->acct);
     } else {
@@ -1502,6 +1880,8 @@ out:
     g_free(ctx);
 
     nvme_enqueue_req_completion(nvme_cq(req), req);
+
+    aio_context_release(aio_context);
 }
 
 static uint16_t nvme_dsm(NvmeCtrl *n, NvmeRequest *req)
@@ -1685,7 +2065,7 @@ static uint16_t nvme_read(NvmeCtrl *n, NvmeRequest *req)
 
     block_acct_start(blk_get_stats(blk), &req->acct, data_size,
                      BLOCK_ACCT_READ);
-    if (req->qsg.sg) {
+    if (req->qsg.nsg) {
         req->aiocb = dma_blk_read(blk, &req->qsg, data_offset,
                                   BDRV_SECTOR_SIZE, nvme_rw_cb, req);
     } else {
@@ -1773,7 +2153,7 @@ static uint16_t nvme_do_write(NvmeCtrl *n, NvmeRequest *req, bool append,
 
         block_acct_start(blk_get_stats(blk), &req->acct, data_size,
                          BLOCK_ACCT_WRITE);
-        if (req->qsg.sg) {
+        if (req->qsg.nsg) {
             req->aiocb = dma_blk_write(blk, &req->qsg, data_offset,
                                        BDRV_SECTOR_SIZE, nvme_rw_cb, req);
         } else {
@@ -2379,10 +2759,162 @@ static uint16_t nvme_io_cmd(NvmeCtrl *n, NvmeRequest *req)
     return NVME_INVALID_OPCODE | NVME_DNR;
 }
 
+static QEMUTimer *nvme_queue_timer_new(NvmeCtrl *n, QEMUTimerCB *cb,
+                                       void *opaque)
+{
+    if (n->iothread) {
+        return aio_timer_new(n->ctx, QEMU_CLOCK_VIRTUAL, SCALE_NS, cb, opaque);
+    }
+
+    return timer_new_ns(QEMU_CLOCK_VIRTUAL, cb, opaque);
+}
+
+static void nvme_set_db_notifier_handler(NvmeCtrl *n, EventNotifier *e,
+                                         EventNotifierHandler *handler)
+{
+    if (n->iothread) {
+        aio_set_event_notifier(n->ctx, e, true, handler, NULL);
+    } else {
+        event_notifier_set_handler(e, handler);
+    }
+}
+
+static void nvme_db_notifier_read(EventNotifier *e)
+{
+    NvmeQueueNotifier *qn = container_of(e, NvmeQueueNotifier, notifier);
+    NvmeCtrl *n = qn->ctrl;
+    uint16_t qid = qn->index >> 1;
+
+    if (!event_notifier_test_and_clear(e)) {
+        return;
+    }
+
+    aio_context_acquire(n->ctx);
+
+    if (qn->index & 1) {
+        NvmeCQueue *cq = n->cq[qid];
+
+        if (cq && cq->db_addr) {
+            uint32_t new_head = cq->head;
+
+            nvme_dbbuf_read(n, cq->db_addr, cq->size, &new_head);
+            trace_pci_nvme_mmio_doorbell_cq(cq->cqid, new_head);
+            nvme_cq_set_head(n, cq, new_head);
+        }
+    } else {
+        NvmeSQueue *sq = n->sq[qid];
+
+        if (sq) {
+            nvme_process_sq(sq);
+        }
+    }
+
+    aio_context_release(n->ctx);
+}
+
+/*
+ * Bind or unbind the ioeventfd of doorbell register @index as last asked.
+ * The eventfd is created on first use and kept until the controller goes
+ * away, so the handler never races with closing it; it ignores doorbells
+ * of queues that no longer exist.
+ */
+static void nvme_sync_db_ioeventfd(NvmeCtrl *n, uint16_t index)
+{
+    NvmeQueueNotifier *qn = &n->db_notifiers[index];
+    bool wanted = qatomic_read(&qn->wanted);
+
+    if (wanted == qn->enabled) {
+        return;
+    }
+
+    if (wanted && !qn->ctrl) {
+        if (event_notifier_init(&qn->notifier, 0)) {
+            return;
+        }
+        qn->ctrl = n;
+        qn->index = index;
+        nvme_set_db_notifier_handler(n, &qn->notifier, nvme_db_notifier_read);
+    }
+
+    if (wanted) {
+        memory_region_add_eventfd(&n->iomem, 0x1000 + (index << 2), 4, false,
+                                  0, &qn->notifier);
+    } else {
+        memory_region_del_eventfd(&n->iomem, 0x1000 + (index << 2), 4, false,
+                                  0, &qn->notifier);
+    }
+    qn->enabled = wanted;
+}
+
+static void nvme_db_ioeventfd_bh(void *opaque)
+{
+    NvmeCtrl *n = opaque;
+    int i;
+
+    for (i = 2; i < 2 * (n->params.max_ioqpairs + 1); i++) {
+        nvme_sync_db_ioeventfd(n, i);
+    }
+}
+
+/*
+ * Memory regions can only be changed under the BQL, which the queues of a
+ * controller with an iothread never hold, so the main loop binds the
+ * eventfds for them.
+ */
+static void nvme_set_db_ioeventfd(NvmeCtrl *n, uint16_t index, bool wanted)
+{
+    if (!n->params.ioeventfd) {
+        return;
+    }
+
+    qatomic_set(&n->db_notifiers[index].wanted, wanted);
+    if (n->iothread) {
+        qemu_bh_schedule(n->db_ioeventfd_bh);
+    } else {
+        nvme_sync_db_ioeventfd(n, index);
+    }
+}
+
+/*
+ * Back the doorbell register @index with an ioeventfd.  The eventfd does
+ * not carry the written value, so this is only done for queues with a
+ * shadow doorbell.
+ */
+static void nvme_init_db_ioeventfd(NvmeCtrl *n, uint16_t index)
+{
+    nvme_set_db_ioeventfd(n, index, true);
+}
+
+static void nvme_free_db_ioeventfd(NvmeCtrl *n, uint16_t index)
+{
+    nvme_set_db_ioeventfd(n, index, false);
+}
+
+static void nvme_init_sq_dbbuf(NvmeCtrl *n, NvmeSQueue *sq)
+{
+    sq->db_addr = n->dbbuf_dbs + (sq->sqid << 3);
+    sq->ei_addr = n->dbbuf_eis + (sq->sqid << 3);
+    nvme_init_db_ioeventfd(n, sq->sqid << 1);
+}
+
+static void nvme_init_cq_dbbuf(NvmeCtrl *n, NvmeCQueue *cq)
+{
+    cq->db_addr = n->dbbuf_dbs + (cq->cqid << 3) + (1 << 2);
+    cq->ei_addr = n->dbbuf_eis + (cq->cqid << 3) + (1 << 2);
+    nvme_init_db_ioeventfd(n, (cq->cqid << 1) + 1);
+}
+
 static void nvme_free_sq(NvmeSQueue *sq, NvmeCtrl *n)
 {
+    int i;
+
+    nvme_free_db_ioeventfd(n, sq->sqid << 1);
     n->sq[sq->sqid] = NULL;
     timer_free(sq->timer);
+    nvme_ring_set(&sq->ring, NULL);
+    for (i = 0; i < sq->size; i++) {
+        nvme_req_free(&sq->io_req[i]);
+    }
     g_free(sq->io_req);
     if (sq->sqid) {
         g_free(sq);
@@ -2405,11 +2937,11 @@ static uint16_t nvme_del_sq(NvmeCtrl *n, NvmeRequest *req)
     trace_pci_nvme_del_sq(qid);
 
     sq = n->sq[qid];
-    while (!QTAILQ_EMPTY(&sq->out_req_list)) {
-        r = QTAILQ_FIRST(&sq->out_req_list);
+    QTAILQ_FOREACH(r, &sq->out_req_list, entry) {
         assert(r->aiocb);
-        blk_aio_cancel(r->aiocb);
+        blk_aio_cancel_async(r->aiocb);
     }
+    AIO_WAIT_WHILE(n->ctx, !QTAILQ_EMPTY(&sq->out_req_list));
     if (!nvme_check_cqid(n, sq->cqid)) {
         cq = n->cq[sq->cqid];
         QTAILQ_REMOVE(&cq->sq_list, sq, entry);
@@ -2447,12 +2979,18 @@ static void nvme_init_sq(NvmeSQueue *sq, NvmeCtrl *n, uint64_t dma_addr,
         sq->io_req[i].sq = sq;
         QTAILQ_INSERT_TAIL(&(sq->req_list), &sq->io_req[i], entry);
     }
-    sq->timer = timer_new_ns(QEMU_CLOCK_VIRTUAL, nvme_process_sq, sq);
+    sq->timer = nvme_queue_timer_new(n, nvme_process_sq, sq);
+    nvme_ring_set(&sq->ring, nvme_ring_new(n, dma_addr, size * n->sqe_size,
+                                           false));
 
     assert(n->cq[cqid]);
     cq = n->cq[cqid];
     QTAILQ_INSERT_TAIL(&(cq->sq_list), sq, entry);
     n->sq[sqid] = sq;
+
+    if (sqid && n->dbbuf_enabled) {
+        nvme_init_sq_dbbuf(n, sq);
+    }
 }
 
 static uint16_t nvme_create_sq(NvmeCtrl *n, NvmeRequest *req)
@@ -2707,9 +3245,12 @@ static uint16_t nvme_get_log(NvmeCtrl *n, NvmeRequest *req)
 
 static void nvme_free_cq(NvmeCQueue *cq, NvmeCtrl *n)
 {
+    nvme_free_db_ioeventfd(n, (cq->cqid << 1) + 1);
     n->cq[cq->cqid] = NULL;
     timer_free(cq->timer);
-    if (msix_enabled(&n->parent_obj)) {
+    timer_free(cq->irq_timer);
+    nvme_ring_set(&cq->ring, NULL);
+    if (!n->iothread && msix_enabled(&n->parent_obj)) {
         msix_vector_unuse(&n->parent_obj, cq->vector);
     }
     if (cq->cqid) {
@@ -2745,7 +3286,8 @@ static void nvme_init_cq(NvmeCQueue *cq, NvmeCtrl *n, uint64_t dma_addr,
 {
     int ret;
 
-    if (msix_enabled(&n->parent_obj)) {
+    /* with an iothread, all vectors are in use from realize on */
+    if (!n->iothread && msix_enabled(&n->parent_obj)) {
         ret = msix_vector_use(&n->parent_obj, vector);
         assert(ret == 0);
     }
@@ -2760,7 +3302,15 @@ static void nvme_init_cq(NvmeCQueue *cq, NvmeCtrl *n, uint64_t dma_addr,
     QTAILQ_INIT(&cq->req_list);
     QTAILQ_INIT(&cq->sq_list);
     n->cq[cqid] = cq;
-    cq->timer = timer_new_ns(QEMU_CLOCK_VIRTUAL, nvme_post_cqes, cq);
+    cq->timer = nvme_queue_timer_new(n, nvme_post_cqes, cq);
+    cq->irq_pending = 0;
+    cq->irq_timer = nvme_queue_timer_new(n, nvme_cq_irq_timer_cb, cq);
+    nvme_ring_set(&cq->ring, nvme_ring_new(n, dma_addr, size * n->cqe_size,
+                                           true));
+
+    if (cqid && n->dbbuf_enabled) {
+        nvme_init_cq_dbbuf(n, cq);
+    }
 }
 
 static uint16_t nvme_create_cq(NvmeCtrl *n, NvmeRequest *req)
@@ -3242,6 +3792,20 @@ static uint16_t nvme_get_feature(NvmeCtrl *n, NvmeRequest *req)
         }
         trace_pci_nvme_getfeat_vwcache(result ? "enabled" : "disabled");
         goto out;
+    case NVME_INTERRUPT_COALESCING:
+        result = n->features.int_coalescing;
+        goto out;
+    case NVME_INTERRUPT_VECTOR_CONF:
+        iv = dw11 & 0xffff;
+        if (iv >= n->params.max_ioqpairs + 1) {
+            return NVME_INVALID_FIELD | NVME_DNR;
+        }
+
+        result = iv;
+        if (iv == n->admin_cq.vector || test_bit(iv, n->features.int_vc_cd)) {
+            result |= NVME_INTVC_NOCOALESCING;
+        }
+        goto out;
     case NVME_ASYNCHRONOUS_EVENT_CONF:
         result = n->features.async_config;
         goto out;
@@ -3320,6 +3884,7 @@ static uint16_t nvme_set_feature(NvmeCtrl *n, NvmeRequest *req)
     uint32_t nsid = le32_to_cpu(cmd->nsid);
     uint8_t fid = NVME_GETSETFEAT_FID(dw10);
     uint8_t save = NVME_SETFEAT_SAVE(dw10);
+    uint16_t iv;
     int i;
 
     trace_pci_nvme_setfeat(nvme_cid(req), nsid, fid, save, dw11);
@@ -3436,6 +4001,21 @@ static uint16_t nvme_set_feature(NvmeCtrl *n, NvmeRequest *req)
         req->cqe.result = cpu_to_le32((n->params.max_ioqpairs - 1) |
                                       ((n->params.max_ioqpairs - 1) << 16));
         break;
+    case NVME_INTERRUPT_COALESCING:
+        n->features.int_coalescing = dw11 & 0xffff;
+        break;
+    case NVME_INTERRUPT_VECTOR_CONF:
+        iv = dw11 & 0xffff;
+        if (iv >= n->params.max_ioqpairs + 1) {
+            return NVME_INVALID_FIELD | NVME_DNR;
+        }
+
+        if (dw11 & NVME_INTVC_NOCOALESCING) {
+            set_bit(iv, n->features.int_vc_cd);
+        } else {
+            clear_bit(iv, n->features.int_vc_cd);
+        }
+        break;
     case NVME_ASYNCHRONOUS_EVENT_CONF:
         n->features.async_config = dw11;
         break;
@@ -3472,6 +4052,46 @@ static uint16_t nvme_aer(NvmeCtrl *n, NvmeRequest *req)
     return NVME_NO_COMPLETE;
 }
 
+static uint16_t nvme_dbbuf_config(NvmeCtrl *n, NvmeRequest *req)
+{
+    uint64_t dbs_addr = le64_to_cpu(req->cmd.dptr.prp1);
+    uint64_t eis_addr = le64_to_cpu(req->cmd.dptr.prp2);
+    int i;
+
+    trace_pci_nvme_dbbuf_config(dbs_addr, eis_addr);
+
+    if (unlikely(!dbs_addr || !eis_addr ||
+                 dbs_addr & (n->page_size - 1) ||
+                 eis_addr & (n->page_size - 1))) {
+        trace_pci_nvme_err_invalid_dbbuf_config_addr(dbs_addr, eis_addr);
+        return NVME_INVALID_FIELD | NVME_DNR;
+    }
+
+    n->dbbuf_dbs = dbs_addr;
+    n->dbbuf_eis = eis_addr;
+    n->dbbuf_enabled = true;
+
+    /* the admin queue keeps using the doorbell registers */
+    for (i = 1; i < n->params.max_ioqpairs + 1; i++) {
+        NvmeSQueue *sq = n->sq[i];
+        NvmeCQueue *cq = n->cq[i];
+
+        if (sq) {
+            nvme_init_sq_dbbuf(n, sq);
+            nvme_dbbuf_write(n, sq->db_addr, sq->tail);
+            nvme_dbbuf_write(n, sq->ei_addr, sq->tail);
+        }
+
+        if (cq) {
+            nvme_init_cq_dbbuf(n, cq);
+            nvme_dbbuf_write(n, cq->db_addr, cq->head);
+            nvme_dbbuf_write(n, cq->ei_addr, cq->head);
+        }
+    }
+
+    return NVME_SUCCESS;
+}
+
 static uint16_t nvme_admin_cmd(NvmeCtrl *n, NvmeRequest *req)
 {
     trace_pci_nvme_admin_cmd(nvme_cid(req), nvme_sqid(req), req->cmd.opcode,
@@ -3503,6 +4123,8 @@ static uint16_t nvme_admin_cmd(NvmeCtrl *n, NvmeRequest *req)
         return nvme_get_feature(n, req);
     case NVME_ADM_CMD_ASYNC_EV_REQ:
         return nvme_aer(n, req);
+    case NVME_ADM_CMD_DBBUF_CONFIG:
+        return nvme_dbbuf_config(n, req);
     default:
         assert(false);
     }
@@ -3521,15 +4143,24 @@ static void nvme_process_sq(void *opaque)
     NvmeCmd cmd;
     NvmeRequest *req;
 
+    aio_context_acquire(n->ctx);
+
+    if (sq->db_addr) {
+        nvme_update_sq_tail(sq);
+    }
+
     while (!(nvme_sq_empty(sq) || QTAILQ_EMPTY(&sq->req_list))) {
         addr = sq->dma_addr + sq->head * n->sqe_size;
-        if (nvme_addr_read(n, addr, (void *)&cmd, sizeof(cmd))) {
+        if (nvme_read_sqe(n, sq, &cmd)) {
             trace_pci_nvme_err_addr_read(addr);
             trace_pci_nvme_err_cfs();
             n->bar.csts = NVME_CSTS_FAILED;
             break;
         }
         nvme_inc_sq_head(sq);
+        if (sq->db_addr && nvme_sq_empty(sq)) {
+            nvme_update_sq_eventidx(sq);
+        }
 
         req = QTAILQ_FIRST(&sq->req_list);
         QTAILQ_REMOVE(&sq->req_list, req, entry);
@@ -3545,6 +4176,8 @@ static void nvme_process_sq(void *opaque)
             nvme_enqueue_req_completion(cq, req);
         }
     }
+
+    aio_context_release(n->ctx);
 }
 
 static void nvme_ctrl_reset(NvmeCtrl *n)
@@ -3578,6 +4211,15 @@ static void nvme_ctrl_reset(NvmeCtrl *n)
         g_free(event);
     }
 
+    /* doorbells rung before the reset must not hit the new queues */
+    for (i = 0; i < 2 * (n->params.max_ioqpairs + 1); i++) {
+        qatomic_set(&n->db[i], 0);
+    }
+
+    n->dbbuf_enabled = false;
+    n->dbbuf_dbs = 0;
+    n->dbbuf_eis = 0;
+
     n->aer_queued = 0;
     n->outstanding_aers = 0;
     n->qs_created = false;
@@ -3989,6 +4631,8 @@ static uint64_t nvme_mmio_read(void *opaque, hwaddr addr, unsigned size)
     uint8_t *ptr = (uint8_t *)&n->bar;
     uint64_t val = 0;
 
+    QEMU_IOTHREAD_LOCK_GUARD();
+
     trace_pci_nvme_mmio_read(addr, size);
 
     if (unlikely(addr & (sizeof(uint32_t) - 1))) {
@@ -4023,7 +4667,7 @@ static uint64_t nvme_mmio_read(void *opaque, hwaddr addr, unsigned size)
     return val;
 }
 
-static void nvme_process_db(NvmeCtrl *n, hwaddr addr, int val)
+static void nvme_process_db(NvmeCtrl *n, hwaddr addr, uint64_t val)
 {
     uint32_t qid;
 
@@ -4037,8 +4681,6 @@ static void nvme_process_db(NvmeCtrl *n, hwaddr addr, int val)
     if (((addr - 0x1000) >> 2) & 1) {
         /* Completion queue doorbell write */
 
-        uint16_t new_head = val & 0xffff;
-        int start_sqs;
         NvmeCQueue *cq;
 
         qid = (addr - (0x1000 + (1 << 2))) >> 3;
@@ -4071,12 +4713,12 @@ static void nvme_process_db(NvmeCtrl *n, hwaddr addr, int val)
         }
 
         cq = n->cq[qid];
-        if (unlikely(new_head >= cq->size)) {
+        if (unlikely(val >= cq->size)) {
             NVME_GUEST_ERR(pci_nvme_ub_db_wr_invalid_cqhead,
                            "completion queue doorbell write value"
                            " beyond queue size, sqid=%"PRIu32","
-                           " new_head=%"PRIu16", ignoring",
-                           qid, new_head);
+                           " new_head=%"PRIu64", ignoring",
+                           qid, val);
 
             if (n->outstanding_aers) {
                 nvme_enqueue_event(n, NVME_AER_TYPE_ERROR,
@@ -4087,25 +4729,12 @@ static void nvme_process_db(NvmeCtrl *n, hwaddr addr, int val)
             return;
         }
 
-        trace_pci_nvme_mmio_doorbell_cq(cq->cqid, new_head);
-
-        start_sqs = nvme_cq_full(cq) ? 1 : 0;
-        cq->head = new_head;
-        if (start_sqs) {
-            NvmeSQueue *sq;
-            QTAILQ_FOREACH(sq, &cq->sq_list, entry) {
-                timer_mod(sq->timer, qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) + 500);
-            }
-            timer_mod(cq->timer, qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) + 500);
-        }
+        trace_pci_nvme_mmio_doorbell_cq(cq->cqid, val);
 
-        if (cq->tail == cq->head) {
-            nvme_irq_deassert(n, cq);
-        }
+        nvme_cq_set_head(n, cq, val);
     } else {
         /* Submission queue doorbell write */
 
-        uint16_t new_tail = val & 0xffff;
         NvmeSQueue *sq;
 
         qid = (addr - 0x1000) >> 3;
@@ -4125,12 +4754,12 @@ static void nvme_process_db(NvmeCtrl *n, hwaddr addr, int val)
         }
 
         sq = n->sq[qid];
-        if (unlikely(new_tail >= sq->size)) {
+        if (unlikely(val >= sq->size)) {
             NVME_GUEST_ERR(pci_nvme_ub_db_wr_invalid_sqtail,
                            "submission queue doorbell write value"
                            " beyond queue size, sqid=%"PRIu32","
-                           " new_tail=%"PRIu16", ignoring",
-                           qid, new_tail);
+                           " new_tail=%"PRIu64", ignoring",
+                           qid, val);
 
             if (n->outstanding_aers) {
                 nvme_enqueue_event(n, NVME_AER_TYPE_ERROR,
@@ -4141,20 +4770,47 @@ static void nvme_process_db(NvmeCtrl *n, hwaddr addr, int val)
             return;
         }
 
-        trace_pci_nvme_mmio_doorbell_sq(sq->sqid, new_tail);
+        trace_pci_nvme_mmio_doorbell_sq(sq->sqid, val);
 
-        sq->tail = new_tail;
+        sq->tail = val;
         timer_mod(sq->timer, qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) + 500);
     }
 }
 
-static void nvme_mmio_write(void *opaque, hwaddr addr, uint64_t data,
-                            unsigned size)
+/* Set in a latched doorbell slot until db_bh has applied its value */
+#define NVME_DB_PENDING (1u << 31)
+
+static void nvme_db_bh(void *opaque)
 {
-    NvmeCtrl *n = (NvmeCtrl *)opaque;
+    NvmeCtrl *n = opaque;
+    int i;
 
-    trace_pci_nvme_mmio_write(addr, data, size);
+    aio_context_acquire(n->ctx);
+    for (i = 0; i < 2 * (n->params.max_ioqpairs + 1); i++) {
+        uint32_t val;
+
+        if (!(qatomic_read(&n->db[i]) & NVME_DB_PENDING)) {
+            continue;
+        }
+        val = qatomic_xchg(&n->db[i], 0);
+        nvme_process_db(n, 0x1000 + (i << 2), val & ~NVME_DB_PENDING);
+    }
+    aio_context_release(n->ctx);
+}
 
+/* The same as db_bh, for a controller with an iothread */
+static void nvme_db_io_notifier_read(EventNotifier *e)
+{
+    NvmeCtrl *n = container_of(e, NvmeCtrl, db_io_notifier);
+
+    if (event_notifier_test_and_clear(e)) {
+        nvme_db_bh(n);
+    }
+}
+
+static void nvme_reg_write(NvmeCtrl *n, hwaddr addr, uint64_t data,
+                           unsigned size)
+{
     if (addr < sizeof(n->bar)) {
         nvme_write_bar(n, addr, data, size);
     } else {
@@ -4162,6 +4818,117 @@ static void nvme_mmio_write(void *opaque, hwaddr addr, uint64_t data,
     }
 }
 
+/* Apply the register writes queued by nvme_mmio_write(), in order */
+static void nvme_reg_bh(void *opaque)
+{
+    NvmeCtrl *n = opaque;
+    NvmeRegWrite *w;
+
+    aio_context_acquire(n->ctx);
+    for (;;) {
+        WITH_QEMU_LOCK_GUARD(&n->reg_lock) {
+            w = QSIMPLEQ_FIRST(&n->reg_writes);
+            if (w) {
+                QSIMPLEQ_REMOVE_HEAD(&n->reg_writes, entry);
+            }
+        }
+        if (!w) {
+            break;
+        }
+
+        nvme_reg_write(n, w->addr, w->data, w->size);
+        if (w->done) {
+            qemu_event_set(w->done);
+        } else {
+            g_free(w);
+        }
+    }
+    aio_context_release(n->ctx);
+}
+
+/*
+ * Have the iothread apply a register write that changes queue state.  A
+ * vCPU waits for it, so that the guest sees the write done when it reads
+ * the registers back.  A thread that holds the BQL, or the iothread
+ * itself, must not wait for the iothread and only queues the write.
+ */
+static void nvme_queue_reg_write(NvmeCtrl *n, hwaddr addr, uint64_t data,
+                                 unsigned size)
+{
+    bool wait = !qemu_mutex_iothread_locked() &&
+                !in_aio_context_home_thread(n->ctx);
+    NvmeRegWrite stack_w, *w;
+    QemuEvent done;
+
+    w = wait ? &stack_w : g_new(NvmeRegWrite, 1);
+    w->addr = addr;
+    w->data = data;
+    w->size = size;
+    w->done = NULL;
+    if (wait) {
+        qemu_event_init(&done, false);
+        w->done = &done;
+    }
+
+    WITH_QEMU_LOCK_GUARD(&n->reg_lock) {
+        QSIMPLEQ_INSERT_TAIL(&n->reg_writes, w, entry);
+    }
+    qemu_bh_schedule(n->reg_bh);
+
+    if (wait) {
+        qemu_event_wait(&done);
+        qemu_event_destroy(&done);
+    }
+}
+
+/*
+ * Doorbell writes are the hot path of the controller and are dispatched
+ * without the BQL.  Aligned ones whose value fits in a 16-bit queue
+ * pointer only latch it, and the bottom half or, with an iothread, the
+ * iothread then applies it; if the guest rings the same doorbell again in
+ * the meantime, only the latest value matters.  Larger values take the
+ * slow path, which reports them with an Invalid Doorbell Write Value
+ * event.
+ *
+ * Everything else goes through the BQL.  With an iothread, writes that
+ * change queue state, i.e. CC and malformed doorbells, are applied by the
+ * iothread, so that the AioContext lock is never taken under the BQL.
+ */
+static void nvme_mmio_write(void *opaque, hwaddr addr, uint64_t data,
+                            unsigned size)
+{
+    NvmeCtrl *n = (NvmeCtrl *)opaque;
+    hwaddr db = (addr - 0x1000) >> 2;
+
+    trace_pci_nvme_mmio_write(addr, data, size);
+
+    if (addr >= 0x1000 && !(addr & 3) &&
+        db < 2 * (n->params.max_ioqpairs + 1) && data <= UINT16_MAX) {
+        qatomic_set(&n->db[db], data | NVME_DB_PENDING);
+        if (n->iothread) {
+            event_notifier_set(&n->db_io_notifier);
+        } else {
+            qemu_bh_schedule(n->db_bh);
+        }
+        return;
+    }
+
+    if (n->iothread) {
+        if (addr == 0x14 || addr >= sizeof(n->bar)) {
+            nvme_queue_reg_write(n, addr, data, size);
+        } else {
+            QEMU_IOTHREAD_LOCK_GUARD();
+            nvme_write_bar(n, addr, data, size);
+        }
+        return;
+    }
+
+    QEMU_IOTHREAD_LOCK_GUARD();
+    aio_context_acquire(n->ctx);
+    nvme_reg_write(n, addr, data, size);
+    aio_context_release(n->ctx);
+}
+
 static const MemoryRegionOps nvme_mmio_ops = {
     .read = nvme_mmio_read,
     .write = nvme_mmio_write,
@@ -4261,8 +5028,23 @@ static void nvme_init_state(NvmeCtrl *n)
                            2 * (n->params.max_ioqpairs + 1) * NVME_DB_SIZE);
     n->sq = g_new0(NvmeSQueue *, n->params.max_ioqpairs + 1);
     n->cq = g_new0(NvmeCQueue *, n->params.max_ioqpairs + 1);
+    n->db = g_new0(uint32_t, 2 * (n->params.max_ioqpairs + 1));
+    n->db_notifiers = g_new0(NvmeQueueNotifier,
+                             2 * (n->params.max_ioqpairs + 1));
+    n->db_ioeventfd_bh = qemu_bh_new(nvme_db_ioeventfd_bh, n);
+    if (n->iothread) {
+        n->ctx = iothread_get_aio_context(n->iothread);
+        qemu_mutex_init(&n->reg_lock);
+        QSIMPLEQ_INIT(&n->reg_writes);
+        n->reg_bh = aio_bh_new(n->ctx, nvme_reg_bh, n);
+        n->dma_bh = aio_bh_new(n->ctx, nvme_dma_remap, n);
+    } else {
+        n->ctx = qemu_get_aio_context();
+        n->db_bh = qemu_bh_new(nvme_db_bh, n);
+    }
     n->temperature = NVME_TEMPERATURE;
     n->features.temp_thresh_hi = NVME_TEMPERATURE_WARNING;
+    n->features.int_vc_cd = bitmap_new(n->params.max_ioqpairs + 1);
     n->starttime_ms = qemu_clock_get_ms(QEMU_CLOCK_VIRTUAL);
     n->aer_reqs = g_new0(NvmeRequest *, n->params.aerl + 1);
 }
@@ -4296,6 +5078,18 @@ int nvme_register_namespace(NvmeCtrl *n, NvmeNamespace *ns, Error **errp)
         }
     }
 
+    if (n->iothread) {
+        AioContext *old_ctx = blk_get_aio_context(ns->blkconf.blk);
+        int ret;
+
+        aio_context_acquire(old_ctx);
+        ret = blk_set_aio_context(ns->blkconf.blk, n->ctx, errp);
+        aio_context_release(old_ctx);
+        if (ret < 0) {
+            return -1;
+        }
+    }
+
     trace_pci_nvme_register_namespace(nsid);
 
     n->namespaces[nsid - 1] = ns;
@@ -4378,6 +5172,8 @@ static int nvme_init_pci(NvmeCtrl *n, PCIDevice *pci_dev, Error **errp)
     memory_region_init(&n->bar0, OBJECT(n), "nvme-bar0", bar_size);
     memory_region_init_io(&n->iomem, OBJECT(n), &nvme_mmio_ops, n, "nvme",
                           n->reg_size);
+    /* nvme_mmio_read() and nvme_mmio_write() take the BQL when needed */
+    memory_region_clear_global_locking(&n->iomem);
     memory_region_add_subregion(&n->bar0, 0, &n->iomem);
 
     pci_register_bar(pci_dev, 0, PCI_BASE_ADDRESS_SPACE_MEMORY |
@@ -4422,7 +5218,7 @@ static void nvme_init_ctrl(NvmeCtrl *n, PCIDevice *pci_dev)
     id->ieee[2] = 0xb3;
     id->mdts = n->params.mdts;
     id->ver = cpu_to_le32(NVME_SPEC_VER);
-    id->oacs = cpu_to_le16(0);
+    id->oacs = cpu_to_le16(NVME_OACS_DBBUF);
     id->cntrltype = 0x1;
 
     /*
@@ -4478,11 +5274,91 @@ static void nvme_init_ctrl(NvmeCtrl *n, PCIDevice *pci_dev)
     n->bar.intmc = n->bar.intms = 0;
 }
 
+static void nvme_irq_notifier_read(EventNotifier *e)
+{
+    NvmeQueueNotifier *qn = container_of(e, NvmeQueueNotifier, notifier);
+    NvmeCtrl *n = qn->ctrl;
+    uint32_t irq;
+
+    if (!event_notifier_test_and_clear(e)) {
+        return;
+    }
+
+    irq = qatomic_read(&qn->irq);
+    if (irq & NVME_IRQ_LEVEL) {
+        nvme_irq_vector_assert(n, irq & NVME_IRQ_VECTOR,
+                               irq & NVME_IRQ_ENABLED);
+    } else {
+        nvme_irq_vector_deassert(n, irq & NVME_IRQ_VECTOR,
+                                 irq & NVME_IRQ_ENABLED);
+    }
+}
+
+static int nvme_init_irq_notifiers(NvmeCtrl *n, Error **errp)
+{
+    int i, ret;
+
+    n->irq_notifiers = g_new0(NvmeQueueNotifier, n->params.max_ioqpairs + 1);
+
+    for (i = 0; i < n->params.max_ioqpairs + 1; i++) {
+        NvmeQueueNotifier *qn = &n->irq_notifiers[i];
+
+        ret = event_notifier_init(&qn->notifier, 0);
+        if (ret < 0) {
+            error_setg_errno(errp, -ret, "failed to initialize irq notifier");
+            return ret;
+        }
+
+        qn->ctrl = n;
+        qn->index = i;
+        event_notifier_set_handler(&qn->notifier, nvme_irq_notifier_read);
+        qn->enabled = true;
+    }
+
+    return 0;
+}
+
+static void nvme_cleanup_irq_notifiers(NvmeCtrl *n)
+{
+    int i;
+
+    if (!n->irq_notifiers) {
+        return;
+    }
+
+    for (i = 0; i < n->params.max_ioqpairs + 1; i++) {
+        NvmeQueueNotifier *qn = &n->irq_notifiers[i];
+
+        if (qn->enabled) {
+            event_notifier_set_handler(&qn->notifier, NULL);
+            event_notifier_cleanup(&qn->notifier);
+        }
+    }
+
+    g_free(n->irq_notifiers);
+    n->irq_notifiers = NULL;
+}
+
+static int nvme_init_db_io_notifier(NvmeCtrl *n, Error **errp)
+{
+    int ret = event_notifier_init(&n->db_io_notifier, 0);
+
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "failed to initialize doorbell notifier");
+        return ret;
+    }
+
+    aio_set_event_notifier(n->ctx, &n->db_io_notifier, true,
+                           nvme_db_io_notifier_read, NULL);
+    return 0;
+}
+
 static void nvme_realize(PCIDevice *pci_dev, Error **errp)
 {
     NvmeCtrl *n = NVME(pci_dev);
     NvmeNamespace *ns;
     Error *local_err = NULL;
+    int i;
 
     nvme_check_constraints(n, &local_err);
     if (local_err) {
@@ -4498,6 +5374,20 @@ static void nvme_realize(PCIDevice *pci_dev, Error **errp)
         return;
     }
 
+    if (n->iothread) {
+        if (nvme_init_irq_notifiers(n, errp) ||
+            nvme_init_db_io_notifier(n, errp)) {
+            return;
+        }
+
+        /* creating a completion queue in the iothread cannot claim one */
+        if (msix_present(pci_dev)) {
+            for (i = 0; i < n->params.msix_qsize; i++) {
+                msix_vector_use(pci_dev, i);
+            }
+        }
+    }
+
     nvme_init_ctrl(n, pci_dev);
 
     /* setup a namespace if the controller drive property was given */
@@ -4513,25 +5403,119 @@ static void nvme_realize(PCIDevice *pci_dev, Error **errp)
             return;
         }
     }
+
+    n->dma_listener.commit = nvme_dma_listener_commit;
+    memory_listener_register(&n->dma_listener,
+                             pci_get_address_space(pci_dev));
 }
 
-static void nvme_exit(PCIDevice *pci_dev)
+typedef struct NvmeExitData {
+    NvmeCtrl *n;
+    bool done;
+} NvmeExitData;
+
+/* Tear down the queues and namespaces in the AioContext they run in */
+static void nvme_exit_queues(NvmeCtrl *n)
 {
-    NvmeCtrl *n = NVME(pci_dev);
     NvmeNamespace *ns;
     int i;
 
+    aio_context_acquire(n->ctx);
+
     nvme_ctrl_reset(n);
 
     for (i = 1; i <= n->num_namespaces; i++) {
         ns = nvme_ns(n, i);
-        if (!ns) {
-            continue;
+        if (ns) {
+            nvme_ns_cleanup(ns);
         }
+    }
 
-        nvme_ns_cleanup(ns);
+    aio_context_release(n->ctx);
+}
+
+static void nvme_exit_bh(void *opaque)
+{
+    NvmeExitData *data = opaque;
+    NvmeCtrl *n = data->n;
+    int i;
+
+    /* apply what the guest wrote last, and stop anything else from running */
+    nvme_reg_bh(n);
+    qemu_bh_delete(n->reg_bh);
+    qemu_bh_delete(n->dma_bh);
+    nvme_exit_queues(n);
+
+    aio_set_event_notifier(n->ctx, &n->db_io_notifier, true, NULL, NULL);
+    for (i = 0; i < 2 * (n->params.max_ioqpairs + 1); i++) {
+        if (n->db_notifiers[i].ctrl) {
+            aio_set_event_notifier(n->ctx, &n->db_notifiers[i].notifier,
+                                   true, NULL, NULL);
+        }
     }
 
+    qatomic_set(&data->done, true);
+    aio_wait_kick();
+}
+
+static void nvme_exit(PCIDevice *pci_dev)
+{
+    NvmeCtrl *n = NVME(pci_dev);
+    NvmeNamespace *ns;
+    int i;
+
+    memory_listener_unregister(&n->dma_listener);
+
+    if (n->iothread) {
+        NvmeExitData data = { .n = n };
+
+        /* let the iothread tear its queues down, without taking its lock */
+        aio_bh_schedule_oneshot(n->ctx, nvme_exit_bh, &data);
+        AIO_WAIT_WHILE(NULL, !qatomic_read(&data.done));
+
+        /*
+         * Moving the backends needs the old AioContext held, but nothing
+         * of the controller can be holding it any more.
+         */
+        for (i = 1; i <= n->num_namespaces; i++) {
+            ns = nvme_ns(n, i);
+            if (!ns) {
+                continue;
+            }
+
+            aio_context_acquire(n->ctx);
+            blk_set_aio_context(ns->blkconf.blk, qemu_get_aio_context(),
+                                NULL);
+            aio_context_release(n->ctx);
+        }
+
+        event_notifier_cleanup(&n->db_io_notifier);
+        qemu_mutex_destroy(&n->reg_lock);
+    } else {
+        nvme_exit_queues(n);
+        qemu_bh_delete(n->db_bh);
+    }
+
+    nvme_cleanup_irq_notifiers(n);
+    qemu_bh_delete(n->db_ioeventfd_bh);
+    for (i = 0; i < 2 * (n->params.max_ioqpairs + 1); i++) {
+        NvmeQueueNotifier *qn = &n->db_notifiers[i];
+
+        if (!qn->ctrl) {
+            continue;
+        }
+        if (qn->enabled) {
+            memory_region_del_eventfd(&n->iomem, 0x1000 + (i << 2), 4, false,
+                                      0, &qn->notifier);
+        }
+        if (!n->iothread) {
+            event_notifier_set_handler(&qn->notifier, NULL);
+        }
+        event_notifier_cleanup(&qn->notifier);
+    }
+    g_free(n->db_notifiers);
+    g_free(n->db);
+    g_free(n->features.int_vc_cd);
     g_free(n->cq);
     g_free(n->sq);
     g_free(n->aer_reqs);
@@ -4560,6 +5544,9 @@ static Property nvme_props[] = {
     DEFINE_PROP_UINT8("mdts", NvmeCtrl, params.mdts, 7),
     DEFINE_PROP_BOOL("use-intel-id", NvmeCtrl, params.use_intel_id, false),
     DEFINE_PROP_BOOL("legacy-cmb", NvmeCtrl, params.legacy_cmb, false),
+    DEFINE_PROP_LINK("iothread", NvmeCtrl, iothread, TYPE_IOTHREAD,
+                     IOThread *),
+    DEFINE_PROP_BOOL("ioeventfd", NvmeCtrl, params.ioeventfd, false),
     DEFINE_PROP_SIZE32("zoned.append_size_limit", NvmeCtrl, params.zasl_bs,
                        NVME_DEFAULT_MAX_ZA_SIZE),
     DEFINE_PROP_END_OF_LIST(),
@@ -2,6 +2,7 @@
 #define HW_NVME_H
 
 #include "block/nvme.h"
+#include "sysemu/iothread.h"
 #include "nvme-ns.h"
 
 #define NVME_MAX_NAMESPACES 256
@@ -21,6 +22,7 @@ typedef struct NvmeParams {
     bool     use_intel_id;
     uint32_t zasl_bs;
     bool     legacy_cmb;
+    bool     ioeventfd;
 } NvmeParams;
 
 typedef struct NvmeAsyncEvent {
@@ -28,6 +30,15 @@ typedef struct NvmeAsyncEvent {
     NvmeAerResult result;
 } NvmeAsyncEvent;
 
+/* A register write forwarded to the iothread, see nvme_mmio_write() */
+typedef struct NvmeRegWrite {
+    QSIMPLEQ_ENTRY(NvmeRegWrite) entry;
+    hwaddr      addr;
+    uint64_t    data;
+    unsigned    size;
+    QemuEvent   *done;
+} NvmeRegWrite;
+
 typedef struct NvmeRequest {
     struct NvmeSQueue       *sq;
     struct NvmeNamespace    *ns;
@@ -55,6 +66,7 @@ static inline const char *nvme_adm_opc_str(uint8_t opc)
     case NVME_ADM_CMD_SET_FEATURES:     return "NVME_ADM_CMD_SET_FEATURES";
     case NVME_ADM_CMD_GET_FEATURES:     return "NVME_ADM_CMD_GET_FEATURES";
     case NVME_ADM_CMD_ASYNC_EV_REQ:     return "NVME_ADM_CMD_ASYNC_EV_REQ";
+    case NVME_ADM_CMD_DBBUF_CONFIG:     return "NVME_ADM_CMD_DBBUF_CONFIG";
     default:                            return "NVME_ADM_CMD_UNKNOWN";
     }
 }
@@ -75,6 +87,12 @@ static inline const char *nvme_io_opc_str(uint8_t opc)
     }
 }
 
+/* A mapped queue ring, replaced under RCU when the memory map changes */
+typedef struct NvmeRing {
+    struct rcu_head rcu;
+    MemoryRegionCache cache;
+} NvmeRing;
+
 typedef struct NvmeSQueue {
     struct NvmeCtrl *ctrl;
     uint16_t    sqid;
@@ -83,6 +101,9 @@ typedef struct NvmeSQueue {
     uint32_t    tail;
     uint32_t    size;
     uint64_t    dma_addr;
+    uint64_t    db_addr;        /* shadow tail doorbell, 0 if not in use */
+    uint64_t    ei_addr;        /* EventIdx for db_addr */
+    NvmeRing    *ring;          /* RCU, NULL if not cached */
     QEMUTimer   *timer;
     NvmeRequest *io_req;
     QTAILQ_HEAD(, NvmeRequest) req_list;
@@ -100,7 +121,13 @@ typedef struct NvmeCQueue {
     uint32_t    vector;
     uint32_t    size;
     uint64_t    dma_addr;
+    uint64_t    db_addr;        /* shadow head doorbell, 0 if not in use */
+    uint64_t    ei_addr;        /* EventIdx for db_addr */
+    NvmeRing    *ring;          /* RCU, NULL if not cached */
     QEMUTimer   *timer;
+    /* entries posted since the last interrupt, see Interrupt Coalescing */
+    uint32_t    irq_pending;
+    QEMUTimer   *irq_timer;
     QTAILQ_HEAD(, NvmeSQueue) sq_list;
     QTAILQ_HEAD(, NvmeRequest) req_list;
 } NvmeCQueue;
@@ -122,8 +149,30 @@ typedef struct NvmeFeatureVal {
         uint16_t temp_thresh_low;
     };
     uint32_t    async_config;
+    uint32_t    int_coalescing;
+    /* Interrupt Vector Configuration, Coalescing Disable bit per vector */
+    unsigned long *int_vc_cd;
 } NvmeFeatureVal;
 
+/*
+ * An event notifier tied to one queue: a doorbell ioeventfd (index is the
+ * doorbell register number) or an interrupt bounced to the main loop
+ * (index is the completion queue id).
+ *
+ * A doorbell ioeventfd is bound to the register when both wanted and
+ * enabled are set; wanted is changed by the queue code and enabled follows
+ * it under the BQL.  An interrupt notifier carries the vector and level to
+ * apply in irq.
+ */
+typedef struct NvmeQueueNotifier {
+    EventNotifier   notifier;
+    struct NvmeCtrl *ctrl;
+    uint16_t        index;
+    bool            wanted;
+    bool            enabled;
+    uint32_t        irq;
+} NvmeQueueNotifier;
+
 typedef struct NvmeCtrl {
     PCIDevice    parent_obj;
     MemoryRegion bar0;
@@ -174,6 +223,41 @@ typedef struct NvmeCtrl {
     NvmeNamespace   *namespaces[NVME_MAX_NAMESPACES];
     NvmeSQueue      **sq;
     NvmeCQueue      **cq;
+    /*
+     * Doorbell writes latched outside the BQL, one slot per doorbell
+     * register.  db_bh applies them under the BQL.  With an iothread, the
+     * iothread applies them instead, kicked through db_io_notifier, so
+     * that no lock is taken to ring them.
+     */
+    uint32_t        *db;
+    QEMUBH          *db_bh;
+    EventNotifier   db_io_notifier;
+
+    /*
+     * With an iothread, all queues, the admin queue included, run in its
+     * AioContext and queue state is only touched there, under the
+     * AioContext lock.  The main loop never takes that lock: register
+     * writes that change queue state are queued on reg_writes for reg_bh,
+     * interrupts are raised through irq_notifiers and doorbell ioeventfds
+     * are bound by db_ioeventfd_bh.
+     */
+    IOThread        *iothread;
+    AioContext      *ctx;
+    NvmeQueueNotifier *db_notifiers;
+    NvmeQueueNotifier *irq_notifiers;
+    QEMUBH          *db_ioeventfd_bh;
+    QemuMutex       reg_lock;
+    QSIMPLEQ_HEAD(, NvmeRegWrite) reg_writes;
+    QEMUBH          *reg_bh;
+
+    /* Remaps the queue rings when the bus master address space changes */
+    MemoryListener  dma_listener;
+    QEMUBH          *dma_bh;
+
+    /* Doorbell Buffer Config: shadow doorbells and EventIdx buffers */
+    bool            dbbuf_enabled;
+    uint64_t        dbbuf_dbs;
+    uint64_t        dbbuf_eis;
     NvmeSQueue      admin_sq;
     NvmeCQueue      admin_cq;
     NvmeIdCtrl      id_ctrl;
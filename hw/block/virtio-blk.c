@@ -36,6 +36,10 @@
 /* Config size before the discard support (hide associated config fields) */
 #define VIRTIO_BLK_CFG_SIZE offsetof(struct virtio_blk_config, \
                                      max_discard_sectors)
+
+/* Number of requests taken off the avail ring at a time */
+#define VIRTIO_BLK_POP_BATCH 16
+
 /*
  * Starting from the discard feature, we can use this array to properly
  * set the config size depending on the features enabled.
@@ -69,7 +73,7 @@ static void virtio_blk_init_request(VirtIOBlock *s, VirtQueue *vq,
 
 static void virtio_blk_free_request(VirtIOBlockReq *req)
 {
-    g_free(req);
+    virtqueue_element_free(&req->elem);
 }
 
 static void virtio_blk_req_complete(VirtIOBlockReq *req, unsigned char status)
@@ -90,6 +94,19 @@ static void virtio_blk_req_complete(VirtIOBlockReq *req, unsigned char status)
     }
 }
 
+/*
+ * The AioContext that processes @vq.  With an iothread-vq-mapping this
+ * differs between virtqueues, and requests complete where they were
+ * submitted.
+ */
+static AioContext *virtio_blk_vq_aio_context(VirtIOBlock *s, VirtQueue *vq)
+{
+    if (s->dataplane_started && !s->dataplane_disabled) {
+        return virtio_blk_data_plane_get_vq_aio_context(s->dataplane, vq);
+    }
+    return blk_get_aio_context(s->blk);
+}
+
 static int virtio_blk_handle_rw_error(VirtIOBlockReq *req, int error,
     bool is_read, bool acct_failed)
 {
@@ -119,8 +136,10 @@ static void virtio_blk_rw_complete(void *opaque, int ret)
     VirtIOBlockReq *next = opaque;
     VirtIOBlock *s = next->dev;
     VirtIODevice *vdev = VIRTIO_DEVICE(s);
+    /* Merged requests all come from the same virtqueue */
+    AioContext *ctx = virtio_blk_vq_aio_context(s, next->vq);
 
-    aio_context_acquire(blk_get_aio_context(s->conf.conf.blk));
+    aio_context_acquire(ctx);
     while (next) {
         VirtIOBlockReq *req = next;
         next = req->mr_next;
@@ -153,15 +172,16 @@ static void virtio_blk_rw_complete(void *opaque, int ret)
         block_acct_done(blk_get_stats(s->blk), &req->acct);
         virtio_blk_free_request(req);
     }
-    aio_context_release(blk_get_aio_context(s->conf.conf.blk));
+    aio_context_release(ctx);
 }
 
 static void virtio_blk_flush_complete(void *opaque, int ret)
 {
     VirtIOBlockReq *req = opaque;
     VirtIOBlock *s = req->dev;
+    AioContext *ctx = virtio_blk_vq_aio_context(s, req->vq);
 
-    aio_context_acquire(blk_get_aio_context(s->conf.conf.blk));
+    aio_context_acquire(ctx);
     if (ret) {
         if (virtio_blk_handle_rw_error(req, -ret, 0, true)) {
             goto out;
@@ -173,7 +193,7 @@ static void virtio_blk_flush_complete(void *opaque, int ret)
     virtio_blk_free_request(req);
 
 out:
-    aio_context_release(blk_get_aio_context(s->conf.conf.blk));
+    aio_context_release(ctx);
 }
 
 static void virtio_blk_discard_write_zeroes_complete(void *opaque, int ret)
@@ -182,8 +202,9 @@ static void virtio_blk_discard_write_zeroes_complete(void *opaque, int ret)
     VirtIOBlock *s = req->dev;
     bool is_write_zeroes = (virtio_ldl_p(VIRTIO_DEVICE(s), &req->out.type) &
                             ~VIRTIO_BLK_T_BARRIER) == VIRTIO_BLK_T_WRITE_ZEROES;
+    AioContext *ctx = virtio_blk_vq_aio_context(s, req->vq);
 
-    aio_context_acquire(blk_get_aio_context(s->conf.conf.blk));
+    aio_context_acquire(ctx);
     if (ret) {
         if (virtio_blk_handle_rw_error(req, -ret, false, is_write_zeroes)) {
             goto out;
@@ -197,7 +218,7 @@ static void virtio_blk_discard_write_zeroes_complete(void *opaque, int ret)
     virtio_blk_free_request(req);
 
 out:
-    aio_context_release(blk_get_aio_context(s->conf.conf.blk));
+    aio_context_release(ctx);
 }
 
 #ifdef __linux__
@@ -213,6 +234,7 @@ static void virtio_blk_ioctl_complete(void *opaque, int status)
     VirtIOBlockReq *req = ioctl_req->req;
     VirtIOBlock *s = req->dev;
     VirtIODevice *vdev = VIRTIO_DEVICE(s);
+    AioContext *ctx = virtio_blk_vq_aio_context(s, req->vq);
     struct virtio_scsi_inhdr *scsi;
     struct sg_io_hdr *hdr;
 
@@ -244,23 +266,27 @@ static void virtio_blk_ioctl_complete(void *opaque, int status)
     virtio_stl_p(vdev, &scsi->data_len, hdr->dxfer_len);
 
 out:
-    aio_context_acquire(blk_get_aio_context(s->conf.conf.blk));
+    aio_context_acquire(ctx);
     virtio_blk_req_complete(req, status);
     virtio_blk_free_request(req);
-    aio_context_release(blk_get_aio_context(s->conf.conf.blk));
+    aio_context_release(ctx);
     g_free(ioctl_req);
 }
 
 #endif
 
-static VirtIOBlockReq *virtio_blk_get_request(VirtIOBlock *s, VirtQueue *vq)
+/* Pop up to VIRTIO_BLK_POP_BATCH requests with one avail ring access */
+static unsigned int virtio_blk_get_requests(VirtIOBlock *s, VirtQueue *vq,
+                                            VirtIOBlockReq **reqs)
 {
-    VirtIOBlockReq *req = virtqueue_pop(vq, sizeof(VirtIOBlockReq));
+    unsigned int i, n;
 
-    if (req) {
-        virtio_blk_init_request(s, vq, req);
+    n = virtqueue_pop_batch(vq, sizeof(VirtIOBlockReq), (void **)reqs,
+                            VIRTIO_BLK_POP_BATCH);
+    for (i = 0; i < n; i++) {
+        virtio_blk_init_request(s, vq, reqs[i]);
     }
-    return req;
+    return n;
 }
 
 static int virtio_blk_handle_scsi_req(VirtIOBlockReq *req)
@@ -455,6 +481,7 @@ static void virtio_blk_submit_multireq(BlockBackend *blk, MultiReqBuffer *mrb)
     if (mrb->num_reqs == 1) {
         submit_requests(blk, mrb, 0, 1, -1);
         mrb->num_reqs = 0;
+        mrb->size = 0;
         return;
     }
 
@@ -495,6 +522,74 @@ static void virtio_blk_submit_multireq(BlockBackend *blk, MultiReqBuffer *mrb)
 
     submit_requests(blk, mrb, start, num_reqs, niov);
     mrb->num_reqs = 0;
+    mrb->size = 0;
+}
+
+/* At most one request per iovec can be merged */
+static unsigned int virtio_blk_max_merge_reqs(VirtIOBlock *s)
+{
+    return MIN(VIRTIO_BLK_MAX_MERGE_REQS, MAX(blk_get_max_iov(s->blk), 1));
+}
+
+/*
+ * Submit the requests held back by the merge window.  Called with the
+ * BlockBackend's AioContext held.
+ */
+void virtio_blk_flush_merge_window(VirtIOBlock *s)
+{
+    if (!s->merge_mrb) {
+        return;
+    }
+
+    if (s->merge_timer) {
+        timer_del(s->merge_timer);
+    }
+    if (s->merge_mrb->num_reqs) {
+        blk_io_plug(s->blk);
+        virtio_blk_submit_multireq(s->blk, s->merge_mrb);
+        blk_io_unplug(s->blk);
+    }
+}
+
+static void virtio_blk_merge_timer_cb(void *opaque)
+{
+    VirtIOBlock *s = opaque;
+    AioContext *ctx = blk_get_aio_context(s->blk);
+
+    aio_context_acquire(ctx);
+    virtio_blk_flush_merge_window(s);
+    aio_context_release(ctx);
+}
+
+/*
+ * Leave the requests in the merge window so that sequential requests from
+ * the next notifications, on any virtqueue, can still be merged with them.
+ * The window is armed by the first request and is not extended afterwards,
+ * so no request waits longer than merge-window-us.
+ */
+static void virtio_blk_arm_merge_window(VirtIOBlock *s)
+{
+    AioContext *ctx = blk_get_aio_context(s->blk);
+
+    /* A full transfer has nothing more to gain from waiting */
+    if (s->merge_mrb->size >= blk_get_max_transfer(s->blk) ||
+        s->merge_mrb->num_reqs >= virtio_blk_max_merge_reqs(s)) {
+        virtio_blk_flush_merge_window(s);
+        return;
+    }
+
+    if (s->merge_timer_ctx != ctx) {
+        if (s->merge_timer) {
+            timer_free(s->merge_timer);
+        }
+        s->merge_timer = aio_timer_new(ctx, QEMU_CLOCK_REALTIME, SCALE_US,
+                                       virtio_blk_merge_timer_cb, s);
+        s->merge_timer_ctx = ctx;
+    }
+    if (!timer_pending(s->merge_timer)) {
+        timer_mod(s->merge_timer, qemu_clock_get_us(QEMU_CLOCK_REALTIME) +
+                                  s->conf.merge_window_us);
+    }
 }
 
 static void virtio_blk_handle_flush(VirtIOBlockReq *req, MultiReqBuffer *mrb)
@@ -535,74 +630,177 @@ static bool virtio_blk_sect_range_ok(VirtIOBlock *dev,
     return true;
 }
 
+/* One block layer request of a multi-segment discard or write zeroes */
+typedef struct {
+    int64_t offset;
+    int64_t bytes;
+    int flags;
+} VirtIOBlockDwzRange;
+
+/* Completion state shared by the ranges of one request */
+typedef struct {
+    VirtIOBlockReq *req;
+    unsigned int pending;
+    int ret;
+} VirtIOBlockDwzAcb;
+
+static void virtio_blk_dwz_acb_put(VirtIOBlockDwzAcb *acb)
+{
+    if (qatomic_dec_fetch(&acb->pending) == 0) {
+        virtio_blk_discard_write_zeroes_complete(acb->req, acb->ret);
+        g_free(acb);
+    }
+}
+
+static void virtio_blk_dwz_range_complete(void *opaque, int ret)
+{
+    VirtIOBlockDwzAcb *acb = opaque;
+
+    if (ret) {
+        qatomic_cmpxchg(&acb->ret, 0, ret);
+    }
+    virtio_blk_dwz_acb_put(acb);
+}
+
+static int virtio_blk_dwz_range_compare(const void *a, const void *b)
+{
+    const VirtIOBlockDwzRange *r1 = a, *r2 = b;
+
+    if (r1->offset != r2->offset) {
+        return r1->offset < r2->offset ? -1 : 1;
+    }
+    return 0;
+}
+
+/*
+ * Sort the ranges and merge the ones that overlap or touch, as long as the
+ * flags agree and the result is still a valid block layer request.
+ * Returns the new number of ranges.
+ */
+static unsigned int virtio_blk_dwz_merge_ranges(VirtIOBlockDwzRange *ranges,
+                                                unsigned int n)
+{
+    unsigned int i, out = 0;
+
+    qsort(ranges, n, sizeof(*ranges), virtio_blk_dwz_range_compare);
+
+    for (i = 1; i < n; i++) {
+        VirtIOBlockDwzRange *cur = &ranges[out];
+        int64_t end = MAX(cur->offset + cur->bytes,
+                          ranges[i].offset + ranges[i].bytes);
+
+        if (ranges[i].offset <= cur->offset + cur->bytes &&
+            ranges[i].flags == cur->flags &&
+            end - cur->offset <= BDRV_REQUEST_MAX_BYTES) {
+            cur->bytes = end - cur->offset;
+        } else {
+            ranges[++out] = ranges[i];
+        }
+    }
+    return out + 1;
+}
+
+static void virtio_blk_dwz_submit(VirtIOBlock *s, VirtIOBlockDwzRange *range,
+                                  bool is_write_zeroes, BlockCompletionFunc *cb,
+                                  void *opaque)
+{
+    if (is_write_zeroes) {
+        blk_aio_pwrite_zeroes(s->blk, range->offset, range->bytes,
+                              range->flags, cb, opaque);
+    } else {
+        blk_aio_pdiscard(s->blk, range->offset, range->bytes, cb, opaque);
+    }
+}
+
 static uint8_t virtio_blk_handle_discard_write_zeroes(VirtIOBlockReq *req,
-    struct virtio_blk_discard_write_zeroes *dwz_hdr, bool is_write_zeroes)
+    struct virtio_blk_discard_write_zeroes *dwz_hdrs, unsigned int nseg,
+    bool is_write_zeroes)
 {
     VirtIOBlock *s = req->dev;
     VirtIODevice *vdev = VIRTIO_DEVICE(s);
+    g_autofree VirtIOBlockDwzRange *ranges = g_new(VirtIOBlockDwzRange, nseg);
+    VirtIOBlockDwzAcb *acb;
     uint64_t sector;
     uint32_t num_sectors, flags, max_sectors;
     uint8_t err_status;
+    int64_t total = 0;
+    unsigned int i, n;
     int bytes;
 
-    sector = virtio_ldq_p(vdev, &dwz_hdr->sector);
-    num_sectors = virtio_ldl_p(vdev, &dwz_hdr->num_sectors);
-    flags = virtio_ldl_p(vdev, &dwz_hdr->flags);
     max_sectors = is_write_zeroes ? s->conf.max_write_zeroes_sectors :
                   s->conf.max_discard_sectors;
 
-    /*
-     * max_sectors is at most BDRV_REQUEST_MAX_SECTORS, this check
-     * make us sure that "num_sectors << BDRV_SECTOR_BITS" can fit in
-     * the integer variable.
-     */
-    if (unlikely(num_sectors > max_sectors)) {
-        err_status = VIRTIO_BLK_S_IOERR;
-        goto err;
-    }
-
-    bytes = num_sectors << BDRV_SECTOR_BITS;
-
-    if (unlikely(!virtio_blk_sect_range_ok(s, sector, bytes))) {
-        err_status = VIRTIO_BLK_S_IOERR;
-        goto err;
-    }
+    /* Check all segments before any of them is submitted */
+    for (i = 0; i < nseg; i++) {
+        sector = virtio_ldq_p(vdev, &dwz_hdrs[i].sector);
+        num_sectors = virtio_ldl_p(vdev, &dwz_hdrs[i].num_sectors);
+        flags = virtio_ldl_p(vdev, &dwz_hdrs[i].flags);
 
-    /*
-     * The device MUST set the status byte to VIRTIO_BLK_S_UNSUPP for discard
-     * and write zeroes commands if any unknown flag is set.
-     */
-    if (unlikely(flags & ~VIRTIO_BLK_WRITE_ZEROES_FLAG_UNMAP)) {
-        err_status = VIRTIO_BLK_S_UNSUPP;
-        goto err;
-    }
+        /*
+         * max_sectors is at most BDRV_REQUEST_MAX_SECTORS, this check
+         * make us sure that "num_sectors << BDRV_SECTOR_BITS" can fit in
+         * the integer variable.
+         */
+        if (unlikely(num_sectors > max_sectors)) {
+            err_status = VIRTIO_BLK_S_IOERR;
+            goto err;
+        }
 
-    if (is_write_zeroes) { /* VIRTIO_BLK_T_WRITE_ZEROES */
-        int blk_aio_flags = 0;
+        bytes = num_sectors << BDRV_SECTOR_BITS;
 
-        if (flags & VIRTIO_BLK_WRITE_ZEROES_FLAG_UNMAP) {
-            blk_aio_flags |= BDRV_REQ_MAY_UNMAP;
+        if (unlikely(!virtio_blk_sect_range_ok(s, sector, bytes))) {
+            err_status = VIRTIO_BLK_S_IOERR;
+            goto err;
         }
 
-        block_acct_start(blk_get_stats(s->blk), &req->acct, bytes,
-                         BLOCK_ACCT_WRITE);
+        /*
+         * The device MUST set the status byte to VIRTIO_BLK_S_UNSUPP for
+         * discard and write zeroes commands if any unknown flag is set.
+         */
+        if (unlikely(flags & ~VIRTIO_BLK_WRITE_ZEROES_FLAG_UNMAP)) {
+            err_status = VIRTIO_BLK_S_UNSUPP;
+            goto err;
+        }
 
-        blk_aio_pwrite_zeroes(s->blk, sector << BDRV_SECTOR_BITS,
-                              bytes, blk_aio_flags,
-                              virtio_blk_discard_write_zeroes_complete, req);
-    } else { /* VIRTIO_BLK_T_DISCARD */
         /*
          * The device MUST set the status byte to VIRTIO_BLK_S_UNSUPP for
          * discard commands if the unmap flag is set.
          */
-        if (unlikely(flags & VIRTIO_BLK_WRITE_ZEROES_FLAG_UNMAP)) {
+        if (unlikely(!is_write_zeroes &&
+                     (flags & VIRTIO_BLK_WRITE_ZEROES_FLAG_UNMAP))) {
             err_status = VIRTIO_BLK_S_UNSUPP;
             goto err;
         }
 
-        blk_aio_pdiscard(s->blk, sector << BDRV_SECTOR_BITS, bytes,
-                         virtio_blk_discard_write_zeroes_complete, req);
+        ranges[i].offset = sector << BDRV_SECTOR_BITS;
+        ranges[i].bytes = bytes;
+        ranges[i].flags = (flags & VIRTIO_BLK_WRITE_ZEROES_FLAG_UNMAP) ?
+                          BDRV_REQ_MAY_UNMAP : 0;
+        total += bytes;
+    }
+
+    if (is_write_zeroes) {
+        block_acct_start(blk_get_stats(s->blk), &req->acct, total,
+                         BLOCK_ACCT_WRITE);
+    }
+
+    n = nseg > 1 ? virtio_blk_dwz_merge_ranges(ranges, nseg) : 1;
+    if (n == 1) {
+        virtio_blk_dwz_submit(s, &ranges[0], is_write_zeroes,
+                              virtio_blk_discard_write_zeroes_complete, req);
+        return VIRTIO_BLK_S_OK;
+    }
+
+    /* The extra reference keeps the request alive until all are submitted */
+    acb = g_new(VirtIOBlockDwzAcb, 1);
+    acb->req = req;
+    acb->pending = n + 1;
+    acb->ret = 0;
+    for (i = 0; i < n; i++) {
+        virtio_blk_dwz_submit(s, &ranges[i], is_write_zeroes,
+                              virtio_blk_dwz_range_complete, acb);
     }
+    virtio_blk_dwz_acb_put(acb);
 
     return VIRTIO_BLK_S_OK;
 
@@ -685,14 +883,16 @@ static int virtio_blk_handle_request(VirtIOBlockReq *req, MultiReqBuffer *mrb)
 
         /* merge would exceed maximum number of requests or IO direction
          * changes */
-        if (mrb->num_reqs > 0 && (mrb->num_reqs == VIRTIO_BLK_MAX_MERGE_REQS ||
-                                  is_write != mrb->is_write ||
-                                  !s->conf.request_merging)) {
+        if (mrb->num_reqs > 0 &&
+            (mrb->num_reqs >= virtio_blk_max_merge_reqs(s) ||
+             is_write != mrb->is_write ||
+             !s->conf.request_merging)) {
             virtio_blk_submit_multireq(s->blk, mrb);
         }
 
         assert(mrb->num_reqs < VIRTIO_BLK_MAX_MERGE_REQS);
         mrb->reqs[mrb->num_reqs++] = req;
+        mrb->size += req->qiov.size;
         mrb->is_write = is_write;
         break;
     }
@@ -726,24 +926,29 @@ static int virtio_blk_handle_request(VirtIOBlockReq *req, MultiReqBuffer *mrb)
     case VIRTIO_BLK_T_WRITE_ZEROES & ~VIRTIO_BLK_T_OUT:
     {
         struct virtio_blk_discard_write_zeroes dwz_hdr;
+        g_autofree struct virtio_blk_discard_write_zeroes *dwz_alloc = NULL;
+        struct virtio_blk_discard_write_zeroes *dwz_hdrs = &dwz_hdr;
         size_t out_len = iov_size(out_iov, out_num);
         bool is_write_zeroes = (type & ~VIRTIO_BLK_T_BARRIER) ==
                                VIRTIO_BLK_T_WRITE_ZEROES;
+        uint32_t max_seg = is_write_zeroes ? s->conf.max_write_zeroes_seg :
+                           s->conf.max_discard_seg;
+        unsigned int nseg = out_len / sizeof(dwz_hdr);
         uint8_t err_status;
 
         /*
          * Unsupported if VIRTIO_BLK_T_OUT is not set or the request contains
-         * more than one segment.
+         * more segments than advertised, or a partial segment.
          */
         if (unlikely(!(type & VIRTIO_BLK_T_OUT) ||
-                     out_len > sizeof(dwz_hdr))) {
+                     out_len > (size_t)max_seg * sizeof(dwz_hdr) ||
+                     (nseg && out_len % sizeof(dwz_hdr)))) {
             virtio_blk_req_complete(req, VIRTIO_BLK_S_UNSUPP);
             virtio_blk_free_request(req);
             return 0;
         }
 
-        if (unlikely(iov_to_buf(out_iov, out_num, 0, &dwz_hdr,
-                                sizeof(dwz_hdr)) != sizeof(dwz_hdr))) {
+        if (unlikely(nseg == 0)) {
             iov_discard_undo(&req->inhdr_undo);
             iov_discard_undo(&req->outhdr_undo);
             virtio_error(vdev, "virtio-blk discard/write_zeroes header"
@@ -751,7 +956,12 @@ static int virtio_blk_handle_request(VirtIOBlockReq *req, MultiReqBuffer *mrb)
             return -1;
         }
 
-        err_status = virtio_blk_handle_discard_write_zeroes(req, &dwz_hdr,
+        if (nseg > 1) {
+            dwz_alloc = g_new(struct virtio_blk_discard_write_zeroes, nseg);
+            dwz_hdrs = dwz_alloc;
+        }
+        iov_to_buf(out_iov, out_num, 0, dwz_hdrs, out_len);
+        err_status = virtio_blk_handle_discard_write_zeroes(req, dwz_hdrs, nseg,
                                                             is_write_zeroes);
         if (err_status != VIRTIO_BLK_S_OK) {
             virtio_blk_req_complete(req, err_status);
@@ -769,12 +979,15 @@ static int virtio_blk_handle_request(VirtIOBlockReq *req, MultiReqBuffer *mrb)
 
 bool virtio_blk_handle_vq(VirtIOBlock *s, VirtQueue *vq)
 {
-    VirtIOBlockReq *req;
-    MultiReqBuffer mrb = {};
+    VirtIOBlockReq *reqs[VIRTIO_BLK_POP_BATCH];
+    MultiReqBuffer local_mrb = {};
+    MultiReqBuffer *mrb = s->merge_mrb ?: &local_mrb;
     bool suppress_notifications = virtio_queue_get_notification(vq);
     bool progress = false;
+    AioContext *ctx = virtio_blk_vq_aio_context(s, vq);
+    unsigned int i, n;
 
-    aio_context_acquire(blk_get_aio_context(s->blk));
+    aio_context_acquire(ctx);
     blk_io_plug(s->blk);
 
     do {
@@ -782,11 +995,19 @@ bool virtio_blk_handle_vq(VirtIOBlock *s, VirtQueue *vq)
             virtio_queue_set_notification(vq, 0);
         }
 
-        while ((req = virtio_blk_get_request(s, vq))) {
+        while ((n = virtio_blk_get_requests(s, vq, reqs))) {
             progress = true;
-            if (virtio_blk_handle_request(req, &mrb)) {
-                virtqueue_detach_element(req->vq, &req->elem, 0);
-                virtio_blk_free_request(req);
+            for (i = 0; i < n; i++) {
+                if (virtio_blk_handle_request(reqs[i], mrb)) {
+                    break;
+                }
+            }
+            if (i < n) {
+                /* The device is broken, drop the rest of the batch too */
+                for (; i < n; i++) {
+                    virtqueue_detach_element(vq, &reqs[i]->elem, 0);
+                    virtio_blk_free_request(reqs[i]);
+                }
                 break;
             }
         }
@@ -796,12 +1017,16 @@ bool virtio_blk_handle_vq(VirtIOBlock *s, VirtQueue *vq)
         }
     } while (!virtio_queue_empty(vq));
 
-    if (mrb.num_reqs) {
-        virtio_blk_submit_multireq(s->blk, &mrb);
+    if (mrb->num_reqs) {
+        if (mrb == &local_mrb) {
+            virtio_blk_submit_multireq(s->blk, mrb);
+        } else {
+            virtio_blk_arm_merge_window(s);
+        }
     }
 
     blk_io_unplug(s->blk);
-    aio_context_release(blk_get_aio_context(s->blk));
+    aio_context_release(ctx);
     return progress;
 }
 
@@ -834,6 +1059,7 @@ void virtio_blk_process_queued_requests(VirtIOBlock *s, bool is_bh)
     s->rq = NULL;
 
     aio_context_acquire(blk_get_aio_context(s->conf.conf.blk));
+    virtio_blk_flush_merge_window(s);
     while (req) {
         VirtIOBlockReq *next = req->next;
         if (virtio_blk_handle_request(req, &mrb)) {
@@ -878,6 +1104,12 @@ static void virtio_blk_dma_restart_cb(void *opaque, int running,
     VirtioBusState *bus = VIRTIO_BUS(qbus);
 
     if (!running) {
+        /* Let the drain that follows see the held back requests */
+        AioContext *ctx = blk_get_aio_context(s->conf.conf.blk);
+
+        aio_context_acquire(ctx);
+        virtio_blk_flush_merge_window(s);
+        aio_context_release(ctx);
         return;
     }
 
@@ -901,6 +1133,7 @@ static void virtio_blk_reset(VirtIODevice *vdev)
 
     ctx = blk_get_aio_context(s->blk);
     aio_context_acquire(ctx);
+    virtio_blk_flush_merge_window(s);
     blk_drain(s->blk);
 
     /* We drop queued requests after blk_drain() because blk_drain() itself can
@@ -966,18 +1199,14 @@ static void virtio_blk_update_config(VirtIODevice *vdev, uint8_t *config)
                      s->conf.max_discard_sectors);
         virtio_stl_p(vdev, &blkcfg.discard_sector_alignment,
                      blk_size >> BDRV_SECTOR_BITS);
-        /*
-         * We support only one segment per request since multiple segments
-         * are not widely used and there are no userspace APIs that allow
-         * applications to submit multiple segments in a single call.
-         */
-        virtio_stl_p(vdev, &blkcfg.max_discard_seg, 1);
+        virtio_stl_p(vdev, &blkcfg.max_discard_seg, s->conf.max_discard_seg);
     }
     if (virtio_has_feature(s->host_features, VIRTIO_BLK_F_WRITE_ZEROES)) {
         virtio_stl_p(vdev, &blkcfg.max_write_zeroes_sectors,
                      s->conf.max_write_zeroes_sectors);
         blkcfg.write_zeroes_may_unmap = 1;
-        virtio_stl_p(vdev, &blkcfg.max_write_zeroes_seg, 1);
+        virtio_stl_p(vdev, &blkcfg.max_write_zeroes_seg,
+                     s->conf.max_write_zeroes_seg);
     }
     memcpy(config, &blkcfg, s->config_size);
 }
@@ -1134,8 +1363,89 @@ static void virtio_blk_resize(void *opaque)
     aio_bh_schedule_oneshot(qemu_get_aio_context(), virtio_resize_cb, vdev);
 }
 
+/*
+ * Stopping the dataplane drains in-flight requests and detaches the
+ * virtqueues from the old iothreads, starting it again attaches the
+ * BlockBackend to the new AioContext and kicks the virtqueues so that
+ * requests submitted in the meantime are not lost.  On failure the device
+ * stays where it was and its properties are left alone.
+ */
+static void virtio_blk_set_iothread(void *opaque, const char *iothread_id,
+                                    const char *vq_mapping, Error **errp)
+{
+    VirtIOBlock *s = VIRTIO_BLK(opaque);
+    VirtIOBlkConf *conf = &s->conf;
+    VirtioBusState *bus = VIRTIO_BUS(qdev_get_parent_bus(DEVICE(s)));
+    VirtioBusClass *k = VIRTIO_BUS_GET_CLASS(bus);
+    IOThread *iothread = NULL;
+    bool started;
+    int r;
+
+    if (!s->dataplane || !k->set_guest_notifiers) {
+        error_setg(errp, "device is incompatible with iothread "
+                   "(transport does not support notifiers)");
+        return;
+    }
+    if (vq_mapping && conf->merge_window_us) {
+        error_setg(errp, "merge-window-us cannot be used with "
+                   "iothread-vq-mapping");
+        return;
+    }
+    if (iothread_id) {
+        iothread = iothread_by_id(iothread_id);
+        if (!iothread) {
+            error_setg(errp, "Cannot find iothread %s", iothread_id);
+            return;
+        }
+    }
+    if ((iothread || vq_mapping) &&
+        !conf->iothread && !conf->iothread_vq_mapping &&
+        blk_op_is_blocked(s->blk, BLOCK_OP_TYPE_DATAPLANE, errp)) {
+        error_prepend(errp, "cannot start virtio-blk dataplane: ");
+        return;
+    }
+
+    started = bus->ioeventfd_started;
+    virtio_bus_stop_ioeventfd(bus);
+
+    if (!virtio_blk_data_plane_set_iothread(s->dataplane, iothread,
+                                            vq_mapping, errp)) {
+        if (started) {
+            virtio_bus_start_ioeventfd(bus);
+        }
+        return;
+    }
+
+    if (started) {
+        r = virtio_bus_start_ioeventfd(bus);
+        if (r < 0) {
+            error_setg_errno(errp, -r, "cannot start virtio-blk dataplane "
+                             "in the new iothread");
+            /* Clear the failed start, then go back to the old iothread */
+            virtio_blk_data_plane_stop(VIRTIO_DEVICE(s));
+            virtio_blk_data_plane_set_iothread(s->dataplane, conf->iothread,
+                                               conf->iothread_vq_mapping,
+                                               NULL);
+            virtio_bus_start_ioeventfd(bus);
+            return;
+        }
+    }
+
+    /* Keep the properties in sync, the link holds a reference */
+    if (iothread) {
+        object_ref(OBJECT(iothread));
+    }
+    if (conf->iothread) {
+        object_unref(OBJECT(conf->iothread));
+    }
+    conf->iothread = iothread;
+    g_free(conf->iothread_vq_mapping);
+    conf->iothread_vq_mapping = g_strdup(vq_mapping);
+}
+
 static const BlockDevOps virtio_block_ops = {
     .resize_cb = virtio_blk_resize,
+    .set_iothread_cb = virtio_blk_set_iothread,
 };
 
 static void virtio_blk_device_realize(DeviceState *dev, Error **errp)
@@ -1207,16 +1517,37 @@ static void virtio_blk_device_realize(DeviceState *dev, Error **errp)
         return;
     }
 
+    if (conf->max_discard_seg < 1 ||
+        conf->max_discard_seg > VIRTIO_BLK_MAX_DWZ_SEG ||
+        conf->max_write_zeroes_seg < 1 ||
+        conf->max_write_zeroes_seg > VIRTIO_BLK_MAX_DWZ_SEG) {
+        error_setg(errp, "max-discard-seg and max-write-zeroes-seg must be "
+                   "between 1 and %d", VIRTIO_BLK_MAX_DWZ_SEG);
+        return;
+    }
+
+    if (conf->merge_window_us && conf->iothread_vq_mapping) {
+        error_setg(errp, "merge-window-us cannot be used with "
+                   "iothread-vq-mapping");
+        return;
+    }
+
     virtio_blk_set_config_size(s, s->host_features);
 
     virtio_init(vdev, "virtio-blk", VIRTIO_ID_BLOCK, s->config_size);
 
     s->blk = conf->conf.blk;
     s->rq = NULL;
+    if (conf->merge_window_us && conf->request_merging) {
+        s->merge_mrb = g_new0(MultiReqBuffer, 1);
+    }
     s->sector_mask = (s->conf.conf.logical_block_size / BDRV_SECTOR_SIZE) - 1;
 
     for (i = 0; i < conf->num_queues; i++) {
-        virtio_add_queue(vdev, conf->queue_size, virtio_blk_handle_output);
+        VirtQueue *vq = virtio_add_queue(vdev, conf->queue_size,
+                                         virtio_blk_handle_output);
+
+        virtio_queue_enable_element_pool(vq, sizeof(VirtIOBlockReq));
     }
     virtio_blk_data_plane_create(vdev, conf, &s->dataplane, &err);
     if (err != NULL) {
@@ -1224,6 +1555,8 @@ static void virtio_blk_device_realize(DeviceState *dev, Error **errp)
         for (i = 0; i < conf->num_queues; i++) {
             virtio_del_queue(vdev, i);
         }
+        g_free(s->merge_mrb);
+        s->merge_mrb = NULL;
         virtio_cleanup(vdev);
         return;
     }
@@ -1245,8 +1578,12 @@ static void virtio_blk_device_unrealize(DeviceState *dev)
     VirtIODevice *vdev = VIRTIO_DEVICE(dev);
     VirtIOBlock *s = VIRTIO_BLK(dev);
     VirtIOBlkConf *conf = &s->conf;
+    AioContext *ctx = blk_get_aio_context(s->blk);
     unsigned i;
 
+    aio_context_acquire(ctx);
+    virtio_blk_flush_merge_window(s);
+    aio_context_release(ctx);
     blk_drain(s->blk);
     del_boot_device_lchs(dev, "/disk@0,0");
     virtio_blk_data_plane_destroy(s->dataplane);
@@ -1255,6 +1592,12 @@ static void virtio_blk_device_unrealize(DeviceState *dev)
         virtio_del_queue(vdev, i);
     }
     qemu_del_vm_change_state_handler(s->change);
+    if (s->merge_timer) {
+        timer_free(s->merge_timer);
+        s->merge_timer = NULL;
+    }
+    g_free(s->merge_mrb);
+    s->merge_mrb = NULL;
     blockdev_mark_auto_del(s->blk);
     virtio_cleanup(vdev);
 }
@@ -1291,20 +1634,29 @@ static Property virtio_blk_properties[] = {
 #endif
     DEFINE_PROP_BIT("request-merging", VirtIOBlock, conf.request_merging, 0,
                     true),
+    DEFINE_PROP_UINT32("merge-window-us", VirtIOBlock, conf.merge_window_us, 0),
     DEFINE_PROP_UINT16("num-queues", VirtIOBlock, conf.num_queues,
                        VIRTIO_BLK_AUTO_NUM_QUEUES),
     DEFINE_PROP_UINT16("queue-size", VirtIOBlock, conf.queue_size, 256),
     DEFINE_PROP_BOOL("seg-max-adjust", VirtIOBlock, conf.seg_max_adjust, true),
     DEFINE_PROP_LINK("iothread", VirtIOBlock, conf.iothread, TYPE_IOTHREAD,
                      IOThread *),
+    DEFINE_PROP_STRING("iothread-vq-mapping", VirtIOBlock,
+                       conf.iothread_vq_mapping),
     DEFINE_PROP_BIT64("discard", VirtIOBlock, host_features,
                       VIRTIO_BLK_F_DISCARD, true),
     DEFINE_PROP_BIT64("write-zeroes", VirtIOBlock, host_features,
                       VIRTIO_BLK_F_WRITE_ZEROES, true),
+    DEFINE_PROP_BIT64("in_order", VirtIOBlock, host_features,
+                      VIRTIO_F_IN_ORDER, true),
     DEFINE_PROP_UINT32("max-discard-sectors", VirtIOBlock,
                        conf.max_discard_sectors, BDRV_REQUEST_MAX_SECTORS),
     DEFINE_PROP_UINT32("max-write-zeroes-sectors", VirtIOBlock,
                        conf.max_write_zeroes_sectors, BDRV_REQUEST_MAX_SECTORS),
+    DEFINE_PROP_UINT32("max-discard-seg", VirtIOBlock, conf.max_discard_seg,
+                       VIRTIO_BLK_DEFAULT_DWZ_SEG),
+    DEFINE_PROP_UINT32("max-write-zeroes-seg", VirtIOBlock,
+                       conf.max_write_zeroes_seg, VIRTIO_BLK_DEFAULT_DWZ_SEG),
     DEFINE_PROP_BOOL("x-enable-wce-if-config-wce", VirtIOBlock,
                      conf.x_enable_wce_if_config_wce, true),
     DEFINE_PROP_END_OF_LIST(),
@@ -34,6 +34,7 @@
 #include "sysemu/reset.h"
 #include "sysemu/runstate.h"
 #include "qemu/error-report.h"
+#include "qemu/main-loop.h"
 #include "trace.h"
 #include "hw/qdev-properties.h"
 #include "hw/qdev-properties-system.h"
@@ -229,6 +230,76 @@ static gboolean serial_watch_cb(GIOChannel *chan, GIOCondition cond,
     return FALSE;
 }
 
+/*
+ * With "x-tx-batch", transmitted bytes are collected and written to the
+ * chardev from a bottom half, or when the buffer is full, instead of one
+ * write per byte.  Whatever the chardev does not take is written from a
+ * watch; the guest only sees the transmitter stall while the buffer is
+ * full.
+ */
+static gboolean serial_tx_watch_cb(GIOChannel *chan, GIOCondition cond,
+                                   void *opaque);
+
+static void serial_tx_flush(SerialState *s)
+{
+    int rc;
+
+    if (!s->tx_len || s->tx_watch_tag) {
+        return;
+    }
+
+    rc = qemu_chr_fe_write(&s->chr, s->tx_buf, s->tx_len);
+    if (rc > 0) {
+        s->tx_len -= rc;
+        memmove(s->tx_buf, s->tx_buf + rc, s->tx_len);
+    } else if (rc < 0 && errno != EAGAIN) {
+        s->tx_len = 0;
+    }
+    if (s->tx_len) {
+        s->tx_watch_tag = qemu_chr_fe_add_watch(&s->chr, G_IO_OUT | G_IO_HUP,
+                                                serial_tx_watch_cb, s);
+        if (!s->tx_watch_tag) {
+            /* nothing will tell us when the chardev can take more */
+            s->tx_len = 0;
+        }
+    }
+}
+
+static gboolean serial_tx_watch_cb(GIOChannel *chan, GIOCondition cond,
+                                   void *opaque)
+{
+    SerialState *s = opaque;
+
+    s->tx_watch_tag = 0;
+    serial_tx_flush(s);
+    if (s->tsr_retry && s->tx_len < sizeof(s->tx_buf)) {
+        /* the transmitter stalled on a full buffer */
+        serial_xmit(s);
+    }
+    return FALSE;
+}
+
+static void serial_tx_bh(void *opaque)
+{
+    serial_tx_flush(opaque);
+}
+
+/* Returns false if the buffer is full and @chr must be sent again later */
+static bool serial_tx_batch(SerialState *s, uint8_t chr)
+{
+    if (s->tx_len == sizeof(s->tx_buf)) {
+        return false;
+    }
+    if (!s->tx_len) {
+        qemu_bh_schedule(s->tx_bh);
+    }
+    s->tx_buf[s->tx_len++] = chr;
+    if (s->tx_len == sizeof(s->tx_buf)) {
+        serial_tx_flush(s);
+    }
+    return true;
+}
+
 static void serial_xmit(SerialState *s)
 {
     do {
@@ -255,6 +326,12 @@ static void serial_xmit(SerialState *s)
         if (s->mcr & UART_MCR_LOOP) {
             /* in loopback mode, say that we just received a char */
             serial_receive1(s, &s->tsr, 1);
+        } else if (s->tx_batch) {
+            if (!serial_tx_batch(s, s->tsr)) {
+                /* serial_tx_watch_cb() retries once the buffer drains */
+                s->tsr_retry = 1;
+                return;
+            }
         } else {
             int rc = qemu_chr_fe_write(&s->chr, &s->tsr, 1);
 
@@ -436,6 +513,7 @@ static void serial_ioport_write(void *opaque, hwaddr addr, uint64_t val,
             break_enable = (val >> 6) & 1;
             if (break_enable != s->last_break_enable) {
                 s->last_break_enable = break_enable;
+                serial_tx_flush(s);
                 qemu_chr_fe_ioctl(&s->chr, CHR_IOCTL_SERIAL_SET_BREAK,
                                   &break_enable);
             }
@@ -632,6 +710,7 @@ static int serial_pre_save(void *opaque)
 {
     SerialState *s = opaque;
     s->fcr_vmstate = s->fcr;
+    serial_tx_flush(s);
 
     return 0;
 }
@@ -859,6 +938,7 @@ static void serial_reset(void *opaque)
         g_source_remove(s->watch_tag);
         s->watch_tag = 0;
     }
+    serial_tx_flush(s);
 
     s->rbr = 0;
     s->ier = 0;
@@ -926,6 +1006,7 @@ static void serial_realize(DeviceState *dev, Error **errp)
     s->modem_status_poll = timer_new_ns(QEMU_CLOCK_VIRTUAL, (QEMUTimerCB *) serial_update_msl, s);
 
     s->fifo_timeout_timer = timer_new_ns(QEMU_CLOCK_VIRTUAL, (QEMUTimerCB *) fifo_timeout_int, s);
+    s->tx_bh = qemu_bh_new(serial_tx_bh, s);
     qemu_register_reset(serial_reset, s);
 
     qemu_chr_fe_set_handlers(&s->chr, serial_can_receive1, serial_receive1,
@@ -939,6 +1020,12 @@ static void serial_unrealize(DeviceState *dev)
 {
     SerialState *s = SERIAL(dev);
 
+    serial_tx_flush(s);
+    if (s->tx_watch_tag) {
+        g_source_remove(s->tx_watch_tag);
+        s->tx_watch_tag = 0;
+    }
+    qemu_bh_delete(s->tx_bh);
     qemu_chr_fe_deinit(&s->chr, false);
 
     timer_free(s->modem_status_poll);
@@ -972,6 +1059,7 @@ static Property serial_properties[] = {
     DEFINE_PROP_CHR("chardev", SerialState, chr),
     DEFINE_PROP_UINT32("baudbase", SerialState, baudbase, 115200),
     DEFINE_PROP_BOOL("wakeup", SerialState, wakeup, false),
+    DEFINE_PROP_BOOL("x-tx-batch", SerialState, tx_batch, false),
     DEFINE_PROP_END_OF_LIST(),
 };
 
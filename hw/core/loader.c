@@ -61,6 +61,7 @@
 #include "hw/boards.h"
 #include "qemu/cutils.h"
 #include "sysemu/runstate.h"
+#include "migration/postcopy-ram.h"
 
 #include <zlib.h>
 
@@ -944,9 +945,11 @@ int rom_add_file(const char *file, const char *fw_dir,
                  AddressSpace *as)
 {
     MachineClass *mc = MACHINE_GET_CLASS(qdev_get_machine());
+    MachineState *ms = MACHINE(qdev_get_machine());
     Rom *rom;
     int rc, fd = -1;
     char devpath[100];
+    GError *gerr = NULL;
 
     if (as && mr) {
         fprintf(stderr, "Specifying an Address Space and Memory Region is " \
@@ -983,13 +986,30 @@ int rom_add_file(const char *file, const char *fw_dir,
     }
 
     rom->datasize = rom->romsize;
-    rom->data     = g_malloc0(rom->datasize);
-    lseek(fd, 0, SEEK_SET);
-    rc = read(fd, rom->data, rom->datasize);
-    if (rc != rom->datasize) {
-        fprintf(stderr, "rom: file %-20s: read error: rc=%d (expected %zd)\n",
-                rom->name, rc, rom->datasize);
-        goto err;
+    if (ms->share_rom) {
+        /*
+         * Map the file instead of reading it, so that firmware which is
+         * never written stays shared in the page cache with other QEMU
+         * processes.  The mapping is private, so writes to rom->data stay
+         * in this process.
+         */
+        rom->mapped_file = g_mapped_file_new_from_fd(fd, TRUE, &gerr);
+        if (!rom->mapped_file) {
+            fprintf(stderr, "rom: file %-20s: map error: %s\n",
+                    rom->name, gerr->message);
+            g_error_free(gerr);
+            goto err;
+        }
+        rom->data = (uint8_t *)g_mapped_file_get_contents(rom->mapped_file);
+    } else {
+        rom->data = g_malloc0(rom->datasize);
+        lseek(fd, 0, SEEK_SET);
+        rc = read(fd, rom->data, rom->datasize);
+        if (rc != rom->datasize) {
+            fprintf(stderr, "rom: file %-20s: read error: rc=%d "
+                    "(expected %zd)\n", rom->name, rc, rom->datasize);
+            goto err;
+        }
     }
     close(fd);
     rom_insert(rom);
@@ -1035,6 +1055,95 @@ err:
     return -1;
 }
 
+#ifdef CONFIG_POSIX
+/*
+ * userfaultfd cannot register the private file mappings of shared ROMs,
+ * so postcopy would only fail on the destination once the source has
+ * stopped.  Refuse it when the destination probes for postcopy support,
+ * which happens before precopy even starts.
+ */
+static int rom_shared_postcopy_notify(NotifierWithReturn *notifier,
+                                      void *opaque)
+{
+    struct PostcopyNotifyData *pnd = opaque;
+
+    if (pnd->reason == POSTCOPY_NOTIFY_PROBE) {
+        error_setg(pnd->errp, "Postcopy is not supported with share-rom=on");
+        return -ENOTSUP;
+    }
+    return 0;
+}
+
+static NotifierWithReturn rom_shared_postcopy_notifier = {
+    .notify = rom_shared_postcopy_notify,
+};
+#endif
+
+int rom_add_file_shared(const char *file, MemoryRegion *mr, const char *name,
+                        uint64_t size, Error **errp)
+{
+#ifdef CONFIG_POSIX
+    static bool postcopy_blocked;
+    Error *local_err = NULL;
+    Rom *rom;
+    off_t file_size;
+    int fd;
+
+    rom = g_malloc0(sizeof(*rom));
+    rom->name = g_strdup(file);
+    rom->path = qemu_find_file(QEMU_FILE_TYPE_BIOS, rom->name);
+    if (rom->path == NULL) {
+        rom->path = g_strdup(file);
+    }
+
+    fd = open(rom->path, O_RDONLY | O_BINARY);
+    if (fd == -1) {
+        error_setg_errno(errp, errno, "Could not open ROM '%s'", rom->path);
+        goto err;
+    }
+    file_size = lseek(fd, 0, SEEK_END);
+    if (file_size != size) {
+        error_setg(errp, "ROM '%s' has size %" PRId64 ", expected %" PRIu64,
+                   rom->path, (int64_t)file_size, size);
+        goto err;
+    }
+
+    /*
+     * A private mapping keeps the pages shared with the page cache, and
+     * lets incoming migration write to the RAM block like to any other.
+     */
+    memory_region_init_ram_from_fd(mr, NULL, name, size, false, fd, 0,
+                                   &local_err);
+    if (local_err) {
+        error_propagate(errp, local_err);
+        goto err;
+    }
+    vmstate_register_ram_global(mr);
+
+    /* Nothing to load at reset, the region already has the contents */
+    rom->mr = mr;
+    rom->romsize = size;
+    rom_insert(rom);
+    trace_loader_rom_shared(rom->name, rom->path, size);
+
+    if (!postcopy_blocked) {
+        postcopy_add_notifier(&rom_shared_postcopy_notifier);
+        postcopy_blocked = true;
+    }
+    return 0;
+
+err:
+    if (fd != -1) {
+        close(fd);
+    }
+    rom_free(rom);
+    return -1;
+#else
+    error_setg(errp, "Shared ROM mappings are not supported on this host");
+    return -1;
+#endif
+}
+
 MemoryRegion *rom_add_blob(const char *name, const void *blob, size_t len,
                    size_t max_len, hwaddr addr, const char *fw_file_name,
                    FWCfgCallback fw_callback, void *callback_opaque,
@@ -26,6 +26,7 @@
 #include "sysemu/reset.h"
 #include "sysemu/runstate.h"
 #include "sysemu/numa.h"
+#include "sysemu/mem-merge.h"
 #include "qemu/error-report.h"
 #include "sysemu/qtest.h"
 #include "hw/pci/pci.h"
@@ -35,10 +36,17 @@
 #include "exec/confidential-guest-support.h"
 #include "hw/virtio/virtio.h"
 #include "hw/virtio/virtio-pci.h"
+#include "block/thread-pool.h"
+#include "qemu/main-loop.h"
+#include "trace.h"
 
 GlobalProperty hw_compat_5_2[] = {
     { "ICH9-LPC", "smm-compat", "on"},
     { "PIIX4_PM", "smm-compat", "on"},
+    { "virtio-blk-device", "in_order", "off" },
+    { "virtio-blk-device", "max-discard-seg", "1" },
+    { "virtio-blk-device", "max-write-zeroes-seg", "1" },
+    { "virtio-net-device", "in_order", "off" },
 };
 const size_t hw_compat_5_2_len = G_N_ELEMENTS(hw_compat_5_2);
 
@@ -371,6 +379,46 @@ static void machine_set_mem_merge(Object *obj, bool value, Error **errp)
     ms->mem_merge = value;
 }
 
+static void machine_get_mem_merge_assist(Object *obj, Visitor *v,
+                                         const char *name, void *opaque,
+                                         Error **errp)
+{
+    MachineState *ms = MACHINE(obj);
+
+    visit_type_uint32(v, name, &ms->mem_merge_assist, errp);
+}
+
+static void machine_set_mem_merge_assist(Object *obj, Visitor *v,
+                                         const char *name, void *opaque,
+                                         Error **errp)
+{
+    MachineState *ms = MACHINE(obj);
+    uint32_t value;
+
+    if (!visit_type_uint32(v, name, &value, errp)) {
+        return;
+    }
+    if (value && QEMU_MADV_MERGEABLE == QEMU_MADV_INVALID) {
+        error_setg(errp, "memory merging is not supported by this host");
+        return;
+    }
+    ms->mem_merge_assist = value;
+}
+
+static bool machine_get_share_rom(Object *obj, Error **errp)
+{
+    MachineState *ms = MACHINE(obj);
+
+    return ms->share_rom;
+}
+
+static void machine_set_share_rom(Object *obj, bool value, Error **errp)
+{
+    MachineState *ms = MACHINE(obj);
+
+    ms->share_rom = value;
+}
+
 static bool machine_get_usb(Object *obj, Error **errp)
 {
     MachineState *ms = MACHINE(obj);
@@ -843,6 +891,18 @@ static void machine_class_init(ObjectClass *oc, void *data)
     object_class_property_set_description(oc, "mem-merge",
         "Enable/disable memory merge support");
 
+    object_class_property_add(oc, "x-mem-merge-assist", "uint32",
+        machine_get_mem_merge_assist, machine_set_mem_merge_assist,
+        NULL, NULL);
+    object_class_property_set_description(oc, "x-mem-merge-assist",
+        "Interval in seconds between scans that pick the guest memory "
+        "ranges advised for merging, 0 to advise all memory");
+
+    object_class_property_add_bool(oc, "share-rom",
+        machine_get_share_rom, machine_set_share_rom);
+    object_class_property_set_description(oc, "share-rom",
+        "Map read-only firmware from its file, sharing it with other VMs");
+
     object_class_property_add_bool(oc, "usb",
         machine_get_usb, machine_set_usb);
     object_class_property_set_description(oc, "usb",
@@ -989,6 +1049,11 @@ bool machine_mem_merge(MachineState *machine)
     return machine->mem_merge;
 }
 
+bool machine_mem_merge_assist(MachineState *machine)
+{
+    return machine->mem_merge_assist;
+}
+
 static char *cpu_slot_to_string(const CPUArchId *cpu)
 {
     GString *s = g_string_new(NULL);
@@ -1216,6 +1281,10 @@ void machine_run_board_init(MachineState *machine)
 
     machine_class->init(machine);
     phase_advance(PHASE_MACHINE_INITIALIZED);
+
+    if (machine->mem_merge_assist) {
+        mem_merge_assist_start(machine->mem_merge_assist);
+    }
 }
 
 static NotifierList machine_init_done_notifiers =
@@ -1234,8 +1303,59 @@ void qemu_remove_machine_init_done_notifier(Notifier *notify)
     notifier_remove(notify);
 }
 
+typedef struct MachineInitWork {
+    void (*done)(void *opaque, int ret, Error **errp);
+    void *opaque;
+} MachineInitWork;
+
+static unsigned machine_init_work_pending;
+/* The first error of a @done callback, reported when the machine is done */
+static Error *machine_init_work_err;
+
+static void machine_init_work_cb(void *opaque, int ret)
+{
+    MachineInitWork *work = opaque;
+    Error *local_err = NULL;
+
+    work->done(work->opaque, ret, &local_err);
+    error_propagate(&machine_init_work_err, local_err);
+    machine_init_work_pending--;
+    g_free(work);
+}
+
+void machine_init_work_submit(int (*func)(void *opaque),
+                              void (*done)(void *opaque, int ret,
+                                           Error **errp),
+                              void *opaque)
+{
+    AioContext *ctx = qemu_get_aio_context();
+    MachineInitWork *work = g_new(MachineInitWork, 1);
+
+    assert(!phase_check(PHASE_MACHINE_READY));
+    work->done = done;
+    work->opaque = opaque;
+    machine_init_work_pending++;
+    thread_pool_submit_aio(aio_get_thread_pool(ctx), func, opaque,
+                           machine_init_work_cb, work);
+}
+
+void machine_init_work_wait(void)
+{
+    int64_t start = get_clock();
+
+    while (machine_init_work_pending) {
+        aio_poll(qemu_get_aio_context(), true);
+    }
+    trace_machine_init_work_wait((get_clock() - start) / SCALE_US);
+}
+
 void qdev_machine_creation_done(void)
 {
+    machine_init_work_wait();
+    if (machine_init_work_err) {
+        error_report_err(machine_init_work_err);
+        exit(1);
+    }
     cpu_synchronize_all_post_init();
 
     if (current_machine->boot_once) {
@@ -32,6 +32,7 @@
 #include "qapi/visitor.h"
 #include "qemu/error-report.h"
 #include "qemu/option.h"
+#include "qemu/timer.h"
 #include "hw/hotplug.h"
 #include "hw/irq.h"
 #include "hw/qdev-properties.h"
@@ -758,10 +759,19 @@ static void device_set_realized(Object *obj, bool value, Error **errp)
         }
 
         if (dc->realize) {
+            int64_t start = 0;
+
+            if (trace_event_get_state_backends(TRACE_QDEV_REALIZE_TIME)) {
+                start = get_clock();
+            }
             dc->realize(dev, &local_err);
             if (local_err != NULL) {
                 goto fail;
             }
+            if (start) {
+                trace_qdev_realize_time(dev, object_get_typename(obj),
+                                        (get_clock() - start) / SCALE_US);
+            }
         }
 
         DEVICE_LISTENER_CALL(realize, Forward, dev);
@@ -1138,6 +1148,7 @@ Object *qdev_get_machine(void)
 }
 
 static MachineInitPhase machine_phase;
+static int64_t machine_phase_start;
 
 bool phase_check(MachineInitPhase phase)
 {
@@ -1146,8 +1157,14 @@ bool phase_check(MachineInitPhase phase)
 
 void phase_advance(MachineInitPhase phase)
 {
+    int64_t now = get_clock();
+
     assert(machine_phase == phase - 1);
     machine_phase = phase;
+    if (machine_phase_start) {
+        trace_phase_advance(phase, (now - machine_phase_start) / SCALE_US);
+    }
+    machine_phase_start = now;
 }
 
 static const TypeInfo device_type_info = {
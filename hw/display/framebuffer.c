@@ -101,6 +101,13 @@ void framebuffer_update_display(
 
     snap = memory_region_snapshot_and_clear_dirty(mem, addr, src_width * rows,
                                                   DIRTY_MEMORY_VGA);
+    if (!invalidate && i < rows &&
+        !memory_region_snapshot_get_dirty(mem, snap, addr,
+                                          src_width * (rows - i))) {
+        /* nothing changed, don't walk the rows */
+        g_free(snap);
+        return;
+    }
     for (; i < rows; i++) {
         dirty = memory_region_snapshot_get_dirty(mem, snap, addr, src_width);
         if (dirty || invalidate) {
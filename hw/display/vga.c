@@ -24,6 +24,7 @@
 
 #include "qemu/osdep.h"
 #include "qemu/units.h"
+#include "qemu/cutils.h"
 #include "sysemu/reset.h"
 #include "qapi/error.h"
 #include "hw/display/vga.h"
@@ -1461,6 +1462,32 @@ void vga_dirty_log_stop(VGACommonState *s)
 /*
  * graphic modes
  */
+/*
+ * Convert the @width pixels at @addr in video memory to scanline @y of
+ * @surface.  Returns false if pixman can not be used for the line.
+ */
+static bool vga_draw_line_pixman(VGACommonState *s, DisplaySurface *surface,
+                                 pixman_format_code_t format, uint32_t addr,
+                                 int width, int y)
+{
+    int bwidth = width * PIXMAN_FORMAT_BPP(format) / 8;
+    pixman_image_t *src;
+
+    if (addr & 3) {
+        return false;
+    }
+    src = pixman_image_create_bits(format, width, 1,
+                                   (uint32_t *)(s->vram_ptr + addr),
+                                   ROUND_UP(bwidth, 4));
+    if (!src) {
+        return false;
+    }
+    pixman_image_composite(PIXMAN_OP_SRC, src, NULL, surface->image,
+                           0, 0, 0, 0, 0, y, width, 1);
+    pixman_image_unref(src);
+    return true;
+}
+
 static void vga_draw_graphic(VGACommonState *s, int full_update)
 {
     DisplaySurface *surface = qemu_console_surface(s->con);
@@ -1473,7 +1500,7 @@ static void vga_draw_graphic(VGACommonState *s, int full_update)
     uint32_t v, addr1, addr;
     vga_draw_line_func *vga_draw_line = NULL;
     bool share_surface, force_shadow = false;
-    pixman_format_code_t format;
+    pixman_format_code_t format, line_format = 0;
 #ifdef HOST_WORDS_BIGENDIAN
     bool byteswap = !s->big_endian_fb;
 #else
@@ -1661,6 +1688,23 @@ static void vga_draw_graphic(VGACommonState *s, int full_update)
         snap = memory_region_snapshot_and_clear_dirty(&s->vram, region_start,
                                                       region_end - region_start,
                                                       DIRTY_MEMORY_VGA);
+        if (!memory_region_snapshot_get_dirty(&s->vram, snap, region_start,
+                                              region_end - region_start) &&
+            buffer_is_zero(s->invalidated_y_table,
+                           sizeof(s->invalidated_y_table))) {
+            /* nothing changed, don't walk the scanlines */
+            g_free(snap);
+            return;
+        }
+    }
+
+    /*
+     * Direct color lines that pixman can read are converted by pixman,
+     * which has vectorized paths for the common formats.
+     */
+    if (shift_control == 2 && bits >= 16 && format &&
+        !is_buffer_shared(surface)) {
+        line_format = format;
     }
 
     for(y = 0; y < height; y++) {
@@ -1695,7 +1739,11 @@ static void vga_draw_graphic(VGACommonState *s, int full_update)
             if (y_start < 0)
                 y_start = y;
             if (!(is_buffer_shared(surface))) {
-                vga_draw_line(s, d, addr, width);
+                if (!line_format || page1 < page0 ||
+                    !vga_draw_line_pixman(s, surface, line_format,
+                                          page0, width, y)) {
+                    vga_draw_line(s, d, addr, width);
+                }
                 if (s->cursor_draw_line)
                     s->cursor_draw_line(s, d, y);
             }
@@ -382,14 +382,189 @@ static void virtio_gpu_resource_unref(VirtIOGPU *g,
     virtio_gpu_resource_destroy(g, res);
 }
 
-static void virtio_gpu_transfer_to_host_2d(VirtIOGPU *g,
-                                           struct virtio_gpu_ctrl_command *cmd)
-{
+struct VirtIOGPUXfer {
+    struct virtio_gpu_ctrl_command *cmd;
     struct virtio_gpu_simple_resource *res;
+    struct virtio_gpu_transfer_to_host_2d t2d;
+    QSIMPLEQ_ENTRY(VirtIOGPUXfer) next;
+};
+
+/*
+ * Copy guest memory into the resource image.  This may run in the transfer
+ * thread: commands that could change the backing or the image of @res are
+ * held back in the command queue until all its transfers are done.
+ */
+static void virtio_gpu_do_transfer_to_host_2d(
+    struct virtio_gpu_simple_resource *res,
+    const struct virtio_gpu_transfer_to_host_2d *t2d)
+{
     int h;
     uint32_t src_offset, dst_offset, stride;
     int bpp;
     pixman_format_code_t format;
+
+    format = pixman_image_get_format(res->image);
+    bpp = DIV_ROUND_UP(PIXMAN_FORMAT_BPP(format), 8);
+    stride = pixman_image_get_stride(res->image);
+
+    if (t2d->offset || t2d->r.x || t2d->r.y ||
+        t2d->r.width != pixman_image_get_width(res->image)) {
+        void *img_data = pixman_image_get_data(res->image);
+        for (h = 0; h < t2d->r.height; h++) {
+            src_offset = t2d->offset + stride * h;
+            dst_offset = (t2d->r.y + h) * stride + (t2d->r.x * bpp);
+
+            iov_to_buf(res->iov, res->iov_cnt, src_offset,
+                       (uint8_t *)img_data
+                       + dst_offset, t2d->r.width * bpp);
+        }
+    } else {
+        iov_to_buf(res->iov, res->iov_cnt, 0,
+                   pixman_image_get_data(res->image),
+                   pixman_image_get_stride(res->image)
+                   * pixman_image_get_height(res->image));
+    }
+}
+
+static void *virtio_gpu_xfer_thread(void *opaque)
+{
+    VirtIOGPU *g = opaque;
+    VirtIOGPUXfer *xfer;
+
+    qemu_mutex_lock(&g->xfer_lock);
+    for (;;) {
+        while (QSIMPLEQ_EMPTY(&g->xfer_queue) && !g->xfer_stop) {
+            qemu_cond_wait(&g->xfer_cond, &g->xfer_lock);
+        }
+        if (QSIMPLEQ_EMPTY(&g->xfer_queue)) {
+            break;
+        }
+        xfer = QSIMPLEQ_FIRST(&g->xfer_queue);
+        qemu_mutex_unlock(&g->xfer_lock);
+
+        virtio_gpu_do_transfer_to_host_2d(xfer->res, &xfer->t2d);
+
+        qemu_mutex_lock(&g->xfer_lock);
+        QSIMPLEQ_REMOVE_HEAD(&g->xfer_queue, next);
+        QSIMPLEQ_INSERT_TAIL(&g->xfer_done, xfer, next);
+        qemu_cond_broadcast(&g->xfer_cond);
+        qemu_bh_schedule(g->xfer_bh);
+    }
+    qemu_mutex_unlock(&g->xfer_lock);
+
+    return NULL;
+}
+
+static void virtio_gpu_xfer_submit(VirtIOGPU *g,
+                                   struct virtio_gpu_ctrl_command *cmd,
+                                   struct virtio_gpu_simple_resource *res,
+                                   struct virtio_gpu_transfer_to_host_2d *t2d)
+{
+    VirtIOGPUXfer *xfer = g_new(VirtIOGPUXfer, 1);
+
+    xfer->cmd = cmd;
+    xfer->res = res;
+    xfer->t2d = *t2d;
+    cmd->deferred = true;
+    res->xfer_pending++;
+    g->xfer_inflight++;
+
+    qemu_mutex_lock(&g->xfer_lock);
+    QSIMPLEQ_INSERT_TAIL(&g->xfer_queue, xfer, next);
+    qemu_cond_broadcast(&g->xfer_cond);
+    qemu_mutex_unlock(&g->xfer_lock);
+}
+
+/* Wait until the transfer thread has nothing left to do */
+static void virtio_gpu_xfer_wait(VirtIOGPU *g)
+{
+    if (!g->cmd_thread) {
+        return;
+    }
+    qemu_mutex_lock(&g->xfer_lock);
+    while (!QSIMPLEQ_EMPTY(&g->xfer_queue)) {
+        qemu_cond_wait(&g->xfer_cond, &g->xfer_lock);
+    }
+    qemu_mutex_unlock(&g->xfer_lock);
+}
+
+/* Retire finished transfers, answering them unless the device is reset */
+static void virtio_gpu_xfer_complete(VirtIOGPU *g, bool respond)
+{
+    QSIMPLEQ_HEAD(, VirtIOGPUXfer) done = QSIMPLEQ_HEAD_INITIALIZER(done);
+    VirtIOGPUXfer *xfer;
+
+    if (!g->cmd_thread) {
+        return;
+    }
+    qemu_mutex_lock(&g->xfer_lock);
+    QSIMPLEQ_CONCAT(&done, &g->xfer_done);
+    qemu_mutex_unlock(&g->xfer_lock);
+
+    while ((xfer = QSIMPLEQ_FIRST(&done))) {
+        QSIMPLEQ_REMOVE_HEAD(&done, next);
+        trace_virtio_gpu_cmd_res_xfer_toh_2d_done(xfer->res->resource_id);
+        xfer->res->xfer_pending--;
+        g->xfer_inflight--;
+        if (respond) {
+            virtio_gpu_ctrl_response_nodata(g, xfer->cmd,
+                                            VIRTIO_GPU_RESP_OK_NODATA);
+        }
+        g_free(xfer->cmd);
+        g_free(xfer);
+    }
+}
+
+static void virtio_gpu_xfer_bh(void *opaque)
+{
+    VirtIOGPU *g = opaque;
+
+    virtio_gpu_xfer_complete(g, true);
+    /* commands may have been waiting for these transfers */
+    virtio_gpu_process_cmdq(g);
+}
+
+/*
+ * With transfers in flight, only further transfers and flushes of other
+ * resources can go ahead.  Fenced commands wait for everything so that
+ * fences still signal in order.
+ */
+static bool virtio_gpu_cmd_must_wait(VirtIOGPU *g,
+                                     struct virtio_gpu_ctrl_command *cmd)
+{
+    struct virtio_gpu_ctrl_hdr hdr;
+    struct virtio_gpu_resource_flush rf;
+    struct virtio_gpu_simple_resource *res;
+
+    if (!g->xfer_inflight) {
+        return false;
+    }
+
+    if (iov_to_buf(cmd->elem.out_sg, cmd->elem.out_num, 0,
+                   &hdr, sizeof(hdr)) != sizeof(hdr) ||
+        le32_to_cpu(hdr.flags) & VIRTIO_GPU_FLAG_FENCE) {
+        return true;
+    }
+
+    switch (le32_to_cpu(hdr.type)) {
+    case VIRTIO_GPU_CMD_TRANSFER_TO_HOST_2D:
+        return false;
+    case VIRTIO_GPU_CMD_RESOURCE_FLUSH:
+        if (iov_to_buf(cmd->elem.out_sg, cmd->elem.out_num, 0,
+                       &rf, sizeof(rf)) != sizeof(rf)) {
+            return true;
+        }
+        res = virtio_gpu_find_resource(g, le32_to_cpu(rf.resource_id));
+        return res && res->xfer_pending;
+    default:
+        return true;
+    }
+}
+
+static void virtio_gpu_transfer_to_host_2d(VirtIOGPU *g,
+                                           struct virtio_gpu_ctrl_command *cmd)
+{
+    struct virtio_gpu_simple_resource *res;
     struct virtio_gpu_transfer_to_host_2d t2d;
 
     VIRTIO_GPU_FILL_CMD(t2d);
@@ -418,27 +593,11 @@ static void virtio_gpu_transfer_to_host_2d(VirtIOGPU *g,
         return;
     }
 
-    format = pixman_image_get_format(res->image);
-    bpp = DIV_ROUND_UP(PIXMAN_FORMAT_BPP(format), 8);
-    stride = pixman_image_get_stride(res->image);
-
-    if (t2d.offset || t2d.r.x || t2d.r.y ||
-        t2d.r.width != pixman_image_get_width(res->image)) {
-        void *img_data = pixman_image_get_data(res->image);
-        for (h = 0; h < t2d.r.height; h++) {
-            src_offset = t2d.offset + stride * h;
-            dst_offset = (t2d.r.y + h) * stride + (t2d.r.x * bpp);
-
-            iov_to_buf(res->iov, res->iov_cnt, src_offset,
-                       (uint8_t *)img_data
-                       + dst_offset, t2d.r.width * bpp);
-        }
-    } else {
-        iov_to_buf(res->iov, res->iov_cnt, 0,
-                   pixman_image_get_data(res->image),
-                   pixman_image_get_stride(res->image)
-                   * pixman_image_get_height(res->image));
+    if (g->cmd_thread) {
+        virtio_gpu_xfer_submit(g, cmd, res, &t2d);
+        return;
     }
+    virtio_gpu_do_transfer_to_host_2d(res, &t2d);
 }
 
 static void virtio_gpu_resource_flush(VirtIOGPU *g,
@@ -785,7 +944,7 @@ static void virtio_gpu_simple_process_cmd(VirtIOGPU *g,
         cmd->error = VIRTIO_GPU_RESP_ERR_UNSPEC;
         break;
     }
-    if (!cmd->finished) {
+    if (!cmd->finished && !cmd->deferred) {
         virtio_gpu_ctrl_response_nodata(g, cmd, cmd->error ? cmd->error :
                                         VIRTIO_GPU_RESP_OK_NODATA);
     }
@@ -814,7 +973,8 @@ void virtio_gpu_process_cmdq(VirtIOGPU *g)
     while (!QTAILQ_EMPTY(&g->cmdq)) {
         cmd = QTAILQ_FIRST(&g->cmdq);
 
-        if (g->parent_obj.renderer_blocked) {
+        if (g->parent_obj.renderer_blocked ||
+            virtio_gpu_cmd_must_wait(g, cmd)) {
             break;
         }
 
@@ -827,6 +987,10 @@ void virtio_gpu_process_cmdq(VirtIOGPU *g)
             g->stats.requests++;
         }
 
+        if (cmd->deferred) {
+            /* owned by the transfer thread until virtio_gpu_xfer_bh() */
+            continue;
+        }
         if (!cmd->finished) {
             QTAILQ_INSERT_TAIL(&g->fenceq, cmd, next);
             g->inflight++;
@@ -877,6 +1041,7 @@ static void virtio_gpu_handle_ctrl(VirtIODevice *vdev, VirtQueue *vq)
         cmd->vq = vq;
         cmd->error = 0;
         cmd->finished = false;
+        cmd->deferred = false;
         QTAILQ_INSERT_TAIL(&g->cmdq, cmd, next);
         cmd = virtqueue_pop(vq, sizeof(struct virtio_gpu_ctrl_command));
     }
@@ -974,6 +1139,16 @@ static int virtio_gpu_save(QEMUFile *f, void *opaque, size_t size,
     struct virtio_gpu_simple_resource *res;
     int i;
 
+    /*
+     * Finish the transfers and the commands that waited for them; those
+     * commands may queue further transfers.
+     */
+    do {
+        virtio_gpu_xfer_wait(g);
+        virtio_gpu_xfer_complete(g, true);
+        virtio_gpu_process_cmdq(g);
+    } while (g->xfer_inflight);
+
     /* in 2d mode we should never find unprocessed commands here */
     assert(QTAILQ_EMPTY(&g->cmdq));
 
@@ -1139,6 +1314,35 @@ static void virtio_gpu_device_realize(DeviceState *qdev, Error **errp)
     QTAILQ_INIT(&g->reslist);
     QTAILQ_INIT(&g->cmdq);
     QTAILQ_INIT(&g->fenceq);
+
+    if (g->cmd_thread) {
+        qemu_mutex_init(&g->xfer_lock);
+        qemu_cond_init(&g->xfer_cond);
+        QSIMPLEQ_INIT(&g->xfer_queue);
+        QSIMPLEQ_INIT(&g->xfer_done);
+        g->xfer_bh = qemu_bh_new(virtio_gpu_xfer_bh, g);
+        qemu_thread_create(&g->xfer_thread, "virtio-gpu-xfer",
+                           virtio_gpu_xfer_thread, g, QEMU_THREAD_JOINABLE);
+    }
+}
+
+static void virtio_gpu_device_unrealize(DeviceState *qdev)
+{
+    VirtIOGPU *g = VIRTIO_GPU(qdev);
+
+    if (g->cmd_thread) {
+        qemu_mutex_lock(&g->xfer_lock);
+        g->xfer_stop = true;
+        qemu_cond_broadcast(&g->xfer_cond);
+        qemu_mutex_unlock(&g->xfer_lock);
+        qemu_thread_join(&g->xfer_thread);
+
+        virtio_gpu_xfer_complete(g, false);
+        qemu_bh_delete(g->xfer_bh);
+        qemu_cond_destroy(&g->xfer_cond);
+        qemu_mutex_destroy(&g->xfer_lock);
+    }
+    virtio_gpu_base_device_unrealize(qdev);
 }
 
 static void virtio_gpu_reset(VirtIODevice *vdev)
@@ -1153,6 +1357,9 @@ static void virtio_gpu_reset(VirtIODevice *vdev)
     }
 #endif
 
+    virtio_gpu_xfer_wait(g);
+    virtio_gpu_xfer_complete(g, false);
+
     QTAILQ_FOREACH_SAFE(res, &g->reslist, next, tmp) {
         virtio_gpu_resource_destroy(g, res);
     }
@@ -1235,6 +1442,7 @@ static Property virtio_gpu_properties[] = {
     VIRTIO_GPU_BASE_PROPERTIES(VirtIOGPU, parent_obj.conf),
     DEFINE_PROP_SIZE("max_hostmem", VirtIOGPU, conf_max_hostmem,
                      256 * MiB),
+    DEFINE_PROP_BOOL("x-cmd-thread", VirtIOGPU, cmd_thread, false),
 #ifdef CONFIG_VIRGL
     DEFINE_PROP_BIT("virgl", VirtIOGPU, parent_obj.conf.flags,
                     VIRTIO_GPU_FLAG_VIRGL_ENABLED, true),
@@ -1252,6 +1460,7 @@ static void virtio_gpu_class_init(ObjectClass *klass, void *data)
 
     vgc->gl_flushed = virtio_gpu_gl_flushed;
     vdc->realize = virtio_gpu_device_realize;
+    vdc->unrealize = virtio_gpu_device_unrealize;
     vdc->reset = virtio_gpu_reset;
     vdc->get_config = virtio_gpu_get_config;
     vdc->set_config = virtio_gpu_set_config;
@@ -1088,6 +1088,7 @@ void x86_bios_rom_init(MachineState *ms, const char *default_firmware,
     char *filename;
     MemoryRegion *bios, *isa_bios;
     int bios_size, isa_bios_size;
+    Error *local_err = NULL;
     int ret;
 
     /* BIOS load */
@@ -1103,11 +1104,22 @@ void x86_bios_rom_init(MachineState *ms, const char *default_firmware,
         goto bios_error;
     }
     bios = g_malloc(sizeof(*bios));
-    memory_region_init_ram(bios, NULL, "pc.bios", bios_size, &error_fatal);
+    ret = -1;
+    if (ms->share_rom && !isapc_ram_fw) {
+        ret = rom_add_file_shared(bios_name, bios, "pc.bios", bios_size,
+                                  &local_err);
+        if (ret != 0) {
+            warn_report_err(local_err);
+        }
+    }
+    if (ret != 0) {
+        memory_region_init_ram(bios, NULL, "pc.bios", bios_size,
+                               &error_fatal);
+        ret = rom_add_file_fixed(bios_name, (uint32_t)(-bios_size), -1);
+    }
     if (!isapc_ram_fw) {
         memory_region_set_readonly(bios, true);
     }
-    ret = rom_add_file_fixed(bios_name, (uint32_t)(-bios_size), -1);
     if (ret != 0) {
     bios_error:
         fprintf(stderr, "qemu: could not load PC BIOS '%s'\n", bios_name);
@@ -28,11 +28,14 @@
 #include "migration/vmstate.h"
 
 #include "qemu/error-report.h"
+#include "qemu/lockable.h"
 #include "qemu/log.h"
 #include "qemu/main-loop.h"
 #include "qemu/module.h"
+#include "exec/memory.h"
 #include "sysemu/block-backend.h"
 #include "sysemu/dma.h"
+#include "sysemu/iothread.h"
 #include "hw/ide/internal.h"
 #include "hw/ide/pci.h"
 #include "ahci_internal.h"
@@ -49,6 +52,22 @@ static bool ahci_map_clb_address(AHCIDevice *ad);
 static bool ahci_map_fis_address(AHCIDevice *ad);
 static void ahci_unmap_clb_address(AHCIDevice *ad);
 static void ahci_unmap_fis_address(AHCIDevice *ad);
+static void ahci_do_reset(AHCIState *s);
+static void ahci_restart(const IDEDMA *dma);
+
+static inline void ahci_lock(AHCIState *s)
+{
+    if (s->ctx) {
+        aio_context_acquire(s->ctx);
+    }
+}
+
+static inline void ahci_unlock(AHCIState *s)
+{
+    if (s->ctx) {
+        aio_context_release(s->ctx);
+    }
+}
 
 static const char *AHCIHostReg_lookup[AHCI_HOST_REG__COUNT] = {
     [AHCI_HOST_REG_CAP]        = "CAP",
@@ -163,7 +182,7 @@ static uint32_t ahci_port_read(AHCIState *s, int port, int offset)
         val = pr->scr_act;
         break;
     case AHCI_PORT_REG_CMD_ISSUE:
-        val = pr->cmd_issue;
+        val = pr->cmd_issue | qatomic_read(&s->dev[port].ci_latched);
         break;
     default:
         trace_ahci_port_read_default(s, port, AHCIPortReg_lookup[regnum],
@@ -208,6 +227,12 @@ static void ahci_check_irq(AHCIState *s)
     int i;
     uint32_t old_irq = s->control_regs.irqstatus;
 
+    /* Raising an interrupt needs the BQL, let the main loop do it */
+    if (s->ctx && !qemu_mutex_iothread_locked()) {
+        qemu_bh_schedule(s->irq_bh);
+        return;
+    }
+
     s->control_regs.irqstatus = 0;
     for (i = 0; i < s->ports; i++) {
         AHCIPortRegs *pr = &s->dev[i].port_regs;
@@ -224,6 +249,15 @@ static void ahci_check_irq(AHCIState *s)
     }
 }
 
+static void ahci_irq_bh(void *opaque)
+{
+    AHCIState *s = opaque;
+
+    ahci_lock(s);
+    ahci_check_irq(s);
+    ahci_unlock(s);
+}
+
 static void ahci_trigger_irq(AHCIState *s, AHCIDevice *d,
                              enum AHCIPortIRQ irqbit)
 {
@@ -240,6 +274,43 @@ static void ahci_trigger_irq(AHCIState *s, AHCIDevice *d,
     ahci_check_irq(s);
 }
 
+/*
+ * Whether [addr, addr + len) is all directly accessible memory.  Only then
+ * can the iothread map it: MMIO and bounce buffers need the BQL.
+ */
+static bool ahci_range_is_ram(AddressSpace *as, hwaddr addr, hwaddr len,
+                              bool is_write)
+{
+    RCU_READ_LOCK_GUARD();
+
+    while (len) {
+        hwaddr xlat, l = len;
+        MemoryRegion *mr;
+
+        mr = address_space_translate(as, addr, &xlat, &l, is_write,
+                                     MEMTXATTRS_UNSPECIFIED);
+        if (!memory_access_is_direct(mr, is_write)) {
+            return false;
+        }
+        addr += l;
+        len -= l;
+    }
+    return true;
+}
+
+static bool ahci_sglist_is_ram(QEMUSGList *sg, bool is_write)
+{
+    int i;
+
+    for (i = 0; i < sg->nsg; i++) {
+        if (!ahci_range_is_ram(sg->as, sg->sg[i].base, sg->sg[i].len,
+                               is_write)) {
+            return false;
+        }
+    }
+    return true;
+}
+
 static void map_page(AddressSpace *as, uint8_t **ptr, uint64_t addr,
                      uint32_t wanted)
 {
@@ -370,7 +441,11 @@ static void ahci_port_write(AHCIState *s, int port, int offset, uint32_t val)
         break;
     case AHCI_PORT_REG_CMD_ISSUE:
         pr->cmd_issue |= val;
-        check_cmd(s, port);
+        if (s->dev[port].iothread_ok) {
+            event_notifier_set(&s->ci_notifier);
+        } else {
+            check_cmd(s, port);
+        }
         break;
     default:
         trace_ahci_port_write_unimpl(s, port, AHCIPortReg_lookup[regnum],
@@ -433,12 +508,19 @@ static uint64_t ahci_mem_read_32(void *opaque, hwaddr addr)
  */
 static uint64_t ahci_mem_read(void *opaque, hwaddr addr, unsigned size)
 {
+    AHCIState *s = opaque;
     hwaddr aligned = addr & ~0x3;
     int ofst = addr - aligned;
-    uint64_t lo = ahci_mem_read_32(opaque, aligned);
+    uint64_t lo;
     uint64_t hi;
     uint64_t val;
 
+    /*
+     * No lock: register reads have no side effects, and waiting here for
+     * the iothread could deadlock with it waiting for the BQL.
+     */
+    lo = ahci_mem_read_32(opaque, aligned);
+
     /* if < 8 byte read does not cross 4 byte boundary */
     if (ofst + size <= 4) {
         val = lo >> (ofst * 8);
@@ -456,11 +538,9 @@ static uint64_t ahci_mem_read(void *opaque, hwaddr addr, unsigned size)
 }
 
 
-static void ahci_mem_write(void *opaque, hwaddr addr,
-                           uint64_t val, unsigned size)
+static void ahci_do_mem_write(AHCIState *s, hwaddr addr,
+                              uint64_t val, unsigned size)
 {
-    AHCIState *s = opaque;
-
     trace_ahci_mem_write(s, size, addr, val);
 
     /* Only aligned reads are allowed on AHCI */
@@ -481,7 +561,7 @@ static void ahci_mem_write(void *opaque, hwaddr addr,
             break;
         case AHCI_HOST_REG_CTL: /* R/W */
             if (val & HOST_CTL_RESET) {
-                ahci_reset(s);
+                ahci_do_reset(s);
             } else {
                 s->control_regs.ghc = (val & 0x3) | HOST_CTL_AHCI_EN;
                 ahci_check_irq(s);
@@ -521,6 +601,97 @@ static void ahci_mem_write(void *opaque, hwaddr addr,
     }
 }
 
+/*
+ * Latch a PxCI write for a port served by the iothread without taking the
+ * AioContext lock: the iothread may hold it while it waits for the BQL,
+ * which we hold here.  check_cmd() picks the bits up.
+ */
+static bool ahci_try_latch_cmd_issue(AHCIState *s, hwaddr addr,
+                                     uint64_t val, unsigned size)
+{
+    hwaddr offset = addr - AHCI_PORT_REGS_START_ADDR;
+    int port = offset / AHCI_PORT_ADDR_OFFSET_LEN;
+    AHCIDevice *ad;
+
+    if (!s->ctx || size != 4 || addr < AHCI_PORT_REGS_START_ADDR ||
+        port >= s->ports ||
+        (offset & AHCI_PORT_ADDR_OFFSET_MASK) !=
+            AHCI_PORT_REG_CMD_ISSUE * sizeof(uint32_t)) {
+        return false;
+    }
+
+    ad = &s->dev[port];
+    if (!ad->iothread_ok) {
+        return false;
+    }
+
+    trace_ahci_mem_write(s, size, addr, val);
+    trace_ahci_port_write(s, port, AHCIPortReg_lookup[AHCI_PORT_REG_CMD_ISSUE],
+                          offset & AHCI_PORT_ADDR_OFFSET_MASK, val);
+    qatomic_or(&ad->ci_latched, val);
+    event_notifier_set(&s->ci_notifier);
+    return true;
+}
+
+/* Apply the register writes queued by ahci_mem_write(), in order */
+static void ahci_reg_bh(void *opaque)
+{
+    AHCIState *s = opaque;
+    AHCIRegWrite *w;
+
+    ahci_lock(s);
+    for (;;) {
+        WITH_QEMU_LOCK_GUARD(&s->reg_lock) {
+            w = QSIMPLEQ_FIRST(&s->reg_writes);
+            if (w) {
+                QSIMPLEQ_REMOVE_HEAD(&s->reg_writes, next);
+            }
+        }
+        if (!w) {
+            break;
+        }
+        ahci_do_mem_write(s, w->addr, w->val, w->size);
+        g_free(w);
+    }
+    ahci_unlock(s);
+}
+
+static void ahci_mem_write(void *opaque, hwaddr addr,
+                           uint64_t val, unsigned size)
+{
+    AHCIState *s = opaque;
+    AHCIRegWrite *w = NULL;
+
+    if (ahci_try_latch_cmd_issue(s, addr, val, size)) {
+        return;
+    }
+
+    if (!s->ctx) {
+        ahci_do_mem_write(s, addr, val, size);
+        return;
+    }
+
+    /*
+     * Never wait for the iothread here.  If it holds the lock, queue the
+     * write; later writes queue behind it so that the order is kept.
+     */
+    WITH_QEMU_LOCK_GUARD(&s->reg_lock) {
+        if (!QSIMPLEQ_EMPTY(&s->reg_writes) ||
+            !aio_context_try_acquire(s->ctx)) {
+            w = g_new(AHCIRegWrite, 1);
+            *w = (AHCIRegWrite) { .addr = addr, .val = val, .size = size };
+            QSIMPLEQ_INSERT_TAIL(&s->reg_writes, w, next);
+        }
+    }
+
+    if (w) {
+        qemu_bh_schedule(s->reg_bh);
+    } else {
+        ahci_do_mem_write(s, addr, val, size);
+        aio_context_release(s->ctx);
+    }
+}
+
 static const MemoryRegionOps ahci_mem_ops = {
     .read = ahci_mem_read,
     .write = ahci_mem_write,
@@ -587,6 +758,8 @@ static void check_cmd(AHCIState *s, int port)
     AHCIPortRegs *pr = &s->dev[port].port_regs;
     uint8_t slot;
 
+    pr->cmd_issue |= qatomic_xchg(&s->dev[port].ci_latched, 0);
+
     if ((pr->cmd & PORT_CMD_START) && pr->cmd_issue) {
         for (slot = 0; (slot < 32) && pr->cmd_issue; slot++) {
             if ((pr->cmd_issue & (1U << slot)) &&
@@ -601,10 +774,52 @@ static void ahci_check_cmd_bh(void *opaque)
 {
     AHCIDevice *ad = opaque;
 
+    ahci_lock(ad->hba);
     qemu_bh_delete(ad->check_bh);
     ad->check_bh = NULL;
 
     check_cmd(ad->hba, ad->port_no);
+    ahci_unlock(ad->hba);
+}
+
+/* Re-run check_cmd for @ad in the main loop */
+static void ahci_schedule_check_cmd(AHCIDevice *ad)
+{
+    if (!ad->check_bh) {
+        ad->check_bh = qemu_bh_new(ahci_check_cmd_bh, ad);
+        qemu_bh_schedule(ad->check_bh);
+    }
+}
+
+/* Context: the iothread */
+static void ahci_ci_notifier_read(EventNotifier *e)
+{
+    AHCIState *s = container_of(e, AHCIState, ci_notifier);
+    int i;
+
+    if (!event_notifier_test_and_clear(e)) {
+        return;
+    }
+
+    aio_context_acquire(s->ctx);
+    for (i = 0; i < s->ports; i++) {
+        if (s->dev[i].iothread_ok) {
+            check_cmd(s, i);
+        }
+    }
+    aio_context_release(s->ctx);
+}
+
+static bool ahci_ncq_in_flight(AHCIDevice *ad)
+{
+    int i;
+
+    for (i = 0; i < AHCI_MAX_CMDS; i++) {
+        if (ad->ncq_tfs[i].aiocb) {
+            return true;
+        }
+    }
+    return false;
 }
 
 static void ahci_init_d2h(AHCIDevice *ad)
@@ -664,6 +879,19 @@ static void ahci_reset_port(AHCIState *s, int port)
         return;
     }
 
+    /*
+     * Requests submitted by the iothread complete there and need our
+     * lock, so cancel them all and wait with the lock dropped.
+     */
+    if (d->iothread_ok) {
+        for (i = 0; i < AHCI_MAX_CMDS; i++) {
+            if (d->ncq_tfs[i].aiocb) {
+                blk_aio_cancel_async(d->ncq_tfs[i].aiocb);
+            }
+        }
+        AIO_WAIT_WHILE(s->ctx, ahci_ncq_in_flight(d));
+    }
+
     /* reset ncq queue */
     for (i = 0; i < AHCI_MAX_CMDS; i++) {
         NCQTransferState *ncq_tfs = &s->dev[port].ncq_tfs[i];
@@ -1024,7 +1252,9 @@ static void ncq_cb(void *opaque, int ret)
 {
     NCQTransferState *ncq_tfs = (NCQTransferState *)opaque;
     IDEState *ide_state = &ncq_tfs->drive->port.ifs[0];
+    AHCIState *s = ncq_tfs->drive->hba;
 
+    ahci_lock(s);
     ncq_tfs->aiocb = NULL;
 
     if (ret < 0) {
@@ -1045,6 +1275,7 @@ static void ncq_cb(void *opaque, int ret)
     if (!ncq_tfs->halt) {
         ncq_finish(ncq_tfs);
     }
+    ahci_unlock(s);
 }
 
 static int is_ncq(uint8_t ata_cmd)
@@ -1062,6 +1293,41 @@ static int is_ncq(uint8_t ata_cmd)
     }
 }
 
+static BlockAIOCB *ahci_ncq_readv(int64_t offset, QEMUIOVector *iov,
+                                  BlockCompletionFunc *cb, void *cb_opaque,
+                                  void *opaque)
+{
+    BlockBackend *blk = opaque;
+    return blk_aio_preadv(blk, offset, iov, 0, cb, cb_opaque);
+}
+
+static BlockAIOCB *ahci_ncq_writev(int64_t offset, QEMUIOVector *iov,
+                                   BlockCompletionFunc *cb, void *cb_opaque,
+                                   void *opaque)
+{
+    BlockBackend *blk = opaque;
+    return blk_aio_pwritev(blk, offset, iov, 0, cb, cb_opaque);
+}
+
+/*
+ * NCQ requests run where they are submitted: in the iothread when it
+ * processes the port, otherwise in the main loop.
+ */
+static AioContext *ahci_ncq_aio_context(AHCIDevice *ad)
+{
+    if (ad->iothread_ok && !qemu_mutex_iothread_locked()) {
+        return ad->hba->ctx;
+    }
+    return blk_get_aio_context(ad->port.ifs[0].blk);
+}
+
+static void ahci_restart_bh(void *opaque)
+{
+    AHCIDevice *ad = opaque;
+
+    ahci_restart(&ad->dma);
+}
+
 static void execute_ncq_command(NCQTransferState *ncq_tfs)
 {
     AHCIDevice *ad = ncq_tfs->drive;
@@ -1069,6 +1335,19 @@ static void execute_ncq_command(NCQTransferState *ncq_tfs)
     int port = ad->port_no;
 
     g_assert(is_ncq(ncq_tfs->cmd));
+
+    /*
+     * DMA to or from MMIO needs the BQL, which the iothread must not wait
+     * for while holding our lock.  Halt the command and let the main loop
+     * resubmit it.
+     */
+    if (!qemu_mutex_iothread_locked() &&
+        !ahci_sglist_is_ram(&ncq_tfs->sglist,
+                            ncq_tfs->cmd == READ_FPDMA_QUEUED)) {
+        ncq_tfs->halt = true;
+        aio_bh_schedule_oneshot(qemu_get_aio_context(), ahci_restart_bh, ad);
+        return;
+    }
     ncq_tfs->halt = false;
 
     switch (ncq_tfs->cmd) {
@@ -1077,20 +1356,26 @@ static void execute_ncq_command(NCQTransferState *ncq_tfs)
                                        ncq_tfs->sector_count, ncq_tfs->lba);
         dma_acct_start(ide_state->blk, &ncq_tfs->acct,
                        &ncq_tfs->sglist, BLOCK_ACCT_READ);
-        ncq_tfs->aiocb = dma_blk_read(ide_state->blk, &ncq_tfs->sglist,
-                                      ncq_tfs->lba << BDRV_SECTOR_BITS,
-                                      BDRV_SECTOR_SIZE,
-                                      ncq_cb, ncq_tfs);
+        ncq_tfs->aiocb = dma_blk_io(ahci_ncq_aio_context(ad),
+                                    &ncq_tfs->sglist,
+                                    ncq_tfs->lba << BDRV_SECTOR_BITS,
+                                    BDRV_SECTOR_SIZE,
+                                    ahci_ncq_readv, ide_state->blk,
+                                    ncq_cb, ncq_tfs,
+                                    DMA_DIRECTION_FROM_DEVICE);
         break;
     case WRITE_FPDMA_QUEUED:
         trace_execute_ncq_command_read(ad->hba, port, ncq_tfs->tag,
                                        ncq_tfs->sector_count, ncq_tfs->lba);
         dma_acct_start(ide_state->blk, &ncq_tfs->acct,
                        &ncq_tfs->sglist, BLOCK_ACCT_WRITE);
-        ncq_tfs->aiocb = dma_blk_write(ide_state->blk, &ncq_tfs->sglist,
-                                       ncq_tfs->lba << BDRV_SECTOR_BITS,
-                                       BDRV_SECTOR_SIZE,
-                                       ncq_cb, ncq_tfs);
+        ncq_tfs->aiocb = dma_blk_io(ahci_ncq_aio_context(ad),
+                                    &ncq_tfs->sglist,
+                                    ncq_tfs->lba << BDRV_SECTOR_BITS,
+                                    BDRV_SECTOR_SIZE,
+                                    ahci_ncq_writev, ide_state->blk,
+                                    ncq_cb, ncq_tfs,
+                                    DMA_DIRECTION_TO_DEVICE);
         break;
     default:
         trace_execute_ncq_command_unsup(ad->hba, port,
@@ -1300,6 +1585,16 @@ static int handle_cmd(AHCIState *s, int port, uint8_t slot)
 
     tbl_addr = le64_to_cpu(cmd->tbl_addr);
     cmd_len = 0x80;
+
+    /* The command table and the PRDT must not need the BQL to be read */
+    if (!qemu_mutex_iothread_locked() &&
+        !ahci_range_is_ram(s->as, tbl_addr,
+                           0x80 + le16_to_cpu(cmd->prdtl) * sizeof(AHCI_SG),
+                           false)) {
+        ahci_schedule_check_cmd(&s->dev[port]);
+        return -1;
+    }
+
     cmd_fis = dma_memory_map(s->as, tbl_addr, &cmd_len,
                              DMA_DIRECTION_TO_DEVICE);
     if (!cmd_fis) {
@@ -1310,6 +1605,17 @@ static int handle_cmd(AHCIState *s, int port, uint8_t slot)
         trace_handle_cmd_badmap(s, port, cmd_len);
         goto out;
     }
+
+    /* Only NCQ commands bypass the IDE core, leave the rest to the BQL */
+    if (!qemu_mutex_iothread_locked() &&
+        !(cmd_fis[0] == SATA_FIS_TYPE_REGISTER_H2D &&
+          (cmd_fis[1] & SATA_FIS_REG_H2D_UPDATE_COMMAND_REGISTER) &&
+          is_ncq(cmd_fis[2]))) {
+        dma_memory_unmap(s->as, cmd_fis, cmd_len, DMA_DIRECTION_TO_DEVICE,
+                         cmd_len);
+        ahci_schedule_check_cmd(&s->dev[port]);
+        return -1;
+    }
     if (trace_event_get_state_backends(TRACE_HANDLE_CMD_FIS_DUMP)) {
         char *pretty_fis = ahci_pretty_buffer_fis(cmd_fis, 0x80);
         trace_handle_cmd_fis_dump(s, port, pretty_fis);
@@ -1422,12 +1728,14 @@ static void ahci_restart(const IDEDMA *dma)
     AHCIDevice *ad = DO_UPCAST(AHCIDevice, dma, dma);
     int i;
 
+    ahci_lock(ad->hba);
     for (i = 0; i < AHCI_MAX_CMDS; i++) {
         NCQTransferState *ncq_tfs = &ad->ncq_tfs[i];
         if (ncq_tfs->halt) {
             execute_ncq_command(ncq_tfs);
         }
     }
+    ahci_unlock(ad->hba);
 }
 
 /**
@@ -1494,6 +1802,8 @@ static void ahci_cmd_done(const IDEDMA *dma)
 
     trace_ahci_cmd_done(ad->hba, ad->port_no);
 
+    ahci_lock(ad->hba);
+
     /* no longer busy */
     if (ad->busy_slot != -1) {
         ad->port_regs.cmd_issue &= ~(1 << ad->busy_slot);
@@ -1503,10 +1813,14 @@ static void ahci_cmd_done(const IDEDMA *dma)
     /* update d2h status */
     ahci_write_fis_d2h(ad);
 
-    if (ad->port_regs.cmd_issue && !ad->check_bh) {
-        ad->check_bh = qemu_bh_new(ahci_check_cmd_bh, ad);
-        qemu_bh_schedule(ad->check_bh);
+    if (ad->port_regs.cmd_issue) {
+        if (ad->iothread_ok) {
+            event_notifier_set(&ad->hba->ci_notifier);
+        } else {
+            ahci_schedule_check_cmd(ad);
+        }
     }
+    ahci_unlock(ad->hba);
 }
 
 static void ahci_irq_set(void *opaque, int n, int level)
@@ -1543,6 +1857,22 @@ void ahci_realize(AHCIState *s, DeviceState *qdev, AddressSpace *as, int ports)
     s->as = as;
     s->ports = ports;
     s->dev = g_new0(AHCIDevice, ports);
+    if (s->iothread) {
+        int ret = event_notifier_init(&s->ci_notifier, 0);
+
+        if (ret < 0) {
+            warn_report("ahci: cannot create notifier (%s), not using "
+                        "the iothread", strerror(-ret));
+        } else {
+            s->ctx = iothread_get_aio_context(s->iothread);
+            s->irq_bh = qemu_bh_new(ahci_irq_bh, s);
+            qemu_mutex_init(&s->reg_lock);
+            QSIMPLEQ_INIT(&s->reg_writes);
+            s->reg_bh = qemu_bh_new(ahci_reg_bh, s);
+            aio_set_event_notifier(s->ctx, &s->ci_notifier, true,
+                                   ahci_ci_notifier_read, NULL);
+        }
+    }
     ahci_reg_init(s);
     irqs = qemu_allocate_irqs(ahci_irq_set, s, s->ports);
     for (i = 0; i < s->ports; i++) {
@@ -1564,9 +1894,17 @@ void ahci_uninit(AHCIState *s)
 {
     int i, j;
 
+    if (s->ctx) {
+        aio_set_event_notifier(s->ctx, &s->ci_notifier, true, NULL, NULL);
+        event_notifier_cleanup(&s->ci_notifier);
+    }
+
     for (i = 0; i < s->ports; i++) {
         AHCIDevice *ad = &s->dev[i];
 
+        if (ad->iothread_ok) {
+            blk_set_multiqueue(ad->port.ifs[0].blk, false, NULL);
+        }
         for (j = 0; j < 2; j++) {
             IDEState *s = &ad->port.ifs[j];
 
@@ -1575,10 +1913,22 @@ void ahci_uninit(AHCIState *s)
         object_unparent(OBJECT(&ad->port));
     }
 
+    if (s->irq_bh) {
+        qemu_bh_delete(s->irq_bh);
+    }
+    if (s->reg_bh) {
+        AHCIRegWrite *w, *next_w;
+
+        qemu_bh_delete(s->reg_bh);
+        QSIMPLEQ_FOREACH_SAFE(w, &s->reg_writes, next, next_w) {
+            g_free(w);
+        }
+        qemu_mutex_destroy(&s->reg_lock);
+    }
     g_free(s->dev);
 }
 
-void ahci_reset(AHCIState *s)
+static void ahci_do_reset(AHCIState *s)
 {
     AHCIPortRegs *pr;
     int i;
@@ -1606,6 +1956,43 @@ void ahci_reset(AHCIState *s)
     }
 }
 
+/*
+ * Drives are attached after the HBA is realized, so decide at reset
+ * which ports can have their NCQ commands handled by the iothread.
+ */
+static void ahci_setup_iothread_ports(AHCIState *s)
+{
+    int i;
+
+    for (i = 0; i < s->ports; i++) {
+        AHCIDevice *ad = &s->dev[i];
+        BlockBackend *blk = ad->port.ifs[0].blk;
+        Error *local_err = NULL;
+
+        ad->iothread_ok = false;
+        if (!blk) {
+            continue;
+        }
+        if (blk_set_multiqueue(blk, true, &local_err)) {
+            ad->iothread_ok = true;
+        } else {
+            warn_report_err(local_err);
+            warn_report("ahci: port %d handles NCQ commands in the main loop",
+                        i);
+        }
+    }
+}
+
+void ahci_reset(AHCIState *s)
+{
+    ahci_lock(s);
+    ahci_do_reset(s);
+    if (s->ctx) {
+        ahci_setup_iothread_ports(s);
+    }
+    ahci_unlock(s);
+}
+
 static const VMStateDescription vmstate_ncq_tfs = {
     .name = "ncq state",
     .version_id = 1,
@@ -1652,13 +2039,12 @@ static const VMStateDescription vmstate_ahci_device = {
     },
 };
 
-static int ahci_state_post_load(void *opaque, int version_id)
+static int ahci_do_post_load(AHCIState *s)
 {
     int i, j;
     struct AHCIDevice *ad;
     NCQTransferState *ncq_tfs;
     AHCIPortRegs *pr;
-    AHCIState *s = opaque;
 
     for (i = 0; i < s->ports; i++) {
         ad = &s->dev[i];
@@ -1737,9 +2123,40 @@ static int ahci_state_post_load(void *opaque, int version_id)
     return 0;
 }
 
+static int ahci_state_post_load(void *opaque, int version_id)
+{
+    AHCIState *s = opaque;
+    int ret;
+
+    ahci_lock(s);
+    ret = ahci_do_post_load(s);
+    ahci_unlock(s);
+    return ret;
+}
+
+/* Migrate PxCI writes that the iothread has not picked up yet */
+static int ahci_state_pre_save(void *opaque)
+{
+    AHCIState *s = opaque;
+    int i;
+
+    if (s->reg_bh) {
+        /* Writes still queued must land in the migrated state */
+        ahci_reg_bh(s);
+    }
+    ahci_lock(s);
+    for (i = 0; i < s->ports; i++) {
+        s->dev[i].port_regs.cmd_issue |=
+            qatomic_xchg(&s->dev[i].ci_latched, 0);
+    }
+    ahci_unlock(s);
+    return 0;
+}
+
 const VMStateDescription vmstate_ahci = {
     .name = "ahci",
     .version_id = 1,
+    .pre_save = ahci_state_pre_save,
     .post_load = ahci_state_post_load,
     .fields = (VMStateField[]) {
         VMSTATE_STRUCT_VARRAY_POINTER_INT32(dev, AHCIState, ports,
@@ -291,6 +291,14 @@ typedef struct AHCI_SG {
     uint32_t    flags_size;
 } QEMU_PACKED AHCI_SG;
 
+/* A register write deferred because the iothread held the HBA lock */
+typedef struct AHCIRegWrite {
+    hwaddr addr;
+    uint64_t val;
+    unsigned size;
+    QSIMPLEQ_ENTRY(AHCIRegWrite) next;
+} AHCIRegWrite;
+
 typedef struct NCQTransferState {
     AHCIDevice *drive;
     BlockAIOCB *aiocb;
@@ -315,6 +323,8 @@ struct AHCIDevice {
     AHCIPortRegs port_regs;
     struct AHCIState *hba;
     QEMUBH *check_bh;
+    bool iothread_ok;       /* the drive accepts requests from the iothread */
+    uint32_t ci_latched;    /* PxCI bits not yet seen by check_cmd, atomic */
     uint8_t *lst;
     uint8_t *res_fis;
     bool done_first_drq;
@@ -130,10 +130,12 @@ struct E1000State_st {
 #define E1000_FLAG_MIT_BIT 1
 #define E1000_FLAG_MAC_BIT 2
 #define E1000_FLAG_TSO_BIT 3
+#define E1000_FLAG_COALESCE_TDT_BIT 4
 #define E1000_FLAG_AUTONEG (1 << E1000_FLAG_AUTONEG_BIT)
 #define E1000_FLAG_MIT (1 << E1000_FLAG_MIT_BIT)
 #define E1000_FLAG_MAC (1 << E1000_FLAG_MAC_BIT)
 #define E1000_FLAG_TSO (1 << E1000_FLAG_TSO_BIT)
+#define E1000_FLAG_COALESCE_TDT (1 << E1000_FLAG_COALESCE_TDT_BIT)
     uint32_t compat_flags;
     bool received_tx_tso;
     bool use_tso_for_migration;
@@ -1340,9 +1342,30 @@ e1000_mmio_read(void *opaque, hwaddr addr, unsigned size)
     return 0;
 }
 
+/*
+ * Transmission goes up to the tail, so a TDT write that is immediately
+ * followed by another one needs not start it.
+ */
+static void
+e1000_mmio_write_batch(void *opaque, const MemoryRegionBatchWrite *writes,
+                       unsigned n)
+{
+    unsigned i;
+
+    for (i = 0; i < n; i++) {
+        if (i + 1 < n && writes[i].addr == E1000_TDT &&
+            writes[i + 1].addr == E1000_TDT) {
+            continue;
+        }
+        e1000_mmio_write(opaque, writes[i].addr, writes[i].data,
+                         writes[i].size);
+    }
+}
+
 static const MemoryRegionOps e1000_mmio_ops = {
     .read = e1000_mmio_read,
     .write = e1000_mmio_write,
+    .write_batch = e1000_mmio_write_batch,
     .endianness = DEVICE_LITTLE_ENDIAN,
     .impl = {
         .min_access_size = 4,
@@ -1639,6 +1662,9 @@ e1000_mmio_setup(E1000State *d)
     for (i = 0; excluded_regs[i] != PNPMMIO_SIZE; i++)
         memory_region_add_coalescing(&d->mmio, excluded_regs[i] + 4,
                                      excluded_regs[i+1] - excluded_regs[i] - 4);
+    if (d->compat_flags & E1000_FLAG_COALESCE_TDT) {
+        memory_region_add_coalescing_doorbell(&d->mmio, E1000_TDT, 4);
+    }
     memory_region_init_io(&d->io, OBJECT(d), &e1000_io_ops, d, "e1000-io", IOPORT_SIZE);
 }
 
@@ -1733,6 +1759,8 @@ static Property e1000_properties[] = {
                     compat_flags, E1000_FLAG_MAC_BIT, true),
     DEFINE_PROP_BIT("migrate_tso_props", E1000State,
                     compat_flags, E1000_FLAG_TSO_BIT, true),
+    DEFINE_PROP_BIT("x-coalesce-tdt", E1000State,
+                    compat_flags, E1000_FLAG_COALESCE_TDT_BIT, false),
     DEFINE_PROP_END_OF_LIST(),
 };
 
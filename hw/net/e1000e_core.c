@@ -53,6 +53,9 @@
                                      second according to spec 10.2.4.2 */
 #define E1000E_MAX_TX_FRAGS (64)
 
+/* Maximum number of descriptors fetched or written back with one DMA */
+#define E1000E_DESC_BATCH   (32)
+
 static inline void
 e1000e_set_interrupt_cause(E1000ECore *core, uint32_t val);
 
@@ -767,26 +770,6 @@ e1000e_rx_wb_interrupt_cause(E1000ECore *core, int queue_idx,
     return (queue_idx == 0) ? E1000_ICR_RXQ0 : E1000_ICR_RXQ1;
 }
 
-static uint32_t
-e1000e_txdesc_writeback(E1000ECore *core, dma_addr_t base,
-                        struct e1000_tx_desc *dp, bool *ide, int queue_idx)
-{
-    uint32_t txd_upper, txd_lower = le32_to_cpu(dp->lower.data);
-
-    if (!(txd_lower & E1000_TXD_CMD_RS) &&
-        !(core->mac[IVAR] & E1000_IVAR_TX_INT_EVERY_WB)) {
-        return 0;
-    }
-
-    *ide = (txd_lower & E1000_TXD_CMD_IDE) ? true : false;
-
-    txd_upper = le32_to_cpu(dp->upper.data) | E1000_TXD_STAT_DD;
-
-    dp->upper.data = cpu_to_le32(txd_upper);
-    pci_dma_write(core->owner, base + ((char *)&dp->upper - (char *)dp),
-                  &dp->upper, sizeof(dp->upper));
-    return e1000e_tx_wb_interrupt_cause(core, queue_idx);
-}
 
 typedef struct E1000E_RingInfo_st {
     int dbah;
@@ -860,6 +843,81 @@ e1000e_ring_len(E1000ECore *core, const E1000E_RingInfo *r)
     return core->mac[r->dlen];
 }
 
+/*
+ * Descriptors are fetched from the guest in runs that stop at the tail
+ * or at the end of the ring, and the ones that were handed out are
+ * written back with a single DMA when the run is exhausted or the
+ * caller is done with the ring.
+ */
+typedef struct E1000E_DescCache_st {
+    uint8_t data[E1000E_DESC_BATCH * E1000_MAX_RX_DESC_LEN];
+    dma_addr_t base;
+    uint32_t len;
+    uint32_t pos;
+    bool dirty;
+} E1000E_DescCache;
+
+static void
+e1000e_desc_cache_flush(E1000ECore *core, E1000E_DescCache *c)
+{
+    if (c->dirty) {
+        pci_dma_write(core->owner, c->base, c->data, c->pos);
+    }
+
+    c->len = 0;
+    c->pos = 0;
+    c->dirty = false;
+}
+
+static uint8_t *
+e1000e_desc_cache_next(E1000ECore *core, const E1000E_RingInfo *r,
+                       E1000E_DescCache *c, uint32_t desc_len,
+                       dma_addr_t *addr)
+{
+    uint8_t *desc;
+
+    if (c->pos == c->len) {
+        uint32_t slots = e1000e_ring_free_descr_num(core, r);
+        uint32_t n;
+
+        e1000e_desc_cache_flush(core, c);
+
+        slots = MIN(slots, e1000e_ring_len(core, r) / E1000_RING_DESC_LEN -
+                           core->mac[r->dh]);
+        n = MIN(slots * E1000_RING_DESC_LEN / desc_len, E1000E_DESC_BATCH);
+
+        c->base = e1000e_ring_head_descr(core, r);
+        c->len = MAX(n, 1) * desc_len;
+        pci_dma_read(core->owner, c->base, c->data, c->len);
+    }
+
+    desc = c->data + c->pos;
+    *addr = c->base + c->pos;
+    c->pos += desc_len;
+
+    return desc;
+}
+
+static uint32_t
+e1000e_txdesc_writeback(E1000ECore *core, E1000E_DescCache *c,
+                        struct e1000_tx_desc *dp, bool *ide, int queue_idx)
+{
+    uint32_t txd_upper, txd_lower = le32_to_cpu(dp->lower.data);
+
+    if (!(txd_lower & E1000_TXD_CMD_RS) &&
+        !(core->mac[IVAR] & E1000_IVAR_TX_INT_EVERY_WB)) {
+        return 0;
+    }
+
+    *ide = (txd_lower & E1000_TXD_CMD_IDE) ? true : false;
+
+    txd_upper = le32_to_cpu(dp->upper.data) | E1000_TXD_STAT_DD;
+
+    dp->upper.data = cpu_to_le32(txd_upper);
+    c->dirty = true;
+    return e1000e_tx_wb_interrupt_cause(core, queue_idx);
+}
+
 typedef struct E1000E_TxRing_st {
     const E1000E_RingInfo *i;
     struct e1000e_tx *tx;
@@ -906,7 +964,8 @@ static void
 e1000e_start_xmit(E1000ECore *core, const E1000E_TxRing *txr)
 {
     dma_addr_t base;
-    struct e1000_tx_desc desc;
+    struct e1000_tx_desc *desc;
+    E1000E_DescCache cache = { 0 };
     bool ide = false;
     const E1000E_RingInfo *txi = txr->i;
     uint32_t cause = E1000_ICS_TXQE;
@@ -917,18 +976,18 @@ e1000e_start_xmit(E1000ECore *core, const E1000E_TxRing *txr)
     }
 
     while (!e1000e_ring_empty(core, txi)) {
-        base = e1000e_ring_head_descr(core, txi);
-
-        pci_dma_read(core->owner, base, &desc, sizeof(desc));
+        desc = (struct e1000_tx_desc *)
+            e1000e_desc_cache_next(core, txi, &cache, sizeof(*desc), &base);
 
-        trace_e1000e_tx_descr((void *)(intptr_t)desc.buffer_addr,
-                              desc.lower.data, desc.upper.data);
+        trace_e1000e_tx_descr((void *)(intptr_t)desc->buffer_addr,
+                              desc->lower.data, desc->upper.data);
 
-        e1000e_process_tx_desc(core, txr->tx, &desc, txi->idx);
-        cause |= e1000e_txdesc_writeback(core, base, &desc, &ide, txi->idx);
+        e1000e_process_tx_desc(core, txr->tx, desc, txi->idx);
+        cause |= e1000e_txdesc_writeback(core, &cache, desc, &ide, txi->idx);
 
         e1000e_ring_advance(core, txi, 1);
     }
+    e1000e_desc_cache_flush(core, &cache);
 
     if (!ide || !e1000e_intrmgr_delay_tx_causes(core, &cause)) {
         e1000e_set_interrupt_cause(core, cause);
@@ -1489,9 +1548,9 @@ e1000e_write_packet_to_guest(E1000ECore *core, struct NetRxPkt *pkt,
                              const E1000E_RxRing *rxr,
                              const E1000E_RSSInfo *rss_info)
 {
-    PCIDevice *d = core->owner;
     dma_addr_t base;
-    uint8_t desc[E1000_MAX_RX_DESC_LEN];
+    uint8_t *desc;
+    E1000E_DescCache cache = { 0 };
     size_t desc_size;
     size_t desc_offset = 0;
     size_t iov_ofs = 0;
@@ -1518,12 +1577,12 @@ e1000e_write_packet_to_guest(E1000ECore *core, struct NetRxPkt *pkt,
         }
 
         if (e1000e_ring_empty(core, rxi)) {
+            e1000e_desc_cache_flush(core, &cache);
             return;
         }
 
-        base = e1000e_ring_head_descr(core, rxi);
-
-        pci_dma_read(d, base, &desc, core->rx_desc_len);
+        desc = e1000e_desc_cache_next(core, rxi, &cache, core->rx_desc_len,
+                                      &base);
 
         trace_e1000e_rx_descr(rxi->idx, base, core->rx_desc_len);
 
@@ -1599,12 +1658,13 @@ e1000e_write_packet_to_guest(E1000ECore *core, struct NetRxPkt *pkt,
 
         e1000e_write_rx_descr(core, desc, is_last ? core->rx_pkt : NULL,
                            rss_info, do_ps ? ps_hdr_len : 0, &bastate.written);
-        pci_dma_write(d, base, &desc, core->rx_desc_len);
+        cache.dirty = true;
 
         e1000e_ring_advance(core, rxi,
                             core->rx_desc_len / E1000_MIN_RX_DESC_LEN);
 
     } while (desc_offset < total_size);
+    e1000e_desc_cache_flush(core, &cache);
 
     e1000e_update_rx_stats(core, size, total_size);
 }
@@ -13,6 +13,7 @@
 
 #include "qemu/osdep.h"
 #include "qemu/atomic.h"
+#include "block/aio-wait.h"
 #include "qemu/iov.h"
 #include "qemu/main-loop.h"
 #include "qemu/module.h"
@@ -58,20 +59,8 @@
 #define VIRTIO_NET_RX_QUEUE_MIN_SIZE VIRTIO_NET_RX_QUEUE_DEFAULT_SIZE
 #define VIRTIO_NET_TX_QUEUE_MIN_SIZE VIRTIO_NET_TX_QUEUE_DEFAULT_SIZE
 
-#define VIRTIO_NET_IP4_ADDR_SIZE   8        /* ipv4 saddr + daddr */
-
-#define VIRTIO_NET_TCP_FLAG         0x3F
-#define VIRTIO_NET_TCP_HDR_LENGTH   0xF000
-
-/* IPv4 max payload, 16 bits in the header */
-#define VIRTIO_NET_MAX_IP4_PAYLOAD (65535 - sizeof(struct ip_header))
-#define VIRTIO_NET_MAX_TCP_PAYLOAD 65535
-
-/* header length value in ip header without option */
-#define VIRTIO_NET_IP4_HEADER_LENGTH 5
-
-#define VIRTIO_NET_IP6_ADDR_SIZE   32      /* ipv6 saddr + daddr */
-#define VIRTIO_NET_MAX_IP6_PAYLOAD VIRTIO_NET_MAX_TCP_PAYLOAD
+/* Number of tx elements popped and completed at a time */
+#define VIRTIO_NET_TX_BATCH 32
 
 /* Purge coalesced packets timer interval, This value affects the performance
    a lot, and should be tuned carefully, '300000'(300us) is the recommended
@@ -117,6 +106,33 @@ static int vq2q(int queue_index)
     return queue_index / 2;
 }
 
+/*
+ * With an iothread, everything that touches the queues or the receive
+ * filters takes its AioContext lock, whichever thread it runs in.
+ */
+static void virtio_net_acquire(VirtIONet *n)
+{
+    if (n->ctx) {
+        aio_context_acquire(n->ctx);
+    }
+}
+
+static void virtio_net_release(VirtIONet *n)
+{
+    if (n->ctx) {
+        aio_context_release(n->ctx);
+    }
+}
+
+static void virtio_net_notify(VirtIONet *n, VirtQueue *vq)
+{
+    if (n->dataplane_started) {
+        virtio_notify_irqfd(VIRTIO_DEVICE(n), vq);
+    } else {
+        virtio_notify(VIRTIO_DEVICE(n), vq);
+    }
+}
+
 /* TODO
  * - we could suppress RX interrupt if we were so inclined.
  */
@@ -354,7 +370,7 @@ static void virtio_net_drop_tx_queue_data(VirtIODevice *vdev, VirtQueue *vq)
 {
     unsigned int dropped = virtqueue_drop_all(vq);
     if (dropped) {
-        virtio_notify(vdev, vq);
+        virtio_net_notify(VIRTIO_NET(vdev), vq);
     }
 }
 
@@ -368,6 +384,7 @@ static void virtio_net_set_status(struct VirtIODevice *vdev, uint8_t status)
     virtio_net_vnet_endian_status(n, status);
     virtio_net_vhost_status(n, status);
 
+    virtio_net_acquire(n);
     for (i = 0; i < n->max_queues; i++) {
         NetClientState *ncs = qemu_get_subqueue(n->nic, i);
         bool queue_started;
@@ -413,6 +430,7 @@ static void virtio_net_set_status(struct VirtIODevice *vdev, uint8_t status)
             }
         }
     }
+    virtio_net_release(n);
 }
 
 static void virtio_net_set_link_status(NetClientState *nc)
@@ -421,6 +439,7 @@ static void virtio_net_set_link_status(NetClientState *nc)
     VirtIODevice *vdev = VIRTIO_DEVICE(n);
     uint16_t old_status = n->status;
 
+    virtio_net_acquire(n);
     if (nc->link_down)
         n->status &= ~VIRTIO_NET_S_LINK_UP;
     else
@@ -430,6 +449,7 @@ static void virtio_net_set_link_status(NetClientState *nc)
         virtio_notify_config(vdev);
 
     virtio_net_set_status(vdev, vdev->status);
+    virtio_net_release(n);
 }
 
 static void rxfilter_notify(NetClientState *nc)
@@ -737,7 +757,10 @@ static uint64_t virtio_net_get_features(VirtIODevice *vdev, uint64_t features,
         return features;
     }
 
-    virtio_clear_feature(&features, VIRTIO_NET_F_RSS);
+    /* RSS with vhost only works if the tap device steers the packets */
+    if (!ebpf_rss_is_loaded(&n->ebpf_rss)) {
+        virtio_clear_feature(&features, VIRTIO_NET_F_RSS);
+    }
     virtio_clear_feature(&features, VIRTIO_NET_F_HASH_REPORT);
     features = vhost_net_get_features(get_vhost_net(nc->peer), features);
     vdev->backend_features = features;
@@ -911,6 +934,7 @@ static void virtio_net_set_features(VirtIODevice *vdev, uint64_t features)
         virtio_has_feature(features, VIRTIO_NET_F_GUEST_TSO4);
     n->rsc6_enabled = virtio_has_feature(features, VIRTIO_NET_F_RSC_EXT) &&
         virtio_has_feature(features, VIRTIO_NET_F_GUEST_TSO6);
+    net_gro_set_enabled(n->rsc, n->rsc4_enabled, n->rsc6_enabled);
     n->rss_data.redirect = virtio_has_feature(features, VIRTIO_NET_F_RSS);
 
     if (n->has_vnet_hdr) {
@@ -1006,6 +1030,7 @@ static int virtio_net_handle_offloads(VirtIONet *n, uint8_t cmd,
             virtio_has_feature(offloads, VIRTIO_NET_F_GUEST_TSO4);
         n->rsc6_enabled = virtio_has_feature(offloads, VIRTIO_NET_F_RSC_EXT) &&
             virtio_has_feature(offloads, VIRTIO_NET_F_GUEST_TSO6);
+        net_gro_set_enabled(n->rsc, n->rsc4_enabled, n->rsc6_enabled);
         virtio_clear_feature(&offloads, VIRTIO_NET_F_RSC_EXT);
 
         supported_offloads = virtio_net_supported_guest_offloads(n);
@@ -1163,12 +1188,73 @@ static int virtio_net_handle_announce(VirtIONet *n, uint8_t cmd,
     }
 }
 
-static void virtio_net_disable_rss(VirtIONet *n)
+static bool virtio_net_attach_ebpf_to_backend(NICState *nic, int prog_fd)
+{
+    NetClientState *nc = qemu_get_queue(nic)->peer;
+
+    if (!nc || !nc->info->set_steering_ebpf) {
+        return false;
+    }
+
+    return nc->info->set_steering_ebpf(nc, prog_fd);
+}
+
+static bool virtio_net_attach_ebpf_rss(VirtIONet *n)
+{
+    struct EBPFRSSConfig config = {};
+
+    if (!ebpf_rss_is_loaded(&n->ebpf_rss)) {
+        return false;
+    }
+
+    config.hash_types = n->rss_data.hash_types;
+    config.indirections_len = n->rss_data.indirections_len;
+    config.default_queue = n->rss_data.default_queue;
+
+    if (!ebpf_rss_set_all(&n->ebpf_rss, &config,
+                          n->rss_data.indirections_table, n->rss_data.key)) {
+        return false;
+    }
+
+    return virtio_net_attach_ebpf_to_backend(n->nic, n->ebpf_rss.program_fd);
+}
+
+static void virtio_net_detach_ebpf_rss(VirtIONet *n)
+{
+    if (ebpf_rss_is_loaded(&n->ebpf_rss)) {
+        virtio_net_attach_ebpf_to_backend(n->nic, -1);
+    }
+}
+
+/*
+ * Steer with the eBPF program in the tap device if possible, which also
+ * works with vhost.  The hash report needs the hash in the virtio-net
+ * header, so it can only be done in software.
+ */
+static void virtio_net_commit_rss_config(VirtIONet *n)
 {
     if (n->rss_data.enabled) {
-        trace_virtio_net_rss_disable();
+        n->rss_data.enabled_software_rss = n->rss_data.populate_hash;
+        if (n->rss_data.populate_hash) {
+            virtio_net_detach_ebpf_rss(n);
+        } else if (!virtio_net_attach_ebpf_rss(n)) {
+            n->rss_data.enabled_software_rss = true;
+        }
+    } else {
+        n->rss_data.enabled_software_rss = false;
+        virtio_net_detach_ebpf_rss(n);
     }
+}
+
+static void virtio_net_disable_rss(VirtIONet *n)
+{
+    if (!n->rss_data.enabled) {
+        return;
+    }
+
+    trace_virtio_net_rss_disable();
     n->rss_data.enabled = false;
+    virtio_net_commit_rss_config(n);
 }
 
 static uint16_t virtio_net_handle_rss(VirtIONet *n,
@@ -1283,6 +1369,7 @@ static uint16_t virtio_net_handle_rss(VirtIONet *n,
         goto error;
     }
     n->rss_data.enabled = true;
+    virtio_net_commit_rss_config(n);
     trace_virtio_net_rss_enable(n->rss_data.hash_types,
                                 n->rss_data.indirections_len,
                                 temp.b);
@@ -1348,6 +1435,7 @@ static void virtio_net_handle_ctrl(VirtIODevice *vdev, VirtQueue *vq)
     struct iovec *iov, *iov2;
     unsigned int iov_cnt;
 
+    virtio_net_acquire(n);
     for (;;) {
         elem = virtqueue_pop(vq, sizeof(VirtQueueElement));
         if (!elem) {
@@ -1389,6 +1477,7 @@ static void virtio_net_handle_ctrl(VirtIODevice *vdev, VirtQueue *vq)
         g_free(iov2);
         g_free(elem);
     }
+    virtio_net_release(n);
 }
 
 /* RX */
@@ -1406,21 +1495,18 @@ static bool virtio_net_can_receive(NetClientState *nc)
     VirtIONet *n = qemu_get_nic_opaque(nc);
     VirtIODevice *vdev = VIRTIO_DEVICE(n);
     VirtIONetQueue *q = virtio_net_get_subqueue(nc);
+    bool ret;
 
     if (!vdev->vm_running) {
         return false;
     }
 
-    if (nc->queue_index >= n->curr_queues) {
-        return false;
-    }
-
-    if (!virtio_queue_ready(q->rx_vq) ||
-        !(vdev->status & VIRTIO_CONFIG_S_DRIVER_OK)) {
-        return false;
-    }
-
-    return true;
+    virtio_net_acquire(n);
+    ret = nc->queue_index < n->curr_queues &&
+          virtio_queue_ready(q->rx_vq) &&
+          (vdev->status & VIRTIO_CONFIG_S_DRIVER_OK);
+    virtio_net_release(n);
+    return ret;
 }
 
 static int virtio_net_has_buffers(VirtIONetQueue *q, int bufsize)
@@ -1668,7 +1754,7 @@ static ssize_t virtio_net_receive_rcu(NetClientState *nc, const uint8_t *buf,
         return -1;
     }
 
-    if (!no_rss && n->rss_data.enabled) {
+    if (!no_rss && n->rss_data.enabled && n->rss_data.enabled_software_rss) {
         int index = virtio_net_process_rss(nc, buf, size);
         if (index >= 0) {
             NetClientState *nc2 = qemu_get_subqueue(n->nic, index);
@@ -1765,7 +1851,11 @@ static ssize_t virtio_net_receive_rcu(NetClientState *nc, const uint8_t *buf,
     }
 
     virtqueue_flush(q->rx_vq, i);
-    virtio_notify(vdev, q->rx_vq);
+    if (n->rx_batch) {
+        q->rx_notify_pending = true;
+    } else {
+        virtio_net_notify(n, q->rx_vq);
+    }
 
     return size;
 }
@@ -1778,608 +1868,46 @@ static ssize_t virtio_net_do_receive(NetClientState *nc, const uint8_t *buf,
     return virtio_net_receive_rcu(nc, buf, size, false);
 }
 
-static void virtio_net_rsc_extract_unit4(VirtioNetRscChain *chain,
-                                         const uint8_t *buf,
-                                         VirtioNetRscUnit *unit)
+static ssize_t virtio_net_rsc_deliver(void *opaque, NetClientState *nc,
+                                      const uint8_t *buf, size_t size,
+                                      NetGROSegment *seg)
 {
-    uint16_t ip_hdrlen;
-    struct ip_header *ip;
-
-    ip = (struct ip_header *)(buf + chain->n->guest_hdr_len
-                              + sizeof(struct eth_header));
-    unit->ip = (void *)ip;
-    ip_hdrlen = (ip->ip_ver_len & 0xF) << 2;
-    unit->ip_plen = &ip->ip_len;
-    unit->tcp = (struct tcp_header *)(((uint8_t *)unit->ip) + ip_hdrlen);
-    unit->tcp_hdrlen = (htons(unit->tcp->th_offset_flags) & 0xF000) >> 10;
-    unit->payload = htons(*unit->ip_plen) - ip_hdrlen - unit->tcp_hdrlen;
-}
-
-static void virtio_net_rsc_extract_unit6(VirtioNetRscChain *chain,
-                                         const uint8_t *buf,
-                                         VirtioNetRscUnit *unit)
-{
-    struct ip6_header *ip6;
-
-    ip6 = (struct ip6_header *)(buf + chain->n->guest_hdr_len
-                                 + sizeof(struct eth_header));
-    unit->ip = ip6;
-    unit->ip_plen = &(ip6->ip6_ctlun.ip6_un1.ip6_un1_plen);
-    unit->tcp = (struct tcp_header *)(((uint8_t *)unit->ip)
-                                        + sizeof(struct ip6_header));
-    unit->tcp_hdrlen = (htons(unit->tcp->th_offset_flags) & 0xF000) >> 10;
-
-    /* There is a difference between payload lenght in ipv4 and v6,
-       ip header is excluded in ipv6 */
-    unit->payload = htons(*unit->ip_plen) - unit->tcp_hdrlen;
-}
-
-static size_t virtio_net_rsc_drain_seg(VirtioNetRscChain *chain,
-                                       VirtioNetRscSeg *seg)
-{
-    int ret;
     struct virtio_net_hdr_v1 *h;
 
-    h = (struct virtio_net_hdr_v1 *)seg->buf;
-    h->flags = 0;
-    h->gso_type = VIRTIO_NET_HDR_GSO_NONE;
-
-    if (seg->is_coalesced) {
-        h->rsc.segments = seg->packets;
-        h->rsc.dup_acks = seg->dup_ack;
-        h->flags = VIRTIO_NET_HDR_F_RSC_INFO;
-        if (chain->proto == ETH_P_IP) {
-            h->gso_type = VIRTIO_NET_HDR_GSO_TCPV4;
-        } else {
-            h->gso_type = VIRTIO_NET_HDR_GSO_TCPV6;
-        }
-    }
-
-    ret = virtio_net_do_receive(seg->nc, seg->buf, seg->size);
-    QTAILQ_REMOVE(&chain->buffers, seg, next);
-    g_free(seg->buf);
-    g_free(seg);
-
-    return ret;
-}
-
-static void virtio_net_rsc_purge(void *opq)
-{
-    VirtioNetRscSeg *seg, *rn;
-    VirtioNetRscChain *chain = (VirtioNetRscChain *)opq;
-
-    QTAILQ_FOREACH_SAFE(seg, &chain->buffers, next, rn) {
-        if (virtio_net_rsc_drain_seg(chain, seg) == 0) {
-            chain->stat.purge_failed++;
-            continue;
-        }
-    }
-
-    chain->stat.timer++;
-    if (!QTAILQ_EMPTY(&chain->buffers)) {
-        timer_mod(chain->drain_timer,
-              qemu_clock_get_ns(QEMU_CLOCK_HOST) + chain->n->rsc_timeout);
-    }
-}
-
-static void virtio_net_rsc_cleanup(VirtIONet *n)
-{
-    VirtioNetRscChain *chain, *rn_chain;
-    VirtioNetRscSeg *seg, *rn_seg;
-
-    QTAILQ_FOREACH_SAFE(chain, &n->rsc_chains, next, rn_chain) {
-        QTAILQ_FOREACH_SAFE(seg, &chain->buffers, next, rn_seg) {
-            QTAILQ_REMOVE(&chain->buffers, seg, next);
-            g_free(seg->buf);
-            g_free(seg);
-        }
-
-        timer_free(chain->drain_timer);
-        QTAILQ_REMOVE(&n->rsc_chains, chain, next);
-        g_free(chain);
-    }
-}
-
-static void virtio_net_rsc_cache_buf(VirtioNetRscChain *chain,
-                                     NetClientState *nc,
-                                     const uint8_t *buf, size_t size)
-{
-    uint16_t hdr_len;
-    VirtioNetRscSeg *seg;
-
-    hdr_len = chain->n->guest_hdr_len;
-    seg = g_malloc(sizeof(VirtioNetRscSeg));
-    seg->buf = g_malloc(hdr_len + sizeof(struct eth_header)
-        + sizeof(struct ip6_header) + VIRTIO_NET_MAX_TCP_PAYLOAD);
-    memcpy(seg->buf, buf, size);
-    seg->size = size;
-    seg->packets = 1;
-    seg->dup_ack = 0;
-    seg->is_coalesced = 0;
-    seg->nc = nc;
-
-    QTAILQ_INSERT_TAIL(&chain->buffers, seg, next);
-    chain->stat.cache++;
-
-    switch (chain->proto) {
-    case ETH_P_IP:
-        virtio_net_rsc_extract_unit4(chain, seg->buf, &seg->unit);
-        break;
-    case ETH_P_IPV6:
-        virtio_net_rsc_extract_unit6(chain, seg->buf, &seg->unit);
-        break;
-    default:
-        g_assert_not_reached();
-    }
-}
-
-static int32_t virtio_net_rsc_handle_ack(VirtioNetRscChain *chain,
-                                         VirtioNetRscSeg *seg,
-                                         const uint8_t *buf,
-                                         struct tcp_header *n_tcp,
-                                         struct tcp_header *o_tcp)
-{
-    uint32_t nack, oack;
-    uint16_t nwin, owin;
-
-    nack = htonl(n_tcp->th_ack);
-    nwin = htons(n_tcp->th_win);
-    oack = htonl(o_tcp->th_ack);
-    owin = htons(o_tcp->th_win);
-
-    if ((nack - oack) >= VIRTIO_NET_MAX_TCP_PAYLOAD) {
-        chain->stat.ack_out_of_win++;
-        return RSC_FINAL;
-    } else if (nack == oack) {
-        /* duplicated ack or window probe */
-        if (nwin == owin) {
-            /* duplicated ack, add dup ack count due to whql test up to 1 */
-            chain->stat.dup_ack++;
-            return RSC_FINAL;
-        } else {
-            /* Coalesce window update */
-            o_tcp->th_win = n_tcp->th_win;
-            chain->stat.win_update++;
-            return RSC_COALESCE;
-        }
-    } else {
-        /* pure ack, go to 'C', finalize*/
-        chain->stat.pure_ack++;
-        return RSC_FINAL;
-    }
-}
-
-static int32_t virtio_net_rsc_coalesce_data(VirtioNetRscChain *chain,
-                                            VirtioNetRscSeg *seg,
-                                            const uint8_t *buf,
-                                            VirtioNetRscUnit *n_unit)
-{
-    void *data;
-    uint16_t o_ip_len;
-    uint32_t nseq, oseq;
-    VirtioNetRscUnit *o_unit;
-
-    o_unit = &seg->unit;
-    o_ip_len = htons(*o_unit->ip_plen);
-    nseq = htonl(n_unit->tcp->th_seq);
-    oseq = htonl(o_unit->tcp->th_seq);
-
-    /* out of order or retransmitted. */
-    if ((nseq - oseq) > VIRTIO_NET_MAX_TCP_PAYLOAD) {
-        chain->stat.data_out_of_win++;
-        return RSC_FINAL;
-    }
-
-    data = ((uint8_t *)n_unit->tcp) + n_unit->tcp_hdrlen;
-    if (nseq == oseq) {
-        if ((o_unit->payload == 0) && n_unit->payload) {
-            /* From no payload to payload, normal case, not a dup ack or etc */
-            chain->stat.data_after_pure_ack++;
-            goto coalesce;
-        } else {
-            return virtio_net_rsc_handle_ack(chain, seg, buf,
-                                             n_unit->tcp, o_unit->tcp);
-        }
-    } else if ((nseq - oseq) != o_unit->payload) {
-        /* Not a consistent packet, out of order */
-        chain->stat.data_out_of_order++;
-        return RSC_FINAL;
-    } else {
-coalesce:
-        if ((o_ip_len + n_unit->payload) > chain->max_payload) {
-            chain->stat.over_size++;
-            return RSC_FINAL;
-        }
-
-        /* Here comes the right data, the payload length in v4/v6 is different,
-           so use the field value to update and record the new data len */
-        o_unit->payload += n_unit->payload; /* update new data len */
-
-        /* update field in ip header */
-        *o_unit->ip_plen = htons(o_ip_len + n_unit->payload);
-
-        /* Bring 'PUSH' big, the whql test guide says 'PUSH' can be coalesced
-           for windows guest, while this may change the behavior for linux
-           guest (only if it uses RSC feature). */
-        o_unit->tcp->th_offset_flags = n_unit->tcp->th_offset_flags;
-
-        o_unit->tcp->th_ack = n_unit->tcp->th_ack;
-        o_unit->tcp->th_win = n_unit->tcp->th_win;
-
-        memmove(seg->buf + seg->size, data, n_unit->payload);
-        seg->size += n_unit->payload;
-        seg->packets++;
-        chain->stat.coalesced++;
-        return RSC_COALESCE;
-    }
-}
-
-static int32_t virtio_net_rsc_coalesce4(VirtioNetRscChain *chain,
-                                        VirtioNetRscSeg *seg,
-                                        const uint8_t *buf, size_t size,
-                                        VirtioNetRscUnit *unit)
-{
-    struct ip_header *ip1, *ip2;
-
-    ip1 = (struct ip_header *)(unit->ip);
-    ip2 = (struct ip_header *)(seg->unit.ip);
-    if ((ip1->ip_src ^ ip2->ip_src) || (ip1->ip_dst ^ ip2->ip_dst)
-        || (unit->tcp->th_sport ^ seg->unit.tcp->th_sport)
-        || (unit->tcp->th_dport ^ seg->unit.tcp->th_dport)) {
-        chain->stat.no_match++;
-        return RSC_NO_MATCH;
-    }
-
-    return virtio_net_rsc_coalesce_data(chain, seg, buf, unit);
-}
-
-static int32_t virtio_net_rsc_coalesce6(VirtioNetRscChain *chain,
-                                        VirtioNetRscSeg *seg,
-                                        const uint8_t *buf, size_t size,
-                                        VirtioNetRscUnit *unit)
-{
-    struct ip6_header *ip1, *ip2;
-
-    ip1 = (struct ip6_header *)(unit->ip);
-    ip2 = (struct ip6_header *)(seg->unit.ip);
-    if (memcmp(&ip1->ip6_src, &ip2->ip6_src, sizeof(struct in6_address))
-        || memcmp(&ip1->ip6_dst, &ip2->ip6_dst, sizeof(struct in6_address))
-        || (unit->tcp->th_sport ^ seg->unit.tcp->th_sport)
-        || (unit->tcp->th_dport ^ seg->unit.tcp->th_dport)) {
-            chain->stat.no_match++;
-            return RSC_NO_MATCH;
-    }
-
-    return virtio_net_rsc_coalesce_data(chain, seg, buf, unit);
-}
-
-/* Packets with 'SYN' should bypass, other flag should be sent after drain
- * to prevent out of order */
-static int virtio_net_rsc_tcp_ctrl_check(VirtioNetRscChain *chain,
-                                         struct tcp_header *tcp)
-{
-    uint16_t tcp_hdr;
-    uint16_t tcp_flag;
-
-    tcp_flag = htons(tcp->th_offset_flags);
-    tcp_hdr = (tcp_flag & VIRTIO_NET_TCP_HDR_LENGTH) >> 10;
-    tcp_flag &= VIRTIO_NET_TCP_FLAG;
-    if (tcp_flag & TH_SYN) {
-        chain->stat.tcp_syn++;
-        return RSC_BYPASS;
-    }
-
-    if (tcp_flag & (TH_FIN | TH_URG | TH_RST | TH_ECE | TH_CWR)) {
-        chain->stat.tcp_ctrl_drain++;
-        return RSC_FINAL;
-    }
-
-    if (tcp_hdr > sizeof(struct tcp_header)) {
-        chain->stat.tcp_all_opt++;
-        return RSC_FINAL;
-    }
-
-    return RSC_CANDIDATE;
-}
-
-static size_t virtio_net_rsc_do_coalesce(VirtioNetRscChain *chain,
-                                         NetClientState *nc,
-                                         const uint8_t *buf, size_t size,
-                                         VirtioNetRscUnit *unit)
-{
-    int ret;
-    VirtioNetRscSeg *seg, *nseg;
-
-    if (QTAILQ_EMPTY(&chain->buffers)) {
-        chain->stat.empty_cache++;
-        virtio_net_rsc_cache_buf(chain, nc, buf, size);
-        timer_mod(chain->drain_timer,
-              qemu_clock_get_ns(QEMU_CLOCK_HOST) + chain->n->rsc_timeout);
-        return size;
-    }
-
-    QTAILQ_FOREACH_SAFE(seg, &chain->buffers, next, nseg) {
-        if (chain->proto == ETH_P_IP) {
-            ret = virtio_net_rsc_coalesce4(chain, seg, buf, size, unit);
-        } else {
-            ret = virtio_net_rsc_coalesce6(chain, seg, buf, size, unit);
-        }
-
-        if (ret == RSC_FINAL) {
-            if (virtio_net_rsc_drain_seg(chain, seg) == 0) {
-                /* Send failed */
-                chain->stat.final_failed++;
-                return 0;
+    if (seg) {
+        h = (struct virtio_net_hdr_v1 *)seg->buf;
+        h->flags = 0;
+        h->gso_type = VIRTIO_NET_HDR_GSO_NONE;
+
+        if (seg->is_coalesced) {
+            h->rsc.segments = seg->packets;
+            h->rsc.dup_acks = seg->dup_ack;
+            h->flags = VIRTIO_NET_HDR_F_RSC_INFO;
+            if (seg->proto == ETH_P_IP) {
+                h->gso_type = VIRTIO_NET_HDR_GSO_TCPV4;
+            } else {
+                h->gso_type = VIRTIO_NET_HDR_GSO_TCPV6;
             }
-
-            /* Send current packet */
-            return virtio_net_do_receive(nc, buf, size);
-        } else if (ret == RSC_NO_MATCH) {
-            continue;
-        } else {
-            /* Coalesced, mark coalesced flag to tell calc cksum for ipv4 */
-            seg->is_coalesced = 1;
-            return size;
-        }
-    }
-
-    chain->stat.no_match_cache++;
-    virtio_net_rsc_cache_buf(chain, nc, buf, size);
-    return size;
-}
-
-/* Drain a connection data, this is to avoid out of order segments */
-static size_t virtio_net_rsc_drain_flow(VirtioNetRscChain *chain,
-                                        NetClientState *nc,
-                                        const uint8_t *buf, size_t size,
-                                        uint16_t ip_start, uint16_t ip_size,
-                                        uint16_t tcp_port)
-{
-    VirtioNetRscSeg *seg, *nseg;
-    uint32_t ppair1, ppair2;
-
-    ppair1 = *(uint32_t *)(buf + tcp_port);
-    QTAILQ_FOREACH_SAFE(seg, &chain->buffers, next, nseg) {
-        ppair2 = *(uint32_t *)(seg->buf + tcp_port);
-        if (memcmp(buf + ip_start, seg->buf + ip_start, ip_size)
-            || (ppair1 != ppair2)) {
-            continue;
-        }
-        if (virtio_net_rsc_drain_seg(chain, seg) == 0) {
-            chain->stat.drain_failed++;
         }
-
-        break;
     }
 
     return virtio_net_do_receive(nc, buf, size);
 }
 
-static int32_t virtio_net_rsc_sanity_check4(VirtioNetRscChain *chain,
-                                            struct ip_header *ip,
-                                            const uint8_t *buf, size_t size)
-{
-    uint16_t ip_len;
-
-    /* Not an ipv4 packet */
-    if (((ip->ip_ver_len & 0xF0) >> 4) != IP_HEADER_VERSION_4) {
-        chain->stat.ip_option++;
-        return RSC_BYPASS;
-    }
-
-    /* Don't handle packets with ip option */
-    if ((ip->ip_ver_len & 0xF) != VIRTIO_NET_IP4_HEADER_LENGTH) {
-        chain->stat.ip_option++;
-        return RSC_BYPASS;
-    }
-
-    if (ip->ip_p != IPPROTO_TCP) {
-        chain->stat.bypass_not_tcp++;
-        return RSC_BYPASS;
-    }
-
-    /* Don't handle packets with ip fragment */
-    if (!(htons(ip->ip_off) & IP_DF)) {
-        chain->stat.ip_frag++;
-        return RSC_BYPASS;
-    }
-
-    /* Don't handle packets with ecn flag */
-    if (IPTOS_ECN(ip->ip_tos)) {
-        chain->stat.ip_ecn++;
-        return RSC_BYPASS;
-    }
-
-    ip_len = htons(ip->ip_len);
-    if (ip_len < (sizeof(struct ip_header) + sizeof(struct tcp_header))
-        || ip_len > (size - chain->n->guest_hdr_len -
-                     sizeof(struct eth_header))) {
-        chain->stat.ip_hacked++;
-        return RSC_BYPASS;
-    }
-
-    return RSC_CANDIDATE;
-}
-
-static size_t virtio_net_rsc_receive4(VirtioNetRscChain *chain,
-                                      NetClientState *nc,
-                                      const uint8_t *buf, size_t size)
-{
-    int32_t ret;
-    uint16_t hdr_len;
-    VirtioNetRscUnit unit;
-
-    hdr_len = ((VirtIONet *)(chain->n))->guest_hdr_len;
-
-    if (size < (hdr_len + sizeof(struct eth_header) + sizeof(struct ip_header)
-        + sizeof(struct tcp_header))) {
-        chain->stat.bypass_not_tcp++;
-        return virtio_net_do_receive(nc, buf, size);
-    }
-
-    virtio_net_rsc_extract_unit4(chain, buf, &unit);
-    if (virtio_net_rsc_sanity_check4(chain, unit.ip, buf, size)
-        != RSC_CANDIDATE) {
-        return virtio_net_do_receive(nc, buf, size);
-    }
-
-    ret = virtio_net_rsc_tcp_ctrl_check(chain, unit.tcp);
-    if (ret == RSC_BYPASS) {
-        return virtio_net_do_receive(nc, buf, size);
-    } else if (ret == RSC_FINAL) {
-        return virtio_net_rsc_drain_flow(chain, nc, buf, size,
-                ((hdr_len + sizeof(struct eth_header)) + 12),
-                VIRTIO_NET_IP4_ADDR_SIZE,
-                hdr_len + sizeof(struct eth_header) + sizeof(struct ip_header));
-    }
-
-    return virtio_net_rsc_do_coalesce(chain, nc, buf, size, &unit);
-}
-
-static int32_t virtio_net_rsc_sanity_check6(VirtioNetRscChain *chain,
-                                            struct ip6_header *ip6,
-                                            const uint8_t *buf, size_t size)
-{
-    uint16_t ip_len;
-
-    if (((ip6->ip6_ctlun.ip6_un1.ip6_un1_flow & 0xF0) >> 4)
-        != IP_HEADER_VERSION_6) {
-        return RSC_BYPASS;
-    }
-
-    /* Both option and protocol is checked in this */
-    if (ip6->ip6_ctlun.ip6_un1.ip6_un1_nxt != IPPROTO_TCP) {
-        chain->stat.bypass_not_tcp++;
-        return RSC_BYPASS;
-    }
-
-    ip_len = htons(ip6->ip6_ctlun.ip6_un1.ip6_un1_plen);
-    if (ip_len < sizeof(struct tcp_header) ||
-        ip_len > (size - chain->n->guest_hdr_len - sizeof(struct eth_header)
-                  - sizeof(struct ip6_header))) {
-        chain->stat.ip_hacked++;
-        return RSC_BYPASS;
-    }
-
-    /* Don't handle packets with ecn flag */
-    if (IP6_ECN(ip6->ip6_ctlun.ip6_un3.ip6_un3_ecn)) {
-        chain->stat.ip_ecn++;
-        return RSC_BYPASS;
-    }
-
-    return RSC_CANDIDATE;
-}
-
-static size_t virtio_net_rsc_receive6(void *opq, NetClientState *nc,
-                                      const uint8_t *buf, size_t size)
-{
-    int32_t ret;
-    uint16_t hdr_len;
-    VirtioNetRscChain *chain;
-    VirtioNetRscUnit unit;
-
-    chain = (VirtioNetRscChain *)opq;
-    hdr_len = ((VirtIONet *)(chain->n))->guest_hdr_len;
-
-    if (size < (hdr_len + sizeof(struct eth_header) + sizeof(struct ip6_header)
-        + sizeof(tcp_header))) {
-        return virtio_net_do_receive(nc, buf, size);
-    }
-
-    virtio_net_rsc_extract_unit6(chain, buf, &unit);
-    if (RSC_CANDIDATE != virtio_net_rsc_sanity_check6(chain,
-                                                 unit.ip, buf, size)) {
-        return virtio_net_do_receive(nc, buf, size);
-    }
-
-    ret = virtio_net_rsc_tcp_ctrl_check(chain, unit.tcp);
-    if (ret == RSC_BYPASS) {
-        return virtio_net_do_receive(nc, buf, size);
-    } else if (ret == RSC_FINAL) {
-        return virtio_net_rsc_drain_flow(chain, nc, buf, size,
-                ((hdr_len + sizeof(struct eth_header)) + 8),
-                VIRTIO_NET_IP6_ADDR_SIZE,
-                hdr_len + sizeof(struct eth_header)
-                + sizeof(struct ip6_header));
-    }
-
-    return virtio_net_rsc_do_coalesce(chain, nc, buf, size, &unit);
-}
-
-static VirtioNetRscChain *virtio_net_rsc_lookup_chain(VirtIONet *n,
-                                                      NetClientState *nc,
-                                                      uint16_t proto)
-{
-    VirtioNetRscChain *chain;
-
-    if ((proto != (uint16_t)ETH_P_IP) && (proto != (uint16_t)ETH_P_IPV6)) {
-        return NULL;
-    }
-
-    QTAILQ_FOREACH(chain, &n->rsc_chains, next) {
-        if (chain->proto == proto) {
-            return chain;
-        }
-    }
-
-    chain = g_malloc(sizeof(*chain));
-    chain->n = n;
-    chain->proto = proto;
-    if (proto == (uint16_t)ETH_P_IP) {
-        chain->max_payload = VIRTIO_NET_MAX_IP4_PAYLOAD;
-        chain->gso_type = VIRTIO_NET_HDR_GSO_TCPV4;
-    } else {
-        chain->max_payload = VIRTIO_NET_MAX_IP6_PAYLOAD;
-        chain->gso_type = VIRTIO_NET_HDR_GSO_TCPV6;
-    }
-    chain->drain_timer = timer_new_ns(QEMU_CLOCK_HOST,
-                                      virtio_net_rsc_purge, chain);
-    memset(&chain->stat, 0, sizeof(chain->stat));
-
-    QTAILQ_INIT(&chain->buffers);
-    QTAILQ_INSERT_TAIL(&n->rsc_chains, chain, next);
-
-    return chain;
-}
-
-static ssize_t virtio_net_rsc_receive(NetClientState *nc,
-                                      const uint8_t *buf,
-                                      size_t size)
-{
-    uint16_t proto;
-    VirtioNetRscChain *chain;
-    struct eth_header *eth;
-    VirtIONet *n;
-
-    n = qemu_get_nic_opaque(nc);
-    if (size < (n->host_hdr_len + sizeof(struct eth_header))) {
-        return virtio_net_do_receive(nc, buf, size);
-    }
-
-    eth = (struct eth_header *)(buf + n->guest_hdr_len);
-    proto = htons(eth->h_proto);
-
-    chain = virtio_net_rsc_lookup_chain(n, nc, proto);
-    if (chain) {
-        chain->stat.received++;
-        if (proto == (uint16_t)ETH_P_IP && n->rsc4_enabled) {
-            return virtio_net_rsc_receive4(chain, nc, buf, size);
-        } else if (proto == (uint16_t)ETH_P_IPV6 && n->rsc6_enabled) {
-            return virtio_net_rsc_receive6(chain, nc, buf, size);
-        }
-    }
-    return virtio_net_do_receive(nc, buf, size);
-}
-
 static ssize_t virtio_net_receive(NetClientState *nc, const uint8_t *buf,
                                   size_t size)
 {
     VirtIONet *n = qemu_get_nic_opaque(nc);
-    if ((n->rsc4_enabled || n->rsc6_enabled)) {
-        return virtio_net_rsc_receive(nc, buf, size);
+    ssize_t ret;
+
+    virtio_net_acquire(n);
+    if (net_gro_enabled(n->rsc)) {
+        ret = net_gro_receive(n->rsc, nc, buf, size, n->guest_hdr_len);
     } else {
-        return virtio_net_do_receive(nc, buf, size);
+        ret = virtio_net_do_receive(nc, buf, size);
     }
+    virtio_net_release(n);
+    return ret;
 }
 
 static int32_t virtio_net_flush_tx(VirtIONetQueue *q);
@@ -2388,16 +1916,45 @@ static void virtio_net_tx_complete(NetClientState *nc, ssize_t len)
 {
     VirtIONet *n = qemu_get_nic_opaque(nc);
     VirtIONetQueue *q = virtio_net_get_subqueue(nc);
-    VirtIODevice *vdev = VIRTIO_DEVICE(n);
 
+    virtio_net_acquire(n);
     virtqueue_push(q->tx_vq, q->async_tx.elem, 0);
-    virtio_notify(vdev, q->tx_vq);
+    virtio_net_notify(n, q->tx_vq);
 
-    g_free(q->async_tx.elem);
+    virtqueue_element_free(q->async_tx.elem);
     q->async_tx.elem = NULL;
 
     virtio_queue_set_notification(q->tx_vq, 1);
     virtio_net_flush_tx(q);
+    virtio_net_release(n);
+}
+
+/* Complete transmitted elements with a single used ring update */
+static void virtio_net_tx_done(VirtIONetQueue *q, VirtQueueElement **elems,
+                               unsigned int count)
+{
+    unsigned int lens[VIRTIO_NET_TX_BATCH] = { 0 };
+    unsigned int i;
+
+    if (!count) {
+        return;
+    }
+
+    virtqueue_fill_batch(q->tx_vq, elems, lens, count);
+    virtio_net_notify(q->n, q->tx_vq);
+    for (i = 0; i < count; i++) {
+        virtqueue_element_free(elems[i]);
+    }
+}
+
+/* Give back elements that were popped but not transmitted, newest first */
+static void virtio_net_tx_unpop(VirtIONetQueue *q, VirtQueueElement **elems,
+                                unsigned int count)
+{
+    while (count--) {
+        virtqueue_unpop(q->tx_vq, elems[count], 0);
+        virtqueue_element_free(elems[count]);
+    }
 }
 
 /* TX */
@@ -2406,6 +1963,9 @@ static int32_t virtio_net_flush_tx(VirtIONetQueue *q)
     VirtIONet *n = q->n;
     VirtIODevice *vdev = VIRTIO_DEVICE(n);
     VirtQueueElement *elem;
+    VirtQueueElement *elems[VIRTIO_NET_TX_BATCH];
+    VirtQueueElement *done[VIRTIO_NET_TX_BATCH];
+    unsigned int popped = 0, next = 0, completed = 0;
     int32_t num_packets = 0;
     int queue_index = vq2q(virtio_get_queue_index(q->tx_vq));
     if (!(vdev->status & VIRTIO_CONFIG_S_DRIVER_OK)) {
@@ -2422,30 +1982,37 @@ static int32_t virtio_net_flush_tx(VirtIONetQueue *q)
         unsigned int out_num;
         struct iovec sg[VIRTQUEUE_MAX_SIZE], sg2[VIRTQUEUE_MAX_SIZE + 1], *out_sg;
         struct virtio_net_hdr_mrg_rxbuf mhdr;
-
-        elem = virtqueue_pop(q->tx_vq, sizeof(VirtQueueElement));
-        if (!elem) {
-            break;
+        bool zerocopy = true;
+
+        if (next == popped) {
+            virtio_net_tx_done(q, done, completed);
+            completed = 0;
+            popped = virtqueue_pop_batch(q->tx_vq, sizeof(VirtQueueElement),
+                                         (void **)elems,
+                                         MIN(VIRTIO_NET_TX_BATCH,
+                                             n->tx_burst - num_packets));
+            next = 0;
+            if (!popped) {
+                break;
+            }
         }
+        elem = elems[next++];
 
         out_num = elem->out_num;
         out_sg = elem->out_sg;
         if (out_num < 1) {
             virtio_error(vdev, "virtio-net header not in first element");
-            virtqueue_detach_element(q->tx_vq, elem, 0);
-            g_free(elem);
-            return -EINVAL;
+            goto err;
         }
 
         if (n->has_vnet_hdr) {
             if (iov_to_buf(out_sg, out_num, 0, &mhdr, n->guest_hdr_len) <
                 n->guest_hdr_len) {
                 virtio_error(vdev, "virtio-net header incorrect");
-                virtqueue_detach_element(q->tx_vq, elem, 0);
-                g_free(elem);
-                return -EINVAL;
+                goto err;
             }
             if (n->needs_vnet_hdr_swap) {
+                zerocopy = false;
                 virtio_net_hdr_swap(vdev, (void *) &mhdr);
                 sg2[0].iov_base = &mhdr;
                 sg2[0].iov_len = n->guest_hdr_len;
@@ -2476,24 +2043,47 @@ static int32_t virtio_net_flush_tx(VirtIONetQueue *q)
             out_sg = sg;
         }
 
-        ret = qemu_sendv_packet_async(qemu_get_subqueue(n->nic, queue_index),
-                                      out_sg, out_num, virtio_net_tx_complete);
+        /*
+         * The element stays popped until virtio_net_tx_complete(), so a
+         * busy backend can queue the guest buffers themselves.  Only a
+         * byte-swapped header lives on the stack.
+         */
+        if (!zerocopy) {
+            ret = qemu_sendv_packet_async(
+                qemu_get_subqueue(n->nic, queue_index),
+                out_sg, out_num, virtio_net_tx_complete);
+        } else {
+            ret = qemu_sendv_packet_async_zerocopy(
+                qemu_get_subqueue(n->nic, queue_index),
+                out_sg, out_num, virtio_net_tx_complete);
+        }
         if (ret == 0) {
+            /*
+             * Everything popped after elem must be refetched once the
+             * backend has room again.
+             */
+            virtio_net_tx_unpop(q, elems + next, popped - next);
+            virtio_net_tx_done(q, done, completed);
             virtio_queue_set_notification(q->tx_vq, 0);
             q->async_tx.elem = elem;
             return -EBUSY;
         }
 
 drop:
-        virtqueue_push(q->tx_vq, elem, 0);
-        virtio_notify(vdev, q->tx_vq);
-        g_free(elem);
+        done[completed++] = elem;
 
         if (++num_packets >= n->tx_burst) {
             break;
         }
     }
+    virtio_net_tx_unpop(q, elems + next, popped - next);
+    virtio_net_tx_done(q, done, completed);
     return num_packets;
+
+err:
+    virtio_net_tx_unpop(q, elems + next - 1, popped - next + 1);
+    virtio_net_tx_done(q, done, completed);
+    return -EINVAL;
 }
 
 static void virtio_net_handle_tx_timer(VirtIODevice *vdev, VirtQueue *vq)
@@ -2549,9 +2139,8 @@ static void virtio_net_handle_tx_bh(VirtIODevice *vdev, VirtQueue *vq)
     qemu_bh_schedule(q->tx_bh);
 }
 
-static void virtio_net_tx_timer(void *opaque)
+static void virtio_net_do_tx_timer(VirtIONetQueue *q)
 {
-    VirtIONetQueue *q = opaque;
     VirtIONet *n = q->n;
     VirtIODevice *vdev = VIRTIO_DEVICE(n);
     /* This happens when device was stopped but BH wasn't. */
@@ -2572,9 +2161,8 @@ static void virtio_net_tx_timer(void *opaque)
     virtio_net_flush_tx(q);
 }
 
-static void virtio_net_tx_bh(void *opaque)
+static void virtio_net_do_tx_bh(VirtIONetQueue *q)
 {
-    VirtIONetQueue *q = opaque;
     VirtIONet *n = q->n;
     VirtIODevice *vdev = VIRTIO_DEVICE(n);
     int32_t ret;
@@ -2621,6 +2209,24 @@ static void virtio_net_tx_bh(void *opaque)
     }
 }
 
+static void virtio_net_tx_timer(void *opaque)
+{
+    VirtIONetQueue *q = opaque;
+
+    virtio_net_acquire(q->n);
+    virtio_net_do_tx_timer(q);
+    virtio_net_release(q->n);
+}
+
+static void virtio_net_tx_bh(void *opaque)
+{
+    VirtIONetQueue *q = opaque;
+
+    virtio_net_acquire(q->n);
+    virtio_net_do_tx_bh(q);
+    virtio_net_release(q->n);
+}
+
 static void virtio_net_add_queue(VirtIONet *n, int index)
 {
     VirtIODevice *vdev = VIRTIO_DEVICE(n);
@@ -2641,6 +2247,8 @@ static void virtio_net_add_queue(VirtIONet *n, int index)
                              virtio_net_handle_tx_bh);
         n->vqs[index].tx_bh = qemu_bh_new(virtio_net_tx_bh, &n->vqs[index]);
     }
+    virtio_queue_enable_element_pool(n->vqs[index].tx_vq,
+                                     sizeof(VirtQueueElement));
 
     n->vqs[index].tx_waiting = 0;
     n->vqs[index].n = n;
@@ -2666,6 +2274,202 @@ static void virtio_net_del_queue(VirtIONet *n, int index)
     virtio_del_queue(vdev, index * 2 + 1);
 }
 
+/*
+ * Dataplane: with an iothread, the rx and tx virtqueues, the tx bottom
+ * halves and timers, and the fd handlers of the backends all run in its
+ * AioContext once ioeventfd is started.  The control queue stays in the
+ * main loop.
+ */
+
+static int virtio_net_dataplane_queues(VirtIONet *n)
+{
+    return n->multiqueue ? n->max_queues : 1;
+}
+
+/* Recreate the tx bottom half or timer of @q in @ctx */
+static void virtio_net_tx_set_aio_context(VirtIONetQueue *q, AioContext *ctx)
+{
+    VirtIODevice *vdev = VIRTIO_DEVICE(q->n);
+
+    if (q->tx_timer) {
+        timer_free(q->tx_timer);
+        q->tx_timer = aio_timer_new(ctx, QEMU_CLOCK_VIRTUAL, SCALE_NS,
+                                    virtio_net_tx_timer, q);
+    } else {
+        qemu_bh_delete(q->tx_bh);
+        q->tx_bh = aio_bh_new(ctx, virtio_net_tx_bh, q);
+    }
+
+    if (q->tx_waiting && vdev->vm_running) {
+        if (q->tx_timer) {
+            timer_mod(q->tx_timer,
+                      qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) + q->n->tx_timeout);
+        } else {
+            qemu_bh_schedule(q->tx_bh);
+        }
+    }
+}
+
+static bool virtio_net_data_plane_handle_rx(VirtIODevice *vdev, VirtQueue *vq)
+{
+    VirtIONet *n = VIRTIO_NET(vdev);
+
+    virtio_net_acquire(n);
+    virtio_net_handle_rx(vdev, vq);
+    virtio_net_release(n);
+    return true;
+}
+
+static bool virtio_net_data_plane_handle_tx(VirtIODevice *vdev, VirtQueue *vq)
+{
+    VirtIONet *n = VIRTIO_NET(vdev);
+    VirtIONetQueue *q = &n->vqs[vq2q(virtio_get_queue_index(vq))];
+    bool progress;
+
+    virtio_net_acquire(n);
+    /* While a flush is pending, polling finds the same buffers again */
+    progress = !q->tx_waiting;
+    if (q->tx_timer) {
+        virtio_net_handle_tx_timer(vdev, vq);
+    } else {
+        virtio_net_handle_tx_bh(vdev, vq);
+    }
+    virtio_net_release(n);
+    return progress;
+}
+
+/*
+ * Bring the queues and the backends back to the main loop.  This also
+ * undoes a partial start, in which case only some backends moved.
+ *
+ * Context: BH in n->ctx
+ */
+static void virtio_net_dataplane_stop_bh(void *opaque)
+{
+    VirtIONet *n = opaque;
+    int i;
+
+    for (i = 0; i < virtio_net_dataplane_queues(n); i++) {
+        VirtIONetQueue *q = &n->vqs[i];
+        NetClientState *peer = qemu_get_subqueue(n->nic, i)->peer;
+
+        if (n->dataplane_started) {
+            virtio_queue_aio_set_host_notifier_handler_no_poll(q->rx_vq,
+                                                               n->ctx, NULL);
+            virtio_queue_aio_set_host_notifier_handler(q->tx_vq, n->ctx,
+                                                       NULL);
+            virtio_net_tx_set_aio_context(q, qemu_get_aio_context());
+        }
+        if (peer) {
+            qemu_net_client_detach_aio_context(peer);
+        }
+    }
+}
+
+/* Context: QEMU global mutex held */
+static void virtio_net_dataplane_start(VirtIONet *n)
+{
+    VirtIODevice *vdev = VIRTIO_DEVICE(n);
+    BusState *qbus = qdev_get_parent_bus(DEVICE(vdev));
+    VirtioBusClass *k = VIRTIO_BUS_GET_CLASS(qbus);
+    int queues = virtio_net_dataplane_queues(n);
+    int i, r;
+
+    for (i = 0; i < queues; i++) {
+        NetClientState *peer = qemu_get_subqueue(n->nic, i)->peer;
+
+        if (!peer || !qemu_net_client_attach_aio_context(peer, n->ctx)) {
+            warn_report_once("virtio-net: backend cannot run in an iothread, "
+                             "using the main loop");
+            goto fail_peers;
+        }
+    }
+
+    /*
+     * The guest notifier mask callbacks only work with vhost; without them
+     * the transport releases and reuses the irqfds itself.
+     */
+    n->saved_guest_notifier_mask = vdev->use_guest_notifier_mask;
+    vdev->use_guest_notifier_mask = false;
+
+    /* Set up guest notifier (irq) */
+    r = k->set_guest_notifiers(qbus->parent, queues * 2, true);
+    if (r != 0) {
+        error_report("virtio-net: Failed to set guest notifiers (%d), "
+                     "ensure -accel kvm is set.", r);
+        vdev->use_guest_notifier_mask = n->saved_guest_notifier_mask;
+        goto fail_peers;
+    }
+
+    for (i = 0; i < queues; i++) {
+        VirtIONetQueue *q = &n->vqs[i];
+
+        virtio_net_tx_set_aio_context(q, n->ctx);
+        event_notifier_set_handler(virtio_queue_get_host_notifier(q->rx_vq),
+                                   NULL);
+        event_notifier_set_handler(virtio_queue_get_host_notifier(q->tx_vq),
+                                   NULL);
+    }
+    n->dataplane_started = true;
+
+    aio_context_acquire(n->ctx);
+    for (i = 0; i < queues; i++) {
+        VirtIONetQueue *q = &n->vqs[i];
+
+        virtio_queue_aio_set_host_notifier_handler_no_poll(q->rx_vq, n->ctx,
+                virtio_net_data_plane_handle_rx);
+        virtio_queue_aio_set_host_notifier_handler(q->tx_vq, n->ctx,
+                virtio_net_data_plane_handle_tx);
+    }
+    aio_context_release(n->ctx);
+    return;
+
+fail_peers:
+    aio_context_acquire(n->ctx);
+    aio_wait_bh_oneshot(n->ctx, virtio_net_dataplane_stop_bh, n);
+    aio_context_release(n->ctx);
+}
+
+/* Context: QEMU global mutex held */
+static void virtio_net_dataplane_stop(VirtIONet *n)
+{
+    VirtIODevice *vdev = VIRTIO_DEVICE(n);
+    BusState *qbus = qdev_get_parent_bus(DEVICE(vdev));
+    VirtioBusClass *k = VIRTIO_BUS_GET_CLASS(qbus);
+
+    if (!n->dataplane_started) {
+        return;
+    }
+
+    aio_context_acquire(n->ctx);
+    aio_wait_bh_oneshot(n->ctx, virtio_net_dataplane_stop_bh, n);
+    aio_context_release(n->ctx);
+    n->dataplane_started = false;
+
+    /* Clean up guest notifier (irq) */
+    k->set_guest_notifiers(qbus->parent,
+                           virtio_net_dataplane_queues(n) * 2, false);
+    vdev->use_guest_notifier_mask = n->saved_guest_notifier_mask;
+}
+
+static int virtio_net_start_ioeventfd(VirtIODevice *vdev)
+{
+    VirtIONet *n = VIRTIO_NET(vdev);
+    int r;
+
+    r = virtio_device_start_ioeventfd_impl(vdev);
+    if (r == 0 && n->ctx) {
+        virtio_net_dataplane_start(n);
+    }
+    return r;
+}
+
+static void virtio_net_stop_ioeventfd(VirtIODevice *vdev)
+{
+    virtio_net_dataplane_stop(VIRTIO_NET(vdev));
+    virtio_device_stop_ioeventfd_impl(vdev);
+}
+
 static void virtio_net_change_num_queues(VirtIONet *n, int new_max_queues)
 {
     VirtIODevice *vdev = VIRTIO_DEVICE(n);
@@ -2772,6 +2576,7 @@ static int virtio_net_post_load_device(void *opaque, int version_id)
     }
 
     if (n->rss_data.enabled) {
+        virtio_net_commit_rss_config(n);
         trace_virtio_net_rss_enable(n->rss_data.hash_types,
                                     n->rss_data.indirections_len,
                                     sizeof(n->rss_data.key));
@@ -3037,11 +2842,45 @@ static const VMStateDescription vmstate_virtio_net_device = {
     }
 };
 
+/*
+ * Packets from a batch may land on any queue because of RSS, so the
+ * batch is tracked per device and every queue that was used gets one
+ * notification when the outermost batch ends.
+ */
+static void virtio_net_receive_batch(NetClientState *nc, bool begin)
+{
+    VirtIONet *n = qemu_get_nic_opaque(nc);
+    int i;
+
+    virtio_net_acquire(n);
+    if (begin) {
+        n->rx_batch++;
+        goto out;
+    }
+
+    assert(n->rx_batch > 0);
+    if (--n->rx_batch) {
+        goto out;
+    }
+
+    for (i = 0; i < n->max_queues; i++) {
+        VirtIONetQueue *q = &n->vqs[i];
+
+        if (q->rx_notify_pending) {
+            q->rx_notify_pending = false;
+            virtio_net_notify(n, q->rx_vq);
+        }
+    }
+out:
+    virtio_net_release(n);
+}
+
 static NetClientInfo net_virtio_info = {
     .type = NET_CLIENT_DRIVER_NIC,
     .size = sizeof(NICState),
     .can_receive = virtio_net_can_receive,
     .receive = virtio_net_receive,
+    .receive_batch = virtio_net_receive_batch,
     .link_status_changed = virtio_net_set_link_status,
     .query_rx_filter = virtio_net_query_rxfilter,
     .announce = virtio_net_announce,
@@ -3290,6 +3129,26 @@ static void virtio_net_device_realize(DeviceState *dev, Error **errp)
     n->net_conf.tx_queue_size = MIN(virtio_net_max_tx_queue_size(n),
                                     n->net_conf.tx_queue_size);
 
+    if (n->net_conf.iothread) {
+        BusState *qbus = qdev_get_parent_bus(dev);
+        VirtioBusClass *k = VIRTIO_BUS_GET_CLASS(qbus);
+
+        if (!k->set_guest_notifiers || !k->ioeventfd_assign) {
+            error_setg(errp,
+                       "device is incompatible with iothread "
+                       "(transport does not support notifiers)");
+            virtio_cleanup(vdev);
+            return;
+        }
+        if (!virtio_device_ioeventfd_enabled(vdev)) {
+            error_setg(errp, "ioeventfd is required for iothread");
+            virtio_cleanup(vdev);
+            return;
+        }
+        object_ref(OBJECT(n->net_conf.iothread));
+        n->ctx = iothread_get_aio_context(n->net_conf.iothread);
+    }
+
     for (i = 0; i < n->max_queues; i++) {
         virtio_net_add_queue(n, i);
     }
@@ -3344,10 +3203,15 @@ static void virtio_net_device_realize(DeviceState *dev, Error **errp)
         vhost_net_set_config(get_vhost_net(nc->peer),
             (uint8_t *)&netcfg, 0, ETH_ALEN, VHOST_SET_CONFIG_TYPE_MASTER);
     }
-    QTAILQ_INIT(&n->rsc_chains);
+    n->rsc = net_gro_new(n->rsc_timeout, n->ctx, virtio_net_rsc_deliver, n);
     n->qdev = dev;
 
     net_rx_pkt_init(&n->rx_pkt, false);
+
+    ebpf_rss_init(&n->ebpf_rss);
+    if (virtio_has_feature(n->host_features, VIRTIO_NET_F_RSS)) {
+        ebpf_rss_load(&n->ebpf_rss);
+    }
 }
 
 static void virtio_net_device_unrealize(DeviceState *dev)
@@ -3380,9 +3244,14 @@ static void virtio_net_device_unrealize(DeviceState *dev)
     qemu_announce_timer_del(&n->announce_timer, false);
     g_free(n->vqs);
     qemu_del_nic(n->nic);
-    virtio_net_rsc_cleanup(n);
+    net_gro_free(n->rsc);
     g_free(n->rss_data.indirections_table);
+    ebpf_rss_unload(&n->ebpf_rss);
     net_rx_pkt_uninit(n->rx_pkt);
+    if (n->ctx) {
+        object_unref(OBJECT(n->net_conf.iothread));
+        n->ctx = NULL;
+    }
     virtio_cleanup(vdev);
 }
 
@@ -3407,6 +3276,7 @@ static int virtio_net_pre_save(void *opaque)
     /* At this point, backend must be stopped, otherwise
      * it might keep writing to memory. */
     assert(!n->vhost_started);
+    assert(!n->dataplane_started);
 
     return 0;
 }
@@ -3492,6 +3362,8 @@ static Property virtio_net_properties[] = {
                     VIRTIO_NET_F_HASH_REPORT, false),
     DEFINE_PROP_BIT64("guest_rsc_ext", VirtIONet, host_features,
                     VIRTIO_NET_F_RSC_EXT, false),
+    DEFINE_PROP_BIT64("in_order", VirtIONet, host_features,
+                    VIRTIO_F_IN_ORDER, true),
     DEFINE_PROP_UINT32("rsc_interval", VirtIONet, rsc_timeout,
                        VIRTIO_NET_RSC_DEFAULT_INTERVAL),
     DEFINE_NIC_PROPERTIES(VirtIONet, nic_conf),
@@ -3509,6 +3381,8 @@ static Property virtio_net_properties[] = {
     DEFINE_PROP_INT32("speed", VirtIONet, net_conf.speed, SPEED_UNKNOWN),
     DEFINE_PROP_STRING("duplex", VirtIONet, net_conf.duplex_str),
     DEFINE_PROP_BOOL("failover", VirtIONet, failover, false),
+    DEFINE_PROP_LINK("iothread", VirtIONet, net_conf.iothread, TYPE_IOTHREAD,
+                     IOThread *),
     DEFINE_PROP_END_OF_LIST(),
 };
 
@@ -3529,6 +3403,8 @@ static void virtio_net_class_init(ObjectClass *klass, void *data)
     vdc->bad_features = virtio_net_bad_features;
     vdc->reset = virtio_net_reset;
     vdc->set_status = virtio_net_set_status;
+    vdc->start_ioeventfd = virtio_net_start_ioeventfd;
+    vdc->stop_ioeventfd = virtio_net_stop_ioeventfd;
     vdc->guest_notifier_mask = virtio_net_guest_notifier_mask;
     vdc->guest_notifier_pending = virtio_net_guest_notifier_pending;
     vdc->legacy_features |= (0x1 << VIRTIO_NET_F_GSO);
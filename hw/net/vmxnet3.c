@@ -41,6 +41,9 @@
 #define VMXNET3_MSIX_BAR_SIZE 0x2000
 #define MIN_BUF_SIZE 60
 
+/* How long software LRO may hold back a segment */
+#define VMXNET3_LRO_TIMEOUT_NS 50000
+
 /* Compatibility flags for migration */
 #define VMXNET3_COMPAT_FLAG_OLD_MSI_OFFSETS_BIT 0
 #define VMXNET3_COMPAT_FLAG_OLD_MSI_OFFSETS \
@@ -1159,6 +1162,7 @@ static void vmxnet3_deactivate_device(VMXNET3State *s)
         net_tx_pkt_reset(s->tx_pkt);
         net_tx_pkt_uninit(s->tx_pkt);
         net_rx_pkt_uninit(s->rx_pkt);
+        net_gro_reset(s->gro);
         s->device_active = false;
     }
 }
@@ -1316,6 +1320,20 @@ static void vmxnet3_update_pm_state(VMXNET3State *s)
     vmxnet3_dump_conf_descr("PM State", &pm_descr);
 }
 
+/*
+ * A peer with a vnet header coalesces in the host and hands us GSO
+ * frames, so only do LRO ourselves when that is not available.
+ */
+static void vmxnet3_update_gro(VMXNET3State *s)
+{
+    bool lro = s->lro_supported && !s->peer_has_vhdr;
+
+    if (!lro) {
+        net_gro_flush(s->gro);
+    }
+    net_gro_set_enabled(s->gro, lro, lro);
+}
+
 static void vmxnet3_update_features(VMXNET3State *s)
 {
     uint32_t guest_features;
@@ -1340,6 +1358,7 @@ static void vmxnet3_update_features(VMXNET3State *s)
                          0,
                          0);
     }
+    vmxnet3_update_gro(s);
 }
 
 static bool vmxnet3_verify_intx(VMXNET3State *s, int intx)
@@ -1947,7 +1966,7 @@ vmxnet3_rx_filter_may_indicate(VMXNET3State *s, const void *data,
 }
 
 static ssize_t
-vmxnet3_receive(NetClientState *nc, const uint8_t *buf, size_t size)
+vmxnet3_do_receive(NetClientState *nc, const uint8_t *buf, size_t size)
 {
     VMXNET3State *s = qemu_get_nic_opaque(nc);
     size_t bytes_indicated;
@@ -1993,6 +2012,37 @@ vmxnet3_receive(NetClientState *nc, const uint8_t *buf, size_t size)
     return bytes_indicated;
 }
 
+static ssize_t vmxnet3_gro_deliver(void *opaque, NetClientState *nc,
+                                   const uint8_t *buf, size_t size,
+                                   NetGROSegment *seg)
+{
+    ssize_t ret;
+
+    if (seg) {
+        net_gro_segment_fix_checksums(seg);
+    }
+
+    ret = vmxnet3_do_receive(nc, buf, size);
+    return ret < 0 ? 0 : ret;
+}
+
+static ssize_t
+vmxnet3_receive(NetClientState *nc, const uint8_t *buf, size_t size)
+{
+    VMXNET3State *s = qemu_get_nic_opaque(nc);
+
+    if (!net_gro_enabled(s->gro)) {
+        return vmxnet3_do_receive(nc, buf, size);
+    }
+
+    if (!vmxnet3_can_receive(nc)) {
+        VMW_PKPRN("Cannot receive now");
+        return -1;
+    }
+
+    return net_gro_receive(s->gro, nc, buf, size, 0);
+}
+
 static void vmxnet3_set_link_status(NetClientState *nc)
 {
     VMXNET3State *s = qemu_get_nic_opaque(nc);
@@ -2030,6 +2080,7 @@ static void vmxnet3_net_uninit(VMXNET3State *s)
     g_free(s->mcast_list);
     vmxnet3_deactivate_device(s);
     qemu_del_nic(s->nic);
+    net_gro_free(s->gro);
 }
 
 static void vmxnet3_net_init(VMXNET3State *s)
@@ -2061,6 +2112,8 @@ static void vmxnet3_net_init(VMXNET3State *s)
     s->rx_pkt = NULL;
     s->rx_vlan_stripping = false;
     s->lro_supported = false;
+    s->gro = net_gro_new(VMXNET3_LRO_TIMEOUT_NS, NULL,
+                         vmxnet3_gro_deliver, s);
 
     if (s->peer_has_vhdr) {
         qemu_set_vnet_hdr_len(qemu_get_queue(s->nic)->peer,
@@ -2401,6 +2454,7 @@ static int vmxnet3_post_load(void *opaque, int version_id)
 
     vmxnet3_validate_queues(s);
     vmxnet3_validate_interrupts(s);
+    vmxnet3_update_gro(s);
 
     return 0;
 }
@@ -18,6 +18,7 @@
 #define HW_NET_VMXNET3_DEFS_H
 
 #include "net/net.h"
+#include "net/gro.h"
 #include "hw/net/vmxnet3.h"
 #include "qom/object.h"
 
@@ -86,6 +87,9 @@ struct VMXNET3State {
         bool rx_vlan_stripping;
         bool lro_supported;
 
+        /* Software LRO, used when the peer can not coalesce for us */
+        NetGRO *gro;
+
         uint8_t rxq_num;
 
         /* Network MTU */
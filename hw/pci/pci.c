@@ -79,6 +79,8 @@ static Property pci_props[] = {
                     QEMU_PCIE_EXTCAP_INIT_BITNR, true),
     DEFINE_PROP_STRING("failover_pair_id", PCIDevice,
                        failover_pair_id),
+    DEFINE_PROP_SIZE32("x-max-bounce-buffer-size", PCIDevice,
+                       max_bounce_buffer_size, DEFAULT_MAX_BOUNCE_BUFFER_SIZE),
     DEFINE_PROP_END_OF_LIST()
 };
 
@@ -1069,6 +1071,8 @@ static PCIDevice *do_pci_register_device(PCIDevice *pci_dev,
                        "bus master container", UINT64_MAX);
     address_space_init(&pci_dev->bus_master_as,
                        &pci_dev->bus_master_container_region, pci_dev->name);
+    pci_dev->bus_master_as.max_bounce_buffer_size =
+        pci_dev->max_bounce_buffer_size;
 
     if (phase_check(PHASE_MACHINE_READY)) {
         pci_init_bus_master(pci_dev);
@@ -2298,6 +2302,38 @@ static void pci_patch_ids(PCIDevice *pdev, uint8_t *ptr, uint32_t size)
     }
 }
 
+typedef struct PCIRomLoad {
+    PCIDevice *pdev;
+    char *path;
+    void *ptr;
+    int64_t size;
+    bool is_default_rom;
+} PCIRomLoad;
+
+static int pci_rom_load_work(void *opaque)
+{
+    PCIRomLoad *load = opaque;
+
+    return load_image_size(load->path, load->ptr, load->size) < 0 ? -EIO : 0;
+}
+
+static void pci_rom_load_done(void *opaque, int ret, Error **errp)
+{
+    PCIRomLoad *load = opaque;
+    PCIDevice *pdev = load->pdev;
+
+    if (ret < 0) {
+        error_setg(errp, "failed to load romfile \"%s\"", pdev->romfile);
+    } else if (load->is_default_rom) {
+        /* Only the default rom images will be patched (if needed). */
+        pci_patch_ids(pdev, load->ptr, load->size);
+    }
+    pdev->rom_loading = false;
+    object_unref(OBJECT(pdev));
+    g_free(load->path);
+    g_free(load);
+}
+
 /* Add an option rom for the device */
 static void pci_add_option_rom(PCIDevice *pdev, bool is_default_rom,
                                Error **errp)
@@ -2379,6 +2415,26 @@ static void pci_add_option_rom(PCIDevice *pdev, bool is_default_rom,
     pdev->has_rom = true;
     memory_region_init_rom(&pdev->rom, OBJECT(pdev), name, pdev->romsize, &error_fatal);
     ptr = memory_region_get_ram_ptr(&pdev->rom);
+
+    if (!phase_check(PHASE_MACHINE_READY)) {
+        /*
+         * The guest can not see the ROM before the machine is ready, so
+         * read the file while the other devices are created.
+         */
+        PCIRomLoad *load = g_new(PCIRomLoad, 1);
+
+        load->pdev = pdev;
+        load->path = path;
+        load->ptr = ptr;
+        load->size = size;
+        load->is_default_rom = is_default_rom;
+        object_ref(OBJECT(pdev));
+        pdev->rom_loading = true;
+        machine_init_work_submit(pci_rom_load_work, pci_rom_load_done, load);
+        pci_register_bar(pdev, PCI_ROM_SLOT, 0, &pdev->rom);
+        return;
+    }
+
     if (load_image_size(path, ptr, size) < 0) {
         error_setg(errp, "failed to load romfile \"%s\"", pdev->romfile);
         g_free(path);
@@ -2399,6 +2455,11 @@ static void pci_del_option_rom(PCIDevice *pdev)
     if (!pdev->has_rom)
         return;
 
+    if (pdev->rom_loading) {
+        /* Don't let the ROM go away under the loader thread */
+        machine_init_work_wait();
+    }
+
     vmstate_unregister_ram(&pdev->rom, &pdev->qdev);
     pdev->has_rom = false;
 }
@@ -19,6 +19,7 @@
 
 #include "qemu/osdep.h"
 #include "qemu/error-report.h"
+#include "qemu/host-utils.h"
 #include "qemu/log.h"
 #include "qemu/module.h"
 #include "sysemu/kvm.h"
@@ -43,6 +44,18 @@ enum SpaprTceAccess {
 #define IOMMU_PAGE_SIZE(shift)      (1ULL << (shift))
 #define IOMMU_PAGE_MASK(shift)      (~(IOMMU_PAGE_SIZE(shift) - 1))
 
+/*
+ * IOMMU notification for a run of TCEs updated by one hypercall: either
+ * unmapping consecutive IOVAs, or mapping them to consecutive guest
+ * physical addresses with the same permissions.
+ */
+typedef struct SpaprTceRun {
+    hwaddr iova;
+    hwaddr translated_addr;
+    hwaddr size;
+    IOMMUAccessFlags perm;
+} SpaprTceRun;
+
 static QLIST_HEAD(, SpaprTceTable) spapr_tce_tables;
 
 SpaprTceTable *spapr_tce_find_by_liobn(target_ulong liobn)
@@ -331,7 +344,19 @@ void spapr_tce_set_need_vfio(SpaprTceTable *tcet, bool need_vfio)
 
     tcet->need_vfio = need_vfio;
 
-    if (!need_vfio || (tcet->fd != -1 && kvmppc_has_cap_spapr_vfio())) {
+    if (!tcet->nb_table) {
+        return;
+    }
+
+    /*
+     * Keep the table in KVM whenever it can be used, so that TCE hypercalls
+     * are handled in the kernel.  When the last VFIO user goes away, try to
+     * move a table that was created in userspace back into KVM.
+     */
+    if (tcet->fd != -1 && (!need_vfio || kvmppc_has_cap_spapr_vfio())) {
+        return;
+    }
+    if (!need_vfio && !kvm_enabled()) {
         return;
     }
 
@@ -442,12 +467,69 @@ static void spapr_tce_reset(DeviceState *dev)
     }
 }
 
-static target_ulong put_tce_emu(SpaprTceTable *tcet, target_ulong ioba,
-                                target_ulong tce)
+static bool spapr_tce_ram_contiguous(hwaddr addr, hwaddr size)
 {
+    MemoryRegion *mr;
+    hwaddr xlat, len = size;
+
+    RCU_READ_LOCK_GUARD();
+    mr = address_space_translate(&address_space_memory, addr, &xlat, &len,
+                                 false, MEMTXATTRS_UNSPECIFIED);
+    return memory_region_is_ram(mr) && len == size;
+}
+
+/*
+ * IOMMU notifiers take naturally aligned power of two ranges, so split the
+ * run into as few of those as possible.  A mapping is only notified as one
+ * range if it does not cross a RAM region boundary, which VFIO could not
+ * map in one go.
+ */
+static void spapr_tce_notify_run(SpaprTceTable *tcet, SpaprTceRun *run)
+{
+    hwaddr page_size = IOMMU_PAGE_SIZE(tcet->page_shift);
     IOMMUTLBEvent event;
+
+    event.type = run->perm ? IOMMU_NOTIFIER_MAP : IOMMU_NOTIFIER_UNMAP;
+    event.entry.target_as = &address_space_memory;
+    event.entry.perm = run->perm;
+
+    while (run->size) {
+        hwaddr align = run->iova | (run->perm ? run->translated_addr : 0);
+        hwaddr len = pow2floor(run->size);
+
+        if (align) {
+            len = MIN(len, 1ULL << ctz64(align));
+        }
+        while (run->perm && len > page_size &&
+               !spapr_tce_ram_contiguous(run->translated_addr, len)) {
+            len >>= 1;
+        }
+
+        trace_spapr_iommu_notify(tcet->liobn, run->iova, run->translated_addr,
+                                 len, run->perm);
+        event.entry.iova = run->iova;
+        event.entry.translated_addr = run->translated_addr;
+        event.entry.addr_mask = len - 1;
+        memory_region_notify_iommu(&tcet->iommu, 0, event);
+
+        run->iova += len;
+        run->translated_addr += len;
+        run->size -= len;
+    }
+}
+
+/*
+ * Update one TCE.  If @run is not NULL, the IOMMU notification is merged
+ * into it when possible, and the caller must pass @run to
+ * spapr_tce_notify_run() once done.
+ */
+static target_ulong put_tce_emu(SpaprTceTable *tcet, target_ulong ioba,
+                                target_ulong tce, SpaprTceRun *run)
+{
     hwaddr page_mask = IOMMU_PAGE_MASK(tcet->page_shift);
+    hwaddr page_size = IOMMU_PAGE_SIZE(tcet->page_shift);
     unsigned long index = (ioba - tcet->bus_offset) >> tcet->page_shift;
+    SpaprTceRun entry;
 
     if (index >= tcet->nb_table) {
         hcall_dprintf("spapr_vio_put_tce on out-of-bounds IOBA 0x"
@@ -457,13 +539,26 @@ static target_ulong put_tce_emu(SpaprTceTable *tcet, target_ulong ioba,
 
     tcet->table[index] = tce;
 
-    event.entry.target_as = &address_space_memory,
-    event.entry.iova = (ioba - tcet->bus_offset) & page_mask;
-    event.entry.translated_addr = tce & page_mask;
-    event.entry.addr_mask = ~page_mask;
-    event.entry.perm = spapr_tce_iommu_access_flags(tce);
-    event.type = event.entry.perm ? IOMMU_NOTIFIER_MAP : IOMMU_NOTIFIER_UNMAP;
-    memory_region_notify_iommu(&tcet->iommu, 0, event);
+    entry.iova = (ioba - tcet->bus_offset) & page_mask;
+    entry.translated_addr = tce & page_mask;
+    entry.size = page_size;
+    entry.perm = spapr_tce_iommu_access_flags(tce);
+
+    if (!run) {
+        spapr_tce_notify_run(tcet, &entry);
+        return H_SUCCESS;
+    }
+
+    if (run->size && run->perm == entry.perm &&
+        run->iova + run->size == entry.iova &&
+        (!entry.perm ||
+         run->translated_addr + run->size == entry.translated_addr)) {
+        run->size += page_size;
+        return H_SUCCESS;
+    }
+
+    spapr_tce_notify_run(tcet, run);
+    *run = entry;
 
     return H_SUCCESS;
 }
@@ -482,6 +577,7 @@ static target_ulong h_put_tce_indirect(PowerPCCPU *cpu,
     SpaprTceTable *tcet = spapr_tce_find_by_liobn(liobn);
     CPUState *cs = CPU(cpu);
     hwaddr page_mask, page_size;
+    SpaprTceRun run = { 0 };
 
     if (!tcet) {
         return H_PARAMETER;
@@ -498,11 +594,12 @@ static target_ulong h_put_tce_indirect(PowerPCCPU *cpu,
     for (i = 0; i < npages; ++i, ioba += page_size) {
         tce = ldq_be_phys(cs->as, tce_list + i * sizeof(target_ulong));
 
-        ret = put_tce_emu(tcet, ioba, tce);
+        ret = put_tce_emu(tcet, ioba, tce, &run);
         if (ret) {
             break;
         }
     }
+    spapr_tce_notify_run(tcet, &run);
 
     /* Trace last successful or the first problematic entry */
     i = i ? (i - 1) : 0;
@@ -525,6 +622,7 @@ static target_ulong h_stuff_tce(PowerPCCPU *cpu, SpaprMachineState *spapr,
     target_ulong ret = H_PARAMETER;
     SpaprTceTable *tcet = spapr_tce_find_by_liobn(liobn);
     hwaddr page_mask, page_size;
+    SpaprTceRun run = { 0 };
 
     if (!tcet) {
         return H_PARAMETER;
@@ -539,11 +637,12 @@ static target_ulong h_stuff_tce(PowerPCCPU *cpu, SpaprMachineState *spapr,
     ioba &= page_mask;
 
     for (i = 0; i < npages; ++i, ioba += page_size) {
-        ret = put_tce_emu(tcet, ioba, tce_value);
+        ret = put_tce_emu(tcet, ioba, tce_value, &run);
         if (ret) {
             break;
         }
     }
+    spapr_tce_notify_run(tcet, &run);
     if (SPAPR_IS_PCI_LIOBN(liobn)) {
         trace_spapr_iommu_pci_stuff(liobn, ioba, tce_value, npages, ret);
     } else {
@@ -567,7 +666,7 @@ static target_ulong h_put_tce(PowerPCCPU *cpu, SpaprMachineState *spapr,
 
         ioba &= page_mask;
 
-        ret = put_tce_emu(tcet, ioba, tce);
+        ret = put_tce_emu(tcet, ioba, tce, NULL);
     }
     if (SPAPR_IS_PCI_LIOBN(liobn)) {
         trace_spapr_iommu_pci_put(liobn, ioba, tce, ret);
@@ -888,9 +888,30 @@ static void rtc_reset(void *opaque)
     }
 }
 
+/*
+ * Only the index port is coalesced, and an index write has no effect
+ * besides setting the index, so only the last of a run of them matters.
+ */
+static void cmos_ioport_write_batch(void *opaque,
+                                    const MemoryRegionBatchWrite *writes,
+                                    unsigned n)
+{
+    unsigned i;
+
+    for (i = 0; i < n; i++) {
+        if (i + 1 < n && (writes[i].addr & 1) == 0 &&
+            (writes[i + 1].addr & 1) == 0) {
+            continue;
+        }
+        cmos_ioport_write(opaque, writes[i].addr, writes[i].data,
+                          writes[i].size);
+    }
+}
+
 static const MemoryRegionOps cmos_ops = {
     .read = cmos_ioport_read,
     .write = cmos_ioport_write,
+    .write_batch = cmos_ioport_write_batch,
     .impl = {
         .min_access_size = 1,
         .max_access_size = 1,
@@ -15,6 +15,7 @@
 #include "trace.h"
 #include "sysemu/dma.h"
 #include "qemu/cutils.h"
+#include "qemu/thread.h"
 
 static char *scsibus_get_dev_path(DeviceState *dev);
 static char *scsibus_get_fw_dev_path(DeviceState *dev);
@@ -674,6 +675,96 @@ static const struct SCSIReqOps reqops_target_command = {
 };
 
 
+/*
+ * Per-thread cache of freed requests.  With one iothread per virtqueue
+ * each queue allocates and frees its requests in its own thread, so
+ * this behaves as a per-queue slab without any locking.  Requests are
+ * cached by size; the few request types of a busy HBA fit in a handful
+ * of size classes and anything else goes back to the heap.
+ */
+#define SCSI_REQ_SLAB_CLASSES 4
+#define SCSI_REQ_SLAB_MAX     64
+
+typedef struct SCSIReqSlabEntry {
+    QSLIST_ENTRY(SCSIReqSlabEntry) next;
+} SCSIReqSlabEntry;
+
+typedef struct SCSIReqSlab {
+    size_t size;
+    unsigned int count;
+    QSLIST_HEAD(, SCSIReqSlabEntry) free;
+} SCSIReqSlab;
+
+static __thread SCSIReqSlab scsi_req_slab[SCSI_REQ_SLAB_CLASSES];
+static __thread Notifier scsi_req_slab_cleanup_notifier;
+
+static void scsi_req_slab_cleanup(Notifier *n, void *value)
+{
+    SCSIReqSlabEntry *e;
+    int i;
+
+    for (i = 0; i < SCSI_REQ_SLAB_CLASSES; i++) {
+        while ((e = QSLIST_FIRST(&scsi_req_slab[i].free))) {
+            QSLIST_REMOVE_HEAD(&scsi_req_slab[i].free, next);
+            g_free(e);
+        }
+        scsi_req_slab[i].count = 0;
+    }
+}
+
+static SCSIReqSlab *scsi_req_slab_find(size_t size, bool create)
+{
+    int i;
+
+    for (i = 0; i < SCSI_REQ_SLAB_CLASSES; i++) {
+        if (scsi_req_slab[i].size == size) {
+            return &scsi_req_slab[i];
+        }
+    }
+    if (!create) {
+        return NULL;
+    }
+    for (i = 0; i < SCSI_REQ_SLAB_CLASSES; i++) {
+        if (!scsi_req_slab[i].size) {
+            /* First use in this thread; register the destructor too */
+            if (!scsi_req_slab_cleanup_notifier.notify) {
+                scsi_req_slab_cleanup_notifier.notify = scsi_req_slab_cleanup;
+                qemu_thread_atexit_add(&scsi_req_slab_cleanup_notifier);
+            }
+            scsi_req_slab[i].size = size;
+            QSLIST_INIT(&scsi_req_slab[i].free);
+            return &scsi_req_slab[i];
+        }
+    }
+    return NULL;
+}
+
+static void *scsi_req_slab_get(size_t size)
+{
+    SCSIReqSlab *slab = scsi_req_slab_find(size, false);
+    SCSIReqSlabEntry *e;
+
+    if (slab && (e = QSLIST_FIRST(&slab->free))) {
+        QSLIST_REMOVE_HEAD(&slab->free, next);
+        slab->count--;
+        return e;
+    }
+    return g_malloc(size);
+}
+
+static void scsi_req_slab_put(void *p, size_t size)
+{
+    SCSIReqSlab *slab = scsi_req_slab_find(size, true);
+    SCSIReqSlabEntry *e = p;
+
+    if (!slab || slab->count >= SCSI_REQ_SLAB_MAX) {
+        g_free(p);
+        return;
+    }
+    QSLIST_INSERT_HEAD(&slab->free, e, next);
+    slab->count++;
+}
+
 SCSIRequest *scsi_req_alloc(const SCSIReqOps *reqops, SCSIDevice *d,
                             uint32_t tag, uint32_t lun, void *hba_private)
 {
@@ -683,7 +774,7 @@ SCSIRequest *scsi_req_alloc(const SCSIReqOps *reqops, SCSIDevice *d,
     const int memset_off = offsetof(SCSIRequest, sense)
                            + sizeof(req->sense);
 
-    req = g_malloc(reqops->size);
+    req = scsi_req_slab_get(reqops->size);
     memset((uint8_t *)req + memset_off, 0, reqops->size - memset_off);
     req->refcount = 1;
     req->bus = bus;
@@ -1375,7 +1466,7 @@ void scsi_req_unref(SCSIRequest *req)
         }
         object_unref(OBJECT(req->dev));
         object_unref(OBJECT(qbus->parent));
-        g_free(req);
+        scsi_req_slab_put(req, req->ops->size);
     }
 }
 
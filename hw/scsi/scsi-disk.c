@@ -64,6 +64,8 @@ struct SCSIDiskClass {
     DMAIOFunc       *dma_writev;
     bool            (*need_fua_emulation)(SCSICommand *cmd);
     void            (*update_sense)(SCSIRequest *r);
+    /* dma_readv/dma_writev cannot be called again before they complete */
+    bool            serial_dma_io;
 };
 
 typedef struct SCSIDiskReq {
@@ -404,6 +406,34 @@ static void scsi_read_complete(void *opaque, int ret)
     aio_context_release(blk_get_aio_context(s->qdev.conf.blk));
 }
 
+/*
+ * Submit the guest scatter/gather list of @r.  Map it straight from
+ * guest memory when possible, splitting at the max transfer size of the
+ * backend so that the pieces run in parallel; otherwise go through
+ * dma_blk_io, which maps in chunks and can wait for the bounce buffer.
+ */
+static BlockAIOCB *scsi_disk_dma_io(SCSIDiskReq *r, DMAIOFunc *io_func,
+                                    DMADirection dir)
+{
+    SCSIDiskState *s = DO_UPCAST(SCSIDiskState, qdev, r->req.dev);
+    SCSIDiskClass *sdc = (SCSIDiskClass *) object_get_class(OBJECT(s));
+    AioContext *ctx = blk_get_aio_context(s->qdev.conf.blk);
+    uint64_t offset = r->sector << BDRV_SECTOR_BITS;
+    uint64_t max_len = 0;
+    BlockAIOCB *acb;
+
+    if (!sdc->serial_dma_io) {
+        max_len = blk_get_max_transfer(s->qdev.conf.blk);
+    }
+    acb = dma_blk_io_direct(ctx, r->req.sg, offset, BDRV_SECTOR_SIZE,
+                            max_len, io_func, r, scsi_dma_complete, r, dir);
+    if (acb) {
+        return acb;
+    }
+    return dma_blk_io(ctx, r->req.sg, offset, BDRV_SECTOR_SIZE,
+                      io_func, r, scsi_dma_complete, r, dir);
+}
+
 /* Actually issue a read to the block device.  */
 static void scsi_do_read(SCSIDiskReq *r, int ret)
 {
@@ -421,11 +451,8 @@ static void scsi_do_read(SCSIDiskReq *r, int ret)
     if (r->req.sg) {
         dma_acct_start(s->qdev.conf.blk, &r->acct, r->req.sg, BLOCK_ACCT_READ);
         r->req.resid -= r->req.sg->size;
-        r->req.aiocb = dma_blk_io(blk_get_aio_context(s->qdev.conf.blk),
-                                  r->req.sg, r->sector << BDRV_SECTOR_BITS,
-                                  BDRV_SECTOR_SIZE,
-                                  sdc->dma_readv, r, scsi_dma_complete, r,
-                                  DMA_DIRECTION_FROM_DEVICE);
+        r->req.aiocb = scsi_disk_dma_io(r, sdc->dma_readv,
+                                        DMA_DIRECTION_FROM_DEVICE);
     } else {
         scsi_init_iovec(r, SCSI_DMA_BUF_SIZE);
         block_acct_start(blk_get_stats(s->qdev.conf.blk), &r->acct,
@@ -581,11 +608,8 @@ static void scsi_write_data(SCSIRequest *req)
     if (r->req.sg) {
         dma_acct_start(s->qdev.conf.blk, &r->acct, r->req.sg, BLOCK_ACCT_WRITE);
         r->req.resid -= r->req.sg->size;
-        r->req.aiocb = dma_blk_io(blk_get_aio_context(s->qdev.conf.blk),
-                                  r->req.sg, r->sector << BDRV_SECTOR_BITS,
-                                  BDRV_SECTOR_SIZE,
-                                  sdc->dma_writev, r, scsi_dma_complete, r,
-                                  DMA_DIRECTION_TO_DEVICE);
+        r->req.aiocb = scsi_disk_dma_io(r, sdc->dma_writev,
+                                        DMA_DIRECTION_TO_DEVICE);
     } else {
         block_acct_start(blk_get_stats(s->qdev.conf.blk), &r->acct,
                          r->qiov.size, BLOCK_ACCT_WRITE);
@@ -3147,6 +3171,8 @@ static void scsi_block_class_initfn(ObjectClass *klass, void *data)
     sdc->dma_readv   = scsi_block_dma_readv;
     sdc->dma_writev  = scsi_block_dma_writev;
     sdc->update_sense = scsi_block_update_sense;
+    /* The SG_IO header lives in the request, one command at a time */
+    sdc->serial_dma_io = true;
     sdc->need_fua_emulation = scsi_block_no_fua;
     dc->desc = "SCSI block device passthrough";
     device_class_set_props(dc, scsi_block_properties);
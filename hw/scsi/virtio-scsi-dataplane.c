@@ -20,6 +20,57 @@
 #include "scsi/constants.h"
 #include "hw/virtio/virtio-bus.h"
 #include "hw/virtio/virtio-access.h"
+#include "sysemu/iothread.h"
+
+static void virtio_scsi_unref_vq_iothreads(VirtIOSCSI *s)
+{
+    VirtIOSCSICommon *vs = VIRTIO_SCSI_COMMON(s);
+    uint32_t i;
+
+    if (!s->vq_iothread) {
+        return;
+    }
+    for (i = 0; i < vs->conf.num_queues; i++) {
+        if (s->vq_iothread[i]) {
+            object_unref(OBJECT(s->vq_iothread[i]));
+        }
+    }
+    g_free(s->vq_iothread);
+    s->vq_iothread = NULL;
+}
+
+/*
+ * Parse iothread-vq-mapping like virtio-blk does: command queue i is
+ * handled by entry i modulo the length of the colon-separated list.
+ */
+static bool virtio_scsi_map_vqs(VirtIOSCSI *s, const char *mapping,
+                                Error **errp)
+{
+    VirtIOSCSICommon *vs = VIRTIO_SCSI_COMMON(s);
+    g_auto(GStrv) ids = g_strsplit(mapping, ":", -1);
+    unsigned nids = g_strv_length(ids);
+    uint32_t i;
+
+    if (!nids) {
+        error_setg(errp, "iothread-vq-mapping must not be empty");
+        return false;
+    }
+
+    s->vq_iothread = g_new0(IOThread *, vs->conf.num_queues);
+    for (i = 0; i < vs->conf.num_queues; i++) {
+        IOThread *iothread = iothread_by_id(ids[i % nids]);
+
+        if (!iothread) {
+            error_setg(errp, "iothread-vq-mapping: no iothread '%s'",
+                       ids[i % nids]);
+            virtio_scsi_unref_vq_iothreads(s);
+            return false;
+        }
+        object_ref(OBJECT(iothread));
+        s->vq_iothread[i] = iothread;
+    }
+    return true;
+}
 
 /* Context: QEMU global mutex held */
 void virtio_scsi_dataplane_setup(VirtIOSCSI *s, Error **errp)
@@ -29,7 +80,13 @@ void virtio_scsi_dataplane_setup(VirtIOSCSI *s, Error **errp)
     BusState *qbus = qdev_get_parent_bus(DEVICE(vdev));
     VirtioBusClass *k = VIRTIO_BUS_GET_CLASS(qbus);
 
-    if (vs->conf.iothread) {
+    if (vs->conf.iothread && vs->conf.iothread_vq_mapping) {
+        error_setg(errp, "iothread and iothread-vq-mapping cannot be used "
+                   "together");
+        return;
+    }
+
+    if (vs->conf.iothread || vs->conf.iothread_vq_mapping) {
         if (!k->set_guest_notifiers || !k->ioeventfd_assign) {
             error_setg(errp,
                        "device is incompatible with iothread "
@@ -40,13 +97,67 @@ void virtio_scsi_dataplane_setup(VirtIOSCSI *s, Error **errp)
             error_setg(errp, "ioeventfd is required for iothread");
             return;
         }
-        s->ctx = iothread_get_aio_context(vs->conf.iothread);
+        if (vs->conf.iothread_vq_mapping) {
+            if (!virtio_scsi_map_vqs(s, vs->conf.iothread_vq_mapping, errp)) {
+                return;
+            }
+            /* The disks, ctrl and event queues live in the first one */
+            s->ctx = iothread_get_aio_context(s->vq_iothread[0]);
+        } else {
+            s->ctx = iothread_get_aio_context(vs->conf.iothread);
+        }
     } else {
         if (!virtio_device_ioeventfd_enabled(vdev)) {
             return;
         }
         s->ctx = qemu_get_aio_context();
     }
+    s->vq_aio_context = g_new(AioContext *, vs->conf.num_queues);
+}
+
+/* Context: QEMU global mutex held */
+void virtio_scsi_dataplane_cleanup(VirtIOSCSI *s)
+{
+    virtio_scsi_unref_vq_iothreads(s);
+    g_free(s->vq_aio_context);
+    s->vq_aio_context = NULL;
+}
+
+/*
+ * Allow the disks on the bus to submit requests from the iothread of
+ * the command queue instead of s->ctx.  Emulation still runs under the
+ * lock of s->ctx; only submission and completion move.
+ *
+ * Context: QEMU global mutex held
+ */
+static bool virtio_scsi_set_multiqueue(VirtIOSCSI *s, bool multiqueue,
+                                       Error **errp)
+{
+    BusChild *kid;
+
+    QTAILQ_FOREACH(kid, &s->bus.qbus.children, sibling) {
+        SCSIDevice *d = SCSI_DEVICE(kid->child);
+
+        if (!blk_set_multiqueue(d->conf.blk, multiqueue, errp) &&
+            multiqueue) {
+            virtio_scsi_set_multiqueue(s, false, NULL);
+            return false;
+        }
+    }
+    return true;
+}
+
+bool virtio_scsi_dataplane_hotplug(VirtIOSCSI *s, SCSIDevice *d,
+                                   Error **errp)
+{
+    if (!s->multiqueue) {
+        return true;
+    }
+    if (!blk_set_multiqueue(d->conf.blk, true, errp)) {
+        error_prepend(errp, "virtio-scsi iothread-vq-mapping: ");
+        return false;
+    }
+    return true;
 }
 
 static bool virtio_scsi_data_plane_handle_cmd(VirtIODevice *vdev,
@@ -95,7 +206,7 @@ static bool virtio_scsi_data_plane_handle_event(VirtIODevice *vdev,
 }
 
 static int virtio_scsi_vring_init(VirtIOSCSI *s, VirtQueue *vq, int n,
-                                  VirtIOHandleAIOOutput fn)
+                                  AioContext *ctx, VirtIOHandleAIOOutput fn)
 {
     BusState *qbus = BUS(qdev_get_parent_bus(DEVICE(s)));
     int rc;
@@ -109,21 +220,41 @@ static int virtio_scsi_vring_init(VirtIOSCSI *s, VirtQueue *vq, int n,
         return rc;
     }
 
-    virtio_queue_aio_set_host_notifier_handler(vq, s->ctx, fn);
+    aio_context_acquire(ctx);
+    virtio_queue_aio_set_host_notifier_handler(vq, ctx, fn);
+    aio_context_release(ctx);
     return 0;
 }
 
-/* Context: BH in IOThread */
+/* Context: BH in the IOThread of the virtqueue */
 static void virtio_scsi_dataplane_stop_bh(void *opaque)
 {
-    VirtIOSCSI *s = opaque;
+    VirtQueue *vq = opaque;
+
+    virtio_queue_aio_set_host_notifier_handler(vq,
+            qemu_get_current_aio_context(), NULL);
+}
+
+/* Context: QEMU global mutex held */
+static void virtio_scsi_dataplane_stop_vq(VirtQueue *vq, AioContext *ctx)
+{
+    aio_context_acquire(ctx);
+    aio_wait_bh_oneshot(ctx, virtio_scsi_dataplane_stop_bh, vq);
+    aio_context_release(ctx);
+}
+
+/* Context: QEMU global mutex held */
+static void virtio_scsi_dataplane_stop_vqs(VirtIOSCSI *s, int nvqs)
+{
     VirtIOSCSICommon *vs = VIRTIO_SCSI_COMMON(s);
     int i;
 
-    virtio_queue_aio_set_host_notifier_handler(vs->ctrl_vq, s->ctx, NULL);
-    virtio_queue_aio_set_host_notifier_handler(vs->event_vq, s->ctx, NULL);
-    for (i = 0; i < vs->conf.num_queues; i++) {
-        virtio_queue_aio_set_host_notifier_handler(vs->cmd_vqs[i], s->ctx, NULL);
+    for (i = 0; i < nvqs; i++) {
+        VirtQueue *vq = i == 0 ? vs->ctrl_vq :
+                        i == 1 ? vs->event_vq : vs->cmd_vqs[i - 2];
+
+        virtio_scsi_dataplane_stop_vq(vq, i < 2 ? s->ctx :
+                                      s->vq_aio_context[i - 2]);
     }
 }
 
@@ -146,6 +277,27 @@ int virtio_scsi_dataplane_start(VirtIODevice *vdev)
 
     s->dataplane_starting = true;
 
+    /*
+     * Disks may have been added or their nodes changed since the last
+     * start, so check again that they accept requests from several
+     * iothreads.
+     */
+    s->multiqueue = false;
+    if (s->vq_iothread) {
+        Error *local_err = NULL;
+
+        s->multiqueue = virtio_scsi_set_multiqueue(s, true, &local_err);
+        if (!s->multiqueue) {
+            warn_report_err(local_err);
+            warn_report("virtio-scsi: handling all virtqueues in one "
+                        "iothread");
+        }
+    }
+    for (i = 0; i < vs->conf.num_queues; i++) {
+        s->vq_aio_context[i] = s->multiqueue ?
+            iothread_get_aio_context(s->vq_iothread[i]) : s->ctx;
+    }
+
     /* Set up guest notifier (irq) */
     rc = k->set_guest_notifiers(qbus->parent, vs->conf.num_queues + 2, true);
     if (rc != 0) {
@@ -154,15 +306,14 @@ int virtio_scsi_dataplane_start(VirtIODevice *vdev)
         goto fail_guest_notifiers;
     }
 
-    aio_context_acquire(s->ctx);
-    rc = virtio_scsi_vring_init(s, vs->ctrl_vq, 0,
+    rc = virtio_scsi_vring_init(s, vs->ctrl_vq, 0, s->ctx,
                                 virtio_scsi_data_plane_handle_ctrl);
     if (rc) {
         goto fail_vrings;
     }
 
     vq_init_count++;
-    rc = virtio_scsi_vring_init(s, vs->event_vq, 1,
+    rc = virtio_scsi_vring_init(s, vs->event_vq, 1, s->ctx,
                                 virtio_scsi_data_plane_handle_event);
     if (rc) {
         goto fail_vrings;
@@ -171,6 +322,7 @@ int virtio_scsi_dataplane_start(VirtIODevice *vdev)
     vq_init_count++;
     for (i = 0; i < vs->conf.num_queues; i++) {
         rc = virtio_scsi_vring_init(s, vs->cmd_vqs[i], i + 2,
+                                    s->vq_aio_context[i],
                                     virtio_scsi_data_plane_handle_cmd);
         if (rc) {
             goto fail_vrings;
@@ -180,18 +332,20 @@ int virtio_scsi_dataplane_start(VirtIODevice *vdev)
 
     s->dataplane_starting = false;
     s->dataplane_started = true;
-    aio_context_release(s->ctx);
     return 0;
 
 fail_vrings:
-    aio_wait_bh_oneshot(s->ctx, virtio_scsi_dataplane_stop_bh, s);
-    aio_context_release(s->ctx);
+    virtio_scsi_dataplane_stop_vqs(s, vq_init_count);
     for (i = 0; i < vq_init_count; i++) {
         virtio_bus_set_host_notifier(VIRTIO_BUS(qbus), i, false);
         virtio_bus_cleanup_host_notifier(VIRTIO_BUS(qbus), i);
     }
     k->set_guest_notifiers(qbus->parent, vs->conf.num_queues + 2, false);
 fail_guest_notifiers:
+    if (s->multiqueue) {
+        virtio_scsi_set_multiqueue(s, false, NULL);
+        s->multiqueue = false;
+    }
     s->dataplane_fenced = true;
     s->dataplane_starting = false;
     s->dataplane_started = true;
@@ -219,12 +373,15 @@ void virtio_scsi_dataplane_stop(VirtIODevice *vdev)
     }
     s->dataplane_stopping = true;
 
-    aio_context_acquire(s->ctx);
-    aio_wait_bh_oneshot(s->ctx, virtio_scsi_dataplane_stop_bh, s);
-    aio_context_release(s->ctx);
+    virtio_scsi_dataplane_stop_vqs(s, vs->conf.num_queues + 2);
 
     blk_drain_all(); /* ensure there are no in-flight requests */
 
+    if (s->multiqueue) {
+        virtio_scsi_set_multiqueue(s, false, NULL);
+        s->multiqueue = false;
+    }
+
     for (i = 0; i < vs->conf.num_queues + 2; i++) {
         virtio_bus_set_host_notifier(VIRTIO_BUS(qbus), i, false);
         virtio_bus_cleanup_host_notifier(VIRTIO_BUS(qbus), i);
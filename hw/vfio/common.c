@@ -30,10 +30,12 @@
 #include "exec/address-spaces.h"
 #include "exec/memory.h"
 #include "exec/ram_addr.h"
+#include "exec/ramblock.h"
 #include "hw/hw.h"
 #include "qemu/error-report.h"
 #include "qemu/main-loop.h"
 #include "qemu/range.h"
+#include "qemu/timer.h"
 #include "sysemu/kvm.h"
 #include "sysemu/reset.h"
 #include "trace.h"
@@ -501,6 +503,153 @@ static int vfio_dma_map(VFIOContainer *container, hwaddr iova,
     return -errno;
 }
 
+/*
+ * With asynchronous DMA mapping, guest RAM that is present when a
+ * container is created is split into chunks, aligned in IOVA so that
+ * IOMMU superpages can still be used, and mapped by worker threads while
+ * the guest boots.  Sections come from the listener in ascending address
+ * order and the workers take chunks in that order, so low memory, where
+ * firmware and the guest kernel live, is mapped first.
+ */
+#define VFIO_DMA_MAP_CHUNK          (1ULL << 30)
+#define VFIO_DMA_MAP_MAX_THREADS    16
+
+typedef struct VFIODMAChunk {
+    hwaddr iova;
+    ram_addr_t size;
+    void *vaddr;
+    size_t pagesize;
+} VFIODMAChunk;
+
+static void vfio_dma_map_defer(VFIOContainer *container,
+                               MemoryRegionSection *section,
+                               hwaddr iova, ram_addr_t size, void *vaddr)
+{
+    size_t pagesize = qemu_ram_pagesize(section->mr->ram_block);
+    hwaddr chunk = MAX(VFIO_DMA_MAP_CHUNK, pagesize);
+
+    while (size) {
+        VFIODMAChunk c = {
+            .iova = iova,
+            .size = MIN(size, QEMU_ALIGN_UP(iova + 1, chunk) - iova),
+            .vaddr = vaddr,
+            .pagesize = pagesize,
+        };
+
+        g_array_append_val(container->dma_map_chunks, c);
+        iova += c.size;
+        vaddr += c.size;
+        size -= c.size;
+    }
+}
+
+/*
+ * VFIO_IOMMU_MAP_DMA pins pages under a container-wide lock, so chunks
+ * are effectively mapped one at a time.  What does run in parallel is
+ * faulting the pages in beforehand, once per host (huge) page.  The
+ * guest may already be running, so touch them with an atomic add of
+ * zero that cannot lose a concurrent write.
+ */
+static void vfio_dma_prefault(void *vaddr, ram_addr_t size, size_t pagesize)
+{
+    uint8_t *p = QEMU_ALIGN_PTR_DOWN(vaddr, pagesize);
+    uint8_t *end = (uint8_t *)vaddr + size;
+
+    for (; p < end; p += pagesize) {
+        qatomic_fetch_add(p, 0);
+    }
+}
+
+static void *vfio_dma_map_thread(void *opaque)
+{
+    VFIOContainer *container = opaque;
+    GArray *chunks = container->dma_map_chunks;
+    unsigned i;
+
+    while ((i = qatomic_fetch_inc(&container->dma_map_next)) < chunks->len) {
+        VFIODMAChunk *c = &g_array_index(chunks, VFIODMAChunk, i);
+        int ret;
+
+        vfio_dma_prefault(c->vaddr, c->size, c->pagesize);
+        ret = vfio_dma_map(container, c->iova, c->size, c->vaddr, false);
+        if (ret) {
+            qatomic_cmpxchg(&container->dma_map_error, 0, ret);
+        }
+    }
+
+    return NULL;
+}
+
+static void vfio_dma_map_async_start(VFIOContainer *container)
+{
+    int i, n = MIN(VFIO_DMA_MAP_MAX_THREADS, sysconf(_SC_NPROCESSORS_ONLN));
+
+    if (!container->dma_map_chunks->len) {
+        return;
+    }
+    n = MAX(MIN(n, container->dma_map_chunks->len), 1);
+
+    trace_vfio_dma_map_async(container->dma_map_chunks->len, n);
+    container->dma_map_next = 0;
+    container->dma_map_error = 0;
+    container->dma_map_threads = g_new0(QemuThread, n);
+    container->dma_map_nthreads = n;
+    for (i = 0; i < n; i++) {
+        qemu_thread_create(&container->dma_map_threads[i], "vfio-dma-map",
+                           vfio_dma_map_thread, container,
+                           QEMU_THREAD_JOINABLE);
+    }
+}
+
+/*
+ * Wait until guest RAM is fully mapped.  Must be called before anything
+ * that lets a device in @container master DMA, and before the mappings
+ * are changed or queried.
+ */
+void vfio_container_dma_map_wait(VFIOContainer *container)
+{
+    int i;
+
+    if (!container || !container->dma_map_nthreads) {
+        return;
+    }
+
+    for (i = 0; i < container->dma_map_nthreads; i++) {
+        qemu_thread_join(&container->dma_map_threads[i]);
+    }
+    g_free(container->dma_map_threads);
+    container->dma_map_threads = NULL;
+    container->dma_map_nthreads = 0;
+    g_array_set_size(container->dma_map_chunks, 0);
+
+    if (container->dma_map_error) {
+        error_report("vfio: asynchronous DMA mapping failed: %s",
+                     strerror(-container->dma_map_error));
+        hw_error("vfio: DMA mapping failed, unable to continue");
+    }
+}
+
+/* Whether an asynchronous mapping job covers part of [@iova, @end] */
+static bool vfio_dma_map_pending(VFIOContainer *container,
+                                 hwaddr iova, hwaddr end)
+{
+    unsigned i;
+
+    if (!container->dma_map_nthreads) {
+        return false;
+    }
+
+    for (i = 0; i < container->dma_map_chunks->len; i++) {
+        VFIODMAChunk *c = &g_array_index(container->dma_map_chunks,
+                                         VFIODMAChunk, i);
+
+        if (ranges_overlap(c->iova, c->size, iova, end - iova + 1)) {
+            return true;
+        }
+    }
+    return false;
+}
+
 static void vfio_host_win_add(VFIOContainer *container,
                               hwaddr min_iova, hwaddr max_iova,
                               uint64_t iova_pgsizes)
@@ -833,6 +982,10 @@ static void vfio_listener_region_add(MemoryListener *listener,
                 pgmask + 1);
             return;
         }
+    } else if (container->dma_map_defer && !section->readonly) {
+        vfio_dma_map_defer(container, section, iova, int128_get64(llsize),
+                           vaddr);
+        return;
     }
 
     ret = vfio_dma_map(container, iova, int128_get64(llsize),
@@ -935,6 +1088,11 @@ static void vfio_listener_region_del(MemoryListener *listener,
 
     trace_vfio_listener_region_del(iova, end);
 
+    /* Only wait for the workers if they may still map this range */
+    if (vfio_dma_map_pending(container, iova, end)) {
+        vfio_container_dma_map_wait(container);
+    }
+
     if (memory_region_is_ram_device(section->mr)) {
         hwaddr pgmask;
         VFIOHostDMAWindow *hostwin;
@@ -1013,11 +1171,23 @@ static int vfio_get_dirty_bitmap(VFIOContainer *container, uint64_t iova,
     pages = TARGET_PAGE_ALIGN(range->size) >> TARGET_PAGE_BITS;
     range->bitmap.size = ROUND_UP(pages, sizeof(__u64) * BITS_PER_BYTE) /
                                          BITS_PER_BYTE;
-    range->bitmap.data = g_try_malloc0(range->bitmap.size);
-    if (!range->bitmap.data) {
-        ret = -ENOMEM;
-        goto err_out;
+
+    /*
+     * The buffer is only used under the BQL, keep it around so that every
+     * sync of a large guest does not allocate and fault in a fresh bitmap.
+     */
+    if (range->bitmap.size > container->dirty_bitmap_size) {
+        void *data = g_try_realloc(container->dirty_bitmap,
+                                   range->bitmap.size);
+        if (!data) {
+            ret = -ENOMEM;
+            goto err_out;
+        }
+        container->dirty_bitmap = data;
+        container->dirty_bitmap_size = range->bitmap.size;
     }
+    range->bitmap.data = container->dirty_bitmap;
+    memset(range->bitmap.data, 0, range->bitmap.size);
 
     ret = ioctl(container->fd, VFIO_IOMMU_DIRTY_PAGES, dbitmap);
     if (ret) {
@@ -1033,7 +1203,6 @@ static int vfio_get_dirty_bitmap(VFIOContainer *container, uint64_t iova,
     trace_vfio_get_dirty_bitmap(container->fd, range->iova, range->size,
                                 range->bitmap.size, ram_addr);
 err_out:
-    g_free(range->bitmap.data);
     g_free(dbitmap);
 
     return ret;
@@ -1077,6 +1246,28 @@ static void vfio_iommu_map_dirty_notify(IOMMUNotifier *n, IOMMUTLBEntry *iotlb)
     rcu_read_unlock();
 }
 
+/*
+ * Whether every page of [@ram_addr, @ram_addr + @size) is already dirty in
+ * the migration bitmap of @rb.  Querying the IOMMU would not add anything
+ * then, and the kernel keeps its dirty bits until they are read, so pages
+ * the device writes now are still reported by a later sync, once the
+ * migration code has sent and cleared them.
+ */
+static bool vfio_ram_all_dirty(RAMBlock *rb, ram_addr_t ram_addr,
+                               uint64_t size)
+{
+    unsigned long start, end;
+
+    if (!rb || !rb->bmap) {
+        return false;
+    }
+
+    start = (ram_addr - rb->offset) >> TARGET_PAGE_BITS;
+    end = TARGET_PAGE_ALIGN(ram_addr - rb->offset + size) >> TARGET_PAGE_BITS;
+
+    return find_next_zero_bit(rb->bmap, end, start) >= end;
+}
+
 static int vfio_sync_dirty_bitmap(VFIOContainer *container,
                                   MemoryRegionSection *section)
 {
@@ -1113,6 +1304,13 @@ static int vfio_sync_dirty_bitmap(VFIOContainer *container,
     ram_addr = memory_region_get_ram_addr(section->mr) +
                section->offset_within_region;
 
+    if (vfio_ram_all_dirty(section->mr->ram_block, ram_addr,
+                           int128_get64(section->size))) {
+        trace_vfio_sync_dirty_bitmap_skip(ram_addr,
+                                          int128_get64(section->size));
+        return 0;
+    }
+
     return vfio_get_dirty_bitmap(container,
                        TARGET_PAGE_ALIGN(section->offset_within_address_space),
                        int128_get64(section->size), ram_addr);
@@ -1129,7 +1327,12 @@ static void vfio_listerner_log_sync(MemoryListener *listener,
     }
 
     if (vfio_devices_all_saving(container)) {
+        int64_t start = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+
+        vfio_container_dma_map_wait(container);
         vfio_sync_dirty_bitmap(container, section);
+        vfio_mig_add_dirty_sync_time(qemu_clock_get_ns(QEMU_CLOCK_REALTIME) -
+                                     start);
     }
 }
 
@@ -1141,6 +1344,7 @@ static const MemoryListener vfio_memory_listener = {
 
 static void vfio_listener_release(VFIOContainer *container)
 {
+    vfio_container_dma_map_wait(container);
     memory_listener_unregister(&container->listener);
     if (container->iommu_type == VFIO_SPAPR_TCE_v2_IOMMU) {
         memory_listener_unregister(&container->prereg_listener);
@@ -1666,7 +1870,7 @@ static void vfio_get_iommu_info_migration(VFIOContainer *container,
 }
 
 static int vfio_connect_container(VFIOGroup *group, AddressSpace *as,
-                                  Error **errp)
+                                  bool async_dma_map, Error **errp)
 {
     VFIOContainer *container;
     int ret, fd;
@@ -1850,7 +2054,13 @@ static int vfio_connect_container(VFIOGroup *group, AddressSpace *as,
 
     container->listener = vfio_memory_listener;
 
+    if (async_dma_map) {
+        container->dma_map_chunks = g_array_new(false, false,
+                                                sizeof(VFIODMAChunk));
+        container->dma_map_defer = true;
+    }
     memory_listener_register(&container->listener, container->space->as);
+    container->dma_map_defer = false;
 
     if (container->error) {
         ret = -1;
@@ -1860,6 +2070,9 @@ static int vfio_connect_container(VFIOGroup *group, AddressSpace *as,
     }
 
     container->initialized = true;
+    if (async_dma_map) {
+        vfio_dma_map_async_start(container);
+    }
 
     return 0;
 listener_release_exit:
@@ -1869,6 +2082,10 @@ listener_release_exit:
     vfio_listener_release(container);
 
 free_container_exit:
+    if (container->dma_map_chunks) {
+        g_array_free(container->dma_map_chunks, true);
+    }
+    g_free(container->dirty_bitmap);
     g_free(container);
 
 close_fd_exit:
@@ -1917,13 +2134,18 @@ static void vfio_disconnect_container(VFIOGroup *group)
 
         trace_vfio_disconnect_container(container->fd);
         close(container->fd);
+        if (container->dma_map_chunks) {
+            g_array_free(container->dma_map_chunks, true);
+        }
+        g_free(container->dirty_bitmap);
         g_free(container);
 
         vfio_put_address_space(space);
     }
 }
 
-VFIOGroup *vfio_get_group(int groupid, AddressSpace *as, Error **errp)
+VFIOGroup *vfio_get_group(int groupid, AddressSpace *as, bool async_dma_map,
+                          Error **errp)
 {
     VFIOGroup *group;
     char path[32];
@@ -1933,6 +2155,9 @@ VFIOGroup *vfio_get_group(int groupid, AddressSpace *as, Error **errp)
         if (group->groupid == groupid) {
             /* Found it.  Now is it already in the right context? */
             if (group->container->space->as == as) {
+                if (!async_dma_map) {
+                    vfio_container_dma_map_wait(group->container);
+                }
                 return group;
             } else {
                 error_setg(errp, "group %d used in multiple address spaces",
@@ -1967,7 +2192,7 @@ VFIOGroup *vfio_get_group(int groupid, AddressSpace *as, Error **errp)
     group->groupid = groupid;
     QLIST_INIT(&group->device_list);
 
-    if (vfio_connect_container(group, as, errp)) {
+    if (vfio_connect_container(group, as, async_dma_map, errp)) {
         error_prepend(errp, "failed to setup container for group %d: ",
                       groupid);
         goto close_fd_exit;
@@ -1979,6 +2204,10 @@ VFIOGroup *vfio_get_group(int groupid, AddressSpace *as, Error **errp)
 
     QLIST_INSERT_HEAD(&vfio_group_list, group, next);
 
+    if (!async_dma_map) {
+        vfio_container_dma_map_wait(group->container);
+    }
+
     return group;
 
 close_fd_exit:
@@ -10,6 +10,7 @@
 #include "qemu/osdep.h"
 #include "qemu/main-loop.h"
 #include "qemu/cutils.h"
+#include "qemu/units.h"
 #include <linux/vfio.h>
 #include <sys/ioctl.h>
 
@@ -45,7 +46,20 @@
 #define VFIO_MIG_FLAG_DEV_SETUP_STATE   (0xffffffffef100003ULL)
 #define VFIO_MIG_FLAG_DEV_DATA_STATE    (0xffffffffef100004ULL)
 
+/*
+ * How much device state a save thread may read ahead of the migration
+ * stream in stop-and-copy
+ */
+#define VFIO_SAVE_QUEUE_MAX             (128 * MiB)
+
+typedef struct VFIOSaveBuffer {
+    QSIMPLEQ_ENTRY(VFIOSaveBuffer) next;
+    uint64_t size;
+    uint8_t data[];
+} VFIOSaveBuffer;
+
 static int64_t bytes_transferred;
+static int64_t dirty_sync_time;
 
 static inline int vfio_mig_access(VFIODevice *vbasedev, void *val, int count,
                                   off_t off, bool iswrite)
@@ -261,6 +275,61 @@ static int vfio_save_buffer(QEMUFile *f, VFIODevice *vbasedev, uint64_t *size)
     return ret;
 }
 
+/* Like vfio_save_buffer(), but copy the data into a new VFIOSaveBuffer */
+static int vfio_read_buffer(VFIODevice *vbasedev, VFIOSaveBuffer **pbuf)
+{
+    VFIOMigration *migration = vbasedev->migration;
+    VFIORegion *region = &migration->region;
+    uint64_t data_offset = 0, data_size = 0, sz;
+    VFIOSaveBuffer *sbuf;
+    uint8_t *dst;
+    int ret;
+
+    ret = vfio_mig_read(vbasedev, &data_offset, sizeof(data_offset),
+                      region->fd_offset + VFIO_MIG_STRUCT_OFFSET(data_offset));
+    if (ret < 0) {
+        return ret;
+    }
+
+    ret = vfio_mig_read(vbasedev, &data_size, sizeof(data_size),
+                        region->fd_offset + VFIO_MIG_STRUCT_OFFSET(data_size));
+    if (ret < 0) {
+        return ret;
+    }
+
+    trace_vfio_save_buffer(vbasedev->name, data_offset, data_size,
+                           migration->pending_bytes);
+
+    sbuf = g_try_malloc(sizeof(*sbuf) + data_size);
+    if (!sbuf) {
+        error_report("%s: Error allocating buffer ", __func__);
+        return -ENOMEM;
+    }
+    sbuf->size = data_size;
+
+    for (dst = sbuf->data, sz = data_size; sz; ) {
+        uint64_t sec_size;
+        void *buf = get_data_section_size(region, data_offset, sz, &sec_size);
+
+        if (buf) {
+            memcpy(dst, buf, sec_size);
+        } else {
+            ret = vfio_mig_read(vbasedev, dst, sec_size,
+                                region->fd_offset + data_offset);
+            if (ret < 0) {
+                g_free(sbuf);
+                return ret;
+            }
+        }
+        sz -= sec_size;
+        data_offset += sec_size;
+        dst += sec_size;
+    }
+
+    *pbuf = sbuf;
+    return 0;
+}
+
 static int vfio_load_buffer(QEMUFile *f, VFIODevice *vbasedev,
                             uint64_t data_size)
 {
@@ -434,6 +503,139 @@ static void vfio_migration_cleanup(VFIODevice *vbasedev)
     }
 }
 
+/*
+ * Once the VM is stopped for stop-and-copy, the remaining state of every
+ * device is read by a thread of its own.  This overlaps reading the
+ * devices with each other and with the final RAM pass, instead of
+ * reading each device in turn when the migration thread gets to it;
+ * vfio_save_complete_precopy() then only has to write out the buffers.
+ */
+static void *vfio_save_thread(void *opaque)
+{
+    VFIODevice *vbasedev = opaque;
+    VFIOMigration *migration = vbasedev->migration;
+    int ret;
+
+    ret = vfio_update_pending(vbasedev);
+    while (!ret && migration->pending_bytes > 0) {
+        VFIOSaveBuffer *buf;
+        uint64_t size;
+
+        ret = vfio_read_buffer(vbasedev, &buf);
+        if (ret) {
+            break;
+        }
+        size = buf->size;
+
+        qemu_mutex_lock(&migration->save_lock);
+        while (migration->save_queued > VFIO_SAVE_QUEUE_MAX &&
+               !migration->save_abort) {
+            qemu_cond_wait(&migration->save_cond, &migration->save_lock);
+        }
+        if (migration->save_abort) {
+            qemu_mutex_unlock(&migration->save_lock);
+            g_free(buf);
+            break;
+        }
+        QSIMPLEQ_INSERT_TAIL(&migration->save_queue, buf, next);
+        migration->save_queued += size;
+        qemu_cond_broadcast(&migration->save_cond);
+        qemu_mutex_unlock(&migration->save_lock);
+
+        if (size == 0) {
+            break;
+        }
+
+        ret = vfio_update_pending(vbasedev);
+    }
+
+    qemu_mutex_lock(&migration->save_lock);
+    migration->save_ret = ret;
+    migration->save_done = true;
+    qemu_cond_broadcast(&migration->save_cond);
+    qemu_mutex_unlock(&migration->save_lock);
+    return NULL;
+}
+
+static void vfio_save_thread_start(VFIODevice *vbasedev)
+{
+    VFIOMigration *migration = vbasedev->migration;
+
+    if (migration->save_thread_running) {
+        return;
+    }
+
+    migration->save_queued = 0;
+    migration->save_done = false;
+    migration->save_abort = false;
+    migration->save_ret = 0;
+    qemu_thread_create(&migration->save_thread, "vfio-save",
+                       vfio_save_thread, vbasedev, QEMU_THREAD_JOINABLE);
+    migration->save_thread_running = true;
+    trace_vfio_save_thread_start(vbasedev->name);
+}
+
+/* Stop the save thread, drop what it read and return its status */
+static int vfio_save_thread_join(VFIODevice *vbasedev)
+{
+    VFIOMigration *migration = vbasedev->migration;
+    VFIOSaveBuffer *buf;
+
+    if (!migration->save_thread_running) {
+        return 0;
+    }
+
+    qemu_mutex_lock(&migration->save_lock);
+    migration->save_abort = true;
+    qemu_cond_broadcast(&migration->save_cond);
+    qemu_mutex_unlock(&migration->save_lock);
+
+    qemu_thread_join(&migration->save_thread);
+    migration->save_thread_running = false;
+
+    while ((buf = QSIMPLEQ_FIRST(&migration->save_queue))) {
+        QSIMPLEQ_REMOVE_HEAD(&migration->save_queue, next);
+        g_free(buf);
+    }
+    migration->save_queued = 0;
+    return migration->save_ret;
+}
+
+/* Write the data read by the save thread to @f as it becomes available */
+static int vfio_save_thread_drain(QEMUFile *f, VFIODevice *vbasedev)
+{
+    VFIOMigration *migration = vbasedev->migration;
+
+    for (;;) {
+        VFIOSaveBuffer *buf;
+
+        qemu_mutex_lock(&migration->save_lock);
+        while (QSIMPLEQ_EMPTY(&migration->save_queue) &&
+               !migration->save_done) {
+            qemu_cond_wait(&migration->save_cond, &migration->save_lock);
+        }
+        buf = QSIMPLEQ_FIRST(&migration->save_queue);
+        if (buf) {
+            QSIMPLEQ_REMOVE_HEAD(&migration->save_queue, next);
+            migration->save_queued -= buf->size;
+            qemu_cond_broadcast(&migration->save_cond);
+        }
+        qemu_mutex_unlock(&migration->save_lock);
+
+        if (!buf) {
+            break;
+        }
+
+        qemu_put_be64(f, VFIO_MIG_FLAG_DEV_DATA_STATE);
+        qemu_put_be64(f, buf->size);
+        qemu_put_buffer(f, buf->data, buf->size);
+        bytes_transferred += buf->size;
+        g_free(buf);
+    }
+
+    return vfio_save_thread_join(vbasedev);
+}
+
 /* ---------------------------------------------------------------------- */
 
 static int vfio_save_setup(QEMUFile *f, void *opaque)
@@ -488,6 +690,7 @@ static void vfio_save_cleanup(void *opaque)
 {
     VFIODevice *vbasedev = opaque;
 
+    vfio_save_thread_join(vbasedev);
     vfio_migration_cleanup(vbasedev);
     trace_vfio_save_cleanup(vbasedev->name);
 }
@@ -502,6 +705,10 @@ static void vfio_save_pending(QEMUFile *f, void *opaque,
     VFIOMigration *migration = vbasedev->migration;
     int ret;
 
+    if (migration->save_thread_running) {
+        return;
+    }
+
     ret = vfio_update_pending(vbasedev);
     if (ret) {
         return;
@@ -567,22 +774,35 @@ static int vfio_save_complete_precopy(QEMUFile *f, void *opaque)
     uint64_t data_size;
     int ret;
 
-    ret = vfio_migration_set_state(vbasedev, ~VFIO_DEVICE_STATE_RUNNING,
-                                   VFIO_DEVICE_STATE_SAVING);
-    if (ret) {
-        error_report("%s: Failed to set state STOP and SAVING",
-                     vbasedev->name);
-        return ret;
+    /* A running save thread implies the device is stopped and saving */
+    if (!migration->save_thread_running) {
+        ret = vfio_migration_set_state(vbasedev, ~VFIO_DEVICE_STATE_RUNNING,
+                                       VFIO_DEVICE_STATE_SAVING);
+        if (ret) {
+            error_report("%s: Failed to set state STOP and SAVING",
+                         vbasedev->name);
+            return ret;
+        }
     }
 
     ret = vfio_save_device_config_state(f, opaque);
     if (ret) {
+        vfio_save_thread_join(vbasedev);
         return ret;
     }
 
-    ret = vfio_update_pending(vbasedev);
-    if (ret) {
-        return ret;
+    if (migration->save_thread_running) {
+        ret = vfio_save_thread_drain(f, vbasedev);
+        if (ret) {
+            error_report("%s: Failed to save buffer", vbasedev->name);
+            return ret;
+        }
+        migration->pending_bytes = 0;
+    } else {
+        ret = vfio_update_pending(vbasedev);
+        if (ret) {
+            return ret;
+        }
     }
 
     while (migration->pending_bytes > 0) {
@@ -739,6 +959,7 @@ static void vfio_vmstate_change(void *opaque, int running, RunState state)
     }
 
     if (running) {
+        vfio_save_thread_join(vbasedev);
         /*
          * Here device state can have one of _SAVING, _RESUMING or _STOP bit.
          * Transition from _SAVING to _RUNNING can happen if there is migration
@@ -767,6 +988,9 @@ static void vfio_vmstate_change(void *opaque, int running, RunState state)
         error_report("%s: Failed to set device state 0x%x", vbasedev->name,
                      (migration->device_state & mask) | value);
         qemu_file_set_error(migrate_get_current()->to_dst_file, ret);
+    } else if (state == RUN_STATE_FINISH_MIGRATE &&
+               (migration->device_state & VFIO_DEVICE_STATE_SAVING)) {
+        vfio_save_thread_start(vbasedev);
     }
     vbasedev->migration->vm_running = running;
     trace_vfio_vmstate_change(vbasedev->name, running, RunState_str(state),
@@ -789,6 +1013,8 @@ static void vfio_migration_state_notifier(Notifier *notifier, void *data)
     case MIGRATION_STATUS_CANCELLED:
     case MIGRATION_STATUS_FAILED:
         bytes_transferred = 0;
+        dirty_sync_time = 0;
+        vfio_save_thread_join(vbasedev);
         ret = vfio_migration_set_state(vbasedev,
                       ~(VFIO_DEVICE_STATE_SAVING | VFIO_DEVICE_STATE_RESUMING),
                       VFIO_DEVICE_STATE_RUNNING);
@@ -802,6 +1028,8 @@ static void vfio_migration_exit(VFIODevice *vbasedev)
 {
     VFIOMigration *migration = vbasedev->migration;
 
+    qemu_cond_destroy(&migration->save_cond);
+    qemu_mutex_destroy(&migration->save_lock);
     vfio_region_exit(&migration->region);
     vfio_region_finalize(&migration->region);
     g_free(vbasedev->migration);
@@ -827,6 +1055,9 @@ static int vfio_migration_init(VFIODevice *vbasedev,
     }
 
     vbasedev->migration = g_new0(VFIOMigration, 1);
+    qemu_mutex_init(&vbasedev->migration->save_lock);
+    qemu_cond_init(&vbasedev->migration->save_cond);
+    QSIMPLEQ_INIT(&vbasedev->migration->save_queue);
 
     ret = vfio_region_setup(obj, vbasedev, &vbasedev->migration->region,
                             info->index, "migration");
@@ -875,6 +1106,16 @@ int64_t vfio_mig_bytes_transferred(void)
     return bytes_transferred;
 }
 
+void vfio_mig_add_dirty_sync_time(int64_t ns)
+{
+    dirty_sync_time += ns;
+}
+
+int64_t vfio_mig_dirty_sync_time(void)
+{
+    return dirty_sync_time;
+}
+
 int vfio_migration_probe(VFIODevice *vbasedev, Error **errp)
 {
     VFIOContainer *container = vbasedev->group->container;
@@ -1134,6 +1134,12 @@ void vfio_pci_write_config(PCIDevice *pdev,
 
     trace_vfio_pci_write_config(vdev->vbasedev.name, addr, val, len);
 
+    /* Guest RAM may still be being mapped, hold off bus mastering */
+    if (range_covers_byte(addr, len, PCI_COMMAND) &&
+        (val >> ((PCI_COMMAND - addr) * 8)) & PCI_COMMAND_MASTER) {
+        vfio_container_dma_map_wait(vdev->vbasedev.group->container);
+    }
+
     /* Write everything to VFIO, let it filter out what we can't write */
     if (pwrite(vdev->vbasedev.fd, &val_le, len, vdev->config_offset + addr)
                 != len) {
@@ -2817,7 +2823,8 @@ static void vfio_realize(PCIDevice *pdev, Error **errp)
 
     trace_vfio_realize(vdev->vbasedev.name, groupid);
 
-    group = vfio_get_group(groupid, pci_device_iommu_address_space(pdev), errp);
+    group = vfio_get_group(groupid, pci_device_iommu_address_space(pdev),
+                           vdev->async_dma_map, errp);
     if (!group) {
         goto error;
     }
@@ -3212,6 +3219,7 @@ static Property vfio_pci_dev_properties[] = {
                      false),
     DEFINE_PROP_BOOL("x-no-vfio-ioeventfd", VFIOPCIDevice, no_vfio_ioeventfd,
                      false),
+    DEFINE_PROP_BOOL("x-async-dma-map", VFIOPCIDevice, async_dma_map, false),
     DEFINE_PROP_UINT32("x-pci-vendor-id", VFIOPCIDevice, vendor_id, PCI_ANY_ID),
     DEFINE_PROP_UINT32("x-pci-device-id", VFIOPCIDevice, device_id, PCI_ANY_ID),
     DEFINE_PROP_UINT32("x-pci-sub-vendor-id", VFIOPCIDevice,
@@ -169,6 +169,7 @@ struct VFIOPCIDevice {
     bool no_kvm_msix;
     bool no_geforce_quirks;
     bool no_kvm_ioeventfd;
+    bool async_dma_map;
     bool no_vfio_ioeventfd;
     bool enable_ramfb;
     VFIODisplay *dpy;
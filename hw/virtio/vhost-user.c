@@ -16,6 +16,7 @@
 #include "hw/virtio/virtio.h"
 #include "hw/virtio/virtio-net.h"
 #include "chardev/char-fe.h"
+#include "exec/address-spaces.h"
 #include "sysemu/kvm.h"
 #include "qemu/error-report.h"
 #include "qemu/main-loop.h"
@@ -256,6 +257,9 @@ struct vhost_user {
     /* Our current regions */
     int num_shadow_regions;
     struct vhost_memory_region shadow_regions[VHOST_USER_MAX_RAM_SLOTS];
+
+    /* Collects memory table acknowledgements when a transaction ends */
+    MemoryListener mem_listener;
 };
 
 struct scrub_regions {
@@ -294,7 +298,7 @@ static int vhost_user_read_header(struct vhost_dev *dev, VhostUserMsg *msg)
     return 0;
 }
 
-static int vhost_user_read(struct vhost_dev *dev, VhostUserMsg *msg)
+static int vhost_user_read_msg(struct vhost_dev *dev, VhostUserMsg *msg)
 {
     struct vhost_user *u = dev->opaque;
     CharBackend *chr = u->user->chr;
@@ -327,6 +331,54 @@ static int vhost_user_read(struct vhost_dev *dev, VhostUserMsg *msg)
     return 0;
 }
 
+/*
+ * Read the acknowledgements of all memory table updates that were sent
+ * without waiting for them.  Replies arrive in the order the requests
+ * were written, so they have to be consumed before anything else can
+ * be read from the channel.
+ */
+static int vhost_user_collect_replies(struct vhost_dev *dev)
+{
+    struct vhost_user *u = dev->opaque;
+    GQueue *pending = &u->user->pending_replies;
+    VhostUserMsg msg_reply;
+    int ret = 0;
+
+    while (!g_queue_is_empty(pending)) {
+        VhostUserRequest request = GPOINTER_TO_UINT(g_queue_pop_head(pending));
+
+        if (vhost_user_read_msg(dev, &msg_reply) < 0) {
+            g_queue_clear(pending);
+            return -1;
+        }
+
+        if (msg_reply.hdr.request != request) {
+            error_report("Received unexpected msg type."
+                         "Expected %d received %d",
+                         request, msg_reply.hdr.request);
+            g_queue_clear(pending);
+            return -1;
+        }
+
+        if (msg_reply.payload.u64) {
+            error_report("vhost-user backend failed memory table update %d",
+                         request);
+            ret = -1;
+        }
+    }
+
+    return ret;
+}
+
+static int vhost_user_read(struct vhost_dev *dev, VhostUserMsg *msg)
+{
+    if (vhost_user_collect_replies(dev) < 0) {
+        return -1;
+    }
+
+    return vhost_user_read_msg(dev, msg);
+}
+
 static int process_message_reply(struct vhost_dev *dev,
                                  const VhostUserMsg *msg)
 {
@@ -350,6 +402,31 @@ static int process_message_reply(struct vhost_dev *dev,
     return msg_reply.payload.u64 ? -1 : 0;
 }
 
+/*
+ * Like process_message_reply(), but inside a memory transaction only
+ * note that a reply is due.  The replies are collected when the
+ * transaction is committed, after every vhost device has sent its
+ * updates, so that all backends remap their memory concurrently instead
+ * of one after the other.
+ */
+static int vhost_user_mem_reply(struct vhost_dev *dev,
+                                const VhostUserMsg *msg)
+{
+    struct vhost_user *u = dev->opaque;
+
+    if ((msg->hdr.flags & VHOST_USER_NEED_REPLY_MASK) == 0) {
+        return 0;
+    }
+
+    if (u->user->defer_replies) {
+        g_queue_push_tail(&u->user->pending_replies,
+                          GUINT_TO_POINTER(msg->hdr.request));
+        return 0;
+    }
+
+    return process_message_reply(dev, msg);
+}
+
 static bool vhost_user_one_time_request(VhostUserRequest request)
 {
     switch (request) {
@@ -658,7 +735,7 @@ static int send_remove_regions(struct vhost_dev *dev,
             }
 
             if (reply_supported) {
-                ret = process_message_reply(dev, msg);
+                ret = vhost_user_mem_reply(dev, msg);
                 if (ret) {
                     return ret;
                 }
@@ -666,8 +743,9 @@ static int send_remove_regions(struct vhost_dev *dev,
         }
 
         /*
-         * At this point we know the backend has unmapped the region. It is now
-         * safe to remove it from the shadow table.
+         * At this point we know the backend has unmapped the region, or
+         * will have done so before the memory transaction completes. It is
+         * now safe to remove it from the shadow table.
          */
         memmove(&u->shadow_regions[shadow_reg_idx],
                 &u->shadow_regions[shadow_reg_idx + 1],
@@ -761,7 +839,7 @@ static int send_add_regions(struct vhost_dev *dev,
                     return -1;
                 }
             } else if (reply_supported) {
-                ret = process_message_reply(dev, msg);
+                ret = vhost_user_mem_reply(dev, msg);
                 if (ret) {
                     return ret;
                 }
@@ -1000,7 +1078,7 @@ static int vhost_user_set_mem_table(struct vhost_dev *dev,
         }
 
         if (reply_supported) {
-            return process_message_reply(dev, &msg);
+            return vhost_user_mem_reply(dev, &msg);
         }
     }
 
@@ -1794,6 +1872,32 @@ static int vhost_user_postcopy_notifier(NotifierWithReturn *notifier,
     return 0;
 }
 
+static void vhost_user_mem_begin(MemoryListener *listener)
+{
+    struct vhost_user *u = container_of(listener, struct vhost_user,
+                                        mem_listener);
+
+    u->user->defer_replies = true;
+}
+
+static void vhost_user_mem_commit(MemoryListener *listener)
+{
+    struct vhost_user *u = container_of(listener, struct vhost_user,
+                                        mem_listener);
+
+    u->user->defer_replies = false;
+    if (vhost_user_collect_replies(u->dev) < 0) {
+        error_report("vhost-user: memory table update failed");
+    }
+}
+
+static const MemoryListener vhost_user_mem_listener = {
+    .begin = vhost_user_mem_begin,
+    .commit = vhost_user_mem_commit,
+    /* Commit after the vhost listeners (priority 10) sent their updates */
+    .priority = 11,
+};
+
 static int vhost_user_backend_init(struct vhost_dev *dev, void *opaque)
 {
     uint64_t features, protocol_features, ram_slots;
@@ -1899,6 +2003,9 @@ static int vhost_user_backend_init(struct vhost_dev *dev, void *opaque)
     u->postcopy_notifier.notify = vhost_user_postcopy_notifier;
     postcopy_add_notifier(&u->postcopy_notifier);
 
+    u->mem_listener = vhost_user_mem_listener;
+    memory_listener_register(&u->mem_listener, &address_space_memory);
+
     return 0;
 }
 
@@ -1909,6 +2016,10 @@ static int vhost_user_backend_cleanup(struct vhost_dev *dev)
     assert(dev->vhost_ops->backend_type == VHOST_BACKEND_TYPE_USER);
 
     u = dev->opaque;
+    if (u->mem_listener.commit) {
+        memory_listener_unregister(&u->mem_listener);
+        u->mem_listener.commit = NULL;
+    }
     if (u->postcopy_notifier.notify) {
         postcopy_remove_notifier(&u->postcopy_notifier);
         u->postcopy_notifier.notify = NULL;
@@ -2332,6 +2443,8 @@ bool vhost_user_init(VhostUserState *user, CharBackend *chr, Error **errp)
     }
     user->chr = chr;
     user->memory_slots = 0;
+    g_queue_init(&user->pending_replies);
+    user->defer_replies = false;
     return true;
 }
 
@@ -2350,6 +2463,7 @@ void vhost_user_cleanup(VhostUserState *user)
             user->notifier[i].addr = NULL;
         }
     }
+    g_queue_clear(&user->pending_replies);
     user->chr = NULL;
 }
 
@@ -86,19 +86,13 @@ static int vhost_vdpa_dma_unmap(struct vhost_vdpa *v, hwaddr iova,
     return ret;
 }
 
-static void vhost_vdpa_listener_begin(MemoryListener *listener)
+static void vhost_vdpa_iotlb_batch(struct vhost_vdpa *v, uint8_t type)
 {
-    struct vhost_vdpa *v = container_of(listener, struct vhost_vdpa, listener);
-    struct vhost_dev *dev = v->dev;
     struct vhost_msg_v2 msg = {};
     int fd = v->device_fd;
 
-    if (!(dev->backend_cap & (0x1ULL << VHOST_BACKEND_F_IOTLB_BATCH))) {
-        return;
-    }
-
     msg.type = v->msg_type;
-    msg.iotlb.type = VHOST_IOTLB_BATCH_BEGIN;
+    msg.iotlb.type = type;
 
     if (write(fd, &msg, sizeof(msg)) != sizeof(msg)) {
         error_report("failed to write, fd=%d, errno=%d (%s)",
@@ -106,23 +100,219 @@ static void vhost_vdpa_listener_begin(MemoryListener *listener)
     }
 }
 
+/*
+ * Open a batch before the first IOTLB update of a transaction, so that
+ * transactions that do not touch guest RAM cost no messages at all.
+ */
+static void vhost_vdpa_iotlb_batch_begin_once(struct vhost_vdpa *v)
+{
+    if (!(v->dev->backend_cap & (0x1ULL << VHOST_BACKEND_F_IOTLB_BATCH)) ||
+        v->iotlb_batch_begin_sent) {
+        return;
+    }
+
+    vhost_vdpa_iotlb_batch(v, VHOST_IOTLB_BATCH_BEGIN);
+    v->iotlb_batch_begin_sent = true;
+}
+
+static void vhost_vdpa_iotlb_batch_end(struct vhost_vdpa *v)
+{
+    if (!v->iotlb_batch_begin_sent) {
+        return;
+    }
+
+    vhost_vdpa_iotlb_batch(v, VHOST_IOTLB_BATCH_END);
+    v->iotlb_batch_begin_sent = false;
+}
+
+static void vhost_vdpa_map_op(struct vhost_vdpa *v, VhostVDPAMap *op)
+{
+    vhost_vdpa_iotlb_batch_begin_once(v);
+    if (op->unmap) {
+        if (vhost_vdpa_dma_unmap(v, op->iova, op->size)) {
+            error_report("vhost_vdpa dma unmap error!");
+        }
+    } else if (vhost_vdpa_dma_map(v, op->iova, op->size, op->vaddr,
+                                  op->readonly)) {
+        error_report("vhost-vdpa: DMA mapping failed, unable to continue");
+    }
+}
+
+static void *vhost_vdpa_map_thread(void *opaque)
+{
+    struct vhost_vdpa *v = opaque;
+    VhostVDPAMap op;
+
+    for (;;) {
+        qemu_mutex_lock(&v->map_thread_lock);
+        if (v->map_thread_next == v->map_thread_maps->len) {
+            v->map_thread_done = true;
+            qemu_mutex_unlock(&v->map_thread_lock);
+            break;
+        }
+        op = g_array_index(v->map_thread_maps, VhostVDPAMap,
+                           v->map_thread_next++);
+        qemu_mutex_unlock(&v->map_thread_lock);
+
+        vhost_vdpa_map_op(v, &op);
+    }
+    vhost_vdpa_iotlb_batch_end(v);
+    trace_vhost_vdpa_map_async_done(v);
+    return NULL;
+}
+
+/* Wait for the background mapping of guest RAM, if any, to complete */
+static void vhost_vdpa_map_wait(struct vhost_vdpa *v)
+{
+    if (!v->map_thread_running) {
+        return;
+    }
+
+    qemu_thread_join(&v->map_thread);
+    v->map_thread_running = false;
+    g_array_free(v->map_thread_maps, true);
+    v->map_thread_maps = NULL;
+}
+
+/*
+ * Send @op to the device.  While the background mapping runs, it is
+ * appended to that thread's work instead: this keeps the IOTLB messages
+ * ordered without waiting for all of guest RAM under the BQL.
+ */
+static void vhost_vdpa_map_send(struct vhost_vdpa *v, VhostVDPAMap *op)
+{
+    bool queued = false;
+
+    if (v->map_thread_running) {
+        qemu_mutex_lock(&v->map_thread_lock);
+        if (!v->map_thread_done) {
+            g_array_append_val(v->map_thread_maps, *op);
+            queued = true;
+        }
+        qemu_mutex_unlock(&v->map_thread_lock);
+        if (queued) {
+            return;
+        }
+        /* The thread is exiting, this does not wait for long */
+        vhost_vdpa_map_wait(v);
+    }
+    vhost_vdpa_map_op(v, op);
+}
+
+/*
+ * Queue a mapping, merging it with the previous one if both are
+ * contiguous in IOVA and host virtual address space.  Guest RAM is
+ * usually split into many sections that are adjacent in both, and the
+ * device only needs to see one update for all of them.
+ */
+static void vhost_vdpa_map_queue(struct vhost_vdpa *v, hwaddr iova,
+                                 hwaddr size, void *vaddr, bool readonly)
+{
+    GArray *maps = v->pending_maps;
+    VhostVDPAMap map = {
+        .iova = iova,
+        .size = size,
+        .vaddr = vaddr,
+        .readonly = readonly,
+    };
+
+    if (maps->len) {
+        VhostVDPAMap *last = &g_array_index(maps, VhostVDPAMap, maps->len - 1);
+
+        if (last->iova + last->size == iova &&
+            last->vaddr + last->size == vaddr &&
+            last->readonly == readonly) {
+            last->size += size;
+            return;
+        }
+    }
+    g_array_append_val(maps, map);
+}
+
+static void vhost_vdpa_map_flush(struct vhost_vdpa *v)
+{
+    int i;
+
+    if (!v->pending_maps->len) {
+        return;
+    }
+
+    g_array_append_vals(v->mapped, v->pending_maps->data,
+                        v->pending_maps->len);
+    for (i = 0; i < v->pending_maps->len; i++) {
+        vhost_vdpa_map_send(v, &g_array_index(v->pending_maps,
+                                              VhostVDPAMap, i));
+    }
+    g_array_set_size(v->pending_maps, 0);
+}
+
+/*
+ * Unmap [@iova, @iova + @size) from guest RAM.  A merged range that
+ * overlaps is split: only the removed part is invalidated, and what is
+ * left of it on either side stays mapped.
+ */
+static void vhost_vdpa_map_remove(struct vhost_vdpa *v, hwaddr iova,
+                                  hwaddr size)
+{
+    hwaddr end = iova + size;
+    int i;
+
+    for (i = v->mapped->len - 1; i >= 0; i--) {
+        VhostVDPAMap m = g_array_index(v->mapped, VhostVDPAMap, i);
+        hwaddr m_end = m.iova + m.size;
+        VhostVDPAMap op = { .unmap = true };
+
+        if (m_end <= iova || m.iova >= end) {
+            continue;
+        }
+
+        /* The pieces are appended behind i, so the loop skips them */
+        g_array_remove_index_fast(v->mapped, i);
+        if (m.iova < iova) {
+            VhostVDPAMap left = m;
+
+            left.size = iova - m.iova;
+            g_array_append_val(v->mapped, left);
+        }
+        if (m_end > end) {
+            VhostVDPAMap right = m;
+
+            right.iova = end;
+            right.size = m_end - end;
+            right.vaddr = m.vaddr + (end - m.iova);
+            g_array_append_val(v->mapped, right);
+        }
+
+        op.iova = MAX(m.iova, iova);
+        op.size = MIN(m_end, end) - op.iova;
+        vhost_vdpa_map_send(v, &op);
+    }
+}
+
 static void vhost_vdpa_listener_commit(MemoryListener *listener)
 {
     struct vhost_vdpa *v = container_of(listener, struct vhost_vdpa, listener);
-    struct vhost_dev *dev = v->dev;
-    struct vhost_msg_v2 msg = {};
-    int fd = v->device_fd;
 
-    if (!(dev->backend_cap & (0x1ULL << VHOST_BACKEND_F_IOTLB_BATCH))) {
+    if (v->async_map && v->pending_maps->len) {
+        vhost_vdpa_map_wait(v);
+        vhost_vdpa_iotlb_batch_end(v);
+        g_array_append_vals(v->mapped, v->pending_maps->data,
+                            v->pending_maps->len);
+        v->map_thread_maps = v->pending_maps;
+        v->map_thread_next = 0;
+        v->map_thread_done = false;
+        v->pending_maps = g_array_new(false, false, sizeof(VhostVDPAMap));
+        trace_vhost_vdpa_map_async(v, v->map_thread_maps->len);
+        qemu_thread_create(&v->map_thread, "vhost-vdpa-map",
+                           vhost_vdpa_map_thread, v, QEMU_THREAD_JOINABLE);
+        v->map_thread_running = true;
         return;
     }
 
-    msg.type = v->msg_type;
-    msg.iotlb.type = VHOST_IOTLB_BATCH_END;
-
-    if (write(fd, &msg, sizeof(msg)) != sizeof(msg)) {
-        error_report("failed to write, fd=%d, errno=%d (%s)",
-                     fd, errno, strerror(errno));
+    vhost_vdpa_map_flush(v);
+    /* Nothing is sent from here while the mapping thread runs */
+    if (!v->map_thread_running) {
+        vhost_vdpa_iotlb_batch_end(v);
     }
 }
 
@@ -167,6 +357,15 @@ static void vhost_vdpa_listener_region_add(MemoryListener *listener,
 
     llsize = int128_sub(llend, int128_make64(iova));
 
+    if (!memory_region_is_ram_device(section->mr)) {
+        vhost_vdpa_map_queue(v, iova, int128_get64(llsize),
+                             vaddr, section->readonly);
+        return;
+    }
+
+    vhost_vdpa_map_flush(v);
+    vhost_vdpa_map_wait(v);
+    vhost_vdpa_iotlb_batch_begin_once(v);
     ret = vhost_vdpa_dma_map(v, iova, int128_get64(llsize),
                              vaddr, section->readonly);
     if (ret) {
@@ -203,7 +402,6 @@ static void vhost_vdpa_listener_region_del(MemoryListener *listener,
     struct vhost_vdpa *v = container_of(listener, struct vhost_vdpa, listener);
     hwaddr iova;
     Int128 llend, llsize;
-    int ret;
 
     if (vhost_vdpa_listener_skipped_section(section)) {
         return;
@@ -228,20 +426,55 @@ static void vhost_vdpa_listener_region_del(MemoryListener *listener,
 
     llsize = int128_sub(llend, int128_make64(iova));
 
-    ret = vhost_vdpa_dma_unmap(v, iova, int128_get64(llsize));
-    if (ret) {
-        error_report("vhost_vdpa dma unmap error!");
+    vhost_vdpa_map_flush(v);
+    if (!memory_region_is_ram_device(section->mr)) {
+        vhost_vdpa_map_remove(v, iova, int128_get64(llsize));
+    } else {
+        VhostVDPAMap op = {
+            .iova = iova,
+            .size = int128_get64(llsize),
+            .unmap = true,
+        };
+
+        vhost_vdpa_map_send(v, &op);
     }
 
     memory_region_unref(section->mr);
 }
+
+/*
+ * Drop all guest RAM mappings in one go before unregistering, so that
+ * region_del does not split and remap the merged ranges piece by piece.
+ */
+static void vhost_vdpa_listener_unregister(struct vhost_vdpa *v)
+{
+    int i;
+
+    if (!v->listener.address_space) {
+        return;
+    }
+
+    vhost_vdpa_map_wait(v);
+    vhost_vdpa_map_flush(v);
+    for (i = 0; i < v->mapped->len; i++) {
+        VhostVDPAMap *m = &g_array_index(v->mapped, VhostVDPAMap, i);
+
+        vhost_vdpa_iotlb_batch_begin_once(v);
+        if (vhost_vdpa_dma_unmap(v, m->iova, m->size)) {
+            error_report("vhost_vdpa dma unmap error!");
+        }
+    }
+    g_array_set_size(v->mapped, 0);
+    vhost_vdpa_iotlb_batch_end(v);
+
+    memory_listener_unregister(&v->listener);
+}
 /*
  * IOTLB API is used by vhost-vpda which requires incremental updating
  * of the mapping. So we can not use generic vhost memory listener which
  * depends on the addnop().
  */
 static const MemoryListener vhost_vdpa_memory_listener = {
-    .begin = vhost_vdpa_listener_begin,
     .commit = vhost_vdpa_listener_commit,
     .region_add = vhost_vdpa_listener_region_add,
     .region_del = vhost_vdpa_listener_region_del,
@@ -286,6 +519,9 @@ static int vhost_vdpa_init(struct vhost_dev *dev, void *opaque)
     dev->backend_features = features;
     v->listener = vhost_vdpa_memory_listener;
     v->msg_type = VHOST_IOTLB_MSG_V2;
+    v->pending_maps = g_array_new(false, false, sizeof(VhostVDPAMap));
+    v->mapped = g_array_new(false, false, sizeof(VhostVDPAMap));
+    qemu_mutex_init(&v->map_thread_lock);
 
     vhost_vdpa_add_status(dev, VIRTIO_CONFIG_S_ACKNOWLEDGE |
                                VIRTIO_CONFIG_S_DRIVER);
@@ -299,7 +535,12 @@ static int vhost_vdpa_cleanup(struct vhost_dev *dev)
     assert(dev->vhost_ops->backend_type == VHOST_BACKEND_TYPE_VDPA);
     v = dev->opaque;
     trace_vhost_vdpa_cleanup(dev, v);
-    memory_listener_unregister(&v->listener);
+    vhost_vdpa_listener_unregister(v);
+    g_array_free(v->pending_maps, true);
+    v->pending_maps = NULL;
+    g_array_free(v->mapped, true);
+    v->mapped = NULL;
+    qemu_mutex_destroy(&v->map_thread_lock);
 
     dev->opaque = NULL;
     return 0;
@@ -356,6 +597,9 @@ static int vhost_vdpa_set_backend_cap(struct vhost_dev *dev)
         0x1ULL << VHOST_BACKEND_F_IOTLB_BATCH;
     int r;
 
+    /* backend_cap is read by the mapping thread */
+    vhost_vdpa_map_wait(dev->opaque);
+
     if (vhost_vdpa_call(dev, VHOST_GET_BACKEND_FEATURES, &features)) {
         return 0;
     }
@@ -371,6 +615,25 @@ static int vhost_vdpa_set_backend_cap(struct vhost_dev *dev)
     return 0;
 }
 
+/*
+ * Start mapping all of guest RAM into the device from a background
+ * thread, instead of when the guest driver first starts the device.
+ * Contiguous RAM is sent as a few large IOTLB updates; pinning it is what
+ * takes long for big guests, and that now overlaps with guest boot.  The
+ * mappings stay in place until the device is stopped.
+ */
+void vhost_vdpa_map_ram_async(struct vhost_vdpa *v)
+{
+    if (v->listener.address_space) {
+        return;
+    }
+
+    vhost_vdpa_set_backend_cap(v->dev);
+    v->async_map = true;
+    memory_listener_register(&v->listener, &address_space_memory);
+    v->async_map = false;
+}
+
 int vhost_vdpa_get_device_id(struct vhost_dev *dev,
                                    uint32_t *device_id)
 {
@@ -474,17 +737,23 @@ static int vhost_vdpa_dev_start(struct vhost_dev *dev, bool started)
     trace_vhost_vdpa_dev_start(dev, started);
     if (started) {
         uint8_t status = 0;
-        memory_listener_register(&v->listener, &address_space_memory);
+        /* Guest RAM may already be mapped by vhost_vdpa_map_ram_async() */
+        if (!v->listener.address_space) {
+            memory_listener_register(&v->listener, &address_space_memory);
+        }
+        /* The device must not run before all of guest RAM is mapped */
+        vhost_vdpa_map_wait(v);
         vhost_vdpa_set_vring_ready(dev);
         vhost_vdpa_add_status(dev, VIRTIO_CONFIG_S_DRIVER_OK);
         vhost_vdpa_call(dev, VHOST_VDPA_GET_STATUS, &status);
 
         return !(status & VIRTIO_CONFIG_S_DRIVER_OK);
     } else {
+        vhost_vdpa_map_wait(v);
         vhost_vdpa_reset_device(dev);
         vhost_vdpa_add_status(dev, VIRTIO_CONFIG_S_ACKNOWLEDGE |
                                    VIRTIO_CONFIG_S_DRIVER);
-        memory_listener_unregister(&v->listener);
+        vhost_vdpa_listener_unregister(v);
 
         return 0;
     }
@@ -17,6 +17,7 @@
 #include "qapi/error.h"
 #include "hw/virtio/vhost.h"
 #include "qemu/atomic.h"
+#include "qemu/cutils.h"
 #include "qemu/range.h"
 #include "qemu/error-report.h"
 #include "qemu/memfd.h"
@@ -61,61 +62,136 @@ bool vhost_has_free_slot(void)
     return slots_limit > used_memslots;
 }
 
+/*
+ * Number of log chunks tested at once with buffer_is_zero(), which uses
+ * vector instructions where the host has them.  512 bytes of log cover
+ * 16 MiB of guest memory, most of which is clean during migration.
+ */
+#define VHOST_LOG_SCAN_CHUNKS 64
+
+static void vhost_log_sync_chunk(MemoryRegionSection *section,
+                                 uint64_t addr, vhost_log_chunk_t log)
+{
+    while (log) {
+        int bit = ctzl(log);
+        int nr = ctol(log >> bit);
+        hwaddr page_addr;
+        hwaddr section_offset;
+        hwaddr mr_offset;
+        page_addr = addr + bit * VHOST_LOG_PAGE;
+        section_offset = page_addr - section->offset_within_address_space;
+        mr_offset = section_offset + section->offset_within_region;
+        /* Mark each run of consecutive dirty pages in one go */
+        memory_region_set_dirty(section->mr, mr_offset, nr * VHOST_LOG_PAGE);
+        if (bit + nr >= VHOST_LOG_BITS) {
+            break;
+        }
+        log &= ~0UL << (bit + nr);
+    }
+}
+
 static void vhost_dev_sync_region(struct vhost_dev *dev,
                                   MemoryRegionSection *section,
-                                  uint64_t mfirst, uint64_t mlast,
-                                  uint64_t rfirst, uint64_t rlast)
+                                  uint64_t start, uint64_t end)
 {
     vhost_log_chunk_t *log = dev->log->log;
 
-    uint64_t start = MAX(mfirst, rfirst);
-    uint64_t end = MIN(mlast, rlast);
     vhost_log_chunk_t *from = log + start / VHOST_LOG_CHUNK;
     vhost_log_chunk_t *to = log + end / VHOST_LOG_CHUNK + 1;
     uint64_t addr = QEMU_ALIGN_DOWN(start, VHOST_LOG_CHUNK);
 
-    if (end < start) {
-        return;
-    }
     assert(end / VHOST_LOG_CHUNK < dev->log_size);
     assert(start / VHOST_LOG_CHUNK < dev->log_size);
 
-    for (;from < to; ++from) {
-        vhost_log_chunk_t log;
+    while (from < to) {
+        size_t n = MIN(to - from, VHOST_LOG_SCAN_CHUNKS);
+
         /* We first check with non-atomic: much cheaper,
          * and we expect non-dirty to be the common case. */
-        if (!*from) {
-            addr += VHOST_LOG_CHUNK;
+        if (buffer_is_zero(from, n * sizeof(*from))) {
+            from += n;
+            addr += n * VHOST_LOG_CHUNK;
             continue;
         }
-        /* Data must be read atomically. We don't really need barrier semantics
-         * but it's easier to use atomic_* than roll our own. */
-        log = qatomic_xchg(from, 0);
-        while (log) {
-            int bit = ctzl(log);
-            hwaddr page_addr;
-            hwaddr section_offset;
-            hwaddr mr_offset;
-            page_addr = addr + bit * VHOST_LOG_PAGE;
-            section_offset = page_addr - section->offset_within_address_space;
-            mr_offset = section_offset + section->offset_within_region;
-            memory_region_set_dirty(section->mr, mr_offset, VHOST_LOG_PAGE);
-            log &= ~(0x1ull << bit);
+
+        for (; n; n--, from++, addr += VHOST_LOG_CHUNK) {
+            vhost_log_chunk_t log;
+
+            if (!*from) {
+                continue;
+            }
+            /* Data must be read atomically. We don't really need barrier
+             * semantics but it's easier to use atomic_* than roll our own. */
+            log = qatomic_xchg(from, 0);
+            vhost_log_sync_chunk(section, addr, log);
+        }
+    }
+}
+
+static GList *vhost_log_range_add(GList *ranges,
+                                  uint64_t mfirst, uint64_t mlast,
+                                  uint64_t rfirst, uint64_t rlast)
+{
+    uint64_t start = MAX(mfirst, rfirst);
+    uint64_t end = MIN(mlast, rlast);
+    Range *range;
+
+    if (end < start) {
+        return ranges;
+    }
+    range = g_new(Range, 1);
+    range_set_bounds(range, start, end);
+    return range_list_insert(ranges, range);
+}
+
+/*
+ * Collect the parts of [@first, @last] that @dev's backend may log to:
+ * its memory regions and used rings.  Overlapping ranges, such as a used
+ * ring inside guest RAM, are merged so that each is scanned only once.
+ */
+static GList *vhost_dev_log_ranges(struct vhost_dev *dev, GList *ranges,
+                                   hwaddr first, hwaddr last)
+{
+    int i;
+
+    for (i = 0; i < dev->mem->nregions; ++i) {
+        struct vhost_memory_region *reg = dev->mem->regions + i;
+        ranges = vhost_log_range_add(ranges, first, last,
+                                     reg->guest_phys_addr,
+                                     range_get_last(reg->guest_phys_addr,
+                                                    reg->memory_size));
+    }
+    for (i = 0; i < dev->nvqs; ++i) {
+        struct vhost_virtqueue *vq = dev->vqs + i;
+
+        if (!vq->used_phys && !vq->used_size) {
+            continue;
         }
-        addr += VHOST_LOG_CHUNK;
+
+        ranges = vhost_log_range_add(ranges, first, last, vq->used_phys,
+                                     range_get_last(vq->used_phys,
+                                                    vq->used_size));
     }
+    return ranges;
+}
+
+static bool vhost_dev_logging(struct vhost_dev *dev)
+{
+    return dev->log_enabled && dev->started;
 }
 
 static int vhost_sync_dirty_bitmap(struct vhost_dev *dev,
                                    MemoryRegionSection *section,
                                    hwaddr first,
-                                   hwaddr last)
+                                   hwaddr last,
+                                   bool shared)
 {
-    int i;
+    struct vhost_dev *hdev;
     hwaddr start_addr;
     hwaddr end_addr;
+    GList *ranges = NULL, *l;
 
-    if (!dev->log_enabled || !dev->started) {
+    if (!vhost_dev_logging(dev)) {
         return 0;
     }
     start_addr = section->offset_within_address_space;
@@ -123,23 +199,23 @@ static int vhost_sync_dirty_bitmap(struct vhost_dev *dev,
     start_addr = MAX(first, start_addr);
     end_addr = MIN(last, end_addr);
 
-    for (i = 0; i < dev->mem->nregions; ++i) {
-        struct vhost_memory_region *reg = dev->mem->regions + i;
-        vhost_dev_sync_region(dev, section, start_addr, end_addr,
-                              reg->guest_phys_addr,
-                              range_get_last(reg->guest_phys_addr,
-                                             reg->memory_size));
-    }
-    for (i = 0; i < dev->nvqs; ++i) {
-        struct vhost_virtqueue *vq = dev->vqs + i;
-
-        if (!vq->used_phys && !vq->used_size) {
-            continue;
+    if (shared) {
+        QLIST_FOREACH(hdev, &vhost_devices, entry) {
+            if (hdev->log == dev->log && vhost_dev_logging(hdev)) {
+                ranges = vhost_dev_log_ranges(hdev, ranges,
+                                              start_addr, end_addr);
+            }
         }
+    } else {
+        ranges = vhost_dev_log_ranges(dev, ranges, start_addr, end_addr);
+    }
 
-        vhost_dev_sync_region(dev, section, start_addr, end_addr, vq->used_phys,
-                              range_get_last(vq->used_phys, vq->used_size));
+    for (l = ranges; l; l = l->next) {
+        Range *range = l->data;
+        vhost_dev_sync_region(dev, section, range_lob(range),
+                              range_upb(range));
     }
+    g_list_free_full(ranges, g_free);
     return 0;
 }
 
@@ -148,7 +224,21 @@ static void vhost_log_sync(MemoryListener *listener,
 {
     struct vhost_dev *dev = container_of(listener, struct vhost_dev,
                                          memory_listener);
-    vhost_sync_dirty_bitmap(dev, section, 0x0, ~0x0ULL);
+    struct vhost_dev *hdev;
+
+    /*
+     * All devices that share a log are synced by the first of them, over
+     * the union of their ranges; the log is then clean for the others.
+     */
+    QLIST_FOREACH(hdev, &vhost_devices, entry) {
+        if (hdev->log == dev->log && vhost_dev_logging(hdev)) {
+            break;
+        }
+    }
+    if (hdev != dev) {
+        return;
+    }
+    vhost_sync_dirty_bitmap(dev, section, 0x0, ~0x0ULL, true);
 }
 
 static void vhost_log_sync_range(struct vhost_dev *dev,
@@ -158,7 +248,7 @@ static void vhost_log_sync_range(struct vhost_dev *dev,
     /* FIXME: this is N^2 in number of sections */
     for (i = 0; i < dev->n_mem_sections; ++i) {
         MemoryRegionSection *section = &dev->mem_sections[i];
-        vhost_sync_dirty_bitmap(dev, section, first, last);
+        vhost_sync_dirty_bitmap(dev, section, first, last, false);
     }
 }
 
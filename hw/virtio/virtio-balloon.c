@@ -267,6 +267,30 @@ out:
     error_propagate(errp, err);
 }
 
+static void balloon_report_stats_get_all(Object *obj, Visitor *v,
+                                         const char *name, void *opaque,
+                                         Error **errp)
+{
+    VirtIOBalloon *s = opaque;
+    uint64_t reports, bytes, ns;
+
+    qemu_mutex_lock(&s->report_lock);
+    reports = s->report_count;
+    bytes = s->report_bytes;
+    ns = s->report_discard_ns;
+    qemu_mutex_unlock(&s->report_lock);
+
+    if (!visit_start_struct(v, name, NULL, 0, errp)) {
+        return;
+    }
+    if (visit_type_uint64(v, "reports", &reports, errp) &&
+        visit_type_uint64(v, "discarded-bytes", &bytes, errp) &&
+        visit_type_uint64(v, "discard-time-ns", &ns, errp)) {
+        visit_check_struct(v, errp);
+    }
+    visit_end_struct(v, NULL);
+}
+
 static void balloon_stats_get_poll_interval(Object *obj, Visitor *v,
                                             const char *name, void *opaque,
                                             Error **errp)
@@ -320,30 +344,49 @@ static void balloon_stats_set_poll_interval(Object *obj, Visitor *v,
     balloon_stats_change_timer(s, 0);
 }
 
-static void virtio_balloon_handle_report(VirtIODevice *vdev, VirtQueue *vq)
+typedef struct VirtIOBalloonRange {
+    RAMBlock *rb;
+    ram_addr_t offset;
+    size_t size;
+} VirtIOBalloonRange;
+
+static gint virtio_balloon_range_cmp(gconstpointer a, gconstpointer b)
 {
-    VirtIOBalloon *dev = VIRTIO_BALLOON(vdev);
-    VirtQueueElement *elem;
+    const VirtIOBalloonRange *ra = a, *rb = b;
 
-    while ((elem = virtqueue_pop(vq, sizeof(VirtQueueElement)))) {
-        unsigned int i;
+    if (ra->rb != rb->rb) {
+        return (uintptr_t)ra->rb < (uintptr_t)rb->rb ? -1 : 1;
+    }
+    if (ra->offset != rb->offset) {
+        return ra->offset < rb->offset ? -1 : 1;
+    }
+    return 0;
+}
 
-        /*
-         * When we discard the page it has the effect of removing the page
-         * from the hypervisor itself and causing it to be zeroed when it
-         * is returned to us. So we must not discard the page if it is
-         * accessible by another device or process, or if the guest is
-         * expecting it to retain a non-zero value.
-         */
-        if (virtio_balloon_inhibited() || dev->poison_val) {
-            goto skip_element;
-        }
+/*
+ * Discard the memory reported in @elems. Adjacent ranges, which guests
+ * report a lot when freeing large areas, are merged so that a single
+ * madvise/fallocate covers them. @async is set when running outside of
+ * the BQL.
+ */
+static void virtio_balloon_report_discard(VirtIOBalloon *dev,
+                                          GPtrArray *elems, bool async)
+{
+    g_autoptr(GArray) ranges = g_array_new(false, false,
+                                           sizeof(VirtIOBalloonRange));
+    int64_t start = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+    uint64_t bytes = 0;
+    guint i, j, n = 0;
+
+    RCU_READ_LOCK_GUARD();
+
+    for (i = 0; i < elems->len; i++) {
+        VirtQueueElement *elem = g_ptr_array_index(elems, i);
 
-        for (i = 0; i < elem->in_num; i++) {
-            void *addr = elem->in_sg[i].iov_base;
-            size_t size = elem->in_sg[i].iov_len;
-            ram_addr_t ram_offset;
-            RAMBlock *rb;
+        for (j = 0; j < elem->in_num; j++) {
+            VirtIOBalloonRange r = {
+                .size = elem->in_sg[j].iov_len,
+            };
 
             /*
              * There is no need to check the memory section to see if
@@ -356,9 +399,10 @@ static void virtio_balloon_handle_report(VirtIODevice *vdev, VirtQueue *vq)
              * will return NULL after the first bounce buffer and fail
              * to map any resources.
              */
-            rb = qemu_ram_block_from_host(addr, false, &ram_offset);
-            if (!rb) {
-                trace_virtio_balloon_bad_addr(elem->in_addr[i]);
+            r.rb = qemu_ram_block_from_host(elem->in_sg[j].iov_base, false,
+                                            &r.offset);
+            if (!r.rb) {
+                trace_virtio_balloon_bad_addr(elem->in_addr[j]);
                 continue;
             }
 
@@ -366,19 +410,177 @@ static void virtio_balloon_handle_report(VirtIODevice *vdev, VirtQueue *vq)
              * For now we will simply ignore unaligned memory regions, or
              * regions that overrun the end of the RAMBlock.
              */
-            if (!QEMU_IS_ALIGNED(ram_offset | size, qemu_ram_pagesize(rb)) ||
-                (ram_offset + size) > qemu_ram_get_used_length(rb)) {
+            if (!QEMU_IS_ALIGNED(r.offset | r.size, qemu_ram_pagesize(r.rb)) ||
+                (r.offset + r.size) > qemu_ram_get_used_length(r.rb)) {
                 continue;
             }
+            g_array_append_val(ranges, r);
+        }
+    }
+
+    g_array_sort(ranges, virtio_balloon_range_cmp);
+    for (i = 0; i < ranges->len; i = j) {
+        VirtIOBalloonRange r = g_array_index(ranges, VirtIOBalloonRange, i);
+
+        for (j = i + 1; j < ranges->len; j++) {
+            VirtIOBalloonRange *next = &g_array_index(ranges,
+                                                      VirtIOBalloonRange, j);
 
-            ram_block_discard_range(rb, ram_offset, size);
+            if (next->rb != r.rb || next->offset != r.offset + r.size) {
+                break;
+            }
+            r.size += next->size;
         }
 
-skip_element:
-        virtqueue_push(vq, elem, 0);
-        virtio_notify(vdev, vq);
+        /* Discarding may have been disabled since the element was popped */
+        if (async && !ram_block_discard_try_begin()) {
+            break;
+        }
+        ram_block_discard_range(r.rb, r.offset, r.size);
+        if (async) {
+            ram_block_discard_end();
+        }
+        bytes += r.size;
+        n++;
+    }
+
+    trace_virtio_balloon_report_discard(elems->len, n, bytes);
+
+    qemu_mutex_lock(&dev->report_lock);
+    dev->report_count += elems->len;
+    dev->report_bytes += bytes;
+    dev->report_discard_ns += qemu_clock_get_ns(QEMU_CLOCK_REALTIME) - start;
+    qemu_mutex_unlock(&dev->report_lock);
+}
+
+static void virtio_balloon_report_move(GPtrArray *dst, GPtrArray *src)
+{
+    guint i;
+
+    for (i = 0; i < src->len; i++) {
+        g_ptr_array_add(dst, g_ptr_array_index(src, i));
+    }
+    g_ptr_array_set_size(src, 0);
+}
+
+static void virtio_balloon_report_push(VirtIOBalloon *dev, GPtrArray *elems)
+{
+    VirtIODevice *vdev = VIRTIO_DEVICE(dev);
+    guint i;
+
+    for (i = 0; i < elems->len; i++) {
+        VirtQueueElement *elem = g_ptr_array_index(elems, i);
+
+        virtqueue_push(dev->reporting_vq, elem, 0);
         g_free(elem);
     }
+    if (elems->len) {
+        virtio_notify(vdev, dev->reporting_vq);
+    }
+    g_ptr_array_set_size(elems, 0);
+}
+
+/* Runs in the iothread */
+static void virtio_balloon_report_bh(void *opaque)
+{
+    VirtIOBalloon *dev = opaque;
+    g_autoptr(GPtrArray) elems = NULL;
+
+    qemu_mutex_lock(&dev->report_lock);
+    elems = dev->report_pending;
+    dev->report_pending = g_ptr_array_new();
+    qemu_mutex_unlock(&dev->report_lock);
+
+    if (!elems->len) {
+        return;
+    }
+
+    virtio_balloon_report_discard(dev, elems, true);
+
+    /*
+     * Schedule report_done_bh before waking up report_drain(): once it
+     * returns, the device may be unrealized and the BH deleted.
+     */
+    qemu_mutex_lock(&dev->report_lock);
+    dev->report_inflight -= elems->len;
+    virtio_balloon_report_move(dev->report_done, elems);
+    qemu_bh_schedule(dev->report_done_bh);
+    qemu_cond_broadcast(&dev->report_cond);
+    qemu_mutex_unlock(&dev->report_lock);
+}
+
+/* Give elements that were processed in the iothread back to the guest */
+static void virtio_balloon_report_done_bh(void *opaque)
+{
+    VirtIOBalloon *dev = opaque;
+    g_autoptr(GPtrArray) elems = NULL;
+
+    qemu_mutex_lock(&dev->report_lock);
+    elems = dev->report_done;
+    dev->report_done = g_ptr_array_new();
+    qemu_mutex_unlock(&dev->report_lock);
+
+    virtio_balloon_report_push(dev, elems);
+}
+
+/*
+ * Wait for the iothread to process all reports and return them to the
+ * guest. Must be called before the queue is reset or migrated, because
+ * the guest waits for every reported page to come back.
+ */
+static void virtio_balloon_report_drain(VirtIOBalloon *dev)
+{
+    if (!dev->report_bh) {
+        return;
+    }
+
+    qemu_mutex_lock(&dev->report_lock);
+    while (dev->report_inflight) {
+        qemu_cond_wait(&dev->report_cond, &dev->report_lock);
+    }
+    qemu_mutex_unlock(&dev->report_lock);
+
+    virtio_balloon_report_done_bh(dev);
+}
+
+static void virtio_balloon_handle_report(VirtIODevice *vdev, VirtQueue *vq)
+{
+    VirtIOBalloon *dev = VIRTIO_BALLOON(vdev);
+    g_autoptr(GPtrArray) elems = g_ptr_array_new();
+    g_autoptr(GPtrArray) skipped = g_ptr_array_new();
+    VirtQueueElement *elem;
+
+    while ((elem = virtqueue_pop(vq, sizeof(VirtQueueElement)))) {
+        /*
+         * When we discard the page it has the effect of removing the page
+         * from the hypervisor itself and causing it to be zeroed when it
+         * is returned to us. So we must not discard the page if it is
+         * accessible by another device or process, or if the guest is
+         * expecting it to retain a non-zero value.
+         */
+        if (virtio_balloon_inhibited() || dev->poison_val) {
+            g_ptr_array_add(skipped, elem);
+        } else {
+            g_ptr_array_add(elems, elem);
+        }
+    }
+    virtio_balloon_report_push(dev, skipped);
+
+    if (!elems->len) {
+        return;
+    }
+
+    if (!dev->report_bh) {
+        virtio_balloon_report_discard(dev, elems, false);
+        virtio_balloon_report_push(dev, elems);
+        return;
+    }
+
+    qemu_mutex_lock(&dev->report_lock);
+    dev->report_inflight += elems->len;
+    virtio_balloon_report_move(dev->report_pending, elems);
+    qemu_mutex_unlock(&dev->report_lock);
+    qemu_bh_schedule(dev->report_bh);
 }
 
 static void virtio_balloon_handle_output(VirtIODevice *vdev, VirtQueue *vq)
@@ -918,6 +1120,14 @@ static void virtio_balloon_device_realize(DeviceState *dev, Error **errp)
     if (virtio_has_feature(s->host_features, VIRTIO_BALLOON_F_REPORTING)) {
         s->reporting_vq = virtio_add_queue(vdev, 32,
                                            virtio_balloon_handle_report);
+        s->report_pending = g_ptr_array_new();
+        s->report_done = g_ptr_array_new();
+        if (s->iothread) {
+            object_ref(OBJECT(s->iothread));
+            s->report_bh = aio_bh_new(iothread_get_aio_context(s->iothread),
+                                      virtio_balloon_report_bh, s);
+            s->report_done_bh = qemu_bh_new(virtio_balloon_report_done_bh, s);
+        }
     }
 
     reset_stats(s);
@@ -934,6 +1144,12 @@ static void virtio_balloon_device_unrealize(DeviceState *dev)
         virtio_balloon_free_page_stop(s);
         precopy_remove_notifier(&s->free_page_hint_notify);
     }
+    if (s->report_bh) {
+        virtio_balloon_report_drain(s);
+        qemu_bh_delete(s->report_bh);
+        qemu_bh_delete(s->report_done_bh);
+        object_unref(OBJECT(s->iothread));
+    }
     balloon_stats_destroy_timer(s);
     qemu_remove_balloon_handler(s);
 
@@ -945,6 +1161,8 @@ static void virtio_balloon_device_unrealize(DeviceState *dev)
     }
     if (s->reporting_vq) {
         virtio_delete_queue(s->reporting_vq);
+        g_ptr_array_free(s->report_pending, true);
+        g_ptr_array_free(s->report_done, true);
     }
     virtio_cleanup(vdev);
 }
@@ -957,6 +1175,8 @@ static void virtio_balloon_device_reset(VirtIODevice *vdev)
         virtio_balloon_free_page_stop(s);
     }
 
+    virtio_balloon_report_drain(s);
+
     if (s->stats_vq_elem != NULL) {
         virtqueue_unpop(s->svq, s->stats_vq_elem, 0);
         g_free(s->stats_vq_elem);
@@ -977,6 +1197,11 @@ static void virtio_balloon_set_status(VirtIODevice *vdev, uint8_t status)
         virtio_balloon_receive_stats(vdev, s->svq);
     }
 
+    /* Don't leave reports in flight while the device state may be saved */
+    if (!vdev->vm_running) {
+        virtio_balloon_report_drain(s);
+    }
+
     if (virtio_balloon_free_page_support(s)) {
         /*
          * The VM is woken up and the iothread was blocked, so signal it to
@@ -1004,6 +1229,8 @@ static void virtio_balloon_instance_init(Object *obj)
 
     qemu_mutex_init(&s->free_page_lock);
     qemu_cond_init(&s->free_page_cond);
+    qemu_mutex_init(&s->report_lock);
+    qemu_cond_init(&s->report_cond);
     s->free_page_hint_cmd_id = VIRTIO_BALLOON_FREE_PAGE_HINT_CMD_ID_MIN;
     s->free_page_hint_notify.notify = virtio_balloon_free_page_hint_notify;
 
@@ -1014,6 +1241,9 @@ static void virtio_balloon_instance_init(Object *obj)
                         balloon_stats_get_poll_interval,
                         balloon_stats_set_poll_interval,
                         NULL, s);
+
+    object_property_add(obj, "free-page-report-stats", "report statistics",
+                        balloon_report_stats_get_all, NULL, NULL, s);
 }
 
 static const VMStateDescription vmstate_virtio_balloon = {
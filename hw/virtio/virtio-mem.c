@@ -215,6 +215,163 @@ static bool virtio_mem_valid_range(VirtIOMEM *vmem, uint64_t gpa, uint64_t size)
     return true;
 }
 
+typedef struct VirtIOMEMRange {
+    uint64_t offset;
+    uint64_t size;
+} VirtIOMEMRange;
+
+/*
+ * The prefault thread works in chunks of this size, to notice stop requests
+ * quickly. Chunks are aligned in the RAM block, so they never split a huge
+ * page.
+ */
+#define VIRTIO_MEM_PREFAULT_CHUNK (64 * MiB)
+
+static void *virtio_mem_prefault_thread(void *opaque)
+{
+    VirtIOMEM *vmem = opaque;
+    RAMBlock *rb = vmem->memdev->mr.ram_block;
+    const size_t pagesize = qemu_ram_pagesize(rb);
+    uint8_t *host = qemu_ram_get_host_addr(rb);
+
+    qemu_mutex_lock(&vmem->prefault_lock);
+    while (vmem->prefault_ranges->len && !qatomic_read(&vmem->prefault_abort)) {
+        VirtIOMEMRange *r = &g_array_index(vmem->prefault_ranges,
+                                           VirtIOMEMRange, 0);
+        const uint64_t offset = r->offset;
+        const uint64_t len = MIN(QEMU_ALIGN_UP(offset + 1,
+                                               VIRTIO_MEM_PREFAULT_CHUNK) -
+                                 offset, r->size);
+        uint8_t *p;
+
+        /*
+         * Only dequeue the chunk we are about to populate, so that the rest
+         * stays visible to virtio_mem_prefault_cancel().
+         */
+        r->offset += len;
+        r->size -= len;
+        if (!r->size) {
+            g_array_remove_index(vmem->prefault_ranges, 0);
+        }
+        qemu_mutex_unlock(&vmem->prefault_lock);
+
+        /*
+         * The guest may already use the memory, so populate it with a
+         * write that does not modify it.
+         */
+        for (p = host + offset; p < host + offset + len; p += pagesize) {
+            qatomic_fetch_add(p, 0);
+        }
+        qemu_mutex_lock(&vmem->prefault_lock);
+    }
+    vmem->prefault_busy = false;
+    qemu_mutex_unlock(&vmem->prefault_lock);
+    return NULL;
+}
+
+static void virtio_mem_prefault_start(VirtIOMEM *vmem)
+{
+    if (vmem->prefault_thread_started) {
+        /* the previous thread ran out of work and is exiting */
+        qemu_thread_join(&vmem->prefault_thread);
+    }
+    qatomic_set(&vmem->prefault_abort, false);
+    qemu_thread_create(&vmem->prefault_thread, "virtio-mem-pf",
+                       virtio_mem_prefault_thread, vmem, QEMU_THREAD_JOINABLE);
+    vmem->prefault_thread_started = true;
+}
+
+static void virtio_mem_prefault_range(VirtIOMEM *vmem, uint64_t offset,
+                                      uint64_t size)
+{
+    VirtIOMEMRange r = { .offset = offset, .size = size };
+    VirtIOMEMRange *last;
+    bool start;
+
+    trace_virtio_mem_prefault_range(offset, size);
+
+    qemu_mutex_lock(&vmem->prefault_lock);
+    last = vmem->prefault_ranges->len ?
+           &g_array_index(vmem->prefault_ranges, VirtIOMEMRange,
+                          vmem->prefault_ranges->len - 1) : NULL;
+    if (last && last->offset + last->size == offset) {
+        last->size += size;
+    } else {
+        g_array_append_val(vmem->prefault_ranges, r);
+    }
+    start = !vmem->prefault_busy;
+    vmem->prefault_busy = true;
+    qemu_mutex_unlock(&vmem->prefault_lock);
+
+    if (start) {
+        virtio_mem_prefault_start(vmem);
+    }
+}
+
+/*
+ * Drop the pending prefaults that overlap [offset, offset + size) and keep
+ * prefaulting the others. Must be called before discarding memory, so it
+ * does not get populated again.
+ */
+static void virtio_mem_prefault_cancel(VirtIOMEM *vmem, uint64_t offset,
+                                       uint64_t size)
+{
+    GArray *ranges = vmem->prefault_ranges;
+    const uint64_t end = offset + size;
+    uint64_t cancelled = 0;
+    guint i = 0;
+
+    if (!vmem->prefault_thread_started) {
+        return;
+    }
+
+    /* the thread checks for aborts between chunks, none is left in flight */
+    qatomic_set(&vmem->prefault_abort, true);
+    qemu_thread_join(&vmem->prefault_thread);
+    vmem->prefault_thread_started = false;
+    vmem->prefault_busy = false;
+
+    while (i < ranges->len) {
+        VirtIOMEMRange *r = &g_array_index(ranges, VirtIOMEMRange, i);
+        const uint64_t r_end = r->offset + r->size;
+        VirtIOMEMRange tail = {
+            .offset = end,
+            .size = r_end > end ? r_end - end : 0,
+        };
+
+        if (r_end <= offset || r->offset >= end) {
+            i++;
+            continue;
+        }
+        cancelled += MIN(r_end, end) - MAX(r->offset, offset);
+        if (r->offset < offset) {
+            r->size = offset - r->offset;
+            i++;
+            if (tail.size) {
+                g_array_insert_val(ranges, i, tail);
+                i++;
+            }
+        } else if (tail.size) {
+            *r = tail;
+            i++;
+        } else {
+            g_array_remove_index(ranges, i);
+        }
+    }
+    trace_virtio_mem_prefault_cancel(offset, size, cancelled);
+
+    if (ranges->len) {
+        vmem->prefault_busy = true;
+        virtio_mem_prefault_start(vmem);
+    }
+}
+
+/* Drop all pending prefaults and stop the prefault thread. */
+static void virtio_mem_prefault_stop(VirtIOMEM *vmem)
+{
+    virtio_mem_prefault_cancel(vmem, 0, UINT64_MAX);
+}
+
 static int virtio_mem_set_block_state(VirtIOMEM *vmem, uint64_t start_gpa,
                                       uint64_t size, bool plug)
 {
@@ -226,6 +383,7 @@ static int virtio_mem_set_block_state(VirtIOMEM *vmem, uint64_t start_gpa,
     }
 
     if (!plug) {
+        virtio_mem_prefault_cancel(vmem, offset, size);
         ret = ram_block_discard_range(vmem->memdev->mr.ram_block, offset, size);
         if (ret) {
             error_report("Unexpected error discarding RAM: %s",
@@ -234,6 +392,9 @@ static int virtio_mem_set_block_state(VirtIOMEM *vmem, uint64_t start_gpa,
         }
     }
     virtio_mem_set_bitmap(vmem, start_gpa, size, plug);
+    if (plug && vmem->prefault) {
+        virtio_mem_prefault_range(vmem, offset, size);
+    }
     return 0;
 }
 
@@ -281,16 +442,74 @@ static void virtio_mem_plug_request(VirtIOMEM *vmem, VirtQueueElement *elem,
     virtio_mem_send_response_simple(vmem, elem, type);
 }
 
-static void virtio_mem_unplug_request(VirtIOMEM *vmem, VirtQueueElement *elem,
-                                      struct virtio_mem_req *req)
+/*
+ * Guests usually unplug large areas one memory block at a time. Unplug
+ * requests for adjacent ranges are collected and the whole range is
+ * discarded with a single call, before any other request is processed or
+ * once the queue is empty.
+ */
+typedef struct VirtIOMEMUnplugBatch {
+    uint64_t gpa;
+    uint64_t size;
+    GPtrArray *elems;
+} VirtIOMEMUnplugBatch;
+
+static void virtio_mem_unplug_flush(VirtIOMEM *vmem,
+                                    VirtIOMEMUnplugBatch *batch)
+{
+    uint16_t type = VIRTIO_MEM_RESP_ACK;
+    guint i;
+
+    if (!batch->elems->len) {
+        return;
+    }
+
+    trace_virtio_mem_unplug_flush(batch->gpa, batch->size, batch->elems->len);
+    if (virtio_mem_set_block_state(vmem, batch->gpa, batch->size, false)) {
+        type = VIRTIO_MEM_RESP_BUSY;
+    } else {
+        vmem->size -= batch->size;
+        notifier_list_notify(&vmem->size_change_notifiers, &vmem->size);
+    }
+
+    for (i = 0; i < batch->elems->len; i++) {
+        VirtQueueElement *elem = g_ptr_array_index(batch->elems, i);
+
+        virtio_mem_send_response_simple(vmem, elem, type);
+        g_free(elem);
+    }
+    g_ptr_array_set_size(batch->elems, 0);
+    batch->size = 0;
+}
+
+/* Returns true if @elem was added to @batch and is answered later. */
+static bool virtio_mem_unplug_request(VirtIOMEM *vmem, VirtQueueElement *elem,
+                                      struct virtio_mem_req *req,
+                                      VirtIOMEMUnplugBatch *batch)
 {
     const uint64_t gpa = le64_to_cpu(req->u.unplug.addr);
     const uint16_t nb_blocks = le16_to_cpu(req->u.unplug.nb_blocks);
-    uint16_t type;
+    const uint64_t size = nb_blocks * vmem->block_size;
 
     trace_virtio_mem_unplug_request(gpa, nb_blocks);
-    type = virtio_mem_state_change_request(vmem, gpa, nb_blocks, false);
-    virtio_mem_send_response_simple(vmem, elem, type);
+
+    if (batch->elems->len && batch->gpa + batch->size != gpa) {
+        virtio_mem_unplug_flush(vmem, batch);
+    }
+
+    /* pending blocks don't overlap, so the bitmap is still accurate here */
+    if (!virtio_mem_valid_range(vmem, gpa, size) ||
+        !virtio_mem_test_bitmap(vmem, gpa, size, true)) {
+        virtio_mem_send_response_simple(vmem, elem, VIRTIO_MEM_RESP_ERROR);
+        return false;
+    }
+
+    if (!batch->elems->len) {
+        batch->gpa = gpa;
+    }
+    batch->size += size;
+    g_ptr_array_add(batch->elems, elem);
+    return true;
 }
 
 static void virtio_mem_resize_usable_region(VirtIOMEM *vmem,
@@ -324,6 +543,7 @@ static int virtio_mem_unplug_all(VirtIOMEM *vmem)
         return -EBUSY;
     }
 
+    virtio_mem_prefault_stop(vmem);
     ret = ram_block_discard_range(rb, 0, qemu_ram_get_used_length(rb));
     if (ret) {
         error_report("Unexpected error discarding RAM: %s", strerror(-ret));
@@ -381,6 +601,7 @@ static void virtio_mem_handle_request(VirtIODevice *vdev, VirtQueue *vq)
 {
     const int len = sizeof(struct virtio_mem_req);
     VirtIOMEM *vmem = VIRTIO_MEM(vdev);
+    VirtIOMEMUnplugBatch batch = { .elems = g_ptr_array_new() };
     VirtQueueElement *elem;
     struct virtio_mem_req req;
     uint16_t type;
@@ -388,7 +609,7 @@ static void virtio_mem_handle_request(VirtIODevice *vdev, VirtQueue *vq)
     while (true) {
         elem = virtqueue_pop(vq, sizeof(VirtQueueElement));
         if (!elem) {
-            return;
+            break;
         }
 
         if (iov_to_buf(elem->out_sg, elem->out_num, 0, &req, len) < len) {
@@ -396,7 +617,7 @@ static void virtio_mem_handle_request(VirtIODevice *vdev, VirtQueue *vq)
                          " size: %d", len);
             virtqueue_detach_element(vq, elem, 0);
             g_free(elem);
-            return;
+            break;
         }
 
         if (iov_size(elem->in_sg, elem->in_num) <
@@ -406,16 +627,22 @@ static void virtio_mem_handle_request(VirtIODevice *vdev, VirtQueue *vq)
                          iov_size(elem->in_sg, elem->in_num));
             virtqueue_detach_element(vq, elem, 0);
             g_free(elem);
-            return;
+            break;
         }
 
         type = le16_to_cpu(req.type);
+        if (type != VIRTIO_MEM_REQ_UNPLUG) {
+            virtio_mem_unplug_flush(vmem, &batch);
+        }
+
         switch (type) {
         case VIRTIO_MEM_REQ_PLUG:
             virtio_mem_plug_request(vmem, elem, &req);
             break;
         case VIRTIO_MEM_REQ_UNPLUG:
-            virtio_mem_unplug_request(vmem, elem, &req);
+            if (virtio_mem_unplug_request(vmem, elem, &req, &batch)) {
+                continue;
+            }
             break;
         case VIRTIO_MEM_REQ_UNPLUG_ALL:
             virtio_mem_unplug_all_request(vmem, elem);
@@ -428,11 +655,15 @@ static void virtio_mem_handle_request(VirtIODevice *vdev, VirtQueue *vq)
                          " type: %d", type);
             virtqueue_detach_element(vq, elem, 0);
             g_free(elem);
-            return;
+            goto out;
         }
 
         g_free(elem);
     }
+
+out:
+    virtio_mem_unplug_flush(vmem, &batch);
+    g_ptr_array_free(batch.elems, true);
 }
 
 static void virtio_mem_get_config(VirtIODevice *vdev, uint8_t *config_data)
@@ -568,6 +799,8 @@ static void virtio_mem_device_realize(DeviceState *dev, Error **errp)
     vmem->bitmap_size = memory_region_size(&vmem->memdev->mr) /
                         vmem->block_size;
     vmem->bitmap = bitmap_new(vmem->bitmap_size);
+    qemu_mutex_init(&vmem->prefault_lock);
+    vmem->prefault_ranges = g_array_new(false, false, sizeof(VirtIOMEMRange));
 
     virtio_init(vdev, TYPE_VIRTIO_MEM, VIRTIO_ID_MEM,
                 sizeof(struct virtio_mem_config));
@@ -590,6 +823,9 @@ static void virtio_mem_device_unrealize(DeviceState *dev)
     host_memory_backend_set_mapped(vmem->memdev, false);
     virtio_del_queue(vdev, 0);
     virtio_cleanup(vdev);
+    virtio_mem_prefault_stop(vmem);
+    g_array_free(vmem->prefault_ranges, true);
+    qemu_mutex_destroy(&vmem->prefault_lock);
     g_free(vmem->bitmap);
     ram_block_discard_require(false);
 }
@@ -937,6 +1173,7 @@ static Property virtio_mem_properties[] = {
     DEFINE_PROP_UINT32(VIRTIO_MEM_NODE_PROP, VirtIOMEM, node, 0),
     DEFINE_PROP_LINK(VIRTIO_MEM_MEMDEV_PROP, VirtIOMEM, memdev,
                      TYPE_MEMORY_BACKEND, HostMemoryBackend *),
+    DEFINE_PROP_BOOL("x-prefault", VirtIOMEM, prefault, false),
     DEFINE_PROP_END_OF_LIST(),
 };
 
@@ -27,8 +27,10 @@
 #include "hw/qdev-properties.h"
 #include "qapi/error.h"
 #include "qemu/error-report.h"
+#include "qemu/bitmap.h"
 #include "qemu/log.h"
 #include "qemu/module.h"
+#include "qemu/main-loop.h"
 #include "hw/pci/msi.h"
 #include "hw/pci/msix.h"
 #include "hw/loader.h"
@@ -482,9 +484,38 @@ static void virtio_pci_config_write(void *opaque, hwaddr addr,
     }
 }
 
+/*
+ * Only the queue notify register is coalesced.  Processing a queue handles
+ * all the buffers that were made available before, so a queue needs to be
+ * notified only once for a run of notifications.
+ */
+static void virtio_pci_config_write_batch(void *opaque,
+                                          const MemoryRegionBatchWrite *writes,
+                                          unsigned n)
+{
+    DECLARE_BITMAP(notified, VIRTIO_QUEUE_MAX);
+    unsigned i;
+
+    bitmap_zero(notified, VIRTIO_QUEUE_MAX);
+    for (i = 0; i < n; i++) {
+        const MemoryRegionBatchWrite *w = &writes[i];
+
+        if (w->addr == VIRTIO_PCI_QUEUE_NOTIFY && w->data < VIRTIO_QUEUE_MAX) {
+            if (test_bit(w->data, notified)) {
+                continue;
+            }
+            set_bit(w->data, notified);
+        } else {
+            bitmap_zero(notified, VIRTIO_QUEUE_MAX);
+        }
+        virtio_pci_config_write(opaque, w->addr, w->data, w->size);
+    }
+}
+
 static const MemoryRegionOps virtio_pci_config_ops = {
     .read = virtio_pci_config_read,
     .write = virtio_pci_config_write,
+    .write_batch = virtio_pci_config_write_batch,
     .impl = {
         .min_access_size = 1,
         .max_access_size = 4,
@@ -1341,7 +1372,9 @@ static void virtio_pci_notify_write(void *opaque, hwaddr addr,
 
     unsigned queue = addr / virtio_pci_queue_mem_mult(proxy);
 
-    if (vdev != NULL && queue < VIRTIO_QUEUE_MAX) {
+    if (vdev != NULL && queue < VIRTIO_QUEUE_MAX &&
+        !virtio_queue_notify_lockless(vdev, queue)) {
+        QEMU_IOTHREAD_LOCK_GUARD();
         virtio_queue_notify(vdev, queue);
     }
 }
@@ -1354,7 +1387,9 @@ static void virtio_pci_notify_write_pio(void *opaque, hwaddr addr,
 
     unsigned queue = val;
 
-    if (vdev != NULL && queue < VIRTIO_QUEUE_MAX) {
+    if (vdev != NULL && queue < VIRTIO_QUEUE_MAX &&
+        !virtio_queue_notify_lockless(vdev, queue)) {
+        QEMU_IOTHREAD_LOCK_GUARD();
         virtio_queue_notify(vdev, queue);
     }
 }
@@ -1500,6 +1535,8 @@ static void virtio_pci_modern_regions_init(VirtIOPCIProxy *proxy,
                           proxy,
                           name->str,
                           proxy->notify.size);
+    /* kicks of queues with a host notifier do not need the BQL */
+    memory_region_clear_global_locking(&proxy->notify.mr);
 
     g_string_printf(name, "virtio-pci-notify-pio-%s", vdev_name);
     memory_region_init_io(&proxy->notify_pio.mr, OBJECT(proxy),
@@ -1507,6 +1544,7 @@ static void virtio_pci_modern_regions_init(VirtIOPCIProxy *proxy,
                           proxy,
                           name->str,
                           proxy->notify_pio.size);
+    memory_region_clear_global_locking(&proxy->notify_pio.mr);
 }
 
 static void virtio_pci_modern_region_map(VirtIOPCIProxy *proxy,
@@ -1716,6 +1754,12 @@ static void virtio_pci_device_plugged(DeviceState *d, Error **errp)
         memory_region_init_io(&proxy->bar, OBJECT(proxy),
                               &virtio_pci_config_ops,
                               proxy, "virtio-pci", size);
+        /* With ioeventfd, notifications do not reach QEMU anyway */
+        if ((proxy->flags & VIRTIO_PCI_FLAG_COALESCE_NOTIFY) &&
+            !(proxy->flags & VIRTIO_PCI_FLAG_USE_IOEVENTFD)) {
+            memory_region_add_coalescing_doorbell(&proxy->bar,
+                                                  VIRTIO_PCI_QUEUE_NOTIFY, 2);
+        }
 
         pci_register_bar(&proxy->pci_dev, proxy->legacy_io_bar_idx,
                          PCI_BASE_ADDRESS_SPACE_IO, &proxy->bar);
@@ -1935,6 +1979,8 @@ static Property virtio_pci_properties[] = {
                     VIRTIO_PCI_FLAG_INIT_FLR_BIT, true),
     DEFINE_PROP_BIT("aer", VirtIOPCIProxy, flags,
                     VIRTIO_PCI_FLAG_AER_BIT, false),
+    DEFINE_PROP_BIT("x-coalesce-notify", VirtIOPCIProxy, flags,
+                    VIRTIO_PCI_FLAG_COALESCE_NOTIFY_BIT, false),
     DEFINE_PROP_END_OF_LIST(),
 };
 
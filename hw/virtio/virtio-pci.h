@@ -42,6 +42,7 @@ enum {
     VIRTIO_PCI_FLAG_INIT_PM_BIT,
     VIRTIO_PCI_FLAG_INIT_FLR_BIT,
     VIRTIO_PCI_FLAG_AER_BIT,
+    VIRTIO_PCI_FLAG_COALESCE_NOTIFY_BIT,
 };
 
 /* Need to activate work-arounds for buggy guests at vmstate load. */
@@ -84,6 +85,10 @@ enum {
 /* Advanced Error Reporting capability */
 #define VIRTIO_PCI_FLAG_AER (1 << VIRTIO_PCI_FLAG_AER_BIT)
 
+/* Coalesce legacy queue notifications when not using ioeventfd */
+#define VIRTIO_PCI_FLAG_COALESCE_NOTIFY \
+    (1 << VIRTIO_PCI_FLAG_COALESCE_NOTIFY_BIT)
+
 typedef struct {
     MSIMessage msg;
     int virq;
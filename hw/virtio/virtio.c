@@ -18,6 +18,7 @@
 #include "exec/address-spaces.h"
 #include "qemu/error-report.h"
 #include "qemu/log.h"
+#include "qemu/lockable.h"
 #include "qemu/main-loop.h"
 #include "qemu/module.h"
 #include "hw/virtio/virtio.h"
@@ -95,10 +96,31 @@ typedef struct VRingPackedDescEvent {
     uint16_t flags;
 } VRingPackedDescEvent ;
 
+/*
+ * Preallocated elements of one size, enough for a full queue.  Elements are
+ * taken and returned by the thread that processes the virtqueue, so no
+ * locking is needed.  A pool outlives its virtqueue until the last element
+ * is returned.
+ */
+typedef struct VirtQueueElementPool {
+    void *mem;
+    void *free_list;
+    size_t sz;
+    size_t slot_size;
+    unsigned int outstanding;
+    bool orphaned;
+} VirtQueueElementPool;
+
+/* Descriptors that fit in a pooled element; larger ones are malloced */
+#define VIRTQUEUE_POOL_SG 16
+
 struct VirtQueue
 {
     VRing vring;
     VirtQueueElement *used_elems;
+    /* With VIRTIO_F_IN_ORDER, the used_elems slot of each in-flight head */
+    uint16_t *in_order_pos;
+    VirtQueueElementPool *elem_pool;
 
     /* Next head to pop */
     uint16_t last_avail_idx;
@@ -836,6 +858,143 @@ static void virtqueue_packed_fill_desc(VirtQueue *vq,
     vring_packed_desc_write(vq->vdev, &desc, &caches->desc, head, strict_order);
 }
 
+/*
+ * With VIRTIO_F_IN_ORDER, buffers must be used in the order in which they
+ * were made available.  used_elems then remembers every in-flight element
+ * at the ring position it was popped from (the avail index for split rings,
+ * the descriptor index for packed rings), and in_order_pos maps its head
+ * back to that position.  Completions only mark their entry, and
+ * virtqueue_flush() publishes the completed prefix.
+ */
+static void virtqueue_in_order_record(VirtQueue *vq, unsigned int pos,
+                                      unsigned int index, unsigned int ndescs)
+{
+    VirtQueueElement *slot = &vq->used_elems[pos % vq->vring.num];
+
+    if (index >= vq->vring.num) {
+        virtio_error(vq->vdev, "Head %u out of range", index);
+        return;
+    }
+    slot->index = index;
+    slot->ndescs = ndescs;
+    slot->len = 0;
+    slot->in_order_filled = false;
+    vq->in_order_pos[index] = pos % vq->vring.num;
+}
+
+/* Like virtqueue_in_order_record(), but keep the completion state */
+static void virtqueue_in_order_restore(VirtQueue *vq, unsigned int pos,
+                                       unsigned int index, unsigned int ndescs)
+{
+    VirtQueueElement *slot = &vq->used_elems[pos % vq->vring.num];
+    unsigned int len = slot->len;
+    bool filled = slot->in_order_filled;
+
+    virtqueue_in_order_record(vq, pos, index, ndescs);
+    slot->len = len;
+    slot->in_order_filled = filled;
+}
+
+/* Number of ring positions between the used and the avail position */
+static unsigned int virtqueue_in_order_inflight(VirtQueue *vq)
+{
+    if (virtio_vdev_has_feature(vq->vdev, VIRTIO_F_RING_PACKED)) {
+        unsigned int inflight = vq->last_avail_idx + vq->vring.num -
+                                vq->used_idx;
+
+        if (vq->last_avail_wrap_counter == vq->used_wrap_counter) {
+            inflight -= vq->vring.num;
+        }
+        return inflight;
+    }
+    return (uint16_t)(vq->last_avail_idx - vq->used_idx);
+}
+
+static inline VirtQueueElement *virtqueue_in_order_slot(VirtQueue *vq,
+                                                       unsigned int off)
+{
+    return &vq->used_elems[(vq->used_idx + off) % vq->vring.num];
+}
+
+static inline unsigned int virtqueue_in_order_step(VirtQueue *vq,
+                                                   const VirtQueueElement *slot)
+{
+    if (virtio_vdev_has_feature(vq->vdev, VIRTIO_F_RING_PACKED)) {
+        return MAX(slot->ndescs, 1);
+    }
+    return 1;
+}
+
+/* Whether ring position @pos holds an in-flight element */
+static bool virtqueue_in_order_pos_inflight(VirtQueue *vq, unsigned int pos)
+{
+    unsigned int num = vq->vring.num;
+
+    return (pos + num - vq->used_idx % num) % num <
+           virtqueue_in_order_inflight(vq);
+}
+
+static void virtqueue_in_order_fill(VirtQueue *vq, const VirtQueueElement *elem,
+                                    unsigned int len)
+{
+    VirtQueueElement *slot;
+    unsigned int pos;
+
+    if (elem->index < vq->vring.num) {
+        pos = vq->in_order_pos[elem->index];
+        slot = &vq->used_elems[pos];
+        if (virtqueue_in_order_pos_inflight(vq, pos) &&
+            slot->index == elem->index && !slot->in_order_filled) {
+            slot->len = len;
+            slot->in_order_filled = true;
+            return;
+        }
+    }
+    virtio_error(vq->vdev, "Completed element %u is not in flight",
+                 elem->index);
+}
+
+/*
+ * Rebuild the in-flight part of used_elems from the rings, e.g. after
+ * migration.  Elements that were completed but not flushed yet keep the
+ * state that the "virtio/in_order" subsection restored.
+ * Called within rcu_read_lock().
+ */
+static void virtqueue_in_order_rebuild(VirtQueue *vq)
+{
+    unsigned int off, inflight = virtqueue_in_order_inflight(vq);
+
+    if (!virtio_vdev_has_feature(vq->vdev, VIRTIO_F_RING_PACKED)) {
+        for (off = 0; off < inflight; off++) {
+            unsigned int pos = (vq->used_idx + off) % vq->vring.num;
+
+            virtqueue_in_order_restore(vq, pos, vring_avail_ring(vq, pos), 1);
+        }
+        return;
+    }
+
+    for (off = 0; off < inflight;) {
+        VRingMemoryRegionCaches *caches = vring_get_region_caches(vq);
+        unsigned int pos = (vq->used_idx + off) % vq->vring.num;
+        unsigned int ndescs = 1;
+        VRingPackedDesc desc;
+        uint16_t id;
+
+        if (!caches) {
+            return;
+        }
+        vring_packed_desc_read(vq->vdev, &desc, &caches->desc, pos, true);
+        id = desc.id;
+        while ((desc.flags & VRING_DESC_F_NEXT) && ndescs < inflight - off) {
+            vring_packed_desc_read(vq->vdev, &desc, &caches->desc,
+                                   (pos + ndescs) % vq->vring.num, true);
+            ndescs++;
+        }
+        virtqueue_in_order_restore(vq, pos, id, ndescs);
+        off += ndescs;
+    }
+}
+
 /* Called within rcu_read_lock().  */
 void virtqueue_fill(VirtQueue *vq, const VirtQueueElement *elem,
                     unsigned int len, unsigned int idx)
@@ -848,7 +1007,9 @@ void virtqueue_fill(VirtQueue *vq, const VirtQueueElement *elem,
         return;
     }
 
-    if (virtio_vdev_has_feature(vq->vdev, VIRTIO_F_RING_PACKED)) {
+    if (virtio_vdev_has_feature(vq->vdev, VIRTIO_F_IN_ORDER)) {
+        virtqueue_in_order_fill(vq, elem, len);
+    } else if (virtio_vdev_has_feature(vq->vdev, VIRTIO_F_RING_PACKED)) {
         virtqueue_packed_fill(vq, elem, len, idx);
     } else {
         virtqueue_split_fill(vq, elem, len, idx);
@@ -898,6 +1059,94 @@ static void virtqueue_packed_flush(VirtQueue *vq, unsigned int count)
     }
 }
 
+/* Number of completed elements at the head of the in-flight ones */
+static unsigned int virtqueue_in_order_completed(VirtQueue *vq,
+                                                 unsigned int *nslots)
+{
+    unsigned int off = 0, n = 0, inflight = virtqueue_in_order_inflight(vq);
+
+    while (off < inflight) {
+        VirtQueueElement *slot = virtqueue_in_order_slot(vq, off);
+
+        if (!slot->in_order_filled) {
+            break;
+        }
+        off += virtqueue_in_order_step(vq, slot);
+        n++;
+    }
+    *nslots = off;
+    return n;
+}
+
+/*
+ * Publish the completed prefix of the in-flight elements.  Only the last
+ * element of a batch needs a used entry, written at the position where the
+ * batch starts; the driver then skips forward by the batch size.  Elements
+ * with a non-zero length still get their own entry so that the driver can
+ * tell how much was written to each of them.
+ *
+ * Called within rcu_read_lock().
+ */
+static void virtqueue_split_flush_in_order(VirtQueue *vq)
+{
+    unsigned int i, start = 0, nslots;
+    unsigned int n = virtqueue_in_order_completed(vq, &nslots);
+    VRingUsedElem uelem;
+
+    if (unlikely(!vq->vring.used) || !n) {
+        return;
+    }
+
+    for (i = 0; i < n; i++) {
+        VirtQueueElement *slot = virtqueue_in_order_slot(vq, i);
+
+        slot->in_order_filled = false;
+        if (slot->len || i == n - 1) {
+            uelem.id = slot->index;
+            uelem.len = slot->len;
+            vring_used_write(vq, &uelem,
+                             (vq->used_idx + start) % vq->vring.num);
+            start = i + 1;
+        }
+    }
+    virtqueue_split_flush(vq, n);
+}
+
+static void virtqueue_packed_flush_in_order(VirtQueue *vq)
+{
+    VirtQueueElement *first = NULL;
+    unsigned int i, off = 0, start = 0, nslots;
+    unsigned int n = virtqueue_in_order_completed(vq, &nslots);
+
+    if (unlikely(!vq->vring.desc) || !n) {
+        return;
+    }
+
+    for (i = 0; i < n; i++) {
+        VirtQueueElement *slot = virtqueue_in_order_slot(vq, off);
+
+        slot->in_order_filled = false;
+        off += virtqueue_in_order_step(vq, slot);
+        if (slot->len || i == n - 1) {
+            /* The first used descriptor is made visible last */
+            if (start) {
+                virtqueue_packed_fill_desc(vq, slot, start, false);
+            } else {
+                first = slot;
+            }
+            start = off;
+        }
+    }
+    virtqueue_packed_fill_desc(vq, first, 0, true);
+
+    vq->inuse -= nslots;
+    vq->used_idx += nslots;
+    if (vq->used_idx >= vq->vring.num) {
+        vq->used_idx -= vq->vring.num;
+        vq->used_wrap_counter ^= 1;
+    }
+}
+
 void virtqueue_flush(VirtQueue *vq, unsigned int count)
 {
     if (virtio_device_disabled(vq->vdev)) {
@@ -905,7 +1154,13 @@ void virtqueue_flush(VirtQueue *vq, unsigned int count)
         return;
     }
 
-    if (virtio_vdev_has_feature(vq->vdev, VIRTIO_F_RING_PACKED)) {
+    if (virtio_vdev_has_feature(vq->vdev, VIRTIO_F_IN_ORDER)) {
+        if (virtio_vdev_has_feature(vq->vdev, VIRTIO_F_RING_PACKED)) {
+            virtqueue_packed_flush_in_order(vq);
+        } else {
+            virtqueue_split_flush_in_order(vq);
+        }
+    } else if (virtio_vdev_has_feature(vq->vdev, VIRTIO_F_RING_PACKED)) {
         virtqueue_packed_flush(vq, count);
     } else {
         virtqueue_split_flush(vq, count);
@@ -920,6 +1175,27 @@ void virtqueue_push(VirtQueue *vq, const VirtQueueElement *elem,
     virtqueue_flush(vq, 1);
 }
 
+/*
+ * Complete @count elements at once: fill them into consecutive used ring
+ * slots and publish them with a single used index update.  @lens holds the
+ * number of bytes written to each element.
+ */
+void virtqueue_fill_batch(VirtQueue *vq, VirtQueueElement **elems,
+                          unsigned int *lens, unsigned int count)
+{
+    unsigned int i;
+
+    if (!count) {
+        return;
+    }
+
+    RCU_READ_LOCK_GUARD();
+    for (i = 0; i < count; i++) {
+        virtqueue_fill(vq, elems[i], lens[i], i);
+    }
+    virtqueue_flush(vq, count);
+}
+
 /* Called within rcu_read_lock().  */
 static int virtqueue_num_heads(VirtQueue *vq, unsigned int idx)
 {
@@ -1389,19 +1665,117 @@ void virtqueue_map(VirtIODevice *vdev, VirtQueueElement *elem)
                                                                         false);
 }
 
-static void *virtqueue_alloc_element(size_t sz, unsigned out_num, unsigned in_num)
+static size_t virtqueue_element_size(size_t sz, unsigned out_num,
+                                     unsigned in_num)
+{
+    VirtQueueElement *elem;
+    size_t in_addr_ofs = QEMU_ALIGN_UP(sz, __alignof__(elem->in_addr[0]));
+    size_t out_addr_ofs = in_addr_ofs + in_num * sizeof(elem->in_addr[0]);
+    size_t out_addr_end = out_addr_ofs + out_num * sizeof(elem->out_addr[0]);
+    size_t in_sg_ofs = QEMU_ALIGN_UP(out_addr_end, __alignof__(elem->in_sg[0]));
+    size_t out_sg_ofs = in_sg_ofs + in_num * sizeof(elem->in_sg[0]);
+
+    return out_sg_ofs + out_num * sizeof(elem->out_sg[0]);
+}
+
+static void virtqueue_element_pool_free(VirtQueueElementPool *pool)
+{
+    g_free(pool->mem);
+    g_free(pool);
+}
+
+/*
+ * Give every element of @vq that is popped with size @sz a preallocated
+ * buffer.  Such elements must be released with virtqueue_element_free(),
+ * from the same thread (or under the same AioContext lock) that pops them.
+ * Elements with more than VIRTQUEUE_POOL_SG descriptors still come from
+ * the heap.
+ */
+void virtio_queue_enable_element_pool(VirtQueue *vq, size_t sz)
+{
+    VirtQueueElementPool *pool;
+    unsigned int i, num = vq->vring.num_default;
+
+    assert(sz >= sizeof(VirtQueueElement));
+    virtio_queue_release_element_pool(vq);
+
+    pool = g_new0(VirtQueueElementPool, 1);
+    pool->sz = sz;
+    pool->slot_size = QEMU_ALIGN_UP(virtqueue_element_size(sz, 0,
+                                                           VIRTQUEUE_POOL_SG),
+                                    16);
+    pool->mem = g_malloc(num * pool->slot_size);
+    for (i = num; i-- > 0;) {
+        void *slot = pool->mem + i * pool->slot_size;
+
+        *(void **)slot = pool->free_list;
+        pool->free_list = slot;
+    }
+    vq->elem_pool = pool;
+}
+
+/* Detach the pool from @vq; it goes away once all its elements are back */
+void virtio_queue_release_element_pool(VirtQueue *vq)
+{
+    VirtQueueElementPool *pool = vq->elem_pool;
+
+    if (!pool) {
+        return;
+    }
+    vq->elem_pool = NULL;
+    if (pool->outstanding) {
+        pool->orphaned = true;
+    } else {
+        virtqueue_element_pool_free(pool);
+    }
+}
+
+void virtqueue_element_free(VirtQueueElement *elem)
 {
+    VirtQueueElementPool *pool;
+
+    if (!elem) {
+        return;
+    }
+
+    pool = elem->pool;
+    if (!pool) {
+        g_free(elem);
+        return;
+    }
+
+    *(void **)elem = pool->free_list;
+    pool->free_list = elem;
+    if (!--pool->outstanding && pool->orphaned) {
+        virtqueue_element_pool_free(pool);
+    }
+}
+
+/* @vq may be NULL for elements that are not tied to a pop, e.g. on load */
+static void *virtqueue_alloc_element(VirtQueue *vq, size_t sz,
+                                     unsigned out_num, unsigned in_num)
+{
+    VirtQueueElementPool *pool = vq ? vq->elem_pool : NULL;
     VirtQueueElement *elem;
     size_t in_addr_ofs = QEMU_ALIGN_UP(sz, __alignof__(elem->in_addr[0]));
     size_t out_addr_ofs = in_addr_ofs + in_num * sizeof(elem->in_addr[0]);
     size_t out_addr_end = out_addr_ofs + out_num * sizeof(elem->out_addr[0]);
     size_t in_sg_ofs = QEMU_ALIGN_UP(out_addr_end, __alignof__(elem->in_sg[0]));
     size_t out_sg_ofs = in_sg_ofs + in_num * sizeof(elem->in_sg[0]);
-    size_t out_sg_end = out_sg_ofs + out_num * sizeof(elem->out_sg[0]);
+    size_t out_sg_end = virtqueue_element_size(sz, out_num, in_num);
 
     assert(sz >= sizeof(VirtQueueElement));
-    elem = g_malloc(out_sg_end);
+    if (pool && pool->free_list && pool->sz == sz &&
+        out_sg_end <= pool->slot_size) {
+        elem = pool->free_list;
+        pool->free_list = *(void **)elem;
+        pool->outstanding++;
+    } else {
+        elem = g_malloc(out_sg_end);
+        pool = NULL;
+    }
     trace_virtqueue_alloc_element(elem, sz, in_num, out_num);
+    elem->pool = pool;
     elem->out_num = out_num;
     elem->in_num = in_num;
     elem->in_addr = (void *)elem + in_addr_ofs;
@@ -1411,10 +1785,16 @@ static void *virtqueue_alloc_element(size_t sz, unsigned out_num, unsigned in_nu
     return elem;
 }
 
-static void *virtqueue_split_pop(VirtQueue *vq, size_t sz)
+/*
+ * Pop the element at last_avail_idx.  Called within rcu_read_lock(), after
+ * the caller has checked that the avail ring is not empty and issued the
+ * matching read barrier.  Updating the avail event is left to the caller.
+ */
+static void *virtqueue_split_pop_one(VirtQueue *vq, size_t sz,
+                                     VRingMemoryRegionCaches *caches)
 {
     unsigned int i, head, max;
-    VRingMemoryRegionCaches *caches;
+    uint16_t pos;
     MemoryRegionCache indirect_desc_cache = MEMORY_REGION_CACHE_INVALID;
     MemoryRegionCache *desc_cache;
     int64_t len;
@@ -1426,14 +1806,6 @@ static void *virtqueue_split_pop(VirtQueue *vq, size_t sz)
     VRingDesc desc;
     int rc;
 
-    RCU_READ_LOCK_GUARD();
-    if (virtio_queue_empty_rcu(vq)) {
-        goto done;
-    }
-    /* Needed after virtio_queue_empty(), see comment in
-     * virtqueue_num_heads(). */
-    smp_rmb();
-
     /* When we start there are none of either input nor output. */
     out_num = in_num = elem_entries = 0;
 
@@ -1444,27 +1816,13 @@ static void *virtqueue_split_pop(VirtQueue *vq, size_t sz)
         goto done;
     }
 
+    pos = vq->last_avail_idx;
     if (!virtqueue_get_head(vq, vq->last_avail_idx++, &head)) {
         goto done;
     }
 
-    if (virtio_vdev_has_feature(vdev, VIRTIO_RING_F_EVENT_IDX)) {
-        vring_set_avail_event(vq, vq->last_avail_idx);
-    }
-
     i = head;
 
-    caches = vring_get_region_caches(vq);
-    if (!caches) {
-        virtio_error(vdev, "Region caches not initialized");
-        goto done;
-    }
-
-    if (caches->desc.len < max * sizeof(VRingDesc)) {
-        virtio_error(vdev, "Cannot map descriptor ring");
-        goto done;
-    }
-
     desc_cache = &caches->desc;
     vring_split_desc_read(vdev, &desc, desc_cache, i);
     if (desc.flags & VRING_DESC_F_INDIRECT) {
@@ -1523,7 +1881,7 @@ static void *virtqueue_split_pop(VirtQueue *vq, size_t sz)
     }
 
     /* Now copy what we have collected and mapped */
-    elem = virtqueue_alloc_element(sz, out_num, in_num);
+    elem = virtqueue_alloc_element(vq, sz, out_num, in_num);
     elem->index = head;
     elem->ndescs = 1;
     for (i = 0; i < out_num; i++) {
@@ -1535,6 +1893,9 @@ static void *virtqueue_split_pop(VirtQueue *vq, size_t sz)
         elem->in_sg[i] = iov[out_num + i];
     }
 
+    if (virtio_vdev_has_feature(vdev, VIRTIO_F_IN_ORDER)) {
+        virtqueue_in_order_record(vq, pos, head, 1);
+    }
     vq->inuse++;
 
     trace_virtqueue_pop(vq, elem, elem->in_num, elem->out_num);
@@ -1548,6 +1909,62 @@ err_undo_map:
     goto done;
 }
 
+/*
+ * Pop up to @max elements with a single RCU critical section, a single read
+ * of the avail index and a single avail event update for the whole batch.
+ */
+static unsigned int virtqueue_split_pop_batch(VirtQueue *vq, size_t sz,
+                                              void **elems, unsigned int max)
+{
+    VRingMemoryRegionCaches *caches;
+    VirtIODevice *vdev = vq->vdev;
+    unsigned int n = 0;
+    uint16_t avail;
+
+    RCU_READ_LOCK_GUARD();
+    if (virtio_queue_empty_rcu(vq)) {
+        return 0;
+    }
+    /* Needed after virtio_queue_empty(), see comment in
+     * virtqueue_num_heads(). */
+    smp_rmb();
+
+    caches = vring_get_region_caches(vq);
+    if (!caches) {
+        virtio_error(vdev, "Region caches not initialized");
+        return 0;
+    }
+
+    if (caches->desc.len < vq->vring.num * sizeof(VRingDesc)) {
+        virtio_error(vdev, "Cannot map descriptor ring");
+        return 0;
+    }
+
+    avail = vq->shadow_avail_idx - vq->last_avail_idx;
+    while (n < max && n < avail) {
+        void *elem = virtqueue_split_pop_one(vq, sz, caches);
+
+        if (!elem) {
+            break;
+        }
+        elems[n++] = elem;
+    }
+
+    if (virtio_vdev_has_feature(vdev, VIRTIO_RING_F_EVENT_IDX)) {
+        vring_set_avail_event(vq, vq->last_avail_idx);
+    }
+
+    return n;
+}
+
+static void *virtqueue_split_pop(VirtQueue *vq, size_t sz)
+{
+    void *elem = NULL;
+
+    virtqueue_split_pop_batch(vq, sz, &elem, 1);
+    return elem;
+}
+
 static void *virtqueue_packed_pop(VirtQueue *vq, size_t sz)
 {
     unsigned int i, max;
@@ -1649,7 +2066,7 @@ static void *virtqueue_packed_pop(VirtQueue *vq, size_t sz)
     } while (rc == VIRTQUEUE_READ_DESC_MORE);
 
     /* Now copy what we have collected and mapped */
-    elem = virtqueue_alloc_element(sz, out_num, in_num);
+    elem = virtqueue_alloc_element(vq, sz, out_num, in_num);
     for (i = 0; i < out_num; i++) {
         elem->out_addr[i] = addr[i];
         elem->out_sg[i] = iov[i];
@@ -1661,6 +2078,9 @@ static void *virtqueue_packed_pop(VirtQueue *vq, size_t sz)
 
     elem->index = id;
     elem->ndescs = (desc_cache == &indirect_desc_cache) ? 1 : elem_entries;
+    if (virtio_vdev_has_feature(vdev, VIRTIO_F_IN_ORDER)) {
+        virtqueue_in_order_record(vq, vq->last_avail_idx, id, elem->ndescs);
+    }
     vq->last_avail_idx += elem->ndescs;
     vq->inuse += elem->ndescs;
 
@@ -1696,6 +2116,30 @@ void *virtqueue_pop(VirtQueue *vq, size_t sz)
     }
 }
 
+unsigned int virtqueue_pop_batch(VirtQueue *vq, size_t sz, void **elems,
+                                 unsigned int max)
+{
+    unsigned int n = 0;
+
+    if (virtio_device_disabled(vq->vdev)) {
+        return 0;
+    }
+
+    if (!virtio_vdev_has_feature(vq->vdev, VIRTIO_F_RING_PACKED)) {
+        return virtqueue_split_pop_batch(vq, sz, elems, max);
+    }
+
+    while (n < max) {
+        void *elem = virtqueue_packed_pop(vq, sz);
+
+        if (!elem) {
+            break;
+        }
+        elems[n++] = elem;
+    }
+    return n;
+}
+
 static unsigned int virtqueue_packed_drop_all(VirtQueue *vq)
 {
     VRingMemoryRegionCaches *caches;
@@ -1731,17 +2175,22 @@ static unsigned int virtqueue_packed_drop_all(VirtQueue *vq)
                                                vq->vring.num, &idx, false)) {
             ++elem.ndescs;
         }
+        if (virtio_vdev_has_feature(vdev, VIRTIO_F_IN_ORDER)) {
+            virtqueue_in_order_record(vq, vq->last_avail_idx, elem.index,
+                                      elem.ndescs);
+        }
+        vq->inuse += elem.ndescs;
+        vq->last_avail_idx += elem.ndescs;
+        if (vq->last_avail_idx >= vq->vring.num) {
+            vq->last_avail_idx -= vq->vring.num;
+            vq->last_avail_wrap_counter ^= 1;
+        }
         /*
          * immediately push the element, nothing to unmap
          * as both in_num and out_num are set to 0.
          */
         virtqueue_push(vq, &elem, 0);
         dropped++;
-        vq->last_avail_idx += elem.ndescs;
-        if (vq->last_avail_idx >= vq->vring.num) {
-            vq->last_avail_idx -= vq->vring.num;
-            vq->last_avail_wrap_counter ^= 1;
-        }
     }
 
     return dropped;
@@ -1761,6 +2210,9 @@ static unsigned int virtqueue_split_drop_all(VirtQueue *vq)
         if (!virtqueue_get_head(vq, vq->last_avail_idx, &elem.index)) {
             break;
         }
+        if (virtio_vdev_has_feature(vdev, VIRTIO_F_IN_ORDER)) {
+            virtqueue_in_order_record(vq, vq->last_avail_idx, elem.index, 1);
+        }
         vq->inuse++;
         vq->last_avail_idx++;
         if (fEventIdx) {
@@ -1829,7 +2281,7 @@ void *qemu_get_virtqueue_element(VirtIODevice *vdev, QEMUFile *f, size_t sz)
     assert(ARRAY_SIZE(data.in_addr) >= data.in_num);
     assert(ARRAY_SIZE(data.out_addr) >= data.out_num);
 
-    elem = virtqueue_alloc_element(sz, data.out_num, data.in_num);
+    elem = virtqueue_alloc_element(NULL, sz, data.out_num, data.in_num);
     elem->index = data.index;
 
     for (i = 0; i < elem->in_num; i++) {
@@ -2028,6 +2480,11 @@ void virtio_reset(void *opaque)
         vdev->vq[i].notification = true;
         vdev->vq[i].vring.num = vdev->vq[i].vring.num_default;
         vdev->vq[i].inuse = 0;
+        if (vdev->vq[i].used_elems) {
+            /* Forget VIRTIO_F_IN_ORDER completions that were never flushed */
+            memset(vdev->vq[i].used_elems, 0,
+                   sizeof(VirtQueueElement) * vdev->vq[i].vring.num);
+        }
         virtio_virtqueue_reset_region_cache(&vdev->vq[i]);
     }
 }
@@ -2371,6 +2828,30 @@ void virtio_queue_notify(VirtIODevice *vdev, int n)
     }
 }
 
+bool virtio_queue_notify_lockless(VirtIODevice *vdev, int n)
+{
+    VirtQueue *vq = &vdev->vq[n];
+    bool notified = false;
+
+    /* Dropped, like virtio_queue_notify() does */
+    if (unlikely(!vq->vring.desc || vdev->broken)) {
+        return true;
+    }
+
+    /*
+     * Disabling the host notifier takes host_notifier_lock, so the
+     * notifier cannot be cleaned up while we kick it.
+     */
+    WITH_QEMU_LOCK_GUARD(&vdev->host_notifier_lock) {
+        if (vq->host_notifier_enabled) {
+            trace_virtio_queue_notify(vdev, n, vq);
+            event_notifier_set(&vq->host_notifier);
+            notified = true;
+        }
+    }
+    return notified;
+}
+
 uint16_t virtio_queue_vector(VirtIODevice *vdev, int n)
 {
     return n < VIRTIO_QUEUE_MAX ? vdev->vq[n].vector :
@@ -2414,6 +2895,7 @@ VirtQueue *virtio_add_queue(VirtIODevice *vdev, int queue_size,
     vdev->vq[i].handle_aio_output = NULL;
     vdev->vq[i].used_elems = g_malloc0(sizeof(VirtQueueElement) *
                                        queue_size);
+    vdev->vq[i].in_order_pos = g_new0(uint16_t, queue_size);
 
     return &vdev->vq[i];
 }
@@ -2426,6 +2908,9 @@ void virtio_delete_queue(VirtQueue *vq)
     vq->handle_aio_output = NULL;
     g_free(vq->used_elems);
     vq->used_elems = NULL;
+    g_free(vq->in_order_pos);
+    vq->in_order_pos = NULL;
+    virtio_queue_release_element_pool(vq);
     virtio_virtqueue_reset_region_cache(vq);
 }
 
@@ -2638,6 +3123,31 @@ static bool virtio_extra_state_needed(void *opaque)
         k->has_extra_state(qbus->parent);
 }
 
+/* Whether a queue has completed elements waiting for earlier ones */
+static bool virtio_in_order_needed(void *opaque)
+{
+    VirtIODevice *vdev = opaque;
+    int i;
+
+    if (!virtio_vdev_has_feature(vdev, VIRTIO_F_IN_ORDER)) {
+        return false;
+    }
+    for (i = 0; i < VIRTIO_QUEUE_MAX && vdev->vq[i].vring.num; i++) {
+        VirtQueue *vq = &vdev->vq[i];
+        unsigned int off, inflight = virtqueue_in_order_inflight(vq);
+
+        for (off = 0; off < inflight;) {
+            VirtQueueElement *slot = virtqueue_in_order_slot(vq, off);
+
+            if (slot->in_order_filled) {
+                return true;
+            }
+            off += virtqueue_in_order_step(vq, slot);
+        }
+    }
+    return false;
+}
+
 static bool virtio_broken_needed(void *opaque)
 {
     VirtIODevice *vdev = opaque;
@@ -2761,6 +3271,96 @@ static const VMStateInfo vmstate_info_extra_state = {
     .put = put_extra_state,
 };
 
+/*
+ * For every queue, the ring position and length of the elements that were
+ * completed but not flushed yet.  The rest of the in-flight state is
+ * rebuilt from the rings by virtqueue_in_order_rebuild().
+ */
+static int get_in_order_state(QEMUFile *f, void *pv, size_t size,
+                              const VMStateField *field)
+{
+    VirtIODevice *vdev = pv;
+    int i;
+
+    for (i = 0; i < VIRTIO_QUEUE_MAX && vdev->vq[i].vring.num; i++) {
+        VirtQueue *vq = &vdev->vq[i];
+        unsigned int j, count;
+
+        for (j = 0; j < vq->vring.num; j++) {
+            vq->used_elems[j].in_order_filled = false;
+        }
+        count = qemu_get_be16(f);
+        for (j = 0; j < count; j++) {
+            unsigned int pos = qemu_get_be16(f);
+            unsigned int len = qemu_get_be32(f);
+
+            if (pos >= vq->vring.num) {
+                error_report("virtio: completed element at %u out of range "
+                             "for queue %d", pos, i);
+                return -EINVAL;
+            }
+            vq->used_elems[pos].len = len;
+            vq->used_elems[pos].in_order_filled = true;
+        }
+    }
+    return qemu_file_get_error(f);
+}
+
+static int put_in_order_state(QEMUFile *f, void *pv, size_t size,
+                              const VMStateField *field, JSONWriter *vmdesc)
+{
+    VirtIODevice *vdev = pv;
+    int i;
+
+    for (i = 0; i < VIRTIO_QUEUE_MAX && vdev->vq[i].vring.num; i++) {
+        VirtQueue *vq = &vdev->vq[i];
+        unsigned int off, count = 0, inflight = virtqueue_in_order_inflight(vq);
+
+        for (off = 0; off < inflight;) {
+            VirtQueueElement *slot = virtqueue_in_order_slot(vq, off);
+
+            count += slot->in_order_filled;
+            off += virtqueue_in_order_step(vq, slot);
+        }
+        qemu_put_be16(f, count);
+        for (off = 0; off < inflight;) {
+            VirtQueueElement *slot = virtqueue_in_order_slot(vq, off);
+
+            if (slot->in_order_filled) {
+                qemu_put_be16(f, (vq->used_idx + off) % vq->vring.num);
+                qemu_put_be32(f, slot->len);
+            }
+            off += virtqueue_in_order_step(vq, slot);
+        }
+    }
+    return 0;
+}
+
+static const VMStateInfo vmstate_info_in_order_state = {
+    .name = "virtqueue_in_order_state",
+    .get = get_in_order_state,
+    .put = put_in_order_state,
+};
+
+static const VMStateDescription vmstate_virtio_in_order = {
+    .name = "virtio/in_order",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .needed = &virtio_in_order_needed,
+    .fields = (VMStateField[]) {
+        {
+            .name         = "in_order_state",
+            .version_id   = 0,
+            .field_exists = NULL,
+            .size         = 0,
+            .info         = &vmstate_info_in_order_state,
+            .flags        = VMS_SINGLE,
+            .offset       = 0,
+        },
+        VMSTATE_END_OF_LIST()
+    }
+};
+
 static const VMStateDescription vmstate_virtio_extra_state = {
     .name = "virtio/extra_state",
     .version_id = 1,
@@ -2853,6 +3453,7 @@ static const VMStateDescription vmstate_virtio = {
         &vmstate_virtio_started,
         &vmstate_virtio_packed_virtqueues,
         &vmstate_virtio_disabled,
+        &vmstate_virtio_in_order,
         NULL
     }
 };
@@ -3155,6 +3756,9 @@ int virtio_load(VirtIODevice *vdev, QEMUFile *f, int version_id)
                 vdev->vq[i].shadow_avail_idx = vdev->vq[i].last_avail_idx;
                 vdev->vq[i].shadow_avail_wrap_counter =
                                         vdev->vq[i].last_avail_wrap_counter;
+                if (virtio_vdev_has_feature(vdev, VIRTIO_F_IN_ORDER)) {
+                    virtqueue_in_order_rebuild(&vdev->vq[i]);
+                }
                 continue;
             }
 
@@ -3190,6 +3794,9 @@ int virtio_load(VirtIODevice *vdev, QEMUFile *f, int version_id)
                              vdev->vq[i].used_idx);
                 return -1;
             }
+            if (virtio_vdev_has_feature(vdev, VIRTIO_F_IN_ORDER)) {
+                virtqueue_in_order_rebuild(&vdev->vq[i]);
+            }
         }
     }
 
@@ -3581,6 +4188,26 @@ void virtio_queue_aio_set_host_notifier_handler(VirtQueue *vq, AioContext *ctx,
     }
 }
 
+/*
+ * Like virtio_queue_aio_set_host_notifier_handler(), for virtqueues that
+ * are usually non-empty without there being any work to do, such as
+ * receive queues that the driver keeps stocked with buffers.  Polling
+ * them would only spin.
+ */
+void virtio_queue_aio_set_host_notifier_handler_no_poll(VirtQueue *vq,
+        AioContext *ctx, VirtIOHandleAIOOutput handle_output)
+{
+    if (handle_output) {
+        vq->handle_aio_output = handle_output;
+        aio_set_event_notifier(ctx, &vq->host_notifier, true,
+                               virtio_queue_host_notifier_aio_read, NULL);
+    } else {
+        aio_set_event_notifier(ctx, &vq->host_notifier, true, NULL, NULL);
+        virtio_queue_host_notifier_aio_read(&vq->host_notifier);
+        vq->handle_aio_output = NULL;
+    }
+}
+
 void virtio_queue_host_notifier_read(EventNotifier *n)
 {
     VirtQueue *vq = container_of(n, VirtQueue, host_notifier);
@@ -3596,6 +4223,7 @@ EventNotifier *virtio_queue_get_host_notifier(VirtQueue *vq)
 
 void virtio_queue_set_host_notifier_enabled(VirtQueue *vq, bool enabled)
 {
+    QEMU_LOCK_GUARD(&vq->vdev->host_notifier_lock);
     vq->host_notifier_enabled = enabled;
 }
 
@@ -3702,16 +4330,25 @@ static void virtio_device_free_virtqueues(VirtIODevice *vdev)
         if (vdev->vq[i].vring.num == 0) {
             break;
         }
+        virtio_queue_release_element_pool(&vdev->vq[i]);
         virtio_virtqueue_reset_region_cache(&vdev->vq[i]);
     }
     g_free(vdev->vq);
 }
 
+static void virtio_device_instance_init(Object *obj)
+{
+    VirtIODevice *vdev = VIRTIO_DEVICE(obj);
+
+    qemu_mutex_init(&vdev->host_notifier_lock);
+}
+
 static void virtio_device_instance_finalize(Object *obj)
 {
     VirtIODevice *vdev = VIRTIO_DEVICE(obj);
 
     virtio_device_free_virtqueues(vdev);
+    qemu_mutex_destroy(&vdev->host_notifier_lock);
 
     g_free(vdev->config);
     g_free(vdev->vector_queues);
@@ -3726,7 +4363,7 @@ static Property virtio_properties[] = {
     DEFINE_PROP_END_OF_LIST(),
 };
 
-static int virtio_device_start_ioeventfd_impl(VirtIODevice *vdev)
+int virtio_device_start_ioeventfd_impl(VirtIODevice *vdev)
 {
     VirtioBusState *qbus = VIRTIO_BUS(qdev_get_parent_bus(DEVICE(vdev)));
     int i, n, r, err;
@@ -3788,7 +4425,7 @@ int virtio_device_start_ioeventfd(VirtIODevice *vdev)
     return virtio_bus_start_ioeventfd(vbus);
 }
 
-static void virtio_device_stop_ioeventfd_impl(VirtIODevice *vdev)
+void virtio_device_stop_ioeventfd_impl(VirtIODevice *vdev)
 {
     VirtioBusState *qbus = VIRTIO_BUS(qdev_get_parent_bus(DEVICE(vdev)));
     int n, r;
@@ -3859,6 +4496,7 @@ static const TypeInfo virtio_device_info = {
     .parent = TYPE_DEVICE,
     .instance_size = sizeof(VirtIODevice),
     .class_init = virtio_device_class_init,
+    .instance_init = virtio_device_instance_init,
     .instance_finalize = virtio_device_instance_finalize,
     .abstract = true,
     .class_size = sizeof(VirtioDeviceClass),
@@ -78,6 +78,24 @@ typedef struct BlockLatencyHistogram {
     uint64_t *bins;
 } BlockLatencyHistogram;
 
+/* Log-linear latency histogram, always collected.  Latencies below
+ * 2^BLOCK_LATENCY_LOG_SUB_BITS ns each have their own bin; above that,
+ * every power of two is split into 2^BLOCK_LATENCY_LOG_SUB_BITS bins of
+ * equal width, so a bin is never wider than 1/16th of its lower bound.
+ * Latencies of 2^BLOCK_LATENCY_LOG_MAX_BITS ns (~68 s) and more all go
+ * into the last bin.
+ */
+#define BLOCK_LATENCY_LOG_SUB_BITS 4
+#define BLOCK_LATENCY_LOG_MAX_BITS 36
+#define BLOCK_LATENCY_LOG_NBINS \
+    ((BLOCK_LATENCY_LOG_MAX_BITS - BLOCK_LATENCY_LOG_SUB_BITS + 1) << \
+     BLOCK_LATENCY_LOG_SUB_BITS)
+
+typedef struct BlockLatencyLogHistogram {
+    uint64_t count;
+    uint64_t bins[BLOCK_LATENCY_LOG_NBINS];
+} BlockLatencyLogHistogram;
+
 struct BlockAcctStats {
     QemuMutex lock;
     uint64_t nr_bytes[BLOCK_MAX_IOTYPE];
@@ -91,6 +109,7 @@ struct BlockAcctStats {
     bool account_invalid;
     bool account_failed;
     BlockLatencyHistogram latency_histogram[BLOCK_MAX_IOTYPE];
+    BlockLatencyLogHistogram latency_log[BLOCK_MAX_IOTYPE];
 };
 
 typedef struct BlockAcctCookie {
@@ -119,5 +138,9 @@ double block_acct_queue_depth(BlockAcctTimedStats *stats,
 int block_latency_histogram_set(BlockAcctStats *stats, enum BlockAcctType type,
                                 uint64List *boundaries);
 void block_latency_histograms_clear(BlockAcctStats *stats);
+uint64_t block_acct_latency_percentile(BlockAcctStats *stats,
+                                       enum BlockAcctType type,
+                                       double percentile,
+                                       uint64_t *count);
 
 #endif
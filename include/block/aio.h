@@ -20,12 +20,18 @@
 #include "qemu/coroutine.h"
 #include "qemu/queue.h"
 #include "qemu/event_notifier.h"
+#include "qemu/event-loop-stats.h"
 #include "qemu/thread.h"
 #include "qemu/timer.h"
 
 typedef struct BlockAIOCB BlockAIOCB;
 typedef void BlockCompletionFunc(void *opaque, int ret);
 
+/* Setup flags of the io_uring rings of an AioContext */
+#define LURING_SQPOLL       (1 << 0)    /* kernel thread polls submissions */
+#define LURING_IOPOLL       (1 << 1)    /* busy-poll for completions */
+#define LURING_NUM_RINGS    4
+
 typedef struct AIOCBInfo {
     void (*cancel_async)(BlockAIOCB *acb);
     AioContext *(*get_aio_context)(BlockAIOCB *acb);
@@ -51,6 +57,14 @@ typedef void QEMUBHFunc(void *opaque);
 typedef bool AioPollFn(void *opaque);
 typedef void IOHandler(void *opaque);
 
+/*
+ * Called with data read from a file descriptor registered with
+ * aio_set_fd_read_handler().  @len is the number of bytes at @buf, 0 at
+ * end of file, or a negative errno value.  @buf is only valid until the
+ * function returns.
+ */
+typedef void IOReadDoneHandler(void *opaque, void *buf, ssize_t len);
+
 struct Coroutine;
 struct ThreadPool;
 struct LinuxAioState;
@@ -104,6 +118,23 @@ typedef struct {
      * Returns: true if ->wait() should be called, false otherwise.
      */
     bool (*need_wait)(AioContext *ctx);
+
+    /*
+     * dispatch_read:
+     * @ctx: the AioContext
+     * @node: a ready handler registered with aio_set_fd_read_handler() or
+     *        aio_set_event_notifier()
+     *
+     * Pass data that the implementation has already read from the file
+     * descriptor to @node.  May be NULL if the implementation only monitors
+     * readiness.
+     *
+     * Called with ctx->list_lock incremented but not locked.
+     *
+     * Returns: true if data was passed, false if aio_poll() must read the
+     * file descriptor itself.
+     */
+    bool (*dispatch_read)(AioContext *ctx, AioHandler *node);
 } FDMonOps;
 
 /*
@@ -121,6 +152,19 @@ struct BHListSlice {
 
 typedef QSLIST_HEAD(, AioHandler) AioHandlerSList;
 
+/*
+ * A submission that the event loop runs once it has finished dispatching,
+ * so that requests queued by several handlers reach the kernel together.
+ * It is embedded in the queue state that @cb flushes.
+ */
+typedef struct AioDeferredSubmit AioDeferredSubmit;
+struct AioDeferredSubmit {
+    void (*cb)(void *opaque);
+    void *opaque;
+    bool scheduled;
+    QSIMPLEQ_ENTRY(AioDeferredSubmit) next;
+};
+
 struct AioContext {
     GSource source;
 
@@ -189,9 +233,40 @@ struct AioContext {
     bool notified;
     EventNotifier notifier;
 
+    /*
+     * Set by the aio_notify() call that writes to the EventNotifier and
+     * cleared when the EventNotifier is read.  While it is set the
+     * EventNotifier is still readable, so other aio_notify() calls, for
+     * example from several threads completing requests at once, can
+     * skip the write: the event loop cannot block until it has read the
+     * EventNotifier anyway.
+     */
+    bool notify_kicked;
+
+    /* EventNotifier writes done and skipped by aio_notify() */
+    Stat64 notify_sent;
+    Stat64 notify_saved;
+
+    /* Accounting of aio_poll(); GSource dispatch is not included */
+    EventLoopStats stats;
+
     QSLIST_HEAD(, Coroutine) scheduled_coroutines;
     QEMUBH *co_schedule_bh;
 
+    /*
+     * Coroutines for the thread that runs this AioContext, if it attached
+     * the pool with qemu_coroutine_pool_attach().
+     */
+    CoroutinePool *co_pool;
+
+    /*
+     * Submissions deferred with aio_defer_submit() and the nesting depth
+     * of the dispatch phases that will run them.  Only accessed from the
+     * AioContext's home thread.
+     */
+    QSIMPLEQ_HEAD(, AioDeferredSubmit) deferred_submits;
+    int deferred_submit_depth;
+
     /* Thread pool for performing work and receiving completion callbacks.
      * Has its own locking.
      */
@@ -206,14 +281,22 @@ struct AioContext {
 #endif
 #ifdef CONFIG_LINUX_IO_URING
     /*
-     * State for Linux io_uring.  Uses aio_context_acquire/release for
-     * locking.
+     * State for Linux io_uring, one ring per combination of LURING_*
+     * setup flags.  Uses aio_context_acquire/release for locking.
      */
-    struct LuringState *linux_io_uring;
+    struct LuringState *linux_io_uring[LURING_NUM_RINGS];
 
     /* State for file descriptor monitoring using Linux io_uring */
     struct io_uring fdmon_io_uring;
     AioHandlerSList submit_list;
+
+    /* Reads on behalf of handlers, see fdmon-io_uring.c */
+    bool fdmon_io_uring_can_read;
+    bool fdmon_io_uring_rearm;      /* reads were cancelled, re-arm them */
+    bool fdmon_io_uring_disarming;
+    uint16_t fdmon_io_uring_bgid;   /* next provided buffer group id */
+    unsigned fdmon_io_uring_reads;  /* armed read requests */
+    unsigned fdmon_io_uring_pending; /* handlers with undelivered data */
 #endif
 
     /* TimerLists for calling timers - one per clock type.  Has its own
@@ -286,7 +369,15 @@ void aio_context_unref(AioContext *ctx);
  * Bottom halves, timers and callbacks can be created or removed without
  * acquiring the AioContext.
  */
-void aio_context_acquire(AioContext *ctx);
+#define aio_context_acquire(ctx)                        \
+    aio_context_acquire_impl(ctx, __FILE__, __LINE__)
+void aio_context_acquire_impl(AioContext *ctx, const char *file, int line);
+
+/*
+ * Like aio_context_acquire(), but fail instead of waiting if another thread
+ * owns the AioContext.  Returns true if ownership was taken.
+ */
+bool aio_context_try_acquire(AioContext *ctx);
 
 /* Relinquish ownership of the AioContext. */
 void aio_context_release(AioContext *ctx);
@@ -353,6 +444,56 @@ void aio_bh_call(QEMUBH *bh);
  */
 int aio_bh_poll(AioContext *ctx);
 
+/**
+ * aio_defer_submit:
+ * @ctx: the AioContext whose event loop should run @ds
+ * @ds: the deferred submission, with @cb and @opaque already set
+ *
+ * Ask the event loop to call @ds->cb once it has finished dispatching
+ * handlers, bottom halves and timers, so that I/O queued by all the
+ * devices in @ctx is submitted with one system call.  Calling it again
+ * before @ds has run has no effect.
+ *
+ * Return: false if the caller is not inside a dispatch phase of @ctx in
+ * its home thread, in which case it must submit right away.
+ */
+bool aio_defer_submit(AioContext *ctx, AioDeferredSubmit *ds);
+
+/**
+ * aio_cancel_deferred_submit:
+ * @ctx: the AioContext that @ds was deferred to
+ * @ds: the deferred submission
+ *
+ * Remove @ds from @ctx if it has not run yet, before the queue that it
+ * submits is detached from @ctx or freed.
+ *
+ * Return: whether @ds was still pending, in which case the caller has to
+ * submit its queue itself.
+ */
+bool aio_cancel_deferred_submit(AioContext *ctx, AioDeferredSubmit *ds);
+
+/**
+ * aio_defer_submit_begin: Start a dispatch phase of the event loop.
+ *
+ * aio_defer_submit_begin, aio_defer_submit_end and aio_run_deferred_submits
+ * are internal functions used by the QEMU main loop.
+ */
+void aio_defer_submit_begin(AioContext *ctx);
+
+/**
+ * aio_defer_submit_end: End a dispatch phase of the event loop, running
+ * the submissions deferred during it.
+ */
+void aio_defer_submit_end(AioContext *ctx);
+
+/**
+ * aio_run_deferred_submits: Run the submissions deferred so far, for
+ * example before blocking in a nested aio_poll().
+ *
+ * Return: whether any deferred submission ran.
+ */
+bool aio_run_deferred_submits(AioContext *ctx);
+
 /**
  * qemu_bh_schedule: Schedule a bottom half.
  *
@@ -443,6 +584,36 @@ void aio_set_fd_handler(AioContext *ctx,
                         AioPollFn *io_poll,
                         void *opaque);
 
+#ifdef CONFIG_POSIX
+/**
+ * aio_set_fd_read_handler:
+ * @ctx: the aio context
+ * @fd: the file descriptor
+ * @is_external: whether this is an external event source
+ * @io_read_done: called with the data read from @fd, or NULL to remove
+ *                the handler
+ * @read_size: maximum number of bytes passed to @io_read_done at a time
+ * @io_poll: userspace polling callback, may be NULL
+ * @opaque: passed to the callbacks
+ *
+ * Like aio_set_fd_handler() with only a read callback, except that the
+ * AioContext reads from @fd itself and hands the data to @io_read_done.
+ * With io_uring fd monitoring this is done with multishot reads into
+ * buffers provided to the kernel, so that no read(2) is needed per event.
+ *
+ * Data that was read but not yet passed to @io_read_done when the handler
+ * is removed is discarded, so only use this for file descriptors that are
+ * read until they are torn down.
+ */
+void aio_set_fd_read_handler(AioContext *ctx,
+                             int fd,
+                             bool is_external,
+                             IOReadDoneHandler *io_read_done,
+                             size_t read_size,
+                             AioPollFn *io_poll,
+                             void *opaque);
+#endif
+
 /* Set polling begin/end callbacks for a file descriptor that has already been
  * registered with aio_set_fd_handler.  Do nothing if the file descriptor is
  * not registered.
@@ -487,11 +658,17 @@ struct LinuxAioState *aio_setup_linux_aio(AioContext *ctx, Error **errp);
 /* Return the LinuxAioState bound to this AioContext */
 struct LinuxAioState *aio_get_linux_aio(AioContext *ctx);
 
-/* Setup the LuringState bound to this AioContext */
-struct LuringState *aio_setup_linux_io_uring(AioContext *ctx, Error **errp);
+/*
+ * Setup the LuringState bound to this AioContext for the given LURING_*
+ * flags.  All SQPOLL rings of an AioContext share one kernel thread.
+ */
+struct LuringState *aio_setup_linux_io_uring(AioContext *ctx,
+                                             unsigned int flags,
+                                             Error **errp);
 
-/* Return the LuringState bound to this AioContext */
-struct LuringState *aio_get_linux_io_uring(AioContext *ctx);
+/* Return the LuringState bound to this AioContext for the given flags */
+struct LuringState *aio_get_linux_io_uring(AioContext *ctx,
+                                           unsigned int flags);
 /**
  * aio_timer_new_with_attrs:
  * @ctx: the aio context
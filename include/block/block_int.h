@@ -32,6 +32,7 @@
 #include "qemu/stats64.h"
 #include "qemu/timer.h"
 #include "qemu/hbitmap.h"
+#include "qemu/interval-tree.h"
 #include "block/snapshot.h"
 #include "qemu/throttle.h"
 
@@ -60,6 +61,7 @@
 #define BLOCK_OPT_DATA_FILE_RAW     "data_file_raw"
 #define BLOCK_OPT_COMPRESSION_TYPE  "compression_type"
 #define BLOCK_OPT_EXTL2             "extended_l2"
+#define BLOCK_OPT_JOURNAL_SIZE      "journal_size"
 
 #define BLOCK_PROBE_BUF_SIZE        512
 
@@ -85,6 +87,7 @@ typedef struct BdrvTrackedRequest {
     bool serialising;
     int64_t overlap_offset;
     int64_t overlap_bytes;
+    IntervalTreeNode overlap_node; /* keyed by overlap_offset/bytes */
 
     QLIST_ENTRY(BdrvTrackedRequest) list;
     Coroutine *co; /* owner, used for deadlock detection */
@@ -95,6 +98,38 @@ typedef struct BdrvTrackedRequest {
 
 int bdrv_check_request(int64_t offset, int64_t bytes, Error **errp);
 
+/* One in this many BlockBackend requests is traced */
+#define BDRV_TRACE_SAMPLE_INTERVAL 64
+
+/*
+ * Where the sampled requests spent their time in a node, in nanoseconds.
+ * @self_ns is what is left of @total_ns after taking out the requests to
+ * children and the waits; for protocol nodes it is the time spent in the
+ * host.
+ */
+typedef struct BdrvTraceStats {
+    Stat64 requests;
+    Stat64 total_ns;
+    Stat64 self_ns;
+    Stat64 serialising_wait_ns;
+    Stat64 lock_wait_ns;
+    Stat64 throttle_wait_ns;
+} BdrvTraceStats;
+
+/*
+ * A traced request in one node, on the stack of the coroutine running it.
+ * The innermost frame is the coroutine's CoroutineTrace.  Requests made
+ * by other coroutines on behalf of a traced request are not traced.
+ */
+typedef struct BdrvTraceFrame {
+    CoroutineTrace co_trace;
+    BlockDriverState *bs; /* NULL for the frame that starts the trace */
+    int64_t start_ns;
+    int64_t child_ns;
+    int64_t serialising_wait_ns;
+    struct BdrvTraceFrame *parent;
+} BdrvTraceFrame;
+
 struct BlockDriver {
     const char *format_name;
     int instance_size;
@@ -154,6 +189,14 @@ struct BlockDriver {
      */
     bool supports_backing;
 
+    /*
+     * Set if requests may be submitted from any AioContext, not only from
+     * the node's own.  The driver must then queue each request on the
+     * submitting context, and bdrv_io_plug()/bdrv_io_unplug() call it for
+     * every nesting level so that it can count plugs per context.
+     */
+    bool supports_multiqueue;
+
     /* For handling image reopen for split or non-split files */
     int (*bdrv_reopen_prepare)(BDRVReopenState *reopen_state,
                                BlockReopenQueue *queue, Error **errp);
@@ -242,6 +285,20 @@ struct BlockDriver {
         int64_t offset, int bytes,
         BlockCompletionFunc *cb, void *opaque);
 
+    /*
+     * Start a read or write without a coroutine, for the fast path of
+     * bdrv_aio_prw_direct().  @offset and the size of @qiov are aligned to
+     * 'request_alignment'.  The request completes in @ctx.  @cb may be
+     * called before the function returns.
+     *
+     * Returns 0 if @cb will be called, or a negative errno (typically
+     * -ENOTSUP) if the request must go through bdrv_co_preadv() or
+     * bdrv_co_pwritev() instead.
+     */
+    int (*bdrv_aio_prw_direct)(BlockDriverState *bs, uint64_t offset,
+        QEMUIOVector *qiov, bool is_write, AioContext *ctx,
+        BlockCompletionFunc *cb, void *opaque);
+
     int coroutine_fn (*bdrv_co_readv)(BlockDriverState *bs,
         int64_t sector_num, int nb_sectors, QEMUIOVector *qiov);
 
@@ -448,6 +505,17 @@ struct BlockDriver {
                                                  Error **errp);
     BlockStatsSpecific *(*bdrv_get_specific_stats)(BlockDriverState *bs);
 
+    /*
+     * Return a host file descriptor whose contents at offset
+     * N + *@fd_offset are the contents of @bs at offset N, or -ENOTSUP.
+     * Only drivers that neither transform data, nor remap it other than
+     * by a constant offset, nor need to see the requests may implement
+     * this; drivers with a child forward the call to it.  Callers may
+     * only use the descriptor with calls that take an explicit offset,
+     * such as sendfile().
+     */
+    int (*bdrv_get_host_fd)(BlockDriverState *bs, int64_t *fd_offset);
+
     int coroutine_fn (*bdrv_save_vmstate)(BlockDriverState *bs,
                                           QEMUIOVector *qiov,
                                           int64_t pos);
@@ -974,6 +1042,9 @@ struct BlockDriverState {
     /* Offset after the highest byte written to */
     Stat64 wr_highest_offset;
 
+    /* Latency breakdown of the sampled requests */
+    BdrvTraceStats trace_stats;
+
     /* If true, copy read backing sectors into image.  Can be >1 if more
      * than one client has requested copy-on-read.  Accessed with atomic
      * ops.
@@ -1003,12 +1074,24 @@ struct BlockDriverState {
     /* Protected by reqs_lock.  */
     CoMutex reqs_lock;
     QLIST_HEAD(, BdrvTrackedRequest) tracked_requests;
+    IntervalTreeRoot tracked_overlaps;    /* tracked_requests by overlap */
     CoQueue flush_queue;                  /* Serializing flush queue */
     bool active_flush_req;                /* Flush request in flight? */
 
     /* Only read/written by whoever has set active_flush_req to true.  */
     unsigned int flushed_gen;             /* Flushed write generation */
 
+    /*
+     * Layers of the backing chain that earlier block status walks from
+     * this node found to own a range, see block/io.c.  chain_status_gen
+     * is bumped whenever they may have changed; accessed with atomic ops.
+     */
+    QemuMutex chain_status_lock;
+    IntervalTreeRoot chain_status;
+    QTAILQ_HEAD(, BdrvChainStatus) chain_status_lru;
+    int chain_status_entries;
+    unsigned int chain_status_gen;
+
     /* BdrvChild links to this node may never be frozen */
     bool never_freeze;
 };
@@ -1052,6 +1135,9 @@ int coroutine_fn bdrv_co_pwritev(BdrvChild *child,
 int coroutine_fn bdrv_co_pwritev_part(BdrvChild *child,
     int64_t offset, int64_t bytes,
     QEMUIOVector *qiov, size_t qiov_offset, BdrvRequestFlags flags);
+int bdrv_aio_prw_direct(BdrvChild *child, int64_t offset,
+                        QEMUIOVector *qiov, bool is_write, AioContext *ctx,
+                        BlockCompletionFunc *cb, void *opaque);
 
 static inline int coroutine_fn bdrv_co_pread(BdrvChild *child,
     int64_t offset, unsigned int bytes, void *buf, BdrvRequestFlags flags)
@@ -1077,6 +1163,11 @@ bool coroutine_fn bdrv_make_request_serialising(BdrvTrackedRequest *req,
                                                 uint64_t align);
 BdrvTrackedRequest *coroutine_fn bdrv_co_get_self_request(BlockDriverState *bs);
 
+void coroutine_fn bdrv_trace_start(BdrvTraceFrame *frame);
+bool coroutine_fn bdrv_trace_begin(BdrvTraceFrame *frame,
+                                   BlockDriverState *bs);
+void coroutine_fn bdrv_trace_end(BdrvTraceFrame *frame);
+
 int get_tmp_filename(char *filename, int size);
 BlockDriver *bdrv_probe_all(const uint8_t *buf, int buf_size,
                             const char *filename);
@@ -1364,6 +1455,17 @@ bool bdrv_dirty_bitmap_merge_internal(BdrvDirtyBitmap *dest,
 void bdrv_inc_in_flight(BlockDriverState *bs);
 void bdrv_dec_in_flight(BlockDriverState *bs);
 
+/**
+ * bdrv_chain_status_invalidate:
+ *
+ * Forget which layer owns [@offset, @offset + @bytes) in the block status
+ * caches of @bs and of every node that has @bs in its backing chain.  Must
+ * be called whenever the allocation status of @bs may have changed without
+ * going through the generic write path.
+ */
+void bdrv_chain_status_invalidate(BlockDriverState *bs, int64_t offset,
+                                  int64_t bytes);
+
 void blockdev_close_all_bdrv_states(void);
 
 int coroutine_fn bdrv_co_copy_range_from(BdrvChild *src, int64_t src_offset,
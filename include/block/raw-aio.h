@@ -52,6 +52,9 @@ LinuxAioState *laio_init(Error **errp);
 void laio_cleanup(LinuxAioState *s);
 int coroutine_fn laio_co_submit(BlockDriverState *bs, LinuxAioState *s, int fd,
                                 uint64_t offset, QEMUIOVector *qiov, int type);
+int laio_submit(BlockDriverState *bs, LinuxAioState *s, int fd,
+                uint64_t offset, QEMUIOVector *qiov, int type,
+                BlockCompletionFunc *cb, void *opaque);
 void laio_detach_aio_context(LinuxAioState *s, AioContext *old_context);
 void laio_attach_aio_context(LinuxAioState *s, AioContext *new_context);
 void laio_io_plug(BlockDriverState *bs, LinuxAioState *s);
@@ -60,14 +63,24 @@ void laio_io_unplug(BlockDriverState *bs, LinuxAioState *s);
 /* io_uring.c - Linux io_uring implementation */
 #ifdef CONFIG_LINUX_IO_URING
 typedef struct LuringState LuringState;
-LuringState *luring_init(Error **errp);
+LuringState *luring_init(unsigned int flags, LuringState *sq_share,
+                         Error **errp);
 void luring_cleanup(LuringState *s);
 int coroutine_fn luring_co_submit(BlockDriverState *bs, LuringState *s, int fd,
-                                uint64_t offset, QEMUIOVector *qiov, int type);
+                                uint64_t offset, QEMUIOVector *qiov, int type,
+                                bool fixed);
+int luring_submit(BlockDriverState *bs, LuringState *s, int fd,
+                  uint64_t offset, QEMUIOVector *qiov, int type, bool fixed,
+                  BlockCompletionFunc *cb, void *opaque);
 void luring_detach_aio_context(LuringState *s, AioContext *old_context);
 void luring_attach_aio_context(LuringState *s, AioContext *new_context);
 void luring_io_plug(BlockDriverState *bs, LuringState *s);
 void luring_io_unplug(BlockDriverState *bs, LuringState *s);
+void luring_register_buf(void *host, size_t size);
+void luring_unregister_buf(void *host);
+void luring_forget_fd(int fd);
+bool luring_register_guest_ram(Error **errp);
+void luring_unregister_guest_ram(void);
 #endif
 
 #ifdef _WIN32
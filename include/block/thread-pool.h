@@ -24,14 +24,43 @@ typedef int ThreadPoolFunc(void *opaque);
 
 typedef struct ThreadPool ThreadPool;
 
+/*
+ * Latency sensitive requests are cheap operations such as fsync or discard
+ * that are run before any queued bulk request, and always have a few
+ * threads left that bulk requests cannot occupy.
+ */
+typedef enum ThreadPoolPriority {
+    THREAD_POOL_PRIO_LATENCY,
+    THREAD_POOL_PRIO_BULK,
+    THREAD_POOL_PRIO__MAX,
+} ThreadPoolPriority;
+
+typedef struct ThreadPoolStats {
+    uint64_t submitted[THREAD_POOL_PRIO__MAX];
+    uint64_t completed;
+    uint64_t canceled;
+    /* requests that a worker took right after the previous one */
+    uint64_t batched;
+    /* idle workers woken up to run a request */
+    uint64_t wakeups;
+    uint64_t max_queued;
+} ThreadPoolStats;
+
 ThreadPool *thread_pool_new(struct AioContext *ctx);
 void thread_pool_free(ThreadPool *pool);
 
 BlockAIOCB *thread_pool_submit_aio(ThreadPool *pool,
         ThreadPoolFunc *func, void *arg,
         BlockCompletionFunc *cb, void *opaque);
+BlockAIOCB *thread_pool_submit_aio_prio(ThreadPool *pool,
+        ThreadPoolPriority prio, ThreadPoolFunc *func, void *arg,
+        BlockCompletionFunc *cb, void *opaque);
 int coroutine_fn thread_pool_submit_co(ThreadPool *pool,
         ThreadPoolFunc *func, void *arg);
+int coroutine_fn thread_pool_submit_co_prio(ThreadPool *pool,
+        ThreadPoolPriority prio, ThreadPoolFunc *func, void *arg);
 void thread_pool_submit(ThreadPool *pool, ThreadPoolFunc *func, void *arg);
 
+void thread_pool_get_stats(ThreadPool *pool, ThreadPoolStats *stats);
+
 #endif
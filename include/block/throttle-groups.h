@@ -49,6 +49,15 @@ typedef struct ThrottleGroupMember {
      */
     unsigned int restart_pending;
 
+    /* I/O that has already been accounted in the group and that this
+     * member can spend without taking the ThrottleGroup lock.  Only
+     * replenished under that lock, spent with atomic operations.
+     * Requests larger than lease_op_size don't use the lease.
+     */
+    int lease_ops[2];
+    int lease_bytes[2];
+    int lease_op_size;
+
     /* The following fields are protected by the ThrottleGroup lock.
      * See the ThrottleGroup documentation for details.
      * throttle_state tells us if I/O limits are configured. */
@@ -291,6 +291,30 @@ typedef enum {
 QCryptoTLSSessionHandshakeStatus
 qcrypto_tls_session_get_handshake_status(QCryptoTLSSession *sess);
 
+/**
+ * qcrypto_tls_session_enable_ktls_tx:
+ * @sess: the TLS session object
+ * @fd: the socket that the session runs over
+ * @errp: pointer to a NULL-initialized error object
+ *
+ * Hand the encryption of outgoing records to the kernel once the
+ * handshake is complete.  From then on payload data must be written
+ * to @fd directly instead of with qcrypto_tls_session_write(), while
+ * incoming data is still read with qcrypto_tls_session_read().
+ *
+ * This is only possible on Linux, for TLS 1.2 and 1.3 sessions using
+ * AES-GCM.  GnuTLS cannot send any record by itself afterwards: a
+ * qcrypto_tls_session_write() call, an alert, or the reply to a TLS 1.3
+ * key update requested by the peer makes the operation that triggered
+ * it fail with EIO, rather than corrupting the stream.
+ *
+ * Returns: 0 on success, -1 on error, in which case the session
+ * can be used as before
+ */
+int qcrypto_tls_session_enable_ktls_tx(QCryptoTLSSession *sess,
+                                       int fd,
+                                       Error **errp);
+
 /**
  * qcrypto_tls_session_get_key_size:
  * @sess: the TLS session object
@@ -76,8 +76,18 @@ typedef uint64_t target_ulong;
 
 #if !defined(CONFIG_USER_ONLY) && defined(CONFIG_TCG)
 
-/* use a fully associative victim tlb of 8 entries */
-#define CPU_VTLB_SIZE 8
+/*
+ * The victim tlb is set associative: a page hashes to one set of
+ * CPU_VTLB_WAYS entries (2 or 4 is sensible), and only that set is
+ * probed on a miss in the main tlb.
+ */
+#define CPU_VTLB_WAYS_BITS 2
+#define CPU_VTLB_SETS_BITS 4
+#define CPU_VTLB_WAYS (1 << CPU_VTLB_WAYS_BITS)
+#define CPU_VTLB_SIZE (CPU_VTLB_WAYS << CPU_VTLB_SETS_BITS)
+
+/* use a fully associative table of 16 large page translations */
+#define CPU_LTLB_SIZE 16
 
 #if HOST_LONG_BITS == 32 && TARGET_LONG_BITS == 32
 #define CPU_TLB_ENTRY_BITS 4
@@ -150,6 +160,19 @@ typedef struct CPUIOTLBEntry {
     MemTxAttrs attrs;
 } CPUIOTLBEntry;
 
+/*
+ * A large page translation, as last installed by tlb_set_page_with_attrs.
+ * A miss within [addr, addr + ~mask] can be refilled from here without
+ * walking the guest page tables again.  An unused entry has addr == -1.
+ */
+typedef struct CPULTLBEntry {
+    target_ulong addr;
+    target_ulong mask;
+    hwaddr paddr;
+    MemTxAttrs attrs;
+    int prot;
+} CPULTLBEntry;
+
 /*
  * Data elements that are per MMU mode, minus the bits accessed by
  * the TCG fast path.
@@ -168,11 +191,15 @@ typedef struct CPUTLBDesc {
     /* maximum number of entries observed in the window */
     size_t window_max_entries;
     size_t n_used_entries;
-    /* The next index to use in the tlb victim table.  */
+    /* The next way to replace within a full set of the victim table.  */
     size_t vindex;
-    /* The tlb victim table, in two parts.  */
+    /* The tlb victim table, in two parts, indexed by set then way.  */
     CPUTLBEntry vtable[CPU_VTLB_SIZE];
     CPUIOTLBEntry viotlb[CPU_VTLB_SIZE];
+    /* The next index to use in the large page table.  */
+    size_t lindex;
+    /* Large page translations, consulted before tlb_fill.  */
+    CPULTLBEntry ltable[CPU_LTLB_SIZE];
     /* The iotlb.  */
     CPUIOTLBEntry *iotlb;
 } CPUTLBDesc;
@@ -208,6 +235,11 @@ typedef struct CPUTLBCommon {
     size_t full_flush_count;
     size_t part_flush_count;
     size_t elide_flush_count;
+    /* Main tlb misses that were, or were not, found in the victim tlb. */
+    size_t vtlb_hit_count;
+    size_t vtlb_miss_count;
+    /* Victim tlb misses refilled from the large page table.  */
+    size_t ltlb_hit_count;
 } CPUTLBCommon;
 
 /*
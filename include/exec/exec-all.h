@@ -455,6 +455,10 @@ struct TranslationBlock {
 #define CF_USE_ICOUNT  0x00020000
 #define CF_INVALID     0x00040000 /* TB is stale. Set with @jmp_lock held */
 #define CF_PARALLEL    0x00080000 /* Generate code for a parallel context */
+#define CF_TRACE       0x00100000 /* Translate as a hot trace; never kept in
+                                     the cflags of a TB */
+#define CF_SMC_CHECK   0x00200000 /* Check the guest code on entry; never
+                                     kept in the cflags of a TB */
 #define CF_CLUSTER_MASK 0xff000000 /* Top 8 bits are cluster ID */
 #define CF_CLUSTER_SHIFT 24
 
@@ -469,6 +473,22 @@ struct TranslationBlock {
     uint16_t size;
     uint16_t icount;
 
+    /* Executions counted on entry, see tb_hot_threshold */
+    uint32_t exec_count;
+
+    /*
+     * Guest pc that jump 0 was first chained to, or -1.  Used as the tag
+     * of the inline cache emitted by translator_indirect_jump().
+     */
+    target_ulong ibc_pc;
+
+    /*
+     * Copy of the guest code, for blocks translated with CF_SMC_CHECK.
+     * Such blocks do not write-protect their page but compare the code
+     * against this copy on entry instead.
+     */
+    void *smc_copy;
+
     struct tb_tc tc;
 
     /* first and second physical page containing code. The lower bit
@@ -582,9 +602,31 @@ struct MemoryRegionSection *iotlb_to_section(CPUState *cpu,
 
 #if defined(CONFIG_USER_ONLY)
 void mmap_lock(void);
+void mmap_lock_pc(target_ulong pc);
 void mmap_unlock(void);
 bool have_mmap_lock(void);
 
+#ifdef TARGET_X86_64
+/**
+ * user_fast_syscall() - handle a syscall without leaving cpu_exec()
+ * @env: CPUArchState
+ * @num: guest syscall number
+ * @arg1: first syscall argument
+ * @arg2: second syscall argument
+ * @ret: set to the return value of the syscall
+ *
+ * Handles the few syscalls that a vDSO implements in guest code, such as
+ * clock_gettime(): they take at most two arguments, do not block and only
+ * write guest memory.  Returns false if the syscall must be raised as an
+ * exception and go through cpu_loop().
+ *
+ * Only x86_64's syscall instruction, whose helper passes the 64-bit
+ * argument registers, uses it.
+ */
+bool user_fast_syscall(CPUArchState *env, int num, target_ulong arg1,
+                       target_ulong arg2, target_ulong *ret);
+#endif
+
 /**
  * get_page_addr_code() - user-mode version
  * @env: CPUArchState
@@ -619,6 +661,7 @@ static inline tb_page_addr_t get_page_addr_code_hostp(CPUArchState *env,
 }
 #else
 static inline void mmap_lock(void) {}
+static inline void mmap_lock_pc(target_ulong pc) {}
 static inline void mmap_unlock(void) {}
 
 /**
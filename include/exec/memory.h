@@ -58,6 +58,7 @@ static inline void fuzz_dma_read_cb(size_t addr,
 extern bool global_dirty_log;
 
 typedef struct MemoryRegionOps MemoryRegionOps;
+typedef struct MemoryRegionBatchWrite MemoryRegionBatchWrite;
 
 struct ReservedRegion {
     hwaddr low;
@@ -167,6 +168,13 @@ static inline void iommu_notifier_init(IOMMUNotifier *n, IOMMUNotify fn,
     n->iommu_idx = iommu_idx;
 }
 
+/* One of the writes passed to MemoryRegionOps.write_batch */
+struct MemoryRegionBatchWrite {
+    hwaddr addr;
+    uint64_t data;
+    unsigned size;
+};
+
 /*
  * Memory region callbacks
  */
@@ -193,6 +201,15 @@ struct MemoryRegionOps {
                                     uint64_t data,
                                     unsigned size,
                                     MemTxAttrs attrs);
+    /*
+     * Optional.  Perform @n coalesced writes, in order, with the same
+     * result as calling @write for each of them; this lets the device
+     * skip the work for writes that a later one overrides.  Only used
+     * for writes that @write would receive unsplit.
+     */
+    void (*write_batch)(void *opaque,
+                        const MemoryRegionBatchWrite *writes,
+                        unsigned n);
 
     enum device_endian endianness;
     /* Guest-visible constraints: */
@@ -461,6 +478,7 @@ struct MemoryRegion {
     bool nonvolatile;
     bool rom_device;
     bool flush_coalesced_mmio;
+    bool global_locking;
     uint8_t dirty_log_mask;
     bool is_iommu;
     RAMBlock *ram_block;
@@ -484,6 +502,7 @@ struct MemoryRegion {
     QTAILQ_HEAD(, MemoryRegion) subregions;
     QTAILQ_ENTRY(MemoryRegion) subregions_link;
     QTAILQ_HEAD(, CoalescedMemoryRange) coalesced;
+    unsigned coalesced_doorbells;
     const char *name;
     unsigned ioeventfd_nb;
     MemoryRegionIoeventfd *ioeventfds;
@@ -616,6 +635,18 @@ struct MemoryListener {
      */
     void (*log_sync)(MemoryListener *listener, MemoryRegionSection *section);
 
+    /**
+     * @log_sync_global:
+     *
+     * This is the global version of @log_sync when the listener does
+     * not have a way to synchronize the log with finer granularity.
+     * When the listener registers with @log_sync_global defined, then
+     * its @log_sync must be NULL.  Vice versa.
+     *
+     * @listener: The #MemoryListener.
+     */
+    void (*log_sync_global)(MemoryListener *listener);
+
     /**
      * @log_clear:
      *
@@ -737,6 +768,13 @@ struct MemoryListener {
     QTAILQ_ENTRY(MemoryListener) link_as;
 };
 
+typedef struct AddressSpaceMapClient {
+    QEMUBH *bh;
+    QLIST_ENTRY(AddressSpaceMapClient) link;
+} AddressSpaceMapClient;
+
+#define DEFAULT_MAX_BOUNCE_BUFFER_SIZE (4096)
+
 /**
  * struct AddressSpace: describes a mapping of addresses to #MemoryRegion objects
  */
@@ -753,6 +791,16 @@ struct AddressSpace {
     struct MemoryRegionIoeventfd *ioeventfds;
     QTAILQ_HEAD(, MemoryListener) listeners;
     QTAILQ_ENTRY(AddressSpace) address_spaces_link;
+
+    /*
+     * Maximum number of bytes in bounce buffers of address_space_map(),
+     * and number of bytes currently allocated to them.
+     */
+    size_t max_bounce_buffer_size;
+    size_t bounce_buffer_size;
+    /* List of callbacks to invoke when bounce buffer space is released */
+    QemuMutex map_client_list_lock;
+    QLIST_HEAD(, AddressSpaceMapClient) map_client_list;
 };
 
 typedef struct AddressSpaceDispatch AddressSpaceDispatch;
@@ -769,6 +817,12 @@ struct FlatView {
     unsigned nr_allocated;
     struct AddressSpaceDispatch *dispatch;
     MemoryRegion *root;
+    /*
+     * The top-level regions (those without a container) of every subtree
+     * rendered into this view, through the root or an alias.  The view
+     * only has to be generated again when one of them changes.
+     */
+    GHashTable *tops;
 };
 
 static inline FlatView *address_space_to_flatview(AddressSpace *as)
@@ -1773,6 +1827,23 @@ void memory_region_add_coalescing(MemoryRegion *mr,
                                   hwaddr offset,
                                   uint64_t size);
 
+/**
+ * memory_region_add_coalescing_doorbell: Enable memory coalescing for a
+ *                                        doorbell register.
+ *
+ * Like memory_region_add_coalescing(), for a register whose writes must
+ * reach the device even if the guest performs no other access to it, such
+ * as a queue tail or notify register.  Pending coalesced writes are
+ * flushed every millisecond while such a range exists.
+ *
+ * @mr: the memory region to be updated.
+ * @offset: the start of the range within the region to be coalesced.
+ * @size: the size of the subrange to be coalesced.
+ */
+void memory_region_add_coalescing_doorbell(MemoryRegion *mr,
+                                           hwaddr offset,
+                                           uint64_t size);
+
 /**
  * memory_region_clear_coalescing: Disable MMIO coalescing for the region.
  *
@@ -1784,6 +1855,34 @@ void memory_region_add_coalescing(MemoryRegion *mr,
  */
 void memory_region_clear_coalescing(MemoryRegion *mr);
 
+/**
+ * memory_region_can_write_batch: Check if a coalesced write can be passed
+ *                                to MemoryRegionOps.write_batch.
+ *
+ * @mr: the memory region, which must not be RAM.
+ * @addr: the address within the region.
+ * @size: the size of the write in bytes.
+ * @attrs: memory transaction attributes.
+ */
+bool memory_region_can_write_batch(MemoryRegion *mr, hwaddr addr,
+                                   unsigned size, MemTxAttrs attrs);
+
+/**
+ * memory_region_dispatch_write_batch: Pass writes to
+ *                                     MemoryRegionOps.write_batch.
+ *
+ * The writes must have been checked with memory_region_can_write_batch().
+ * Their data is in host endianness, as for memory_region_dispatch_write()
+ * with a MemOp of size_memop(size), and is converted in place.
+ *
+ * @mr: the memory region.
+ * @writes: the writes, with addresses relative to @mr.
+ * @n: the number of writes.
+ */
+void memory_region_dispatch_write_batch(MemoryRegion *mr,
+                                        MemoryRegionBatchWrite *writes,
+                                        unsigned n);
+
 /**
  * memory_region_set_flush_coalesced: Enforce memory coalescing flush before
  *                                    accesses.
@@ -1809,6 +1908,49 @@ void memory_region_set_flush_coalesced(MemoryRegion *mr);
  */
 void memory_region_clear_flush_coalesced(MemoryRegion *mr);
 
+/**
+ * memory_region_clear_global_locking: Declares that access processing does
+ *                                     not depend on the QEMU global lock.
+ *
+ * By clearing this property, accesses to the memory region will be processed
+ * outside of QEMU's global lock (unless the lock is held on when issuing the
+ * access request).  In this case, the device model implementing the access
+ * handlers is responsible for synchronization of concurrency.  Handlers that
+ * need the global lock for part of their work, for example to raise an
+ * interrupt or to touch state shared with other callbacks, can take it with
+ * QEMU_IOTHREAD_LOCK_GUARD().
+ *
+ * Regions that flush coalesced MMIO before each access are still dispatched
+ * with the global lock held, because the flush replays writes to other
+ * devices.
+ *
+ * @mr: the memory region to be updated.
+ */
+void memory_region_clear_global_locking(MemoryRegion *mr);
+
+/**
+ * memory_region_set_global_locking: Declares the access processing requires
+ *                                   QEMU's global lock.
+ *
+ * When this is invoked, accesses to the memory region will be processed while
+ * holding the global lock of QEMU.  This is the default behavior of memory
+ * regions.
+ *
+ * @mr: the memory region to be updated.
+ */
+void memory_region_set_global_locking(MemoryRegion *mr);
+
+/**
+ * memory_region_needs_global_locking: Whether accesses to the region have to
+ *                                     be dispatched under the global lock.
+ *
+ * @mr: the memory region being accessed.
+ */
+static inline bool memory_region_needs_global_locking(MemoryRegion *mr)
+{
+    return mr->global_locking || mr->flush_coalesced_mmio;
+}
+
 /**
  * memory_region_add_eventfd: Request an eventfd to be triggered when a word
  *                            is written to a location.
@@ -2402,8 +2544,8 @@ bool address_space_access_valid(AddressSpace *as, hwaddr addr, hwaddr len,
  * May return %NULL and set *@plen to zero(0), if resources needed to perform
  * the mapping are exhausted.
  * Use only for reads OR writes - not for read-modify-write operations.
- * Use cpu_register_map_client() to know when retrying the map operation is
- * likely to succeed.
+ * Use address_space_register_map_client() to know when retrying the map
+ * operation is likely to succeed.
  *
  * @as: #AddressSpace to be accessed
  * @addr: address within that address space
@@ -2428,6 +2570,29 @@ void *address_space_map(AddressSpace *as, hwaddr addr,
 void address_space_unmap(AddressSpace *as, void *buffer, hwaddr len,
                          bool is_write, hwaddr access_len);
 
+/*
+ * address_space_register_map_client: Register a callback to invoke when
+ * resources for address_space_map() are available again.
+ *
+ * address_space_map may fail when there are not enough resources available,
+ * such as when bounce buffer memory would exceed the limit.  The callback can
+ * be used to retry the address_space_map operation.  Note that the callback
+ * gets automatically removed after firing.
+ *
+ * @as: #AddressSpace to be accessed
+ * @bh: callback to invoke when address_space_map() retry is appropriate
+ */
+void address_space_register_map_client(AddressSpace *as, QEMUBH *bh);
+
+/*
+ * address_space_unregister_map_client: Unregister a callback that has
+ * previously been registered and not fired yet.
+ *
+ * @as: #AddressSpace to be accessed
+ * @bh: callback to unregister
+ */
+void address_space_unregister_map_client(AddressSpace *as, QEMUBH *bh);
+
 
 /* Internal functions, part of the implementation of address_space_read.  */
 MemTxResult address_space_read_full(AddressSpace *as, hwaddr addr,
@@ -2605,6 +2770,17 @@ bool ram_block_discard_is_disabled(void);
  */
 bool ram_block_discard_is_required(void);
 
+/*
+ * Announce a discard from a thread that does not hold the BQL. Fails if
+ * discarding is disabled; otherwise ram_block_discard_disable() waits for
+ * the matching ram_block_discard_end() before it returns, so the discard
+ * cannot race with a technology that starts to pin memory.
+ *
+ * Returns true if the caller may discard.
+ */
+bool ram_block_discard_try_begin(void);
+void ram_block_discard_end(void);
+
 #endif
 
 #endif
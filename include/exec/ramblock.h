@@ -59,6 +59,21 @@ struct RAMBlock {
      */
     unsigned long *clear_bmap;
     uint8_t clear_bmap_shift;
+
+    /*
+     * With mapped-ram, the bitmap of the pages present in the migration
+     * file, and where the bitmap and the pages of this block live in it.
+     */
+    unsigned long *file_bmap;
+    off_t bitmap_offset;
+    off_t pages_offset;
+
+    /*
+     * Mergeable, but the memory merge assist picks the ranges to advise.
+     * merge_bmap tracks the advised granules and is owned by its thread.
+     */
+    bool merge_assist;
+    unsigned long *merge_bmap;
 };
 #endif
 #endif
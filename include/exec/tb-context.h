@@ -22,6 +22,7 @@
 
 #include "qemu/thread.h"
 #include "qemu/qht.h"
+#include "qemu/stats64.h"
 
 #define CODE_GEN_HTABLE_BITS     15
 #define CODE_GEN_HTABLE_SIZE     (1 << CODE_GEN_HTABLE_BITS)
@@ -31,9 +32,20 @@ typedef struct TBContext TBContext;
 struct TBContext {
 
     struct qht htable;
+    /* protects TranslationBlock.ibc_pc, see tb_claim_jump() */
+    QemuSpin ibc_lock;
 
     /* statistics */
     unsigned tb_flush_count;
+    /* code buffer regions recycled instead of flushing everything */
+    unsigned tb_evict_count;
+    /* page locks that were busy when a vCPU thread tried to take them */
+    size_t page_lock_contended;
+    /* translations discarded because another thread published first */
+    size_t tb_lost_races;
+    /* translations done, and the time spent in them in ns */
+    size_t tb_gen_count;
+    Stat64 tb_gen_time;
 };
 
 extern TBContext tb_ctx;
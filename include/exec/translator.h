@@ -145,6 +145,42 @@ void translator_loop(const TranslatorOps *ops, DisasContextBase *db,
 
 void translator_loop_temp_check(DisasContextBase *db);
 
+/*
+ * Number of executions after which a TB is translated again as a trace,
+ * or 0 to disable execution counting.
+ */
+extern unsigned int tb_hot_threshold;
+
+/**
+ * translator_follow_jump:
+ * @db: Disassembly context.
+ * @next: Address of the instruction following the jump.
+ * @dest: Target of an unconditional direct jump.
+ *
+ * Returns true if the translator should go on translating at @dest
+ * instead of ending the TB with a jump there.  This is the case when
+ * a hot trace is translated (CF_TRACE) and @dest lies ahead on the
+ * same guest page, so that the TB still covers a single range of
+ * guest code and the optimizer and register allocator can work
+ * across both blocks.
+ */
+bool translator_follow_jump(DisasContextBase *db, target_ulong next,
+                            target_ulong dest);
+
+/**
+ * translator_indirect_jump:
+ * @db: Disassembly context.
+ * @dest: Guest pc the TB jumps to, as it will be found in TranslationBlock.pc.
+ *
+ * End the TB with an indirect jump, in place of tcg_gen_lookup_and_goto_ptr().
+ * The first target that is reached is cached inline: jumping to it again
+ * goes through jump 0, chained as for a direct jump, and only the other
+ * targets go through helper_lookup_tb_ptr().  The guest CPU state other
+ * than the pc (cs_base, flags) must be the one of the current TB, and
+ * jump 0 must not be used otherwise.
+ */
+void translator_indirect_jump(DisasContextBase *db, TCGv dest);
+
 /*
  * Translator Load Functions
  *
@@ -31,11 +31,30 @@ bool machine_usb(MachineState *machine);
 int machine_phandle_start(MachineState *machine);
 bool machine_dump_guest_core(MachineState *machine);
 bool machine_mem_merge(MachineState *machine);
+bool machine_mem_merge_assist(MachineState *machine);
 HotpluggableCPUList *machine_query_hotpluggable_cpus(MachineState *machine);
 void machine_set_cpu_numa_node(MachineState *machine,
                                const CpuInstanceProperties *props,
                                Error **errp);
 
+/**
+ * machine_init_work_submit:
+ * @func: the work, run in a worker thread
+ * @done: called in the main loop with the return value of @func
+ * @opaque: passed to @func and @done
+ *
+ * Run slow work of device creation, such as loading files, concurrently
+ * with the creation of the other devices.  @done is called at the latest
+ * before the machine becomes ready.  If it sets an error, creating the
+ * machine fails with it.  Must only be called while the machine is being
+ * created.
+ */
+void machine_init_work_submit(int (*func)(void *opaque),
+                              void (*done)(void *opaque, int ret,
+                                           Error **errp),
+                              void *opaque);
+void machine_init_work_wait(void);
+
 void machine_class_allow_dynamic_sysbus_dev(MachineClass *mc, const char *type);
 /*
  * Checks that backend isn't used, preps it for exclusive usage and
@@ -264,6 +283,8 @@ struct MachineState {
     char *dt_compatible;
     bool dump_guest_core;
     bool mem_merge;
+    uint32_t mem_merge_assist;
+    bool share_rom;
     bool usb;
     bool usb_disabled;
     char *firmware;
@@ -34,6 +34,7 @@
 #include "qom/object.h"
 
 #define UART_FIFO_LENGTH    16      /* 16550A Fifo Length */
+#define UART_TX_BATCH_SIZE  4096    /* see the "x-tx-batch" property */
 
 struct SerialState {
     DeviceState parent;
@@ -78,6 +79,13 @@ struct SerialState {
 
     QEMUTimer *modem_status_poll;
     MemoryRegion io;
+
+    /* Transmitted bytes not written to the chardev yet, for x-tx-batch */
+    bool tx_batch;
+    QEMUBH *tx_bh;
+    guint tx_watch_tag;
+    uint32_t tx_len;
+    uint8_t tx_buf[UART_TX_BATCH_SIZE];
 };
 typedef struct SerialState SerialState;
 
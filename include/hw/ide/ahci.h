@@ -25,6 +25,8 @@
 #define HW_IDE_AHCI_H
 
 #include "hw/sysbus.h"
+#include "qemu/event_notifier.h"
+#include "qemu/thread.h"
 #include "qom/object.h"
 
 typedef struct AHCIDevice AHCIDevice;
@@ -49,6 +51,22 @@ typedef struct AHCIState {
     int32_t ports;
     qemu_irq irq;
     AddressSpace *as;
+
+    /*
+     * With an iothread, NCQ commands are parsed, submitted and completed
+     * there.  The lock of ctx then protects the HBA and port state.  The
+     * iothread never needs the BQL while holding it, and MMIO handlers
+     * never wait for it: PxCI writes are latched and kick ci_notifier,
+     * other writes are queued on reg_writes when the lock is busy and
+     * applied in order by reg_bh.
+     */
+    struct IOThread *iothread;
+    AioContext *ctx;
+    QEMUBH *irq_bh;         /* interrupt updates requested by the iothread */
+    EventNotifier ci_notifier;  /* runs check_cmd in the iothread */
+    QemuMutex reg_lock;     /* protects reg_writes */
+    QSIMPLEQ_HEAD(, AHCIRegWrite) reg_writes;
+    QEMUBH *reg_bh;         /* applies reg_writes in the main loop */
 } AHCIState;
 
 
@@ -256,6 +256,28 @@ extern bool rom_file_has_mr;
 int rom_add_file(const char *file, const char *fw_dir,
                  hwaddr addr, int32_t bootindex,
                  bool option_rom, MemoryRegion *mr, AddressSpace *as);
+
+/**
+ * rom_add_file_shared: back a read-only memory region with a firmware file
+ * @file: Name of the firmware file, looked up as in rom_add_file()
+ * @mr: Memory region to initialize
+ * @name: Name of the memory region, which is also its migration name
+ * @size: Size of the memory region; must be the size of the file
+ * @errp: pointer to Error*, to store an error if it happens
+ *
+ * Initialize @mr as RAM privately mapped from @file, instead of anonymous
+ * RAM into which the file is copied at reset.  Pages of the file that the
+ * guest does not write are then shared through the host page cache by all
+ * QEMU processes that use the same file.  The file is registered as a ROM
+ * without data, so it shows in "info roms" but is not reloaded at reset;
+ * @mr should therefore be read-only for the guest.  Incoming postcopy
+ * migration is refused, because userfaultfd cannot handle the mapping.
+ *
+ * Returns 0 on success, or -1 with @mr uninitialized.  Callers can then
+ * fall back to memory_region_init_ram() and rom_add_file().
+ */
+int rom_add_file_shared(const char *file, MemoryRegion *mr, const char *name,
+                        uint64_t size, Error **errp);
 MemoryRegion *rom_add_blob(const char *name, const void *blob, size_t len,
                            size_t max_len, hwaddr addr,
                            const char *fw_file_name,
@@ -24,6 +24,7 @@
 #include "exec/memory.h"
 #include "qemu/queue.h"
 #include "qemu/notify.h"
+#include "qemu/thread.h"
 #include "ui/console.h"
 #include "hw/display/ramfb.h"
 #ifdef CONFIG_LINUX
@@ -66,6 +67,16 @@ typedef struct VFIOMigration {
     int vm_running;
     Notifier migration_state;
     uint64_t pending_bytes;
+    /* Stop-and-copy state read ahead by save_thread, see vfio_save_thread() */
+    bool save_thread_running;
+    QemuThread save_thread;
+    QemuMutex save_lock;
+    QemuCond save_cond;
+    QSIMPLEQ_HEAD(, VFIOSaveBuffer) save_queue;
+    uint64_t save_queued;
+    bool save_done;
+    bool save_abort;
+    int save_ret;
 } VFIOMigration;
 
 typedef struct VFIOAddressSpace {
@@ -92,6 +103,16 @@ typedef struct VFIOContainer {
     QLIST_HEAD(, VFIOHostDMAWindow) hostwin_list;
     QLIST_HEAD(, VFIOGroup) group_list;
     QLIST_ENTRY(VFIOContainer) next;
+    /* Initial mapping of guest RAM from worker threads */
+    bool dma_map_defer;
+    GArray *dma_map_chunks;
+    unsigned dma_map_next;
+    int dma_map_error;
+    int dma_map_nthreads;
+    QemuThread *dma_map_threads;
+    /* Buffer for VFIO_IOMMU_DIRTY_PAGES, reused across syncs */
+    void *dirty_bitmap;
+    uint64_t dirty_bitmap_size;
 } VFIOContainer;
 
 typedef struct VFIOGuestIOMMU {
@@ -196,7 +217,9 @@ void vfio_region_unmap(VFIORegion *region);
 void vfio_region_exit(VFIORegion *region);
 void vfio_region_finalize(VFIORegion *region);
 void vfio_reset_handler(void *opaque);
-VFIOGroup *vfio_get_group(int groupid, AddressSpace *as, Error **errp);
+VFIOGroup *vfio_get_group(int groupid, AddressSpace *as, bool async_dma_map,
+                          Error **errp);
+void vfio_container_dma_map_wait(VFIOContainer *container);
 void vfio_put_group(VFIOGroup *group);
 int vfio_get_device(VFIOGroup *group, const char *name,
                     VFIODevice *vbasedev, Error **errp);
@@ -207,6 +230,8 @@ extern VFIOGroupList vfio_group_list;
 
 bool vfio_mig_active(void);
 int64_t vfio_mig_bytes_transferred(void);
+void vfio_mig_add_dirty_sync_time(int64_t ns);
+int64_t vfio_mig_dirty_sync_time(void);
 
 #ifdef CONFIG_LINUX
 int vfio_get_region_info(VFIODevice *vbasedev, int index,
@@ -21,6 +21,12 @@ typedef struct VhostUserState {
     CharBackend *chr;
     VhostUserHostNotifier notifier[VIRTIO_QUEUE_MAX];
     int memory_slots;
+    /*
+     * Memory table updates sent during a memory transaction whose
+     * acknowledgements are collected once it is committed
+     */
+    GQueue pending_replies;
+    bool defer_replies;
 } VhostUserState;
 
 bool vhost_user_init(VhostUserState *user, CharBackend *chr, Error **errp);
@@ -13,15 +13,42 @@
 #define HW_VIRTIO_VHOST_VDPA_H
 
 #include "hw/virtio/virtio.h"
+#include "qemu/thread.h"
+
+typedef struct VhostVDPAMap {
+    hwaddr iova;
+    hwaddr size;
+    void *vaddr;
+    bool readonly;
+    bool unmap;     /* invalidate [iova, iova + size) instead */
+} VhostVDPAMap;
 
 typedef struct vhost_vdpa {
     int device_fd;
     uint32_t msg_type;
+    bool iotlb_batch_begin_sent;
     MemoryListener listener;
     struct vhost_dev *dev;
+    /* Contiguous guest RAM mappings not yet sent, merged (VhostVDPAMap) */
+    GArray *pending_maps;
+    /* Ranges currently mapped in the device (VhostVDPAMap) */
+    GArray *mapped;
+    /* Hand the mappings of the next commit to map_thread */
+    bool async_map;
+    bool map_thread_running;
+    QemuThread map_thread;
+    /*
+     * IOTLB updates for map_thread, which later ones are appended to until
+     * it is done, so that they stay ordered.  Protected by map_thread_lock.
+     */
+    QemuMutex map_thread_lock;
+    GArray *map_thread_maps;
+    guint map_thread_next;
+    bool map_thread_done;
 } VhostVDPA;
 
 extern AddressSpace address_space_memory;
 extern int vhost_vdpa_get_device_id(struct vhost_dev *dev,
                                    uint32_t *device_id);
+void vhost_vdpa_map_ram_async(struct vhost_vdpa *v);
 #endif
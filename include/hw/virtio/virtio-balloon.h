@@ -71,6 +71,23 @@ struct VirtIOBalloon {
 
     bool qemu_4_0_config_size;
     uint32_t poison_val;
+
+    /*
+     * Free page reports are discarded in @iothread if one is set. Elements
+     * move from report_pending to report_done and are returned to the guest
+     * from the main loop.
+     */
+    QEMUBH *report_bh;
+    QEMUBH *report_done_bh;
+    QemuMutex report_lock;
+    QemuCond report_cond;
+    GPtrArray *report_pending;
+    GPtrArray *report_done;
+    unsigned int report_inflight;
+    /* statistics, protected by report_lock */
+    uint64_t report_count;
+    uint64_t report_bytes;
+    uint64_t report_discard_ns;
 };
 
 #endif
@@ -32,23 +32,32 @@ struct virtio_blk_inhdr
 
 #define VIRTIO_BLK_AUTO_NUM_QUEUES UINT16_MAX
 
+/* Segments per discard or write zeroes request */
+#define VIRTIO_BLK_DEFAULT_DWZ_SEG 256
+#define VIRTIO_BLK_MAX_DWZ_SEG 4096
+
 struct VirtIOBlkConf
 {
     BlockConf conf;
     IOThread *iothread;
+    char *iothread_vq_mapping;
     char *serial;
     uint32_t request_merging;
+    uint32_t merge_window_us;
     uint16_t num_queues;
     uint16_t queue_size;
     bool seg_max_adjust;
     uint32_t max_discard_sectors;
     uint32_t max_write_zeroes_sectors;
+    uint32_t max_discard_seg;
+    uint32_t max_write_zeroes_seg;
     bool x_enable_wce_if_config_wce;
 };
 
 struct VirtIOBlockDataPlane;
 
 struct VirtIOBlockReq;
+struct MultiReqBuffer;
 struct VirtIOBlock {
     VirtIODevice parent_obj;
     BlockBackend *blk;
@@ -63,6 +72,10 @@ struct VirtIOBlock {
     struct VirtIOBlockDataPlane *dataplane;
     uint64_t host_features;
     size_t config_size;
+    /* Requests held back by the merge window, see merge-window-us */
+    struct MultiReqBuffer *merge_mrb;
+    QEMUTimer *merge_timer;
+    AioContext *merge_timer_ctx;
 };
 
 typedef struct VirtIOBlockReq {
@@ -81,15 +94,18 @@ typedef struct VirtIOBlockReq {
     BlockAcctCookie acct;
 } VirtIOBlockReq;
 
-#define VIRTIO_BLK_MAX_MERGE_REQS 32
+/* Upper bound; the backend's max_iov may lower it further */
+#define VIRTIO_BLK_MAX_MERGE_REQS 256
 
 typedef struct MultiReqBuffer {
     VirtIOBlockReq *reqs[VIRTIO_BLK_MAX_MERGE_REQS];
     unsigned int num_reqs;
+    size_t size;
     bool is_write;
 } MultiReqBuffer;
 
 bool virtio_blk_handle_vq(VirtIOBlock *s, VirtQueue *vq);
+void virtio_blk_flush_merge_window(VirtIOBlock *s);
 void virtio_blk_process_queued_requests(VirtIOBlock *s, bool is_bh);
 
 #endif
@@ -15,6 +15,7 @@
 #define HW_VIRTIO_GPU_H
 
 #include "qemu/queue.h"
+#include "qemu/thread.h"
 #include "ui/qemu-pixman.h"
 #include "ui/console.h"
 #include "hw/virtio/virtio.h"
@@ -47,6 +48,8 @@ struct virtio_gpu_simple_resource {
     uint32_t scanout_bitmask;
     pixman_image_t *image;
     uint64_t hostmem;
+    /* transfers queued to the transfer thread, main loop only */
+    uint32_t xfer_pending;
     QTAILQ_ENTRY(virtio_gpu_simple_resource) next;
 };
 
@@ -96,9 +99,13 @@ struct virtio_gpu_ctrl_command {
     struct virtio_gpu_ctrl_hdr cmd_hdr;
     uint32_t error;
     bool finished;
+    /* handed to the transfer thread, which completes it */
+    bool deferred;
     QTAILQ_ENTRY(virtio_gpu_ctrl_command) next;
 };
 
+typedef struct VirtIOGPUXfer VirtIOGPUXfer;
+
 struct VirtIOGPUBase {
     VirtIODevice parent_obj;
 
@@ -155,6 +162,18 @@ struct VirtIOGPU {
     QEMUTimer *print_stats;
 
     uint32_t inflight;
+
+    /* 2D transfers done outside of the main loop, see "x-cmd-thread" */
+    bool cmd_thread;
+    QemuThread xfer_thread;
+    QemuMutex xfer_lock;
+    QemuCond xfer_cond;
+    QSIMPLEQ_HEAD(, VirtIOGPUXfer) xfer_queue;
+    QSIMPLEQ_HEAD(, VirtIOGPUXfer) xfer_done;
+    QEMUBH *xfer_bh;
+    uint32_t xfer_inflight;
+    bool xfer_stop;         /* the transfer thread exits once idle */
+
     struct {
         uint32_t max_inflight;
         uint32_t requests;
@@ -190,6 +209,7 @@ bool virtio_gpu_base_device_realize(DeviceState *qdev,
                                     VirtIOHandleOutput ctrl_cb,
                                     VirtIOHandleOutput cursor_cb,
                                     Error **errp);
+void virtio_gpu_base_device_unrealize(DeviceState *qdev);
 void virtio_gpu_base_reset(VirtIOGPUBase *g);
 void virtio_gpu_base_fill_display_info(VirtIOGPUBase *g,
                         struct virtio_gpu_resp_display_info *dpy_info);
@@ -18,6 +18,7 @@
 #include "qapi/qapi-types-misc.h"
 #include "sysemu/hostmem.h"
 #include "qom/object.h"
+#include "qemu/thread.h"
 
 #define TYPE_VIRTIO_MEM "virtio-mem"
 
@@ -67,6 +68,15 @@ struct VirtIOMEM {
 
     /* don't migrate unplugged memory */
     NotifierWithReturn precopy_notifier;
+
+    /* populate plugged memory from a worker thread */
+    bool prefault;
+    QemuMutex prefault_lock;
+    GArray *prefault_ranges;
+    QemuThread prefault_thread;
+    bool prefault_thread_started;
+    bool prefault_busy;
+    bool prefault_abort;
 };
 
 struct VirtIOMEMClass {
@@ -62,6 +62,7 @@ struct VirtIOSCSIConf {
     CharBackend chardev;
     uint32_t boot_tpgt;
     IOThread *iothread;
+    char *iothread_vq_mapping;
 };
 
 struct VirtIOSCSI;
@@ -85,7 +86,10 @@ struct VirtIOSCSI {
     bool events_dropped;
 
     /* Fields for dataplane below */
-    AioContext *ctx; /* one iothread per virtio-scsi-pci for now */
+    AioContext *ctx; /* home context of the disks, ctrl and event queues */
+    IOThread **vq_iothread; /* from iothread-vq-mapping, per command queue */
+    AioContext **vq_aio_context; /* command queue handlers, while started */
+    bool multiqueue; /* command queues are spread over several iothreads */
 
     bool dataplane_started;
     bool dataplane_starting;
@@ -160,6 +164,9 @@ void virtio_scsi_push_event(VirtIOSCSI *s, SCSIDevice *dev,
                             uint32_t event, uint32_t reason);
 
 void virtio_scsi_dataplane_setup(VirtIOSCSI *s, Error **errp);
+void virtio_scsi_dataplane_cleanup(VirtIOSCSI *s);
+bool virtio_scsi_dataplane_hotplug(VirtIOSCSI *s, SCSIDevice *d,
+                                   Error **errp);
 int virtio_scsi_dataplane_start(VirtIODevice *s);
 void virtio_scsi_dataplane_stop(VirtIODevice *s);
 
@@ -61,6 +61,10 @@ typedef struct VirtQueueElement
     hwaddr *out_addr;
     struct iovec *in_sg;
     struct iovec *out_sg;
+    /* Pool the element came from, NULL if it was malloced */
+    struct VirtQueueElementPool *pool;
+    /* VIRTIO_F_IN_ORDER: completed but not yet flushed (used_elems only) */
+    bool in_order_filled;
 } VirtQueueElement;
 
 #define VIRTIO_QUEUE_MAX 1024
@@ -108,6 +112,8 @@ struct VirtIODevice
     bool use_guest_notifier_mask;
     AddressSpace *dma_as;
     QLIST_HEAD(, VirtQueue) *vector_queues;
+    /* Serializes lockless kicks against host notifier teardown */
+    QemuMutex host_notifier_lock;
 };
 
 struct VirtioDeviceClass {
@@ -194,9 +200,17 @@ void virtqueue_unpop(VirtQueue *vq, const VirtQueueElement *elem,
 bool virtqueue_rewind(VirtQueue *vq, unsigned int num);
 void virtqueue_fill(VirtQueue *vq, const VirtQueueElement *elem,
                     unsigned int len, unsigned int idx);
+void virtqueue_fill_batch(VirtQueue *vq, VirtQueueElement **elems,
+                          unsigned int *lens, unsigned int count);
+
+void virtio_queue_enable_element_pool(VirtQueue *vq, size_t sz);
+void virtio_queue_release_element_pool(VirtQueue *vq);
+void virtqueue_element_free(VirtQueueElement *elem);
 
 void virtqueue_map(VirtIODevice *vdev, VirtQueueElement *elem);
 void *virtqueue_pop(VirtQueue *vq, size_t sz);
+unsigned int virtqueue_pop_batch(VirtQueue *vq, size_t sz, void **elems,
+                                 unsigned int max);
 unsigned int virtqueue_drop_all(VirtQueue *vq);
 void *qemu_get_virtqueue_element(VirtIODevice *vdev, QEMUFile *f, size_t sz);
 void qemu_put_virtqueue_element(VirtIODevice *vdev, QEMUFile *f,
@@ -260,6 +274,13 @@ void virtio_queue_set_rings(VirtIODevice *vdev, int n, hwaddr desc,
 void virtio_queue_update_rings(VirtIODevice *vdev, int n);
 void virtio_queue_set_align(VirtIODevice *vdev, int n, int align);
 void virtio_queue_notify(VirtIODevice *vdev, int n);
+/*
+ * Forward a guest kick of queue @n to its host notifier without taking
+ * the BQL.  Kicks of a queue that is not set up or of a broken device are
+ * dropped.  Returns false if the queue has no host notifier enabled, in
+ * which case the caller has to take the BQL and use virtio_queue_notify().
+ */
+bool virtio_queue_notify_lockless(VirtIODevice *vdev, int n);
 uint16_t virtio_queue_vector(VirtIODevice *vdev, int n);
 void virtio_queue_set_vector(VirtIODevice *vdev, int n, uint16_t vector);
 int virtio_queue_set_host_notifier_mr(VirtIODevice *vdev, int n,
@@ -311,6 +332,9 @@ EventNotifier *virtio_queue_get_guest_notifier(VirtQueue *vq);
 void virtio_queue_set_guest_notifier_fd_handler(VirtQueue *vq, bool assign,
                                                 bool with_irqfd);
 int virtio_device_start_ioeventfd(VirtIODevice *vdev);
+/* The default VirtioDeviceClass start_ioeventfd/stop_ioeventfd */
+int virtio_device_start_ioeventfd_impl(VirtIODevice *vdev);
+void virtio_device_stop_ioeventfd_impl(VirtIODevice *vdev);
 int virtio_device_grab_ioeventfd(VirtIODevice *vdev);
 void virtio_device_release_ioeventfd(VirtIODevice *vdev);
 bool virtio_device_ioeventfd_enabled(VirtIODevice *vdev);
@@ -319,6 +343,8 @@ void virtio_queue_set_host_notifier_enabled(VirtQueue *vq, bool enabled);
 void virtio_queue_host_notifier_read(EventNotifier *n);
 void virtio_queue_aio_set_host_notifier_handler(VirtQueue *vq, AioContext *ctx,
                                                 VirtIOHandleAIOOutput handle_output);
+void virtio_queue_aio_set_host_notifier_handler_no_poll(VirtQueue *vq,
+        AioContext *ctx, VirtIOHandleAIOOutput handle_output);
 VirtQueue *virtio_vector_first_queue(VirtIODevice *vdev, uint16_t vector);
 VirtQueue *virtio_vector_next_queue(VirtQueue *vq);
 
@@ -48,6 +48,8 @@ struct QIOChannelTLS {
     QIOChannel *master;
     QCryptoTLSSession *session;
     QIOChannelShutdown shutdown;
+    bool ktls;      /* try kernel TLS after the handshake */
+    bool ktls_tx;   /* the kernel encrypts data written to @master */
 };
 
 /**
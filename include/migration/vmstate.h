@@ -189,6 +189,16 @@ struct VMStateDescription {
     int (*post_save)(void *opaque);
     bool (*needed)(void *opaque);
     bool (*dev_unplug_pending)(void *opaque);
+    /*
+     * The state only depends on the device itself, so with the
+     * parallel-device-state capability it may be saved and loaded by a
+     * worker thread, concurrently with the other parallel devices of the
+     * same priority.  The post_load hooks, including those of nested
+     * states and subsections, are deferred and run by the migration
+     * thread with the BQL held; the other hooks run on the worker and
+     * must not touch state shared with other devices.
+     */
+    bool parallel;
 
     const VMStateField *fields;
     const VMStateDescription **subsections;
@@ -0,0 +1,155 @@
+/*
+ * Software TCP receive coalescing (GRO/LRO) for emulated NICs
+ *
+ * Copyright IBM, Corp. 2007
+ *
+ * Authors:
+ *  Anthony Liguori   <aliguori@us.ibm.com>
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the COPYING file in the top-level directory.
+ */
+
+#ifndef QEMU_NET_GRO_H
+#define QEMU_NET_GRO_H
+
+#include "block/aio.h"
+#include "net/eth.h"
+#include "net/net.h"
+#include "qemu/queue.h"
+
+/* IPv4 max payload, 16 bits in the header */
+#define NET_GRO_MAX_IP4_PAYLOAD (65535 - sizeof(struct ip_header))
+#define NET_GRO_MAX_TCP_PAYLOAD 65535
+#define NET_GRO_MAX_IP6_PAYLOAD NET_GRO_MAX_TCP_PAYLOAD
+
+typedef struct NetGROStat {
+    uint32_t received;
+    uint32_t coalesced;
+    uint32_t over_size;
+    uint32_t cache;
+    uint32_t empty_cache;
+    uint32_t no_match_cache;
+    uint32_t win_update;
+    uint32_t no_match;
+    uint32_t tcp_syn;
+    uint32_t tcp_ctrl_drain;
+    uint32_t dup_ack;
+    uint32_t dup_ack1;
+    uint32_t dup_ack2;
+    uint32_t pure_ack;
+    uint32_t ack_out_of_win;
+    uint32_t data_out_of_win;
+    uint32_t data_out_of_order;
+    uint32_t data_after_pure_ack;
+    uint32_t bypass_not_tcp;
+    uint32_t tcp_option;
+    uint32_t tcp_all_opt;
+    uint32_t ip_frag;
+    uint32_t ip_ecn;
+    uint32_t ip_hacked;
+    uint32_t ip_option;
+    uint32_t purge_failed;
+    uint32_t drain_failed;
+    uint32_t final_failed;
+    int64_t  timer;
+} NetGROStat;
+
+/* General info used to check if a packet can be coalesced */
+typedef struct NetGROUnit {
+    void *ip;               /* ip header */
+    uint16_t *ip_plen;      /* data len pointer in ip header field */
+    struct tcp_header *tcp; /* tcp header */
+    uint16_t tcp_hdrlen;    /* tcp header len */
+    uint16_t payload;       /* pure payload without hdr/eth/ip/tcp */
+} NetGROUnit;
+
+/* Coalesced segment */
+typedef struct NetGROSegment {
+    QTAILQ_ENTRY(NetGROSegment) next;
+    uint8_t *buf;
+    size_t size;
+    size_t hdr_len;         /* device header in front of the frame */
+    uint16_t proto;         /* ETH_P_IP or ETH_P_IPV6 */
+    uint16_t packets;
+    uint16_t dup_ack;
+    bool is_coalesced;      /* headers were rewritten, checksums are stale */
+    NetGROUnit unit;
+    NetClientState *nc;
+} NetGROSegment;
+
+typedef struct NetGRO NetGRO;
+
+/**
+ * NetGRODeliver:
+ * @opaque: the opaque pointer passed to net_gro_new()
+ * @nc: the client the packet was received on
+ * @buf: the packet, including the device header
+ * @size: the size of @buf
+ * @seg: the cached segment that @buf belongs to, or %NULL if @buf is a
+ * packet that was not held back and is passed through unmodified
+ *
+ * Hand a packet to the device's receive path.  When @seg is not %NULL
+ * and @seg->is_coalesced is set, the frame has been built from
+ * @seg->packets wire packets and the device is expected to fill in its
+ * header, or call net_gro_segment_fix_checksums(), before delivery.
+ *
+ * Returns: the same as NetClientInfo.receive; 0 means the packet was
+ * not delivered.
+ */
+typedef ssize_t (NetGRODeliver)(void *opaque, NetClientState *nc,
+                                const uint8_t *buf, size_t size,
+                                NetGROSegment *seg);
+
+/**
+ * net_gro_new:
+ * @timeout: how long a segment may be held back, in nanoseconds
+ * @ctx: if not %NULL, the AioContext acquired around the drain timer
+ * @deliver: called for every packet leaving the coalescing engine
+ * @opaque: passed to @deliver
+ *
+ * Create a TCP receive coalescing engine.  Coalescing is disabled until
+ * net_gro_set_enabled() is called, which devices should do only once
+ * the guest driver has enabled the matching LRO/RSC capability.
+ */
+NetGRO *net_gro_new(uint32_t timeout, AioContext *ctx,
+                    NetGRODeliver *deliver, void *opaque);
+void net_gro_free(NetGRO *gro);
+
+void net_gro_set_enabled(NetGRO *gro, bool ipv4, bool ipv6);
+bool net_gro_enabled(NetGRO *gro);
+
+/**
+ * net_gro_receive:
+ * @gro: the coalescing engine
+ * @nc: the client the packet was received on
+ * @buf: the packet
+ * @size: the size of @buf
+ * @hdr_len: the size of the device header preceding the ethernet frame
+ *
+ * Feed a packet into the coalescing engine.  Packets that can not be
+ * coalesced are handed to the deliver callback right away, after any
+ * segment of the same flow that is still pending.
+ *
+ * Returns: the same as NetClientInfo.receive.
+ */
+ssize_t net_gro_receive(NetGRO *gro, NetClientState *nc,
+                        const uint8_t *buf, size_t size, size_t hdr_len);
+
+/* Deliver all pending segments now */
+void net_gro_flush(NetGRO *gro);
+
+/* Drop all pending segments without delivering them */
+void net_gro_reset(NetGRO *gro);
+
+/**
+ * net_gro_segment_fix_checksums:
+ * @seg: a coalesced segment
+ *
+ * Recompute the IPv4 header and TCP checksums of @seg, for devices that
+ * have no way to tell the guest that the checksums were already
+ * verified for the individual wire packets.
+ */
+void net_gro_segment_fix_checksums(NetGROSegment *seg);
+
+#endif
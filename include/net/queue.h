@@ -32,6 +32,11 @@ typedef void (NetPacketSent) (NetClientState *sender, ssize_t ret);
 
 #define QEMU_NET_PACKET_FLAG_NONE  0
 #define QEMU_NET_PACKET_FLAG_RAW  (1<<0)
+/*
+ * The sender keeps the buffers valid until its sent callback runs, so a
+ * packet that has one is queued by reference instead of being copied.
+ */
+#define QEMU_NET_PACKET_FLAG_ZEROCOPY  (1<<1)
 
 /* Returns:
  *   >0 - success
@@ -15,6 +15,7 @@
 #define JSON_WRITER_H
 
 JSONWriter *json_writer_new(bool pretty);
+JSONWriter *json_writer_new_append(GString *contents, bool pretty);
 const char *json_writer_get(JSONWriter *);
 GString *json_writer_get_and_free(JSONWriter *);
 void json_writer_free(JSONWriter *);
@@ -31,5 +32,6 @@ void json_writer_int64(JSONWriter *, const char *name, int64_t val);
 void json_writer_uint64(JSONWriter *, const char *name, uint64_t val);
 void json_writer_double(JSONWriter *, const char *name, double val);
 void json_writer_str(JSONWriter *, const char *name, const char *str);
+void json_writer_raw(JSONWriter *, const char *name, const char *json);
 
 #endif
@@ -17,6 +17,7 @@
 
 #include "qemu/queue.h"
 #include "qemu/timer.h"
+#include "qemu/stats64.h"
 
 /**
  * Coroutines are a mechanism for stack switching and can be used for
@@ -65,6 +66,69 @@ typedef void coroutine_fn CoroutineEntry(void *opaque);
  */
 Coroutine *qemu_coroutine_create(CoroutineEntry *entry, void *opaque);
 
+/**
+ * CoroutinePool:
+ *
+ * Terminated coroutines, with their stacks, kept for reuse by the one
+ * thread that the pool is attached to.  Reusing them in the same thread
+ * keeps the stacks in its cache and on its NUMA node, whose pages the
+ * thread faulted in when it allocated them.
+ *
+ * The pool keeps as many coroutines as were recently in use at the same
+ * time, but at least a small batch.  Its fields are only written by the
+ * owning thread and may be read by others for statistics, except that
+ * @in_use and @refcnt are decremented by whichever thread a coroutine
+ * terminates in.  Coroutines may outlive the owner of the pool, so they
+ * hold a reference to it.
+ */
+typedef struct CoroutinePool {
+    QSLIST_HEAD(, Coroutine) list;
+    unsigned int size;      /* coroutines in @list */
+    unsigned int in_use;    /* created by the thread and not terminated */
+    unsigned int peak;      /* recent high-water mark of @in_use */
+    unsigned int refcnt;    /* the owner, plus one for each of @in_use */
+    Stat64 hits;            /* creations served from @list */
+    Stat64 misses;          /* creations that allocated a new coroutine */
+} CoroutinePool;
+
+CoroutinePool *qemu_coroutine_pool_new(void);
+
+/**
+ * qemu_coroutine_pool_attach:
+ * @pool: the pool to use, or NULL to go back to the default pools
+ *
+ * Make coroutines created and terminated in the calling thread come from
+ * and go back to @pool.
+ */
+void qemu_coroutine_pool_attach(CoroutinePool *pool);
+
+/**
+ * qemu_coroutine_pool_free:
+ *
+ * Free the coroutines in @pool, which must not be attached to a running
+ * thread anymore, and drop the owner's reference to it.  Coroutines that
+ * were created from @pool and have not terminated yet keep it allocated
+ * until they do.
+ */
+void qemu_coroutine_pool_free(CoroutinePool *pool);
+
+/**
+ * qemu_coroutine_pool_trim:
+ *
+ * Halve the peak that @pool remembers, but not below the coroutines in
+ * use, and free the coroutines that it no longer keeps.  Must be called
+ * by the thread that @pool is attached to, from time to time, so that
+ * the pool also shrinks while no coroutines are created.
+ */
+void qemu_coroutine_pool_trim(CoroutinePool *pool);
+
+/**
+ * qemu_coroutine_pool_max_size:
+ *
+ * Return the number of free coroutines that @pool currently keeps at most.
+ */
+unsigned int qemu_coroutine_pool_max_size(CoroutinePool *pool);
+
 /**
  * Transfer control to a coroutine
  */
@@ -99,6 +163,30 @@ AioContext *coroutine_fn qemu_coroutine_get_aio_context(Coroutine *co);
  */
 Coroutine *coroutine_fn qemu_coroutine_self(void);
 
+/**
+ * CoroutineTrace:
+ *
+ * Tracing state of a coroutine.  Users embed it in their own structure
+ * and install it with qemu_coroutine_set_trace(); while it is installed,
+ * the coroutine primitives update the fields below.
+ */
+typedef struct CoroutineTrace {
+    /* Nanoseconds spent waiting to acquire a CoMutex */
+    int64_t lock_wait_ns;
+} CoroutineTrace;
+
+/**
+ * Get the tracing state of the current coroutine, or NULL if there is none.
+ * New coroutines start without one.
+ */
+CoroutineTrace *coroutine_fn qemu_coroutine_get_trace(void);
+
+/**
+ * Install @trace as the tracing state of the current coroutine, NULL to
+ * stop tracing
+ */
+void coroutine_fn qemu_coroutine_set_trace(CoroutineTrace *trace);
+
 /**
  * Return whether or not currently inside a coroutine
  *
@@ -159,7 +247,15 @@ void qemu_co_mutex_init(CoMutex *mutex);
  * Locks the mutex. If the lock cannot be taken immediately, control is
  * transferred to the caller of the current coroutine.
  */
-void coroutine_fn qemu_co_mutex_lock(CoMutex *mutex);
+#define qemu_co_mutex_lock(m)                           \
+    qemu_co_mutex_lock_impl(m, __FILE__, __LINE__)
+void coroutine_fn qemu_co_mutex_lock_impl(CoMutex *mutex,
+                                          const char *file, int line);
+
+static inline void coroutine_fn (qemu_co_mutex_lock)(CoMutex *mutex)
+{
+    qemu_co_mutex_lock(mutex);
+}
 
 /**
  * Unlocks the mutex and schedules the next coroutine that was waiting for this
@@ -231,6 +327,14 @@ void coroutine_fn qemu_co_queue_restart_all(CoQueue *queue);
     qemu_co_enter_next_impl(queue, QEMU_MAKE_LOCKABLE(lock))
 bool qemu_co_enter_next_impl(CoQueue *queue, QemuLockable *lock);
 
+/**
+ * Removes the next coroutine from the CoQueue and schedules it in its home
+ * AioContext with aio_co_schedule.  Unlike qemu_co_enter_next, it never
+ * runs the coroutine in the caller, so it can be called from any thread
+ * while holding the lock that protects the queue.
+ */
+bool qemu_co_queue_schedule_next(CoQueue *queue);
+
 /**
  * Checks if the CoQueue is empty.
  */
@@ -255,7 +359,9 @@ void qemu_co_rwlock_init(CoRwlock *lock);
  * of a parallel writer, control is transferred to the caller of the current
  * coroutine.
  */
-void qemu_co_rwlock_rdlock(CoRwlock *lock);
+#define qemu_co_rwlock_rdlock(l)                        \
+    qemu_co_rwlock_rdlock_impl(l, __FILE__, __LINE__)
+void qemu_co_rwlock_rdlock_impl(CoRwlock *lock, const char *file, int line);
 
 /**
  * Write Locks the CoRwlock from a reader.  This is a bit more efficient than
@@ -265,7 +371,9 @@ void qemu_co_rwlock_rdlock(CoRwlock *lock);
  * only overrides CoRwlock fairness if there are no concurrent readers, so
  * another writer might run while @qemu_co_rwlock_upgrade blocks.
  */
-void qemu_co_rwlock_upgrade(CoRwlock *lock);
+#define qemu_co_rwlock_upgrade(l)                       \
+    qemu_co_rwlock_upgrade_impl(l, __FILE__, __LINE__)
+void qemu_co_rwlock_upgrade_impl(CoRwlock *lock, const char *file, int line);
 
 /**
  * Downgrades a write-side critical section to a reader.  Downgrading with
@@ -280,7 +388,9 @@ void qemu_co_rwlock_downgrade(CoRwlock *lock);
  * of a parallel reader, control is transferred to the caller of the current
  * coroutine.
  */
-void qemu_co_rwlock_wrlock(CoRwlock *lock);
+#define qemu_co_rwlock_wrlock(l)                        \
+    qemu_co_rwlock_wrlock_impl(l, __FILE__, __LINE__)
+void qemu_co_rwlock_wrlock_impl(CoRwlock *lock, const char *file, int line);
 
 /**
  * Unlocks the read/write lock and schedules the next coroutine that was
@@ -49,6 +49,9 @@ struct Coroutine {
     /* Only used when the coroutine has terminated.  */
     QSLIST_ENTRY(Coroutine) pool_next;
 
+    /* The pool whose in_use counts the coroutine, if any */
+    CoroutinePool *pool;
+
     size_t locks_held;
 
     /* Only used when the coroutine has yielded.  */
@@ -67,6 +70,9 @@ struct Coroutine {
     QSIMPLEQ_HEAD(, Coroutine) co_queue_wakeup;
 
     QSLIST_ENTRY(Coroutine) co_scheduled_next;
+
+    /* See qemu_coroutine_set_trace() */
+    CoroutineTrace *trace;
 };
 
 Coroutine *qemu_coroutine_new(void);
@@ -0,0 +1,57 @@
+/*
+ * Event loop accounting
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#ifndef QEMU_EVENT_LOOP_STATS_H
+#define QEMU_EVENT_LOOP_STATS_H
+
+#include "qemu/host-utils.h"
+#include "qemu/stats64.h"
+
+typedef enum EventLoopDispatch {
+    EVENT_LOOP_DISPATCH_FD,
+    EVENT_LOOP_DISPATCH_BH,
+    EVENT_LOOP_DISPATCH_TIMER,
+    EVENT_LOOP_DISPATCH_KVM_EXIT,
+    EVENT_LOOP_DISPATCH__MAX,
+} EventLoopDispatch;
+
+/*
+ * Bucket 0 counts the iterations that dispatched for less than 1 us, bucket
+ * i the ones that took [2^(i-1), 2^i) us, and the last one everything above.
+ */
+#define EVENT_LOOP_LATENCY_BUCKETS 16
+
+/*
+ * Where the thread that runs an event loop spends its time, in ns.  Only
+ * that thread updates the counters.
+ */
+struct EventLoopStats {
+    /* busy waiting for events, including the work done by poll handlers */
+    Stat64 poll_ns;
+    /* sleeping until an event, a timer or a notification arrives */
+    Stat64 blocked_ns;
+    /* for vCPU threads, running guest code */
+    Stat64 guest_ns;
+    Stat64 dispatch_ns[EVENT_LOOP_DISPATCH__MAX];
+    Stat64 latency[EVENT_LOOP_LATENCY_BUCKETS];
+};
+
+static inline void event_loop_stats_add(Stat64 *counter, int64_t ns)
+{
+    stat64_add(counter, MAX(ns, 0));
+}
+
+/* Account an iteration that took @ns to dispatch what was ready */
+static inline void event_loop_stats_latency(EventLoopStats *s, int64_t ns)
+{
+    uint64_t us = MAX(ns, 0) / 1000;
+    int bucket = us ? 64 - clz64(us) : 0;
+
+    stat64_add(&s->latency[MIN(bucket, EVENT_LOOP_LATENCY_BUCKETS - 1)], 1);
+}
+
+#endif
@@ -25,6 +25,7 @@ struct EventNotifier {
     int rfd;
     int wfd;
     bool initialized;
+    bool consumed;  /* an AioContext already drained the eventfd */
 #endif
 };
 
@@ -340,6 +340,22 @@ bool hbitmap_next_dirty_area(const HBitmap *hb, int64_t start, int64_t end,
                              int64_t max_dirty_count,
                              int64_t *dirty_start, int64_t *dirty_count);
 
+/*
+ * hbitmap_next_run:
+ * @hb: The HBitmap to operate on
+ * @start: the offset to start from
+ * @end: end of requested area, greater than @start
+ * @dirty: set to whether the run is dirty
+ *
+ * Returns the length of the run of dirty or clean bits that starts at
+ * @start and ends before @end.  Offsets past the end of the bitmap are
+ * reported as clean.  Walking an area run by run this way is cheaper than
+ * alternating hbitmap_next_dirty() and hbitmap_next_zero(), because short
+ * runs are found in the last level without setting up an iterator.
+ */
+int64_t hbitmap_next_run(const HBitmap *hb, int64_t start, int64_t end,
+                         bool *dirty);
+
 /**
  * hbitmap_iter_next:
  * @hbi: HBitmapIter to operate on.
@@ -0,0 +1,90 @@
+/*
+ * Intrusive interval tree
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+#ifndef QEMU_INTERVAL_TREE_H
+#define QEMU_INTERVAL_TREE_H
+
+/*
+ * An interval tree keeps a set of possibly overlapping closed ranges
+ * [start, last] and finds all those that overlap a given range in
+ * O(log n + m) time, where m is the number of matches.
+ *
+ * The tree is an AVL tree ordered by start.  Each node also records
+ * the largest last of its subtree, which lets lookups skip subtrees
+ * that end before the range of interest.  Nodes are embedded in the
+ * objects they describe, so insertion and removal never allocate.
+ *
+ * The start and last of a node must not change while it is in the
+ * tree; remove it and insert it again instead.  The tree provides no
+ * locking of its own.
+ */
+
+typedef struct IntervalTreeNode {
+    struct IntervalTreeNode *parent;
+    struct IntervalTreeNode *left;
+    struct IntervalTreeNode *right;
+
+    uint64_t start;             /* Inclusive */
+    uint64_t last;              /* Inclusive */
+    uint64_t subtree_last;
+    int height;
+} IntervalTreeNode;
+
+typedef struct IntervalTreeRoot {
+    IntervalTreeNode *node;
+} IntervalTreeRoot;
+
+#define INTERVAL_TREE_ROOT_INIT { .node = NULL }
+
+static inline bool interval_tree_is_empty(const IntervalTreeRoot *root)
+{
+    return root->node == NULL;
+}
+
+/**
+ * interval_tree_insert:
+ *
+ * @node: the node to insert, with start and last already set
+ * @root: the tree to insert it into
+ */
+void interval_tree_insert(IntervalTreeNode *node, IntervalTreeRoot *root);
+
+/**
+ * interval_tree_remove:
+ *
+ * @node: a node currently in @root
+ * @root: the tree to remove it from
+ */
+void interval_tree_remove(IntervalTreeNode *node, IntervalTreeRoot *root);
+
+/**
+ * interval_tree_iter_first:
+ *
+ * @root: the tree to search
+ * @start: first value of the range to look up
+ * @last: last value of the range to look up, inclusive
+ *
+ * Return: the node with the lowest start that overlaps [@start, @last],
+ * or NULL if there is none.
+ */
+IntervalTreeNode *interval_tree_iter_first(IntervalTreeRoot *root,
+                                           uint64_t start, uint64_t last);
+
+/**
+ * interval_tree_iter_next:
+ *
+ * @node: a node returned by interval_tree_iter_first() or
+ *        interval_tree_iter_next() for the same range
+ * @start: first value of the range to look up
+ * @last: last value of the range to look up, inclusive
+ *
+ * Return: the next node in start order that overlaps [@start, @last],
+ * or NULL if there is none.
+ */
+IntervalTreeNode *interval_tree_iter_next(IntervalTreeNode *node,
+                                          uint64_t start, uint64_t last);
+
+#endif
@@ -81,6 +81,14 @@ int qemu_init_main_loop(Error **errp);
  */
 void main_loop_wait(int nonblocking);
 
+/**
+ * main_loop_get_stats: Return the accounting of main_loop_wait()
+ *
+ * Nested aio_poll() calls on the main AioContext are counted as part
+ * of the dispatch time of the main loop.
+ */
+EventLoopStats *main_loop_get_stats(void);
+
 /**
  * qemu_get_aio_context: Return the main loop's AioContext
  */
@@ -295,6 +303,42 @@ void qemu_mutex_lock_iothread_impl(const char *file, int line);
  */
 void qemu_mutex_unlock_iothread(void);
 
+/*
+ * IOThreadLockAuto: a guard for the main loop mutex
+ *
+ * The guard only releases the mutex if it took it, so it can be used
+ * both by code that runs with the mutex already held and by code that
+ * runs outside it, for example MMIO handlers of regions that called
+ * memory_region_clear_global_locking().
+ */
+typedef struct IOThreadLockAuto IOThreadLockAuto;
+
+static inline IOThreadLockAuto *qemu_iothread_auto_lock(const char *file,
+                                                        int line)
+{
+    if (qemu_mutex_iothread_locked()) {
+        return NULL;
+    }
+    qemu_mutex_lock_iothread_impl(file, line);
+    /* Anything non-NULL causes the cleanup function to be called */
+    return (IOThreadLockAuto *)(uintptr_t)1;
+}
+
+static inline void qemu_iothread_auto_unlock(IOThreadLockAuto *l)
+{
+    qemu_mutex_unlock_iothread();
+}
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC(IOThreadLockAuto, qemu_iothread_auto_unlock)
+
+/**
+ * QEMU_IOTHREAD_LOCK_GUARD: Take the main loop mutex until the end of
+ * the scope, unless the current thread holds it already.
+ */
+#define QEMU_IOTHREAD_LOCK_GUARD() \
+    g_autoptr(IOThreadLockAuto) _iothread_lock_auto G_GNUC_UNUSED = \
+        qemu_iothread_auto_lock(__FILE__, __LINE__)
+
 /*
  * qemu_cond_wait_iothread: Wait on condition for the main loop mutex
  *
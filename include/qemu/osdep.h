@@ -347,6 +347,34 @@ void *qemu_anon_ram_alloc(size_t size, uint64_t *align, bool shared);
 void qemu_vfree(void *ptr);
 void qemu_anon_ram_free(void *ptr, size_t size);
 
+/**
+ * qemu_try_alloc_large: allocate a large, long-lived buffer
+ * @size: size of the buffer in bytes
+ *
+ * Allocate zeroed memory aligned to at least the host page size, for data
+ * structures that scale with guest RAM or images, such as dirty bitmaps
+ * and caches.  Buffers of QEMU_VMALLOC_ALIGN bytes or more are mapped
+ * like guest RAM: aligned to QEMU_VMALLOC_ALIGN and advised to use
+ * transparent huge pages, which cuts TLB misses when they are accessed
+ * randomly.  Their pages are populated on first touch, and therefore on
+ * the NUMA node of the thread that first writes them.
+ *
+ * Returns NULL on failure.  Free the buffer with qemu_free_large().
+ */
+void *qemu_try_alloc_large(size_t size);
+
+/**
+ * qemu_alloc_large: like qemu_try_alloc_large(), but abort on failure
+ */
+void *qemu_alloc_large(size_t size);
+
+/**
+ * qemu_free_large: free a buffer from qemu_try_alloc_large()
+ * @ptr: the buffer, or NULL
+ * @size: the size passed when allocating @ptr
+ */
+void qemu_free_large(void *ptr, size_t size);
+
 #define QEMU_MADV_INVALID -1
 
 #if defined(CONFIG_MADVISE)
@@ -614,6 +642,17 @@ void qemu_set_tty_echo(int fd, bool echo);
 void os_mem_prealloc(int fd, char *area, size_t sz, int smp_cpus,
                      Error **errp);
 
+/**
+ * os_mem_prealloc_nodes:
+ *
+ * Like os_mem_prealloc(), but run the threads that touch the memory on
+ * the CPUs of the host NUMA nodes set in the first @maxnode bits of
+ * @host_nodes.  The NUMA policy of @area should already be in place.
+ */
+void os_mem_prealloc_nodes(int fd, char *area, size_t sz, int smp_cpus,
+                           const unsigned long *host_nodes,
+                           unsigned long maxnode, Error **errp);
+
 /**
  * qemu_get_pid_name:
  * @pid: pid of a process
@@ -85,13 +85,38 @@ struct qemu_plugin_dyn_cb {
     enum qemu_plugin_mem_rw rw;
     /* fields specific to each dyn_cb type go here */
     union {
+        /*
+         * Inline ops apply to @entry if it has a scoreboard, else to the
+         * uint64_t at @userp.  A non-zero @ring_slots makes a STORE_U64
+         * go to the next slot of the ring at @entry.
+         */
         struct {
             enum qemu_plugin_op op;
             uint64_t imm;
+            qemu_plugin_u64 entry;
+            size_t ring_slots;
         } inline_insn;
+        /* regular callbacks only fire if @cond holds for @entry and @imm */
+        struct {
+            enum qemu_plugin_cond cond;
+            qemu_plugin_u64 entry;
+            uint64_t imm;
+        } cond;
     };
 };
 
+/*
+ * Scoreboard entries are @stride bytes apart, one per vCPU.  @data may be
+ * reallocated when a vCPU is created, so translated code loads it anew on
+ * each access.
+ */
+struct qemu_plugin_scoreboard {
+    void *data;
+    size_t element_size;
+    size_t stride;
+    QLIST_ENTRY(qemu_plugin_scoreboard) entry;
+};
+
 /* Internal context for instrumenting an instruction */
 struct qemu_plugin_insn {
     GByteArray *data;
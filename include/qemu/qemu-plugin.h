@@ -228,8 +228,86 @@ void qemu_plugin_register_vcpu_tb_exec_cb(struct qemu_plugin_tb *tb,
 
 enum qemu_plugin_op {
     QEMU_PLUGIN_INLINE_ADD_U64,
+    QEMU_PLUGIN_INLINE_STORE_U64,
 };
 
+/**
+ * enum qemu_plugin_cond - condition for a conditional callback
+ *
+ * The comparison is unsigned, between the per-vCPU counter and the
+ * immediate given at registration time.
+ */
+enum qemu_plugin_cond {
+    QEMU_PLUGIN_COND_NEVER,
+    QEMU_PLUGIN_COND_ALWAYS,
+    QEMU_PLUGIN_COND_EQ,
+    QEMU_PLUGIN_COND_NE,
+    QEMU_PLUGIN_COND_LT,
+    QEMU_PLUGIN_COND_LE,
+    QEMU_PLUGIN_COND_GT,
+    QEMU_PLUGIN_COND_GE,
+};
+
+/*
+ * Scoreboards
+ *
+ * A scoreboard holds one entry of a plugin-defined size for each vCPU.
+ * Inline ops that target a scoreboard update the entry of the vCPU that
+ * executes them, so they need neither atomics nor locking, and the
+ * entries are kept on separate cache lines.
+ */
+struct qemu_plugin_scoreboard;
+
+/**
+ * typedef qemu_plugin_u64 - uint64_t member of a scoreboard entry
+ * @score: the scoreboard
+ * @offset: offset of the uint64_t within an entry
+ */
+typedef struct {
+    struct qemu_plugin_scoreboard *score;
+    size_t offset;
+} qemu_plugin_u64;
+
+/**
+ * qemu_plugin_scoreboard_new() - allocate a new scoreboard
+ * @element_size: size of each vCPU's entry
+ *
+ * Entries are zero-initialized.
+ */
+struct qemu_plugin_scoreboard *qemu_plugin_scoreboard_new(size_t element_size);
+
+/**
+ * qemu_plugin_scoreboard_free() - free a scoreboard
+ * @score: the scoreboard
+ *
+ * No translated code may refer to @score any more, e.g. because the
+ * plugin has been uninstalled or QEMU is exiting.
+ */
+void qemu_plugin_scoreboard_free(struct qemu_plugin_scoreboard *score);
+
+/**
+ * qemu_plugin_scoreboard_find() - get a vCPU's entry of a scoreboard
+ * @score: the scoreboard
+ * @vcpu_index: the vCPU
+ *
+ * The pointer is only valid until the next vCPU is created.
+ */
+void *qemu_plugin_scoreboard_find(struct qemu_plugin_scoreboard *score,
+                                  unsigned int vcpu_index);
+
+/* Accessors for a vCPU's uint64_t in a scoreboard */
+uint64_t qemu_plugin_u64_get(qemu_plugin_u64 entry, unsigned int vcpu_index);
+void qemu_plugin_u64_set(qemu_plugin_u64 entry, unsigned int vcpu_index,
+                         uint64_t val);
+void qemu_plugin_u64_add(qemu_plugin_u64 entry, unsigned int vcpu_index,
+                         uint64_t added);
+
+/**
+ * qemu_plugin_u64_sum() - sum a uint64_t over all vCPUs
+ * @entry: the scoreboard member
+ */
+uint64_t qemu_plugin_u64_sum(qemu_plugin_u64 entry);
+
 /**
  * qemu_plugin_register_vcpu_tb_trans_exec_inline() - execution inline op
  * @tb: the opaque qemu_plugin_tb handle for the translation
@@ -245,6 +323,61 @@ void qemu_plugin_register_vcpu_tb_exec_inline(struct qemu_plugin_tb *tb,
                                               enum qemu_plugin_op op,
                                               void *ptr, uint64_t imm);
 
+/**
+ * qemu_plugin_register_vcpu_tb_exec_inline_per_vcpu() - per-vCPU inline op
+ * @tb: the opaque qemu_plugin_tb handle for the translation
+ * @op: the type of qemu_plugin_op (e.g. ADD_U64)
+ * @entry: the scoreboard member the op applies to
+ * @imm: the op data (e.g. 1)
+ *
+ * Like qemu_plugin_register_vcpu_tb_exec_inline(), but the op applies to
+ * the executing vCPU's entry of a scoreboard.
+ */
+void qemu_plugin_register_vcpu_tb_exec_inline_per_vcpu(
+    struct qemu_plugin_tb *tb,
+    enum qemu_plugin_op op,
+    qemu_plugin_u64 entry,
+    uint64_t imm);
+
+/**
+ * qemu_plugin_register_vcpu_tb_exec_cond_cb() - conditional execution cb
+ * @tb: the opaque qemu_plugin_tb handle for the translation
+ * @cb: callback function
+ * @flags: does the plugin read or write the CPU's registers?
+ * @cond: condition on @entry and @imm
+ * @entry: per-vCPU counter compared against @imm
+ * @imm: the value @entry is compared against
+ * @userdata: any plugin data to pass to the @cb?
+ *
+ * The @cb function is called each time a translated unit executes and
+ * @cond holds.  The check is done inline, so a callback that rarely
+ * fires (e.g. when a counter crosses a threshold) costs no helper call
+ * the rest of the time.
+ */
+void qemu_plugin_register_vcpu_tb_exec_cond_cb(struct qemu_plugin_tb *tb,
+                                               qemu_plugin_vcpu_udata_cb_t cb,
+                                               enum qemu_plugin_cb_flags flags,
+                                               enum qemu_plugin_cond cond,
+                                               qemu_plugin_u64 entry,
+                                               uint64_t imm,
+                                               void *userdata);
+
+/**
+ * qemu_plugin_register_vcpu_tb_exec_ring() - record block executions
+ * @tb: the opaque qemu_plugin_tb handle for the translation
+ * @ring: per-vCPU ring buffer
+ * @n_slots: number of slots in the ring, a power of 2
+ *
+ * Every time the translated unit executes, its address is stored
+ * inline in the executing vCPU's ring.  The ring is laid out in the
+ * scoreboard entry as a uint64_t count of stores at @ring.offset,
+ * followed by @n_slots uint64_t slots; the latest address is in slot
+ * (count - 1) % @n_slots.
+ */
+void qemu_plugin_register_vcpu_tb_exec_ring(struct qemu_plugin_tb *tb,
+                                            qemu_plugin_u64 ring,
+                                            size_t n_slots);
+
 /**
  * qemu_plugin_register_vcpu_insn_exec_cb() - register insn execution cb
  * @insn: the opaque qemu_plugin_insn handle for an instruction
@@ -274,6 +407,52 @@ void qemu_plugin_register_vcpu_insn_exec_inline(struct qemu_plugin_insn *insn,
                                                 enum qemu_plugin_op op,
                                                 void *ptr, uint64_t imm);
 
+/**
+ * qemu_plugin_register_vcpu_insn_exec_inline_per_vcpu() - per-vCPU inline op
+ * @insn: the opaque qemu_plugin_insn handle for an instruction
+ * @op: the type of qemu_plugin_op (e.g. ADD_U64)
+ * @entry: the scoreboard member the op applies to
+ * @imm: the op data (e.g. 1)
+ */
+void qemu_plugin_register_vcpu_insn_exec_inline_per_vcpu(
+    struct qemu_plugin_insn *insn,
+    enum qemu_plugin_op op,
+    qemu_plugin_u64 entry,
+    uint64_t imm);
+
+/**
+ * qemu_plugin_register_vcpu_insn_exec_cond_cb() - conditional insn cb
+ * @insn: the opaque qemu_plugin_insn handle for an instruction
+ * @cb: callback function
+ * @flags: does the plugin read or write the CPU's registers?
+ * @cond: condition on @entry and @imm
+ * @entry: per-vCPU counter compared against @imm
+ * @imm: the value @entry is compared against
+ * @userdata: any plugin data to pass to the @cb?
+ *
+ * See qemu_plugin_register_vcpu_tb_exec_cond_cb().
+ */
+void qemu_plugin_register_vcpu_insn_exec_cond_cb(
+    struct qemu_plugin_insn *insn,
+    qemu_plugin_vcpu_udata_cb_t cb,
+    enum qemu_plugin_cb_flags flags,
+    enum qemu_plugin_cond cond,
+    qemu_plugin_u64 entry,
+    uint64_t imm,
+    void *userdata);
+
+/**
+ * qemu_plugin_register_vcpu_insn_exec_ring() - record insn executions
+ * @insn: the opaque qemu_plugin_insn handle for an instruction
+ * @ring: per-vCPU ring buffer
+ * @n_slots: number of slots in the ring, a power of 2
+ *
+ * See qemu_plugin_register_vcpu_tb_exec_ring().
+ */
+void qemu_plugin_register_vcpu_insn_exec_ring(struct qemu_plugin_insn *insn,
+                                              qemu_plugin_u64 ring,
+                                              size_t n_slots);
+
 /*
  * Helpers to query information about the instructions in a block
  */
@@ -352,6 +531,13 @@ void qemu_plugin_register_vcpu_mem_inline(struct qemu_plugin_insn *insn,
                                           enum qemu_plugin_op op, void *ptr,
                                           uint64_t imm);
 
+void qemu_plugin_register_vcpu_mem_inline_per_vcpu(
+    struct qemu_plugin_insn *insn,
+    enum qemu_plugin_mem_rw rw,
+    enum qemu_plugin_op op,
+    qemu_plugin_u64 entry,
+    uint64_t imm);
+
 
 
 typedef void
@@ -405,6 +591,99 @@ int qemu_plugin_n_vcpus(void);
 /* returns -1 in user-mode */
 int qemu_plugin_n_max_vcpus(void);
 
+/*
+ * Trace buffers
+ *
+ * A trace buffer gives each vCPU its own ring of fixed-size records.
+ * vCPUs push records from their callbacks without taking any lock, and
+ * a single consumer, typically a thread started by QEMU, drains them in
+ * batches.  Plugins can thus stream events such as memory accesses to a
+ * sink without serializing the vCPUs on a shared data structure.
+ */
+struct qemu_plugin_trace_buffer;
+
+/**
+ * typedef qemu_plugin_trace_cb_t - trace buffer consumer callback
+ * @vcpu_index: the vCPU that pushed the records
+ * @records: @n_records consecutive records, only valid during the call
+ * @n_records: number of records
+ * @userdata: the pointer given when starting the consumer
+ */
+typedef void (*qemu_plugin_trace_cb_t)(unsigned int vcpu_index,
+                                       const void *records, size_t n_records,
+                                       void *userdata);
+
+/**
+ * qemu_plugin_trace_buffer_new() - allocate a trace buffer
+ * @record_size: size of each record
+ * @n_records: number of records in each vCPU's ring, a power of 2
+ */
+struct qemu_plugin_trace_buffer *
+qemu_plugin_trace_buffer_new(size_t record_size, size_t n_records);
+
+/**
+ * qemu_plugin_trace_buffer_push() - append a record to a vCPU's ring
+ * @buf: the trace buffer
+ * @vcpu_index: the vCPU; only that vCPU's callbacks may push to its ring
+ * @record: the record to copy
+ *
+ * Returns false, and counts the record as dropped, if the ring is full.
+ */
+bool qemu_plugin_trace_buffer_push(struct qemu_plugin_trace_buffer *buf,
+                                   unsigned int vcpu_index,
+                                   const void *record);
+
+/**
+ * qemu_plugin_trace_buffer_drain() - consume the pending records
+ * @buf: the trace buffer
+ * @cb: called for each batch of records
+ * @userdata: passed to @cb
+ *
+ * Must not run concurrently with another drain of @buf, including the
+ * one done by a consumer thread.  Returns the number of records consumed.
+ */
+size_t qemu_plugin_trace_buffer_drain(struct qemu_plugin_trace_buffer *buf,
+                                      qemu_plugin_trace_cb_t cb,
+                                      void *userdata);
+
+/**
+ * qemu_plugin_trace_buffer_start_consumer() - drain from a QEMU thread
+ * @buf: the trace buffer
+ * @cb: called for each batch of records
+ * @period_ms: how often to drain, at the latest
+ * @userdata: passed to @cb
+ *
+ * Starts a thread that drains @buf every @period_ms milliseconds, and
+ * sooner when a ring fills up halfway.
+ */
+void qemu_plugin_trace_buffer_start_consumer(
+    struct qemu_plugin_trace_buffer *buf,
+    qemu_plugin_trace_cb_t cb,
+    unsigned int period_ms,
+    void *userdata);
+
+/**
+ * qemu_plugin_trace_buffer_stop_consumer() - stop the consumer thread
+ * @buf: the trace buffer
+ *
+ * Waits for the thread to exit and then drains the remaining records,
+ * so that @cb has seen everything pushed so far when this returns.
+ */
+void qemu_plugin_trace_buffer_stop_consumer(
+    struct qemu_plugin_trace_buffer *buf);
+
+/* Number of records dropped because a ring was full */
+uint64_t qemu_plugin_trace_buffer_dropped(
+    const struct qemu_plugin_trace_buffer *buf);
+
+/**
+ * qemu_plugin_trace_buffer_free() - free a trace buffer
+ * @buf: the trace buffer
+ *
+ * Stops the consumer, if any.  No vCPU may push to @buf any more.
+ */
+void qemu_plugin_trace_buffer_free(struct qemu_plugin_trace_buffer *buf);
+
 /**
  * qemu_plugin_outs() - output string via QEMU's logging system
  * @string: a string
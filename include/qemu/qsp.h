@@ -11,17 +11,74 @@
 #ifndef QEMU_QSP_H
 #define QEMU_QSP_H
 
+enum QSPType {
+    QSP_MUTEX,
+    QSP_BQL_MUTEX,
+    QSP_REC_MUTEX,
+    QSP_CONDVAR,
+    QSP_CO_MUTEX,
+    QSP_CO_RWLOCK,
+    QSP_AIO_CONTEXT,
+};
+
 enum QSPSortBy {
     QSP_SORT_BY_TOTAL_WAIT_TIME,
     QSP_SORT_BY_AVG_WAIT_TIME,
 };
 
+typedef struct QSPReportEntry {
+    const void *obj;
+    char *callsite_at;
+    const char *typename;
+    uint64_t ns;
+    double time_s;
+    double ns_avg;
+    uint64_t n_acqs;
+    unsigned int n_objs; /* count of coalesced objects */
+} QSPReportEntry;
+
 void qsp_report(size_t max, enum QSPSortBy sort_by,
                 bool callsite_coalesce);
 
+/*
+ * Return up to @max entries of the report, whose number is stored in
+ * @n_entries.  Free them with qsp_report_entries_free().
+ */
+QSPReportEntry *qsp_report_entries(size_t max, enum QSPSortBy sort_by,
+                                   bool callsite_coalesce, size_t *n_entries);
+void qsp_report_entries_free(QSPReportEntry *entries, size_t n_entries);
+
 bool qsp_is_enabled(void);
 void qsp_enable(void);
 void qsp_disable(void);
 void qsp_reset(void);
 
+/*
+ * Profile only one in every @period operations of each thread, and account
+ * it @period times.  1, the default, profiles every operation.
+ */
+unsigned int qsp_get_sample_period(void);
+void qsp_set_sample_period(unsigned int period);
+
+/*
+ * For primitives that are not always linked in, and thus cannot be wrapped
+ * by the profiler.  qsp_external_sample() returns 0 if the current
+ * operation must not be profiled, or else a weight to be passed to
+ * qsp_external_record() together with the time that the operation took.
+ * While profiling is off, it costs a single load.
+ */
+extern bool qsp_external_enabled;
+unsigned int qsp_external_sample_slow(void);
+
+static inline unsigned int qsp_external_sample(void)
+{
+    if (likely(!qatomic_read(&qsp_external_enabled))) {
+        return 0;
+    }
+    return qsp_external_sample_slow();
+}
+
+void qsp_external_record(const void *obj, const char *file, int line,
+                         enum QSPType type, int64_t ns, unsigned int weight);
+
 #endif /* QEMU_QSP_H */
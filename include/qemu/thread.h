@@ -44,6 +44,7 @@ extern QemuRecMutexLockFunc qemu_rec_mutex_lock_func;
 extern QemuRecMutexTrylockFunc qemu_rec_mutex_trylock_func;
 extern QemuCondWaitFunc qemu_cond_wait_func;
 extern QemuCondTimedWaitFunc qemu_cond_timedwait_func;
+extern QemuRecMutexLockFunc qemu_aio_context_lock_func;
 
 /* convenience macros to bypass the profiler */
 #define qemu_mutex_lock__raw(m)                         \
@@ -177,6 +178,11 @@ void qemu_thread_create(QemuThread *thread, const char *name,
 void *qemu_thread_join(QemuThread *thread);
 void qemu_thread_get_self(QemuThread *thread);
 bool qemu_thread_is_self(QemuThread *thread);
+/*
+ * Return the CPU time consumed so far by a running @thread, in
+ * nanoseconds, or -1 if the host cannot tell.
+ */
+int64_t qemu_thread_get_cpu_time_ns(QemuThread *thread);
 void qemu_thread_exit(void *retval) QEMU_NORETURN;
 void qemu_thread_naming(bool enable);
 
@@ -89,6 +89,8 @@ struct QEMUTimer {
     QEMUTimer *next;
     int attributes;
     int scale;
+    unsigned heap_index;        /* position in the timer list's heap */
+    uint64_t seq;               /* orders timers with the same expire_time */
 };
 
 extern QEMUTimerListGroup main_loop_tlg;
@@ -25,21 +25,39 @@ typedef struct VuFdWatch {
     int fd; /*kick fd*/
     void *pvt;
     vu_watch_cb cb;
+    AioContext *ctx; /* virtqueue's own AioContext, NULL for VuServer->ctx */
     QTAILQ_ENTRY(VuFdWatch) next;
 } VuFdWatch;
 
+typedef struct VuServer VuServer;
+typedef void coroutine_fn VuServerDrainedFn(VuServer *server, bool begin);
+
 /**
  * VuServer:
  * A vhost-user server instance with user-defined VuDevIface callbacks.
  * Vhost-user device backends can be implemented using VuServer. VuDevIface
- * callbacks and virtqueue kicks run in the given AioContext.
+ * callbacks and virtqueue kicks run in the given AioContext, unless a
+ * virtqueue was given its own one with vhost_user_server_set_queue_ctx().
  */
-typedef struct {
+struct VuServer {
     QIONetListener *listener;
     QEMUBH *restart_listener_bh;
     AioContext *ctx;
     int max_queues;
     const VuDevIface *vu_iface;
+    AioContext **queue_ctx; /* max_queues entries or NULL, owned by caller */
+    VuServerDrainedFn *drained;
+    bool queues_quiesced; /* while handling a message that unmaps memory */
+
+    /*
+     * Requests popped from a virtqueue and not yet pushed back and
+     * notified; co_trip waits for them with wait_idle set.  Atomic.
+     */
+    unsigned int in_flight;
+    bool wait_idle;
+
+    /* Protects vu_fd_watches, which kicks in queue_ctx also modify */
+    QemuMutex watches_lock;
 
     /* Protected by ctx lock */
     VuDev vu_dev;
@@ -48,7 +66,7 @@ typedef struct {
     QTAILQ_HEAD(, VuFdWatch) vu_fd_watches;
 
     Coroutine *co_trip; /* coroutine for processing VhostUserMsg */
-} VuServer;
+};
 
 bool vhost_user_server_start(VuServer *server,
                              SocketAddress *unix_socket,
@@ -59,6 +77,12 @@ bool vhost_user_server_start(VuServer *server,
 
 void vhost_user_server_stop(VuServer *server);
 
+void vhost_user_server_set_queue_ctx(VuServer *server, AioContext **queue_ctx,
+                                     VuServerDrainedFn *drained);
+
+void vhost_user_server_inc_in_flight(VuServer *server);
+void vhost_user_server_dec_in_flight(VuServer *server);
+
 void vhost_user_server_attach_aio_context(VuServer *server, AioContext *ctx);
 void vhost_user_server_detach_aio_context(VuServer *server);
 
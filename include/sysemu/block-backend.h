@@ -66,6 +66,15 @@ typedef struct BlockDevOps {
      * Runs when the backend's last drain request ends.
      */
     void (*drained_end)(void *opaque);
+    /*
+     * Runs when the monitor moves the device's request processing to
+     * @iothread, or to the colon-separated list of IOThread ids
+     * @iothread_vq_mapping, or to the main loop if both are NULL.
+     * Device models implement this only if they can switch AioContext
+     * while the guest is running.
+     */
+    void (*set_iothread_cb)(void *opaque, const char *iothread,
+                            const char *iothread_vq_mapping, Error **errp);
 } BlockDevOps;
 
 /* This struct is embedded in (the private) BlockBackend struct and contains
@@ -107,6 +116,7 @@ void blk_get_perm(BlockBackend *blk, uint64_t *perm, uint64_t *shared_perm);
 void blk_set_allow_write_beyond_eof(BlockBackend *blk, bool allow);
 void blk_set_allow_aio_context_change(BlockBackend *blk, bool allow);
 void blk_set_disable_request_queuing(BlockBackend *blk, bool disable);
+bool blk_set_multiqueue(BlockBackend *blk, bool multiqueue, Error **errp);
 void blk_iostatus_enable(BlockBackend *blk);
 bool blk_iostatus_is_enabled(const BlockBackend *blk);
 BlockDeviceIoStatus blk_iostatus(const BlockBackend *blk);
@@ -120,6 +130,8 @@ char *blk_get_attached_dev_id(BlockBackend *blk);
 BlockBackend *blk_by_dev(void *dev);
 BlockBackend *blk_by_qdev_id(const char *id, Error **errp);
 void blk_set_dev_ops(BlockBackend *blk, const BlockDevOps *ops, void *opaque);
+void blk_dev_set_iothread(BlockBackend *blk, const char *iothread,
+                          const char *iothread_vq_mapping, Error **errp);
 int coroutine_fn blk_co_preadv(BlockBackend *blk, int64_t offset,
                                unsigned int bytes, QEMUIOVector *qiov,
                                BdrvRequestFlags flags);
@@ -205,6 +217,7 @@ int blk_get_flags(BlockBackend *blk);
 uint32_t blk_get_request_alignment(BlockBackend *blk);
 uint32_t blk_get_max_transfer(BlockBackend *blk);
 int blk_get_max_iov(BlockBackend *blk);
+int blk_get_host_fd(BlockBackend *blk, int64_t *fd_offset);
 void blk_set_guest_block_size(BlockBackend *blk, int align);
 void *blk_try_blockalign(BlockBackend *blk, size_t size);
 void *blk_blockalign(BlockBackend *blk, size_t size);
@@ -215,6 +228,8 @@ void blk_op_unblock_all(BlockBackend *blk, Error *reason);
 AioContext *blk_get_aio_context(BlockBackend *blk);
 int blk_set_aio_context(BlockBackend *blk, AioContext *new_context,
                         Error **errp);
+bool blk_can_set_aio_context(BlockBackend *blk, AioContext *new_context,
+                             Error **errp);
 void blk_add_aio_context_notifier(BlockBackend *blk,
         void (*attached_aio_context)(AioContext *new_context, void *opaque),
         void (*detach_aio_context)(void *opaque), void *opaque);
@@ -0,0 +1,80 @@
+/*
+ * Per-vCPU dirty page rate limit
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#ifndef SYSEMU_DIRTYLIMIT_H
+#define SYSEMU_DIRTYLIMIT_H
+
+#include "hw/core/cpu.h"
+
+/* Period of the dirty page rate calculation, in milliseconds */
+#define DIRTYLIMIT_CALC_TIME_MS         1000
+
+/**
+ * dirtylimit_start:
+ * @quota: Dirty page rate allowed for each vCPU, in MB/s.
+ *
+ * Start limiting the dirty page rate of every vCPU to @quota.  The limit
+ * relies on the KVM dirty ring: a vCPU whose ring fills up faster than
+ * @quota allows is put to sleep for a while before it re-enters the
+ * guest.  Calling dirtylimit_start again while the limit is in service
+ * just updates the quota.
+ *
+ * Must be called with the iothread lock held.
+ */
+void dirtylimit_start(uint64_t quota);
+
+/**
+ * dirtylimit_stop:
+ *
+ * Stop limiting the dirty page rate and let all vCPUs run at full speed.
+ *
+ * Must be called with the iothread lock held.
+ */
+void dirtylimit_stop(void);
+
+/**
+ * dirtylimit_in_service:
+ *
+ * Returns: %true if the dirty page rate limit is active.
+ */
+bool dirtylimit_in_service(void);
+
+/**
+ * dirtylimit_vcpu_execute:
+ * @cpu: The vCPU whose dirty ring has just been harvested.
+ *
+ * Throttle @cpu according to the sleep time computed by the dirty limit
+ * thread.  Called from the vCPU thread, without the iothread lock.
+ */
+void dirtylimit_vcpu_execute(CPUState *cpu);
+
+/**
+ * dirtylimit_vcpu_dirty_rate:
+ * @cpu_index: Index of the vCPU.
+ *
+ * Returns: the dirty page rate of the vCPU measured during the last
+ * calculation period, in MB/s.
+ */
+uint64_t dirtylimit_vcpu_dirty_rate(int cpu_index);
+
+/**
+ * dirtylimit_throttle_time_per_round:
+ *
+ * Returns: the average time, in microseconds, that a vCPU sleeps each
+ * time its dirty ring fills up.
+ */
+int64_t dirtylimit_throttle_time_per_round(void);
+
+/**
+ * dirtylimit_ring_full_time:
+ *
+ * Returns: the estimated time, in microseconds, that the fastest dirtying
+ * vCPU needs to fill up its dirty ring.
+ */
+int64_t dirtylimit_ring_full_time(void);
+
+#endif
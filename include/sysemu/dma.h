@@ -284,6 +284,12 @@ BlockAIOCB *dma_blk_io(AioContext *ctx,
                        QEMUSGList *sg, uint64_t offset, uint32_t align,
                        DMAIOFunc *io_func, void *io_func_opaque,
                        BlockCompletionFunc *cb, void *opaque, DMADirection dir);
+BlockAIOCB *dma_blk_io_direct(AioContext *ctx,
+                              QEMUSGList *sg, uint64_t offset, uint32_t align,
+                              uint64_t max_len,
+                              DMAIOFunc *io_func, void *io_func_opaque,
+                              BlockCompletionFunc *cb, void *opaque,
+                              DMADirection dir);
 BlockAIOCB *dma_blk_read(BlockBackend *blk,
                          QEMUSGList *sg, uint64_t offset, uint32_t align,
                          BlockCompletionFunc *cb, void *opaque);
@@ -15,6 +15,8 @@
 #define DUMP_H
 
 #include "qapi/qapi-types-dump.h"
+#include "qemu/queue.h"
+#include "qemu/thread.h"
 
 #define MAKEDUMPFILE_SIGNATURE      "makedumpfile"
 #define MAX_SIZE_MDF_HEADER         (4096) /* max size of makedumpfile_header */
@@ -150,6 +152,19 @@ typedef struct QEMU_PACKED PageDescriptor {
     uint64_t page_flags;            /* page flags */
 } PageDescriptor;
 
+typedef struct DumpJob DumpJob;
+
+/* Threads that compress or write guest memory in parallel */
+typedef struct DumpWorkers {
+    QemuMutex lock;
+    QemuCond work_cond;         /* signalled when jobs are queued */
+    QemuCond done_cond;         /* signalled when a job completes */
+    QSIMPLEQ_HEAD(, DumpJob) jobs;
+    QemuThread *threads;
+    int nthreads;
+    bool quit;
+} DumpWorkers;
+
 typedef struct DumpState {
     GuestPhysBlockList guest_phys_blocks;
     ArchDumpInfo dump_info;
@@ -195,6 +210,7 @@ typedef struct DumpState {
                                   * finished. */
     uint8_t *guest_note;         /* ELF note content */
     size_t guest_note_size;
+    DumpWorkers workers;
 } DumpState;
 
 uint16_t cpu_to_dump16(DumpState *s, uint16_t val);
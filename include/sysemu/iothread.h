@@ -32,6 +32,7 @@ struct IOThread {
     bool stopping;              /* has iothread_stop() been called? */
     bool running;               /* should iothread_run() continue? */
     int thread_id;
+    QEMUTimer *co_pool_timer;   /* trims the AioContext's coroutine pool */
 
     /* AioContext poll parameters */
     int64_t poll_max_ns;
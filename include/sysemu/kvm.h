@@ -464,6 +464,20 @@ int kvm_physical_memory_addr_from_host(KVMState *s, void *ram_addr,
 
 #endif /* NEED_CPU_H */
 
+/**
+ * kvm_irqchip_batch_begin:
+ *
+ * Defer the MSIs that kvm_irqchip_send_msi() sends from this thread
+ * until the matching kvm_irqchip_batch_end(), sending each distinct
+ * message only once.  Calls nest; the outermost kvm_irqchip_batch_end()
+ * delivers the messages in the order they were first raised.  The main
+ * loop, IOThreads and KVM vCPU exits each run in a batch, so a device
+ * that completes many requests in one dispatch interrupts the guest once
+ * per vector instead of once per request.
+ */
+void kvm_irqchip_batch_begin(void);
+void kvm_irqchip_batch_end(void);
+
 void kvm_cpu_synchronize_state(CPUState *cpu);
 
 void kvm_init_cpu_signals(CPUState *cpu);
@@ -551,4 +565,20 @@ bool kvm_cpu_check_are_resettable(void);
 
 bool kvm_arch_cpu_check_are_resettable(void);
 
+/**
+ * kvm_dirty_ring_enabled - return whether the KVM dirty ring is in use
+ *
+ * Returns: true if dirty pages are collected through the per-vCPU
+ *          dirty rings rather than through the KVM dirty bitmaps.
+ */
+bool kvm_dirty_ring_enabled(void);
+
+/**
+ * kvm_dirty_ring_size - return the number of entries of each dirty ring
+ *
+ * Returns: the number of dirty ring entries per vCPU, or 0 if the dirty
+ *          ring is not in use.
+ */
+uint32_t kvm_dirty_ring_size(void);
+
 #endif
@@ -11,6 +11,7 @@
 
 #include "exec/memory.h"
 #include "qemu/accel.h"
+#include "qemu/thread.h"
 #include "sysemu/kvm.h"
 
 typedef struct KVMSlot
@@ -23,16 +24,45 @@ typedef struct KVMSlot
     int old_flags;
     /* Dirty bitmap cache for the slot */
     unsigned long *dirty_bmap;
+    /* Offset of the slot within the ram_addr_t space */
+    ram_addr_t ram_start_offset;
+    /* Removed by the current transaction, but still registered with KVM */
+    bool pending_del;
 } KVMSlot;
 
 typedef struct KVMMemoryListener {
     MemoryListener listener;
-    /* Protects the slots and all inside them */
-    QemuMutex slots_lock;
     KVMSlot *slots;
+    /* The registered slots, ordered by guest physical address */
+    GTree *slot_index;
+    /* Inside a memory transaction, removals are deferred to its commit */
+    bool in_transaction;
+    int nr_pending_del;
     int as_id;
 } KVMMemoryListener;
 
+enum KVMDirtyRingReaperState {
+    KVM_DIRTY_RING_REAPER_NONE = 0,
+    /* The reaper is sleeping */
+    KVM_DIRTY_RING_REAPER_WAIT,
+    /* The reaper is reaping for dirty pages */
+    KVM_DIRTY_RING_REAPER_REAPING,
+};
+
+/*
+ * KVM reaper instance, responsible for collecting the KVM dirty bits
+ * via the dirty ring.
+ */
+struct KVMDirtyRingReaper {
+    /* The reaper thread */
+    QemuThread reaper_thr;
+    volatile uint64_t reaper_iteration; /* iteration number of reaper thr */
+    volatile enum KVMDirtyRingReaperState reaper_state; /* reap thr state */
+    QemuSemaphore reaper_sem;   /* wakes the reaper thread up early */
+    bool reaper_quit;           /* the reaper thread should exit */
+    Notifier exit_notifier;
+};
+
 void kvm_memory_listener_register(KVMState *s, KVMMemoryListener *kml,
                                   AddressSpace *as, int as_id);
 
@@ -0,0 +1,17 @@
+/*
+ * Memory merge assist
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#ifndef SYSEMU_MEM_MERGE_H
+#define SYSEMU_MEM_MERGE_H
+
+/*
+ * Start scanning mergeable RAM blocks every @interval seconds and advise
+ * only the ranges worth merging to KSM.
+ */
+void mem_merge_assist_start(uint32_t interval);
+
+#endif
@@ -0,0 +1,28 @@
+/*
+ * Describe translated code to host profilers
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#ifndef TCG_PERF_H
+#define TCG_PERF_H
+
+/* Write /tmp/perf-<pid>.map, read by "perf report" */
+void perf_enable_perfmap(void);
+/* Write jit-<pid>.dump in the temporary directory, for "perf inject -j" */
+void perf_enable_jitdump(void);
+
+/* Describe the TCG prologue and epilogue once they are generated */
+void perf_report_prologue(const void *start, size_t size);
+
+/*
+ * Describe the host code starting at @start, @size bytes long, that
+ * was translated from @guest_pc.
+ */
+void perf_report_code(uint64_t guest_pc, const void *start, size_t size);
+
+/* Flush and close the files opened by perf_enable_*() */
+void perf_exit(void);
+
+#endif /* TCG_PERF_H */
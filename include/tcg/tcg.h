@@ -874,9 +874,11 @@ void *tcg_malloc_internal(TCGContext *s, int size);
 void tcg_pool_reset(TCGContext *s);
 TranslationBlock *tcg_tb_alloc(TCGContext *s);
 
+void tcg_region_reserve(size_t size);
 void tcg_region_init(void);
 void tb_destroy(TranslationBlock *tb);
 void tcg_region_reset_all(void);
+int tcg_region_evict(void);
 
 size_t tcg_code_size(void);
 size_t tcg_code_capacity(void);
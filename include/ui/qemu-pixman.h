@@ -75,6 +75,8 @@ void qemu_pixman_linebuf_copy(pixman_image_t *fb, int width, int x, int y,
                               pixman_image_t *linebuf);
 pixman_image_t *qemu_pixman_mirror_create(pixman_format_code_t format,
                                           pixman_image_t *image);
+pixman_image_t *qemu_pixman_image_new_large(pixman_format_code_t format,
+                                            int width, int height);
 void qemu_pixman_image_unref(pixman_image_t *image);
 
 pixman_color_t qemu_pixman_color(PixelFormat *pf, uint32_t color);
@@ -23,6 +23,7 @@
 #include "qemu/error-report.h"
 #include "qemu/rcu.h"
 #include "qemu/main-loop.h"
+#include "sysemu/kvm.h"
 
 typedef ObjectClass IOThreadClass;
 
@@ -39,6 +40,9 @@ DECLARE_CLASS_CHECKERS(IOThreadClass, IOTHREAD,
 #define IOTHREAD_POLL_MAX_NS_DEFAULT 0ULL
 #endif
 
+/* How often an iothread gives back coroutines it no longer needs */
+#define IOTHREAD_CO_POOL_TRIM_MS 10000
+
 static __thread IOThread *my_iothread;
 
 AioContext *qemu_get_current_aio_context(void)
@@ -46,6 +50,16 @@ AioContext *qemu_get_current_aio_context(void)
     return my_iothread ? my_iothread->ctx : qemu_get_aio_context();
 }
 
+static void iothread_co_pool_trim(void *opaque)
+{
+    IOThread *iothread = opaque;
+
+    qemu_coroutine_pool_trim(iothread->ctx->co_pool);
+    timer_mod(iothread->co_pool_timer,
+              qemu_clock_get_ms(QEMU_CLOCK_REALTIME) +
+              IOTHREAD_CO_POOL_TRIM_MS);
+}
+
 static void *iothread_run(void *opaque)
 {
     IOThread *iothread = opaque;
@@ -57,6 +71,13 @@ static void *iothread_run(void *opaque)
      */
     g_main_context_push_thread_default(iothread->worker_context);
     my_iothread = iothread;
+    qemu_coroutine_pool_attach(iothread->ctx->co_pool);
+    iothread->co_pool_timer = aio_timer_new(iothread->ctx, QEMU_CLOCK_REALTIME,
+                                            SCALE_MS, iothread_co_pool_trim,
+                                            iothread);
+    timer_mod(iothread->co_pool_timer,
+              qemu_clock_get_ms(QEMU_CLOCK_REALTIME) +
+              IOTHREAD_CO_POOL_TRIM_MS);
     iothread->thread_id = qemu_get_thread_id();
     qemu_sem_post(&iothread->init_done_sem);
 
@@ -70,7 +91,9 @@ static void *iothread_run(void *opaque)
          * other words, when we want to run the gcontext with the
          * iothread we need to pay some performance for functionality.
          */
+        kvm_irqchip_batch_begin();
         aio_poll(iothread->ctx, true);
+        kvm_irqchip_batch_end();
 
         /*
          * We must check the running state again in case it was
@@ -81,6 +104,9 @@ static void *iothread_run(void *opaque)
         }
     }
 
+    timer_free(iothread->co_pool_timer);
+    iothread->co_pool_timer = NULL;
+    qemu_coroutine_pool_attach(NULL);
     g_main_context_pop_thread_default(iothread->worker_context);
     rcu_unregister_thread();
     return NULL;
@@ -313,6 +339,7 @@ static int query_one_iothread(Object *object, void *opaque)
     IOThreadInfoList ***tail = opaque;
     IOThreadInfo *info;
     IOThread *iothread;
+    CoroutinePool *pool;
 
     iothread = (IOThread *)object_dynamic_cast(object, TYPE_IOTHREAD);
     if (!iothread) {
@@ -325,6 +352,20 @@ static int query_one_iothread(Object *object, void *opaque)
     info->poll_max_ns = iothread->poll_max_ns;
     info->poll_grow = iothread->poll_grow;
     info->poll_shrink = iothread->poll_shrink;
+    info->notify_sent = stat64_get(&iothread->ctx->notify_sent);
+    info->notify_saved = stat64_get(&iothread->ctx->notify_saved);
+    if (!iothread->stopping) {
+        info->cpu_time_ns = qemu_thread_get_cpu_time_ns(&iothread->thread);
+        info->has_cpu_time_ns = info->cpu_time_ns >= 0;
+    }
+
+    pool = iothread->ctx->co_pool;
+    info->coroutine_pool = g_new0(CoroutinePoolInfo, 1);
+    info->coroutine_pool->size = qatomic_read(&pool->size);
+    info->coroutine_pool->max_size = qemu_coroutine_pool_max_size(pool);
+    info->coroutine_pool->in_use = qatomic_read(&pool->in_use);
+    info->coroutine_pool->hits = stat64_get(&pool->hits);
+    info->coroutine_pool->misses = stat64_get(&pool->misses);
 
     QAPI_LIST_APPEND(*tail, info);
     return 0;
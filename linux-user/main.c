@@ -58,6 +58,9 @@ static envlist_t *envlist;
 static const char *cpu_model;
 static const char *cpu_type;
 static const char *seed_optarg;
+static uint32_t hot_threshold;
+static const char *perf_mode;
+bool jit_stats;
 unsigned long mmap_min_addr;
 uintptr_t guest_base;
 bool have_guest_base;
@@ -376,6 +379,21 @@ static void handle_arg_singlestep(const char *arg)
     singlestep = 1;
 }
 
+static void handle_arg_hot_threshold(const char *arg)
+{
+    hot_threshold = strtoul(arg, NULL, 0);
+}
+
+static void handle_arg_perf(const char *arg)
+{
+    perf_mode = arg;
+}
+
+static void handle_arg_jit_stats(const char *arg)
+{
+    jit_stats = true;
+}
+
 static void handle_arg_strace(const char *arg)
 {
     enable_strace = true;
@@ -454,6 +472,12 @@ static const struct qemu_argument arg_table[] = {
      "pagesize",   "set the host page size to 'pagesize'"},
     {"singlestep", "QEMU_SINGLESTEP",  false, handle_arg_singlestep,
      "",           "run in singlestep mode"},
+    {"hot-threshold", "QEMU_HOT_THRESHOLD", true, handle_arg_hot_threshold,
+     "count",      "translate blocks run 'count' times again as traces"},
+    {"perf",       "QEMU_PERF",        true,  handle_arg_perf,
+     "mode",       "describe translated code to perf (map or jitdump)"},
+    {"jitstats",   "QEMU_JIT_STATS",   false, handle_arg_jit_stats,
+     "",           "print translation statistics when the guest exits"},
     {"strace",     "QEMU_STRACE",      false, handle_arg_strace,
      "",           "log system calls"},
     {"seed",       "QEMU_RAND_SEED",   true,  handle_arg_seed,
@@ -706,6 +730,12 @@ int main(int argc, char **argv, char **envp)
     {
         AccelClass *ac = ACCEL_GET_CLASS(current_accel());
 
+        object_property_set_uint(OBJECT(current_accel()), "hot-threshold",
+                                 hot_threshold, &error_abort);
+        if (perf_mode) {
+            object_property_set_str(OBJECT(current_accel()), "perf",
+                                    perf_mode, &error_fatal);
+        }
         ac->init_machine(NULL);
         accel_init_interfaces(ac);
     }
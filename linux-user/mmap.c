@@ -21,20 +21,139 @@
 #include "exec/log.h"
 #include "qemu.h"
 
+/*
+ * mmap_mutex serializes changes to the guest address space.  The address
+ * space is also split into MMAP_STRIPES interleaved stripes of
+ * 1 << MMAP_STRIPE_SHIFT bytes, each with its own lock, so that
+ * translation and mmap/munmap/mprotect calls only exclude each other
+ * when they touch the same part of it:
+ *
+ *  - mmap_lock() takes the mutex and every stripe;
+ *  - mmap_lock_range() takes the mutex and the stripes covering a range;
+ *  - mmap_lock_pc() takes only the stripes around a block of guest code,
+ *    plus mmap_tb_gen_mutex.
+ *
+ * All threads translate into the same TCGContext, so translations must
+ * not run concurrently even when their stripes differ.  mmap_tb_gen_mutex
+ * serializes those done under mmap_lock_pc(); mmap_lock() excludes them
+ * anyway because it takes every stripe.
+ *
+ * Stripes are always taken after the mutex and in increasing order, and
+ * mmap_tb_gen_mutex after the stripes.
+ * The locks are recursive per thread; a nested call must not need more
+ * than the outermost one took.
+ */
+#define MMAP_STRIPES        64
+#define MMAP_STRIPE_SHIFT   24
+#define MMAP_STRIPES_ALL    ((uint64_t)-1)
+
 static pthread_mutex_t mmap_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t mmap_tb_gen_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t mmap_stripe[MMAP_STRIPES] = {
+    [0 ... MMAP_STRIPES - 1] = PTHREAD_MUTEX_INITIALIZER
+};
 static __thread int mmap_lock_count;
+static __thread bool mmap_mutex_held;
+static __thread bool mmap_tb_gen_held;
+static __thread uint64_t mmap_stripes_held;
 
-void mmap_lock(void)
+/* Stripes covering [start, end), widened to whole host pages plus one. */
+static uint64_t mmap_stripe_mask(abi_ulong start, abi_ulong end)
+{
+    abi_ulong pad = MAX(qemu_host_page_size, TARGET_PAGE_SIZE);
+    abi_ulong first, last;
+    uint64_t mask = 0;
+
+    start &= qemu_host_page_mask;
+    end = HOST_PAGE_ALIGN(end);
+    start = start > pad ? start - pad : 0;
+    if (end <= start || end + pad < end) {
+        return MMAP_STRIPES_ALL;
+    }
+    end += pad;
+
+    first = start >> MMAP_STRIPE_SHIFT;
+    last = (end - 1) >> MMAP_STRIPE_SHIFT;
+    if (last - first >= MMAP_STRIPES - 1) {
+        return MMAP_STRIPES_ALL;
+    }
+    for (; first <= last; first++) {
+        mask |= 1ull << (first % MMAP_STRIPES);
+    }
+    return mask;
+}
+
+static void mmap_lock_stripes(uint64_t mask)
+{
+    int i;
+
+    for (i = 0; i < MMAP_STRIPES; i++) {
+        if (mask & (1ull << i)) {
+            pthread_mutex_lock(&mmap_stripe[i]);
+        }
+    }
+}
+
+static void mmap_unlock_stripes(uint64_t mask)
+{
+    int i;
+
+    for (i = MMAP_STRIPES - 1; i >= 0; i--) {
+        if (mask & (1ull << i)) {
+            pthread_mutex_unlock(&mmap_stripe[i]);
+        }
+    }
+}
+
+static void mmap_lock_stripes_mutex(uint64_t mask, bool mutex)
 {
     if (mmap_lock_count++ == 0) {
-        pthread_mutex_lock(&mmap_mutex);
+        if (mutex) {
+            pthread_mutex_lock(&mmap_mutex);
+        }
+        mmap_lock_stripes(mask);
+        /* Without the mutex, this is a translation */
+        if (!mutex) {
+            pthread_mutex_lock(&mmap_tb_gen_mutex);
+        }
+        mmap_mutex_held = mutex;
+        mmap_tb_gen_held = !mutex;
+        mmap_stripes_held = mask;
+    } else {
+        assert(mmap_mutex_held || !mutex);
+        assert((mmap_stripes_held & mask) == mask);
     }
 }
 
+void mmap_lock(void)
+{
+    mmap_lock_stripes_mutex(MMAP_STRIPES_ALL, true);
+}
+
+void mmap_lock_range(abi_ulong start, abi_ulong len)
+{
+    mmap_lock_stripes_mutex(mmap_stripe_mask(start, start + len), true);
+}
+
+void mmap_lock_pc(target_ulong pc)
+{
+    mmap_lock_stripes_mutex(mmap_stripe_mask(pc, pc + 2 * TARGET_PAGE_SIZE),
+                            false);
+}
+
 void mmap_unlock(void)
 {
     if (--mmap_lock_count == 0) {
-        pthread_mutex_unlock(&mmap_mutex);
+        if (mmap_tb_gen_held) {
+            pthread_mutex_unlock(&mmap_tb_gen_mutex);
+        }
+        mmap_unlock_stripes(mmap_stripes_held);
+        if (mmap_mutex_held) {
+            pthread_mutex_unlock(&mmap_mutex);
+        }
+        mmap_mutex_held = false;
+        mmap_tb_gen_held = false;
+        mmap_stripes_held = 0;
     }
 }
 
@@ -49,14 +168,25 @@ void mmap_fork_start(void)
     if (mmap_lock_count)
         abort();
     pthread_mutex_lock(&mmap_mutex);
+    mmap_lock_stripes(MMAP_STRIPES_ALL);
+    pthread_mutex_lock(&mmap_tb_gen_mutex);
 }
 
 void mmap_fork_end(int child)
 {
-    if (child)
+    int i;
+
+    if (child) {
         pthread_mutex_init(&mmap_mutex, NULL);
-    else
+        pthread_mutex_init(&mmap_tb_gen_mutex, NULL);
+        for (i = 0; i < MMAP_STRIPES; i++) {
+            pthread_mutex_init(&mmap_stripe[i], NULL);
+        }
+    } else {
+        pthread_mutex_unlock(&mmap_tb_gen_mutex);
+        mmap_unlock_stripes(MMAP_STRIPES_ALL);
         pthread_mutex_unlock(&mmap_mutex);
+    }
 }
 
 /*
@@ -132,7 +262,7 @@ int target_mprotect(abi_ulong start, abi_ulong len, int target_prot)
         return 0;
     }
 
-    mmap_lock();
+    mmap_lock_range(start, len);
     host_start = start & qemu_host_page_mask;
     host_end = HOST_PAGE_ALIGN(end);
     if (start > host_start) {
@@ -425,7 +555,11 @@ abi_long target_mmap(abi_ulong start, abi_ulong len, int target_prot,
     abi_ulong ret, end, real_start, real_end, retaddr, host_offset, host_len;
     int page_flags, host_prot;
 
-    mmap_lock();
+    if (flags & MAP_FIXED) {
+        mmap_lock_range(start, len);
+    } else {
+        mmap_lock();
+    }
     trace_target_mmap(start, len, target_prot, flags, fd, offset);
 
     if (!len) {
@@ -679,7 +813,7 @@ int target_munmap(abi_ulong start, abi_ulong len)
         return -TARGET_EINVAL;
     }
 
-    mmap_lock();
+    mmap_lock_range(start, len);
     end = start + len;
     real_start = start & qemu_host_page_mask;
     real_end = HOST_PAGE_ALIGN(end);
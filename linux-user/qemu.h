@@ -155,6 +155,13 @@ typedef struct TaskState {
      */
     int signal_pending;
 
+    /*
+     * True if block_signals() blocked all host signals and they were not
+     * unblocked since, so that process_pending_signals() need not block
+     * them again.
+     */
+    bool host_signals_blocked;
+
     /* This thread's sigaltstack, if it has one */
     struct target_sigaltstack sigaltstack_used;
 } __attribute__((aligned(16))) TaskState;
@@ -165,6 +172,7 @@ void task_settid(TaskState *);
 void stop_all_tasks(void);
 extern const char *qemu_uname_release;
 extern unsigned long mmap_min_addr;
+extern bool jit_stats;
 
 /* ??? See if we can avoid exposing so much of the loader internals.  */
 
@@ -478,6 +486,7 @@ abi_long target_mremap(abi_ulong old_addr, abi_ulong old_size,
 extern unsigned long last_brk;
 extern abi_ulong mmap_next_start;
 abi_ulong mmap_find_vma(abi_ulong, abi_ulong, abi_ulong);
+void mmap_lock_range(abi_ulong start, abi_ulong len);
 void mmap_fork_start(void);
 void mmap_fork_end(int child);
 
@@ -640,6 +649,9 @@ int copy_to_user(abi_ulong gaddr, void *hptr, size_t len);
    host area will have the same contents as the guest.  */
 void *lock_user(int type, abi_ulong guest_addr, size_t len, bool copy);
 
+/* As lock_user, for an untagged area already checked with access_ok.  */
+void *lock_user_checked(abi_ulong guest_addr, size_t len, bool copy);
+
 /* Unlock an area of guest memory.  The first LEN bytes must be
    flushed back to guest memory. host_ptr = NULL is explicitly
    allowed and does nothing. */
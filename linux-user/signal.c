@@ -192,12 +192,40 @@ int block_signals(void)
      * run any further guest code before unblocking signals in
      * process_pending_signals().
      */
-    sigfillset(&set);
-    sigprocmask(SIG_SETMASK, &set, 0);
+    if (!ts->host_signals_blocked) {
+        sigfillset(&set);
+        sigprocmask(SIG_SETMASK, &set, 0);
+        ts->host_signals_blocked = true;
+    }
 
     return qatomic_xchg(&ts->signal_pending, 1);
 }
 
+/* Let host signals in again, as allowed by the guest signal mask */
+static void unblock_host_signals(TaskState *ts)
+{
+    sigset_t set = ts->signal_mask;
+
+    sigdelset(&set, SIGSEGV);
+    sigdelset(&set, SIGBUS);
+    ts->host_signals_blocked = false;
+    sigprocmask(SIG_SETMASK, &set, 0);
+}
+
+/* Whether a queued signal is not blocked by the guest signal mask */
+static bool signal_deliverable(TaskState *ts)
+{
+    int sig;
+
+    for (sig = 1; sig <= TARGET_NSIG; sig++) {
+        if (ts->sigtab[sig - 1].pending &&
+            !sigismember(&ts->signal_mask, target_to_host_signal_table[sig])) {
+            return true;
+        }
+    }
+    return false;
+}
+
 /* Wrapper for sigprocmask function
  * Emulates a sigprocmask in a safe way for the guest. Note that set and oldset
  * are host signal set, not guest ones. Returns -TARGET_ERESTARTSYS if
@@ -241,6 +269,17 @@ int do_sigprocmask(int how, const sigset_t *set, sigset_t *oldset)
         /* Silently ignore attempts to change blocking status of KILL or STOP */
         sigdelset(&ts->signal_mask, SIGKILL);
         sigdelset(&ts->signal_mask, SIGSTOP);
+
+        /*
+         * No signal was pending when block_signals() was called, so unless
+         * the new mask lets a queued one through there is nothing for
+         * process_pending_signals() to do but unblocking host signals.
+         * Do it here and skip the scan.
+         */
+        if (!signal_deliverable(ts)) {
+            qatomic_set(&ts->signal_pending, 0);
+            unblock_host_signals(ts);
+        }
     }
     return 0;
 }
@@ -749,6 +788,7 @@ static void host_signal_handler(int host_signum, siginfo_t *info,
     memset(&uc->uc_sigmask, 0xff, SIGSET_T_SIZE);
     sigdelset(&uc->uc_sigmask, SIGSEGV);
     sigdelset(&uc->uc_sigmask, SIGBUS);
+    ts->host_signals_blocked = false;
 
     /* interrupt the virtual CPU as soon as possible */
     cpu_exit(thread_cpu);
@@ -1006,8 +1046,11 @@ void process_pending_signals(CPUArchState *cpu_env)
 
     while (qatomic_read(&ts->signal_pending)) {
         /* FIXME: This is not threadsafe.  */
-        sigfillset(&set);
-        sigprocmask(SIG_SETMASK, &set, 0);
+        if (!ts->host_signals_blocked) {
+            sigfillset(&set);
+            sigprocmask(SIG_SETMASK, &set, 0);
+            ts->host_signals_blocked = true;
+        }
 
     restart_scan:
         sig = ts->sync_signal.pending;
@@ -1050,10 +1093,7 @@ void process_pending_signals(CPUArchState *cpu_env)
          */
         qatomic_set(&ts->signal_pending, 0);
         ts->in_sigsuspend = 0;
-        set = ts->signal_mask;
-        sigdelset(&set, SIGSEGV);
-        sigdelset(&set, SIGBUS);
-        sigprocmask(SIG_SETMASK, &set, 0);
+        unblock_host_signals(ts);
     }
     ts->in_sigsuspend = 0;
 }
@@ -1234,6 +1234,29 @@ static inline abi_long copy_to_user_timeval64(abi_ulong target_tv_addr,
     return 0;
 }
 
+/*
+ * Whether a target structure has the host layout, so that the host kernel
+ * can access the guest copy directly.  These are compile-time constants,
+ * so the conversion code goes away when they hold.
+ */
+#if defined(HOST_WORDS_BIGENDIAN) == defined(TARGET_WORDS_BIGENDIAN)
+#define TARGET_LAYOUT_IS_HOST(cond) (cond)
+#else
+#define TARGET_LAYOUT_IS_HOST(cond) false
+#endif
+
+#define TARGET_TIMESPEC_IS_HOST                             \
+    TARGET_LAYOUT_IS_HOST(sizeof(abi_long) == sizeof(long) && \
+                          sizeof(abi_long) == sizeof(time_t))
+
+#ifdef CONFIG_EPOLL
+#define TARGET_EPOLL_EVENT_IS_HOST                                       \
+    TARGET_LAYOUT_IS_HOST(sizeof(struct target_epoll_event) ==           \
+                          sizeof(struct epoll_event) &&                  \
+                          offsetof(struct target_epoll_event, data) ==   \
+                          offsetof(struct epoll_event, data))
+#endif
+
 #if defined(TARGET_NR_futex) || \
     defined(TARGET_NR_rt_sigtimedwait) || \
     defined(TARGET_NR_pselect6) || defined(TARGET_NR_pselect6) || \
@@ -3078,15 +3101,40 @@ static void target_to_host_low_high(abi_ulong tlow,
     *hhigh = (off >> HOST_LONG_BITS / 2) >> HOST_LONG_BITS / 2;
 }
 
+/*
+ * Return the end of the run of contiguous, non-empty guest buffers that
+ * starts at @target_vec[@i].
+ */
+static abi_ulong iovec_run_end(struct target_iovec *target_vec, int i,
+                               abi_ulong count)
+{
+    abi_ulong end = cpu_untagged_addr(thread_cpu,
+                                      tswapal(target_vec[i].iov_base));
+
+    for (; i < count; i++) {
+        abi_ulong base = cpu_untagged_addr(thread_cpu,
+                                           tswapal(target_vec[i].iov_base));
+        abi_long len = tswapal(target_vec[i].iov_len);
+
+        if (len <= 0 || base != end || base + len < base) {
+            break;
+        }
+        end = base + len;
+    }
+    return end;
+}
+
 static struct iovec *lock_iovec(int type, abi_ulong target_addr,
                                 abi_ulong count, int copy)
 {
     struct target_iovec *target_vec;
     struct iovec *vec;
     abi_ulong total_len, max_len;
+    abi_ulong run_start = 0, run_end = 0;
     int i;
     int err = 0;
     bool bad_address = false;
+    bool run_ok = false;
 
     if (count == 0) {
         errno = 0;
@@ -3126,7 +3174,28 @@ static struct iovec *lock_iovec(int type, abi_ulong target_addr,
             /* Zero length pointer is ignored.  */
             vec[i].iov_base = 0;
         } else {
-            vec[i].iov_base = lock_user(type, base, len, copy);
+            abi_ulong start = cpu_untagged_addr(thread_cpu, base);
+
+            /*
+             * Scatter/gather lists often cover one contiguous area, so
+             * check the page flags for each run of adjacent buffers at
+             * once.  If the run has a fault, check the rest of its buffers
+             * one by one to know which one is bad, but do not look for a
+             * new run until past it.
+             */
+            if (start < run_start || start >= run_end
+                || len > run_end - start) {
+                run_start = start;
+                run_end = iovec_run_end(target_vec, i, count);
+                run_ok = run_end - run_start > len
+                    && access_ok_untagged(type, run_start,
+                                          run_end - run_start);
+            }
+            if (run_ok) {
+                vec[i].iov_base = lock_user_checked(start, len, copy);
+            } else {
+                vec[i].iov_base = lock_user(type, base, len, copy);
+            }
             /* If the first buffer pointer is bad, this is a fault.  But
              * subsequent bad buffers will result in a partial write; this
              * is realized by filling the vector with null pointers and
@@ -7625,11 +7694,18 @@ static int do_futex(CPUState *cpu, target_ulong uaddr, int op, int val,
     switch (base_op) {
     case FUTEX_WAIT:
     case FUTEX_WAIT_BITSET:
-        if (timeout) {
-            pts = &ts;
-            target_to_host_timespec(pts, timeout);
-        } else {
+        if (!timeout) {
             pts = NULL;
+        } else if (TARGET_TIMESPEC_IS_HOST) {
+            if (!access_ok(cpu, VERIFY_READ, timeout, sizeof(ts))) {
+                return -TARGET_EFAULT;
+            }
+            pts = g2h(cpu, timeout);
+        } else {
+            pts = &ts;
+            if (target_to_host_timespec(pts, timeout)) {
+                return -TARGET_EFAULT;
+            }
         }
         return do_safe_futex(g2h(cpu, uaddr),
                              op, tswap32(val), pts, NULL, val3);
@@ -7675,13 +7751,18 @@ static int do_futex_time64(CPUState *cpu, target_ulong uaddr, int op,
     switch (base_op) {
     case FUTEX_WAIT:
     case FUTEX_WAIT_BITSET:
-        if (timeout) {
+        /*
+         * No fast path as in do_futex(): only 32-bit ABIs have
+         * futex_time64, and their tv_nsec has padding that the host kernel
+         * would not ignore, so the timeout always needs converting.
+         */
+        if (!timeout) {
+            pts = NULL;
+        } else {
             pts = &ts;
             if (target_to_host_timespec64(pts, timeout)) {
                 return -TARGET_EFAULT;
             }
-        } else {
-            pts = NULL;
         }
         return do_safe_futex(g2h(cpu, uaddr), op,
                              tswap32(val), pts, NULL, val3);
@@ -12746,7 +12827,12 @@ static abi_long do_syscall1(void *cpu_env, int num, abi_long arg1,
     {
         struct epoll_event ep;
         struct epoll_event *epp = 0;
-        if (arg4) {
+        if (arg4 && arg2 != EPOLL_CTL_DEL && TARGET_EPOLL_EVENT_IS_HOST) {
+            if (!access_ok(cpu, VERIFY_READ, arg4, sizeof(ep))) {
+                return -TARGET_EFAULT;
+            }
+            epp = g2h(cpu, arg4);
+        } else if (arg4) {
             if (arg2 != EPOLL_CTL_DEL) {
                 struct target_epoll_event *target_ep;
                 if (!lock_user_struct(VERIFY_READ, target_ep, arg4, 1)) {
@@ -12796,10 +12882,15 @@ static abi_long do_syscall1(void *cpu_env, int num, abi_long arg1,
             return -TARGET_EFAULT;
         }
 
-        ep = g_try_new(struct epoll_event, maxevents);
-        if (!ep) {
-            unlock_user(target_ep, arg2, 0);
-            return -TARGET_ENOMEM;
+        if (TARGET_EPOLL_EVENT_IS_HOST) {
+            /* Let the kernel fill the guest buffer */
+            ep = (struct epoll_event *)target_ep;
+        } else {
+            ep = g_try_new(struct epoll_event, maxevents);
+            if (!ep) {
+                unlock_user(target_ep, arg2, 0);
+                return -TARGET_ENOMEM;
+            }
         }
 
         switch (num) {
@@ -12843,7 +12934,7 @@ static abi_long do_syscall1(void *cpu_env, int num, abi_long arg1,
         }
         if (!is_error(ret)) {
             int i;
-            for (i = 0; i < ret; i++) {
+            for (i = 0; !TARGET_EPOLL_EVENT_IS_HOST && i < ret; i++) {
                 target_ep[i].events = tswap32(ep[i].events);
                 target_ep[i].data.u64 = tswap64(ep[i].data.u64);
             }
@@ -12852,7 +12943,9 @@ static abi_long do_syscall1(void *cpu_env, int num, abi_long arg1,
         } else {
             unlock_user(target_ep, arg2, 0);
         }
-        g_free(ep);
+        if (!TARGET_EPOLL_EVENT_IS_HOST) {
+            g_free(ep);
+        }
         return ret;
     }
 #endif
@@ -13305,3 +13398,34 @@ abi_long do_syscall(void *cpu_env, int num, abi_long arg1,
     record_syscall_return(cpu, num, ret);
     return ret;
 }
+
+#ifdef TARGET_X86_64
+bool user_fast_syscall(CPUArchState *env, int num, target_ulong arg1,
+                       target_ulong arg2, target_ulong *ret)
+{
+#ifdef DEBUG_ERESTARTSYS
+    return false;
+#endif
+
+    switch (num) {
+#ifdef TARGET_NR_clock_gettime
+    case TARGET_NR_clock_gettime:
+#endif
+#ifdef TARGET_NR_clock_getres
+    case TARGET_NR_clock_getres:
+#endif
+#ifdef TARGET_NR_gettimeofday
+    case TARGET_NR_gettimeofday:
+#endif
+#ifdef TARGET_NR_time
+    case TARGET_NR_time:
+#endif
+        break;
+    default:
+        return false;
+    }
+
+    *ret = do_syscall(env, num, arg1, arg2, 0, 0, 0, 0, 0, 0);
+    return true;
+}
+#endif
@@ -6,13 +6,17 @@
 
 void *lock_user(int type, abi_ulong guest_addr, size_t len, bool copy)
 {
-    void *host_addr;
-
     guest_addr = cpu_untagged_addr(thread_cpu, guest_addr);
     if (!access_ok_untagged(type, guest_addr, len)) {
         return NULL;
     }
-    host_addr = g2h_untagged(guest_addr);
+    return lock_user_checked(guest_addr, len, copy);
+}
+
+void *lock_user_checked(abi_ulong guest_addr, size_t len, bool copy)
+{
+    void *host_addr = g2h_untagged(guest_addr);
+
 #ifdef DEBUG_REMAP
     if (copy) {
         host_addr = g_memdup(host_addr, len);
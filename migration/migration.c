@@ -20,10 +20,13 @@
 #include "migration/blocker.h"
 #include "exec.h"
 #include "fd.h"
+#include "file.h"
 #include "socket.h"
 #include "sysemu/runstate.h"
 #include "sysemu/sysemu.h"
 #include "sysemu/cpu-throttle.h"
+#include "sysemu/dirtylimit.h"
+#include "sysemu/kvm.h"
 #include "rdma.h"
 #include "ram.h"
 #include "migration/global_state.h"
@@ -91,6 +94,12 @@
 #define DEFAULT_MIGRATE_CPU_THROTTLE_INITIAL 20
 #define DEFAULT_MIGRATE_CPU_THROTTLE_INCREMENT 10
 #define DEFAULT_MIGRATE_MAX_CPU_THROTTLE 99
+/* Default per-vCPU dirty page rate limit, in MB/s */
+#define DEFAULT_MIGRATE_VCPU_DIRTY_LIMIT 1
+
+/* 0: place postcopy pages from the thread reading the stream */
+#define DEFAULT_MIGRATE_POSTCOPY_PLACE_THREADS 0
+#define MAX_MIGRATE_POSTCOPY_PLACE_THREADS 64
 
 /* Migration XBZRLE default cache size */
 #define DEFAULT_MIGRATE_XBZRLE_CACHE_SIZE (64 * 1024 * 1024)
@@ -176,7 +185,22 @@ static MigrationIncomingState *current_incoming;
 
 static GSList *migration_blockers;
 
+/*
+ * query-migrate may be executed out-of-band in the monitor I/O thread,
+ * without the BQL.  It then returns a copy of this snapshot, which the
+ * main loop rebuilds whenever the migration state changes and whenever
+ * the migration thread updates its counters.
+ */
+typedef struct MigrationInfoSnapshot {
+    struct rcu_head rcu;
+    MigrationInfo *info;
+} MigrationInfoSnapshot;
+
+static MigrationInfoSnapshot *migration_info_snapshot;
+static QEMUBH *migration_info_bh;
+
 static bool migration_object_check(MigrationState *ms, Error **errp);
+static void migration_info_bh_cb(void *opaque);
 static int migration_maybe_pause(MigrationState *s,
                                  int *current_active_state,
                                  int new_state);
@@ -221,6 +245,9 @@ void migration_object_init(void)
     blk_mig_init();
     ram_mig_init();
     dirty_bitmap_mig_init();
+
+    migration_info_bh = qemu_bh_new(migration_info_bh_cb, NULL);
+    qemu_bh_schedule(migration_info_bh);
 }
 
 void migration_shutdown(void)
@@ -275,6 +302,10 @@ void migration_incoming_state_destroy(void)
         qemu_fclose(mis->from_src_file);
         mis->from_src_file = NULL;
     }
+    if (mis->postcopy_qemufile_dst) {
+        qemu_fclose(mis->postcopy_qemufile_dst);
+        mis->postcopy_qemufile_dst = NULL;
+    }
     if (mis->postcopy_remote_fds) {
         g_array_free(mis->postcopy_remote_fds, TRUE);
         mis->postcopy_remote_fds = NULL;
@@ -471,6 +502,8 @@ static void qemu_start_incoming_migration(const char *uri, Error **errp)
         exec_start_incoming_migration(p, errp);
     } else if (strstart(uri, "fd:", &p)) {
         fd_start_incoming_migration(p, errp);
+    } else if (strstart(uri, "file:", &p)) {
+        file_start_incoming_migration(p, errp);
     } else {
         yank_unregister_instance(MIGRATION_YANK_INSTANCE);
         error_setg(errp, "unknown migration protocol: %s", uri);
@@ -530,6 +563,10 @@ static void process_incoming_migration_bh(void *opaque)
     } else {
         runstate_set(global_state_get_runstate());
     }
+    mis->downtime_switchover = qemu_clock_get_us(QEMU_CLOCK_REALTIME) -
+                               mis->switchover_start;
+    trace_process_incoming_migration_bh_switchover(mis->downtime_device_state,
+                                                   mis->downtime_switchover);
     /*
      * This must happen after any state changes since as soon as an external
      * observer sees this event they might start to prod at the VM assuming
@@ -555,6 +592,7 @@ static void process_incoming_migration_co(void *opaque)
     migrate_set_state(&mis->state, MIGRATION_STATUS_NONE,
                       MIGRATION_STATUS_ACTIVE);
     ret = qemu_loadvm_state(mis->from_src_file);
+    mis->switchover_start = qemu_clock_get_us(QEMU_CLOCK_REALTIME);
 
     ps = postcopy_state_get();
     trace_process_incoming_migration_co_end(ret, ps);
@@ -718,9 +756,15 @@ void migration_ioc_process_incoming(QIOChannel *ioc, Error **errp)
 
         /*
          * Common migration only needs one channel, so we can start
-         * right now.  Multifd needs more than one channel, we wait.
+         * right now.  Multifd and postcopy-preempt need more than one
+         * channel, we wait.
          */
-        start_migration = !migrate_use_multifd();
+        start_migration = !migrate_use_multifd() &&
+                          !migrate_postcopy_preempt();
+    } else if (migrate_postcopy_preempt()) {
+        /* The second connection is the postcopy preempt channel */
+        postcopy_preempt_new_channel(mis, qemu_fopen_channel_input(ioc));
+        start_migration = true;
     } else {
         /* Multiple connections */
         assert(migrate_use_multifd());
@@ -749,6 +793,10 @@ bool migration_has_all_channels(void)
 
     all_channels = multifd_recv_all_channels_created();
 
+    if (migrate_postcopy_preempt()) {
+        all_channels = all_channels && mis->postcopy_qemufile_dst != NULL;
+    }
+
     return all_channels && mis->from_src_file != NULL;
 }
 
@@ -908,6 +956,10 @@ MigrationParameters *qmp_query_migrate_parameters(Error **errp)
     params->announce_rounds = s->parameters.announce_rounds;
     params->has_announce_step = true;
     params->announce_step = s->parameters.announce_step;
+    params->has_vcpu_dirty_limit = true;
+    params->vcpu_dirty_limit = s->parameters.vcpu_dirty_limit;
+    params->has_postcopy_place_threads = true;
+    params->postcopy_place_threads = s->parameters.postcopy_place_threads;
 
     if (s->parameters.has_block_bitmap_mapping) {
         params->has_block_bitmap_mapping = true;
@@ -996,6 +1048,24 @@ static void populate_time_info(MigrationInfo *info, MigrationState *s)
     }
 }
 
+static void populate_downtime_info(MigrationInfo *info, MigrationState *s)
+{
+    DowntimeStats *stats = g_new0(DowntimeStats, 1);
+
+    stats->has_vm_stop = true;
+    stats->vm_stop = s->downtime_vm_stop;
+    stats->has_bitmap_sync = true;
+    stats->bitmap_sync = s->downtime_bitmap_sync;
+    stats->has_ram_flush = true;
+    stats->ram_flush = s->downtime_ram_flush;
+    stats->device_state = s->downtime_device_state;
+    stats->devices = qemu_savevm_downtime_devices(false);
+
+    qapi_free_DowntimeStats(info->downtime_stats);
+    info->has_downtime_stats = true;
+    info->downtime_stats = stats;
+}
+
 static void populate_ram_info(MigrationInfo *info, MigrationState *s)
 {
     info->has_ram = true;
@@ -1044,6 +1114,24 @@ static void populate_ram_info(MigrationInfo *info, MigrationState *s)
         info->cpu_throttle_percentage = cpu_throttle_get_percentage();
     }
 
+    if (migrate_dirty_limit() && dirtylimit_in_service()) {
+        MachineState *ms = MACHINE(qdev_get_machine());
+        uint64List *rates = NULL;
+        int i;
+
+        info->has_dirty_limit_throttle_time_per_round = true;
+        info->dirty_limit_throttle_time_per_round =
+                            dirtylimit_throttle_time_per_round();
+        info->has_dirty_limit_ring_full_time = true;
+        info->dirty_limit_ring_full_time = dirtylimit_ring_full_time();
+
+        for (i = ms->smp.cpus - 1; i >= 0; i--) {
+            QAPI_LIST_PREPEND(rates, dirtylimit_vcpu_dirty_rate(i));
+        }
+        info->has_dirty_limit_vcpu_dirty_rate = true;
+        info->dirty_limit_vcpu_dirty_rate = rates;
+    }
+
     if (s->state != MIGRATION_STATUS_COMPLETED) {
         info->ram->remaining = ram_bytes_remaining();
         info->ram->dirty_pages_rate = ram_counters.dirty_pages_rate;
@@ -1068,6 +1156,7 @@ static void populate_vfio_info(MigrationInfo *info)
         info->has_vfio = true;
         info->vfio = g_malloc0(sizeof(*info->vfio));
         info->vfio->transferred = vfio_mig_bytes_transferred();
+        info->vfio->dirty_sync_time = vfio_mig_dirty_sync_time() / SCALE_MS;
     }
 #endif
 }
@@ -1125,6 +1214,10 @@ static void fill_source_migration_info(MigrationInfo *info)
         break;
     case MIGRATION_STATUS_COMPLETED:
         populate_time_info(info, s);
+        /* Postcopy has no single stop-and-copy to break down */
+        if (!s->postcopy_after_devices) {
+            populate_downtime_info(info, s);
+        }
         populate_ram_info(info, s);
         populate_vfio_info(info);
         break;
@@ -1231,6 +1324,65 @@ static bool migrate_caps_check(bool *cap_list,
         }
     }
 
+    if (cap_list[MIGRATION_CAPABILITY_MULTIFD_ZERO_PAGE] &&
+        !cap_list[MIGRATION_CAPABILITY_MULTIFD]) {
+        error_setg(errp, "Multifd zero page detection requires multifd");
+        return false;
+    }
+
+    if (cap_list[MIGRATION_CAPABILITY_POSTCOPY_PREEMPT]) {
+        if (!cap_list[MIGRATION_CAPABILITY_POSTCOPY_RAM]) {
+            error_setg(errp, "Postcopy preempt requires postcopy-ram");
+            return false;
+        }
+        if (cap_list[MIGRATION_CAPABILITY_MULTIFD]) {
+            error_setg(errp, "Postcopy preempt is not compatible with multifd");
+            return false;
+        }
+    }
+
+    if (cap_list[MIGRATION_CAPABILITY_MAPPED_RAM]) {
+        if (cap_list[MIGRATION_CAPABILITY_MULTIFD] ||
+            cap_list[MIGRATION_CAPABILITY_XBZRLE] ||
+            cap_list[MIGRATION_CAPABILITY_COMPRESS] ||
+            cap_list[MIGRATION_CAPABILITY_POSTCOPY_RAM] ||
+            cap_list[MIGRATION_CAPABILITY_X_COLO]) {
+            error_setg(errp, "Mapped-ram is not compatible with multifd, "
+                       "xbzrle, compress, postcopy-ram or x-colo");
+            return false;
+        }
+    }
+
+    if (cap_list[MIGRATION_CAPABILITY_MAPPED_RAM_MMAP] &&
+        !cap_list[MIGRATION_CAPABILITY_MAPPED_RAM]) {
+        error_setg(errp, "Mapped-ram-mmap requires mapped-ram");
+        return false;
+    }
+
+    if (cap_list[MIGRATION_CAPABILITY_DIRTY_LIMIT]) {
+        if (cap_list[MIGRATION_CAPABILITY_AUTO_CONVERGE]) {
+            error_setg(errp, "Dirty limit is not compatible with "
+                       "auto-converge");
+            return false;
+        }
+        if (!kvm_enabled() || !kvm_dirty_ring_enabled()) {
+            error_setg(errp, "Dirty limit requires KVM with the dirty "
+                       "ring enabled");
+            return false;
+        }
+    }
+
+#ifdef CONFIG_LINUX
+    if (cap_list[MIGRATION_CAPABILITY_ZERO_COPY_SEND] &&
+        (!cap_list[MIGRATION_CAPABILITY_MULTIFD] ||
+         cap_list[MIGRATION_CAPABILITY_COMPRESS] ||
+         cap_list[MIGRATION_CAPABILITY_XBZRLE])) {
+        error_setg(errp, "Zero copy only available for non-compressed "
+                   "multifd migration");
+        return false;
+    }
+#endif
+
     if (cap_list[MIGRATION_CAPABILITY_BACKGROUND_SNAPSHOT]) {
         WriteTrackingSupport wt_support;
         int idx;
@@ -1294,12 +1446,21 @@ static void fill_destination_migration_info(MigrationInfo *info)
     case MIGRATION_STATUS_COMPLETED:
         info->has_status = true;
         fill_destination_postcopy_migration_info(info);
+        if (postcopy_state_get() > POSTCOPY_INCOMING_ADVISE) {
+            break;
+        }
+        info->has_downtime_stats = true;
+        info->downtime_stats = g_new0(DowntimeStats, 1);
+        info->downtime_stats->device_state = mis->downtime_device_state;
+        info->downtime_stats->has_switchover = true;
+        info->downtime_stats->switchover = mis->downtime_switchover;
+        info->downtime_stats->devices = qemu_savevm_downtime_devices(true);
         break;
     }
     info->status = mis->state;
 }
 
-MigrationInfo *qmp_query_migrate(Error **errp)
+static MigrationInfo *migration_info_fill(void)
 {
     MigrationInfo *info = g_malloc0(sizeof(*info));
 
@@ -1309,6 +1470,50 @@ MigrationInfo *qmp_query_migrate(Error **errp)
     return info;
 }
 
+static void migration_info_snapshot_free(MigrationInfoSnapshot *snap)
+{
+    qapi_free_MigrationInfo(snap->info);
+    g_free(snap);
+}
+
+static void migration_info_bh_cb(void *opaque)
+{
+    MigrationInfoSnapshot *snap = g_new0(MigrationInfoSnapshot, 1);
+    MigrationInfoSnapshot *old;
+
+    snap->info = migration_info_fill();
+    old = qatomic_xchg(&migration_info_snapshot, snap);
+    if (old) {
+        call_rcu(old, migration_info_snapshot_free, rcu);
+    }
+}
+
+/* Rebuild the snapshot returned to out-of-band query-migrate */
+void migration_info_update(void)
+{
+    if (migration_info_bh) {
+        qemu_bh_schedule(migration_info_bh);
+    }
+}
+
+MigrationInfo *qmp_query_migrate(Error **errp)
+{
+    MigrationInfoSnapshot *snap;
+
+    if (qemu_mutex_iothread_locked()) {
+        return migration_info_fill();
+    }
+
+    /* Out-of-band, the migration state may not be looked at directly */
+    RCU_READ_LOCK_GUARD();
+    snap = qatomic_rcu_read(&migration_info_snapshot);
+    if (!snap) {
+        error_setg(errp, "Migration status is not available yet");
+        return NULL;
+    }
+    return QAPI_CLONE(MigrationInfo, snap->info);
+}
+
 void qmp_migrate_set_capabilities(MigrationCapabilityStatusList *params,
                                   Error **errp)
 {
@@ -1473,6 +1678,22 @@ static bool migrate_params_check(MigrationParameters *params, Error **errp)
        return false;
     }
 
+    if (params->has_vcpu_dirty_limit &&
+        params->vcpu_dirty_limit < 1) {
+        error_setg(errp, QERR_INVALID_PARAMETER_VALUE,
+                   "vcpu_dirty_limit",
+                   "a value greater than or equal to 1");
+        return false;
+    }
+
+    if (params->has_postcopy_place_threads &&
+        params->postcopy_place_threads > MAX_MIGRATE_POSTCOPY_PLACE_THREADS) {
+        error_setg(errp, QERR_INVALID_PARAMETER_VALUE,
+                   "postcopy_place_threads",
+                   "a value between 0 and 64");
+        return false;
+    }
+
     if (params->has_block_bitmap_mapping &&
         !check_dirty_bitmap_mig_alias_map(params->block_bitmap_mapping, errp)) {
         error_prepend(errp, "Invalid mapping given for block-bitmap-mapping: ");
@@ -1573,6 +1794,12 @@ static void migrate_params_test_apply(MigrateSetParameters *params,
     if (params->has_announce_step) {
         dest->announce_step = params->announce_step;
     }
+    if (params->has_vcpu_dirty_limit) {
+        dest->vcpu_dirty_limit = params->vcpu_dirty_limit;
+    }
+    if (params->has_postcopy_place_threads) {
+        dest->postcopy_place_threads = params->postcopy_place_threads;
+    }
 
     if (params->has_block_bitmap_mapping) {
         dest->has_block_bitmap_mapping = true;
@@ -1690,6 +1917,16 @@ static void migrate_params_apply(MigrateSetParameters *params, Error **errp)
     if (params->has_announce_step) {
         s->parameters.announce_step = params->announce_step;
     }
+    if (params->has_vcpu_dirty_limit) {
+        s->parameters.vcpu_dirty_limit = params->vcpu_dirty_limit;
+        /* Apply the new quota right away if throttling has started */
+        if (migrate_dirty_limit() && dirtylimit_in_service()) {
+            dirtylimit_start(s->parameters.vcpu_dirty_limit);
+        }
+    }
+    if (params->has_postcopy_place_threads) {
+        s->parameters.postcopy_place_threads = params->postcopy_place_threads;
+    }
 
     if (params->has_block_bitmap_mapping) {
         qapi_free_BitmapMigrationNodeAliasList(
@@ -1762,6 +1999,7 @@ void migrate_set_state(int *state, int old_state, int new_state)
     if (qatomic_cmpxchg(state, old_state, new_state) == old_state) {
         trace_migrate_set_state(MigrationStatus_str(new_state));
         migrate_generate_event(new_state);
+        migration_info_update();
     }
 }
 
@@ -1831,6 +2069,11 @@ static void migrate_fd_cleanup(MigrationState *s)
         qemu_fclose(tmp);
     }
 
+    if (s->postcopy_qemufile_src) {
+        qemu_fclose(s->postcopy_qemufile_src);
+        s->postcopy_qemufile_src = NULL;
+    }
+
     assert(!migration_is_active(s));
 
     if (s->state == MIGRATION_STATUS_CANCELLING) {
@@ -2030,6 +2273,10 @@ void migrate_init(MigrationState *s)
     s->mbps = 0.0;
     s->pages_per_second = 0.0;
     s->downtime = 0;
+    s->downtime_vm_stop = 0;
+    s->downtime_bitmap_sync = 0;
+    s->downtime_ram_flush = 0;
+    s->downtime_device_state = 0;
     s->expected_downtime = 0;
     s->setup_time = 0;
     s->start_postcopy = false;
@@ -2046,6 +2293,8 @@ void migrate_init(MigrationState *s)
     s->vm_was_running = false;
     s->iteration_initial_bytes = 0;
     s->threshold_size = 0;
+    s->switchover_threshold = 0;
+    s->bitmap_sync_time = 0;
 }
 
 int migrate_add_blocker(Error *reason, Error **errp)
@@ -2059,6 +2308,7 @@ int migrate_add_blocker(Error *reason, Error **errp)
 
     if (migration_is_idle()) {
         migration_blockers = g_slist_prepend(migration_blockers, reason);
+        migration_info_update();
         return 0;
     }
 
@@ -2071,6 +2321,7 @@ int migrate_add_blocker(Error *reason, Error **errp)
 void migrate_del_blocker(Error *reason)
 {
     migration_blockers = g_slist_remove(migration_blockers, reason);
+    migration_info_update();
 }
 
 void qmp_migrate_incoming(const char *uri, Error **errp)
@@ -2248,6 +2499,13 @@ static bool migrate_prepare(MigrationState *s, bool blk, bool blk_inc,
     return true;
 }
 
+static bool migrate_uri_is_socket(const char *uri)
+{
+    return strstart(uri, "tcp:", NULL) ||
+           strstart(uri, "unix:", NULL) ||
+           strstart(uri, "vsock:", NULL);
+}
+
 void qmp_migrate(const char *uri, bool has_blk, bool blk,
                  bool has_inc, bool inc, bool has_detach, bool detach,
                  bool has_resume, bool resume, Error **errp)
@@ -2256,6 +2514,13 @@ void qmp_migrate(const char *uri, bool has_blk, bool blk,
     MigrationState *s = migrate_get_current();
     const char *p = NULL;
 
+    /* The preempt channel is opened to the same socket address */
+    if (migrate_postcopy_preempt() && !migrate_uri_is_socket(uri)) {
+        error_setg(errp, "Postcopy preempt requires a tcp, unix or vsock "
+                   "migration URI");
+        return;
+    }
+
     if (!migrate_prepare(s, has_blk && blk, has_inc && inc,
                          has_resume && resume, errp)) {
         /* Error detected, put into errp */
@@ -2268,9 +2533,8 @@ void qmp_migrate(const char *uri, bool has_blk, bool blk,
         }
     }
 
-    if (strstart(uri, "tcp:", &p) ||
-        strstart(uri, "unix:", NULL) ||
-        strstart(uri, "vsock:", NULL)) {
+    if (migrate_uri_is_socket(uri)) {
+        strstart(uri, "tcp:", &p);
         socket_start_outgoing_migration(s, p ? p : uri, &local_err);
 #ifdef CONFIG_RDMA
     } else if (strstart(uri, "rdma:", &p)) {
@@ -2280,6 +2544,8 @@ void qmp_migrate(const char *uri, bool has_blk, bool blk,
         exec_start_outgoing_migration(s, p, &local_err);
     } else if (strstart(uri, "fd:", &p)) {
         fd_start_outgoing_migration(s, p, &local_err);
+    } else if (strstart(uri, "file:", &p)) {
+        file_start_outgoing_migration(s, p, &local_err);
     } else {
         if (!(has_resume && resume)) {
             yank_unregister_instance(MIGRATION_YANK_INSTANCE);
@@ -2458,6 +2724,15 @@ int migrate_decompress_threads(void)
     return s->parameters.decompress_threads;
 }
 
+int migrate_postcopy_place_threads(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->parameters.postcopy_place_threads;
+}
+
 bool migrate_dirty_bitmaps(void)
 {
     MigrationState *s;
@@ -2503,6 +2778,71 @@ bool migrate_use_multifd(void)
     return s->enabled_capabilities[MIGRATION_CAPABILITY_MULTIFD];
 }
 
+bool migrate_multifd_zero_page(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_MULTIFD_ZERO_PAGE];
+}
+
+bool migrate_dirty_limit(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_DIRTY_LIMIT];
+}
+
+bool migrate_postcopy_preempt(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_POSTCOPY_PREEMPT];
+}
+
+bool migrate_mapped_ram(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_MAPPED_RAM];
+}
+
+bool migrate_mapped_ram_mmap(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_MAPPED_RAM_MMAP];
+}
+
+bool migrate_parallel_device_state(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_PARALLEL_DEVICE_STATE];
+}
+
+#ifdef CONFIG_LINUX
+bool migrate_use_zero_copy_send(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_ZERO_COPY_SEND];
+}
+#endif
+
 bool migrate_pause_before_switchover(void)
 {
     MigrationState *s;
@@ -2930,8 +3270,14 @@ static int postcopy_start(MigrationState *ms)
     QEMUFile *fb;
     int64_t time_at_stop = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
     int64_t bandwidth = migrate_max_postcopy_bandwidth();
+    int64_t stop_start;
     bool restart_block = false;
     int cur_state = MIGRATION_STATUS_ACTIVE;
+
+    if (postcopy_preempt_wait_channel(ms)) {
+        return -1;
+    }
+
     if (!migrate_pause_before_switchover()) {
         migrate_set_state(&ms->state, MIGRATION_STATUS_ACTIVE,
                           MIGRATION_STATUS_POSTCOPY_ACTIVE);
@@ -2943,10 +3289,12 @@ static int postcopy_start(MigrationState *ms)
 
     qemu_system_wakeup_request(QEMU_WAKEUP_REASON_OTHER, NULL);
     global_state_store();
+    stop_start = qemu_clock_get_us(QEMU_CLOCK_REALTIME);
     ret = vm_stop_force_state(RUN_STATE_FINISH_MIGRATE);
     if (ret < 0) {
         goto fail;
     }
+    ms->downtime_vm_stop = qemu_clock_get_us(QEMU_CLOCK_REALTIME) - stop_start;
 
     ret = migration_maybe_pause(ms, &cur_state,
                                 MIGRATION_STATUS_POSTCOPY_ACTIVE);
@@ -3159,7 +3507,11 @@ static void migration_completion(MigrationState *s)
 
         if (!ret) {
             bool inactivate = !migrate_colo_enabled();
+            int64_t stop_start = qemu_clock_get_us(QEMU_CLOCK_REALTIME);
+
             ret = vm_stop_force_state(RUN_STATE_FINISH_MIGRATE);
+            s->downtime_vm_stop = qemu_clock_get_us(QEMU_CLOCK_REALTIME) -
+                                  stop_start;
             if (ret >= 0) {
                 ret = migration_maybe_pause(s, &current_active_state,
                                             MIGRATION_STATUS_DEVICE);
@@ -3471,6 +3823,10 @@ static void migration_calculate_complete(MigrationState *s)
          */
         s->downtime = end_time - s->downtime_start;
     }
+    trace_migration_downtime_summary(s->downtime, s->downtime_vm_stop,
+                                     s->downtime_bitmap_sync,
+                                     s->downtime_ram_flush,
+                                     s->downtime_device_state);
 
     transfer_time = s->total_time - s->setup_time;
     if (transfer_time) {
@@ -3489,12 +3845,29 @@ static void update_iteration_initial_status(MigrationState *s)
     s->iteration_initial_pages = ram_get_total_transferred_pages();
 }
 
+/*
+ * Predict the part of the downtime that does not depend on the pending
+ * data (ms), and the device state that will be sent on top of it (bytes).
+ * The final dirty bitmap sync is expected to take as long as the latest
+ * one, and the non-iterable device state to cost what it did the last
+ * time it was saved.
+ */
+static double migration_switchover_cost(MigrationState *s,
+                                        uint64_t *device_size)
+{
+    int64_t device_time;
+
+    qemu_savevm_state_switchover_cost(device_size, &device_time);
+    return (s->bitmap_sync_time + device_time) / 1000.0;
+}
+
 static void migration_update_counters(MigrationState *s,
                                       int64_t current_time)
 {
     uint64_t transferred, transferred_pages, time_spent;
     uint64_t current_bytes; /* bytes transferred since the beginning */
-    double bandwidth;
+    uint64_t device_size;
+    double bandwidth, fixed_time, budget;
 
     if (current_time < s->iteration_start_time + BUFFER_DELAY) {
         return;
@@ -3505,6 +3878,19 @@ static void migration_update_counters(MigrationState *s,
     time_spent = current_time - s->iteration_start_time;
     bandwidth = (double)transferred / time_spent;
     s->threshold_size = bandwidth * s->parameters.downtime_limit;
+    fixed_time = migration_switchover_cost(s, &device_size);
+
+    /*
+     * Leave room in the downtime budget for the switchover costs.  If
+     * nothing was sent, or if those costs alone exceed the budget, the
+     * limit cannot be honoured anyway; fall back to the plain threshold
+     * rather than never converging.
+     */
+    s->switchover_threshold = s->threshold_size;
+    budget = s->threshold_size - (double)device_size - bandwidth * fixed_time;
+    if (bandwidth > 0 && budget > 0) {
+        s->switchover_threshold = budget;
+    }
 
     s->mbps = (((double) transferred * 8.0) /
                ((double) time_spent / 1000.0)) / 1000.0 / 1000.0;
@@ -3519,7 +3905,8 @@ static void migration_update_counters(MigrationState *s,
      * recalculate. 10000 is a small enough number for our purposes
      */
     if (ram_counters.dirty_pages_rate && transferred > 10000) {
-        s->expected_downtime = ram_counters.remaining / bandwidth;
+        s->expected_downtime = (ram_counters.remaining + device_size) /
+                               bandwidth + fixed_time;
     }
 
     qemu_file_reset_rate_limit(s->to_dst_file);
@@ -3528,6 +3915,9 @@ static void migration_update_counters(MigrationState *s,
 
     trace_migrate_transferred(transferred, time_spent,
                               bandwidth, s->threshold_size);
+    trace_migrate_switchover_cost(device_size, fixed_time * 1000,
+                                  s->switchover_threshold);
+    migration_info_update();
 }
 
 /* Migration thread iteration status */
@@ -3553,7 +3943,7 @@ static MigIterateState migration_iteration_run(MigrationState *s)
     trace_migrate_pending(pending_size, s->threshold_size,
                           pend_pre, pend_compat, pend_post);
 
-    if (pending_size && pending_size >= s->threshold_size) {
+    if (pending_size && pending_size >= s->switchover_threshold) {
         /* Still a significant amount to transfer */
         if (!in_postcopy && pend_pre <= s->threshold_size &&
             qatomic_read(&s->start_postcopy)) {
@@ -3579,6 +3969,8 @@ static void migration_iteration_finish(MigrationState *s)
     cpu_throttle_stop();
 
     qemu_mutex_lock_iothread();
+    /* Likewise for the per-vCPU dirty limit */
+    dirtylimit_stop();
     switch (s->state) {
     case MIGRATION_STATUS_COMPLETED:
         migration_calculate_complete(s);
@@ -4033,6 +4425,10 @@ void migrate_fd_connect(MigrationState *s, Error *error_in)
         return;
     }
 
+    if (migrate_postcopy_preempt()) {
+        postcopy_preempt_setup(s);
+    }
+
     if (migrate_background_snapshot()) {
         qemu_thread_create(&s->thread, "bg_snapshot",
                 bg_migration_thread, s, QEMU_THREAD_JOINABLE);
@@ -4141,6 +4537,12 @@ static Property migration_properties[] = {
     DEFINE_PROP_SIZE("announce-step", MigrationState,
                       parameters.announce_step,
                       DEFAULT_MIGRATE_ANNOUNCE_STEP),
+    DEFINE_PROP_UINT64("vcpu-dirty-limit", MigrationState,
+                      parameters.vcpu_dirty_limit,
+                      DEFAULT_MIGRATE_VCPU_DIRTY_LIMIT),
+    DEFINE_PROP_UINT8("x-postcopy-place-threads", MigrationState,
+                      parameters.postcopy_place_threads,
+                      DEFAULT_MIGRATE_POSTCOPY_PLACE_THREADS),
 
     /* Migration capabilities */
     DEFINE_PROP_MIG_CAP("x-xbzrle", MIGRATION_CAPABILITY_XBZRLE),
@@ -4155,8 +4557,18 @@ static Property migration_properties[] = {
     DEFINE_PROP_MIG_CAP("x-block", MIGRATION_CAPABILITY_BLOCK),
     DEFINE_PROP_MIG_CAP("x-return-path", MIGRATION_CAPABILITY_RETURN_PATH),
     DEFINE_PROP_MIG_CAP("x-multifd", MIGRATION_CAPABILITY_MULTIFD),
+    DEFINE_PROP_MIG_CAP("x-multifd-zero-page",
+            MIGRATION_CAPABILITY_MULTIFD_ZERO_PAGE),
     DEFINE_PROP_MIG_CAP("x-background-snapshot",
             MIGRATION_CAPABILITY_BACKGROUND_SNAPSHOT),
+    DEFINE_PROP_MIG_CAP("x-dirty-limit", MIGRATION_CAPABILITY_DIRTY_LIMIT),
+    DEFINE_PROP_MIG_CAP("x-postcopy-preempt",
+            MIGRATION_CAPABILITY_POSTCOPY_PREEMPT),
+    DEFINE_PROP_MIG_CAP("x-mapped-ram", MIGRATION_CAPABILITY_MAPPED_RAM),
+    DEFINE_PROP_MIG_CAP("x-parallel-device-state",
+                        MIGRATION_CAPABILITY_PARALLEL_DEVICE_STATE),
+    DEFINE_PROP_MIG_CAP("x-mapped-ram-mmap",
+                        MIGRATION_CAPABILITY_MAPPED_RAM_MMAP),
 
     DEFINE_PROP_END_OF_LIST(),
 };
@@ -4180,6 +4592,7 @@ static void migration_instance_finalize(Object *obj)
     g_free(params->tls_creds);
     qemu_sem_destroy(&ms->wait_unplug_sem);
     qemu_sem_destroy(&ms->rate_limit_sem);
+    qemu_sem_destroy(&ms->postcopy_qemufile_src_sem);
     qemu_sem_destroy(&ms->pause_sem);
     qemu_sem_destroy(&ms->postcopy_pause_sem);
     qemu_sem_destroy(&ms->postcopy_pause_rp_sem);
@@ -4224,11 +4637,14 @@ static void migration_instance_init(Object *obj)
     params->has_announce_max = true;
     params->has_announce_rounds = true;
     params->has_announce_step = true;
+    params->has_vcpu_dirty_limit = true;
+    params->has_postcopy_place_threads = true;
 
     qemu_sem_init(&ms->postcopy_pause_sem, 0);
     qemu_sem_init(&ms->postcopy_pause_rp_sem, 0);
     qemu_sem_init(&ms->rp_state.rp_sem, 0);
     qemu_sem_init(&ms->rate_limit_sem, 0);
+    qemu_sem_init(&ms->postcopy_qemufile_src_sem, 0);
     qemu_sem_init(&ms->wait_unplug_sem, 0);
     qemu_mutex_init(&ms->qemu_file_lock);
 }
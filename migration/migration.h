@@ -79,6 +79,15 @@ struct MigrationIncomingState {
     RAMBlock *last_rb;
     void     *postcopy_tmp_page;
     void     *postcopy_tmp_zero_page;
+
+    /* Dedicated channel for urgent pages when postcopy-preempt is on */
+    QEMUFile *postcopy_qemufile_dst;
+    bool      have_preempt_thread;
+    QemuThread postcopy_prio_thread;
+    /* Set this when we want the preempt thread to quit */
+    bool      preempt_thread_quit;
+    /* Temporary page used by the preempt thread to assemble host pages */
+    void     *postcopy_preempt_tmp_page;
     /* PostCopyFD's for external userfaultfds & handlers of shared memory */
     GArray   *postcopy_remote_fds;
 
@@ -122,6 +131,11 @@ struct MigrationIncomingState {
      * contains valid information.
      */
     QemuMutex page_request_mutex;
+
+    /* Breakdown of the downtime (us), see DowntimeStats */
+    int64_t downtime_device_state;
+    int64_t switchover_start;
+    int64_t downtime_switchover;
 };
 
 MigrationIncomingState *migration_incoming_get_current(void);
@@ -164,6 +178,14 @@ struct MigrationState {
      */
     QemuSemaphore rate_limit_sem;
 
+    /*
+     * Channel used for the pages requested by the destination during
+     * postcopy, when postcopy-preempt is enabled.  The semaphore is
+     * posted once the connection attempt has completed.
+     */
+    QEMUFile *postcopy_qemufile_src;
+    QemuSemaphore postcopy_qemufile_src_sem;
+
     /* pages already send at the beginning of current iteration */
     uint64_t iteration_initial_pages;
 
@@ -180,6 +202,13 @@ struct MigrationState {
      * measured bandwidth
      */
     int64_t threshold_size;
+    /*
+     * The pending data below which the predicted downtime, including the
+     * fixed costs of the switchover, fits the requested downtime
+     */
+    int64_t switchover_threshold;
+    /* Duration of the latest dirty bitmap sync (us) */
+    int64_t bitmap_sync_time;
 
     /* params from 'migrate-set-parameters' */
     MigrationParameters parameters;
@@ -202,6 +231,11 @@ struct MigrationState {
     /* Timestamp when VM is down (ms) to migrate the last stuff */
     int64_t downtime_start;
     int64_t downtime;
+    /* Breakdown of the downtime (us), see DowntimeStats */
+    int64_t downtime_vm_stop;
+    int64_t downtime_bitmap_sync;
+    int64_t downtime_ram_flush;
+    int64_t downtime_device_state;
     int64_t expected_downtime;
     bool enabled_capabilities[MIGRATION_CAPABILITY__MAX];
     int64_t setup_time;
@@ -286,6 +320,7 @@ struct MigrationState {
 };
 
 void migrate_set_state(int *state, int old_state, int new_state);
+void migration_info_update(void);
 
 void migration_fd_process_incoming(QEMUFile *f, Error **errp);
 void migration_ioc_process_incoming(QIOChannel *ioc, Error **errp);
@@ -320,6 +355,17 @@ bool migrate_validate_uuid(void);
 
 bool migrate_auto_converge(void);
 bool migrate_use_multifd(void);
+bool migrate_multifd_zero_page(void);
+bool migrate_dirty_limit(void);
+bool migrate_postcopy_preempt(void);
+bool migrate_mapped_ram(void);
+bool migrate_parallel_device_state(void);
+bool migrate_mapped_ram_mmap(void);
+#ifdef CONFIG_LINUX
+bool migrate_use_zero_copy_send(void);
+#else
+#define migrate_use_zero_copy_send() (false)
+#endif
 bool migrate_pause_before_switchover(void);
 int migrate_multifd_channels(void);
 MultiFDCompression migrate_multifd_compression(void);
@@ -342,6 +388,7 @@ int migrate_compress_level(void);
 int migrate_compress_threads(void);
 int migrate_compress_wait_thread(void);
 int migrate_decompress_threads(void);
+int migrate_postcopy_place_threads(void);
 bool migrate_use_events(void);
 bool migrate_postcopy_blocktime(void);
 bool migrate_background_snapshot(void);
@@ -0,0 +1,489 @@
+/*
+ * Multifd qpl compression accelerator implementation
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include <qpl/qpl.h>
+#include "qemu/rcu.h"
+#include "qemu/bswap.h"
+#include "exec/target_page.h"
+#include "qapi/error.h"
+#include "migration.h"
+#include "trace.h"
+#include "multifd.h"
+
+/*
+ * Every page of a packet is compressed by its own job.  The jobs of a
+ * packet are submitted to the accelerator in one batch and only then
+ * waited for, so that the device works on the whole packet while the
+ * multifd thread is free.  A page whose job cannot be queued because
+ * the device work queues are full is compressed in software instead,
+ * using the same deflate format, so the receiving side never needs to
+ * know which path was taken.
+ *
+ * The compressed buffer sent on the wire is made of one big endian
+ * 32 bit length per page followed by the data of all the pages.  A
+ * length equal to the page size means that the page did not compress
+ * and is sent as is.
+ */
+
+struct qpl_data {
+    /* hardware jobs, one per page */
+    qpl_job **hw_jobs;
+    /* software job used when the hardware queues are busy */
+    qpl_job *sw_job;
+    /* whether the hardware path could be initialized */
+    bool hw_avail;
+    /* whether the job of each page was submitted to the device */
+    bool *hw_submitted;
+    /* length of the compressed data of each page */
+    uint32_t *zlen;
+    /* buffer with the compressed data of all the pages */
+    uint8_t *zbuff;
+    /* size of compressed buffer */
+    uint32_t zbuff_len;
+    /* number of pages in a packet */
+    uint32_t page_count;
+    /* pages that went through the software fallback */
+    uint64_t sw_pages;
+};
+
+static qpl_job *multifd_qpl_job_new(qpl_path_t path)
+{
+    uint32_t size = 0;
+    qpl_job *job;
+
+    if (qpl_get_job_size(path, &size) != QPL_STS_OK) {
+        return NULL;
+    }
+    job = g_malloc0(size);
+    if (qpl_init_job(path, job) != QPL_STS_OK) {
+        g_free(job);
+        return NULL;
+    }
+    return job;
+}
+
+static void multifd_qpl_job_free(qpl_job *job)
+{
+    if (job) {
+        qpl_fini_job(job);
+        g_free(job);
+    }
+}
+
+static void multifd_qpl_free_hw_jobs(struct qpl_data *qpl)
+{
+    uint32_t i;
+
+    if (!qpl->hw_jobs) {
+        return;
+    }
+    for (i = 0; i < qpl->page_count; i++) {
+        multifd_qpl_job_free(qpl->hw_jobs[i]);
+    }
+    g_free(qpl->hw_jobs);
+    qpl->hw_jobs = NULL;
+}
+
+static void multifd_qpl_free(struct qpl_data *qpl)
+{
+    multifd_qpl_free_hw_jobs(qpl);
+    multifd_qpl_job_free(qpl->sw_job);
+    g_free(qpl->hw_submitted);
+    g_free(qpl->zlen);
+    g_free(qpl->zbuff);
+    g_free(qpl);
+}
+
+/**
+ * multifd_qpl_init: allocate the per channel qpl state
+ *
+ * The hardware path is optional: when no accelerator can be opened all
+ * the pages go through the software path.
+ *
+ * Returns the new state or NULL for error
+ *
+ * @id: multifd channel number
+ * @errp: pointer to an error
+ */
+static struct qpl_data *multifd_qpl_init(uint8_t id, Error **errp)
+{
+    uint32_t page_size = qemu_target_page_size();
+    struct qpl_data *qpl = g_new0(struct qpl_data, 1);
+    uint32_t i;
+
+    qpl->page_count = MULTIFD_PACKET_SIZE / page_size;
+    qpl->sw_job = multifd_qpl_job_new(qpl_path_software);
+    if (!qpl->sw_job) {
+        g_free(qpl);
+        error_setg(errp, "multifd %d: qpl software job init failed", id);
+        return NULL;
+    }
+
+    qpl->hw_avail = true;
+    qpl->hw_jobs = g_new0(qpl_job *, qpl->page_count);
+    for (i = 0; i < qpl->page_count; i++) {
+        qpl->hw_jobs[i] = multifd_qpl_job_new(qpl_path_hardware);
+        if (!qpl->hw_jobs[i]) {
+            multifd_qpl_free_hw_jobs(qpl);
+            qpl->hw_avail = false;
+            break;
+        }
+    }
+    trace_multifd_qpl_init(id, qpl->hw_avail);
+
+    qpl->hw_submitted = g_new0(bool, qpl->page_count);
+    qpl->zlen = g_new0(uint32_t, qpl->page_count);
+    /* A length per page, then at most one uncompressed page per page */
+    qpl->zbuff_len = qpl->page_count * (sizeof(uint32_t) + page_size);
+    qpl->zbuff = g_try_malloc(qpl->zbuff_len);
+    if (!qpl->zbuff) {
+        multifd_qpl_free(qpl);
+        error_setg(errp, "multifd %d: out of memory for zbuff", id);
+        return NULL;
+    }
+    return qpl;
+}
+
+static void multifd_qpl_prepare_comp_job(qpl_job *job, uint8_t *in,
+                                         uint8_t *out, uint32_t size)
+{
+    job->op = qpl_op_compress;
+    job->next_in_ptr = in;
+    job->available_in = size;
+    job->next_out_ptr = out;
+    /* Anything bigger than the page itself is not worth sending */
+    job->available_out = size;
+    job->flags = QPL_FLAG_FIRST | QPL_FLAG_LAST | QPL_FLAG_OMIT_VERIFY;
+    job->level = qpl_default_level;
+}
+
+static void multifd_qpl_prepare_decomp_job(qpl_job *job, uint8_t *in,
+                                           uint32_t in_size, uint8_t *out,
+                                           uint32_t out_size)
+{
+    job->op = qpl_op_decompress;
+    job->next_in_ptr = in;
+    job->available_in = in_size;
+    job->next_out_ptr = out;
+    job->available_out = out_size;
+    job->flags = QPL_FLAG_FIRST | QPL_FLAG_LAST;
+}
+
+/*
+ * Record the result of the compression job of one page, falling back
+ * to sending the page uncompressed if it did not shrink.
+ */
+static void multifd_qpl_comp_done(struct qpl_data *qpl, uint32_t i,
+                                  qpl_status status, qpl_job *job,
+                                  uint8_t *page, uint8_t *out,
+                                  uint32_t page_size)
+{
+    if (status == QPL_STS_OK && job->total_out < page_size) {
+        qpl->zlen[i] = job->total_out;
+    } else {
+        memcpy(out, page, page_size);
+        qpl->zlen[i] = page_size;
+    }
+}
+
+/* Multifd qpl compression */
+
+/**
+ * qpl_send_setup: setup send side
+ *
+ * Setup each channel with qpl compression.
+ *
+ * Returns 0 for success or -1 for error
+ *
+ * @p: Params for the channel that we are using
+ * @errp: pointer to an error
+ */
+static int qpl_send_setup(MultiFDSendParams *p, Error **errp)
+{
+    p->data = multifd_qpl_init(p->id, errp);
+    return p->data ? 0 : -1;
+}
+
+/**
+ * qpl_send_cleanup: cleanup send side
+ *
+ * Close the channel and return memory.
+ *
+ * @p: Params for the channel that we are using
+ */
+static void qpl_send_cleanup(MultiFDSendParams *p, Error **errp)
+{
+    struct qpl_data *qpl = p->data;
+
+    trace_multifd_qpl_send_cleanup(p->id, qpl->sw_pages);
+    multifd_qpl_free(qpl);
+    p->data = NULL;
+}
+
+/**
+ * qpl_send_prepare: prepare date to be able to send
+ *
+ * Submit one compression job per page to the accelerator, then wait
+ * for all of them.  Pages that the accelerator cannot take because its
+ * queues are full are compressed in software while the device works
+ * on the others.
+ *
+ * Returns 0 for success or -1 for error
+ *
+ * @p: Params for the channel that we are using
+ * @used: number of pages used
+ */
+static int qpl_send_prepare(MultiFDSendParams *p, uint32_t used, Error **errp)
+{
+    struct iovec *iov = p->pages->iov;
+    struct qpl_data *qpl = p->data;
+    uint32_t page_size = qemu_target_page_size();
+    uint8_t *data = qpl->zbuff + used * sizeof(uint32_t);
+    uint32_t *hdr = (uint32_t *)qpl->zbuff;
+    uint32_t sw_pages = 0;
+    uint8_t *out;
+    qpl_status status;
+    uint32_t i;
+
+    for (i = 0; i < used; i++) {
+        out = data + i * page_size;
+        qpl->hw_submitted[i] = false;
+        if (qpl->hw_avail) {
+            multifd_qpl_prepare_comp_job(qpl->hw_jobs[i], iov[i].iov_base,
+                                         out, page_size);
+            status = qpl_submit_job(qpl->hw_jobs[i]);
+            if (status == QPL_STS_OK) {
+                qpl->hw_submitted[i] = true;
+                continue;
+            }
+            if (status != QPL_STS_QUEUES_ARE_BUSY_ERR) {
+                error_setg(errp, "multifd %d: qpl submit failed with error %d",
+                           p->id, status);
+                goto err;
+            }
+        }
+        multifd_qpl_prepare_comp_job(qpl->sw_job, iov[i].iov_base,
+                                     out, page_size);
+        status = qpl_execute_job(qpl->sw_job);
+        multifd_qpl_comp_done(qpl, i, status, qpl->sw_job, iov[i].iov_base,
+                              out, page_size);
+        sw_pages++;
+    }
+
+    for (i = 0; i < used; i++) {
+        if (!qpl->hw_submitted[i]) {
+            continue;
+        }
+        qpl->hw_submitted[i] = false;
+        status = qpl_wait_job(qpl->hw_jobs[i]);
+        multifd_qpl_comp_done(qpl, i, status, qpl->hw_jobs[i],
+                              iov[i].iov_base, data + i * page_size,
+                              page_size);
+    }
+
+    /* Pack the pages behind each other now that all lengths are known */
+    out = data;
+    for (i = 0; i < used; i++) {
+        uint8_t *src = data + i * page_size;
+
+        if (out != src) {
+            memmove(out, src, qpl->zlen[i]);
+        }
+        out += qpl->zlen[i];
+        hdr[i] = cpu_to_be32(qpl->zlen[i]);
+    }
+
+    qpl->sw_pages += sw_pages;
+    trace_multifd_qpl_send_prepare(p->id, used, sw_pages);
+    p->next_packet_size = out - qpl->zbuff;
+    p->flags |= MULTIFD_FLAG_QPL;
+
+    return 0;
+
+err:
+    /* Jobs already on the device still write into zbuff */
+    while (i-- > 0) {
+        if (qpl->hw_submitted[i]) {
+            qpl_wait_job(qpl->hw_jobs[i]);
+            qpl->hw_submitted[i] = false;
+        }
+    }
+    return -1;
+}
+
+/**
+ * qpl_send_write: do the actual write of the data
+ *
+ * Do the actual write of the comprresed buffer.
+ *
+ * Returns 0 for success or -1 for error
+ *
+ * @p: Params for the channel that we are using
+ * @used: number of pages used
+ * @errp: pointer to an error
+ */
+static int qpl_send_write(MultiFDSendParams *p, uint32_t used, Error **errp)
+{
+    struct qpl_data *qpl = p->data;
+
+    return qio_channel_write_all(p->c, (void *)qpl->zbuff, p->next_packet_size,
+                                 errp);
+}
+
+/**
+ * qpl_recv_setup: setup receive side
+ *
+ * Create the compressed channel and buffer.
+ *
+ * Returns 0 for success or -1 for error
+ *
+ * @p: Params for the channel that we are using
+ * @errp: pointer to an error
+ */
+static int qpl_recv_setup(MultiFDRecvParams *p, Error **errp)
+{
+    p->data = multifd_qpl_init(p->id, errp);
+    return p->data ? 0 : -1;
+}
+
+/**
+ * qpl_recv_cleanup: setup receive side
+ *
+ * Close the channel and return memory.
+ *
+ * @p: Params for the channel that we are using
+ */
+static void qpl_recv_cleanup(MultiFDRecvParams *p)
+{
+    multifd_qpl_free(p->data);
+    p->data = NULL;
+}
+
+/**
+ * qpl_recv_pages: read the data from the channel into actual pages
+ *
+ * Read the compressed buffer, and uncompress it into the actual
+ * pages, batching the decompression jobs on the accelerator the same
+ * way the sending side does.
+ *
+ * Returns 0 for success or -1 for error
+ *
+ * @p: Params for the channel that we are using
+ * @used: number of pages used
+ * @errp: pointer to an error
+ */
+static int qpl_recv_pages(MultiFDRecvParams *p, uint32_t used, Error **errp)
+{
+    struct qpl_data *qpl = p->data;
+    uint32_t in_size = p->next_packet_size;
+    uint32_t page_size = qemu_target_page_size();
+    uint32_t hdr_size = used * sizeof(uint32_t);
+    uint32_t flags = p->flags & MULTIFD_FLAG_COMPRESSION_MASK;
+    uint32_t *hdr = (uint32_t *)qpl->zbuff;
+    uint8_t *data = qpl->zbuff + hdr_size;
+    uint64_t data_size = 0;
+    qpl_status status;
+    qpl_job *job = qpl->sw_job;
+    uint32_t i;
+    int ret = 0;
+
+    if (flags != MULTIFD_FLAG_QPL) {
+        error_setg(errp, "multifd %d: flags received %x flags expected %x",
+                   p->id, flags, MULTIFD_FLAG_QPL);
+        return -1;
+    }
+    if (in_size < hdr_size || in_size > qpl->zbuff_len) {
+        error_setg(errp, "multifd %d: invalid packet size %d for %d pages",
+                   p->id, in_size, used);
+        return -1;
+    }
+    ret = qio_channel_read_all(p->c, (void *)qpl->zbuff, in_size, errp);
+    if (ret != 0) {
+        return ret;
+    }
+
+    for (i = 0; i < used; i++) {
+        qpl->zlen[i] = be32_to_cpu(hdr[i]);
+        if (qpl->zlen[i] == 0 || qpl->zlen[i] > page_size) {
+            error_setg(errp, "multifd %d: invalid page %d length %d",
+                       p->id, i, qpl->zlen[i]);
+            return -1;
+        }
+        data_size += qpl->zlen[i];
+    }
+    if (data_size != in_size - hdr_size) {
+        error_setg(errp, "multifd %d: packet size received %d size expected %"
+                   PRIu64, p->id, in_size, data_size + hdr_size);
+        return -1;
+    }
+
+    for (i = 0; i < used; i++) {
+        struct iovec *iov = &p->pages->iov[i];
+
+        qpl->hw_submitted[i] = false;
+        if (qpl->zlen[i] == page_size) {
+            memcpy(iov->iov_base, data, page_size);
+        } else {
+            status = QPL_STS_QUEUES_ARE_BUSY_ERR;
+            if (qpl->hw_avail) {
+                job = qpl->hw_jobs[i];
+                multifd_qpl_prepare_decomp_job(job, data, qpl->zlen[i],
+                                               iov->iov_base, page_size);
+                status = qpl_submit_job(job);
+                qpl->hw_submitted[i] = status == QPL_STS_OK;
+            }
+            if (status == QPL_STS_QUEUES_ARE_BUSY_ERR) {
+                job = qpl->sw_job;
+                multifd_qpl_prepare_decomp_job(job, data, qpl->zlen[i],
+                                               iov->iov_base, page_size);
+                status = qpl_execute_job(job);
+            }
+            if (status != QPL_STS_OK ||
+                (!qpl->hw_submitted[i] && job->total_out != page_size)) {
+                error_setg(errp, "multifd %d: qpl decompress of page %d "
+                           "failed with error %d", p->id, i, status);
+                ret = -1;
+                break;
+            }
+        }
+        data += qpl->zlen[i];
+    }
+
+    /* Always reap what is on the device, even after an error */
+    for (i = 0; i < used; i++) {
+        if (!qpl->hw_submitted[i]) {
+            continue;
+        }
+        qpl->hw_submitted[i] = false;
+        status = qpl_wait_job(qpl->hw_jobs[i]);
+        if (ret == 0 && (status != QPL_STS_OK ||
+                         qpl->hw_jobs[i]->total_out != page_size)) {
+            error_setg(errp, "multifd %d: qpl decompress of page %d "
+                       "failed with error %d", p->id, i, status);
+            ret = -1;
+        }
+    }
+    return ret;
+}
+
+static MultiFDMethods multifd_qpl_ops = {
+    .send_setup = qpl_send_setup,
+    .send_cleanup = qpl_send_cleanup,
+    .send_prepare = qpl_send_prepare,
+    .send_write = qpl_send_write,
+    .recv_setup = qpl_recv_setup,
+    .recv_cleanup = qpl_recv_cleanup,
+    .recv_pages = qpl_recv_pages
+};
+
+static void multifd_qpl_register(void)
+{
+    multifd_register_ops(MULTIFD_COMPRESSION_QPL, &multifd_qpl_ops);
+}
+
+migration_init(multifd_qpl_register);
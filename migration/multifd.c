@@ -12,6 +12,8 @@
 
 #include "qemu/osdep.h"
 #include "qemu/rcu.h"
+#include "qemu/bitmap.h"
+#include "qemu/cutils.h"
 #include "exec/target_page.h"
 #include "sysemu/sysemu.h"
 #include "exec/ramblock.h"
@@ -20,6 +22,7 @@
 #include "ram.h"
 #include "migration.h"
 #include "socket.h"
+#include "rdma.h"
 #include "tls.h"
 #include "qemu-file.h"
 #include "trace.h"
@@ -88,13 +91,18 @@ static int nocomp_send_prepare(MultiFDSendParams *p, uint32_t used,
 {
     p->next_packet_size = used * qemu_target_page_size();
     p->flags |= MULTIFD_FLAG_NOCOMP;
+    if (rdma_multifd_channel(p->c)) {
+        p->flags |= MULTIFD_FLAG_RDMA_WRITE;
+    }
     return 0;
 }
 
 /**
  * nocomp_send_write: do the actual write of the data
  *
- * For no compression we just have to write the data.
+ * For no compression we just have to write the data.  Over RDMA the
+ * pages are RDMA written into the destination memory and only a marker
+ * goes through the channel; it is delivered after the writes have landed.
  *
  * Returns 0 for success or -1 for error
  *
@@ -104,7 +112,18 @@ static int nocomp_send_prepare(MultiFDSendParams *p, uint32_t used,
  */
 static int nocomp_send_write(MultiFDSendParams *p, uint32_t used, Error **errp)
 {
-    return qio_channel_writev_all(p->c, p->pages->iov, used, errp);
+    if (rdma_multifd_channel(p->c)) {
+        uint64_t marker = cpu_to_be64(MULTIFD_MAGIC);
+
+        if (rdma_multifd_write_pages(p->c, p->pages->block, p->pages->iov,
+                                     used, errp)) {
+            return -1;
+        }
+        return qio_channel_write_all(p->c, (void *)&marker, sizeof(marker),
+                                     errp);
+    }
+    return qio_channel_writev_full_all(p->c, p->pages->iov, used, NULL, 0,
+                                       p->write_flags, errp);
 }
 
 /**
@@ -153,6 +172,20 @@ static int nocomp_recv_pages(MultiFDRecvParams *p, uint32_t used, Error **errp)
                    p->id, flags, MULTIFD_FLAG_NOCOMP);
         return -1;
     }
+    if (p->flags & MULTIFD_FLAG_RDMA_WRITE) {
+        uint64_t marker;
+
+        if (qio_channel_read_all(p->c, (void *)&marker, sizeof(marker),
+                                 errp)) {
+            return -1;
+        }
+        if (be64_to_cpu(marker) != MULTIFD_MAGIC) {
+            error_setg(errp, "multifd %d: received rdma marker %" PRIx64,
+                       p->id, be64_to_cpu(marker));
+            return -1;
+        }
+        return 0;
+    }
     return qio_channel_readv_all(p->c, p->pages->iov, used, errp);
 }
 
@@ -238,6 +271,22 @@ static int multifd_recv_initial_packet(QIOChannel *c, Error **errp)
     return msg.id;
 }
 
+/* Size in bytes of the zero page bitmap that follows the packet offsets */
+static uint32_t multifd_zero_bmap_size(uint32_t pages)
+{
+    return DIV_ROUND_UP(pages, 64) * sizeof(uint64_t);
+}
+
+static uint32_t multifd_packet_len(uint32_t pages)
+{
+    uint32_t len = sizeof(MultiFDPacket_t) + sizeof(uint64_t) * pages;
+
+    if (migrate_multifd_zero_page()) {
+        len += multifd_zero_bmap_size(pages);
+    }
+    return len;
+}
+
 static MultiFDPages_t *multifd_pages_init(size_t size)
 {
     MultiFDPages_t *pages = g_new0(MultiFDPages_t, 1);
@@ -245,6 +294,7 @@ static MultiFDPages_t *multifd_pages_init(size_t size)
     pages->allocated = size;
     pages->iov = g_new0(struct iovec, size);
     pages->offset = g_new0(ram_addr_t, size);
+    pages->zero_bmap = bitmap_new(size);
 
     return pages;
 }
@@ -253,16 +303,50 @@ static void multifd_pages_clear(MultiFDPages_t *pages)
 {
     pages->used = 0;
     pages->allocated = 0;
+    pages->normal = 0;
     pages->packet_num = 0;
     pages->block = NULL;
     g_free(pages->iov);
     pages->iov = NULL;
     g_free(pages->offset);
     pages->offset = NULL;
+    g_free(pages->zero_bmap);
+    pages->zero_bmap = NULL;
     g_free(pages);
 }
 
-static void multifd_send_fill_packet(MultiFDSendParams *p)
+/**
+ * multifd_send_zero_page_detect: find the zero pages of a batch
+ *
+ * Marks the zero pages of @p in its zero page bitmap and compacts the
+ * iovec array so that only the non-zero pages are left in it, in the
+ * same order as in the offset array.
+ *
+ * Returns the number of zero pages found
+ *
+ * @p: Params for the channel that we are using
+ */
+static uint32_t multifd_send_zero_page_detect(MultiFDSendParams *p)
+{
+    MultiFDPages_t *pages = p->pages;
+    size_t page_size = qemu_target_page_size();
+    uint32_t i, normal = 0;
+
+    bitmap_zero(pages->zero_bmap, pages->allocated);
+
+    for (i = 0; i < pages->used; i++) {
+        if (buffer_is_zero(pages->iov[i].iov_base, page_size)) {
+            set_bit(i, pages->zero_bmap);
+        } else {
+            pages->iov[normal++] = pages->iov[i];
+        }
+    }
+    pages->normal = normal;
+
+    return pages->used - normal;
+}
+
+static void multifd_send_fill_packet(MultiFDSendParams *p, uint32_t zero)
 {
     MultiFDPacket_t *packet = p->packet;
     int i;
@@ -272,6 +356,7 @@ static void multifd_send_fill_packet(MultiFDSendParams *p)
     packet->pages_used = cpu_to_be32(p->pages->used);
     packet->next_packet_size = cpu_to_be32(p->next_packet_size);
     packet->packet_num = cpu_to_be64(p->packet_num);
+    packet->zero_pages = cpu_to_be32(zero);
 
     if (p->pages->block) {
         strncpy(packet->ramblock, p->pages->block->idstr, 256);
@@ -283,6 +368,11 @@ static void multifd_send_fill_packet(MultiFDSendParams *p)
 
         packet->offset[i] = cpu_to_be64(temp);
     }
+
+    if (migrate_multifd_zero_page()) {
+        bitmap_to_le((unsigned long *)&packet->offset[p->pages->allocated],
+                     p->pages->zero_bmap, p->pages->allocated);
+    }
 }
 
 static int multifd_recv_unfill_packet(MultiFDRecvParams *p, Error **errp)
@@ -340,11 +430,27 @@ static int multifd_recv_unfill_packet(MultiFDRecvParams *p, Error **errp)
 
     p->next_packet_size = be32_to_cpu(packet->next_packet_size);
     p->packet_num = be64_to_cpu(packet->packet_num);
+    packet->zero_pages = be32_to_cpu(packet->zero_pages);
+    p->pages->normal = 0;
 
     if (p->pages->used == 0) {
         return 0;
     }
 
+    if (migrate_multifd_zero_page()) {
+        if (multifd_packet_len(packet->pages_alloc) > p->packet_len) {
+            error_setg(errp, "multifd: received packet "
+                       "with %d pages does not fit the zero page bitmap",
+                       packet->pages_alloc);
+            return -1;
+        }
+        bitmap_from_le(p->pages->zero_bmap,
+                       (unsigned long *)&packet->offset[packet->pages_alloc],
+                       packet->pages_alloc);
+    } else {
+        bitmap_zero(p->pages->zero_bmap, p->pages->allocated);
+    }
+
     /* make sure that ramblock is 0 terminated */
     packet->ramblock[255] = 0;
     block = qemu_ram_block_by_name(packet->ramblock);
@@ -353,6 +459,7 @@ static int multifd_recv_unfill_packet(MultiFDRecvParams *p, Error **errp)
                    packet->ramblock);
         return -1;
     }
+    p->pages->block = block;
 
     for (i = 0; i < p->pages->used; i++) {
         uint64_t offset = be64_to_cpu(packet->offset[i]);
@@ -363,13 +470,46 @@ static int multifd_recv_unfill_packet(MultiFDRecvParams *p, Error **errp)
                        offset, block->max_length);
             return -1;
         }
-        p->pages->iov[i].iov_base = block->host + offset;
-        p->pages->iov[i].iov_len = qemu_target_page_size();
+        p->pages->offset[i] = offset;
+        if (test_bit(i, p->pages->zero_bmap)) {
+            ram_handle_compressed(colo_multifd_host(block, offset), 0,
+                                  qemu_target_page_size());
+            continue;
+        }
+        p->pages->iov[p->pages->normal].iov_base =
+            colo_multifd_host(block, offset);
+        p->pages->iov[p->pages->normal].iov_len = qemu_target_page_size();
+        p->pages->normal++;
+    }
+
+    if (p->pages->used - p->pages->normal != packet->zero_pages) {
+        error_setg(errp, "multifd: received packet with %d zero pages "
+                   "and announced %d", p->pages->used - p->pages->normal,
+                   packet->zero_pages);
+        return -1;
     }
 
     return 0;
 }
 
+/*
+ * Zero pages are found by the channels, after the migration thread
+ * has accounted them as normal.  Fix up ram_counters from the
+ * migration thread, the only one that updates them.
+ *
+ * Called with p->mutex held.
+ */
+static void multifd_account_zero_pages(MultiFDSendParams *p)
+{
+    uint64_t bytes = p->pending_zero_pages * qemu_target_page_size();
+
+    ram_counters.duplicate += p->pending_zero_pages;
+    ram_counters.normal -= p->pending_zero_pages;
+    ram_counters.multifd_bytes -= bytes;
+    ram_counters.transferred -= bytes;
+    p->pending_zero_pages = 0;
+}
+
 struct {
     MultiFDSendParams *params;
     /* array of pages to sent */
@@ -444,6 +584,7 @@ static int multifd_send_pages(QEMUFile *f)
     assert(!p->pages->used);
     assert(!p->pages->block);
 
+    multifd_account_zero_pages(p);
     p->packet_num = multifd_send_state->packet_num++;
     multifd_send_state->pages = p->pages;
     p->pages = pages;
@@ -600,6 +741,7 @@ void multifd_send_sync_main(QEMUFile *f)
             return;
         }
 
+        multifd_account_zero_pages(p);
         p->packet_num = multifd_send_state->packet_num++;
         p->flags |= MULTIFD_FLAG_SYNC;
         p->pending_job++;
@@ -645,26 +787,36 @@ static void *multifd_send_thread(void *opaque)
 
         if (p->pending_job) {
             uint32_t used = p->pages->used;
+            uint32_t normal = used;
+            uint32_t zero = 0;
             uint64_t packet_num = p->packet_num;
             flags = p->flags;
 
-            if (used) {
-                ret = multifd_send_state->ops->send_prepare(p, used,
+            if (used && migrate_multifd_zero_page()) {
+                zero = multifd_send_zero_page_detect(p);
+                normal = used - zero;
+            }
+            p->pages->normal = normal;
+
+            if (normal) {
+                ret = multifd_send_state->ops->send_prepare(p, normal,
                                                             &local_err);
                 if (ret != 0) {
                     qemu_mutex_unlock(&p->mutex);
                     break;
                 }
+            } else {
+                p->next_packet_size = 0;
             }
-            multifd_send_fill_packet(p);
+            multifd_send_fill_packet(p, zero);
             p->flags = 0;
             p->num_packets++;
             p->num_pages += used;
-            p->pages->used = 0;
-            p->pages->block = NULL;
+            p->num_zero_pages += zero;
+            p->pending_zero_pages += zero;
             qemu_mutex_unlock(&p->mutex);
 
-            trace_multifd_send(p->id, packet_num, used, flags,
+            trace_multifd_send(p->id, packet_num, used, zero, flags,
                                p->next_packet_size);
 
             ret = qio_channel_write_all(p->c, (void *)p->packet,
@@ -673,18 +825,33 @@ static void *multifd_send_thread(void *opaque)
                 break;
             }
 
-            if (used) {
-                ret = multifd_send_state->ops->send_write(p, used, &local_err);
+            if (normal) {
+                ret = multifd_send_state->ops->send_write(p, normal,
+                                                          &local_err);
                 if (ret != 0) {
                     break;
                 }
             }
 
+            /* The pages are only released once the data has been written */
             qemu_mutex_lock(&p->mutex);
+            p->pages->used = 0;
+            p->pages->block = NULL;
             p->pending_job--;
             qemu_mutex_unlock(&p->mutex);
 
             if (flags & MULTIFD_FLAG_SYNC) {
+                /*
+                 * Pages written with zero copy may still be queued in
+                 * the kernel; make sure they are all on the wire before
+                 * the sync point is reached.
+                 */
+                if (p->write_flags & QIO_CHANNEL_WRITE_FLAG_ZERO_COPY) {
+                    ret = qio_channel_flush(p->c, &local_err);
+                    if (ret < 0) {
+                        break;
+                    }
+                }
                 qemu_sem_post(&p->sem_sync);
             }
             qemu_sem_post(&multifd_send_state->channels_ready);
@@ -718,7 +885,8 @@ out:
     qemu_mutex_unlock(&p->mutex);
 
     rcu_unregister_thread();
-    trace_multifd_send_thread_end(p->id, p->num_packets, p->num_pages);
+    trace_multifd_send_thread_end(p->id, p->num_packets, p->num_pages,
+                                  p->num_zero_pages);
 
     return NULL;
 }
@@ -840,6 +1008,12 @@ static void multifd_new_send_channel_async(QIOTask *task, gpointer opaque)
     trace_multifd_new_send_channel_async(p->id);
     if (qio_task_propagate_error(task, &local_err)) {
         goto cleanup;
+    } else if ((p->write_flags & QIO_CHANNEL_WRITE_FLAG_ZERO_COPY) &&
+               !qio_channel_has_feature(sioc,
+                                        QIO_CHANNEL_FEATURE_WRITE_ZERO_COPY)) {
+        error_setg(&local_err, "multifd: channel %d: zero copy send is not "
+                   "supported by the host", p->id);
+        goto cleanup;
     } else {
         p->c = QIO_CHANNEL(sioc);
         qio_channel_set_delay(p->c, false);
@@ -865,6 +1039,13 @@ int multifd_save_setup(Error **errp)
         return 0;
     }
     s = migrate_get_current();
+    if (migrate_use_zero_copy_send() &&
+        (migrate_multifd_compression() != MULTIFD_COMPRESSION_NONE ||
+         (s->parameters.tls_creds && *s->parameters.tls_creds))) {
+        error_setg(errp, "Zero copy only available for non-compressed "
+                   "non-TLS multifd migration");
+        return -1;
+    }
     thread_count = migrate_multifd_channels();
     multifd_send_state = g_malloc0(sizeof(*multifd_send_state));
     multifd_send_state->params = g_new0(MultiFDSendParams, thread_count);
@@ -883,14 +1064,19 @@ int multifd_save_setup(Error **errp)
         p->pending_job = 0;
         p->id = i;
         p->pages = multifd_pages_init(page_count);
-        p->packet_len = sizeof(MultiFDPacket_t)
-                      + sizeof(uint64_t) * page_count;
+        p->packet_len = multifd_packet_len(page_count);
         p->packet = g_malloc0(p->packet_len);
         p->packet->magic = cpu_to_be32(MULTIFD_MAGIC);
         p->packet->version = cpu_to_be32(MULTIFD_VERSION);
+        p->write_flags = migrate_use_zero_copy_send() ?
+                         QIO_CHANNEL_WRITE_FLAG_ZERO_COPY : 0;
         p->name = g_strdup_printf("multifdsend_%d", i);
         p->tls_hostname = g_strdup(s->hostname);
-        socket_send_channel_create(multifd_new_send_channel_async, p);
+        if (rdma_is_migration_file(s->to_dst_file)) {
+            rdma_send_channel_create(multifd_new_send_channel_async, p);
+        } else {
+            socket_send_channel_create(multifd_new_send_channel_async, p);
+        }
     }
 
     for (i = 0; i < thread_count; i++) {
@@ -1043,7 +1229,7 @@ static void *multifd_recv_thread(void *opaque)
     rcu_register_thread();
 
     while (true) {
-        uint32_t used;
+        uint32_t used, normal;
         uint32_t flags;
 
         if (p->quit) {
@@ -1067,22 +1253,27 @@ static void *multifd_recv_thread(void *opaque)
         }
 
         used = p->pages->used;
+        normal = p->pages->normal;
         flags = p->flags;
         /* recv methods don't know how to handle the SYNC flag */
         p->flags &= ~MULTIFD_FLAG_SYNC;
-        trace_multifd_recv(p->id, p->packet_num, used, flags,
+        trace_multifd_recv(p->id, p->packet_num, used, used - normal, flags,
                            p->next_packet_size);
         p->num_packets++;
         p->num_pages += used;
         qemu_mutex_unlock(&p->mutex);
 
-        if (used) {
-            ret = multifd_recv_state->ops->recv_pages(p, used, &local_err);
+        if (normal) {
+            ret = multifd_recv_state->ops->recv_pages(p, normal, &local_err);
             if (ret != 0) {
                 break;
             }
         }
 
+        if (used) {
+            colo_multifd_backup_pages(p->pages->block, p->pages->offset, used);
+        }
+
         if (flags & MULTIFD_FLAG_SYNC) {
             qemu_sem_post(&multifd_recv_state->sem_sync);
             qemu_sem_wait(&p->sem_sync);
@@ -1127,8 +1318,7 @@ int multifd_load_setup(Error **errp)
         p->quit = false;
         p->id = i;
         p->pages = multifd_pages_init(page_count);
-        p->packet_len = sizeof(MultiFDPacket_t)
-                      + sizeof(uint64_t) * page_count;
+        p->packet_len = multifd_packet_len(page_count);
         p->packet = g_malloc0(p->packet_len);
         p->name = g_strdup_printf("multifdrecv_%d", i);
     }
@@ -32,6 +32,9 @@ int multifd_queue_page(QEMUFile *f, RAMBlock *block, ram_addr_t offset);
 #define MULTIFD_FLAG_NOCOMP (0 << 1)
 #define MULTIFD_FLAG_ZLIB (1 << 1)
 #define MULTIFD_FLAG_ZSTD (2 << 1)
+#define MULTIFD_FLAG_QPL (3 << 1)
+/* uncompressed pages were RDMA written, only a marker follows the packet */
+#define MULTIFD_FLAG_RDMA_WRITE (1 << 4)
 
 /* This value needs to be a multiple of qemu_target_page_size() */
 #define MULTIFD_PACKET_SIZE (512 * 1024)
@@ -46,8 +49,17 @@ typedef struct {
     /* size of the next packet that contains pages */
     uint32_t next_packet_size;
     uint64_t packet_num;
-    uint64_t unused[4];    /* Reserved for future use */
+    /* number of pages in offset[] that are zero pages */
+    uint32_t zero_pages;
+    uint32_t unused32;     /* Reserved for future use */
+    uint64_t unused[3];    /* Reserved for future use */
     char ramblock[256];
+    /*
+     * offset[] has pages_alloc entries.  With the multifd-zero-page
+     * capability it is followed by a little endian bitmap of
+     * pages_alloc bits, rounded up to 64 bits; a set bit means the
+     * page at the same index is a zero page and its data is not sent.
+     */
     uint64_t offset[];
 } __attribute__((packed)) MultiFDPacket_t;
 
@@ -56,12 +68,16 @@ typedef struct {
     uint32_t used;
     /* number of allocated pages */
     uint32_t allocated;
+    /* number of pages in @iov whose data is transferred */
+    uint32_t normal;
     /* global number of generated multifd packets */
     uint64_t packet_num;
     /* offset of each page */
     ram_addr_t *offset;
-    /* pointer to each page */
+    /* pointer to each non-zero page, @normal entries */
     struct iovec *iov;
+    /* bitmap of the pages in @offset that are zero pages */
+    unsigned long *zero_bmap;
     RAMBlock *block;
 } MultiFDPages_t;
 
@@ -99,11 +115,17 @@ typedef struct {
     uint32_t next_packet_size;
     /* global number of generated multifd packets */
     uint64_t packet_num;
+    /* QIO_CHANNEL_WRITE_FLAG_* used to write the page data */
+    int write_flags;
     /* thread local variables */
     /* packets sent through this channel */
     uint64_t num_packets;
     /* pages sent through this channel */
     uint64_t num_pages;
+    /* zero pages found by this channel */
+    uint64_t num_zero_pages;
+    /* zero pages not yet accounted in ram_counters, protected by @mutex */
+    uint64_t pending_zero_pages;
     /* syncs main thread and channels */
     QemuSemaphore sem_sync;
     /* used for compression methods */
@@ -23,19 +23,30 @@
 /* the page in cache will not be replaced in two cycles */
 #define CACHED_PAGE_LIFETIME 2
 
+/*
+ * Number of entries a page can be cached in.  When all of them are taken,
+ * the least recently hit entry is evicted first, and among those the one
+ * with the fewest hits, so pages that keep being re-dirtied stay cached.
+ */
+#define CACHE_WAYS 4
+
 typedef struct CacheItem CacheItem;
 
 struct CacheItem {
     uint64_t it_addr;
     uint64_t it_age;
+    uint64_t it_hits;
     uint8_t *it_data;
 };
 
 struct PageCache {
     CacheItem *page_cache;
+    uint8_t *data;
     size_t page_size;
     size_t max_num_items;
     size_t num_items;
+    size_t num_ways;
+    size_t num_sets;
 };
 
 PageCache *cache_init(uint64_t new_size, size_t page_size, Error **errp)
@@ -66,14 +77,24 @@ PageCache *cache_init(uint64_t new_size, size_t page_size, Error **errp)
     cache->page_size = page_size;
     cache->num_items = 0;
     cache->max_num_items = num_pages;
+    cache->num_ways = MIN(num_pages, CACHE_WAYS);
+    cache->num_sets = num_pages / cache->num_ways;
 
     trace_migration_pagecache_init(cache->max_num_items);
 
-    /* We prefer not to abort if there is no memory */
-    cache->page_cache = g_try_malloc((cache->max_num_items) *
-                                     sizeof(*cache->page_cache));
-    if (!cache->page_cache) {
+    /*
+     * We prefer not to abort if there is no memory.  The page data is only
+     * populated as pages are inserted, and comes from huge pages if
+     * possible since it is accessed at random.
+     */
+    cache->page_cache = qemu_try_alloc_large(cache->max_num_items *
+                                             sizeof(*cache->page_cache));
+    cache->data = qemu_try_alloc_large(cache->max_num_items * page_size);
+    if (!cache->page_cache || !cache->data) {
         error_setg(errp, "Failed to allocate page cache");
+        qemu_free_large(cache->page_cache,
+                        cache->max_num_items * sizeof(*cache->page_cache));
+        qemu_free_large(cache->data, cache->max_num_items * page_size);
         g_free(cache);
         return NULL;
     }
@@ -81,6 +102,7 @@ PageCache *cache_init(uint64_t new_size, size_t page_size, Error **errp)
     for (i = 0; i < cache->max_num_items; i++) {
         cache->page_cache[i].it_data = NULL;
         cache->page_cache[i].it_age = 0;
+        cache->page_cache[i].it_hits = 0;
         cache->page_cache[i].it_addr = -1;
     }
 
@@ -89,42 +111,48 @@ PageCache *cache_init(uint64_t new_size, size_t page_size, Error **errp)
 
 void cache_fini(PageCache *cache)
 {
-    int64_t i;
-
     g_assert(cache);
     g_assert(cache->page_cache);
 
-    for (i = 0; i < cache->max_num_items; i++) {
-        g_free(cache->page_cache[i].it_data);
-    }
-
-    g_free(cache->page_cache);
+    qemu_free_large(cache->data, cache->max_num_items * cache->page_size);
+    qemu_free_large(cache->page_cache,
+                    cache->max_num_items * sizeof(*cache->page_cache));
     cache->page_cache = NULL;
     g_free(cache);
 }
 
-static size_t cache_get_cache_pos(const PageCache *cache,
-                                  uint64_t address)
+/* Returns the first of the num_ways entries where @address can be cached */
+static CacheItem *cache_get_set(const PageCache *cache, uint64_t address)
 {
-    g_assert(cache->max_num_items);
-    return (address / cache->page_size) & (cache->max_num_items - 1);
-}
-
-static CacheItem *cache_get_by_addr(const PageCache *cache, uint64_t addr)
-{
-    size_t pos;
+    size_t set;
 
     g_assert(cache);
     g_assert(cache->page_cache);
+    g_assert(cache->num_sets);
+
+    set = (address / cache->page_size) & (cache->num_sets - 1);
 
-    pos = cache_get_cache_pos(cache, addr);
+    return &cache->page_cache[set * cache->num_ways];
+}
+
+static CacheItem *cache_get_by_addr(const PageCache *cache, uint64_t addr)
+{
+    CacheItem *set = cache_get_set(cache, addr);
+    size_t i;
 
-    return &cache->page_cache[pos];
+    for (i = 0; i < cache->num_ways; i++) {
+        if (set[i].it_addr == addr) {
+            return &set[i];
+        }
+    }
+    return NULL;
 }
 
 uint8_t *get_cached_data(const PageCache *cache, uint64_t addr)
 {
-    return cache_get_by_addr(cache, addr)->it_data;
+    CacheItem *it = cache_get_by_addr(cache, addr);
+
+    return it ? it->it_data : NULL;
 }
 
 bool cache_is_cached(const PageCache *cache, uint64_t addr,
@@ -134,14 +162,45 @@ bool cache_is_cached(const PageCache *cache, uint64_t addr,
 
     it = cache_get_by_addr(cache, addr);
 
-    if (it->it_addr == addr) {
+    if (it) {
         /* update the it_age when the cache hit */
         it->it_age = current_age;
+        it->it_hits++;
         return true;
     }
     return false;
 }
 
+/*
+ * Pick the entry to store @addr in: the one already holding it, a free
+ * one, or else the coldest entry that is not fresh.  Returns NULL if all
+ * the entries of the set are fresh.
+ */
+static CacheItem *cache_get_victim(const PageCache *cache, uint64_t addr,
+                                   uint64_t current_age)
+{
+    CacheItem *set = cache_get_set(cache, addr);
+    CacheItem *victim = NULL;
+    size_t i;
+
+    for (i = 0; i < cache->num_ways; i++) {
+        CacheItem *it = &set[i];
+
+        if (it->it_addr == addr || !it->it_data) {
+            return it;
+        }
+        if (it->it_age + CACHED_PAGE_LIFETIME > current_age) {
+            /* the cache page is fresh, don't replace it */
+            continue;
+        }
+        if (!victim || it->it_age < victim->it_age ||
+            (it->it_age == victim->it_age && it->it_hits < victim->it_hits)) {
+            victim = it;
+        }
+    }
+    return victim;
+}
+
 int cache_insert(PageCache *cache, uint64_t addr, const uint8_t *pdata,
                  uint64_t current_age)
 {
@@ -149,20 +208,16 @@ int cache_insert(PageCache *cache, uint64_t addr, const uint8_t *pdata,
     CacheItem *it;
 
     /* actual update of entry */
-    it = cache_get_by_addr(cache, addr);
-
-    if (it->it_data && it->it_addr != addr &&
-        it->it_age + CACHED_PAGE_LIFETIME > current_age) {
-        /* the cache page is fresh, don't replace it */
+    it = cache_get_victim(cache, addr, current_age);
+    if (!it) {
         return -1;
     }
-    /* allocate page */
+    if (it->it_addr != addr) {
+        it->it_hits = 0;
+    }
+    /* assign a page to a free entry */
     if (!it->it_data) {
-        it->it_data = g_try_malloc(cache->page_size);
-        if (!it->it_data) {
-            trace_migration_pagecache_insert();
-            return -1;
-        }
+        it->it_data = cache->data + (it - cache->page_cache) * cache->page_size;
         cache->num_items++;
     }
 
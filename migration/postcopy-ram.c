@@ -30,6 +30,8 @@
 #include "qemu/error-report.h"
 #include "trace.h"
 #include "hw/boards.h"
+#include "socket.h"
+#include "qemu-file-channel.h"
 
 /* Arbitrary limit on size of each discard command,
  * keeps them around ~200 bytes
@@ -75,6 +77,64 @@ int postcopy_notify(enum PostcopyNotifyReason reason, Error **errp)
                                             &pnd);
 }
 
+/*
+ * Postcopy preempt channel
+ *
+ * With postcopy-preempt the source opens a second connection to the
+ * destination.  The pages requested by the destination fault thread are
+ * sent on it, so that they are not queued behind the background pages
+ * on the main stream.  The destination loads them from a dedicated
+ * thread.
+ */
+static void postcopy_preempt_send_channel_new(QIOTask *task, gpointer opaque)
+{
+    MigrationState *s = opaque;
+    QIOChannel *ioc = QIO_CHANNEL(qio_task_get_source(task));
+    Error *local_err = NULL;
+
+    if (qio_task_propagate_error(task, &local_err)) {
+        trace_postcopy_preempt_send_channel_error(error_get_pretty(local_err));
+        migrate_set_error(s, local_err);
+        error_free(local_err);
+    } else {
+        trace_postcopy_preempt_send_channel_new();
+        s->postcopy_qemufile_src = qemu_fopen_channel_output(ioc);
+    }
+    /* The QEMUFile holds its own reference */
+    object_unref(OBJECT(ioc));
+    qemu_sem_post(&s->postcopy_qemufile_src_sem);
+}
+
+void postcopy_preempt_setup(MigrationState *s)
+{
+    /* Drop any leftover from a previous migration */
+    while (!qemu_sem_timedwait(&s->postcopy_qemufile_src_sem, 0)) {
+        /* nothing */
+    }
+    socket_send_channel_create(postcopy_preempt_send_channel_new, s);
+}
+
+int postcopy_preempt_wait_channel(MigrationState *s)
+{
+    if (!migrate_postcopy_preempt()) {
+        return 0;
+    }
+
+    qemu_sem_wait(&s->postcopy_qemufile_src_sem);
+    if (!s->postcopy_qemufile_src) {
+        error_report("%s: postcopy preempt channel is not available",
+                     __func__);
+        return -1;
+    }
+    return 0;
+}
+
+void postcopy_preempt_new_channel(MigrationIncomingState *mis, QEMUFile *file)
+{
+    trace_postcopy_preempt_new_channel();
+    mis->postcopy_qemufile_dst = file;
+}
+
 /* Postcopy needs to detect accesses to pages that haven't yet been copied
  * across, and efficiently map new pages in, the techniques for doing this
  * are target OS specific.
@@ -516,6 +576,70 @@ int postcopy_ram_incoming_init(MigrationIncomingState *mis)
     return 0;
 }
 
+static void *postcopy_preempt_thread(void *opaque)
+{
+    MigrationIncomingState *mis = opaque;
+    int ret;
+
+    trace_postcopy_preempt_thread_entry();
+    rcu_register_thread();
+
+    WITH_RCU_READ_LOCK_GUARD() {
+        ret = ram_load_postcopy(mis->postcopy_qemufile_dst,
+                                RAM_CHANNEL_POSTCOPY);
+    }
+    if (ret && !qatomic_read(&mis->preempt_thread_quit)) {
+        error_report("%s: loading urgent pages failed: %s", __func__,
+                     strerror(-ret));
+    }
+
+    rcu_unregister_thread();
+    trace_postcopy_preempt_thread_exit(ret);
+    return NULL;
+}
+
+static int postcopy_preempt_thread_start(MigrationIncomingState *mis)
+{
+    if (!migrate_postcopy_preempt()) {
+        return 0;
+    }
+
+    mis->postcopy_preempt_tmp_page = mmap(NULL, mis->largest_page_size,
+                                          PROT_READ | PROT_WRITE,
+                                          MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mis->postcopy_preempt_tmp_page == MAP_FAILED) {
+        mis->postcopy_preempt_tmp_page = NULL;
+        error_report("%s: Failed to map postcopy_preempt_tmp_page %s",
+                     __func__, strerror(errno));
+        return -1;
+    }
+
+    mis->preempt_thread_quit = false;
+    qemu_thread_create(&mis->postcopy_prio_thread, "postcopy/preempt",
+                       postcopy_preempt_thread, mis, QEMU_THREAD_JOINABLE);
+    mis->have_preempt_thread = true;
+    return 0;
+}
+
+static void postcopy_preempt_thread_stop(MigrationIncomingState *mis)
+{
+    if (mis->have_preempt_thread) {
+        /*
+         * The source ends the preempt channel with an EOS once postcopy
+         * is done; shut it down anyway in case the source went away.
+         */
+        qatomic_set(&mis->preempt_thread_quit, true);
+        qemu_file_shutdown(mis->postcopy_qemufile_dst);
+        qemu_thread_join(&mis->postcopy_prio_thread);
+        mis->have_preempt_thread = false;
+    }
+
+    if (mis->postcopy_preempt_tmp_page) {
+        munmap(mis->postcopy_preempt_tmp_page, mis->largest_page_size);
+        mis->postcopy_preempt_tmp_page = NULL;
+    }
+}
+
 /*
  * At the end of a migration where postcopy_ram_incoming_init was called.
  */
@@ -523,6 +647,9 @@ int postcopy_ram_incoming_cleanup(MigrationIncomingState *mis)
 {
     trace_postcopy_ram_incoming_cleanup_entry();
 
+    postcopy_preempt_thread_stop(mis);
+    postcopy_place_threads_cleanup(mis);
+
     if (mis->have_fault_thread) {
         Error *local_err = NULL;
 
@@ -1119,6 +1246,14 @@ int postcopy_ram_incoming_setup(MigrationIncomingState *mis)
     }
     memset(mis->postcopy_tmp_zero_page, '\0', mis->largest_page_size);
 
+    if (postcopy_place_threads_setup(mis)) {
+        return -1;
+    }
+
+    if (postcopy_preempt_thread_start(mis)) {
+        return -1;
+    }
+
     trace_postcopy_ram_enable_notify();
 
     return 0;
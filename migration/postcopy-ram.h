@@ -179,4 +179,14 @@ int postcopy_wake_shared(struct PostCopyFD *pcfd, uint64_t client_addr,
 int postcopy_request_shared_page(struct PostCopyFD *pcfd, RAMBlock *rb,
                                  uint64_t client_addr, uint64_t offset);
 
+/* Source: start connecting the postcopy preempt channel */
+void postcopy_preempt_setup(MigrationState *s);
+/*
+ * Source: wait for the preempt channel before switching to postcopy.
+ * Returns 0 on success, or if postcopy-preempt is not enabled.
+ */
+int postcopy_preempt_wait_channel(MigrationState *s);
+/* Destination: got the preempt channel connection */
+void postcopy_preempt_new_channel(MigrationIncomingState *mis, QEMUFile *file);
+
 #endif
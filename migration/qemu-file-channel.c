@@ -167,12 +167,18 @@ static QEMUFile *channel_get_output_return_path(void *opaque)
     return qemu_fopen_channel_input(ioc);
 }
 
+static QIOChannel *channel_get_ioc(void *opaque)
+{
+    return QIO_CHANNEL(opaque);
+}
+
 static const QEMUFileOps channel_input_ops = {
     .get_buffer = channel_get_buffer,
     .close = channel_close,
     .shut_down = channel_shutdown,
     .set_blocking = channel_set_blocking,
     .get_return_path = channel_get_input_return_path,
+    .get_ioc = channel_get_ioc,
 };
 
 
@@ -182,6 +188,7 @@ static const QEMUFileOps channel_output_ops = {
     .shut_down = channel_shutdown,
     .set_blocking = channel_set_blocking,
     .get_return_path = channel_get_output_return_path,
+    .get_ioc = channel_get_ioc,
 };
 
 
@@ -318,6 +318,66 @@ size_t ram_control_save_page(QEMUFile *f, ram_addr_t block_offset,
     return RAM_SAVE_CONTROL_NOT_SUPP;
 }
 
+QIOChannel *qemu_file_get_ioc(QEMUFile *f)
+{
+    if (!f->ops->get_ioc) {
+        return NULL;
+    }
+    return f->ops->get_ioc(f->opaque);
+}
+
+/*
+ * Get the position of the stream in the underlying channel: pending
+ * writes are flushed first, and data that was read ahead into the
+ * buffer but not consumed yet is accounted for.
+ *
+ * Returns the offset, or -1 if the channel is not seekable
+ */
+off_t qemu_get_offset(QEMUFile *f, Error **errp)
+{
+    QIOChannel *ioc = qemu_file_get_ioc(f);
+    off_t ret;
+
+    if (!ioc) {
+        error_setg(errp, "Migration stream does not support random access");
+        return -1;
+    }
+    qemu_fflush(f);
+    ret = qio_channel_io_seek(ioc, 0, SEEK_CUR, errp);
+    if (ret < 0) {
+        return -1;
+    }
+    if (!qemu_file_is_writable(f)) {
+        ret -= f->buf_size - f->buf_index;
+    }
+    return ret;
+}
+
+/*
+ * Move the stream to @offset of the underlying channel, dropping
+ * whatever was buffered.
+ *
+ * Returns 0 on success or -1 on error
+ */
+int qemu_set_offset(QEMUFile *f, off_t offset, Error **errp)
+{
+    QIOChannel *ioc = qemu_file_get_ioc(f);
+
+    if (!ioc) {
+        error_setg(errp, "Migration stream does not support random access");
+        return -1;
+    }
+    qemu_fflush(f);
+    if (qio_channel_io_seek(ioc, offset, SEEK_SET, errp) < 0) {
+        return -1;
+    }
+    if (!qemu_file_is_writable(f)) {
+        f->buf_index = 0;
+        f->buf_size = 0;
+    }
+    return 0;
+}
+
 /*
  * Attempt to fill the buffer from the underlying file
  * Returns the number of bytes read, or negative value for an error.
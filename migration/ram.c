@@ -32,6 +32,7 @@
 #include "qemu/bitops.h"
 #include "qemu/bitmap.h"
 #include "qemu/main-loop.h"
+#include "qemu/units.h"
 #include "xbzrle.h"
 #include "ram.h"
 #include "migration.h"
@@ -53,12 +54,17 @@
 #include "block.h"
 #include "sysemu/sysemu.h"
 #include "sysemu/cpu-throttle.h"
+#include "sysemu/dirtylimit.h"
 #include "savevm.h"
 #include "qemu/iov.h"
+#include "io/channel-file.h"
 #include "multifd.h"
 #include "sysemu/runstate.h"
+#include "hw/boards.h"
 
 #if defined(__linux__)
+#include <poll.h>
+#include "qemu/event_notifier.h"
 #include "qemu/userfaultfd.h"
 #endif /* defined(__linux__) */
 
@@ -189,13 +195,28 @@ int foreach_not_ignored_block(RAMBlockIterFunc func, void *opaque)
     return ret;
 }
 
+/*
+ * Per-RAMBlock bitmaps scale with guest RAM and are accessed all over the
+ * place, so allocate them like guest RAM to get huge pages.
+ */
+static unsigned long *ram_bitmap_new(unsigned long nbits)
+{
+    return qemu_alloc_large(BITS_TO_LONGS(nbits) * sizeof(unsigned long));
+}
+
+static void ram_bitmap_free(unsigned long *map, unsigned long nbits)
+{
+    qemu_free_large(map, BITS_TO_LONGS(nbits) * sizeof(unsigned long));
+}
+
 static void ramblock_recv_map_init(void)
 {
     RAMBlock *rb;
 
     RAMBLOCK_FOREACH_NOT_IGNORED(rb) {
         assert(!rb->receivedmap);
-        rb->receivedmap = bitmap_new(rb->max_length >> qemu_target_page_bits());
+        rb->receivedmap = ram_bitmap_new(rb->max_length >>
+                                         qemu_target_page_bits());
     }
 }
 
@@ -354,6 +375,13 @@ struct RAMState {
     /* Queue of outstanding page requests from the destination */
     QemuMutex src_page_req_mutex;
     QSIMPLEQ_HEAD(, RAMSrcPageRequest) src_page_requests;
+    /*
+     * postcopy-preempt: channel that @f and @last_sent_block currently
+     * refer to, and the saved state of each channel.
+     */
+    int postcopy_channel;
+    QEMUFile *channel_f[RAM_CHANNEL_MAX];
+    RAMBlock *channel_last_sent_block[RAM_CHANNEL_MAX];
 };
 typedef struct RAMState RAMState;
 
@@ -460,6 +488,533 @@ static QemuThread *decompress_threads;
 static QemuMutex decomp_done_lock;
 static QemuCond decomp_done_cond;
 
+/*
+ * With mapped-ram each page of a RAMBlock has a fixed place in the
+ * migration file.  The stream only carries a small header per block,
+ * written by mapped_ram_save_header(), followed by a seek over the
+ * area of the block pages.  The pages themselves are written with
+ * pwritev() by a pool of I/O threads, and read back the same way on
+ * the destination; a bitmap of the pages present in the file is
+ * written when the migration completes.
+ */
+#define MAPPED_RAM_HDR_VERSION  1
+#define MAPPED_RAM_HDR_SIZE     (sizeof(uint32_t) + 3 * sizeof(uint64_t))
+/* Alignment of the area of the pages of each block in the file */
+#define MAPPED_RAM_FILE_ALIGN   (1 * MiB)
+/* Largest contiguous range handed to an I/O thread at once */
+#define MAPPED_RAM_JOB_SIZE     (1 * MiB)
+/* Jobs queued per I/O thread before the migration thread waits */
+#define MAPPED_RAM_JOBS_PER_THREAD  256
+
+typedef struct MappedRamJob {
+    RAMBlock *block;
+    ram_addr_t offset;
+    size_t len;
+    QSIMPLEQ_ENTRY(MappedRamJob) next;
+} MappedRamJob;
+
+typedef struct {
+    QIOChannel *ioc;
+    /* whether the threads read pages back instead of writing them */
+    bool load;
+    QemuThread *threads;
+    int thread_count;
+    /* protects the fields below */
+    QemuMutex lock;
+    /* signalled when a job is queued, or on quit */
+    QemuCond job_cond;
+    /* signalled each time a job is done */
+    QemuCond done_cond;
+    QSIMPLEQ_HEAD(, MappedRamJob) jobs;
+    int queued;
+    int inflight;
+    bool quit;
+    /* first error hit by an I/O thread */
+    Error *err;
+    /* range of pages being gathered by the migration thread */
+    MappedRamJob pending;
+} MappedRamState;
+
+static MappedRamState *mapped_ram;
+
+static int mapped_ram_do_job(MappedRamState *ms, MappedRamJob *job,
+                             Error **errp)
+{
+    uint8_t *host = job->block->host + job->offset;
+    off_t pos = job->block->pages_offset + job->offset;
+    size_t done = 0;
+
+    while (done < job->len) {
+        struct iovec iov = {
+            .iov_base = host + done,
+            .iov_len = job->len - done,
+        };
+        ssize_t ret;
+
+        if (ms->load) {
+            ret = qio_channel_preadv(ms->ioc, &iov, 1, pos + done, errp);
+        } else {
+            ret = qio_channel_pwritev(ms->ioc, &iov, 1, pos + done, errp);
+        }
+        if (ret == QIO_CHANNEL_ERR_BLOCK) {
+            error_setg(errp, "Migration file would block");
+            return -1;
+        }
+        if (ret < 0) {
+            return -1;
+        }
+        if (ret == 0) {
+            error_setg(errp, "Unexpected end of migration file for %s",
+                       job->block->idstr);
+            return -1;
+        }
+        done += ret;
+    }
+    return 0;
+}
+
+static void *mapped_ram_thread(void *opaque)
+{
+    MappedRamState *ms = opaque;
+    Error *local_err = NULL;
+    MappedRamJob *job;
+
+    qemu_mutex_lock(&ms->lock);
+    while (true) {
+        job = QSIMPLEQ_FIRST(&ms->jobs);
+        if (!job) {
+            if (ms->quit) {
+                break;
+            }
+            qemu_cond_wait(&ms->job_cond, &ms->lock);
+            continue;
+        }
+        QSIMPLEQ_REMOVE_HEAD(&ms->jobs, next);
+        ms->queued--;
+        ms->inflight++;
+        qemu_mutex_unlock(&ms->lock);
+
+        mapped_ram_do_job(ms, job, &local_err);
+        g_free(job);
+
+        qemu_mutex_lock(&ms->lock);
+        if (local_err) {
+            if (!ms->err) {
+                ms->err = local_err;
+            } else {
+                error_free(local_err);
+            }
+            local_err = NULL;
+        }
+        ms->inflight--;
+        qemu_cond_broadcast(&ms->done_cond);
+    }
+    qemu_mutex_unlock(&ms->lock);
+
+    return NULL;
+}
+
+static void mapped_ram_queue_pending(MappedRamState *ms)
+{
+    MappedRamJob *job;
+
+    if (!ms->pending.len) {
+        return;
+    }
+    job = g_new(MappedRamJob, 1);
+    *job = ms->pending;
+    ms->pending.len = 0;
+
+    qemu_mutex_lock(&ms->lock);
+    while (ms->queued >= ms->thread_count * MAPPED_RAM_JOBS_PER_THREAD) {
+        qemu_cond_wait(&ms->done_cond, &ms->lock);
+    }
+    QSIMPLEQ_INSERT_TAIL(&ms->jobs, job, next);
+    ms->queued++;
+    qemu_cond_signal(&ms->job_cond);
+    qemu_mutex_unlock(&ms->lock);
+}
+
+/*
+ * Queue the I/O of @len bytes at @offset of @block, merging it with
+ * the previous range when they are contiguous.  @len must not be
+ * bigger than MAPPED_RAM_JOB_SIZE.
+ */
+static void mapped_ram_queue(MappedRamState *ms, RAMBlock *block,
+                             ram_addr_t offset, size_t len)
+{
+    MappedRamJob *p = &ms->pending;
+
+    if (p->len && (p->block != block || p->offset + p->len != offset ||
+                   p->len + len > MAPPED_RAM_JOB_SIZE)) {
+        mapped_ram_queue_pending(ms);
+    }
+    if (!p->len) {
+        p->block = block;
+        p->offset = offset;
+    }
+    p->len += len;
+}
+
+/*
+ * Wait until all the queued I/O is done.
+ *
+ * Returns 0 for success or -1 if any of the I/O failed
+ */
+static int mapped_ram_flush(MappedRamState *ms, Error **errp)
+{
+    Error *err;
+
+    mapped_ram_queue_pending(ms);
+
+    qemu_mutex_lock(&ms->lock);
+    while (ms->queued || ms->inflight) {
+        qemu_cond_wait(&ms->done_cond, &ms->lock);
+    }
+    err = ms->err;
+    ms->err = NULL;
+    qemu_mutex_unlock(&ms->lock);
+
+    if (err) {
+        error_propagate(errp, err);
+        return -1;
+    }
+    return 0;
+}
+
+static void mapped_ram_cleanup(void)
+{
+    MappedRamState *ms = mapped_ram;
+    MappedRamJob *job, *next;
+    int i;
+
+    if (!ms) {
+        return;
+    }
+
+    qemu_mutex_lock(&ms->lock);
+    ms->quit = true;
+    qemu_cond_broadcast(&ms->job_cond);
+    qemu_mutex_unlock(&ms->lock);
+    for (i = 0; i < ms->thread_count; i++) {
+        qemu_thread_join(ms->threads + i);
+    }
+
+    QSIMPLEQ_FOREACH_SAFE(job, &ms->jobs, next, next) {
+        g_free(job);
+    }
+    error_free(ms->err);
+    qemu_cond_destroy(&ms->job_cond);
+    qemu_cond_destroy(&ms->done_cond);
+    qemu_mutex_destroy(&ms->lock);
+    object_unref(OBJECT(ms->ioc));
+    g_free(ms->threads);
+    g_free(ms);
+    mapped_ram = NULL;
+}
+
+/*
+ * Start the I/O threads of mapped-ram, as many as the multifd
+ * channels.
+ *
+ * Returns 0 for success or -1 for error
+ */
+static int mapped_ram_setup(QIOChannel *ioc, bool load, Error **errp)
+{
+    MappedRamState *ms;
+    int i;
+
+    if (!ioc || !qio_channel_has_feature(ioc, QIO_CHANNEL_FEATURE_SEEKABLE)) {
+        error_setg(errp, "mapped-ram requires a seekable migration channel, "
+                   "such as file:");
+        return -1;
+    }
+
+    ms = g_new0(MappedRamState, 1);
+    ms->ioc = ioc;
+    object_ref(OBJECT(ioc));
+    ms->load = load;
+    ms->thread_count = migrate_multifd_channels();
+    ms->threads = g_new0(QemuThread, ms->thread_count);
+    qemu_mutex_init(&ms->lock);
+    qemu_cond_init(&ms->job_cond);
+    qemu_cond_init(&ms->done_cond);
+    QSIMPLEQ_INIT(&ms->jobs);
+    for (i = 0; i < ms->thread_count; i++) {
+        qemu_thread_create(ms->threads + i, "mapped-ram",
+                           mapped_ram_thread, ms, QEMU_THREAD_JOINABLE);
+    }
+    mapped_ram = ms;
+    trace_migration_mapped_ram_setup(load, ms->thread_count);
+
+    return 0;
+}
+
+static size_t mapped_ram_bitmap_size(ram_addr_t length)
+{
+    return BITS_TO_LONGS(length >> TARGET_PAGE_BITS) * sizeof(unsigned long);
+}
+
+/*
+ * Write the mapped-ram header of @block and reserve the room of its
+ * bitmap and pages in the file; the stream goes on after the pages.
+ *
+ * Returns 0 for success or -1 for error
+ */
+static int mapped_ram_save_header(QEMUFile *f, RAMBlock *block, Error **errp)
+{
+    off_t pos = qemu_get_offset(f, errp);
+
+    if (pos < 0) {
+        return -1;
+    }
+    block->bitmap_offset = pos + MAPPED_RAM_HDR_SIZE;
+    block->pages_offset = ROUND_UP(block->bitmap_offset +
+                                   mapped_ram_bitmap_size(block->used_length),
+                                   MAPPED_RAM_FILE_ALIGN);
+
+    qemu_put_be32(f, MAPPED_RAM_HDR_VERSION);
+    qemu_put_be64(f, TARGET_PAGE_SIZE);
+    qemu_put_be64(f, block->bitmap_offset);
+    qemu_put_be64(f, block->pages_offset);
+
+    return qemu_set_offset(f, block->pages_offset + block->used_length, errp);
+}
+
+/*
+ * Write the bitmap of the pages present in the file for every block.
+ *
+ * Returns 0 for success or -1 for error
+ *
+ * Called with RCU critical section
+ */
+static int mapped_ram_save_bitmaps(MappedRamState *ms, Error **errp)
+{
+    RAMBlock *block;
+
+    RAMBLOCK_FOREACH_MIGRATABLE(block) {
+        unsigned long pages = block->used_length >> TARGET_PAGE_BITS;
+        size_t size = mapped_ram_bitmap_size(block->used_length);
+        unsigned long *le_bmap = bitmap_new(pages);
+        struct iovec iov = { .iov_base = le_bmap, .iov_len = size };
+        ssize_t ret;
+
+        bitmap_to_le(le_bmap, block->file_bmap, pages);
+        ret = qio_channel_pwritev(ms->ioc, &iov, 1, block->bitmap_offset,
+                                  errp);
+        g_free(le_bmap);
+        if (ret < 0) {
+            return -1;
+        }
+        if (ret != size) {
+            error_setg(errp, "Short write of the mapped-ram bitmap of %s",
+                       block->idstr);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+#ifdef CONFIG_POSIX
+/* Above this many runs of zero pages, the holes are cleared, not remapped */
+#define MAPPED_RAM_MMAP_MAX_HOLES   4096
+
+/*
+ * The mapped-ram-mmap capability replaces the memory of a block by a
+ * private mapping of its pages in the migration file.  Only anonymous
+ * memory can be replaced, and nothing may hold on to the old pages:
+ * devices that pin guest memory disable discards, so the capability
+ * falls back to reading the pages when discards are already disabled.
+ * Once a block is mapped, discards stay disabled because dropping a
+ * page of a private file mapping brings back the file contents instead
+ * of zeroes.
+ */
+static bool mapped_ram_can_mmap(RAMBlock *block, ram_addr_t length)
+{
+    static bool discard_disabled;
+
+    if (block->fd >= 0 || qemu_ram_is_shared(block) ||
+        block->page_size != qemu_real_host_page_size ||
+        TARGET_PAGE_SIZE % qemu_real_host_page_size ||
+        block->pages_offset % qemu_real_host_page_size ||
+        length != block->used_length ||
+        !object_dynamic_cast(OBJECT(mapped_ram->ioc), TYPE_QIO_CHANNEL_FILE)) {
+        return false;
+    }
+    if (!discard_disabled) {
+        if (ram_block_discard_is_disabled() || ram_block_discard_disable(true)) {
+            return false;
+        }
+        discard_disabled = true;
+    }
+    return true;
+}
+
+/*
+ * Map the pages of @block copy-on-write from the migration file, so
+ * that they are only read when the guest touches them and are shared
+ * with every other VM started from the same file.  Pages missing from
+ * the bitmap may have stale contents in the file, they get fresh
+ * anonymous memory instead.
+ *
+ * Returns 0 for success or -1 for error
+ */
+static int mapped_ram_mmap_block(RAMBlock *block, ram_addr_t length,
+                                 unsigned long *bmap, Error **errp)
+{
+    unsigned long pages = length >> TARGET_PAGE_BITS;
+    int fd = QIO_CHANNEL_FILE(mapped_ram->ioc)->fd;
+    unsigned long run, end;
+    unsigned int holes = 0;
+    void *ptr;
+
+    for (run = find_first_zero_bit(bmap, pages); run < pages;
+         run = find_next_zero_bit(bmap, pages, end)) {
+        end = find_next_bit(bmap, pages, run + 1);
+        holes++;
+    }
+    trace_migration_mapped_ram_mmap(block->idstr, length, holes);
+
+    ptr = mmap(block->host, length, PROT_READ | PROT_WRITE,
+               MAP_PRIVATE | MAP_FIXED, fd, block->pages_offset);
+    if (ptr == MAP_FAILED) {
+        error_setg_errno(errp, errno, "Could not map the pages of %s",
+                         block->idstr);
+        return -1;
+    }
+
+    /* Too fragmented to map, fill the holes with zeroes */
+    if (holes > MAPPED_RAM_MMAP_MAX_HOLES) {
+        for (run = find_first_zero_bit(bmap, pages); run < pages;
+             run = find_next_zero_bit(bmap, pages, end)) {
+            end = find_next_bit(bmap, pages, run + 1);
+            memset(block->host + ((ram_addr_t)run << TARGET_PAGE_BITS), 0,
+                   (ram_addr_t)(end - run) << TARGET_PAGE_BITS);
+        }
+    } else {
+        for (run = find_first_zero_bit(bmap, pages); run < pages;
+             run = find_next_zero_bit(bmap, pages, end)) {
+            ram_addr_t offset = (ram_addr_t)run << TARGET_PAGE_BITS;
+            ram_addr_t len;
+
+            end = find_next_bit(bmap, pages, run + 1);
+            len = (ram_addr_t)(end - run) << TARGET_PAGE_BITS;
+            ptr = mmap(block->host + offset, len, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0);
+            if (ptr == MAP_FAILED) {
+                error_setg_errno(errp, errno,
+                                 "Could not map the zero pages of %s",
+                                 block->idstr);
+                return -1;
+            }
+        }
+    }
+
+    /* what ram_block_add() set up on the old mapping */
+    qemu_madvise(block->host, length, QEMU_MADV_DONTFORK);
+    return 0;
+}
+#endif
+
+/*
+ * Read the mapped-ram header of @block from the stream, and queue the
+ * reads of all the pages that its bitmap says are in the file.  The
+ * pages that are not in the file are zero.
+ *
+ * Returns 0 for success or -1 for error
+ */
+static int mapped_ram_load_block(QEMUFile *f, RAMBlock *block,
+                                 ram_addr_t length, Error **errp)
+{
+    unsigned long pages = length >> TARGET_PAGE_BITS;
+    size_t size = mapped_ram_bitmap_size(length);
+    g_autofree unsigned long *le_bmap = NULL;
+    g_autofree unsigned long *bmap = NULL;
+    unsigned long run, end;
+    uint32_t version;
+    uint64_t page_size;
+    struct iovec iov;
+    ssize_t ret;
+
+    version = qemu_get_be32(f);
+    page_size = qemu_get_be64(f);
+    block->bitmap_offset = qemu_get_be64(f);
+    block->pages_offset = qemu_get_be64(f);
+    if (version != MAPPED_RAM_HDR_VERSION) {
+        error_setg(errp, "Unsupported mapped-ram header version %u for %s",
+                   version, block->idstr);
+        return -1;
+    }
+    if (page_size != TARGET_PAGE_SIZE) {
+        error_setg(errp, "Mismatched mapped-ram page size %" PRIu64
+                   " for %s", page_size, block->idstr);
+        return -1;
+    }
+
+    le_bmap = g_malloc0(size);
+    iov.iov_base = le_bmap;
+    iov.iov_len = size;
+    ret = qio_channel_preadv(mapped_ram->ioc, &iov, 1, block->bitmap_offset,
+                             errp);
+    if (ret < 0) {
+        return -1;
+    }
+    if (ret != size) {
+        error_setg(errp, "Short read of the mapped-ram bitmap of %s",
+                   block->idstr);
+        return -1;
+    }
+    bmap = bitmap_new(pages);
+    bitmap_from_le(bmap, le_bmap, pages);
+
+#ifdef CONFIG_POSIX
+    if (migrate_mapped_ram_mmap() && mapped_ram_can_mmap(block, length)) {
+        if (mapped_ram_mmap_block(block, length, bmap, errp)) {
+            return -1;
+        }
+        return qemu_set_offset(f, block->pages_offset + length, errp);
+    }
+#endif
+
+    for (run = find_first_bit(bmap, pages); run < pages;
+         run = find_next_bit(bmap, pages, end)) {
+        ram_addr_t offset;
+
+        end = find_next_zero_bit(bmap, pages, run + 1);
+        for (offset = run << TARGET_PAGE_BITS;
+             offset < ((ram_addr_t)end << TARGET_PAGE_BITS);
+             offset += MAPPED_RAM_JOB_SIZE) {
+            mapped_ram_queue(mapped_ram, block, offset,
+                             MIN(MAPPED_RAM_JOB_SIZE,
+                                 ((ram_addr_t)end << TARGET_PAGE_BITS) -
+                                 offset));
+        }
+    }
+
+    return qemu_set_offset(f, block->pages_offset + length, errp);
+}
+
+static int ram_save_mapped_ram_page(RAMState *rs, RAMBlock *block,
+                                    ram_addr_t offset)
+{
+    unsigned long page = offset >> TARGET_PAGE_BITS;
+
+    if (buffer_is_zero(block->host + offset, TARGET_PAGE_SIZE)) {
+        /* Pages missing from the file are zero on the destination */
+        clear_bit(page, block->file_bmap);
+        ram_counters.duplicate++;
+        return 1;
+    }
+
+    set_bit(page, block->file_bmap);
+    mapped_ram_queue(mapped_ram, block, offset, TARGET_PAGE_SIZE);
+    qemu_file_update_transfer(rs->f, TARGET_PAGE_SIZE);
+    ram_counters.transferred += TARGET_PAGE_SIZE;
+    ram_counters.normal++;
+
+    return 1;
+}
+
 static bool do_compress_ram_page(QEMUFile *f, z_stream *stream, RAMBlock *block,
                                  ram_addr_t offset, uint8_t *source_buf);
 
@@ -867,6 +1422,175 @@ static void ramblock_sync_dirty_bitmap(RAMState *rs, RAMBlock *rb)
     rs->num_dirty_pages_period += new_dirty_pages;
 }
 
+/*
+ * Size of the RAMBlock regions synced by the dirty bitmap sync threads.
+ * It is a multiple of BITS_PER_LONG pages, so that two threads never
+ * update the same word of RAMBlock->bmap.
+ */
+#define BITMAP_SYNC_CHUNK_SIZE  (1ULL << 30)
+
+typedef struct {
+    RAMBlock *block;
+    ram_addr_t start;
+    ram_addr_t length;
+} BitmapSyncChunk;
+
+typedef struct {
+    QemuThread *threads;
+    int thread_count;
+    bool quit;
+    /* posted once per thread to start a round */
+    QemuSemaphore sem_work;
+    /* posted by each thread at the end of a round */
+    QemuSemaphore sem_done;
+    BitmapSyncChunk *chunks;
+    int nr_chunks;
+    int nr_alloc;
+    int next_chunk;
+    uint64_t num_dirty;
+} BitmapSyncState;
+
+static BitmapSyncState *bitmap_sync;
+
+static void bitmap_sync_run(BitmapSyncState *bs)
+{
+    uint64_t num_dirty = 0;
+    int i;
+
+    WITH_RCU_READ_LOCK_GUARD() {
+        while ((i = qatomic_fetch_inc(&bs->next_chunk)) < bs->nr_chunks) {
+            BitmapSyncChunk *chunk = &bs->chunks[i];
+
+            num_dirty += cpu_physical_memory_sync_dirty_bitmap(chunk->block,
+                                                               chunk->start,
+                                                               chunk->length);
+        }
+    }
+
+    qatomic_add(&bs->num_dirty, num_dirty);
+}
+
+static void *bitmap_sync_thread(void *opaque)
+{
+    BitmapSyncState *bs = opaque;
+
+    rcu_register_thread();
+
+    while (true) {
+        qemu_sem_wait(&bs->sem_work);
+        if (qatomic_read(&bs->quit)) {
+            break;
+        }
+        bitmap_sync_run(bs);
+        qemu_sem_post(&bs->sem_done);
+    }
+
+    rcu_unregister_thread();
+    return NULL;
+}
+
+static void bitmap_sync_add_block(BitmapSyncState *bs, RAMBlock *rb)
+{
+    ram_addr_t start;
+
+    for (start = 0; start < rb->used_length; start += BITMAP_SYNC_CHUNK_SIZE) {
+        BitmapSyncChunk *chunk;
+
+        if (bs->nr_chunks == bs->nr_alloc) {
+            bs->nr_alloc = MAX(bs->nr_alloc * 2, 16);
+            bs->chunks = g_renew(BitmapSyncChunk, bs->chunks, bs->nr_alloc);
+        }
+        chunk = &bs->chunks[bs->nr_chunks++];
+        chunk->block = rb;
+        chunk->start = start;
+        chunk->length = MIN(BITMAP_SYNC_CHUNK_SIZE, rb->used_length - start);
+    }
+}
+
+/*
+ * Sync the chunks queued by bitmap_sync_add_block() on all the sync
+ * threads, the calling thread included.  Returns the number of newly
+ * dirtied pages.
+ *
+ * Called with RCU critical section
+ */
+static uint64_t bitmap_sync_flush(BitmapSyncState *bs)
+{
+    int i;
+
+    if (!bs->nr_chunks) {
+        return 0;
+    }
+
+    bs->next_chunk = 0;
+    bs->num_dirty = 0;
+    smp_wmb();
+
+    for (i = 0; i < bs->thread_count; i++) {
+        qemu_sem_post(&bs->sem_work);
+    }
+    bitmap_sync_run(bs);
+    for (i = 0; i < bs->thread_count; i++) {
+        qemu_sem_wait(&bs->sem_done);
+    }
+
+    trace_migration_bitmap_sync_threads(bs->nr_chunks, bs->num_dirty);
+    bs->nr_chunks = 0;
+
+    return bs->num_dirty;
+}
+
+static void bitmap_sync_threads_cleanup(void)
+{
+    BitmapSyncState *bs = bitmap_sync;
+    int i;
+
+    if (!bs) {
+        return;
+    }
+
+    qatomic_set(&bs->quit, true);
+    for (i = 0; i < bs->thread_count; i++) {
+        qemu_sem_post(&bs->sem_work);
+    }
+    for (i = 0; i < bs->thread_count; i++) {
+        qemu_thread_join(bs->threads + i);
+    }
+
+    qemu_sem_destroy(&bs->sem_work);
+    qemu_sem_destroy(&bs->sem_done);
+    g_free(bs->threads);
+    g_free(bs->chunks);
+    g_free(bs);
+    bitmap_sync = NULL;
+}
+
+/*
+ * The dirty bitmap sync is split across as many threads as the multifd
+ * channels, the migration thread included.  Without multifd it stays
+ * single threaded.
+ */
+static void bitmap_sync_threads_setup(void)
+{
+    BitmapSyncState *bs;
+    int i;
+
+    if (!migrate_use_multifd() || migrate_multifd_channels() < 2) {
+        return;
+    }
+
+    bs = g_new0(BitmapSyncState, 1);
+    bs->thread_count = migrate_multifd_channels() - 1;
+    bs->threads = g_new0(QemuThread, bs->thread_count);
+    qemu_sem_init(&bs->sem_work, 0);
+    qemu_sem_init(&bs->sem_done, 0);
+    for (i = 0; i < bs->thread_count; i++) {
+        qemu_thread_create(bs->threads + i, "bitmap-sync",
+                           bitmap_sync_thread, bs, QEMU_THREAD_JOINABLE);
+    }
+    bitmap_sync = bs;
+}
+
 /**
  * ram_pagesize_summary: calculate all the pagesizes of a VM
  *
@@ -972,12 +1696,26 @@ static void migration_trigger_throttle(RAMState *rs)
             mig_throttle_guest_down(bytes_dirty_period,
                                     bytes_dirty_threshold);
         }
+    } else if (migrate_dirty_limit() && !blk_mig_bulk_active()) {
+        /*
+         * Same detection as auto-converge, but only throttle the vCPUs
+         * that dirty memory faster than the quota.  Once started, the
+         * dirty limit thread keeps adjusting the throttle by itself.
+         */
+        if (!dirtylimit_in_service() &&
+            (bytes_dirty_period > bytes_dirty_threshold) &&
+            (++rs->dirty_rate_high_cnt >= 2)) {
+            trace_migration_dirty_limit_start(s->parameters.vcpu_dirty_limit);
+            rs->dirty_rate_high_cnt = 0;
+            dirtylimit_start(s->parameters.vcpu_dirty_limit);
+        }
     }
 }
 
 static void migration_bitmap_sync(RAMState *rs)
 {
     RAMBlock *block;
+    int64_t start_time = qemu_clock_get_us(QEMU_CLOCK_REALTIME);
     int64_t end_time;
 
     ram_counters.dirty_sync_count++;
@@ -992,7 +1730,19 @@ static void migration_bitmap_sync(RAMState *rs)
     qemu_mutex_lock(&rs->bitmap_mutex);
     WITH_RCU_READ_LOCK_GUARD() {
         RAMBLOCK_FOREACH_NOT_IGNORED(block) {
-            ramblock_sync_dirty_bitmap(rs, block);
+            /* Only split blocks that span several chunks */
+            if (bitmap_sync &&
+                block->used_length > BITMAP_SYNC_CHUNK_SIZE) {
+                bitmap_sync_add_block(bitmap_sync, block);
+            } else {
+                ramblock_sync_dirty_bitmap(rs, block);
+            }
+        }
+        if (bitmap_sync) {
+            uint64_t new_dirty_pages = bitmap_sync_flush(bitmap_sync);
+
+            rs->migration_dirty_pages += new_dirty_pages;
+            rs->num_dirty_pages_period += new_dirty_pages;
         }
         ram_counters.remaining = ram_bytes_remaining();
     }
@@ -1000,6 +1750,8 @@ static void migration_bitmap_sync(RAMState *rs)
 
     memory_global_after_dirty_log_sync();
     trace_migration_bitmap_sync_end(rs->num_dirty_pages_period);
+    migrate_get_current()->bitmap_sync_time =
+        qemu_clock_get_us(QEMU_CLOCK_REALTIME) - start_time;
 
     end_time = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
 
@@ -1051,11 +1803,12 @@ static void migration_bitmap_sync_precopy(RAMState *rs)
  * @file: the file where the data is saved
  * @block: block that contains the page we want to send
  * @offset: offset inside the block for the page
+ * @p: the contents of the page
  */
 static int save_zero_page_to_file(RAMState *rs, QEMUFile *file,
-                                  RAMBlock *block, ram_addr_t offset)
+                                  RAMBlock *block, ram_addr_t offset,
+                                  uint8_t *p)
 {
-    uint8_t *p = block->host + offset;
     int len = 0;
 
     if (is_zero_range(p, TARGET_PAGE_SIZE)) {
@@ -1074,10 +1827,12 @@ static int save_zero_page_to_file(RAMState *rs, QEMUFile *file,
  * @rs: current RAM state
  * @block: block that contains the page we want to send
  * @offset: offset inside the block for the page
+ * @p: the contents of the page
  */
-static int save_zero_page(RAMState *rs, RAMBlock *block, ram_addr_t offset)
+static int save_zero_page(RAMState *rs, RAMBlock *block, ram_addr_t offset,
+                          uint8_t *p)
 {
-    int len = save_zero_page_to_file(rs, rs->f, block, offset);
+    int len = save_zero_page_to_file(rs, rs->f, block, offset, p);
 
     if (len) {
         ram_counters.duplicate++;
@@ -1229,7 +1984,7 @@ static bool do_compress_ram_page(QEMUFile *f, z_stream *stream, RAMBlock *block,
     bool zero_page = false;
     int ret;
 
-    if (save_zero_page_to_file(rs, f, block, offset)) {
+    if (save_zero_page_to_file(rs, f, block, offset, p)) {
         zero_page = true;
         goto exit;
     }
@@ -1403,45 +2158,334 @@ static bool find_dirty_block(RAMState *rs, PageSearchStatus *pss, bool *again)
 }
 
 /**
- * unqueue_page: gets a page of the queue
+ * unqueue_page: gets a page of the queue
+ *
+ * Helper for 'get_queued_page' - gets a page off the queue
+ *
+ * Returns the block of the page (or NULL if none available)
+ *
+ * @rs: current RAM state
+ * @offset: used to return the offset within the RAMBlock
+ */
+static RAMBlock *unqueue_page(RAMState *rs, ram_addr_t *offset)
+{
+    RAMBlock *block = NULL;
+
+    if (QSIMPLEQ_EMPTY_ATOMIC(&rs->src_page_requests)) {
+        return NULL;
+    }
+
+    QEMU_LOCK_GUARD(&rs->src_page_req_mutex);
+    if (!QSIMPLEQ_EMPTY(&rs->src_page_requests)) {
+        struct RAMSrcPageRequest *entry =
+                                QSIMPLEQ_FIRST(&rs->src_page_requests);
+        block = entry->rb;
+        *offset = entry->offset;
+
+        if (entry->len > TARGET_PAGE_SIZE) {
+            entry->len -= TARGET_PAGE_SIZE;
+            entry->offset += TARGET_PAGE_SIZE;
+        } else {
+            memory_region_unref(block->mr);
+            QSIMPLEQ_REMOVE_HEAD(&rs->src_page_requests, next_req);
+            g_free(entry);
+            migration_consume_urgent_request();
+        }
+    }
+
+    return block;
+}
+
+#if defined(__linux__)
+/*
+ * Background snapshot write faults
+ *
+ * A vCPU that writes to a page that was not saved yet is blocked until
+ * the page is unprotected.  Rather than waiting for the migration thread
+ * to get to the fault between bulk pages, a pool of fault threads copies
+ * the page into a bounded copy-before-write buffer and unprotects it at
+ * once; the migration thread then sends the copies ahead of any other
+ * page.  When the buffer is full, or the page is already being saved,
+ * the fault is handed to the migration thread, which saves the page from
+ * guest memory before unprotecting it.
+ */
+#define SNAPSHOT_CBW_PAGES  1024
+
+/*
+ * A fault blocks one vCPU and only costs a memcpy to service, so a few
+ * threads are enough and more threads than vCPUs never help.
+ */
+#define SNAPSHOT_FAULT_THREADS_MAX  4
+
+typedef struct SnapshotCopy {
+    RAMBlock *block;
+    /* offset of the host page in the block */
+    ram_addr_t offset;
+    uint8_t *buf;
+    QSIMPLEQ_ENTRY(SnapshotCopy) next;
+} SnapshotCopy;
+
+typedef struct SnapshotFault {
+    RAMBlock *block;
+    ram_addr_t offset;
+    QSIMPLEQ_ENTRY(SnapshotFault) next;
+} SnapshotFault;
+
+typedef struct {
+    QemuThread *threads;
+    int thread_count;
+    /* set to make the fault threads quit */
+    EventNotifier quit;
+    SnapshotCopy *copies;
+    uint8_t *buf;
+    /* protects the fields below */
+    QemuMutex lock;
+    /* signalled when a fault thread is done with a copy */
+    QemuCond copy_cond;
+    QSIMPLEQ_HEAD(, SnapshotCopy) free_copies;
+    QSIMPLEQ_HEAD(, SnapshotCopy) ready_copies;
+    /* copies taken by a fault thread but not ready yet */
+    int inflight;
+    /* faults left to the migration thread */
+    QSIMPLEQ_HEAD(, SnapshotFault) faults;
+} SnapshotFaultState;
+
+static SnapshotFaultState *snapshot_faults;
+
+static void snapshot_fault_queue(SnapshotFaultState *sf, RAMBlock *block,
+                                 ram_addr_t offset)
+{
+    SnapshotFault *fault = g_new(SnapshotFault, 1);
+
+    fault->block = block;
+    fault->offset = offset;
+    qemu_mutex_lock(&sf->lock);
+    QSIMPLEQ_INSERT_TAIL(&sf->faults, fault, next);
+    qemu_mutex_unlock(&sf->lock);
+    trace_snapshot_fault_queue(block->idstr, offset);
+}
+
+static void snapshot_fault_handle(SnapshotFaultState *sf, RAMState *rs,
+                                  void *addr)
+{
+    size_t pagesize = qemu_real_host_page_size;
+    unsigned long npages = pagesize >> TARGET_PAGE_BITS;
+    unsigned long page;
+    SnapshotCopy *copy;
+    ram_addr_t offset;
+    RAMBlock *block;
+    bool unsaved;
+
+    RCU_READ_LOCK_GUARD();
+
+    block = qemu_ram_block_from_host(addr, false, &offset);
+    assert(block && (block->flags & RAM_UF_WRITEPROTECT) != 0);
+    offset &= ~(ram_addr_t)(pagesize - 1);
+
+    if (!npages || qemu_ram_pagesize(block) != pagesize) {
+        snapshot_fault_queue(sf, block, offset);
+        return;
+    }
+
+    qemu_mutex_lock(&sf->lock);
+    copy = QSIMPLEQ_FIRST(&sf->free_copies);
+    if (copy) {
+        QSIMPLEQ_REMOVE_HEAD(&sf->free_copies, next);
+        sf->inflight++;
+    }
+    qemu_mutex_unlock(&sf->lock);
+    if (!copy) {
+        snapshot_fault_queue(sf, block, offset);
+        return;
+    }
+
+    /*
+     * Only take the host page if none of it was picked by the migration
+     * thread, which can still be sending it from guest memory.
+     */
+    page = offset >> TARGET_PAGE_BITS;
+    qemu_mutex_lock(&rs->bitmap_mutex);
+    unsaved = find_next_zero_bit(block->bmap, page + npages, page) >=
+              page + npages;
+    if (unsaved) {
+        bitmap_clear(block->bmap, page, npages);
+    }
+    qemu_mutex_unlock(&rs->bitmap_mutex);
+
+    if (unsaved) {
+        /* The page is still write protected, so it cannot change */
+        copy->block = block;
+        copy->offset = offset;
+        memcpy(copy->buf, block->host + offset, pagesize);
+        uffd_change_protection(rs->uffdio_fd, block->host + offset, pagesize,
+                               false, false);
+        trace_snapshot_fault_copy(block->idstr, offset);
+    }
+
+    qemu_mutex_lock(&sf->lock);
+    if (unsaved) {
+        QSIMPLEQ_INSERT_TAIL(&sf->ready_copies, copy, next);
+    } else {
+        QSIMPLEQ_INSERT_HEAD(&sf->free_copies, copy, next);
+    }
+    sf->inflight--;
+    qemu_cond_broadcast(&sf->copy_cond);
+    qemu_mutex_unlock(&sf->lock);
+
+    if (!unsaved) {
+        snapshot_fault_queue(sf, block, offset);
+    }
+}
+
+static void *snapshot_fault_thread(void *opaque)
+{
+    SnapshotFaultState *sf = opaque;
+    RAMState *rs = ram_state;
+    struct pollfd pfd[2] = {
+        { .fd = rs->uffdio_fd, .events = POLLIN },
+        { .fd = event_notifier_get_fd(&sf->quit), .events = POLLIN },
+    };
+    struct uffd_msg msg;
+
+    rcu_register_thread();
+    while (true) {
+        if (poll(pfd, ARRAY_SIZE(pfd), -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            error_report("%s: poll() failed: %s", __func__, strerror(errno));
+            break;
+        }
+        if (pfd[1].revents) {
+            break;
+        }
+        /* Another fault thread may have taken the event already */
+        if (uffd_read_events(rs->uffdio_fd, &msg, 1) <= 0 ||
+            msg.event != UFFD_EVENT_PAGEFAULT) {
+            continue;
+        }
+        snapshot_fault_handle(sf, rs,
+                              (void *)(uintptr_t)msg.arg.pagefault.address);
+    }
+    rcu_unregister_thread();
+
+    return NULL;
+}
+
+/* Start the fault threads of background snapshot */
+static void snapshot_faults_setup(void)
+{
+    MachineState *ms = MACHINE(qdev_get_machine());
+    SnapshotFaultState *sf = g_new0(SnapshotFaultState, 1);
+    int i;
+
+    if (event_notifier_init(&sf->quit, false)) {
+        g_free(sf);
+        return;
+    }
+    sf->thread_count = MIN(ms->smp.cpus, SNAPSHOT_FAULT_THREADS_MAX);
+    sf->threads = g_new0(QemuThread, sf->thread_count);
+    sf->copies = g_new0(SnapshotCopy, SNAPSHOT_CBW_PAGES);
+    sf->buf = qemu_memalign(qemu_real_host_page_size,
+                            SNAPSHOT_CBW_PAGES * qemu_real_host_page_size);
+    qemu_mutex_init(&sf->lock);
+    qemu_cond_init(&sf->copy_cond);
+    QSIMPLEQ_INIT(&sf->free_copies);
+    QSIMPLEQ_INIT(&sf->ready_copies);
+    QSIMPLEQ_INIT(&sf->faults);
+    for (i = 0; i < SNAPSHOT_CBW_PAGES; i++) {
+        sf->copies[i].buf = sf->buf + i * qemu_real_host_page_size;
+        QSIMPLEQ_INSERT_TAIL(&sf->free_copies, &sf->copies[i], next);
+    }
+    snapshot_faults = sf;
+    for (i = 0; i < sf->thread_count; i++) {
+        qemu_thread_create(sf->threads + i, "snapshot-fault",
+                           snapshot_fault_thread, sf, QEMU_THREAD_JOINABLE);
+    }
+    trace_snapshot_faults_setup(sf->thread_count, SNAPSHOT_CBW_PAGES);
+}
+
+static void snapshot_faults_cleanup(void)
+{
+    SnapshotFaultState *sf = snapshot_faults;
+    SnapshotFault *fault, *next;
+    int i;
+
+    if (!sf) {
+        return;
+    }
+
+    event_notifier_set(&sf->quit);
+    for (i = 0; i < sf->thread_count; i++) {
+        qemu_thread_join(sf->threads + i);
+    }
+    QSIMPLEQ_FOREACH_SAFE(fault, &sf->faults, next, next) {
+        g_free(fault);
+    }
+    qemu_cond_destroy(&sf->copy_cond);
+    qemu_mutex_destroy(&sf->lock);
+    event_notifier_cleanup(&sf->quit);
+    qemu_vfree(sf->buf);
+    g_free(sf->copies);
+    g_free(sf->threads);
+    g_free(sf);
+    snapshot_faults = NULL;
+}
+
+/**
+ * ram_save_snapshot_copies: send the pages copied by the fault threads
  *
- * Helper for 'get_queued_page' - gets a page off the queue
+ * Waits for the copies that are still being taken, so that no page is
+ * left behind when the RAM looks clean.
  *
- * Returns the block of the page (or NULL if none available)
+ * Returns the number of pages written
  *
  * @rs: current RAM state
- * @offset: used to return the offset within the RAMBlock
  */
-static RAMBlock *unqueue_page(RAMState *rs, ram_addr_t *offset)
+static int ram_save_snapshot_copies(RAMState *rs)
 {
-    RAMBlock *block = NULL;
+    SnapshotFaultState *sf = snapshot_faults;
+    QSIMPLEQ_HEAD(, SnapshotCopy) copies;
+    unsigned long npages = qemu_real_host_page_size >> TARGET_PAGE_BITS;
+    SnapshotCopy *copy;
+    int pages = 0;
+    unsigned long i;
 
-    if (QSIMPLEQ_EMPTY_ATOMIC(&rs->src_page_requests)) {
-        return NULL;
+    if (!sf) {
+        return 0;
     }
 
-    QEMU_LOCK_GUARD(&rs->src_page_req_mutex);
-    if (!QSIMPLEQ_EMPTY(&rs->src_page_requests)) {
-        struct RAMSrcPageRequest *entry =
-                                QSIMPLEQ_FIRST(&rs->src_page_requests);
-        block = entry->rb;
-        *offset = entry->offset;
+    QSIMPLEQ_INIT(&copies);
+    qemu_mutex_lock(&sf->lock);
+    while (QSIMPLEQ_EMPTY(&sf->ready_copies) && sf->inflight) {
+        qemu_cond_wait(&sf->copy_cond, &sf->lock);
+    }
+    QSIMPLEQ_CONCAT(&copies, &sf->ready_copies);
+    qemu_mutex_unlock(&sf->lock);
 
-        if (entry->len > TARGET_PAGE_SIZE) {
-            entry->len -= TARGET_PAGE_SIZE;
-            entry->offset += TARGET_PAGE_SIZE;
-        } else {
-            memory_region_unref(block->mr);
-            QSIMPLEQ_REMOVE_HEAD(&rs->src_page_requests, next_req);
-            g_free(entry);
-            migration_consume_urgent_request();
+    QSIMPLEQ_FOREACH(copy, &copies, next) {
+        for (i = 0; i < npages; i++) {
+            ram_addr_t offset = copy->offset + (i << TARGET_PAGE_BITS);
+            uint8_t *p = copy->buf + (i << TARGET_PAGE_BITS);
+
+            if (save_zero_page(rs, copy->block, offset, p) < 0) {
+                save_normal_page(rs, copy->block, offset, p, false);
+            }
         }
+        pages += npages;
     }
 
-    return block;
+    qemu_mutex_lock(&rs->bitmap_mutex);
+    rs->migration_dirty_pages -= pages;
+    qemu_mutex_unlock(&rs->bitmap_mutex);
+
+    qemu_mutex_lock(&sf->lock);
+    QSIMPLEQ_CONCAT(&sf->free_copies, &copies);
+    qemu_mutex_unlock(&sf->lock);
+
+    return pages;
 }
 
-#if defined(__linux__)
 /**
  * poll_fault_page: try to get next UFFD write fault page and, if pending fault
  *   is found, return RAM block pointer and page offset
@@ -1454,6 +2498,7 @@ static RAMBlock *unqueue_page(RAMState *rs, ram_addr_t *offset)
  */
 static RAMBlock *poll_fault_page(RAMState *rs, ram_addr_t *offset)
 {
+    SnapshotFaultState *sf = snapshot_faults;
     struct uffd_msg uffd_msg;
     void *page_address;
     RAMBlock *bs;
@@ -1463,6 +2508,22 @@ static RAMBlock *poll_fault_page(RAMState *rs, ram_addr_t *offset)
         return NULL;
     }
 
+    if (sf) {
+        SnapshotFault *fault;
+
+        bs = NULL;
+        qemu_mutex_lock(&sf->lock);
+        fault = QSIMPLEQ_FIRST(&sf->faults);
+        if (fault) {
+            QSIMPLEQ_REMOVE_HEAD(&sf->faults, next);
+            bs = fault->block;
+            *offset = fault->offset;
+            g_free(fault);
+        }
+        qemu_mutex_unlock(&sf->lock);
+        return bs;
+    }
+
     res = uffd_read_events(rs->uffdio_fd, &uffd_msg, 1);
     if (res <= 0) {
         return NULL;
@@ -1604,6 +2665,7 @@ int ram_write_tracking_start(void)
                 bs->host, bs->max_length);
     }
 
+    snapshot_faults_setup();
     return 0;
 
 fail:
@@ -1637,6 +2699,8 @@ void ram_write_tracking_stop(void)
     RAMState *rs = ram_state;
     RAMBlock *bs;
 
+    snapshot_faults_cleanup();
+
     RCU_READ_LOCK_GUARD();
 
     RAMBLOCK_FOREACH_NOT_IGNORED(bs) {
@@ -1663,6 +2727,13 @@ void ram_write_tracking_stop(void)
 #else
 /* No target OS support, stubs just fail or ignore */
 
+static int ram_save_snapshot_copies(RAMState *rs)
+{
+    (void) rs;
+
+    return 0;
+}
+
 static RAMBlock *poll_fault_page(RAMState *rs, ram_addr_t *offset)
 {
     (void) rs;
@@ -1941,7 +3012,20 @@ static int ram_save_target_page(RAMState *rs, PageSearchStatus *pss,
         return 1;
     }
 
-    res = save_zero_page(rs, block, offset);
+    if (migrate_mapped_ram()) {
+        return ram_save_mapped_ram_page(rs, block, offset);
+    }
+
+    /*
+     * With multifd zero page detection the channels look for zero
+     * pages themselves, so hand the page out without scanning it here.
+     */
+    if (migrate_multifd_zero_page() && !save_page_use_compression(rs) &&
+        !migration_in_postcopy()) {
+        return ram_save_multifd_page(rs, block, offset);
+    }
+
+    res = save_zero_page(rs, block, offset, block->host + offset);
     if (res > 0) {
         /* Must let xbzrle know, otherwise a previous (now 0'd) cached
          * page would be stale
@@ -2027,6 +3111,49 @@ static int ram_save_host_page(RAMState *rs, PageSearchStatus *pss,
     return (res < 0 ? res : pages);
 }
 
+/*
+ * postcopy_preempt_choose_channel: switch the stream the pages are sent on
+ *
+ * With postcopy-preempt, the pages requested by the destination once
+ * postcopy has started go on the dedicated preempt channel.  Each
+ * channel keeps track of its own last sent block, since the destination
+ * decodes RAM_SAVE_FLAG_CONTINUE per channel.
+ *
+ * If the preempt channel is not usable, e.g. after a network failure,
+ * the pages keep going on the main stream.
+ */
+static void postcopy_preempt_choose_channel(RAMState *rs, int channel)
+{
+    MigrationState *s = migrate_get_current();
+    QEMUFile *next;
+
+    if (channel == rs->postcopy_channel) {
+        return;
+    }
+
+    if (channel == RAM_CHANNEL_POSTCOPY) {
+        if (!migrate_postcopy_preempt() || !migration_in_postcopy() ||
+            !s->postcopy_qemufile_src ||
+            qemu_file_get_error(s->postcopy_qemufile_src)) {
+            return;
+        }
+        next = s->postcopy_qemufile_src;
+    } else {
+        /* Urgent pages must not linger in the buffer */
+        qemu_fflush(rs->f);
+        next = rs->channel_f[RAM_CHANNEL_PRECOPY];
+    }
+
+    rs->channel_f[rs->postcopy_channel] = rs->f;
+    rs->channel_last_sent_block[rs->postcopy_channel] = rs->last_sent_block;
+
+    rs->f = next;
+    rs->last_sent_block = rs->channel_last_sent_block[channel];
+    rs->postcopy_channel = channel;
+
+    trace_postcopy_preempt_switch_channel(channel);
+}
+
 /**
  * ram_find_and_save_block: finds a dirty page and sends it to f
  *
@@ -2046,13 +3173,19 @@ static int ram_find_and_save_block(RAMState *rs, bool last_stage)
 {
     PageSearchStatus pss;
     int pages = 0;
-    bool again, found;
+    bool again, found, urgent;
 
     /* No dirty page as there is zero RAM */
     if (!ram_bytes_total()) {
         return pages;
     }
 
+    /* Pages copied on a write fault go first */
+    pages = ram_save_snapshot_copies(rs);
+    if (pages) {
+        return pages;
+    }
+
     pss.block = rs->last_seen_block;
     pss.page = rs->last_page;
     pss.complete_round = false;
@@ -2063,7 +3196,7 @@ static int ram_find_and_save_block(RAMState *rs, bool last_stage)
 
     do {
         again = true;
-        found = get_queued_page(rs, &pss);
+        found = urgent = get_queued_page(rs, &pss);
 
         if (!found) {
             /* priority queue empty, so just search for something dirty */
@@ -2071,13 +3204,22 @@ static int ram_find_and_save_block(RAMState *rs, bool last_stage)
         }
 
         if (found) {
+            if (urgent) {
+                postcopy_preempt_choose_channel(rs, RAM_CHANNEL_POSTCOPY);
+            }
             pages = ram_save_host_page(rs, &pss, last_stage);
+            postcopy_preempt_choose_channel(rs, RAM_CHANNEL_PRECOPY);
         }
     } while (!pages && again);
 
     rs->last_seen_block = pss.block;
     rs->last_page = pss.page;
 
+    if (!pages) {
+        /* A fault thread may have taken the last dirty pages meanwhile */
+        pages = ram_save_snapshot_copies(rs);
+    }
+
     return pages;
 }
 
@@ -2170,14 +3312,21 @@ static void ram_save_cleanup(void *opaque)
     }
 
     RAMBLOCK_FOREACH_NOT_IGNORED(block) {
-        g_free(block->clear_bmap);
+        unsigned long pages = block->max_length >> TARGET_PAGE_BITS;
+
+        ram_bitmap_free(block->clear_bmap,
+                        clear_bmap_size(pages, block->clear_bmap_shift));
         block->clear_bmap = NULL;
-        g_free(block->bmap);
+        ram_bitmap_free(block->bmap, pages);
         block->bmap = NULL;
+        g_free(block->file_bmap);
+        block->file_bmap = NULL;
     }
 
     xbzrle_cleanup();
     compress_threads_save_cleanup();
+    bitmap_sync_threads_cleanup();
+    mapped_ram_cleanup();
     ram_state_cleanup(rsp);
 }
 
@@ -2611,10 +3760,10 @@ static void ram_list_init_bitmaps(void)
              * dirty_memory[DIRTY_MEMORY_MIGRATION] don't include the whole
              * guest memory.
              */
-            block->bmap = bitmap_new(pages);
+            block->bmap = ram_bitmap_new(pages);
             bitmap_set(block->bmap, 0, pages);
             block->clear_bmap_shift = shift;
-            block->clear_bmap = bitmap_new(clear_bmap_size(pages, shift));
+            block->clear_bmap = ram_bitmap_new(clear_bmap_size(pages, shift));
         }
     }
 }
@@ -2754,20 +3903,29 @@ static int ram_save_setup(QEMUFile *f, void *opaque)
 {
     RAMState **rsp = opaque;
     RAMBlock *block;
+    Error *local_err = NULL;
 
     if (compress_threads_save_setup()) {
         return -1;
     }
+    bitmap_sync_threads_setup();
 
     /* migration has already setup the bitmap, reuse it. */
     if (!migration_in_colo_state()) {
         if (ram_init_all(rsp) != 0) {
             compress_threads_save_cleanup();
+            bitmap_sync_threads_cleanup();
             return -1;
         }
     }
     (*rsp)->f = f;
 
+    if (migrate_mapped_ram() &&
+        mapped_ram_setup(qemu_file_get_ioc(f), false, &local_err)) {
+        error_report_err(local_err);
+        return -1;
+    }
+
     WITH_RCU_READ_LOCK_GUARD() {
         qemu_put_be64(f, ram_bytes_total_common(true) | RAM_SAVE_FLAG_MEM_SIZE);
 
@@ -2782,6 +3940,14 @@ static int ram_save_setup(QEMUFile *f, void *opaque)
             if (migrate_ignore_shared()) {
                 qemu_put_be64(f, block->mr->addr);
             }
+            if (migrate_mapped_ram()) {
+                block->file_bmap =
+                    bitmap_new(block->used_length >> TARGET_PAGE_BITS);
+                if (mapped_ram_save_header(f, block, &local_err)) {
+                    error_report_err(local_err);
+                    return -1;
+                }
+            }
         }
     }
 
@@ -2888,6 +4054,18 @@ static int ram_save_iterate(QEMUFile *f, void *opaque)
 out:
     if (ret >= 0
         && migration_is_setup_or_active(migrate_get_current()->state)) {
+        /*
+         * A page can only be queued again after the next bitmap sync,
+         * so its writes never race with each other.
+         */
+        if (mapped_ram) {
+            Error *local_err = NULL;
+
+            if (mapped_ram_flush(mapped_ram, &local_err)) {
+                qemu_file_set_error_obj(f, -EIO, local_err);
+                return -EIO;
+            }
+        }
         multifd_send_sync_main(rs->f);
         qemu_put_be64(f, RAM_SAVE_FLAG_EOS);
         qemu_fflush(f);
@@ -2920,7 +4098,11 @@ static int ram_save_complete(QEMUFile *f, void *opaque)
 
     WITH_RCU_READ_LOCK_GUARD() {
         if (!migration_in_postcopy()) {
+            int64_t start = qemu_clock_get_us(QEMU_CLOCK_REALTIME);
+
             migration_bitmap_sync_precopy(rs);
+            migrate_get_current()->downtime_bitmap_sync =
+                qemu_clock_get_us(QEMU_CLOCK_REALTIME) - start;
         }
 
         ram_control_before_iterate(f, RAM_CONTROL_FINISH);
@@ -2944,10 +4126,27 @@ static int ram_save_complete(QEMUFile *f, void *opaque)
 
         flush_compressed_data(rs);
         ram_control_after_iterate(f, RAM_CONTROL_FINISH);
+
+        if (ret >= 0 && mapped_ram) {
+            Error *local_err = NULL;
+
+            if (mapped_ram_flush(mapped_ram, &local_err) ||
+                mapped_ram_save_bitmaps(mapped_ram, &local_err)) {
+                qemu_file_set_error_obj(f, -EIO, local_err);
+                ret = -EIO;
+            }
+        }
     }
 
     if (ret >= 0) {
+        MigrationState *s = migrate_get_current();
+
         multifd_send_sync_main(rs->f);
+        if (s->postcopy_qemufile_src && migration_in_postcopy()) {
+            /* Let the destination preempt thread finish */
+            qemu_put_be64(s->postcopy_qemufile_src, RAM_SAVE_FLAG_EOS);
+            qemu_fflush(s->postcopy_qemufile_src);
+        }
         qemu_put_be64(f, RAM_SAVE_FLAG_EOS);
         qemu_fflush(f);
     }
@@ -3027,26 +4226,30 @@ static int load_xbzrle(QEMUFile *f, ram_addr_t addr, void *host)
  *
  * @f: QEMUFile where to read the data from
  * @flags: Page flags (mostly to see if it's a continuation of previous block)
+ * @channel: the channel the page is read from, each one tracks its own
+ *           last block
  */
-static inline RAMBlock *ram_block_from_stream(QEMUFile *f, int flags)
+static inline RAMBlock *ram_block_from_stream(QEMUFile *f, int flags,
+                                              int channel)
 {
-    static RAMBlock *block;
+    static RAMBlock *last_block[RAM_CHANNEL_MAX];
+    RAMBlock *block;
     char id[256];
     uint8_t len;
 
     if (flags & RAM_SAVE_FLAG_CONTINUE) {
-        if (!block) {
+        if (!last_block[channel]) {
             error_report("Ack, bad migration stream!");
             return NULL;
         }
-        return block;
+        return last_block[channel];
     }
 
     len = qemu_get_byte(f);
     qemu_get_buffer(f, (uint8_t *)id, len);
     id[len] = 0;
 
-    block = qemu_ram_block_by_name(id);
+    block = last_block[channel] = qemu_ram_block_by_name(id);
     if (!block) {
         error_report("Can't find block %s", id);
         return NULL;
@@ -3087,13 +4290,61 @@ static inline void *colo_cache_from_block_offset(RAMBlock *block,
     * It help us to decide which pages in ram cache should be flushed
     * into VM's RAM later.
     */
-    if (record_bitmap &&
+    if (record_bitmap && migrate_use_multifd()) {
+        /* Shared with the multifd channels, counted when flushing */
+        set_bit_atomic(offset >> TARGET_PAGE_BITS, block->bmap);
+    } else if (record_bitmap &&
         !test_and_set_bit(offset >> TARGET_PAGE_BITS, block->bmap)) {
         ram_state->migration_dirty_pages++;
     }
     return block->colo_cache + offset;
 }
 
+/**
+ * colo_multifd_host: where a multifd channel stores a received page
+ *
+ * In COLO state the pages go to the COLO cache, like the ones received
+ * on the main stream.  The channels only set their bits in @bmap, the
+ * count of dirty pages is redone by colo_flush_ram_cache().
+ *
+ * @block: RAMBlock of the page
+ * @offset: offset of the page inside @block
+ */
+void *colo_multifd_host(RAMBlock *block, ram_addr_t offset)
+{
+    if (!migration_incoming_in_colo_state()) {
+        return block->host + offset;
+    }
+    set_bit_atomic(offset >> TARGET_PAGE_BITS, block->bmap);
+    return block->colo_cache + offset;
+}
+
+/**
+ * colo_multifd_backup_pages: copy pages received by multifd to the cache
+ *
+ * Before the COLO state the pages are loaded into the SVM's memory and
+ * the COLO cache keeps a copy of them, see ram_load_precopy().
+ *
+ * @block: RAMBlock of the pages
+ * @offset: array of offsets of the pages inside @block
+ * @pages: number of pages in @offset
+ */
+void colo_multifd_backup_pages(RAMBlock *block, const ram_addr_t *offset,
+                               uint32_t pages)
+{
+    uint32_t i;
+
+    if (!migration_incoming_colo_enabled() ||
+        migration_incoming_in_colo_state()) {
+        return;
+    }
+
+    for (i = 0; i < pages; i++) {
+        memcpy(block->colo_cache + offset[i], block->host + offset[i],
+               TARGET_PAGE_SIZE);
+    }
+}
+
 /**
  * ram_handle_compressed: handle the zero page case
  *
@@ -3349,7 +4600,7 @@ int colo_init_ram_cache(void)
 
         RAMBLOCK_FOREACH_NOT_IGNORED(block) {
             unsigned long pages = block->max_length >> TARGET_PAGE_BITS;
-            block->bmap = bitmap_new(pages);
+            block->bmap = ram_bitmap_new(pages);
         }
     }
 
@@ -3386,7 +4637,7 @@ void colo_release_ram_cache(void)
 
     memory_global_dirty_log_stop();
     RAMBLOCK_FOREACH_NOT_IGNORED(block) {
-        g_free(block->bmap);
+        ram_bitmap_free(block->bmap, block->max_length >> TARGET_PAGE_BITS);
         block->bmap = NULL;
     }
 
@@ -3418,6 +4669,15 @@ static int ram_load_setup(QEMUFile *f, void *opaque)
     xbzrle_load_setup();
     ramblock_recv_map_init();
 
+    if (migrate_mapped_ram()) {
+        Error *local_err = NULL;
+
+        if (mapped_ram_setup(qemu_file_get_ioc(f), true, &local_err)) {
+            error_report_err(local_err);
+            return -1;
+        }
+    }
+
     return 0;
 }
 
@@ -3431,9 +4691,11 @@ static int ram_load_cleanup(void *opaque)
 
     xbzrle_load_cleanup();
     compress_threads_load_cleanup();
+    mapped_ram_cleanup();
 
     RAMBLOCK_FOREACH_NOT_IGNORED(rb) {
-        g_free(rb->receivedmap);
+        ram_bitmap_free(rb->receivedmap,
+                        rb->max_length >> qemu_target_page_bits());
         rb->receivedmap = NULL;
     }
 
@@ -3456,24 +4718,238 @@ int ram_postcopy_incoming_init(MigrationIncomingState *mis)
     return postcopy_ram_incoming_init(mis);
 }
 
+/*
+ * Postcopy page placement threads
+ *
+ * UFFDIO_COPY is expensive enough to limit the postcopy bandwidth when
+ * it is issued from the thread that reads the stream.  With
+ * postcopy-place-threads, each host page is assembled into the buffer
+ * of a free placement thread, which then places it while the reader
+ * goes on with the next page.  Buffers are as large as the largest host
+ * page, so hugetlbfs pages are still placed with a single ioctl.
+ */
+typedef struct {
+    QemuThread thread;
+    QemuMutex mutex;
+    QemuCond cond;
+    bool quit;
+    /* a page is ready to be placed; protected by @mutex */
+    bool pending;
+    /* set when the buffer is free; protected by place_done_lock */
+    bool done;
+    void *buf;
+    void *host;
+    RAMBlock *block;
+    bool all_zero;
+} PlaceParam;
+
+static PlaceParam *place_param;
+static int place_thread_count;
+static QemuMutex place_done_lock;
+static QemuCond place_done_cond;
+/* first error of the placement threads; protected by place_done_lock */
+static int place_error;
+/* pages submitted and not placed yet; protected by place_done_lock */
+static int place_inflight;
+
+static void *postcopy_place_thread(void *opaque)
+{
+    PlaceParam *param = opaque;
+    MigrationIncomingState *mis = migration_incoming_get_current();
+
+    rcu_register_thread();
+
+    qemu_mutex_lock(&param->mutex);
+    while (!param->quit) {
+        if (param->pending) {
+            int ret;
+
+            param->pending = false;
+            qemu_mutex_unlock(&param->mutex);
+
+            if (param->all_zero) {
+                ret = postcopy_place_page_zero(mis, param->host, param->block);
+            } else {
+                ret = postcopy_place_page(mis, param->host, param->buf,
+                                          param->block);
+            }
+
+            qemu_mutex_lock(&place_done_lock);
+            if (ret && !place_error) {
+                place_error = ret;
+            }
+            param->done = true;
+            place_inflight--;
+            qemu_cond_broadcast(&place_done_cond);
+            qemu_mutex_unlock(&place_done_lock);
+
+            qemu_mutex_lock(&param->mutex);
+        } else {
+            qemu_cond_wait(&param->cond, &param->mutex);
+        }
+    }
+    qemu_mutex_unlock(&param->mutex);
+
+    rcu_unregister_thread();
+    return NULL;
+}
+
+/* Wait for a free placement thread and hand its buffer to the caller */
+static PlaceParam *postcopy_place_get(void)
+{
+    PlaceParam *param = NULL;
+    int i;
+
+    qemu_mutex_lock(&place_done_lock);
+    while (!param) {
+        for (i = 0; i < place_thread_count; i++) {
+            if (place_param[i].done) {
+                param = &place_param[i];
+                param->done = false;
+                break;
+            }
+        }
+        if (!param) {
+            qemu_cond_wait(&place_done_cond, &place_done_lock);
+        }
+    }
+    qemu_mutex_unlock(&place_done_lock);
+
+    return param;
+}
+
+static void postcopy_place_submit(PlaceParam *param, void *host,
+                                  RAMBlock *block, bool all_zero)
+{
+    qemu_mutex_lock(&place_done_lock);
+    place_inflight++;
+    qemu_mutex_unlock(&place_done_lock);
+
+    qemu_mutex_lock(&param->mutex);
+    param->host = host;
+    param->block = block;
+    param->all_zero = all_zero;
+    param->pending = true;
+    qemu_cond_signal(&param->cond);
+    qemu_mutex_unlock(&param->mutex);
+}
+
+/* Give back a buffer that was not submitted */
+static void postcopy_place_put(PlaceParam *param)
+{
+    qemu_mutex_lock(&place_done_lock);
+    param->done = true;
+    qemu_cond_broadcast(&place_done_cond);
+    qemu_mutex_unlock(&place_done_lock);
+}
+
+/*
+ * Wait until all the submitted pages are placed, returns the first error.
+ * Buffers still being filled by another channel are not waited for.
+ */
+static int postcopy_place_wait_done(void)
+{
+    int ret;
+
+    qemu_mutex_lock(&place_done_lock);
+    while (place_inflight) {
+        qemu_cond_wait(&place_done_cond, &place_done_lock);
+    }
+    ret = place_error;
+    qemu_mutex_unlock(&place_done_lock);
+
+    return ret;
+}
+
+int postcopy_place_threads_setup(MigrationIncomingState *mis)
+{
+    int i;
+
+    place_thread_count = migrate_postcopy_place_threads();
+    if (!place_thread_count) {
+        return 0;
+    }
+
+    place_param = g_new0(PlaceParam, place_thread_count);
+    qemu_mutex_init(&place_done_lock);
+    qemu_cond_init(&place_done_cond);
+    place_error = 0;
+    place_inflight = 0;
+    for (i = 0; i < place_thread_count; i++) {
+        PlaceParam *param = &place_param[i];
+
+        param->buf = qemu_try_memalign(qemu_real_host_page_size,
+                                       mis->largest_page_size);
+        if (!param->buf) {
+            error_report("%s: Failed to allocate placement buffer", __func__);
+            place_thread_count = i;
+            postcopy_place_threads_cleanup(mis);
+            return -1;
+        }
+        param->done = true;
+        qemu_mutex_init(&param->mutex);
+        qemu_cond_init(&param->cond);
+        qemu_thread_create(&param->thread, "postcopy/place",
+                           postcopy_place_thread, param,
+                           QEMU_THREAD_JOINABLE);
+    }
+    trace_postcopy_place_threads_setup(place_thread_count);
+
+    return 0;
+}
+
+void postcopy_place_threads_cleanup(MigrationIncomingState *mis)
+{
+    int i;
+
+    if (!place_param) {
+        return;
+    }
+
+    for (i = 0; i < place_thread_count; i++) {
+        PlaceParam *param = &place_param[i];
+
+        qemu_mutex_lock(&param->mutex);
+        param->quit = true;
+        qemu_cond_signal(&param->cond);
+        qemu_mutex_unlock(&param->mutex);
+
+        qemu_thread_join(&param->thread);
+        qemu_mutex_destroy(&param->mutex);
+        qemu_cond_destroy(&param->cond);
+        qemu_vfree(param->buf);
+    }
+    qemu_mutex_destroy(&place_done_lock);
+    qemu_cond_destroy(&place_done_cond);
+    g_free(place_param);
+    place_param = NULL;
+    place_thread_count = 0;
+}
+
 /**
  * ram_load_postcopy: load a page in postcopy case
  *
  * Returns 0 for success or -errno in case of error
  *
- * Called in postcopy mode by ram_load().
+ * Called in postcopy mode by ram_load(), and by the postcopy preempt
+ * thread for the urgent pages channel.
  * rcu_read_lock is taken prior to this being called.
  *
  * @f: QEMUFile where to send the data
+ * @channel: RAM_CHANNEL_PRECOPY or RAM_CHANNEL_POSTCOPY
  */
-static int ram_load_postcopy(QEMUFile *f)
+int ram_load_postcopy(QEMUFile *f, int channel)
 {
     int flags = 0, ret = 0;
     bool place_needed = false;
     bool matches_target_page_size = false;
     MigrationIncomingState *mis = migration_incoming_get_current();
     /* Temporary page that is later 'placed' */
-    void *postcopy_host_page = mis->postcopy_tmp_page;
+    void *postcopy_host_page = channel == RAM_CHANNEL_POSTCOPY ?
+                               mis->postcopy_preempt_tmp_page :
+                               mis->postcopy_tmp_page;
+    /* Placement thread owning postcopy_host_page, if any */
+    PlaceParam *place = NULL;
     void *this_host = NULL;
     bool all_zero = true;
     int target_pages = 0;
@@ -3504,7 +4980,7 @@ static int ram_load_postcopy(QEMUFile *f)
         trace_ram_load_postcopy_loop((uint64_t)addr, flags);
         if (flags & (RAM_SAVE_FLAG_ZERO | RAM_SAVE_FLAG_PAGE |
                      RAM_SAVE_FLAG_COMPRESS_PAGE)) {
-            block = ram_block_from_stream(f, flags);
+            block = ram_block_from_stream(f, flags, channel);
 
             host = host_from_ram_block_offset(block, addr);
             if (!host) {
@@ -3514,6 +4990,11 @@ static int ram_load_postcopy(QEMUFile *f)
             }
             target_pages++;
             matches_target_page_size = block->page_size == TARGET_PAGE_SIZE;
+            if (place_thread_count && target_pages == 1) {
+                /* Assemble the host page in a placement thread buffer */
+                place = postcopy_place_get();
+                postcopy_host_page = place->buf;
+            }
             /*
              * Postcopy requires that we place whole host pages atomically;
              * these may be huge pages for RAMBlocks that are backed by
@@ -3567,8 +5048,12 @@ static int ram_load_postcopy(QEMUFile *f)
 
         case RAM_SAVE_FLAG_PAGE:
             all_zero = false;
-            if (!matches_target_page_size) {
-                /* For huge pages, we always use temporary buffer */
+            if (!matches_target_page_size || place) {
+                /*
+                 * For huge pages, we always use temporary buffer; so do
+                 * placement threads, since the QEMUFile buffer does not
+                 * outlive the next read.
+                 */
                 qemu_get_buffer(f, page_buffer, TARGET_PAGE_SIZE);
             } else {
                 /*
@@ -3615,7 +5100,16 @@ static int ram_load_postcopy(QEMUFile *f)
             ret = qemu_file_get_error(f);
         }
 
-        if (!ret && place_needed) {
+        if (!ret && place_needed && place) {
+            void *place_dest = (void *)QEMU_ALIGN_DOWN((uintptr_t)host,
+                                                       block->page_size);
+
+            postcopy_place_submit(place, place_dest, block, all_zero);
+            place = NULL;
+            place_needed = false;
+            target_pages = 0;
+            all_zero = true;
+        } else if (!ret && place_needed) {
             /* This gets called at the last target page in the host page */
             void *place_dest = (void *)QEMU_ALIGN_DOWN((uintptr_t)host,
                                                        block->page_size);
@@ -3634,6 +5128,18 @@ static int ram_load_postcopy(QEMUFile *f)
         }
     }
 
+    if (place) {
+        /* Bailed out in the middle of a host page */
+        postcopy_place_put(place);
+    }
+    if (place_thread_count) {
+        int place_ret = postcopy_place_wait_done();
+
+        if (!ret) {
+            ret = place_ret;
+        }
+    }
+
     return ret;
 }
 
@@ -3665,6 +5171,16 @@ void colo_flush_ram_cache(void)
         RAMBLOCK_FOREACH_NOT_IGNORED(block) {
             ramblock_sync_dirty_bitmap(ram_state, block);
         }
+
+        /* Pages from the multifd channels are not counted, see above */
+        if (migrate_use_multifd()) {
+            ram_state->migration_dirty_pages = 0;
+            RAMBLOCK_FOREACH_NOT_IGNORED(block) {
+                ram_state->migration_dirty_pages +=
+                    bitmap_count_one(block->bmap,
+                                     block->used_length >> TARGET_PAGE_BITS);
+            }
+        }
     }
 
     trace_colo_flush_ram_cache_begin(ram_state->migration_dirty_pages);
@@ -3741,7 +5257,8 @@ static int ram_load_precopy(QEMUFile *f)
 
         if (flags & (RAM_SAVE_FLAG_ZERO | RAM_SAVE_FLAG_PAGE |
                      RAM_SAVE_FLAG_COMPRESS_PAGE | RAM_SAVE_FLAG_XBZRLE)) {
-            RAMBlock *block = ram_block_from_stream(f, flags);
+            RAMBlock *block = ram_block_from_stream(f, flags,
+                                                    RAM_CHANNEL_PRECOPY);
 
             host = host_from_ram_block_offset(block, addr);
             /*
@@ -3830,6 +5347,15 @@ static int ram_load_precopy(QEMUFile *f)
                             ret = -EINVAL;
                         }
                     }
+                    if (!ret && migrate_mapped_ram()) {
+                        Error *local_err = NULL;
+
+                        if (mapped_ram_load_block(f, block, length,
+                                                  &local_err)) {
+                            error_report_err(local_err);
+                            ret = -EINVAL;
+                        }
+                    }
                     ram_control_load_hook(f, RAM_CONTROL_BLOCK_REG,
                                           block->idstr);
                 } else {
@@ -3840,6 +5366,14 @@ static int ram_load_precopy(QEMUFile *f)
 
                 total_ram_bytes -= length;
             }
+            if (!ret && mapped_ram) {
+                Error *local_err = NULL;
+
+                if (mapped_ram_flush(mapped_ram, &local_err)) {
+                    error_report_err(local_err);
+                    ret = -EIO;
+                }
+            }
             break;
 
         case RAM_SAVE_FLAG_ZERO:
@@ -3918,7 +5452,7 @@ static int ram_load(QEMUFile *f, void *opaque, int version_id)
      */
     WITH_RCU_READ_LOCK_GUARD() {
         if (postcopy_running) {
-            ret = ram_load_postcopy(f);
+            ret = ram_load_postcopy(f, RAM_CHANNEL_PRECOPY);
         } else {
             ret = ram_load_precopy(f);
         }
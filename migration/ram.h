@@ -37,6 +37,13 @@ extern MigrationStats ram_counters;
 extern XBZRLECacheStats xbzrle_counters;
 extern CompressionStats compression_counters;
 
+/* Streams that carry RAM pages when postcopy-preempt is enabled */
+enum {
+    RAM_CHANNEL_PRECOPY = 0,
+    RAM_CHANNEL_POSTCOPY = 1,
+    RAM_CHANNEL_MAX,
+};
+
 bool ramblock_is_ignored(RAMBlock *block);
 /* Should be holding either ram_list.mutex, or the RCU lock. */
 #define RAMBLOCK_FOREACH_NOT_IGNORED(block)            \
@@ -62,6 +69,9 @@ int ram_postcopy_send_discard_bitmap(MigrationState *ms);
 /* For incoming postcopy discard */
 int ram_discard_range(const char *block_name, uint64_t start, size_t length);
 int ram_postcopy_incoming_init(MigrationIncomingState *mis);
+int ram_load_postcopy(QEMUFile *f, int channel);
+int postcopy_place_threads_setup(MigrationIncomingState *mis);
+void postcopy_place_threads_cleanup(MigrationIncomingState *mis);
 
 void ram_handle_compressed(void *host, uint8_t ch, uint64_t size);
 
@@ -78,6 +88,9 @@ int colo_init_ram_cache(void);
 void colo_flush_ram_cache(void);
 void colo_release_ram_cache(void);
 void colo_incoming_start_dirty_log(void);
+void *colo_multifd_host(RAMBlock *block, ram_addr_t offset);
+void colo_multifd_backup_pages(RAMBlock *block, const ram_addr_t *offset,
+                               uint32_t pages);
 
 /* Background snapshot */
 bool ram_write_tracking_available(void);
@@ -22,6 +22,7 @@
 #include "qemu-file.h"
 #include "ram.h"
 #include "qemu-file-channel.h"
+#include "multifd.h"
 #include "qemu/error-report.h"
 #include "qemu/main-loop.h"
 #include "qemu/module.h"
@@ -126,6 +127,7 @@ static uint32_t known_capabilities = RDMA_CAPABILITY_PIN_ALL;
 enum {
     RDMA_WRID_NONE = 0,
     RDMA_WRID_RDMA_WRITE = 1,
+    RDMA_WRID_MULTIFD_WRITE = 2,
     RDMA_WRID_SEND_CONTROL = 2000,
     RDMA_WRID_RECV_CONTROL = 4000,
 };
@@ -133,6 +135,7 @@ enum {
 static const char *wrid_desc[] = {
     [RDMA_WRID_NONE] = "NONE",
     [RDMA_WRID_RDMA_WRITE] = "WRITE RDMA",
+    [RDMA_WRID_MULTIFD_WRITE] = "WRITE RDMA MULTIFD",
     [RDMA_WRID_SEND_CONTROL] = "CONTROL SEND",
     [RDMA_WRID_RECV_CONTROL] = "CONTROL RECV",
 };
@@ -396,6 +399,14 @@ typedef struct RDMAContext {
     /* the RDMAContext for return path */
     struct RDMAContext *return_path;
     bool is_return_path;
+
+    /*
+     * The main RDMAContext when this one carries a multifd channel.
+     * Multifd channels have their own queue pair, but share the
+     * protection domain (and so the ram block registrations) of
+     * the main connection.
+     */
+    struct RDMAContext *multifd_parent;
 } RDMAContext;
 
 #define TYPE_QIO_CHANNEL_RDMA "qio-channel-rdma"
@@ -1049,7 +1060,11 @@ err_resolve_create_id:
 static int qemu_rdma_alloc_pd_cq(RDMAContext *rdma)
 {
     /* allocate pd */
-    rdma->pd = ibv_alloc_pd(rdma->verbs);
+    if (rdma->multifd_parent) {
+        rdma->pd = rdma->multifd_parent->pd;
+    } else {
+        rdma->pd = ibv_alloc_pd(rdma->verbs);
+    }
     if (!rdma->pd) {
         error_report("failed to allocate protection domain");
         return -1;
@@ -1076,7 +1091,7 @@ static int qemu_rdma_alloc_pd_cq(RDMAContext *rdma)
     return 0;
 
 err_alloc_pd_cq:
-    if (rdma->pd) {
+    if (rdma->pd && !rdma->multifd_parent) {
         ibv_dealloc_pd(rdma->pd);
     }
     if (rdma->comp_channel) {
@@ -2362,7 +2377,9 @@ static void qemu_rdma_cleanup(RDMAContext *rdma)
         rdma->comp_channel = NULL;
     }
     if (rdma->pd) {
-        ibv_dealloc_pd(rdma->pd);
+        if (!rdma->multifd_parent) {
+            ibv_dealloc_pd(rdma->pd);
+        }
         rdma->pd = NULL;
     }
     if (rdma->cm_id) {
@@ -2668,6 +2685,7 @@ static ssize_t qio_channel_rdma_writev(QIOChannel *ioc,
                                        size_t niov,
                                        int *fds,
                                        size_t nfds,
+                                       int flags,
                                        Error **errp)
 {
     QIOChannelRDMA *rioc = QIO_CHANNEL_RDMA(ioc);
@@ -3140,7 +3158,8 @@ static size_t qemu_rdma_save_page(QEMUFile *f, void *opaque,
 
     CHECK_ERROR_STATE();
 
-    if (migration_in_postcopy()) {
+    /* With multifd the pages are written by the multifd channels */
+    if (migration_in_postcopy() || migrate_use_multifd()) {
         return RAM_SAVE_CONTROL_NOT_SUPP;
     }
 
@@ -3232,6 +3251,8 @@ err:
 }
 
 static void rdma_accept_incoming_migration(void *opaque);
+static void qemu_rdma_multifd_accept(RDMAContext *rdma,
+                                     struct rdma_cm_event *cm_event);
 
 static void rdma_cm_poll_handler(void *opaque)
 {
@@ -3245,6 +3266,14 @@ static void rdma_cm_poll_handler(void *opaque)
         error_report("get_cm_event failed %d", errno);
         return;
     }
+
+    /* Connection requests after the main one are multifd channels */
+    if (cm_event->event == RDMA_CM_EVENT_CONNECT_REQUEST &&
+        migrate_use_multifd()) {
+        qemu_rdma_multifd_accept(rdma->is_return_path ?
+                                 rdma->return_path : rdma, cm_event);
+        return;
+    }
     rdma_ack_cm_event(cm_event);
 
     if (cm_event->event == RDMA_CM_EVENT_DISCONNECTED ||
@@ -3407,6 +3436,126 @@ err_rdma_dest_wait:
     return ret;
 }
 
+/*
+ * Accept a multifd channel on the destination.  The channel gets its
+ * own queue pair and cm event channel, but lives in the protection
+ * domain of the main connection so that the source can RDMA write
+ * into the ram blocks registered there.
+ */
+static void qemu_rdma_multifd_accept(RDMAContext *parent,
+                                     struct rdma_cm_event *cm_event)
+{
+    RDMACapabilities cap;
+    struct rdma_conn_param conn_param = {
+                                            .responder_resources = 2,
+                                            .private_data = &cap,
+                                            .private_data_len = sizeof(cap),
+                                         };
+    RDMAContext *rdma;
+    QIOChannelRDMA *rioc;
+    Error *local_err = NULL;
+    int ret, idx;
+
+    memcpy(&cap, cm_event->param.conn.private_data, sizeof(cap));
+    network_to_caps(&cap);
+    cap.flags &= known_capabilities;
+
+    rdma = g_new0(RDMAContext, 1);
+    rdma->current_index = -1;
+    rdma->current_chunk = -1;
+    rdma->host = g_strdup(parent->host);
+    rdma->port = parent->port;
+    rdma->multifd_parent = parent;
+    rdma->pin_all = cap.flags & RDMA_CAPABILITY_PIN_ALL;
+    rdma->cm_id = cm_event->id;
+    rdma->verbs = cm_event->id->verbs;
+
+    rdma_ack_cm_event(cm_event);
+
+    trace_qemu_rdma_multifd_accept(rdma->verbs);
+
+    if (rdma->verbs != parent->verbs) {
+        error_report("rdma multifd: ibv context not matching %p, %p!",
+                     parent->verbs, rdma->verbs);
+        goto err;
+    }
+
+    /* Keep the events of this connection away from the main one */
+    rdma->channel = rdma_create_event_channel();
+    if (!rdma->channel) {
+        error_report("rdma multifd: could not create rdma event channel");
+        goto err;
+    }
+    if (rdma_migrate_id(rdma->cm_id, rdma->channel)) {
+        error_report("rdma multifd: could not migrate cm_id");
+        goto err;
+    }
+
+    ret = qemu_rdma_alloc_pd_cq(rdma);
+    if (ret) {
+        error_report("rdma multifd: error allocating cq!");
+        goto err;
+    }
+
+    ret = qemu_rdma_alloc_qp(rdma);
+    if (ret) {
+        error_report("rdma multifd: error allocating qp!");
+        goto err;
+    }
+
+    for (idx = 0; idx < RDMA_WRID_MAX; idx++) {
+        ret = qemu_rdma_reg_control(rdma, idx);
+        if (ret) {
+            error_report("rdma multifd: error registering %d control", idx);
+            goto err;
+        }
+    }
+
+    caps_to_network(&cap);
+
+    ret = rdma_accept(rdma->cm_id, &conn_param);
+    if (ret) {
+        error_report("rdma multifd: rdma_accept returns %d", ret);
+        goto err;
+    }
+
+    ret = rdma_get_cm_event(rdma->channel, &cm_event);
+    if (ret) {
+        error_report("rdma multifd: rdma_accept get_cm_event failed %d", ret);
+        goto err;
+    }
+
+    if (cm_event->event != RDMA_CM_EVENT_ESTABLISHED) {
+        error_report("rdma multifd: rdma_accept not event established");
+        rdma_ack_cm_event(cm_event);
+        goto err;
+    }
+
+    rdma_ack_cm_event(cm_event);
+    rdma->connected = true;
+
+    ret = qemu_rdma_post_recv_control(rdma, RDMA_WRID_READY);
+    if (ret) {
+        error_report("rdma multifd: error posting second control recv");
+        goto err;
+    }
+
+    rioc = QIO_CHANNEL_RDMA(object_new(TYPE_QIO_CHANNEL_RDMA));
+    rioc->rdmain = rdma;
+    qio_channel_set_name(QIO_CHANNEL(rioc), "migration-rdma-multifd-incoming");
+
+    multifd_recv_new_channel(QIO_CHANNEL(rioc), &local_err);
+    object_unref(OBJECT(rioc));
+    if (local_err) {
+        error_reportf_err(local_err, "RDMA ERROR:");
+    }
+    return;
+
+err:
+    qemu_rdma_cleanup(rdma);
+    g_free(rdma);
+}
+
 static int dest_ram_sort_func(const void *a, const void *b)
 {
     unsigned int a_index = ((const RDMALocalBlock *)a)->src_index;
@@ -4083,6 +4232,22 @@ void rdma_start_outgoing_migration(void *opaque,
         return;
     }
 
+    /*
+     * Multifd channels RDMA write straight into the ram blocks, using
+     * the keys of the whole blocks.
+     */
+    if (migrate_use_multifd() &&
+        !s->enabled_capabilities[MIGRATION_CAPABILITY_RDMA_PIN_ALL]) {
+        error_setg(errp, "RDMA: multifd requires the rdma-pin-all "
+                   "capability");
+        return;
+    }
+    /* COLO keeps the pages in a cache that RDMA writes would bypass */
+    if (migrate_use_multifd() && migrate_colo_enabled()) {
+        error_setg(errp, "RDMA: multifd is not compatible with x-colo");
+        return;
+    }
+
     rdma = qemu_rdma_data_init(host_port, errp);
     if (rdma == NULL) {
         goto err;
@@ -4102,6 +4267,11 @@ void rdma_start_outgoing_migration(void *opaque,
         goto err;
     }
 
+    if (migrate_use_multifd() && !rdma->pin_all) {
+        qemu_rdma_cleanup(rdma);
+        goto err;
+    }
+
     /* RDMA postcopy need a separate queue pair for return path */
     if (migrate_postcopy()) {
         rdma_return_path = qemu_rdma_data_init(host_port, errp);
@@ -4139,3 +4309,219 @@ err:
     g_free(rdma);
     g_free(rdma_return_path);
 }
+
+/*
+ * Multifd over RDMA
+ *
+ * Every multifd channel is a separate RDMA connection to the destination
+ * with its own queue pair.  Packets and compressed data go through the
+ * usual QEMUFile control messages of the channel, while uncompressed
+ * pages are RDMA written straight into the destination ram blocks before
+ * a marker message tells the receiving thread that they have landed.
+ */
+
+/* Number of RDMA writes posted before waiting for them to complete */
+#define RDMA_MULTIFD_WRITE_BATCH 64
+
+bool rdma_is_migration_file(QEMUFile *f)
+{
+    return object_dynamic_cast(OBJECT(qemu_file_get_ioc(f)),
+                               TYPE_QIO_CHANNEL_RDMA);
+}
+
+bool rdma_multifd_channel(QIOChannel *ioc)
+{
+    QIOChannelRDMA *rioc;
+
+    if (!object_dynamic_cast(OBJECT(ioc), TYPE_QIO_CHANNEL_RDMA)) {
+        return false;
+    }
+    rioc = QIO_CHANNEL_RDMA(ioc);
+    return rioc->rdmaout && rioc->rdmaout->multifd_parent;
+}
+
+static RDMAContext *qemu_rdma_multifd_connect(RDMAContext *parent,
+                                              Error **errp)
+{
+    RDMAContext *rdma;
+    int ret, idx;
+
+    trace_qemu_rdma_multifd_connect(parent->host, parent->port);
+
+    rdma = g_new0(RDMAContext, 1);
+    rdma->current_index = -1;
+    rdma->current_chunk = -1;
+    rdma->host = g_strdup(parent->host);
+    rdma->port = parent->port;
+    rdma->multifd_parent = parent;
+    rdma->pin_all = true;
+
+    ret = qemu_rdma_resolve_host(rdma, errp);
+    if (ret) {
+        goto err;
+    }
+
+    if (rdma->verbs != parent->verbs) {
+        error_setg(errp, "rdma multifd: channel resolved to a different "
+                   "device than the main connection");
+        goto err;
+    }
+
+    ret = qemu_rdma_alloc_pd_cq(rdma);
+    if (ret) {
+        error_setg(errp, "rdma multifd: error allocating cq!");
+        goto err;
+    }
+
+    ret = qemu_rdma_alloc_qp(rdma);
+    if (ret) {
+        error_setg(errp, "rdma multifd: error allocating qp!");
+        goto err;
+    }
+
+    for (idx = 0; idx < RDMA_WRID_MAX; idx++) {
+        ret = qemu_rdma_reg_control(rdma, idx);
+        if (ret) {
+            error_setg(errp, "rdma multifd: error registering %d control!",
+                       idx);
+            goto err;
+        }
+    }
+
+    /* qemu_rdma_connect() cleans up on failure */
+    ret = qemu_rdma_connect(rdma, errp);
+    if (ret) {
+        g_free(rdma);
+        return NULL;
+    }
+
+    if (!rdma->pin_all) {
+        goto err;
+    }
+    return rdma;
+
+err:
+    qemu_rdma_cleanup(rdma);
+    g_free(rdma);
+    return NULL;
+}
+
+static void rdma_send_channel_worker(QIOTask *task, gpointer opaque)
+{
+    QIOChannelRDMA *rioc = QIO_CHANNEL_RDMA(qio_task_get_source(task));
+    RDMAContext *parent = opaque;
+    Error *err = NULL;
+
+    rioc->rdmaout = qemu_rdma_multifd_connect(parent, &err);
+    if (!rioc->rdmaout) {
+        qio_task_set_error(task, err);
+    }
+}
+
+void rdma_send_channel_create(QIOTaskFunc f, void *data)
+{
+    MigrationState *s = migrate_get_current();
+    QIOChannelRDMA *main_ioc = QIO_CHANNEL_RDMA(
+        qemu_file_get_ioc(s->to_dst_file));
+    QIOChannelRDMA *rioc;
+    QIOTask *task;
+
+    rioc = QIO_CHANNEL_RDMA(object_new(TYPE_QIO_CHANNEL_RDMA));
+    qio_channel_set_name(QIO_CHANNEL(rioc), "migration-rdma-multifd-outgoing");
+
+    task = qio_task_new(OBJECT(rioc), f, data, NULL);
+    qio_task_run_in_thread(task, rdma_send_channel_worker,
+                           main_ioc->rdmaout, NULL, NULL);
+}
+
+int rdma_multifd_write_pages(QIOChannel *ioc, RAMBlock *rb,
+                             const struct iovec *iov, uint32_t niov,
+                             Error **errp)
+{
+    QIOChannelRDMA *rioc = QIO_CHANNEL_RDMA(ioc);
+    RDMAContext *rdma;
+    RDMALocalBlock *block;
+    struct ibv_sge sge;
+    struct ibv_send_wr send_wr = { 0 };
+    struct ibv_send_wr *bad_wr;
+    uint32_t i = 0, j;
+    int ret, posted, writes = 0;
+
+    RCU_READ_LOCK_GUARD();
+    rdma = qatomic_rcu_read(&rioc->rdmaout);
+    if (!rdma) {
+        error_setg(errp, "rdma multifd: channel is closed");
+        return -1;
+    }
+
+    if (rdma->error_state) {
+        error_setg(errp, "rdma multifd: channel in error state %d",
+                   rdma->error_state);
+        return -1;
+    }
+
+    block = g_hash_table_lookup(rdma->multifd_parent->blockmap,
+                                (void *)(uintptr_t)qemu_ram_get_offset(rb));
+    if (!block || !block->mr) {
+        error_setg(errp, "rdma multifd: ram block %s is not registered",
+                   qemu_ram_get_idstr(rb));
+        return -1;
+    }
+
+    send_wr.opcode = IBV_WR_RDMA_WRITE;
+    send_wr.sg_list = &sge;
+    send_wr.num_sge = 1;
+    send_wr.wr.rdma.rkey = block->remote_rkey;
+
+    while (i < niov) {
+        for (posted = 0; i < niov && posted < RDMA_MULTIFD_WRITE_BATCH;
+             posted++) {
+            uint8_t *start = iov[i].iov_base;
+            size_t len = iov[i].iov_len;
+
+            /* Merge pages that are contiguous in the ram block */
+            for (j = i + 1; j < niov && iov[j].iov_base == start + len; j++) {
+                len += iov[j].iov_len;
+            }
+            i = j;
+
+            sge.addr = (uintptr_t)start;
+            sge.length = len;
+            sge.lkey = block->mr->lkey;
+            send_wr.wr.rdma.remote_addr = block->remote_host_addr +
+                                          (start - block->local_host_addr);
+
+            /* Only the last write of a batch generates a completion */
+            if (i == niov || posted + 1 == RDMA_MULTIFD_WRITE_BATCH) {
+                send_wr.wr_id = RDMA_WRID_MULTIFD_WRITE;
+                send_wr.send_flags = IBV_SEND_SIGNALED;
+            } else {
+                send_wr.wr_id = RDMA_WRID_NONE;
+                send_wr.send_flags = 0;
+            }
+
+            /*
+             * ibv_post_send() does not return negative error numbers,
+             * per the specification they are positive - no idea why.
+             */
+            ret = ibv_post_send(rdma->qp, &send_wr, &bad_wr);
+            if (ret) {
+                error_setg_errno(errp, ret, "rdma multifd: post rdma write "
+                                 "failed");
+                rdma->error_state = -ret;
+                return -1;
+            }
+            rdma->total_writes++;
+            writes++;
+        }
+
+        ret = qemu_rdma_block_for_wrid(rdma, RDMA_WRID_MULTIFD_WRITE, NULL);
+        if (ret < 0) {
+            error_setg(errp, "rdma multifd: rdma write failed %d", ret);
+            return -1;
+        }
+    }
+
+    trace_qemu_rdma_multifd_write_pages(qemu_ram_get_idstr(rb), niov, writes);
+    return 0;
+}
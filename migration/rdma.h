@@ -17,9 +17,42 @@
 #ifndef QEMU_MIGRATION_RDMA_H
 #define QEMU_MIGRATION_RDMA_H
 
+#include "io/task.h"
+
 void rdma_start_outgoing_migration(void *opaque, const char *host_port,
                                    Error **errp);
 
 void rdma_start_incoming_migration(const char *host_port, Error **errp);
 
+#ifdef CONFIG_RDMA
+bool rdma_is_migration_file(QEMUFile *f);
+bool rdma_multifd_channel(QIOChannel *ioc);
+void rdma_send_channel_create(QIOTaskFunc f, void *data);
+int rdma_multifd_write_pages(QIOChannel *ioc, RAMBlock *rb,
+                             const struct iovec *iov, uint32_t niov,
+                             Error **errp);
+#else
+static inline bool rdma_is_migration_file(QEMUFile *f)
+{
+    return false;
+}
+
+static inline bool rdma_multifd_channel(QIOChannel *ioc)
+{
+    return false;
+}
+
+static inline void rdma_send_channel_create(QIOTaskFunc f, void *data)
+{
+    g_assert_not_reached();
+}
+
+static inline int rdma_multifd_write_pages(QIOChannel *ioc, RAMBlock *rb,
+                                           const struct iovec *iov,
+                                           uint32_t niov, Error **errp)
+{
+    g_assert_not_reached();
+}
+#endif
+
 #endif
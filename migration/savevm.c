@@ -248,6 +248,15 @@ typedef struct SaveStateEntry {
     void *opaque;
     CompatEntry *compat;
     int is_ram;
+    /* Time (us) spent on the state while the guest was stopped, or -1 */
+    int64_t save_time;
+    int64_t load_time;
+    /*
+     * Size and save time (us) of the latest non-iterable state, kept
+     * across migrations to predict the cost of the next switchover.
+     */
+    int64_t cost_size;
+    int64_t cost_time;
 } SaveStateEntry;
 
 typedef struct SaveState {
@@ -952,6 +961,7 @@ static void save_section_header(QEMUFile *f, SaveStateEntry *se,
     qemu_put_be32(f, se->section_id);
 
     if (section_type == QEMU_VM_SECTION_FULL ||
+        section_type == QEMU_VM_SECTION_FULL_SIZED ||
         section_type == QEMU_VM_SECTION_START) {
         /* ID string */
         size_t len = strlen(se->idstr);
@@ -975,6 +985,238 @@ static void save_section_footer(QEMUFile *f, SaveStateEntry *se)
     }
 }
 
+/*
+ * Estimate the cost of saving the non-iterable device state at the next
+ * switchover from the latest time it was saved: @size in bytes and @time
+ * in microseconds.  Devices that were never saved count as free.
+ */
+void qemu_savevm_state_switchover_cost(uint64_t *size, int64_t *time)
+{
+    SaveStateEntry *se;
+
+    *size = 0;
+    *time = 0;
+    QTAILQ_FOREACH(se, &savevm_state.handlers, entry) {
+        *size += se->cost_size;
+        *time += se->cost_time;
+    }
+}
+
+/* Record the time spent on @se since @start */
+static void savevm_record_downtime(SaveStateEntry *se, bool load,
+                                   int64_t start)
+{
+    int64_t time = qemu_clock_get_us(QEMU_CLOCK_REALTIME) - start;
+
+    if (load) {
+        se->load_time = time;
+        trace_vmstate_downtime_load(se->idstr, se->instance_id, time);
+    } else {
+        se->save_time = time;
+        trace_vmstate_downtime_save(se->idstr, se->instance_id, time);
+    }
+}
+
+static void savevm_record_cost(SaveStateEntry *se, int64_t size)
+{
+    se->cost_size = size;
+    se->cost_time = se->save_time;
+}
+
+/*
+ * Parallel device state
+ *
+ * With the parallel-device-state capability, the sections of the devices
+ * whose VMStateDescription is marked parallel are saved into, and loaded
+ * from, separate buffers by worker threads, while the migration thread
+ * holds the BQL on their behalf.  Consecutive parallel sections of the
+ * same priority form a group, and a group is always completed before any
+ * other section is handled, so the relative order of dependent devices
+ * is kept.  On the wire such sections are QEMU_VM_SECTION_FULL_SIZED:
+ * the usual full section header, followed by the size of the data.
+ */
+#define VMSTATE_PARALLEL_MAX_THREADS 16
+
+typedef struct VMStateTask {
+    SaveStateEntry *se;
+    QIOChannelBuffer *bioc;
+    QEMUFile *f;
+    /* vmdesc entry of the device, built by the worker on save */
+    JSONWriter *vmdesc;
+    /* post_load hooks, run by the migration thread after a load */
+    GArray *post_load;
+    int ret;
+} VMStateTask;
+
+typedef struct VMStateTaskGroup {
+    bool load;
+    MigrationPriority priority;
+    GArray *tasks;
+    int next_task;
+} VMStateTaskGroup;
+
+static bool vmstate_can_run_parallel(SaveStateEntry *se)
+{
+    return se->vmsd && se->vmsd->parallel && migrate_parallel_device_state();
+}
+
+static void vmstate_task_group_init(VMStateTaskGroup *group, bool load)
+{
+    group->load = load;
+    group->tasks = g_array_new(false, true, sizeof(VMStateTask));
+}
+
+/* Drop the tasks of a load group that will not be run */
+static void vmstate_task_group_discard(VMStateTaskGroup *group)
+{
+    int i;
+
+    for (i = 0; i < group->tasks->len; i++) {
+        object_unref(OBJECT(g_array_index(group->tasks, VMStateTask, i).bioc));
+    }
+    g_array_set_size(group->tasks, 0);
+}
+
+static void vmstate_task_group_destroy(VMStateTaskGroup *group)
+{
+    g_array_free(group->tasks, true);
+}
+
+static void vmstate_task_run(VMStateTaskGroup *group, VMStateTask *task)
+{
+    SaveStateEntry *se = task->se;
+    int64_t start = qemu_clock_get_us(QEMU_CLOCK_REALTIME);
+
+    if (group->load) {
+        task->f = qemu_fopen_channel_input(QIO_CHANNEL(task->bioc));
+        task->post_load = vmstate_defer_post_load_begin();
+        task->ret = vmstate_load(task->f, se);
+        vmstate_defer_post_load_end();
+        savevm_record_downtime(se, true, start);
+        qemu_fclose(task->f);
+        task->f = NULL;
+        return;
+    }
+
+    task->bioc = qio_channel_buffer_new(4096);
+    qio_channel_set_name(QIO_CHANNEL(task->bioc), "migration-vmstate-buffer");
+    task->f = qemu_fopen_channel_output(QIO_CHANNEL(task->bioc));
+    task->vmdesc = json_writer_new(false);
+    json_writer_start_object(task->vmdesc, NULL);
+    json_writer_str(task->vmdesc, "name", se->idstr);
+    json_writer_int64(task->vmdesc, "instance_id", se->instance_id);
+    task->ret = vmstate_save(task->f, se, task->vmdesc);
+    savevm_record_downtime(se, false, start);
+    json_writer_end_object(task->vmdesc);
+    qemu_fflush(task->f);
+    savevm_record_cost(se, task->bioc->usage);
+    if (!task->ret) {
+        task->ret = qemu_file_get_error(task->f);
+    }
+}
+
+static void vmstate_task_group_work(VMStateTaskGroup *group)
+{
+    int i;
+
+    while ((i = qatomic_fetch_inc(&group->next_task)) < group->tasks->len) {
+        vmstate_task_run(group, &g_array_index(group->tasks, VMStateTask, i));
+    }
+}
+
+static void *vmstate_task_thread(void *opaque)
+{
+    rcu_register_thread();
+    vmstate_task_group_work(opaque);
+    rcu_unregister_thread();
+    return NULL;
+}
+
+/*
+ * Run all the tasks of @group, on the calling thread and on up to
+ * VMSTATE_PARALLEL_MAX_THREADS - 1 worker threads.
+ */
+static void vmstate_task_group_run(VMStateTaskGroup *group)
+{
+    int nthreads = MIN(group->tasks->len, VMSTATE_PARALLEL_MAX_THREADS) - 1;
+    g_autofree QemuThread *threads = g_new0(QemuThread, MAX(nthreads, 1));
+    int i;
+
+    trace_vmstate_task_group_run(group->load, group->tasks->len, nthreads);
+    group->next_task = 0;
+    for (i = 0; i < nthreads; i++) {
+        qemu_thread_create(&threads[i], "vmstate-worker", vmstate_task_thread,
+                           group, QEMU_THREAD_JOINABLE);
+    }
+    vmstate_task_group_work(group);
+    for (i = 0; i < nthreads; i++) {
+        qemu_thread_join(&threads[i]);
+    }
+}
+
+/*
+ * Save the pending group of parallel sections, then write them to @f
+ * in the order they were queued.
+ *
+ * Returns 0 for success or negative for error
+ */
+static int vmstate_save_flush_group(QEMUFile *f, VMStateTaskGroup *group,
+                                    JSONWriter *vmdesc)
+{
+    int ret = 0;
+    int i;
+
+    if (!group->tasks->len) {
+        return 0;
+    }
+
+    vmstate_task_group_run(group);
+
+    for (i = 0; i < group->tasks->len; i++) {
+        VMStateTask *task = &g_array_index(group->tasks, VMStateTask, i);
+        SaveStateEntry *se = task->se;
+
+        if (!ret && task->ret) {
+            ret = task->ret;
+        }
+        if (!ret) {
+            json_writer_raw(vmdesc, NULL, json_writer_get(task->vmdesc));
+            save_section_header(f, se, QEMU_VM_SECTION_FULL_SIZED);
+            qemu_put_be32(f, task->bioc->usage);
+            qemu_put_buffer(f, task->bioc->data, task->bioc->usage);
+            trace_savevm_section_end(se->idstr, se->section_id, 0);
+            save_section_footer(f, se);
+        }
+        qemu_fclose(task->f);
+        object_unref(OBJECT(task->bioc));
+        json_writer_free(task->vmdesc);
+    }
+    g_array_set_size(group->tasks, 0);
+
+    return ret;
+}
+
+/*
+ * Queue the state of @se for saving in parallel, completing the pending
+ * group before if it holds another priority.
+ */
+static int vmstate_save_queue(QEMUFile *f, VMStateTaskGroup *group,
+                              JSONWriter *vmdesc, SaveStateEntry *se)
+{
+    VMStateTask task = { .se = se };
+    int ret;
+
+    if (group->tasks->len && group->priority != save_state_priority(se)) {
+        ret = vmstate_save_flush_group(f, group, vmdesc);
+        if (ret) {
+            return ret;
+        }
+    }
+    group->priority = save_state_priority(se);
+    g_array_append_val(group->tasks, task);
+    return 0;
+}
+
 /**
  * qemu_savevm_command_send: Send a 'QEMU_VM_COMMAND' type element with the
  *                           command and associated data.
@@ -1169,6 +1411,32 @@ void qemu_savevm_non_migratable_list(strList **reasons)
     }
 }
 
+/*
+ * List the time spent saving, or loading, each device during the downtime
+ * of the latest migration.
+ */
+DowntimeDeviceStatsList *qemu_savevm_downtime_devices(bool load)
+{
+    DowntimeDeviceStatsList *head = NULL, **tail = &head;
+    SaveStateEntry *se;
+
+    QTAILQ_FOREACH(se, &savevm_state.handlers, entry) {
+        int64_t time = load ? se->load_time : se->save_time;
+        DowntimeDeviceStats *stats;
+
+        if (time < 0) {
+            continue;
+        }
+        stats = g_new0(DowntimeDeviceStats, 1);
+        stats->name = g_strdup(se->idstr);
+        stats->instance_id = se->instance_id;
+        stats->time = time;
+        QAPI_LIST_APPEND(tail, stats);
+    }
+
+    return head;
+}
+
 void qemu_savevm_state_header(QEMUFile *f)
 {
     trace_savevm_state_header();
@@ -1202,6 +1470,9 @@ void qemu_savevm_state_setup(QEMUFile *f)
     int ret;
 
     trace_savevm_state_setup();
+    QTAILQ_FOREACH(se, &savevm_state.handlers, entry) {
+        se->save_time = -1;
+    }
     QTAILQ_FOREACH(se, &savevm_state.handlers, entry) {
         if (!se->ops || !se->ops->save_setup) {
             continue;
@@ -1361,6 +1632,9 @@ void qemu_savevm_state_complete_postcopy(QEMUFile *f)
 static
 int qemu_savevm_state_complete_precopy_iterable(QEMUFile *f, bool in_postcopy)
 {
+    MigrationState *ms = migrate_get_current();
+    int64_t start = qemu_clock_get_us(QEMU_CLOCK_REALTIME);
+    int64_t se_start;
     SaveStateEntry *se;
     int ret;
 
@@ -1381,7 +1655,9 @@ int qemu_savevm_state_complete_precopy_iterable(QEMUFile *f, bool in_postcopy)
 
         save_section_header(f, se, QEMU_VM_SECTION_END);
 
+        se_start = qemu_clock_get_us(QEMU_CLOCK_REALTIME);
         ret = se->ops->save_live_complete_precopy(f, se->opaque);
+        savevm_record_downtime(se, false, se_start);
         trace_savevm_section_end(se->idstr, se->section_id, ret);
         save_section_footer(f, se);
         if (ret < 0) {
@@ -1390,6 +1666,7 @@ int qemu_savevm_state_complete_precopy_iterable(QEMUFile *f, bool in_postcopy)
         }
     }
 
+    ms->downtime_ram_flush = qemu_clock_get_us(QEMU_CLOCK_REALTIME) - start;
     return 0;
 }
 
@@ -1397,11 +1674,16 @@ int qemu_savevm_state_complete_precopy_non_iterable(QEMUFile *f,
                                                     bool in_postcopy,
                                                     bool inactivate_disks)
 {
+    MigrationState *ms = migrate_get_current();
+    int64_t start = qemu_clock_get_us(QEMU_CLOCK_REALTIME);
+    int64_t se_start, se_pos;
     g_autoptr(JSONWriter) vmdesc = NULL;
+    VMStateTaskGroup group;
     int vmdesc_len;
     SaveStateEntry *se;
     int ret;
 
+    vmstate_task_group_init(&group, false);
     vmdesc = json_writer_new(false);
     json_writer_start_object(vmdesc, NULL);
     json_writer_int64(vmdesc, "page_size", qemu_target_page_size());
@@ -1418,13 +1700,32 @@ int qemu_savevm_state_complete_precopy_non_iterable(QEMUFile *f,
 
         trace_savevm_section_start(se->idstr, se->section_id);
 
+        if (vmstate_can_run_parallel(se)) {
+            ret = vmstate_save_queue(f, &group, vmdesc, se);
+        } else {
+            ret = vmstate_save_flush_group(f, &group, vmdesc);
+        }
+        if (ret) {
+            vmstate_task_group_destroy(&group);
+            qemu_file_set_error(f, ret);
+            return ret;
+        }
+        if (vmstate_can_run_parallel(se)) {
+            continue;
+        }
+
         json_writer_start_object(vmdesc, NULL);
         json_writer_str(vmdesc, "name", se->idstr);
         json_writer_int64(vmdesc, "instance_id", se->instance_id);
 
         save_section_header(f, se, QEMU_VM_SECTION_FULL);
+        se_start = qemu_clock_get_us(QEMU_CLOCK_REALTIME);
+        se_pos = qemu_ftell_fast(f);
         ret = vmstate_save(f, se, vmdesc);
+        savevm_record_downtime(se, false, se_start);
+        savevm_record_cost(se, qemu_ftell_fast(f) - se_pos);
         if (ret) {
+            vmstate_task_group_destroy(&group);
             qemu_file_set_error(f, ret);
             return ret;
         }
@@ -1434,6 +1735,14 @@ int qemu_savevm_state_complete_precopy_non_iterable(QEMUFile *f,
         json_writer_end_object(vmdesc);
     }
 
+    ret = vmstate_save_flush_group(f, &group, vmdesc);
+    vmstate_task_group_destroy(&group);
+    if (ret) {
+        qemu_file_set_error(f, ret);
+        return ret;
+    }
+    ms->downtime_device_state = qemu_clock_get_us(QEMU_CLOCK_REALTIME) - start;
+
     if (inactivate_disks) {
         /* Inactivate before sending QEMU_VM_EOF so that the
          * bdrv_invalidate_cache_all() on the other end won't fail. */
@@ -2378,8 +2687,12 @@ static bool check_section_footer(QEMUFile *f, SaveStateEntry *se)
     return true;
 }
 
-static int
-qemu_loadvm_section_start_full(QEMUFile *f, MigrationIncomingState *mis)
+/*
+ * Read the header of a full or start section and find its SaveStateEntry
+ *
+ * Returns 0 for success or negative for error
+ */
+static int qemu_loadvm_section_lookup(QEMUFile *f, SaveStateEntry **sep)
 {
     uint32_t instance_id, version_id, section_id;
     SaveStateEntry *se;
@@ -2430,10 +2743,32 @@ qemu_loadvm_section_start_full(QEMUFile *f, MigrationIncomingState *mis)
         return -EINVAL;
     }
 
+    *sep = se;
+    return 0;
+}
+
+static int
+qemu_loadvm_section_start_full(QEMUFile *f, MigrationIncomingState *mis,
+                               uint8_t type)
+{
+    SaveStateEntry *se;
+    int64_t start;
+    int ret;
+
+    ret = qemu_loadvm_section_lookup(f, &se);
+    if (ret < 0) {
+        return ret;
+    }
+
+    start = qemu_clock_get_us(QEMU_CLOCK_REALTIME);
     ret = vmstate_load(f, se);
+    if (type == QEMU_VM_SECTION_FULL) {
+        savevm_record_downtime(se, true, start);
+        mis->downtime_device_state += se->load_time;
+    }
     if (ret < 0) {
         error_report("error while loading state for instance 0x%"PRIx32" of"
-                     " device '%s'", instance_id, idstr);
+                     " device '%s'", se->instance_id, se->idstr);
         return ret;
     }
     if (!check_section_footer(f, se)) {
@@ -2443,6 +2778,124 @@ qemu_loadvm_section_start_full(QEMUFile *f, MigrationIncomingState *mis)
     return 0;
 }
 
+/*
+ * Run the post_load hooks of a loaded task.  They may use the memory API
+ * or other devices, so unlike the rest of the load they must run with
+ * the BQL held, i.e. on the migration thread.
+ */
+static void vmstate_task_post_load(VMStateTask *task)
+{
+    if (task->ret < 0) {
+        g_array_free(task->post_load, true);
+    } else {
+        task->ret = vmstate_run_post_load(task->post_load);
+    }
+    task->post_load = NULL;
+}
+
+/*
+ * Load the pending group of parallel sections
+ *
+ * Returns 0 for success or negative for error
+ */
+static int vmstate_load_flush_group(VMStateTaskGroup *group)
+{
+    MigrationIncomingState *mis = migration_incoming_get_current();
+    int64_t start;
+    int ret = 0;
+    int i;
+
+    if (!group->tasks->len) {
+        return 0;
+    }
+
+    start = qemu_clock_get_us(QEMU_CLOCK_REALTIME);
+    vmstate_task_group_run(group);
+    mis->downtime_device_state += qemu_clock_get_us(QEMU_CLOCK_REALTIME) -
+                                  start;
+
+    for (i = 0; i < group->tasks->len; i++) {
+        VMStateTask *task = &g_array_index(group->tasks, VMStateTask, i);
+
+        vmstate_task_post_load(task);
+        if (task->ret < 0 && !ret) {
+            error_report("error while loading state for instance 0x%"PRIx32
+                         " of device '%s'", task->se->instance_id,
+                         task->se->idstr);
+            ret = task->ret;
+        }
+        object_unref(OBJECT(task->bioc));
+    }
+    g_array_set_size(group->tasks, 0);
+
+    return ret;
+}
+
+/*
+ * Read a section written by a parallel save.  Its data is loaded at once
+ * unless the device can be loaded in parallel too, in which case it is
+ * only queued in @group.
+ *
+ * Returns 0 for success or negative for error
+ */
+static int
+qemu_loadvm_section_full_sized(QEMUFile *f, VMStateTaskGroup *group)
+{
+    VMStateTask task = { 0 };
+    SaveStateEntry *se;
+    uint32_t length;
+    int ret;
+
+    ret = qemu_loadvm_section_lookup(f, &se);
+    if (ret < 0) {
+        return ret;
+    }
+
+    length = qemu_get_be32(f);
+    trace_qemu_loadvm_state_section_full_sized(se->idstr, length);
+    task.se = se;
+    task.bioc = qio_channel_buffer_new(length);
+    qio_channel_set_name(QIO_CHANNEL(task.bioc), "migration-vmstate-buffer");
+    if (qemu_get_buffer(f, task.bioc->data, length) != length) {
+        object_unref(OBJECT(task.bioc));
+        error_report("Failed to read the state of device '%s'", se->idstr);
+        return -EIO;
+    }
+    task.bioc->usage = length;
+    if (!check_section_footer(f, se)) {
+        object_unref(OBJECT(task.bioc));
+        return -EINVAL;
+    }
+
+    if (vmstate_can_run_parallel(se) &&
+        (!group->tasks->len || group->priority == save_state_priority(se))) {
+        group->priority = save_state_priority(se);
+        g_array_append_val(group->tasks, task);
+        return 0;
+    }
+
+    ret = vmstate_load_flush_group(group);
+    if (ret < 0) {
+        object_unref(OBJECT(task.bioc));
+        return ret;
+    }
+    if (vmstate_can_run_parallel(se)) {
+        group->priority = save_state_priority(se);
+        g_array_append_val(group->tasks, task);
+        return 0;
+    }
+
+    vmstate_task_run(group, &task);
+    vmstate_task_post_load(&task);
+    migration_incoming_get_current()->downtime_device_state += se->load_time;
+    object_unref(OBJECT(task.bioc));
+    if (task.ret < 0) {
+        error_report("error while loading state for instance 0x%"PRIx32" of"
+                     " device '%s'", se->instance_id, se->idstr);
+    }
+    return task.ret;
+}
+
 static int
 qemu_loadvm_section_part_end(QEMUFile *f, MigrationIncomingState *mis)
 {
@@ -2600,9 +3053,12 @@ static bool postcopy_pause_incoming(MigrationIncomingState *mis)
 
 int qemu_loadvm_state_main(QEMUFile *f, MigrationIncomingState *mis)
 {
+    VMStateTaskGroup group;
     uint8_t section_type;
     int ret = 0;
 
+    vmstate_task_group_init(&group, true);
+
 retry:
     while (true) {
         section_type = qemu_get_byte(f);
@@ -2613,10 +3069,23 @@ retry:
         }
 
         trace_qemu_loadvm_state_section(section_type);
+        if (section_type != QEMU_VM_SECTION_FULL_SIZED) {
+            /* Parallel sections are done before anything that follows */
+            ret = vmstate_load_flush_group(&group);
+            if (ret < 0) {
+                goto out;
+            }
+        }
         switch (section_type) {
         case QEMU_VM_SECTION_START:
         case QEMU_VM_SECTION_FULL:
-            ret = qemu_loadvm_section_start_full(f, mis);
+            ret = qemu_loadvm_section_start_full(f, mis, section_type);
+            if (ret < 0) {
+                goto out;
+            }
+            break;
+        case QEMU_VM_SECTION_FULL_SIZED:
+            ret = qemu_loadvm_section_full_sized(f, &group);
             if (ret < 0) {
                 goto out;
             }
@@ -2646,6 +3115,7 @@ retry:
     }
 
 out:
+    vmstate_task_group_discard(&group);
     if (ret < 0) {
         qemu_file_set_error(f, ret);
 
@@ -2670,6 +3140,7 @@ out:
             goto retry;
         }
     }
+    vmstate_task_group_destroy(&group);
     return ret;
 }
 
@@ -2677,6 +3148,7 @@ int qemu_loadvm_state(QEMUFile *f)
 {
     MigrationIncomingState *mis = migration_incoming_get_current();
     Error *local_err = NULL;
+    SaveStateEntry *se;
     int ret;
 
     if (qemu_savevm_state_blocked(&local_err)) {
@@ -2684,6 +3156,11 @@ int qemu_loadvm_state(QEMUFile *f)
         return -EINVAL;
     }
 
+    QTAILQ_FOREACH(se, &savevm_state.handlers, entry) {
+        se->load_time = -1;
+    }
+    mis->downtime_device_state = 0;
+
     ret = qemu_loadvm_state_header(f);
     if (ret) {
         return ret;
@@ -25,6 +25,52 @@ static int vmstate_subsection_save(QEMUFile *f, const VMStateDescription *vmsd,
 static int vmstate_subsection_load(QEMUFile *f, const VMStateDescription *vmsd,
                                    void *opaque);
 
+typedef struct VMStatePostLoad {
+    const VMStateDescription *vmsd;
+    void *opaque;
+    int version_id;
+} VMStatePostLoad;
+
+/* post_load hooks queued by vmstate_load_state() on this thread, if any */
+static __thread GArray *deferred_post_load;
+
+/*
+ * Queue the post_load hooks that vmstate_load_state() would run on the
+ * calling thread, until vmstate_defer_post_load_end().  They are run in
+ * the same order, nested states first, by vmstate_run_post_load().
+ */
+GArray *vmstate_defer_post_load_begin(void)
+{
+    assert(!deferred_post_load);
+    deferred_post_load = g_array_new(false, false, sizeof(VMStatePostLoad));
+    return deferred_post_load;
+}
+
+void vmstate_defer_post_load_end(void)
+{
+    deferred_post_load = NULL;
+}
+
+/*
+ * Run and free the hooks queued in @list.  Stops at the first failure.
+ *
+ * Returns 0 for success or negative for error
+ */
+int vmstate_run_post_load(GArray *list)
+{
+    int ret = 0;
+    guint i;
+
+    for (i = 0; i < list->len && !ret; i++) {
+        VMStatePostLoad *pl = &g_array_index(list, VMStatePostLoad, i);
+
+        ret = pl->vmsd->post_load(pl->opaque, pl->version_id);
+        trace_vmstate_load_state_end(pl->vmsd->name, "deferred", ret);
+    }
+    g_array_free(list, true);
+    return ret;
+}
+
 static int vmstate_n_elems(void *opaque, const VMStateField *field)
 {
     int n_elems = 1;
@@ -164,7 +210,11 @@ int vmstate_load_state(QEMUFile *f, const VMStateDescription *vmsd,
     if (ret != 0) {
         return ret;
     }
-    if (vmsd->post_load) {
+    if (vmsd->post_load && deferred_post_load) {
+        VMStatePostLoad pl = { vmsd, opaque, version_id };
+
+        g_array_append_val(deferred_post_load, pl);
+    } else if (vmsd->post_load) {
         ret = vmsd->post_load(opaque, version_id);
     }
     trace_vmstate_load_state_end(vmsd->name, "end", ret);
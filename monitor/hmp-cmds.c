@@ -339,6 +339,16 @@ void hmp_info_migrate(Monitor *mon, const QDict *qdict)
                        info->cpu_throttle_percentage);
     }
 
+    if (info->has_dirty_limit_throttle_time_per_round) {
+        monitor_printf(mon, "dirty-limit throttle time: %" PRIu64 " us\n",
+                       info->dirty_limit_throttle_time_per_round);
+    }
+
+    if (info->has_dirty_limit_ring_full_time) {
+        monitor_printf(mon, "dirty-limit ring full time: %" PRIu64 " us\n",
+                       info->dirty_limit_ring_full_time);
+    }
+
     if (info->has_postcopy_blocktime) {
         monitor_printf(mon, "postcopy blocktime: %u\n",
                        info->postcopy_blocktime);
@@ -355,6 +365,31 @@ void hmp_info_migrate(Monitor *mon, const QDict *qdict)
         g_free(str);
         visit_free(v);
     }
+    if (info->has_downtime_stats) {
+        DowntimeStats *stats = info->downtime_stats;
+        DowntimeDeviceStatsList *dev;
+
+        monitor_printf(mon, "downtime breakdown (us):");
+        if (stats->has_vm_stop) {
+            monitor_printf(mon, " vm-stop: %" PRId64, stats->vm_stop);
+        }
+        if (stats->has_bitmap_sync) {
+            monitor_printf(mon, " bitmap-sync: %" PRId64, stats->bitmap_sync);
+        }
+        if (stats->has_ram_flush) {
+            monitor_printf(mon, " ram-flush: %" PRId64, stats->ram_flush);
+        }
+        monitor_printf(mon, " device-state: %" PRId64, stats->device_state);
+        if (stats->has_switchover) {
+            monitor_printf(mon, " switchover: %" PRId64, stats->switchover);
+        }
+        monitor_printf(mon, "\n");
+        for (dev = stats->devices; dev; dev = dev->next) {
+            monitor_printf(mon, "  %s/%" PRIu32 ": %" PRId64 " us\n",
+                           dev->value->name, dev->value->instance_id,
+                           dev->value->time);
+        }
+    }
     if (info->has_socket_address) {
         SocketAddressList *addr;
 
@@ -371,6 +406,8 @@ void hmp_info_migrate(Monitor *mon, const QDict *qdict)
     if (info->has_vfio) {
         monitor_printf(mon, "vfio device transferred: %" PRIu64 " kbytes\n",
                        info->vfio->transferred >> 10);
+        monitor_printf(mon, "vfio dirty sync time: %" PRIu64 " ms\n",
+                       info->vfio->dirty_sync_time);
     }
 
     qapi_free_MigrationInfo(info);
@@ -487,6 +524,14 @@ void hmp_info_migrate_parameters(Monitor *mon, const QDict *qdict)
         monitor_printf(mon, "%s: '%s'\n",
             MigrationParameter_str(MIGRATION_PARAMETER_TLS_AUTHZ),
             params->tls_authz);
+        assert(params->has_vcpu_dirty_limit);
+        monitor_printf(mon, "%s: %" PRIu64 " MB/s\n",
+            MigrationParameter_str(MIGRATION_PARAMETER_VCPU_DIRTY_LIMIT),
+            params->vcpu_dirty_limit);
+        assert(params->has_postcopy_place_threads);
+        monitor_printf(mon, "%s: %u\n",
+            MigrationParameter_str(MIGRATION_PARAMETER_POSTCOPY_PLACE_THREADS),
+            params->postcopy_place_threads);
 
         if (params->has_block_bitmap_mapping) {
             const BitmapMigrationNodeAliasList *bmnal;
@@ -968,14 +1013,27 @@ void hmp_stop(Monitor *mon, const QDict *qdict)
 void hmp_sync_profile(Monitor *mon, const QDict *qdict)
 {
     const char *op = qdict_get_try_str(qdict, "op");
+    int64_t period = qdict_get_try_int(qdict, "period", 1);
 
     if (op == NULL) {
         bool on = qsp_is_enabled();
 
-        monitor_printf(mon, "sync-profile is %s\n", on ? "on" : "off");
+        monitor_printf(mon, "sync-profile is %s, sample period %u\n",
+                       on ? "on" : "off", qsp_get_sample_period());
         return;
     }
     if (!strcmp(op, "on")) {
+        if (period <= 0 || period > UINT_MAX) {
+            Error *err = NULL;
+
+            error_setg(&err, QERR_INVALID_PARAMETER_VALUE, "period",
+                       "a positive integer");
+            hmp_handle_error(mon, err);
+            return;
+        }
+        if (qdict_haskey(qdict, "period")) {
+            qsp_set_sample_period(period);
+        }
         qsp_enable();
     } else if (!strcmp(op, "off")) {
         qsp_disable();
@@ -1425,10 +1483,18 @@ void hmp_migrate_set_parameter(Monitor *mon, const QDict *qdict)
         p->has_announce_step = true;
         visit_type_size(v, param, &p->announce_step, &err);
         break;
+    case MIGRATION_PARAMETER_POSTCOPY_PLACE_THREADS:
+        p->has_postcopy_place_threads = true;
+        visit_type_uint8(v, param, &p->postcopy_place_threads, &err);
+        break;
     case MIGRATION_PARAMETER_BLOCK_BITMAP_MAPPING:
         error_setg(&err, "The block-bitmap-mapping parameter can only be set "
                    "through QMP");
         break;
+    case MIGRATION_PARAMETER_VCPU_DIRTY_LIMIT:
+        p->has_vcpu_dirty_limit = true;
+        visit_type_uint64(v, param, &p->vcpu_dirty_limit, &err);
+        break;
     default:
         assert(0);
     }
@@ -1936,6 +2002,16 @@ void hmp_info_iothreads(Monitor *mon, const QDict *qdict)
         monitor_printf(mon, "  poll-max-ns=%" PRId64 "\n", value->poll_max_ns);
         monitor_printf(mon, "  poll-grow=%" PRId64 "\n", value->poll_grow);
         monitor_printf(mon, "  poll-shrink=%" PRId64 "\n", value->poll_shrink);
+        monitor_printf(mon, "  coroutine-pool: size=%" PRId64
+                       " max-size=%" PRId64 " in-use=%" PRId64
+                       " hits=%" PRId64 " misses=%" PRId64 "\n",
+                       value->coroutine_pool->size,
+                       value->coroutine_pool->max_size,
+                       value->coroutine_pool->in_use,
+                       value->coroutine_pool->hits,
+                       value->coroutine_pool->misses);
+        monitor_printf(mon, "  notify-sent=%" PRId64 " notify-saved=%" PRId64
+                       "\n", value->notify_sent, value->notify_saved);
     }
 
     qapi_free_IOThreadInfoList(info_list);
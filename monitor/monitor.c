@@ -155,8 +155,6 @@ static inline bool monitor_is_hmp_non_interactive(const Monitor *mon)
     return !monitor_uses_readline(container_of(mon, MonitorHMP, common));
 }
 
-static void monitor_flush_locked(Monitor *mon);
-
 static gboolean monitor_unblocked(GIOChannel *chan, GIOCondition cond,
                                   void *opaque)
 {
@@ -170,7 +168,7 @@ static gboolean monitor_unblocked(GIOChannel *chan, GIOCondition cond,
 }
 
 /* Caller must hold mon->mon_lock */
-static void monitor_flush_locked(Monitor *mon)
+void monitor_flush_locked(Monitor *mon)
 {
     int rc;
     size_t len;
@@ -212,23 +210,20 @@ void monitor_flush(Monitor *mon)
 /* flush at every end of line */
 int monitor_puts(Monitor *mon, const char *str)
 {
-    int i;
-    char c;
+    const char *p = str;
+    const char *nl;
 
     qemu_mutex_lock(&mon->mon_lock);
-    for (i = 0; str[i]; i++) {
-        c = str[i];
-        if (c == '\n') {
-            g_string_append_c(mon->outbuf, '\r');
-        }
-        g_string_append_c(mon->outbuf, c);
-        if (c == '\n') {
-            monitor_flush_locked(mon);
-        }
+    while ((nl = strchr(p, '\n'))) {
+        g_string_append_len(mon->outbuf, p, nl - p);
+        g_string_append(mon->outbuf, "\r\n");
+        monitor_flush_locked(mon);
+        p = nl + 1;
     }
+    g_string_append(mon->outbuf, p);
     qemu_mutex_unlock(&mon->mon_lock);
 
-    return i;
+    return p - str + strlen(p);
 }
 
 int monitor_vprintf(Monitor *mon, const char *fmt, va_list ap)
@@ -40,6 +40,9 @@
 #include "qapi/qmp/qerror.h"
 #include "hw/mem/memory-device.h"
 #include "hw/acpi/acpi_dev_interface.h"
+#include "hw/core/cpu.h"
+#include "qemu/main-loop.h"
+#include "sysemu/iothread.h"
 
 NameInfo *qmp_query_name(Error **errp)
 {
@@ -334,3 +337,113 @@ MemoryInfo *qmp_query_memory_size_summary(Error **errp)
 
     return mem_info;
 }
+
+SyncProfileInfo *qmp_query_sync_profile(bool has_max, uint32_t max,
+                                        bool has_sort_by_average,
+                                        bool sort_by_average,
+                                        bool has_coalesce, bool coalesce,
+                                        Error **errp)
+{
+    SyncProfileInfo *info = g_new0(SyncProfileInfo, 1);
+    SyncProfileEntryList **tail = &info->entries;
+    QSPReportEntry *entries;
+    size_t n_entries, i;
+
+    entries = qsp_report_entries(has_max ? max : SIZE_MAX,
+                                 sort_by_average ? QSP_SORT_BY_AVG_WAIT_TIME :
+                                                   QSP_SORT_BY_TOTAL_WAIT_TIME,
+                                 !has_coalesce || coalesce, &n_entries);
+    for (i = 0; i < n_entries; i++) {
+        SyncProfileEntry *entry = g_new0(SyncProfileEntry, 1);
+
+        entry->type = g_strdup(entries[i].typename);
+        entry->call_site = g_strdup(entries[i].callsite_at);
+        entry->objects = MAX(entries[i].n_objs, 1);
+        entry->has_object = entry->objects == 1;
+        entry->object = (uintptr_t)entries[i].obj;
+        entry->wait_time_ns = entries[i].ns;
+        entry->count = entries[i].n_acqs;
+        QAPI_LIST_APPEND(tail, entry);
+    }
+    qsp_report_entries_free(entries, n_entries);
+
+    info->enabled = qsp_is_enabled();
+    info->sample_period = qsp_get_sample_period();
+    return info;
+}
+
+static EventLoopInfo *event_loop_info(EventLoopKind kind, char *id,
+                                      EventLoopStats *stats)
+{
+    EventLoopInfo *info = g_new0(EventLoopInfo, 1);
+    uint64List **tail = &info->dispatch_latency;
+    int i;
+
+    info->kind = kind;
+    info->id = id;
+    info->poll_ns = stat64_get(&stats->poll_ns);
+    info->blocked_ns = stat64_get(&stats->blocked_ns);
+    info->guest_ns = stat64_get(&stats->guest_ns);
+
+    info->dispatch_ns = g_new0(EventLoopDispatchInfo, 1);
+    info->dispatch_ns->fd =
+        stat64_get(&stats->dispatch_ns[EVENT_LOOP_DISPATCH_FD]);
+    info->dispatch_ns->bh =
+        stat64_get(&stats->dispatch_ns[EVENT_LOOP_DISPATCH_BH]);
+    info->dispatch_ns->timer =
+        stat64_get(&stats->dispatch_ns[EVENT_LOOP_DISPATCH_TIMER]);
+    info->dispatch_ns->kvm_exit =
+        stat64_get(&stats->dispatch_ns[EVENT_LOOP_DISPATCH_KVM_EXIT]);
+
+    for (i = 0; i < EVENT_LOOP_LATENCY_BUCKETS; i++) {
+        QAPI_LIST_APPEND(tail, stat64_get(&stats->latency[i]));
+    }
+    return info;
+}
+
+static int query_one_event_loop(Object *object, void *opaque)
+{
+    EventLoopInfoList ***tail = opaque;
+    IOThread *iothread;
+    EventLoopInfo *info;
+
+    iothread = (IOThread *)object_dynamic_cast(object, TYPE_IOTHREAD);
+    if (!iothread) {
+        return 0;
+    }
+
+    info = event_loop_info(EVENT_LOOP_KIND_IOTHREAD, iothread_get_id(iothread),
+                           &iothread_get_aio_context(iothread)->stats);
+    info->has_thread_id = true;
+    info->thread_id = iothread->thread_id;
+    QAPI_LIST_APPEND(*tail, info);
+    return 0;
+}
+
+EventLoopInfoList *qmp_query_event_loops(Error **errp)
+{
+    EventLoopInfoList *head = NULL;
+    EventLoopInfoList **tail = &head;
+    CPUState *cpu;
+
+    QAPI_LIST_APPEND(tail, event_loop_info(EVENT_LOOP_KIND_MAIN_LOOP,
+                                           g_strdup("main"),
+                                           main_loop_get_stats()));
+
+    object_child_foreach(object_get_objects_root(), query_one_event_loop,
+                         &tail);
+
+    if (kvm_enabled()) {
+        CPU_FOREACH(cpu) {
+            EventLoopInfo *info;
+
+            info = event_loop_info(EVENT_LOOP_KIND_VCPU,
+                                   g_strdup_printf("%d", cpu->cpu_index),
+                                   &cpu->kvm_stats);
+            info->has_thread_id = true;
+            info->thread_id = cpu->thread_id;
+            QAPI_LIST_APPEND(tail, info);
+        }
+    }
+    return head;
+}
@@ -111,6 +111,25 @@ void qmp_send_response(MonitorQMP *mon, const QDict *rsp)
     const QObject *data = QOBJECT(rsp);
     GString *json;
 
+    if (!mon->pretty) {
+        Monitor *common = &mon->common;
+        gsize start;
+
+        /*
+         * Without pretty-printing, the output has no newlines to
+         * translate, so serialize it straight into the output buffer
+         * instead of building a copy of a possibly large response.
+         */
+        qemu_mutex_lock(&common->mon_lock);
+        start = common->outbuf->len;
+        qobject_to_json_append(common->outbuf, data, false);
+        trace_monitor_qmp_respond(mon, common->outbuf->str + start);
+        g_string_append(common->outbuf, "\r\n");
+        monitor_flush_locked(common);
+        qemu_mutex_unlock(&common->mon_lock);
+        return;
+    }
+
     json = qobject_to_json_pretty(data, mon->pretty);
     assert(json != NULL);
     trace_monitor_qmp_respond(mon, json->str);
@@ -20,12 +20,18 @@
 #include "qemu/osdep.h"
 
 #include "block/export.h"
+#include "block/thread-pool.h"
 #include "qapi/error.h"
+#include "sysemu/iothread.h"
 #include "qemu/queue.h"
 #include "trace.h"
 #include "nbd-internal.h"
 #include "qemu/units.h"
 
+#ifdef CONFIG_LINUX
+#include <sys/sendfile.h>
+#endif
+
 #define NBD_META_ID_BASE_ALLOCATION 0
 #define NBD_META_ID_ALLOCATION_DEPTH 1
 /* Dirty bitmaps use 'NBD_META_ID_DIRTY_BITMAP + i', so keep this id last. */
@@ -39,6 +45,14 @@
  */
 #define NBD_MAX_BLOCK_STATUS_EXTENTS (1 * MiB / 8)
 
+/*
+ * NBD_MAX_BLOCK_STATUS_EXT_EXTENTS: 16 MiB of extents data.  With
+ * extended headers a single request can cover a whole export, so allow
+ * replies to describe many more extents, while staying below the 32 MiB
+ * recommended by the protocol.
+ */
+#define NBD_MAX_BLOCK_STATUS_EXT_EXTENTS (16 * MiB / sizeof(NBDExtent64))
+
 static int system_errno_to_nbd_errno(int err)
 {
     switch (err) {
@@ -99,6 +113,11 @@ struct NBDExport {
     bool allocation_depth;
     BdrvDirtyBitmap **export_bitmaps;
     size_t nr_export_bitmaps;
+
+    /* Iothreads that clients are spread over, if not served in common.ctx */
+    IOThread **iothreads;
+    size_t nr_iothreads;
+    size_t next_iothread;
 };
 
 static QTAILQ_HEAD(, NBDExport) exports = QTAILQ_HEAD_INITIALIZER(exports);
@@ -122,6 +141,7 @@ struct NBDClient {
     void (*close_fn)(NBDClient *client, bool negotiated);
 
     NBDExport *exp;
+    IOThread *iothread; /* NULL if served in exp->common.ctx */
     QCryptoTLSCreds *tlscreds;
     char *tlsauthz;
     QIOChannelSocket *sioc; /* The underlying data channel */
@@ -142,6 +162,7 @@ struct NBDClient {
     uint32_t check_align; /* If non-zero, check for aligned client requests */
 
     bool structured_reply;
+    bool extended_headers; /* implies structured_reply */
     NBDExportMetaContexts export_meta;
 
     uint32_t opt; /* Current option being negotiated */
@@ -151,6 +172,15 @@ struct NBDClient {
 
 static void nbd_client_receive_next_request(NBDClient *client);
 
+/* Return the AioContext in which @client's requests are processed */
+static AioContext *nbd_client_aio_context(NBDClient *client)
+{
+    if (client->iothread) {
+        return iothread_get_aio_context(client->iothread);
+    }
+    return client->exp->common.ctx;
+}
+
 /* Basic flow for negotiation
 
    Server         Client
@@ -1253,6 +1283,10 @@ static int nbd_negotiate_options(NBDClient *client, Error **errp)
             case NBD_OPT_STRUCTURED_REPLY:
                 if (length) {
                     ret = nbd_reject_length(client, false, errp);
+                } else if (client->extended_headers) {
+                    ret = nbd_negotiate_send_rep_err(
+                        client, NBD_REP_ERR_EXT_HEADER_REQD, errp,
+                        "extended headers already negotiated");
                 } else if (client->structured_reply) {
                     ret = nbd_negotiate_send_rep_err(
                         client, NBD_REP_ERR_INVALID, errp,
@@ -1263,6 +1297,20 @@ static int nbd_negotiate_options(NBDClient *client, Error **errp)
                 }
                 break;
 
+            case NBD_OPT_EXTENDED_HEADERS:
+                if (length) {
+                    ret = nbd_reject_length(client, false, errp);
+                } else if (client->extended_headers) {
+                    ret = nbd_negotiate_send_rep_err(
+                        client, NBD_REP_ERR_INVALID, errp,
+                        "extended headers already negotiated");
+                } else {
+                    ret = nbd_negotiate_send_rep(client, NBD_REP_ACK, errp);
+                    client->structured_reply = true;
+                    client->extended_headers = true;
+                }
+                break;
+
             case NBD_OPT_LIST_META_CONTEXT:
             case NBD_OPT_SET_META_CONTEXT:
                 ret = nbd_negotiate_meta_queries(client, &client->export_meta,
@@ -1344,9 +1392,21 @@ static coroutine_fn int nbd_negotiate(NBDClient *client, Error **errp)
         return ret;
     }
 
-    /* Attach the channel to the same AioContext as the export */
-    if (client->exp && client->exp->common.ctx) {
-        qio_channel_attach_aio_context(client->ioc, client->exp->common.ctx);
+    /*
+     * Attach the channel to the AioContext that serves the client: the
+     * export's own one, or the next iothread of the export's pool
+     */
+    if (client->exp && client->exp->nr_iothreads) {
+        NBDExport *exp = client->exp;
+
+        client->iothread = exp->iothreads[exp->next_iothread];
+        exp->next_iothread = (exp->next_iothread + 1) % exp->nr_iothreads;
+        trace_nbd_negotiate_assign_iothread(exp->name,
+                                            nbd_client_aio_context(client));
+    }
+    if (client->exp && nbd_client_aio_context(client)) {
+        qio_channel_attach_aio_context(client->ioc,
+                                       nbd_client_aio_context(client));
     }
 
     assert(!client->optlen);
@@ -1404,22 +1464,26 @@ nbd_read_eof(NBDClient *client, void *buffer, size_t size, Error **errp)
 static int nbd_receive_request(NBDClient *client, NBDRequest *request,
                                Error **errp)
 {
-    uint8_t buf[NBD_REQUEST_SIZE];
-    uint32_t magic;
+    uint8_t buf[NBD_EXTENDED_REQUEST_SIZE];
+    uint32_t magic, expected_magic;
     int ret;
 
-    ret = nbd_read_eof(client, buf, sizeof(buf), errp);
+    ret = nbd_read_eof(client, buf,
+                       client->extended_headers ? NBD_EXTENDED_REQUEST_SIZE
+                                                : NBD_REQUEST_SIZE,
+                       errp);
     if (ret < 0) {
         return ret;
     }
 
     /* Request
-       [ 0 ..  3]   magic   (NBD_REQUEST_MAGIC)
+       [ 0 ..  3]   magic   (NBD_REQUEST_MAGIC or NBD_EXTENDED_REQUEST_MAGIC)
        [ 4 ..  5]   flags   (NBD_CMD_FLAG_FUA, ...)
        [ 6 ..  7]   type    (NBD_CMD_READ, ...)
        [ 8 .. 15]   handle
        [16 .. 23]   from
        [24 .. 27]   len
+       [24 .. 31]   len, with extended headers
      */
 
     magic = ldl_be_p(buf);
@@ -1427,12 +1491,18 @@ static int nbd_receive_request(NBDClient *client, NBDRequest *request,
     request->type   = lduw_be_p(buf + 6);
     request->handle = ldq_be_p(buf + 8);
     request->from   = ldq_be_p(buf + 16);
-    request->len    = ldl_be_p(buf + 24);
+    if (client->extended_headers) {
+        request->len = ldq_be_p(buf + 24);
+        expected_magic = NBD_EXTENDED_REQUEST_MAGIC;
+    } else {
+        request->len = ldl_be_p(buf + 24);
+        expected_magic = NBD_REQUEST_MAGIC;
+    }
 
     trace_nbd_receive_request(magic, request->flags, request->type,
                               request->from, request->len);
 
-    if (magic != NBD_REQUEST_MAGIC) {
+    if (magic != expected_magic) {
         error_setg(errp, "invalid magic (got 0x%" PRIx32 ")", magic);
         return -EINVAL;
     }
@@ -1443,30 +1513,47 @@ static int nbd_receive_request(NBDClient *client, NBDRequest *request,
 
 void nbd_client_get(NBDClient *client)
 {
-    client->refcount++;
+    qatomic_inc(&client->refcount);
+}
+
+static void nbd_client_free(void *opaque)
+{
+    NBDClient *client = opaque;
+
+    qio_channel_detach_aio_context(client->ioc);
+    object_unref(OBJECT(client->sioc));
+    object_unref(OBJECT(client->ioc));
+    if (client->tlscreds) {
+        object_unref(OBJECT(client->tlscreds));
+    }
+    g_free(client->tlsauthz);
+    if (client->exp) {
+        QTAILQ_REMOVE(&client->exp->clients, client, next);
+        blk_exp_unref(&client->exp->common);
+    }
+    g_free(client->export_meta.bitmaps);
+    g_free(client);
 }
 
 void nbd_client_put(NBDClient *client)
 {
-    if (--client->refcount == 0) {
+    if (qatomic_fetch_dec(&client->refcount) == 1) {
         /* The last reference should be dropped by client->close,
          * which is called by client_close.
          */
         assert(client->closing);
 
-        qio_channel_detach_aio_context(client->ioc);
-        object_unref(OBJECT(client->sioc));
-        object_unref(OBJECT(client->ioc));
-        if (client->tlscreds) {
-            object_unref(OBJECT(client->tlscreds));
-        }
-        g_free(client->tlsauthz);
-        if (client->exp) {
-            QTAILQ_REMOVE(&client->exp->clients, client, next);
-            blk_exp_unref(&client->exp->common);
+        /*
+         * A client served by one of the export's iothreads may drop its
+         * last reference there; the export and its client list belong to
+         * the main loop.
+         */
+        if (client->iothread) {
+            aio_bh_schedule_oneshot(qemu_get_aio_context(), nbd_client_free,
+                                    client);
+        } else {
+            nbd_client_free(client);
         }
-        g_free(client->export_meta.bitmaps);
-        g_free(client);
     }
 }
 
@@ -1528,6 +1615,9 @@ static void blk_aio_attached(AioContext *ctx, void *opaque)
     exp->common.ctx = ctx;
 
     QTAILQ_FOREACH(client, &exp->clients, next) {
+        if (client->iothread) {
+            continue;
+        }
         qio_channel_attach_aio_context(client->ioc, ctx);
 
         assert(client->recv_coroutine == NULL);
@@ -1546,6 +1636,10 @@ static void nbd_aio_detach_bh(void *opaque)
     NBDClient *client;
 
     QTAILQ_FOREACH(client, &exp->clients, next) {
+        /* Clients in the export's iothreads stay where they are */
+        if (client->iothread) {
+            continue;
+        }
         qio_channel_detach_aio_context(client->ioc);
         client->quiescing = true;
 
@@ -1604,7 +1698,7 @@ static int nbd_export_create(BlockExport *blk_exp, BlockExportOptions *exp_args,
     uint64_t perm, shared_perm;
     bool readonly = !exp_args->writable;
     bool shared = !exp_args->writable;
-    strList *bitmaps;
+    strList *bitmaps, *iothreads;
     size_t i;
     int ret;
 
@@ -1715,12 +1809,45 @@ static int nbd_export_create(BlockExport *blk_exp, BlockExportOptions *exp_args,
 
     exp->allocation_depth = arg->allocation_depth;
 
+    if (arg->has_iothreads && arg->iothreads) {
+        if (!blk_set_multiqueue(blk, true, errp)) {
+            ret = -EINVAL;
+            goto fail_iothreads;
+        }
+        for (iothreads = arg->iothreads; iothreads;
+             iothreads = iothreads->next) {
+            exp->nr_iothreads++;
+        }
+        exp->iothreads = g_new0(IOThread *, exp->nr_iothreads);
+        for (i = 0, iothreads = arg->iothreads; iothreads;
+             i++, iothreads = iothreads->next) {
+            IOThread *iothread = iothread_by_id(iothreads->value);
+
+            if (!iothread) {
+                error_setg(errp, "IOThread '%s' not found", iothreads->value);
+                ret = -ENOENT;
+                goto fail_iothreads;
+            }
+            exp->iothreads[i] = iothread;
+            object_ref(OBJECT(iothread));
+        }
+    }
+
     blk_add_aio_context_notifier(blk, blk_aio_attached, blk_aio_detach, exp);
 
     QTAILQ_INSERT_TAIL(&exports, exp, next);
 
     return 0;
 
+fail_iothreads:
+    for (i = 0; i < exp->nr_iothreads && exp->iothreads[i]; i++) {
+        object_unref(OBJECT(exp->iothreads[i]));
+    }
+    g_free(exp->iothreads);
+    blk_set_multiqueue(blk, false, NULL);
+    for (i = 0; i < exp->nr_export_bitmaps; i++) {
+        bdrv_dirty_bitmap_set_busy(exp->export_bitmaps[i], false);
+    }
 fail:
     g_free(exp->export_bitmaps);
     g_free(exp->name);
@@ -1788,11 +1915,19 @@ static void nbd_export_delete(BlockExport *blk_exp)
         }
         blk_remove_aio_context_notifier(exp->common.blk, blk_aio_attached,
                                         blk_aio_detach, exp);
+        if (exp->nr_iothreads) {
+            blk_set_multiqueue(exp->common.blk, false, NULL);
+        }
     }
 
     for (i = 0; i < exp->nr_export_bitmaps; i++) {
         bdrv_dirty_bitmap_set_busy(exp->export_bitmaps[i], false);
     }
+
+    for (i = 0; i < exp->nr_iothreads; i++) {
+        object_unref(OBJECT(exp->iothreads[i]));
+    }
+    g_free(exp->iothreads);
 }
 
 const BlockExportDriver blk_exp_nbd = {
@@ -1828,8 +1963,9 @@ static inline void set_be_simple_reply(NBDSimpleReply *reply, uint64_t error,
     stq_be_p(&reply->handle, handle);
 }
 
+/* Not allowed once extended headers are negotiated */
 static int nbd_co_send_simple_reply(NBDClient *client,
-                                    uint64_t handle,
+                                    NBDRequest *request,
                                     uint32_t error,
                                     void *data,
                                     size_t len,
@@ -1842,84 +1978,279 @@ static int nbd_co_send_simple_reply(NBDClient *client,
         {.iov_base = data, .iov_len = len}
     };
 
-    trace_nbd_co_send_simple_reply(handle, nbd_err, nbd_err_lookup(nbd_err),
-                                   len);
-    set_be_simple_reply(&reply, nbd_err, handle);
+    assert(!client->extended_headers);
+    trace_nbd_co_send_simple_reply(request->handle, nbd_err,
+                                   nbd_err_lookup(nbd_err), len);
+    set_be_simple_reply(&reply, nbd_err, request->handle);
 
     return nbd_co_send_iov(client, iov, len ? 2 : 1, errp);
 }
 
-static inline void set_be_chunk(NBDStructuredReplyChunk *chunk, uint16_t flags,
-                                uint16_t type, uint64_t handle, uint32_t length)
+/*
+ * Fill in @hdr with the header of a reply chunk to @request, in the
+ * format negotiated with the client, and point @iov[0] at it.  The
+ * payload of the chunk is described by @iov[1] to @iov[@niov - 1].
+ */
+static inline void set_be_chunk(NBDClient *client, struct iovec *iov,
+                                size_t niov, NBDReply *hdr, uint16_t flags,
+                                uint16_t type, NBDRequest *request)
 {
-    stl_be_p(&chunk->magic, NBD_STRUCTURED_REPLY_MAGIC);
-    stw_be_p(&chunk->flags, flags);
-    stw_be_p(&chunk->type, type);
-    stq_be_p(&chunk->handle, handle);
-    stl_be_p(&chunk->length, length);
+    uint64_t length = 0;
+    size_t i;
+
+    for (i = 1; i < niov; i++) {
+        length += iov[i].iov_len;
+    }
+
+    if (client->extended_headers) {
+        NBDExtendedReplyChunk *chunk = &hdr->extended;
+
+        stl_be_p(&chunk->magic, NBD_EXTENDED_REPLY_MAGIC);
+        stw_be_p(&chunk->flags, flags);
+        stw_be_p(&chunk->type, type);
+        stq_be_p(&chunk->handle, request->handle);
+        stq_be_p(&chunk->offset, request->from);
+        stq_be_p(&chunk->length, length);
+        iov[0].iov_len = sizeof(*chunk);
+    } else {
+        NBDStructuredReplyChunk *chunk = &hdr->structured;
+
+        assert(length <= UINT32_MAX);
+        stl_be_p(&chunk->magic, NBD_STRUCTURED_REPLY_MAGIC);
+        stw_be_p(&chunk->flags, flags);
+        stw_be_p(&chunk->type, type);
+        stq_be_p(&chunk->handle, request->handle);
+        stl_be_p(&chunk->length, length);
+        iov[0].iov_len = sizeof(*chunk);
+    }
+    iov[0].iov_base = hdr;
 }
 
 static int coroutine_fn nbd_co_send_structured_done(NBDClient *client,
-                                                    uint64_t handle,
+                                                    NBDRequest *request,
                                                     Error **errp)
 {
-    NBDStructuredReplyChunk chunk;
-    struct iovec iov[] = {
-        {.iov_base = &chunk, .iov_len = sizeof(chunk)},
-    };
+    NBDReply hdr;
+    struct iovec iov[1];
 
-    trace_nbd_co_send_structured_done(handle);
-    set_be_chunk(&chunk, NBD_REPLY_FLAG_DONE, NBD_REPLY_TYPE_NONE, handle, 0);
+    trace_nbd_co_send_structured_done(request->handle);
+    set_be_chunk(client, iov, 1, &hdr, NBD_REPLY_FLAG_DONE,
+                 NBD_REPLY_TYPE_NONE, request);
 
     return nbd_co_send_iov(client, iov, 1, errp);
 }
 
 static int coroutine_fn nbd_co_send_structured_read(NBDClient *client,
-                                                    uint64_t handle,
+                                                    NBDRequest *request,
                                                     uint64_t offset,
                                                     void *data,
                                                     size_t size,
                                                     bool final,
                                                     Error **errp)
 {
+    NBDReply hdr;
     NBDStructuredReadData chunk;
     struct iovec iov[] = {
+        {},
         {.iov_base = &chunk, .iov_len = sizeof(chunk)},
         {.iov_base = data, .iov_len = size}
     };
 
     assert(size);
-    trace_nbd_co_send_structured_read(handle, offset, data, size);
-    set_be_chunk(&chunk.h, final ? NBD_REPLY_FLAG_DONE : 0,
-                 NBD_REPLY_TYPE_OFFSET_DATA, handle,
-                 sizeof(chunk) - sizeof(chunk.h) + size);
+    trace_nbd_co_send_structured_read(request->handle, offset, data, size);
+    set_be_chunk(client, iov, 3, &hdr, final ? NBD_REPLY_FLAG_DONE : 0,
+                 NBD_REPLY_TYPE_OFFSET_DATA, request);
     stq_be_p(&chunk.offset, offset);
 
-    return nbd_co_send_iov(client, iov, 2, errp);
+    return nbd_co_send_iov(client, iov, 3, errp);
 }
 
+#ifdef CONFIG_LINUX
+typedef struct NBDSendfileData {
+    int out_fd;
+    int in_fd;
+    off_t offset;
+    size_t len;
+} NBDSendfileData;
+
+static int nbd_sendfile_worker(void *opaque)
+{
+    NBDSendfileData *d = opaque;
+    ssize_t ret;
+
+    do {
+        ret = sendfile(d->out_fd, d->in_fd, &d->offset, d->len);
+    } while (ret < 0 && errno == EINTR);
+
+    return ret < 0 ? -errno : ret;
+}
+
+/*
+ * Send a successful read reply for @size bytes of the export at @offset,
+ * moving the data from the image file to the socket with sendfile()
+ * instead of reading it into @data first.  This is only possible for a
+ * plain socket and an export of a host file, possibly through the raw
+ * format, with no filters or throttling in the way (see
+ * blk_get_host_fd()).
+ *
+ * sendfile() runs in the thread pool so that disk reads do not block the
+ * event loop.  An in-flight reference keeps drained sections from
+ * changing the graph while the descriptor is in use; it is dropped while
+ * waiting for the socket, and the descriptor is looked up again after.
+ * Whatever sendfile() does not transfer is read into @data and sent
+ * normally; because the reply header is already out at that point, a
+ * read error there ends the connection.
+ *
+ * Returns -ENOTSUP without sending anything if zero copy is not possible,
+ * otherwise 0 or -EIO like nbd_co_send_iov().
+ */
+static int coroutine_fn nbd_co_send_read_zero_copy(NBDClient *client,
+                                                   NBDRequest *request,
+                                                   uint64_t offset,
+                                                   uint8_t *data,
+                                                   size_t size,
+                                                   bool final,
+                                                   Error **errp)
+{
+    BlockBackend *blk = client->exp->common.blk;
+    ThreadPool *pool = aio_get_thread_pool(qemu_get_current_aio_context());
+    NBDSimpleReply reply;
+    NBDReply hdr;
+    NBDStructuredReadData chunk;
+    /* The data itself, the last element, is sent separately */
+    struct iovec iov[3];
+    unsigned niov;
+    NBDSendfileData sf;
+    QEMUIOVector qiov;
+    int64_t fd_offset;
+    size_t progress = 0;
+    int fd, ret;
+
+    if (client->ioc != QIO_CHANNEL(client->sioc)) {
+        /* TLS */
+        return -ENOTSUP;
+    }
+    blk_inc_in_flight(blk);
+    fd = blk_get_host_fd(blk, &fd_offset);
+    if (fd < 0) {
+        blk_dec_in_flight(blk);
+        return -ENOTSUP;
+    }
+
+    if (client->structured_reply) {
+        trace_nbd_co_send_structured_read(request->handle, offset, NULL, size);
+        iov[1] = (struct iovec) { .iov_base = &chunk,
+                                  .iov_len = sizeof(chunk) };
+        iov[2] = (struct iovec) { .iov_base = data, .iov_len = size };
+        set_be_chunk(client, iov, 3, &hdr, final ? NBD_REPLY_FLAG_DONE : 0,
+                     NBD_REPLY_TYPE_OFFSET_DATA, request);
+        stq_be_p(&chunk.offset, offset);
+        niov = 2;
+    } else {
+        assert(!client->extended_headers);
+        trace_nbd_co_send_simple_reply(request->handle, 0, nbd_err_lookup(0),
+                                       size);
+        set_be_simple_reply(&reply, 0, request->handle);
+        iov[0] = (struct iovec) { .iov_base = &reply,
+                                  .iov_len = sizeof(reply) };
+        niov = 1;
+    }
+
+    qemu_co_mutex_lock(&client->send_lock);
+    client->send_coroutine = qemu_coroutine_self();
+    qio_channel_set_cork(client->ioc, true);
+
+    if (qio_channel_writev_all(client->ioc, iov, niov, errp) < 0) {
+        blk_dec_in_flight(blk);
+        ret = -EIO;
+        goto out;
+    }
+
+    sf = (NBDSendfileData) {
+        .out_fd = client->sioc->fd,
+    };
+    while (progress < size) {
+        sf.in_fd = fd;
+        sf.offset = fd_offset + offset + progress;
+        sf.len = size - progress;
+        ret = thread_pool_submit_co(pool, nbd_sendfile_worker, &sf);
+        if (ret == -EAGAIN) {
+            /* Do not hold up drained sections while the client is slow */
+            blk_dec_in_flight(blk);
+            qio_channel_yield(client->ioc, G_IO_OUT);
+            blk_inc_in_flight(blk);
+            fd = blk_get_host_fd(blk, &fd_offset);
+            if (fd < 0) {
+                break;
+            }
+            continue;
+        }
+        if (ret <= 0) {
+            /* End of file or an unsupported descriptor: copy the rest */
+            break;
+        }
+        progress += ret;
+    }
+    blk_dec_in_flight(blk);
+    trace_nbd_co_send_read_zero_copy(request->handle, offset, size, progress);
+
+    ret = 0;
+    if (progress < size) {
+        qemu_iovec_init_buf(&qiov, data + progress, size - progress);
+        ret = blk_co_preadv(blk, offset + progress, size - progress,
+                            &qiov, 0);
+        if (ret < 0) {
+            error_setg_errno(errp, -ret, "reading from file failed");
+            ret = -EIO;
+            goto out;
+        }
+        ret = qio_channel_write_all(client->ioc, (char *)data + progress,
+                                    size - progress, errp) < 0 ? -EIO : 0;
+    }
+
+out:
+    qio_channel_set_cork(client->ioc, false);
+    client->send_coroutine = NULL;
+    qemu_co_mutex_unlock(&client->send_lock);
+    return ret;
+}
+#else
+static int coroutine_fn nbd_co_send_read_zero_copy(NBDClient *client,
+                                                   NBDRequest *request,
+                                                   uint64_t offset,
+                                                   uint8_t *data,
+                                                   size_t size,
+                                                   bool final,
+                                                   Error **errp)
+{
+    return -ENOTSUP;
+}
+#endif
+
 static int coroutine_fn nbd_co_send_structured_error(NBDClient *client,
-                                                     uint64_t handle,
+                                                     NBDRequest *request,
                                                      uint32_t error,
                                                      const char *msg,
                                                      Error **errp)
 {
+    NBDReply hdr;
     NBDStructuredError chunk;
     int nbd_err = system_errno_to_nbd_errno(error);
     struct iovec iov[] = {
+        {},
         {.iov_base = &chunk, .iov_len = sizeof(chunk)},
         {.iov_base = (char *)msg, .iov_len = msg ? strlen(msg) : 0},
     };
 
     assert(nbd_err);
-    trace_nbd_co_send_structured_error(handle, nbd_err,
+    trace_nbd_co_send_structured_error(request->handle, nbd_err,
                                        nbd_err_lookup(nbd_err), msg ? msg : "");
-    set_be_chunk(&chunk.h, NBD_REPLY_FLAG_DONE, NBD_REPLY_TYPE_ERROR, handle,
-                 sizeof(chunk) - sizeof(chunk.h) + iov[1].iov_len);
+    set_be_chunk(client, iov, 3, &hdr, NBD_REPLY_FLAG_DONE,
+                 NBD_REPLY_TYPE_ERROR, request);
     stl_be_p(&chunk.error, nbd_err);
-    stw_be_p(&chunk.message_length, iov[1].iov_len);
+    stw_be_p(&chunk.message_length, iov[2].iov_len);
 
-    return nbd_co_send_iov(client, iov, 1 + !!iov[1].iov_len, errp);
+    return nbd_co_send_iov(client, iov, 2 + !!iov[2].iov_len, errp);
 }
 
 /* Do a sparse read and send the structured reply to the client.
@@ -1927,7 +2258,7 @@ static int coroutine_fn nbd_co_send_structured_error(NBDClient *client,
  * reported to the client, at which point this function succeeds.
  */
 static int coroutine_fn nbd_co_send_sparse_read(NBDClient *client,
-                                                uint64_t handle,
+                                                NBDRequest *request,
                                                 uint64_t offset,
                                                 uint8_t *data,
                                                 size_t size,
@@ -1949,7 +2280,7 @@ static int coroutine_fn nbd_co_send_sparse_read(NBDClient *client,
             char *msg = g_strdup_printf("unable to check for holes: %s",
                                         strerror(-status));
 
-            ret = nbd_co_send_structured_error(client, handle, -status, msg,
+            ret = nbd_co_send_structured_error(client, request, -status, msg,
                                                errp);
             g_free(msg);
             return ret;
@@ -1957,29 +2288,38 @@ static int coroutine_fn nbd_co_send_sparse_read(NBDClient *client,
         assert(pnum && pnum <= size - progress);
         final = progress + pnum == size;
         if (status & BDRV_BLOCK_ZERO) {
+            NBDReply hdr;
             NBDStructuredReadHole chunk;
             struct iovec iov[] = {
+                {},
                 {.iov_base = &chunk, .iov_len = sizeof(chunk)},
             };
 
-            trace_nbd_co_send_structured_read_hole(handle, offset + progress,
-                                                   pnum);
-            set_be_chunk(&chunk.h, final ? NBD_REPLY_FLAG_DONE : 0,
-                         NBD_REPLY_TYPE_OFFSET_HOLE,
-                         handle, sizeof(chunk) - sizeof(chunk.h));
+            trace_nbd_co_send_structured_read_hole(request->handle,
+                                                   offset + progress, pnum);
+            set_be_chunk(client, iov, 2, &hdr,
+                         final ? NBD_REPLY_FLAG_DONE : 0,
+                         NBD_REPLY_TYPE_OFFSET_HOLE, request);
             stq_be_p(&chunk.offset, offset + progress);
             stl_be_p(&chunk.length, pnum);
-            ret = nbd_co_send_iov(client, iov, 1, errp);
+            ret = nbd_co_send_iov(client, iov, 2, errp);
         } else {
-            ret = blk_pread(exp->common.blk, offset + progress,
-                            data + progress, pnum);
-            if (ret < 0) {
-                error_setg_errno(errp, -ret, "reading from file failed");
-                break;
+            ret = nbd_co_send_read_zero_copy(client, request,
+                                             offset + progress,
+                                             data + progress, pnum, final,
+                                             errp);
+            if (ret == -ENOTSUP) {
+                ret = blk_pread(exp->common.blk, offset + progress,
+                                data + progress, pnum);
+                if (ret < 0) {
+                    error_setg_errno(errp, -ret, "reading from file failed");
+                    break;
+                }
+                ret = nbd_co_send_structured_read(client, request,
+                                                  offset + progress,
+                                                  data + progress, pnum, final,
+                                                  errp);
             }
-            ret = nbd_co_send_structured_read(client, handle, offset + progress,
-                                              data + progress, pnum, final,
-                                              errp);
         }
 
         if (ret < 0) {
@@ -1990,21 +2330,38 @@ static int coroutine_fn nbd_co_send_sparse_read(NBDClient *client,
     return ret;
 }
 
+/*
+ * Extents are collected with 64-bit fields, and only packed into the
+ * 32-bit wire format of NBD_REPLY_TYPE_BLOCK_STATUS when sent without
+ * extended headers.
+ */
 typedef struct NBDExtentArray {
-    NBDExtent *extents;
+    NBDExtent64 *extents;
     unsigned int nb_alloc;
+    unsigned int max_extents;
     unsigned int count;
     uint64_t total_length;
+    bool extended;
     bool can_add;
     bool converted_to_be;
 } NBDExtentArray;
 
-static NBDExtentArray *nbd_extent_array_new(unsigned int nb_alloc)
+static NBDExtentArray *nbd_extent_array_new(NBDClient *client,
+                                            bool dont_fragment)
 {
     NBDExtentArray *ea = g_new0(NBDExtentArray, 1);
 
-    ea->nb_alloc = nb_alloc;
-    ea->extents = g_new(NBDExtent, nb_alloc);
+    ea->extended = client->extended_headers;
+    if (dont_fragment) {
+        ea->max_extents = 1;
+    } else if (ea->extended) {
+        ea->max_extents = NBD_MAX_BLOCK_STATUS_EXT_EXTENTS;
+    } else {
+        ea->max_extents = NBD_MAX_BLOCK_STATUS_EXTENTS;
+    }
+    /* Most replies are short, grow the array as needed */
+    ea->nb_alloc = MIN(ea->max_extents, 1024);
+    ea->extents = g_new(NBDExtent64, ea->nb_alloc);
     ea->can_add = true;
 
     return ea;
@@ -2017,9 +2374,15 @@ static void nbd_extent_array_free(NBDExtentArray *ea)
 }
 G_DEFINE_AUTOPTR_CLEANUP_FUNC(NBDExtentArray, nbd_extent_array_free);
 
-/* Further modifications of the array after conversion are abandoned */
+/*
+ * Further modifications of the array after conversion are abandoned.
+ * Without extended headers the array is packed in place into NBDExtent
+ * elements, which is safe because each of them only overwrites 64-bit
+ * extents that were already converted.
+ */
 static void nbd_extent_array_convert_to_be(NBDExtentArray *ea)
 {
+    NBDExtent *extents32 = (NBDExtent *)ea->extents;
     int i;
 
     assert(!ea->converted_to_be);
@@ -2027,8 +2390,15 @@ static void nbd_extent_array_convert_to_be(NBDExtentArray *ea)
     ea->converted_to_be = true;
 
     for (i = 0; i < ea->count; i++) {
-        ea->extents[i].flags = cpu_to_be32(ea->extents[i].flags);
-        ea->extents[i].length = cpu_to_be32(ea->extents[i].length);
+        NBDExtent64 e = ea->extents[i];
+
+        if (ea->extended) {
+            ea->extents[i].flags = cpu_to_be64(e.flags);
+            ea->extents[i].length = cpu_to_be64(e.length);
+        } else {
+            extents32[i].flags = cpu_to_be32(e.flags);
+            extents32[i].length = cpu_to_be32(e.length);
+        }
     }
 }
 
@@ -2043,9 +2413,12 @@ static void nbd_extent_array_convert_to_be(NBDExtentArray *ea)
  * have invalid array with skipped extent)
  */
 static int nbd_extent_array_add(NBDExtentArray *ea,
-                                uint32_t length, uint32_t flags)
+                                uint64_t length, uint32_t flags)
 {
+    uint64_t max_length = ea->extended ? INT64_MAX : UINT32_MAX;
+
     assert(ea->can_add);
+    assert(length <= max_length);
 
     if (!length) {
         return 0;
@@ -2053,9 +2426,9 @@ static int nbd_extent_array_add(NBDExtentArray *ea,
 
     /* Extend previous extent if flags are the same */
     if (ea->count > 0 && flags == ea->extents[ea->count - 1].flags) {
-        uint64_t sum = (uint64_t)length + ea->extents[ea->count - 1].length;
+        uint64_t sum = length + ea->extents[ea->count - 1].length;
 
-        if (sum <= UINT32_MAX) {
+        if (sum <= max_length) {
             ea->extents[ea->count - 1].length = sum;
             ea->total_length += length;
             return 0;
@@ -2063,12 +2436,16 @@ static int nbd_extent_array_add(NBDExtentArray *ea,
     }
 
     if (ea->count >= ea->nb_alloc) {
-        ea->can_add = false;
-        return -1;
+        if (ea->nb_alloc == ea->max_extents) {
+            ea->can_add = false;
+            return -1;
+        }
+        ea->nb_alloc = MIN(ea->max_extents, ea->nb_alloc * 2);
+        ea->extents = g_renew(NBDExtent64, ea->extents, ea->nb_alloc);
     }
 
     ea->total_length += length;
-    ea->extents[ea->count] = (NBDExtent) {.length = length, .flags = flags};
+    ea->extents[ea->count] = (NBDExtent64) {.length = length, .flags = flags};
     ea->count++;
 
     return 0;
@@ -2130,38 +2507,50 @@ static int blockalloc_to_extents(BlockDriverState *bs, uint64_t offset,
  * @ea is converted to BE by the function
  * @last controls whether NBD_REPLY_FLAG_DONE is sent.
  */
-static int nbd_co_send_extents(NBDClient *client, uint64_t handle,
+static int nbd_co_send_extents(NBDClient *client, NBDRequest *request,
                                NBDExtentArray *ea,
                                bool last, uint32_t context_id, Error **errp)
 {
-    NBDStructuredMeta chunk;
+    NBDReply hdr;
+    NBDStructuredMeta meta;
+    NBDExtendedMeta meta_ext;
     struct iovec iov[] = {
-        {.iov_base = &chunk, .iov_len = sizeof(chunk)},
-        {.iov_base = ea->extents, .iov_len = ea->count * sizeof(ea->extents[0])}
+        {},
+        {.iov_base = &meta, .iov_len = sizeof(meta)},
+        {.iov_base = ea->extents, .iov_len = ea->count * sizeof(NBDExtent)}
     };
+    uint16_t type = NBD_REPLY_TYPE_BLOCK_STATUS;
 
     nbd_extent_array_convert_to_be(ea);
 
-    trace_nbd_co_send_extents(handle, ea->count, context_id, ea->total_length,
-                              last);
-    set_be_chunk(&chunk.h, last ? NBD_REPLY_FLAG_DONE : 0,
-                 NBD_REPLY_TYPE_BLOCK_STATUS,
-                 handle, sizeof(chunk) - sizeof(chunk.h) + iov[1].iov_len);
-    stl_be_p(&chunk.context_id, context_id);
+    trace_nbd_co_send_extents(request->handle, ea->count, context_id,
+                              ea->total_length, last);
+    if (ea->extended) {
+        stl_be_p(&meta_ext.context_id, context_id);
+        stl_be_p(&meta_ext.count, ea->count);
+        iov[1] = (struct iovec) { .iov_base = &meta_ext,
+                                  .iov_len = sizeof(meta_ext) };
+        iov[2].iov_len = ea->count * sizeof(NBDExtent64);
+        type = NBD_REPLY_TYPE_BLOCK_STATUS_EXT;
+    } else {
+        stl_be_p(&meta.context_id, context_id);
+    }
+    set_be_chunk(client, iov, 3, &hdr, last ? NBD_REPLY_FLAG_DONE : 0, type,
+                 request);
 
-    return nbd_co_send_iov(client, iov, 2, errp);
+    return nbd_co_send_iov(client, iov, 3, errp);
 }
 
 /* Get block status from the exported device and send it to the client */
-static int nbd_co_send_block_status(NBDClient *client, uint64_t handle,
+static int nbd_co_send_block_status(NBDClient *client, NBDRequest *request,
                                     BlockDriverState *bs, uint64_t offset,
-                                    uint32_t length, bool dont_fragment,
+                                    uint64_t length, bool dont_fragment,
                                     bool last, uint32_t context_id,
                                     Error **errp)
 {
     int ret;
-    unsigned int nb_extents = dont_fragment ? 1 : NBD_MAX_BLOCK_STATUS_EXTENTS;
-    g_autoptr(NBDExtentArray) ea = nbd_extent_array_new(nb_extents);
+    g_autoptr(NBDExtentArray) ea = nbd_extent_array_new(client,
+                                                        dont_fragment);
 
     if (context_id == NBD_META_ID_BASE_ALLOCATION) {
         ret = blockstatus_to_extents(bs, offset, length, ea);
@@ -2170,55 +2559,44 @@ static int nbd_co_send_block_status(NBDClient *client, uint64_t handle,
     }
     if (ret < 0) {
         return nbd_co_send_structured_error(
-                client, handle, -ret, "can't get block status", errp);
+                client, request, -ret, "can't get block status", errp);
     }
 
-    return nbd_co_send_extents(client, handle, ea, last, context_id, errp);
+    return nbd_co_send_extents(client, request, ea, last, context_id, errp);
 }
 
-/* Populate @ea from a dirty bitmap. */
+/* Populate @ea from a dirty bitmap, one run of equal bits at a time. */
 static void bitmap_to_extents(BdrvDirtyBitmap *bitmap,
                               uint64_t offset, uint64_t length,
                               NBDExtentArray *es)
 {
-    int64_t start, dirty_start, dirty_count;
+    int64_t start, run;
     int64_t end = offset + length;
-    bool full = false;
+    bool dirty;
 
     bdrv_dirty_bitmap_lock(bitmap);
 
-    for (start = offset;
-         bdrv_dirty_bitmap_next_dirty_area(bitmap, start, end, INT32_MAX,
-                                           &dirty_start, &dirty_count);
-         start = dirty_start + dirty_count)
-    {
-        if ((nbd_extent_array_add(es, dirty_start - start, 0) < 0) ||
-            (nbd_extent_array_add(es, dirty_count, NBD_STATE_DIRTY) < 0))
-        {
-            full = true;
+    for (start = offset; start < end; start += run) {
+        run = bdrv_dirty_bitmap_next_run(bitmap, start, end, &dirty);
+        if (nbd_extent_array_add(es, run, dirty ? NBD_STATE_DIRTY : 0) < 0) {
             break;
         }
     }
 
-    if (!full) {
-        /* last non dirty extent, nothing to do if array is now full */
-        (void) nbd_extent_array_add(es, end - start, 0);
-    }
-
     bdrv_dirty_bitmap_unlock(bitmap);
 }
 
-static int nbd_co_send_bitmap(NBDClient *client, uint64_t handle,
+static int nbd_co_send_bitmap(NBDClient *client, NBDRequest *request,
                               BdrvDirtyBitmap *bitmap, uint64_t offset,
-                              uint32_t length, bool dont_fragment, bool last,
+                              uint64_t length, bool dont_fragment, bool last,
                               uint32_t context_id, Error **errp)
 {
-    unsigned int nb_extents = dont_fragment ? 1 : NBD_MAX_BLOCK_STATUS_EXTENTS;
-    g_autoptr(NBDExtentArray) ea = nbd_extent_array_new(nb_extents);
+    g_autoptr(NBDExtentArray) ea = nbd_extent_array_new(client,
+                                                        dont_fragment);
 
     bitmap_to_extents(bitmap, offset, length, ea);
 
-    return nbd_co_send_extents(client, handle, ea, last, context_id, errp);
+    return nbd_co_send_extents(client, request, ea, last, context_id, errp);
 }
 
 /* nbd_co_receive_request
@@ -2260,7 +2638,7 @@ static int nbd_co_receive_request(NBDRequestData *req, NBDRequest *request,
         request->type == NBD_CMD_CACHE)
     {
         if (request->len > NBD_MAX_BUFFER_SIZE) {
-            error_setg(errp, "len (%" PRIu32" ) is larger than max len (%u)",
+            error_setg(errp, "len (%" PRIu64 ") is larger than max len (%u)",
                        request->len, NBD_MAX_BUFFER_SIZE);
             return -EINVAL;
         }
@@ -2297,7 +2675,7 @@ static int nbd_co_receive_request(NBDRequestData *req, NBDRequest *request,
     }
     if (request->from > client->exp->size ||
         request->len > client->exp->size - request->from) {
-        error_setg(errp, "operation past EOF; From: %" PRIu64 ", Len: %" PRIu32
+        error_setg(errp, "operation past EOF; From: %" PRIu64 ", Len: %" PRIu64
                    ", Size: %" PRIu64, request->from, request->len,
                    client->exp->size);
         return (request->type == NBD_CMD_WRITE ||
@@ -2336,16 +2714,18 @@ static int nbd_co_receive_request(NBDRequestData *req, NBDRequest *request,
  * Returns 0 if connection is still live, -errno on failure to talk to client
  */
 static coroutine_fn int nbd_send_generic_reply(NBDClient *client,
-                                               uint64_t handle,
+                                               NBDRequest *request,
                                                int ret,
                                                const char *error_msg,
                                                Error **errp)
 {
     if (client->structured_reply && ret < 0) {
-        return nbd_co_send_structured_error(client, handle, -ret, error_msg,
+        return nbd_co_send_structured_error(client, request, -ret, error_msg,
                                             errp);
+    } else if (client->extended_headers) {
+        return nbd_co_send_structured_done(client, request, errp);
     } else {
-        return nbd_co_send_simple_reply(client, handle, ret < 0 ? -ret : 0,
+        return nbd_co_send_simple_reply(client, request, ret < 0 ? -ret : 0,
                                         NULL, 0, errp);
     }
 }
@@ -2365,7 +2745,7 @@ static coroutine_fn int nbd_do_cmd_read(NBDClient *client, NBDRequest *request,
     if (request->flags & NBD_CMD_FLAG_FUA) {
         ret = blk_co_flush(exp->common.blk);
         if (ret < 0) {
-            return nbd_send_generic_reply(client, request->handle, ret,
+            return nbd_send_generic_reply(client, request, ret,
                                           "flush failed", errp);
         }
     }
@@ -2373,26 +2753,35 @@ static coroutine_fn int nbd_do_cmd_read(NBDClient *client, NBDRequest *request,
     if (client->structured_reply && !(request->flags & NBD_CMD_FLAG_DF) &&
         request->len)
     {
-        return nbd_co_send_sparse_read(client, request->handle, request->from,
+        return nbd_co_send_sparse_read(client, request, request->from,
                                        data, request->len, errp);
     }
 
+    if (request->len) {
+        ret = nbd_co_send_read_zero_copy(client, request,
+                                         request->from, data, request->len,
+                                         true, errp);
+        if (ret != -ENOTSUP) {
+            return ret;
+        }
+    }
+
     ret = blk_pread(exp->common.blk, request->from, data, request->len);
     if (ret < 0) {
-        return nbd_send_generic_reply(client, request->handle, ret,
+        return nbd_send_generic_reply(client, request, ret,
                                       "reading from file failed", errp);
     }
 
     if (client->structured_reply) {
         if (request->len) {
-            return nbd_co_send_structured_read(client, request->handle,
+            return nbd_co_send_structured_read(client, request,
                                                request->from, data,
                                                request->len, true, errp);
         } else {
-            return nbd_co_send_structured_done(client, request->handle, errp);
+            return nbd_co_send_structured_done(client, request, errp);
         }
     } else {
-        return nbd_co_send_simple_reply(client, request->handle, 0,
+        return nbd_co_send_simple_reply(client, request, 0,
                                         data, request->len, errp);
     }
 }
@@ -2415,7 +2804,7 @@ static coroutine_fn int nbd_do_cmd_cache(NBDClient *client, NBDRequest *request,
     ret = blk_co_preadv(exp->common.blk, request->from, request->len,
                         NULL, BDRV_REQ_COPY_ON_READ | BDRV_REQ_PREFETCH);
 
-    return nbd_send_generic_reply(client, request->handle, ret,
+    return nbd_send_generic_reply(client, request, ret,
                                   "caching data failed", errp);
 }
 
@@ -2429,6 +2818,7 @@ static coroutine_fn int nbd_handle_request(NBDClient *client,
     int ret;
     int flags;
     NBDExport *exp = client->exp;
+    uint64_t offset, bytes;
     char *msg;
     size_t i;
 
@@ -2446,7 +2836,7 @@ static coroutine_fn int nbd_handle_request(NBDClient *client,
         }
         ret = blk_pwrite(exp->common.blk, request->from, data, request->len,
                          flags);
-        return nbd_send_generic_reply(client, request->handle, ret,
+        return nbd_send_generic_reply(client, request, ret,
                                       "writing to file failed", errp);
 
     case NBD_CMD_WRITE_ZEROES:
@@ -2461,16 +2851,18 @@ static coroutine_fn int nbd_handle_request(NBDClient *client,
             flags |= BDRV_REQ_NO_FALLBACK;
         }
         ret = 0;
+        offset = request->from;
+        bytes = request->len;
         /* FIXME simplify this when blk_pwrite_zeroes switches to 64-bit */
-        while (ret >= 0 && request->len) {
+        while (ret >= 0 && bytes) {
             int align = client->check_align ?: 1;
-            int len = MIN(request->len, QEMU_ALIGN_DOWN(BDRV_REQUEST_MAX_BYTES,
-                                                        align));
-            ret = blk_pwrite_zeroes(exp->common.blk, request->from, len, flags);
-            request->len -= len;
-            request->from += len;
+            int len = MIN(bytes, QEMU_ALIGN_DOWN(BDRV_REQUEST_MAX_BYTES,
+                                                 align));
+            ret = blk_pwrite_zeroes(exp->common.blk, offset, len, flags);
+            bytes -= len;
+            offset += len;
         }
-        return nbd_send_generic_reply(client, request->handle, ret,
+        return nbd_send_generic_reply(client, request, ret,
                                       "writing to file failed", errp);
 
     case NBD_CMD_DISC:
@@ -2479,29 +2871,31 @@ static coroutine_fn int nbd_handle_request(NBDClient *client,
 
     case NBD_CMD_FLUSH:
         ret = blk_co_flush(exp->common.blk);
-        return nbd_send_generic_reply(client, request->handle, ret,
+        return nbd_send_generic_reply(client, request, ret,
                                       "flush failed", errp);
 
     case NBD_CMD_TRIM:
         ret = 0;
+        offset = request->from;
+        bytes = request->len;
         /* FIXME simplify this when blk_co_pdiscard switches to 64-bit */
-        while (ret >= 0 && request->len) {
+        while (ret >= 0 && bytes) {
             int align = client->check_align ?: 1;
-            int len = MIN(request->len, QEMU_ALIGN_DOWN(BDRV_REQUEST_MAX_BYTES,
-                                                        align));
-            ret = blk_co_pdiscard(exp->common.blk, request->from, len);
-            request->len -= len;
-            request->from += len;
+            int len = MIN(bytes, QEMU_ALIGN_DOWN(BDRV_REQUEST_MAX_BYTES,
+                                                 align));
+            ret = blk_co_pdiscard(exp->common.blk, offset, len);
+            bytes -= len;
+            offset += len;
         }
         if (ret >= 0 && request->flags & NBD_CMD_FLAG_FUA) {
             ret = blk_co_flush(exp->common.blk);
         }
-        return nbd_send_generic_reply(client, request->handle, ret,
+        return nbd_send_generic_reply(client, request, ret,
                                       "discard failed", errp);
 
     case NBD_CMD_BLOCK_STATUS:
         if (!request->len) {
-            return nbd_send_generic_reply(client, request->handle, -EINVAL,
+            return nbd_send_generic_reply(client, request, -EINVAL,
                                           "need non-zero length", errp);
         }
         if (client->export_meta.count) {
@@ -2509,7 +2903,7 @@ static coroutine_fn int nbd_handle_request(NBDClient *client,
             int contexts_remaining = client->export_meta.count;
 
             if (client->export_meta.base_allocation) {
-                ret = nbd_co_send_block_status(client, request->handle,
+                ret = nbd_co_send_block_status(client, request,
                                                blk_bs(exp->common.blk),
                                                request->from,
                                                request->len, dont_fragment,
@@ -2522,7 +2916,7 @@ static coroutine_fn int nbd_handle_request(NBDClient *client,
             }
 
             if (client->export_meta.allocation_depth) {
-                ret = nbd_co_send_block_status(client, request->handle,
+                ret = nbd_co_send_block_status(client, request,
                                                blk_bs(exp->common.blk),
                                                request->from, request->len,
                                                dont_fragment,
@@ -2538,7 +2932,7 @@ static coroutine_fn int nbd_handle_request(NBDClient *client,
                 if (!client->export_meta.bitmaps[i]) {
                     continue;
                 }
-                ret = nbd_co_send_bitmap(client, request->handle,
+                ret = nbd_co_send_bitmap(client, request,
                                          client->exp->export_bitmaps[i],
                                          request->from, request->len,
                                          dont_fragment, !--contexts_remaining,
@@ -2552,7 +2946,7 @@ static coroutine_fn int nbd_handle_request(NBDClient *client,
 
             return 0;
         } else {
-            return nbd_send_generic_reply(client, request->handle, -EINVAL,
+            return nbd_send_generic_reply(client, request, -EINVAL,
                                           "CMD_BLOCK_STATUS not negotiated",
                                           errp);
         }
@@ -2560,7 +2954,7 @@ static coroutine_fn int nbd_handle_request(NBDClient *client,
     default:
         msg = g_strdup_printf("invalid request type (%" PRIu32 ") received",
                               request->type);
-        ret = nbd_send_generic_reply(client, request->handle, -EINVAL, msg,
+        ret = nbd_send_generic_reply(client, request, -EINVAL, msg,
                                      errp);
         g_free(msg);
         return ret;
@@ -2621,7 +3015,7 @@ static coroutine_fn void nbd_trip(void *opaque)
         Error *export_err = local_err;
 
         local_err = NULL;
-        ret = nbd_send_generic_reply(client, request.handle, -EINVAL,
+        ret = nbd_send_generic_reply(client, &request, -EINVAL,
                                      error_get_pretty(export_err), &local_err);
         error_free(export_err);
     } else {
@@ -2660,7 +3054,8 @@ static void nbd_client_receive_next_request(NBDClient *client)
         !client->quiescing) {
         nbd_client_get(client);
         client->recv_coroutine = qemu_coroutine_create(nbd_trip, client);
-        aio_co_schedule(client->exp->common.ctx, client->recv_coroutine);
+        aio_co_schedule(nbd_client_aio_context(client),
+                        client->recv_coroutine);
     }
 }
 
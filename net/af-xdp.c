@@ -0,0 +1,883 @@
+/*
+ * AF_XDP network backend
+ *
+ * Each queue of the netdev is an AF_XDP socket bound to one queue of the
+ * host NIC.  Packet buffers live in a UMEM area that is shared with the
+ * kernel; with drivers that support it the NIC DMAs straight into it.  A
+ * minimal XDP program redirects every packet received on the bound queues
+ * to the corresponding socket and passes everything else to the stack.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <net/if.h>
+#include <linux/bpf.h>
+#include <linux/if_link.h>
+#include <linux/if_xdp.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+
+#include "clients.h"
+#include "block/aio.h"
+#include "net/net.h"
+#include "qapi/error.h"
+#include "qemu/atomic.h"
+#include "qemu/cutils.h"
+#include "qemu/error-report.h"
+#include "qemu/iov.h"
+#include "qemu/main-loop.h"
+#include "sysemu/iothread.h"
+
+#ifndef SOL_XDP
+#define SOL_XDP 283
+#endif
+#ifndef SO_PREFER_BUSY_POLL
+#define SO_PREFER_BUSY_POLL 69
+#endif
+#ifndef SO_BUSY_POLL_BUDGET
+#define SO_BUSY_POLL_BUDGET 70
+#endif
+
+#define AF_XDP_FRAME_SIZE       4096
+#define AF_XDP_RING_SIZE        2048
+#define AF_XDP_RING_MASK        (AF_XDP_RING_SIZE - 1)
+/* One frame per fill ring slot for receive, as many again for transmit */
+#define AF_XDP_NUM_FRAMES       (2 * AF_XDP_RING_SIZE)
+#define AF_XDP_RX_BUDGET        64
+#define AF_XDP_BUSY_POLL_USECS  20
+
+typedef struct AFXDPRing {
+    uint32_t *producer;
+    uint32_t *consumer;
+    uint32_t *flags;
+    void *descs;
+    void *map;
+    size_t map_size;
+    /* Our copy of the index we own, and the last seen value of the other */
+    uint32_t cached_prod;
+    uint32_t cached_cons;
+} AFXDPRing;
+
+/* The XDP program and socket map are shared by all queues of a netdev */
+typedef struct AFXDPProgram {
+    int refcnt;
+    int ifindex;
+    uint32_t xdp_flags;
+    int prog_fd;
+    int map_fd;
+    bool attached;
+} AFXDPProgram;
+
+struct AFXDPState;
+
+/*
+ * The socket and its rings.  With an IOThread this is the opaque of the
+ * AioContext handlers, so it outlives the net client until the IOThread
+ * is known not to be using it anymore.
+ */
+typedef struct AFXDPSocket {
+    struct AFXDPState *s;       /* NULL once the net client is gone */
+    int fd;
+    void *umem;
+    AFXDPRing rx;
+    AFXDPRing tx;
+    AFXDPRing fill;
+    AFXDPRing comp;
+    uint64_t free_frames[AF_XDP_RING_SIZE];
+    uint32_t n_free_frames;
+} AFXDPSocket;
+
+typedef struct AFXDPState {
+    NetClientState nc;
+    AFXDPSocket *xsk;
+    AFXDPProgram *prog;
+    char ifname[IFNAMSIZ];
+    int queue_id;
+    IOThread *iothread;
+    AioContext *ctx;
+    bool read_poll;
+    bool write_poll;
+} AFXDPState;
+
+static int af_xdp_bpf(int cmd, union bpf_attr *attr)
+{
+    return syscall(__NR_bpf, cmd, attr, sizeof(*attr));
+}
+
+/* Consumer side of the rx and completion rings */
+static uint32_t af_xdp_cons_peek(AFXDPRing *r, uint32_t max)
+{
+    uint32_t avail = r->cached_prod - r->cached_cons;
+
+    if (!avail) {
+        r->cached_prod = qatomic_load_acquire(r->producer);
+        avail = r->cached_prod - r->cached_cons;
+    }
+    return MIN(avail, max);
+}
+
+static void af_xdp_cons_release(AFXDPRing *r, uint32_t n)
+{
+    r->cached_cons += n;
+    qatomic_store_release(r->consumer, r->cached_cons);
+}
+
+/* Producer side of the tx and fill rings */
+static uint32_t af_xdp_prod_space(AFXDPRing *r)
+{
+    uint32_t space = AF_XDP_RING_SIZE - (r->cached_prod - r->cached_cons);
+
+    if (!space) {
+        r->cached_cons = qatomic_load_acquire(r->consumer);
+        space = AF_XDP_RING_SIZE - (r->cached_prod - r->cached_cons);
+    }
+    return space;
+}
+
+static void af_xdp_prod_submit(AFXDPRing *r, uint32_t n)
+{
+    r->cached_prod += n;
+    qatomic_store_release(r->producer, r->cached_prod);
+}
+
+static bool af_xdp_need_wakeup(AFXDPRing *r)
+{
+    return qatomic_read(r->flags) & XDP_RING_NEED_WAKEUP;
+}
+
+static void af_xdp_send(AFXDPState *s);
+static void af_xdp_writable(void *opaque);
+
+static void af_xdp_iothread_read(void *opaque)
+{
+    AFXDPSocket *xsk = opaque;
+
+    qemu_mutex_lock_iothread();
+    if (xsk->s) {
+        af_xdp_send(xsk->s);
+    }
+    qemu_mutex_unlock_iothread();
+}
+
+static void af_xdp_iothread_write(void *opaque)
+{
+    AFXDPSocket *xsk = opaque;
+
+    qemu_mutex_lock_iothread();
+    if (xsk->s) {
+        af_xdp_writable(xsk->s);
+    }
+    qemu_mutex_unlock_iothread();
+}
+
+/* Busy poll the rx ring, only taking the BQL when there are packets */
+static bool af_xdp_iothread_poll(void *opaque)
+{
+    AFXDPSocket *xsk = opaque;
+
+    if (qatomic_read(xsk->rx.producer) == qatomic_read(xsk->rx.consumer)) {
+        return false;
+    }
+
+    af_xdp_iothread_read(xsk);
+    return true;
+}
+
+static void af_xdp_main_loop_read(void *opaque)
+{
+    AFXDPState *s = opaque;
+
+    qemu_net_client_acquire(&s->nc);
+    af_xdp_send(s);
+    qemu_net_client_release(&s->nc);
+}
+
+static void af_xdp_update_fd_handler(AFXDPState *s)
+{
+    if (s->ctx) {
+        aio_set_fd_handler(s->ctx, s->xsk->fd, false,
+                           s->read_poll ? af_xdp_iothread_read : NULL,
+                           s->write_poll ? af_xdp_iothread_write : NULL,
+                           s->read_poll ? af_xdp_iothread_poll : NULL,
+                           s->xsk);
+    } else {
+        qemu_net_set_fd_handler(&s->nc, s->xsk->fd,
+                                s->read_poll ? af_xdp_main_loop_read : NULL,
+                                s->write_poll ? af_xdp_writable : NULL,
+                                s);
+    }
+}
+
+static void af_xdp_read_poll(AFXDPState *s, bool enable)
+{
+    if (s->read_poll != enable) {
+        s->read_poll = enable;
+        af_xdp_update_fd_handler(s);
+    }
+}
+
+static void af_xdp_write_poll(AFXDPState *s, bool enable)
+{
+    if (s->write_poll != enable) {
+        s->write_poll = enable;
+        af_xdp_update_fd_handler(s);
+    }
+}
+
+static void af_xdp_poll(NetClientState *nc, bool enable)
+{
+    AFXDPState *s = DO_UPCAST(AFXDPState, nc, nc);
+
+    if (s->read_poll != enable || s->write_poll != enable) {
+        s->read_poll = enable;
+        s->write_poll = enable;
+        af_xdp_update_fd_handler(s);
+    }
+}
+
+/*
+ * Let the NIC run the handlers in its own AioContext.  With an IOThread of
+ * its own the backend already hands packets over under the BQL.
+ */
+static bool af_xdp_set_aio_context(NetClientState *nc, AioContext *ctx)
+{
+    AFXDPState *s = DO_UPCAST(AFXDPState, nc, nc);
+
+    if (s->iothread) {
+        return false;
+    }
+
+    qemu_net_set_fd_handler(nc, s->xsk->fd, NULL, NULL, NULL);
+    nc->ctx = ctx;
+    af_xdp_update_fd_handler(s);
+    return true;
+}
+
+/* Move the frames the kernel has finished transmitting to the free list */
+static void af_xdp_complete_tx(AFXDPSocket *xsk)
+{
+    uint64_t *descs = xsk->comp.descs;
+    uint32_t n, i;
+
+    n = af_xdp_cons_peek(&xsk->comp, AF_XDP_RING_SIZE);
+    for (i = 0; i < n; i++) {
+        xsk->free_frames[xsk->n_free_frames++] =
+            descs[(xsk->comp.cached_cons + i) & AF_XDP_RING_MASK];
+    }
+    af_xdp_cons_release(&xsk->comp, n);
+}
+
+static void af_xdp_kick_tx(AFXDPSocket *xsk)
+{
+    if (af_xdp_need_wakeup(&xsk->tx)) {
+        /* EAGAIN, EBUSY and ENOBUFS only mean that the kernel is busy */
+        sendto(xsk->fd, NULL, 0, MSG_DONTWAIT, NULL, 0);
+    }
+}
+
+static void af_xdp_writable(void *opaque)
+{
+    AFXDPState *s = opaque;
+
+    qemu_net_client_acquire(&s->nc);
+    af_xdp_write_poll(s, false);
+    af_xdp_complete_tx(s->xsk);
+    qemu_flush_queued_packets(&s->nc);
+    qemu_net_client_release(&s->nc);
+}
+
+static ssize_t af_xdp_receive_iov(NetClientState *nc,
+                                  const struct iovec *iov, int iovcnt)
+{
+    AFXDPState *s = DO_UPCAST(AFXDPState, nc, nc);
+    AFXDPSocket *xsk = s->xsk;
+    struct xdp_desc *desc;
+    size_t size = iov_size(iov, iovcnt);
+    uint64_t addr;
+
+    if (size > AF_XDP_FRAME_SIZE) {
+        /* AF_XDP has no multi-buffer frames, drop what does not fit */
+        return size;
+    }
+
+    if (!xsk->n_free_frames || !af_xdp_prod_space(&xsk->tx)) {
+        af_xdp_complete_tx(xsk);
+    }
+    if (!xsk->n_free_frames || !af_xdp_prod_space(&xsk->tx)) {
+        /* Out of frames or slots, retry when the kernel caught up */
+        af_xdp_kick_tx(xsk);
+        af_xdp_write_poll(s, true);
+        return 0;
+    }
+
+    addr = xsk->free_frames[--xsk->n_free_frames];
+    iov_to_buf(iov, iovcnt, 0, xsk->umem + addr, size);
+
+    desc = xsk->tx.descs;
+    desc += xsk->tx.cached_prod & AF_XDP_RING_MASK;
+    desc->addr = addr;
+    desc->len = size;
+    desc->options = 0;
+    af_xdp_prod_submit(&xsk->tx, 1);
+    af_xdp_kick_tx(xsk);
+
+    return size;
+}
+
+static ssize_t af_xdp_receive(NetClientState *nc,
+                              const uint8_t *buf, size_t size)
+{
+    struct iovec iov = {
+        .iov_base = (void *)buf,
+        .iov_len = size,
+    };
+
+    return af_xdp_receive_iov(nc, &iov, 1);
+}
+
+static void af_xdp_send_completed(NetClientState *nc, ssize_t len)
+{
+    AFXDPState *s = DO_UPCAST(AFXDPState, nc, nc);
+
+    af_xdp_read_poll(s, true);
+}
+
+/*
+ * Hand received packets to the peer.  The peer either copies a packet or
+ * queues a copy of it, so every frame goes back to the fill ring at once.
+ */
+static void af_xdp_send(AFXDPState *s)
+{
+    AFXDPSocket *xsk = s->xsk;
+    struct xdp_desc *descs = xsk->rx.descs;
+    uint64_t *fill = xsk->fill.descs;
+    uint32_t n, i;
+
+    n = af_xdp_cons_peek(&xsk->rx, AF_XDP_RX_BUDGET);
+    if (!n) {
+        goto out;
+    }
+
+    qemu_send_batch_begin(&s->nc);
+    for (i = 0; i < n; i++) {
+        struct xdp_desc *desc =
+            &descs[(xsk->rx.cached_cons + i) & AF_XDP_RING_MASK];
+        ssize_t ret;
+
+        ret = qemu_send_packet_async(&s->nc, xsk->umem + desc->addr,
+                                     desc->len, af_xdp_send_completed);
+
+        /* The fill ring has room for every frame that is not in it */
+        fill[(xsk->fill.cached_prod + i) & AF_XDP_RING_MASK] =
+            desc->addr - desc->addr % AF_XDP_FRAME_SIZE;
+
+        if (ret == 0) {
+            /* The packet was queued, stop until the peer drains it */
+            af_xdp_read_poll(s, false);
+            i++;
+            break;
+        }
+    }
+    qemu_send_batch_end(&s->nc);
+
+    af_xdp_cons_release(&xsk->rx, i);
+    af_xdp_prod_submit(&xsk->fill, i);
+
+out:
+    if (af_xdp_need_wakeup(&xsk->fill)) {
+        recvfrom(xsk->fd, NULL, 0, MSG_DONTWAIT, NULL, NULL);
+    }
+}
+
+static void af_xdp_socket_free(AFXDPSocket *xsk)
+{
+    AFXDPRing *rings[] = { &xsk->rx, &xsk->tx, &xsk->fill, &xsk->comp };
+    int i;
+
+    for (i = 0; i < ARRAY_SIZE(rings); i++) {
+        if (rings[i]->map) {
+            munmap(rings[i]->map, rings[i]->map_size);
+        }
+    }
+    if (xsk->fd >= 0) {
+        close(xsk->fd);
+    }
+    if (xsk->umem) {
+        munmap(xsk->umem, (size_t)AF_XDP_NUM_FRAMES * AF_XDP_FRAME_SIZE);
+    }
+    g_free(xsk);
+}
+
+static void af_xdp_socket_free_bh(void *opaque)
+{
+    af_xdp_socket_free(opaque);
+}
+
+static bool af_xdp_ring_map(AFXDPSocket *xsk, AFXDPRing *r,
+                            const struct xdp_ring_offset *off,
+                            size_t desc_size, off_t pgoff, Error **errp)
+{
+    r->map_size = off->desc + AF_XDP_RING_SIZE * desc_size;
+    r->map = mmap(NULL, r->map_size, PROT_READ | PROT_WRITE,
+                  MAP_SHARED | MAP_POPULATE, xsk->fd, pgoff);
+    if (r->map == MAP_FAILED) {
+        r->map = NULL;
+        error_setg_errno(errp, errno, "failed to map AF_XDP ring");
+        return false;
+    }
+
+    r->producer = r->map + off->producer;
+    r->consumer = r->map + off->consumer;
+    r->flags = r->map + off->flags;
+    r->descs = r->map + off->desc;
+    r->cached_prod = *r->producer;
+    r->cached_cons = *r->consumer;
+    return true;
+}
+
+static AFXDPSocket *af_xdp_socket_create(AFXDPState *s, int ifindex,
+                                         const NetdevAFXDPOptions *opts,
+                                         Error **errp)
+{
+    AFXDPSocket *xsk = g_new0(AFXDPSocket, 1);
+    struct xdp_umem_reg umem_reg = {};
+    struct xdp_mmap_offsets off;
+    struct sockaddr_xdp sxdp = {};
+    socklen_t optlen = sizeof(off);
+    int ring_size = AF_XDP_RING_SIZE;
+    uint64_t *fill;
+    int i;
+
+    xsk->s = s;
+    xsk->fd = socket(AF_XDP, SOCK_RAW | SOCK_CLOEXEC, 0);
+    if (xsk->fd < 0) {
+        error_setg_errno(errp, errno, "failed to create AF_XDP socket");
+        goto fail;
+    }
+
+    xsk->umem = mmap(NULL, (size_t)AF_XDP_NUM_FRAMES * AF_XDP_FRAME_SIZE,
+                     PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS,
+                     -1, 0);
+    if (xsk->umem == MAP_FAILED) {
+        xsk->umem = NULL;
+        error_setg_errno(errp, errno, "failed to allocate AF_XDP UMEM");
+        goto fail;
+    }
+
+    umem_reg.addr = (uintptr_t)xsk->umem;
+    umem_reg.len = (uint64_t)AF_XDP_NUM_FRAMES * AF_XDP_FRAME_SIZE;
+    umem_reg.chunk_size = AF_XDP_FRAME_SIZE;
+    if (setsockopt(xsk->fd, SOL_XDP, XDP_UMEM_REG,
+                   &umem_reg, sizeof(umem_reg)) ||
+        setsockopt(xsk->fd, SOL_XDP, XDP_UMEM_FILL_RING,
+                   &ring_size, sizeof(ring_size)) ||
+        setsockopt(xsk->fd, SOL_XDP, XDP_UMEM_COMPLETION_RING,
+                   &ring_size, sizeof(ring_size)) ||
+        setsockopt(xsk->fd, SOL_XDP, XDP_RX_RING,
+                   &ring_size, sizeof(ring_size)) ||
+        setsockopt(xsk->fd, SOL_XDP, XDP_TX_RING,
+                   &ring_size, sizeof(ring_size))) {
+        error_setg_errno(errp, errno, "failed to set up AF_XDP UMEM");
+        goto fail;
+    }
+
+    if (getsockopt(xsk->fd, SOL_XDP, XDP_MMAP_OFFSETS, &off, &optlen)) {
+        error_setg_errno(errp, errno, "failed to get AF_XDP ring offsets");
+        goto fail;
+    }
+
+    if (!af_xdp_ring_map(xsk, &xsk->rx, &off.rx, sizeof(struct xdp_desc),
+                         XDP_PGOFF_RX_RING, errp) ||
+        !af_xdp_ring_map(xsk, &xsk->tx, &off.tx, sizeof(struct xdp_desc),
+                         XDP_PGOFF_TX_RING, errp) ||
+        !af_xdp_ring_map(xsk, &xsk->fill, &off.fr, sizeof(uint64_t),
+                         XDP_UMEM_PGOFF_FILL_RING, errp) ||
+        !af_xdp_ring_map(xsk, &xsk->comp, &off.cr, sizeof(uint64_t),
+                         XDP_UMEM_PGOFF_COMPLETION_RING, errp)) {
+        goto fail;
+    }
+
+    /* The first half of the frames is for receive, the rest for transmit */
+    fill = xsk->fill.descs;
+    for (i = 0; i < AF_XDP_RING_SIZE; i++) {
+        fill[i] = (uint64_t)i * AF_XDP_FRAME_SIZE;
+        xsk->free_frames[i] = (uint64_t)(AF_XDP_RING_SIZE + i) *
+                              AF_XDP_FRAME_SIZE;
+    }
+    xsk->n_free_frames = AF_XDP_RING_SIZE;
+    af_xdp_prod_submit(&xsk->fill, AF_XDP_RING_SIZE);
+
+    if (opts->has_busy_budget && opts->busy_budget) {
+        int value = 1;
+
+        if (setsockopt(xsk->fd, SOL_SOCKET, SO_PREFER_BUSY_POLL,
+                       &value, sizeof(value))) {
+            error_setg_errno(errp, errno, "failed to set SO_PREFER_BUSY_POLL");
+            goto fail;
+        }
+        value = AF_XDP_BUSY_POLL_USECS;
+        if (setsockopt(xsk->fd, SOL_SOCKET, SO_BUSY_POLL,
+                       &value, sizeof(value))) {
+            error_setg_errno(errp, errno, "failed to set SO_BUSY_POLL");
+            goto fail;
+        }
+        value = opts->busy_budget;
+        if (setsockopt(xsk->fd, SOL_SOCKET, SO_BUSY_POLL_BUDGET,
+                       &value, sizeof(value))) {
+            error_setg_errno(errp, errno, "failed to set SO_BUSY_POLL_BUDGET");
+            goto fail;
+        }
+    }
+
+    /* Without XDP_COPY the kernel uses zero-copy if the driver has it */
+    sxdp.sxdp_family = AF_XDP;
+    sxdp.sxdp_ifindex = ifindex;
+    sxdp.sxdp_queue_id = s->queue_id;
+    sxdp.sxdp_flags = XDP_USE_NEED_WAKEUP;
+    if (opts->has_force_copy && opts->force_copy) {
+        sxdp.sxdp_flags |= XDP_COPY;
+    }
+    if (bind(xsk->fd, (struct sockaddr *)&sxdp, sizeof(sxdp))) {
+        error_setg_errno(errp, errno, "failed to bind AF_XDP socket to "
+                         "queue %d of '%s'", s->queue_id, s->ifname);
+        goto fail;
+    }
+
+    return xsk;
+
+fail:
+    af_xdp_socket_free(xsk);
+    return NULL;
+}
+
+/* Attach @prog_fd as the XDP program of @ifindex, or detach it if -1 */
+static int af_xdp_set_link_xdp_fd(int ifindex, int prog_fd, uint32_t flags)
+{
+    struct {
+        struct nlmsghdr nh;
+        struct ifinfomsg ifinfo;
+        char attrbuf[64];
+    } req;
+    struct {
+        struct nlmsghdr nh;
+        struct nlmsgerr err;
+        char payload[256];
+    } resp;
+    struct nlattr *nla, *attr;
+    int sock, ret;
+
+    sock = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_ROUTE);
+    if (sock < 0) {
+        return -errno;
+    }
+
+    memset(&req, 0, sizeof(req));
+    req.nh.nlmsg_len = NLMSG_LENGTH(sizeof(struct ifinfomsg));
+    req.nh.nlmsg_flags = NLM_F_REQUEST | NLM_F_ACK;
+    req.nh.nlmsg_type = RTM_SETLINK;
+    req.ifinfo.ifi_family = AF_UNSPEC;
+    req.ifinfo.ifi_index = ifindex;
+
+    nla = (void *)&req + NLMSG_ALIGN(req.nh.nlmsg_len);
+    nla->nla_type = NLA_F_NESTED | IFLA_XDP;
+    nla->nla_len = NLA_HDRLEN;
+
+    attr = (void *)nla + nla->nla_len;
+    attr->nla_type = IFLA_XDP_FD;
+    attr->nla_len = NLA_HDRLEN + sizeof(int32_t);
+    memcpy((void *)attr + NLA_HDRLEN, &prog_fd, sizeof(int32_t));
+    nla->nla_len += NLA_ALIGN(attr->nla_len);
+
+    attr = (void *)nla + nla->nla_len;
+    attr->nla_type = IFLA_XDP_FLAGS;
+    attr->nla_len = NLA_HDRLEN + sizeof(uint32_t);
+    memcpy((void *)attr + NLA_HDRLEN, &flags, sizeof(uint32_t));
+    nla->nla_len += NLA_ALIGN(attr->nla_len);
+
+    req.nh.nlmsg_len += NLA_ALIGN(nla->nla_len);
+
+    if (send(sock, &req, req.nh.nlmsg_len, 0) < 0) {
+        ret = -errno;
+        goto out;
+    }
+
+    ret = recv(sock, &resp, sizeof(resp), 0);
+    if (ret < 0) {
+        ret = -errno;
+    } else if (ret < NLMSG_LENGTH(sizeof(struct nlmsgerr)) ||
+               resp.nh.nlmsg_type != NLMSG_ERROR) {
+        ret = -EPROTO;
+    } else {
+        ret = resp.err.error;
+    }
+
+out:
+    close(sock);
+    return ret;
+}
+
+/*
+ * xdp_md->rx_queue_index is the key into the socket map; packets for
+ * queues without a socket are passed to the kernel stack.
+ */
+static int af_xdp_load_program(int map_fd)
+{
+    struct bpf_insn insns[] = {
+        {
+            .code = BPF_LDX | BPF_W | BPF_MEM,
+            .dst_reg = BPF_REG_2, .src_reg = BPF_REG_1,
+            .off = offsetof(struct xdp_md, rx_queue_index),
+        }, {
+            .code = BPF_LD | BPF_DW | BPF_IMM,
+            .dst_reg = BPF_REG_1, .src_reg = BPF_PSEUDO_MAP_FD,
+            .imm = map_fd,
+        }, {
+            .code = 0,
+        }, {
+            .code = BPF_ALU64 | BPF_MOV | BPF_K,
+            .dst_reg = BPF_REG_3, .imm = XDP_PASS,
+        }, {
+            .code = BPF_JMP | BPF_CALL, .imm = BPF_FUNC_redirect_map,
+        }, {
+            .code = BPF_JMP | BPF_EXIT,
+        },
+    };
+    union bpf_attr attr;
+
+    memset(&attr, 0, sizeof(attr));
+    attr.prog_type = BPF_PROG_TYPE_XDP;
+    attr.insns = (uintptr_t)insns;
+    attr.insn_cnt = ARRAY_SIZE(insns);
+    attr.license = (uintptr_t)"GPL";
+    return af_xdp_bpf(BPF_PROG_LOAD, &attr);
+}
+
+static bool af_xdp_program_attach(AFXDPProgram *prog, AFXDPState **states,
+                                  int queues, const NetdevAFXDPOptions *opts,
+                                  Error **errp)
+{
+    static const uint32_t modes[] = {
+        [AFXDP_MODE_NATIVE] = XDP_FLAGS_DRV_MODE,
+        [AFXDP_MODE_SKB] = XDP_FLAGS_SKB_MODE,
+    };
+    union bpf_attr attr;
+    int i, ret;
+
+    memset(&attr, 0, sizeof(attr));
+    attr.map_type = BPF_MAP_TYPE_XSKMAP;
+    attr.key_size = sizeof(uint32_t);
+    attr.value_size = sizeof(uint32_t);
+    attr.max_entries = states[queues - 1]->queue_id + 1;
+    prog->map_fd = af_xdp_bpf(BPF_MAP_CREATE, &attr);
+    if (prog->map_fd < 0) {
+        error_setg_errno(errp, errno, "failed to create XDP socket map");
+        return false;
+    }
+
+    for (i = 0; i < queues; i++) {
+        uint32_t key = states[i]->queue_id;
+        uint32_t value = states[i]->xsk->fd;
+
+        memset(&attr, 0, sizeof(attr));
+        attr.map_fd = prog->map_fd;
+        attr.key = (uintptr_t)&key;
+        attr.value = (uintptr_t)&value;
+        if (af_xdp_bpf(BPF_MAP_UPDATE_ELEM, &attr)) {
+            error_setg_errno(errp, errno, "failed to add AF_XDP socket "
+                             "to the XDP socket map");
+            return false;
+        }
+    }
+
+    prog->prog_fd = af_xdp_load_program(prog->map_fd);
+    if (prog->prog_fd < 0) {
+        error_setg_errno(errp, errno, "failed to load XDP program");
+        return false;
+    }
+
+    if (opts->has_mode) {
+        prog->xdp_flags = modes[opts->mode];
+        ret = af_xdp_set_link_xdp_fd(prog->ifindex, prog->prog_fd,
+                                     prog->xdp_flags |
+                                     XDP_FLAGS_UPDATE_IF_NOEXIST);
+    } else {
+        /* Best effort: native mode if the driver supports it */
+        prog->xdp_flags = XDP_FLAGS_DRV_MODE;
+        ret = af_xdp_set_link_xdp_fd(prog->ifindex, prog->prog_fd,
+                                     prog->xdp_flags |
+                                     XDP_FLAGS_UPDATE_IF_NOEXIST);
+        if (ret < 0 && ret != -EBUSY && ret != -EEXIST) {
+            prog->xdp_flags = XDP_FLAGS_SKB_MODE;
+            ret = af_xdp_set_link_xdp_fd(prog->ifindex, prog->prog_fd,
+                                         prog->xdp_flags |
+                                         XDP_FLAGS_UPDATE_IF_NOEXIST);
+        }
+    }
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "failed to attach XDP program to '%s'",
+                         opts->ifname);
+        return false;
+    }
+
+    prog->attached = true;
+    return true;
+}
+
+static void af_xdp_program_unref(AFXDPProgram *prog)
+{
+    if (--prog->refcnt) {
+        return;
+    }
+
+    if (prog->attached) {
+        af_xdp_set_link_xdp_fd(prog->ifindex, -1, prog->xdp_flags);
+    }
+    if (prog->prog_fd >= 0) {
+        close(prog->prog_fd);
+    }
+    if (prog->map_fd >= 0) {
+        close(prog->map_fd);
+    }
+    g_free(prog);
+}
+
+static void af_xdp_cleanup(NetClientState *nc)
+{
+    AFXDPState *s = DO_UPCAST(AFXDPState, nc, nc);
+
+    qemu_purge_queued_packets(nc);
+
+    if (s->xsk) {
+        af_xdp_poll(nc, false);
+        s->xsk->s = NULL;
+        if (s->ctx) {
+            /* A handler may be waiting for the BQL; free after it ran */
+            aio_bh_schedule_oneshot(s->ctx, af_xdp_socket_free_bh, s->xsk);
+        } else {
+            af_xdp_socket_free(s->xsk);
+        }
+        s->xsk = NULL;
+    }
+
+    if (s->iothread) {
+        object_unref(OBJECT(s->iothread));
+        s->iothread = NULL;
+        s->ctx = NULL;
+    }
+
+    if (s->prog) {
+        af_xdp_program_unref(s->prog);
+        s->prog = NULL;
+    }
+}
+
+static NetClientInfo net_af_xdp_info = {
+    .type = NET_CLIENT_DRIVER_AF_XDP,
+    .size = sizeof(AFXDPState),
+    .receive = af_xdp_receive,
+    .receive_iov = af_xdp_receive_iov,
+    .poll = af_xdp_poll,
+    .cleanup = af_xdp_cleanup,
+    .set_aio_context = af_xdp_set_aio_context,
+};
+
+int net_init_af_xdp(const Netdev *netdev,
+                    const char *name, NetClientState *peer, Error **errp)
+{
+    const NetdevAFXDPOptions *opts = &netdev->u.af_xdp;
+    g_autofree AFXDPState **states = NULL;
+    NetClientState *nc, *nc0 = NULL;
+    IOThread *iothread = NULL;
+    AFXDPProgram *prog;
+    int ifindex, queues, start_queue, i;
+
+    ifindex = if_nametoindex(opts->ifname);
+    if (!ifindex) {
+        error_setg_errno(errp, errno, "failed to get ifindex for '%s'",
+                         opts->ifname);
+        return -1;
+    }
+
+    if (opts->has_queues &&
+        (opts->queues < 1 || opts->queues > MAX_QUEUE_NUM)) {
+        error_setg(errp, "invalid number of queues (%" PRId64 ") for '%s'",
+                   opts->queues, opts->ifname);
+        return -1;
+    }
+    queues = opts->has_queues ? opts->queues : 1;
+
+    if (opts->has_start_queue &&
+        (opts->start_queue < 0 || opts->start_queue > INT_MAX - queues)) {
+        error_setg(errp, "invalid start queue (%" PRId64 ") for '%s'",
+                   opts->start_queue, opts->ifname);
+        return -1;
+    }
+    start_queue = opts->has_start_queue ? opts->start_queue : 0;
+
+    if (opts->has_busy_budget &&
+        (opts->busy_budget < 0 || opts->busy_budget > UINT16_MAX)) {
+        error_setg(errp, "invalid busy budget (%" PRId64 ")",
+                   opts->busy_budget);
+        return -1;
+    }
+
+    if (opts->has_iothread) {
+        iothread = iothread_by_id(opts->iothread);
+        if (!iothread) {
+            error_setg(errp, "IOThread '%s' not found", opts->iothread);
+            return -1;
+        }
+    }
+
+    prog = g_new0(AFXDPProgram, 1);
+    prog->ifindex = ifindex;
+    prog->prog_fd = -1;
+    prog->map_fd = -1;
+
+    states = g_new0(AFXDPState *, queues);
+    for (i = 0; i < queues; i++) {
+        AFXDPState *s;
+
+        nc = qemu_new_net_client(&net_af_xdp_info, peer, "af-xdp", name);
+        if (!nc0) {
+            nc0 = nc;
+        }
+
+        s = DO_UPCAST(AFXDPState, nc, nc);
+        pstrcpy(s->ifname, sizeof(s->ifname), opts->ifname);
+        s->queue_id = start_queue + i;
+        s->prog = prog;
+        prog->refcnt++;
+        if (iothread) {
+            s->iothread = iothread;
+            object_ref(OBJECT(iothread));
+            s->ctx = iothread_get_aio_context(iothread);
+        }
+        snprintf(nc->info_str, sizeof(nc->info_str),
+                 "af-xdp%d to %s", s->queue_id, s->ifname);
+
+        s->xsk = af_xdp_socket_create(s, ifindex, opts, errp);
+        if (!s->xsk) {
+            goto err;
+        }
+        states[i] = s;
+    }
+
+    if (!af_xdp_program_attach(prog, states, queues, opts, errp)) {
+        goto err;
+    }
+
+    for (i = 0; i < queues; i++) {
+        af_xdp_read_poll(states[i], true);
+    }
+
+    return 0;
+
+err:
+    qemu_del_net_client(nc0);
+    return -1;
+}
@@ -31,6 +31,7 @@
 #include "migration/colo.h"
 #include "migration/migration.h"
 #include "util.h"
+#include "qemu/stats64.h"
 
 #include "block/aio-wait.h"
 #include "qemu/coroutine.h"
@@ -138,6 +139,12 @@ struct CompareState {
     QEMUBH *event_bh;
     enum colo_event event;
 
+    /* A checkpoint was requested and has not been done yet */
+    bool checkpoint_pending;
+    int64_t checkpoint_request_ms;
+    Stat64 checkpoint_requests;
+    Stat64 checkpoint_requests_merged;
+
     QTAILQ_ENTRY(CompareState) next;
 };
 
@@ -184,8 +191,29 @@ static void notify_remote_frame(CompareState *s)
     }
 }
 
-static void colo_compare_inconsistency_notify(CompareState *s)
+/*
+ * One checkpoint resynchronizes every connection, so while a request
+ * is outstanding further miscompares are merged into it.  The request
+ * is repeated if the checkpoint has not happened within a scan cycle.
+ */
+static void colo_compare_inconsistency_notify(CompareState *s,
+                                              const char *reason)
 {
+    int64_t now = qemu_clock_get_ms(QEMU_CLOCK_HOST);
+
+    if (s->checkpoint_pending &&
+        now - s->checkpoint_request_ms < s->expired_scan_cycle) {
+        stat64_add(&s->checkpoint_requests_merged, 1);
+        return;
+    }
+
+    s->checkpoint_pending = true;
+    s->checkpoint_request_ms = now;
+    stat64_add(&s->checkpoint_requests, 1);
+    trace_colo_compare_checkpoint_request(reason,
+                        stat64_get(&s->checkpoint_requests),
+                        stat64_get(&s->checkpoint_requests_merged));
+
     if (s->notify_dev) {
         notify_remote_frame(s);
     } else {
@@ -238,6 +266,48 @@ static int colo_insert_packet(GQueue *queue, Packet *pkt, uint32_t *max_ack)
     return 0;
 }
 
+static uint32_t colo_digest(const uint8_t *buf, size_t len)
+{
+    uint64_t h = 0xcbf29ce484222325ULL;
+
+    /* FNV-1a over 64-bit words; every step is a bijection */
+    for (; len >= 8; buf += 8, len -= 8) {
+        h = (h ^ ldq_he_p(buf)) * 0x100000001b3ULL;
+    }
+    for (; len; buf++, len--) {
+        h = (h ^ *buf) * 0x100000001b3ULL;
+    }
+
+    return h ^ (h >> 32);
+}
+
+/*
+ * Hash the part of the packet that the compare functions look at, so
+ * that different packets can be told apart without a memcmp().  Equal
+ * digests still need a full comparison.
+ */
+static void colo_packet_fill_digest(Packet *pkt)
+{
+    int offset;
+
+    switch (pkt->ip->ip_p) {
+    case IPPROTO_TCP:
+        offset = pkt->header_size;
+        break;
+    case IPPROTO_UDP:
+    case IPPROTO_ICMP:
+        offset = (pkt->ip->ip_hl << 2) + ETH_HLEN + pkt->vnet_hdr_len;
+        break;
+    default:
+        offset = pkt->vnet_hdr_len;
+        break;
+    }
+
+    offset = MIN(offset, pkt->size);
+    pkt->digest = colo_digest((uint8_t *)pkt->data + offset,
+                              pkt->size - offset);
+}
+
 /*
  * Return 0 on success, if return -1 means the pkt
  * is unsupported(arp and ipv6) and will be sent later
@@ -286,6 +356,8 @@ static int packet_enqueue(CompareState *s, int mode, Connection **con)
             "queue size too big, drop packet");
         packet_destroy(pkt, NULL);
         pkt = NULL;
+    } else {
+        colo_packet_fill_digest(pkt);
     }
 
     *con = conn;
@@ -355,6 +427,13 @@ static bool colo_mark_tcp_pkt(Packet *ppkt, Packet *spkt,
     *mark = 0;
 
     if (ppkt->tcp_seq == spkt->tcp_seq && ppkt->seq_end == spkt->seq_end) {
+        /*
+         * With nothing consumed yet the digests cover exactly the
+         * payloads compared here and below, so they can't match.
+         */
+        if (!ppkt->offset && !spkt->offset && ppkt->digest != spkt->digest) {
+            return false;
+        }
         if (!colo_compare_packet_payload(ppkt, spkt,
                                         ppkt->header_size, spkt->header_size,
                                         ppkt->payload_size)) {
@@ -496,7 +575,7 @@ sec:
         qemu_hexdump(stderr, "colo-compare spkt", spkt->data, spkt->size);
 #endif
 
-        colo_compare_inconsistency_notify(s);
+        colo_compare_inconsistency_notify(s, "tcp miscompare");
     }
 }
 
@@ -526,7 +605,8 @@ static int colo_packet_compare_udp(Packet *spkt, Packet *ppkt)
         trace_colo_compare_main("UDP: payload size of packets are different");
         return -1;
     }
-    if (colo_compare_packet_payload(ppkt, spkt, offset, offset,
+    if (ppkt->digest != spkt->digest ||
+        colo_compare_packet_payload(ppkt, spkt, offset, offset,
                                     ppkt->size - offset)) {
         trace_colo_compare_udp_miscompare("primary pkt size", ppkt->size);
         trace_colo_compare_udp_miscompare("Secondary pkt size", spkt->size);
@@ -565,7 +645,8 @@ static int colo_packet_compare_icmp(Packet *spkt, Packet *ppkt)
         trace_colo_compare_main("ICMP: payload size of packets are different");
         return -1;
     }
-    if (colo_compare_packet_payload(ppkt, spkt, offset, offset,
+    if (ppkt->digest != spkt->digest ||
+        colo_compare_packet_payload(ppkt, spkt, offset, offset,
                                     ppkt->size - offset)) {
         trace_colo_compare_icmp_miscompare("primary pkt size",
                                            ppkt->size);
@@ -607,6 +688,9 @@ static int colo_packet_compare_other(Packet *spkt, Packet *ppkt)
         trace_colo_compare_main("Other: payload size of packets are different");
         return -1;
     }
+    if (ppkt->digest != spkt->digest) {
+        return -1;
+    }
     return colo_compare_packet_payload(ppkt, spkt, offset, offset,
                                        ppkt->size - offset);
 }
@@ -654,7 +738,7 @@ static int colo_old_packet_check_one_conn(Connection *conn,
 
 out:
     /* Do checkpoint will flush old packet */
-    colo_compare_inconsistency_notify(s);
+    colo_compare_inconsistency_notify(s, "packet timeout");
     return 0;
 }
 
@@ -701,7 +785,7 @@ static void colo_compare_packet(CompareState *s, Connection *conn,
             trace_colo_compare_main("packet different");
             g_queue_push_head(&conn->primary_list, pkt);
 
-            colo_compare_inconsistency_notify(s);
+            colo_compare_inconsistency_notify(s, "packet miscompare");
             break;
         }
     }
@@ -965,8 +1049,10 @@ static void colo_compare_handle_event(void *opaque)
     switch (s->event) {
     case COLO_EVENT_CHECKPOINT:
         g_queue_foreach(&s->conn_list, colo_flush_packets, s);
+        s->checkpoint_pending = false;
         break;
     case COLO_EVENT_FAILOVER:
+        s->checkpoint_pending = false;
         break;
     default:
         break;
@@ -1164,6 +1250,26 @@ out:
     error_propagate(errp, local_err);
 }
 
+static void compare_get_checkpoint_requests(Object *obj, Visitor *v,
+                                           const char *name, void *opaque,
+                                           Error **errp)
+{
+    CompareState *s = COLO_COMPARE(obj);
+    uint64_t value = stat64_get(&s->checkpoint_requests);
+
+    visit_type_uint64(v, name, &value, errp);
+}
+
+static void compare_get_checkpoint_requests_merged(Object *obj, Visitor *v,
+                                                  const char *name,
+                                                  void *opaque, Error **errp)
+{
+    CompareState *s = COLO_COMPARE(obj);
+    uint64_t value = stat64_get(&s->checkpoint_requests_merged);
+
+    visit_type_uint64(v, name, &value, errp);
+}
+
 static void compare_pri_rs_finalize(SocketReadState *pri_rs)
 {
     CompareState *s = container_of(pri_rs, CompareState, pri_rs);
@@ -1215,6 +1321,7 @@ static void compare_notify_rs_finalize(SocketReadState *notify_rs)
                                   notify_rs->packet_len)) {
         /* colo-compare do checkpoint, flush pri packet and remove sec packet */
         g_queue_foreach(&s->conn_list, colo_flush_packets, s);
+        s->checkpoint_pending = false;
     } else {
         error_report("COLO compare got unsupported instruction");
     }
@@ -1412,6 +1519,14 @@ static void colo_compare_init(Object *obj)
     s->vnet_hdr = false;
     object_property_add_bool(obj, "vnet_hdr_support", compare_get_vnet_hdr,
                              compare_set_vnet_hdr);
+
+    /* Statistics, read-only */
+    object_property_add(obj, "checkpoint_requests", "uint64",
+                        compare_get_checkpoint_requests,
+                        NULL, NULL, NULL);
+    object_property_add(obj, "checkpoint_requests_merged", "uint64",
+                        compare_get_checkpoint_requests_merged,
+                        NULL, NULL, NULL);
 }
 
 static void colo_compare_finalize(Object *obj)
@@ -170,6 +170,7 @@ Packet *packet_new(const void *data, int size, int vnet_hdr_len)
     pkt->payload_size = 0;
     pkt->offset = 0;
     pkt->flags = 0;
+    pkt->digest = 0;
 
     return pkt;
 }
@@ -54,6 +54,8 @@ typedef struct Packet {
     /* record the payload offset(the length that has been compared) */
     uint16_t offset;
     uint8_t flags; /* Flags(aka Control bits) */
+    /* digest of the compared part of the packet, filled by colo-compare */
+    uint32_t digest;
 } Packet;
 
 typedef struct ConnectionKey {
@@ -0,0 +1,710 @@
+/*
+ * Software TCP receive coalescing (GRO/LRO) for emulated NICs
+ *
+ * Consecutive in-order TCP segments of the same flow are merged into one
+ * large frame before they reach the guest, so that the guest takes one
+ * interrupt and walks its stack once per burst instead of once per wire
+ * packet.  Originally written as the RSC implementation of virtio-net.
+ *
+ * Copyright IBM, Corp. 2007
+ *
+ * Authors:
+ *  Anthony Liguori   <aliguori@us.ibm.com>
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "net/gro.h"
+#include "net/checksum.h"
+#include "qemu/timer.h"
+
+#define NET_GRO_IP4_ADDR_SIZE   8        /* ipv4 saddr + daddr */
+#define NET_GRO_IP6_ADDR_SIZE   32       /* ipv6 saddr + daddr */
+
+#define NET_GRO_TCP_FLAG        0x3F
+#define NET_GRO_TCP_HDR_LENGTH  0xF000
+
+/* header length value in ip header without option */
+#define NET_GRO_IP4_HEADER_LENGTH 5
+
+/* Coalesced packets type & status */
+typedef enum {
+    GRO_COALESCE,           /* Data been coalesced */
+    GRO_FINAL,              /* Will terminate current connection */
+    GRO_NO_MATCH,           /* No matched in the buffer pool */
+    GRO_BYPASS,             /* Packet to be bypass, not tcp, tcp ctrl, etc */
+    GRO_CANDIDATE           /* Data want to be coalesced */
+} CoalesceStatus;
+
+/* Chain is divided by protocol (ipv4/v6) */
+typedef struct NetGROChain {
+    QTAILQ_ENTRY(NetGROChain) next;
+    NetGRO *gro;
+    uint16_t proto;
+    uint16_t max_payload;
+    QEMUTimer *drain_timer;
+    QTAILQ_HEAD(, NetGROSegment) buffers;
+    NetGROStat stat;
+} NetGROChain;
+
+struct NetGRO {
+    NetGRODeliver *deliver;
+    void *opaque;
+    AioContext *ctx;
+    uint32_t timeout;
+    bool ipv4;
+    bool ipv6;
+    size_t hdr_len;         /* of the packet being received */
+    QTAILQ_HEAD(, NetGROChain) chains;
+};
+
+static ssize_t net_gro_deliver(NetGRO *gro, NetClientState *nc,
+                               const uint8_t *buf, size_t size)
+{
+    return gro->deliver(gro->opaque, nc, buf, size, NULL);
+}
+
+static void net_gro_extract_unit4(const uint8_t *buf, size_t hdr_len,
+                                  NetGROUnit *unit)
+{
+    uint16_t ip_hdrlen;
+    struct ip_header *ip;
+
+    ip = (struct ip_header *)(buf + hdr_len + sizeof(struct eth_header));
+    unit->ip = (void *)ip;
+    ip_hdrlen = (ip->ip_ver_len & 0xF) << 2;
+    unit->ip_plen = &ip->ip_len;
+    unit->tcp = (struct tcp_header *)(((uint8_t *)unit->ip) + ip_hdrlen);
+    unit->tcp_hdrlen = (htons(unit->tcp->th_offset_flags) & 0xF000) >> 10;
+    unit->payload = htons(*unit->ip_plen) - ip_hdrlen - unit->tcp_hdrlen;
+}
+
+static void net_gro_extract_unit6(const uint8_t *buf, size_t hdr_len,
+                                  NetGROUnit *unit)
+{
+    struct ip6_header *ip6;
+
+    ip6 = (struct ip6_header *)(buf + hdr_len + sizeof(struct eth_header));
+    unit->ip = ip6;
+    unit->ip_plen = &(ip6->ip6_ctlun.ip6_un1.ip6_un1_plen);
+    unit->tcp = (struct tcp_header *)(((uint8_t *)unit->ip)
+                                        + sizeof(struct ip6_header));
+    unit->tcp_hdrlen = (htons(unit->tcp->th_offset_flags) & 0xF000) >> 10;
+
+    /* There is a difference between payload lenght in ipv4 and v6,
+       ip header is excluded in ipv6 */
+    unit->payload = htons(*unit->ip_plen) - unit->tcp_hdrlen;
+}
+
+static void net_gro_free_seg(NetGROChain *chain, NetGROSegment *seg)
+{
+    QTAILQ_REMOVE(&chain->buffers, seg, next);
+    g_free(seg->buf);
+    g_free(seg);
+}
+
+static size_t net_gro_drain_seg(NetGROChain *chain, NetGROSegment *seg)
+{
+    NetGRO *gro = chain->gro;
+    ssize_t ret;
+
+    ret = gro->deliver(gro->opaque, seg->nc, seg->buf, seg->size, seg);
+    net_gro_free_seg(chain, seg);
+
+    return ret;
+}
+
+static void net_gro_purge(void *opq)
+{
+    NetGROSegment *seg, *rn;
+    NetGROChain *chain = (NetGROChain *)opq;
+    NetGRO *gro = chain->gro;
+
+    if (gro->ctx) {
+        aio_context_acquire(gro->ctx);
+    }
+    QTAILQ_FOREACH_SAFE(seg, &chain->buffers, next, rn) {
+        if (net_gro_drain_seg(chain, seg) == 0) {
+            chain->stat.purge_failed++;
+            continue;
+        }
+    }
+
+    chain->stat.timer++;
+    if (!QTAILQ_EMPTY(&chain->buffers)) {
+        timer_mod(chain->drain_timer,
+                  qemu_clock_get_ns(QEMU_CLOCK_HOST) + gro->timeout);
+    }
+    if (gro->ctx) {
+        aio_context_release(gro->ctx);
+    }
+}
+
+static void net_gro_cache_buf(NetGROChain *chain, NetClientState *nc,
+                              const uint8_t *buf, size_t size)
+{
+    size_t hdr_len = chain->gro->hdr_len;
+    NetGROSegment *seg;
+
+    seg = g_malloc(sizeof(NetGROSegment));
+    seg->buf = g_malloc(hdr_len + sizeof(struct eth_header)
+        + sizeof(struct ip6_header) + NET_GRO_MAX_TCP_PAYLOAD);
+    memcpy(seg->buf, buf, size);
+    seg->size = size;
+    seg->hdr_len = hdr_len;
+    seg->proto = chain->proto;
+    seg->packets = 1;
+    seg->dup_ack = 0;
+    seg->is_coalesced = 0;
+    seg->nc = nc;
+
+    QTAILQ_INSERT_TAIL(&chain->buffers, seg, next);
+    chain->stat.cache++;
+
+    switch (chain->proto) {
+    case ETH_P_IP:
+        net_gro_extract_unit4(seg->buf, hdr_len, &seg->unit);
+        break;
+    case ETH_P_IPV6:
+        net_gro_extract_unit6(seg->buf, hdr_len, &seg->unit);
+        break;
+    default:
+        g_assert_not_reached();
+    }
+}
+
+static int32_t net_gro_handle_ack(NetGROChain *chain, NetGROSegment *seg,
+                                  const uint8_t *buf,
+                                  struct tcp_header *n_tcp,
+                                  struct tcp_header *o_tcp)
+{
+    uint32_t nack, oack;
+    uint16_t nwin, owin;
+
+    nack = htonl(n_tcp->th_ack);
+    nwin = htons(n_tcp->th_win);
+    oack = htonl(o_tcp->th_ack);
+    owin = htons(o_tcp->th_win);
+
+    if ((nack - oack) >= NET_GRO_MAX_TCP_PAYLOAD) {
+        chain->stat.ack_out_of_win++;
+        return GRO_FINAL;
+    } else if (nack == oack) {
+        /* duplicated ack or window probe */
+        if (nwin == owin) {
+            /* duplicated ack, add dup ack count due to whql test up to 1 */
+            chain->stat.dup_ack++;
+            return GRO_FINAL;
+        } else {
+            /* Coalesce window update */
+            o_tcp->th_win = n_tcp->th_win;
+            chain->stat.win_update++;
+            return GRO_COALESCE;
+        }
+    } else {
+        /* pure ack, go to 'C', finalize*/
+        chain->stat.pure_ack++;
+        return GRO_FINAL;
+    }
+}
+
+static int32_t net_gro_coalesce_data(NetGROChain *chain, NetGROSegment *seg,
+                                     const uint8_t *buf, NetGROUnit *n_unit)
+{
+    void *data;
+    uint16_t o_ip_len;
+    uint32_t nseq, oseq;
+    NetGROUnit *o_unit;
+
+    o_unit = &seg->unit;
+    o_ip_len = htons(*o_unit->ip_plen);
+    nseq = htonl(n_unit->tcp->th_seq);
+    oseq = htonl(o_unit->tcp->th_seq);
+
+    /* out of order or retransmitted. */
+    if ((nseq - oseq) > NET_GRO_MAX_TCP_PAYLOAD) {
+        chain->stat.data_out_of_win++;
+        return GRO_FINAL;
+    }
+
+    data = ((uint8_t *)n_unit->tcp) + n_unit->tcp_hdrlen;
+    if (nseq == oseq) {
+        if ((o_unit->payload == 0) && n_unit->payload) {
+            /* From no payload to payload, normal case, not a dup ack or etc */
+            chain->stat.data_after_pure_ack++;
+            goto coalesce;
+        } else {
+            return net_gro_handle_ack(chain, seg, buf,
+                                      n_unit->tcp, o_unit->tcp);
+        }
+    } else if ((nseq - oseq) != o_unit->payload) {
+        /* Not a consistent packet, out of order */
+        chain->stat.data_out_of_order++;
+        return GRO_FINAL;
+    } else {
+coalesce:
+        if ((o_ip_len + n_unit->payload) > chain->max_payload) {
+            chain->stat.over_size++;
+            return GRO_FINAL;
+        }
+
+        /* Here comes the right data, the payload length in v4/v6 is different,
+           so use the field value to update and record the new data len */
+        o_unit->payload += n_unit->payload; /* update new data len */
+
+        /* update field in ip header */
+        *o_unit->ip_plen = htons(o_ip_len + n_unit->payload);
+
+        /* Bring 'PUSH' big, the whql test guide says 'PUSH' can be coalesced
+           for windows guest, while this may change the behavior for linux
+           guest (only if it uses RSC feature). */
+        o_unit->tcp->th_offset_flags = n_unit->tcp->th_offset_flags;
+
+        o_unit->tcp->th_ack = n_unit->tcp->th_ack;
+        o_unit->tcp->th_win = n_unit->tcp->th_win;
+
+        memmove(seg->buf + seg->size, data, n_unit->payload);
+        seg->size += n_unit->payload;
+        seg->packets++;
+        chain->stat.coalesced++;
+        return GRO_COALESCE;
+    }
+}
+
+static int32_t net_gro_coalesce4(NetGROChain *chain, NetGROSegment *seg,
+                                 const uint8_t *buf, size_t size,
+                                 NetGROUnit *unit)
+{
+    struct ip_header *ip1, *ip2;
+
+    ip1 = (struct ip_header *)(unit->ip);
+    ip2 = (struct ip_header *)(seg->unit.ip);
+    if ((ip1->ip_src ^ ip2->ip_src) || (ip1->ip_dst ^ ip2->ip_dst)
+        || (unit->tcp->th_sport ^ seg->unit.tcp->th_sport)
+        || (unit->tcp->th_dport ^ seg->unit.tcp->th_dport)) {
+        chain->stat.no_match++;
+        return GRO_NO_MATCH;
+    }
+
+    return net_gro_coalesce_data(chain, seg, buf, unit);
+}
+
+static int32_t net_gro_coalesce6(NetGROChain *chain, NetGROSegment *seg,
+                                 const uint8_t *buf, size_t size,
+                                 NetGROUnit *unit)
+{
+    struct ip6_header *ip1, *ip2;
+
+    ip1 = (struct ip6_header *)(unit->ip);
+    ip2 = (struct ip6_header *)(seg->unit.ip);
+    if (memcmp(&ip1->ip6_src, &ip2->ip6_src, sizeof(struct in6_address))
+        || memcmp(&ip1->ip6_dst, &ip2->ip6_dst, sizeof(struct in6_address))
+        || (unit->tcp->th_sport ^ seg->unit.tcp->th_sport)
+        || (unit->tcp->th_dport ^ seg->unit.tcp->th_dport)) {
+            chain->stat.no_match++;
+            return GRO_NO_MATCH;
+    }
+
+    return net_gro_coalesce_data(chain, seg, buf, unit);
+}
+
+/* Packets with 'SYN' should bypass, other flag should be sent after drain
+ * to prevent out of order */
+static int net_gro_tcp_ctrl_check(NetGROChain *chain, struct tcp_header *tcp)
+{
+    uint16_t tcp_hdr;
+    uint16_t tcp_flag;
+
+    tcp_flag = htons(tcp->th_offset_flags);
+    tcp_hdr = (tcp_flag & NET_GRO_TCP_HDR_LENGTH) >> 10;
+    tcp_flag &= NET_GRO_TCP_FLAG;
+    if (tcp_flag & TH_SYN) {
+        chain->stat.tcp_syn++;
+        return GRO_BYPASS;
+    }
+
+    if (tcp_flag & (TH_FIN | TH_URG | TH_RST | TH_ECE | TH_CWR)) {
+        chain->stat.tcp_ctrl_drain++;
+        return GRO_FINAL;
+    }
+
+    if (tcp_hdr > sizeof(struct tcp_header)) {
+        chain->stat.tcp_all_opt++;
+        return GRO_FINAL;
+    }
+
+    return GRO_CANDIDATE;
+}
+
+static size_t net_gro_do_coalesce(NetGROChain *chain, NetClientState *nc,
+                                  const uint8_t *buf, size_t size,
+                                  NetGROUnit *unit)
+{
+    int ret;
+    NetGROSegment *seg, *nseg;
+
+    if (QTAILQ_EMPTY(&chain->buffers)) {
+        chain->stat.empty_cache++;
+        net_gro_cache_buf(chain, nc, buf, size);
+        timer_mod(chain->drain_timer,
+                  qemu_clock_get_ns(QEMU_CLOCK_HOST) + chain->gro->timeout);
+        return size;
+    }
+
+    QTAILQ_FOREACH_SAFE(seg, &chain->buffers, next, nseg) {
+        if (chain->proto == ETH_P_IP) {
+            ret = net_gro_coalesce4(chain, seg, buf, size, unit);
+        } else {
+            ret = net_gro_coalesce6(chain, seg, buf, size, unit);
+        }
+
+        if (ret == GRO_FINAL) {
+            if (net_gro_drain_seg(chain, seg) == 0) {
+                /* Send failed */
+                chain->stat.final_failed++;
+                return 0;
+            }
+
+            /* Send current packet */
+            return net_gro_deliver(chain->gro, nc, buf, size);
+        } else if (ret == GRO_NO_MATCH) {
+            continue;
+        } else {
+            /* Coalesced, mark coalesced flag to tell calc cksum for ipv4 */
+            seg->is_coalesced = 1;
+            return size;
+        }
+    }
+
+    chain->stat.no_match_cache++;
+    net_gro_cache_buf(chain, nc, buf, size);
+    return size;
+}
+
+/* Drain a connection data, this is to avoid out of order segments */
+static size_t net_gro_drain_flow(NetGROChain *chain, NetClientState *nc,
+                                 const uint8_t *buf, size_t size,
+                                 uint16_t ip_start, uint16_t ip_size,
+                                 uint16_t tcp_port)
+{
+    NetGROSegment *seg, *nseg;
+    uint32_t ppair1, ppair2;
+
+    ppair1 = *(uint32_t *)(buf + tcp_port);
+    QTAILQ_FOREACH_SAFE(seg, &chain->buffers, next, nseg) {
+        ppair2 = *(uint32_t *)(seg->buf + tcp_port);
+        if (memcmp(buf + ip_start, seg->buf + ip_start, ip_size)
+            || (ppair1 != ppair2)) {
+            continue;
+        }
+        if (net_gro_drain_seg(chain, seg) == 0) {
+            chain->stat.drain_failed++;
+        }
+
+        break;
+    }
+
+    return net_gro_deliver(chain->gro, nc, buf, size);
+}
+
+static int32_t net_gro_sanity_check4(NetGROChain *chain,
+                                     struct ip_header *ip,
+                                     const uint8_t *buf, size_t size)
+{
+    uint16_t ip_len;
+
+    /* Not an ipv4 packet */
+    if (((ip->ip_ver_len & 0xF0) >> 4) != IP_HEADER_VERSION_4) {
+        chain->stat.ip_option++;
+        return GRO_BYPASS;
+    }
+
+    /* Don't handle packets with ip option */
+    if ((ip->ip_ver_len & 0xF) != NET_GRO_IP4_HEADER_LENGTH) {
+        chain->stat.ip_option++;
+        return GRO_BYPASS;
+    }
+
+    if (ip->ip_p != IPPROTO_TCP) {
+        chain->stat.bypass_not_tcp++;
+        return GRO_BYPASS;
+    }
+
+    /* Don't handle packets with ip fragment */
+    if (!(htons(ip->ip_off) & IP_DF)) {
+        chain->stat.ip_frag++;
+        return GRO_BYPASS;
+    }
+
+    /* Don't handle packets with ecn flag */
+    if (IPTOS_ECN(ip->ip_tos)) {
+        chain->stat.ip_ecn++;
+        return GRO_BYPASS;
+    }
+
+    ip_len = htons(ip->ip_len);
+    if (ip_len < (sizeof(struct ip_header) + sizeof(struct tcp_header))
+        || ip_len > (size - chain->gro->hdr_len -
+                     sizeof(struct eth_header))) {
+        chain->stat.ip_hacked++;
+        return GRO_BYPASS;
+    }
+
+    return GRO_CANDIDATE;
+}
+
+static size_t net_gro_receive4(NetGROChain *chain, NetClientState *nc,
+                               const uint8_t *buf, size_t size)
+{
+    int32_t ret;
+    size_t hdr_len = chain->gro->hdr_len;
+    NetGROUnit unit;
+
+    if (size < (hdr_len + sizeof(struct eth_header) + sizeof(struct ip_header)
+        + sizeof(struct tcp_header))) {
+        chain->stat.bypass_not_tcp++;
+        return net_gro_deliver(chain->gro, nc, buf, size);
+    }
+
+    net_gro_extract_unit4(buf, hdr_len, &unit);
+    if (net_gro_sanity_check4(chain, unit.ip, buf, size) != GRO_CANDIDATE) {
+        return net_gro_deliver(chain->gro, nc, buf, size);
+    }
+
+    ret = net_gro_tcp_ctrl_check(chain, unit.tcp);
+    if (ret == GRO_BYPASS) {
+        return net_gro_deliver(chain->gro, nc, buf, size);
+    } else if (ret == GRO_FINAL) {
+        return net_gro_drain_flow(chain, nc, buf, size,
+                ((hdr_len + sizeof(struct eth_header)) + 12),
+                NET_GRO_IP4_ADDR_SIZE,
+                hdr_len + sizeof(struct eth_header) + sizeof(struct ip_header));
+    }
+
+    return net_gro_do_coalesce(chain, nc, buf, size, &unit);
+}
+
+static int32_t net_gro_sanity_check6(NetGROChain *chain,
+                                     struct ip6_header *ip6,
+                                     const uint8_t *buf, size_t size)
+{
+    uint16_t ip_len;
+
+    if (((ip6->ip6_ctlun.ip6_un1.ip6_un1_flow & 0xF0) >> 4)
+        != IP_HEADER_VERSION_6) {
+        return GRO_BYPASS;
+    }
+
+    /* Both option and protocol is checked in this */
+    if (ip6->ip6_ctlun.ip6_un1.ip6_un1_nxt != IPPROTO_TCP) {
+        chain->stat.bypass_not_tcp++;
+        return GRO_BYPASS;
+    }
+
+    ip_len = htons(ip6->ip6_ctlun.ip6_un1.ip6_un1_plen);
+    if (ip_len < sizeof(struct tcp_header) ||
+        ip_len > (size - chain->gro->hdr_len - sizeof(struct eth_header)
+                  - sizeof(struct ip6_header))) {
+        chain->stat.ip_hacked++;
+        return GRO_BYPASS;
+    }
+
+    /* Don't handle packets with ecn flag */
+    if (IP6_ECN(ip6->ip6_ctlun.ip6_un3.ip6_un3_ecn)) {
+        chain->stat.ip_ecn++;
+        return GRO_BYPASS;
+    }
+
+    return GRO_CANDIDATE;
+}
+
+static size_t net_gro_receive6(NetGROChain *chain, NetClientState *nc,
+                               const uint8_t *buf, size_t size)
+{
+    int32_t ret;
+    size_t hdr_len = chain->gro->hdr_len;
+    NetGROUnit unit;
+
+    if (size < (hdr_len + sizeof(struct eth_header) + sizeof(struct ip6_header)
+        + sizeof(tcp_header))) {
+        return net_gro_deliver(chain->gro, nc, buf, size);
+    }
+
+    net_gro_extract_unit6(buf, hdr_len, &unit);
+    if (GRO_CANDIDATE != net_gro_sanity_check6(chain, unit.ip, buf, size)) {
+        return net_gro_deliver(chain->gro, nc, buf, size);
+    }
+
+    ret = net_gro_tcp_ctrl_check(chain, unit.tcp);
+    if (ret == GRO_BYPASS) {
+        return net_gro_deliver(chain->gro, nc, buf, size);
+    } else if (ret == GRO_FINAL) {
+        return net_gro_drain_flow(chain, nc, buf, size,
+                ((hdr_len + sizeof(struct eth_header)) + 8),
+                NET_GRO_IP6_ADDR_SIZE,
+                hdr_len + sizeof(struct eth_header)
+                + sizeof(struct ip6_header));
+    }
+
+    return net_gro_do_coalesce(chain, nc, buf, size, &unit);
+}
+
+static NetGROChain *net_gro_lookup_chain(NetGRO *gro, uint16_t proto)
+{
+    NetGROChain *chain;
+
+    if ((proto != (uint16_t)ETH_P_IP) && (proto != (uint16_t)ETH_P_IPV6)) {
+        return NULL;
+    }
+
+    QTAILQ_FOREACH(chain, &gro->chains, next) {
+        if (chain->proto == proto) {
+            return chain;
+        }
+    }
+
+    chain = g_new0(NetGROChain, 1);
+    chain->gro = gro;
+    chain->proto = proto;
+    if (proto == (uint16_t)ETH_P_IP) {
+        chain->max_payload = NET_GRO_MAX_IP4_PAYLOAD;
+    } else {
+        chain->max_payload = NET_GRO_MAX_IP6_PAYLOAD;
+    }
+    chain->drain_timer = timer_new_ns(QEMU_CLOCK_HOST, net_gro_purge, chain);
+
+    QTAILQ_INIT(&chain->buffers);
+    QTAILQ_INSERT_TAIL(&gro->chains, chain, next);
+
+    return chain;
+}
+
+ssize_t net_gro_receive(NetGRO *gro, NetClientState *nc,
+                        const uint8_t *buf, size_t size, size_t hdr_len)
+{
+    uint16_t proto;
+    NetGROChain *chain;
+    struct eth_header *eth;
+
+    if (!net_gro_enabled(gro) ||
+        size < (hdr_len + sizeof(struct eth_header))) {
+        return net_gro_deliver(gro, nc, buf, size);
+    }
+
+    eth = (struct eth_header *)(buf + hdr_len);
+    proto = htons(eth->h_proto);
+
+    gro->hdr_len = hdr_len;
+    chain = net_gro_lookup_chain(gro, proto);
+    if (chain) {
+        chain->stat.received++;
+        if (proto == (uint16_t)ETH_P_IP && gro->ipv4) {
+            return net_gro_receive4(chain, nc, buf, size);
+        } else if (proto == (uint16_t)ETH_P_IPV6 && gro->ipv6) {
+            return net_gro_receive6(chain, nc, buf, size);
+        }
+    }
+    return net_gro_deliver(gro, nc, buf, size);
+}
+
+void net_gro_flush(NetGRO *gro)
+{
+    NetGROChain *chain;
+    NetGROSegment *seg, *rn;
+
+    QTAILQ_FOREACH(chain, &gro->chains, next) {
+        QTAILQ_FOREACH_SAFE(seg, &chain->buffers, next, rn) {
+            if (net_gro_drain_seg(chain, seg) == 0) {
+                chain->stat.purge_failed++;
+            }
+        }
+        timer_del(chain->drain_timer);
+    }
+}
+
+void net_gro_reset(NetGRO *gro)
+{
+    NetGROChain *chain;
+    NetGROSegment *seg, *rn;
+
+    QTAILQ_FOREACH(chain, &gro->chains, next) {
+        QTAILQ_FOREACH_SAFE(seg, &chain->buffers, next, rn) {
+            net_gro_free_seg(chain, seg);
+        }
+        timer_del(chain->drain_timer);
+    }
+}
+
+void net_gro_set_enabled(NetGRO *gro, bool ipv4, bool ipv6)
+{
+    gro->ipv4 = ipv4;
+    gro->ipv6 = ipv6;
+}
+
+bool net_gro_enabled(NetGRO *gro)
+{
+    return gro->ipv4 || gro->ipv6;
+}
+
+void net_gro_segment_fix_checksums(NetGROSegment *seg)
+{
+    uint8_t *frame = seg->buf + seg->hdr_len;
+    struct ip6_header *ip6;
+    struct tcp_header *tcp;
+    uint16_t plen;
+    uint32_t sum;
+
+    if (!seg->is_coalesced) {
+        return;
+    }
+
+    if (seg->proto == ETH_P_IP) {
+        net_checksum_calculate(frame, seg->size - seg->hdr_len,
+                               CSUM_IP | CSUM_TCP);
+        return;
+    }
+
+    /* IPv6 has no header checksum, only the TCP pseudo header one */
+    ip6 = seg->unit.ip;
+    tcp = seg->unit.tcp;
+    plen = htons(*seg->unit.ip_plen);
+
+    stw_he_p(&tcp->th_sum, 0);
+    sum = net_checksum_add(NET_GRO_IP6_ADDR_SIZE, (uint8_t *)&ip6->ip6_src);
+    sum += plen + IPPROTO_TCP;
+    sum += net_checksum_add(plen, (uint8_t *)tcp);
+    stw_be_p(&tcp->th_sum, net_checksum_finish_nozero(sum));
+}
+
+NetGRO *net_gro_new(uint32_t timeout, AioContext *ctx,
+                    NetGRODeliver *deliver, void *opaque)
+{
+    NetGRO *gro = g_new0(NetGRO, 1);
+
+    gro->deliver = deliver;
+    gro->opaque = opaque;
+    gro->ctx = ctx;
+    gro->timeout = timeout;
+    QTAILQ_INIT(&gro->chains);
+
+    return gro;
+}
+
+void net_gro_free(NetGRO *gro)
+{
+    NetGROChain *chain, *rn_chain;
+
+    if (!gro) {
+        return;
+    }
+
+    net_gro_reset(gro);
+    QTAILQ_FOREACH_SAFE(chain, &gro->chains, next, rn_chain) {
+        timer_free(chain->drain_timer);
+        QTAILQ_REMOVE(&gro->chains, chain, next);
+        g_free(chain);
+    }
+    g_free(gro);
+}
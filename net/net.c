@@ -47,6 +47,7 @@
 #include "qemu/qemu-print.h"
 #include "qemu/main-loop.h"
 #include "qemu/option.h"
+#include "block/aio-wait.h"
 #include "qapi/error.h"
 #include "qapi/opts-visitor.h"
 #include "sysemu/sysemu.h"
@@ -333,10 +334,96 @@ NetClientState *qemu_get_peer(NetClientState *nc, int queue_index)
     return ncs->peer;
 }
 
+/*
+ * Backends register their fds through this so that the NIC can move them
+ * to its own AioContext with qemu_net_client_attach_aio_context().
+ */
+void qemu_net_set_fd_handler(NetClientState *nc, int fd, IOHandler *fd_read,
+                             IOHandler *fd_write, void *opaque)
+{
+    if (nc->ctx) {
+        aio_set_fd_handler(nc->ctx, fd, false, fd_read, fd_write, NULL,
+                           opaque);
+    } else {
+        qemu_set_fd_handler(fd, fd_read, fd_write, opaque);
+    }
+}
+
+/*
+ * The fd handlers of a backend run without the lock of nc->ctx, while the
+ * NIC and the main loop take it to flush or purge the packet queues.  The
+ * handlers hold it with these around everything that sends packets to the
+ * peer or flushes the queue of the backend.
+ */
+void qemu_net_client_acquire(NetClientState *nc)
+{
+    if (nc->ctx) {
+        aio_context_acquire(nc->ctx);
+    }
+}
+
+void qemu_net_client_release(NetClientState *nc)
+{
+    if (nc->ctx) {
+        aio_context_release(nc->ctx);
+    }
+}
+
+/*
+ * Run the fd handlers of a backend in @ctx.  Packets then flow between
+ * the backend and its peer in @ctx only, so filters, which may have
+ * timers or fds of their own in the main loop, are not supported.
+ *
+ * Context: QEMU global mutex held, @nc in the main loop
+ */
+bool qemu_net_client_attach_aio_context(NetClientState *nc, AioContext *ctx)
+{
+    assert(!nc->ctx);
+
+    if (!nc->info->set_aio_context || !QTAILQ_EMPTY(&nc->filters)) {
+        return false;
+    }
+    return nc->info->set_aio_context(nc, ctx);
+}
+
+/*
+ * Bring the fd handlers of a backend back to the main loop.
+ *
+ * Context: the AioContext of @nc, so that none of its handlers is running
+ */
+void qemu_net_client_detach_aio_context(NetClientState *nc)
+{
+    if (nc->ctx) {
+        nc->info->set_aio_context(nc, NULL);
+        assert(!nc->ctx);
+    }
+}
+
+static void qemu_net_client_detach_aio_context_bh(void *opaque)
+{
+    qemu_net_client_detach_aio_context(opaque);
+}
+
+/* Context: QEMU global mutex held */
+static void qemu_net_client_detach_aio_context_sync(NetClientState *nc)
+{
+    AioContext *ctx = nc->ctx;
+
+    if (!ctx) {
+        return;
+    }
+
+    aio_context_acquire(ctx);
+    aio_wait_bh_oneshot(ctx, qemu_net_client_detach_aio_context_bh, nc);
+    aio_context_release(ctx);
+}
+
 static void qemu_cleanup_net_client(NetClientState *nc)
 {
     QTAILQ_REMOVE(&net_clients, nc, next);
 
+    qemu_net_client_detach_aio_context_sync(nc);
+
     if (nc->info->cleanup) {
         nc->info->cleanup(nc);
     }
@@ -674,6 +761,29 @@ ssize_t qemu_send_packet_async(NetClientState *sender,
                                              buf, size, sent_cb);
 }
 
+static void qemu_send_batch(NetClientState *sender, bool begin)
+{
+    NetClientState *peer = sender->peer;
+
+    if (peer && peer->info->receive_batch) {
+        peer->info->receive_batch(peer, begin);
+    }
+}
+
+/*
+ * Packets sent between qemu_send_batch_begin() and qemu_send_batch_end()
+ * are delivered as usual, but the peer may complete them as a group.
+ */
+void qemu_send_batch_begin(NetClientState *sender)
+{
+    qemu_send_batch(sender, true);
+}
+
+void qemu_send_batch_end(NetClientState *sender)
+{
+    qemu_send_batch(sender, false);
+}
+
 ssize_t qemu_send_packet(NetClientState *nc, const uint8_t *buf, int size)
 {
     return qemu_send_packet_async(nc, buf, size, NULL);
@@ -747,9 +857,11 @@ static ssize_t qemu_deliver_packet_iov(NetClientState *sender,
     return ret;
 }
 
-ssize_t qemu_sendv_packet_async(NetClientState *sender,
-                                const struct iovec *iov, int iovcnt,
-                                NetPacketSent *sent_cb)
+static ssize_t qemu_sendv_packet_async_with_flags(NetClientState *sender,
+                                                  unsigned flags,
+                                                  const struct iovec *iov,
+                                                  int iovcnt,
+                                                  NetPacketSent *sent_cb)
 {
     NetQueue *queue;
     size_t size = iov_size(iov, iovcnt);
@@ -778,11 +890,34 @@ ssize_t qemu_sendv_packet_async(NetClientState *sender,
 
     queue = sender->peer->incoming_queue;
 
-    return qemu_net_queue_send_iov(queue, sender,
-                                   QEMU_NET_PACKET_FLAG_NONE,
+    return qemu_net_queue_send_iov(queue, sender, flags,
                                    iov, iovcnt, sent_cb);
 }
 
+ssize_t qemu_sendv_packet_async(NetClientState *sender,
+                                const struct iovec *iov, int iovcnt,
+                                NetPacketSent *sent_cb)
+{
+    return qemu_sendv_packet_async_with_flags(sender,
+                                              QEMU_NET_PACKET_FLAG_NONE,
+                                              iov, iovcnt, sent_cb);
+}
+
+/*
+ * Like qemu_sendv_packet_async(), but if the peer is busy the packet is
+ * queued by reference: the buffers that @iov points to must stay valid
+ * until @sent_cb is called.  The iovec array itself may be reused.
+ */
+ssize_t qemu_sendv_packet_async_zerocopy(NetClientState *sender,
+                                         const struct iovec *iov, int iovcnt,
+                                         NetPacketSent *sent_cb)
+{
+    assert(sent_cb);
+    return qemu_sendv_packet_async_with_flags(sender,
+                                              QEMU_NET_PACKET_FLAG_ZEROCOPY,
+                                              iov, iovcnt, sent_cb);
+}
+
 ssize_t
 qemu_sendv_packet(NetClientState *nc, const struct iovec *iov, int iovcnt)
 {
@@ -964,6 +1099,9 @@ static int (* const net_client_init_fun[NET_CLIENT_DRIVER__MAX])(
 #ifdef CONFIG_NETMAP
         [NET_CLIENT_DRIVER_NETMAP]    = net_init_netmap,
 #endif
+#ifdef CONFIG_AF_XDP
+        [NET_CLIENT_DRIVER_AF_XDP]    = net_init_af_xdp,
+#endif
 #ifdef CONFIG_NET_BRIDGE
         [NET_CLIENT_DRIVER_BRIDGE]    = net_init_bridge,
 #endif
@@ -1057,6 +1195,9 @@ void show_netdevs(void)
 #ifdef CONFIG_NETMAP
         "netmap",
 #endif
+#ifdef CONFIG_AF_XDP
+        "af-xdp",
+#endif
 #ifdef CONFIG_POSIX
         "vhost-user",
 #endif
@@ -107,10 +107,10 @@ static void netmap_writable(void *opaque);
 /* Set the event-loop handlers for the netmap backend. */
 static void netmap_update_fd_handler(NetmapState *s)
 {
-    qemu_set_fd_handler(s->nmd->fd,
-                        s->read_poll ? netmap_send : NULL,
-                        s->write_poll ? netmap_writable : NULL,
-                        s);
+    qemu_net_set_fd_handler(&s->nc, s->nmd->fd,
+                            s->read_poll ? netmap_send : NULL,
+                            s->write_poll ? netmap_writable : NULL,
+                            s);
 }
 
 /* Update the read handler. */
@@ -142,6 +142,17 @@ static void netmap_poll(NetClientState *nc, bool enable)
     }
 }
 
+/* Move the event-loop handlers to another AioContext. */
+static bool netmap_set_aio_context(NetClientState *nc, AioContext *ctx)
+{
+    NetmapState *s = DO_UPCAST(NetmapState, nc, nc);
+
+    qemu_net_set_fd_handler(nc, s->nmd->fd, NULL, NULL, NULL);
+    nc->ctx = ctx;
+    netmap_update_fd_handler(s);
+    return true;
+}
+
 /*
  * The fd_write() callback, invoked if the fd is marked as
  * writable after a poll. Unregister the handler and flush any
@@ -151,8 +162,10 @@ static void netmap_writable(void *opaque)
 {
     NetmapState *s = opaque;
 
+    qemu_net_client_acquire(&s->nc);
     netmap_write_poll(s, false);
     qemu_flush_queued_packets(&s->nc);
+    qemu_net_client_release(&s->nc);
 }
 
 static ssize_t netmap_receive_iov(NetClientState *nc,
@@ -252,6 +265,8 @@ static void netmap_send(void *opaque)
     struct netmap_ring *ring = s->rx;
     unsigned int tail = ring->tail;
 
+    qemu_net_client_acquire(&s->nc);
+
     /* Keep sending while there are available slots in the netmap
        RX ring and the forwarding path towards the peer is open. */
     while (ring->head != tail) {
@@ -294,6 +309,7 @@ static void netmap_send(void *opaque)
             break;
         }
     }
+    qemu_net_client_release(&s->nc);
 }
 
 /* Flush and close. */
@@ -397,6 +413,7 @@ static NetClientInfo net_netmap_info = {
     .using_vnet_hdr = netmap_using_vnet_hdr,
     .set_offload = netmap_set_offload,
     .set_vnet_hdr_len = netmap_set_vnet_hdr_len,
+    .set_aio_context = netmap_set_aio_context,
 };
 
 /* The exported init function
@@ -38,6 +38,10 @@
  *
  * If a sent callback isn't provided, we just drop the packet to avoid
  * unbounded queueing.
+ *
+ * A packet sent with QEMU_NET_PACKET_FLAG_ZEROCOPY and a sent callback
+ * is queued as a copy of its iovec array only; the data stays in the
+ * sender's buffers until the callback runs.
  */
 
 struct NetPacket {
@@ -45,6 +49,8 @@ struct NetPacket {
     NetClientState *sender;
     unsigned flags;
     int size;
+    /* Non-zero if data holds the iovec array of a zero-copy packet */
+    int iovcnt;
     NetPacketSent *sent_cb;
     uint8_t data[];
 };
@@ -106,6 +112,7 @@ static void qemu_net_queue_append(NetQueue *queue,
     packet->sender = sender;
     packet->flags = flags;
     packet->size = size;
+    packet->iovcnt = 0;
     packet->sent_cb = sent_cb;
     memcpy(packet->data, buf, size);
 
@@ -131,11 +138,26 @@ void qemu_net_queue_append_iov(NetQueue *queue,
         max_len += iov[i].iov_len;
     }
 
+    if ((flags & QEMU_NET_PACKET_FLAG_ZEROCOPY) && sent_cb && iovcnt) {
+        packet = g_malloc(sizeof(NetPacket) + iovcnt * sizeof(*iov));
+        packet->sender = sender;
+        packet->sent_cb = sent_cb;
+        packet->flags = flags;
+        packet->size = max_len;
+        packet->iovcnt = iovcnt;
+        memcpy(packet->data, iov, iovcnt * sizeof(*iov));
+
+        queue->nq_count++;
+        QTAILQ_INSERT_TAIL(&queue->packets, packet, entry);
+        return;
+    }
+
     packet = g_malloc(sizeof(NetPacket) + max_len);
     packet->sender = sender;
     packet->sent_cb = sent_cb;
-    packet->flags = flags;
+    packet->flags = flags & ~QEMU_NET_PACKET_FLAG_ZEROCOPY;
     packet->size = 0;
+    packet->iovcnt = 0;
 
     for (i = 0; i < iovcnt; i++) {
         size_t len = iov[i].iov_len;
@@ -261,11 +283,19 @@ bool qemu_net_queue_flush(NetQueue *queue)
         QTAILQ_REMOVE(&queue->packets, packet, entry);
         queue->nq_count--;
 
-        ret = qemu_net_queue_deliver(queue,
-                                     packet->sender,
-                                     packet->flags,
-                                     packet->data,
-                                     packet->size);
+        if (packet->iovcnt) {
+            ret = qemu_net_queue_deliver_iov(queue,
+                                             packet->sender,
+                                             packet->flags,
+                                             (struct iovec *)packet->data,
+                                             packet->iovcnt);
+        } else {
+            ret = qemu_net_queue_deliver(queue,
+                                         packet->sender,
+                                         packet->flags,
+                                         packet->data,
+                                         packet->size);
+        }
         if (ret == 0) {
             queue->nq_count++;
             QTAILQ_INSERT_HEAD(&queue->packets, packet, entry);
@@ -316,3 +316,18 @@ int tap_fd_get_ifname(int fd, char *ifname)
     pstrcpy(ifname, sizeof(ifr.ifr_name), ifr.ifr_name);
     return 0;
 }
+
+/*
+ * Attach the steering program @prog_fd to the queues of the tap device,
+ * or detach the current one if @prog_fd is -1.
+ */
+int tap_fd_set_steering_ebpf(int fd, int prog_fd)
+{
+    if (ioctl(fd, TUNSETSTEERINGEBPF, (void *) &prog_fd) != 0) {
+        error_report("TUNSETSTEERINGEBPF ioctl() failed: %s",
+                     strerror(errno));
+        return -1;
+    }
+
+    return 0;
+}
@@ -47,12 +47,20 @@
 
 #include "net/vhost_net.h"
 
+/*
+ * Packets are read from the tap device in batches of up to TAP_BATCH_SIZE
+ * and then handed to the peer together, at most TAP_SEND_BUDGET packets per
+ * tap_send() callback.
+ */
+#define TAP_BATCH_SIZE 8
+#define TAP_SEND_BUDGET 50
+
 typedef struct TAPState {
     NetClientState nc;
     int fd;
     char down_script[1024];
     char down_script_arg[128];
-    uint8_t buf[NET_BUFSIZE];
+    uint8_t (*bufs)[NET_BUFSIZE];
     bool read_poll;
     bool write_poll;
     bool using_vnet_hdr;
@@ -71,10 +79,10 @@ static void tap_writable(void *opaque);
 
 static void tap_update_fd_handler(TAPState *s)
 {
-    qemu_set_fd_handler(s->fd,
-                        s->read_poll && s->enabled ? tap_send : NULL,
-                        s->write_poll && s->enabled ? tap_writable : NULL,
-                        s);
+    qemu_net_set_fd_handler(&s->nc, s->fd,
+                            s->read_poll && s->enabled ? tap_send : NULL,
+                            s->write_poll && s->enabled ? tap_writable : NULL,
+                            s);
 }
 
 static void tap_read_poll(TAPState *s, bool enable)
@@ -93,9 +101,11 @@ static void tap_writable(void *opaque)
 {
     TAPState *s = opaque;
 
+    qemu_net_client_acquire(&s->nc);
     tap_write_poll(s, false);
 
     qemu_flush_queued_packets(&s->nc);
+    qemu_net_client_release(&s->nc);
 }
 
 static ssize_t tap_write_packet(TAPState *s, const struct iovec *iov, int iovcnt)
@@ -184,41 +194,64 @@ static void tap_send_completed(NetClientState *nc, ssize_t len)
 static void tap_send(void *opaque)
 {
     TAPState *s = opaque;
-    int size;
+    int sizes[TAP_BATCH_SIZE];
     int packets = 0;
+    bool more = true;
 
-    while (true) {
-        uint8_t *buf = s->buf;
+    if (!s->bufs) {
+        s->bufs = g_malloc(TAP_BATCH_SIZE * sizeof(*s->bufs));
+    }
 
-        size = tap_read_packet(s->fd, s->buf, sizeof(s->buf));
-        if (size <= 0) {
-            break;
-        }
+    qemu_net_client_acquire(&s->nc);
 
-        if (s->host_vnet_hdr_len && !s->using_vnet_hdr) {
-            buf  += s->host_vnet_hdr_len;
-            size -= s->host_vnet_hdr_len;
+    /*
+     * When the host keeps receiving more packets while tap_send() is
+     * running we can hog the QEMU global mutex.  Limit the number of
+     * packets that are processed per tap_send() callback to prevent
+     * stalling the guest.
+     */
+    while (more && packets < TAP_SEND_BUDGET) {
+        int n, i;
+
+        for (n = 0; n < TAP_BATCH_SIZE && packets + n < TAP_SEND_BUDGET; n++) {
+            sizes[n] = tap_read_packet(s->fd, s->bufs[n], NET_BUFSIZE);
+            if (sizes[n] <= 0) {
+                more = false;
+                break;
+            }
         }
-
-        size = qemu_send_packet_async(&s->nc, buf, size, tap_send_completed);
-        if (size == 0) {
-            tap_read_poll(s, false);
-            break;
-        } else if (size < 0) {
+        if (n == 0) {
             break;
         }
 
         /*
-         * When the host keeps receiving more packets while tap_send() is
-         * running we can hog the QEMU global mutex.  Limit the number of
-         * packets that are processed per tap_send() callback to prevent
-         * stalling the guest.
+         * Packets that were already read are handed over even if the peer
+         * stops accepting them; they are queued and complete later.
          */
-        packets++;
-        if (packets >= 50) {
-            break;
+        qemu_send_batch_begin(&s->nc);
+        for (i = 0; i < n; i++) {
+            uint8_t *buf = s->bufs[i];
+            int size = sizes[i];
+
+            if (s->host_vnet_hdr_len && !s->using_vnet_hdr) {
+                buf  += s->host_vnet_hdr_len;
+                size -= s->host_vnet_hdr_len;
+            }
+
+            size = qemu_send_packet_async(&s->nc, buf, size,
+                                          tap_send_completed);
+            if (size == 0) {
+                tap_read_poll(s, false);
+                more = false;
+            } else if (size < 0) {
+                more = false;
+            }
         }
+        qemu_send_batch_end(&s->nc);
+
+        packets += n;
     }
+    qemu_net_client_release(&s->nc);
 }
 
 static bool tap_has_ufo(NetClientState *nc)
@@ -285,6 +318,13 @@ static int tap_set_vnet_be(NetClientState *nc, bool is_be)
     return tap_fd_set_vnet_be(s->fd, is_be);
 }
 
+static bool tap_set_steering_ebpf(NetClientState *nc, int prog_fd)
+{
+    TAPState *s = DO_UPCAST(TAPState, nc, nc);
+
+    return tap_fd_set_steering_ebpf(s->fd, prog_fd) == 0;
+}
+
 static void tap_set_offload(NetClientState *nc, int csum, int tso4,
                      int tso6, int ecn, int ufo)
 {
@@ -328,6 +368,9 @@ static void tap_cleanup(NetClientState *nc)
     tap_write_poll(s, false);
     close(s->fd);
     s->fd = -1;
+
+    g_free(s->bufs);
+    s->bufs = NULL;
 }
 
 static void tap_poll(NetClientState *nc, bool enable)
@@ -337,6 +380,20 @@ static void tap_poll(NetClientState *nc, bool enable)
     tap_write_poll(s, enable);
 }
 
+static bool tap_set_aio_context(NetClientState *nc, AioContext *ctx)
+{
+    TAPState *s = DO_UPCAST(TAPState, nc, nc);
+
+    if (s->vhost_net) {
+        return false;
+    }
+
+    qemu_net_set_fd_handler(nc, s->fd, NULL, NULL, NULL);
+    nc->ctx = ctx;
+    tap_update_fd_handler(s);
+    return true;
+}
+
 int tap_get_fd(NetClientState *nc)
 {
     TAPState *s = DO_UPCAST(TAPState, nc, nc);
@@ -362,6 +419,8 @@ static NetClientInfo net_tap_info = {
     .set_vnet_hdr_len = tap_set_vnet_hdr_len,
     .set_vnet_le = tap_set_vnet_le,
     .set_vnet_be = tap_set_vnet_be,
+    .set_steering_ebpf = tap_set_steering_ebpf,
+    .set_aio_context = tap_set_aio_context,
 };
 
 static TAPState *net_tap_fd_init(NetClientState *peer,
@@ -47,6 +47,10 @@
 #include "hw/boards.h"
 #endif
 #include "trace/mem.h"
+#include "qemu/host-utils.h"
+#include "qemu/lockable.h"
+
+extern struct qemu_plugin_state plugin;
 
 /* Uninstall and Reset handlers */
 
@@ -99,6 +103,43 @@ void qemu_plugin_register_vcpu_tb_exec_inline(struct qemu_plugin_tb *tb,
     }
 }
 
+void qemu_plugin_register_vcpu_tb_exec_inline_per_vcpu(
+    struct qemu_plugin_tb *tb,
+    enum qemu_plugin_op op,
+    qemu_plugin_u64 entry,
+    uint64_t imm)
+{
+    if (!tb->mem_only) {
+        plugin_register_inline_op_on_entry(&tb->cbs[PLUGIN_CB_INLINE], 0, op,
+                                           entry, 0, imm);
+    }
+}
+
+void qemu_plugin_register_vcpu_tb_exec_cond_cb(struct qemu_plugin_tb *tb,
+                                               qemu_plugin_vcpu_udata_cb_t cb,
+                                               enum qemu_plugin_cb_flags flags,
+                                               enum qemu_plugin_cond cond,
+                                               qemu_plugin_u64 entry,
+                                               uint64_t imm,
+                                               void *udata)
+{
+    if (!tb->mem_only) {
+        plugin_register_dyn_cond_cb__udata(&tb->cbs[PLUGIN_CB_REGULAR],
+                                           cb, flags, cond, entry, imm, udata);
+    }
+}
+
+void qemu_plugin_register_vcpu_tb_exec_ring(struct qemu_plugin_tb *tb,
+                                            qemu_plugin_u64 ring,
+                                            size_t n_slots)
+{
+    if (!tb->mem_only) {
+        plugin_register_inline_op_on_entry(&tb->cbs[PLUGIN_CB_INLINE], 0,
+                                           QEMU_PLUGIN_INLINE_STORE_U64,
+                                           ring, n_slots, tb->vaddr);
+    }
+}
+
 void qemu_plugin_register_vcpu_insn_exec_cb(struct qemu_plugin_insn *insn,
                                             qemu_plugin_vcpu_udata_cb_t cb,
                                             enum qemu_plugin_cb_flags flags,
@@ -120,6 +161,44 @@ void qemu_plugin_register_vcpu_insn_exec_inline(struct qemu_plugin_insn *insn,
     }
 }
 
+void qemu_plugin_register_vcpu_insn_exec_inline_per_vcpu(
+    struct qemu_plugin_insn *insn,
+    enum qemu_plugin_op op,
+    qemu_plugin_u64 entry,
+    uint64_t imm)
+{
+    if (!insn->mem_only) {
+        plugin_register_inline_op_on_entry(
+            &insn->cbs[PLUGIN_CB_INSN][PLUGIN_CB_INLINE], 0, op, entry, 0, imm);
+    }
+}
+
+void qemu_plugin_register_vcpu_insn_exec_cond_cb(
+    struct qemu_plugin_insn *insn,
+    qemu_plugin_vcpu_udata_cb_t cb,
+    enum qemu_plugin_cb_flags flags,
+    enum qemu_plugin_cond cond,
+    qemu_plugin_u64 entry,
+    uint64_t imm,
+    void *udata)
+{
+    if (!insn->mem_only) {
+        plugin_register_dyn_cond_cb__udata(
+            &insn->cbs[PLUGIN_CB_INSN][PLUGIN_CB_REGULAR],
+            cb, flags, cond, entry, imm, udata);
+    }
+}
+
+void qemu_plugin_register_vcpu_insn_exec_ring(struct qemu_plugin_insn *insn,
+                                              qemu_plugin_u64 ring,
+                                              size_t n_slots)
+{
+    if (!insn->mem_only) {
+        plugin_register_inline_op_on_entry(
+            &insn->cbs[PLUGIN_CB_INSN][PLUGIN_CB_INLINE], 0,
+            QEMU_PLUGIN_INLINE_STORE_U64, ring, n_slots, insn->vaddr);
+    }
+}
 
 /*
  * We always plant memory instrumentation because they don't finalise until
@@ -144,6 +223,17 @@ void qemu_plugin_register_vcpu_mem_inline(struct qemu_plugin_insn *insn,
                               rw, op, ptr, imm);
 }
 
+void qemu_plugin_register_vcpu_mem_inline_per_vcpu(
+    struct qemu_plugin_insn *insn,
+    enum qemu_plugin_mem_rw rw,
+    enum qemu_plugin_op op,
+    qemu_plugin_u64 entry,
+    uint64_t imm)
+{
+    plugin_register_inline_op_on_entry(
+        &insn->cbs[PLUGIN_CB_MEM][PLUGIN_CB_INLINE], rw, op, entry, 0, imm);
+}
+
 void qemu_plugin_register_vcpu_tb_trans_cb(qemu_plugin_id_t id,
                                            qemu_plugin_vcpu_tb_trans_cb_t cb)
 {
@@ -367,6 +457,200 @@ int qemu_plugin_n_max_vcpus(void)
 #endif
 }
 
+/*
+ * Trace buffers
+ *
+ * Each vCPU pushes into its own ring, so a push is a copy and a release
+ * store of the head.  The ring table is only replaced when vCPUs are
+ * added, and is read under RCU.
+ */
+
+static struct plugin_trace_ring *
+plugin_trace_ring_new(struct qemu_plugin_trace_buffer *buf)
+{
+    struct plugin_trace_ring *ring = qemu_memalign(64, sizeof(*ring));
+
+    memset(ring, 0, sizeof(*ring));
+    ring->data = qemu_memalign(qemu_real_host_page_size,
+                               buf->record_size * buf->n_records);
+    return ring;
+}
+
+void plugin_trace_buffer_resize__locked(struct qemu_plugin_trace_buffer *buf,
+                                        size_t n_vcpus)
+{
+    struct plugin_trace_rings *old = buf->rings;
+    struct plugin_trace_rings *rings;
+    size_t old_n = old ? old->n : 0;
+    size_t i;
+
+    rings = g_malloc0(sizeof(*rings) + n_vcpus * sizeof(rings->ring[0]));
+    rings->n = n_vcpus;
+    for (i = 0; i < n_vcpus; i++) {
+        rings->ring[i] = i < old_n ? old->ring[i] : plugin_trace_ring_new(buf);
+    }
+    qatomic_rcu_set(&buf->rings, rings);
+    if (old) {
+        g_free_rcu(old, rcu);
+    }
+}
+
+struct qemu_plugin_trace_buffer *
+qemu_plugin_trace_buffer_new(size_t record_size, size_t n_records)
+{
+    struct qemu_plugin_trace_buffer *buf;
+
+    g_assert(record_size && is_power_of_2(n_records));
+
+    buf = g_new0(struct qemu_plugin_trace_buffer, 1);
+    buf->record_size = record_size;
+    buf->n_records = n_records;
+    qemu_sem_init(&buf->wakeup, 0);
+
+    QEMU_LOCK_GUARD(&plugin.lock);
+    plugin_trace_buffer_resize__locked(buf, plugin.scoreboard_alloc_size);
+    QLIST_INSERT_HEAD(&plugin.trace_buffers, buf, entry);
+    return buf;
+}
+
+bool qemu_plugin_trace_buffer_push(struct qemu_plugin_trace_buffer *buf,
+                                   unsigned int vcpu_index,
+                                   const void *record)
+{
+    struct plugin_trace_rings *rings;
+    struct plugin_trace_ring *ring;
+    size_t head, used;
+
+    RCU_READ_LOCK_GUARD();
+    rings = qatomic_rcu_read(&buf->rings);
+    g_assert(vcpu_index < rings->n);
+    ring = rings->ring[vcpu_index];
+
+    head = ring->head;
+    used = head - qatomic_load_acquire(&ring->tail);
+    if (unlikely(used == buf->n_records)) {
+        qatomic_inc(&buf->dropped);
+        if (buf->consumer_running) {
+            qemu_sem_post(&buf->wakeup);
+        }
+        return false;
+    }
+    memcpy(ring->data + (head & (buf->n_records - 1)) * buf->record_size,
+           record, buf->record_size);
+    qatomic_store_release(&ring->head, head + 1);
+
+    /* don't wait for the period to expire if the ring is filling up */
+    if (used + 1 == buf->n_records / 2 && buf->consumer_running) {
+        qemu_sem_post(&buf->wakeup);
+    }
+    return true;
+}
+
+/*
+ * Disable CFI checks.
+ * The callback function has been loaded from an external library so we do not
+ * have type information
+ */
+QEMU_DISABLE_CFI
+size_t qemu_plugin_trace_buffer_drain(struct qemu_plugin_trace_buffer *buf,
+                                      qemu_plugin_trace_cb_t cb,
+                                      void *userdata)
+{
+    struct plugin_trace_rings *rings;
+    size_t mask = buf->n_records - 1;
+    size_t total = 0;
+    size_t i;
+
+    RCU_READ_LOCK_GUARD();
+    rings = qatomic_rcu_read(&buf->rings);
+    for (i = 0; i < rings->n; i++) {
+        struct plugin_trace_ring *ring = rings->ring[i];
+        size_t tail = ring->tail;
+        size_t head = qatomic_load_acquire(&ring->head);
+
+        /* hand out the records in at most two contiguous batches */
+        while (tail != head) {
+            size_t start = tail & mask;
+            size_t n = MIN(head - tail, buf->n_records - start);
+
+            cb(i, ring->data + start * buf->record_size, n, userdata);
+            tail += n;
+            total += n;
+        }
+        qatomic_store_release(&ring->tail, tail);
+    }
+    return total;
+}
+
+static void *plugin_trace_consumer(void *opaque)
+{
+    struct qemu_plugin_trace_buffer *buf = opaque;
+
+    rcu_register_thread();
+    while (!qatomic_read(&buf->stopping)) {
+        qemu_sem_timedwait(&buf->wakeup, buf->period_ms);
+        qemu_plugin_trace_buffer_drain(buf, buf->cb, buf->userdata);
+    }
+    rcu_unregister_thread();
+    return NULL;
+}
+
+void qemu_plugin_trace_buffer_start_consumer(
+    struct qemu_plugin_trace_buffer *buf,
+    qemu_plugin_trace_cb_t cb,
+    unsigned int period_ms,
+    void *userdata)
+{
+    g_assert(!buf->consumer_running);
+
+    buf->cb = cb;
+    buf->userdata = userdata;
+    buf->period_ms = MAX(period_ms, 1);
+    buf->stopping = false;
+    qatomic_set(&buf->consumer_running, true);
+    qemu_thread_create(&buf->thread, "plugin-trace", plugin_trace_consumer,
+                       buf, QEMU_THREAD_JOINABLE);
+}
+
+void qemu_plugin_trace_buffer_stop_consumer(
+    struct qemu_plugin_trace_buffer *buf)
+{
+    if (!buf->consumer_running) {
+        return;
+    }
+    qatomic_set(&buf->stopping, true);
+    qemu_sem_post(&buf->wakeup);
+    qemu_thread_join(&buf->thread);
+    qatomic_set(&buf->consumer_running, false);
+
+    qemu_plugin_trace_buffer_drain(buf, buf->cb, buf->userdata);
+}
+
+uint64_t qemu_plugin_trace_buffer_dropped(
+    const struct qemu_plugin_trace_buffer *buf)
+{
+    return qatomic_read(&buf->dropped);
+}
+
+void qemu_plugin_trace_buffer_free(struct qemu_plugin_trace_buffer *buf)
+{
+    size_t i;
+
+    qemu_plugin_trace_buffer_stop_consumer(buf);
+
+    qemu_rec_mutex_lock(&plugin.lock);
+    QLIST_REMOVE(buf, entry);
+    qemu_rec_mutex_unlock(&plugin.lock);
+
+    for (i = 0; i < buf->rings->n; i++) {
+        qemu_vfree(buf->rings->ring[i]->data);
+        qemu_vfree(buf->rings->ring[i]);
+    }
+    g_free(buf->rings);
+    qemu_sem_destroy(&buf->wakeup);
+    g_free(buf);
+}
+
 /*
  * Plugin output
  */
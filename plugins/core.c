@@ -19,6 +19,7 @@
 #include "qemu/option.h"
 #include "qemu/rcu_queue.h"
 #include "qemu/xxhash.h"
+#include "qemu/host-utils.h"
 #include "qemu/rcu.h"
 #include "hw/core/cpu.h"
 #include "exec/cpu-common.h"
@@ -213,10 +214,53 @@ plugin_register_cb_udata(qemu_plugin_id_t id, enum qemu_plugin_event ev,
     do_plugin_register_cb(id, ev, func, udata);
 }
 
+/*
+ * Make room for @cpu in all scoreboards and trace buffers.  In system
+ * mode they are sized for max_cpus from the start.  In user mode vCPUs
+ * come and go with guest threads, and translated code may be using them
+ * while the new vCPU's thread is created, so stop all vCPUs before moving
+ * them.
+ */
+static void plugin_grow_scoreboards(CPUState *cpu)
+{
+    struct qemu_plugin_scoreboard *score;
+    struct qemu_plugin_trace_buffer *buf;
+    size_t old_size = plugin.scoreboard_alloc_size;
+    size_t new_size;
+
+    if (likely(cpu->cpu_index < old_size)) {
+        return;
+    }
+    new_size = MAX(old_size * 2, cpu->cpu_index + 1);
+    if (QLIST_EMPTY(&plugin.scoreboards) &&
+        QLIST_EMPTY(&plugin.trace_buffers)) {
+        plugin.scoreboard_alloc_size = new_size;
+        return;
+    }
+
+    start_exclusive();
+    qemu_rec_mutex_lock(&plugin.lock);
+    QLIST_FOREACH(score, &plugin.scoreboards, entry) {
+        void *data = g_malloc0(score->stride * new_size);
+
+        memcpy(data, score->data, score->stride * old_size);
+        g_free(score->data);
+        score->data = data;
+    }
+    QLIST_FOREACH(buf, &plugin.trace_buffers, entry) {
+        plugin_trace_buffer_resize__locked(buf, new_size);
+    }
+    plugin.scoreboard_alloc_size = new_size;
+    qemu_rec_mutex_unlock(&plugin.lock);
+    end_exclusive();
+}
+
 void qemu_plugin_vcpu_init_hook(CPUState *cpu)
 {
     bool success;
 
+    plugin_grow_scoreboards(cpu);
+
     qemu_rec_mutex_lock(&plugin.lock);
     plugin_cpu_update__locked(&cpu->cpu_index, NULL, NULL);
     success = g_hash_table_insert(plugin.cpu_ht, &cpu->cpu_index,
@@ -295,6 +339,33 @@ void plugin_register_inline_op(GArray **arr,
     dyn_cb->rw = rw;
     dyn_cb->inline_insn.op = op;
     dyn_cb->inline_insn.imm = imm;
+    dyn_cb->inline_insn.entry.score = NULL;
+    dyn_cb->inline_insn.entry.offset = 0;
+    dyn_cb->inline_insn.ring_slots = 0;
+}
+
+void plugin_register_inline_op_on_entry(GArray **arr,
+                                        enum qemu_plugin_mem_rw rw,
+                                        enum qemu_plugin_op op,
+                                        qemu_plugin_u64 entry,
+                                        size_t ring_slots,
+                                        uint64_t imm)
+{
+    struct qemu_plugin_dyn_cb *dyn_cb;
+
+    g_assert(entry.score);
+    g_assert(is_power_of_2(ring_slots) || ring_slots == 0);
+    g_assert(entry.offset + (ring_slots + 1) * sizeof(uint64_t) <=
+             entry.score->element_size);
+
+    dyn_cb = plugin_get_dyn_cb(arr);
+    dyn_cb->userp = NULL;
+    dyn_cb->type = PLUGIN_CB_INLINE;
+    dyn_cb->rw = rw;
+    dyn_cb->inline_insn.op = op;
+    dyn_cb->inline_insn.imm = imm;
+    dyn_cb->inline_insn.entry = entry;
+    dyn_cb->inline_insn.ring_slots = ring_slots;
 }
 
 static inline uint32_t cb_to_tcg_flags(enum qemu_plugin_cb_flags flags)
@@ -326,6 +397,34 @@ plugin_register_dyn_cb__udata(GArray **arr,
     dyn_cb->tcg_flags = cb_to_tcg_flags(flags);
     dyn_cb->f.vcpu_udata = cb;
     dyn_cb->type = PLUGIN_CB_REGULAR;
+    dyn_cb->cond.cond = QEMU_PLUGIN_COND_ALWAYS;
+}
+
+void
+plugin_register_dyn_cond_cb__udata(GArray **arr,
+                                   qemu_plugin_vcpu_udata_cb_t cb,
+                                   enum qemu_plugin_cb_flags flags,
+                                   enum qemu_plugin_cond cond,
+                                   qemu_plugin_u64 entry,
+                                   uint64_t imm,
+                                   void *udata)
+{
+    struct qemu_plugin_dyn_cb *dyn_cb;
+
+    if (cond == QEMU_PLUGIN_COND_NEVER) {
+        return;
+    }
+    g_assert(entry.score);
+    g_assert(entry.offset + sizeof(uint64_t) <= entry.score->element_size);
+
+    dyn_cb = plugin_get_dyn_cb(arr);
+    dyn_cb->userp = udata;
+    dyn_cb->tcg_flags = cb_to_tcg_flags(flags);
+    dyn_cb->f.vcpu_udata = cb;
+    dyn_cb->type = PLUGIN_CB_REGULAR;
+    dyn_cb->cond.cond = cond;
+    dyn_cb->cond.entry = entry;
+    dyn_cb->cond.imm = imm;
 }
 
 void plugin_register_vcpu_mem_cb(GArray **arr,
@@ -453,14 +552,34 @@ void qemu_plugin_flush_cb(void)
     plugin_cb__simple(QEMU_PLUGIN_EV_FLUSH);
 }
 
-void exec_inline_op(struct qemu_plugin_dyn_cb *cb)
+static uint64_t *plugin_u64_address(qemu_plugin_u64 entry, int cpu_index)
+{
+    return (uint64_t *)((char *)qemu_plugin_scoreboard_find(entry.score,
+                                                            cpu_index) +
+                        entry.offset);
+}
+
+void exec_inline_op(struct qemu_plugin_dyn_cb *cb, int cpu_index)
 {
     uint64_t *val = cb->userp;
 
+    if (cb->inline_insn.entry.score) {
+        val = plugin_u64_address(cb->inline_insn.entry, cpu_index);
+    }
+
     switch (cb->inline_insn.op) {
     case QEMU_PLUGIN_INLINE_ADD_U64:
         *val += cb->inline_insn.imm;
         break;
+    case QEMU_PLUGIN_INLINE_STORE_U64:
+        if (cb->inline_insn.ring_slots) {
+            val[1 + (*val & (cb->inline_insn.ring_slots - 1))] =
+                cb->inline_insn.imm;
+            *val += 1;
+        } else {
+            *val = cb->inline_insn.imm;
+        }
+        break;
     default:
         g_assert_not_reached();
     }
@@ -487,7 +606,7 @@ void qemu_plugin_vcpu_mem_cb(CPUState *cpu, uint64_t vaddr, uint32_t info)
             cb->f.vcpu_mem(cpu->cpu_index, info, vaddr, cb->userp);
             break;
         case PLUGIN_CB_INLINE:
-            exec_inline_op(cb);
+            exec_inline_op(cb, cpu->cpu_index);
             break;
         default:
             g_assert_not_reached();
@@ -507,6 +626,65 @@ void qemu_plugin_register_atexit_cb(qemu_plugin_id_t id,
     plugin_register_cb_udata(id, QEMU_PLUGIN_EV_ATEXIT, cb, udata);
 }
 
+struct qemu_plugin_scoreboard *qemu_plugin_scoreboard_new(size_t element_size)
+{
+    struct qemu_plugin_scoreboard *score = g_new0(struct qemu_plugin_scoreboard,
+                                                  1);
+
+    score->element_size = element_size;
+    /* keep vCPUs from sharing cache lines */
+    score->stride = ROUND_UP(MAX(element_size, 1), 64);
+
+    QEMU_LOCK_GUARD(&plugin.lock);
+    score->data = g_malloc0(score->stride * plugin.scoreboard_alloc_size);
+    QLIST_INSERT_HEAD(&plugin.scoreboards, score, entry);
+    return score;
+}
+
+void qemu_plugin_scoreboard_free(struct qemu_plugin_scoreboard *score)
+{
+    QEMU_LOCK_GUARD(&plugin.lock);
+    QLIST_REMOVE(score, entry);
+    g_free(score->data);
+    g_free(score);
+}
+
+void *qemu_plugin_scoreboard_find(struct qemu_plugin_scoreboard *score,
+                                  unsigned int vcpu_index)
+{
+    g_assert(vcpu_index < plugin.scoreboard_alloc_size);
+    return (char *)score->data + vcpu_index * score->stride;
+}
+
+uint64_t qemu_plugin_u64_get(qemu_plugin_u64 entry, unsigned int vcpu_index)
+{
+    return *plugin_u64_address(entry, vcpu_index);
+}
+
+void qemu_plugin_u64_set(qemu_plugin_u64 entry, unsigned int vcpu_index,
+                         uint64_t val)
+{
+    *plugin_u64_address(entry, vcpu_index) = val;
+}
+
+void qemu_plugin_u64_add(qemu_plugin_u64 entry, unsigned int vcpu_index,
+                         uint64_t added)
+{
+    *plugin_u64_address(entry, vcpu_index) += added;
+}
+
+uint64_t qemu_plugin_u64_sum(qemu_plugin_u64 entry)
+{
+    uint64_t total = 0;
+    size_t i;
+
+    QEMU_LOCK_GUARD(&plugin.lock);
+    for (i = 0; i < plugin.scoreboard_alloc_size; i++) {
+        total += *plugin_u64_address(entry, i);
+    }
+    return total;
+}
+
 /*
  * Call this function after longjmp'ing to the main loop. It's possible that the
  * last instruction of a TB might have used helpers, and therefore the
@@ -533,6 +711,9 @@ static void __attribute__((__constructor__)) plugin_init(void)
     plugin.id_ht = g_hash_table_new(g_int64_hash, g_int64_equal);
     plugin.cpu_ht = g_hash_table_new(g_int_hash, g_int_equal);
     QTAILQ_INIT(&plugin.ctxs);
+    QLIST_INIT(&plugin.scoreboards);
+    QLIST_INIT(&plugin.trace_buffers);
+    plugin.scoreboard_alloc_size = 1;
     qht_init(&plugin.dyn_cb_arr_ht, plugin_dyn_cb_arr_cmp, 16,
              QHT_MODE_AUTO_RESIZE);
     atexit(qemu_plugin_atexit_cb);
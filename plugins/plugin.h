@@ -13,6 +13,8 @@
 #define _PLUGIN_INTERNAL_H_
 
 #include <gmodule.h>
+#include "qemu/rcu.h"
+#include "qemu/thread.h"
 
 #define QEMU_PLUGIN_MIN_VERSION 0
 
@@ -43,6 +45,14 @@ struct qemu_plugin_state {
      * the code cache is flushed.
      */
     struct qht dyn_cb_arr_ht;
+    /*
+     * Scoreboards, each with room for @scoreboard_alloc_size vCPUs.
+     * Protected by @lock, and only resized with all vCPUs stopped.
+     */
+    QLIST_HEAD(, qemu_plugin_scoreboard) scoreboards;
+    size_t scoreboard_alloc_size;
+    /* trace buffers have rings for as many vCPUs as scoreboards */
+    QLIST_HEAD(, qemu_plugin_trace_buffer) trace_buffers;
 };
 
 
@@ -61,13 +71,59 @@ struct qemu_plugin_ctx {
     bool resetting;
 };
 
+/*
+ * A vCPU's trace ring.  @head is only written by the vCPU and @tail only
+ * by the consumer; both count records and wrap around the ring with
+ * & (n_records - 1).
+ */
+struct plugin_trace_ring {
+    size_t head QEMU_ALIGNED(64);
+    size_t tail QEMU_ALIGNED(64);
+    uint8_t *data QEMU_ALIGNED(64);
+};
+
+/* The rings of a trace buffer, replaced under RCU when vCPUs are added */
+struct plugin_trace_rings {
+    struct rcu_head rcu;
+    size_t n;
+    struct plugin_trace_ring *ring[];
+};
+
+struct qemu_plugin_trace_buffer {
+    size_t record_size;
+    size_t n_records;
+    struct plugin_trace_rings *rings;
+    size_t dropped;
+
+    /* consumer thread */
+    QemuThread thread;
+    QemuSemaphore wakeup;
+    bool consumer_running;
+    bool stopping;
+    qemu_plugin_trace_cb_t cb;
+    void *userdata;
+    unsigned int period_ms;
+
+    QLIST_ENTRY(qemu_plugin_trace_buffer) entry;
+};
+
 struct qemu_plugin_ctx *plugin_id_to_ctx_locked(qemu_plugin_id_t id);
 
+void plugin_trace_buffer_resize__locked(struct qemu_plugin_trace_buffer *buf,
+                                        size_t n_vcpus);
+
 void plugin_register_inline_op(GArray **arr,
                                enum qemu_plugin_mem_rw rw,
                                enum qemu_plugin_op op, void *ptr,
                                uint64_t imm);
 
+void plugin_register_inline_op_on_entry(GArray **arr,
+                                        enum qemu_plugin_mem_rw rw,
+                                        enum qemu_plugin_op op,
+                                        qemu_plugin_u64 entry,
+                                        size_t ring_slots,
+                                        uint64_t imm);
+
 void plugin_reset_uninstall(qemu_plugin_id_t id,
                             qemu_plugin_simple_cb_t cb,
                             bool reset);
@@ -87,6 +143,15 @@ plugin_register_dyn_cb__udata(GArray **arr,
                               qemu_plugin_vcpu_udata_cb_t cb,
                               enum qemu_plugin_cb_flags flags, void *udata);
 
+void
+plugin_register_dyn_cond_cb__udata(GArray **arr,
+                                   qemu_plugin_vcpu_udata_cb_t cb,
+                                   enum qemu_plugin_cb_flags flags,
+                                   enum qemu_plugin_cond cond,
+                                   qemu_plugin_u64 entry,
+                                   uint64_t imm,
+                                   void *udata);
+
 
 void plugin_register_vcpu_mem_cb(GArray **arr,
                                  void *cb,
@@ -94,6 +159,6 @@ void plugin_register_vcpu_mem_cb(GArray **arr,
                                  enum qemu_plugin_mem_rw rw,
                                  void *udata);
 
-void exec_inline_op(struct qemu_plugin_dyn_cb *cb);
+void exec_inline_op(struct qemu_plugin_dyn_cb *cb, int cpu_index);
 
 #endif /* _PLUGIN_INTERNAL_H_ */
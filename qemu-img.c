@@ -37,10 +37,12 @@
 #include "qemu/config-file.h"
 #include "qemu/option.h"
 #include "qemu/error-report.h"
+#include "qemu/host-utils.h"
 #include "qemu/log.h"
 #include "qemu/main-loop.h"
 #include "qemu/module.h"
 #include "qemu/sockets.h"
+#include "qemu/timer.h"
 #include "qemu/units.h"
 #include "qom/object_interfaces.h"
 #include "sysemu/block-backend.h"
@@ -82,6 +84,10 @@ enum {
     OPTION_MERGE = 274,
     OPTION_BITMAPS = 275,
     OPTION_FORCE = 276,
+    OPTION_RANDOM = 277,
+    OPTION_WRITE_PERCENT = 278,
+    OPTION_QUEUES = 279,
+    OPTION_TIME = 280,
 };
 
 typedef enum OutputFormat {
@@ -1210,7 +1216,14 @@ static int is_allocated_sectors(const uint8_t *buf, int n, int *pnum,
         return 0;
     }
     is_zero = buffer_is_zero(buf, BDRV_SECTOR_SIZE);
-    for(i = 1; i < n; i++) {
+    if (is_zero && n > 1 &&
+        buffer_is_zero(buf + BDRV_SECTOR_SIZE, (n - 1) * BDRV_SECTOR_SIZE)) {
+        /* Zero areas are usually large, scan them in one go */
+        i = n;
+    } else {
+        i = 1;
+    }
+    for (; i < n; i++) {
         buf += BDRV_SECTOR_SIZE;
         if (is_zero != buffer_is_zero(buf, BDRV_SECTOR_SIZE)) {
             break;
@@ -1669,6 +1682,14 @@ enum ImgConvertBlockStatus {
 };
 
 #define MAX_COROUTINES 16
+#define CONVERT_MAX_SHARD_SIZE (1 * GiB)
+
+/* Position of a walk over the source block status */
+typedef struct ImgConvertWalk {
+    enum ImgConvertBlockStatus status;
+    int64_t sector_next_status;
+} ImgConvertWalk;
+
 #define CONVERT_THROTTLE_GROUP "img_convert"
 
 typedef struct ImgConvertState {
@@ -1681,8 +1702,10 @@ typedef struct ImgConvertState {
     int64_t allocated_done;
     int64_t sector_num;
     int64_t wr_offs;
-    enum ImgConvertBlockStatus status;
-    int64_t sector_next_status;
+    ImgConvertWalk walk;
+    /* Without in-order writes, coroutines claim shards of this many sectors
+     * and walk the block status of each on their own; 0 if disabled */
+    int64_t shard_sectors;
     BlockBackend *target;
     bool has_zero_init;
     bool compressed;
@@ -1717,7 +1740,8 @@ static void convert_select_part(ImgConvertState *s, int64_t sector_num,
     }
 }
 
-static int convert_iteration_sectors(ImgConvertState *s, int64_t sector_num)
+static int convert_iteration_sectors(ImgConvertState *s, ImgConvertWalk *walk,
+                                     int64_t sector_num)
 {
     int64_t src_cur_offset;
     int ret, n, src_cur;
@@ -1738,7 +1762,7 @@ static int convert_iteration_sectors(ImgConvertState *s, int64_t sector_num)
         }
     }
 
-    if (s->sector_next_status <= sector_num) {
+    if (walk->sector_next_status <= sector_num) {
         uint64_t offset = (sector_num - src_cur_offset) * BDRV_SECTOR_SIZE;
         int64_t count;
         int tail;
@@ -1783,7 +1807,7 @@ static int convert_iteration_sectors(ImgConvertState *s, int64_t sector_num)
         n = DIV_ROUND_UP(count, BDRV_SECTOR_SIZE);
 
         /*
-         * Avoid that s->sector_next_status becomes unaligned to the source
+         * Avoid that walk->sector_next_status becomes unaligned to the source
          * request alignment and/or cluster size to avoid unnecessary read
          * cycles.
          */
@@ -1793,18 +1817,18 @@ static int convert_iteration_sectors(ImgConvertState *s, int64_t sector_num)
         }
 
         if (ret & BDRV_BLOCK_ZERO) {
-            s->status = post_backing_zero ? BLK_BACKING_FILE : BLK_ZERO;
+            walk->status = post_backing_zero ? BLK_BACKING_FILE : BLK_ZERO;
         } else if (ret & BDRV_BLOCK_DATA) {
-            s->status = BLK_DATA;
+            walk->status = BLK_DATA;
         } else {
-            s->status = s->target_has_backing ? BLK_BACKING_FILE : BLK_DATA;
+            walk->status = s->target_has_backing ? BLK_BACKING_FILE : BLK_DATA;
         }
 
-        s->sector_next_status = sector_num + n;
+        walk->sector_next_status = sector_num + n;
     }
 
-    n = MIN(n, s->sector_next_status - sector_num);
-    if (s->status == BLK_DATA) {
+    n = MIN(n, walk->sector_next_status - sector_num);
+    if (walk->status == BLK_DATA) {
         n = MIN(n, s->buf_sectors);
     }
 
@@ -1814,7 +1838,7 @@ static int convert_iteration_sectors(ImgConvertState *s, int64_t sector_num)
     if (s->compressed) {
         if (n < s->cluster_sectors) {
             n = MIN(s->cluster_sectors, s->total_sectors - sector_num);
-            s->status = BLK_DATA;
+            walk->status = BLK_DATA;
         } else {
             n = QEMU_ALIGN_DOWN(n, s->cluster_sectors);
         }
@@ -1975,6 +1999,8 @@ static int coroutine_fn convert_co_copy_range(ImgConvertState *s, int64_t sector
 static void coroutine_fn convert_co_do_copy(void *opaque)
 {
     ImgConvertState *s = opaque;
+    ImgConvertWalk shard_walk = { 0 };
+    int64_t shard_next = 0, shard_end = 0;
     uint8_t *buf = NULL;
     int ret, i;
     int index = -1;
@@ -1994,29 +2020,62 @@ static void coroutine_fn convert_co_do_copy(void *opaque)
         int n;
         int64_t sector_num;
         enum ImgConvertBlockStatus status;
+        ImgConvertWalk *walk;
         bool copy_range;
 
-        qemu_co_mutex_lock(&s->lock);
-        if (s->ret != -EINPROGRESS || s->sector_num >= s->total_sectors) {
-            qemu_co_mutex_unlock(&s->lock);
-            break;
-        }
-        n = convert_iteration_sectors(s, s->sector_num);
-        if (n < 0) {
+        if (s->shard_sectors) {
+            if (s->ret != -EINPROGRESS) {
+                break;
+            }
+            if (shard_next >= shard_end) {
+                /* claim the next shard; nothing yields in between, so
+                 * s->lock is not needed */
+                if (s->sector_num >= s->total_sectors) {
+                    break;
+                }
+                shard_next = s->sector_num;
+                shard_end = MIN(shard_next + s->shard_sectors,
+                                s->total_sectors);
+                s->sector_num = shard_end;
+                shard_walk.sector_next_status = 0;
+            }
+            walk = &shard_walk;
+            n = convert_iteration_sectors(s, walk, shard_next);
+            if (n < 0) {
+                s->ret = n;
+                break;
+            }
+            sector_num = shard_next;
+            status = walk->status;
+            n = MIN(n, shard_end - sector_num);
+            if (!s->min_sparse && status == BLK_ZERO) {
+                n = MIN(n, s->buf_sectors);
+            }
+            shard_next += n;
+        } else {
+            qemu_co_mutex_lock(&s->lock);
+            if (s->ret != -EINPROGRESS || s->sector_num >= s->total_sectors) {
+                qemu_co_mutex_unlock(&s->lock);
+                break;
+            }
+            walk = &s->walk;
+            n = convert_iteration_sectors(s, walk, s->sector_num);
+            if (n < 0) {
+                qemu_co_mutex_unlock(&s->lock);
+                s->ret = n;
+                break;
+            }
+            /* save current sector and allocation status to local variables */
+            sector_num = s->sector_num;
+            status = walk->status;
+            if (!s->min_sparse && walk->status == BLK_ZERO) {
+                n = MIN(n, s->buf_sectors);
+            }
+            /* increment global sector counter so that other coroutines can
+             * already continue reading beyond this request */
+            s->sector_num += n;
             qemu_co_mutex_unlock(&s->lock);
-            s->ret = n;
-            break;
         }
-        /* save current sector and allocation status to local variables */
-        sector_num = s->sector_num;
-        status = s->status;
-        if (!s->min_sparse && s->status == BLK_ZERO) {
-            n = MIN(n, s->buf_sectors);
-        }
-        /* increment global sector counter so that other coroutines can
-         * already continue reading beyond this request */
-        s->sector_num += n;
-        qemu_co_mutex_unlock(&s->lock);
 
         if (status == BLK_DATA || (!s->min_sparse && status == BLK_ZERO)) {
             s->allocated_done += n;
@@ -2025,7 +2084,7 @@ static void coroutine_fn convert_co_do_copy(void *opaque)
         }
 
 retry:
-        copy_range = s->copy_range && s->status == BLK_DATA;
+        copy_range = s->copy_range && walk->status == BLK_DATA;
         if (status == BLK_DATA && !copy_range) {
             ret = convert_co_read(s, sector_num, n, buf);
             if (ret < 0) {
@@ -2113,19 +2172,34 @@ static int convert_do_copy(ImgConvertState *s)
     }
 
     while (sector_num < s->total_sectors) {
-        n = convert_iteration_sectors(s, sector_num);
+        n = convert_iteration_sectors(s, &s->walk, sector_num);
         if (n < 0) {
             return n;
         }
-        if (s->status == BLK_DATA || (!s->min_sparse && s->status == BLK_ZERO))
+        if (s->walk.status == BLK_DATA ||
+            (!s->min_sparse && s->walk.status == BLK_ZERO))
         {
             s->allocated_sectors += n;
         }
         sector_num += n;
     }
 
+    /*
+     * When writes may be reordered, let each coroutine walk the block status
+     * of its own shard so that status queries do not serialize the copy.
+     * Shards are a multiple of the buffer size, which is a whole cluster for
+     * compressed targets, and small enough to keep all coroutines busy.
+     */
+    if (!s->wr_in_order && s->num_coroutines > 1) {
+        s->shard_sectors = DIV_ROUND_UP(s->total_sectors,
+                                        s->num_coroutines * 4);
+        s->shard_sectors = MIN(s->shard_sectors,
+                               CONVERT_MAX_SHARD_SIZE / BDRV_SECTOR_SIZE);
+        s->shard_sectors = QEMU_ALIGN_UP(s->shard_sectors, s->buf_sectors);
+    }
+
     /* Do the copy */
-    s->sector_next_status = 0;
+    s->walk.sector_next_status = 0;
     s->ret = -EINPROGRESS;
 
     qemu_co_mutex_init(&s->lock);
@@ -4301,23 +4375,130 @@ out_no_progress:
     return 0;
 }
 
-typedef struct BenchData {
+/*
+ * Latencies are counted in a log-linear histogram as HdrHistogram does:
+ * values below BENCH_HIST_SUB have a bucket each, and every following
+ * power of two is split into BENCH_HIST_SUB / 2 buckets, which keeps the
+ * error of a reported value below 2%.
+ */
+#define BENCH_HIST_SUB_BITS 7
+#define BENCH_HIST_SUB      (1 << BENCH_HIST_SUB_BITS)
+#define BENCH_HIST_BUCKETS  ((66 - BENCH_HIST_SUB_BITS) * BENCH_HIST_SUB / 2)
+
+typedef struct BenchHistogram {
+    uint64_t count;
+    uint64_t bytes;
+    uint64_t sum;
+    uint64_t min;
+    uint64_t max;
+    uint64_t buckets[BENCH_HIST_BUCKETS];
+} BenchHistogram;
+
+typedef struct BenchData BenchData;
+
+typedef struct BenchRequest {
+    BenchData *b;
+    QEMUIOVector qiov;
+    int64_t start;
+    bool write;
+} BenchRequest;
+
+struct BenchData {
     BlockBackend *blk;
     uint64_t image_size;
-    bool write;
+    int write_percent;
+    bool random;
     int bufsize;
     int step;
     int nrreq;
     int n;
     int flush_interval;
     bool drain_on_flush;
+    int64_t deadline;
     uint8_t *buf;
-    QEMUIOVector *qiov;
+    BenchRequest *reqs;
+    BenchRequest **free_reqs;
+    int nr_free;
+    GRand *rand;
+    /* Indexed by BenchRequest.write, shared by all queues */
+    BenchHistogram *hist;
 
     int in_flight;
     bool in_flush;
     uint64_t offset;
-} BenchData;
+};
+
+static unsigned bench_hist_index(uint64_t v)
+{
+    int shift;
+
+    if (v < BENCH_HIST_SUB) {
+        return v;
+    }
+    shift = 63 - clz64(v) - (BENCH_HIST_SUB_BITS - 1);
+    return shift * (BENCH_HIST_SUB / 2) + (v >> shift);
+}
+
+/* Highest value counted in bucket @i */
+static uint64_t bench_hist_value(unsigned i)
+{
+    int shift;
+
+    if (i < BENCH_HIST_SUB) {
+        return i;
+    }
+    shift = i / (BENCH_HIST_SUB / 2) - 1;
+    return ((uint64_t)(i - shift * (BENCH_HIST_SUB / 2) + 1) << shift) - 1;
+}
+
+static void bench_hist_add(BenchHistogram *h, uint64_t ns, int bytes)
+{
+    if (!h->count || ns < h->min) {
+        h->min = ns;
+    }
+    h->max = MAX(h->max, ns);
+    h->count++;
+    h->bytes += bytes;
+    h->sum += ns;
+    h->buckets[bench_hist_index(ns)]++;
+}
+
+static uint64_t bench_hist_percentile(BenchHistogram *h, double percent)
+{
+    uint64_t target = MAX(1, (uint64_t)(h->count * percent / 100 + 0.5));
+    uint64_t seen = 0;
+    unsigned i;
+
+    for (i = 0; i < BENCH_HIST_BUCKETS; i++) {
+        seen += h->buckets[i];
+        if (seen >= target) {
+            return MIN(bench_hist_value(i), h->max);
+        }
+    }
+    return h->max;
+}
+
+static void bench_hist_print(const char *name, BenchHistogram *h, double secs)
+{
+    static const double percents[] = { 50, 90, 99, 99.9, 99.99 };
+    int i;
+
+    if (!h->count) {
+        return;
+    }
+
+    printf("%s: %" PRIu64 " requests, %.0f IOPS, %.2f MiB/s\n",
+           name, h->count, h->count / secs, h->bytes / secs / MiB);
+    printf("  latency (us): min %.1f, avg %.1f, max %.1f\n",
+           h->min / 1000.0, (double)h->sum / h->count / 1000.0,
+           h->max / 1000.0);
+    printf("  percentiles (us):");
+    for (i = 0; i < ARRAY_SIZE(percents); i++) {
+        printf(" p%g %.1f", percents[i],
+               bench_hist_percentile(h, percents[i]) / 1000.0);
+    }
+    printf("\n");
+}
 
 static void bench_undrained_flush_cb(void *opaque, int ret)
 {
@@ -4327,6 +4508,37 @@ static void bench_undrained_flush_cb(void *opaque, int ret)
     }
 }
 
+static void bench_cb(void *opaque, int ret);
+
+static void bench_request_cb(void *opaque, int ret)
+{
+    BenchRequest *req = opaque;
+    BenchData *b = req->b;
+
+    if (ret >= 0) {
+        bench_hist_add(&b->hist[req->write], get_clock() - req->start,
+                       b->bufsize);
+    }
+    b->free_reqs[b->nr_free++] = req;
+    bench_cb(b, ret);
+}
+
+static uint64_t bench_next_offset(BenchData *b)
+{
+    uint64_t offset = b->offset;
+
+    if (b->random) {
+        uint64_t r = (uint64_t)g_rand_int(b->rand) << 32 |
+                     g_rand_int(b->rand);
+
+        return r % (b->image_size / b->bufsize) * b->bufsize;
+    }
+
+    b->offset += b->step;
+    b->offset %= b->image_size;
+    return offset;
+}
+
 static void bench_cb(void *opaque, int ret)
 {
     BenchData *b = opaque;
@@ -4372,18 +4584,32 @@ static void bench_cb(void *opaque, int ret)
     }
 
     while (b->n > b->in_flight && b->in_flight < b->nrreq) {
-        int64_t offset = b->offset;
+        BenchRequest *req;
+        int64_t offset;
+
+        if (b->deadline && get_clock() >= b->deadline) {
+            /* Time is up: only complete the requests in flight */
+            b->n = b->in_flight;
+            break;
+        }
+
         /* blk_aio_* might look for completed I/Os and kick bench_cb
          * again, so make sure this operation is counted by in_flight
          * and b->offset is ready for the next submission.
          */
+        req = b->free_reqs[--b->nr_free];
+        req->write = b->write_percent == 100 ||
+                     (b->write_percent &&
+                      g_rand_int_range(b->rand, 0, 100) < b->write_percent);
+        offset = bench_next_offset(b);
         b->in_flight++;
-        b->offset += b->step;
-        b->offset %= b->image_size;
-        if (b->write) {
-            acb = blk_aio_pwritev(b->blk, offset, b->qiov, 0, bench_cb, b);
+        req->start = get_clock();
+        if (req->write) {
+            acb = blk_aio_pwritev(b->blk, offset, &req->qiov, 0,
+                                  bench_request_cb, req);
         } else {
-            acb = blk_aio_preadv(b->blk, offset, b->qiov, 0, bench_cb, b);
+            acb = blk_aio_preadv(b->blk, offset, &req->qiov, 0,
+                                 bench_request_cb, req);
         }
         if (!acb) {
             error_report("Failed to issue request");
@@ -4392,28 +4618,46 @@ static void bench_cb(void *opaque, int ret)
     }
 }
 
+static bool bench_running(BenchData *queues, int nr_queues)
+{
+    int i;
+
+    for (i = 0; i < nr_queues; i++) {
+        if (queues[i].n > 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
 static int img_bench(int argc, char **argv)
 {
     int c, ret = 0;
     const char *fmt = NULL, *filename;
     bool quiet = false;
     bool image_opts = false;
-    bool is_write = false;
+    int write_percent = 0;
+    bool is_random = false;
     int count = 75000;
+    bool count_set = false;
     int depth = 64;
+    int nr_queues = 1;
     int64_t offset = 0;
     size_t bufsize = 4096;
     int pattern = 0;
     size_t step = 0;
     int flush_interval = 0;
     bool drain_on_flush = true;
-    int64_t image_size;
+    unsigned long run_time = 0;
+    int64_t image_size, queue_size;
     BlockBackend *blk = NULL;
-    BenchData data = {};
+    BenchData *queues = NULL;
+    BenchHistogram *hist = NULL;
     int flags = 0;
     bool writethrough = false;
-    struct timeval t1, t2;
-    int i;
+    int64_t t1, t2;
+    double secs;
+    int i, q;
     bool force_share = false;
     size_t buf_size;
 
@@ -4424,6 +4668,10 @@ static int img_bench(int argc, char **argv)
             {"image-opts", no_argument, 0, OPTION_IMAGE_OPTS},
             {"pattern", required_argument, 0, OPTION_PATTERN},
             {"no-drain", no_argument, 0, OPTION_NO_DRAIN},
+            {"random", no_argument, 0, OPTION_RANDOM},
+            {"write-percent", required_argument, 0, OPTION_WRITE_PERCENT},
+            {"queues", required_argument, 0, OPTION_QUEUES},
+            {"time", required_argument, 0, OPTION_TIME},
             {"force-share", no_argument, 0, 'U'},
             {0, 0, 0, 0}
         };
@@ -4452,6 +4700,7 @@ static int img_bench(int argc, char **argv)
                 return 1;
             }
             count = res;
+            count_set = true;
             break;
         }
         case 'd':
@@ -4525,7 +4774,7 @@ static int img_bench(int argc, char **argv)
             break;
         case 'w':
             flags |= BDRV_O_RDWR;
-            is_write = true;
+            write_percent = 100;
             break;
         case 'U':
             force_share = true;
@@ -4555,6 +4804,42 @@ static int img_bench(int argc, char **argv)
         case OPTION_NO_DRAIN:
             drain_on_flush = false;
             break;
+        case OPTION_RANDOM:
+            is_random = true;
+            break;
+        case OPTION_WRITE_PERCENT:
+        {
+            unsigned long res;
+
+            if (qemu_strtoul(optarg, NULL, 0, &res) < 0 || res > 100) {
+                error_report("Invalid write percentage specified");
+                return 1;
+            }
+            write_percent = res;
+            if (write_percent) {
+                flags |= BDRV_O_RDWR;
+            }
+            break;
+        }
+        case OPTION_QUEUES:
+        {
+            unsigned long res;
+
+            if (qemu_strtoul(optarg, NULL, 0, &res) < 0 || res < 1 ||
+                res > 1024) {
+                error_report("Invalid number of queues specified");
+                return 1;
+            }
+            nr_queues = res;
+            break;
+        }
+        case OPTION_TIME:
+            if (qemu_strtoul(optarg, NULL, 0, &run_time) < 0 ||
+                run_time < 1 || run_time > INT32_MAX) {
+                error_report("Invalid run time specified");
+                return 1;
+            }
+            break;
         case OPTION_IMAGE_OPTS:
             image_opts = true;
             break;
@@ -4566,7 +4851,7 @@ static int img_bench(int argc, char **argv)
     }
     filename = argv[argc - 1];
 
-    if (!is_write && flush_interval) {
+    if (!write_percent && flush_interval) {
         error_report("--flush-interval is only available in write tests");
         ret = -1;
         goto out;
@@ -4590,56 +4875,133 @@ static int img_bench(int argc, char **argv)
         goto out;
     }
 
-    data = (BenchData) {
-        .blk            = blk,
-        .image_size     = image_size,
-        .bufsize        = bufsize,
-        .step           = step ?: bufsize,
-        .nrreq          = depth,
-        .n              = count,
-        .offset         = offset,
-        .write          = is_write,
-        .flush_interval = flush_interval,
-        .drain_on_flush = drain_on_flush,
-    };
-    printf("Sending %d %s requests, %d bytes each, %d in parallel "
-           "(starting at offset %" PRId64 ", step size %d)\n",
-           data.n, data.write ? "write" : "read", data.bufsize, data.nrreq,
-           data.offset, data.step);
-    if (flush_interval) {
-        printf("Sending flush every %d requests\n", flush_interval);
+    if (is_random && (!bufsize || image_size < bufsize)) {
+        error_report("Image is smaller than the buffer size");
+        ret = -1;
+        goto out;
+    }
+
+    if (run_time && !count_set) {
+        count = INT_MAX;
     }
+    if (count < nr_queues) {
+        nr_queues = MAX(count, 1);
+    }
+
+    /*
+     * All queues submit to the same BlockBackend and thus run in its
+     * AioContext, but keep their own depth, buffers and position so
+     * that they compete with each other as separate guest queues would.
+     * Sequential queues start at evenly spread positions in the image.
+     */
+    hist = g_new0(BenchHistogram, 2);
+    queues = g_new0(BenchData, nr_queues);
+    queue_size = QEMU_ALIGN_DOWN(image_size / nr_queues, bufsize);
+    for (q = 0; q < nr_queues; q++) {
+        BenchData *b = &queues[q];
+
+        *b = (BenchData) {
+            .blk            = blk,
+            .image_size     = image_size,
+            .bufsize        = bufsize,
+            .step           = step ?: bufsize,
+            .nrreq          = depth,
+            .n              = run_time && !count_set ? count :
+                              count / nr_queues + (q < count % nr_queues),
+            .offset         = (offset + q * queue_size) % image_size,
+            .write_percent  = write_percent,
+            .random         = is_random,
+            .flush_interval = flush_interval,
+            .drain_on_flush = drain_on_flush,
+            .hist           = hist,
+            /* Fixed seeds make runs comparable with each other */
+            .rand           = g_rand_new_with_seed(q),
+        };
+
+        buf_size = b->nrreq * b->bufsize;
+        b->buf = blk_blockalign(blk, buf_size);
+        memset(b->buf, pattern, buf_size);
 
-    buf_size = data.nrreq * data.bufsize;
-    data.buf = blk_blockalign(blk, buf_size);
-    memset(data.buf, pattern, data.nrreq * data.bufsize);
+        blk_register_buf(blk, b->buf, buf_size);
 
-    blk_register_buf(blk, data.buf, buf_size);
+        b->reqs = g_new0(BenchRequest, b->nrreq);
+        b->free_reqs = g_new(BenchRequest *, b->nrreq);
+        for (i = 0; i < b->nrreq; i++) {
+            b->reqs[i].b = b;
+            qemu_iovec_init(&b->reqs[i].qiov, 1);
+            qemu_iovec_add(&b->reqs[i].qiov,
+                           b->buf + i * b->bufsize, b->bufsize);
+            b->free_reqs[b->nr_free++] = &b->reqs[i];
+        }
+    }
 
-    data.qiov = g_new(QEMUIOVector, data.nrreq);
-    for (i = 0; i < data.nrreq; i++) {
-        qemu_iovec_init(&data.qiov[i], 1);
-        qemu_iovec_add(&data.qiov[i],
-                       data.buf + i * data.bufsize, data.bufsize);
+    if (run_time) {
+        printf("Sending %s%s requests for %lu seconds",
+               is_random ? "random " : "",
+               write_percent == 100 ? "write" :
+               write_percent ? "mixed" : "read", run_time);
+        if (count_set) {
+            printf(" (at most %d)", count);
+        }
+    } else {
+        printf("Sending %d %s%s requests", count, is_random ? "random " : "",
+               write_percent == 100 ? "write" :
+               write_percent ? "mixed" : "read");
+    }
+    printf(", %d bytes each, %d in parallel", queues[0].bufsize, depth);
+    if (nr_queues > 1) {
+        printf(" on each of %d queues", nr_queues);
+    }
+    if (is_random) {
+        printf("\n");
+    } else {
+        printf(" (starting at offset %" PRId64 ", step size %d)\n",
+               offset, queues[0].step);
+    }
+    if (write_percent && write_percent < 100) {
+        printf("%d%% of requests are writes\n", write_percent);
+    }
+    if (flush_interval) {
+        printf("Sending flush every %d requests\n", flush_interval);
     }
 
-    gettimeofday(&t1, NULL);
-    bench_cb(&data, 0);
+    t1 = get_clock();
+    for (q = 0; q < nr_queues; q++) {
+        if (run_time) {
+            queues[q].deadline = t1 + run_time * NANOSECONDS_PER_SECOND;
+        }
+        bench_cb(&queues[q], 0);
+    }
 
-    while (data.n > 0) {
+    while (bench_running(queues, nr_queues)) {
         main_loop_wait(false);
     }
-    gettimeofday(&t2, NULL);
+    t2 = get_clock();
 
-    printf("Run completed in %3.3f seconds.\n",
-           (t2.tv_sec - t1.tv_sec)
-           + ((double)(t2.tv_usec - t1.tv_usec) / 1000000));
+    secs = (double)(t2 - t1) / NANOSECONDS_PER_SECOND;
+    printf("Run completed in %3.3f seconds.\n", secs);
+    bench_hist_print("read", &hist[false], secs);
+    bench_hist_print("write", &hist[true], secs);
 
 out:
-    if (data.buf) {
-        blk_unregister_buf(blk, data.buf);
+    for (q = 0; queues && q < nr_queues; q++) {
+        BenchData *b = &queues[q];
+
+        if (b->buf) {
+            blk_unregister_buf(blk, b->buf);
+        }
+        for (i = 0; b->reqs && i < b->nrreq; i++) {
+            qemu_iovec_destroy(&b->reqs[i].qiov);
+        }
+        g_free(b->reqs);
+        g_free(b->free_reqs);
+        if (b->rand) {
+            g_rand_free(b->rand);
+        }
+        qemu_vfree(b->buf);
     }
-    qemu_vfree(data.buf);
+    g_free(queues);
+    g_free(hist);
     blk_unref(blk);
 
     if (ret) {
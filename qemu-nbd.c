@@ -40,6 +40,7 @@
 #include "qapi/qmp/qdict.h"
 #include "qapi/qmp/qstring.h"
 #include "qom/object_interfaces.h"
+#include "sysemu/iothread.h"
 #include "io/channel-socket.h"
 #include "io/net-listener.h"
 #include "crypto/init.h"
@@ -63,6 +64,7 @@
 #define QEMU_NBD_OPT_FORK          263
 #define QEMU_NBD_OPT_TLSAUTHZ      264
 #define QEMU_NBD_OPT_PID_FILE      265
+#define QEMU_NBD_OPT_IOTHREADS     266
 
 #define MBR_SIZE 512
 
@@ -93,6 +95,7 @@ static void usage(const char *name)
 "  -k, --socket=PATH         path to the unix socket\n"
 "                            (default '"SOCKET_PATH"')\n"
 "  -e, --shared=NUM          device can be shared by NUM clients (default '1')\n"
+"      --iothreads=NUM       serve clients from a pool of NUM iothreads\n"
 "  -t, --persistent          don't exit on the last connection\n"
 "  -v, --verbose             display extra debugging information\n"
 "  -x, --export-name=NAME    expose export by name (default is empty string)\n"
@@ -555,6 +558,7 @@ int main(int argc, char **argv)
         { "trace", required_argument, NULL, 'T' },
         { "fork", no_argument, NULL, QEMU_NBD_OPT_FORK },
         { "pid-file", required_argument, NULL, QEMU_NBD_OPT_PID_FILE },
+        { "iothreads", required_argument, NULL, QEMU_NBD_OPT_IOTHREADS },
         { NULL, 0, NULL, 0 }
     };
     int ch;
@@ -581,6 +585,8 @@ int main(int argc, char **argv)
     int old_stderr = -1;
     unsigned socket_activation;
     const char *pid_file_name = NULL;
+    unsigned nr_iothreads = 0;
+    strList *iothreads = NULL;
     BlockExportOptions *export_opts;
 
 #ifdef CONFIG_POSIX
@@ -776,6 +782,13 @@ int main(int argc, char **argv)
         case QEMU_NBD_OPT_PID_FILE:
             pid_file_name = optarg;
             break;
+        case QEMU_NBD_OPT_IOTHREADS:
+            if (qemu_strtoui(optarg, NULL, 0, &nr_iothreads) < 0 ||
+                nr_iothreads > 256) {
+                error_report("Invalid number of iothreads '%s'", optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
         }
     }
 
@@ -786,7 +799,8 @@ int main(int argc, char **argv)
         }
         if (export_name || export_description || dev_offset ||
             device || disconnect || fmt || sn_id_or_name || bitmaps ||
-            alloc_depth || seen_aio || seen_discard || seen_cache) {
+            alloc_depth || seen_aio || seen_discard || seen_cache ||
+            nr_iothreads) {
             error_report("List mode is incompatible with per-device settings");
             exit(EXIT_FAILURE);
         }
@@ -1064,6 +1078,14 @@ int main(int argc, char **argv)
 
     nbd_server_is_qemu_nbd(true);
 
+    while (nr_iothreads > 0) {
+        char *id = g_strdup_printf("qemu-nbd-iothread%u", --nr_iothreads);
+
+        object_new_with_props(TYPE_IOTHREAD, object_get_objects_root(), id,
+                              &error_fatal, NULL);
+        QAPI_LIST_PREPEND(iothreads, id);
+    }
+
     export_opts = g_new(BlockExportOptions, 1);
     *export_opts = (BlockExportOptions) {
         .type               = BLOCK_EXPORT_TYPE_NBD,
@@ -1082,6 +1104,8 @@ int main(int argc, char **argv)
             .bitmaps              = bitmaps,
             .has_allocation_depth = alloc_depth,
             .allocation_depth     = alloc_depth,
+            .has_iothreads        = !!iothreads,
+            .iothreads            = iothreads,
         },
     };
     blk_exp_add(export_opts, &error_fatal);
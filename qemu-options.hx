@@ -30,6 +30,7 @@ DEF("machine", HAS_ARG, QEMU_OPTION_machine, \
     "                vmport=on|off|auto controls emulation of vmport (default: auto)\n"
     "                dump-guest-core=on|off include guest memory in a core dump (default=on)\n"
     "                mem-merge=on|off controls memory merge support (default: on)\n"
+    "                share-rom=on|off maps read-only firmware from its file (default: off)\n"
     "                aes-key-wrap=on|off controls support for AES key wrapping (default=on)\n"
     "                dea-key-wrap=on|off controls support for DEA key wrapping (default=on)\n"
     "                suppress-vmdesc=on|off disables self-describing migration (default=off)\n"
@@ -76,6 +77,17 @@ SRST
         supported by the host, de-duplicates identical memory pages
         among VMs instances (enabled by default).
 
+    ``share-rom=on|off``
+        Enables or disables mapping read-only firmware, such as the PC
+        BIOS, directly from its file instead of copying it into guest
+        RAM. Pages that the guest does not modify are then shared by all
+        VMs that use the same file through the host page cache. The file
+        must not be modified in place while QEMU runs; replacing it is
+        fine. Other ROM files are then also mapped rather than read into
+        QEMU's own memory. Postcopy migration does not support such
+        mappings, and an incoming migration refuses to use it. The
+        default is off.
+
     ``aes-key-wrap=on|off``
         Enables or disables AES key wrapping support on s390-ccw hosts.
         This feature controls whether AES wrapping keys will be created
@@ -139,8 +151,12 @@ DEF("accel", HAS_ARG, QEMU_OPTION_accel,
     "                igd-passthru=on|off (enable Xen integrated Intel graphics passthrough, default=off)\n"
     "                kernel-irqchip=on|off|split controls accelerated irqchip support (default=on)\n"
     "                kvm-shadow-mem=size of KVM shadow MMU in bytes\n"
+    "                dirty-ring-size=n (KVM dirty ring GFN count, default 0)\n"
     "                split-wx=on|off (enable TCG split w^x mapping)\n"
     "                tb-size=n (TCG translation block cache size)\n"
+    "                hot-threshold=n (retranslate TCG blocks run n times as traces)\n"
+    "                tb-cache=file (keep TCG translations across runs)\n"
+    "                perf=off|map|jitdump (describe TCG code to perf)\n"
     "                thread=single|multi (enable multi-threaded TCG)\n", QEMU_ARCH_ALL)
 SRST
 ``-accel name[,prop=value[,...]]``
@@ -165,6 +181,16 @@ SRST
     ``kvm-shadow-mem=size``
         Defines the size of the KVM shadow MMU.
 
+    ``dirty-ring-size=n``
+        When the KVM accelerator is used, it controls the size of the per-vCPU
+        dirty page ring buffer (number of entries for each vCPU). It should
+        be a value that is power of two, and it should be 1024 or bigger (but
+        still less than the maximum value that the kernel supports).  4096
+        could be a good initial value if you have no idea which is the best.
+        Set this value to 0 to disable the feature.  By default, this feature
+        is disabled (dirty-ring-size=0), in which case KVM records dirty pages
+        in a bitmap.
+
     ``split-wx=on|off``
         Controls the use of split w^x mapping for the TCG code generation
         buffer. Some operating systems require this to be enabled, and in
@@ -174,6 +200,33 @@ SRST
     ``tb-size=n``
         Controls the size (in MiB) of the TCG translation block cache.
 
+    ``hot-threshold=n``
+        Counts how many times each TCG translation block is entered, and
+        translates it again as a trace once it has run ``n`` times.  A
+        trace goes on through unconditional jumps where the guest
+        front-end supports it (currently x86), so that hot code is
+        optimized across basic blocks.  The default, 0, disables
+        counting.
+
+    ``tb-cache=file``
+        Saves the code generated by TCG to ``file`` when QEMU exits, and
+        reuses it on the next run for the blocks whose guest code and CPU
+        state are unchanged.  The generated code refers to host addresses,
+        so the file is only used when the same QEMU binary and options
+        are run with host address space randomization disabled (for
+        example with ``setarch -R``); otherwise it is ignored with a
+        warning and rewritten at exit.  Not available with ``split-wx=on``.
+
+    ``perf=off|map|jitdump``
+        Describes the code generated by TCG to the Linux ``perf`` tool,
+        naming each translation block after the guest address and, if
+        known, the guest symbol it comes from.  ``map`` writes
+        ``/tmp/perf-<pid>.map``, which ``perf report`` reads directly.
+        ``jitdump`` writes ``jit-<pid>.dump`` to the temporary directory,
+        including the generated code; record with ``perf record -k 1``
+        and run ``perf inject -j`` on the result to annotate it.  The
+        default is ``off``.
+
     ``thread=single|multi``
         Controls number of TCG threads. When the TCG is multi-threaded
         there will be one thread per vCPU therefor taking advantage of
@@ -1903,7 +1956,8 @@ DEF("spice", HAS_ARG, QEMU_OPTION_spice,
     "       [,image-compression=[auto_glz|auto_lz|quic|glz|lz|off]]\n"
     "       [,jpeg-wan-compression=[auto|never|always]]\n"
     "       [,zlib-glz-wan-compression=[auto|never|always]]\n"
-    "       [,streaming-video=[off|all|filter]][,disable-copy-paste=on|off]\n"
+    "       [,streaming-video=[off|all|filter]][,video-codecs=<codec-list>]\n"
+    "       [,disable-copy-paste=on|off]\n"
     "       [,disable-agent-file-xfer=on|off][,agent-mouse=[on|off]]\n"
     "       [,playback-compression=[on|off]][,seamless-migration=[on|off]]\n"
     "       [,gl=[on|off]][,rendernode=<file>]\n"
@@ -1982,6 +2036,13 @@ SRST
     ``streaming-video=[off|all|filter]``
         Configure video stream detection. Default is off.
 
+    ``video-codecs=<encoder>:<codec>[;<encoder>:<codec>]``
+        Specify the encoders and codecs that detected video streams are
+        encoded with, in order of preference, for example
+        ``gstreamer:h264;spice:mjpeg``.  With the ``gstreamer`` encoder,
+        hardware encoders such as VA-API are used when GStreamer provides
+        them.  The default list is chosen by the spice server.
+
     ``agent-mouse=[on|off]``
         Enable/disable passing mouse events via vdagent. Default is on.
 
@@ -2501,13 +2562,26 @@ DEF("netdev", HAS_ARG, QEMU_OPTION_netdev,
     "                VALE port (created on the fly) called 'name' ('nmname' is name of the \n"
     "                netmap device, defaults to '/dev/netmap')\n"
 #endif
+#ifdef CONFIG_AF_XDP
+    "-netdev af-xdp,id=str,ifname=name[,mode=native|skb][,force-copy=on|off]\n"
+    "         [,queues=n][,start-queue=m][,busy-budget=b][,iothread=id]\n"
+    "                attach to the existing network interface 'name' with AF_XDP socket\n"
+    "                use 'mode=MODE' to specify an XDP program attach mode\n"
+    "                use 'force-copy=on|off' to force XDP copy mode even if device supports zero-copy (default: off)\n"
+    "                use 'queues=n' to specify how many queues of a multiqueue interface should be used\n"
+    "                use 'start-queue=m' to specify the first queue that should be used\n"
+    "                use 'busy-budget=b' to enable kernel busy polling with a budget of 'b' packets\n"
+    "                use 'iothread=id' to poll the rings in an IOThread\n"
+#endif
 #ifdef CONFIG_POSIX
     "-netdev vhost-user,id=str,chardev=dev[,vhostforce=on|off]\n"
     "                configure a vhost-user network, backed by a chardev 'dev'\n"
 #endif
 #ifdef __linux__
-    "-netdev vhost-vdpa,id=str,vhostdev=/path/to/dev\n"
+    "-netdev vhost-vdpa,id=str,vhostdev=/path/to/dev[,x-async-map=on|off]\n"
     "                configure a vhost-vdpa network,Establish a vhost-vdpa netdev\n"
+    "                use 'x-async-map=on' to map guest memory in the background\n"
+    "                while the guest boots\n"
 #endif
     "-netdev hubport,id=str,hubid=n[,netdev=nd]\n"
     "                configure a hub port on the hub with ID 'n'\n", QEMU_ARCH_ALL)
@@ -2968,6 +3042,31 @@ SRST
         # launch QEMU instance
         |qemu_system| linux.img -nic vde,sock=/tmp/myswitch
 
+``-netdev af-xdp,id=str,ifname=name[,mode=native|skb][,force-copy=on|off][,queues=n][,start-queue=m][,busy-budget=b][,iothread=id]``
+    Configure AF_XDP backend to connect to a network interface 'name'
+    using AF_XDP socket. A specific program attach mode for a default
+    XDP program can be forced with 'mode', defaults to best-effort,
+    where the likely most performant mode will be in use. Number of
+    queues 'n' should generally match the number or combined channels
+    on the interface. To use a subset of the interface queues, the
+    'start-queue' can be specified. Zero-copy is used when the driver
+    supports it, unless 'force-copy=on'. 'busy-budget' enables kernel
+    busy polling of the socket. With 'iothread', the rings are polled
+    from that IOThread instead of the main loop.
+
+    The interface should not already have an XDP program attached, and
+    QEMU needs CAP_NET_ADMIN and CAP_BPF (or CAP_SYS_ADMIN) to load one.
+
+    Example:
+
+    .. parsed-literal::
+
+        # set number of queues to 4
+        ethtool -L eth0 combined 4
+        # launch QEMU instance
+        |qemu_system| linux.img -device virtio-net-pci,netdev=n1 \\
+            -netdev af-xdp,id=n1,ifname=eth0,queues=4
+
 ``-netdev vhost-user,chardev=id[,vhostforce=on|off][,queues=n]``
     Establish a vhost-user netdev, backed by a chardev id. The chardev
     should be a unix domain socket backed one. The vhost-user uses a
@@ -2987,7 +3086,7 @@ SRST
              -netdev type=vhost-user,id=net0,chardev=chr0 \
              -device virtio-net-pci,netdev=net0
 
-``-netdev vhost-vdpa,vhostdev=/path/to/dev``
+``-netdev vhost-vdpa,vhostdev=/path/to/dev[,x-async-map=on|off]``
     Establish a vhost-vdpa netdev.
 
     vDPA device is a device that uses a datapath which complies with
@@ -2995,6 +3094,11 @@ SRST
     vDPA devices can be both physically located on the hardware or
     emulated by software.
 
+    Mapping guest memory into the device can take seconds for large
+    guests. With ``x-async-map=on`` it is done by a background thread
+    as soon as the netdev is created, and the guest only waits for it
+    if its driver starts the device before the mapping is complete.
+
 ``-netdev hubport,id=id,hubid=hubid[,netdev=nd]``
     Create a hub port on the emulated hub with ID hubid.
 
@@ -4798,6 +4902,9 @@ SRST
         is to set the period of scanning expired primary node network packets.
         The max\_queue\_size=@var{size} is to set the max compare queue
         size depend on user environment.
+        While a checkpoint requested by colo-compare is pending, further
+        miscompares are merged into it; the read-only checkpoint\_requests
+        and checkpoint\_requests\_merged properties count both.
         If user want to use Xen COLO, need to add the notify\_dev to
         notify Xen colo-frame to do checkpoint.
 
@@ -26,6 +26,8 @@
 #include "qemu/sockets.h"
 #include "qemu/base64.h"
 #include "qemu/cutils.h"
+#include "qemu/thread.h"
+#include "qemu/units.h"
 #include "commands-common.h"
 
 #ifdef HAVE_UTMPX
@@ -60,6 +62,13 @@ extern char **environ;
 #ifdef FITRIM
 #define CONFIG_FSTRIM
 #endif
+
+#ifdef CONFIG_AF_VSOCK
+#include <poll.h>
+#include <sys/sendfile.h>
+#include <linux/vm_sockets.h>
+#define CONFIG_FILE_TRANSFER
+#endif
 #endif
 
 static void ga_wait_child(pid_t pid, int *status, Error **errp)
@@ -238,10 +247,13 @@ typedef enum {
     RW_STATE_WRITING,
 } RwState;
 
+typedef struct GuestFileXfer GuestFileXfer;
+
 struct GuestFileHandle {
     uint64_t id;
     FILE *fh;
     RwState state;
+    GuestFileXfer *xfer;
     QTAILQ_ENTRY(GuestFileHandle) next;
 };
 
@@ -284,6 +296,9 @@ GuestFileHandle *guest_file_handle_find(int64_t id, Error **errp)
     return NULL;
 }
 
+static bool guest_file_xfer_busy(GuestFileHandle *gfh, Error **errp);
+static void guest_file_xfer_free(GuestFileHandle *gfh);
+
 typedef const char * const ccpc;
 
 #ifndef O_BINARY
@@ -451,6 +466,8 @@ void qmp_guest_file_close(int64_t handle, Error **errp)
         return;
     }
 
+    guest_file_xfer_free(gfh);
+
     ret = fclose(gfh->fh);
     if (ret == EOF) {
         error_setg_errno(errp, errno, "failed to close handle");
@@ -469,6 +486,10 @@ GuestFileRead *guest_file_read_unsafe(GuestFileHandle *gfh,
     FILE *fh = gfh->fh;
     size_t read_count;
 
+    if (guest_file_xfer_busy(gfh, errp)) {
+        return NULL;
+    }
+
     /* explicitly flush when switching from writing to reading */
     if (gfh->state == RW_STATE_WRITING) {
         int ret = fflush(fh);
@@ -510,7 +531,7 @@ GuestFileWrite *qmp_guest_file_write(int64_t handle, const char *buf_b64,
     GuestFileHandle *gfh = guest_file_handle_find(handle, errp);
     FILE *fh;
 
-    if (!gfh) {
+    if (!gfh || guest_file_xfer_busy(gfh, errp)) {
         return NULL;
     }
 
@@ -566,7 +587,7 @@ struct GuestFileSeek *qmp_guest_file_seek(int64_t handle, int64_t offset,
     int whence;
     Error *err = NULL;
 
-    if (!gfh) {
+    if (!gfh || guest_file_xfer_busy(gfh, errp)) {
         return NULL;
     }
 
@@ -602,7 +623,7 @@ void qmp_guest_file_flush(int64_t handle, Error **errp)
     FILE *fh;
     int ret;
 
-    if (!gfh) {
+    if (!gfh || guest_file_xfer_busy(gfh, errp)) {
         return;
     }
 
@@ -615,6 +636,439 @@ void qmp_guest_file_flush(int64_t handle, Error **errp)
     }
 }
 
+#if defined(CONFIG_FILE_TRANSFER)
+
+#define GUEST_FILE_XFER_CHUNK       (1 * MiB)
+#define GUEST_FILE_XFER_ACCEPT_MS   30000
+#define GUEST_FILE_XFER_POLL_MS     100
+
+/*
+ * Bulk transfer for guest-file-transfer.  The data moves in a separate
+ * thread, with sendfile() or splice() so that it is not copied through
+ * userspace, and the main loop only polls for the result.  The thread
+ * does read the data back from the page cache to compute its checksum.
+ */
+struct GuestFileXfer {
+    QemuThread thread;
+    bool joined;
+    int listen_fd;
+    int fd;             /* file, owned by the handle */
+    bool to_guest;
+    int64_t count;      /* -1 for no limit */
+    off_t offset;       /* file position, only valid once joined */
+
+    QemuMutex lock;
+    /* The following fields are protected by @lock */
+    int conn_fd;
+    bool cancelled;
+    bool done;
+    int64_t moved;
+    char *sha256;
+    char *error;
+};
+
+static bool guest_file_xfer_cancelled(GuestFileXfer *x)
+{
+    bool cancelled;
+
+    qemu_mutex_lock(&x->lock);
+    cancelled = x->cancelled;
+    qemu_mutex_unlock(&x->lock);
+    return cancelled;
+}
+
+/* Accept the connection from the host and return it, or -1 on failure */
+static int guest_file_xfer_accept(GuestFileXfer *x, const char **msg)
+{
+    struct pollfd pfd = { .fd = x->listen_fd, .events = POLLIN };
+    struct sockaddr_vm peer;
+    socklen_t len = sizeof(peer);
+    int waited, fd;
+
+    for (waited = 0; ; waited += GUEST_FILE_XFER_POLL_MS) {
+        if (guest_file_xfer_cancelled(x)) {
+            errno = ECANCELED;
+            *msg = "transfer cancelled";
+            return -1;
+        }
+        if (waited >= GUEST_FILE_XFER_ACCEPT_MS) {
+            errno = ETIMEDOUT;
+            *msg = "timed out waiting for the host to connect";
+            return -1;
+        }
+        if (poll(&pfd, 1, GUEST_FILE_XFER_POLL_MS) > 0) {
+            break;
+        }
+    }
+
+    fd = qemu_accept(x->listen_fd, (struct sockaddr *)&peer, &len);
+    if (fd < 0) {
+        *msg = "failed to accept connection";
+        return -1;
+    }
+
+    qemu_mutex_lock(&x->lock);
+    x->conn_fd = fd;
+    qemu_mutex_unlock(&x->lock);
+
+    /* Only the host may connect, not other processes in the guest */
+    if (peer.svm_cid != VMADDR_CID_HOST) {
+        errno = EPERM;
+        *msg = "connection is not from the host";
+        return -1;
+    }
+    return fd;
+}
+
+/* Move up to @len bytes from the socket to the file through @pipefd */
+static ssize_t guest_file_xfer_splice(GuestFileXfer *x, int fd, int *pipefd,
+                                      size_t len)
+{
+    loff_t offset = x->offset;
+    ssize_t n, left, ret;
+
+    n = splice(fd, NULL, pipefd[1], NULL, len, SPLICE_F_MOVE);
+    for (left = n; left > 0; left -= ret) {
+        ret = splice(pipefd[0], NULL, x->fd, &offset, left, SPLICE_F_MOVE);
+        if (ret < 0 && errno == EINTR) {
+            ret = 0;
+        } else if (ret <= 0) {
+            /* Data already taken from the socket is lost */
+            errno = ret ? errno : EIO;
+            n = -1;
+            break;
+        }
+    }
+    x->offset = offset;
+    return n;
+}
+
+static void *guest_file_xfer_thread(void *opaque)
+{
+    GuestFileXfer *x = opaque;
+    g_autoptr(GChecksum) sum = g_checksum_new(G_CHECKSUM_SHA256);
+    g_autofree guchar *buf = g_malloc(GUEST_FILE_XFER_CHUNK);
+    int pipefd[2] = { -1, -1 };
+    const char *msg = NULL;
+    int64_t moved = 0;
+    int fd, err = 0;
+
+    fd = guest_file_xfer_accept(x, &msg);
+    if (fd < 0) {
+        err = errno;
+        goto out;
+    }
+
+    if (x->to_guest) {
+        if (qemu_pipe(pipefd) < 0) {
+            err = errno;
+            msg = "failed to create pipe";
+            goto out;
+        }
+        /* Best effort: move a whole chunk per splice() */
+        fcntl(pipefd[1], F_SETPIPE_SZ, GUEST_FILE_XFER_CHUNK);
+    }
+
+    while (x->count < 0 || moved < x->count) {
+        size_t len = GUEST_FILE_XFER_CHUNK;
+        ssize_t n;
+
+        if (x->count >= 0) {
+            len = MIN(len, x->count - moved);
+        }
+        if (x->to_guest) {
+            n = guest_file_xfer_splice(x, fd, pipefd, len);
+        } else {
+            n = sendfile(fd, x->fd, &x->offset, len);
+        }
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0) {
+            err = errno;
+            msg = x->to_guest ? "failed to receive data"
+                              : "failed to send data";
+            break;
+        }
+        if (n == 0) {
+            break;
+        }
+
+        if (pread(x->fd, buf, n, x->offset - n) != n) {
+            err = errno;
+            msg = "failed to read back data";
+            break;
+        }
+        g_checksum_update(sum, buf, n);
+        moved += n;
+
+        qemu_mutex_lock(&x->lock);
+        x->moved = moved;
+        if (x->cancelled) {
+            err = ECANCELED;
+            msg = "transfer cancelled";
+        }
+        qemu_mutex_unlock(&x->lock);
+        if (msg) {
+            break;
+        }
+    }
+
+out:
+    if (pipefd[0] != -1) {
+        close(pipefd[0]);
+        close(pipefd[1]);
+    }
+    if (fd >= 0) {
+        /* Let the host see the end of the data; the handle closes @fd */
+        shutdown(fd, SHUT_RDWR);
+    }
+
+    qemu_mutex_lock(&x->lock);
+    if (msg) {
+        x->error = err ? g_strdup_printf("%s: %s", msg, strerror(err))
+                       : g_strdup(msg);
+    } else {
+        x->sha256 = g_strdup(g_checksum_get_string(sum));
+    }
+    x->done = true;
+    qemu_mutex_unlock(&x->lock);
+
+    return NULL;
+}
+
+static void guest_file_xfer_join(GuestFileHandle *gfh)
+{
+    GuestFileXfer *x = gfh->xfer;
+
+    if (x->joined) {
+        return;
+    }
+    qemu_thread_join(&x->thread);
+    x->joined = true;
+
+    fseeko(gfh->fh, x->offset, SEEK_SET);
+    gfh->state = RW_STATE_NEW;
+}
+
+static bool guest_file_xfer_busy(GuestFileHandle *gfh, Error **errp)
+{
+    GuestFileXfer *x = gfh->xfer;
+    bool done;
+
+    if (!x) {
+        return false;
+    }
+
+    qemu_mutex_lock(&x->lock);
+    done = x->done;
+    qemu_mutex_unlock(&x->lock);
+
+    if (!done) {
+        error_setg(errp, "handle '%" PRId64 "' has a transfer in progress",
+                   gfh->id);
+        return true;
+    }
+    guest_file_xfer_join(gfh);
+    return false;
+}
+
+static void guest_file_xfer_free(GuestFileHandle *gfh)
+{
+    GuestFileXfer *x = gfh->xfer;
+
+    if (!x) {
+        return;
+    }
+
+    qemu_mutex_lock(&x->lock);
+    x->cancelled = true;
+    if (x->conn_fd != -1) {
+        shutdown(x->conn_fd, SHUT_RDWR);
+    }
+    qemu_mutex_unlock(&x->lock);
+    guest_file_xfer_join(gfh);
+
+    if (x->conn_fd != -1) {
+        close(x->conn_fd);
+    }
+    close(x->listen_fd);
+    qemu_mutex_destroy(&x->lock);
+    g_free(x->sha256);
+    g_free(x->error);
+    g_free(x);
+    gfh->xfer = NULL;
+}
+
+GuestFileTransfer *qmp_guest_file_transfer(int64_t handle,
+                                           GuestFileTransferDirection direction,
+                                           bool has_port, int64_t port,
+                                           bool has_count, int64_t count,
+                                           Error **errp)
+{
+    GuestFileHandle *gfh = guest_file_handle_find(handle, errp);
+    bool to_guest = direction == GUEST_FILE_TRANSFER_DIRECTION_TO_GUEST;
+    struct sockaddr_vm svm = {
+        .svm_family = AF_VSOCK,
+        .svm_cid = VMADDR_CID_ANY,
+        .svm_port = has_port ? port : VMADDR_PORT_ANY,
+    };
+    socklen_t len = sizeof(svm);
+    GuestFileTransfer *ret;
+    GuestFileXfer *x;
+    struct stat st;
+    int fd, flags, listen_fd;
+    off_t offset;
+
+    slog("guest-file-transfer called, handle: %" PRId64, handle);
+    if (!gfh || guest_file_xfer_busy(gfh, errp)) {
+        return NULL;
+    }
+    if (has_port && (port < 0 || port >= VMADDR_PORT_ANY)) {
+        error_setg(errp, "value '%" PRId64 "' is invalid for argument port",
+                   port);
+        return NULL;
+    }
+    if (has_count && count < 0) {
+        error_setg(errp, "value '%" PRId64 "' is invalid for argument count",
+                   count);
+        return NULL;
+    }
+
+    fd = fileno(gfh->fh);
+    flags = fcntl(fd, F_GETFL);
+    if (fstat(fd, &st) < 0 || flags < 0) {
+        error_setg_errno(errp, errno, "failed to get file status");
+        return NULL;
+    }
+    if (!S_ISREG(st.st_mode)) {
+        error_setg(errp, "transfers are only supported for regular files");
+        return NULL;
+    }
+    /* The checksum is computed from what is read back from the file */
+    if (to_guest ? (flags & O_ACCMODE) != O_RDWR
+                 : (flags & O_ACCMODE) == O_WRONLY) {
+        error_setg(errp, "file is not open for %s",
+                   to_guest ? "reading and writing" : "reading");
+        return NULL;
+    }
+    if (to_guest && (flags & O_APPEND)) {
+        error_setg(errp, "transfers into files in append mode are not "
+                   "supported");
+        return NULL;
+    }
+
+    /* Sync the file descriptor with the stdio stream position */
+    if (fflush(gfh->fh) == EOF) {
+        error_setg_errno(errp, errno, "failed to flush file");
+        return NULL;
+    }
+    offset = lseek(fd, 0, SEEK_CUR);
+    if (offset < 0) {
+        error_setg_errno(errp, errno, "failed to get file position");
+        return NULL;
+    }
+
+    listen_fd = qemu_socket(AF_VSOCK, SOCK_STREAM, 0);
+    if (listen_fd < 0) {
+        error_setg_errno(errp, errno, "failed to create vsock socket");
+        return NULL;
+    }
+    if (bind(listen_fd, (struct sockaddr *)&svm, sizeof(svm)) < 0 ||
+        listen(listen_fd, 1) < 0 ||
+        getsockname(listen_fd, (struct sockaddr *)&svm, &len) < 0) {
+        error_setg_errno(errp, errno, "failed to listen on vsock port");
+        close(listen_fd);
+        return NULL;
+    }
+
+    guest_file_xfer_free(gfh);
+
+    x = g_new0(GuestFileXfer, 1);
+    x->listen_fd = listen_fd;
+    x->conn_fd = -1;
+    x->fd = fd;
+    x->to_guest = to_guest;
+    x->count = has_count ? count : -1;
+    x->offset = offset;
+    qemu_mutex_init(&x->lock);
+    gfh->xfer = x;
+
+    qemu_thread_create(&x->thread, "qga-transfer", guest_file_xfer_thread,
+                       x, QEMU_THREAD_JOINABLE);
+
+    slog("guest-file-transfer listening on vsock port %u", svm.svm_port);
+    ret = g_new0(GuestFileTransfer, 1);
+    ret->port = svm.svm_port;
+    return ret;
+}
+
+GuestFileTransferStatus *qmp_guest_file_transfer_status(int64_t handle,
+                                                        Error **errp)
+{
+    GuestFileHandle *gfh = guest_file_handle_find(handle, errp);
+    GuestFileTransferStatus *status;
+    GuestFileXfer *x;
+
+    if (!gfh) {
+        return NULL;
+    }
+    x = gfh->xfer;
+    if (!x) {
+        error_setg(errp, "handle '%" PRId64 "' has no transfer", handle);
+        return NULL;
+    }
+
+    status = g_new0(GuestFileTransferStatus, 1);
+    qemu_mutex_lock(&x->lock);
+    status->active = !x->done;
+    status->count = x->moved;
+    if (x->sha256) {
+        status->has_sha256 = true;
+        status->sha256 = g_strdup(x->sha256);
+    }
+    if (x->error) {
+        status->has_error = true;
+        status->error = g_strdup(x->error);
+    }
+    qemu_mutex_unlock(&x->lock);
+
+    if (!status->active) {
+        guest_file_xfer_join(gfh);
+    }
+    return status;
+}
+
+#else /* !CONFIG_FILE_TRANSFER */
+
+static bool guest_file_xfer_busy(GuestFileHandle *gfh, Error **errp)
+{
+    return false;
+}
+
+static void guest_file_xfer_free(GuestFileHandle *gfh)
+{
+}
+
+GuestFileTransfer *qmp_guest_file_transfer(int64_t handle,
+                                           GuestFileTransferDirection direction,
+                                           bool has_port, int64_t port,
+                                           bool has_count, int64_t count,
+                                           Error **errp)
+{
+    error_setg(errp, QERR_UNSUPPORTED);
+    return NULL;
+}
+
+GuestFileTransferStatus *qmp_guest_file_transfer_status(int64_t handle,
+                                                        Error **errp)
+{
+    error_setg(errp, QERR_UNSUPPORTED);
+    return NULL;
+}
+
+#endif /* CONFIG_FILE_TRANSFER */
+
 /* linux-specific implementations. avoid this if at all possible. */
 #if defined(__linux__)
 
@@ -3095,6 +3549,12 @@ GList *ga_command_blacklist_init(GList *blacklist)
     blacklist = g_list_append(blacklist, g_strdup("guest-fstrim"));
 #endif
 
+#if !defined(CONFIG_FILE_TRANSFER)
+    blacklist = g_list_append(blacklist, g_strdup("guest-file-transfer"));
+    blacklist = g_list_append(blacklist,
+                              g_strdup("guest-file-transfer-status"));
+#endif
+
     blacklist = g_list_append(blacklist, g_strdup("guest-get-devices"));
 
     return blacklist;
@@ -474,6 +474,23 @@ void qmp_guest_file_flush(int64_t handle, Error **errp)
     }
 }
 
+GuestFileTransfer *qmp_guest_file_transfer(int64_t handle,
+                                           GuestFileTransferDirection direction,
+                                           bool has_port, int64_t port,
+                                           bool has_count, int64_t count,
+                                           Error **errp)
+{
+    error_setg(errp, QERR_UNSUPPORTED);
+    return NULL;
+}
+
+GuestFileTransferStatus *qmp_guest_file_transfer_status(int64_t handle,
+                                                        Error **errp)
+{
+    error_setg(errp, QERR_UNSUPPORTED);
+    return NULL;
+}
+
 #ifdef CONFIG_QGA_NTDDSCSI
 
 static GuestDiskBusType win2qemu[] = {
@@ -2012,6 +2029,7 @@ GList *ga_command_blacklist_init(GList *blacklist)
         "guest-set-vcpus",
         "guest-get-memory-blocks", "guest-set-memory-blocks",
         "guest-get-memory-block-size", "guest-get-memory-block-info",
+        "guest-file-transfer", "guest-file-transfer-status",
         NULL};
     char **p = (char **)list_unsupported;
 
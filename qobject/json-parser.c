@@ -24,17 +24,22 @@
 #include "qapi/qmp/qstring.h"
 #include "json-parser-int.h"
 
+/*
+ * The tokens of a message are stored back to back in one buffer rather
+ * than allocated one by one, see json_token_append().
+ */
 struct JSONToken {
     JSONTokenType type;
     int x;
     int y;
+    uint32_t len;
     char str[];
 };
 
 typedef struct JSONParserContext {
     Error *err;
-    JSONToken *current;
-    GQueue *buf;
+    uint8_t *next;
+    uint8_t *end;
     va_list *ap;
 } JSONParserContext;
 
@@ -235,20 +240,29 @@ out:
     return NULL;
 }
 
-/* Note: the token object returned by parser_context_peek_token or
- * parser_context_pop_token is deleted as soon as parser_context_pop_token
- * is called again.
+static size_t json_token_size(uint32_t len)
+{
+    return QEMU_ALIGN_UP(sizeof(JSONToken) + len + 1, __alignof__(JSONToken));
+}
+
+/* Note: tokens stay valid until the caller of json_parser_parse() resets
+ * the token buffer.
  */
 static JSONToken *parser_context_pop_token(JSONParserContext *ctxt)
 {
-    g_free(ctxt->current);
-    ctxt->current = g_queue_pop_head(ctxt->buf);
-    return ctxt->current;
+    JSONToken *token;
+
+    if (ctxt->next == ctxt->end) {
+        return NULL;
+    }
+    token = (JSONToken *)ctxt->next;
+    ctxt->next += json_token_size(token->len);
+    return token;
 }
 
 static JSONToken *parser_context_peek_token(JSONParserContext *ctxt)
 {
-    return g_queue_peek_head(ctxt->buf);
+    return ctxt->next == ctxt->end ? NULL : (JSONToken *)ctxt->next;
 }
 
 /**
@@ -559,32 +573,35 @@ static QObject *parse_value(JSONParserContext *ctxt)
     }
 }
 
-JSONToken *json_token(JSONTokenType type, int x, int y, GString *tokstr)
+void json_token_append(GByteArray *tokens, JSONTokenType type, int x, int y,
+                       GString *tokstr)
 {
-    JSONToken *token = g_malloc(sizeof(JSONToken) + tokstr->len + 1);
+    guint offset = tokens->len;
+    JSONToken *token;
 
+    g_byte_array_set_size(tokens, offset + json_token_size(tokstr->len));
+    token = (JSONToken *)(tokens->data + offset);
     token->type = type;
-    memcpy(token->str, tokstr->str, tokstr->len);
-    token->str[tokstr->len] = 0;
     token->x = x;
     token->y = y;
-    return token;
+    token->len = tokstr->len;
+    memcpy(token->str, tokstr->str, tokstr->len);
+    token->str[tokstr->len] = 0;
 }
 
-QObject *json_parser_parse(GQueue *tokens, va_list *ap, Error **errp)
+QObject *json_parser_parse(GByteArray *tokens, va_list *ap, Error **errp)
 {
-    JSONParserContext ctxt = { .buf = tokens, .ap = ap };
+    JSONParserContext ctxt = {
+        .next = tokens->data,
+        .end = tokens->data + tokens->len,
+        .ap = ap,
+    };
     QObject *result;
 
     result = parse_value(&ctxt);
-    assert(ctxt.err || g_queue_is_empty(ctxt.buf));
+    assert(ctxt.err || ctxt.next == ctxt.end);
 
     error_propagate(errp, ctxt.err);
 
-    while (!g_queue_is_empty(ctxt.buf)) {
-        parser_context_pop_token(&ctxt);
-    }
-    g_free(ctxt.current);
-
     return result;
 }
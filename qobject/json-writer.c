@@ -20,17 +20,32 @@
 struct JSONWriter {
     bool pretty;
     bool need_comma;
+    bool own_contents;
     GString *contents;
     GByteArray *container_is_array;
 };
 
 JSONWriter *json_writer_new(bool pretty)
+{
+    JSONWriter *writer = json_writer_new_append(g_string_new(NULL), pretty);
+
+    writer->own_contents = true;
+    return writer;
+}
+
+/*
+ * Like json_writer_new(), but append to @contents, which remains owned
+ * by the caller.  This saves copying the output when it ends up in a
+ * larger buffer anyway.
+ */
+JSONWriter *json_writer_new_append(GString *contents, bool pretty)
 {
     JSONWriter *writer = g_new(JSONWriter, 1);
 
     writer->pretty = pretty;
     writer->need_comma = false;
-    writer->contents = g_string_new(NULL);
+    writer->own_contents = false;
+    writer->contents = contents;
     writer->container_is_array = g_byte_array_new();
     return writer;
 }
@@ -54,7 +69,12 @@ GString *json_writer_get_and_free(JSONWriter *writer)
 void json_writer_free(JSONWriter *writer)
 {
     if (writer) {
-        g_string_free(json_writer_get_and_free(writer), true);
+        bool own_contents = writer->own_contents;
+        GString *contents = json_writer_get_and_free(writer);
+
+        if (own_contents) {
+            g_string_free(contents, true);
+        }
     }
 }
 
@@ -245,3 +265,13 @@ void json_writer_str(JSONWriter *writer, const char *name, const char *str)
     maybe_comma_name(writer, name);
     quoted_str(writer, str);
 }
+
+/*
+ * Append @json, the complete output of another non-pretty JSONWriter,
+ * as the value of @name.
+ */
+void json_writer_raw(JSONWriter *writer, const char *name, const char *json)
+{
+    maybe_comma_name(writer, name);
+    g_string_append(writer->contents, json);
+}
@@ -226,6 +226,15 @@ GString *qobject_to_json_pretty(const QObject *obj, bool pretty)
     return json_writer_get_and_free(writer);
 }
 
+/* Append the JSON representation of @obj to @str */
+void qobject_to_json_append(GString *str, const QObject *obj, bool pretty)
+{
+    JSONWriter *writer = json_writer_new_append(str, pretty);
+
+    to_json(writer, NULL, obj);
+    json_writer_free(writer);
+}
+
 GString *qobject_to_json(const QObject *obj)
 {
     return qobject_to_json_pretty(obj, false);
@@ -242,6 +242,31 @@ static bool type_is_ancestor(TypeImpl *type, TypeImpl *target_type)
     return false;
 }
 
+/*
+ * Like object_class_dynamic_cast(), but only based on the type
+ * definitions, so that it does not need to initialize the class.  It
+ * may return true for types that the cast rejects, never the opposite.
+ */
+static bool type_may_implement(TypeImpl *type, TypeImpl *target_type)
+{
+    int i;
+
+    for (; type; type = type_get_parent(type)) {
+        if (type == target_type) {
+            return true;
+        }
+        for (i = 0; i < type->num_interfaces; i++) {
+            TypeImpl *iface = type_get_by_name(type->interfaces[i].typename);
+
+            if (!iface || type_may_implement(iface, target_type)) {
+                return true;
+            }
+        }
+    }
+
+    return false;
+}
+
 static void type_initialize(TypeImpl *ti);
 
 static void type_initialize_interface(TypeImpl *ti, TypeImpl *interface_type,
@@ -1055,6 +1080,7 @@ typedef struct OCFData
 {
     void (*fn)(ObjectClass *klass, void *opaque);
     const char *implements_type;
+    TypeImpl *implements_impl;
     bool include_abstract;
     void *opaque;
 } OCFData;
@@ -1066,6 +1092,12 @@ static void object_class_foreach_tramp(gpointer key, gpointer value,
     TypeImpl *type = value;
     ObjectClass *k;
 
+    /* Don't initialize every class to look for a few of them */
+    if (data->implements_impl &&
+        !type_may_implement(type, data->implements_impl)) {
+        return;
+    }
+
     type_initialize(type);
     k = type->class;
 
@@ -1085,7 +1117,15 @@ void object_class_foreach(void (*fn)(ObjectClass *klass, void *opaque),
                           const char *implements_type, bool include_abstract,
                           void *opaque)
 {
-    OCFData data = { fn, implements_type, include_abstract, opaque };
+    OCFData data = { fn, implements_type, NULL, include_abstract, opaque };
+
+    if (implements_type) {
+        data.implements_impl = type_get_by_name(implements_type);
+        if (!data.implements_impl) {
+            /* nothing can implement an unknown type */
+            return;
+        }
+    }
 
     enumerating_types = true;
     g_hash_table_foreach(type_table_get(), object_class_foreach_tramp, &data);
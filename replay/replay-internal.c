@@ -10,6 +10,7 @@
  */
 
 #include "qemu/osdep.h"
+#include "qemu/bswap.h"
 #include "sysemu/replay.h"
 #include "sysemu/runstate.h"
 #include "replay-internal.h"
@@ -30,6 +31,27 @@ static unsigned long mutex_head, mutex_tail;
 static bool write_error;
 FILE *replay_file;
 
+/*
+ * In record mode the log is accumulated in one of two buffers, and full
+ * buffers are written out by a separate thread, so that the thread holding
+ * the replay mutex never waits for the file.
+ */
+#define REPLAY_BUF_SIZE (1 << 20)
+
+static struct {
+    QemuThread thread;
+    QemuMutex lock;
+    QemuCond cond;
+    uint8_t *buf[2];
+    /* fill level of buf[cur], protected by the replay mutex */
+    size_t len;
+    int cur;
+    /* buffer handed to the writer thread, protected by lock */
+    uint8_t *pending;
+    size_t pending_len;
+    bool exiting;
+} replay_writer;
+
 static void replay_write_error(void)
 {
     if (!write_error) {
@@ -44,12 +66,124 @@ static void replay_read_error(void)
     exit(1);
 }
 
-void replay_put_byte(uint8_t byte)
+static void *replay_writer_thread(void *opaque)
 {
-    if (replay_file) {
-        if (putc(byte, replay_file) == EOF) {
+    qemu_mutex_lock(&replay_writer.lock);
+    for (;;) {
+        if (replay_writer.pending) {
+            uint8_t *buf = replay_writer.pending;
+            size_t len = replay_writer.pending_len;
+
+            qemu_mutex_unlock(&replay_writer.lock);
+            if (fwrite(buf, 1, len, replay_file) != len) {
+                replay_write_error();
+            }
+            qemu_mutex_lock(&replay_writer.lock);
+            replay_writer.pending = NULL;
+            qemu_cond_broadcast(&replay_writer.cond);
+        } else if (replay_writer.exiting) {
+            break;
+        } else {
+            qemu_cond_wait(&replay_writer.cond, &replay_writer.lock);
+        }
+    }
+    qemu_mutex_unlock(&replay_writer.lock);
+    return NULL;
+}
+
+void replay_writer_start(void)
+{
+    replay_writer.buf[0] = g_malloc(REPLAY_BUF_SIZE);
+    replay_writer.buf[1] = g_malloc(REPLAY_BUF_SIZE);
+    replay_writer.len = 0;
+    replay_writer.cur = 0;
+    replay_writer.exiting = false;
+    qemu_mutex_init(&replay_writer.lock);
+    qemu_cond_init(&replay_writer.cond);
+    qemu_thread_create(&replay_writer.thread, "replay-writer",
+                       replay_writer_thread, NULL, QEMU_THREAD_JOINABLE);
+}
+
+/* Hand the current buffer to the writer thread and switch to the other one */
+static void replay_writer_submit(void)
+{
+    qemu_mutex_lock(&replay_writer.lock);
+    while (replay_writer.pending) {
+        qemu_cond_wait(&replay_writer.cond, &replay_writer.lock);
+    }
+    replay_writer.pending = replay_writer.buf[replay_writer.cur];
+    replay_writer.pending_len = replay_writer.len;
+    qemu_cond_broadcast(&replay_writer.cond);
+    qemu_mutex_unlock(&replay_writer.lock);
+
+    replay_writer.cur ^= 1;
+    replay_writer.len = 0;
+}
+
+void replay_flush(void)
+{
+    if (!replay_writer.buf[0]) {
+        return;
+    }
+    if (replay_writer.len) {
+        replay_writer_submit();
+    }
+    qemu_mutex_lock(&replay_writer.lock);
+    while (replay_writer.pending) {
+        qemu_cond_wait(&replay_writer.cond, &replay_writer.lock);
+    }
+    qemu_mutex_unlock(&replay_writer.lock);
+    if (fflush(replay_file)) {
+        replay_write_error();
+    }
+}
+
+void replay_writer_stop(void)
+{
+    if (!replay_writer.buf[0]) {
+        return;
+    }
+    replay_flush();
+
+    qemu_mutex_lock(&replay_writer.lock);
+    replay_writer.exiting = true;
+    qemu_cond_broadcast(&replay_writer.cond);
+    qemu_mutex_unlock(&replay_writer.lock);
+    qemu_thread_join(&replay_writer.thread);
+
+    qemu_cond_destroy(&replay_writer.cond);
+    qemu_mutex_destroy(&replay_writer.lock);
+    g_free(replay_writer.buf[0]);
+    g_free(replay_writer.buf[1]);
+    replay_writer.buf[0] = replay_writer.buf[1] = NULL;
+}
+
+static void replay_put_bytes(const uint8_t *buf, size_t size)
+{
+    if (!replay_writer.buf[0]) {
+        if (fwrite(buf, 1, size, replay_file) != size) {
             replay_write_error();
         }
+        return;
+    }
+    while (size) {
+        size_t n = MIN(size, REPLAY_BUF_SIZE - replay_writer.len);
+
+        memcpy(replay_writer.buf[replay_writer.cur] + replay_writer.len,
+               buf, n);
+        replay_writer.len += n;
+        buf += n;
+        size -= n;
+        if (replay_writer.len == REPLAY_BUF_SIZE) {
+            replay_writer_submit();
+        }
+    }
+}
+
+void replay_put_byte(uint8_t byte)
+{
+    if (replay_file) {
+        replay_put_bytes(&byte, 1);
     }
 }
 
@@ -62,29 +196,39 @@ void replay_put_event(uint8_t event)
 
 void replay_put_word(uint16_t word)
 {
-    replay_put_byte(word >> 8);
-    replay_put_byte(word);
+    if (replay_file) {
+        uint8_t buf[2];
+
+        stw_be_p(buf, word);
+        replay_put_bytes(buf, sizeof(buf));
+    }
 }
 
 void replay_put_dword(uint32_t dword)
 {
-    replay_put_word(dword >> 16);
-    replay_put_word(dword);
+    if (replay_file) {
+        uint8_t buf[4];
+
+        stl_be_p(buf, dword);
+        replay_put_bytes(buf, sizeof(buf));
+    }
 }
 
 void replay_put_qword(int64_t qword)
 {
-    replay_put_dword(qword >> 32);
-    replay_put_dword(qword);
+    if (replay_file) {
+        uint8_t buf[8];
+
+        stq_be_p(buf, qword);
+        replay_put_bytes(buf, sizeof(buf));
+    }
 }
 
 void replay_put_array(const uint8_t *buf, size_t size)
 {
     if (replay_file) {
         replay_put_dword(size);
-        if (fwrite(buf, 1, size, replay_file) != size) {
-            replay_write_error();
-        }
+        replay_put_bytes(buf, size);
     }
 }
 
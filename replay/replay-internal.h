@@ -113,6 +113,13 @@ int64_t replay_get_qword(void);
 void replay_get_array(uint8_t *buf, size_t *size);
 void replay_get_array_alloc(uint8_t **buf, size_t *size);
 
+/*! Starts the thread that writes the log in record mode. */
+void replay_writer_start(void);
+/*! Writes out everything that was recorded so far. */
+void replay_flush(void);
+/*! Flushes the log and stops the writer thread. */
+void replay_writer_stop(void);
+
 /* Mutex functions for protecting replay log file and ensuring
  * synchronisation between vCPU and main-loop threads. */
 
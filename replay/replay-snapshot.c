@@ -22,6 +22,10 @@
 static int replay_pre_save(void *opaque)
 {
     ReplayState *state = opaque;
+
+    if (replay_mode == REPLAY_MODE_RECORD) {
+        replay_flush();
+    }
     state->file_offset = ftell(replay_file);
 
     return 0;
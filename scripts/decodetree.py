@@ -42,6 +42,11 @@
 output_fd = None
 insntype = 'uint32_t'
 decode_function = 'decode'
+decode_table = False
+decode_table_count = 0
+
+# Widest contiguous mask for which a dispatch table is emitted.
+decode_table_max_bits = 8
 
 # An identifier for C.
 re_C_ident = '[a-zA-Z][a-zA-Z0-9_]*'
@@ -137,6 +142,10 @@ def ctz(x):
     return r
 
 
+def ctpop(bits):
+    return bin(bits).count('1')
+
+
 def is_contiguous(bits):
     if bits == 0:
         return -1
@@ -147,6 +156,20 @@ def is_contiguous(bits):
         return -1
 
 
+def table_name(kind):
+    """Return a unique name for a function of the table decoder"""
+    global decode_table_count
+    decode_table_count += 1
+    return '{0}_{1}_{2}'.format(decode_function, kind, decode_table_count)
+
+
+def table_function(name):
+    """Start the function NAME of the table decoder"""
+    output('static bool ', name, '(DisasContext *ctx, ', insntype,
+           ' insn)\n{\n')
+    return name
+
+
 def eq_fields_for_args(flds_a, flds_b):
     if len(flds_a) != len(flds_b):
         return False
@@ -378,6 +401,18 @@ def output_code(self, i, extracted, outerbits, outermask):
         output(ind, 'if (', translate_prefix, '_', self.name,
                '(ctx, &u.f_', arg, ')) return true;\n')
 
+    def output_table(self, outerbits, outermask):
+        global translate_prefix
+        output('/* ', self.file, ':', str(self.lineno), ' */\n')
+        name = table_function(table_name(self.name))
+        output('    ', self.base.base.struct_name(), ' a;\n\n')
+        output('    ', self.base.extract_name(), '(ctx, &a, insn);\n')
+        for n, f in self.fields.items():
+            output('    a.', n, ' = ', f.str_extract(), ';\n')
+        output('    return ', translate_prefix, '_', self.name,
+               '(ctx, &a);\n}\n\n')
+        return name
+
     # Normal patterns do not have children.
     def build_tree(self):
         return
@@ -486,6 +521,26 @@ def output_code(self, i, extracted, outerbits, outermask):
                 output(ind, '}\n')
             else:
                 p.output_code(i, extracted, p.fixedbits, p.fixedmask)
+
+    def output_table(self, outerbits, outermask):
+        subs = []
+        for p in self.pats:
+            subs.append((p, p.output_table(p.fixedbits, p.fixedmask)))
+
+        name = table_function(table_name('group'))
+        for p, f in subs:
+            if outermask != p.fixedmask:
+                innermask = p.fixedmask & ~outermask
+                innerbits = p.fixedbits & ~outermask
+                output('    if ((insn & ',
+                       '0x{0:08x}) == 0x{1:08x}'.format(innermask, innerbits),
+                       ' && ', f, '(ctx, insn)) {\n')
+            else:
+                output('    if (', f, '(ctx, insn)) {\n')
+            output('        return true;\n',
+                   '    }\n')
+        output('    return false;\n}\n\n')
+        return name
 #end IncMultiPattern
 
 
@@ -551,6 +606,48 @@ def str_case(b):
             s.output_code(i + 4, extracted, innerbits, innermask)
             output(ind, '    break;\n')
         output(ind, '}\n')
+
+    def output_table(self, outerbits, outermask):
+        subs = []
+        for b, s in sorted(self.subs):
+            assert (self.thismask & ~s.fixedmask) == 0
+            subs.append((b, s.output_table(outerbits | b,
+                                           outermask | self.thismask)))
+
+        # Edge condition: a single pattern with nothing left to select.
+        name = table_name('node')
+        if self.thismask == 0:
+            table_function(name)
+            output('    return ', subs[0][1], '(ctx, insn);\n}\n\n')
+            return name
+
+        # Index a table of the subtrees by the bits that select them,
+        # unless they are scattered or too many for the table to be compact.
+        sh = is_contiguous(self.thismask)
+        if sh >= 0 and ctpop(self.thismask) <= decode_table_max_bits:
+            tab = name + '_table'
+            output('static bool (* const ', tab, '[',
+                   str(1 << ctpop(self.thismask)),
+                   '])(DisasContext *, ', insntype, ') = {\n')
+            for b, f in subs:
+                output('    [0x{0:x}] = '.format(b >> sh), f, ',\n')
+            output('};\n\n')
+
+            table_function(name)
+            output('    bool (*fn)(DisasContext *, ', insntype, ') =\n',
+                   '        ', tab, '[(insn >> {0}) & 0x{1:x}];\n\n'
+                   .format(sh, self.thismask >> sh),
+                   '    return fn && fn(ctx, insn);\n}\n\n')
+            return name
+
+        table_function(name)
+        output('    switch (insn & 0x{0:08x}) {{\n'.format(self.thismask))
+        for b, f in subs:
+            output('    case 0x{0:08x}:\n'.format(b),
+                   '        return ', f, '(ctx, insn);\n')
+        output('    }\n',
+               '    return false;\n}\n\n')
+        return name
 # end Tree
 
 
@@ -561,6 +658,9 @@ def output_code(self, i, extracted, outerbits, outermask):
         # Defer everything to our decomposed Tree node
         self.tree.output_code(i, extracted, outerbits, outermask)
 
+    def output_table(self, outerbits, outermask):
+        return self.tree.output_table(outerbits, outermask)
+
     @staticmethod
     def __build_tree(pats, outerbits, outermask):
         # Find the intersection of all remaining fixedmask.
@@ -1266,11 +1366,12 @@ def main():
     global decode_function
     global variablewidth
     global anyextern
+    global decode_table
 
     decode_scope = 'static '
 
     long_opts = ['decode=', 'translate=', 'output=', 'insnwidth=',
-                 'static-decode=', 'varinsnwidth=']
+                 'static-decode=', 'varinsnwidth=', 'decode-table']
     try:
         (opts, args) = getopt.gnu_getopt(sys.argv[1:], 'o:vw:', long_opts)
     except getopt.GetoptError as err:
@@ -1283,6 +1384,8 @@ def main():
             decode_scope = ''
         elif o == '--static-decode':
             decode_function = a
+        elif o == '--decode-table':
+            decode_table = True
         elif o == '--translate':
             translate_prefix = a
             translate_scope = ''
@@ -1368,20 +1471,27 @@ def main():
         f = formats[n]
         f.output_extract()
 
+    top = None
+    if decode_table and len(allpatterns) != 0:
+        top = toppat.output_table(0, 0)
+
     output(decode_scope, 'bool ', decode_function,
            '(DisasContext *ctx, ', insntype, ' insn)\n{\n')
 
     i4 = str_indent(4)
 
-    if len(allpatterns) != 0:
-        output(i4, 'union {\n')
-        for n in sorted(arguments.keys()):
-            f = arguments[n]
-            output(i4, i4, f.struct_name(), ' f_', f.name, ';\n')
-        output(i4, '} u;\n\n')
-        toppat.output_code(4, False, 0, 0)
-
-    output(i4, 'return false;\n')
+    if top:
+        output(i4, 'return ', top, '(ctx, insn);\n')
+    else:
+        if len(allpatterns) != 0:
+            output(i4, 'union {\n')
+            for n in sorted(arguments.keys()):
+                f = arguments[n]
+                output(i4, i4, f.struct_name(), ' f_', f.name, ';\n')
+            output(i4, '} u;\n\n')
+            toppat.output_code(4, False, 0, 0)
+
+        output(i4, 'return false;\n')
     output('}\n')
 
     if variablewidth:
@@ -0,0 +1,177 @@
+#!/usr/bin/env python3
+#
+# Spread virtio-blk devices across iothreads according to their load
+#
+# Every interval, the CPU time of each iothread (cpu-time-ns in
+# query-iothreads) and the number of requests of each device
+# (query-blockstats) are sampled.  When the busiest iothread is loaded
+# more than the idlest one by at least the threshold, the device of the
+# busiest iothread whose share of the load best halves the difference is
+# moved to the idlest iothread with x-device-set-iothread.
+#
+# Only devices that use a single iothread are moved; devices configured
+# with iothread-vq-mapping are left alone.
+#
+# This program is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation; either version 2 of the License, or
+# (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program.  If not, see <http://www.gnu.org/licenses/>.
+#
+
+import argparse
+import os
+import sys
+import time
+
+sys.path.append(os.path.join(os.path.dirname(__file__), '..', 'python'))
+from qemu.qmp import (
+    QEMUMonitorProtocol,
+    QMPResponseError,
+)
+
+
+def parse_address(addr):
+    """Return a unix socket path or a (host, port) tuple"""
+    host, _, port = addr.rpartition(':')
+    if host and port.isdigit():
+        return (host, int(port))
+    return addr
+
+
+def iothread_load(qmp):
+    """Return {iothread id: CPU time in ns}"""
+    return {t['id']: t['cpu-time-ns']
+            for t in qmp.command('query-iothreads')
+            if 'cpu-time-ns' in t}
+
+
+def device_iothreads(qmp):
+    """Return {device QOM path: iothread id} for single-iothread devices"""
+    devices = {}
+    for blk in qmp.command('query-block'):
+        qdev = blk.get('qdev')
+        if not qdev:
+            continue
+        try:
+            if qmp.command('qom-get', path=qdev,
+                           property='iothread-vq-mapping'):
+                continue
+            iothread = qmp.command('qom-get', path=qdev, property='iothread')
+        except QMPResponseError:
+            continue
+        if iothread:
+            devices[qdev] = iothread.rsplit('/', 1)[-1]
+    return devices
+
+
+def device_requests(qmp):
+    """Return {device QOM path: number of completed requests}"""
+    requests = {}
+    for blk in qmp.command('query-blockstats'):
+        if 'qdev' in blk:
+            stats = blk['stats']
+            requests[blk['qdev']] = (stats['rd_operations'] +
+                                     stats['wr_operations'] +
+                                     stats['flush_operations'] +
+                                     stats['unmap_operations'])
+    return requests
+
+
+def pick_move(load, devices, requests):
+    """Return (device, from, to, estimated load moved) or None"""
+    busiest = max(load, key=load.get)
+    idlest = min(load, key=load.get)
+    gap = load[busiest] - load[idlest]
+
+    candidates = [d for d, t in devices.items() if t == busiest]
+    total = sum(requests.get(d, 0) for d in candidates)
+    if len(candidates) < 2 or total == 0:
+        return None
+
+    # Estimate the load of a device from its share of the requests
+    best = None
+    for dev in candidates:
+        moved = load[busiest] * requests.get(dev, 0) / total
+        if moved == 0 or moved >= gap:
+            continue
+        if best is None or abs(gap / 2 - moved) < abs(gap / 2 - best[3]):
+            best = (dev, busiest, idlest, moved)
+    return best
+
+
+def balance(qmp, interval, threshold, dry_run):
+    prev_cpu = iothread_load(qmp)
+    prev_req = device_requests(qmp)
+    if len(prev_cpu) < 2:
+        sys.exit('need at least two iothreads with cpu-time-ns')
+
+    while True:
+        time.sleep(interval)
+        cpu = iothread_load(qmp)
+        req = device_requests(qmp)
+
+        # Fraction of a host CPU used by each iothread during the interval
+        load = {t: (cpu[t] - prev_cpu[t]) / (interval * 1e9)
+                for t in cpu if t in prev_cpu}
+        requests = {d: req[d] - prev_req[d] for d in req if d in prev_req}
+        prev_cpu, prev_req = cpu, req
+
+        if len(load) < 2:
+            continue
+        if max(load.values()) - min(load.values()) < threshold:
+            continue
+
+        move = pick_move(load, device_iothreads(qmp), requests)
+        if not move:
+            continue
+
+        dev, src, dst, moved = move
+        print(f'{dev}: {src} ({load[src]:.2f}) -> {dst} ({load[dst]:.2f}), '
+              f'moving about {moved:.2f}')
+        if dry_run:
+            continue
+        try:
+            qmp.command('x-device-set-iothread', id=dev, iothread=dst)
+        except QMPResponseError as e:
+            print(f'{dev}: {e}', file=sys.stderr)
+
+        # Let the load settle before considering another move
+        time.sleep(interval)
+        prev_cpu = iothread_load(qmp)
+        prev_req = device_requests(qmp)
+
+
+def main():
+    parser = argparse.ArgumentParser(
+        description='Move virtio-blk devices from busy to idle iothreads')
+    parser.add_argument('socket', help='QMP socket path or host:port')
+    parser.add_argument('-i', '--interval', type=float, default=5,
+                        help='seconds between samples (default: 5)')
+    parser.add_argument('-t', '--threshold', type=float, default=0.25,
+                        help='minimum load difference between the busiest '
+                        'and the idlest iothread, in host CPUs '
+                        '(default: 0.25)')
+    parser.add_argument('-n', '--dry-run', action='store_true',
+                        help='only print the moves')
+    args = parser.parse_args()
+
+    qmp = QEMUMonitorProtocol(parse_address(args.socket))
+    qmp.connect()
+    try:
+        balance(qmp, args.interval, args.threshold, args.dry_run)
+    except KeyboardInterrupt:
+        pass
+    finally:
+        qmp.close()
+
+
+if __name__ == '__main__':
+    main()
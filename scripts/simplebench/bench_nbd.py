@@ -0,0 +1,170 @@
+#!/usr/bin/env python3
+#
+# Benchmark NBD exports of qemu-storage-daemon with qemu-img bench
+#
+# This program is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation; either version 2 of the License, or
+# (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program.  If not, see <http://www.gnu.org/licenses/>.
+#
+
+
+import sys
+import os
+import re
+import subprocess
+import tempfile
+import time
+
+import simplebench
+from results_to_text import results_to_text
+
+
+def start_storage_daemon(qsd, image, sock, iothread):
+    """Start qemu-storage-daemon exporting @image over NBD on @sock"""
+    export = 'nbd,id=exp0,node-name=disk0,name=disk0,writable=on'
+    args = [qsd,
+            '--blockdev', 'driver=file,node-name=file0,cache.direct=on,'
+            f'filename={image}',
+            '--blockdev', 'driver=raw,node-name=disk0,file=file0',
+            '--nbd-server', f'addr.type=unix,addr.path={sock}']
+    if iothread:
+        args += ['--object', 'iothread,id=iothread0']
+        export += ',iothread=iothread0'
+    args += ['--export', export]
+
+    daemon = subprocess.Popen(args, stdout=subprocess.DEVNULL,
+                              stderr=subprocess.PIPE,
+                              universal_newlines=True)
+    for _ in range(100):
+        if os.path.exists(sock) or daemon.poll() is not None:
+            break
+        time.sleep(0.1)
+    return daemon
+
+
+def bench_nbd(qemu_img, qsd, image, iothread, depth, block_size, write,
+              duration):
+    """Benchmark random requests to an NBD export
+
+    qemu_img   -- path to qemu-img binary, which runs the NBD client
+    qsd        -- path to qemu-storage-daemon binary, which runs the server
+    image      -- raw image to export
+    iothread   -- run the export in an iothread
+    depth      -- number of requests in flight
+    block_size -- size of each request, in bytes
+    write      -- True for write requests, False for reads
+    duration   -- seconds to submit requests for
+
+    Returns {'iops': float, 'latency-p50-us': float, 'latency-p99-us':
+    float} on success and {'error': str} on failure.  Return value is
+    compatible with simplebench lib.
+    """
+
+    with tempfile.TemporaryDirectory() as tmpdir:
+        sock = os.path.join(tmpdir, 'nbd.sock')
+        try:
+            daemon = start_storage_daemon(qsd, image, sock, iothread)
+        except OSError as e:
+            return {'error': 'qemu-storage-daemon failed: ' + str(e)}
+
+        if not os.path.exists(sock):
+            daemon.kill()
+            return {'error': 'qemu-storage-daemon failed: ' +
+                    daemon.communicate()[1]}
+
+        args = [qemu_img, 'bench', '-f', 'raw', '--random',
+                '--time', str(duration), '-d', str(depth),
+                '-s', str(block_size)]
+        if write:
+            args.append('-w')
+        args.append(f'nbd+unix:///disk0?socket={sock}')
+
+        try:
+            out = subprocess.run(args, stdout=subprocess.PIPE,
+                                 stderr=subprocess.STDOUT,
+                                 universal_newlines=True).stdout
+        except OSError as e:
+            return {'error': 'qemu-img bench failed: ' + str(e)}
+        finally:
+            daemon.terminate()
+            daemon.wait()
+
+    # See bench_hist_print() in qemu-img.c
+    op = 'write' if write else 'read'
+    iops = re.search(rf'^{op}: \d+ requests, (\d+) IOPS', out, re.M)
+    lat = re.search(r'percentiles \(us\): p50 ([\d.]+) p90 [\d.]+ '
+                    r'p99 ([\d.]+)', out)
+    if not iops or not lat:
+        return {'error': 'qemu-img bench failed: ' + out}
+
+    return {'iops': float(iops.group(1)),
+            'latency-p50-us': float(lat.group(1)),
+            'latency-p99-us': float(lat.group(2))}
+
+
+def bench_func(env, case):
+    """ Handle one "cell" of benchmarking table. """
+    return bench_nbd(env['qemu-img'], env['qemu-storage-daemon'],
+                     env['image'], env.get('iothread', False),
+                     case['depth'], case['block-size'],
+                     case.get('write', False), case.get('duration', 10))
+
+
+if __name__ == '__main__':
+    if len(sys.argv) < 4 or len(sys.argv) % 2:
+        program = os.path.basename(sys.argv[0])
+        print(f'USAGE: {program} <scratch file to create> '
+              '<qemu-img binary> <qemu-storage-daemon binary> '
+              '[<another qemu-img> <another qemu-storage-daemon>]')
+        exit(1)
+
+    image = sys.argv[1]
+    with open(image, 'wb') as f:
+        os.posix_fallocate(f.fileno(), 0, 1024 * 1024 * 1024)
+
+    # Test-cases are "rows" in benchmark resulting table, 'id' is a caption
+    # for the row, other fields are handled by bench_func.
+    test_cases = []
+    for write in (False, True):
+        for block_size in (4096, 65536):
+            for depth in (1, 16, 64):
+                test_cases.append({
+                    'id': f'{"write" if write else "read"} '
+                          f'bs={block_size // 1024}k depth={depth}',
+                    'write': write,
+                    'block-size': block_size,
+                    'depth': depth,
+                })
+
+    # Test-envs are "columns" in benchmark resulting table, 'id is a caption
+    # for the column, other fields are handled by bench_func.
+    test_envs = []
+    for i in range(2, len(sys.argv), 2):
+        for iothread in (False, True):
+            test_envs.append({
+                'id': f'{sys.argv[i + 1]}{" iothread" if iothread else ""}',
+                'qemu-img': sys.argv[i],
+                'qemu-storage-daemon': sys.argv[i + 1],
+                'image': image,
+                'iothread': iothread,
+            })
+
+    try:
+        result = simplebench.bench(bench_func, test_envs, test_cases,
+                                   count=3)
+    finally:
+        os.remove(image)
+
+    print(results_to_text(result))
+    for field in ('latency-p50-us', 'latency-p99-us'):
+        print()
+        print(results_to_text(simplebench.results_field(result, field)))
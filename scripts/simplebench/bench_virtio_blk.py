@@ -0,0 +1,298 @@
+#!/usr/bin/env python3
+#
+# Benchmark the virtio-blk request path, driven through qtest
+#
+# This program is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation; either version 2 of the License, or
+# (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program.  If not, see <http://www.gnu.org/licenses/>.
+#
+
+
+import sys
+import os
+import random
+import struct
+import socket
+import time
+
+import simplebench
+from results_to_text import results_to_text
+
+sys.path.append(os.path.join(os.path.dirname(__file__), '..', '..', 'python'))
+from qemu.qtest import QEMUQtestMachine
+from qemu.qmp import QMPConnectError
+
+
+# The device is placed in slot 4 of a pc machine and driven through its
+# legacy virtio-pci I/O BAR, like a simple guest driver would do.
+PCI_SLOT = 4
+IO_BASE = 0xc000
+
+VIRTIO_PCI_GUEST_FEATURES = 4
+VIRTIO_PCI_QUEUE_PFN = 8
+VIRTIO_PCI_QUEUE_NUM = 12
+VIRTIO_PCI_QUEUE_SEL = 14
+VIRTIO_PCI_QUEUE_NOTIFY = 16
+VIRTIO_PCI_STATUS = 18
+
+VIRTIO_STATUS_DRIVER_OK = 1 | 2 | 4
+
+VRING_DESC_F_NEXT = 1
+VRING_DESC_F_WRITE = 2
+
+VIRTIO_BLK_T_IN = 0
+VIRTIO_BLK_T_OUT = 1
+
+# Guest physical memory layout
+RING_ADDR = 0x100000
+HEADER_ADDR = 0x180000
+STATUS_ADDR = 0x190000
+DATA_ADDR = 0x200000
+
+
+class VirtioBlkQtest:
+    """Minimal virtio-blk driver on top of the qtest protocol
+
+    Each of the @depth request slots owns a chain of three descriptors:
+    request header, data buffer and status byte.  The chains are set up
+    once, so that submitting a request only needs to set its sector and
+    to publish its head in the available ring.
+    """
+
+    def __init__(self, vm, depth, block_size, write):
+        self.vm = vm
+        self.depth = depth
+        self.block_size = block_size
+        self.write = write
+
+    def cmd(self, command):
+        resp = self.vm.qtest(command)
+        if not resp.startswith('OK'):
+            raise RuntimeError(f'qtest "{command}" failed: {resp}')
+        return resp
+
+    def read(self, size, addr):
+        return int(self.cmd(f'read{size} {addr:#x}').split()[1], 16)
+
+    def pci_config_write(self, reg, size, value):
+        self.cmd(f'outl 0xcf8 {0x80000000 | (PCI_SLOT << 11) | reg:#x}')
+        self.cmd(f'out{size} {0xcfc + (reg & 3):#x} {value:#x}')
+
+    def setup(self):
+        self.pci_config_write(0x10, 'l', IO_BASE)
+        # I/O space, memory space and bus master
+        self.pci_config_write(0x04, 'w', 7)
+
+        self.cmd(f'outb {IO_BASE + VIRTIO_PCI_STATUS:#x} 0')
+        self.cmd(f'outb {IO_BASE + VIRTIO_PCI_STATUS:#x} 3')
+        self.cmd(f'outl {IO_BASE + VIRTIO_PCI_GUEST_FEATURES:#x} 0')
+        self.cmd(f'outw {IO_BASE + VIRTIO_PCI_QUEUE_SEL:#x} 0')
+        self.num = int(self.cmd(
+            f'inw {IO_BASE + VIRTIO_PCI_QUEUE_NUM:#x}').split()[1], 16)
+        if self.num < 3 * self.depth:
+            raise RuntimeError(f'queue size {self.num} is too small '
+                               f'for depth {self.depth}')
+
+        self.avail = RING_ADDR + 16 * self.num
+        self.used = (self.avail + 6 + 2 * self.num + 4095) & ~4095
+
+        desc = b''
+        data_flags = 0 if self.write else VRING_DESC_F_WRITE
+        for slot in range(self.depth):
+            head = 3 * slot
+            desc += struct.pack('<QIHH', HEADER_ADDR + 16 * slot, 16,
+                                VRING_DESC_F_NEXT, head + 1)
+            desc += struct.pack('<QIHH', DATA_ADDR + self.block_size * slot,
+                                self.block_size,
+                                data_flags | VRING_DESC_F_NEXT, head + 2)
+            desc += struct.pack('<QIHH', STATUS_ADDR + slot, 1,
+                                VRING_DESC_F_WRITE, 0)
+            self.cmd(f'writel {HEADER_ADDR + 16 * slot:#x} '
+                     f'{VIRTIO_BLK_T_OUT if self.write else VIRTIO_BLK_T_IN}')
+        self.cmd(f'write {RING_ADDR:#x} {len(desc)} 0x{desc.hex()}')
+
+        self.cmd(f'outl {IO_BASE + VIRTIO_PCI_QUEUE_PFN:#x} '
+                 f'{RING_ADDR >> 12:#x}')
+        self.cmd(f'outb {IO_BASE + VIRTIO_PCI_STATUS:#x} '
+                 f'{VIRTIO_STATUS_DRIVER_OK}')
+
+        self.avail_idx = 0
+        self.used_idx = 0
+
+    def submit(self, slot, sector):
+        self.cmd(f'writeq {HEADER_ADDR + 16 * slot + 8:#x} {sector:#x}')
+        self.cmd(f'writew {self.avail + 4 + 2 * (self.avail_idx % self.num):#x}'
+                 f' {3 * slot}')
+        self.avail_idx = (self.avail_idx + 1) & 0xffff
+        self.cmd(f'writew {self.avail + 2:#x} {self.avail_idx}')
+
+    def notify(self):
+        self.cmd(f'outw {IO_BASE + VIRTIO_PCI_QUEUE_NOTIFY:#x} 0')
+
+    def completions(self):
+        """Return the slots of the requests completed since the last call"""
+        idx = self.read('w', self.used + 2)
+        slots = []
+        while self.used_idx != idx:
+            elem = self.used + 4 + 8 * (self.used_idx % self.num)
+            slot = self.read('l', elem) // 3
+            if self.read('b', STATUS_ADDR + slot) != 0:
+                raise RuntimeError('request failed')
+            slots.append(slot)
+            self.used_idx = (self.used_idx + 1) & 0xffff
+        return slots
+
+
+def percentile(values, percent):
+    values = sorted(values)
+    return values[min(len(values) - 1, int(len(values) * percent / 100))]
+
+
+def bench_virtio_blk(qemu_args, image_size, depth, block_size, write,
+                     duration):
+    """Benchmark random requests to a virtio-blk device
+
+    qemu_args  -- list of Qemu command line arguments, including path to Qemu
+                  binary, which must define a virtio-blk-pci device in slot 4
+                  with modern virtio disabled
+    image_size -- size of the device, in bytes
+    depth      -- number of requests in flight
+    block_size -- size of each request, in bytes
+    write      -- True for write requests, False for reads
+    duration   -- seconds to submit requests for
+
+    The requests are issued and reaped through qtest, which adds a constant
+    cost per request, so IOPS and latencies are only meaningful when
+    compared with each other.
+
+    Returns {'iops': float, 'latency-p50-us': float, 'latency-p99-us':
+    float} on success and {'error': str} on failure.  Return value is
+    compatible with simplebench lib.
+    """
+
+    vm = QEMUQtestMachine(qemu_args[0], args=qemu_args[1:])
+
+    try:
+        vm.launch()
+    except OSError as e:
+        return {'error': 'popen failed: ' + str(e)}
+    except (QMPConnectError, socket.timeout):
+        return {'error': 'qemu failed: ' + str(vm.get_log())}
+
+    dev = VirtioBlkQtest(vm, depth, block_size, write)
+    sectors = block_size // 512
+    blocks = image_size // block_size
+    start = [0.0] * depth
+    latencies = []
+
+    try:
+        dev.setup()
+
+        begin = time.perf_counter()
+        end = begin + duration
+        for slot in range(depth):
+            start[slot] = time.perf_counter()
+            dev.submit(slot, random.randrange(blocks) * sectors)
+        dev.notify()
+
+        in_flight = depth
+        while in_flight:
+            slots = dev.completions()
+            now = time.perf_counter()
+            for slot in slots:
+                latencies.append(now - start[slot])
+                in_flight -= 1
+                if now < end:
+                    start[slot] = now
+                    dev.submit(slot, random.randrange(blocks) * sectors)
+                    in_flight += 1
+            if slots and now < end:
+                dev.notify()
+        elapsed = time.perf_counter() - begin
+    except RuntimeError as e:
+        vm.shutdown()
+        return {'error': str(e), 'vm-log': vm.get_log()}
+
+    vm.shutdown()
+
+    return {'iops': len(latencies) / elapsed,
+            'latency-p50-us': percentile(latencies, 50) * 1000000,
+            'latency-p99-us': percentile(latencies, 99) * 1000000}
+
+
+def bench_func(env, case):
+    """ Handle one "cell" of benchmarking table. """
+    qemu_args = [env['qemu-binary'], '-machine', 'pc', '-m', '1024',
+                 '-nodefaults', '-display', 'none',
+                 '-blockdev', 'driver=file,node-name=file0,cache.direct=on,'
+                 f'filename={env["image"]}',
+                 '-blockdev', 'driver=raw,node-name=disk0,file=file0']
+    device = f'virtio-blk-pci,drive=disk0,addr={PCI_SLOT:#x},disable-modern=on'
+    if env.get('iothread'):
+        qemu_args += ['-object', 'iothread,id=iothread0']
+        device += ',iothread=iothread0'
+    qemu_args += ['-device', device]
+
+    return bench_virtio_blk(qemu_args, env['image-size'], case['depth'],
+                            case['block-size'], case.get('write', False),
+                            case.get('duration', 10))
+
+
+if __name__ == '__main__':
+    if len(sys.argv) < 3:
+        program = os.path.basename(sys.argv[0])
+        print(f'USAGE: {program} <scratch file to create> '
+              '<qemu-system-x86_64 binary> [<another binary to compare>]')
+        exit(1)
+
+    image = sys.argv[1]
+    image_size = 1024 * 1024 * 1024
+    with open(image, 'wb') as f:
+        os.posix_fallocate(f.fileno(), 0, image_size)
+
+    # Test-cases are "rows" in benchmark resulting table, 'id' is a caption
+    # for the row, other fields are handled by bench_func.
+    test_cases = []
+    for write in (False, True):
+        for block_size in (4096, 65536):
+            for depth in (1, 16, 64):
+                test_cases.append({
+                    'id': f'{"write" if write else "read"} '
+                          f'bs={block_size // 1024}k depth={depth}',
+                    'write': write,
+                    'block-size': block_size,
+                    'depth': depth,
+                })
+
+    # Test-envs are "columns" in benchmark resulting table, 'id is a caption
+    # for the column, other fields are handled by bench_func.
+    test_envs = []
+    for binary in sys.argv[2:]:
+        for iothread in (False, True):
+            test_envs.append({
+                'id': f'{binary}{" dataplane" if iothread else ""}',
+                'qemu-binary': binary,
+                'image': image,
+                'image-size': image_size,
+                'iothread': iothread,
+            })
+
+    try:
+        result = simplebench.bench(bench_func, test_envs, test_cases,
+                                   count=3)
+    finally:
+        os.remove(image)
+
+    print(results_to_text(result))
+    for field in ('latency-p50-us', 'latency-p99-us'):
+        print()
+        print(results_to_text(simplebench.results_field(result, field)))
@@ -114,3 +114,34 @@ def bench(test_func, test_envs, test_cases, *args, **vargs):
 
     print('Done')
     return results
+
+
+def results_field(results, field):
+    """Return bench() results with the statistics of another field
+
+    Benchmark functions may return more fields than the main 'seconds' or
+    'iops' one, like latencies.  The returned dict has @field as dimension
+    of all its cells, and can be passed to results_to_text() to get a
+    table of @field.
+    """
+    tab = {}
+    for case_id, row in results['tab'].items():
+        tab[case_id] = {}
+        for env_id, res in row.items():
+            runs = res['runs']
+            values = [r[field] for r in runs if field in r]
+            cell = {'runs': runs}
+            if values:
+                cell['dimension'] = field
+                cell['average'] = statistics.mean(values)
+                cell['stdev'] = statistics.stdev(values) \
+                    if len(values) > 1 else 0
+            if len(values) < len(runs):
+                cell['n-failed'] = len(runs) - len(values)
+            tab[case_id][env_id] = cell
+
+    return {
+        'envs': results['envs'],
+        'cases': results['cases'],
+        'tab': tab
+    }
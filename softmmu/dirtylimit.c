@@ -0,0 +1,284 @@
+/*
+ * Per-vCPU dirty page rate limit
+ *
+ * The dirty page rate of each vCPU is sampled from its KVM dirty ring
+ * once per DIRTYLIMIT_CALC_TIME_MS.  A vCPU dirtying memory faster than
+ * the quota is made to sleep whenever its dirty ring fills up, so that
+ * only the offending vCPUs are slowed down instead of the whole guest.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/thread.h"
+#include "qemu/atomic.h"
+#include "qemu/rcu.h"
+#include "qemu/units.h"
+#include "qemu/timer.h"
+#include "qemu/main-loop.h"
+#include "exec/target_page.h"
+#include "hw/boards.h"
+#include "hw/core/cpu.h"
+#include "sysemu/kvm.h"
+#include "sysemu/dirtylimit.h"
+#include "trace.h"
+
+/* Do not adjust the throttle when the rate is within 1/20 of the quota */
+#define DIRTYLIMIT_TOLERANCE_DIV        20
+/* Granularity of the vCPU sleep, so that stop requests are honored */
+#define DIRTYLIMIT_SLEEP_SLICE_US       10000
+
+typedef struct VcpuDirtyLimitState {
+    uint64_t last_pages;
+    uint64_t dirty_rate;            /* MB/s */
+} VcpuDirtyLimitState;
+
+typedef struct DirtyLimitState {
+    int max_cpus;
+    uint64_t quota;                 /* MB/s */
+    QemuMutex lock;                 /* protects quit */
+    QemuCond quit_cond;
+    bool quit;
+    QemuThread thread;
+    VcpuDirtyLimitState *states;
+} DirtyLimitState;
+
+static DirtyLimitState *dirtylimit_state;
+static bool dirtylimit_active;
+
+/*
+ * Time, in microseconds, needed to fill up a dirty ring at @rate MB/s.
+ */
+static int64_t dirtylimit_dirty_ring_full_time(uint64_t rate)
+{
+    uint64_t ring_bytes = (uint64_t)kvm_dirty_ring_size() *
+                          qemu_target_page_size();
+
+    if (!rate) {
+        rate = 1;
+    }
+    return ring_bytes * G_USEC_PER_SEC / (rate * MiB);
+}
+
+/*
+ * A vCPU dirtying at @rate fills its ring in full_time(@rate), sleep
+ * included.  Adding full_time(quota) - full_time(rate) to the sleep
+ * stretches the period to the one matching the quota.
+ */
+static void dirtylimit_adjust_throttle(CPUState *cpu, uint64_t rate,
+                                       uint64_t quota)
+{
+    int64_t throttle = qatomic_read(&cpu->throttle_us_per_full);
+    int64_t quota_full = dirtylimit_dirty_ring_full_time(quota);
+    uint64_t tolerance = quota / DIRTYLIMIT_TOLERANCE_DIV;
+
+    if (rate > quota + tolerance) {
+        throttle += quota_full - dirtylimit_dirty_ring_full_time(rate);
+    } else if (rate + tolerance < quota && throttle) {
+        /* An idle vCPU contributes nothing, release it entirely */
+        throttle = rate ? throttle + quota_full -
+                          dirtylimit_dirty_ring_full_time(rate) : 0;
+    } else {
+        return;
+    }
+
+    throttle = MAX(throttle, 0);
+    throttle = MIN(throttle, quota_full);
+    qatomic_set(&cpu->throttle_us_per_full, throttle);
+    trace_dirtylimit_adjust(cpu->cpu_index, rate, quota, throttle);
+}
+
+static void dirtylimit_calc_rates(DirtyLimitState *state)
+{
+    uint64_t quota = qatomic_read(&state->quota);
+    CPUState *cpu;
+
+    WITH_RCU_READ_LOCK_GUARD() {
+        CPU_FOREACH(cpu) {
+            VcpuDirtyLimitState *vs;
+            uint64_t pages, rate;
+
+            if (cpu->cpu_index >= state->max_cpus) {
+                continue;
+            }
+            vs = &state->states[cpu->cpu_index];
+            pages = qatomic_read(&cpu->dirty_pages);
+            rate = (pages - vs->last_pages) * qemu_target_page_size() * 1000 /
+                   (DIRTYLIMIT_CALC_TIME_MS * MiB);
+            vs->last_pages = pages;
+            qatomic_set(&vs->dirty_rate, rate);
+
+            dirtylimit_adjust_throttle(cpu, rate, quota);
+        }
+    }
+}
+
+static void *dirtylimit_thread(void *opaque)
+{
+    DirtyLimitState *state = opaque;
+    int64_t deadline = qemu_clock_get_ms(QEMU_CLOCK_REALTIME) +
+                       DIRTYLIMIT_CALC_TIME_MS;
+
+    rcu_register_thread();
+
+    qemu_mutex_lock(&state->lock);
+    while (!state->quit) {
+        int64_t now = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
+
+        /* dirtylimit_stop() wakes us up early */
+        if (now < deadline) {
+            qemu_cond_timedwait(&state->quit_cond, &state->lock,
+                                deadline - now);
+            continue;
+        }
+        deadline = now + DIRTYLIMIT_CALC_TIME_MS;
+
+        qemu_mutex_unlock(&state->lock);
+        dirtylimit_calc_rates(state);
+        qemu_mutex_lock(&state->lock);
+    }
+    qemu_mutex_unlock(&state->lock);
+
+    rcu_unregister_thread();
+    return NULL;
+}
+
+void dirtylimit_start(uint64_t quota)
+{
+    MachineState *ms = MACHINE(qdev_get_machine());
+    DirtyLimitState *state = dirtylimit_state;
+    CPUState *cpu;
+
+    assert(qemu_mutex_iothread_locked());
+    assert(kvm_dirty_ring_enabled());
+
+    trace_dirtylimit_start(quota);
+
+    if (state) {
+        qatomic_set(&state->quota, quota);
+        return;
+    }
+
+    state = g_new0(DirtyLimitState, 1);
+    state->max_cpus = ms->smp.max_cpus;
+    state->quota = quota;
+    qemu_mutex_init(&state->lock);
+    qemu_cond_init(&state->quit_cond);
+    state->states = g_new0(VcpuDirtyLimitState, state->max_cpus);
+    CPU_FOREACH(cpu) {
+        if (cpu->cpu_index < state->max_cpus) {
+            state->states[cpu->cpu_index].last_pages =
+                qatomic_read(&cpu->dirty_pages);
+        }
+    }
+
+    dirtylimit_state = state;
+    qatomic_set(&dirtylimit_active, true);
+    qemu_thread_create(&state->thread, "dirtylimit", dirtylimit_thread,
+                       state, QEMU_THREAD_JOINABLE);
+}
+
+void dirtylimit_stop(void)
+{
+    DirtyLimitState *state = dirtylimit_state;
+    CPUState *cpu;
+
+    assert(qemu_mutex_iothread_locked());
+
+    if (!state) {
+        return;
+    }
+
+    trace_dirtylimit_stop();
+
+    qatomic_set(&dirtylimit_active, false);
+    qemu_mutex_lock(&state->lock);
+    state->quit = true;
+    qemu_cond_signal(&state->quit_cond);
+    qemu_mutex_unlock(&state->lock);
+    qemu_thread_join(&state->thread);
+
+    CPU_FOREACH(cpu) {
+        qatomic_set(&cpu->throttle_us_per_full, 0);
+    }
+
+    dirtylimit_state = NULL;
+    qemu_cond_destroy(&state->quit_cond);
+    qemu_mutex_destroy(&state->lock);
+    g_free(state->states);
+    g_free(state);
+}
+
+bool dirtylimit_in_service(void)
+{
+    return qatomic_read(&dirtylimit_active);
+}
+
+void dirtylimit_vcpu_execute(CPUState *cpu)
+{
+    int64_t sleep_us;
+
+    if (!dirtylimit_in_service()) {
+        return;
+    }
+
+    sleep_us = qatomic_read(&cpu->throttle_us_per_full);
+    if (!sleep_us) {
+        return;
+    }
+
+    trace_dirtylimit_vcpu_execute(cpu->cpu_index, sleep_us);
+
+    while (sleep_us > 0 && !qatomic_read(&cpu->stop) &&
+           dirtylimit_in_service()) {
+        int64_t slice = MIN(sleep_us, DIRTYLIMIT_SLEEP_SLICE_US);
+
+        g_usleep(slice);
+        sleep_us -= slice;
+    }
+}
+
+uint64_t dirtylimit_vcpu_dirty_rate(int cpu_index)
+{
+    DirtyLimitState *state = dirtylimit_state;
+
+    if (!state || cpu_index < 0 || cpu_index >= state->max_cpus) {
+        return 0;
+    }
+    return qatomic_read(&state->states[cpu_index].dirty_rate);
+}
+
+int64_t dirtylimit_throttle_time_per_round(void)
+{
+    CPUState *cpu;
+    int64_t total = 0;
+    int n = 0;
+
+    if (!dirtylimit_in_service()) {
+        return 0;
+    }
+
+    CPU_FOREACH(cpu) {
+        total += qatomic_read(&cpu->throttle_us_per_full);
+        n++;
+    }
+
+    return n ? total / n : 0;
+}
+
+int64_t dirtylimit_ring_full_time(void)
+{
+    CPUState *cpu;
+    uint64_t max_rate = 0;
+
+    if (!dirtylimit_in_service()) {
+        return 0;
+    }
+
+    CPU_FOREACH(cpu) {
+        max_rate = MAX(max_rate, dirtylimit_vcpu_dirty_rate(cpu->cpu_index));
+    }
+
+    return dirtylimit_dirty_ring_full_time(max_rate);
+}
@@ -178,7 +178,7 @@ static void dma_blk_cb(void *opaque, int ret)
     if (dbs->iov.size == 0) {
         trace_dma_map_wait(dbs);
         dbs->bh = aio_bh_new(dbs->ctx, reschedule_dma, dbs);
-        cpu_register_map_client(dbs->bh);
+        address_space_register_map_client(dbs->sg->as, dbs->bh);
         return;
     }
 
@@ -208,7 +208,7 @@ static void dma_aio_cancel(BlockAIOCB *acb)
     }
 
     if (dbs->bh) {
-        cpu_unregister_map_client(dbs->bh);
+        address_space_unregister_map_client(dbs->sg->as, dbs->bh);
         qemu_bh_delete(dbs->bh);
         dbs->bh = NULL;
     }
@@ -257,6 +257,205 @@ BlockAIOCB *dma_blk_io(AioContext *ctx,
 }
 
 
+/*
+ * Direct variant of dma_blk_io: the whole scatter/gather list is mapped
+ * up front and submitted at once, optionally split into pieces of at
+ * most @max_len bytes that run in parallel.
+ */
+typedef struct DMADirectAIOCB DMADirectAIOCB;
+
+typedef struct {
+    DMADirectAIOCB *dbs;
+    QEMUIOVector qiov;
+    BlockAIOCB *acb;
+} DMADirectPiece;
+
+struct DMADirectAIOCB {
+    BlockAIOCB common;
+    AioContext *ctx;
+    AddressSpace *as;
+    DMADirection dir;
+    QEMUIOVector iov;
+    DMADirectPiece *pieces;
+    int npieces;
+    int pending;
+    int ret;
+};
+
+/*
+ * Unmap @iov.  Without @accessed the buffers were never filled, so
+ * nothing (in particular no bounce buffer) is written back to the guest.
+ */
+static void dma_direct_unmap(AddressSpace *as, QEMUIOVector *iov,
+                             DMADirection dir, bool accessed)
+{
+    int i;
+
+    for (i = 0; i < iov->niov; ++i) {
+        dma_memory_unmap(as, iov->iov[i].iov_base, iov->iov[i].iov_len,
+                         dir, accessed ? iov->iov[i].iov_len : 0);
+    }
+    qemu_iovec_reset(iov);
+}
+
+/* Map all of @sg into @iov, or nothing if any part cannot be mapped */
+static bool dma_direct_map(QEMUSGList *sg, QEMUIOVector *iov,
+                           DMADirection dir)
+{
+    int i;
+
+    for (i = 0; i < sg->nsg; i++) {
+        dma_addr_t base = sg->sg[i].base;
+        dma_addr_t left = sg->sg[i].len;
+
+        while (left) {
+            dma_addr_t len = left;
+            void *mem = dma_memory_map(sg->as, base, &len, dir);
+
+            if (!mem) {
+                dma_direct_unmap(sg->as, iov, dir, false);
+                return false;
+            }
+            qemu_iovec_add(iov, mem, len);
+            base += len;
+            left -= len;
+        }
+    }
+    return true;
+}
+
+static void dma_direct_complete(DMADirectAIOCB *dbs)
+{
+    int i;
+
+    trace_dma_complete(dbs, dbs->ret, dbs->common.cb);
+
+    dma_direct_unmap(dbs->as, &dbs->iov, dbs->dir, true);
+    if (dbs->common.cb) {
+        dbs->common.cb(dbs->common.opaque, dbs->ret);
+    }
+    for (i = 0; i < dbs->npieces; i++) {
+        qemu_iovec_destroy(&dbs->pieces[i].qiov);
+    }
+    g_free(dbs->pieces);
+    qemu_iovec_destroy(&dbs->iov);
+    qemu_aio_unref(dbs);
+}
+
+static void dma_direct_piece_cb(void *opaque, int ret)
+{
+    DMADirectPiece *piece = opaque;
+    DMADirectAIOCB *dbs = piece->dbs;
+
+    trace_dma_blk_cb(dbs, ret);
+
+    piece->acb = NULL;
+    if (ret < 0 && !dbs->ret) {
+        dbs->ret = ret;
+    }
+    if (--dbs->pending == 0) {
+        dma_direct_complete(dbs);
+    }
+}
+
+static void dma_direct_aio_cancel(BlockAIOCB *acb)
+{
+    DMADirectAIOCB *dbs = container_of(acb, DMADirectAIOCB, common);
+    int i;
+
+    trace_dma_aio_cancel(dbs);
+
+    /* Each cancelled piece still goes through dma_direct_piece_cb */
+    for (i = 0; i < dbs->npieces; i++) {
+        if (dbs->pieces[i].acb) {
+            blk_aio_cancel_async(dbs->pieces[i].acb);
+        }
+    }
+}
+
+static AioContext *dma_direct_get_aio_context(BlockAIOCB *acb)
+{
+    DMADirectAIOCB *dbs = container_of(acb, DMADirectAIOCB, common);
+
+    return dbs->ctx;
+}
+
+static const AIOCBInfo dma_direct_aiocb_info = {
+    .aiocb_size         = sizeof(DMADirectAIOCB),
+    .cancel_async       = dma_direct_aio_cancel,
+    .get_aio_context    = dma_direct_get_aio_context,
+};
+
+/*
+ * Like dma_blk_io, but return NULL without submitting anything if @sg
+ * cannot be mapped in one go (e.g. because it points to MMIO and the
+ * bounce buffer is busy) or is not a multiple of @align.  The caller
+ * then falls back to dma_blk_io.  A non-zero @max_len splits the
+ * request; @io_func must then accept several concurrent calls.
+ */
+BlockAIOCB *dma_blk_io_direct(AioContext *ctx,
+    QEMUSGList *sg, uint64_t offset, uint32_t align, uint64_t max_len,
+    DMAIOFunc *io_func, void *io_func_opaque,
+    BlockCompletionFunc *cb,
+    void *opaque, DMADirection dir)
+{
+    DMADirectAIOCB *dbs;
+    QEMUIOVector iov;
+    uint64_t pos;
+    int i;
+
+    /* dma_blk_cb has to keep overlapping reads ordered under icount */
+    if ((icount_enabled() && dir == DMA_DIRECTION_FROM_DEVICE) ||
+        !sg->size || !QEMU_IS_ALIGNED(sg->size, align)) {
+        return NULL;
+    }
+
+    qemu_iovec_init(&iov, sg->nsg);
+    if (!dma_direct_map(sg, &iov, dir)) {
+        qemu_iovec_destroy(&iov);
+        return NULL;
+    }
+
+    dbs = qemu_aio_get(&dma_direct_aiocb_info, NULL, cb, opaque);
+    trace_dma_blk_io(dbs, io_func_opaque, offset,
+                     (dir == DMA_DIRECTION_TO_DEVICE));
+
+    dbs->ctx = ctx;
+    dbs->as = sg->as;
+    dbs->dir = dir;
+    dbs->iov = iov;
+    dbs->ret = 0;
+
+    max_len = QEMU_ALIGN_DOWN(max_len, align);
+    if (!max_len || max_len > iov.size) {
+        max_len = iov.size;
+    }
+    dbs->npieces = DIV_ROUND_UP(iov.size, max_len);
+    dbs->pieces = g_new0(DMADirectPiece, dbs->npieces);
+
+    /* Hold one extra reference until every piece has been submitted */
+    dbs->pending = dbs->npieces + 1;
+
+    aio_context_acquire(ctx);
+    for (i = 0, pos = 0; i < dbs->npieces; i++, pos += max_len) {
+        DMADirectPiece *piece = &dbs->pieces[i];
+        uint64_t len = MIN(max_len, dbs->iov.size - pos);
+
+        piece->dbs = dbs;
+        qemu_iovec_init(&piece->qiov, dbs->iov.niov);
+        qemu_iovec_concat(&piece->qiov, &dbs->iov, pos, len);
+        piece->acb = io_func(offset + pos, &piece->qiov,
+                             dma_direct_piece_cb, piece, io_func_opaque);
+        assert(piece->acb);
+    }
+    aio_context_release(ctx);
+
+    /* Completion callbacks never run before the submitter returns */
+    dbs->pending--;
+    assert(dbs->pending);
+    return &dbs->common;
+}
+
 static
 BlockAIOCB *dma_blk_read_io_func(int64_t offset, QEMUIOVector *iov,
                                  BlockCompletionFunc *cb, void *cb_opaque,
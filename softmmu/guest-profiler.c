@@ -0,0 +1,326 @@
+/*
+ * Sampling guest profiler
+ *
+ * A timer kicks every vCPU once per sampling period.  The vCPU then
+ * records where the guest was executing: its PC, its MMU mode and, where
+ * the target knows how to walk the frame pointer chain, the return
+ * addresses above it.  With TCG the kick is a cpu_exit() and the state
+ * is read from env; with KVM the registers are fetched first through
+ * cpu_synchronize_state().  Samples are kept per vCPU and aggregated
+ * into folded stacks, the input format of flame graph tools, when they
+ * are queried.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/timer.h"
+#include "qemu/main-loop.h"
+#include "qapi/error.h"
+#include "qapi/qapi-commands-machine.h"
+#include "cpu.h"
+#include "exec/exec-all.h"
+#include "hw/core/cpu.h"
+#include "sysemu/hw_accel.h"
+#include "trace.h"
+
+#define GUEST_PROFILER_MAX_DEPTH        16
+#define GUEST_PROFILER_SAMPLES          8192
+#define GUEST_PROFILER_DEFAULT_US       1000
+/* frames further apart than this end the walk */
+#define GUEST_PROFILER_MAX_FRAME        (1 * MiB)
+
+typedef struct GuestSample {
+    vaddr pc;
+    int mode;
+    bool idle;
+    int depth;
+    vaddr frames[GUEST_PROFILER_MAX_DEPTH];
+} GuestSample;
+
+typedef struct VcpuProfile {
+    int scheduled;
+    unsigned int n_samples;
+    GuestSample samples[GUEST_PROFILER_SAMPLES];
+} VcpuProfile;
+
+/* All fields are protected by the BQL */
+typedef struct GuestProfilerState {
+    QEMUTimer *timer;
+    int64_t period_ns;
+    int max_cpus;
+    uint64_t samples;
+    uint64_t dropped;
+    VcpuProfile **vcpus;
+} GuestProfilerState;
+
+static GuestProfilerState *profiler;
+
+#ifdef TARGET_I386
+/* Walk the guest's EBP/RBP chain, like perf does without DWARF info */
+static int guest_profiler_unwind(CPUState *cpu, vaddr *frames, int max_depth)
+{
+    CPUX86State *env = &X86_CPU(cpu)->env;
+    int size;
+    vaddr fp = env->regs[R_EBP];
+    int depth = 0;
+
+    if (env->hflags & HF_CS64_MASK) {
+        size = 8;
+    } else if (env->hflags & HF_CS32_MASK) {
+        size = 4;
+    } else {
+        return 0;
+    }
+
+    while (depth < max_depth && fp) {
+        uint64_t frame[2] = { 0, 0 };
+        uint32_t frame32[2];
+        vaddr next;
+
+        if (size == 8) {
+            if (cpu_memory_rw_debug(cpu, fp, frame, sizeof(frame), false)) {
+                break;
+            }
+            frame[0] = le64_to_cpu(frame[0]);
+            frame[1] = le64_to_cpu(frame[1]);
+        } else {
+            if (cpu_memory_rw_debug(cpu, fp, frame32, sizeof(frame32),
+                                    false)) {
+                break;
+            }
+            frame[0] = le32_to_cpu(frame32[0]);
+            frame[1] = le32_to_cpu(frame32[1]);
+        }
+        if (!frame[1]) {
+            break;
+        }
+        frames[depth++] = frame[1];
+
+        /* the chain must go up the stack */
+        next = frame[0];
+        if (next <= fp || next - fp > GUEST_PROFILER_MAX_FRAME) {
+            break;
+        }
+        fp = next;
+    }
+    return depth;
+}
+
+static const char *guest_profiler_mode_name(int mode, char *buf, size_t len)
+{
+    return mode == 3 ? "user" : "kernel";
+}
+
+static int guest_profiler_mode(CPUState *cpu)
+{
+    return X86_CPU(cpu)->env.hflags & HF_CPL_MASK;
+}
+#else
+static int guest_profiler_unwind(CPUState *cpu, vaddr *frames, int max_depth)
+{
+    return 0;
+}
+
+static const char *guest_profiler_mode_name(int mode, char *buf, size_t len)
+{
+    snprintf(buf, len, "mmu%d", mode);
+    return buf;
+}
+
+static int guest_profiler_mode(CPUState *cpu)
+{
+    return cpu_mmu_index(cpu->env_ptr, true);
+}
+#endif
+
+static void guest_profiler_sample(CPUState *cpu, run_on_cpu_data data)
+{
+    VcpuProfile *vcpu;
+    GuestSample *sample;
+    target_ulong pc, cs_base;
+    uint32_t flags;
+
+    if (!profiler || cpu->cpu_index >= profiler->max_cpus) {
+        return;
+    }
+    vcpu = profiler->vcpus[cpu->cpu_index];
+    qatomic_set(&vcpu->scheduled, 0);
+
+    if (vcpu->n_samples == GUEST_PROFILER_SAMPLES) {
+        profiler->dropped++;
+        return;
+    }
+    sample = &vcpu->samples[vcpu->n_samples++];
+    profiler->samples++;
+
+    sample->idle = cpu->halted;
+    if (sample->idle) {
+        sample->pc = 0;
+        sample->mode = 0;
+        sample->depth = 0;
+        return;
+    }
+
+    cpu_synchronize_state(cpu);
+    cpu_get_tb_cpu_state(cpu->env_ptr, &pc, &cs_base, &flags);
+    sample->pc = pc;
+    sample->mode = guest_profiler_mode(cpu);
+    sample->depth = guest_profiler_unwind(cpu, sample->frames,
+                                          GUEST_PROFILER_MAX_DEPTH);
+}
+
+static void guest_profiler_tick(void *opaque)
+{
+    CPUState *cpu;
+
+    CPU_FOREACH(cpu) {
+        VcpuProfile *vcpu;
+
+        if (cpu->cpu_index >= profiler->max_cpus) {
+            continue;
+        }
+        vcpu = profiler->vcpus[cpu->cpu_index];
+        /* a vCPU that has not taken the last sample yet is not kicked again */
+        if (!qatomic_xchg(&vcpu->scheduled, 1)) {
+            async_run_on_cpu(cpu, guest_profiler_sample, RUN_ON_CPU_NULL);
+        }
+    }
+    timer_mod(profiler->timer,
+              qemu_clock_get_ns(QEMU_CLOCK_REALTIME) + profiler->period_ns);
+}
+
+void qmp_guest_profiler_start(bool has_period_us, uint32_t period_us,
+                              Error **errp)
+{
+    CPUState *cpu;
+    int i;
+
+    if (profiler) {
+        error_setg(errp, "The guest profiler is already running");
+        return;
+    }
+    if (!has_period_us) {
+        period_us = GUEST_PROFILER_DEFAULT_US;
+    }
+    if (!period_us) {
+        error_setg(errp, "Parameter 'period-us' must be positive");
+        return;
+    }
+
+    profiler = g_new0(GuestProfilerState, 1);
+    profiler->period_ns = (int64_t)period_us * SCALE_US;
+    CPU_FOREACH(cpu) {
+        profiler->max_cpus = MAX(profiler->max_cpus, cpu->cpu_index + 1);
+    }
+    profiler->vcpus = g_new0(VcpuProfile *, profiler->max_cpus);
+    for (i = 0; i < profiler->max_cpus; i++) {
+        profiler->vcpus[i] = g_new0(VcpuProfile, 1);
+    }
+
+    trace_guest_profiler_start(period_us);
+    profiler->timer = timer_new_ns(QEMU_CLOCK_REALTIME, guest_profiler_tick,
+                                   NULL);
+    timer_mod(profiler->timer,
+              qemu_clock_get_ns(QEMU_CLOCK_REALTIME) + profiler->period_ns);
+}
+
+static void guest_profiler_reset(void)
+{
+    int i;
+
+    for (i = 0; i < profiler->max_cpus; i++) {
+        profiler->vcpus[i]->n_samples = 0;
+    }
+    profiler->samples = 0;
+    profiler->dropped = 0;
+}
+
+void qmp_guest_profiler_stop(Error **errp)
+{
+    int i;
+
+    if (!profiler) {
+        error_setg(errp, "The guest profiler is not running");
+        return;
+    }
+
+    trace_guest_profiler_stop(profiler->samples, profiler->dropped);
+    timer_free(profiler->timer);
+    for (i = 0; i < profiler->max_cpus; i++) {
+        g_free(profiler->vcpus[i]);
+    }
+    g_free(profiler->vcpus);
+    g_free(profiler);
+    /* samples still queued on vCPUs see this and bail out */
+    profiler = NULL;
+}
+
+/* Append @sample as "mode;outermost frame;...;pc" */
+static void guest_profiler_fold(GString *out, const GuestSample *sample)
+{
+    char mode[16];
+    int i;
+
+    if (sample->idle) {
+        g_string_append(out, "[idle]");
+        return;
+    }
+    g_string_append(out, guest_profiler_mode_name(sample->mode, mode,
+                                                  sizeof(mode)));
+    for (i = sample->depth - 1; i >= 0; i--) {
+        g_string_append_printf(out, ";0x%" VADDR_PRIx, sample->frames[i]);
+    }
+    g_string_append_printf(out, ";0x%" VADDR_PRIx, sample->pc);
+}
+
+static void guest_profiler_print(gpointer key, gpointer value, gpointer opaque)
+{
+    g_string_append_printf(opaque, "%s %" PRIuPTR "\n", (char *)key,
+                           (uintptr_t)value);
+}
+
+GuestProfile *qmp_query_guest_profile(bool has_reset, bool reset,
+                                      Error **errp)
+{
+    g_autoptr(GHashTable) stacks = NULL;
+    g_autoptr(GString) key = g_string_new(NULL);
+    GString *folded;
+    GuestProfile *info;
+    int i;
+    unsigned int j;
+
+    if (!profiler) {
+        error_setg(errp, "The guest profiler is not running");
+        return NULL;
+    }
+
+    stacks = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+    for (i = 0; i < profiler->max_cpus; i++) {
+        VcpuProfile *vcpu = profiler->vcpus[i];
+
+        for (j = 0; j < vcpu->n_samples; j++) {
+            gpointer count;
+
+            g_string_truncate(key, 0);
+            guest_profiler_fold(key, &vcpu->samples[j]);
+            count = g_hash_table_lookup(stacks, key->str);
+            g_hash_table_replace(stacks, g_strdup(key->str),
+                                 (gpointer)((uintptr_t)count + 1));
+        }
+    }
+
+    folded = g_string_new(NULL);
+    g_hash_table_foreach(stacks, guest_profiler_print, folded);
+
+    info = g_new0(GuestProfile, 1);
+    info->samples = profiler->samples;
+    info->dropped = profiler->dropped;
+    info->folded = g_string_free(folded, false);
+
+    if (has_reset && reset) {
+        guest_profiler_reset();
+    }
+    return info;
+}
@@ -0,0 +1,240 @@
+/*
+ * Memory merge assist
+ *
+ * KSM scans all memory that was advised as mergeable, and for large
+ * guests most of that work is wasted on pages that never merge.  With the
+ * "x-mem-merge-assist" machine property, mergeable RAM blocks are not
+ * advised as a whole.  Instead a thread periodically hashes their resident
+ * pages and advises only the granules that hold zero pages or pages whose
+ * content also appeared elsewhere during the previous pass, so that the
+ * content is both shared and stable for a while.  Granules stay advised
+ * once they are, which keeps the memory that KSM merged there.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/bitmap.h"
+#include "qemu/cutils.h"
+#include "qemu/host-utils.h"
+#include "qemu/rcu.h"
+#include "qemu/thread.h"
+#include "qemu/units.h"
+#include "exec/ramblock.h"
+#include "exec/ramlist.h"
+#include "sysemu/mem-merge.h"
+#include "trace.h"
+
+/* Ranges are advised in units of a THP, which KSM splits anyway */
+#define MEM_MERGE_GRANULE       (2 * MiB)
+/* Fraction of candidate pages needed to advise a granule */
+#define MEM_MERGE_MIN_RATIO     32
+#define MEM_MERGE_MIN_BITS      (1ULL << 16)
+#define MEM_MERGE_MAX_BITS      (1ULL << 30)
+
+typedef struct MemMergeState {
+    QemuThread thread;
+    uint32_t interval;
+    size_t page_size;
+    unsigned char *vec;
+    /*
+     * Hash sets of the page contents seen once and more than once during
+     * the current pass, and seen more than once during the previous one.
+     */
+    uint64_t bits;
+    unsigned long *seen;
+    unsigned long *dup;
+    unsigned long *prev_dup;
+    /* statistics of the current pass */
+    uint64_t scanned;
+    uint64_t candidates;
+    uint64_t advised;
+} MemMergeState;
+
+static bool mem_merge_eligible(MemMergeState *s, RAMBlock *rb)
+{
+    /* KSM only merges private anonymous memory in small pages */
+    return qatomic_read(&rb->merge_assist) && rb->fd < 0 &&
+           !qemu_ram_is_shared(rb) && qemu_ram_pagesize(rb) == s->page_size;
+}
+
+static uint64_t mem_merge_hash(const void *buf, size_t len)
+{
+    const uint64_t m = 0x9e3779b97f4a7c15ull;
+    const uint64_t *p = buf;
+    uint64_t a = 1, b = 2, c = 3, d = 4;
+    size_t i;
+
+    for (i = 0; i < len / sizeof(uint64_t); i += 4) {
+        a = (a ^ p[i]) * m;
+        b = (b ^ p[i + 1]) * m;
+        c = (c ^ p[i + 2]) * m;
+        d = (d ^ p[i + 3]) * m;
+    }
+    return a ^ rol64(b, 17) ^ rol64(c, 31) ^ rol64(d, 47);
+}
+
+/* Returns true if the page is worth advising */
+static bool mem_merge_page(MemMergeState *s, const void *page)
+{
+    uint64_t bit;
+
+    if (buffer_is_zero(page, s->page_size)) {
+        return true;
+    }
+
+    bit = mem_merge_hash(page, s->page_size) & (s->bits - 1);
+    if (test_bit(bit, s->seen)) {
+        set_bit(bit, s->dup);
+    } else {
+        set_bit(bit, s->seen);
+    }
+    return test_bit(bit, s->prev_dup);
+}
+
+static void mem_merge_scan_granule(MemMergeState *s, RAMBlock *rb,
+                                   ram_addr_t offset, size_t len)
+{
+    uint8_t *host = rb->host + offset;
+    size_t pages = len / s->page_size;
+    size_t i, candidates = 0;
+
+#ifdef CONFIG_LINUX
+    /* Don't populate memory the guest never touched */
+    if (mincore(host, len, s->vec)) {
+        return;
+    }
+#else
+    memset(s->vec, 1, pages);
+#endif
+
+    for (i = 0; i < pages; i++) {
+        if (s->vec[i] & 1) {
+            s->scanned++;
+            candidates += mem_merge_page(s, host + i * s->page_size);
+        }
+    }
+    s->candidates += candidates;
+
+    if (candidates >= MAX(1, pages / MEM_MERGE_MIN_RATIO) &&
+        !test_bit(offset / MEM_MERGE_GRANULE, rb->merge_bmap)) {
+        qemu_madvise(host, len, QEMU_MADV_MERGEABLE);
+        set_bit(offset / MEM_MERGE_GRANULE, rb->merge_bmap);
+        s->advised += len;
+    }
+}
+
+/*
+ * Size the hash sets for the pages of all eligible blocks, and forget the
+ * state of blocks that are no longer mergeable.
+ */
+static void mem_merge_pass_start(MemMergeState *s)
+{
+    uint64_t pages = 0, bits;
+    RAMBlock *rb;
+
+    WITH_RCU_READ_LOCK_GUARD() {
+        RAMBLOCK_FOREACH(rb) {
+            if (!mem_merge_eligible(s, rb)) {
+                g_free(rb->merge_bmap);
+                rb->merge_bmap = NULL;
+                continue;
+            }
+            if (!rb->merge_bmap) {
+                rb->merge_bmap = bitmap_new(DIV_ROUND_UP(rb->max_length,
+                                                         MEM_MERGE_GRANULE));
+            }
+            pages += rb->used_length / s->page_size;
+        }
+    }
+
+    bits = MIN(MAX(pow2ceil(pages), MEM_MERGE_MIN_BITS), MEM_MERGE_MAX_BITS);
+    if (bits != s->bits) {
+        g_free(s->seen);
+        g_free(s->dup);
+        g_free(s->prev_dup);
+        s->bits = bits;
+        s->seen = bitmap_new(bits);
+        s->dup = bitmap_new(bits);
+        s->prev_dup = bitmap_new(bits);
+    }
+    s->scanned = s->candidates = s->advised = 0;
+}
+
+static void mem_merge_pass_end(MemMergeState *s)
+{
+    unsigned long *tmp = s->prev_dup;
+
+    s->prev_dup = s->dup;
+    s->dup = tmp;
+    bitmap_zero(s->dup, s->bits);
+    bitmap_zero(s->seen, s->bits);
+
+    trace_mem_merge_assist_pass(s->scanned, s->candidates, s->advised);
+}
+
+/*
+ * Scan the granule at or after @cursor, a ram_addr_t.  The RCU read lock
+ * is only held for one granule, so that RAM blocks can go away between.
+ * Returns false when there is nothing left to scan.
+ */
+static bool mem_merge_scan_next(MemMergeState *s, ram_addr_t *cursor)
+{
+    RAMBlock *rb, *next = NULL;
+    ram_addr_t offset;
+
+    RCU_READ_LOCK_GUARD();
+
+    RAMBLOCK_FOREACH(rb) {
+        if (!mem_merge_eligible(s, rb) || !rb->merge_bmap ||
+            rb->offset + rb->used_length <= *cursor) {
+            continue;
+        }
+        if (!next || rb->offset < next->offset) {
+            next = rb;
+        }
+    }
+    if (!next) {
+        return false;
+    }
+
+    offset = *cursor > next->offset ? *cursor - next->offset : 0;
+    offset = QEMU_ALIGN_DOWN(offset, MEM_MERGE_GRANULE);
+    mem_merge_scan_granule(s, next, offset,
+                           MIN(MEM_MERGE_GRANULE, next->used_length - offset));
+    *cursor = next->offset + offset + MEM_MERGE_GRANULE;
+    return true;
+}
+
+static void *mem_merge_thread(void *opaque)
+{
+    MemMergeState *s = opaque;
+
+    rcu_register_thread();
+
+    for (;;) {
+        ram_addr_t cursor = 0;
+
+        g_usleep(s->interval * G_USEC_PER_SEC);
+
+        mem_merge_pass_start(s);
+        while (mem_merge_scan_next(s, &cursor)) {
+            /* nothing */
+        }
+        mem_merge_pass_end(s);
+    }
+
+    return NULL;
+}
+
+void mem_merge_assist_start(uint32_t interval)
+{
+    MemMergeState *s = g_new0(MemMergeState, 1);
+
+    s->interval = interval;
+    s->page_size = qemu_real_host_page_size;
+    s->vec = g_malloc(MAX(MEM_MERGE_GRANULE / s->page_size, 1));
+    qemu_thread_create(&s->thread, "mem-merge", mem_merge_thread, s,
+                       QEMU_THREAD_DETACHED);
+}
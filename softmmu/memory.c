@@ -24,6 +24,7 @@
 #include "qemu/error-report.h"
 #include "qemu/main-loop.h"
 #include "qemu/qemu-print.h"
+#include "qemu/timer.h"
 #include "qom/object.h"
 #include "trace.h"
 
@@ -41,6 +42,9 @@
 static unsigned memory_region_transaction_depth;
 static bool memory_region_update_pending;
 static bool ioeventfd_update_pending;
+/* Top-level regions changed by the current transaction, see FlatView::tops */
+static GHashTable *topology_dirty_tops;
+static bool topology_all_dirty;
 bool global_dirty_log;
 
 static QTAILQ_HEAD(, MemoryListener) memory_listeners
@@ -254,6 +258,61 @@ static bool flatrange_equal(FlatRange *a, FlatRange *b)
         && a->nonvolatile == b->nonvolatile;
 }
 
+static MemoryRegion *memory_region_get_top(MemoryRegion *mr)
+{
+    while (mr->container) {
+        mr = mr->container;
+    }
+    return mr;
+}
+
+/*
+ * Record that the FlatViews rendering @mr must be generated again at the
+ * end of the transaction; a NULL @mr stands for all of them.  Changes to
+ * the containment of @mr itself must be recorded both before and after
+ * they are made, because they change which region is its top.
+ */
+static void memory_region_topology_changed(MemoryRegion *mr)
+{
+    if (!mr) {
+        topology_all_dirty = true;
+        return;
+    }
+    if (!topology_dirty_tops) {
+        topology_dirty_tops = g_hash_table_new(NULL, NULL);
+    }
+    g_hash_table_add(topology_dirty_tops, memory_region_get_top(mr));
+}
+
+static void flatview_add_top(FlatView *view, MemoryRegion *mr)
+{
+    MemoryRegion *top = memory_region_get_top(mr);
+
+    if (g_hash_table_add(view->tops, top)) {
+        memory_region_ref(top);
+    }
+}
+
+static bool flatview_is_dirty(FlatView *view)
+{
+    GHashTableIter iter;
+    gpointer top;
+
+    if (topology_all_dirty) {
+        return true;
+    }
+    if (!topology_dirty_tops) {
+        return false;
+    }
+    g_hash_table_iter_init(&iter, view->tops);
+    while (g_hash_table_iter_next(&iter, &top, NULL)) {
+        if (g_hash_table_contains(topology_dirty_tops, top)) {
+            return true;
+        }
+    }
+    return false;
+}
+
 static FlatView *flatview_new(MemoryRegion *mr_root)
 {
     FlatView *view;
@@ -261,6 +320,7 @@ static FlatView *flatview_new(MemoryRegion *mr_root)
     view = g_new0(FlatView, 1);
     view->ref = 1;
     view->root = mr_root;
+    view->tops = g_hash_table_new(NULL, NULL);
     memory_region_ref(mr_root);
     trace_flatview_new(view, mr_root);
 
@@ -284,6 +344,11 @@ static void flatview_insert(FlatView *view, unsigned pos, FlatRange *range)
     ++view->nr;
 }
 
+static void flatview_unref_top(gpointer key, gpointer value, gpointer opaque)
+{
+    memory_region_unref(key);
+}
+
 static void flatview_destroy(FlatView *view)
 {
     int i;
@@ -296,6 +361,8 @@ static void flatview_destroy(FlatView *view)
         memory_region_unref(view->ranges[i].mr);
     }
     g_free(view->ranges);
+    g_hash_table_foreach(view->tops, flatview_unref_top, NULL);
+    g_hash_table_destroy(view->tops);
     memory_region_unref(view->root);
     g_free(view);
 }
@@ -556,6 +623,21 @@ static MemTxResult access_with_adjusted_size(hwaddr addr,
     return r;
 }
 
+/*
+ * Most accesses have a size that the device implements, and need neither
+ * splitting nor combining.  They call the device directly, without going
+ * through access_with_adjusted_size() and its indirect accessor calls.
+ */
+static inline bool memory_region_access_is_direct(MemoryRegion *mr,
+                                                  unsigned size)
+{
+    unsigned access_size_min = mr->ops->impl.min_access_size;
+    unsigned access_size_max = mr->ops->impl.max_access_size;
+
+    return size >= MAX(access_size_min, 1) &&
+           size <= (access_size_max ? access_size_max : 4);
+}
+
 static AddressSpace *memory_region_to_address_space(MemoryRegion *mr)
 {
     AddressSpace *as;
@@ -608,6 +690,7 @@ static void render_memory_region(FlatView *view,
     if (mr->alias) {
         int128_subfrom(&base, int128_make64(mr->alias->addr));
         int128_subfrom(&base, int128_make64(mr->alias_offset));
+        flatview_add_top(view, mr->alias);
         render_memory_region(view, mr->alias, base, clip,
                              readonly, nonvolatile);
         return;
@@ -729,6 +812,7 @@ static FlatView *generate_memory_topology(MemoryRegion *mr)
     view = flatview_new(mr);
 
     if (mr) {
+        flatview_add_top(view, mr);
         render_memory_region(view, mr, int128_zero(),
                              addrrange_make(int128_zero(), int128_2_64()),
                              false, false);
@@ -999,24 +1083,37 @@ static void flatviews_init(void)
 
 static void flatviews_reset(void)
 {
+    GHashTable *old_views = flat_views;
     AddressSpace *as;
 
-    if (flat_views) {
-        g_hash_table_unref(flat_views);
-        flat_views = NULL;
-    }
+    flat_views = NULL;
     flatviews_init();
 
-    /* Render unique FVs */
+    /*
+     * Render unique FVs, keeping those that do not include any region
+     * changed by the transaction.
+     */
     QTAILQ_FOREACH(as, &address_spaces, address_spaces_link) {
         MemoryRegion *physmr = memory_region_get_flatview_root(as->root);
+        FlatView *view;
 
         if (g_hash_table_lookup(flat_views, physmr)) {
             continue;
         }
 
+        view = old_views ? g_hash_table_lookup(old_views, physmr) : NULL;
+        if (view && physmr && !flatview_is_dirty(view)) {
+            flatview_ref(view);
+            g_hash_table_replace(flat_views, physmr, view);
+            continue;
+        }
+
         generate_memory_topology(physmr);
     }
+
+    if (old_views) {
+        g_hash_table_unref(old_views);
+    }
 }
 
 static void address_space_set_flatview(AddressSpace *as)
@@ -1096,8 +1193,13 @@ void memory_region_transaction_commit(void)
             MEMORY_LISTENER_CALL_GLOBAL(begin, Forward);
 
             QTAILQ_FOREACH(as, &address_spaces, address_spaces_link) {
+                FlatView *old_view = address_space_to_flatview(as);
+
                 address_space_set_flatview(as);
-                address_space_update_ioeventfds(as);
+                if (ioeventfd_update_pending ||
+                    address_space_to_flatview(as) != old_view) {
+                    address_space_update_ioeventfds(as);
+                }
             }
             memory_region_update_pending = false;
             ioeventfd_update_pending = false;
@@ -1108,6 +1210,10 @@ void memory_region_transaction_commit(void)
             }
             ioeventfd_update_pending = false;
         }
+        if (topology_dirty_tops) {
+            g_hash_table_remove_all(topology_dirty_tops);
+        }
+        topology_all_dirty = false;
    }
 }
 
@@ -1242,6 +1348,7 @@ static void memory_region_initfn(Object *obj)
     mr->ops = &unassigned_mem_ops;
     mr->enabled = true;
     mr->romd_mode = true;
+    mr->global_locking = true;
     mr->destructor = memory_region_destructor_none;
     QTAILQ_INIT(&mr->subregions);
     QTAILQ_INIT(&mr->coalesced);
@@ -1416,6 +1523,17 @@ static MemTxResult memory_region_dispatch_read1(MemoryRegion *mr,
 {
     *pval = 0;
 
+    if (memory_region_access_is_direct(mr, size)) {
+        uint64_t access_mask = MAKE_64BIT_MASK(0, size * 8);
+
+        if (mr->ops->read) {
+            return memory_region_read_accessor(mr, addr, pval, size, 0,
+                                               access_mask, attrs);
+        }
+        return memory_region_read_with_attrs_accessor(mr, addr, pval, size, 0,
+                                                      access_mask, attrs);
+    }
+
     if (mr->ops->read) {
         return access_with_adjusted_size(addr, pval, size,
                                          mr->ops->impl.min_access_size,
@@ -1477,6 +1595,40 @@ static bool memory_region_dispatch_write_eventfds(MemoryRegion *mr,
     return false;
 }
 
+bool memory_region_can_write_batch(MemoryRegion *mr, hwaddr addr,
+                                   unsigned size, MemTxAttrs attrs)
+{
+    const MemoryRegionOps *ops = mr->ops;
+
+    /*
+     * Anything that memory_region_dispatch_write() would reject, split
+     * or divert to an ioeventfd goes through the normal path.
+     */
+    return ops->write_batch && !mr->ioeventfd_nb &&
+           size >= (ops->impl.min_access_size ?: 1) &&
+           size <= (ops->impl.max_access_size ?: 4) &&
+           size <= (ops->valid.max_access_size ?: 4) &&
+           memory_region_access_valid(mr, addr, size, true, attrs);
+}
+
+void memory_region_dispatch_write_batch(MemoryRegion *mr,
+                                        MemoryRegionBatchWrite *writes,
+                                        unsigned n)
+{
+    unsigned i;
+
+    for (i = 0; i < n; i++) {
+        adjust_endianness(mr, &writes[i].data, size_memop(writes[i].size));
+        if (trace_event_get_state_backends(TRACE_MEMORY_REGION_OPS_WRITE)) {
+            hwaddr abs_addr = memory_region_to_absolute_addr(mr,
+                                                             writes[i].addr);
+            trace_memory_region_ops_write(get_cpu_index(), mr, abs_addr,
+                                          writes[i].data, writes[i].size);
+        }
+    }
+    mr->ops->write_batch(mr->opaque, writes, n);
+}
+
 MemTxResult memory_region_dispatch_write(MemoryRegion *mr,
                                          hwaddr addr,
                                          uint64_t data,
@@ -1497,6 +1649,17 @@ MemTxResult memory_region_dispatch_write(MemoryRegion *mr,
         return MEMTX_OK;
     }
 
+    if (memory_region_access_is_direct(mr, size)) {
+        uint64_t access_mask = MAKE_64BIT_MASK(0, size * 8);
+
+        if (mr->ops->write) {
+            return memory_region_write_accessor(mr, addr, &data, size, 0,
+                                                access_mask, attrs);
+        }
+        return memory_region_write_with_attrs_accessor(mr, addr, &data, size,
+                                                       0, access_mask, attrs);
+    }
+
     if (mr->ops->write) {
         return access_with_adjusted_size(addr, &data, size,
                                          mr->ops->impl.min_access_size,
@@ -2043,6 +2206,7 @@ void memory_region_set_log(MemoryRegion *mr, bool log, unsigned client)
 
     memory_region_transaction_begin();
     mr->dirty_log_mask = (mr->dirty_log_mask & ~mask) | (log * mask);
+    memory_region_topology_changed(mr);
     memory_region_update_pending |= mr->enabled;
     memory_region_transaction_commit();
 }
@@ -2069,6 +2233,15 @@ static void memory_region_sync_dirty_bitmap(MemoryRegion *mr)
      * address space once.
      */
     QTAILQ_FOREACH(listener, &memory_listeners, link) {
+        if (listener->log_sync_global) {
+            /*
+             * No matter whether MR is specified, what we can do here
+             * is to do a global sync, because we are not capable to
+             * sync in a finer granularity.
+             */
+            listener->log_sync_global(listener);
+            continue;
+        }
         if (!listener->log_sync) {
             continue;
         }
@@ -2161,6 +2334,7 @@ void memory_region_set_readonly(MemoryRegion *mr, bool readonly)
     if (mr->readonly != readonly) {
         memory_region_transaction_begin();
         mr->readonly = readonly;
+        memory_region_topology_changed(mr);
         memory_region_update_pending |= mr->enabled;
         memory_region_transaction_commit();
     }
@@ -2171,6 +2345,7 @@ void memory_region_set_nonvolatile(MemoryRegion *mr, bool nonvolatile)
     if (mr->nonvolatile != nonvolatile) {
         memory_region_transaction_begin();
         mr->nonvolatile = nonvolatile;
+        memory_region_topology_changed(mr);
         memory_region_update_pending |= mr->enabled;
         memory_region_transaction_commit();
     }
@@ -2181,6 +2356,7 @@ void memory_region_rom_device_set_romd(MemoryRegion *mr, bool romd_mode)
     if (mr->romd_mode != romd_mode) {
         memory_region_transaction_begin();
         mr->romd_mode = romd_mode;
+        memory_region_topology_changed(mr);
         memory_region_update_pending |= mr->enabled;
         memory_region_transaction_commit();
     }
@@ -2306,6 +2482,41 @@ void memory_region_add_coalescing(MemoryRegion *mr,
     memory_region_set_flush_coalesced(mr);
 }
 
+/* Number of doorbell ranges, which need coalesced_doorbell_timer */
+static unsigned coalesced_doorbells;
+static QEMUTimer *coalesced_doorbell_timer;
+
+static void coalesced_doorbell_flush(void *opaque)
+{
+    qemu_flush_coalesced_mmio_buffer();
+    if (coalesced_doorbells) {
+        timer_mod(coalesced_doorbell_timer,
+                  qemu_clock_get_ms(QEMU_CLOCK_REALTIME) + 1);
+    }
+}
+
+void memory_region_add_coalescing_doorbell(MemoryRegion *mr,
+                                           hwaddr offset,
+                                           uint64_t size)
+{
+    memory_region_add_coalescing(mr, offset, size);
+
+    /* Only KVM coalesces writes */
+    if (!kvm_enabled()) {
+        return;
+    }
+    mr->coalesced_doorbells++;
+    if (!coalesced_doorbells++) {
+        if (!coalesced_doorbell_timer) {
+            coalesced_doorbell_timer = timer_new_ms(QEMU_CLOCK_REALTIME,
+                                                    coalesced_doorbell_flush,
+                                                    NULL);
+        }
+        timer_mod(coalesced_doorbell_timer,
+                  qemu_clock_get_ms(QEMU_CLOCK_REALTIME) + 1);
+    }
+}
+
 void memory_region_clear_coalescing(MemoryRegion *mr)
 {
     CoalescedMemoryRange *cmr;
@@ -2316,6 +2527,8 @@ void memory_region_clear_coalescing(MemoryRegion *mr)
 
     qemu_flush_coalesced_mmio_buffer();
     mr->flush_coalesced_mmio = false;
+    coalesced_doorbells -= mr->coalesced_doorbells;
+    mr->coalesced_doorbells = 0;
 
     while (!QTAILQ_EMPTY(&mr->coalesced)) {
         cmr = QTAILQ_FIRST(&mr->coalesced);
@@ -2338,6 +2551,16 @@ void memory_region_clear_flush_coalesced(MemoryRegion *mr)
     }
 }
 
+void memory_region_clear_global_locking(MemoryRegion *mr)
+{
+    mr->global_locking = false;
+}
+
+void memory_region_set_global_locking(MemoryRegion *mr)
+{
+    mr->global_locking = true;
+}
+
 static bool userspace_eventfd_warning;
 
 void memory_region_add_eventfd(MemoryRegion *mr,
@@ -2433,6 +2656,7 @@ static void memory_region_update_container_subregions(MemoryRegion *subregion)
     }
     QTAILQ_INSERT_TAIL(&mr->subregions, subregion, subregions_link);
 done:
+    memory_region_topology_changed(subregion);
     memory_region_update_pending |= mr->enabled && subregion->enabled;
     memory_region_transaction_commit();
 }
@@ -2442,6 +2666,7 @@ static void memory_region_add_subregion_common(MemoryRegion *mr,
                                                MemoryRegion *subregion)
 {
     assert(!subregion->container);
+    memory_region_topology_changed(subregion);
     subregion->container = mr;
     subregion->addr = offset;
     memory_region_update_container_subregions(subregion);
@@ -2469,8 +2694,10 @@ void memory_region_del_subregion(MemoryRegion *mr,
 {
     memory_region_transaction_begin();
     assert(subregion->container == mr);
+    memory_region_topology_changed(subregion);
     subregion->container = NULL;
     QTAILQ_REMOVE(&mr->subregions, subregion, subregions_link);
+    memory_region_topology_changed(subregion);
     memory_region_unref(subregion);
     memory_region_update_pending |= mr->enabled && subregion->enabled;
     memory_region_transaction_commit();
@@ -2483,6 +2710,7 @@ void memory_region_set_enabled(MemoryRegion *mr, bool enabled)
     }
     memory_region_transaction_begin();
     mr->enabled = enabled;
+    memory_region_topology_changed(mr);
     memory_region_update_pending = true;
     memory_region_transaction_commit();
 }
@@ -2499,6 +2727,7 @@ void memory_region_set_size(MemoryRegion *mr, uint64_t size)
     }
     memory_region_transaction_begin();
     mr->size = s;
+    memory_region_topology_changed(mr);
     memory_region_update_pending = true;
     memory_region_transaction_commit();
 }
@@ -2536,6 +2765,7 @@ void memory_region_set_alias_offset(MemoryRegion *mr, hwaddr offset)
 
     memory_region_transaction_begin();
     mr->alias_offset = offset;
+    memory_region_topology_changed(mr);
     memory_region_update_pending |= mr->enabled;
     memory_region_transaction_commit();
 }
@@ -2663,6 +2893,7 @@ void memory_global_dirty_log_start(void)
 
     /* Refresh DIRTY_MEMORY_MIGRATION bit.  */
     memory_region_transaction_begin();
+    memory_region_topology_changed(NULL);
     memory_region_update_pending = true;
     memory_region_transaction_commit();
 }
@@ -2673,6 +2904,7 @@ static void memory_global_dirty_log_do_stop(void)
 
     /* Refresh DIRTY_MEMORY_MIGRATION bit.  */
     memory_region_transaction_begin();
+    memory_region_topology_changed(NULL);
     memory_region_update_pending = true;
     memory_region_transaction_commit();
 
@@ -2824,6 +3056,10 @@ void address_space_init(AddressSpace *as, MemoryRegion *root, const char *name)
     as->ioeventfds = NULL;
     QTAILQ_INIT(&as->listeners);
     QTAILQ_INSERT_TAIL(&address_spaces, as, address_spaces_link);
+    as->max_bounce_buffer_size = DEFAULT_MAX_BOUNCE_BUFFER_SIZE;
+    as->bounce_buffer_size = 0;
+    qemu_mutex_init(&as->map_client_list_lock);
+    QLIST_INIT(&as->map_client_list);
     as->name = g_strdup(name ? name : "anonymous");
     address_space_update_topology(as);
     address_space_update_ioeventfds(as);
@@ -2831,6 +3067,10 @@ void address_space_init(AddressSpace *as, MemoryRegion *root, const char *name)
 
 static void do_address_space_destroy(AddressSpace *as)
 {
+    assert(qatomic_read(&as->bounce_buffer_size) == 0);
+    assert(QLIST_EMPTY(&as->map_client_list));
+    qemu_mutex_destroy(&as->map_client_list_lock);
+
     assert(QTAILQ_EMPTY(&as->listeners));
 
     flatview_unref(as->current_map);
@@ -2994,13 +3234,15 @@ static void mtree_print_mr(const MemoryRegion *mr, unsigned int level,
                 qemu_printf(MTREE_INDENT);
             }
             qemu_printf(TARGET_FMT_plx "-" TARGET_FMT_plx
-                        " (prio %d, %s%s): %s%s",
+                        " (prio %d, %s%s): %s%s%s",
                         cur_start, cur_end,
                         mr->priority,
                         mr->nonvolatile ? "nv-" : "",
                         memory_region_type((MemoryRegion *)mr),
                         memory_region_name(mr),
-                        mr->enabled ? "" : " [disabled]");
+                        mr->enabled ? "" : " [disabled]",
+                        memory_region_needs_global_locking((MemoryRegion *)mr)
+                        ? "" : " [lockless]");
             if (owner) {
                 mtree_print_mr_owner(mr);
             }
@@ -128,7 +128,8 @@ typedef struct PhysPageMap {
 } PhysPageMap;
 
 struct AddressSpaceDispatch {
-    MemoryRegionSection *mru_section;
+    /* Unique among all dispatches ever created, see PhysSectionCache */
+    uint64_t gen;
     /* This is a multi-level map on the physical address space.
      * The bottom level has pointers to MemoryRegionSections.
      */
@@ -332,18 +333,52 @@ static MemoryRegionSection *phys_page_find(AddressSpaceDispatch *d, hwaddr addr)
     }
 }
 
+/*
+ * Sections recently looked up by this thread.  Device models running in
+ * different threads tend to access different regions, so this hits more
+ * often than a single MRU section per dispatch would, and is not written
+ * by several threads.  An entry is only used if its generation is that of the
+ * dispatch being looked up, which is still alive, so entries pointing into
+ * freed dispatches are never dereferenced.
+ */
+#define PHYS_SECTION_CACHE_SIZE 8
+
+typedef struct PhysSectionCache {
+    struct {
+        uint64_t gen;
+        MemoryRegionSection *section;
+    } entry[PHYS_SECTION_CACHE_SIZE];
+    unsigned next;
+} PhysSectionCache;
+
+static __thread PhysSectionCache phys_section_cache;
+static uint64_t phys_dispatch_gen;
+
 /* Called from RCU critical section */
 static MemoryRegionSection *address_space_lookup_region(AddressSpaceDispatch *d,
                                                         hwaddr addr,
                                                         bool resolve_subpage)
 {
-    MemoryRegionSection *section = qatomic_read(&d->mru_section);
+    PhysSectionCache *cache = &phys_section_cache;
+    MemoryRegionSection *section = NULL;
     subpage_t *subpage;
+    int i;
 
-    if (!section || section == &d->map.sections[PHYS_SECTION_UNASSIGNED] ||
-        !section_covers_addr(section, addr)) {
+    for (i = 0; i < PHYS_SECTION_CACHE_SIZE; i++) {
+        if (cache->entry[i].gen == d->gen &&
+            section_covers_addr(cache->entry[i].section, addr)) {
+            section = cache->entry[i].section;
+            break;
+        }
+    }
+    if (!section) {
         section = phys_page_find(d, addr);
-        qatomic_set(&d->mru_section, section);
+        /* The unassigned section covers everything, don't cache it */
+        if (section != &d->map.sections[PHYS_SECTION_UNASSIGNED]) {
+            i = cache->next++ % PHYS_SECTION_CACHE_SIZE;
+            cache->entry[i].gen = d->gen;
+            cache->entry[i].section = section;
+        }
     }
     if (resolve_subpage && section->mr->subpage) {
         subpage = container_of(section->mr, subpage_t, iomem);
@@ -1102,7 +1137,13 @@ DirtyBitmapSnapshot *cpu_physical_memory_snapshot_and_clear_dirty
         }
     }
 
-    if (tcg_enabled()) {
+    /*
+     * With no dirty page, TLB entries for the range already trap writes:
+     * an entry can only lose TLB_NOTDIRTY once the page is dirty for all
+     * clients, DIRTY_MEMORY_VGA included.
+     */
+    if (tcg_enabled() &&
+        !bitmap_empty(snap->dirty, (last - first) >> TARGET_PAGE_BITS)) {
         tlb_reset_dirty_range_all(start, length);
     }
 
@@ -1123,13 +1164,7 @@ bool cpu_physical_memory_snapshot_get_dirty(DirtyBitmapSnapshot *snap,
     end = TARGET_PAGE_ALIGN(start + length - snap->start) >> TARGET_PAGE_BITS;
     page = (start - snap->start) >> TARGET_PAGE_BITS;
 
-    while (page < end) {
-        if (test_bit(page, snap->dirty)) {
-            return true;
-        }
-        page++;
-    }
-    return false;
+    return find_next_bit(snap->dirty, end, page) < end;
 }
 
 /* Called from RCU critical section */
@@ -1741,6 +1776,22 @@ void qemu_ram_unset_migratable(RAMBlock *rb)
     rb->flags &= ~RAM_MIGRATABLE;
 }
 
+/*
+ * Advise @rb to KSM.  With the memory merge assist, only flag it, and
+ * leave it to the assist to advise the ranges that are worth merging.
+ */
+void qemu_ram_set_mergeable(RAMBlock *rb, bool mergeable)
+{
+    if (machine_mem_merge_assist(current_machine)) {
+        qatomic_set(&rb->merge_assist, mergeable);
+        if (mergeable) {
+            return;
+        }
+    }
+    qemu_madvise(rb->host, rb->max_length,
+                 mergeable ? QEMU_MADV_MERGEABLE : QEMU_MADV_UNMERGEABLE);
+}
+
 /* Called with iothread lock held.  */
 void qemu_ram_set_idstr(RAMBlock *new_block, const char *name, DeviceState *dev)
 {
@@ -1971,7 +2022,9 @@ static void ram_block_add(RAMBlock *new_block, Error **errp, bool shared)
                 qemu_mutex_unlock_ramlist();
                 return;
             }
-            memory_try_enable_merging(new_block->host, new_block->max_length);
+            if (machine_mem_merge(current_machine)) {
+                qemu_ram_set_mergeable(new_block, true);
+            }
         }
     }
 
@@ -2200,6 +2253,7 @@ static void reclaim_ramblock(RAMBlock *block)
     } else {
         qemu_anon_ram_free(block->host, block->max_length);
     }
+    g_free(block->merge_bmap);
     g_free(block);
 }
 
@@ -2582,6 +2636,8 @@ AddressSpaceDispatch *address_space_dispatch_new(FlatView *fv)
     AddressSpaceDispatch *d = g_new0(AddressSpaceDispatch, 1);
     uint16_t n;
 
+    /* Called with the BQL held; 0 is never used so empty entries miss */
+    d->gen = ++phys_dispatch_gen;
     n = dummy_section(&d->map, fv, &io_mem_unassigned);
     assert(n == PHYS_SECTION_UNASSIGNED);
 
@@ -2742,6 +2798,9 @@ static bool prepare_mmio_access(MemoryRegion *mr)
 {
     bool release_lock = false;
 
+    if (!memory_region_needs_global_locking(mr)) {
+        return false;
+    }
     if (!qemu_mutex_iothread_locked()) {
         qemu_mutex_lock_iothread();
         release_lock = true;
@@ -3000,53 +3059,47 @@ void cpu_flush_icache_range(hwaddr start, hwaddr len)
                                      NULL, len, FLUSH_CACHE);
 }
 
+#define BOUNCE_BUFFER_MAGIC 0xb4017ceb4ffe12edULL
+
 typedef struct {
+    uint64_t magic;
     MemoryRegion *mr;
-    void *buffer;
     hwaddr addr;
-    hwaddr len;
-    bool in_use;
+    size_t len;
+    uint8_t buffer[];
 } BounceBuffer;
 
-static BounceBuffer bounce;
-
-typedef struct MapClient {
-    QEMUBH *bh;
-    QLIST_ENTRY(MapClient) link;
-} MapClient;
-
-QemuMutex map_client_list_lock;
-static QLIST_HEAD(, MapClient) map_client_list
-    = QLIST_HEAD_INITIALIZER(map_client_list);
-
-static void cpu_unregister_map_client_do(MapClient *client)
+static void
+address_space_unregister_map_client_do(AddressSpaceMapClient *client)
 {
     QLIST_REMOVE(client, link);
     g_free(client);
 }
 
-static void cpu_notify_map_clients_locked(void)
+static void address_space_notify_map_clients_locked(AddressSpace *as)
 {
-    MapClient *client;
+    AddressSpaceMapClient *client;
 
-    while (!QLIST_EMPTY(&map_client_list)) {
-        client = QLIST_FIRST(&map_client_list);
+    while (!QLIST_EMPTY(&as->map_client_list)) {
+        client = QLIST_FIRST(&as->map_client_list);
         qemu_bh_schedule(client->bh);
-        cpu_unregister_map_client_do(client);
+        address_space_unregister_map_client_do(client);
     }
 }
 
-void cpu_register_map_client(QEMUBH *bh)
+void address_space_register_map_client(AddressSpace *as, QEMUBH *bh)
 {
-    MapClient *client = g_malloc(sizeof(*client));
+    AddressSpaceMapClient *client = g_malloc(sizeof(*client));
 
-    qemu_mutex_lock(&map_client_list_lock);
+    qemu_mutex_lock(&as->map_client_list_lock);
     client->bh = bh;
-    QLIST_INSERT_HEAD(&map_client_list, client, link);
-    if (!qatomic_read(&bounce.in_use)) {
-        cpu_notify_map_clients_locked();
+    QLIST_INSERT_HEAD(&as->map_client_list, client, link);
+    /* Write map_client_list before reading bounce_buffer_size. */
+    smp_mb();
+    if (qatomic_read(&as->bounce_buffer_size) < as->max_bounce_buffer_size) {
+        address_space_notify_map_clients_locked(as);
     }
-    qemu_mutex_unlock(&map_client_list_lock);
+    qemu_mutex_unlock(&as->map_client_list_lock);
 }
 
 void cpu_exec_init_all(void)
@@ -3062,28 +3115,27 @@ void cpu_exec_init_all(void)
     finalize_target_page_bits();
     io_mem_init();
     memory_map_init();
-    qemu_mutex_init(&map_client_list_lock);
 }
 
-void cpu_unregister_map_client(QEMUBH *bh)
+void address_space_unregister_map_client(AddressSpace *as, QEMUBH *bh)
 {
-    MapClient *client;
+    AddressSpaceMapClient *client;
 
-    qemu_mutex_lock(&map_client_list_lock);
-    QLIST_FOREACH(client, &map_client_list, link) {
+    qemu_mutex_lock(&as->map_client_list_lock);
+    QLIST_FOREACH(client, &as->map_client_list, link) {
         if (client->bh == bh) {
-            cpu_unregister_map_client_do(client);
+            address_space_unregister_map_client_do(client);
             break;
         }
     }
-    qemu_mutex_unlock(&map_client_list_lock);
+    qemu_mutex_unlock(&as->map_client_list_lock);
 }
 
-static void cpu_notify_map_clients(void)
+static void address_space_notify_map_clients(AddressSpace *as)
 {
-    qemu_mutex_lock(&map_client_list_lock);
-    cpu_notify_map_clients_locked();
-    qemu_mutex_unlock(&map_client_list_lock);
+    qemu_mutex_lock(&as->map_client_list_lock);
+    address_space_notify_map_clients_locked(as);
+    qemu_mutex_unlock(&as->map_client_list_lock);
 }
 
 static bool flatview_access_valid(FlatView *fv, hwaddr addr, hwaddr len,
@@ -3152,8 +3204,8 @@ flatview_extend_translation(FlatView *fv, hwaddr addr,
  * May map a subset of the requested range, given by and returned in *plen.
  * May return NULL if resources needed to perform the mapping are exhausted.
  * Use only for reads OR writes - not for read-modify-write operations.
- * Use cpu_register_map_client() to know when retrying the map operation is
- * likely to succeed.
+ * Use address_space_register_map_client() to know when retrying the map
+ * operation is likely to succeed.
  */
 void *address_space_map(AddressSpace *as,
                         hwaddr addr,
@@ -3177,25 +3229,40 @@ void *address_space_map(AddressSpace *as,
     mr = flatview_translate(fv, addr, &xlat, &l, is_write, attrs);
 
     if (!memory_access_is_direct(mr, is_write)) {
-        if (qatomic_xchg(&bounce.in_use, true)) {
+        size_t used = qatomic_read(&as->bounce_buffer_size);
+        BounceBuffer *bounce;
+
+        /* Avoid unbounded allocations, reserve what the limit allows */
+        for (;;) {
+            hwaddr alloc = MIN(as->max_bounce_buffer_size - used, l);
+            size_t actual = qatomic_cmpxchg(&as->bounce_buffer_size,
+                                            used, used + alloc);
+            if (actual == used) {
+                l = alloc;
+                break;
+            }
+            used = actual;
+        }
+
+        if (l == 0) {
             *plen = 0;
             return NULL;
         }
-        /* Avoid unbounded allocations */
-        l = MIN(l, TARGET_PAGE_SIZE);
-        bounce.buffer = qemu_memalign(TARGET_PAGE_SIZE, l);
-        bounce.addr = addr;
-        bounce.len = l;
 
+        bounce = g_malloc0(l + sizeof(BounceBuffer));
+        bounce->magic = BOUNCE_BUFFER_MAGIC;
         memory_region_ref(mr);
-        bounce.mr = mr;
+        bounce->mr = mr;
+        bounce->addr = addr;
+        bounce->len = l;
+
         if (!is_write) {
             flatview_read(fv, addr, MEMTXATTRS_UNSPECIFIED,
-                               bounce.buffer, l);
+                          bounce->buffer, l);
         }
 
         *plen = l;
-        return bounce.buffer;
+        return bounce->buffer;
     }
 
 
@@ -3215,12 +3282,12 @@ void *address_space_map(AddressSpace *as,
 void address_space_unmap(AddressSpace *as, void *buffer, hwaddr len,
                          bool is_write, hwaddr access_len)
 {
-    if (buffer != bounce.buffer) {
-        MemoryRegion *mr;
-        ram_addr_t addr1;
+    MemoryRegion *mr;
+    ram_addr_t addr1;
+    BounceBuffer *bounce;
 
-        mr = memory_region_from_host(buffer, &addr1);
-        assert(mr != NULL);
+    mr = memory_region_from_host(buffer, &addr1);
+    if (mr != NULL) {
         if (is_write) {
             invalidate_and_set_dirty(mr, addr1, access_len);
         }
@@ -3230,15 +3297,22 @@ void address_space_unmap(AddressSpace *as, void *buffer, hwaddr len,
         memory_region_unref(mr);
         return;
     }
+
+    bounce = container_of(buffer, BounceBuffer, buffer);
+    assert(bounce->magic == BOUNCE_BUFFER_MAGIC);
+
     if (is_write) {
-        address_space_write(as, bounce.addr, MEMTXATTRS_UNSPECIFIED,
-                            bounce.buffer, access_len);
+        address_space_write(as, bounce->addr, MEMTXATTRS_UNSPECIFIED,
+                            bounce->buffer, access_len);
     }
-    qemu_vfree(bounce.buffer);
-    bounce.buffer = NULL;
-    memory_region_unref(bounce.mr);
-    qatomic_mb_set(&bounce.in_use, false);
-    cpu_notify_map_clients();
+
+    qatomic_sub(&as->bounce_buffer_size, bounce->len);
+    bounce->magic = ~BOUNCE_BUFFER_MAGIC;
+    memory_region_unref(bounce->mr);
+    g_free(bounce);
+    /* Write bounce_buffer_size before reading map_client_list. */
+    smp_mb();
+    address_space_notify_map_clients(as);
 }
 
 void *cpu_physical_memory_map(hwaddr addr,
@@ -3632,14 +3706,13 @@ void mtree_print_dispatch(AddressSpaceDispatch *d, MemoryRegion *root)
                                 " [ROM]", " [watch]" };
 
         qemu_printf("      #%d @" TARGET_FMT_plx ".." TARGET_FMT_plx
-                    " %s%s%s%s%s",
+                    " %s%s%s%s",
             i,
             s->offset_within_address_space,
             s->offset_within_address_space + MR_SIZE(s->mr->size),
             s->mr->name ? s->mr->name : "(noname)",
             i < ARRAY_SIZE(names) ? names[i] : "",
             s->mr == root ? " [ROOT]" : "",
-            s == d->mru_section ? " [MRU]" : "",
             s->mr->is_iommu ? " [iommu]" : "");
 
         if (s->mr->alias) {
@@ -3683,6 +3756,16 @@ void mtree_print_dispatch(AddressSpaceDispatch *d, MemoryRegion *root)
  */
 static int ram_block_discard_disabled;
 
+/* Discards running outside of the BQL, see ram_block_discard_try_begin() */
+static int ram_block_discard_inflight;
+/* Set when ram_block_discard_inflight drops to zero */
+static QemuEvent ram_block_discard_idle;
+
+static void __attribute__((constructor)) ram_block_discard_init(void)
+{
+    qemu_event_init(&ram_block_discard_idle, false);
+}
+
 int ram_block_discard_disable(bool state)
 {
     int old;
@@ -3699,9 +3782,45 @@ int ram_block_discard_disable(bool state)
         }
     } while (qatomic_cmpxchg(&ram_block_discard_disabled,
                              old, old + 1) != old);
+
+    /* Pairs with smp_mb() in ram_block_discard_try_begin() */
+    smp_mb();
+
+    /* Discards that started before are short, wait for them to finish. */
+    while (qatomic_read(&ram_block_discard_inflight)) {
+        qemu_event_reset(&ram_block_discard_idle);
+        /* Order the reset before re-reading the in-flight counter */
+        smp_mb();
+        if (!qatomic_read(&ram_block_discard_inflight)) {
+            break;
+        }
+        qemu_event_wait(&ram_block_discard_idle);
+    }
     return 0;
 }
 
+bool ram_block_discard_try_begin(void)
+{
+    qatomic_inc(&ram_block_discard_inflight);
+    /*
+     * Order the increment before reading the disabled counter; pairs with
+     * smp_mb() in ram_block_discard_disable().
+     */
+    smp_mb();
+    if (ram_block_discard_is_disabled()) {
+        ram_block_discard_end();
+        return false;
+    }
+    return true;
+}
+
+void ram_block_discard_end(void)
+{
+    if (qatomic_fetch_dec(&ram_block_discard_inflight) == 1) {
+        qemu_event_set(&ram_block_discard_idle);
+    }
+}
+
 int ram_block_discard_require(bool state)
 {
     int old;
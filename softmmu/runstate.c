@@ -56,6 +56,7 @@
 #include "sysemu/reset.h"
 #include "sysemu/runstate.h"
 #include "sysemu/runstate-action.h"
+#include "sysemu/kvm.h"
 #include "sysemu/sysemu.h"
 #include "sysemu/tpm.h"
 #include "trace.h"
@@ -722,7 +723,9 @@ void qemu_main_loop(void)
 #ifdef CONFIG_PROFILER
         ti = profile_getclock();
 #endif
+        kvm_irqchip_batch_begin();
         main_loop_wait(false);
+        kvm_irqchip_batch_end();
 #ifdef CONFIG_PROFILER
         dev_time += profile_getclock() - ti;
 #endif
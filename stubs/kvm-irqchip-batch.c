@@ -0,0 +1,10 @@
+#include "qemu/osdep.h"
+#include "sysemu/kvm.h"
+
+void kvm_irqchip_batch_begin(void)
+{
+}
+
+void kvm_irqchip_batch_end(void)
+{
+}
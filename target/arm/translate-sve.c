@@ -114,6 +114,28 @@ static inline int pred_full_reg_offset(DisasContext *s, int regno)
     return offsetof(CPUARMState, vfp.pregs[regno]);
 }
 
+/*
+ * Predicates set to all true by PTRUE are remembered until the end of
+ * the TB, so that the predicated operations they govern can be expanded
+ * like the unpredicated ones.  Every write to a predicate register gets
+ * its offset from here, which forgets what was known about it.
+ */
+static int pred_dest_reg_offset(DisasContext *s, int regno)
+{
+    int esz;
+
+    for (esz = 0; esz < ARRAY_SIZE(s->sve_pred_true); esz++) {
+        s->sve_pred_true[esz] &= ~(1u << regno);
+    }
+    return pred_full_reg_offset(s, regno);
+}
+
+/* Return true if all elements of size @esz are active in Preg @pg.  */
+static bool pred_known_true(DisasContext *s, int pg, int esz)
+{
+    return s->sve_pred_true[esz] & (1u << pg);
+}
+
 /* Return the byte size of the whole predicate register, VL / 64.  */
 static inline int pred_full_reg_size(DisasContext *s)
 {
@@ -226,7 +248,7 @@ static void gen_gvec_fn_ppp(DisasContext *s, GVecGen3Fn *gvec_fn,
                             int rd, int rn, int rm)
 {
     unsigned psz = pred_gvec_reg_size(s);
-    gvec_fn(MO_64, pred_full_reg_offset(s, rd),
+    gvec_fn(MO_64, pred_dest_reg_offset(s, rd),
             pred_full_reg_offset(s, rn),
             pred_full_reg_offset(s, rm), psz, psz);
 }
@@ -236,7 +258,7 @@ static bool do_mov_p(DisasContext *s, int rd, int rn)
 {
     if (sve_access_check(s)) {
         unsigned psz = pred_gvec_reg_size(s);
-        tcg_gen_gvec_mov(MO_8, pred_full_reg_offset(s, rd),
+        tcg_gen_gvec_mov(MO_8, pred_dest_reg_offset(s, rd),
                          pred_full_reg_offset(s, rn), psz, psz);
     }
     return true;
@@ -366,6 +388,22 @@ static bool do_zpzz_ool(DisasContext *s, arg_rprr_esz *a, gen_helper_gvec_4 *fn)
     return true;
 }
 
+/*
+ * With all elements active, the merging predicated operation is the
+ * unpredicated one, which expands inline instead of in a helper.
+ */
+static bool do_zpzz_fn(DisasContext *s, arg_rprr_esz *a,
+                       gen_helper_gvec_4 *fn, GVecGen3Fn *gvec_fn)
+{
+    if (!pred_known_true(s, a->pg, a->esz)) {
+        return do_zpzz_ool(s, a, fn);
+    }
+    if (sve_access_check(s)) {
+        gen_gvec_fn_zzz(s, gvec_fn, a->esz, a->rd, a->rn, a->rm);
+    }
+    return true;
+}
+
 /* Select active elememnts from Zn and inactive elements from Zm,
  * storing the result in Zd.
  */
@@ -388,22 +426,32 @@ static bool trans_##NAME##_zpzz(DisasContext *s, arg_rprr_esz *a)         \
     return do_zpzz_ool(s, a, fns[a->esz]);                                \
 }
 
-DO_ZPZZ(AND, and)
-DO_ZPZZ(EOR, eor)
-DO_ZPZZ(ORR, orr)
-DO_ZPZZ(BIC, bic)
+#define DO_ZPZZ_FN(NAME, name, gvec_fn) \
+static bool trans_##NAME##_zpzz(DisasContext *s, arg_rprr_esz *a)         \
+{                                                                         \
+    static gen_helper_gvec_4 * const fns[4] = {                           \
+        gen_helper_sve_##name##_zpzz_b, gen_helper_sve_##name##_zpzz_h,   \
+        gen_helper_sve_##name##_zpzz_s, gen_helper_sve_##name##_zpzz_d,   \
+    };                                                                    \
+    return do_zpzz_fn(s, a, fns[a->esz], gvec_fn);                        \
+}
 
-DO_ZPZZ(ADD, add)
-DO_ZPZZ(SUB, sub)
+DO_ZPZZ_FN(AND, and, tcg_gen_gvec_and)
+DO_ZPZZ_FN(EOR, eor, tcg_gen_gvec_xor)
+DO_ZPZZ_FN(ORR, orr, tcg_gen_gvec_or)
+DO_ZPZZ_FN(BIC, bic, tcg_gen_gvec_andc)
 
-DO_ZPZZ(SMAX, smax)
-DO_ZPZZ(UMAX, umax)
-DO_ZPZZ(SMIN, smin)
-DO_ZPZZ(UMIN, umin)
+DO_ZPZZ_FN(ADD, add, tcg_gen_gvec_add)
+DO_ZPZZ_FN(SUB, sub, tcg_gen_gvec_sub)
+
+DO_ZPZZ_FN(SMAX, smax, tcg_gen_gvec_smax)
+DO_ZPZZ_FN(UMAX, umax, tcg_gen_gvec_umax)
+DO_ZPZZ_FN(SMIN, smin, tcg_gen_gvec_smin)
+DO_ZPZZ_FN(UMIN, umin, tcg_gen_gvec_umin)
 DO_ZPZZ(SABD, sabd)
 DO_ZPZZ(UABD, uabd)
 
-DO_ZPZZ(MUL, mul)
+DO_ZPZZ_FN(MUL, mul, tcg_gen_gvec_mul)
 DO_ZPZZ(SMULH, smulh)
 DO_ZPZZ(UMULH, umulh)
 
@@ -436,6 +484,7 @@ static bool trans_SEL_zpzz(DisasContext *s, arg_rprr_esz *a)
 }
 
 #undef DO_ZPZZ
+#undef DO_ZPZZ_FN
 
 /*
  *** SVE Integer Arithmetic - Unary Predicated Group
@@ -452,6 +501,19 @@ static bool do_zpz_ool(DisasContext *s, arg_rpr_esz *a, gen_helper_gvec_3 *fn)
     return true;
 }
 
+/* As do_zpzz_fn, for unary operations.  */
+static bool do_zpz_fn(DisasContext *s, arg_rpr_esz *a,
+                      gen_helper_gvec_3 *fn, GVecGen2Fn *gvec_fn)
+{
+    if (!pred_known_true(s, a->pg, a->esz)) {
+        return do_zpz_ool(s, a, fn);
+    }
+    if (sve_access_check(s)) {
+        gen_gvec_fn_zz(s, gvec_fn, a->esz, a->rd, a->rn);
+    }
+    return true;
+}
+
 #define DO_ZPZ(NAME, name) \
 static bool trans_##NAME(DisasContext *s, arg_rpr_esz *a)           \
 {                                                                   \
@@ -462,13 +524,23 @@ static bool trans_##NAME(DisasContext *s, arg_rpr_esz *a)           \
     return do_zpz_ool(s, a, fns[a->esz]);                           \
 }
 
+#define DO_ZPZ_FN(NAME, name, gvec_fn) \
+static bool trans_##NAME(DisasContext *s, arg_rpr_esz *a)           \
+{                                                                   \
+    static gen_helper_gvec_3 * const fns[4] = {                     \
+        gen_helper_sve_##name##_b, gen_helper_sve_##name##_h,       \
+        gen_helper_sve_##name##_s, gen_helper_sve_##name##_d,       \
+    };                                                              \
+    return do_zpz_fn(s, a, fns[a->esz], gvec_fn);                   \
+}
+
 DO_ZPZ(CLS, cls)
 DO_ZPZ(CLZ, clz)
 DO_ZPZ(CNT_zpz, cnt_zpz)
 DO_ZPZ(CNOT, cnot)
-DO_ZPZ(NOT_zpz, not_zpz)
-DO_ZPZ(ABS, abs)
-DO_ZPZ(NEG, neg)
+DO_ZPZ_FN(NOT_zpz, not_zpz, tcg_gen_gvec_not)
+DO_ZPZ_FN(ABS, abs, tcg_gen_gvec_abs)
+DO_ZPZ_FN(NEG, neg, tcg_gen_gvec_neg)
 
 static bool trans_FABS(DisasContext *s, arg_rpr_esz *a)
 {
@@ -545,6 +617,7 @@ static bool trans_UXTW(DisasContext *s, arg_rpr_esz *a)
 }
 
 #undef DO_ZPZ
+#undef DO_ZPZ_FN
 
 /*
  *** SVE Integer Reduction Group
@@ -1039,7 +1112,7 @@ static bool do_pppp_flags(DisasContext *s, arg_rprr_s *a,
     }
 
     unsigned psz = pred_gvec_reg_size(s);
-    int dofs = pred_full_reg_offset(s, a->rd);
+    int dofs = pred_dest_reg_offset(s, a->rd);
     int nofs = pred_full_reg_offset(s, a->rn);
     int mofs = pred_full_reg_offset(s, a->rm);
     int gofs = pred_full_reg_offset(s, a->pg);
@@ -1190,7 +1263,7 @@ static bool trans_SEL_pppp(DisasContext *s, arg_rprr_s *a)
     }
     if (sve_access_check(s)) {
         unsigned psz = pred_gvec_reg_size(s);
-        tcg_gen_gvec_bitsel(MO_8, pred_full_reg_offset(s, a->rd),
+        tcg_gen_gvec_bitsel(MO_8, pred_dest_reg_offset(s, a->rd),
                             pred_full_reg_offset(s, a->pg),
                             pred_full_reg_offset(s, a->rn),
                             pred_full_reg_offset(s, a->rm), psz, psz);
@@ -1376,13 +1449,20 @@ static bool do_predset(DisasContext *s, int esz, int rd, int pat, bool setflag)
     }
 
     unsigned fullsz = vec_full_reg_size(s);
-    unsigned ofs = pred_full_reg_offset(s, rd);
+    unsigned ofs = pred_dest_reg_offset(s, rd);
     unsigned numelem, setsz, i;
     uint64_t word, lastword;
     TCGv_i64 t;
 
     numelem = decode_pred_count(fullsz, pat, esz);
 
+    /* All elements of size esz and larger are active */
+    if (rd != FFR_PRED_NUM && numelem << esz == fullsz) {
+        for (i = esz; i < ARRAY_SIZE(s->sve_pred_true); i++) {
+            s->sve_pred_true[i] |= 1u << rd;
+        }
+    }
+
     /* Determine what we must store into each bit, and how many.  */
     if (numelem == 0) {
         lastword = word = 0;
@@ -1499,7 +1579,7 @@ static bool do_pfirst_pnext(DisasContext *s, arg_rr_esz *a,
     desc = FIELD_DP32(desc, PREDDESC, OPRSZ, pred_full_reg_size(s));
     desc = FIELD_DP32(desc, PREDDESC, ESZ, a->esz);
 
-    tcg_gen_addi_ptr(t_pd, cpu_env, pred_full_reg_offset(s, a->rd));
+    tcg_gen_addi_ptr(t_pd, cpu_env, pred_dest_reg_offset(s, a->rd));
     tcg_gen_addi_ptr(t_pg, cpu_env, pred_full_reg_offset(s, a->rn));
     t = tcg_const_i32(desc);
 
@@ -2120,7 +2200,7 @@ static bool do_perm_pred3(DisasContext *s, arg_rrr_esz *a, bool high_odd,
     desc = FIELD_DP32(desc, PREDDESC, ESZ, a->esz);
     desc = FIELD_DP32(desc, PREDDESC, DATA, high_odd);
 
-    tcg_gen_addi_ptr(t_d, cpu_env, pred_full_reg_offset(s, a->rd));
+    tcg_gen_addi_ptr(t_d, cpu_env, pred_dest_reg_offset(s, a->rd));
     tcg_gen_addi_ptr(t_n, cpu_env, pred_full_reg_offset(s, a->rn));
     tcg_gen_addi_ptr(t_m, cpu_env, pred_full_reg_offset(s, a->rm));
     t_desc = tcg_const_i32(desc);
@@ -2147,7 +2227,7 @@ static bool do_perm_pred2(DisasContext *s, arg_rr_esz *a, bool high_odd,
     TCGv_i32 t_desc;
     uint32_t desc = 0;
 
-    tcg_gen_addi_ptr(t_d, cpu_env, pred_full_reg_offset(s, a->rd));
+    tcg_gen_addi_ptr(t_d, cpu_env, pred_dest_reg_offset(s, a->rd));
     tcg_gen_addi_ptr(t_n, cpu_env, pred_full_reg_offset(s, a->rn));
 
     desc = FIELD_DP32(desc, PREDDESC, OPRSZ, vsz);
@@ -2710,7 +2790,7 @@ static bool do_ppzz_flags(DisasContext *s, arg_rprr_esz *a,
     zm = tcg_temp_new_ptr();
     pg = tcg_temp_new_ptr();
 
-    tcg_gen_addi_ptr(pd, cpu_env, pred_full_reg_offset(s, a->rd));
+    tcg_gen_addi_ptr(pd, cpu_env, pred_dest_reg_offset(s, a->rd));
     tcg_gen_addi_ptr(zn, cpu_env, vec_full_reg_offset(s, a->rn));
     tcg_gen_addi_ptr(zm, cpu_env, vec_full_reg_offset(s, a->rm));
     tcg_gen_addi_ptr(pg, cpu_env, pred_full_reg_offset(s, a->pg));
@@ -2794,7 +2874,7 @@ static bool do_ppzi_flags(DisasContext *s, arg_rpri_esz *a,
     zn = tcg_temp_new_ptr();
     pg = tcg_temp_new_ptr();
 
-    tcg_gen_addi_ptr(pd, cpu_env, pred_full_reg_offset(s, a->rd));
+    tcg_gen_addi_ptr(pd, cpu_env, pred_dest_reg_offset(s, a->rd));
     tcg_gen_addi_ptr(zn, cpu_env, vec_full_reg_offset(s, a->rn));
     tcg_gen_addi_ptr(pg, cpu_env, pred_full_reg_offset(s, a->pg));
 
@@ -2853,7 +2933,7 @@ static bool do_brk3(DisasContext *s, arg_rprr_s *a,
     TCGv_ptr g = tcg_temp_new_ptr();
     TCGv_i32 t = tcg_const_i32(vsz - 2);
 
-    tcg_gen_addi_ptr(d, cpu_env, pred_full_reg_offset(s, a->rd));
+    tcg_gen_addi_ptr(d, cpu_env, pred_dest_reg_offset(s, a->rd));
     tcg_gen_addi_ptr(n, cpu_env, pred_full_reg_offset(s, a->rn));
     tcg_gen_addi_ptr(m, cpu_env, pred_full_reg_offset(s, a->rm));
     tcg_gen_addi_ptr(g, cpu_env, pred_full_reg_offset(s, a->pg));
@@ -2887,7 +2967,7 @@ static bool do_brk2(DisasContext *s, arg_rpr_s *a,
     TCGv_ptr g = tcg_temp_new_ptr();
     TCGv_i32 t = tcg_const_i32(vsz - 2);
 
-    tcg_gen_addi_ptr(d, cpu_env, pred_full_reg_offset(s, a->rd));
+    tcg_gen_addi_ptr(d, cpu_env, pred_dest_reg_offset(s, a->rd));
     tcg_gen_addi_ptr(n, cpu_env, pred_full_reg_offset(s, a->rn));
     tcg_gen_addi_ptr(g, cpu_env, pred_full_reg_offset(s, a->pg));
 
@@ -3167,7 +3247,7 @@ static bool trans_WHILE(DisasContext *s, arg_WHILE *a)
     t3 = tcg_const_i32(desc);
 
     ptr = tcg_temp_new_ptr();
-    tcg_gen_addi_ptr(ptr, cpu_env, pred_full_reg_offset(s, a->rd));
+    tcg_gen_addi_ptr(ptr, cpu_env, pred_dest_reg_offset(s, a->rd));
 
     gen_helper_sve_while(t2, ptr, t2, t3);
     do_pred_flags(t2);
@@ -3542,7 +3622,7 @@ static void do_ppz_fp(DisasContext *s, arg_rpr_esz *a,
     unsigned vsz = vec_full_reg_size(s);
     TCGv_ptr status = fpstatus_ptr(a->esz == MO_16 ? FPST_FPCR_F16 : FPST_FPCR);
 
-    tcg_gen_gvec_3_ptr(pred_full_reg_offset(s, a->rd),
+    tcg_gen_gvec_3_ptr(pred_dest_reg_offset(s, a->rd),
                        vec_full_reg_offset(s, a->rn),
                        pred_full_reg_offset(s, a->pg),
                        status, vsz, vsz, 0, fn);
@@ -3814,7 +3894,7 @@ static bool do_fp_cmp(DisasContext *s, arg_rprr_esz *a,
     if (sve_access_check(s)) {
         unsigned vsz = vec_full_reg_size(s);
         TCGv_ptr status = fpstatus_ptr(a->esz == MO_16 ? FPST_FPCR_F16 : FPST_FPCR);
-        tcg_gen_gvec_4_ptr(pred_full_reg_offset(s, a->rd),
+        tcg_gen_gvec_4_ptr(pred_dest_reg_offset(s, a->rd),
                            vec_full_reg_offset(s, a->rn),
                            vec_full_reg_offset(s, a->rm),
                            pred_full_reg_offset(s, a->pg),
@@ -4440,7 +4520,7 @@ static bool trans_LDR_pri(DisasContext *s, arg_rri *a)
 {
     if (sve_access_check(s)) {
         int size = pred_full_reg_size(s);
-        int off = pred_full_reg_offset(s, a->rd);
+        int off = pred_dest_reg_offset(s, a->rd);
         do_ldr(s, off, size, a->rn, a->imm * size);
     }
     return true;
@@ -316,4 +316,63 @@
 #define fGEN_TCG_F2_dfmpyhh(SHORTCODE) \
     gen_helper_dfmpyhh(RxxV, cpu_env, RxxV, RssV, RttV)
 
+/* Common ALU operations, including their duplex forms */
+#define fGEN_TCG_A2_add(SHORTCODE) \
+    tcg_gen_add_tl(RdV, RsV, RtV)
+#define fGEN_TCG_A2_addi(SHORTCODE) \
+    tcg_gen_addi_tl(RdV, RsV, siV)
+#define fGEN_TCG_A2_sub(SHORTCODE) \
+    tcg_gen_sub_tl(RdV, RtV, RsV)
+#define fGEN_TCG_A2_subri(SHORTCODE) \
+    tcg_gen_subfi_tl(RdV, siV, RsV)
+#define fGEN_TCG_A2_and(SHORTCODE) \
+    tcg_gen_and_tl(RdV, RsV, RtV)
+#define fGEN_TCG_A2_andir(SHORTCODE) \
+    tcg_gen_andi_tl(RdV, RsV, siV)
+#define fGEN_TCG_A2_or(SHORTCODE) \
+    tcg_gen_or_tl(RdV, RsV, RtV)
+#define fGEN_TCG_A2_orir(SHORTCODE) \
+    tcg_gen_ori_tl(RdV, RsV, siV)
+#define fGEN_TCG_A2_xor(SHORTCODE) \
+    tcg_gen_xor_tl(RdV, RsV, RtV)
+#define fGEN_TCG_A2_tfr(SHORTCODE) \
+    tcg_gen_mov_tl(RdV, RsV)
+#define fGEN_TCG_A2_tfrsi(SHORTCODE) \
+    tcg_gen_movi_tl(RdV, siV)
+#define fGEN_TCG_A2_sxtb(SHORTCODE) \
+    tcg_gen_ext8s_tl(RdV, RsV)
+#define fGEN_TCG_A2_sxth(SHORTCODE) \
+    tcg_gen_ext16s_tl(RdV, RsV)
+#define fGEN_TCG_A2_zxth(SHORTCODE) \
+    tcg_gen_ext16u_tl(RdV, RsV)
+#define fGEN_TCG_A2_combinew(SHORTCODE) \
+    tcg_gen_concat_i32_i64(RddV, RtV, RsV)
+#define fGEN_TCG_A2_combineii(SHORTCODE) \
+    tcg_gen_movi_i64(RddV, deposit64((uint32_t)SiV, 32, 32, siV))
+
+#define fGEN_TCG_SA1_addi(SHORTCODE) \
+    tcg_gen_addi_tl(RxV, RxV, siV)
+#define fGEN_TCG_SA1_addrx(SHORTCODE) \
+    tcg_gen_add_tl(RxV, RxV, RsV)
+#define fGEN_TCG_SA1_tfr(SHORTCODE) \
+    tcg_gen_mov_tl(RdV, RsV)
+#define fGEN_TCG_SA1_seti(SHORTCODE) \
+    tcg_gen_movi_tl(RdV, uiV)
+#define fGEN_TCG_SA1_setin1(SHORTCODE) \
+    tcg_gen_movi_tl(RdV, -1)
+#define fGEN_TCG_SA1_inc(SHORTCODE) \
+    tcg_gen_addi_tl(RdV, RsV, 1)
+#define fGEN_TCG_SA1_dec(SHORTCODE) \
+    tcg_gen_subi_tl(RdV, RsV, 1)
+#define fGEN_TCG_SA1_zxtb(SHORTCODE) \
+    tcg_gen_ext8u_tl(RdV, RsV)
+#define fGEN_TCG_SA1_and1(SHORTCODE) \
+    tcg_gen_andi_tl(RdV, RsV, 1)
+#define fGEN_TCG_SA1_sxtb(SHORTCODE) \
+    tcg_gen_ext8s_tl(RdV, RsV)
+#define fGEN_TCG_SA1_zxth(SHORTCODE) \
+    tcg_gen_ext16u_tl(RdV, RsV)
+#define fGEN_TCG_SA1_sxth(SHORTCODE) \
+    tcg_gen_ext16s_tl(RdV, RsV)
+
 #endif
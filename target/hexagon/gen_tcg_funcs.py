@@ -290,10 +290,10 @@ def gen_helper_free_imm(f,immlett):
 
 def genptr_dst_write_pair(f, tag, regtype, regid):
     if ('A_CONDEXEC' in hex_common.attribdict[tag]):
-        f.write("    gen_log_predicated_reg_write_pair(%s%sN, %s%sV, insn->slot);\n" % \
+        f.write("    gen_log_predicated_reg_write_pair(ctx, %s%sN, %s%sV, insn->slot);\n" % \
             (regtype, regid, regtype, regid))
     else:
-        f.write("    gen_log_reg_write_pair(%s%sN, %s%sV);\n" % \
+        f.write("    gen_log_reg_write_pair(ctx, %s%sN, %s%sV);\n" % \
             (regtype, regid, regtype, regid))
     f.write("    ctx_log_reg_write_pair(ctx, %s%sN);\n" % \
         (regtype, regid))
@@ -304,11 +304,11 @@ def genptr_dst_write(f, tag, regtype, regid):
             genptr_dst_write_pair(f, tag, regtype, regid)
         elif (regid in {"d", "e", "x", "y"}):
             if ('A_CONDEXEC' in hex_common.attribdict[tag]):
-                f.write("    gen_log_predicated_reg_write(%s%sN, %s%sV,\n" % \
+                f.write("    gen_log_predicated_reg_write(ctx, %s%sN, %s%sV,\n" % \
                     (regtype, regid, regtype, regid))
                 f.write("                                 insn->slot);\n")
             else:
-                f.write("    gen_log_reg_write(%s%sN, %s%sV);\n" % \
+                f.write("    gen_log_reg_write(ctx, %s%sN, %s%sV);\n" % \
                     (regtype, regid, regtype, regid))
             f.write("    ctx_log_reg_write(ctx, %s%sN);\n" % \
                 (regtype, regid))
@@ -357,7 +357,7 @@ def genptr_dst_write_opn(f,regtype, regid, tag):
 ##           TCGv RsV = hex_gpr[insn->regno[1]];
 ##           TCGv RtV = hex_gpr[insn->regno[2]];
 ##           <GEN>
-##           gen_log_reg_write(RdN, RdV);
+##           gen_log_reg_write(ctx, RdN, RdV);
 ##           ctx_log_reg_write(ctx, RdN);
 ##           tcg_temp_free(RdV);
 ##       }
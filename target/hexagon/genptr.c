@@ -33,15 +33,17 @@ static inline TCGv gen_read_preg(TCGv pred, uint8_t num)
     return pred;
 }
 
-static inline void gen_log_predicated_reg_write(int rnum, TCGv val, int slot)
+static inline void gen_log_predicated_reg_write(DisasContext *ctx, int rnum,
+                                                TCGv val, int slot)
 {
+    TCGv result = get_result_gpr(ctx, rnum);
     TCGv one = tcg_const_tl(1);
     TCGv zero = tcg_const_tl(0);
     TCGv slot_mask = tcg_temp_new();
 
     tcg_gen_andi_tl(slot_mask, hex_slot_cancelled, 1 << slot);
-    tcg_gen_movcond_tl(TCG_COND_EQ, hex_new_value[rnum], slot_mask, zero,
-                           val, hex_new_value[rnum]);
+    tcg_gen_movcond_tl(TCG_COND_EQ, result, slot_mask, zero,
+                       val, result);
 #if HEX_DEBUG
     /* Do this so HELPER(debug_commit_end) will know */
     tcg_gen_movcond_tl(TCG_COND_EQ, hex_reg_written[rnum], slot_mask, zero,
@@ -53,17 +55,20 @@ static inline void gen_log_predicated_reg_write(int rnum, TCGv val, int slot)
     tcg_temp_free(slot_mask);
 }
 
-static inline void gen_log_reg_write(int rnum, TCGv val)
+static inline void gen_log_reg_write(DisasContext *ctx, int rnum, TCGv val)
 {
-    tcg_gen_mov_tl(hex_new_value[rnum], val);
+    tcg_gen_mov_tl(get_result_gpr(ctx, rnum), val);
 #if HEX_DEBUG
     /* Do this so HELPER(debug_commit_end) will know */
     tcg_gen_movi_tl(hex_reg_written[rnum], 1);
 #endif
 }
 
-static void gen_log_predicated_reg_write_pair(int rnum, TCGv_i64 val, int slot)
+static void gen_log_predicated_reg_write_pair(DisasContext *ctx, int rnum,
+                                              TCGv_i64 val, int slot)
 {
+    TCGv result_lo = get_result_gpr(ctx, rnum);
+    TCGv result_hi = get_result_gpr(ctx, rnum + 1);
     TCGv val32 = tcg_temp_new();
     TCGv one = tcg_const_tl(1);
     TCGv zero = tcg_const_tl(0);
@@ -72,8 +77,8 @@ static void gen_log_predicated_reg_write_pair(int rnum, TCGv_i64 val, int slot)
     tcg_gen_andi_tl(slot_mask, hex_slot_cancelled, 1 << slot);
     /* Low word */
     tcg_gen_extrl_i64_i32(val32, val);
-    tcg_gen_movcond_tl(TCG_COND_EQ, hex_new_value[rnum], slot_mask, zero,
-                       val32, hex_new_value[rnum]);
+    tcg_gen_movcond_tl(TCG_COND_EQ, result_lo, slot_mask, zero,
+                       val32, result_lo);
 #if HEX_DEBUG
     /* Do this so HELPER(debug_commit_end) will know */
     tcg_gen_movcond_tl(TCG_COND_EQ, hex_reg_written[rnum],
@@ -83,9 +88,8 @@ static void gen_log_predicated_reg_write_pair(int rnum, TCGv_i64 val, int slot)
 
     /* High word */
     tcg_gen_extrh_i64_i32(val32, val);
-    tcg_gen_movcond_tl(TCG_COND_EQ, hex_new_value[rnum + 1],
-                       slot_mask, zero,
-                       val32, hex_new_value[rnum + 1]);
+    tcg_gen_movcond_tl(TCG_COND_EQ, result_hi, slot_mask, zero,
+                       val32, result_hi);
 #if HEX_DEBUG
     /* Do this so HELPER(debug_commit_end) will know */
     tcg_gen_movcond_tl(TCG_COND_EQ, hex_reg_written[rnum + 1],
@@ -99,17 +103,17 @@ static void gen_log_predicated_reg_write_pair(int rnum, TCGv_i64 val, int slot)
     tcg_temp_free(slot_mask);
 }
 
-static void gen_log_reg_write_pair(int rnum, TCGv_i64 val)
+static void gen_log_reg_write_pair(DisasContext *ctx, int rnum, TCGv_i64 val)
 {
     /* Low word */
-    tcg_gen_extrl_i64_i32(hex_new_value[rnum], val);
+    tcg_gen_extrl_i64_i32(get_result_gpr(ctx, rnum), val);
 #if HEX_DEBUG
     /* Do this so HELPER(debug_commit_end) will know */
     tcg_gen_movi_tl(hex_reg_written[rnum], 1);
 #endif
 
     /* High word */
-    tcg_gen_extrh_i64_i32(hex_new_value[rnum + 1], val);
+    tcg_gen_extrh_i64_i32(get_result_gpr(ctx, rnum + 1), val);
 #if HEX_DEBUG
     /* Do this so HELPER(debug_commit_end) will know */
     tcg_gen_movi_tl(hex_reg_written[rnum + 1], 1);
@@ -222,7 +226,7 @@ static inline void gen_write_ctrl_reg(DisasContext *ctx, int reg_num,
     if (reg_num == HEX_REG_P3_0) {
         gen_write_p3_0(val);
     } else {
-        gen_log_reg_write(reg_num, val);
+        gen_log_reg_write(ctx, reg_num, val);
         ctx_log_reg_write(ctx, reg_num);
         if (reg_num == HEX_REG_QEMU_PKT_CNT) {
             ctx->num_packets = 0;
@@ -241,11 +245,11 @@ static inline void gen_write_ctrl_reg_pair(DisasContext *ctx, int reg_num,
         tcg_gen_extrl_i64_i32(val32, val);
         gen_write_p3_0(val32);
         tcg_gen_extrh_i64_i32(val32, val);
-        gen_log_reg_write(reg_num + 1, val32);
+        gen_log_reg_write(ctx, reg_num + 1, val32);
         tcg_temp_free(val32);
         ctx_log_reg_write(ctx, reg_num + 1);
     } else {
-        gen_log_reg_write_pair(reg_num, val);
+        gen_log_reg_write_pair(ctx, reg_num, val);
         ctx_log_reg_write_pair(ctx, reg_num);
         if (reg_num == HEX_REG_QEMU_PKT_CNT) {
             ctx->num_packets = 0;
@@ -139,6 +139,76 @@ static bool need_pred_written(Packet *pkt)
     return check_for_attrib(pkt, A_WRITES_PRED_REG);
 }
 
+/*
+ * Mark in @regs the general registers of the operands of @insn listed
+ * in @opregs, which is either opcode_rregs or opcode_wregs.  The entries
+ * there are the operand type and letter followed by the register width,
+ * and the position of the letter in opcode_reginfo is the index of the
+ * register number in insn->regno.
+ */
+static void analyze_insn_regs(Insn *insn, const char *opregs,
+                              unsigned long *regs)
+{
+    const char *reginfo = opcode_reginfo[insn->opcode];
+    const char *p;
+
+    for (p = opregs; p; p = strchr(p, ',')) {
+        if (*p == ',') {
+            p++;
+        }
+        /* New value operands read the register of their producer */
+        if (p[0] == 'R' || p[0] == 'N') {
+            const char *letter = strchr(reginfo, p[1]);
+            int rnum;
+
+            g_assert(letter);
+            rnum = insn->regno[letter - reginfo];
+            set_bit(rnum, regs);
+            if (p[2] == p[1]) {
+                set_bit(rnum + 1, regs);
+            }
+        }
+    }
+}
+
+/*
+ * The results of a packet are logged in hex_new_value and committed at
+ * the end of the packet, so that every instruction sees the registers
+ * as they were before the packet.  A register that the packet writes but
+ * never reads can't show the difference, and is written in place.
+ *
+ * Only R0-R28 qualify, as helpers access SP, FP, LR and the control
+ * registers through env.  Packets that trap are left alone because the
+ * exception is taken before the packet commits.
+ */
+static void analyze_packet(DisasContext *ctx, Packet *pkt)
+{
+    DECLARE_BITMAP(regs_read, TOTAL_PER_THREAD_REGS);
+
+    bitmap_zero(ctx->direct_writes, TOTAL_PER_THREAD_REGS);
+    if (HEX_DEBUG) {
+        /* HELPER(debug_commit_end) wants to see every write in the log */
+        return;
+    }
+
+    bitmap_zero(regs_read, TOTAL_PER_THREAD_REGS);
+    for (int i = 0; i < pkt->num_insns; i++) {
+        Insn *insn = &pkt->insn[i];
+
+        if (insn->opcode == J2_trap0 || insn->opcode == J2_pause) {
+            bitmap_zero(ctx->direct_writes, TOTAL_PER_THREAD_REGS);
+            return;
+        }
+        analyze_insn_regs(insn, opcode_rregs[insn->opcode], regs_read);
+        analyze_insn_regs(insn, opcode_wregs[insn->opcode],
+                          ctx->direct_writes);
+    }
+    bitmap_andnot(ctx->direct_writes, ctx->direct_writes, regs_read,
+                  TOTAL_PER_THREAD_REGS);
+    bitmap_clear(ctx->direct_writes, HEX_REG_SP,
+                 TOTAL_PER_THREAD_REGS - HEX_REG_SP);
+}
+
 static void gen_start_packet(DisasContext *ctx, Packet *pkt)
 {
     target_ulong next_PC = ctx->base.pc_next + pkt->encod_pkt_size_in_bytes;
@@ -147,6 +217,7 @@ static void gen_start_packet(DisasContext *ctx, Packet *pkt)
     /* Clear out the disassembly context */
     ctx->reg_log_idx = 0;
     bitmap_zero(ctx->regs_written, TOTAL_PER_THREAD_REGS);
+    analyze_packet(ctx, pkt);
     ctx->preg_log_idx = 0;
     for (i = 0; i < STORES_MAX; i++) {
         ctx->store_width[i] = 0;
@@ -240,7 +311,9 @@ static void gen_reg_writes(DisasContext *ctx)
     for (i = 0; i < ctx->reg_log_idx; i++) {
         int reg_num = ctx->reg_log[i];
 
-        tcg_gen_mov_tl(hex_gpr[reg_num], hex_new_value[reg_num]);
+        if (!is_direct_write(ctx, reg_num)) {
+            tcg_gen_mov_tl(hex_gpr[reg_num], hex_new_value[reg_num]);
+        }
     }
 }
 
@@ -32,6 +32,7 @@ typedef struct DisasContext {
     int reg_log[REG_WRITES_MAX];
     int reg_log_idx;
     DECLARE_BITMAP(regs_written, TOTAL_PER_THREAD_REGS);
+    DECLARE_BITMAP(direct_writes, TOTAL_PER_THREAD_REGS);
     int preg_log[PRED_WRITES_MAX];
     int preg_log_idx;
     uint8_t store_width[STORES_MAX];
@@ -62,9 +63,19 @@ static inline void ctx_log_pred_write(DisasContext *ctx, int pnum)
     ctx->preg_log_idx++;
 }
 
+/*
+ * Registers of the current packet written in place rather than through
+ * hex_new_value, see analyze_packet()
+ */
+static inline bool is_direct_write(DisasContext *ctx, int rnum)
+{
+    return test_bit(rnum, ctx->direct_writes);
+}
+
 static inline bool is_preloaded(DisasContext *ctx, int num)
 {
-    return test_bit(num, ctx->regs_written);
+    /* A register written in place already holds its old value */
+    return test_bit(num, ctx->regs_written) || is_direct_write(ctx, num);
 }
 
 extern TCGv hex_gpr[TOTAL_PER_THREAD_REGS];
@@ -86,6 +97,11 @@ extern TCGv hex_llsc_addr;
 extern TCGv hex_llsc_val;
 extern TCGv_i64 hex_llsc_val_i64;
 
+static inline TCGv get_result_gpr(DisasContext *ctx, int rnum)
+{
+    return is_direct_write(ctx, rnum) ? hex_gpr[rnum] : hex_new_value[rnum];
+}
+
 void gen_exception(int excp);
 void gen_exception_debug(void);
 
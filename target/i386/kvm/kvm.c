@@ -124,12 +124,53 @@ static int has_xsave;
 static int has_xcrs;
 static int has_pit_state2;
 static int has_exception_payload;
+static int has_sync_regs;
 
 static bool has_msr_mcg_ext_ctl;
 
 static struct kvm_cpuid2 *cpuid_cache;
 static struct kvm_msr_list *kvm_feature_msrs;
 
+/*
+ * Register groups whose last value exchanged with KVM is kept, so that
+ * putting them again unchanged, as happens when cpu_synchronize_state() is
+ * only needed to read or modify a few registers, can skip the ioctl.  KVM
+ * only changes them in KVM_RUN, and in the ioctls that put the reset or
+ * full state, and those invalidate the copies.
+ */
+#define KVM_SHADOW_REGS         (1 << 0)
+#define KVM_SHADOW_XSAVE        (1 << 1)
+#define KVM_SHADOW_XCRS         (1 << 2)
+#define KVM_SHADOW_DEBUGREGS    (1 << 3)
+
+typedef struct X86KVMShadow {
+    unsigned valid;
+    struct kvm_regs regs;
+    struct kvm_xsave xsave;
+    struct kvm_xcrs xcrs;
+    struct kvm_debugregs debugregs;
+} X86KVMShadow;
+
+static bool kvm_shadow_equal(X86CPU *cpu, unsigned group, const void *shadow,
+                             const void *data, size_t size)
+{
+    return (cpu->env.kvm_shadow->valid & group) &&
+           memcmp(shadow, data, size) == 0;
+}
+
+/* Record the result of an ioctl that got or set @data */
+static int kvm_shadow_update(X86CPU *cpu, unsigned group, void *shadow,
+                             const void *data, size_t size, int ret)
+{
+    if (ret < 0) {
+        cpu->env.kvm_shadow->valid &= ~group;
+    } else {
+        memcpy(shadow, data, size);
+        cpu->env.kvm_shadow->valid |= group;
+    }
+    return ret;
+}
+
 int kvm_has_pit_state2(void)
 {
     return has_pit_state2;
@@ -1838,6 +1879,7 @@ int kvm_arch_init_vcpu(CPUState *cs)
         env->xsave_buf = qemu_memalign(4096, sizeof(struct kvm_xsave));
         memset(env->xsave_buf, 0, sizeof(struct kvm_xsave));
     }
+    env->kvm_shadow = g_new0(X86KVMShadow, 1);
 
     max_nested_state_len = kvm_max_nested_state_length();
     if (max_nested_state_len > 0) {
@@ -1896,6 +1938,9 @@ int kvm_arch_destroy_vcpu(CPUState *cs)
         env->nested_state = NULL;
     }
 
+    g_free(env->kvm_shadow);
+    env->kvm_shadow = NULL;
+
     qemu_del_vm_change_state_handler(cpu->vmsentry);
 
     return 0;
@@ -2174,6 +2219,9 @@ int kvm_arch_init(MachineState *ms, KVMState *s)
 
     hv_vpindex_settable = kvm_check_extension(s, KVM_CAP_HYPERV_VP_INDEX);
 
+    has_sync_regs = kvm_check_extension(s, KVM_CAP_SYNC_REGS) &
+                    KVM_SYNC_X86_REGS;
+
     has_exception_payload = kvm_check_extension(s, KVM_CAP_EXCEPTION_PAYLOAD);
     if (has_exception_payload) {
         ret = kvm_vm_enable_cap(s, KVM_CAP_EXCEPTION_PAYLOAD, 0, true);
@@ -2328,17 +2376,44 @@ static void kvm_getput_reg(__u64 *kvm_reg, target_ulong *qemu_reg, int set)
     }
 }
 
-static int kvm_getput_regs(X86CPU *cpu, int set)
+/*
+ * KVM_RUN loads registers passed through kvm_run->s.regs only after the
+ * other puts have been done, and loading them drops a pending exception and
+ * the TF that KVM_SET_GUEST_DEBUG may have forced.  Only defer them when
+ * nothing put afterwards depends on the register state.
+ */
+static bool kvm_can_defer_regs(X86CPU *cpu, int level)
 {
     CPUX86State *env = &cpu->env;
+
+    return has_sync_regs && level == KVM_PUT_RUNTIME_STATE &&
+           env->mp_state == KVM_MP_STATE_RUNNABLE &&
+           env->exception_nr < 0 && !env->exception_pending &&
+           !env->exception_injected && !CPU(cpu)->singlestep_enabled;
+}
+
+static int kvm_getput_regs(X86CPU *cpu, int set, bool defer)
+{
+    CPUX86State *env = &cpu->env;
+    X86KVMShadow *shadow = env->kvm_shadow;
+    struct kvm_run *run = CPU(cpu)->kvm_run;
     struct kvm_regs regs;
     int ret = 0;
 
     if (!set) {
-        ret = kvm_vcpu_ioctl(CPU(cpu), KVM_GET_REGS, &regs);
-        if (ret < 0) {
-            return ret;
+        if (run->kvm_dirty_regs & KVM_SYNC_X86_REGS) {
+            /* Not loaded by KVM yet */
+            regs = run->s.regs.regs;
+        } else {
+            ret = kvm_vcpu_ioctl(CPU(cpu), KVM_GET_REGS, &regs);
+            kvm_shadow_update(cpu, KVM_SHADOW_REGS, &shadow->regs, &regs,
+                              sizeof(regs), ret);
+            if (ret < 0) {
+                return ret;
+            }
         }
+    } else {
+        memset(&regs, 0, sizeof(regs));
     }
 
     kvm_getput_reg(&regs.rax, &env->regs[R_EAX], set);
@@ -2364,7 +2439,26 @@ static int kvm_getput_regs(X86CPU *cpu, int set)
     kvm_getput_reg(&regs.rip, &env->eip, set);
 
     if (set) {
-        ret = kvm_vcpu_ioctl(CPU(cpu), KVM_SET_REGS, &regs);
+        /* A deferred copy still waiting for KVM_RUN must be flushed now */
+        if ((defer || !(run->kvm_dirty_regs & KVM_SYNC_X86_REGS)) &&
+            kvm_shadow_equal(cpu, KVM_SHADOW_REGS, &shadow->regs, &regs,
+                             sizeof(regs))) {
+            return 0;
+        }
+        /*
+         * Let KVM_RUN load them if allowed.  An unstarted vCPU is never
+         * deferred: KVM_RUN then waits for INIT/SIPI before looking at the
+         * dirty registers and would overwrite the start address.
+         */
+        if (defer) {
+            run->s.regs.regs = regs;
+            run->kvm_dirty_regs |= KVM_SYNC_X86_REGS;
+        } else {
+            run->kvm_dirty_regs &= ~KVM_SYNC_X86_REGS;
+            ret = kvm_vcpu_ioctl(CPU(cpu), KVM_SET_REGS, &regs);
+        }
+        kvm_shadow_update(cpu, KVM_SHADOW_REGS, &shadow->regs, &regs,
+                          sizeof(regs), ret);
     }
 
     return ret;
@@ -2438,20 +2532,29 @@ ASSERT_OFFSET(XSAVE_PKRU, pkru_state);
 static int kvm_put_xsave(X86CPU *cpu)
 {
     CPUX86State *env = &cpu->env;
+    X86KVMShadow *shadow = env->kvm_shadow;
     X86XSaveArea *xsave = env->xsave_buf;
+    int ret;
 
     if (!has_xsave) {
         return kvm_put_fpu(cpu);
     }
     x86_cpu_xsave_all_areas(cpu, xsave);
 
-    return kvm_vcpu_ioctl(CPU(cpu), KVM_SET_XSAVE, xsave);
+    if (kvm_shadow_equal(cpu, KVM_SHADOW_XSAVE, &shadow->xsave, xsave,
+                         sizeof(shadow->xsave))) {
+        return 0;
+    }
+    ret = kvm_vcpu_ioctl(CPU(cpu), KVM_SET_XSAVE, xsave);
+    return kvm_shadow_update(cpu, KVM_SHADOW_XSAVE, &shadow->xsave, xsave,
+                             sizeof(shadow->xsave), ret);
 }
 
 static int kvm_put_xcrs(X86CPU *cpu)
 {
     CPUX86State *env = &cpu->env;
     struct kvm_xcrs xcrs = {};
+    int ret;
 
     if (!has_xcrs) {
         return 0;
@@ -2461,7 +2564,14 @@ static int kvm_put_xcrs(X86CPU *cpu)
     xcrs.flags = 0;
     xcrs.xcrs[0].xcr = 0;
     xcrs.xcrs[0].value = env->xcr0;
-    return kvm_vcpu_ioctl(CPU(cpu), KVM_SET_XCRS, &xcrs);
+
+    if (kvm_shadow_equal(cpu, KVM_SHADOW_XCRS, &env->kvm_shadow->xcrs, &xcrs,
+                         sizeof(xcrs))) {
+        return 0;
+    }
+    ret = kvm_vcpu_ioctl(CPU(cpu), KVM_SET_XCRS, &xcrs);
+    return kvm_shadow_update(cpu, KVM_SHADOW_XCRS, &env->kvm_shadow->xcrs,
+                             &xcrs, sizeof(xcrs), ret);
 }
 
 static int kvm_put_sregs(X86CPU *cpu)
@@ -3092,6 +3202,8 @@ static int kvm_get_xsave(X86CPU *cpu)
     }
 
     ret = kvm_vcpu_ioctl(CPU(cpu), KVM_GET_XSAVE, xsave);
+    kvm_shadow_update(cpu, KVM_SHADOW_XSAVE, &env->kvm_shadow->xsave, xsave,
+                      sizeof(struct kvm_xsave), ret);
     if (ret < 0) {
         return ret;
     }
@@ -3111,6 +3223,8 @@ static int kvm_get_xcrs(X86CPU *cpu)
     }
 
     ret = kvm_vcpu_ioctl(CPU(cpu), KVM_GET_XCRS, &xcrs);
+    kvm_shadow_update(cpu, KVM_SHADOW_XCRS, &env->kvm_shadow->xcrs, &xcrs,
+                      sizeof(xcrs), ret);
     if (ret < 0) {
         return ret;
     }
@@ -3878,7 +3992,7 @@ static int kvm_put_debugregs(X86CPU *cpu)
 {
     CPUX86State *env = &cpu->env;
     struct kvm_debugregs dbgregs;
-    int i;
+    int i, ret;
 
     if (!kvm_has_debugregs()) {
         return 0;
@@ -3892,7 +4006,15 @@ static int kvm_put_debugregs(X86CPU *cpu)
     dbgregs.dr7 = env->dr[7];
     dbgregs.flags = 0;
 
-    return kvm_vcpu_ioctl(CPU(cpu), KVM_SET_DEBUGREGS, &dbgregs);
+    if (kvm_shadow_equal(cpu, KVM_SHADOW_DEBUGREGS,
+                         &env->kvm_shadow->debugregs, &dbgregs,
+                         sizeof(dbgregs))) {
+        return 0;
+    }
+    ret = kvm_vcpu_ioctl(CPU(cpu), KVM_SET_DEBUGREGS, &dbgregs);
+    return kvm_shadow_update(cpu, KVM_SHADOW_DEBUGREGS,
+                             &env->kvm_shadow->debugregs, &dbgregs,
+                             sizeof(dbgregs), ret);
 }
 
 static int kvm_get_debugregs(X86CPU *cpu)
@@ -3906,6 +4028,8 @@ static int kvm_get_debugregs(X86CPU *cpu)
     }
 
     ret = kvm_vcpu_ioctl(CPU(cpu), KVM_GET_DEBUGREGS, &dbgregs);
+    kvm_shadow_update(cpu, KVM_SHADOW_DEBUGREGS, &env->kvm_shadow->debugregs,
+                      &dbgregs, sizeof(dbgregs), ret);
     if (ret < 0) {
         return ret;
     }
@@ -3999,6 +4123,11 @@ int kvm_arch_put_registers(CPUState *cpu, int level)
 
     assert(cpu_is_stopped(cpu) || qemu_cpu_is_self(cpu));
 
+    /* The nested state and MP state can change everything else */
+    if (level >= KVM_PUT_RESET_STATE) {
+        x86_cpu->env.kvm_shadow->valid = 0;
+    }
+
     /* must be before kvm_put_nested_state so that EFER.SVME is set */
     ret = kvm_put_sregs(x86_cpu);
     if (ret < 0) {
@@ -4026,7 +4155,7 @@ int kvm_arch_put_registers(CPUState *cpu, int level)
         kvm_arch_set_tsc_khz(cpu);
     }
 
-    ret = kvm_getput_regs(x86_cpu, 1);
+    ret = kvm_getput_regs(x86_cpu, 1, kvm_can_defer_regs(x86_cpu, level));
     if (ret < 0) {
         return ret;
     }
@@ -4093,7 +4222,7 @@ int kvm_arch_get_registers(CPUState *cs)
     if (ret < 0) {
         goto out;
     }
-    ret = kvm_getput_regs(cpu, 0);
+    ret = kvm_getput_regs(cpu, 0, false);
     if (ret < 0) {
         goto out;
     }
@@ -4229,6 +4358,8 @@ MemTxAttrs kvm_arch_post_run(CPUState *cpu, struct kvm_run *run)
     X86CPU *x86_cpu = X86_CPU(cpu);
     CPUX86State *env = &x86_cpu->env;
 
+    env->kvm_shadow->valid = 0;
+
     if (run->flags & KVM_RUN_X86_SMM) {
         env->hflags |= HF_SMM_MASK;
     } else {
@@ -28,6 +28,7 @@
 #define L(n) MMX_L(n)
 #define Q(n) MMX_Q(n)
 #define SUFFIX _mmx
+#define MOVE(d, r) ((d) = (r))
 #else
 #define Reg ZMMReg
 #define XMM_ONLY(...) __VA_ARGS__
@@ -36,6 +37,14 @@
 #define L(n) ZMM_L(n)
 #define Q(n) ZMM_Q(n)
 #define SUFFIX _xmm
+/*
+ * Only store the low 128 bits: the upper half of a ymm register must be
+ * preserved, and @d may point to the upper lane of a ymm register.
+ */
+#define MOVE(d, r) do {                         \
+        (d).Q(0) = (r).Q(0);                    \
+        (d).Q(1) = (r).Q(1);                    \
+    } while (0)
 #endif
 
 void glue(helper_psrlw, SUFFIX)(CPUX86State *env, Reg *d, Reg *s)
@@ -516,7 +525,7 @@ void glue(helper_pshufw, SUFFIX)(Reg *d, Reg *s, int order)
     r.W(1) = s->W((order >> 2) & 3);
     r.W(2) = s->W((order >> 4) & 3);
     r.W(3) = s->W((order >> 6) & 3);
-    *d = r;
+    MOVE(*d, r);
 }
 #else
 void helper_shufps(Reg *d, Reg *s, int order)
@@ -527,7 +536,7 @@ void helper_shufps(Reg *d, Reg *s, int order)
     r.L(1) = d->L((order >> 2) & 3);
     r.L(2) = s->L((order >> 4) & 3);
     r.L(3) = s->L((order >> 6) & 3);
-    *d = r;
+    MOVE(*d, r);
 }
 
 void helper_shufpd(Reg *d, Reg *s, int order)
@@ -536,7 +545,7 @@ void helper_shufpd(Reg *d, Reg *s, int order)
 
     r.Q(0) = d->Q(order & 1);
     r.Q(1) = s->Q((order >> 1) & 1);
-    *d = r;
+    MOVE(*d, r);
 }
 
 void glue(helper_pshufd, SUFFIX)(Reg *d, Reg *s, int order)
@@ -547,7 +556,7 @@ void glue(helper_pshufd, SUFFIX)(Reg *d, Reg *s, int order)
     r.L(1) = s->L((order >> 2) & 3);
     r.L(2) = s->L((order >> 4) & 3);
     r.L(3) = s->L((order >> 6) & 3);
-    *d = r;
+    MOVE(*d, r);
 }
 
 void glue(helper_pshuflw, SUFFIX)(Reg *d, Reg *s, int order)
@@ -559,7 +568,7 @@ void glue(helper_pshuflw, SUFFIX)(Reg *d, Reg *s, int order)
     r.W(2) = s->W((order >> 4) & 3);
     r.W(3) = s->W((order >> 6) & 3);
     r.Q(1) = s->Q(1);
-    *d = r;
+    MOVE(*d, r);
 }
 
 void glue(helper_pshufhw, SUFFIX)(Reg *d, Reg *s, int order)
@@ -571,7 +580,7 @@ void glue(helper_pshufhw, SUFFIX)(Reg *d, Reg *s, int order)
     r.W(5) = s->W(4 + ((order >> 2) & 3));
     r.W(6) = s->W(4 + ((order >> 4) & 3));
     r.W(7) = s->W(4 + ((order >> 6) & 3));
-    *d = r;
+    MOVE(*d, r);
 }
 #endif
 
@@ -619,10 +628,47 @@ void glue(helper_pshufhw, SUFFIX)(Reg *d, Reg *s, int order)
 #define FPU_MAX(size, a, b)                                     \
     (float ## size ## _lt(b, a, &env->sse_status) ? (a) : (b))
 
-SSE_HELPER_S(add, FPU_ADD)
-SSE_HELPER_S(sub, FPU_SUB)
-SSE_HELPER_S(mul, FPU_MUL)
-SSE_HELPER_S(div, FPU_DIV)
+/*
+ * The low elements of a register are contiguous in host memory, but in
+ * reverse order on big-endian hosts; that does not matter to elementwise
+ * operations, which only need the lowest address.
+ */
+#ifdef HOST_WORDS_BIGENDIAN
+#define ZMM_S_BASE(r, n) (&(r)->ZMM_S((n) - 1))
+#define ZMM_D_BASE(r, n) (&(r)->ZMM_D((n) - 1))
+#else
+#define ZMM_S_BASE(r, n) (&(r)->ZMM_S(0))
+#define ZMM_D_BASE(r, n) (&(r)->ZMM_D(0))
+#endif
+
+/* As SSE_HELPER_S, with the packed forms done by softfloat's _vec ops */
+#define SSE_HELPER_S_VEC(name, F)                                       \
+    void helper_ ## name ## ps(CPUX86State *env, Reg *d, Reg *s)        \
+    {                                                                   \
+        float32_ ## name ## _vec(ZMM_S_BASE(d, 4), ZMM_S_BASE(d, 4),    \
+                                 ZMM_S_BASE(s, 4), 4, &env->sse_status); \
+    }                                                                   \
+                                                                        \
+    void helper_ ## name ## ss(CPUX86State *env, Reg *d, Reg *s)        \
+    {                                                                   \
+        d->ZMM_S(0) = F(32, d->ZMM_S(0), s->ZMM_S(0));                  \
+    }                                                                   \
+                                                                        \
+    void helper_ ## name ## pd(CPUX86State *env, Reg *d, Reg *s)        \
+    {                                                                   \
+        float64_ ## name ## _vec(ZMM_D_BASE(d, 2), ZMM_D_BASE(d, 2),    \
+                                 ZMM_D_BASE(s, 2), 2, &env->sse_status); \
+    }                                                                   \
+                                                                        \
+    void helper_ ## name ## sd(CPUX86State *env, Reg *d, Reg *s)        \
+    {                                                                   \
+        d->ZMM_D(0) = F(64, d->ZMM_D(0), s->ZMM_D(0));                  \
+    }
+
+SSE_HELPER_S_VEC(add, FPU_ADD)
+SSE_HELPER_S_VEC(sub, FPU_SUB)
+SSE_HELPER_S_VEC(mul, FPU_MUL)
+SSE_HELPER_S_VEC(div, FPU_DIV)
 SSE_HELPER_S(min, FPU_MIN)
 SSE_HELPER_S(max, FPU_MAX)
 SSE_HELPER_S(sqrt, FPU_SQRT)
@@ -937,7 +983,7 @@ void helper_haddps(CPUX86State *env, ZMMReg *d, ZMMReg *s)
     r.ZMM_S(1) = float32_add(d->ZMM_S(2), d->ZMM_S(3), &env->sse_status);
     r.ZMM_S(2) = float32_add(s->ZMM_S(0), s->ZMM_S(1), &env->sse_status);
     r.ZMM_S(3) = float32_add(s->ZMM_S(2), s->ZMM_S(3), &env->sse_status);
-    *d = r;
+    MOVE(*d, r);
 }
 
 void helper_haddpd(CPUX86State *env, ZMMReg *d, ZMMReg *s)
@@ -946,7 +992,7 @@ void helper_haddpd(CPUX86State *env, ZMMReg *d, ZMMReg *s)
 
     r.ZMM_D(0) = float64_add(d->ZMM_D(0), d->ZMM_D(1), &env->sse_status);
     r.ZMM_D(1) = float64_add(s->ZMM_D(0), s->ZMM_D(1), &env->sse_status);
-    *d = r;
+    MOVE(*d, r);
 }
 
 void helper_hsubps(CPUX86State *env, ZMMReg *d, ZMMReg *s)
@@ -957,7 +1003,7 @@ void helper_hsubps(CPUX86State *env, ZMMReg *d, ZMMReg *s)
     r.ZMM_S(1) = float32_sub(d->ZMM_S(2), d->ZMM_S(3), &env->sse_status);
     r.ZMM_S(2) = float32_sub(s->ZMM_S(0), s->ZMM_S(1), &env->sse_status);
     r.ZMM_S(3) = float32_sub(s->ZMM_S(2), s->ZMM_S(3), &env->sse_status);
-    *d = r;
+    MOVE(*d, r);
 }
 
 void helper_hsubpd(CPUX86State *env, ZMMReg *d, ZMMReg *s)
@@ -966,7 +1012,7 @@ void helper_hsubpd(CPUX86State *env, ZMMReg *d, ZMMReg *s)
 
     r.ZMM_D(0) = float64_sub(d->ZMM_D(0), d->ZMM_D(1), &env->sse_status);
     r.ZMM_D(1) = float64_sub(s->ZMM_D(0), s->ZMM_D(1), &env->sse_status);
-    *d = r;
+    MOVE(*d, r);
 }
 
 void helper_addsubps(CPUX86State *env, ZMMReg *d, ZMMReg *s)
@@ -1035,6 +1081,55 @@ SSE_HELPER_CMP(cmpnlt, FPU_CMPNLT)
 SSE_HELPER_CMP(cmpnle, FPU_CMPNLE)
 SSE_HELPER_CMP(cmpord, FPU_CMPORD)
 
+/*
+ * VEX-encoded compares take any of the 32 predicates as an immediate.
+ * Bits 0-3 select which of less, equal, greater and unordered are true,
+ * bit 4 flips between the quiet and the signalling variant.
+ */
+static const uint8_t vcmp_true[16] = {
+    0x2, 0x1, 0x3, 0x8, 0xd, 0xe, 0xc, 0x7,
+    0xa, 0x9, 0xb, 0x0, 0x5, 0x6, 0x4, 0xf,
+};
+
+static inline bool vcmp_signalling(uint32_t pred)
+{
+    return ((0x6666 >> (pred & 15)) ^ (pred >> 4)) & 1;
+}
+
+static inline int vcmp_result(uint32_t pred, FloatRelation rel)
+{
+    return (vcmp_true[pred & 15] >> (rel + 1)) & 1 ? -1 : 0;
+}
+
+#define FPU_VCMP(size, a, b)                                            \
+    vcmp_result(pred, vcmp_signalling(pred) ?                           \
+                float ## size ## _compare(a, b, &env->sse_status) :     \
+                float ## size ## _compare_quiet(a, b, &env->sse_status))
+
+void helper_vcmpps(CPUX86State *env, Reg *d, Reg *s, uint32_t pred)
+{
+    d->ZMM_L(0) = FPU_VCMP(32, d->ZMM_S(0), s->ZMM_S(0));
+    d->ZMM_L(1) = FPU_VCMP(32, d->ZMM_S(1), s->ZMM_S(1));
+    d->ZMM_L(2) = FPU_VCMP(32, d->ZMM_S(2), s->ZMM_S(2));
+    d->ZMM_L(3) = FPU_VCMP(32, d->ZMM_S(3), s->ZMM_S(3));
+}
+
+void helper_vcmpss(CPUX86State *env, Reg *d, Reg *s, uint32_t pred)
+{
+    d->ZMM_L(0) = FPU_VCMP(32, d->ZMM_S(0), s->ZMM_S(0));
+}
+
+void helper_vcmppd(CPUX86State *env, Reg *d, Reg *s, uint32_t pred)
+{
+    d->ZMM_Q(0) = FPU_VCMP(64, d->ZMM_D(0), s->ZMM_D(0));
+    d->ZMM_Q(1) = FPU_VCMP(64, d->ZMM_D(1), s->ZMM_D(1));
+}
+
+void helper_vcmpsd(CPUX86State *env, Reg *d, Reg *s, uint32_t pred)
+{
+    d->ZMM_Q(0) = FPU_VCMP(64, d->ZMM_D(0), s->ZMM_D(0));
+}
+
 static const int comis_eflags[4] = {CC_C, CC_Z, 0, CC_Z | CC_P | CC_C};
 
 void helper_ucomiss(CPUX86State *env, Reg *d, Reg *s)
@@ -1153,7 +1248,7 @@ void glue(helper_packsswb, SUFFIX)(CPUX86State *env, Reg *d, Reg *s)
     r.B(14) = satsb((int16_t)s->W(6));
     r.B(15) = satsb((int16_t)s->W(7));
 #endif
-    *d = r;
+    MOVE(*d, r);
 }
 
 void glue(helper_packuswb, SUFFIX)(CPUX86State *env, Reg *d, Reg *s)
@@ -1180,7 +1275,7 @@ void glue(helper_packuswb, SUFFIX)(CPUX86State *env, Reg *d, Reg *s)
     r.B(14) = satub((int16_t)s->W(6));
     r.B(15) = satub((int16_t)s->W(7));
 #endif
-    *d = r;
+    MOVE(*d, r);
 }
 
 void glue(helper_packssdw, SUFFIX)(CPUX86State *env, Reg *d, Reg *s)
@@ -1199,7 +1294,7 @@ void glue(helper_packssdw, SUFFIX)(CPUX86State *env, Reg *d, Reg *s)
     r.W(6) = satsw(s->L(2));
     r.W(7) = satsw(s->L(3));
 #endif
-    *d = r;
+    MOVE(*d, r);
 }
 
 #define UNPCK_OP(base_name, base)                                       \
@@ -1227,7 +1322,7 @@ void glue(helper_packssdw, SUFFIX)(CPUX86State *env, Reg *d, Reg *s)
                  r.B(14) = d->B((base << (SHIFT + 2)) + 7);             \
                  r.B(15) = s->B((base << (SHIFT + 2)) + 7);             \
                                                                       ) \
-            *d = r;                                                     \
+            MOVE(*d, r);                                                \
     }                                                                   \
                                                                         \
     void glue(helper_punpck ## base_name ## wd, SUFFIX)(CPUX86State *env,\
@@ -1245,7 +1340,7 @@ void glue(helper_packssdw, SUFFIX)(CPUX86State *env, Reg *d, Reg *s)
                  r.W(6) = d->W((base << (SHIFT + 1)) + 3);              \
                  r.W(7) = s->W((base << (SHIFT + 1)) + 3);              \
                                                                       ) \
-            *d = r;                                                     \
+            MOVE(*d, r);                                                \
     }                                                                   \
                                                                         \
     void glue(helper_punpck ## base_name ## dq, SUFFIX)(CPUX86State *env,\
@@ -1259,7 +1354,7 @@ void glue(helper_packssdw, SUFFIX)(CPUX86State *env, Reg *d, Reg *s)
                  r.L(2) = d->L((base << SHIFT) + 1);                    \
                  r.L(3) = s->L((base << SHIFT) + 1);                    \
                                                                       ) \
-            *d = r;                                                     \
+            MOVE(*d, r);                                                \
     }                                                                   \
                                                                         \
     XMM_ONLY(                                                           \
@@ -1272,7 +1367,7 @@ void glue(helper_packssdw, SUFFIX)(CPUX86State *env, Reg *d, Reg *s)
                                                                         \
                  r.Q(0) = d->Q(base);                                   \
                  r.Q(1) = s->Q(base);                                   \
-                 *d = r;                                                \
+                 MOVE(*d, r);                                           \
              }                                                          \
                                                                         )
 
@@ -1313,7 +1408,7 @@ void helper_pfacc(CPUX86State *env, MMXReg *d, MMXReg *s)
 
     r.MMX_S(0) = float32_add(d->MMX_S(0), d->MMX_S(1), &env->mmx_status);
     r.MMX_S(1) = float32_add(s->MMX_S(0), s->MMX_S(1), &env->mmx_status);
-    *d = r;
+    MOVE(*d, r);
 }
 
 void helper_pfadd(CPUX86State *env, MMXReg *d, MMXReg *s)
@@ -1378,7 +1473,7 @@ void helper_pfnacc(CPUX86State *env, MMXReg *d, MMXReg *s)
 
     r.MMX_S(0) = float32_sub(d->MMX_S(0), d->MMX_S(1), &env->mmx_status);
     r.MMX_S(1) = float32_sub(s->MMX_S(0), s->MMX_S(1), &env->mmx_status);
-    *d = r;
+    MOVE(*d, r);
 }
 
 void helper_pfpnacc(CPUX86State *env, MMXReg *d, MMXReg *s)
@@ -1387,7 +1482,7 @@ void helper_pfpnacc(CPUX86State *env, MMXReg *d, MMXReg *s)
 
     r.MMX_S(0) = float32_sub(d->MMX_S(0), d->MMX_S(1), &env->mmx_status);
     r.MMX_S(1) = float32_add(s->MMX_S(0), s->MMX_S(1), &env->mmx_status);
-    *d = r;
+    MOVE(*d, r);
 }
 
 void helper_pfrcp(CPUX86State *env, MMXReg *d, MMXReg *s)
@@ -1424,7 +1519,7 @@ void helper_pswapd(CPUX86State *env, MMXReg *d, MMXReg *s)
 
     r.MMX_L(0) = s->MMX_L(1);
     r.MMX_L(1) = s->MMX_L(0);
-    *d = r;
+    MOVE(*d, r);
 }
 #endif
 
@@ -1438,7 +1533,7 @@ void glue(helper_pshufb, SUFFIX)(CPUX86State *env, Reg *d, Reg *s)
         r.B(i) = (s->B(i) & 0x80) ? 0 : (d->B(s->B(i) & ((8 << SHIFT) - 1)));
     }
 
-    *d = r;
+    MOVE(*d, r);
 }
 
 void glue(helper_phaddw, SUFFIX)(CPUX86State *env, Reg *d, Reg *s)
@@ -1455,7 +1550,7 @@ void glue(helper_phaddw, SUFFIX)(CPUX86State *env, Reg *d, Reg *s)
     XMM_ONLY(r.W(6) = (int16_t)s->W(4) + (int16_t)s->W(5));
     XMM_ONLY(r.W(7) = (int16_t)s->W(6) + (int16_t)s->W(7));
 
-    *d = r;
+    MOVE(*d, r);
 }
 
 void glue(helper_phaddd, SUFFIX)(CPUX86State *env, Reg *d, Reg *s)
@@ -1467,7 +1562,7 @@ void glue(helper_phaddd, SUFFIX)(CPUX86State *env, Reg *d, Reg *s)
     r.L((1 << SHIFT) + 0) = (int32_t)s->L(0) + (int32_t)s->L(1);
     XMM_ONLY(r.L(3) = (int32_t)s->L(2) + (int32_t)s->L(3));
 
-    *d = r;
+    MOVE(*d, r);
 }
 
 void glue(helper_phaddsw, SUFFIX)(CPUX86State *env, Reg *d, Reg *s)
@@ -1483,7 +1578,7 @@ void glue(helper_phaddsw, SUFFIX)(CPUX86State *env, Reg *d, Reg *s)
     XMM_ONLY(r.W(6) = satsw((int16_t)s->W(4) + (int16_t)s->W(5)));
     XMM_ONLY(r.W(7) = satsw((int16_t)s->W(6) + (int16_t)s->W(7)));
 
-    *d = r;
+    MOVE(*d, r);
 }
 
 void glue(helper_pmaddubsw, SUFFIX)(CPUX86State *env, Reg *d, Reg *s)
@@ -1585,7 +1680,7 @@ void glue(helper_palignr, SUFFIX)(CPUX86State *env, Reg *d, Reg *s,
 #undef SHR
     }
 
-    *d = r;
+    MOVE(*d, r);
 }
 
 #define XMM0 (env->xmm_regs[0])
@@ -1667,6 +1762,109 @@ void glue(helper_ptest, SUFFIX)(CPUX86State *env, Reg *d, Reg *s)
     CC_SRC = (zf ? 0 : CC_Z) | (cf ? 0 : CC_C);
 }
 
+/* Like ptest, but only the sign bit of each element counts */
+void glue(helper_vtestps, SUFFIX)(CPUX86State *env, Reg *d, Reg *s)
+{
+    uint64_t mask = 0x8000000080000000ULL;
+    uint64_t zf = ((s->Q(0) &  d->Q(0)) | (s->Q(1) &  d->Q(1))) & mask;
+    uint64_t cf = ((s->Q(0) & ~d->Q(0)) | (s->Q(1) & ~d->Q(1))) & mask;
+
+    CC_SRC = (zf ? 0 : CC_Z) | (cf ? 0 : CC_C);
+}
+
+void glue(helper_vtestpd, SUFFIX)(CPUX86State *env, Reg *d, Reg *s)
+{
+    uint64_t mask = 0x8000000000000000ULL;
+    uint64_t zf = ((s->Q(0) &  d->Q(0)) | (s->Q(1) &  d->Q(1))) & mask;
+    uint64_t cf = ((s->Q(0) & ~d->Q(0)) | (s->Q(1) & ~d->Q(1))) & mask;
+
+    CC_SRC = (zf ? 0 : CC_Z) | (cf ? 0 : CC_C);
+}
+
+/* AVX vpermilps/vpermilpd: permute @d with the selectors in @s */
+void glue(helper_vpermilps, SUFFIX)(CPUX86State *env, Reg *d, Reg *s)
+{
+    Reg r;
+
+    r.L(0) = d->L(s->L(0) & 3);
+    r.L(1) = d->L(s->L(1) & 3);
+    r.L(2) = d->L(s->L(2) & 3);
+    r.L(3) = d->L(s->L(3) & 3);
+    MOVE(*d, r);
+}
+
+void glue(helper_vpermilpd, SUFFIX)(CPUX86State *env, Reg *d, Reg *s)
+{
+    Reg r;
+
+    r.Q(0) = d->Q((s->Q(0) >> 1) & 1);
+    r.Q(1) = d->Q((s->Q(1) >> 1) & 1);
+    MOVE(*d, r);
+}
+
+void glue(helper_vpermilpd_imm, SUFFIX)(Reg *d, Reg *s, uint32_t order)
+{
+    Reg r;
+
+    r.Q(0) = s->Q(order & 1);
+    r.Q(1) = s->Q((order >> 1) & 1);
+    MOVE(*d, r);
+}
+
+/*
+ * AVX vmaskmovps/vmaskmovpd on one lane at @a0: the elements whose sign
+ * bit is clear in @v are neither accessed nor, for loads, kept.
+ */
+void glue(helper_vmaskmovps_ld, SUFFIX)(CPUX86State *env, Reg *d, Reg *v,
+                                        target_ulong a0)
+{
+    Reg r;
+    int i;
+
+    for (i = 0; i < 4; i++) {
+        r.L(i) = (v->L(i) & 0x80000000)
+            ? cpu_ldl_data_ra(env, a0 + i * 4, GETPC()) : 0;
+    }
+    MOVE(*d, r);
+}
+
+void glue(helper_vmaskmovpd_ld, SUFFIX)(CPUX86State *env, Reg *d, Reg *v,
+                                        target_ulong a0)
+{
+    Reg r;
+    int i;
+
+    for (i = 0; i < 2; i++) {
+        r.Q(i) = (v->Q(i) & 0x8000000000000000ULL)
+            ? cpu_ldq_data_ra(env, a0 + i * 8, GETPC()) : 0;
+    }
+    MOVE(*d, r);
+}
+
+void glue(helper_vmaskmovps_st, SUFFIX)(CPUX86State *env, Reg *d, Reg *v,
+                                        target_ulong a0)
+{
+    int i;
+
+    for (i = 0; i < 4; i++) {
+        if (v->L(i) & 0x80000000) {
+            cpu_stl_data_ra(env, a0 + i * 4, d->L(i), GETPC());
+        }
+    }
+}
+
+void glue(helper_vmaskmovpd_st, SUFFIX)(CPUX86State *env, Reg *d, Reg *v,
+                                        target_ulong a0)
+{
+    int i;
+
+    for (i = 0; i < 2; i++) {
+        if (v->Q(i) & 0x8000000000000000ULL) {
+            cpu_stq_data_ra(env, a0 + i * 8, d->Q(i), GETPC());
+        }
+    }
+}
+
 #define SSE_HELPER_F(name, elem, num, F)        \
     void glue(name, SUFFIX)(CPUX86State *env, Reg *d, Reg *s)     \
     {                                           \
@@ -1718,7 +1916,7 @@ void glue(helper_packusdw, SUFFIX)(CPUX86State *env, Reg *d, Reg *s)
     r.W(5) = satuw((int32_t) s->L(1));
     r.W(6) = satuw((int32_t) s->L(2));
     r.W(7) = satuw((int32_t) s->L(3));
-    *d = r;
+    MOVE(*d, r);
 }
 
 #define FMINSB(d, s) MIN((int8_t)d, (int8_t)s)
@@ -1984,7 +2182,7 @@ void glue(helper_mpsadbw, SUFFIX)(CPUX86State *env, Reg *d, Reg *s,
         r.W(i) += abs1(d->B(d0 + 3) - s->B(s0 + 3));
     }
 
-    *d = r;
+    MOVE(*d, r);
 }
 
 /* SSE4.2 op helpers */
@@ -2324,3 +2522,4 @@ void glue(helper_aeskeygenassist, SUFFIX)(CPUX86State *env, Reg *d, Reg *s,
 #undef L
 #undef Q
 #undef SUFFIX
+#undef MOVE
@@ -216,6 +216,11 @@ SSE_HELPER_CMP(cmpnlt, FPU_CMPNLT)
 SSE_HELPER_CMP(cmpnle, FPU_CMPNLE)
 SSE_HELPER_CMP(cmpord, FPU_CMPORD)
 
+DEF_HELPER_4(vcmpps, void, env, Reg, Reg, i32)
+DEF_HELPER_4(vcmpss, void, env, Reg, Reg, i32)
+DEF_HELPER_4(vcmppd, void, env, Reg, Reg, i32)
+DEF_HELPER_4(vcmpsd, void, env, Reg, Reg, i32)
+
 DEF_HELPER_3(ucomiss, void, env, Reg, Reg)
 DEF_HELPER_3(comiss, void, env, Reg, Reg)
 DEF_HELPER_3(ucomisd, void, env, Reg, Reg)
@@ -288,6 +293,15 @@ DEF_HELPER_3(glue(pblendvb, SUFFIX), void, env, Reg, Reg)
 DEF_HELPER_3(glue(blendvps, SUFFIX), void, env, Reg, Reg)
 DEF_HELPER_3(glue(blendvpd, SUFFIX), void, env, Reg, Reg)
 DEF_HELPER_3(glue(ptest, SUFFIX), void, env, Reg, Reg)
+DEF_HELPER_3(glue(vtestps, SUFFIX), void, env, Reg, Reg)
+DEF_HELPER_3(glue(vtestpd, SUFFIX), void, env, Reg, Reg)
+DEF_HELPER_3(glue(vpermilps, SUFFIX), void, env, Reg, Reg)
+DEF_HELPER_3(glue(vpermilpd, SUFFIX), void, env, Reg, Reg)
+DEF_HELPER_3(glue(vpermilpd_imm, SUFFIX), void, Reg, Reg, i32)
+DEF_HELPER_4(glue(vmaskmovps_ld, SUFFIX), void, env, Reg, Reg, tl)
+DEF_HELPER_4(glue(vmaskmovpd_ld, SUFFIX), void, env, Reg, Reg, tl)
+DEF_HELPER_4(glue(vmaskmovps_st, SUFFIX), void, env, Reg, Reg, tl)
+DEF_HELPER_4(glue(vmaskmovpd_st, SUFFIX), void, env, Reg, Reg, tl)
 DEF_HELPER_3(glue(pmovsxbw, SUFFIX), void, env, Reg, Reg)
 DEF_HELPER_3(glue(pmovsxbd, SUFFIX), void, env, Reg, Reg)
 DEF_HELPER_3(glue(pmovsxbq, SUFFIX), void, env, Reg, Reg)
@@ -981,6 +981,19 @@ static void do_interrupt64(CPUX86State *env, int intno, int is_int,
 void helper_syscall(CPUX86State *env, int next_eip_addend)
 {
     CPUState *cs = env_cpu(env);
+    target_ulong ret;
+
+    /*
+     * RAX, RDI and RSI only hold the syscall number and arguments in 64-bit
+     * code.  The translator ends the TB after the syscall, so just return.
+     */
+    if ((env->hflags & HF_CS64_MASK) &&
+        user_fast_syscall(env, env->regs[R_EAX], env->regs[R_EDI],
+                          env->regs[R_ESI], &ret)) {
+        env->regs[R_EAX] = ret;
+        env->eip += next_eip_addend;
+        return;
+    }
 
     cs->exception_index = EXCP_SYSCALL;
     env->exception_is_int = 0;
@@ -23,6 +23,7 @@
 #include "disas/disas.h"
 #include "exec/exec-all.h"
 #include "tcg/tcg-op.h"
+#include "tcg/tcg-op-gvec.h"
 #include "exec/cpu_ldst.h"
 #include "exec/translator.h"
 
@@ -2568,7 +2569,8 @@ static void gen_bnd_jmp(DisasContext *s)
    If RECHECK_TF, emit a rechecking helper for #DB, ignoring the state of
    S->TF.  This is used by the syscall/sysret insns.  */
 static void
-do_gen_eob_worker(DisasContext *s, bool inhibit, bool recheck_tf, bool jr)
+do_gen_eob_worker(DisasContext *s, bool inhibit, bool recheck_tf, bool jr,
+                  TCGv near_dest)
 {
     gen_update_cc_op(s);
 
@@ -2589,6 +2591,10 @@ do_gen_eob_worker(DisasContext *s, bool inhibit, bool recheck_tf, bool jr)
         tcg_gen_exit_tb(NULL, 0);
     } else if (s->tf) {
         gen_helper_single_step(cpu_env);
+    } else if (jr && near_dest && s->jmp_opt &&
+               !(s->base.tb->flags & HF_RF_MASK)) {
+        tcg_gen_addi_tl(near_dest, near_dest, s->cs_base);
+        translator_indirect_jump(&s->base, near_dest);
     } else if (jr) {
         tcg_gen_lookup_and_goto_ptr();
     } else {
@@ -2600,7 +2606,7 @@ do_gen_eob_worker(DisasContext *s, bool inhibit, bool recheck_tf, bool jr)
 static inline void
 gen_eob_worker(DisasContext *s, bool inhibit, bool recheck_tf)
 {
-    do_gen_eob_worker(s, inhibit, recheck_tf, false);
+    do_gen_eob_worker(s, inhibit, recheck_tf, false, NULL);
 }
 
 /* End of block.
@@ -2619,7 +2625,13 @@ static void gen_eob(DisasContext *s)
 /* Jump to register */
 static void gen_jr(DisasContext *s, TCGv dest)
 {
-    do_gen_eob_worker(s, false, false, true);
+    do_gen_eob_worker(s, false, false, true, NULL);
+}
+
+/* Jump to register with CS and hflags unchanged: call, jmp and ret near */
+static void gen_jr_near(DisasContext *s, TCGv dest)
+{
+    do_gen_eob_worker(s, false, false, true, dest);
 }
 
 /* generate a jump to eip. No segment change must happen before as a
@@ -2638,6 +2650,12 @@ static void gen_jmp_tb(DisasContext *s, target_ulong eip, int tb_num)
 
 static void gen_jmp(DisasContext *s, target_ulong eip)
 {
+    /* In a hot trace, keep translating at the target of the jump */
+    if (s->jmp_opt &&
+        translator_follow_jump(&s->base, s->pc, s->cs_base + eip)) {
+        s->pc = s->cs_base + eip;
+        return;
+    }
     gen_jmp_tb(s, eip, 0);
 }
 
@@ -2673,6 +2691,32 @@ static inline void gen_sto_env_A0(DisasContext *s, int offset)
     tcg_gen_qemu_st_i64(s->tmp1_i64, s->tmp0, mem_index, MO_LEQ);
 }
 
+static inline void gen_ldy_env_A0(DisasContext *s, int offset)
+{
+    int mem_index = s->mem_index;
+    int i;
+
+    for (i = 0; i < 4; i++) {
+        tcg_gen_addi_tl(s->tmp0, s->A0, i * 8);
+        tcg_gen_qemu_ld_i64(s->tmp1_i64, s->tmp0, mem_index, MO_LEQ);
+        tcg_gen_st_i64(s->tmp1_i64, cpu_env,
+                       offset + offsetof(ZMMReg, ZMM_Q(i)));
+    }
+}
+
+static inline void gen_sty_env_A0(DisasContext *s, int offset)
+{
+    int mem_index = s->mem_index;
+    int i;
+
+    for (i = 0; i < 4; i++) {
+        tcg_gen_ld_i64(s->tmp1_i64, cpu_env,
+                       offset + offsetof(ZMMReg, ZMM_Q(i)));
+        tcg_gen_addi_tl(s->tmp0, s->A0, i * 8);
+        tcg_gen_qemu_st_i64(s->tmp1_i64, s->tmp0, mem_index, MO_LEQ);
+    }
+}
+
 static inline void gen_op_movo(DisasContext *s, int d_offset, int s_offset)
 {
     tcg_gen_ld_i64(s->tmp1_i64, cpu_env, s_offset + offsetof(ZMMReg, ZMM_Q(0)));
@@ -2876,158 +2920,1516 @@ static const SSEFunc_0_epl sse_op_table3aq[] = {
 };
 #endif
 
-static const SSEFunc_i_ep sse_op_table3bi[] = {
-    gen_helper_cvttss2si,
-    gen_helper_cvtss2si,
-    gen_helper_cvttsd2si,
-    gen_helper_cvtsd2si
-};
+static const SSEFunc_i_ep sse_op_table3bi[] = {
+    gen_helper_cvttss2si,
+    gen_helper_cvtss2si,
+    gen_helper_cvttsd2si,
+    gen_helper_cvtsd2si
+};
+
+#ifdef TARGET_X86_64
+static const SSEFunc_l_ep sse_op_table3bq[] = {
+    gen_helper_cvttss2sq,
+    gen_helper_cvtss2sq,
+    gen_helper_cvttsd2sq,
+    gen_helper_cvtsd2sq
+};
+#endif
+
+static const SSEFunc_0_epp sse_op_table4[8][4] = {
+    SSE_FOP(cmpeq),
+    SSE_FOP(cmplt),
+    SSE_FOP(cmple),
+    SSE_FOP(cmpunord),
+    SSE_FOP(cmpneq),
+    SSE_FOP(cmpnlt),
+    SSE_FOP(cmpnle),
+    SSE_FOP(cmpord),
+};
+
+/* The VEX forms take any of the 32 predicates as an immediate */
+static const SSEFunc_0_eppi sse_op_table4_vex[4] = SSE_FOP(vcmp);
+
+static const SSEFunc_0_epp sse_op_table5[256] = {
+    [0x0c] = gen_helper_pi2fw,
+    [0x0d] = gen_helper_pi2fd,
+    [0x1c] = gen_helper_pf2iw,
+    [0x1d] = gen_helper_pf2id,
+    [0x8a] = gen_helper_pfnacc,
+    [0x8e] = gen_helper_pfpnacc,
+    [0x90] = gen_helper_pfcmpge,
+    [0x94] = gen_helper_pfmin,
+    [0x96] = gen_helper_pfrcp,
+    [0x97] = gen_helper_pfrsqrt,
+    [0x9a] = gen_helper_pfsub,
+    [0x9e] = gen_helper_pfadd,
+    [0xa0] = gen_helper_pfcmpgt,
+    [0xa4] = gen_helper_pfmax,
+    [0xa6] = gen_helper_movq, /* pfrcpit1; no need to actually increase precision */
+    [0xa7] = gen_helper_movq, /* pfrsqit1 */
+    [0xaa] = gen_helper_pfsubr,
+    [0xae] = gen_helper_pfacc,
+    [0xb0] = gen_helper_pfcmpeq,
+    [0xb4] = gen_helper_pfmul,
+    [0xb6] = gen_helper_movq, /* pfrcpit2 */
+    [0xb7] = gen_helper_pmulhrw_mmx,
+    [0xbb] = gen_helper_pswapd,
+    [0xbf] = gen_helper_pavgb_mmx /* pavgusb */
+};
+
+struct SSEOpHelper_epp {
+    SSEFunc_0_epp op[2];
+    uint32_t ext_mask;
+};
+
+struct SSEOpHelper_eppi {
+    SSEFunc_0_eppi op[2];
+    uint32_t ext_mask;
+};
+
+#define SSSE3_OP(x) { MMX_OP2(x), CPUID_EXT_SSSE3 }
+#define SSE41_OP(x) { { NULL, gen_helper_ ## x ## _xmm }, CPUID_EXT_SSE41 }
+#define SSE42_OP(x) { { NULL, gen_helper_ ## x ## _xmm }, CPUID_EXT_SSE42 }
+#define SSE41_SPECIAL { { NULL, SSE_SPECIAL }, CPUID_EXT_SSE41 }
+#define PCLMULQDQ_OP(x) { { NULL, gen_helper_ ## x ## _xmm }, \
+        CPUID_EXT_PCLMULQDQ }
+#define AESNI_OP(x) { { NULL, gen_helper_ ## x ## _xmm }, CPUID_EXT_AES }
+
+static const struct SSEOpHelper_epp sse_op_table6[256] = {
+    [0x00] = SSSE3_OP(pshufb),
+    [0x01] = SSSE3_OP(phaddw),
+    [0x02] = SSSE3_OP(phaddd),
+    [0x03] = SSSE3_OP(phaddsw),
+    [0x04] = SSSE3_OP(pmaddubsw),
+    [0x05] = SSSE3_OP(phsubw),
+    [0x06] = SSSE3_OP(phsubd),
+    [0x07] = SSSE3_OP(phsubsw),
+    [0x08] = SSSE3_OP(psignb),
+    [0x09] = SSSE3_OP(psignw),
+    [0x0a] = SSSE3_OP(psignd),
+    [0x0b] = SSSE3_OP(pmulhrsw),
+    [0x10] = SSE41_OP(pblendvb),
+    [0x14] = SSE41_OP(blendvps),
+    [0x15] = SSE41_OP(blendvpd),
+    [0x17] = SSE41_OP(ptest),
+    [0x1c] = SSSE3_OP(pabsb),
+    [0x1d] = SSSE3_OP(pabsw),
+    [0x1e] = SSSE3_OP(pabsd),
+    [0x20] = SSE41_OP(pmovsxbw),
+    [0x21] = SSE41_OP(pmovsxbd),
+    [0x22] = SSE41_OP(pmovsxbq),
+    [0x23] = SSE41_OP(pmovsxwd),
+    [0x24] = SSE41_OP(pmovsxwq),
+    [0x25] = SSE41_OP(pmovsxdq),
+    [0x28] = SSE41_OP(pmuldq),
+    [0x29] = SSE41_OP(pcmpeqq),
+    [0x2a] = SSE41_SPECIAL, /* movntqda */
+    [0x2b] = SSE41_OP(packusdw),
+    [0x30] = SSE41_OP(pmovzxbw),
+    [0x31] = SSE41_OP(pmovzxbd),
+    [0x32] = SSE41_OP(pmovzxbq),
+    [0x33] = SSE41_OP(pmovzxwd),
+    [0x34] = SSE41_OP(pmovzxwq),
+    [0x35] = SSE41_OP(pmovzxdq),
+    [0x37] = SSE42_OP(pcmpgtq),
+    [0x38] = SSE41_OP(pminsb),
+    [0x39] = SSE41_OP(pminsd),
+    [0x3a] = SSE41_OP(pminuw),
+    [0x3b] = SSE41_OP(pminud),
+    [0x3c] = SSE41_OP(pmaxsb),
+    [0x3d] = SSE41_OP(pmaxsd),
+    [0x3e] = SSE41_OP(pmaxuw),
+    [0x3f] = SSE41_OP(pmaxud),
+    [0x40] = SSE41_OP(pmulld),
+    [0x41] = SSE41_OP(phminposuw),
+    [0xdb] = AESNI_OP(aesimc),
+    [0xdc] = AESNI_OP(aesenc),
+    [0xdd] = AESNI_OP(aesenclast),
+    [0xde] = AESNI_OP(aesdec),
+    [0xdf] = AESNI_OP(aesdeclast),
+};
+
+static const struct SSEOpHelper_eppi sse_op_table7[256] = {
+    [0x08] = SSE41_OP(roundps),
+    [0x09] = SSE41_OP(roundpd),
+    [0x0a] = SSE41_OP(roundss),
+    [0x0b] = SSE41_OP(roundsd),
+    [0x0c] = SSE41_OP(blendps),
+    [0x0d] = SSE41_OP(blendpd),
+    [0x0e] = SSE41_OP(pblendw),
+    [0x0f] = SSSE3_OP(palignr),
+    [0x14] = SSE41_SPECIAL, /* pextrb */
+    [0x15] = SSE41_SPECIAL, /* pextrw */
+    [0x16] = SSE41_SPECIAL, /* pextrd/pextrq */
+    [0x17] = SSE41_SPECIAL, /* extractps */
+    [0x20] = SSE41_SPECIAL, /* pinsrb */
+    [0x21] = SSE41_SPECIAL, /* insertps */
+    [0x22] = SSE41_SPECIAL, /* pinsrd/pinsrq */
+    [0x40] = SSE41_OP(dpps),
+    [0x41] = SSE41_OP(dppd),
+    [0x42] = SSE41_OP(mpsadbw),
+    [0x44] = PCLMULQDQ_OP(pclmulqdq),
+    [0x60] = SSE42_OP(pcmpestrm),
+    [0x61] = SSE42_OP(pcmpestri),
+    [0x62] = SSE42_OP(pcmpistrm),
+    [0x63] = SSE42_OP(pcmpistri),
+    [0xdf] = AESNI_OP(aeskeygenassist),
+};
+
+/*
+ * Offset of the low @oprsz bytes of the MMX, SSE or AVX register at @ofs,
+ * in the form the gvec expanders want.  On big-endian hosts the low bytes
+ * of a ZMMReg are at its end, in reverse order; the order does not matter
+ * to the lane-wise operations below.
+ */
+static inline uint32_t sse_gvec_ofs(int ofs, int oprsz)
+{
+#ifdef HOST_WORDS_BIGENDIAN
+    if (oprsz >= 16) {
+        return ofs + sizeof(ZMMReg) - oprsz;
+    }
+#endif
+    return ofs;
+}
+
+/*
+ * Expand the integer MMX/SSE ops of sse_op_table1 that map directly to
+ * a gvec operation, so that they use host vectors when available.
+ * The result of "@n_ofs op @m_ofs" is written to @d_ofs; legacy encodings
+ * pass the destination as @n_ofs, VEX encodings the vvvv register.
+ * Return false to let the caller fall back to the out-of-line helper.
+ */
+static bool gen_sse_gvec(int b, uint32_t sz, int d_ofs, int n_ofs, int m_ofs)
+{
+    uint32_t d = sse_gvec_ofs(d_ofs, sz);
+    uint32_t n = sse_gvec_ofs(n_ofs, sz);
+    uint32_t m = sse_gvec_ofs(m_ofs, sz);
+
+    switch (b) {
+    case 0xfc: /* paddb */
+    case 0xfd: /* paddw */
+    case 0xfe: /* paddl */
+        tcg_gen_gvec_add(b - 0xfc, d, n, m, sz, sz);
+        break;
+    case 0xd4: /* paddq */
+        tcg_gen_gvec_add(MO_64, d, n, m, sz, sz);
+        break;
+    case 0xf8: /* psubb */
+    case 0xf9: /* psubw */
+    case 0xfa: /* psubl */
+    case 0xfb: /* psubq */
+        tcg_gen_gvec_sub(b - 0xf8, d, n, m, sz, sz);
+        break;
+    case 0xec: /* paddsb */
+    case 0xed: /* paddsw */
+        tcg_gen_gvec_ssadd(b - 0xec, d, n, m, sz, sz);
+        break;
+    case 0xdc: /* paddusb */
+    case 0xdd: /* paddusw */
+        tcg_gen_gvec_usadd(b - 0xdc, d, n, m, sz, sz);
+        break;
+    case 0xe8: /* psubsb */
+    case 0xe9: /* psubsw */
+        tcg_gen_gvec_sssub(b - 0xe8, d, n, m, sz, sz);
+        break;
+    case 0xd8: /* psubusb */
+    case 0xd9: /* psubusw */
+        tcg_gen_gvec_ussub(b - 0xd8, d, n, m, sz, sz);
+        break;
+    case 0xd5: /* pmullw */
+        tcg_gen_gvec_mul(MO_16, d, n, m, sz, sz);
+        break;
+    case 0xda: /* pminub */
+        tcg_gen_gvec_umin(MO_8, d, n, m, sz, sz);
+        break;
+    case 0xde: /* pmaxub */
+        tcg_gen_gvec_umax(MO_8, d, n, m, sz, sz);
+        break;
+    case 0xea: /* pminsw */
+        tcg_gen_gvec_smin(MO_16, d, n, m, sz, sz);
+        break;
+    case 0xee: /* pmaxsw */
+        tcg_gen_gvec_smax(MO_16, d, n, m, sz, sz);
+        break;
+    case 0x74: /* pcmpeqb */
+    case 0x75: /* pcmpeqw */
+    case 0x76: /* pcmpeql */
+        tcg_gen_gvec_cmp(TCG_COND_EQ, b - 0x74, d, n, m, sz, sz);
+        break;
+    case 0x64: /* pcmpgtb */
+    case 0x65: /* pcmpgtw */
+    case 0x66: /* pcmpgtl */
+        tcg_gen_gvec_cmp(TCG_COND_GT, b - 0x64, d, n, m, sz, sz);
+        break;
+    case 0x54: /* andps, andpd */
+    case 0xdb: /* pand */
+        tcg_gen_gvec_and(MO_64, d, n, m, sz, sz);
+        break;
+    case 0x55: /* andnps, andnpd */
+    case 0xdf: /* pandn */
+        tcg_gen_gvec_andc(MO_64, d, m, n, sz, sz);
+        break;
+    case 0x56: /* orps, orpd */
+    case 0xeb: /* por */
+        tcg_gen_gvec_or(MO_64, d, n, m, sz, sz);
+        break;
+    case 0x57: /* xorps, xorpd */
+    case 0xef: /* pxor */
+        tcg_gen_gvec_xor(MO_64, d, n, m, sz, sz);
+        break;
+    default:
+        return false;
+    }
+    return true;
+}
+
+/* As gen_sse_gvec, for the SSSE3/SSE4 ops of sse_op_table6 */
+static bool gen_sse_gvec_0f38(int b, uint32_t sz, int d_ofs, int n_ofs,
+                              int m_ofs)
+{
+    uint32_t d = sse_gvec_ofs(d_ofs, sz);
+    uint32_t n = sse_gvec_ofs(n_ofs, sz);
+    uint32_t m = sse_gvec_ofs(m_ofs, sz);
+
+    switch (b) {
+    case 0x1c: /* pabsb */
+    case 0x1d: /* pabsw */
+    case 0x1e: /* pabsd */
+        tcg_gen_gvec_abs(b - 0x1c, d, m, sz, sz);
+        break;
+    case 0x29: /* pcmpeqq */
+        tcg_gen_gvec_cmp(TCG_COND_EQ, MO_64, d, n, m, sz, sz);
+        break;
+    case 0x37: /* pcmpgtq */
+        tcg_gen_gvec_cmp(TCG_COND_GT, MO_64, d, n, m, sz, sz);
+        break;
+    case 0x38: /* pminsb */
+        tcg_gen_gvec_smin(MO_8, d, n, m, sz, sz);
+        break;
+    case 0x39: /* pminsd */
+        tcg_gen_gvec_smin(MO_32, d, n, m, sz, sz);
+        break;
+    case 0x3a: /* pminuw */
+        tcg_gen_gvec_umin(MO_16, d, n, m, sz, sz);
+        break;
+    case 0x3b: /* pminud */
+        tcg_gen_gvec_umin(MO_32, d, n, m, sz, sz);
+        break;
+    case 0x3c: /* pmaxsb */
+        tcg_gen_gvec_smax(MO_8, d, n, m, sz, sz);
+        break;
+    case 0x3d: /* pmaxsd */
+        tcg_gen_gvec_smax(MO_32, d, n, m, sz, sz);
+        break;
+    case 0x3e: /* pmaxuw */
+        tcg_gen_gvec_umax(MO_16, d, n, m, sz, sz);
+        break;
+    case 0x3f: /* pmaxud */
+        tcg_gen_gvec_umax(MO_32, d, n, m, sz, sz);
+        break;
+    case 0x40: /* pmulld */
+        tcg_gen_gvec_mul(MO_32, d, n, m, sz, sz);
+        break;
+    default:
+        return false;
+    }
+    return true;
+}
+
+/*
+ * AVX and AVX2.  The VEX encodings take their first source operand from
+ * vvvv, operate on up to 256 bits (VEX.L) and zero bits 255:128 of the
+ * destination in their 128-bit form.
+ *
+ * Most of them reuse the SSE helpers, called once per 128-bit lane with
+ * the Reg pointers aimed at the upper half of the ymm registers for the
+ * second lane.
+ */
+
+#define AVX_NDS        (1 << 0) /* vvvv is the first source */
+#define AVX_256        (1 << 1) /* the VEX.256 form works lane by lane */
+#define AVX_AVX2       (1 << 2) /* the VEX.256 form needs AVX2 */
+#define AVX_SCALAR     (1 << 3) /* scalar op, VEX.L is ignored */
+#define AVX_M_LOW      (1 << 4) /* every lane uses the low r/m lane */
+#define AVX_M128       (1 << 5) /* the r/m operand is always 128 bits */
+#define AVX_IMM        (1 << 6) /* an imm8 follows, passed to the helper */
+#define AVX_IMM_NOENV  (1 << 7) /* ... which takes no env argument */
+
+/*
+ * Offset of 128-bit lane @lane of the register at @ofs, such that the
+ * ZMM_* accessors of an xmm helper reach that lane.
+ */
+static inline int ymm_lane_ofs(int ofs, int lane)
+{
+#ifdef HOST_WORDS_BIGENDIAN
+    return ofs - lane * 16;
+#else
+    return ofs + lane * 16;
+#endif
+}
+
+static void gen_avx_clear_high(DisasContext *s, int ofs)
+{
+    tcg_gen_movi_i64(s->tmp1_i64, 0);
+    tcg_gen_st_i64(s->tmp1_i64, cpu_env, ofs + offsetof(ZMMReg, ZMM_Q(2)));
+    tcg_gen_st_i64(s->tmp1_i64, cpu_env, ofs + offsetof(ZMMReg, ZMM_Q(3)));
+}
+
+static void gen_avx_zero(DisasContext *s, int ofs)
+{
+    tcg_gen_movi_i64(s->tmp1_i64, 0);
+    tcg_gen_st_i64(s->tmp1_i64, cpu_env, ofs + offsetof(ZMMReg, ZMM_Q(0)));
+    tcg_gen_st_i64(s->tmp1_i64, cpu_env, ofs + offsetof(ZMMReg, ZMM_Q(1)));
+    tcg_gen_st_i64(s->tmp1_i64, cpu_env, ofs + offsetof(ZMMReg, ZMM_Q(2)));
+    tcg_gen_st_i64(s->tmp1_i64, cpu_env, ofs + offsetof(ZMMReg, ZMM_Q(3)));
+}
+
+/* Copy @len bytes of ymm register, zeroing the upper half if @len is 16 */
+static void gen_avx_mov(DisasContext *s, int d_ofs, int m_ofs, int len)
+{
+    gen_op_movo(s, d_ofs, m_ofs);
+    if (len == 32) {
+        gen_op_movo(s, ymm_lane_ofs(d_ofs, 1), ymm_lane_ofs(m_ofs, 1));
+    } else {
+        gen_avx_clear_high(s, d_ofs);
+    }
+}
+
+/* Load @size bytes at A0 into the low bytes of the register at @ofs */
+static void gen_avx_ld(DisasContext *s, int ofs, int size)
+{
+    switch (size) {
+    case 1:
+        tcg_gen_qemu_ld_i32(s->tmp2_i32, s->A0, s->mem_index, MO_UB);
+        tcg_gen_st8_i32(s->tmp2_i32, cpu_env,
+                        ofs + offsetof(ZMMReg, ZMM_B(0)));
+        break;
+    case 2:
+        tcg_gen_qemu_ld_i32(s->tmp2_i32, s->A0, s->mem_index, MO_LEUW);
+        tcg_gen_st16_i32(s->tmp2_i32, cpu_env,
+                         ofs + offsetof(ZMMReg, ZMM_W(0)));
+        break;
+    case 4:
+        tcg_gen_qemu_ld_i32(s->tmp2_i32, s->A0, s->mem_index, MO_LEUL);
+        tcg_gen_st_i32(s->tmp2_i32, cpu_env,
+                       ofs + offsetof(ZMMReg, ZMM_L(0)));
+        break;
+    case 8:
+        gen_ldq_env_A0(s, ofs + offsetof(ZMMReg, ZMM_Q(0)));
+        break;
+    case 16:
+        gen_ldo_env_A0(s, ofs);
+        break;
+    default:
+        gen_ldy_env_A0(s, ofs);
+        break;
+    }
+}
+
+/*
+ * Apply an SSE helper to each 128-bit lane: the same as the legacy
+ * encoding, except that the destination is first loaded from vvvv.
+ * The r/m operand at @m_ofs must not alias the destination then.
+ */
+static void gen_avx_lanes(DisasContext *s, SSEFunc_0_epp fn, int flags,
+                          int val, int val_shift, int d_ofs, int v_ofs,
+                          int m_ofs, int len)
+{
+    int i;
+
+    for (i = 0; i < len / 16; i++) {
+        int d = ymm_lane_ofs(d_ofs, i);
+        int m = ymm_lane_ofs(m_ofs, flags & AVX_M_LOW ? 0 : i);
+
+        if ((flags & AVX_NDS) && d_ofs != v_ofs) {
+            gen_op_movo(s, d, ymm_lane_ofs(v_ofs, i));
+        }
+        tcg_gen_addi_ptr(s->ptr0, cpu_env, d);
+        tcg_gen_addi_ptr(s->ptr1, cpu_env, m);
+        if (flags & AVX_IMM) {
+            TCGv_i32 imm = tcg_const_i32(val >> (i * val_shift));
+
+            if (flags & AVX_IMM_NOENV) {
+                ((SSEFunc_0_ppi)fn)(s->ptr0, s->ptr1, imm);
+            } else {
+                ((SSEFunc_0_eppi)fn)(cpu_env, s->ptr0, s->ptr1, imm);
+            }
+            tcg_temp_free_i32(imm);
+        } else {
+            fn(cpu_env, s->ptr0, s->ptr1);
+        }
+    }
+    if (len == 16) {
+        gen_avx_clear_high(s, d_ofs);
+    }
+}
+
+/* AVX_* flags of the VEX form of sse_op_table1[b][b1], -1 if it has none */
+static int avx_table1_flags(int b, int b1)
+{
+    switch (b) {
+    case 0x14 ... 0x15: /* vunpck[lh]p[sd] */
+    case 0x54 ... 0x57: /* vandp[sd], vandnp[sd], vorp[sd], vxorp[sd] */
+        return b1 < 2 ? AVX_NDS | AVX_256 : -1;
+    case 0x51: /* vsqrt */
+        return b1 < 2 ? AVX_256 : AVX_NDS | AVX_SCALAR;
+    case 0x52 ... 0x53: /* vrsqrt, vrcp */
+        return b1 == 0 ? AVX_256 : AVX_NDS | AVX_SCALAR;
+    case 0x58 ... 0x59: /* vadd, vmul */
+    case 0x5c ... 0x5f: /* vsub, vmin, vdiv, vmax */
+        return b1 < 2 ? AVX_NDS | AVX_256 : AVX_NDS | AVX_SCALAR;
+    case 0x5a: /* vcvtss2sd, vcvtsd2ss */
+        return b1 < 2 ? -1 : AVX_NDS | AVX_SCALAR;
+    case 0x5b: /* vcvtdq2ps, vcvtps2dq, vcvttps2dq */
+        return AVX_256;
+    case 0x60 ... 0x6d:
+    case 0x74 ... 0x76:
+    case 0xd4 ... 0xd5:
+    case 0xd8 ... 0xe0:
+    case 0xe3 ... 0xe5:
+    case 0xe8 ... 0xef:
+    case 0xf4 ... 0xf6:
+    case 0xf8 ... 0xfe:
+        return b1 == 1 ? AVX_NDS | AVX_256 | AVX_AVX2 : -1;
+    case 0xd1 ... 0xd3: /* vpsrl[wdq] */
+    case 0xe1 ... 0xe2: /* vpsra[wd] */
+    case 0xf1 ... 0xf3: /* vpsll[wdq] */
+        return b1 == 1 ? AVX_NDS | AVX_256 | AVX_AVX2 | AVX_M_LOW | AVX_M128
+                       : -1;
+    case 0x70: /* vpshufd, vpshufhw, vpshuflw */
+        return b1 ? AVX_256 | AVX_AVX2 | AVX_IMM | AVX_IMM_NOENV : -1;
+    case 0x7c ... 0x7d: /* vhaddp[sd], vhsubp[sd] */
+    case 0xd0: /* vaddsubp[sd] */
+        return b1 & 1 ? AVX_NDS | AVX_256 : -1;
+    case 0xc2: /* vcmp */
+        return b1 < 2 ? AVX_NDS | AVX_256 | AVX_IMM
+                      : AVX_NDS | AVX_SCALAR | AVX_IMM;
+    case 0xc6: /* vshufp[sd] */
+        return b1 < 2 ? AVX_NDS | AVX_256 | AVX_IMM | AVX_IMM_NOENV : -1;
+    default:
+        return -1;
+    }
+}
+
+/* Likewise for sse_op_table6[b] */
+static int avx_table6_flags(int b)
+{
+    switch (b) {
+    case 0x00 ... 0x0b: /* vpshufb, vphadd*, vpmaddubsw, vphsub*, ... */
+    case 0x28 ... 0x29: /* vpmuldq, vpcmpeqq */
+    case 0x2b: /* vpackusdw */
+    case 0x37 ... 0x40: /* vpcmpgtq, vpmin*, vpmax*, vpmulld */
+        return AVX_NDS | AVX_256 | AVX_AVX2;
+    case 0x1c ... 0x1e: /* vpabs[bwd] */
+        return AVX_256 | AVX_AVX2;
+    case 0x41: /* vphminposuw */
+    case 0xdb: /* vaesimc */
+        return 0;
+    case 0xdc ... 0xdf: /* vaesenc, vaesenclast, vaesdec, vaesdeclast */
+        return AVX_NDS;
+    default:
+        return -1;
+    }
+}
+
+/* Likewise for sse_op_table7[b] */
+static int avx_table7_flags(int b)
+{
+    switch (b) {
+    case 0x08 ... 0x09: /* vroundp[sd] */
+        return AVX_256 | AVX_IMM;
+    case 0x0a ... 0x0b: /* vrounds[sd] */
+        return AVX_NDS | AVX_SCALAR | AVX_IMM;
+    case 0x0c ... 0x0d: /* vblendp[sd] */
+    case 0x40: /* vdpps */
+        return AVX_NDS | AVX_256 | AVX_IMM;
+    case 0x0e ... 0x0f: /* vpblendw, vpalignr */
+    case 0x42: /* vmpsadbw */
+        return AVX_NDS | AVX_256 | AVX_AVX2 | AVX_IMM;
+    case 0x41: /* vdppd */
+    case 0x44: /* vpclmulqdq */
+        return AVX_NDS | AVX_IMM;
+    case 0xdf: /* vaeskeygenassist */
+        return AVX_IMM;
+    default:
+        return -1;
+    }
+}
+
+/*
+ * VEX.128 forms that neither use vvvv nor write an xmm register, and
+ * which gen_sse therefore decodes correctly as their legacy forms.
+ */
+static bool avx_is_legacy(int map, int op, int b1)
+{
+    switch ((map << 8) | op) {
+    case 0x02c ... 0x02d: /* vcvt[t]s[sd]2si */
+        return b1 >= 2;
+    case 0x013: /* vmovlp[sd] m64, xmm */
+    case 0x017: /* vmovhp[sd] m64, xmm */
+    case 0x02e ... 0x02f: /* v[u]comis[sd] */
+    case 0x050: /* vmovmskp[sd] */
+        return b1 < 2;
+    case 0x07e: /* vmovd r/m32, xmm */
+    case 0x0c5: /* vpextrw */
+    case 0x0d7: /* vpmovmskb */
+    case 0x0f7: /* vmaskmovdqu */
+    case 0x117: /* vptest */
+    case 0x214 ... 0x217: /* vpextr[bwdq], vextractps */
+    case 0x260 ... 0x263: /* vpcmp[ei]str[im] */
+        return b1 == 1;
+    default:
+        return false;
+    }
+}
+
+/*
+ * Translate the VEX-encoded instruction whose opcode (after the implied
+ * leading bytes) is @b.  Return false if gen_sse should decode it instead.
+ */
+static bool gen_avx(CPUX86State *env, DisasContext *s, int b,
+                    target_ulong pc_start, int rex_r)
+{
+    int b1, map, op, modrm, mod, rm, reg, vreg, val, len, i;
+    int d_ofs, v_ofs, m_ofs, flags, msize, shift;
+    int t0_ofs = offsetof(CPUX86State, xmm_t0);
+    bool avx2 = s->cpuid_7_0_ebx_features & CPUID_7_0_EBX_AVX2;
+    SSEFunc_0_epp fn;
+    MemOp ot;
+
+    b &= 0xff;
+    if (s->prefix & PREFIX_DATA) {
+        b1 = 1;
+    } else if (s->prefix & PREFIX_REPZ) {
+        b1 = 2;
+    } else if (s->prefix & PREFIX_REPNZ) {
+        b1 = 3;
+    } else {
+        b1 = 0;
+    }
+    if (b == 0x38 || b == 0x3a) {
+        map = b == 0x38 ? 1 : 2;
+        op = x86_ldub_code(env, s);
+        /* BMI1, BMI2 and RORX only use the general purpose registers.  */
+        if (op >= 0xf0) {
+            s->pc--;
+            return false;
+        }
+    } else {
+        map = 0;
+        op = b;
+    }
+
+    if (!(s->cpuid_ext_features & CPUID_EXT_AVX)
+        || !(s->flags & HF_AVX_EN_MASK)) {
+        goto illegal_op;
+    }
+    if (s->flags & HF_TS_MASK) {
+        gen_exception(s, EXCP07_PREX, pc_start - s->cs_base);
+        return true;
+    }
+    if (!s->vex_l && avx_is_legacy(map, op, b1)) {
+        if (map) {
+            s->pc--;
+        }
+        return false;
+    }
+
+    len = s->vex_l ? 32 : 16;
+    vreg = CODE64(s) ? s->vex_v : s->vex_v & 7;
+    v_ofs = offsetof(CPUX86State, xmm_regs[vreg]);
+
+    if (map == 0 && op == 0x77) {
+        if (b1 != 0) {
+            goto illegal_op;
+        }
+        for (i = 0; i < (CODE64(s) ? 16 : 8); i++) {
+            if (s->vex_l) {
+                /* vzeroall */
+                gen_avx_zero(s, offsetof(CPUX86State, xmm_regs[i]));
+            } else {
+                /* vzeroupper */
+                gen_avx_clear_high(s, offsetof(CPUX86State, xmm_regs[i]));
+            }
+        }
+        return true;
+    }
+
+    modrm = x86_ldub_code(env, s);
+    mod = (modrm >> 6) & 3;
+    rm = (modrm & 7) | REX_B(s);
+    reg = ((modrm >> 3) & 7) | rex_r;
+    d_ofs = offsetof(CPUX86State, xmm_regs[reg]);
+    m_ofs = offsetof(CPUX86State, xmm_regs[rm]);
+    if (map == 2) {
+        s->rip_offset = 1;
+    }
+
+    switch ((map << 8) | op) {
+    case 0x010: /* vmovups, vmovupd, vmovss, vmovsd */
+    case 0x011:
+        if (b1 < 2) {
+            goto do_mov;
+        }
+        msize = b1 == 2 ? 4 : 8;
+        if (op == 0x11 && mod != 3) {
+            gen_lea_modrm(env, s, modrm);
+            if (msize == 4) {
+                tcg_gen_ld_i32(s->tmp2_i32, cpu_env,
+                               d_ofs + offsetof(ZMMReg, ZMM_L(0)));
+                tcg_gen_qemu_st_i32(s->tmp2_i32, s->A0,
+                                    s->mem_index, MO_LEUL);
+            } else {
+                gen_stq_env_A0(s, d_ofs + offsetof(ZMMReg, ZMM_Q(0)));
+            }
+            break;
+        }
+        if (mod != 3) {
+            gen_lea_modrm(env, s, modrm);
+            gen_op_movq_env_0(s, t0_ofs + offsetof(ZMMReg, ZMM_Q(0)));
+            gen_op_movq_env_0(s, t0_ofs + offsetof(ZMMReg, ZMM_Q(1)));
+            gen_avx_ld(s, t0_ofs, msize);
+            gen_avx_mov(s, d_ofs, t0_ofs, 16);
+            break;
+        }
+        /* Register forms merge the low element into vvvv.  */
+        if (op == 0x11) {
+            val = rm;
+            rm = reg;
+            reg = val;
+            d_ofs = offsetof(CPUX86State, xmm_regs[reg]);
+            m_ofs = offsetof(CPUX86State, xmm_regs[rm]);
+        }
+        gen_op_movo(s, t0_ofs, v_ofs);
+        if (msize == 4) {
+            tcg_gen_ld_i32(s->tmp2_i32, cpu_env,
+                           m_ofs + offsetof(ZMMReg, ZMM_L(0)));
+            tcg_gen_st_i32(s->tmp2_i32, cpu_env,
+                           t0_ofs + offsetof(ZMMReg, ZMM_L(0)));
+        } else {
+            gen_op_movq(s, t0_ofs + offsetof(ZMMReg, ZMM_Q(0)),
+                        m_ofs + offsetof(ZMMReg, ZMM_Q(0)));
+        }
+        gen_avx_mov(s, d_ofs, t0_ofs, 16);
+        break;
+
+    case 0x028: /* vmovaps, vmovapd */
+    case 0x029:
+    case 0x02b: /* vmovntps, vmovntpd */
+        if (b1 >= 2) {
+            goto illegal_op;
+        }
+        goto do_mov;
+    case 0x06f: /* vmovdqa, vmovdqu */
+    case 0x07f:
+        if (b1 != 1 && b1 != 2) {
+            goto illegal_op;
+        }
+        goto do_mov;
+    case 0x0f0: /* vlddqu */
+        if (b1 != 3 || mod == 3) {
+            goto illegal_op;
+        }
+        goto do_mov;
+    case 0x0e7: /* vmovntdq */
+    case 0x12a: /* vmovntdqa */
+        if (b1 != 1) {
+            goto illegal_op;
+        }
+        if (mod == 3 || (op == 0x2a && len == 32 && !avx2)) {
+            goto illegal_op;
+        }
+    do_mov:
+        if (op == 0x10 || op == 0x28 || op == 0x6f || op == 0x2a
+            || op == 0xf0) {
+            if (mod == 3) {
+                gen_avx_mov(s, d_ofs, m_ofs, len);
+            } else {
+                gen_lea_modrm(env, s, modrm);
+                if (len == 32) {
+                    gen_ldy_env_A0(s, d_ofs);
+                } else {
+                    gen_ldo_env_A0(s, d_ofs);
+                    gen_avx_clear_high(s, d_ofs);
+                }
+            }
+        } else {
+            if (mod == 3) {
+                if (op == 0x2b) {
+                    goto illegal_op;
+                }
+                gen_avx_mov(s, m_ofs, d_ofs, len);
+            } else {
+                gen_lea_modrm(env, s, modrm);
+                if (len == 32) {
+                    gen_sty_env_A0(s, d_ofs);
+                } else {
+                    gen_sto_env_A0(s, d_ofs);
+                }
+            }
+        }
+        break;
+
+    case 0x012: /* vmovlps, vmovlpd, vmovhlps, vmovsldup, vmovddup */
+    case 0x016: /* vmovhps, vmovhpd, vmovlhps, vmovshdup */
+        if (b1 >= 2) {
+            if (op == 0x16 && b1 == 3) {
+                goto illegal_op;
+            }
+            /* vmovddup only reads the low quadword of each lane.  */
+            if (mod != 3) {
+                gen_lea_modrm(env, s, modrm);
+                gen_avx_ld(s, t0_ofs, b1 == 3 && len == 16 ? 8 : len);
+            } else {
+                gen_avx_mov(s, t0_ofs, m_ofs, len);
+            }
+            for (i = 0; i < len / 16; i++) {
+                int d = ymm_lane_ofs(d_ofs, i);
+                int m = ymm_lane_ofs(t0_ofs, i);
+                int j;
+
+                if (b1 == 3) {
+                    gen_op_movq(s, d + offsetof(ZMMReg, ZMM_Q(0)),
+                                m + offsetof(ZMMReg, ZMM_Q(0)));
+                    gen_op_movq(s, d + offsetof(ZMMReg, ZMM_Q(1)),
+                                m + offsetof(ZMMReg, ZMM_Q(0)));
+                    continue;
+                }
+                /* vmovsldup copies the even elements, vmovshdup the odd */
+                for (j = 0; j < 4; j++) {
+                    int elt = (j & ~1) | (op == 0x16);
+
+                    tcg_gen_ld_i32(s->tmp2_i32, cpu_env,
+                                   m + offsetof(ZMMReg, ZMM_L(elt)));
+                    tcg_gen_st_i32(s->tmp2_i32, cpu_env,
+                                   d + offsetof(ZMMReg, ZMM_L(j)));
+                }
+            }
+            if (len == 16) {
+                gen_avx_clear_high(s, d_ofs);
+            }
+            break;
+        }
+        if (len == 32 || (mod == 3 && b1 == 1)) {
+            goto illegal_op;
+        }
+        /* The 64 bits that come from r/m go to the low or high half.  */
+        shift = op == 0x12 ? 0 : 1;
+        if (mod != 3) {
+            gen_lea_modrm(env, s, modrm);
+            gen_ldq_env_A0(s, t0_ofs + offsetof(ZMMReg, ZMM_Q(shift)));
+        } else {
+            gen_op_movq(s, t0_ofs + offsetof(ZMMReg, ZMM_Q(shift)),
+                        m_ofs + offsetof(ZMMReg, ZMM_Q(shift ^ 1)));
+        }
+        gen_op_movq(s, t0_ofs + offsetof(ZMMReg, ZMM_Q(shift ^ 1)),
+                    v_ofs + offsetof(ZMMReg, ZMM_Q(shift ^ 1)));
+        gen_avx_mov(s, d_ofs, t0_ofs, 16);
+        break;
+
+    case 0x02a: /* vcvtsi2ss, vcvtsi2sd */
+        if (b1 < 2) {
+            goto illegal_op;
+        }
+        ot = mo_64_32(s->dflag);
+        gen_ldst_modrm(env, s, modrm, ot, OR_TMP0, 0);
+        if (reg != vreg) {
+            gen_op_movo(s, d_ofs, v_ofs);
+        }
+        tcg_gen_addi_ptr(s->ptr0, cpu_env, d_ofs);
+        if (ot == MO_32) {
+            SSEFunc_0_epi sse_fn_epi = sse_op_table3ai[b1 & 1];
+            tcg_gen_trunc_tl_i32(s->tmp2_i32, s->T0);
+            sse_fn_epi(cpu_env, s->ptr0, s->tmp2_i32);
+        } else {
+#ifdef TARGET_X86_64
+            SSEFunc_0_epl sse_fn_epl = sse_op_table3aq[b1 & 1];
+            sse_fn_epl(cpu_env, s->ptr0, s->T0);
+#else
+            goto illegal_op;
+#endif
+        }
+        gen_avx_clear_high(s, d_ofs);
+        break;
+
+    case 0x050: /* vmovmskps, vmovmskpd (VEX.256) */
+    case 0x0d7: /* vpmovmskb (VEX.256) */
+        if (mod != 3 || len == 16
+            || (op == 0x50 ? b1 >= 2 : b1 != 1 || !avx2)) {
+            goto illegal_op;
+        }
+        for (i = 0; i < 2; i++) {
+            tcg_gen_addi_ptr(s->ptr0, cpu_env, ymm_lane_ofs(m_ofs, i));
+            if (op == 0xd7) {
+                gen_helper_pmovmskb_xmm(s->tmp2_i32, cpu_env, s->ptr0);
+            } else if (b1) {
+                gen_helper_movmskpd(s->tmp2_i32, cpu_env, s->ptr0);
+            } else {
+                gen_helper_movmskps(s->tmp2_i32, cpu_env, s->ptr0);
+            }
+            tcg_gen_extu_i32_tl(i ? s->T1 : s->T0, s->tmp2_i32);
+        }
+        shift = op == 0xd7 ? 16 : b1 ? 2 : 4;
+        tcg_gen_shli_tl(s->T1, s->T1, shift);
+        tcg_gen_or_tl(cpu_regs[reg], s->T0, s->T1);
+        break;
+
+    case 0x06e: /* vmovd, vmovq xmm, r/m */
+        if (b1 != 1 || len == 32) {
+            goto illegal_op;
+        }
+        ot = mo_64_32(s->dflag);
+        gen_ldst_modrm(env, s, modrm, ot, OR_TMP0, 0);
+        gen_avx_zero(s, d_ofs);
+        if (ot == MO_32) {
+            tcg_gen_st32_tl(s->T0, cpu_env,
+                            d_ofs + offsetof(ZMMReg, ZMM_L(0)));
+        } else {
+            tcg_gen_st_tl(s->T0, cpu_env,
+                          d_ofs + offsetof(ZMMReg, ZMM_Q(0)));
+        }
+        break;
+
+    case 0x07e: /* vmovq xmm, xmm/m64 */
+        if (b1 != 2 || len == 32) {
+            goto illegal_op;
+        }
+        if (mod != 3) {
+            gen_lea_modrm(env, s, modrm);
+            gen_ldq_env_A0(s, t0_ofs + offsetof(ZMMReg, ZMM_Q(0)));
+            m_ofs = t0_ofs;
+        }
+        gen_op_movq(s, d_ofs + offsetof(ZMMReg, ZMM_Q(0)),
+                    m_ofs + offsetof(ZMMReg, ZMM_Q(0)));
+        gen_op_movq_env_0(s, d_ofs + offsetof(ZMMReg, ZMM_Q(1)));
+        gen_avx_clear_high(s, d_ofs);
+        break;
+
+    case 0x0d6: /* vmovq xmm/m64, xmm */
+        if (b1 != 1 || len == 32) {
+            goto illegal_op;
+        }
+        if (mod != 3) {
+            gen_lea_modrm(env, s, modrm);
+            gen_stq_env_A0(s, d_ofs + offsetof(ZMMReg, ZMM_Q(0)));
+        } else {
+            gen_op_movq(s, m_ofs + offsetof(ZMMReg, ZMM_Q(0)),
+                        d_ofs + offsetof(ZMMReg, ZMM_Q(0)));
+            gen_op_movq_env_0(s, m_ofs + offsetof(ZMMReg, ZMM_Q(1)));
+            gen_avx_clear_high(s, m_ofs);
+        }
+        break;
+
+    case 0x0c4: /* vpinsrw */
+        if (b1 != 1 || len == 32) {
+            goto illegal_op;
+        }
+        s->rip_offset = 1;
+        gen_ldst_modrm(env, s, modrm, MO_16, OR_TMP0, 0);
+        val = x86_ldub_code(env, s);
+        if (reg != vreg) {
+            gen_op_movo(s, d_ofs, v_ofs);
+        }
+        tcg_gen_st16_tl(s->T0, cpu_env,
+                        d_ofs + offsetof(ZMMReg, ZMM_W(val & 7)));
+        gen_avx_clear_high(s, d_ofs);
+        break;
+
+    case 0x071: /* shift xmm, imm */
+    case 0x072:
+    case 0x073:
+        if (b1 != 1 || mod != 3 || (len == 32 && !avx2)) {
+            goto illegal_op;
+        }
+        val = x86_ldub_code(env, s);
+        /* Here vvvv is the destination and r/m the source.  */
+        shift = (modrm >> 3) & 7;
+        if (op == 0x73 && (shift == 3 || shift == 7)) {
+            /* vpsrldq, vpslldq */
+            tcg_gen_movi_tl(s->T0, val);
+            tcg_gen_st32_tl(s->T0, cpu_env,
+                            t0_ofs + offsetof(ZMMReg, ZMM_L(0)));
+            tcg_gen_movi_tl(s->T0, 0);
+            tcg_gen_st32_tl(s->T0, cpu_env,
+                            t0_ofs + offsetof(ZMMReg, ZMM_L(1)));
+            gen_avx_lanes(s, sse_op_table2[16 + shift][1],
+                          AVX_NDS | AVX_M_LOW, 0, 0,
+                          v_ofs, m_ofs, t0_ofs, len);
+            break;
+        } else {
+            MemOp vece = op - 0x71 + MO_16;
+            int bits = 8 << vece;
+            uint32_t gd = sse_gvec_ofs(v_ofs, len);
+            uint32_t gm = sse_gvec_ofs(m_ofs, len);
+
+            switch (shift) {
+            case 2:
+                if (val >= bits) {
+                    tcg_gen_gvec_dup_imm(MO_64, gd, len, len, 0);
+                } else {
+                    tcg_gen_gvec_shri(vece, gd, gm, val, len, len);
+                }
+                break;
+            case 4:
+                if (op == 0x73) {
+                    goto illegal_op;
+                }
+                tcg_gen_gvec_sari(vece, gd, gm, MIN(val, bits - 1),
+                                  len, len);
+                break;
+            case 6:
+                if (val >= bits) {
+                    tcg_gen_gvec_dup_imm(MO_64, gd, len, len, 0);
+                } else {
+                    tcg_gen_gvec_shli(vece, gd, gm, val, len, len);
+                }
+                break;
+            default:
+                goto illegal_op;
+            }
+        }
+        if (len == 16) {
+            gen_avx_clear_high(s, v_ofs);
+        }
+        break;
+
+    case 0x10e: /* vtestps */
+    case 0x10f: /* vtestpd */
+    case 0x117: /* vptest (VEX.256) */
+        if (b1 != 1) {
+            goto illegal_op;
+        }
+        if (mod != 3) {
+            gen_lea_modrm(env, s, modrm);
+            gen_avx_ld(s, t0_ofs, len);
+            m_ofs = t0_ofs;
+        }
+        fn = op == 0x0e ? gen_helper_vtestps_xmm
+             : op == 0x0f ? gen_helper_vtestpd_xmm : gen_helper_ptest_xmm;
+        for (i = 0; i < len / 16; i++) {
+            tcg_gen_addi_ptr(s->ptr0, cpu_env, ymm_lane_ofs(d_ofs, i));
+            tcg_gen_addi_ptr(s->ptr1, cpu_env, ymm_lane_ofs(m_ofs, i));
+            fn(cpu_env, s->ptr0, s->ptr1);
+            if (i == 0) {
+                tcg_gen_mov_tl(s->T0, cpu_cc_src);
+            }
+        }
+        /* ZF and CF are set if they are set for both lanes.  */
+        tcg_gen_and_tl(cpu_cc_src, cpu_cc_src, s->T0);
+        set_cc_op(s, CC_OP_EFLAGS);
+        break;
+
+    case 0x05a: /* vcvtps2pd, vcvtpd2ps */
+    case 0x0e6: /* vcvttpd2dq, vcvtdq2pd, vcvtpd2dq */
+        if (op == 0x5a && b1 >= 2) {
+            goto do_lanes;
+        }
+        if (op == 0xe6 && b1 == 0) {
+            goto illegal_op;
+        }
+        fn = sse_op_table1[op][b1];
+        if (op == 0x5a ? b1 == 0 : b1 == 2) {
+            /* Widening: each lane converts half of the 128-bit source.  */
+            if (mod != 3) {
+                gen_lea_modrm(env, s, modrm);
+                gen_avx_ld(s, t0_ofs, len / 2);
+            } else {
+                gen_op_movo(s, t0_ofs, m_ofs);
+            }
+            if (len == 32) {
+                gen_op_movq(s, ymm_lane_ofs(t0_ofs, 1)
+                            + offsetof(ZMMReg, ZMM_Q(0)),
+                            t0_ofs + offsetof(ZMMReg, ZMM_Q(1)));
+            }
+            gen_avx_lanes(s, fn, 0, 0, 0, d_ofs, d_ofs, t0_ofs, len);
+            break;
+        }
+        /* Narrowing: each lane yields 64 bits of the xmm result.  */
+        if (mod != 3) {
+            gen_lea_modrm(env, s, modrm);
+            gen_avx_ld(s, t0_ofs, len);
+        } else {
+            gen_avx_mov(s, t0_ofs, m_ofs, len);
+        }
+        for (i = 0; i < len / 16; i++) {
+            tcg_gen_addi_ptr(s->ptr0, cpu_env, ymm_lane_ofs(t0_ofs, i));
+            fn(cpu_env, s->ptr0, s->ptr0);
+        }
+        if (len == 32) {
+            gen_op_movq(s, t0_ofs + offsetof(ZMMReg, ZMM_Q(1)),
+                        ymm_lane_ofs(t0_ofs, 1) + offsetof(ZMMReg, ZMM_Q(0)));
+        }
+        gen_avx_mov(s, d_ofs, t0_ofs, 16);
+        break;
+
+    case 0x118: /* vbroadcastss */
+    case 0x119: /* vbroadcastsd */
+    case 0x158: /* vpbroadcastd */
+    case 0x159: /* vpbroadcastq */
+    case 0x178: /* vpbroadcastb */
+    case 0x179: /* vpbroadcastw */
+        {
+            MemOp vece;
+            int elt;
+
+            switch (op) {
+            case 0x18:
+            case 0x58:
+                vece = MO_32;
+                elt = offsetof(ZMMReg, ZMM_L(0));
+                break;
+            case 0x19:
+            case 0x59:
+                vece = MO_64;
+                elt = offsetof(ZMMReg, ZMM_Q(0));
+                break;
+            case 0x78:
+                vece = MO_8;
+                elt = offsetof(ZMMReg, ZMM_B(0));
+                break;
+            default:
+                vece = MO_16;
+                elt = offsetof(ZMMReg, ZMM_W(0));
+                break;
+            }
+            if (b1 != 1 || (op == 0x19 && len == 16)
+                || ((op >= 0x58 || mod == 3) && !avx2)) {
+                goto illegal_op;
+            }
+            if (mod != 3) {
+                gen_lea_modrm(env, s, modrm);
+                gen_avx_ld(s, t0_ofs, 1 << vece);
+                m_ofs = t0_ofs;
+            }
+            tcg_gen_gvec_dup_mem(vece, sse_gvec_ofs(d_ofs, len), m_ofs + elt,
+                                 len, len);
+            if (len == 16) {
+                gen_avx_clear_high(s, d_ofs);
+            }
+        }
+        break;
+
+    case 0x10c: /* vpermilps */
+    case 0x10d: /* vpermilpd */
+        if (b1 != 1) {
+            goto illegal_op;
+        }
+        if (mod != 3) {
+            gen_lea_modrm(env, s, modrm);
+            gen_avx_ld(s, t0_ofs, len);
+            m_ofs = t0_ofs;
+        } else if (rm == reg && vreg != reg) {
+            gen_avx_mov(s, t0_ofs, m_ofs, 32);
+            m_ofs = t0_ofs;
+        }
+        gen_avx_lanes(s, op == 0x0c ? gen_helper_vpermilps_xmm
+                      : gen_helper_vpermilpd_xmm,
+                      AVX_NDS, 0, 0, d_ofs, v_ofs, m_ofs, len);
+        break;
+
+    case 0x204: /* vpermilps imm */
+    case 0x205: /* vpermilpd imm */
+        if (b1 != 1) {
+            goto illegal_op;
+        }
+        if (mod != 3) {
+            gen_lea_modrm(env, s, modrm);
+            gen_avx_ld(s, t0_ofs, len);
+            m_ofs = t0_ofs;
+        }
+        val = x86_ldub_code(env, s);
+        /* vpermilps uses the same selectors in each lane, like vpshufd */
+        gen_avx_lanes(s, op == 0x04
+                      ? (SSEFunc_0_epp)gen_helper_pshufd_xmm
+                      : (SSEFunc_0_epp)gen_helper_vpermilpd_imm_xmm,
+                      AVX_IMM | AVX_IMM_NOENV, val, op == 0x04 ? 0 : 2,
+                      d_ofs, v_ofs, m_ofs, len);
+        break;
+
+    case 0x24a: /* vblendvps */
+    case 0x24b: /* vblendvpd */
+    case 0x24c: /* vpblendvb */
+        {
+            MemOp vece = op == 0x4a ? MO_32 : op == 0x4b ? MO_64 : MO_8;
+            /* Lanes 2-3 of xmm_t0 hold the mask, lanes 0-1 the r/m operand */
+            int mask_ofs = ymm_lane_ofs(t0_ofs, 2);
+            int is4;
+
+            if (b1 != 1 || (op == 0x4c && len == 32 && !avx2)) {
+                goto illegal_op;
+            }
+            if (mod != 3) {
+                gen_lea_modrm(env, s, modrm);
+                gen_avx_ld(s, t0_ofs, len);
+                m_ofs = t0_ofs;
+            }
+            is4 = x86_ldub_code(env, s) >> 4;
+            if (!CODE64(s)) {
+                is4 &= 7;
+            }
+            /* Spread the sign bit of each mask element over the element */
+            tcg_gen_gvec_sari(vece, sse_gvec_ofs(mask_ofs, len),
+                              sse_gvec_ofs(offsetof(CPUX86State,
+                                                    xmm_regs[is4]), len),
+                              (8 << vece) - 1, len, len);
+            tcg_gen_gvec_bitsel(MO_64, sse_gvec_ofs(d_ofs, len),
+                                sse_gvec_ofs(mask_ofs, len),
+                                sse_gvec_ofs(m_ofs, len),
+                                sse_gvec_ofs(v_ofs, len), len, len);
+            if (len == 16) {
+                gen_avx_clear_high(s, d_ofs);
+            }
+        }
+        break;
+
+    case 0x12c: /* vmaskmovps m, load */
+    case 0x12d: /* vmaskmovpd m, load */
+    case 0x12e: /* vmaskmovps m, store */
+    case 0x12f: /* vmaskmovpd m, store */
+        {
+            static SSEFunc_0_eppt const maskmov_fn[4] = {
+                gen_helper_vmaskmovps_ld_xmm, gen_helper_vmaskmovpd_ld_xmm,
+                gen_helper_vmaskmovps_st_xmm, gen_helper_vmaskmovpd_st_xmm,
+            };
+            bool load = op < 0x2e;
+
+            if (b1 != 1 || mod == 3) {
+                goto illegal_op;
+            }
+            gen_lea_modrm(env, s, modrm);
+            /*
+             * Loads go through xmm_t0, so that a fault in the upper lane
+             * leaves the destination, which may also be the mask, alone.
+             */
+            for (i = 0; i < len / 16; i++) {
+                tcg_gen_addi_ptr(s->ptr0, cpu_env,
+                                 ymm_lane_ofs(load ? t0_ofs : d_ofs, i));
+                tcg_gen_addi_ptr(s->ptr1, cpu_env, ymm_lane_ofs(v_ofs, i));
+                tcg_gen_addi_tl(s->tmp0, s->A0, i * 16);
+                maskmov_fn[op - 0x2c](cpu_env, s->ptr0, s->ptr1, s->tmp0);
+            }
+            if (load) {
+                gen_avx_mov(s, d_ofs, t0_ofs, len);
+            }
+        }
+        break;
+
+    case 0x11a: /* vbroadcastf128 */
+    case 0x15a: /* vbroadcasti128 */
+        if (b1 != 1 || mod == 3 || len == 16 || (op == 0x5a && !avx2)) {
+            goto illegal_op;
+        }
+        gen_lea_modrm(env, s, modrm);
+        gen_ldo_env_A0(s, t0_ofs);
+        gen_op_movo(s, d_ofs, t0_ofs);
+        gen_op_movo(s, ymm_lane_ofs(d_ofs, 1), t0_ofs);
+        break;
+
+    case 0x120 ... 0x125: /* vpmovsx* */
+    case 0x130 ... 0x135: /* vpmovzx* */
+        {
+            /* Widening factor: 2 for bw, wd, dq; 4 for bd, wq; 8 for bq */
+            static const uint8_t ratio[6] = { 2, 4, 8, 2, 4, 2 };
+            int src_size = len / ratio[op & 7];
+            int half = src_size / 2;
+
+            if (b1 != 1 || (len == 32 && !avx2)) {
+                goto illegal_op;
+            }
+            if (mod != 3) {
+                gen_lea_modrm(env, s, modrm);
+                gen_avx_ld(s, t0_ofs, src_size);
+            } else if (len == 32) {
+                gen_op_movo(s, t0_ofs, m_ofs);
+            } else {
+                t0_ofs = m_ofs;
+            }
+            if (len == 32) {
+                /* The upper lane widens the upper half of the source.  */
+                switch (half) {
+                case 8:
+                    gen_op_movq(s, t0_ofs + offsetof(ZMMReg, ZMM_Q(2)),
+                                t0_ofs + offsetof(ZMMReg, ZMM_Q(1)));
+                    break;
+                case 4:
+                    tcg_gen_ld_i32(s->tmp2_i32, cpu_env,
+                                   t0_ofs + offsetof(ZMMReg, ZMM_L(1)));
+                    tcg_gen_st_i32(s->tmp2_i32, cpu_env,
+                                   t0_ofs + offsetof(ZMMReg, ZMM_L(4)));
+                    break;
+                default:
+                    tcg_gen_ld16u_i32(s->tmp2_i32, cpu_env,
+                                      t0_ofs + offsetof(ZMMReg, ZMM_W(1)));
+                    tcg_gen_st16_i32(s->tmp2_i32, cpu_env,
+                                     t0_ofs + offsetof(ZMMReg, ZMM_W(8)));
+                    break;
+                }
+            }
+            gen_avx_lanes(s, sse_op_table6[op].op[1], 0, 0, 0,
+                          d_ofs, d_ofs, t0_ofs, len);
+        }
+        break;
+
+    case 0x200: /* vpermq */
+    case 0x201: /* vpermpd */
+        if (b1 != 1 || len == 16 || !avx2) {
+            goto illegal_op;
+        }
+        if (mod != 3) {
+            gen_lea_modrm(env, s, modrm);
+            gen_ldy_env_A0(s, t0_ofs);
+        } else {
+            gen_avx_mov(s, t0_ofs, m_ofs, 32);
+        }
+        val = x86_ldub_code(env, s);
+        for (i = 0; i < 4; i++) {
+            gen_op_movq(s, d_ofs + offsetof(ZMMReg, ZMM_Q(i)),
+                        t0_ofs + offsetof(ZMMReg,
+                                          ZMM_Q((val >> (i * 2)) & 3)));
+        }
+        break;
+
+    case 0x202: /* vpblendd */
+        if (b1 != 1 || !avx2) {
+            goto illegal_op;
+        }
+        if (mod != 3) {
+            gen_lea_modrm(env, s, modrm);
+            gen_avx_ld(s, t0_ofs, len);
+            m_ofs = t0_ofs;
+        }
+        val = x86_ldub_code(env, s);
+        for (i = 0; i < len / 4; i++) {
+            tcg_gen_ld_i32(s->tmp2_i32, cpu_env,
+                           ((val >> i) & 1 ? m_ofs : v_ofs)
+                           + offsetof(ZMMReg, ZMM_L(i)));
+            tcg_gen_st_i32(s->tmp2_i32, cpu_env,
+                           d_ofs + offsetof(ZMMReg, ZMM_L(i)));
+        }
+        if (len == 16) {
+            gen_avx_clear_high(s, d_ofs);
+        }
+        break;
 
-#ifdef TARGET_X86_64
-static const SSEFunc_l_ep sse_op_table3bq[] = {
-    gen_helper_cvttss2sq,
-    gen_helper_cvtss2sq,
-    gen_helper_cvttsd2sq,
-    gen_helper_cvtsd2sq
-};
-#endif
+    case 0x206: /* vperm2f128 */
+    case 0x246: /* vperm2i128 */
+        if (b1 != 1 || len == 16 || (op == 0x46 && !avx2)) {
+            goto illegal_op;
+        }
+        /* Gather the sources as lanes 0-1 (r/m) and 2-3 (vvvv) of xmm_t0 */
+        if (mod != 3) {
+            gen_lea_modrm(env, s, modrm);
+            gen_ldy_env_A0(s, t0_ofs);
+        } else {
+            gen_avx_mov(s, t0_ofs, m_ofs, 32);
+        }
+        gen_op_movo(s, ymm_lane_ofs(t0_ofs, 2), v_ofs);
+        gen_op_movo(s, ymm_lane_ofs(t0_ofs, 3), ymm_lane_ofs(v_ofs, 1));
+        val = x86_ldub_code(env, s);
+        for (i = 0; i < 2; i++) {
+            int sel = (val >> (i * 4)) & 0xf;
+            int lane = ymm_lane_ofs(d_ofs, i);
 
-static const SSEFunc_0_epp sse_op_table4[8][4] = {
-    SSE_FOP(cmpeq),
-    SSE_FOP(cmplt),
-    SSE_FOP(cmple),
-    SSE_FOP(cmpunord),
-    SSE_FOP(cmpneq),
-    SSE_FOP(cmpnlt),
-    SSE_FOP(cmpnle),
-    SSE_FOP(cmpord),
-};
+            if (sel & 8) {
+                gen_op_movq_env_0(s, lane + offsetof(ZMMReg, ZMM_Q(0)));
+                gen_op_movq_env_0(s, lane + offsetof(ZMMReg, ZMM_Q(1)));
+            } else {
+                gen_op_movo(s, lane, ymm_lane_ofs(t0_ofs, (sel & 3) ^ 2));
+            }
+        }
+        break;
 
-static const SSEFunc_0_epp sse_op_table5[256] = {
-    [0x0c] = gen_helper_pi2fw,
-    [0x0d] = gen_helper_pi2fd,
-    [0x1c] = gen_helper_pf2iw,
-    [0x1d] = gen_helper_pf2id,
-    [0x8a] = gen_helper_pfnacc,
-    [0x8e] = gen_helper_pfpnacc,
-    [0x90] = gen_helper_pfcmpge,
-    [0x94] = gen_helper_pfmin,
-    [0x96] = gen_helper_pfrcp,
-    [0x97] = gen_helper_pfrsqrt,
-    [0x9a] = gen_helper_pfsub,
-    [0x9e] = gen_helper_pfadd,
-    [0xa0] = gen_helper_pfcmpgt,
-    [0xa4] = gen_helper_pfmax,
-    [0xa6] = gen_helper_movq, /* pfrcpit1; no need to actually increase precision */
-    [0xa7] = gen_helper_movq, /* pfrsqit1 */
-    [0xaa] = gen_helper_pfsubr,
-    [0xae] = gen_helper_pfacc,
-    [0xb0] = gen_helper_pfcmpeq,
-    [0xb4] = gen_helper_pfmul,
-    [0xb6] = gen_helper_movq, /* pfrcpit2 */
-    [0xb7] = gen_helper_pmulhrw_mmx,
-    [0xbb] = gen_helper_pswapd,
-    [0xbf] = gen_helper_pavgb_mmx /* pavgusb */
-};
+    case 0x218: /* vinsertf128 */
+    case 0x238: /* vinserti128 */
+        if (b1 != 1 || len == 16 || (op == 0x38 && !avx2)) {
+            goto illegal_op;
+        }
+        if (mod != 3) {
+            gen_lea_modrm(env, s, modrm);
+            gen_ldo_env_A0(s, t0_ofs);
+        } else {
+            gen_op_movo(s, t0_ofs, m_ofs);
+        }
+        val = x86_ldub_code(env, s);
+        if (reg != vreg) {
+            gen_avx_mov(s, d_ofs, v_ofs, 32);
+        }
+        gen_op_movo(s, ymm_lane_ofs(d_ofs, val & 1), t0_ofs);
+        break;
 
-struct SSEOpHelper_epp {
-    SSEFunc_0_epp op[2];
-    uint32_t ext_mask;
-};
+    case 0x219: /* vextractf128 */
+    case 0x239: /* vextracti128 */
+        if (b1 != 1 || len == 16 || (op == 0x39 && !avx2)) {
+            goto illegal_op;
+        }
+        if (mod != 3) {
+            gen_lea_modrm(env, s, modrm);
+        }
+        val = x86_ldub_code(env, s);
+        if (mod != 3) {
+            gen_sto_env_A0(s, ymm_lane_ofs(d_ofs, val & 1));
+        } else {
+            gen_op_movo(s, m_ofs, ymm_lane_ofs(d_ofs, val & 1));
+            gen_avx_clear_high(s, m_ofs);
+        }
+        break;
 
-struct SSEOpHelper_eppi {
-    SSEFunc_0_eppi op[2];
-    uint32_t ext_mask;
-};
+    case 0x220: /* vpinsrb */
+    case 0x221: /* vinsertps */
+    case 0x222: /* vpinsrd, vpinsrq */
+        if (b1 != 1 || len == 32) {
+            goto illegal_op;
+        }
+        if (mod != 3) {
+            gen_lea_modrm(env, s, modrm);
+        }
+        val = x86_ldub_code(env, s);
+        ot = mo_64_32(s->dflag);
+        /* Load the inserted element before vvvv overwrites a source.  */
+        if (op == 0x20) {
+            if (mod == 3) {
+                gen_op_mov_v_reg(s, MO_32, s->T0, rm);
+            } else {
+                tcg_gen_qemu_ld_tl(s->T0, s->A0, s->mem_index, MO_UB);
+            }
+        } else if (op == 0x21) {
+            if (mod == 3) {
+                tcg_gen_ld_i32(s->tmp2_i32, cpu_env,
+                               m_ofs + offsetof(ZMMReg,
+                                                ZMM_L((val >> 6) & 3)));
+            } else {
+                tcg_gen_qemu_ld_i32(s->tmp2_i32, s->A0,
+                                    s->mem_index, MO_LEUL);
+            }
+        } else if (ot == MO_32) {
+            if (mod == 3) {
+                tcg_gen_trunc_tl_i32(s->tmp2_i32, cpu_regs[rm]);
+            } else {
+                tcg_gen_qemu_ld_i32(s->tmp2_i32, s->A0,
+                                    s->mem_index, MO_LEUL);
+            }
+        } else {
+#ifdef TARGET_X86_64
+            if (mod == 3) {
+                gen_op_mov_v_reg(s, ot, s->tmp1_i64, rm);
+            } else {
+                tcg_gen_qemu_ld_i64(s->tmp1_i64, s->A0,
+                                    s->mem_index, MO_LEQ);
+            }
+            /* gen_op_movo clobbers tmp1_i64 */
+            tcg_gen_st_i64(s->tmp1_i64, cpu_env,
+                           t0_ofs + offsetof(ZMMReg, ZMM_Q(0)));
+#else
+            goto illegal_op;
+#endif
+        }
+        if (reg != vreg) {
+            gen_op_movo(s, d_ofs, v_ofs);
+        }
+        if (op == 0x20) {
+            tcg_gen_st8_tl(s->T0, cpu_env,
+                           d_ofs + offsetof(ZMMReg, ZMM_B(val & 15)));
+        } else if (op == 0x21) {
+            tcg_gen_st_i32(s->tmp2_i32, cpu_env,
+                           d_ofs + offsetof(ZMMReg, ZMM_L((val >> 4) & 3)));
+            tcg_gen_movi_i32(s->tmp2_i32, 0);
+            for (i = 0; i < 4; i++) {
+                if ((val >> i) & 1) {
+                    tcg_gen_st_i32(s->tmp2_i32, cpu_env,
+                                   d_ofs + offsetof(ZMMReg, ZMM_L(i)));
+                }
+            }
+        } else if (ot == MO_32) {
+            tcg_gen_st_i32(s->tmp2_i32, cpu_env,
+                           d_ofs + offsetof(ZMMReg, ZMM_L(val & 3)));
+        } else {
+            tcg_gen_ld_i64(s->tmp1_i64, cpu_env,
+                           t0_ofs + offsetof(ZMMReg, ZMM_Q(0)));
+            tcg_gen_st_i64(s->tmp1_i64, cpu_env,
+                           d_ofs + offsetof(ZMMReg, ZMM_Q(val & 1)));
+        }
+        gen_avx_clear_high(s, d_ofs);
+        break;
 
-#define SSSE3_OP(x) { MMX_OP2(x), CPUID_EXT_SSSE3 }
-#define SSE41_OP(x) { { NULL, gen_helper_ ## x ## _xmm }, CPUID_EXT_SSE41 }
-#define SSE42_OP(x) { { NULL, gen_helper_ ## x ## _xmm }, CPUID_EXT_SSE42 }
-#define SSE41_SPECIAL { { NULL, SSE_SPECIAL }, CPUID_EXT_SSE41 }
-#define PCLMULQDQ_OP(x) { { NULL, gen_helper_ ## x ## _xmm }, \
-        CPUID_EXT_PCLMULQDQ }
-#define AESNI_OP(x) { { NULL, gen_helper_ ## x ## _xmm }, CPUID_EXT_AES }
+    default:
+    do_lanes:
+        /* Ops that apply an SSE helper lane by lane. */
+        shift = 0;
+        if (map == 0) {
+            flags = avx_table1_flags(op, b1);
+            fn = flags < 0 ? NULL : sse_op_table1[op][b1];
+            msize = b1 == 2 ? 4 : 8;
+            if (op == 0xc6 && b1 == 1) {
+                shift = 2;
+            }
+        } else {
+            const struct SSEOpHelper_epp *op6 = &sse_op_table6[op];
+            const struct SSEOpHelper_eppi *op7 = &sse_op_table7[op];
+            uint32_t ext_mask = map == 1 ? op6->ext_mask : op7->ext_mask;
 
-static const struct SSEOpHelper_epp sse_op_table6[256] = {
-    [0x00] = SSSE3_OP(pshufb),
-    [0x01] = SSSE3_OP(phaddw),
-    [0x02] = SSSE3_OP(phaddd),
-    [0x03] = SSSE3_OP(phaddsw),
-    [0x04] = SSSE3_OP(pmaddubsw),
-    [0x05] = SSSE3_OP(phsubw),
-    [0x06] = SSSE3_OP(phsubd),
-    [0x07] = SSSE3_OP(phsubsw),
-    [0x08] = SSSE3_OP(psignb),
-    [0x09] = SSSE3_OP(psignw),
-    [0x0a] = SSSE3_OP(psignd),
-    [0x0b] = SSSE3_OP(pmulhrsw),
-    [0x10] = SSE41_OP(pblendvb),
-    [0x14] = SSE41_OP(blendvps),
-    [0x15] = SSE41_OP(blendvpd),
-    [0x17] = SSE41_OP(ptest),
-    [0x1c] = SSSE3_OP(pabsb),
-    [0x1d] = SSSE3_OP(pabsw),
-    [0x1e] = SSSE3_OP(pabsd),
-    [0x20] = SSE41_OP(pmovsxbw),
-    [0x21] = SSE41_OP(pmovsxbd),
-    [0x22] = SSE41_OP(pmovsxbq),
-    [0x23] = SSE41_OP(pmovsxwd),
-    [0x24] = SSE41_OP(pmovsxwq),
-    [0x25] = SSE41_OP(pmovsxdq),
-    [0x28] = SSE41_OP(pmuldq),
-    [0x29] = SSE41_OP(pcmpeqq),
-    [0x2a] = SSE41_SPECIAL, /* movntqda */
-    [0x2b] = SSE41_OP(packusdw),
-    [0x30] = SSE41_OP(pmovzxbw),
-    [0x31] = SSE41_OP(pmovzxbd),
-    [0x32] = SSE41_OP(pmovzxbq),
-    [0x33] = SSE41_OP(pmovzxwd),
-    [0x34] = SSE41_OP(pmovzxwq),
-    [0x35] = SSE41_OP(pmovzxdq),
-    [0x37] = SSE42_OP(pcmpgtq),
-    [0x38] = SSE41_OP(pminsb),
-    [0x39] = SSE41_OP(pminsd),
-    [0x3a] = SSE41_OP(pminuw),
-    [0x3b] = SSE41_OP(pminud),
-    [0x3c] = SSE41_OP(pmaxsb),
-    [0x3d] = SSE41_OP(pmaxsd),
-    [0x3e] = SSE41_OP(pmaxuw),
-    [0x3f] = SSE41_OP(pmaxud),
-    [0x40] = SSE41_OP(pmulld),
-    [0x41] = SSE41_OP(phminposuw),
-    [0xdb] = AESNI_OP(aesimc),
-    [0xdc] = AESNI_OP(aesenc),
-    [0xdd] = AESNI_OP(aesenclast),
-    [0xde] = AESNI_OP(aesdec),
-    [0xdf] = AESNI_OP(aesdeclast),
-};
+            flags = map == 1 ? avx_table6_flags(op) : avx_table7_flags(op);
+            fn = map == 1 ? op6->op[1] : (SSEFunc_0_epp)op7->op[1];
+            if (b1 != 1 || !(s->cpuid_ext_features & ext_mask)) {
+                flags = -1;
+            }
+            msize = op == 0x0a ? 4 : 8;
+            shift = op == 0x0c ? 4 : op == 0x0d ? 2 : op == 0x42 ? 3 : 0;
+        }
+        if (flags < 0 || !fn || fn == SSE_SPECIAL) {
+            goto illegal_op;
+        }
+        if (flags & AVX_SCALAR) {
+            len = 16;
+        } else if (len == 32) {
+            if (!(flags & AVX_256) || ((flags & AVX_AVX2) && !avx2)) {
+                goto illegal_op;
+            }
+        }
+        if (!(flags & AVX_SCALAR)) {
+            msize = flags & AVX_M128 ? 16 : len;
+        }
+        if (flags & AVX_IMM) {
+            s->rip_offset = 1;
+        }
+        if (mod != 3) {
+            gen_lea_modrm(env, s, modrm);
+            gen_avx_ld(s, t0_ofs, msize);
+            m_ofs = t0_ofs;
+        } else if (rm == reg && (((flags & AVX_NDS) && vreg != reg)
+                                 || ((flags & AVX_M_LOW) && len == 32))) {
+            gen_op_movo(s, t0_ofs, m_ofs);
+            if (len == 32) {
+                gen_op_movo(s, ymm_lane_ofs(t0_ofs, 1),
+                            ymm_lane_ofs(m_ofs, 1));
+            }
+            m_ofs = t0_ofs;
+        }
+        val = 0;
+        if (flags & AVX_IMM) {
+            val = x86_ldub_code(env, s);
+        }
+        if (map == 0 && op == 0xc2) {
+            /* The helper takes the predicate.  */
+            fn = (SSEFunc_0_epp)sse_op_table4_vex[b1];
+            val &= 31;
+        }
+        if (!(flags & (AVX_IMM | AVX_SCALAR))
+            && (map == 0 ? gen_sse_gvec(op, len, d_ofs, v_ofs, m_ofs)
+                : gen_sse_gvec_0f38(op, len, d_ofs, v_ofs, m_ofs))) {
+            if (len == 16) {
+                gen_avx_clear_high(s, d_ofs);
+            }
+            break;
+        }
+        gen_avx_lanes(s, fn, flags, val, shift, d_ofs, v_ofs, m_ofs, len);
+        break;
+    }
+    return true;
 
-static const struct SSEOpHelper_eppi sse_op_table7[256] = {
-    [0x08] = SSE41_OP(roundps),
-    [0x09] = SSE41_OP(roundpd),
-    [0x0a] = SSE41_OP(roundss),
-    [0x0b] = SSE41_OP(roundsd),
-    [0x0c] = SSE41_OP(blendps),
-    [0x0d] = SSE41_OP(blendpd),
-    [0x0e] = SSE41_OP(pblendw),
-    [0x0f] = SSSE3_OP(palignr),
-    [0x14] = SSE41_SPECIAL, /* pextrb */
-    [0x15] = SSE41_SPECIAL, /* pextrw */
-    [0x16] = SSE41_SPECIAL, /* pextrd/pextrq */
-    [0x17] = SSE41_SPECIAL, /* extractps */
-    [0x20] = SSE41_SPECIAL, /* pinsrb */
-    [0x21] = SSE41_SPECIAL, /* insertps */
-    [0x22] = SSE41_SPECIAL, /* pinsrd/pinsrq */
-    [0x40] = SSE41_OP(dpps),
-    [0x41] = SSE41_OP(dppd),
-    [0x42] = SSE41_OP(mpsadbw),
-    [0x44] = PCLMULQDQ_OP(pclmulqdq),
-    [0x60] = SSE42_OP(pcmpestrm),
-    [0x61] = SSE42_OP(pcmpestri),
-    [0x62] = SSE42_OP(pcmpistrm),
-    [0x63] = SSE42_OP(pcmpistri),
-    [0xdf] = AESNI_OP(aeskeygenassist),
-};
+ illegal_op:
+    gen_illegal_opcode(s);
+    return true;
+}
 
 static void gen_sse(CPUX86State *env, DisasContext *s, int b,
                     target_ulong pc_start, int rex_r)
@@ -3040,6 +4442,10 @@ static void gen_sse(CPUX86State *env, DisasContext *s, int b,
     SSEFunc_0_eppt sse_fn_eppt;
     MemOp ot;
 
+    if ((s->prefix & PREFIX_VEX) && gen_avx(env, s, b, pc_start, rex_r)) {
+        return;
+    }
+
     b &= 0xff;
     if (s->prefix & PREFIX_DATA)
         b1 = 1;
@@ -3752,6 +5158,10 @@ static void gen_sse(CPUX86State *env, DisasContext *s, int b,
                 goto unknown_op;
             }
 
+            if (gen_sse_gvec_0f38(b, b1 ? 16 : 8, op1_offset, op1_offset,
+                                  op2_offset)) {
+                break;
+            }
             tcg_gen_addi_ptr(s->ptr0, cpu_env, op1_offset);
             tcg_gen_addi_ptr(s->ptr1, cpu_env, op2_offset);
             sse_fn_epp(cpu_env, s->ptr0, s->ptr1);
@@ -4463,6 +5873,10 @@ static void gen_sse(CPUX86State *env, DisasContext *s, int b,
             sse_fn_eppt(cpu_env, s->ptr0, s->ptr1, s->A0);
             break;
         default:
+            if (gen_sse_gvec(b, is_xmm ? 16 : 8, op1_offset, op1_offset,
+                             op2_offset)) {
+                break;
+            }
             tcg_gen_addi_ptr(s->ptr0, cpu_env, op1_offset);
             tcg_gen_addi_ptr(s->ptr1, cpu_env, op2_offset);
             sse_fn_epp(cpu_env, s->ptr0, s->ptr1);
@@ -5058,7 +6472,7 @@ static target_ulong disas_insn(DisasContext *s, CPUState *cpu)
             gen_push_v(s, s->T1);
             gen_op_jmp_v(s->T0);
             gen_bnd_jmp(s);
-            gen_jr(s, s->T0);
+            gen_jr_near(s, s->T0);
             break;
         case 3: /* lcall Ev */
             gen_op_ld_v(s, ot, s->T1, s->A0);
@@ -5085,7 +6499,7 @@ static target_ulong disas_insn(DisasContext *s, CPUState *cpu)
             }
             gen_op_jmp_v(s->T0);
             gen_bnd_jmp(s);
-            gen_jr(s, s->T0);
+            gen_jr_near(s, s->T0);
             break;
         case 5: /* ljmp Ev */
             gen_op_ld_v(s, ot, s->T1, s->A0);
@@ -6512,7 +7926,7 @@ static target_ulong disas_insn(DisasContext *s, CPUState *cpu)
         /* Note that gen_pop_T0 uses a zero-extending load.  */
         gen_op_jmp_v(s->T0);
         gen_bnd_jmp(s);
-        gen_jr(s, s->T0);
+        gen_jr_near(s, s->T0);
         break;
     case 0xc3: /* ret */
         ot = gen_pop_T0(s);
@@ -6520,7 +7934,7 @@ static target_ulong disas_insn(DisasContext *s, CPUState *cpu)
         /* Note that gen_pop_T0 uses a zero-extending load.  */
         gen_op_jmp_v(s->T0);
         gen_bnd_jmp(s);
-        gen_jr(s, s->T0);
+        gen_jr_near(s, s->T0);
         break;
     case 0xca: /* lret im */
         val = x86_ldsw_code(env, s);
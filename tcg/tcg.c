@@ -31,11 +31,15 @@
 #undef DEBUG_JIT
 
 #include "qemu/error-report.h"
+#include "qemu/bitmap.h"
 #include "qemu/cutils.h"
 #include "qemu/host-utils.h"
 #include "qemu/qemu-print.h"
 #include "qemu/timer.h"
 #include "qemu/cacheflush.h"
+#ifdef CONFIG_LINUX
+#include <sys/syscall.h>
+#endif
 
 /* Note: the long term plan is to reduce the dependencies on the QEMU
    CPU definitions. Currently they are used for qemu_ld/st
@@ -50,6 +54,7 @@
 #endif
 
 #include "tcg/tcg-op.h"
+#include "tcg/perf.h"
 
 #if UINTPTR_MAX == UINT32_MAX
 # define ELF_CLASS  ELFCLASS32
@@ -191,6 +196,11 @@ struct tcg_region_state {
     /* fields protected by the lock */
     size_t current; /* current region index */
     size_t agg_size_full; /* aggregate size of full regions */
+    unsigned long *evicted; /* regions below current that are free again */
+    uint64_t *gen; /* allocation order of each region, oldest lowest */
+    int *node; /* NUMA node that first touched each region below current */
+    uint64_t next_gen;
+    size_t reserved; /* bytes at the start of region 0 not handed out */
 };
 
 static struct tcg_region_state region;
@@ -513,6 +523,21 @@ static void tcg_region_trees_init(void)
     }
 }
 
+/* Return the index of the region that contains @p, a pointer into the buffer */
+static size_t tcg_region_index(const void *p)
+{
+    ptrdiff_t offset;
+
+    if (p < region.start_aligned) {
+        return 0;
+    }
+    offset = p - region.start_aligned;
+    if (offset > region.stride * (region.n - 1)) {
+        return region.n - 1;
+    }
+    return offset / region.stride;
+}
+
 static struct tcg_region_tree *tc_ptr_to_region_tree(const void *p)
 {
     size_t region_idx;
@@ -528,17 +553,7 @@ static struct tcg_region_tree *tc_ptr_to_region_tree(const void *p)
         }
     }
 
-    if (p < region.start_aligned) {
-        region_idx = 0;
-    } else {
-        ptrdiff_t offset = p - region.start_aligned;
-
-        if (offset > region.stride * (region.n - 1)) {
-            region_idx = region.n - 1;
-        } else {
-            region_idx = offset / region.stride;
-        }
-    }
+    region_idx = tcg_region_index(p);
     return region_trees + region_idx * tree_size;
 }
 
@@ -683,17 +698,68 @@ static void tcg_region_assign(TCGContext *s, size_t curr_region)
 
     s->code_gen_buffer = start;
     s->code_gen_ptr = start;
+    if (curr_region == 0) {
+        s->code_gen_ptr += region.reserved;
+    }
     s->code_gen_buffer_size = end - start;
     s->code_gen_highwater = end - TCG_HIGHWATER;
 }
 
-static bool tcg_region_alloc__locked(TCGContext *s)
+/*
+ * Return the NUMA node of the calling thread, or -1 if unknown.  Pages of
+ * the buffer are placed on the node of the thread that first writes them.
+ */
+static int tcg_region_current_node(void)
 {
-    if (region.current == region.n) {
-        return true;
+#if defined(CONFIG_LINUX) && defined(SYS_getcpu)
+    unsigned int cpu, node;
+
+    if (syscall(SYS_getcpu, &cpu, &node, NULL) == 0) {
+        return node;
+    }
+#endif
+    return -1;
+}
+
+static size_t tcg_region_find_evicted__locked(int node)
+{
+    size_t i;
+
+    if (node < 0) {
+        return region.n;
+    }
+    for (i = find_first_bit(region.evicted, region.n); i < region.n;
+         i = find_next_bit(region.evicted, region.n, i + 1)) {
+        if (region.node[i] == node) {
+            break;
+        }
+    }
+    return i;
+}
+
+/*
+ * Hand out a region to a thread running on @node: preferably an emptied
+ * region whose memory is already on that node, else a region never used
+ * so far, which the thread will fault in locally, else any emptied region.
+ */
+static bool tcg_region_alloc__locked(TCGContext *s, int node)
+{
+    size_t i;
+
+    i = tcg_region_find_evicted__locked(node);
+    if (i == region.n && region.current < region.n) {
+        i = region.current++;
+        region.node[i] = node;
+    } else if (i == region.n) {
+        /* Reuse a region that tcg_region_evict has emptied */
+        i = find_first_bit(region.evicted, region.n);
+        if (i == region.n) {
+            return true;
+        }
     }
-    tcg_region_assign(s, region.current);
-    region.current++;
+    clear_bit(i, region.evicted);
+    tcg_region_assign(s, i);
+    region.gen[i] = region.next_gen++;
     return false;
 }
 
@@ -706,9 +772,10 @@ static bool tcg_region_alloc(TCGContext *s)
     bool err;
     /* read the region size now; alloc__locked will overwrite it on success */
     size_t size_full = s->code_gen_buffer_size;
+    int node = tcg_region_current_node();
 
     qemu_mutex_lock(&region.lock);
-    err = tcg_region_alloc__locked(s);
+    err = tcg_region_alloc__locked(s, node);
     if (!err) {
         region.agg_size_full += size_full - TCG_HIGHWATER;
     }
@@ -720,9 +787,23 @@ static bool tcg_region_alloc(TCGContext *s)
  * Perform a context's first region allocation.
  * This function does _not_ increment region.agg_size_full.
  */
-static inline bool tcg_region_initial_alloc__locked(TCGContext *s)
+static inline bool tcg_region_initial_alloc__locked(TCGContext *s, int node)
 {
-    return tcg_region_alloc__locked(s);
+    return tcg_region_alloc__locked(s, node);
+}
+
+/*
+ * Keep the first @size bytes of the buffer, which hold code that was
+ * not generated through the regions (e.g. a restored TB cache), from
+ * being handed out.  They are part of region 0, so that TBs there can
+ * be inserted in its tree.  Call before tcg_region_init() to reserve
+ * space, and with 0 from a safe-work context before
+ * tcg_region_reset_all() to give it back.
+ */
+void tcg_region_reserve(size_t size)
+{
+    g_assert(size == 0 || !region.n);
+    region.reserved = size;
 }
 
 /* Call from a safe-work context */
@@ -732,12 +813,18 @@ void tcg_region_reset_all(void)
     unsigned int i;
 
     qemu_mutex_lock(&region.lock);
-    region.current = 0;
+    /*
+     * Every region that was used is free again, but its memory stays on
+     * the node that touched it first: give each context one on the node
+     * of the region it was using.
+     */
+    bitmap_set(region.evicted, 0, region.current);
     region.agg_size_full = 0;
 
     for (i = 0; i < n_ctxs; i++) {
         TCGContext *s = qatomic_read(&tcg_ctxs[i]);
-        bool err = tcg_region_initial_alloc__locked(s);
+        int node = region.node[tcg_region_index(s->code_gen_buffer)];
+        bool err = tcg_region_initial_alloc__locked(s, node);
 
         g_assert(!err);
     }
@@ -746,6 +833,88 @@ void tcg_region_reset_all(void)
     tcg_region_tree_reset_all();
 }
 
+static bool tcg_region_in_use__locked(size_t curr_region)
+{
+    unsigned int n_ctxs = qatomic_read(&n_tcg_ctxs);
+    void *start, *end;
+    unsigned int i;
+
+    tcg_region_bounds(curr_region, &start, &end);
+    for (i = 0; i < n_ctxs; i++) {
+        if (qatomic_read(&tcg_ctxs[i])->code_gen_buffer == start) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static gboolean tcg_region_tree_collect(gpointer k, gpointer v, gpointer data)
+{
+    g_ptr_array_add(data, v);
+    return FALSE;
+}
+
+/*
+ * Make room for tcg_region_alloc without flushing the whole buffer:
+ * invalidate every TB of the oldest full region that no context is
+ * translating into, and hand that region out again.  TBs in other
+ * regions stay valid; jumps into the evicted ones are unlinked by
+ * tb_phys_invalidate.  Returns 1 if a region was evicted, 0 if there
+ * was room already, and -ENOSPC if no region can be evicted, in which
+ * case the caller must fall back to tb_flush.
+ *
+ * Call from a safe-work context.
+ */
+int tcg_region_evict(void)
+{
+    struct tcg_region_tree *rt;
+    size_t i, victim = region.n;
+    void *start, *end;
+    GPtrArray *tbs;
+
+    qemu_mutex_lock(&region.lock);
+    if (region.current < region.n ||
+        find_first_bit(region.evicted, region.n) < region.n) {
+        /* Somebody else made room already */
+        qemu_mutex_unlock(&region.lock);
+        return 0;
+    }
+    for (i = 0; i < region.n; i++) {
+        if (tcg_region_in_use__locked(i)) {
+            continue;
+        }
+        if (victim == region.n || region.gen[i] < region.gen[victim]) {
+            victim = i;
+        }
+    }
+    if (victim == region.n) {
+        qemu_mutex_unlock(&region.lock);
+        return -ENOSPC;
+    }
+    tcg_region_bounds(victim, &start, &end);
+    region.agg_size_full -= (end - start) - TCG_HIGHWATER;
+    set_bit(victim, region.evicted);
+    qemu_mutex_unlock(&region.lock);
+
+    rt = region_trees + victim * tree_size;
+    tbs = g_ptr_array_new();
+    qemu_mutex_lock(&rt->lock);
+    g_tree_foreach(rt->tree, tcg_region_tree_collect, tbs);
+    /* Increment the refcount first so that destroy acts as a reset */
+    g_tree_ref(rt->tree);
+    g_tree_destroy(rt->tree);
+    qemu_mutex_unlock(&rt->lock);
+
+    for (i = 0; i < tbs->len; i++) {
+        TranslationBlock *tb = g_ptr_array_index(tbs, i);
+
+        tb_phys_invalidate(tb, -1);
+        tb_destroy(tb);
+    }
+    g_ptr_array_free(tbs, TRUE);
+    return 1;
+}
+
 #ifdef CONFIG_USER_ONLY
 static size_t tcg_n_regions(void)
 {
@@ -761,30 +930,34 @@ static size_t tcg_n_regions(void)
 static size_t tcg_n_regions(void)
 {
     size_t i;
-
-    /* Use a single region if all we have is one vCPU thread */
 #if !defined(CONFIG_USER_ONLY)
     MachineState *ms = MACHINE(qdev_get_machine());
     unsigned int max_cpus = ms->smp.max_cpus;
 #endif
+    unsigned int n_threads = max_cpus;
+
+    /*
+     * A single vCPU thread still gets several regions, so that filling
+     * up the buffer only evicts the oldest region instead of flushing.
+     */
     if (max_cpus == 1 || !qemu_tcg_mttcg_enabled()) {
-        return 1;
+        n_threads = 1;
     }
 
-    /* Try to have more regions than max_cpus, with each region being >= 2 MB */
+    /* Try to have more regions than threads, with each region being >= 2 MB */
     for (i = 8; i > 0; i--) {
         size_t regions_per_thread = i;
         size_t region_size;
 
         region_size = tcg_init_ctx.code_gen_buffer_size;
-        region_size /= max_cpus * regions_per_thread;
+        region_size /= n_threads * regions_per_thread;
 
         if (region_size >= 2 * 1024u * 1024) {
-            return max_cpus * regions_per_thread;
+            return n_threads * regions_per_thread;
         }
     }
     /* If we can't, then just allocate one region per vCPU thread */
-    return max_cpus;
+    return n_threads;
 }
 #endif
 
@@ -799,7 +972,8 @@ static size_t tcg_n_regions(void)
  * code in parallel without synchronization.
  *
  * In softmmu the number of TCG threads is bounded by max_cpus, so we use at
- * least max_cpus regions in MTTCG. In !MTTCG we use a single region.
+ * least max_cpus regions in MTTCG. In !MTTCG there is a single TCG thread,
+ * which still gets several regions so that tcg_region_evict can recycle them.
  * Note that the TCG options from the command-line (i.e. -accel accel=tcg,[...])
  * must have been parsed before calling this function, since it calls
  * qemu_tcg_mttcg_enabled().
@@ -822,6 +996,7 @@ void tcg_region_init(void)
     void *aligned;
     size_t size = tcg_init_ctx.code_gen_buffer_size;
     size_t page_size = qemu_real_host_page_size;
+    size_t align = page_size;
     size_t region_size;
     size_t n_regions;
     size_t i;
@@ -829,16 +1004,28 @@ void tcg_region_init(void)
 
     n_regions = tcg_n_regions();
 
-    /* The first region will be 'aligned - buf' bytes larger than the others */
-    aligned = QEMU_ALIGN_PTR_UP(buf, page_size);
+    /*
+     * Start regions on huge page boundaries when they are large enough, so
+     * that the huge page hint of the buffer covers all of a region but the
+     * huge page that holds its guard page.
+     */
+    if (size / n_regions >= 4 * QEMU_VMALLOC_ALIGN) {
+        align = QEMU_VMALLOC_ALIGN;
+    }
+
+    /*
+     * The first region will be 'aligned - buf' bytes larger than the others,
+     * which also makes room for the reserved bytes.
+     */
+    aligned = QEMU_ALIGN_PTR_UP(buf + region.reserved, align);
     g_assert(aligned < tcg_init_ctx.code_gen_buffer + size);
     /*
-     * Make region_size a multiple of page_size, using aligned as the start.
+     * Make region_size a multiple of align, using aligned as the start.
      * As a result of this we might end up with a few extra pages at the end of
      * the buffer; we will assign those to the last region.
      */
     region_size = (size - (aligned - buf)) / n_regions;
-    region_size = QEMU_ALIGN_DOWN(region_size, page_size);
+    region_size = QEMU_ALIGN_DOWN(region_size, align);
 
     /* A region must have at least 2 pages; one code, one guard */
     g_assert(region_size >= 2 * page_size);
@@ -854,6 +1041,9 @@ void tcg_region_init(void)
     region.end = QEMU_ALIGN_PTR_DOWN(buf + size, page_size);
     /* account for that last guard page */
     region.end -= page_size;
+    region.evicted = bitmap_new(region.n);
+    region.gen = g_new0(uint64_t, region.n);
+    region.node = g_new(int, region.n);
 
     /* set guard pages */
     splitwx_diff = tcg_splitwx_diff;
@@ -875,7 +1065,7 @@ void tcg_region_init(void)
     /* In user-mode we support only one ctx, so do the initial allocation now */
 #ifdef CONFIG_USER_ONLY
     {
-        bool err = tcg_region_initial_alloc__locked(tcg_ctx);
+        bool err = tcg_region_initial_alloc__locked(tcg_ctx, -1);
 
         g_assert(!err);
     }
@@ -964,7 +1154,7 @@ void tcg_register_thread(void)
 
     tcg_ctx = s;
     qemu_mutex_lock(&region.lock);
-    err = tcg_region_initial_alloc__locked(tcg_ctx);
+    err = tcg_region_initial_alloc__locked(tcg_ctx, tcg_region_current_node());
     g_assert(!err);
     qemu_mutex_unlock(&region.lock);
 }
@@ -1254,6 +1444,7 @@ void tcg_prologue_init(TCGContext *s)
 
     /* Deduct the prologue from the buffer.  */
     prologue_size = tcg_current_code_size(s);
+    perf_report_prologue(tcg_splitwx_to_rx(buf0), prologue_size);
     s->code_gen_ptr = buf1;
     s->code_gen_buffer = buf1;
     s->code_buf = buf1;
@@ -3589,6 +3780,59 @@ static void tcg_reg_free(TCGContext *s, TCGReg reg, TCGRegSet allocated_regs)
     }
 }
 
+/*
+ * Free call-clobbered register 'reg' before a helper call with FLAGS.
+ * Whatever is still in a register at this point is live across the call,
+ * so rather than spilling it and loading it again afterwards, move it to
+ * a free call-saved register if there is one.  Globals are only kept if
+ * the helper does not write them; sync_globals() still stores them when
+ * the helper may read them.
+ */
+static void tcg_reg_free_for_call(TCGContext *s, TCGReg reg,
+                                  TCGRegSet allocated_regs, int flags)
+{
+    TCGTemp *ts = s->reg_to_temp[reg];
+    TCGRegSet set;
+    int i;
+
+    if (ts == NULL) {
+        return;
+    }
+
+    switch (ts->kind) {
+    case TEMP_GLOBAL:
+        if (!(flags & (TCG_CALL_NO_READ_GLOBALS | TCG_CALL_NO_WRITE_GLOBALS))) {
+            goto spill;
+        }
+        break;
+    case TEMP_LOCAL:
+    case TEMP_NORMAL:
+        break;
+    default:
+        goto spill;
+    }
+
+    set = tcg_target_available_regs[ts->type] & ~tcg_target_call_clobber_regs
+          & ~allocated_regs & ~s->reserved_regs;
+    for (i = 0; set && i < ARRAY_SIZE(tcg_target_reg_alloc_order); i++) {
+        TCGReg new_reg = tcg_target_reg_alloc_order[i];
+
+        if (tcg_regset_test_reg(set, new_reg) &&
+            s->reg_to_temp[new_reg] == NULL) {
+            if (!tcg_out_mov(s, ts->type, new_reg, reg)) {
+                break;
+            }
+            s->reg_to_temp[reg] = NULL;
+            s->reg_to_temp[new_reg] = ts;
+            ts->reg = new_reg;
+            return;
+        }
+    }
+
+ spill:
+    tcg_reg_free(s, reg, allocated_regs);
+}
+
 /**
  * tcg_reg_alloc:
  * @required_regs: Set of registers in which we must allocate.
@@ -4417,7 +4661,7 @@ static void tcg_reg_alloc_call(TCGContext *s, TCGOp *op)
     /* clobber call registers */
     for (i = 0; i < TCG_TARGET_NB_REGS; i++) {
         if (tcg_regset_test_reg(tcg_target_call_clobber_regs, i)) {
-            tcg_reg_free(s, i, allocated_regs);
+            tcg_reg_free_for_call(s, i, allocated_regs, flags);
         }
     }
 
@@ -12,6 +12,9 @@
  */
 #include "qemu/osdep.h"
 #include "qemu/units.h"
+#include "qemu/bswap.h"
+#include "qemu/thread.h"
+#include "qapi/error.h"
 #include "crypto/init.h"
 #include "crypto/cipher.h"
 
@@ -164,6 +167,71 @@ static void test_cipher_speed_xts_aes_256(const void *opaque)
                       QCRYPTO_CIPHER_ALG_AES_256);
 }
 
+/*
+ * Encrypt a disk request the way LUKS does, one 512 byte sector at a time
+ * with the sector number as IV, from several threads each with its own
+ * cipher, as block/crypto.c does for large requests.
+ */
+#define SECTORS_REQUEST_SIZE (1 * MiB)
+#define SECTORS_TOTAL (1 * GiB)
+
+static void *test_cipher_sectors_thread(void *opaque)
+{
+    size_t nthreads = (size_t)opaque;
+    QCryptoCipher *cipher;
+    uint8_t key[64], iv[16] = { 0 };
+    uint8_t *buf = g_malloc0(SECTORS_REQUEST_SIZE);
+    uint64_t sector = 0;
+    size_t remain, i;
+
+    memset(key, 0x5a, sizeof(key));
+    cipher = qcrypto_cipher_new(QCRYPTO_CIPHER_ALG_AES_256,
+                                QCRYPTO_CIPHER_MODE_XTS,
+                                key, sizeof(key), &error_abort);
+
+    for (remain = SECTORS_TOTAL / nthreads; remain >= SECTORS_REQUEST_SIZE;
+         remain -= SECTORS_REQUEST_SIZE) {
+        for (i = 0; i < SECTORS_REQUEST_SIZE; i += 512) {
+            stq_le_p(iv, sector++);
+            g_assert(qcrypto_cipher_setiv(cipher, iv, sizeof(iv),
+                                          &error_abort) == 0);
+            g_assert(qcrypto_cipher_encrypt(cipher, buf + i, buf + i, 512,
+                                            &error_abort) == 0);
+        }
+    }
+
+    qcrypto_cipher_free(cipher);
+    g_free(buf);
+    return NULL;
+}
+
+static void test_cipher_speed_sectors(const void *opaque)
+{
+    size_t nthreads = (size_t)opaque;
+    QemuThread *threads = g_new(QemuThread, nthreads);
+    size_t i;
+
+    if (!qcrypto_cipher_supports(QCRYPTO_CIPHER_ALG_AES_256,
+                                 QCRYPTO_CIPHER_MODE_XTS)) {
+        g_free(threads);
+        return;
+    }
+
+    g_test_timer_start();
+    for (i = 0; i < nthreads; i++) {
+        qemu_thread_create(&threads[i], "cipher", test_cipher_sectors_thread,
+                           (void *)nthreads, QEMU_THREAD_JOINABLE);
+    }
+    for (i = 0; i < nthreads; i++) {
+        qemu_thread_join(&threads[i]);
+    }
+    g_test_timer_elapsed();
+
+    g_test_message("enc(aes-256-xts) 512 byte sectors %zu threads %.2f MB/sec",
+                   nthreads, (double)SECTORS_TOTAL / MiB / g_test_timer_last());
+    g_free(threads);
+}
+
 
 int main(int argc, char **argv)
 {
@@ -204,5 +272,12 @@ int main(int argc, char **argv)
     ADD_TESTS(16384);
     ADD_TESTS(65536);
 
+    if (!alg || g_str_equal(alg, "sectors")) {
+        g_test_add_data_func("/crypto/cipher/sectors/threads-1", (void *)1,
+                             test_cipher_speed_sectors);
+        g_test_add_data_func("/crypto/cipher/sectors/threads-4", (void *)4,
+                             test_cipher_speed_sectors);
+    }
+
     return g_test_run();
 }
@@ -0,0 +1,73 @@
+/*
+ * QEMU timer list speed benchmark
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or
+ * (at your option) any later version.  See the COPYING file in the
+ * top-level directory.
+ */
+#include "qemu/osdep.h"
+#include "qemu/timer.h"
+
+#define TIMER_BENCH_OPS (4 * 1000 * 1000)
+
+static void timer_bench_cb(void *opaque)
+{
+}
+
+/*
+ * Re-arm random timers among @n armed ones, as devices with periodic
+ * or interrupt moderation timers do.
+ */
+static void test_timer_mod_speed(const void *opaque)
+{
+    unsigned n = GPOINTER_TO_UINT(opaque);
+    QEMUTimerListGroup tlg;
+    QEMUTimer *timers = g_new0(QEMUTimer, n);
+    int64_t now = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+    unsigned i;
+
+    timerlistgroup_init(&tlg, NULL, NULL);
+    for (i = 0; i < n; i++) {
+        timer_init_full(&timers[i], &tlg, QEMU_CLOCK_REALTIME, SCALE_NS, 0,
+                        timer_bench_cb, NULL);
+        timer_mod_ns(&timers[i], now + NANOSECONDS_PER_SECOND +
+                     g_test_rand_int_range(0, 1000000));
+    }
+
+    g_test_timer_start();
+    for (i = 0; i < TIMER_BENCH_OPS; i++) {
+        QEMUTimer *ts = &timers[g_test_rand_int_range(0, n)];
+
+        timer_mod_ns(ts, now + NANOSECONDS_PER_SECOND +
+                     g_test_rand_int_range(0, 1000000));
+    }
+    g_test_timer_elapsed();
+
+    g_test_message("timer_mod: %u timers %.2f Mops/sec", n,
+                   TIMER_BENCH_OPS / g_test_timer_last() / 1000000);
+
+    for (i = 0; i < n; i++) {
+        timer_del(&timers[i]);
+        timer_deinit(&timers[i]);
+    }
+    timerlistgroup_deinit(&tlg);
+    g_free(timers);
+}
+
+int main(int argc, char **argv)
+{
+    static const unsigned counts[] = { 4, 64, 1024, 16384 };
+    char name[64];
+    int i;
+
+    g_test_init(&argc, &argv, NULL);
+    init_clocks(NULL);
+
+    for (i = 0; i < ARRAY_SIZE(counts); i++) {
+        snprintf(name, sizeof(name), "/timer/mod/%u", counts[i]);
+        g_test_add_data_func(name, GUINT_TO_POINTER(counts[i]),
+                             test_timer_mod_speed);
+    }
+
+    return g_test_run();
+}
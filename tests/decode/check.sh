@@ -4,6 +4,7 @@
 
 PYTHON=$1
 DECODETREE=$2
+CC=$3
 E=0
 
 # All of these tests should produce errors
@@ -18,7 +19,47 @@ done
 for i in succ_*.decode; do
     if ! $PYTHON $DECODETREE $i > /dev/null 2> /dev/null; then
         echo FAIL:$i 1>&2
+        E=1
     fi
 done
 
+for i in succ_*.decode; do
+    if ! $PYTHON $DECODETREE --decode-table $i > /dev/null 2> /dev/null; then
+        echo FAIL:--decode-table $i 1>&2
+        E=1
+    fi
+done
+
+# With a compiler, check that both decoders call the same translators
+# with the same arguments for the same instructions.
+if test -n "$CC"; then
+    T=$(mktemp -d)
+    trap 'rm -rf "$T"' EXIT
+    for i in succ_*.decode; do
+        for mode in switch table; do
+            opt=
+            test $mode = table && opt=--decode-table
+            if ! $PYTHON $DECODETREE $opt -o $T/$mode.c.inc $i 2> /dev/null; then
+                continue
+            fi
+            sed -n 's/^static bool trans_\([A-Za-z0-9_]*\)(DisasContext \*ctx, arg_\([A-Za-z0-9_]*\) \*a);$/static bool trans_\1(DisasContext *ctx, arg_\2 *a)\
+{\
+    return record(ctx, "\1", a, sizeof(*a));\
+}/p' $T/$mode.c.inc > $T/$mode-stubs.c.inc
+            if ! $CC -o $T/$mode compare.c -I$T \
+                    -DDECODER="\"$mode.c.inc\"" \
+                    -DSTUBS="\"$mode-stubs.c.inc\"" ||
+               ! $T/$mode > $T/$mode.out; then
+                echo FAIL:compile $mode $i 1>&2
+                E=1
+            fi
+        done
+        if ! cmp -s $T/switch.out $T/table.out; then
+            echo FAIL:--decode-table differs $i 1>&2
+            E=1
+        fi
+        rm -f $T/*
+    done
+fi
+
 exit $E
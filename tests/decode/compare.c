@@ -0,0 +1,97 @@
+/*
+ * Harness for comparing the decoders produced by decodetree.py.
+ *
+ * The generated decoder (DECODER) and a set of translator stubs (STUBS)
+ * are included below.  Every translator that gets called is folded into
+ * a running hash together with its argument set; the final hash over a
+ * fixed sequence of instructions is printed, so that the output of the
+ * switch-based and --decode-table decoders can be compared.
+ *
+ * This work is licensed under the terms of the GNU LGPL, version 2 or later.
+ * See the COPYING.LIB file in the top-level directory.
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+typedef struct DisasContext {
+    uint32_t insn;
+    uint64_t hash;
+} DisasContext;
+
+static inline uint32_t extract32(uint32_t value, int start, int length)
+{
+    return (value >> start) & (~0U >> (32 - length));
+}
+
+static inline int32_t sextract32(uint32_t value, int start, int length)
+{
+    return ((int32_t)(value << (32 - length - start))) >> (32 - length);
+}
+
+static inline uint32_t deposit32(uint32_t value, int start, int length,
+                                 uint32_t fieldval)
+{
+    uint32_t mask = (~0U >> (32 - length)) << start;
+    return (value & ~mask) | ((fieldval << start) & mask);
+}
+
+static void mix(DisasContext *ctx, const void *p, size_t n)
+{
+    const unsigned char *c = p;
+
+    while (n--) {
+        ctx->hash = (ctx->hash ^ *c++) * 0x100000001b3ULL;
+    }
+}
+
+/*
+ * Accept or reject depending on the history so far, so that both the
+ * success and the fall-through paths of pattern groups are exercised.
+ */
+static bool record(DisasContext *ctx, const char *name,
+                   const void *a, size_t size)
+{
+    mix(ctx, name, strlen(name));
+    mix(ctx, a, size);
+    return (ctx->hash >> 17) & 1;
+}
+
+/* For "!function=foo" in succ_function.decode.  */
+static int __attribute__((unused)) foo(DisasContext *ctx)
+{
+    return ctx->insn >> 7;
+}
+
+#include DECODER
+#include STUBS
+
+int main(void)
+{
+    DisasContext ctx = { .hash = 0xcbf29ce484222325ULL };
+    uint32_t x = 1;
+    long i;
+
+    for (i = 0; i < (1L << 20); i++) {
+        uint32_t insn;
+
+        /* Cover small values exhaustively, then a pseudo-random sample.  */
+        if (i < (1L << 16)) {
+            insn = i;
+        } else {
+            x ^= x << 13;
+            x ^= x >> 17;
+            x ^= x << 5;
+            insn = x;
+        }
+        ctx.insn = insn;
+        if (decode(&ctx, insn)) {
+            mix(&ctx, &insn, sizeof(insn));
+        }
+    }
+    printf("%016llx\n", (unsigned long long)ctx.hash);
+    return 0;
+}
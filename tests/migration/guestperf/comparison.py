@@ -121,4 +121,58 @@ def __init__(self, name, scenarios):
         Scenario("compr-xbzrle-cache-50",
                  compression_xbzrle=True, compression_xbzrle_cache=50),
     ]),
+
+
+    # Looking at effect of multifd with varying numbers of
+    # channels
+    Comparison("multifd-channels", scenarios = [
+        Scenario("multifd-channels-1",
+                 multifd=True, multifd_channels=1),
+        Scenario("multifd-channels-2",
+                 multifd=True, multifd_channels=2),
+        Scenario("multifd-channels-4",
+                 multifd=True, multifd_channels=4),
+        Scenario("multifd-channels-8",
+                 multifd=True, multifd_channels=8),
+    ]),
+
+
+    # Looking at effect of multifd compression methods
+    Comparison("multifd-compression", scenarios = [
+        Scenario("multifd-compression-none",
+                 multifd=True, multifd_channels=4,
+                 multifd_compression="none"),
+        Scenario("multifd-compression-zlib",
+                 multifd=True, multifd_channels=4,
+                 multifd_compression="zlib"),
+        Scenario("multifd-compression-zstd",
+                 multifd=True, multifd_channels=4,
+                 multifd_compression="zstd"),
+    ]),
+
+
+    # Looking at pre-copy convergence in relation to the rate
+    # at which the guest dirties memory
+    Comparison("dirty-rate", scenarios = [
+        Scenario("dirty-rate-100mbs",
+                 dirty_rate=100),
+        Scenario("dirty-rate-500mbs",
+                 dirty_rate=500),
+        Scenario("dirty-rate-1gbs",
+                 dirty_rate=1024),
+        Scenario("dirty-rate-unlimited",
+                 dirty_rate=0),
+    ]),
+
+
+    # Looking at post-copy in relation to the rate at which
+    # the guest dirties memory
+    Comparison("post-copy-dirty-rate", scenarios = [
+        Scenario("post-copy-dirty-rate-100mbs",
+                 post_copy=True, dirty_rate=100),
+        Scenario("post-copy-dirty-rate-1gbs",
+                 post_copy=True, dirty_rate=1024),
+        Scenario("post-copy-dirty-rate-unlimited",
+                 post_copy=True, dirty_rate=0),
+    ]),
 ]
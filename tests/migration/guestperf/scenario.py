@@ -29,7 +29,10 @@ def __init__(self, name,
                  post_copy=False, post_copy_iters=5,
                  auto_converge=False, auto_converge_step=10,
                  compression_mt=False, compression_mt_threads=1,
-                 compression_xbzrle=False, compression_xbzrle_cache=10):
+                 compression_xbzrle=False, compression_xbzrle_cache=10,
+                 multifd=False, multifd_channels=2,
+                 multifd_compression="none",
+                 dirty_rate=0):
 
         self._name = name
 
@@ -56,6 +59,13 @@ def __init__(self, name,
         self._compression_xbzrle = compression_xbzrle
         self._compression_xbzrle_cache = compression_xbzrle_cache # percentage of guest RAM
 
+        self._multifd = multifd
+        self._multifd_channels = multifd_channels
+        self._multifd_compression = multifd_compression # 'none', 'zlib' or 'zstd'
+
+        # Guest workload
+        self._dirty_rate = dirty_rate # MiB per second, 0 for unlimited
+
     def serialize(self):
         return {
             "name": self._name,
@@ -73,6 +83,10 @@ def serialize(self):
             "compression_mt_threads": self._compression_mt_threads,
             "compression_xbzrle": self._compression_xbzrle,
             "compression_xbzrle_cache": self._compression_xbzrle_cache,
+            "multifd": self._multifd,
+            "multifd_channels": self._multifd_channels,
+            "multifd_compression": self._multifd_compression,
+            "dirty_rate": self._dirty_rate,
         }
 
     @classmethod
@@ -92,4 +106,9 @@ def deserialize(cls, data):
             data["compression_mt"],
             data["compression_mt_threads"],
             data["compression_xbzrle"],
-            data["compression_xbzrle_cache"])
+            data["compression_xbzrle_cache"],
+            # Reports written before these were added lack them
+            data.get("multifd", False),
+            data.get("multifd_channels", 2),
+            data.get("multifd_compression", "none"),
+            data.get("dirty_rate", 0))
@@ -32,6 +32,7 @@
 from guestperf.comparison import COMPARISONS
 from guestperf.plot import Plot
 from guestperf.report import Report
+from guestperf.summary import ScenarioSummary, Summary
 
 
 class BaseShell(object):
@@ -122,6 +123,12 @@ def __init__(self):
         parser.add_argument("--compression-xbzrle", dest="compression_xbzrle", default=False, action="store_true")
         parser.add_argument("--compression-xbzrle-cache", dest="compression_xbzrle_cache", default=10, type=int)
 
+        parser.add_argument("--multifd", dest="multifd", default=False, action="store_true")
+        parser.add_argument("--multifd-channels", dest="multifd_channels", default=2, type=int)
+        parser.add_argument("--multifd-compression", dest="multifd_compression", default="none")
+
+        parser.add_argument("--dirty-rate", dest="dirty_rate", default=0, type=int)
+
     def get_scenario(self, args):
         return Scenario(name="perfreport",
                         downtime=args.downtime,
@@ -142,7 +149,13 @@ def get_scenario(self, args):
                         compression_mt_threads=args.compression_mt_threads,
 
                         compression_xbzrle=args.compression_xbzrle,
-                        compression_xbzrle_cache=args.compression_xbzrle_cache)
+                        compression_xbzrle_cache=args.compression_xbzrle_cache,
+
+                        multifd=args.multifd,
+                        multifd_channels=args.multifd_channels,
+                        multifd_compression=args.multifd_compression,
+
+                        dirty_rate=args.dirty_rate)
 
     def run(self, argv):
         args = self._parser.parse_args(argv)
@@ -179,6 +192,8 @@ def __init__(self):
 
         parser.add_argument("--filter", dest="filter", default="*")
         parser.add_argument("--output", dest="output", default=os.getcwd())
+        parser.add_argument("--baseline", dest="baseline", default=None)
+        parser.add_argument("--threshold", dest="threshold", default=10, type=float)
 
     def run(self, argv):
         args = self._parser.parse_args(argv)
@@ -189,6 +204,7 @@ def run(self, argv):
 
         engine = self.get_engine(args)
         hardware = self.get_hardware(args)
+        summaries = []
 
         try:
             for comparison in COMPARISONS:
@@ -210,10 +226,27 @@ def run(self, argv):
                     report = engine.run(hardware, scenario)
                     with open(filename, "w") as fh:
                         print(report.to_json(), file=fh)
+                    summaries.append(ScenarioSummary.from_report(name, report))
         except Exception as e:
             print("Error: %s" % str(e), file=sys.stderr)
             if args.debug:
                 raise
+            return 1
+
+        # Machine readable results of the whole batch, to be kept as
+        # the baseline of later runs or to follow trends
+        summary = Summary(summaries)
+        with open(os.path.join(args.output, "summary.json"), "w") as fh:
+            print(summary.to_json(), file=fh)
+
+        if args.baseline is None:
+            return 0
+
+        regressions = summary.compare(Summary.from_json_file(args.baseline),
+                                      args.threshold)
+        for regression in regressions:
+            print("Regression: %s" % regression, file=sys.stderr)
+        return 1 if regressions else 0
 
 
 class PlotShell(object):
@@ -0,0 +1,149 @@
+#
+# Migration test result summary and baseline comparison
+#
+# This library is free software; you can redistribute it and/or
+# modify it under the terms of the GNU Lesser General Public
+# License as published by the Free Software Foundation; either
+# version 2.1 of the License, or (at your option) any later version.
+#
+# This library is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+# Lesser General Public License for more details.
+#
+# You should have received a copy of the GNU Lesser General Public
+# License along with this library; if not, see <http://www.gnu.org/licenses/>.
+#
+
+import json
+
+
+class ScenarioSummary(object):
+
+    # Metrics checked against a baseline, all of them lower is better
+    METRICS = ("downtime", "total_time", "cpu_per_gib")
+
+    def __init__(self, name, status, downtime, total_time,
+                 transferred_bytes, iterations, cpu_per_gib):
+
+        self._name = name # "comparison/scenario"
+        self._status = status
+        self._downtime = downtime # milliseconds
+        self._total_time = total_time # milliseconds
+        self._transferred_bytes = transferred_bytes
+        self._iterations = iterations
+        # Milliseconds of source QEMU CPU time, not counting vCPU
+        # threads, spent per GiB of migration data sent
+        self._cpu_per_gib = cpu_per_gib
+
+    @staticmethod
+    def _value_at(records, when, after):
+        # Cumulative CPU time around @when, from the samples taken
+        # every second
+        if after:
+            for record in records:
+                if record._timestamp >= when:
+                    return record._value
+            return records[-1]._value
+        value = records[0]._value
+        for record in records:
+            if record._timestamp > when:
+                break
+            value = record._value
+        return value
+
+    @classmethod
+    def _cpu_time(cls, records, start, end):
+        if len(records) == 0:
+            return 0
+        return (cls._value_at(records, end, True) -
+                cls._value_at(records, start, False))
+
+    @classmethod
+    def from_report(cls, name, report):
+        first = report._progress_history[0]
+        last = report._progress_history[-1]
+
+        qemu_cpu = cls._cpu_time(report._qemu_timings._records,
+                                 first._now, last._now)
+        vcpus = {}
+        for record in report._vcpu_timings._records:
+            vcpus.setdefault(record._tid, []).append(record)
+        for records in vcpus.values():
+            qemu_cpu -= cls._cpu_time(records, first._now, last._now)
+
+        gib = last._ram._transferred_bytes / (1024.0 * 1024 * 1024)
+        return cls(name, last._status, last._downtime, last._duration,
+                   last._ram._transferred_bytes, last._ram._iterations,
+                   max(qemu_cpu, 0) / gib if gib else 0)
+
+    def serialize(self):
+        return {
+            "name": self._name,
+            "status": self._status,
+            "downtime": self._downtime,
+            "total_time": self._total_time,
+            "transferred_bytes": self._transferred_bytes,
+            "iterations": self._iterations,
+            "cpu_per_gib": self._cpu_per_gib,
+        }
+
+    @classmethod
+    def deserialize(cls, data):
+        return cls(
+            data["name"],
+            data["status"],
+            data["downtime"],
+            data["total_time"],
+            data["transferred_bytes"],
+            data["iterations"],
+            data["cpu_per_gib"])
+
+
+class Summary(object):
+
+    def __init__(self, scenarios):
+
+        self._scenarios = scenarios
+
+    def serialize(self):
+        return [scenario.serialize() for scenario in self._scenarios]
+
+    @classmethod
+    def deserialize(cls, data):
+        return cls([ScenarioSummary.deserialize(record) for record in data])
+
+    def to_json(self):
+        return json.dumps(self.serialize(), indent=4)
+
+    @classmethod
+    def from_json_file(cls, filename):
+        with open(filename, "r") as fh:
+            return cls.deserialize(json.load(fh))
+
+    def compare(self, baseline, threshold):
+        """Return the list of regressions against @baseline, as strings.
+
+        A metric regresses if it is more than @threshold percent above
+        the baseline value, and a scenario regresses if it no longer
+        completes.  Scenarios missing from either side are ignored.
+        """
+        base = dict((scenario._name, scenario)
+                    for scenario in baseline._scenarios)
+        regressions = []
+        for scenario in self._scenarios:
+            old = base.get(scenario._name)
+            if old is None:
+                continue
+            if old._status == "completed" and scenario._status != "completed":
+                regressions.append("%s: status %s (baseline %s)" % (
+                    scenario._name, scenario._status, old._status))
+                continue
+            for metric in ScenarioSummary.METRICS:
+                new_value = getattr(scenario, "_" + metric)
+                old_value = getattr(old, "_" + metric)
+                if old_value and new_value > old_value * (1 + threshold / 100.0):
+                    regressions.append("%s: %s %.1f (baseline %.1f, +%.1f%%)" % (
+                        scenario._name, metric, new_value, old_value,
+                        (new_value - old_value) * 100.0 / old_value))
+        return regressions
@@ -156,7 +156,14 @@ static unsigned long long now(void)
     return (tv.tv_sec * 1000ull) + (tv.tv_usec / 1000ull);
 }
 
-static void stressone(unsigned long long ramsizeMB)
+/*
+ * Dirty @ramsizeMB of RAM over and over again.  If @dirtyrateMB is not
+ * zero, the thread sleeps as needed to dirty no more than that many MB
+ * per second, so that migration can be measured against guests that
+ * are not just dirtying memory as fast as they can.
+ */
+static void stressone(unsigned long long ramsizeMB,
+                      unsigned long long dirtyrateMB)
 {
     size_t pagesPerMB = 1024 * 1024 / RAM_PAGE_SIZE;
     g_autofree char *ram = g_malloc(ramsizeMB * 1024 * 1024);
@@ -166,6 +173,7 @@ static void stressone(unsigned long long ramsizeMB)
     char *dataptr;
     size_t nMB = 0;
     unsigned long long before, after;
+    unsigned long long pace_start, paced_MB = 0;
 
     /* We don't care about initial state, but we do want
      * to fault it all into RAM, otherwise the first iter
@@ -178,7 +186,7 @@ static void stressone(unsigned long long ramsizeMB)
         return;
     }
 
-    before = now();
+    before = pace_start = now();
 
     while (1) {
 
@@ -193,6 +201,17 @@ static void stressone(unsigned long long ramsizeMB)
                 }
             }
 
+            if (dirtyrateMB) {
+                unsigned long long due, cur;
+
+                paced_MB++;
+                due = pace_start + paced_MB * 1000 / dirtyrateMB;
+                cur = now();
+                if (cur < due) {
+                    g_usleep((due - cur) * 1000);
+                }
+            }
+
             if (nMB == 1024) {
                 after = now();
                 fprintf(stderr, "%s (%05d): INFO: %06llums copied 1 GB in %05llums\n",
@@ -205,28 +224,38 @@ static void stressone(unsigned long long ramsizeMB)
 }
 
 
+typedef struct {
+    unsigned long long ramsizeMB;
+    unsigned long long dirtyrateMB;
+} StressArgs;
+
 static void *stressthread(void *arg)
 {
-    unsigned long long ramsizeMB = *(unsigned long long *)arg;
+    StressArgs *args = arg;
 
-    stressone(ramsizeMB);
+    stressone(args->ramsizeMB, args->dirtyrateMB);
 
     return NULL;
 }
 
-static void stress(unsigned long long ramsizeGB, int ncpus)
+static void stress(unsigned long long ramsizeGB, int ncpus,
+                   unsigned long long dirtyrateMB)
 {
     size_t i;
-    unsigned long long ramsizeMB = ramsizeGB * 1024 / ncpus;
+    static StressArgs args;
+
+    args.ramsizeMB = ramsizeGB * 1024 / ncpus;
+    /* The rate is for the whole guest, split it among the threads */
+    args.dirtyrateMB = dirtyrateMB ? MAX(dirtyrateMB / ncpus, 1) : 0;
     ncpus--;
 
     for (i = 0; i < ncpus; i++) {
         pthread_t thr;
         pthread_create(&thr, NULL,
-                       stressthread,   &ramsizeMB);
+                       stressthread,   &args);
     }
 
-    stressone(ramsizeMB);
+    stressone(args.ramsizeMB, args.dirtyrateMB);
 }
 
 
@@ -263,14 +292,16 @@ static int mount_all(void)
 int main(int argc, char **argv)
 {
     unsigned long long ramsizeGB = 1;
+    unsigned long long dirtyrateMB = 0;
     char *end;
     int ch;
     int opt_ind = 0;
-    const char *sopt = "hr:c:";
+    const char *sopt = "hr:c:d:";
     struct option lopt[] = {
         { "help", no_argument, NULL, 'h' },
         { "ramsize", required_argument, NULL, 'r' },
         { "cpus", required_argument, NULL, 'c' },
+        { "dirtyrate", required_argument, NULL, 'd' },
         { NULL, 0, NULL, 0 }
     };
     int ret;
@@ -300,9 +331,20 @@ int main(int argc, char **argv)
             }
             break;
 
+        case 'd':
+            errno = 0;
+            dirtyrateMB = strtoll(optarg, &end, 10);
+            if (errno != 0 || *end) {
+                fprintf(stderr, "%s (%05d): ERROR: Cannot parse dirty rate %s\n",
+                        argv0, gettid(), optarg);
+                exit_failure();
+            }
+            break;
+
         case '?':
         case 'h':
-            fprintf(stderr, "%s: [--help][--ramsize GB][--cpus N]\n", argv0);
+            fprintf(stderr, "%s: [--help][--ramsize GB][--cpus N]"
+                    "[--dirtyrate MB/s]\n", argv0);
             exit_failure();
         }
     }
@@ -314,6 +356,11 @@ int main(int argc, char **argv)
         ret = get_command_arg_ull("ramsize", &ramsizeGB);
         if (ret < 0)
             exit_failure();
+
+        ret = get_command_arg_ull("dirtyrate", &dirtyrateMB);
+        if (ret < 0) {
+            exit_failure();
+        }
     }
 
     if (ncpus == 0)
@@ -322,7 +369,12 @@ int main(int argc, char **argv)
     fprintf(stdout, "%s (%05d): INFO: RAM %llu GiB across %d CPUs\n",
             argv0, gettid(), ramsizeGB, ncpus);
 
-    stress(ramsizeGB, ncpus);
+    if (dirtyrateMB) {
+        fprintf(stdout, "%s (%05d): INFO: dirtying at most %llu MB/s\n",
+                argv0, gettid(), dirtyrateMB);
+    }
+
+    stress(ramsizeGB, ncpus, dirtyrateMB);
 
     exit_failure();
 }
@@ -207,6 +207,18 @@ static void read_blocktime(QTestState *who)
     qobject_unref(rsp_return);
 }
 
+static void check_downtime_stats(QTestState *who)
+{
+    QDict *rsp_return, *stats;
+
+    rsp_return = migrate_query(who);
+    g_assert(qdict_haskey(rsp_return, "downtime-stats"));
+    stats = qdict_get_qdict(rsp_return, "downtime-stats");
+    g_assert(qdict_haskey(stats, "device-state"));
+    g_assert(qdict_get_qlist(stats, "devices"));
+    qobject_unref(rsp_return);
+}
+
 static void wait_for_migration_pass(QTestState *who)
 {
     uint64_t initial_pass = get_migration_pass(who);
@@ -879,6 +891,42 @@ static void test_precopy_unix(void)
 
     qtest_qmp_eventwait(to, "RESUME");
 
+    wait_for_serial("dest_serial");
+    wait_for_migration_complete(from);
+    check_downtime_stats(from);
+
+    test_migrate_end(from, to, true);
+    g_free(uri);
+}
+
+static void test_precopy_unix_parallel_device_state(void)
+{
+    char *uri = g_strdup_printf("unix:%s/migsocket", tmpfs);
+    MigrateStart *args = migrate_start_new();
+    QTestState *from, *to;
+
+    if (test_migrate_start(&from, &to, uri, args)) {
+        return;
+    }
+
+    migrate_set_capability(from, "parallel-device-state", true);
+    migrate_set_capability(to, "parallel-device-state", true);
+
+    migrate_set_parameter_int(from, "downtime-limit", CONVERGE_DOWNTIME);
+    /* 1GB/s */
+    migrate_set_parameter_int(from, "max-bandwidth", 1000000000);
+
+    /* Wait for the first serial output from the source */
+    wait_for_serial("src_serial");
+
+    migrate_qmp(from, uri, "{}");
+
+    if (!got_stop) {
+        qtest_qmp_eventwait(from, "STOP");
+    }
+
+    qtest_qmp_eventwait(to, "RESUME");
+
     wait_for_serial("dest_serial");
     wait_for_migration_complete(from);
 
@@ -1266,7 +1314,7 @@ static void test_migrate_auto_converge(void)
     test_migrate_end(from, to, true);
 }
 
-static void test_multifd_tcp(const char *method)
+static void test_multifd_tcp_common(const char *method, bool zero_page)
 {
     MigrateStart *args = migrate_start_new();
     QTestState *from, *to;
@@ -1296,6 +1344,11 @@ static void test_multifd_tcp(const char *method)
     migrate_set_capability(from, "multifd", "true");
     migrate_set_capability(to, "multifd", "true");
 
+    if (zero_page) {
+        migrate_set_capability(from, "multifd-zero-page", "true");
+        migrate_set_capability(to, "multifd-zero-page", "true");
+    }
+
     /* Start incoming migration from the 1st socket */
     rsp = wait_command(to, "{ 'execute': 'migrate-incoming',"
                            "  'arguments': { 'uri': 'tcp:127.0.0.1:0' }}");
@@ -1323,6 +1376,50 @@ static void test_multifd_tcp(const char *method)
     g_free(uri);
 }
 
+static void test_precopy_file_mapped_ram(void)
+{
+    MigrateStart *args = migrate_start_new();
+    QTestState *from, *to;
+    QDict *rsp;
+    char *uri = g_strdup_printf("file:%s/migfile", tmpfs);
+    char *file = g_strdup_printf("%s/migfile", tmpfs);
+
+    if (test_migrate_start(&from, &to, "defer", args)) {
+        return;
+    }
+
+    migrate_set_parameter_int(from, "multifd-channels", 4);
+    migrate_set_parameter_int(to, "multifd-channels", 4);
+    migrate_set_capability(from, "mapped-ram", true);
+    migrate_set_capability(to, "mapped-ram", true);
+
+    /* Wait for the first serial output from the source */
+    wait_for_serial("src_serial");
+
+    /* The whole state goes to the file before the destination reads it */
+    migrate_qmp(from, uri, "{}");
+    if (!got_stop) {
+        qtest_qmp_eventwait(from, "STOP");
+    }
+    wait_for_migration_complete(from);
+
+    rsp = wait_command(to, "{ 'execute': 'migrate-incoming',"
+                           "  'arguments': { 'uri': %s }}", uri);
+    qobject_unref(rsp);
+    qtest_qmp_eventwait(to, "RESUME");
+
+    wait_for_serial("dest_serial");
+    test_migrate_end(from, to, true);
+    unlink(file);
+    g_free(file);
+    g_free(uri);
+}
+
+static void test_multifd_tcp(const char *method)
+{
+    test_multifd_tcp_common(method, false);
+}
+
 static void test_multifd_tcp_none(void)
 {
     test_multifd_tcp("none");
@@ -1340,6 +1437,18 @@ static void test_multifd_tcp_zstd(void)
 }
 #endif
 
+#ifdef CONFIG_QPL
+static void test_multifd_tcp_qpl(void)
+{
+    test_multifd_tcp("qpl");
+}
+#endif
+
+static void test_multifd_tcp_zero_page(void)
+{
+    test_multifd_tcp_common("none", true);
+}
+
 /*
  * This test does:
  *  source               target
@@ -1490,6 +1599,8 @@ int main(int argc, char **argv)
     qtest_add_func("/migration/bad_dest", test_baddest);
     qtest_add_func("/migration/precopy/unix", test_precopy_unix);
     qtest_add_func("/migration/precopy/tcp", test_precopy_tcp);
+    qtest_add_func("/migration/precopy/unix/parallel-device-state",
+                   test_precopy_unix_parallel_device_state);
     /* qtest_add_func("/migration/ignore_shared", test_ignore_shared); */
     qtest_add_func("/migration/xbzrle/unix", test_xbzrle_unix);
     qtest_add_func("/migration/fd_proto", test_migrate_fd_proto);
@@ -1504,9 +1615,16 @@ int main(int argc, char **argv)
     qtest_add_func("/migration/multifd/tcp/none", test_multifd_tcp_none);
     qtest_add_func("/migration/multifd/tcp/cancel", test_multifd_tcp_cancel);
     qtest_add_func("/migration/multifd/tcp/zlib", test_multifd_tcp_zlib);
+    qtest_add_func("/migration/precopy/file/mapped-ram",
+                   test_precopy_file_mapped_ram);
+    qtest_add_func("/migration/multifd/tcp/zero-page",
+                   test_multifd_tcp_zero_page);
 #ifdef CONFIG_ZSTD
     qtest_add_func("/migration/multifd/tcp/zstd", test_multifd_tcp_zstd);
 #endif
+#ifdef CONFIG_QPL
+    qtest_add_func("/migration/multifd/tcp/qpl", test_multifd_tcp_qpl);
+#endif
 
     ret = g_test_run();
 
@@ -0,0 +1,84 @@
+/*
+ * QTest testcase for the AF_XDP network backend
+ *
+ * Attaching to an interface needs CAP_NET_ADMIN and CAP_BPF (or root);
+ * without them only the option checks are tested.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "libqos/libqtest.h"
+#include "qapi/qmp/qdict.h"
+
+static QDict *netdev_add(QTestState *qts, const char *ifname, int queues)
+{
+    return qtest_qmp(qts, "{ 'execute': 'netdev_add', 'arguments': {"
+                     " 'type': 'af-xdp', 'id': 'xdp0', 'ifname': %s,"
+                     " 'mode': 'skb', 'queues': %d } }", ifname, queues);
+}
+
+static void assert_error(QDict *rsp, const char *what)
+{
+    QDict *error = qdict_get_qdict(rsp, "error");
+
+    g_assert(error);
+    g_assert(strstr(qdict_get_str(error, "desc"), what));
+    qobject_unref(rsp);
+}
+
+static void test_bad_options(void)
+{
+    QTestState *qts = qtest_init("-machine none -nodefaults");
+
+    assert_error(netdev_add(qts, "qtest-no-such-if", 1),
+                 "failed to get ifindex");
+    assert_error(netdev_add(qts, "lo", 0), "invalid number of queues");
+
+    qtest_quit(qts);
+}
+
+/* Attach to the loopback interface in skb mode, which every host has */
+static void test_add_del(void)
+{
+    QTestState *qts = qtest_init("-machine none -nodefaults");
+    QDict *rsp;
+
+    rsp = netdev_add(qts, "lo", 1);
+    if (qdict_haskey(rsp, "error")) {
+        g_test_skip(qdict_get_str(qdict_get_qdict(rsp, "error"), "desc"));
+        qobject_unref(rsp);
+        qtest_quit(qts);
+        return;
+    }
+    qobject_unref(rsp);
+
+    /* The interface can only have one XDP program of ours at a time */
+    assert_error(qtest_qmp(qts, "{ 'execute': 'netdev_add', 'arguments': {"
+                           " 'type': 'af-xdp', 'id': 'xdp1',"
+                           " 'ifname': 'lo', 'mode': 'skb' } }"),
+                 "lo");
+
+    rsp = qtest_qmp(qts, "{ 'execute': 'netdev_del',"
+                    " 'arguments': { 'id': 'xdp0' } }");
+    g_assert(!qdict_haskey(rsp, "error"));
+    qobject_unref(rsp);
+
+    /* Detaching released the interface */
+    rsp = netdev_add(qts, "lo", 1);
+    g_assert(!qdict_haskey(rsp, "error"));
+    qobject_unref(rsp);
+
+    qtest_quit(qts);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+
+    qtest_add_func("/netdev/af-xdp/bad-options", test_bad_options);
+    qtest_add_func("/netdev/af-xdp/add-del", test_add_del);
+
+    return g_test_run();
+}
@@ -113,6 +113,115 @@ static uint64_t virtio_blk_request(QGuestAllocator *alloc, QVirtioDevice *d,
     return addr;
 }
 
+/*
+ * WRITE_ZEROES with two out-of-order segments that leave a sector in
+ * between, which must keep its data.
+ */
+static void test_write_zeroes_multi_seg(QVirtioDevice *dev,
+                                        QGuestAllocator *alloc,
+                                        QVirtQueue *vq)
+{
+    struct virtio_blk_discard_write_zeroes dwz_hdr[2];
+    QVirtioBlkReq req;
+    uint64_t req_addr;
+    uint32_t free_head;
+    uint32_t max_seg;
+    uint8_t status;
+    char *data;
+    char *expected;
+    QTestState *qts = global_qtest;
+    int i;
+
+    max_seg = qvirtio_config_readl(dev,
+        offsetof(struct virtio_blk_config, max_write_zeroes_seg));
+    g_assert_cmpint(max_seg, >=, 2);
+
+    /* Fill sectors 1-3 */
+    req.type = VIRTIO_BLK_T_OUT;
+    req.ioprio = 1;
+    req.sector = 1;
+    req.data = g_malloc(3 * 512);
+    memset(req.data, 0xaa, 3 * 512);
+
+    req_addr = virtio_blk_request(alloc, dev, &req, 3 * 512);
+
+    g_free(req.data);
+
+    free_head = qvirtqueue_add(qts, vq, req_addr, 16, false, true);
+    qvirtqueue_add(qts, vq, req_addr + 16, 3 * 512, false, true);
+    qvirtqueue_add(qts, vq, req_addr + 16 + 3 * 512, 1, true, false);
+
+    qvirtqueue_kick(qts, dev, vq, free_head);
+
+    qvirtio_wait_used_elem(qts, dev, vq, free_head, NULL,
+                           QVIRTIO_BLK_TIMEOUT_US);
+    status = readb(req_addr + 16 + 3 * 512);
+    g_assert_cmpint(status, ==, 0);
+
+    guest_free(alloc, req_addr);
+
+    /* Zero sectors 3 and 1, in this order */
+    req.type = VIRTIO_BLK_T_WRITE_ZEROES;
+    req.data = (char *) dwz_hdr;
+    dwz_hdr[0].sector = 3;
+    dwz_hdr[0].num_sectors = 1;
+    dwz_hdr[0].flags = 0;
+    dwz_hdr[1].sector = 1;
+    dwz_hdr[1].num_sectors = 1;
+    dwz_hdr[1].flags = 0;
+
+    virtio_blk_fix_dwz_hdr(dev, &dwz_hdr[0]);
+    virtio_blk_fix_dwz_hdr(dev, &dwz_hdr[1]);
+
+    req_addr = virtio_blk_request(alloc, dev, &req, sizeof(dwz_hdr));
+
+    free_head = qvirtqueue_add(qts, vq, req_addr, 16, false, true);
+    qvirtqueue_add(qts, vq, req_addr + 16, sizeof(dwz_hdr), false, true);
+    qvirtqueue_add(qts, vq, req_addr + 16 + sizeof(dwz_hdr), 1, true, false);
+
+    qvirtqueue_kick(qts, dev, vq, free_head);
+
+    qvirtio_wait_used_elem(qts, dev, vq, free_head, NULL,
+                           QVIRTIO_BLK_TIMEOUT_US);
+    status = readb(req_addr + 16 + sizeof(dwz_hdr));
+    g_assert_cmpint(status, ==, 0);
+
+    guest_free(alloc, req_addr);
+
+    /* Read sectors 1-3 back */
+    req.type = VIRTIO_BLK_T_IN;
+    req.ioprio = 1;
+    req.sector = 1;
+    req.data = g_malloc0(3 * 512);
+
+    req_addr = virtio_blk_request(alloc, dev, &req, 3 * 512);
+
+    g_free(req.data);
+
+    free_head = qvirtqueue_add(qts, vq, req_addr, 16, false, true);
+    qvirtqueue_add(qts, vq, req_addr + 16, 3 * 512, true, true);
+    qvirtqueue_add(qts, vq, req_addr + 16 + 3 * 512, 1, true, false);
+
+    qvirtqueue_kick(qts, dev, vq, free_head);
+
+    qvirtio_wait_used_elem(qts, dev, vq, free_head, NULL,
+                           QVIRTIO_BLK_TIMEOUT_US);
+    status = readb(req_addr + 16 + 3 * 512);
+    g_assert_cmpint(status, ==, 0);
+
+    data = g_malloc(3 * 512);
+    expected = g_malloc0(3 * 512);
+    memset(expected + 512, 0xaa, 512);
+    memread(req_addr + 16, data, 3 * 512);
+    for (i = 0; i < 3; i++) {
+        g_assert_cmpmem(data + i * 512, 512, expected + i * 512, 512);
+    }
+    g_free(expected);
+    g_free(data);
+
+    guest_free(alloc, req_addr);
+}
+
 /* Returns the request virtqueue so the caller can perform further tests */
 static QVirtQueue *test_basic(QVirtioDevice *dev, QGuestAllocator *alloc)
 {
@@ -254,6 +363,8 @@ static QVirtQueue *test_basic(QVirtioDevice *dev, QGuestAllocator *alloc)
         g_free(data);
 
         guest_free(alloc, req_addr);
+
+        test_write_zeroes_multi_seg(dev, alloc, vq);
     }
 
     if (features & (1u << VIRTIO_BLK_F_DISCARD)) {
@@ -766,6 +877,111 @@ static void resize(void *obj, void *data, QGuestAllocator *t_alloc)
 
 }
 
+static void iothread_move_to(const char *iothread)
+{
+    QDict *rsp;
+
+    if (iothread) {
+        rsp = qmp("{ 'execute': 'x-device-set-iothread', "
+                  " 'arguments': { "
+                  "   'id': '/machine/peripheral/drv0/virtio-backend', "
+                  "   'iothread': %s } }", iothread);
+    } else {
+        rsp = qmp("{ 'execute': 'x-device-set-iothread', "
+                  " 'arguments': { "
+                  "   'id': '/machine/peripheral/drv0/virtio-backend' } }");
+    }
+    g_assert(qdict_haskey(rsp, "return"));
+    qobject_unref(rsp);
+}
+
+/*
+ * Move the device between iothreads and the main loop while a write is in
+ * flight, then check that every write completed and landed on the disk.
+ */
+static void iothread_move(void *obj, void *u_data, QGuestAllocator *t_alloc)
+{
+    static const char *const targets[] = { "iothread0", "iothread1", NULL };
+    QVirtioBlkPCI *blk = obj;
+    QVirtioDevice *dev = &blk->pci_vdev.vdev;
+    QTestState *qts = global_qtest;
+    QVirtioBlkReq req;
+    QVirtQueue *vq;
+    QDict *rsp;
+    uint64_t req_addr;
+    uint32_t free_head;
+    char *data;
+    int i;
+
+    vq = test_basic(dev, t_alloc);
+
+    for (i = 0; i < 2 * ARRAY_SIZE(targets); i++) {
+        req.type = VIRTIO_BLK_T_OUT;
+        req.ioprio = 1;
+        req.sector = 2 + i;
+        req.data = g_malloc0(512);
+        sprintf(req.data, "MOVE%d", i);
+
+        req_addr = virtio_blk_request(t_alloc, dev, &req, 512);
+
+        g_free(req.data);
+
+        free_head = qvirtqueue_add(qts, vq, req_addr, 16, false, true);
+        qvirtqueue_add(qts, vq, req_addr + 16, 512, false, true);
+        qvirtqueue_add(qts, vq, req_addr + 528, 1, true, false);
+
+        qvirtqueue_kick(qts, dev, vq, free_head);
+        iothread_move_to(targets[i % ARRAY_SIZE(targets)]);
+
+        qvirtio_wait_used_elem(qts, dev, vq, free_head, NULL,
+                               QVIRTIO_BLK_TIMEOUT_US);
+        g_assert_cmpint(readb(req_addr + 528), ==, 0);
+
+        guest_free(t_alloc, req_addr);
+    }
+
+    /* A failed move leaves the device working where it was */
+    rsp = qmp("{ 'execute': 'x-device-set-iothread', "
+              " 'arguments': { "
+              "   'id': '/machine/peripheral/drv0/virtio-backend', "
+              "   'iothread': 'nonexistent' } }");
+    g_assert(qdict_haskey(rsp, "error"));
+    qobject_unref(rsp);
+
+    for (i = 0; i < 2 * ARRAY_SIZE(targets); i++) {
+        char expected[512] = { 0 };
+
+        req.type = VIRTIO_BLK_T_IN;
+        req.ioprio = 1;
+        req.sector = 2 + i;
+        req.data = g_malloc0(512);
+
+        req_addr = virtio_blk_request(t_alloc, dev, &req, 512);
+
+        g_free(req.data);
+
+        free_head = qvirtqueue_add(qts, vq, req_addr, 16, false, true);
+        qvirtqueue_add(qts, vq, req_addr + 16, 512, true, true);
+        qvirtqueue_add(qts, vq, req_addr + 528, 1, true, false);
+
+        qvirtqueue_kick(qts, dev, vq, free_head);
+
+        qvirtio_wait_used_elem(qts, dev, vq, free_head, NULL,
+                               QVIRTIO_BLK_TIMEOUT_US);
+        g_assert_cmpint(readb(req_addr + 528), ==, 0);
+
+        data = g_malloc0(512);
+        memread(req_addr + 16, data, 512);
+        sprintf(expected, "MOVE%d", i);
+        g_assert_cmpmem(data, 512, expected, 512);
+        g_free(data);
+
+        guest_free(t_alloc, req_addr);
+    }
+
+    qvirtqueue_cleanup(dev->bus, vq, t_alloc);
+}
+
 static void *virtio_blk_test_setup(GString *cmd_line, void *arg)
 {
     char *tmp_path = drive_create();
@@ -780,11 +996,21 @@ static void *virtio_blk_test_setup(GString *cmd_line, void *arg)
     return arg;
 }
 
+static void *virtio_blk_iothread_test_setup(GString *cmd_line, void *arg)
+{
+    g_string_append(cmd_line, " -object iothread,id=iothread0 "
+                              "-object iothread,id=iothread1 ");
+    return virtio_blk_test_setup(cmd_line, arg);
+}
+
 static void register_virtio_blk_test(void)
 {
     QOSGraphTestOptions opts = {
         .before = virtio_blk_test_setup,
     };
+    QOSGraphTestOptions iothread_opts = {
+        .before = virtio_blk_iothread_test_setup,
+    };
 
     qos_add_test("indirect", "virtio-blk", indirect, &opts);
     qos_add_test("config", "virtio-blk", config, &opts);
@@ -797,6 +1023,8 @@ static void register_virtio_blk_test(void)
     qos_add_test("nxvirtq", "virtio-blk-pci",
                       test_nonexistent_virtqueue, &opts);
     qos_add_test("hotplug", "virtio-blk-pci", pci_hotplug, &opts);
+    qos_add_test("iothread-move", "virtio-blk-pci", iothread_move,
+                 &iothread_opts);
 }
 
 libqos_init(register_virtio_blk_test);
@@ -0,0 +1,86 @@
+/*
+ * TCG benchmark: floating point and SIMD loops
+ *
+ * Simple loops over arrays that the compiler vectorizes at -O2 with
+ * -ftree-vectorize, and a small n-body simulation with scalar divisions
+ * and square roots.
+ *
+ * SPDX-License-Identifier: GPL-2.0-or-later
+ */
+
+#include <math.h>
+#include <stdio.h>
+
+#define VEC_LEN     4096
+#define VEC_ROUNDS  2000
+#define NBODY_N     32
+#define NBODY_STEPS 2000
+
+static float xs[VEC_LEN], ys[VEC_LEN];
+static double xd[VEC_LEN], yd[VEC_LEN];
+
+static double bench_vec(void)
+{
+    float dotf = 0;
+    double dotd = 0;
+    int i, r;
+
+    for (i = 0; i < VEC_LEN; i++) {
+        xs[i] = xd[i] = i * 0.5;
+        ys[i] = yd[i] = 1.0 / (i + 1);
+    }
+    for (r = 0; r < VEC_ROUNDS; r++) {
+        /* saxpy and daxpy */
+        for (i = 0; i < VEC_LEN; i++) {
+            ys[i] = 0.999f * xs[i] + ys[i] * 0.5f;
+        }
+        for (i = 0; i < VEC_LEN; i++) {
+            yd[i] = 0.999 * xd[i] + yd[i] * 0.5;
+        }
+    }
+    for (i = 0; i < VEC_LEN; i++) {
+        dotf += xs[i] * ys[i];
+        dotd += xd[i] * yd[i];
+    }
+    return dotf + dotd;
+}
+
+static double bench_nbody(void)
+{
+    static double px[NBODY_N], py[NBODY_N], vx[NBODY_N], vy[NBODY_N];
+    double energy = 0;
+    int i, j, s;
+
+    for (i = 0; i < NBODY_N; i++) {
+        px[i] = cos(i * 0.7) * (i + 1);
+        py[i] = sin(i * 0.7) * (i + 1);
+        vx[i] = vy[i] = 0;
+    }
+    for (s = 0; s < NBODY_STEPS; s++) {
+        for (i = 0; i < NBODY_N; i++) {
+            for (j = 0; j < NBODY_N; j++) {
+                double dx = px[j] - px[i], dy = py[j] - py[i];
+                double d2 = dx * dx + dy * dy + 0.01;
+                double f = 0.001 / (d2 * sqrt(d2));
+
+                vx[i] += dx * f;
+                vy[i] += dy * f;
+            }
+        }
+        for (i = 0; i < NBODY_N; i++) {
+            px[i] += vx[i] * 0.01;
+            py[i] += vy[i] * 0.01;
+        }
+    }
+    for (i = 0; i < NBODY_N; i++) {
+        energy += vx[i] * vx[i] + vy[i] * vy[i];
+    }
+    return energy;
+}
+
+int main(void)
+{
+    printf("vec %.6e\n", bench_vec());
+    printf("nbody %.6e\n", bench_nbody());
+    return 0;
+}
@@ -0,0 +1,147 @@
+/*
+ * TCG benchmark: integer kernels
+ *
+ * CRC32, a sieve, integer matrix multiplication and a sort, i.e. loads,
+ * stores, shifts, multiplications and data dependent branches.
+ *
+ * SPDX-License-Identifier: GPL-2.0-or-later
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define CRC_LEN     (256 * 1024)
+#define CRC_ROUNDS  16
+#define SIEVE_LEN   (1024 * 1024)
+#define SIEVE_ROUNDS 4
+#define MAT_N       96
+#define SORT_LEN    (256 * 1024)
+
+static uint32_t crc_table[256];
+
+static void crc32_init(void)
+{
+    uint32_t i, j, c;
+
+    for (i = 0; i < 256; i++) {
+        c = i;
+        for (j = 0; j < 8; j++) {
+            c = c & 1 ? 0xedb88320 ^ (c >> 1) : c >> 1;
+        }
+        crc_table[i] = c;
+    }
+}
+
+static uint32_t crc32(uint32_t crc, const uint8_t *buf, size_t len)
+{
+    crc = ~crc;
+    while (len--) {
+        crc = crc_table[(crc ^ *buf++) & 0xff] ^ (crc >> 8);
+    }
+    return ~crc;
+}
+
+static uint32_t bench_crc(void)
+{
+    uint8_t *buf = malloc(CRC_LEN);
+    uint32_t crc = 0;
+    int i;
+
+    for (i = 0; i < CRC_LEN; i++) {
+        buf[i] = i * 7 + (i >> 8);
+    }
+    crc32_init();
+    for (i = 0; i < CRC_ROUNDS; i++) {
+        crc = crc32(crc, buf, CRC_LEN);
+    }
+    free(buf);
+    return crc;
+}
+
+static uint32_t bench_sieve(void)
+{
+    uint8_t *composite = malloc(SIEVE_LEN);
+    uint32_t count = 0;
+    int round, i, j;
+
+    for (round = 0; round < SIEVE_ROUNDS; round++) {
+        memset(composite, 0, SIEVE_LEN);
+        for (i = 2; i < SIEVE_LEN; i++) {
+            if (composite[i]) {
+                continue;
+            }
+            count++;
+            for (j = 2 * i; j < SIEVE_LEN; j += i) {
+                composite[j] = 1;
+            }
+        }
+    }
+    free(composite);
+    return count;
+}
+
+static uint32_t bench_matmul(void)
+{
+    static int32_t a[MAT_N][MAT_N], b[MAT_N][MAT_N], c[MAT_N][MAT_N];
+    uint32_t sum = 0;
+    int i, j, k;
+
+    for (i = 0; i < MAT_N; i++) {
+        for (j = 0; j < MAT_N; j++) {
+            a[i][j] = i * 3 - j;
+            b[i][j] = i ^ j;
+        }
+    }
+    for (i = 0; i < MAT_N; i++) {
+        for (j = 0; j < MAT_N; j++) {
+            int32_t acc = 0;
+
+            for (k = 0; k < MAT_N; k++) {
+                acc += a[i][k] * b[k][j];
+            }
+            c[i][j] = acc;
+        }
+    }
+    for (i = 0; i < MAT_N; i++) {
+        sum = sum * 31 + c[i][(i * 7) % MAT_N];
+    }
+    return sum;
+}
+
+static int cmp_u32(const void *pa, const void *pb)
+{
+    uint32_t a = *(const uint32_t *)pa, b = *(const uint32_t *)pb;
+
+    return a < b ? -1 : a > b;
+}
+
+static uint32_t bench_sort(void)
+{
+    uint32_t *v = malloc(SORT_LEN * sizeof(*v));
+    uint32_t x = 12345, sum = 0;
+    int i;
+
+    for (i = 0; i < SORT_LEN; i++) {
+        x ^= x << 13;
+        x ^= x >> 17;
+        x ^= x << 5;
+        v[i] = x;
+    }
+    qsort(v, SORT_LEN, sizeof(*v), cmp_u32);
+    for (i = 0; i < SORT_LEN; i += 1024) {
+        sum += v[i];
+    }
+    free(v);
+    return sum;
+}
+
+int main(void)
+{
+    printf("crc %08x\n", bench_crc());
+    printf("sieve %u\n", bench_sieve());
+    printf("matmul %08x\n", bench_matmul());
+    printf("sort %08x\n", bench_sort());
+    return 0;
+}
@@ -0,0 +1,154 @@
+/*
+ * TCG benchmark: interpreters
+ *
+ * A bytecode interpreter with a switch in a loop, and a tree of function
+ * pointers, so that most guest branches are indirect and go to one of
+ * many targets, as in guest interpreters and virtual dispatch.
+ *
+ * SPDX-License-Identifier: GPL-2.0-or-later
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+
+enum {
+    OP_PUSH,    /* push the next byte */
+    OP_LOAD,    /* push register, index in the next byte */
+    OP_STORE,   /* pop into register, index in the next byte */
+    OP_ADD,
+    OP_SUB,
+    OP_MUL,
+    OP_XOR,
+    OP_SHR,
+    OP_DUP,
+    OP_JNZ,     /* pop, jump back by the next byte if not zero */
+    OP_HALT,
+};
+
+/*
+ * r1 = 0; r0 = n;
+ * do { r1 = (r1 * 33) ^ (r1 >> 7) + r0; r0 -= 1; } while (r0);
+ */
+static const uint8_t program[] = {
+    OP_PUSH, 0, OP_STORE, 1,
+    /* loop: */
+    OP_LOAD, 1, OP_PUSH, 33, OP_MUL,
+    OP_LOAD, 1, OP_PUSH, 7, OP_SHR,
+    OP_LOAD, 0, OP_ADD, OP_XOR, OP_STORE, 1,
+    OP_LOAD, 0, OP_PUSH, 1, OP_SUB, OP_DUP, OP_STORE, 0,
+    OP_JNZ, 24,
+    OP_HALT,
+};
+
+static uint32_t interp(const uint8_t *pc, uint32_t n)
+{
+    uint32_t stack[16], *sp = stack, regs[4] = { n };
+
+    for (;;) {
+        switch (*pc++) {
+        case OP_PUSH:
+            *sp++ = *pc++;
+            break;
+        case OP_LOAD:
+            *sp++ = regs[*pc++];
+            break;
+        case OP_STORE:
+            regs[*pc++] = *--sp;
+            break;
+        case OP_ADD:
+            sp--;
+            sp[-1] += sp[0];
+            break;
+        case OP_SUB:
+            sp--;
+            sp[-1] -= sp[0];
+            break;
+        case OP_MUL:
+            sp--;
+            sp[-1] *= sp[0];
+            break;
+        case OP_XOR:
+            sp--;
+            sp[-1] ^= sp[0];
+            break;
+        case OP_SHR:
+            sp--;
+            sp[-1] >>= sp[0];
+            break;
+        case OP_DUP:
+            sp[0] = sp[-1];
+            sp++;
+            break;
+        case OP_JNZ:
+            if (*--sp) {
+                pc -= *pc + 1;
+            } else {
+                pc++;
+            }
+            break;
+        case OP_HALT:
+            return regs[1];
+        }
+    }
+}
+
+typedef struct Node Node;
+struct Node {
+    uint32_t (*eval)(const Node *n, uint32_t x);
+    const Node *l, *r;
+    uint32_t k;
+};
+
+static uint32_t eval_const(const Node *n, uint32_t x)
+{
+    return n->k;
+}
+
+static uint32_t eval_var(const Node *n, uint32_t x)
+{
+    return x;
+}
+
+static uint32_t eval_add(const Node *n, uint32_t x)
+{
+    return n->l->eval(n->l, x) + n->r->eval(n->r, x);
+}
+
+static uint32_t eval_mul(const Node *n, uint32_t x)
+{
+    return n->l->eval(n->l, x) * n->r->eval(n->r, x);
+}
+
+static uint32_t eval_xor(const Node *n, uint32_t x)
+{
+    return n->l->eval(n->l, x) ^ n->r->eval(n->r, x);
+}
+
+static uint32_t bench_tree(void)
+{
+    /* ((x * 5) + (x ^ 3)) * ((x + 7) ^ (x * x)) */
+    static const Node x = { eval_var };
+    static const Node k3 = { eval_const, 0, 0, 3 };
+    static const Node k5 = { eval_const, 0, 0, 5 };
+    static const Node k7 = { eval_const, 0, 0, 7 };
+    static const Node a = { eval_mul, &x, &k5 };
+    static const Node b = { eval_xor, &x, &k3 };
+    static const Node c = { eval_add, &x, &k7 };
+    static const Node d = { eval_mul, &x, &x };
+    static const Node e = { eval_add, &a, &b };
+    static const Node f = { eval_xor, &c, &d };
+    static const Node root = { eval_mul, &e, &f };
+    uint32_t sum = 0, i;
+
+    for (i = 0; i < 2000000; i++) {
+        sum += root.eval(&root, i);
+    }
+    return sum;
+}
+
+int main(void)
+{
+    printf("interp %08x\n", interp(program, 5000000));
+    printf("tree %08x\n", bench_tree());
+    return 0;
+}
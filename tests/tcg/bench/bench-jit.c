@@ -0,0 +1,66 @@
+/*
+ * TCG benchmark: self-modifying code
+ *
+ * Emulate a guest JIT that keeps patching the immediate of a small
+ * function and calling it.  Every patch invalidates the translation of
+ * the function, so this measures the cost of code invalidation and
+ * retranslation rather than the speed of the generated code.
+ *
+ * SPDX-License-Identifier: GPL-2.0-or-later
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#define PATCHES     200000
+#define CALLS       16
+
+typedef long (*jit_fn)(long);
+
+/* Emit "return x + imm" at @p, with 0 <= imm < 2048 */
+static size_t emit_add(void *p, unsigned imm)
+{
+#if defined(__x86_64__)
+    /* lea imm32(%rdi), %eax; ret */
+    uint8_t insn[] = { 0x8d, 0x87, imm, imm >> 8, 0, 0, 0xc3 };
+#elif defined(__aarch64__)
+    /* add w0, w0, #imm; ret */
+    uint32_t insn[] = { 0x11000000 | (imm << 10), 0xd65f03c0 };
+#elif defined(__riscv) && __riscv_xlen == 64
+    /* addiw a0, a0, imm; ret */
+    uint32_t insn[] = { (imm << 20) | (10 << 15) | (10 << 7) | 0x1b,
+                        0x00008067 };
+#else
+#error "unsupported host"
+#endif
+
+    memcpy(p, insn, sizeof(insn));
+    __builtin___clear_cache((char *)p, (char *)p + sizeof(insn));
+    return sizeof(insn);
+}
+
+int main(void)
+{
+    void *code = mmap(NULL, 4096, PROT_READ | PROT_WRITE | PROT_EXEC,
+                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    jit_fn fn = (jit_fn)code;
+    long sum = 0;
+    int i, j;
+
+    if (code == MAP_FAILED) {
+        perror("mmap");
+        return 1;
+    }
+
+    for (i = 0; i < PATCHES; i++) {
+        emit_add(code, i & 2047);
+        for (j = 0; j < CALLS; j++) {
+            sum = fn(sum) & 0xffffff;
+        }
+    }
+
+    printf("jit %08lx\n", sum);
+    return 0;
+}
@@ -0,0 +1,122 @@
+#!/usr/bin/env python3
+#
+# Run the TCG benchmarks under a linux-user QEMU
+#
+# Each benchmark is run with -jitstats, which prints the translation
+# statistics of "info jit" when the guest exits, and its wall clock time
+# is measured.  If the insn plugin is available, a second run counts the
+# guest instructions so that the emulation speed can be given in MIPS.
+#
+# This program is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation; either version 2 of the License, or
+# (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program.  If not, see <http://www.gnu.org/licenses/>.
+#
+
+import argparse
+import json
+import os
+import re
+import shlex
+import subprocess
+import sys
+import time
+
+
+# See dump_exec_info() in accel/tcg/translate-all.c
+JIT_STATS = {
+    'tbs': r'^TB count\s+(\d+)',
+    'flushes': r'^TB flush count\s+(\d+)',
+    'invalidations': r'^TB invalidate count\s+(\d+)',
+    'translations': r'^TB translations\s+(\d+)',
+    'translation-s': r'^TB translations\s+\d+ \(([\d.]+) s',
+}
+
+
+def run(qemu, args, binary):
+    start = time.perf_counter()
+    out = subprocess.run(qemu + args + [binary], stdout=subprocess.PIPE,
+                         stderr=subprocess.STDOUT, check=True,
+                         universal_newlines=True).stdout
+    return time.perf_counter() - start, out
+
+
+def bench(qemu, plugin, binary, count):
+    result = {'name': os.path.basename(binary)}
+    times = []
+    for _ in range(count):
+        elapsed, out = run(qemu, ['-jitstats'], binary)
+        times.append(elapsed)
+    result['time-s'] = min(times)
+
+    for key, regex in JIT_STATS.items():
+        m = re.search(regex, out, re.M)
+        if m:
+            result[key] = float(m.group(1)) if '.' in m.group(1) \
+                else int(m.group(1))
+    if 'translation-s' in result:
+        result['translation-%'] = \
+            100 * result['translation-s'] / result['time-s']
+
+    if plugin:
+        _, out = run(qemu, ['-plugin', plugin + ',arg=inline',
+                            '-d', 'plugin'], binary)
+        m = re.search(r'^insns: (\d+)', out, re.M)
+        if m:
+            result['insns'] = int(m.group(1))
+            result['mips'] = result['insns'] / result['time-s'] / 1e6
+
+    return result
+
+
+def print_table(results):
+    columns = [('name', '{}'), ('time-s', '{:.3f}'), ('mips', '{:.1f}'),
+               ('tbs', '{}'), ('translations', '{}'),
+               ('translation-%', '{:.1f}'), ('invalidations', '{}'),
+               ('flushes', '{}')]
+    rows = [[c for c, _ in columns]]
+    for r in results:
+        rows.append([fmt.format(r[c]) if c in r else '-'
+                     for c, fmt in columns])
+    widths = [max(len(row[i]) for row in rows) for i in range(len(columns))]
+    for row in rows:
+        print('  '.join(cell.rjust(w) for cell, w in zip(row, widths)))
+
+
+def main():
+    parser = argparse.ArgumentParser(description='Run TCG benchmarks')
+    parser.add_argument('--qemu', required=True,
+                        help='QEMU linux-user binary, with any options')
+    parser.add_argument('--insn-plugin',
+                        help='path to libinsn.so, to compute MIPS')
+    parser.add_argument('--count', type=int, default=3,
+                        help='runs per benchmark, the fastest is kept')
+    parser.add_argument('--json', help='also write the results here')
+    parser.add_argument('benchmarks', nargs='+')
+    args = parser.parse_args()
+
+    qemu = shlex.split(args.qemu)
+    try:
+        results = [bench(qemu, args.insn_plugin, b, args.count)
+                   for b in args.benchmarks]
+    except subprocess.CalledProcessError as e:
+        print(f'{e.cmd[-1]} failed:\n{e.output}', file=sys.stderr)
+        return 1
+
+    print_table(results)
+    if args.json:
+        with open(args.json, 'w') as f:
+            json.dump(results, f, indent=4)
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
@@ -221,6 +221,39 @@ static inline int test_clrtnew(int arg1, int old_val)
   return ret;
 }
 
+/* Both instructions must see the registers as they were before the packet */
+static inline long long test_packet_swap(int x, int y)
+{
+  long long ret;
+  asm volatile("r4 = %1\n\t"
+               "r5 = %2\n\t"
+               "{\n\t"
+                   "r4 = r5\n\t"
+                   "r5 = r4\n\t"
+               "}\n\t"
+               "%0 = combine(r5, r4)\n\t"
+               : "=r"(ret)
+               : "r"(x), "r"(y)
+               : "r4", "r5");
+  return ret;
+}
+
+/* r6 is not read by the packet, but r5 is */
+static inline long long test_packet_write_unread(int x, int y)
+{
+  long long ret;
+  asm volatile("r5 = %1\n\t"
+               "{\n\t"
+                   "r6 = add(r5, %2)\n\t"
+                   "r5 = add(r5, #1)\n\t"
+               "}\n\t"
+               "%0 = combine(r6, r5)\n\t"
+               : "=r"(ret)
+               : "r"(x), "r"(y)
+               : "r5", "r6");
+  return ret;
+}
+
 int err;
 
 static void check(int val, int expect)
@@ -375,6 +408,14 @@ int main()
     res = test_clrtnew(2, 7);
     check(res, 7);
 
+    pair = test_packet_swap(5, 7);
+    check((int)pair, 7);
+    check((int)(pair >> 32), 5);
+
+    pair = test_packet_write_unread(5, 7);
+    check((int)pair, 6);
+    check((int)(pair >> 32), 12);
+
     puts(err ? "FAIL" : "PASS");
     return err;
 }
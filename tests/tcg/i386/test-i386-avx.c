@@ -0,0 +1,201 @@
+/* Test the VEX-encoded forms of some SSE2/SSE3 instructions.  */
+
+#include <immintrin.h>
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+
+union u {
+    __m256 ps;
+    __m256d pd;
+    __m256i si;
+    __m128 ps128;
+    __m128d pd128;
+    __m128i si128;
+    float f[8];
+    double d[4];
+    int i[8];
+    unsigned char uc[32];
+};
+
+union u fa = { .f = { 1, 2, 3, 4, 5, 6, 7, 8 } };
+union u fb = { .f = { 1, 3, 2, 4, -5, 6, 0, 9 } };
+union u da = { .d = { 1.5, -2.5, 3.5, 8 } };
+union u db = { .d = { 1.5, 3, -4, 0 } };
+union u ia = { .i = { 1, -2, 3, -4, 5, -6, 7, -8 } };
+union u bytes = { .uc = "abcdefghijklmnopqrstuvwxyz012345" };
+
+static int ret;
+
+static void check(const char *name, const void *got, const void *exp,
+                  size_t len)
+{
+    if (memcmp(got, exp, len)) {
+        printf("FAIL: %s\n", name);
+        ret = 1;
+    }
+}
+
+static void test_dup(void)
+{
+    union u r;
+    static const float ldup[8] = { 1, 1, 3, 3, 5, 5, 7, 7 };
+    static const float hdup[8] = { 2, 2, 4, 4, 6, 6, 8, 8 };
+    static const double ddup[4] = { 1.5, 1.5, 3.5, 3.5 };
+
+    r.ps = _mm256_moveldup_ps(fa.ps);
+    check("vmovsldup", r.f, ldup, sizeof(ldup));
+    r.ps = _mm256_movehdup_ps(fa.ps);
+    check("vmovshdup", r.f, hdup, sizeof(hdup));
+    r.pd = _mm256_movedup_pd(da.pd);
+    check("vmovddup ymm", r.d, ddup, sizeof(ddup));
+    r.pd = _mm256_setzero_pd();
+    r.pd128 = _mm_loaddup_pd(&da.d[2]);
+    check("vmovddup m64", r.d, &ddup[2], 2 * sizeof(double));
+}
+
+static void test_lddqu(void)
+{
+    union u r;
+
+    r.si = _mm256_lddqu_si256((const __m256i *)bytes.uc);
+    check("vlddqu", r.uc, bytes.uc, 32);
+}
+
+static void test_vtest(void)
+{
+    union u neg = { .f = { -1, 1, 1, 1, 1, 1, 1, -1 } };
+
+    /* Only the sign bits are tested.  */
+    if (!_mm256_testz_ps(fa.ps, fa.ps) || _mm256_testz_ps(neg.ps, neg.ps)) {
+        printf("FAIL: vtestps zf\n");
+        ret = 1;
+    }
+    if (_mm256_testc_ps(fa.ps, neg.ps) || !_mm256_testc_ps(neg.ps, neg.ps)) {
+        printf("FAIL: vtestps cf\n");
+        ret = 1;
+    }
+    if (_mm_testz_pd(da.pd128, da.pd128)
+        || !_mm_testz_pd(db.pd128, da.pd128)) {
+        printf("FAIL: vtestpd zf\n");
+        ret = 1;
+    }
+    if (!_mm256_testc_pd(da.pd, da.pd) || _mm256_testc_pd(db.pd, da.pd)) {
+        printf("FAIL: vtestpd cf\n");
+        ret = 1;
+    }
+}
+
+static void test_cmp(void)
+{
+    union u r, nan = fb;
+    static const int gt[8] = { 0, 0, -1, 0, -1, 0, -1, 0 };
+    static const int eq_uq[8] = { -1, 0, 0, -1, 0, -1, -1, 0 };
+    static const int neq_oq[8] = { 0, -1, -1, 0, -1, 0, 0, -1 };
+
+    r.ps = _mm256_cmp_ps(fa.ps, fb.ps, _CMP_GT_OS);
+    check("vcmpps gt_os", r.i, gt, sizeof(gt));
+    r.ps = _mm256_cmp_ps(fa.ps, fb.ps, _CMP_NLE_UQ);
+    check("vcmpps nle_uq", r.i, gt, sizeof(gt));
+
+    nan.f[6] = NAN;
+    fa.f[6] = 0;
+    r.ps = _mm256_cmp_ps(fa.ps, nan.ps, _CMP_EQ_UQ);
+    check("vcmpps eq_uq", r.i, eq_uq, sizeof(eq_uq));
+    r.ps = _mm256_cmp_ps(fa.ps, nan.ps, _CMP_NEQ_OQ);
+    check("vcmpps neq_oq", r.i, neq_oq, sizeof(neq_oq));
+    fa.f[6] = 7;
+
+    r.pd = _mm256_cmp_pd(da.pd, db.pd, _CMP_TRUE_UQ);
+    if (r.i[0] != -1 || r.i[7] != -1) {
+        printf("FAIL: vcmppd true_uq\n");
+        ret = 1;
+    }
+    r.pd = _mm256_cmp_pd(da.pd, db.pd, _CMP_GE_OQ);
+    if (r.i[1] != -1 || r.i[3] != 0 || r.i[5] != -1 || r.i[7] != -1) {
+        printf("FAIL: vcmppd ge_oq\n");
+        ret = 1;
+    }
+}
+
+static void test_cvt(void)
+{
+    union u r;
+    static const double ps2pd[4] = { 1, 2, 3, 4 };
+    static const float pd2ps[4] = { 1.5, -2.5, 3.5, 8 };
+    static const double dq2pd[4] = { 1, -2, 3, -4 };
+    static const int tpd2dq[4] = { 1, -2, 3, 8 };
+
+    r.pd = _mm256_cvtps_pd(fa.ps128);
+    check("vcvtps2pd ymm", r.d, ps2pd, sizeof(ps2pd));
+    r.ps = _mm256_set1_ps(-1);
+    r.ps128 = _mm256_cvtpd_ps(da.pd);
+    check("vcvtpd2ps ymm", r.f, pd2ps, sizeof(pd2ps));
+    r.pd = _mm256_cvtepi32_pd(ia.si128);
+    check("vcvtdq2pd ymm", r.d, dq2pd, sizeof(dq2pd));
+    r.si128 = _mm256_cvttpd_epi32(da.pd);
+    check("vcvttpd2dq ymm", r.i, tpd2dq, sizeof(tpd2dq));
+}
+
+static void test_permil(void)
+{
+    union u r, sel = { .i = { 3, 2, 1, 0, 0, 0, 5, 6 } };
+    static const float pvar[8] = { 4, 3, 2, 1, 5, 5, 6, 7 };
+    static const float pimm[8] = { 2, 1, 4, 3, 6, 5, 8, 7 };
+    static const double pdimm[4] = { -2.5, 1.5, 3.5, 8 };
+
+    r.ps = _mm256_permutevar_ps(fa.ps, sel.si);
+    check("vpermilps ymm", r.f, pvar, sizeof(pvar));
+    r.ps = _mm256_permute_ps(fa.ps, 0xb1);
+    check("vpermilps imm", r.f, pimm, sizeof(pimm));
+    r.pd = _mm256_permute_pd(da.pd, 0x9);
+    check("vpermilpd imm", r.d, pdimm, sizeof(pdimm));
+}
+
+static void test_blendv(void)
+{
+    union u r, mask = { .i = { -1, 0, -1, 0, 0, -1, 0, -1 } };
+    static const float bps[8] = { 1, 2, 2, 4, 5, 6, 7, 9 };
+    union u bb;
+    int i;
+
+    r.ps = _mm256_blendv_ps(fa.ps, fb.ps, mask.ps);
+    check("vblendvps", r.f, bps, sizeof(bps));
+
+    r.si128 = _mm_blendv_epi8(bytes.si128, _mm_setzero_si128(),
+                              ia.si128);
+    memcpy(bb.uc, bytes.uc, 16);
+    for (i = 0; i < 16; i++) {
+        if (ia.uc[i] & 0x80) {
+            bb.uc[i] = 0;
+        }
+    }
+    check("vpblendvb", r.uc, bb.uc, 16);
+}
+
+static void test_maskmov(void)
+{
+    union u r, mask = { .i = { -1, 0, -1, 0, 0, -1, 0, -1 } };
+    static const float ld[8] = { 1, 0, 3, 0, 0, 6, 0, 8 };
+    double st[4] = { 0, 0, 0, 0 };
+    static const double st_exp[4] = { 1.5, 0, 3.5, 0 };
+    union u qmask = { .i = { 0, -1, 0, 0, 0, -1, 0, 0 } };
+
+    r.ps = _mm256_maskload_ps(fa.f, mask.si);
+    check("vmaskmovps load", r.f, ld, sizeof(ld));
+    _mm256_maskstore_pd(st, qmask.si, da.pd);
+    check("vmaskmovpd store", st, st_exp, sizeof(st));
+}
+
+int main(void)
+{
+    test_dup();
+    test_lddqu();
+    test_vtest();
+    test_cmp();
+    test_cvt();
+    test_permil();
+    test_blendv();
+    test_maskmov();
+    return ret;
+}
@@ -11,6 +11,7 @@
  */
 
 #include "qemu/osdep.h"
+#include "qemu-common.h"
 #include "block/aio.h"
 #include "qapi/error.h"
 #include "qemu/timer.h"
@@ -186,6 +187,72 @@ static void test_bh_schedule(void)
     qemu_bh_delete(data.bh);
 }
 
+typedef struct {
+    AioDeferredSubmit ds;
+    int n;
+} DeferTestData;
+
+static void defer_test_cb(void *opaque)
+{
+    DeferTestData *data = opaque;
+
+    data->n++;
+}
+
+static void defer_bh_cb(void *opaque)
+{
+    DeferTestData *data = opaque;
+
+    g_assert(aio_defer_submit(ctx, &data->ds));
+    g_assert(aio_defer_submit(ctx, &data->ds));
+    g_assert_cmpint(data->n, ==, 0);
+}
+
+static void test_defer_submit(void)
+{
+    DeferTestData data = { .n = 0 };
+    QEMUBH *bh;
+
+    data.ds.cb = defer_test_cb;
+    data.ds.opaque = &data;
+
+    /* Outside the event loop the caller must submit by itself */
+    g_assert(!aio_defer_submit(ctx, &data.ds));
+
+    bh = aio_bh_new(ctx, defer_bh_cb, &data);
+    qemu_bh_schedule(bh);
+    g_assert(aio_poll(ctx, true));
+    g_assert_cmpint(data.n, ==, 1);
+
+    g_assert(!aio_poll(ctx, false));
+    g_assert_cmpint(data.n, ==, 1);
+    qemu_bh_delete(bh);
+}
+
+static void defer_cancel_bh_cb(void *opaque)
+{
+    DeferTestData *data = opaque;
+
+    g_assert(aio_defer_submit(ctx, &data->ds));
+    g_assert(aio_cancel_deferred_submit(ctx, &data->ds));
+    g_assert(!aio_cancel_deferred_submit(ctx, &data->ds));
+}
+
+static void test_defer_submit_cancel(void)
+{
+    DeferTestData data = { .n = 0 };
+    QEMUBH *bh;
+
+    data.ds.cb = defer_test_cb;
+    data.ds.opaque = &data;
+
+    bh = aio_bh_new(ctx, defer_cancel_bh_cb, &data);
+    qemu_bh_schedule(bh);
+    g_assert(aio_poll(ctx, true));
+    g_assert_cmpint(data.n, ==, 0);
+    qemu_bh_delete(bh);
+}
+
 static void test_bh_schedule10(void)
 {
     BHTestData data = { .n = 0, .max = 10 };
@@ -456,6 +523,51 @@ static void test_wait_event_notifier_noflush(void)
     event_notifier_cleanup(&data.e);
 }
 
+#ifdef CONFIG_POSIX
+typedef struct {
+    char buf[16];
+    ssize_t len;
+    int n;
+} FdReadTestData;
+
+static void fd_read_done_cb(void *opaque, void *buf, ssize_t len)
+{
+    FdReadTestData *data = opaque;
+
+    g_assert_cmpint(len, >, 0);
+    g_assert_cmpint(len, <=, sizeof(data->buf));
+    memcpy(data->buf, buf, len);
+    data->len = len;
+    data->n++;
+}
+
+static void test_fd_read_handler(void)
+{
+    FdReadTestData data = { .n = 0 };
+    int fds[2];
+
+    g_assert(!qemu_pipe(fds));
+    qemu_set_nonblock(fds[0]);
+    aio_set_fd_read_handler(ctx, fds[0], false, fd_read_done_cb,
+                            sizeof(data.buf), NULL, &data);
+    g_assert(!aio_poll(ctx, false));
+    g_assert_cmpint(data.n, ==, 0);
+
+    g_assert_cmpint(write(fds[1], "hello", 5), ==, 5);
+    g_assert(aio_poll(ctx, true));
+    g_assert_cmpint(data.n, ==, 1);
+    g_assert_cmpint(data.len, ==, 5);
+    g_assert(!memcmp(data.buf, "hello", 5));
+    g_assert(!aio_poll(ctx, false));
+    g_assert_cmpint(data.n, ==, 1);
+
+    aio_set_fd_read_handler(ctx, fds[0], false, NULL, 0, NULL, NULL);
+    g_assert(!aio_poll(ctx, false));
+    close(fds[0]);
+    close(fds[1]);
+}
+#endif
+
 static void test_timer_schedule(void)
 {
     TimerTestData data = { .n = 0, .ctx = ctx, .ns = SCALE_MS * 750LL,
@@ -889,6 +1001,8 @@ int main(int argc, char **argv)
     g_test_init(&argc, &argv, NULL);
     g_test_add_func("/aio/acquire",                 test_acquire);
     g_test_add_func("/aio/bh/schedule",             test_bh_schedule);
+    g_test_add_func("/aio/defer-submit",            test_defer_submit);
+    g_test_add_func("/aio/defer-submit-cancel",     test_defer_submit_cancel);
     g_test_add_func("/aio/bh/schedule10",           test_bh_schedule10);
     g_test_add_func("/aio/bh/cancel",               test_bh_cancel);
     g_test_add_func("/aio/bh/delete",               test_bh_delete);
@@ -900,6 +1014,9 @@ int main(int argc, char **argv)
     g_test_add_func("/aio/event/wait/no-flush-cb",  test_wait_event_notifier_noflush);
     g_test_add_func("/aio/event/flush",             test_flush_event_notifier);
     g_test_add_func("/aio/external-client",         test_aio_external_client);
+#ifdef CONFIG_POSIX
+    g_test_add_func("/aio/fd/read",                 test_fd_read_handler);
+#endif
     g_test_add_func("/aio/timer/schedule",          test_timer_schedule);
 
     g_test_add_func("/aio/coroutine/queue-chaining", test_queue_chaining);
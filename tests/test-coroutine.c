@@ -293,6 +293,66 @@ static void test_lifecycle(void)
 }
 
 
+/*
+ * Check that an attached pool recycles coroutines and keeps as many as
+ * were in use at the same time
+ */
+
+static void coroutine_fn yield_once(void *opaque)
+{
+    qemu_coroutine_yield();
+}
+
+static void test_pool(void)
+{
+    CoroutinePool *pool = qemu_coroutine_pool_new();
+    Coroutine *co, *cos[100];
+    bool done = false;
+    int i;
+
+    qemu_coroutine_pool_attach(pool);
+
+    co = qemu_coroutine_create(set_and_exit, &done);
+    g_assert_cmpint(pool->in_use, ==, 1);
+    qemu_coroutine_enter(co);
+    g_assert(done);
+    g_assert_cmpint(pool->in_use, ==, 0);
+    g_assert_cmpint(pool->size, ==, 1);
+    g_assert_cmpint(stat64_get(&pool->misses), ==, 1);
+
+    done = false;
+    g_assert(qemu_coroutine_create(set_and_exit, &done) == co);
+    g_assert_cmpint(stat64_get(&pool->hits), ==, 1);
+    qemu_coroutine_enter(co);
+    g_assert(done);
+
+    for (i = 0; i < ARRAY_SIZE(cos); i++) {
+        cos[i] = qemu_coroutine_create(yield_once, NULL);
+        qemu_coroutine_enter(cos[i]);
+    }
+    g_assert_cmpint(pool->in_use, ==, ARRAY_SIZE(cos));
+    for (i = 0; i < ARRAY_SIZE(cos); i++) {
+        qemu_coroutine_enter(cos[i]);
+    }
+    g_assert_cmpint(pool->in_use, ==, 0);
+    g_assert_cmpint(pool->size, ==, ARRAY_SIZE(cos));
+    g_assert_cmpint(qemu_coroutine_pool_max_size(pool), ==,
+                    ARRAY_SIZE(cos));
+
+    /* Without new coroutines, trimming shrinks the pool to a batch */
+    qemu_coroutine_pool_trim(pool);
+    g_assert_cmpint(qemu_coroutine_pool_max_size(pool), <,
+                    ARRAY_SIZE(cos));
+    g_assert_cmpint(pool->size, ==, qemu_coroutine_pool_max_size(pool));
+
+    /* A coroutine may terminate after its pool was freed */
+    co = qemu_coroutine_create(yield_once, NULL);
+    qemu_coroutine_enter(co);
+    qemu_coroutine_pool_attach(NULL);
+    qemu_coroutine_pool_free(pool);
+    qemu_coroutine_enter(co);
+}
+
 #define RECORD_SIZE 10 /* Leave some room for expansion */
 struct coroutine_position {
     int func;
@@ -490,6 +550,7 @@ int main(int argc, char **argv)
      */
     if (CONFIG_COROUTINE_POOL) {
         g_test_add_func("/basic/no-dangling-access", test_no_dangling_access);
+        g_test_add_func("/basic/pool", test_pool);
     }
 
     g_test_add_func("/basic/lifecycle", test_lifecycle);
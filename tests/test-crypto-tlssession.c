@@ -172,6 +172,126 @@ static void test_crypto_tls_session_psk(void)
 }
 
 
+/*
+ * Kernel TLS needs a TCP socket, so connect two sockets over loopback
+ * instead of using a socketpair.
+ */
+static void test_tls_tcp_pair(int channel[2])
+{
+    struct sockaddr_in addr = {
+        .sin_family = AF_INET,
+        .sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+    };
+    socklen_t addrlen = sizeof(addr);
+    int lfd;
+
+    lfd = socket(AF_INET, SOCK_STREAM, 0);
+    g_assert(lfd >= 0);
+    g_assert(bind(lfd, (struct sockaddr *)&addr, sizeof(addr)) == 0);
+    g_assert(listen(lfd, 1) == 0);
+    g_assert(getsockname(lfd, (struct sockaddr *)&addr, &addrlen) == 0);
+
+    channel[1] = socket(AF_INET, SOCK_STREAM, 0);
+    g_assert(channel[1] >= 0);
+    g_assert(connect(channel[1], (struct sockaddr *)&addr,
+                     sizeof(addr)) == 0);
+    channel[0] = accept(lfd, NULL, NULL);
+    g_assert(channel[0] >= 0);
+    close(lfd);
+}
+
+
+static void test_crypto_tls_session_ktls(void)
+{
+    QCryptoTLSCreds *clientCreds;
+    QCryptoTLSCreds *serverCreds;
+    QCryptoTLSSession *clientSess = NULL;
+    QCryptoTLSSession *serverSess = NULL;
+    Error *err = NULL;
+    int channel[2];
+    bool clientShake = false;
+    bool serverShake = false;
+    char buf[5];
+    int i;
+
+    test_tls_tcp_pair(channel);
+    qemu_set_nonblock(channel[0]);
+    qemu_set_nonblock(channel[1]);
+
+    clientCreds = test_tls_creds_psk_create(
+        QCRYPTO_TLS_CREDS_ENDPOINT_CLIENT,
+        WORKDIR);
+    serverCreds = test_tls_creds_psk_create(
+        QCRYPTO_TLS_CREDS_ENDPOINT_SERVER,
+        WORKDIR);
+
+    clientSess = qcrypto_tls_session_new(
+        clientCreds, NULL, NULL,
+        QCRYPTO_TLS_CREDS_ENDPOINT_CLIENT, &error_abort);
+    serverSess = qcrypto_tls_session_new(
+        serverCreds, NULL, NULL,
+        QCRYPTO_TLS_CREDS_ENDPOINT_SERVER, &error_abort);
+
+    qcrypto_tls_session_set_callbacks(serverSess,
+                                      testWrite, testRead,
+                                      &channel[0]);
+    qcrypto_tls_session_set_callbacks(clientSess,
+                                      testWrite, testRead,
+                                      &channel[1]);
+
+    do {
+        if (!serverShake) {
+            g_assert(qcrypto_tls_session_handshake(serverSess,
+                                                   &error_abort) >= 0);
+            serverShake = qcrypto_tls_session_get_handshake_status(
+                serverSess) == QCRYPTO_TLS_HANDSHAKE_COMPLETE;
+        }
+        if (!clientShake) {
+            g_assert(qcrypto_tls_session_handshake(clientSess,
+                                                   &error_abort) >= 0);
+            clientShake = qcrypto_tls_session_get_handshake_status(
+                clientSess) == QCRYPTO_TLS_HANDSHAKE_COMPLETE;
+        }
+    } while (!clientShake || !serverShake);
+
+    if (qcrypto_tls_session_enable_ktls_tx(clientSess, channel[1],
+                                           &err) < 0) {
+        g_test_skip(error_get_pretty(err));
+        error_free(err);
+        goto cleanup;
+    }
+
+    /* Data written to the socket is encrypted by the kernel */
+    g_assert(write(channel[1], "hello", 5) == 5);
+    for (i = 0; i < 1000; i++) {
+        if (qcrypto_tls_session_read(serverSess, buf, 5) == 5) {
+            break;
+        }
+        g_assert(errno == EAGAIN);
+        g_usleep(1000);
+    }
+    g_assert(i < 1000);
+    g_assert(memcmp(buf, "hello", 5) == 0);
+
+    /* Records built by GnuTLS must not reach the socket any more */
+    g_assert(qcrypto_tls_session_write(clientSess, "world", 5) < 0);
+    g_assert(errno == EIO);
+    g_usleep(10000);
+    g_assert(qcrypto_tls_session_read(serverSess, buf, 5) < 0);
+    g_assert(errno == EAGAIN);
+
+ cleanup:
+    object_unparent(OBJECT(serverCreds));
+    object_unparent(OBJECT(clientCreds));
+
+    qcrypto_tls_session_free(serverSess);
+    qcrypto_tls_session_free(clientSess);
+
+    close(channel[0]);
+    close(channel[1]);
+}
+
+
 struct QCryptoTLSSessionTestData {
     const char *servercacrt;
     const char *clientcacrt;
@@ -408,6 +528,8 @@ int main(int argc, char **argv)
     /* Simple initial test using Pre-Shared Keys. */
     g_test_add_func("/qcrypto/tlssession/psk",
                     test_crypto_tls_session_psk);
+    g_test_add_func("/qcrypto/tlssession/ktls",
+                    test_crypto_tls_session_ktls);
 
     /* More complex tests using X.509 certificates. */
 # define TEST_SESS_REG(name, caCrt,                                     \
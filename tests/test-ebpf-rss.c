@@ -0,0 +1,204 @@
+/*
+ * eBPF RSS steering program test
+ *
+ * Runs the program with BPF_PROG_TEST_RUN on the verification vectors of
+ * the Microsoft RSS specification.  Loading it needs CAP_BPF or root, the
+ * tests are skipped otherwise.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include <sys/syscall.h>
+#include <arpa/inet.h>
+#include <linux/bpf.h>
+
+#include "qemu/bswap.h"
+#include "ebpf/ebpf_rss.h"
+#include "standard-headers/linux/virtio_net.h"
+
+#define TEST_DEFAULT_QUEUE  5
+
+static const uint8_t test_key[EBPF_RSS_KEY_SIZE] = {
+    0x6d, 0x5a, 0x56, 0xda, 0x25, 0x5b, 0x0e, 0xc2,
+    0x41, 0x67, 0x25, 0x3d, 0x43, 0xa3, 0x8f, 0xb0,
+    0xd0, 0xca, 0x2b, 0xcb, 0xae, 0x7b, 0x30, 0xb4,
+    0x77, 0xcb, 0x2d, 0xa3, 0x80, 0x30, 0xf2, 0x0c,
+    0x6a, 0x42, 0xb7, 0x3b, 0xbe, 0xac, 0x01, 0xfa,
+};
+
+typedef struct {
+    const char *src;
+    const char *dst;
+    uint16_t sport;
+    uint16_t dport;
+    uint32_t l3_hash;
+    uint32_t l4_hash;
+} RSSVector;
+
+static const RSSVector vectors[] = {
+    { "66.9.149.187", "161.142.100.80", 2794, 1766,
+      0x323e8fc2, 0x51ccc178 },
+    { "199.92.111.2", "65.69.140.83", 14230, 4739,
+      0xd718262a, 0xc626b0ea },
+    { "3ffe:2501:200:1fff::7", "3ffe:2501:200:3::1", 2794, 1766,
+      0x2cc18cd5, 0x40207d3d },
+};
+
+static EBPFRSSContext ctx;
+
+static bool loaded(void)
+{
+    if (!ebpf_rss_is_loaded(&ctx)) {
+        g_test_skip("cannot load the eBPF program, needs CAP_BPF");
+        return false;
+    }
+    return true;
+}
+
+static void configure(uint32_t hash_types)
+{
+    struct EBPFRSSConfig config = {
+        .hash_types = hash_types,
+        .indirections_len = EBPF_RSS_INDIRECTION_TABLE_SIZE,
+        .default_queue = TEST_DEFAULT_QUEUE,
+    };
+    uint16_t table[EBPF_RSS_INDIRECTION_TABLE_SIZE];
+    int i;
+
+    for (i = 0; i < EBPF_RSS_INDIRECTION_TABLE_SIZE; i++) {
+        table[i] = i;
+    }
+    g_assert(ebpf_rss_set_all(&ctx, &config, table, (uint8_t *)test_key));
+}
+
+/*
+ * The program expects the Ethernet header at offset 0, as on the transmit
+ * path of a tap device.  BPF_PROG_TEST_RUN pulls a first Ethernet header
+ * off socket filter input, so prepend a dummy one.
+ */
+static uint32_t run(const uint8_t *frame, size_t len)
+{
+    g_autofree uint8_t *data = g_malloc0(14 + len);
+    union bpf_attr attr;
+
+    data[12] = 0x08;
+    memcpy(data + 14, frame, len);
+
+    memset(&attr, 0, sizeof(attr));
+    attr.test.prog_fd = ctx.program_fd;
+    attr.test.data_in = (uintptr_t)data;
+    attr.test.data_size_in = 14 + len;
+    attr.test.repeat = 1;
+    g_assert_cmpint(syscall(__NR_bpf, BPF_PROG_TEST_RUN, &attr,
+                            sizeof(attr)), ==, 0);
+    return attr.test.retval;
+}
+
+/* An Ethernet frame with a TCP header, returns its length */
+static size_t build_tcp_frame(uint8_t *frame, const RSSVector *v)
+{
+    bool ipv6 = strchr(v->src, ':');
+    uint8_t *ip = frame + 14;
+    uint8_t *tcp;
+
+    memset(frame, 0, 14 + 40 + 20);
+    stw_be_p(frame + 12, ipv6 ? 0x86dd : 0x0800);
+    if (ipv6) {
+        ip[0] = 0x60;
+        stw_be_p(ip + 4, 20);
+        ip[6] = IPPROTO_TCP;
+        ip[7] = 64;
+        g_assert(inet_pton(AF_INET6, v->src, ip + 8) == 1);
+        g_assert(inet_pton(AF_INET6, v->dst, ip + 24) == 1);
+        tcp = ip + 40;
+    } else {
+        ip[0] = 0x45;
+        stw_be_p(ip + 2, 40);
+        ip[8] = 64;
+        ip[9] = IPPROTO_TCP;
+        g_assert(inet_pton(AF_INET, v->src, ip + 12) == 1);
+        g_assert(inet_pton(AF_INET, v->dst, ip + 16) == 1);
+        tcp = ip + 20;
+    }
+    stw_be_p(tcp, v->sport);
+    stw_be_p(tcp + 2, v->dport);
+    tcp[12] = 5 << 4;
+    return tcp + 20 - frame;
+}
+
+static void test_l4(void)
+{
+    uint8_t frame[14 + 40 + 20];
+    int i;
+
+    if (!loaded()) {
+        return;
+    }
+    configure(VIRTIO_NET_RSS_HASH_TYPE_IPv4 | VIRTIO_NET_RSS_HASH_TYPE_TCPv4 |
+              VIRTIO_NET_RSS_HASH_TYPE_IPv6 | VIRTIO_NET_RSS_HASH_TYPE_TCPv6);
+    for (i = 0; i < ARRAY_SIZE(vectors); i++) {
+        size_t len = build_tcp_frame(frame, &vectors[i]);
+
+        g_assert_cmpuint(run(frame, len), ==,
+                         vectors[i].l4_hash %
+                         EBPF_RSS_INDIRECTION_TABLE_SIZE);
+    }
+}
+
+static void test_l3(void)
+{
+    uint8_t frame[14 + 40 + 20];
+    int i;
+
+    if (!loaded()) {
+        return;
+    }
+    configure(VIRTIO_NET_RSS_HASH_TYPE_IPv4 | VIRTIO_NET_RSS_HASH_TYPE_IPv6);
+    for (i = 0; i < ARRAY_SIZE(vectors); i++) {
+        size_t len = build_tcp_frame(frame, &vectors[i]);
+
+        g_assert_cmpuint(run(frame, len), ==,
+                         vectors[i].l3_hash %
+                         EBPF_RSS_INDIRECTION_TABLE_SIZE);
+    }
+}
+
+static void test_default_queue(void)
+{
+    uint8_t frame[14 + 40 + 20];
+    size_t len;
+
+    if (!loaded()) {
+        return;
+    }
+    configure(VIRTIO_NET_RSS_HASH_TYPE_IPv6);
+
+    /* Not IP */
+    memset(frame, 0, sizeof(frame));
+    stw_be_p(frame + 12, 0x0806);
+    g_assert_cmpuint(run(frame, 60), ==, TEST_DEFAULT_QUEUE);
+
+    /* IPv4, but only IPv6 is hashed */
+    len = build_tcp_frame(frame, &vectors[0]);
+    g_assert_cmpuint(run(frame, len), ==, TEST_DEFAULT_QUEUE);
+}
+
+int main(int argc, char **argv)
+{
+    int ret;
+
+    g_test_init(&argc, &argv, NULL);
+
+    ebpf_rss_init(&ctx);
+    ebpf_rss_load(&ctx);
+
+    g_test_add_func("/ebpf-rss/l4", test_l4);
+    g_test_add_func("/ebpf-rss/l3", test_l3);
+    g_test_add_func("/ebpf-rss/default-queue", test_default_queue);
+
+    ret = g_test_run();
+    ebpf_rss_unload(&ctx);
+    return ret;
+}
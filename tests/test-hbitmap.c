@@ -800,6 +800,29 @@ static void hbitmap_test_add(const char *testpath,
                hbitmap_test_teardown);
 }
 
+static void test_hbitmap_merge(TestHBitmapData *data,
+                               const void *unused)
+{
+    HBitmap *src;
+
+    hbitmap_test_init(data, L3 + 23, 0);
+    src = hbitmap_alloc(L3 + 23, 0);
+
+    hbitmap_test_set(data, 5, L1);
+    hbitmap_set(src, L1, 10);
+    hbitmap_set(src, L2, L2 + 17);
+    hbitmap_set(src, L3, 23);
+    g_assert(hbitmap_merge(data->hb, src, data->hb));
+
+    /* Mirror the merge into the shadow bitmap; the bits are already set */
+    hbitmap_test_set(data, L1, 10);
+    hbitmap_test_set(data, L2, L2 + 17);
+    hbitmap_test_set(data, L3, 23);
+    hbitmap_test_check(data, 0);
+
+    hbitmap_free(src);
+}
+
 static void test_hbitmap_iter_and_reset(TestHBitmapData *data,
                                         const void *unused)
 {
@@ -1042,6 +1065,79 @@ static void test_hbitmap_next_dirty_area_after_truncate(TestHBitmapData *data,
     test_hbitmap_next_dirty_area_check(data, 0, INT64_MAX);
 }
 
+static void test_hbitmap_next_run_check(TestHBitmapData *data,
+                                        int64_t offset, int64_t count)
+{
+    int64_t end = offset + count;
+    int64_t len1, len2;
+    bool dirty1, dirty2;
+
+    len1 = hbitmap_next_run(data->hb, offset, end, &dirty1);
+
+    if (offset >= data->size) {
+        dirty2 = false;
+        len2 = count;
+    } else {
+        dirty2 = hbitmap_get(data->hb, offset);
+        for (len2 = 1; (offset + len2 < MIN(end, data->size) &&
+                        hbitmap_get(data->hb, offset + len2) == dirty2);
+             len2++)
+        {
+            ;
+        }
+    }
+
+    g_assert_cmpint(dirty1, ==, dirty2);
+    g_assert_cmpint(len1, ==, len2);
+}
+
+static void test_hbitmap_next_run_do(TestHBitmapData *data, int granularity)
+{
+    const int64_t offsets[] = {
+        0, 1, L1 - 1, L1, L2 - 1, L2, L2 + 1, L2 + 4, L2 + 5, L2 + 6,
+        L2 + 5 + L1 - 1, L2 + 5 + L1, L2 * 2 - 1, L2 * 2, L2 * 2 + 1, L3 - 1,
+        L3, L3 + 1,
+    };
+    const int64_t counts[] = { 1, 2, L1, L1 * 10, L2 + 1, L3 + L1 };
+    int i, j, pass;
+
+    hbitmap_test_init(data, L3, granularity);
+
+    for (pass = 0; pass < 4; pass++) {
+        switch (pass) {
+        case 1:
+            hbitmap_set(data->hb, L2, 1);
+            break;
+        case 2:
+            hbitmap_set(data->hb, L2 + 5, L1);
+            break;
+        case 3:
+            hbitmap_set(data->hb, L2 * 2, L3 - L2 * 2);
+            break;
+        }
+        for (i = 0; i < ARRAY_SIZE(offsets); i++) {
+            for (j = 0; j < ARRAY_SIZE(counts); j++) {
+                test_hbitmap_next_run_check(data, offsets[i], counts[j]);
+            }
+        }
+    }
+}
+
+static void test_hbitmap_next_run_0(TestHBitmapData *data, const void *unused)
+{
+    test_hbitmap_next_run_do(data, 0);
+}
+
+static void test_hbitmap_next_run_1(TestHBitmapData *data, const void *unused)
+{
+    test_hbitmap_next_run_do(data, 1);
+}
+
+static void test_hbitmap_next_run_4(TestHBitmapData *data, const void *unused)
+{
+    test_hbitmap_next_run_do(data, 4);
+}
+
 int main(int argc, char **argv)
 {
     g_test_init(&argc, &argv, NULL);
@@ -1094,6 +1190,8 @@ int main(int argc, char **argv)
     hbitmap_test_add("/hbitmap/serialize/zeroes",
                      test_hbitmap_serialize_zeroes);
 
+    hbitmap_test_add("/hbitmap/merge", test_hbitmap_merge);
+
     hbitmap_test_add("/hbitmap/iter/iter_and_reset",
                      test_hbitmap_iter_and_reset);
 
@@ -1113,6 +1211,10 @@ int main(int argc, char **argv)
     hbitmap_test_add("/hbitmap/next_dirty_area/next_dirty_area_after_truncate",
                      test_hbitmap_next_dirty_area_after_truncate);
 
+    hbitmap_test_add("/hbitmap/next_run/next_run_0", test_hbitmap_next_run_0);
+    hbitmap_test_add("/hbitmap/next_run/next_run_1", test_hbitmap_next_run_1);
+    hbitmap_test_add("/hbitmap/next_run/next_run_4", test_hbitmap_next_run_4);
+
     g_test_run();
 
     return 0;
@@ -0,0 +1,132 @@
+/*
+ * Interval tree tests
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+#include "qemu/osdep.h"
+#include "qemu/interval-tree.h"
+
+#define N 1000
+#define RANGE 10000
+
+static IntervalTreeNode nodes[N];
+static bool in_tree[N];
+
+static int check_subtree(IntervalTreeNode *node, IntervalTreeNode *parent,
+                         uint64_t *subtree_last)
+{
+    uint64_t left_last = 0, right_last = 0;
+    int left, right;
+
+    if (!node) {
+        *subtree_last = 0;
+        return 0;
+    }
+    g_assert(node->parent == parent);
+    if (node->left) {
+        g_assert_cmpuint(node->left->start, <=, node->start);
+    }
+    if (node->right) {
+        g_assert_cmpuint(node->right->start, >=, node->start);
+    }
+
+    left = check_subtree(node->left, node, &left_last);
+    right = check_subtree(node->right, node, &right_last);
+    g_assert_cmpint(ABS(left - right), <=, 1);
+    g_assert_cmpint(node->height, ==, 1 + MAX(left, right));
+
+    *subtree_last = MAX(node->last, MAX(left_last, right_last));
+    g_assert_cmpuint(node->subtree_last, ==, *subtree_last);
+    return node->height;
+}
+
+static void check_tree(IntervalTreeRoot *root)
+{
+    uint64_t subtree_last;
+
+    check_subtree(root->node, NULL, &subtree_last);
+}
+
+/* Compare a lookup with a scan of all the nodes */
+static void check_lookup(IntervalTreeRoot *root, uint64_t start, uint64_t last)
+{
+    bool found[N] = { };
+    IntervalTreeNode *node;
+    uint64_t prev_start = 0;
+    int i;
+
+    for (node = interval_tree_iter_first(root, start, last); node;
+         node = interval_tree_iter_next(node, start, last)) {
+        i = node - nodes;
+        g_assert(in_tree[i]);
+        g_assert(!found[i]);
+        g_assert_cmpuint(node->start, >=, prev_start);
+        found[i] = true;
+        prev_start = node->start;
+    }
+
+    for (i = 0; i < N; i++) {
+        bool overlaps = in_tree[i] &&
+                        nodes[i].start <= last && nodes[i].last >= start;
+
+        g_assert(found[i] == overlaps);
+    }
+}
+
+static void test_empty(void)
+{
+    IntervalTreeRoot root = INTERVAL_TREE_ROOT_INIT;
+
+    g_assert(interval_tree_is_empty(&root));
+    g_assert(!interval_tree_iter_first(&root, 0, UINT64_MAX));
+}
+
+static void test_random(void)
+{
+    IntervalTreeRoot root = INTERVAL_TREE_ROOT_INIT;
+    GRand *rand = g_rand_new_with_seed(1);
+    int i, round;
+
+    memset(in_tree, 0, sizeof(in_tree));
+    for (round = 0; round < 20 * N; round++) {
+        uint64_t start, last;
+
+        i = g_rand_int_range(rand, 0, N);
+        if (in_tree[i]) {
+            interval_tree_remove(&nodes[i], &root);
+            in_tree[i] = false;
+        } else {
+            nodes[i].start = g_rand_int_range(rand, 0, RANGE);
+            nodes[i].last = nodes[i].start + g_rand_int_range(rand, 0, 100);
+            interval_tree_insert(&nodes[i], &root);
+            in_tree[i] = true;
+        }
+
+        if (round % 64 == 0) {
+            check_tree(&root);
+            start = g_rand_int_range(rand, 0, RANGE);
+            last = start + g_rand_int_range(rand, 0, 200);
+            check_lookup(&root, start, last);
+        }
+    }
+
+    check_tree(&root);
+    check_lookup(&root, 0, UINT64_MAX);
+    for (i = 0; i < N; i++) {
+        if (in_tree[i]) {
+            interval_tree_remove(&nodes[i], &root);
+            in_tree[i] = false;
+        }
+    }
+    g_assert(interval_tree_is_empty(&root));
+    g_rand_free(rand);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func("/interval-tree/empty", test_empty);
+    g_test_add_func("/interval-tree/random", test_random);
+    return g_test_run();
+}
@@ -639,6 +639,114 @@ static void test_qga_file_write_read(gconstpointer fix)
     qobject_unref(ret);
 }
 
+static int64_t guest_file_open(const TestFixture *fixture, const char *mode)
+{
+    QDict *ret;
+    int64_t id;
+
+    ret = qmp_fd(fixture->fd, "{'execute': 'guest-file-open',"
+                 " 'arguments': { 'path': 'foo', 'mode': %s } }", mode);
+    g_assert_nonnull(ret);
+    qmp_assert_no_error(ret);
+    id = qdict_get_int(ret, "return");
+    qobject_unref(ret);
+    return id;
+}
+
+static void guest_file_close(const TestFixture *fixture, int64_t id)
+{
+    QDict *ret;
+
+    ret = qmp_fd(fixture->fd,
+                 "{'execute': 'guest-file-close',"
+                 " 'arguments': {'handle': %" PRId64 "} }",
+                 id);
+    qmp_assert_no_error(ret);
+    qobject_unref(ret);
+}
+
+/*
+ * The host end of the transfer cannot connect from here, so only check
+ * the argument checks, the state of a transfer waiting for the host and
+ * that closing the handle cancels it.
+ */
+static void test_qga_file_transfer(gconstpointer fix)
+{
+    const TestFixture *fixture = fix;
+    QDict *ret, *val, *error;
+    const gchar *class, *desc;
+    int64_t id;
+
+    /* the checksum is read back from the file */
+    id = guest_file_open(fixture, "w");
+    ret = qmp_fd(fixture->fd,
+                 "{'execute': 'guest-file-transfer',"
+                 " 'arguments': { 'handle': %" PRId64 ","
+                 " 'direction': 'to-guest' } }", id);
+    g_assert_nonnull(ret);
+    error = qdict_get_qdict(ret, "error");
+    g_assert_nonnull(error);
+    class = qdict_get_try_str(error, "class");
+    desc = qdict_get_try_str(error, "desc");
+    if (g_str_equal(class, "CommandNotFound")) {
+        g_test_skip("guest-file-transfer is not supported");
+        qobject_unref(ret);
+        guest_file_close(fixture, id);
+        return;
+    }
+    g_assert_nonnull(strstr(desc, "not open for reading and writing"));
+    qobject_unref(ret);
+    guest_file_close(fixture, id);
+
+    id = guest_file_open(fixture, "w+");
+    ret = qmp_fd(fixture->fd,
+                 "{'execute': 'guest-file-transfer',"
+                 " 'arguments': { 'handle': %" PRId64 ","
+                 " 'direction': 'from-guest' } }", id);
+    g_assert_nonnull(ret);
+    error = qdict_get_qdict(ret, "error");
+    if (error) {
+        desc = qdict_get_try_str(error, "desc");
+        g_assert_nonnull(strstr(desc, "vsock"));
+        g_test_skip(desc);
+        qobject_unref(ret);
+        guest_file_close(fixture, id);
+        return;
+    }
+    val = qdict_get_qdict(ret, "return");
+    g_assert_cmpint(qdict_get_int(val, "port"), >, 0);
+    qobject_unref(ret);
+
+    /* waiting for the host */
+    ret = qmp_fd(fixture->fd,
+                 "{'execute': 'guest-file-transfer-status',"
+                 " 'arguments': { 'handle': %" PRId64 "} }",
+                 id);
+    g_assert_nonnull(ret);
+    qmp_assert_no_error(ret);
+    val = qdict_get_qdict(ret, "return");
+    g_assert(qdict_get_bool(val, "active"));
+    g_assert_cmpint(qdict_get_int(val, "count"), ==, 0);
+    g_assert(!qdict_haskey(val, "sha256"));
+    g_assert(!qdict_haskey(val, "error"));
+    qobject_unref(ret);
+
+    /* the handle is busy */
+    ret = qmp_fd(fixture->fd,
+                 "{'execute': 'guest-file-read',"
+                 " 'arguments': { 'handle': %" PRId64 "} }",
+                 id);
+    g_assert_nonnull(ret);
+    error = qdict_get_qdict(ret, "error");
+    g_assert_nonnull(error);
+    desc = qdict_get_try_str(error, "desc");
+    g_assert_nonnull(strstr(desc, "transfer in progress"));
+    qobject_unref(ret);
+
+    /* close cancels the transfer */
+    guest_file_close(fixture, id);
+}
+
 static void test_qga_get_time(gconstpointer fix)
 {
     const TestFixture *fixture = fix;
@@ -989,6 +1097,7 @@ int main(int argc, char **argv)
                          test_qga_get_memory_blocks);
     g_test_add_data_func("/qga/file-ops", &fix, test_qga_file_ops);
     g_test_add_data_func("/qga/file-write-read", &fix, test_qga_file_write_read);
+    g_test_add_data_func("/qga/file-transfer", &fix, test_qga_file_transfer);
     g_test_add_data_func("/qga/get-time", &fix, test_qga_get_time);
     g_test_add_data_func("/qga/id", &fix, test_qga_id);
     g_test_add_data_func("/qga/invalid-oob", &fix, test_qga_invalid_oob);
@@ -11,6 +11,7 @@
 static AioContext *ctx;
 static ThreadPool *pool;
 static int active;
+static bool release;
 
 typedef struct {
     BlockAIOCB *aiocb;
@@ -34,6 +35,17 @@ static int long_cb(void *opaque)
     return 0;
 }
 
+static int blocking_cb(void *opaque)
+{
+    WorkerTestData *data = opaque;
+
+    qatomic_inc(&data->n);
+    while (!qatomic_read(&release)) {
+        g_usleep(1000);
+    }
+    return 0;
+}
+
 static void done_cb(void *opaque, int ret)
 {
     WorkerTestData *data = opaque;
@@ -222,6 +234,55 @@ static void do_test_cancel(bool sync)
     }
 }
 
+static void test_priority(void)
+{
+    WorkerTestData data[100], latency = { .n = 0, .ret = -EINPROGRESS };
+    ThreadPoolStats before, after;
+    int i, started = 0;
+
+    thread_pool_get_stats(pool, &before);
+
+    /* Occupy every thread that bulk requests may use, and queue more.  */
+    release = false;
+    for (i = 0; i < 100; i++) {
+        data[i].n = 0;
+        data[i].ret = -EINPROGRESS;
+        thread_pool_submit_aio(pool, blocking_cb, &data[i], done_cb, &data[i]);
+    }
+    thread_pool_submit_aio_prio(pool, THREAD_POOL_PRIO_LATENCY, worker_cb,
+                                &latency, done_cb, &latency);
+
+    /* The latency sensitive request runs while bulk ones are stuck.  */
+    active = 101;
+    while (latency.ret == -EINPROGRESS) {
+        aio_poll(ctx, true);
+    }
+    g_assert_cmpint(latency.n, ==, 1);
+    g_assert_cmpint(latency.ret, ==, 0);
+    for (i = 0; i < 100; i++) {
+        started += qatomic_read(&data[i].n);
+        g_assert_cmpint(data[i].ret, ==, -EINPROGRESS);
+    }
+    g_assert_cmpint(started, <, 100);
+
+    qatomic_set(&release, true);
+    while (active > 0) {
+        aio_poll(ctx, true);
+    }
+    for (i = 0; i < 100; i++) {
+        g_assert_cmpint(data[i].n, ==, 1);
+        g_assert_cmpint(data[i].ret, ==, 0);
+    }
+
+    thread_pool_get_stats(pool, &after);
+    g_assert_cmpint(after.submitted[THREAD_POOL_PRIO_LATENCY] -
+                    before.submitted[THREAD_POOL_PRIO_LATENCY], ==, 1);
+    g_assert_cmpint(after.submitted[THREAD_POOL_PRIO_BULK] -
+                    before.submitted[THREAD_POOL_PRIO_BULK], ==, 100);
+    g_assert_cmpint(after.completed - before.completed, ==, 101);
+    g_assert_cmpint(after.max_queued, >, 0);
+}
+
 static void test_cancel(void)
 {
     do_test_cancel(true);
@@ -243,6 +304,7 @@ int main(int argc, char **argv)
     g_test_add_func("/thread-pool/submit-aio", test_submit_aio);
     g_test_add_func("/thread-pool/submit-co", test_submit_co);
     g_test_add_func("/thread-pool/submit-many", test_submit_many);
+    g_test_add_func("/thread-pool/priority", test_priority);
     g_test_add_func("/thread-pool/cancel", test_cancel);
     g_test_add_func("/thread-pool/cancel-async", test_cancel_async);
 
@@ -671,6 +671,54 @@ static void test_accounting(void)
                                 (64.0 / 13)));
 }
 
+static void test_lease(void)
+{
+    int ops, bytes, i;
+    double level;
+
+    throttle_config_init(&cfg);
+    cfg.buckets[THROTTLE_BPS_TOTAL].avg = 1000000;
+    cfg.buckets[THROTTLE_OPS_WRITE].avg = 1000;
+
+    throttle_init(&ts);
+    throttle_timers_init(tt, ctx, QEMU_CLOCK_VIRTUAL,
+                         read_timer_cb, write_timer_cb, &ts);
+    throttle_config(&ts, QEMU_CLOCK_VIRTUAL, &cfg);
+
+    /* 10 ms worth of I/O, accounted right away */
+    g_assert(throttle_lease(&ts, QEMU_CLOCK_VIRTUAL, true, 10 * SCALE_MS,
+                            &ops, &bytes));
+    g_assert_cmpint(ops, ==, 10);
+    g_assert_cmpint(bytes, ==, 10000);
+    g_assert(double_cmp(ts.cfg.buckets[THROTTLE_BPS_TOTAL].level, 10000));
+    g_assert(double_cmp(ts.cfg.buckets[THROTTLE_OPS_WRITE].level, 10));
+
+    /* reads have no ops limit */
+    g_assert(throttle_lease(&ts, QEMU_CLOCK_VIRTUAL, false, 10 * SCALE_MS,
+                            &ops, &bytes));
+    g_assert_cmpint(ops, ==, INT_MAX);
+    g_assert_cmpint(bytes, ==, 10000);
+    g_assert(double_cmp(ts.cfg.buckets[THROTTLE_BPS_TOTAL].level, 20000));
+
+    /* too short to cover a single operation */
+    g_assert(!throttle_lease(&ts, QEMU_CLOCK_VIRTUAL, true, SCALE_US,
+                             &ops, &bytes));
+
+    /* leases stop once the buckets are full, and leave them untouched */
+    for (i = 0; i < 100; i++) {
+        level = ts.cfg.buckets[THROTTLE_BPS_TOTAL].level;
+        if (!throttle_lease(&ts, QEMU_CLOCK_VIRTUAL, true, 10 * SCALE_MS,
+                            &ops, &bytes)) {
+            break;
+        }
+    }
+    g_assert_cmpint(i, <, 100);
+    g_assert(double_cmp(ts.cfg.buckets[THROTTLE_BPS_TOTAL].level, level));
+    g_assert(throttle_compute_wait(&ts.cfg.buckets[THROTTLE_BPS_TOTAL]) == 0);
+
+    throttle_timers_destroy(tt);
+}
+
 static void test_groups(void)
 {
     ThrottleConfig cfg1, cfg2;
@@ -764,6 +812,7 @@ int main(int argc, char **argv)
                     test_iops_size_is_missing_limit);
     g_test_add_func("/throttle/config_functions",   test_config_functions);
     g_test_add_func("/throttle/accounting",         test_accounting);
+    g_test_add_func("/throttle/lease",              test_lease);
     g_test_add_func("/throttle/groups",             test_groups);
     return g_test_run();
 }
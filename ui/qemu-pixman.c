@@ -204,6 +204,34 @@ pixman_image_t *qemu_pixman_mirror_create(pixman_format_code_t format,
                                     pixman_image_get_stride(image));
 }
 
+static void qemu_pixman_free_large(pixman_image_t *image, void *data)
+{
+    qemu_free_large(pixman_image_get_data(image), GPOINTER_TO_SIZE(data));
+}
+
+/*
+ * Create an image whose bits come from qemu_alloc_large(), for big
+ * long-lived surfaces that are scanned and updated as a whole.
+ */
+pixman_image_t *qemu_pixman_image_new_large(pixman_format_code_t format,
+                                            int width, int height)
+{
+    int stride = ((PIXMAN_FORMAT_BPP(format) * width + 31) / 32) * 4;
+    size_t size = (size_t)stride * height;
+    pixman_image_t *image;
+
+    if (!size) {
+        return pixman_image_create_bits(format, width, height, NULL, 0);
+    }
+
+    image = pixman_image_create_bits(format, width, height,
+                                     qemu_alloc_large(size), stride);
+    assert(image != NULL);
+    pixman_image_set_destroy_function(image, qemu_pixman_free_large,
+                                      GSIZE_TO_POINTER(size));
+    return image;
+}
+
 void qemu_pixman_image_unref(pixman_image_t *image)
 {
     if (image == NULL) {
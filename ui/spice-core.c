@@ -467,6 +467,11 @@ static QemuOptsList qemu_spice_opts = {
             .name = "streaming-video",
             .type = QEMU_OPT_STRING,
         },{
+#if SPICE_SERVER_VERSION >= 0x000d02 /* release 0.13.2 */
+            .name = "video-codecs",
+            .type = QEMU_OPT_STRING,
+        },{
+#endif
             .name = "agent-mouse",
             .type = QEMU_OPT_BOOL,
         },{
@@ -778,6 +783,14 @@ static void qemu_spice_init(void)
         spice_server_set_streaming_video(spice_server, SPICE_STREAM_VIDEO_OFF);
     }
 
+#if SPICE_SERVER_VERSION >= 0x000d02 /* release 0.13.2 */
+    str = qemu_opt_get(opts, "video-codecs");
+    if (str && spice_server_set_video_codecs(spice_server, str) != 0) {
+        error_report("spice: invalid video-codecs: %s", str);
+        exit(1);
+    }
+#endif
+
     spice_server_set_agent_mouse
         (spice_server, qemu_opt_get_bool(opts, "agent-mouse", 1));
     spice_server_set_playback_compression
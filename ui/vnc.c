@@ -636,13 +636,26 @@ static void vnc_set_area_dirty(DECLARE_BITMAP(dirty[VNC_MAX_HEIGHT],
     }
 }
 
+/* Like vnc_set_area_dirty(), also keeping track of the dirty guest rows */
+static void vnc_set_guest_dirty(VncDisplay *vd, int x, int y, int w, int h)
+{
+    int height = vnc_height(vd);
+
+    vnc_set_area_dirty(vd->guest.dirty, vd, x, y, w, h);
+
+    y = MIN(y, height);
+    h = MIN(y + h, height) - y;
+    if (h > 0) {
+        bitmap_set(vd->guest.dirty_rows, y, h);
+    }
+}
+
 static void vnc_dpy_update(DisplayChangeListener *dcl,
                            int x, int y, int w, int h)
 {
     VncDisplay *vd = container_of(dcl, VncDisplay, dcl);
-    struct VncSurface *s = &vd->guest;
 
-    vnc_set_area_dirty(s->dirty, vd, x, y, w, h);
+    vnc_set_guest_dirty(vd, x, y, w, h);
 }
 
 void vnc_framebuffer_update(VncState *vs, int x, int y, int w, int h,
@@ -767,13 +780,12 @@ static void vnc_update_server_surface(VncDisplay *vd)
 
     width = vnc_width(vd);
     height = vnc_height(vd);
-    vd->server = pixman_image_create_bits(VNC_SERVER_FB_FORMAT,
-                                          width, height,
-                                          NULL, 0);
+    vd->server = qemu_pixman_image_new_large(VNC_SERVER_FB_FORMAT,
+                                             width, height);
 
     memset(vd->guest.dirty, 0x00, sizeof(vd->guest.dirty));
-    vnc_set_area_dirty(vd->guest.dirty, vd, 0, 0,
-                       width, height);
+    bitmap_zero(vd->guest.dirty_rows, VNC_MAX_HEIGHT);
+    vnc_set_guest_dirty(vd, 0, 0, width, height);
 }
 
 static bool vnc_check_pageflip(DisplaySurface *s1,
@@ -803,9 +815,8 @@ static void vnc_dpy_switch(DisplayChangeListener *dcl,
     vd->guest.format = surface->format;
 
     if (pageflip) {
-        vnc_set_area_dirty(vd->guest.dirty, vd, 0, 0,
-                           surface_width(surface),
-                           surface_height(surface));
+        vnc_set_guest_dirty(vd, 0, 0, surface_width(surface),
+                            surface_height(surface));
         return;
     }
 
@@ -3002,17 +3013,94 @@ static void vnc_rect_updated(VncDisplay *vd, int x, int y, struct timeval * tv)
     rect->updated = true;
 }
 
+/*
+ * Copy @len bytes from the guest surface to the server surface unless they
+ * are equal.  Returns true if they were not.
+ */
+static bool vnc_update_chunk_int(uint8_t *server, const uint8_t *guest,
+                                 size_t len)
+{
+    if (memcmp(server, guest, len) == 0) {
+        return false;
+    }
+    memcpy(server, guest, len);
+    return true;
+}
+
+#ifdef CONFIG_AVX2_OPT
+#pragma GCC push_options
+#pragma GCC target("avx2")
+#include <immintrin.h>
+
+/*
+ * Chunks are 64 bytes with the 32bpp server format, so this compares a
+ * chunk in two vector loads without the library calls, and stores what
+ * was loaded once a difference is found.
+ */
+static bool vnc_update_chunk_avx2(uint8_t *server, const uint8_t *guest,
+                                  size_t len)
+{
+    size_t i;
+
+    for (i = 0; i + 32 <= len; i += 32) {
+        __m256i g = _mm256_loadu_si256((const __m256i *)(guest + i));
+        __m256i s = _mm256_loadu_si256((const __m256i *)(server + i));
+
+        if ((uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(g, s)) !=
+            UINT32_MAX) {
+            _mm256_storeu_si256((__m256i *)(server + i), g);
+            for (i += 32; i + 32 <= len; i += 32) {
+                g = _mm256_loadu_si256((const __m256i *)(guest + i));
+                _mm256_storeu_si256((__m256i *)(server + i), g);
+            }
+            memcpy(server + i, guest + i, len - i);
+            return true;
+        }
+    }
+    return i < len && vnc_update_chunk_int(server + i, guest + i, len - i);
+}
+#pragma GCC pop_options
+#endif /* CONFIG_AVX2_OPT */
+
+static bool (*vnc_update_chunk)(uint8_t *, const uint8_t *, size_t) =
+    vnc_update_chunk_int;
+
+#ifdef CONFIG_AVX2_OPT
+#include "qemu/cpuid.h"
+
+static void __attribute__((constructor)) init_vnc_update_chunk(void)
+{
+    int max = __get_cpuid_max(0, NULL);
+    int a, b, c, d;
+
+    if (max >= 7) {
+        __cpuid(1, a, b, c, d);
+        /* We must check that AVX is not just available, but usable.  */
+        if ((c & bit_OSXSAVE) && (c & bit_AVX)) {
+            int bv;
+            __asm("xgetbv" : "=a"(bv), "=d"(d) : "c"(0));
+            __cpuid_count(7, 0, a, b, c, d);
+            if ((bv & 0x6) == 0x6 && (b & bit_AVX2)) {
+                vnc_update_chunk = vnc_update_chunk_avx2;
+            }
+        }
+    }
+}
+#endif /* CONFIG_AVX2_OPT */
+
 static int vnc_refresh_server_surface(VncDisplay *vd)
 {
     int width = MIN(pixman_image_get_width(vd->guest.fb),
                     pixman_image_get_width(vd->server));
     int height = MIN(pixman_image_get_height(vd->guest.fb),
                      pixman_image_get_height(vd->server));
-    int cmp_bytes, server_stride, line_bytes, guest_ll, guest_stride, y = 0;
+    int xmax = DIV_ROUND_UP(width, VNC_DIRTY_PIXELS_PER_BIT);
+    int cmp_bytes, server_stride, line_bytes, guest_ll, guest_stride, y;
     uint8_t *guest_row0 = NULL, *server_row0;
     VncState *vs;
     int has_dirty = 0;
     pixman_image_t *tmpbuf = NULL;
+    DECLARE_BITMAP(changed, VNC_DIRTY_BITS);
 
     struct timeval tv = { 0, 0 };
 
@@ -3044,54 +3132,51 @@ static int vnc_refresh_server_surface(VncDisplay *vd)
     }
     line_bytes = MIN(server_stride, guest_ll);
 
-    for (;;) {
+    /* Rows that are not in the row map have no dirty bits, skip them */
+    for (y = find_next_bit(vd->guest.dirty_rows, height, 0); y < height;
+         y = find_next_bit(vd->guest.dirty_rows, height, y + 1)) {
         int x;
         uint8_t *guest_ptr, *server_ptr;
-        unsigned long offset = find_next_bit((unsigned long *) &vd->guest.dirty,
-                                             height * VNC_DIRTY_BPL(&vd->guest),
-                                             y * VNC_DIRTY_BPL(&vd->guest));
-        if (offset == height * VNC_DIRTY_BPL(&vd->guest)) {
-            /* no more dirty bits */
-            break;
-        }
-        y = offset / VNC_DIRTY_BPL(&vd->guest);
-        x = offset % VNC_DIRTY_BPL(&vd->guest);
 
-        server_ptr = server_row0 + y * server_stride + x * cmp_bytes;
+        clear_bit(y, vd->guest.dirty_rows);
+        x = find_next_bit(vd->guest.dirty[y], xmax, 0);
+        if (x >= xmax) {
+            continue;
+        }
 
+        server_ptr = server_row0 + y * server_stride;
         if (vd->guest.format != VNC_SERVER_FB_FORMAT) {
             qemu_pixman_linebuf_fill(tmpbuf, vd->guest.fb, width, 0, y);
             guest_ptr = (uint8_t *)pixman_image_get_data(tmpbuf);
         } else {
             guest_ptr = guest_row0 + y * guest_stride;
         }
-        guest_ptr += x * cmp_bytes;
 
-        for (; x < DIV_ROUND_UP(width, VNC_DIRTY_PIXELS_PER_BIT);
-             x++, guest_ptr += cmp_bytes, server_ptr += cmp_bytes) {
+        bitmap_zero(changed, VNC_DIRTY_BITS);
+        for (; x < xmax; x = find_next_bit(vd->guest.dirty[y], xmax, x + 1)) {
             int _cmp_bytes = cmp_bytes;
-            if (!test_and_clear_bit(x, vd->guest.dirty[y])) {
-                continue;
-            }
+
             if ((x + 1) * cmp_bytes > line_bytes) {
                 _cmp_bytes = line_bytes - x * cmp_bytes;
             }
             assert(_cmp_bytes >= 0);
-            if (memcmp(server_ptr, guest_ptr, _cmp_bytes) == 0) {
+            if (!vnc_update_chunk(server_ptr + x * cmp_bytes,
+                                  guest_ptr + x * cmp_bytes, _cmp_bytes)) {
                 continue;
             }
-            memcpy(server_ptr, guest_ptr, _cmp_bytes);
             if (!vd->non_adaptive) {
                 vnc_rect_updated(vd, x * VNC_DIRTY_PIXELS_PER_BIT,
                                  y, &tv);
             }
-            QTAILQ_FOREACH(vs, &vd->clients, next) {
-                set_bit(x, vs->dirty[y]);
-            }
+            set_bit(x, changed);
             has_dirty++;
         }
+        bitmap_clear(vd->guest.dirty[y], 0, xmax);
 
-        y++;
+        /* Mark the whole row for every client at once */
+        QTAILQ_FOREACH(vs, &vd->clients, next) {
+            bitmap_or(vs->dirty[y], vs->dirty[y], changed, VNC_DIRTY_BITS);
+        }
     }
     qemu_pixman_image_unref(tmpbuf);
     return has_dirty;
@@ -121,6 +121,8 @@ struct VncSurface
     struct timeval last_freq_check;
     DECLARE_BITMAP(dirty[VNC_MAX_HEIGHT],
                    VNC_MAX_WIDTH / VNC_DIRTY_PIXELS_PER_BIT);
+    /* rows of @dirty that may have bits set */
+    DECLARE_BITMAP(dirty_rows, VNC_MAX_HEIGHT);
     VncRectStat stats[VNC_STAT_ROWS][VNC_STAT_COLS];
     pixman_image_t *fb;
     pixman_format_code_t format;
@@ -248,6 +250,7 @@ struct VncRectEntry
 struct VncJob
 {
     VncState *vs;
+    bool running;
 
     QLIST_HEAD(, VncRectEntry) rectangles;
     QTAILQ_ENTRY(VncJob) next;
@@ -23,8 +23,14 @@
 #include "trace.h"
 #include "aio-posix.h"
 
-/* Stop userspace polling on a handler if it isn't active for some time */
-#define POLL_IDLE_INTERVAL_NS (7 * NANOSECONDS_PER_SECOND)
+/* Weight of the last interval in the average time between events */
+#define POLL_INTERVAL_WEIGHT 8
+
+/*
+ * Stop userspace polling on a handler that no longer deserves it and has
+ * missed this many of its events, as expected from its average interval.
+ */
+#define POLL_IDLE_EVENTS 8
 
 bool aio_poll_disabled(AioContext *ctx)
 {
@@ -87,13 +93,16 @@ static bool aio_remove_fd_handler(AioContext *ctx, AioHandler *node)
     return true;
 }
 
-void aio_set_fd_handler(AioContext *ctx,
-                        int fd,
-                        bool is_external,
-                        IOHandler *io_read,
-                        IOHandler *io_write,
-                        AioPollFn *io_poll,
-                        void *opaque)
+static void aio_set_fd_handler_common(AioContext *ctx,
+                                      int fd,
+                                      bool is_external,
+                                      IOHandler *io_read,
+                                      IOReadDoneHandler *io_read_done,
+                                      size_t read_size,
+                                      bool is_event_notifier,
+                                      IOHandler *io_write,
+                                      AioPollFn *io_poll,
+                                      void *opaque)
 {
     AioHandler *node;
     AioHandler *new_node = NULL;
@@ -106,7 +115,7 @@ void aio_set_fd_handler(AioContext *ctx,
     node = find_aio_handler(ctx, fd);
 
     /* Are we deleting the fd handler? */
-    if (!io_read && !io_write && !io_poll) {
+    if (!io_read && !io_read_done && !io_write && !io_poll) {
         if (node == NULL) {
             qemu_lockcnt_unlock(&ctx->list_lock);
             return;
@@ -125,6 +134,9 @@ void aio_set_fd_handler(AioContext *ctx,
 
         /* Update handler with latest information */
         new_node->io_read = io_read;
+        new_node->io_read_done = io_read_done;
+        new_node->read_size = read_size;
+        new_node->is_event_notifier = is_event_notifier;
         new_node->io_write = io_write;
         new_node->io_poll = io_poll;
         new_node->opaque = opaque;
@@ -137,7 +149,8 @@ void aio_set_fd_handler(AioContext *ctx,
         }
         g_source_add_poll(&ctx->source, &new_node->pfd);
 
-        new_node->pfd.events = (io_read ? G_IO_IN | G_IO_HUP | G_IO_ERR : 0);
+        new_node->pfd.events = (io_read || io_read_done ?
+                                G_IO_IN | G_IO_HUP | G_IO_ERR : 0);
         new_node->pfd.events |= (io_write ? G_IO_OUT | G_IO_ERR : 0);
 
         QLIST_INSERT_HEAD_RCU(&ctx->aio_handlers, new_node, node);
@@ -164,6 +177,31 @@ void aio_set_fd_handler(AioContext *ctx,
     }
 }
 
+void aio_set_fd_handler(AioContext *ctx,
+                        int fd,
+                        bool is_external,
+                        IOHandler *io_read,
+                        IOHandler *io_write,
+                        AioPollFn *io_poll,
+                        void *opaque)
+{
+    aio_set_fd_handler_common(ctx, fd, is_external, io_read, NULL, 0, false,
+                              io_write, io_poll, opaque);
+}
+
+void aio_set_fd_read_handler(AioContext *ctx,
+                             int fd,
+                             bool is_external,
+                             IOReadDoneHandler *io_read_done,
+                             size_t read_size,
+                             AioPollFn *io_poll,
+                             void *opaque)
+{
+    assert(read_size > 0 || !io_read_done);
+    aio_set_fd_handler_common(ctx, fd, is_external, NULL, io_read_done,
+                              read_size, false, NULL, io_poll, opaque);
+}
+
 void aio_set_fd_poll(AioContext *ctx, int fd,
                      IOHandler *io_poll_begin,
                      IOHandler *io_poll_end)
@@ -184,8 +222,17 @@ void aio_set_event_notifier(AioContext *ctx,
                             EventNotifierHandler *io_read,
                             AioPollFn *io_poll)
 {
-    aio_set_fd_handler(ctx, event_notifier_get_fd(notifier), is_external,
-                       (IOHandler *)io_read, NULL, io_poll, notifier);
+    /*
+     * An eventfd only holds a counter, so the fd monitor may drain it on
+     * behalf of the handler; event_notifier_test_and_clear() then finds
+     * notifier->consumed set and needs no system call.
+     */
+    bool is_eventfd = notifier->rfd == notifier->wfd;
+
+    aio_set_fd_handler_common(ctx, event_notifier_get_fd(notifier),
+                              is_external, (IOHandler *)io_read, NULL,
+                              sizeof(uint64_t), is_eventfd && io_read,
+                              NULL, io_poll, notifier);
 }
 
 void aio_set_event_notifier_poll(AioContext *ctx,
@@ -261,7 +308,8 @@ bool aio_pending(AioContext *ctx)
         int revents;
 
         revents = node->pfd.revents & node->pfd.events;
-        if (revents & (G_IO_IN | G_IO_HUP | G_IO_ERR) && node->io_read &&
+        if (revents & (G_IO_IN | G_IO_HUP | G_IO_ERR) &&
+            (node->io_read || node->io_read_done) &&
             aio_node_check(ctx, node->is_external)) {
             result = true;
             break;
@@ -298,7 +346,63 @@ static void aio_free_deleted_handlers(AioContext *ctx)
     qemu_lockcnt_inc_and_unlock(&ctx->list_lock);
 }
 
-static bool aio_dispatch_handler(AioContext *ctx, AioHandler *node)
+/* Read the file descriptor of an aio_set_fd_read_handler() handler */
+static void aio_read_fd(AioHandler *node)
+{
+    char stack_buf[256];
+    void *buf = stack_buf;
+    ssize_t len;
+
+    if (node->read_size > sizeof(stack_buf)) {
+        buf = g_malloc(node->read_size);
+    }
+
+    do {
+        len = read(node->pfd.fd, buf, node->read_size);
+    } while (len < 0 && errno == EINTR);
+
+    /* On EAGAIN somebody else drained the file descriptor first */
+    if (len >= 0 || errno != EAGAIN) {
+        node->io_read_done(node->opaque, buf, len < 0 ? -errno : len);
+    }
+
+    if (buf != stack_buf) {
+        g_free(buf);
+    }
+}
+
+static void aio_dispatch_read(AioContext *ctx, AioHandler *node)
+{
+    if (aio_node_wants_data(node) && ctx->fdmon_ops->dispatch_read &&
+        ctx->fdmon_ops->dispatch_read(ctx, node)) {
+        return;
+    }
+
+    if (node->io_read_done) {
+        aio_read_fd(node);
+    } else {
+        node->io_read(node->opaque);
+    }
+}
+
+/* Update the average time between the events of a handler */
+static void poll_handler_event(AioHandler *node, int64_t now)
+{
+    if (node->poll_last_event) {
+        int64_t delta = now - node->poll_last_event;
+
+        if (node->poll_interval) {
+            node->poll_interval += (delta - node->poll_interval) /
+                                   POLL_INTERVAL_WEIGHT;
+        } else {
+            node->poll_interval = delta;
+        }
+    }
+    node->poll_last_event = now;
+}
+
+static bool aio_dispatch_handler(AioContext *ctx, AioHandler *node,
+                                 int64_t now)
 {
     bool progress = false;
     int revents;
@@ -306,6 +410,10 @@ static bool aio_dispatch_handler(AioContext *ctx, AioHandler *node)
     revents = node->pfd.revents & node->pfd.events;
     node->pfd.revents = 0;
 
+    if (revents && node->io_poll) {
+        poll_handler_event(node, now);
+    }
+
     /*
      * Start polling AioHandlers when they become ready because activity is
      * likely to continue.  Note that starvation is theoretically possible when
@@ -325,8 +433,8 @@ static bool aio_dispatch_handler(AioContext *ctx, AioHandler *node)
     if (!QLIST_IS_INSERTED(node, node_deleted) &&
         (revents & (G_IO_IN | G_IO_HUP | G_IO_ERR)) &&
         aio_node_check(ctx, node->is_external) &&
-        node->io_read) {
-        node->io_read(node->opaque);
+        (node->io_read || node->io_read_done)) {
+        aio_dispatch_read(ctx, node);
 
         /* aio_notify() does not count as progress */
         if (node->opaque != &ctx->notifier) {
@@ -349,14 +457,15 @@ static bool aio_dispatch_handler(AioContext *ctx, AioHandler *node)
  * scanning all handlers with aio_dispatch_handlers().
  */
 static bool aio_dispatch_ready_handlers(AioContext *ctx,
-                                        AioHandlerList *ready_list)
+                                        AioHandlerList *ready_list,
+                                        int64_t now)
 {
     bool progress = false;
     AioHandler *node;
 
     while ((node = QLIST_FIRST(ready_list))) {
         QLIST_REMOVE(node, node_ready);
-        progress = aio_dispatch_handler(ctx, node) || progress;
+        progress = aio_dispatch_handler(ctx, node, now) || progress;
     }
 
     return progress;
@@ -367,9 +476,10 @@ static bool aio_dispatch_handlers(AioContext *ctx)
 {
     AioHandler *node, *tmp;
     bool progress = false;
+    int64_t now = get_clock();
 
     QLIST_FOREACH_SAFE_RCU(node, &ctx->aio_handlers, node, tmp) {
-        progress = aio_dispatch_handler(ctx, node) || progress;
+        progress = aio_dispatch_handler(ctx, node, now) || progress;
     }
 
     return progress;
@@ -386,18 +496,34 @@ void aio_dispatch(AioContext *ctx)
     timerlistgroup_run_timers(&ctx->tlg);
 }
 
+static bool fdmon_supports_polling(AioContext *ctx)
+{
+    return ctx->fdmon_ops->need_wait != aio_poll_disabled;
+}
+
+/*
+ * Each handler is polled for its own window, so that an idle handler does
+ * not spin as long as a busy one sharing the AioContext.  All handlers are
+ * polled on the first round, and all of them are polled for as long as the
+ * busiest one if the fd monitor cannot wait on the others meanwhile.
+ */
 static bool run_poll_handlers_once(AioContext *ctx,
                                    int64_t now,
+                                   int64_t elapsed,
                                    int64_t *timeout)
 {
     bool progress = false;
+    bool budget = elapsed && fdmon_supports_polling(ctx);
     AioHandler *node;
     AioHandler *tmp;
 
     QLIST_FOREACH_SAFE(node, &ctx->poll_aio_handlers, node_poll, tmp) {
+        if (budget && elapsed >= node->poll_ns) {
+            continue;
+        }
         if (aio_node_check(ctx, node->is_external) &&
             node->io_poll(node->opaque)) {
-            node->poll_idle_timeout = now + POLL_IDLE_INTERVAL_NS;
+            poll_handler_event(node, now);
 
             /*
              * Polling was successful, exit try_poll_mode immediately
@@ -415,47 +541,99 @@ static bool run_poll_handlers_once(AioContext *ctx,
     return progress;
 }
 
-static bool fdmon_supports_polling(AioContext *ctx)
+/*
+ * Set how long @node is worth polling from the average time between its
+ * events.  ctx->poll_grow and ctx->poll_shrink are the rates at which the
+ * window follows the interval.
+ */
+static void adjust_polling_time(AioContext *ctx, AioHandler *node, int64_t now)
 {
-    return ctx->fdmon_ops->need_wait != aio_poll_disabled;
+    int64_t interval;
+    int64_t old = node->poll_ns;
+    int64_t target;
+
+    if (!node->poll_last_event) {
+        /* Newly polled handler, give it a chance */
+        node->poll_last_event = now;
+    }
+    interval = MAX(node->poll_interval, now - node->poll_last_event);
+
+    if (interval > ctx->poll_max_ns) {
+        /* Events are too rare for polling to catch them */
+        target = 0;
+    } else if (!node->poll_interval) {
+        /* Not enough events yet, try as hard as allowed */
+        target = ctx->poll_max_ns;
+    } else {
+        /* Most events arrive within twice the average interval */
+        target = MIN(interval * 2, ctx->poll_max_ns);
+    }
+
+    if (node->poll_ns < target) {
+        int64_t grow = ctx->poll_grow ? ctx->poll_grow : 2;
+
+        if (node->poll_ns) {
+            node->poll_ns = MIN(node->poll_ns * grow, target);
+        } else {
+            /* start polling at 4 microseconds */
+            node->poll_ns = MIN(4000, target);
+        }
+        trace_poll_grow(ctx, node, interval, old, node->poll_ns);
+    } else if (node->poll_ns > target) {
+        if (ctx->poll_shrink) {
+            node->poll_ns = MAX(node->poll_ns / ctx->poll_shrink, target);
+        } else {
+            node->poll_ns = target;
+        }
+        trace_poll_shrink(ctx, node, interval, old, node->poll_ns);
+    }
 }
 
-static bool remove_idle_poll_handlers(AioContext *ctx, int64_t now)
+/*
+ * Adjust the polling window of each handler, and set the one of the
+ * AioContext to the longest of them.  Handlers that went idle go back to
+ * file descriptor monitoring until they have an event again.
+ */
+static bool adjust_polling_times(AioContext *ctx, int64_t now)
 {
     AioHandler *node;
     AioHandler *tmp;
     bool progress = false;
-
-    /*
-     * File descriptor monitoring implementations without userspace polling
-     * support suffer from starvation when a subset of handlers is polled
-     * because fds will not be processed in a timely fashion.  Don't remove
-     * idle poll handlers.
-     */
-    if (!fdmon_supports_polling(ctx)) {
-        return false;
-    }
+    int64_t poll_ns = 0;
 
     QLIST_FOREACH_SAFE(node, &ctx->poll_aio_handlers, node_poll, tmp) {
-        if (node->poll_idle_timeout == 0LL) {
-            node->poll_idle_timeout = now + POLL_IDLE_INTERVAL_NS;
-        } else if (now >= node->poll_idle_timeout) {
-            trace_poll_remove(ctx, node, node->pfd.fd);
-            node->poll_idle_timeout = 0LL;
-            QLIST_SAFE_REMOVE(node, node_poll);
-            if (ctx->poll_started && node->io_poll_end) {
-                node->io_poll_end(node->opaque);
-
-                /*
-                 * Final poll in case ->io_poll_end() races with an event.
-                 * Nevermind about re-adding the handler in the rare case where
-                 * this causes progress.
-                 */
-                progress = node->io_poll(node->opaque) || progress;
-            }
+        int64_t idle_ns;
+
+        adjust_polling_time(ctx, node, now);
+        poll_ns = MAX(poll_ns, node->poll_ns);
+
+        /*
+         * File descriptor monitoring implementations without userspace
+         * polling support suffer from starvation when a subset of handlers
+         * is polled because fds will not be processed in a timely fashion.
+         * Don't remove idle poll handlers.
+         */
+        idle_ns = MAX(node->poll_interval, ctx->poll_max_ns) * POLL_IDLE_EVENTS;
+        if (!fdmon_supports_polling(ctx) || node->poll_ns ||
+            now - node->poll_last_event < idle_ns) {
+            continue;
+        }
+
+        trace_poll_remove(ctx, node, node->pfd.fd);
+        QLIST_SAFE_REMOVE(node, node_poll);
+        if (ctx->poll_started && node->io_poll_end) {
+            node->io_poll_end(node->opaque);
+
+            /*
+             * Final poll in case ->io_poll_end() races with an event.
+             * Nevermind about re-adding the handler in the rare case where
+             * this causes progress.
+             */
+            progress = node->io_poll(node->opaque) || progress;
         }
     }
 
+    ctx->poll_ns = poll_ns;
     return progress;
 }
 
@@ -489,18 +667,15 @@ static bool run_poll_handlers(AioContext *ctx, int64_t max_ns, int64_t *timeout)
     RCU_READ_LOCK_GUARD();
 
     start_time = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+    elapsed_time = 0;
     do {
-        progress = run_poll_handlers_once(ctx, start_time, timeout);
+        progress = run_poll_handlers_once(ctx, start_time + elapsed_time,
+                                          elapsed_time, timeout);
         elapsed_time = qemu_clock_get_ns(QEMU_CLOCK_REALTIME) - start_time;
         max_ns = qemu_soonest_timeout(*timeout, max_ns);
         assert(!(max_ns && progress));
     } while (elapsed_time < max_ns && !ctx->fdmon_ops->need_wait(ctx));
 
-    if (remove_idle_poll_handlers(ctx, start_time + elapsed_time)) {
-        *timeout = 0;
-        progress = true;
-    }
-
     /* If time has passed with no successful polling, adjust *timeout to
      * keep the same ending time.
      */
@@ -553,7 +728,7 @@ bool aio_poll(AioContext *ctx, bool blocking)
     bool progress;
     bool use_notify_me;
     int64_t timeout;
-    int64_t start = 0;
+    int64_t start, polled, woken, bh_done, fd_done, end;
 
     /*
      * There cannot be two concurrent aio_poll calls for the same AioContext (or
@@ -567,15 +742,25 @@ bool aio_poll(AioContext *ctx, bool blocking)
     assert(in_aio_context_home_thread(ctx == iohandler_get_aio_context() ?
                                       qemu_get_aio_context() : ctx));
 
+    aio_defer_submit_begin(ctx);
     qemu_lockcnt_inc(&ctx->list_lock);
 
-    if (ctx->poll_max_ns) {
-        start = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
-    }
+    start = get_clock();
 
     timeout = blocking ? aio_compute_timeout(ctx) : 0;
     progress = try_poll_mode(ctx, &timeout);
     assert(!(timeout && progress));
+    polled = get_clock();
+    event_loop_stats_add(&ctx->stats.poll_ns, polled - start);
+
+    /*
+     * Do not block while I/O deferred by polling handlers, or by the
+     * caller of a nested aio_poll(), has not been submitted yet.
+     */
+    if (aio_run_deferred_submits(ctx)) {
+        progress = true;
+        timeout = 0;
+    }
 
     /*
      * aio_notify can avoid the expensive event_notifier_set if
@@ -615,59 +800,41 @@ bool aio_poll(AioContext *ctx, bool blocking)
 
     aio_notify_accept(ctx);
 
+    woken = get_clock();
+    event_loop_stats_add(&ctx->stats.blocked_ns, woken - polled);
+
     /* Adjust polling time */
     if (ctx->poll_max_ns) {
-        int64_t block_ns = qemu_clock_get_ns(QEMU_CLOCK_REALTIME) - start;
-
-        if (block_ns <= ctx->poll_ns) {
-            /* This is the sweet spot, no adjustment needed */
-        } else if (block_ns > ctx->poll_max_ns) {
-            /* We'd have to poll for too long, poll less */
-            int64_t old = ctx->poll_ns;
-
-            if (ctx->poll_shrink) {
-                ctx->poll_ns /= ctx->poll_shrink;
-            } else {
-                ctx->poll_ns = 0;
-            }
-
-            trace_poll_shrink(ctx, old, ctx->poll_ns);
-        } else if (ctx->poll_ns < ctx->poll_max_ns &&
-                   block_ns < ctx->poll_max_ns) {
-            /* There is room to grow, poll longer */
-            int64_t old = ctx->poll_ns;
-            int64_t grow = ctx->poll_grow;
-
-            if (grow == 0) {
-                grow = 2;
-            }
-
-            if (ctx->poll_ns) {
-                ctx->poll_ns *= grow;
-            } else {
-                ctx->poll_ns = 4000; /* start polling at 4 microseconds */
-            }
-
-            if (ctx->poll_ns > ctx->poll_max_ns) {
-                ctx->poll_ns = ctx->poll_max_ns;
-            }
-
-            trace_poll_grow(ctx, old, ctx->poll_ns);
-        }
+        progress |= adjust_polling_times(ctx, woken);
     }
 
     progress |= aio_bh_poll(ctx);
+    bh_done = get_clock();
+    event_loop_stats_add(&ctx->stats.dispatch_ns[EVENT_LOOP_DISPATCH_BH],
+                         bh_done - woken);
 
     if (ret > 0) {
-        progress |= aio_dispatch_ready_handlers(ctx, &ready_list);
+        progress |= aio_dispatch_ready_handlers(ctx, &ready_list, woken);
     }
 
     aio_free_deleted_handlers(ctx);
 
     qemu_lockcnt_dec(&ctx->list_lock);
 
+    fd_done = get_clock();
+    event_loop_stats_add(&ctx->stats.dispatch_ns[EVENT_LOOP_DISPATCH_FD],
+                         fd_done - bh_done);
+
     progress |= timerlistgroup_run_timers(&ctx->tlg);
 
+    end = get_clock();
+    event_loop_stats_add(&ctx->stats.dispatch_ns[EVENT_LOOP_DISPATCH_TIMER],
+                         end - fd_done);
+    if (progress) {
+        event_loop_stats_latency(&ctx->stats, end - woken);
+    }
+
+    aio_defer_submit_end(ctx);
     return progress;
 }
 
@@ -22,6 +22,8 @@
 struct AioHandler {
     GPollFD pfd;
     IOHandler *io_read;
+    IOReadDoneHandler *io_read_done;
+    size_t read_size;
     IOHandler *io_write;
     AioPollFn *io_poll;
     IOHandler *io_poll_begin;
@@ -34,11 +36,21 @@ struct AioHandler {
 #ifdef CONFIG_LINUX_IO_URING
     QSLIST_ENTRY(AioHandler) node_submitted;
     unsigned flags; /* see fdmon-io_uring.c */
+    struct FDMonIoUringRead *io_uring_read; /* see fdmon-io_uring.c */
 #endif
-    int64_t poll_idle_timeout; /* when to stop userspace polling */
+    int64_t poll_ns;         /* how long this handler is worth polling */
+    int64_t poll_last_event; /* when the handler last had an event */
+    int64_t poll_interval;   /* average time between events, 0 if unknown */
     bool is_external;
+    bool is_event_notifier; /* opaque is an eventfd EventNotifier */
 };
 
+/* Does the AioContext read from the file descriptor on behalf of @node? */
+static inline bool aio_node_wants_data(AioHandler *node)
+{
+    return node->io_read_done || node->is_event_notifier;
+}
+
 /* Add a handler to a ready list */
 void aio_add_ready_handler(AioHandlerList *ready_list, AioHandler *node,
                            int revents);
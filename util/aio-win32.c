@@ -341,7 +341,11 @@ bool aio_poll(AioContext *ctx, bool blocking)
      */
     assert(in_aio_context_home_thread(ctx == iohandler_get_aio_context() ?
                                       qemu_get_aio_context() : ctx));
-    progress = false;
+    aio_defer_submit_begin(ctx);
+    progress = aio_run_deferred_submits(ctx);
+    if (progress) {
+        blocking = false;
+    }
 
     /* aio_notify can avoid the expensive event_notifier_set if
      * everything (file descriptors, bottom halves, timers) will
@@ -385,7 +389,9 @@ bool aio_poll(AioContext *ctx, bool blocking)
         HANDLE event;
         int ret;
 
-        timeout = blocking && !have_select_revents
+        /* Don't block if aio_notify() was called */
+        timeout = blocking && !have_select_revents &&
+                  !qatomic_read(&ctx->notified)
             ? qemu_timeout_ns_to_ms(aio_compute_timeout(ctx)) : 0;
         ret = WaitForMultipleObjects(count, events, FALSE, timeout);
         if (blocking) {
@@ -418,6 +424,7 @@ bool aio_poll(AioContext *ctx, bool blocking)
     qemu_lockcnt_dec(&ctx->list_lock);
 
     progress |= timerlistgroup_run_timers(&ctx->tlg);
+    aio_defer_submit_end(ctx);
     return progress;
 }
 
@@ -26,6 +26,7 @@
 #include "qemu/osdep.h"
 #include "qapi/error.h"
 #include "block/aio.h"
+#include "block/aio-wait.h"
 #include "block/thread-pool.h"
 #include "qemu/main-loop.h"
 #include "qemu/atomic.h"
@@ -171,6 +172,55 @@ int aio_bh_poll(AioContext *ctx)
     return ret;
 }
 
+bool aio_defer_submit(AioContext *ctx, AioDeferredSubmit *ds)
+{
+    if (!in_aio_context_home_thread(ctx) || !ctx->deferred_submit_depth) {
+        return false;
+    }
+    if (!ds->scheduled) {
+        ds->scheduled = true;
+        QSIMPLEQ_INSERT_TAIL(&ctx->deferred_submits, ds, next);
+    }
+    return true;
+}
+
+bool aio_cancel_deferred_submit(AioContext *ctx, AioDeferredSubmit *ds)
+{
+    if (!ds->scheduled) {
+        return false;
+    }
+    QSIMPLEQ_REMOVE(&ctx->deferred_submits, ds, AioDeferredSubmit, next);
+    ds->scheduled = false;
+    return true;
+}
+
+bool aio_run_deferred_submits(AioContext *ctx)
+{
+    AioDeferredSubmit *ds;
+    bool ret = false;
+
+    /* Callbacks may defer more work, pick it up in the same pass */
+    while ((ds = QSIMPLEQ_FIRST(&ctx->deferred_submits))) {
+        QSIMPLEQ_REMOVE_HEAD(&ctx->deferred_submits, next);
+        ds->scheduled = false;
+        ds->cb(ds->opaque);
+        ret = true;
+    }
+    return ret;
+}
+
+void aio_defer_submit_begin(AioContext *ctx)
+{
+    ctx->deferred_submit_depth++;
+}
+
+void aio_defer_submit_end(AioContext *ctx)
+{
+    assert(ctx->deferred_submit_depth > 0);
+    aio_run_deferred_submits(ctx);
+    ctx->deferred_submit_depth--;
+}
+
 void qemu_bh_schedule_idle(QEMUBH *bh)
 {
     aio_bh_enqueue(bh, BH_SCHEDULED | BH_IDLE);
@@ -261,7 +311,8 @@ aio_ctx_prepare(GSource *source, gint    *timeout)
     /* We assume there is no timeout already supplied */
     *timeout = qemu_timeout_ns_to_ms(aio_compute_timeout(ctx));
 
-    if (aio_prepare(ctx)) {
+    /* Don't block if aio_notify() was called */
+    if (aio_prepare(ctx) || qatomic_read(&ctx->notified)) {
         *timeout = 0;
     }
 
@@ -303,7 +354,9 @@ aio_ctx_dispatch(GSource     *source,
     AioContext *ctx = (AioContext *) source;
 
     assert(callback == NULL);
+    aio_defer_submit_begin(ctx);
     aio_dispatch(ctx);
+    aio_defer_submit_end(ctx);
     return true;
 }
 
@@ -313,6 +366,9 @@ aio_ctx_finalize(GSource     *source)
     AioContext *ctx = (AioContext *) source;
     QEMUBH *bh;
     unsigned flags;
+#ifdef CONFIG_LINUX_IO_URING
+    int i;
+#endif
 
     thread_pool_free(ctx->thread_pool);
 
@@ -325,15 +381,18 @@ aio_ctx_finalize(GSource     *source)
 #endif
 
 #ifdef CONFIG_LINUX_IO_URING
-    if (ctx->linux_io_uring) {
-        luring_detach_aio_context(ctx->linux_io_uring, ctx);
-        luring_cleanup(ctx->linux_io_uring);
-        ctx->linux_io_uring = NULL;
+    for (i = 0; i < LURING_NUM_RINGS; i++) {
+        if (ctx->linux_io_uring[i]) {
+            luring_detach_aio_context(ctx->linux_io_uring[i], ctx);
+            luring_cleanup(ctx->linux_io_uring[i]);
+            ctx->linux_io_uring[i] = NULL;
+        }
     }
 #endif
 
     assert(QSLIST_EMPTY(&ctx->scheduled_coroutines));
     qemu_bh_delete(ctx->co_schedule_bh);
+    qemu_coroutine_pool_free(ctx->co_pool);
 
     /* There must be no aio_bh_poll() calls going on */
     assert(QSIMPLEQ_EMPTY(&ctx->bh_slice_list));
@@ -395,25 +454,40 @@ LinuxAioState *aio_get_linux_aio(AioContext *ctx)
 #endif
 
 #ifdef CONFIG_LINUX_IO_URING
-LuringState *aio_setup_linux_io_uring(AioContext *ctx, Error **errp)
+LuringState *aio_setup_linux_io_uring(AioContext *ctx, unsigned int flags,
+                                      Error **errp)
 {
-    if (ctx->linux_io_uring) {
-        return ctx->linux_io_uring;
+    LuringState *sq_share = NULL;
+    int i;
+
+    assert(flags < LURING_NUM_RINGS);
+    if (ctx->linux_io_uring[flags]) {
+        return ctx->linux_io_uring[flags];
+    }
+
+    if (flags & LURING_SQPOLL) {
+        for (i = 0; i < LURING_NUM_RINGS; i++) {
+            if ((i & LURING_SQPOLL) && ctx->linux_io_uring[i]) {
+                sq_share = ctx->linux_io_uring[i];
+                break;
+            }
+        }
     }
 
-    ctx->linux_io_uring = luring_init(errp);
-    if (!ctx->linux_io_uring) {
+    ctx->linux_io_uring[flags] = luring_init(flags, sq_share, errp);
+    if (!ctx->linux_io_uring[flags]) {
         return NULL;
     }
 
-    luring_attach_aio_context(ctx->linux_io_uring, ctx);
-    return ctx->linux_io_uring;
+    luring_attach_aio_context(ctx->linux_io_uring[flags], ctx);
+    return ctx->linux_io_uring[flags];
 }
 
-LuringState *aio_get_linux_io_uring(AioContext *ctx)
+LuringState *aio_get_linux_io_uring(AioContext *ctx, unsigned int flags)
 {
-    assert(ctx->linux_io_uring);
-    return ctx->linux_io_uring;
+    assert(flags < LURING_NUM_RINGS);
+    assert(ctx->linux_io_uring[flags]);
+    return ctx->linux_io_uring[flags];
 }
 #endif
 
@@ -432,7 +506,12 @@ void aio_notify(AioContext *ctx)
      */
     smp_mb();
     if (qatomic_read(&ctx->notify_me)) {
-        event_notifier_set(&ctx->notifier);
+        if (!qatomic_xchg(&ctx->notify_kicked, true)) {
+            event_notifier_set(&ctx->notifier);
+            stat64_add(&ctx->notify_sent, 1);
+        } else {
+            stat64_add(&ctx->notify_saved, 1);
+        }
     }
 }
 
@@ -457,6 +536,16 @@ static void aio_context_notifier_cb(EventNotifier *e)
     AioContext *ctx = container_of(e, AioContext, notifier);
 
     event_notifier_test_and_clear(&ctx->notifier);
+
+    /*
+     * The EventNotifier is drained, so the next aio_notify() must write
+     * it again.  Write ctx->notify_kicked before reading e.g. bh->flags,
+     * so that an aio_notify() that skipped the write because it read
+     * the old value of notify_kicked is seen by the event loop.  Pairs
+     * with the smp_mb in aio_notify.
+     */
+    qatomic_set(&ctx->notify_kicked, false);
+    smp_mb();
 }
 
 /* Returns true if aio_notify() was called (e.g. a BH was scheduled) */
@@ -503,6 +592,8 @@ AioContext *aio_context_new(Error **errp)
     ctx = (AioContext *) g_source_new(&aio_source_funcs, sizeof(AioContext));
     QSLIST_INIT(&ctx->bh_list);
     QSIMPLEQ_INIT(&ctx->bh_slice_list);
+    QSIMPLEQ_INIT(&ctx->deferred_submits);
+    ctx->deferred_submit_depth = 0;
     aio_context_setup(ctx);
 
     ret = event_notifier_init(&ctx->notifier, false);
@@ -515,6 +606,10 @@ AioContext *aio_context_new(Error **errp)
 
     ctx->co_schedule_bh = aio_bh_new(ctx, co_schedule_bh_cb, ctx);
     QSLIST_INIT(&ctx->scheduled_coroutines);
+    ctx->co_pool = qemu_coroutine_pool_new();
+    ctx->notify_kicked = false;
+    stat64_init(&ctx->notify_sent, 0);
+    stat64_init(&ctx->notify_saved, 0);
 
     aio_set_event_notifier(ctx, &ctx->notifier,
                            false,
@@ -525,7 +620,7 @@ AioContext *aio_context_new(Error **errp)
 #endif
 
 #ifdef CONFIG_LINUX_IO_URING
-    ctx->linux_io_uring = NULL;
+    memset(ctx->linux_io_uring, 0, sizeof(ctx->linux_io_uring));
 #endif
 
     ctx->thread_pool = NULL;
@@ -640,9 +735,16 @@ void aio_context_unref(AioContext *ctx)
     g_source_unref(&ctx->source);
 }
 
-void aio_context_acquire(AioContext *ctx)
+void aio_context_acquire_impl(AioContext *ctx, const char *file, int line)
+{
+    QemuRecMutexLockFunc lock = qatomic_read(&qemu_aio_context_lock_func);
+
+    lock(&ctx->lock, file, line);
+}
+
+bool aio_context_try_acquire(AioContext *ctx)
 {
-    qemu_rec_mutex_lock(&ctx->lock);
+    return qemu_rec_mutex_trylock(&ctx->lock) == 0;
 }
 
 void aio_context_release(AioContext *ctx)
@@ -30,6 +30,7 @@ void event_notifier_init_fd(EventNotifier *e, int fd)
     e->rfd = fd;
     e->wfd = fd;
     e->initialized = true;
+    e->consumed = false;
 }
 #endif
 
@@ -67,6 +68,7 @@ int event_notifier_init(EventNotifier *e, int active)
         e->wfd = fds[1];
     }
     e->initialized = true;
+    e->consumed = false;
     if (active) {
         event_notifier_set(e);
     }
@@ -92,6 +94,7 @@ void event_notifier_cleanup(EventNotifier *e)
     close(e->wfd);
     e->wfd = -1;
     e->initialized = false;
+    e->consumed = false;
 }
 
 int event_notifier_get_fd(const EventNotifier *e)
@@ -129,6 +132,10 @@ int event_notifier_test_and_clear(EventNotifier *e)
         return 0;
     }
 
+    if (qatomic_xchg(&e->consumed, false)) {
+        return 1;
+    }
+
     /* Drain the notify pipe.  For eventfd, only 8 bytes will be read.  */
     value = 0;
     do {
@@ -41,6 +41,21 @@
  * fdmon_io_uring_wait().  Changes to AioHandlers are made by enqueuing them on
  * ctx->submit_list so that fdmon_io_uring_wait() can submit IORING_OP_POLL_ADD
  * and/or IORING_OP_POLL_REMOVE sqes for them.
+ *
+ * Handlers that want data rather than readiness (aio_set_fd_read_handler()
+ * and eventfd notifiers) get an IORING_OP_READ_MULTISHOT instead of
+ * IORING_OP_POLL_ADD.  The kernel reads into a ring of buffers provided by
+ * the handler's AioHandler and fdmon_io_uring_dispatch_read() passes them on,
+ * so an event costs no system call at all.  Data that the kernel has read
+ * cannot be put back into the file descriptor, which has two consequences:
+ *
+ * 1. While external clients are disabled, fdmon-poll must see the real
+ *    readiness of the file descriptors, so all reads are cancelled first and
+ *    re-armed when io_uring is used again.
+ *
+ * 2. Completions that arrive after a handler was removed cannot be delivered.
+ *    For eventfds the counter is written back, so that whoever reads the
+ *    eventfd next still sees the event; other data is dropped.
  */
 
 #include "qemu/osdep.h"
@@ -50,11 +65,40 @@
 
 enum {
     FDMON_IO_URING_ENTRIES  = 128, /* sq/cq ring size */
+    FDMON_IO_URING_READ_BUFS = 8, /* provided buffers per handler */
 
     /* AioHandler::flags */
     FDMON_IO_URING_PENDING  = (1 << 0),
     FDMON_IO_URING_ADD      = (1 << 1),
     FDMON_IO_URING_REMOVE   = (1 << 2),
+    FDMON_IO_URING_NO_READ  = (1 << 3), /* use POLL_ADD for this handler */
+
+    /* Low bits of user_data, the rest is the AioHandler */
+    FDMON_IO_URING_TAG_POLL = 0,
+    FDMON_IO_URING_TAG_READ = 1,
+    FDMON_IO_URING_TAG_MASK = 3,
+};
+
+typedef struct {
+    int bid;    /* buffer id, or -1 */
+    int res;
+} FDMonIoUringCompletion;
+
+/* Buffers and completions of a handler with an IORING_OP_READ_MULTISHOT */
+typedef struct FDMonIoUringRead FDMonIoUringRead;
+struct FDMonIoUringRead {
+    struct io_uring_buf_ring *br;
+    uint8_t *bufs;
+    size_t buf_size;
+    int bgid;
+    unsigned in_kernel;     /* buffers available to the kernel */
+    bool armed;             /* the read is in flight */
+    bool done;              /* end of file or error, don't re-arm */
+
+    /* Completions not yet passed to the handler */
+    unsigned head;
+    unsigned count;
+    FDMonIoUringCompletion queue[FDMON_IO_URING_READ_BUFS + 1];
 };
 
 static inline int poll_events_from_pfd(int pfd_events)
@@ -180,8 +224,369 @@ static void add_poll_remove_sqe(AioContext *ctx, AioHandler *node)
     struct io_uring_sqe *sqe = get_sqe(ctx);
 
     io_uring_prep_poll_remove(sqe, node);
+    io_uring_sqe_set_data(sqe, NULL);
+}
+
+#ifdef CONFIG_LINUX_IO_URING_READ_MULTISHOT
+static int process_cq_ring(AioContext *ctx, AioHandlerList *ready_list);
+
+/* Does the kernel read the file descriptor on behalf of @node? */
+static bool node_reads(AioContext *ctx, AioHandler *node)
+{
+    return ctx->fdmon_io_uring_can_read && aio_node_wants_data(node) &&
+           !(qatomic_read(&node->flags) & FDMON_IO_URING_NO_READ);
+}
+
+static uint8_t *read_buf(FDMonIoUringRead *r, int bid)
+{
+    return r->bufs + bid * r->buf_size;
+}
+
+/* Give a buffer back to the kernel */
+static void read_recycle(FDMonIoUringRead *r, int bid)
+{
+    io_uring_buf_ring_add(r->br, read_buf(r, bid), r->buf_size, bid,
+                          io_uring_buf_ring_mask(FDMON_IO_URING_READ_BUFS), 0);
+    io_uring_buf_ring_advance(r->br, 1);
+    r->in_kernel++;
+}
+
+static void read_push(AioContext *ctx, FDMonIoUringRead *r, int bid, int res)
+{
+    assert(r->count < ARRAY_SIZE(r->queue));
+    if (r->count++ == 0) {
+        ctx->fdmon_io_uring_pending++;
+    }
+    r->queue[(r->head + r->count - 1) % ARRAY_SIZE(r->queue)] =
+        (FDMonIoUringCompletion) { .bid = bid, .res = res };
+}
+
+static FDMonIoUringCompletion read_pop(AioContext *ctx, FDMonIoUringRead *r)
+{
+    FDMonIoUringCompletion c = r->queue[r->head];
+
+    assert(r->count > 0);
+    r->head = (r->head + 1) % ARRAY_SIZE(r->queue);
+    if (--r->count == 0) {
+        ctx->fdmon_io_uring_pending--;
+    }
+    return c;
+}
+
+static FDMonIoUringRead *read_new(AioContext *ctx, AioHandler *node)
+{
+    FDMonIoUringRead *r = g_new0(FDMonIoUringRead, 1);
+    int i, ret;
+
+    /* Skip group ids that are still registered by someone else */
+    for (i = 0; i < 16; i++) {
+        r->bgid = ctx->fdmon_io_uring_bgid++;
+        r->br = io_uring_setup_buf_ring(&ctx->fdmon_io_uring,
+                                        FDMON_IO_URING_READ_BUFS, r->bgid,
+                                        0, &ret);
+        if (r->br || ret != -EEXIST) {
+            break;
+        }
+    }
+    if (!r->br) {
+        g_free(r);
+        return NULL;
+    }
+
+    r->buf_size = node->read_size;
+    r->bufs = g_malloc(FDMON_IO_URING_READ_BUFS * r->buf_size);
+    for (i = 0; i < FDMON_IO_URING_READ_BUFS; i++) {
+        read_recycle(r, i);
+    }
+    return r;
+}
+
+/* Free the read state of @node, which has no read in flight */
+static void read_release(AioContext *ctx, AioHandler *node)
+{
+    FDMonIoUringRead *r = node->io_uring_read;
+    bool resignal;
+
+    if (!r) {
+        return;
+    }
+
+    /*
+     * Put back the part of the eventfd counter the handler never saw, but
+     * only while the handler is registered: once it is deleted, the owner
+     * may already have closed the fd, and the number may have been reused.
+     */
+    resignal = node->is_event_notifier &&
+               !QLIST_IS_INSERTED(node, node_deleted);
+
+    assert(!r->armed);
+    while (r->count) {
+        FDMonIoUringCompletion c = read_pop(ctx, r);
+
+        if (resignal && c.bid >= 0 && c.res == sizeof(uint64_t)) {
+            ssize_t ret;
+
+            do {
+                ret = write(node->pfd.fd, read_buf(r, c.bid), c.res);
+            } while (ret < 0 && errno == EINTR);
+        }
+    }
+
+    io_uring_free_buf_ring(&ctx->fdmon_io_uring, r->br,
+                           FDMON_IO_URING_READ_BUFS, r->bgid);
+    g_free(r->bufs);
+    g_free(r);
+    node->io_uring_read = NULL;
+}
+
+/* Start reading, or fall back to IORING_OP_POLL_ADD if that fails */
+static void add_read_sqe(AioContext *ctx, AioHandler *node)
+{
+    FDMonIoUringRead *r = node->io_uring_read;
+    struct io_uring_sqe *sqe;
+
+    if (!r) {
+        r = node->io_uring_read = read_new(ctx, node);
+        if (!r) {
+            qatomic_or(&node->flags, FDMON_IO_URING_NO_READ);
+            add_poll_add_sqe(ctx, node);
+            return;
+        }
+    }
+
+    if (r->armed || r->done || !r->in_kernel ||
+        ctx->fdmon_io_uring_disarming) {
+        return;
+    }
+
+    sqe = get_sqe(ctx);
+    io_uring_prep_read_multishot(sqe, node->pfd.fd, 0, -1, r->bgid);
+    io_uring_sqe_set_data(sqe,
+            (void *)((uintptr_t)node | FDMON_IO_URING_TAG_READ));
+    r->armed = true;
+    ctx->fdmon_io_uring_reads++;
+}
+
+static void add_read_cancel_sqe(AioContext *ctx, AioHandler *node)
+{
+    struct io_uring_sqe *sqe = get_sqe(ctx);
+
+    io_uring_prep_cancel(sqe,
+            (void *)((uintptr_t)node | FDMON_IO_URING_TAG_READ), 0);
+    io_uring_sqe_set_data(sqe, NULL);
+}
+
+/* Returns true if a handler became ready */
+static bool process_read_cqe(AioContext *ctx,
+                             AioHandlerList *ready_list,
+                             AioHandler *node,
+                             struct io_uring_cqe *cqe)
+{
+    FDMonIoUringRead *r = node->io_uring_read;
+    bool more = cqe->flags & IORING_CQE_F_MORE;
+    int bid = -1;
+    unsigned flags;
+
+    if (cqe->flags & IORING_CQE_F_BUFFER) {
+        bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+        r->in_kernel--;
+    }
+
+    /* Out of buffers, cancelled or interrupted: no data and no error */
+    if (bid >= 0 || (cqe->res != -ENOBUFS && cqe->res != -ECANCELED &&
+                     cqe->res != -EINTR && cqe->res != -EAGAIN)) {
+        if ((cqe->res == -EBADFD || cqe->res == -EINVAL) && !more &&
+            !r->count) {
+            /* The file cannot do multishot reads, monitor readiness */
+            r->armed = false;
+            ctx->fdmon_io_uring_reads--;
+            read_release(ctx, node);
+            qatomic_or(&node->flags, FDMON_IO_URING_NO_READ);
+            flags = qatomic_fetch_and(&node->flags, ~FDMON_IO_URING_REMOVE);
+            if (flags & FDMON_IO_URING_REMOVE) {
+                QLIST_INSERT_HEAD_RCU(&ctx->deleted_aio_handlers, node,
+                                      node_deleted);
+            } else {
+                add_poll_add_sqe(ctx, node);
+            }
+            return false;
+        }
+
+        read_push(ctx, r, bid, cqe->res);
+        if (cqe->res <= 0 && !more) {
+            r->done = true;
+        }
+    }
+
+    if (!more) {
+        r->armed = false;
+        ctx->fdmon_io_uring_reads--;
+
+        /* As with IORING_OP_POLL_ADD, deletion waits for the last cqe */
+        flags = qatomic_fetch_and(&node->flags, ~FDMON_IO_URING_REMOVE);
+        if (flags & FDMON_IO_URING_REMOVE) {
+            read_release(ctx, node);
+            QLIST_INSERT_HEAD_RCU(&ctx->deleted_aio_handlers, node,
+                                  node_deleted);
+            return false;
+        }
+
+        if (cqe->res == -ECANCELED || ctx->fdmon_io_uring_disarming) {
+            ctx->fdmon_io_uring_rearm = true;
+        } else {
+            add_read_sqe(ctx, node);
+        }
+    }
+
+    if (!r->count || QLIST_IS_INSERTED(node, node_deleted)) {
+        return false;
+    }
+    aio_add_ready_handler(ready_list, node, G_IO_IN);
+    return true;
 }
 
+/*
+ * Cancel all reads and wait until they are gone, so that the file
+ * descriptors can be monitored by other means.
+ */
+static int disarm_reads(AioContext *ctx, AioHandlerList *ready_list)
+{
+    AioHandler *node;
+    int ready = 0;
+    int ret;
+
+    ctx->fdmon_io_uring_disarming = true;
+    QLIST_FOREACH_RCU(node, &ctx->aio_handlers, node) {
+        if (node->io_uring_read && node->io_uring_read->armed) {
+            add_read_cancel_sqe(ctx, node);
+        }
+    }
+
+    while (ctx->fdmon_io_uring_reads) {
+        do {
+            ret = io_uring_submit_and_wait(&ctx->fdmon_io_uring, 1);
+        } while (ret == -EINTR);
+        assert(ret >= 0);
+
+        ready += process_cq_ring(ctx, ready_list);
+    }
+    ctx->fdmon_io_uring_disarming = false;
+    return ready;
+}
+
+/*
+ * Hand data that is still waiting in handlers to aio_poll() again, for
+ * example because external clients were disabled when it arrived, and
+ * re-arm reads that disarm_reads() cancelled.
+ */
+static int rescan_reads(AioContext *ctx, AioHandlerList *ready_list,
+                        bool rearm)
+{
+    AioHandler *node;
+    int ready = 0;
+
+    QLIST_FOREACH_RCU(node, &ctx->aio_handlers, node) {
+        FDMonIoUringRead *r = node->io_uring_read;
+
+        if (!r || QLIST_IS_INSERTED(node, node_deleted)) {
+            continue;
+        }
+        if (rearm) {
+            add_read_sqe(ctx, node);
+        }
+        if (r->count && aio_node_check(ctx, node->is_external)) {
+            aio_add_ready_handler(ready_list, node, G_IO_IN);
+            ready++;
+        }
+    }
+    return ready;
+}
+
+static bool fdmon_io_uring_dispatch_read(AioContext *ctx, AioHandler *node)
+{
+    FDMonIoUringRead *r = node->io_uring_read;
+
+    if (!r || !r->count) {
+        return false;
+    }
+
+    if (node->is_event_notifier) {
+        EventNotifier *e = node->opaque;
+
+        /* The counter is already drained, one callback covers it all */
+        while (r->count) {
+            FDMonIoUringCompletion c = read_pop(ctx, r);
+
+            if (c.bid >= 0) {
+                read_recycle(r, c.bid);
+            }
+        }
+        qatomic_set(&e->consumed, true);
+        node->io_read(node->opaque);
+    } else {
+        while (r->count && !QLIST_IS_INSERTED(node, node_deleted)) {
+            FDMonIoUringCompletion c = read_pop(ctx, r);
+
+            node->io_read_done(node->opaque,
+                               c.bid >= 0 ? read_buf(r, c.bid) : NULL,
+                               c.res);
+            if (c.bid >= 0) {
+                read_recycle(r, c.bid);
+            }
+        }
+    }
+
+    /* The read stopped when it ran out of buffers */
+    if (!r->armed && !r->done && r->in_kernel) {
+        enqueue(&ctx->submit_list, node, FDMON_IO_URING_ADD);
+    }
+    return true;
+}
+#else /* !CONFIG_LINUX_IO_URING_READ_MULTISHOT */
+static bool node_reads(AioContext *ctx, AioHandler *node)
+{
+    return false;
+}
+
+static void read_release(AioContext *ctx, AioHandler *node)
+{
+}
+
+static void add_read_sqe(AioContext *ctx, AioHandler *node)
+{
+    g_assert_not_reached();
+}
+
+static void add_read_cancel_sqe(AioContext *ctx, AioHandler *node)
+{
+    g_assert_not_reached();
+}
+
+static bool process_read_cqe(AioContext *ctx,
+                             AioHandlerList *ready_list,
+                             AioHandler *node,
+                             struct io_uring_cqe *cqe)
+{
+    g_assert_not_reached();
+}
+
+static int disarm_reads(AioContext *ctx, AioHandlerList *ready_list)
+{
+    g_assert_not_reached();
+}
+
+static int rescan_reads(AioContext *ctx, AioHandlerList *ready_list,
+                        bool rearm)
+{
+    g_assert_not_reached();
+}
+
+static bool fdmon_io_uring_dispatch_read(AioContext *ctx, AioHandler *node)
+{
+    return false;
+}
+#endif /* !CONFIG_LINUX_IO_URING_READ_MULTISHOT */
+
 /* Add a timeout that self-cancels when another cqe becomes ready */
 static void add_timeout_sqe(AioContext *ctx, int64_t ns)
 {
@@ -193,6 +598,7 @@ static void add_timeout_sqe(AioContext *ctx, int64_t ns)
 
     sqe = get_sqe(ctx);
     io_uring_prep_timeout(sqe, &ts, 1, 0);
+    io_uring_sqe_set_data(sqe, NULL);
 }
 
 /* Add sqes from ctx->submit_list for submission */
@@ -207,10 +613,24 @@ static void fill_sq_ring(AioContext *ctx)
     while ((node = dequeue(&submit_list, &flags))) {
         /* Order matters, just in case both flags were set */
         if (flags & FDMON_IO_URING_ADD) {
-            add_poll_add_sqe(ctx, node);
+            if (node_reads(ctx, node)) {
+                add_read_sqe(ctx, node);
+            } else {
+                add_poll_add_sqe(ctx, node);
+            }
         }
         if (flags & FDMON_IO_URING_REMOVE) {
-            add_poll_remove_sqe(ctx, node);
+            if (!node_reads(ctx, node)) {
+                add_poll_remove_sqe(ctx, node);
+            } else if (node->io_uring_read && node->io_uring_read->armed) {
+                add_read_cancel_sqe(ctx, node);
+            } else if (qatomic_fetch_and(&node->flags, ~FDMON_IO_URING_REMOVE) &
+                       FDMON_IO_URING_REMOVE) {
+                /* Nothing in flight, the handler can go right away */
+                read_release(ctx, node);
+                QLIST_INSERT_HEAD_RCU(&ctx->deleted_aio_handlers, node,
+                                      node_deleted);
+            }
         }
     }
 }
@@ -221,13 +641,19 @@ static bool process_cqe(AioContext *ctx,
                         struct io_uring_cqe *cqe)
 {
     AioHandler *node = io_uring_cqe_get_data(cqe);
+    uintptr_t tag = (uintptr_t)node & FDMON_IO_URING_TAG_MASK;
     unsigned flags;
 
-    /* poll_timeout and poll_remove have a zero user_data field */
+    /* poll_timeout, poll_remove and the like have a zero user_data field */
     if (!node) {
         return false;
     }
 
+    if (tag == FDMON_IO_URING_TAG_READ) {
+        node = (AioHandler *)((uintptr_t)node & ~FDMON_IO_URING_TAG_MASK);
+        return process_read_cqe(ctx, ready_list, node, cqe);
+    }
+
     /*
      * Deletion can only happen when IORING_OP_POLL_ADD completes.  If we race
      * with enqueue() here then we can safely clear the FDMON_IO_URING_REMOVE
@@ -270,13 +696,33 @@ static int fdmon_io_uring_wait(AioContext *ctx, AioHandlerList *ready_list,
                                int64_t timeout)
 {
     unsigned wait_nr = 1; /* block until at least one cqe is ready */
+    int ready = 0;
     int ret;
 
     /* Fall back while external clients are disabled */
     if (qatomic_read(&ctx->external_disable_cnt)) {
+        if (ctx->fdmon_io_uring_reads) {
+            ready = disarm_reads(ctx, ready_list);
+        }
+        if (ctx->fdmon_io_uring_pending) {
+            ready += rescan_reads(ctx, ready_list, false);
+        }
+        if (ready) {
+            return ready;
+        }
         return fdmon_poll_ops.wait(ctx, ready_list, timeout);
     }
 
+    if (ctx->fdmon_io_uring_rearm || ctx->fdmon_io_uring_pending) {
+        bool rearm = ctx->fdmon_io_uring_rearm;
+
+        ctx->fdmon_io_uring_rearm = false;
+        ready = rescan_reads(ctx, ready_list, rearm);
+        if (ready) {
+            timeout = 0;
+        }
+    }
+
     if (timeout == 0) {
         wait_nr = 0; /* non-blocking */
     } else if (timeout > 0) {
@@ -291,7 +737,7 @@ static int fdmon_io_uring_wait(AioContext *ctx, AioHandlerList *ready_list,
 
     assert(ret >= 0);
 
-    return process_cq_ring(ctx, ready_list);
+    return ready + process_cq_ring(ctx, ready_list);
 }
 
 static bool fdmon_io_uring_need_wait(AioContext *ctx)
@@ -311,6 +757,11 @@ static bool fdmon_io_uring_need_wait(AioContext *ctx)
         return true;
     }
 
+    /* Is there data that handlers have not seen yet? */
+    if (ctx->fdmon_io_uring_pending) {
+        return true;
+    }
+
     /* Are we falling back to fdmon-poll? */
     return qatomic_read(&ctx->external_disable_cnt);
 }
@@ -319,8 +770,26 @@ static const FDMonOps fdmon_io_uring_ops = {
     .update = fdmon_io_uring_update,
     .wait = fdmon_io_uring_wait,
     .need_wait = fdmon_io_uring_need_wait,
+    .dispatch_read = fdmon_io_uring_dispatch_read,
 };
 
+static bool fdmon_io_uring_probe_read(struct io_uring *ring)
+{
+#ifdef CONFIG_LINUX_IO_URING_READ_MULTISHOT
+    struct io_uring_probe *probe = io_uring_get_probe_ring(ring);
+    bool ret;
+
+    if (!probe) {
+        return false;
+    }
+    ret = io_uring_opcode_supported(probe, IORING_OP_READ_MULTISHOT);
+    io_uring_free_probe(probe);
+    return ret;
+#else
+    return false;
+#endif
+}
+
 bool fdmon_io_uring_setup(AioContext *ctx)
 {
     int ret;
@@ -330,6 +799,8 @@ bool fdmon_io_uring_setup(AioContext *ctx)
         return false;
     }
 
+    ctx->fdmon_io_uring_can_read =
+        fdmon_io_uring_probe_read(&ctx->fdmon_io_uring);
     QSLIST_INIT(&ctx->submit_list);
     ctx->fdmon_ops = &fdmon_io_uring_ops;
     return true;
@@ -338,8 +809,25 @@ bool fdmon_io_uring_setup(AioContext *ctx)
 void fdmon_io_uring_destroy(AioContext *ctx)
 {
     if (ctx->fdmon_ops == &fdmon_io_uring_ops) {
+        AioHandlerList ready_list = QLIST_HEAD_INITIALIZER(ready_list);
         AioHandler *node;
 
+        /*
+         * Data that was read already can only be given back for eventfds,
+         * see read_release().
+         */
+        if (ctx->fdmon_io_uring_reads) {
+            disarm_reads(ctx, &ready_list);
+        }
+        while ((node = QLIST_FIRST(&ready_list))) {
+            QLIST_REMOVE(node, node_ready);
+        }
+        QLIST_FOREACH(node, &ctx->aio_handlers, node) {
+            read_release(ctx, node);
+        }
+        ctx->fdmon_io_uring_can_read = false;
+        ctx->fdmon_io_uring_rearm = false;
+
         io_uring_queue_exit(&ctx->fdmon_io_uring);
 
         /* Move handlers due to be removed onto the deleted list */
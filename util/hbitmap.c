@@ -217,6 +217,25 @@ int64_t hbitmap_next_dirty(const HBitmap *hb, int64_t start, int64_t count)
     return MAX(start, first_dirty_off);
 }
 
+/*
+ * Return the index of the first word in [@pos, @sz) of @words that is not
+ * all ones, or @sz if there is none.  Testing a few words per iteration
+ * lets the compiler use vector instructions on fully dirty stretches.
+ */
+static size_t hb_find_non_full_word(const unsigned long *words,
+                                    size_t pos, size_t sz)
+{
+    while (pos + 4 <= sz &&
+           (words[pos] & words[pos + 1] & words[pos + 2] & words[pos + 3]) ==
+           (unsigned long)-1) {
+        pos += 4;
+    }
+    while (pos < sz && words[pos] == (unsigned long)-1) {
+        pos++;
+    }
+    return pos;
+}
+
 int64_t hbitmap_next_zero(const HBitmap *hb, int64_t start, int64_t count)
 {
     size_t pos = (start >> hb->granularity) >> BITS_PER_LEVEL;
@@ -245,9 +264,7 @@ int64_t hbitmap_next_zero(const HBitmap *hb, int64_t start, int64_t count)
     assert((start >> hb->granularity) < hb->size);
 
     if (cur == (unsigned long)-1) {
-        do {
-            pos++;
-        } while (pos < sz && last_lev[pos] == (unsigned long)-1);
+        pos = hb_find_non_full_word(last_lev, pos + 1, sz);
 
         if (pos >= sz) {
             return -1;
@@ -301,6 +318,67 @@ bool hbitmap_next_dirty_area(const HBitmap *hb, int64_t start, int64_t end,
     return true;
 }
 
+/*
+ * Number of words of the last level that hbitmap_next_run() scans for the
+ * end of a clean run, before it lets the upper levels skip the rest.
+ */
+#define HB_RUN_SCAN_WORDS 8
+
+int64_t hbitmap_next_run(const HBitmap *hb, int64_t start, int64_t end,
+                         bool *dirty)
+{
+    const unsigned long *last_lev = hb->levels[HBITMAP_LEVELS - 1];
+    uint64_t bit, end_bit;
+    unsigned long cur, flip;
+    size_t pos, sz, scan_end;
+    int64_t res;
+
+    assert(start >= 0 && start < end);
+
+    if (start >= hb->orig_size) {
+        *dirty = false;
+        return end - start;
+    }
+    end = MIN(end, hb->orig_size);
+
+    bit = start >> hb->granularity;
+    end_bit = ((end - 1) >> hb->granularity) + 1;
+    sz = (end_bit + BITS_PER_LONG - 1) >> BITS_PER_LEVEL;
+    pos = bit >> BITS_PER_LEVEL;
+
+    cur = last_lev[pos];
+    *dirty = cur & (1UL << (bit & (BITS_PER_LONG - 1)));
+
+    /* Set the bits that differ from the run, except those before @start */
+    flip = *dirty ? (unsigned long)-1 : 0;
+    cur = (cur ^ flip) & ~((1UL << (bit & (BITS_PER_LONG - 1))) - 1);
+
+    if (!cur) {
+        if (*dirty) {
+            pos = hb_find_non_full_word(last_lev, pos + 1, sz);
+        } else {
+            scan_end = MIN(sz, pos + 1 + HB_RUN_SCAN_WORDS);
+            for (pos++; pos < scan_end && !last_lev[pos]; pos++) {
+                ;
+            }
+            if (pos == scan_end && pos < sz) {
+                int64_t from = (int64_t)pos << (BITS_PER_LEVEL +
+                                                hb->granularity);
+
+                res = hbitmap_next_dirty(hb, from, end - from);
+                return (res < 0 ? end : res) - start;
+            }
+        }
+        if (pos >= sz) {
+            return end - start;
+        }
+        cur = last_lev[pos] ^ flip;
+    }
+
+    res = (((uint64_t)pos << BITS_PER_LEVEL) + ctzl(cur)) << hb->granularity;
+    return MIN(res, end) - start;
+}
+
 bool hbitmap_empty(const HBitmap *hb)
 {
     return hb->count == 0;
@@ -375,6 +453,32 @@ static uint64_t hb_count_between(HBitmap *hb, uint64_t start, uint64_t last)
     return count;
 }
 
+/* Bits of the last word of the last level that lie past the end of @hb */
+static unsigned long hb_tail_mask(const HBitmap *hb)
+{
+    unsigned bits = hb->size & (BITS_PER_LONG - 1);
+
+    return bits ? ~((1UL << bits) - 1) : 0;
+}
+
+/* Count the set bits of the whole bitmap with a plain sweep, which beats
+ * hb_count_between() unless the bitmap is very sparse.
+ */
+static uint64_t hb_count_all(const HBitmap *hb)
+{
+    const unsigned long *cur = hb->levels[HBITMAP_LEVELS - 1];
+    size_t i, n = hb->sizes[HBITMAP_LEVELS - 1];
+    uint64_t count = 0;
+
+    for (i = 0; i < n; i++) {
+        count += ctpopl(cur[i]);
+    }
+    if (n) {
+        count -= ctpopl(cur[n - 1] & hb_tail_mask(hb));
+    }
+    return count;
+}
+
 /* Setting starts at the last layer and propagates up if an element
  * changes.
  */
@@ -641,14 +745,18 @@ void hbitmap_serialize_part(const HBitmap *hb, uint8_t *buf,
                             uint64_t start, uint64_t count)
 {
     uint64_t el_count;
-    unsigned long *cur, *end;
+    unsigned long *cur;
+#ifdef HOST_WORDS_BIGENDIAN
+    unsigned long *end;
+#endif
 
     if (!count) {
         return;
     }
     serialization_chunk(hb, start, count, &cur, &el_count);
-    end = cur + el_count;
 
+#ifdef HOST_WORDS_BIGENDIAN
+    end = cur + el_count;
     while (cur != end) {
         unsigned long el =
             (BITS_PER_LONG == 32 ? cpu_to_le32(*cur) : cpu_to_le64(*cur));
@@ -657,6 +765,10 @@ void hbitmap_serialize_part(const HBitmap *hb, uint8_t *buf,
         buf += sizeof(el);
         cur++;
     }
+#else
+    /* The serialized format is the in-memory one */
+    memcpy(buf, cur, el_count * sizeof(unsigned long));
+#endif
 }
 
 void hbitmap_deserialize_part(HBitmap *hb, uint8_t *buf,
@@ -664,14 +776,18 @@ void hbitmap_deserialize_part(HBitmap *hb, uint8_t *buf,
                               bool finish)
 {
     uint64_t el_count;
-    unsigned long *cur, *end;
+    unsigned long *cur;
+#ifdef HOST_WORDS_BIGENDIAN
+    unsigned long *end;
+#endif
 
     if (!count) {
         return;
     }
     serialization_chunk(hb, start, count, &cur, &el_count);
-    end = cur + el_count;
 
+#ifdef HOST_WORDS_BIGENDIAN
+    end = cur + el_count;
     while (cur != end) {
         memcpy(cur, buf, sizeof(*cur));
 
@@ -684,6 +800,9 @@ void hbitmap_deserialize_part(HBitmap *hb, uint8_t *buf,
         buf += sizeof(unsigned long);
         cur++;
     }
+#else
+    memcpy(cur, buf, el_count * sizeof(unsigned long));
+#endif
     if (finish) {
         hbitmap_deserialize_finish(hb);
     }
@@ -745,7 +864,7 @@ void hbitmap_deserialize_finish(HBitmap *bitmap)
     }
 
     bitmap->levels[0][0] |= 1UL << (BITS_PER_LONG - 1);
-    bitmap->count = hb_count_between(bitmap, 0, bitmap->size - 1);
+    bitmap->count = hb_count_all(bitmap);
 }
 
 void hbitmap_free(HBitmap *hb)
@@ -874,8 +993,8 @@ static void hbitmap_sparse_merge(HBitmap *dst, const HBitmap *src)
  */
 bool hbitmap_merge(const HBitmap *a, const HBitmap *b, HBitmap *result)
 {
-    int i;
-    uint64_t j;
+    int i, last;
+    uint64_t j, count = 0;
 
     if (!hbitmap_can_merge(a, b) || !hbitmap_can_merge(a, result)) {
         return false;
@@ -908,16 +1027,29 @@ bool hbitmap_merge(const HBitmap *a, const HBitmap *b, HBitmap *result)
     /* This merge is O(size), as BITS_PER_LONG and HBITMAP_LEVELS are constant.
      * It may be possible to improve running times for sparsely populated maps
      * by using hbitmap_iter_next, but this is suboptimal for dense maps.
+     *
+     * The last level is by far the largest, so recompute the dirty count
+     * in the same pass instead of walking it again.
      */
     assert(a->size == b->size);
-    for (i = HBITMAP_LEVELS - 1; i >= 0; i--) {
+    last = HBITMAP_LEVELS - 1;
+    for (j = 0; j < a->sizes[last]; j++) {
+        unsigned long el = a->levels[last][j] | b->levels[last][j];
+
+        result->levels[last][j] = el;
+        count += ctpopl(el);
+    }
+    if (a->sizes[last]) {
+        count -= ctpopl(result->levels[last][a->sizes[last] - 1] &
+                        hb_tail_mask(result));
+    }
+    for (i = last - 1; i >= 0; i--) {
         for (j = 0; j < a->sizes[i]; j++) {
             result->levels[i][j] = a->levels[i][j] | b->levels[i][j];
         }
     }
 
-    /* Recompute the dirty count */
-    result->count = hb_count_between(result, 0, result->size - 1);
+    result->count = count;
 
     return true;
 }
@@ -0,0 +1,227 @@
+/*
+ * Intrusive interval tree
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/interval-tree.h"
+
+static inline int node_height(IntervalTreeNode *node)
+{
+    return node ? node->height : 0;
+}
+
+/* Recompute the height and subtree_last of @node from its children */
+static void node_update(IntervalTreeNode *node)
+{
+    node->height = 1 + MAX(node_height(node->left), node_height(node->right));
+    node->subtree_last = node->last;
+    if (node->left) {
+        node->subtree_last = MAX(node->subtree_last,
+                                 node->left->subtree_last);
+    }
+    if (node->right) {
+        node->subtree_last = MAX(node->subtree_last,
+                                 node->right->subtree_last);
+    }
+}
+
+/* Make @new take the place of @old as a child of @parent */
+static void replace_child(IntervalTreeRoot *root, IntervalTreeNode *parent,
+                          IntervalTreeNode *old, IntervalTreeNode *new)
+{
+    if (!parent) {
+        root->node = new;
+    } else if (parent->left == old) {
+        parent->left = new;
+    } else {
+        parent->right = new;
+    }
+    if (new) {
+        new->parent = parent;
+    }
+}
+
+static IntervalTreeNode *rotate_left(IntervalTreeRoot *root,
+                                     IntervalTreeNode *node)
+{
+    IntervalTreeNode *pivot = node->right;
+
+    node->right = pivot->left;
+    if (pivot->left) {
+        pivot->left->parent = node;
+    }
+    replace_child(root, node->parent, node, pivot);
+    pivot->left = node;
+    node->parent = pivot;
+
+    node_update(node);
+    node_update(pivot);
+    return pivot;
+}
+
+static IntervalTreeNode *rotate_right(IntervalTreeRoot *root,
+                                      IntervalTreeNode *node)
+{
+    IntervalTreeNode *pivot = node->left;
+
+    node->left = pivot->right;
+    if (pivot->right) {
+        pivot->right->parent = node;
+    }
+    replace_child(root, node->parent, node, pivot);
+    pivot->right = node;
+    node->parent = pivot;
+
+    node_update(node);
+    node_update(pivot);
+    return pivot;
+}
+
+/*
+ * Walk from @node up to the root, restoring the AVL invariant and the
+ * subtree_last of every node on the way.
+ */
+static void rebalance(IntervalTreeRoot *root, IntervalTreeNode *node)
+{
+    while (node) {
+        int balance;
+
+        node_update(node);
+        balance = node_height(node->left) - node_height(node->right);
+        if (balance > 1) {
+            if (node_height(node->left->left) <
+                node_height(node->left->right)) {
+                rotate_left(root, node->left);
+            }
+            node = rotate_right(root, node);
+        } else if (balance < -1) {
+            if (node_height(node->right->right) <
+                node_height(node->right->left)) {
+                rotate_right(root, node->right);
+            }
+            node = rotate_left(root, node);
+        }
+        node = node->parent;
+    }
+}
+
+void interval_tree_insert(IntervalTreeNode *node, IntervalTreeRoot *root)
+{
+    IntervalTreeNode **link = &root->node;
+    IntervalTreeNode *parent = NULL;
+
+    assert(node->start <= node->last);
+
+    while (*link) {
+        parent = *link;
+        link = node->start < parent->start ? &parent->left : &parent->right;
+    }
+
+    node->parent = parent;
+    node->left = NULL;
+    node->right = NULL;
+    node->height = 1;
+    node->subtree_last = node->last;
+    *link = node;
+
+    rebalance(root, parent);
+}
+
+void interval_tree_remove(IntervalTreeNode *node, IntervalTreeRoot *root)
+{
+    IntervalTreeNode *succ, *fix;
+
+    if (!node->left || !node->right) {
+        fix = node->parent;
+        replace_child(root, fix, node, node->left ? node->left : node->right);
+        rebalance(root, fix);
+        return;
+    }
+
+    /* Put the in-order successor, which has no left child, in its place */
+    succ = node->right;
+    while (succ->left) {
+        succ = succ->left;
+    }
+
+    if (succ->parent == node) {
+        fix = succ;
+    } else {
+        fix = succ->parent;
+        fix->left = succ->right;
+        if (succ->right) {
+            succ->right->parent = fix;
+        }
+        succ->right = node->right;
+        node->right->parent = succ;
+    }
+    succ->left = node->left;
+    node->left->parent = succ;
+    replace_child(root, node->parent, node, succ);
+
+    rebalance(root, fix);
+}
+
+/* Return the leftmost node of the subtree at @node overlapping the range */
+static IntervalTreeNode *subtree_search(IntervalTreeNode *node,
+                                        uint64_t start, uint64_t last)
+{
+    while (true) {
+        if (node->left && node->left->subtree_last >= start) {
+            node = node->left;
+            continue;
+        }
+        if (node->start > last) {
+            return NULL;
+        }
+        if (node->last >= start) {
+            return node;
+        }
+        if (!node->right || node->right->subtree_last < start) {
+            return NULL;
+        }
+        node = node->right;
+    }
+}
+
+IntervalTreeNode *interval_tree_iter_first(IntervalTreeRoot *root,
+                                           uint64_t start, uint64_t last)
+{
+    if (!root->node || root->node->subtree_last < start) {
+        return NULL;
+    }
+    return subtree_search(root->node, start, last);
+}
+
+IntervalTreeNode *interval_tree_iter_next(IntervalTreeNode *node,
+                                          uint64_t start, uint64_t last)
+{
+    IntervalTreeNode *right = node->right;
+    IntervalTreeNode *prev;
+
+    while (true) {
+        if (right && right->subtree_last >= start) {
+            return subtree_search(right, start, last);
+        }
+
+        /* Climb until we arrive from a left child */
+        do {
+            prev = node;
+            node = node->parent;
+            if (!node) {
+                return NULL;
+            }
+            right = node->right;
+        } while (prev == right);
+
+        if (node->start > last) {
+            return NULL;
+        }
+        if (node->last >= start) {
+            return node;
+        }
+    }
+}
@@ -34,6 +34,7 @@
 #include "qemu/error-report.h"
 #include "qemu/queue.h"
 #include "qemu/compiler.h"
+#include "qemu/event-loop-stats.h"
 
 #ifndef _WIN32
 #include <sys/wait.h>
@@ -186,6 +187,13 @@ int qemu_init_main_loop(Error **errp)
 
 static int max_priority;
 
+static EventLoopStats main_loop_stats;
+
+EventLoopStats *main_loop_get_stats(void)
+{
+    return &main_loop_stats;
+}
+
 #ifndef _WIN32
 static int glib_pollfds_idx;
 static int glib_n_poll_fds;
@@ -235,15 +243,17 @@ static void glib_pollfds_poll(void)
 
 #define MAX_MAIN_LOOP_SPIN (1000)
 
-static int os_host_main_loop_wait(int64_t timeout)
+static int os_host_main_loop_wait(int64_t timeout, int64_t *woken)
 {
     GMainContext *context = g_main_context_default();
+    int64_t blocked;
     int ret;
 
     g_main_context_acquire(context);
 
     glib_pollfds_fill(&timeout);
 
+    blocked = get_clock();
     qemu_mutex_unlock_iothread();
     replay_mutex_unlock();
 
@@ -251,6 +261,8 @@ static int os_host_main_loop_wait(int64_t timeout)
 
     replay_mutex_lock();
     qemu_mutex_lock_iothread();
+    *woken = get_clock();
+    event_loop_stats_add(&main_loop_stats.blocked_ns, *woken - blocked);
 
     glib_pollfds_poll();
 
@@ -398,10 +410,11 @@ static void pollfds_poll(GArray *pollfds, int nfds, fd_set *rfds,
     }
 }
 
-static int os_host_main_loop_wait(int64_t timeout)
+static int os_host_main_loop_wait(int64_t timeout, int64_t *woken)
 {
     GMainContext *context = g_main_context_default();
     GPollFD poll_fds[1024 * 2]; /* this is probably overkill */
+    int64_t blocked;
     int select_ret = 0;
     int g_poll_ret, ret, i, n_poll_fds;
     PollingEntry *pe;
@@ -456,6 +469,7 @@ static int os_host_main_loop_wait(int64_t timeout)
 
     poll_timeout_ns = qemu_soonest_timeout(poll_timeout_ns, timeout);
 
+    blocked = get_clock();
     qemu_mutex_unlock_iothread();
 
     replay_mutex_unlock();
@@ -465,6 +479,8 @@ static int os_host_main_loop_wait(int64_t timeout)
     replay_mutex_lock();
 
     qemu_mutex_lock_iothread();
+    *woken = get_clock();
+    event_loop_stats_add(&main_loop_stats.blocked_ns, *woken - blocked);
     if (g_poll_ret > 0) {
         for (i = 0; i < w->num; i++) {
             w->revents[i] = poll_fds[n_poll_fds + i].revents;
@@ -507,7 +523,7 @@ void main_loop_wait(int nonblocking)
         .pollfds = gpollfds,
     };
     int ret;
-    int64_t timeout_ns;
+    int64_t timeout_ns, woken, dispatched, end;
 
     if (nonblocking) {
         mlpoll.timeout = 0;
@@ -528,7 +544,8 @@ void main_loop_wait(int nonblocking)
                                       timerlistgroup_deadline_ns(
                                           &main_loop_tlg));
 
-    ret = os_host_main_loop_wait(timeout_ns);
+    woken = get_clock();
+    ret = os_host_main_loop_wait(timeout_ns, &woken);
     mlpoll.state = ret < 0 ? MAIN_LOOP_POLL_ERR : MAIN_LOOP_POLL_OK;
     notifier_list_notify(&main_loop_poll_notifiers, &mlpoll);
 
@@ -539,7 +556,16 @@ void main_loop_wait(int nonblocking)
          */
         icount_start_warp_timer();
     }
+
+    dispatched = get_clock();
+    event_loop_stats_add(&main_loop_stats.dispatch_ns[EVENT_LOOP_DISPATCH_FD],
+                         dispatched - woken);
     qemu_clock_run_all_timers();
+    end = get_clock();
+    event_loop_stats_add(
+        &main_loop_stats.dispatch_ns[EVENT_LOOP_DISPATCH_TIMER],
+        end - dispatched);
+    event_loop_stats_latency(&main_loop_stats, end - woken);
 }
 
 /* Functions to operate on the main QEMU AioContext.  */
@@ -74,6 +74,42 @@ int qemu_madvise(void *addr, size_t len, int advice)
 #endif
 }
 
+void *qemu_try_alloc_large(size_t size)
+{
+    void *ptr;
+
+    if (size < QEMU_VMALLOC_ALIGN) {
+        ptr = qemu_try_memalign(qemu_real_host_page_size, size);
+        if (ptr) {
+            memset(ptr, 0, size);
+        }
+        return ptr;
+    }
+
+    ptr = qemu_anon_ram_alloc(size, NULL, false);
+    if (ptr) {
+        qemu_madvise(ptr, size, QEMU_MADV_HUGEPAGE);
+    }
+    return ptr;
+}
+
+void *qemu_alloc_large(size_t size)
+{
+    return qemu_oom_check(qemu_try_alloc_large(size));
+}
+
+void qemu_free_large(void *ptr, size_t size)
+{
+    if (!ptr) {
+        return;
+    }
+    if (size < QEMU_VMALLOC_ALIGN) {
+        qemu_vfree(ptr);
+    } else {
+        qemu_anon_ram_free(ptr, size);
+    }
+}
+
 static int qemu_mprotect__osdep(void *addr, size_t size, int prot)
 {
     g_assert(!((uintptr_t)addr & ~qemu_real_host_page_mask));
@@ -39,6 +39,7 @@
 #include "qemu/thread.h"
 #include <libgen.h>
 #include "qemu/cutils.h"
+#include "qemu/bitops.h"
 #include "qemu/compiler.h"
 
 #ifdef CONFIG_LINUX
@@ -77,6 +78,7 @@ struct MemsetThread {
     char *addr;
     size_t numpages;
     size_t hpagesize;
+    int node;
     QemuThread pgthread;
     sigjmp_buf env;
 };
@@ -456,11 +458,64 @@ static void sigbus_handler(int signal)
     }
 }
 
+#ifdef CONFIG_LINUX
+/*
+ * Run the calling thread on the CPUs of host NUMA node @node, as listed
+ * in sysfs.  The kernel clears huge pages on the CPU that faults them
+ * in, so touching pages from their own node avoids zeroing them across
+ * the interconnect.
+ */
+static void memset_thread_bind_node(int node)
+{
+    g_autofree char *path = NULL;
+    g_autofree char *contents = NULL;
+    g_auto(GStrv) ranges = NULL;
+    cpu_set_t cpus;
+    int i;
+
+    path = g_strdup_printf("/sys/devices/system/node/node%d/cpulist", node);
+    if (!g_file_get_contents(path, &contents, NULL, NULL)) {
+        return;
+    }
+
+    CPU_ZERO(&cpus);
+    ranges = g_strsplit(g_strstrip(contents), ",", -1);
+    for (i = 0; ranges[i]; i++) {
+        unsigned long first, last;
+        const char *end;
+
+        if (qemu_strtoul(ranges[i], &end, 10, &first) < 0) {
+            continue;
+        }
+        last = first;
+        if (*end == '-' && qemu_strtoul(end + 1, NULL, 10, &last) < 0) {
+            continue;
+        }
+        for (; first <= last && first < CPU_SETSIZE; first++) {
+            CPU_SET(first, &cpus);
+        }
+    }
+
+    /* best effort: a node without CPUs keeps the default affinity */
+    if (CPU_COUNT(&cpus)) {
+        sched_setaffinity(0, sizeof(cpus), &cpus);
+    }
+}
+#else
+static void memset_thread_bind_node(int node)
+{
+}
+#endif
+
 static void *do_touch_pages(void *arg)
 {
     MemsetThread *memset_args = (MemsetThread *)arg;
     sigset_t set, oldset;
 
+    if (memset_args->node >= 0) {
+        memset_thread_bind_node(memset_args->node);
+    }
+
     /*
      * On Linux, the page faults from the loop below can cause mmap_sem
      * contention with allocation of the thread stacks.  Do not start
@@ -505,7 +560,8 @@ static void *do_touch_pages(void *arg)
     return NULL;
 }
 
-static inline int get_memset_num_threads(int smp_cpus)
+static inline int get_memset_num_threads(int smp_cpus, size_t numpages,
+                                         int num_nodes)
 {
     long host_procs = sysconf(_SC_NPROCESSORS_ONLN);
     int ret = 1;
@@ -513,12 +569,16 @@ static inline int get_memset_num_threads(int smp_cpus)
     if (host_procs > 0) {
         ret = MIN(MIN(host_procs, MAX_MEM_PREALLOC_THREAD_COUNT), smp_cpus);
     }
+    /* When binding to nodes, give each node at least one thread */
+    ret = MAX(ret, MIN(num_nodes, MAX_MEM_PREALLOC_THREAD_COUNT));
+    /* With 1G pages a small backend has fewer pages than threads */
+    ret = MIN(ret, MAX(numpages, 1));
     /* In case sysconf() fails, we fall back to single threaded */
     return ret;
 }
 
 static bool touch_all_pages(char *area, size_t hpagesize, size_t numpages,
-                            int smp_cpus)
+                            int smp_cpus, const int *nodes, int num_nodes)
 {
     static gsize initialized = 0;
     size_t numpages_per_thread, leftover;
@@ -533,14 +593,23 @@ static bool touch_all_pages(char *area, size_t hpagesize, size_t numpages,
 
     memset_thread_failed = false;
     threads_created_flag = false;
-    memset_num_threads = get_memset_num_threads(smp_cpus);
+    memset_num_threads = get_memset_num_threads(smp_cpus, numpages,
+                                                num_nodes);
     memset_thread = g_new0(MemsetThread, memset_num_threads);
     numpages_per_thread = numpages / memset_num_threads;
     leftover = numpages % memset_num_threads;
+    trace_os_mem_prealloc(numpages, hpagesize, memset_num_threads, num_nodes);
     for (i = 0; i < memset_num_threads; i++) {
         memset_thread[i].addr = addr;
         memset_thread[i].numpages = numpages_per_thread + (i < leftover);
         memset_thread[i].hpagesize = hpagesize;
+        /*
+         * Threads are spread over the nodes in address order.  That is
+         * exactly where bind and preferred policies allocate with one
+         * node, and a fair share of the zeroing work otherwise.
+         */
+        memset_thread[i].node = num_nodes ?
+            nodes[(size_t)i * num_nodes / memset_num_threads] : -1;
         qemu_thread_create(&memset_thread[i].pgthread, "touch_pages",
                            do_touch_pages, &memset_thread[i],
                            QEMU_THREAD_JOINABLE);
@@ -563,11 +632,29 @@ static bool touch_all_pages(char *area, size_t hpagesize, size_t numpages,
 
 void os_mem_prealloc(int fd, char *area, size_t memory, int smp_cpus,
                      Error **errp)
+{
+    os_mem_prealloc_nodes(fd, area, memory, smp_cpus, NULL, 0, errp);
+}
+
+void os_mem_prealloc_nodes(int fd, char *area, size_t memory, int smp_cpus,
+                           const unsigned long *host_nodes,
+                           unsigned long maxnode, Error **errp)
 {
     int ret;
     struct sigaction act, oldact;
     size_t hpagesize = qemu_fd_getpagesize(fd);
     size_t numpages = DIV_ROUND_UP(memory, hpagesize);
+    g_autofree int *nodes = NULL;
+    int num_nodes = 0;
+    unsigned long node;
+
+    if (host_nodes && maxnode) {
+        nodes = g_new(int, maxnode);
+        for (node = find_first_bit(host_nodes, maxnode); node < maxnode;
+             node = find_next_bit(host_nodes, maxnode, node + 1)) {
+            nodes[num_nodes++] = node;
+        }
+    }
 
     memset(&act, 0, sizeof(act));
     act.sa_handler = &sigbus_handler;
@@ -581,7 +668,8 @@ void os_mem_prealloc(int fd, char *area, size_t memory, int smp_cpus,
     }
 
     /* touch pages simultaneously */
-    if (touch_all_pages(area, hpagesize, numpages, smp_cpus)) {
+    if (touch_all_pages(area, hpagesize, numpages, smp_cpus,
+                        nodes, num_nodes)) {
         error_setg(errp, "os_mem_prealloc: Insufficient free host memory "
             "pages available to allocate guest RAM");
     }
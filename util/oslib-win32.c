@@ -572,6 +572,13 @@ void os_mem_prealloc(int fd, char *area, size_t memory, int smp_cpus,
     }
 }
 
+void os_mem_prealloc_nodes(int fd, char *area, size_t memory, int smp_cpus,
+                           const unsigned long *host_nodes,
+                           unsigned long maxnode, Error **errp)
+{
+    os_mem_prealloc(fd, area, memory, smp_cpus, errp);
+}
+
 char *qemu_get_pid_name(pid_t pid)
 {
     /* XXX Implement me */
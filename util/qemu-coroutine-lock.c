@@ -115,6 +115,20 @@ bool qemu_co_enter_next_impl(CoQueue *queue, QemuLockable *lock)
     return true;
 }
 
+bool qemu_co_queue_schedule_next(CoQueue *queue)
+{
+    Coroutine *next;
+
+    next = QSIMPLEQ_FIRST(&queue->entries);
+    if (!next) {
+        return false;
+    }
+
+    QSIMPLEQ_REMOVE_HEAD(&queue->entries, co_queue_next);
+    aio_co_schedule(qatomic_read(&next->ctx), next);
+    return true;
+}
+
 bool qemu_co_queue_empty(CoQueue *queue)
 {
     return QSIMPLEQ_FIRST(&queue->entries) == NULL;
@@ -200,6 +214,8 @@ static void coroutine_fn qemu_co_mutex_lock_slowpath(AioContext *ctx,
                                                      CoMutex *mutex)
 {
     Coroutine *self = qemu_coroutine_self();
+    CoroutineTrace *trace = self->trace;
+    int64_t start_ns = trace ? get_clock() : 0;
     CoWaitRecord w;
     unsigned old_handoff;
 
@@ -231,9 +247,13 @@ static void coroutine_fn qemu_co_mutex_lock_slowpath(AioContext *ctx,
 
     qemu_coroutine_yield();
     trace_qemu_co_mutex_lock_return(mutex, self);
+
+    if (trace) {
+        trace->lock_wait_ns += get_clock() - start_ns;
+    }
 }
 
-void coroutine_fn qemu_co_mutex_lock(CoMutex *mutex)
+static void coroutine_fn co_mutex_lock(CoMutex *mutex)
 {
     AioContext *ctx = qemu_get_current_aio_context();
     Coroutine *self = qemu_coroutine_self();
@@ -273,6 +293,22 @@ retry_fast_path:
     self->locks_held++;
 }
 
+void coroutine_fn qemu_co_mutex_lock_impl(CoMutex *mutex,
+                                          const char *file, int line)
+{
+    unsigned int weight = qsp_external_sample();
+    int64_t t0;
+
+    if (likely(!weight)) {
+        co_mutex_lock(mutex);
+        return;
+    }
+    t0 = get_clock();
+    co_mutex_lock(mutex);
+    qsp_external_record(mutex, file, line, QSP_CO_MUTEX, get_clock() - t0,
+                        weight);
+}
+
 void coroutine_fn qemu_co_mutex_unlock(CoMutex *mutex)
 {
     Coroutine *self = qemu_coroutine_self();
@@ -335,11 +371,11 @@ void qemu_co_rwlock_init(CoRwlock *lock)
     qemu_co_mutex_init(&lock->mutex);
 }
 
-void qemu_co_rwlock_rdlock(CoRwlock *lock)
+static void coroutine_fn co_rwlock_rdlock(CoRwlock *lock)
 {
     Coroutine *self = qemu_coroutine_self();
 
-    qemu_co_mutex_lock(&lock->mutex);
+    co_mutex_lock(&lock->mutex);
     /* For fairness, wait if a writer is in line.  */
     while (lock->pending_writer) {
         qemu_co_queue_wait(&lock->queue, &lock->mutex);
@@ -362,7 +398,7 @@ void qemu_co_rwlock_unlock(CoRwlock *lock)
     } else {
         self->locks_held--;
 
-        qemu_co_mutex_lock(&lock->mutex);
+        co_mutex_lock(&lock->mutex);
         lock->reader--;
         assert(lock->reader >= 0);
         /* Wakeup only one waiting writer */
@@ -388,9 +424,9 @@ void qemu_co_rwlock_downgrade(CoRwlock *lock)
     self->locks_held++;
 }
 
-void qemu_co_rwlock_wrlock(CoRwlock *lock)
+static void coroutine_fn co_rwlock_wrlock(CoRwlock *lock)
 {
-    qemu_co_mutex_lock(&lock->mutex);
+    co_mutex_lock(&lock->mutex);
     lock->pending_writer++;
     while (lock->reader) {
         qemu_co_queue_wait(&lock->queue, &lock->mutex);
@@ -403,11 +439,11 @@ void qemu_co_rwlock_wrlock(CoRwlock *lock)
      */
 }
 
-void qemu_co_rwlock_upgrade(CoRwlock *lock)
+static void coroutine_fn co_rwlock_upgrade(CoRwlock *lock)
 {
     Coroutine *self = qemu_coroutine_self();
 
-    qemu_co_mutex_lock(&lock->mutex);
+    co_mutex_lock(&lock->mutex);
     assert(lock->reader > 0);
     lock->reader--;
     lock->pending_writer++;
@@ -422,3 +458,35 @@ void qemu_co_rwlock_upgrade(CoRwlock *lock)
      */
     self->locks_held--;
 }
+
+static void coroutine_fn co_rwlock_profile(CoRwlock *lock,
+                                           void (*fn)(CoRwlock *),
+                                           const char *file, int line)
+{
+    unsigned int weight = qsp_external_sample();
+    int64_t t0;
+
+    if (likely(!weight)) {
+        fn(lock);
+        return;
+    }
+    t0 = get_clock();
+    fn(lock);
+    qsp_external_record(lock, file, line, QSP_CO_RWLOCK, get_clock() - t0,
+                        weight);
+}
+
+void qemu_co_rwlock_rdlock_impl(CoRwlock *lock, const char *file, int line)
+{
+    co_rwlock_profile(lock, co_rwlock_rdlock, file, line);
+}
+
+void qemu_co_rwlock_wrlock_impl(CoRwlock *lock, const char *file, int line)
+{
+    co_rwlock_profile(lock, co_rwlock_wrlock, file, line);
+}
+
+void qemu_co_rwlock_upgrade_impl(CoRwlock *lock, const char *file, int line)
+{
+    co_rwlock_profile(lock, co_rwlock_upgrade, file, line);
+}
@@ -30,6 +30,7 @@ static unsigned int release_pool_size;
 static __thread QSLIST_HEAD(, Coroutine) alloc_pool = QSLIST_HEAD_INITIALIZER(pool);
 static __thread unsigned int alloc_pool_size;
 static __thread Notifier coroutine_pool_cleanup_notifier;
+static __thread CoroutinePool *local_pool;
 
 static void coroutine_pool_cleanup(Notifier *n, void *value)
 {
@@ -42,11 +43,104 @@ static void coroutine_pool_cleanup(Notifier *n, void *value)
     }
 }
 
+CoroutinePool *qemu_coroutine_pool_new(void)
+{
+    CoroutinePool *pool = g_new0(CoroutinePool, 1);
+
+    QSLIST_INIT(&pool->list);
+    pool->refcnt = 1;
+    stat64_init(&pool->hits, 0);
+    stat64_init(&pool->misses, 0);
+    return pool;
+}
+
+static void coroutine_pool_unref(CoroutinePool *pool)
+{
+    if (qatomic_fetch_dec(&pool->refcnt) == 1) {
+        assert(QSLIST_EMPTY(&pool->list));
+        g_free(pool);
+    }
+}
+
+void qemu_coroutine_pool_attach(CoroutinePool *pool)
+{
+    local_pool = pool;
+}
+
+void qemu_coroutine_pool_free(CoroutinePool *pool)
+{
+    Coroutine *co;
+    Coroutine *tmp;
+
+    QSLIST_FOREACH_SAFE(co, &pool->list, pool_next, tmp) {
+        QSLIST_REMOVE_HEAD(&pool->list, pool_next);
+        qemu_coroutine_delete(co);
+    }
+    qatomic_set(&pool->size, 0);
+    coroutine_pool_unref(pool);
+}
+
+void qemu_coroutine_pool_trim(CoroutinePool *pool)
+{
+    unsigned int max_size;
+
+    qatomic_set(&pool->peak,
+                MAX(qatomic_read(&pool->in_use), pool->peak / 2));
+    max_size = qemu_coroutine_pool_max_size(pool);
+    while (pool->size > max_size) {
+        Coroutine *co = QSLIST_FIRST(&pool->list);
+
+        QSLIST_REMOVE_HEAD(&pool->list, pool_next);
+        qatomic_set(&pool->size, pool->size - 1);
+        qemu_coroutine_delete(co);
+    }
+}
+
+unsigned int qemu_coroutine_pool_max_size(CoroutinePool *pool)
+{
+    return MAX(qatomic_read(&pool->peak), POOL_BATCH_SIZE);
+}
+
+static Coroutine *coroutine_pool_get(CoroutinePool *pool)
+{
+    Coroutine *co = QSLIST_FIRST(&pool->list);
+    unsigned int in_use = qatomic_fetch_inc(&pool->in_use) + 1;
+
+    qatomic_inc(&pool->refcnt);
+    if (in_use > pool->peak) {
+        qatomic_set(&pool->peak, in_use);
+    } else if (pool->peak > POOL_BATCH_SIZE && in_use < pool->peak / 2) {
+        /* Slowly forget a peak once the load has gone down */
+        qatomic_set(&pool->peak, pool->peak - 1);
+    }
+
+    if (!co) {
+        stat64_add(&pool->misses, 1);
+        return NULL;
+    }
+    QSLIST_REMOVE_HEAD(&pool->list, pool_next);
+    qatomic_set(&pool->size, pool->size - 1);
+    stat64_add(&pool->hits, 1);
+    return co;
+}
+
+static bool coroutine_pool_put(CoroutinePool *pool, Coroutine *co)
+{
+    if (pool->size >= qemu_coroutine_pool_max_size(pool)) {
+        return false;
+    }
+    QSLIST_INSERT_HEAD(&pool->list, co, pool_next);
+    qatomic_set(&pool->size, pool->size + 1);
+    return true;
+}
+
 Coroutine *qemu_coroutine_create(CoroutineEntry *entry, void *opaque)
 {
     Coroutine *co = NULL;
 
-    if (CONFIG_COROUTINE_POOL) {
+    if (CONFIG_COROUTINE_POOL && local_pool) {
+        co = coroutine_pool_get(local_pool);
+    } else if (CONFIG_COROUTINE_POOL) {
         co = QSLIST_FIRST(&alloc_pool);
         if (!co) {
             if (release_pool_size > POOL_BATCH_SIZE) {
@@ -75,8 +169,10 @@ Coroutine *qemu_coroutine_create(CoroutineEntry *entry, void *opaque)
         co = qemu_coroutine_new();
     }
 
+    co->pool = CONFIG_COROUTINE_POOL ? local_pool : NULL;
     co->entry = entry;
     co->entry_arg = opaque;
+    co->trace = NULL;
     QSIMPLEQ_INIT(&co->co_queue_wakeup);
     return co;
 }
@@ -85,7 +181,21 @@ static void coroutine_delete(Coroutine *co)
 {
     co->caller = NULL;
 
-    if (CONFIG_COROUTINE_POOL) {
+    /*
+     * The coroutine may terminate in another thread than the one that
+     * created it, and go to another pool than the one that counts it.
+     */
+    if (co->pool) {
+        qatomic_dec(&co->pool->in_use);
+        coroutine_pool_unref(co->pool);
+        co->pool = NULL;
+    }
+
+    if (CONFIG_COROUTINE_POOL && local_pool) {
+        if (coroutine_pool_put(local_pool, co)) {
+            return;
+        }
+    } else if (CONFIG_COROUTINE_POOL) {
         if (release_pool_size < POOL_BATCH_SIZE * 2) {
             QSLIST_INSERT_HEAD_ATOMIC(&release_pool, co, pool_next);
             qatomic_inc(&release_pool_size);
@@ -193,6 +303,16 @@ void coroutine_fn qemu_coroutine_yield(void)
     qemu_coroutine_switch(self, to, COROUTINE_YIELD);
 }
 
+CoroutineTrace *coroutine_fn qemu_coroutine_get_trace(void)
+{
+    return qemu_coroutine_self()->trace;
+}
+
+void coroutine_fn qemu_coroutine_set_trace(CoroutineTrace *trace)
+{
+    qemu_coroutine_self()->trace = trace;
+}
+
 bool qemu_coroutine_entered(Coroutine *co)
 {
     return co->caller;
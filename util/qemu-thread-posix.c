@@ -576,6 +576,20 @@ bool qemu_thread_is_self(QemuThread *thread)
    return pthread_equal(pthread_self(), thread->thread);
 }
 
+int64_t qemu_thread_get_cpu_time_ns(QemuThread *thread)
+{
+#ifdef _POSIX_THREAD_CPUTIME
+    clockid_t clock;
+    struct timespec ts;
+
+    if (pthread_getcpuclockid(thread->thread, &clock) == 0 &&
+        clock_gettime(clock, &ts) == 0) {
+        return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+    }
+#endif
+    return -1;
+}
+
 void qemu_thread_exit(void *retval)
 {
     pthread_exit(retval);
@@ -459,3 +459,34 @@ bool qemu_thread_is_self(QemuThread *thread)
 {
     return GetCurrentThreadId() == thread->tid;
 }
+
+int64_t qemu_thread_get_cpu_time_ns(QemuThread *thread)
+{
+    QemuThreadData *data = thread->data;
+    FILETIME creation, exit, kernel, user;
+    HANDLE handle = NULL;
+    int64_t ret = -1;
+
+    /* Like qemu_thread_get_handle(), only joinable threads are tracked */
+    if (data && data->mode != QEMU_THREAD_DETACHED) {
+        EnterCriticalSection(&data->cs);
+        if (!data->exited) {
+            handle = OpenThread(THREAD_QUERY_LIMITED_INFORMATION, FALSE,
+                                thread->tid);
+        }
+        LeaveCriticalSection(&data->cs);
+    }
+    if (!handle) {
+        return -1;
+    }
+
+    /* FILETIMEs count 100 ns intervals */
+    if (GetThreadTimes(handle, &creation, &exit, &kernel, &user)) {
+        ret = ((((uint64_t)kernel.dwHighDateTime << 32) |
+                kernel.dwLowDateTime) +
+               (((uint64_t)user.dwHighDateTime << 32) |
+                user.dwLowDateTime)) * 100;
+    }
+    CloseHandle(handle);
+    return ret;
+}
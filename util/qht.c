@@ -68,8 +68,13 @@
 #include "qemu/osdep.h"
 #include "qemu/qht.h"
 #include "qemu/atomic.h"
+#include "qemu/host-utils.h"
 #include "qemu/rcu.h"
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 //#define QHT_DEBUG
 
 /*
@@ -484,26 +489,57 @@ bool qht_reset_size(struct qht *ht, size_t n_elems)
     return !!new;
 }
 
+/* Return a mask of the entries of @b whose hash is @hash */
+#if defined(__SSE2__) && QHT_BUCKET_ENTRIES == 4
+static inline unsigned int qht_bucket_match(const struct qht_bucket *b,
+                                            uint32_t hash)
+{
+    /*
+     * Each 32-bit lane is read atomically, and the caller checks the
+     * seqlock, as with the scalar reads below.
+     */
+    __m128i h = _mm_loadu_si128((const __m128i *)b->hashes);
+    __m128i eq = _mm_cmpeq_epi32(h, _mm_set1_epi32(hash));
+
+    return _mm_movemask_ps(_mm_castsi128_ps(eq));
+}
+#else
+static inline unsigned int qht_bucket_match(const struct qht_bucket *b,
+                                            uint32_t hash)
+{
+    unsigned int match = 0;
+    int i;
+
+    for (i = 0; i < QHT_BUCKET_ENTRIES; i++) {
+        if (qatomic_read(&b->hashes[i]) == hash) {
+            match |= 1u << i;
+        }
+    }
+    return match;
+}
+#endif
+
 static inline
 void *qht_do_lookup(const struct qht_bucket *head, qht_lookup_func_t func,
                     const void *userp, uint32_t hash)
 {
     const struct qht_bucket *b = head;
-    int i;
 
     do {
-        for (i = 0; i < QHT_BUCKET_ENTRIES; i++) {
-            if (qatomic_read(&b->hashes[i]) == hash) {
-                /* The pointer is dereferenced before seqlock_read_retry,
-                 * so (unlike qht_insert__locked) we need to use
-                 * qatomic_rcu_read here.
-                 */
-                void *p = qatomic_rcu_read(&b->pointers[i]);
-
-                if (likely(p) && likely(func(p, userp))) {
-                    return p;
-                }
+        unsigned int match = qht_bucket_match(b, hash);
+
+        while (match) {
+            int i = ctz32(match);
+            /* The pointer is dereferenced before seqlock_read_retry,
+             * so (unlike qht_insert__locked) we need to use
+             * qatomic_rcu_read here.
+             */
+            void *p = qatomic_rcu_read(&b->pointers[i]);
+
+            if (likely(p) && likely(func(p, userp))) {
+                return p;
             }
+            match &= match - 1;
         }
         b = qatomic_rcu_read(&b->next);
     } while (b);
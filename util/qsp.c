@@ -10,8 +10,9 @@
  * help diagnose performance problems, e.g. scalability issues when
  * contention is high.
  *
- * The primitives currently supported are mutexes, recursive mutexes and
- * condition variables. Note that not all related functions are intercepted;
+ * The primitives currently supported are mutexes, recursive mutexes,
+ * condition variables, coroutine mutexes and rwlocks, and the locks of the
+ * BQL and AioContexts. Note that not all related functions are intercepted;
  * instead we profile only those functions that can have a performance impact,
  * either due to blocking (e.g. cond_wait, mutex_lock) or cache line
  * contention (e.g. mutex_lock, mutex_trylock).
@@ -31,6 +32,10 @@
  * of the same type can be coalesced, which can be particularly useful when
  * profiling dynamically-allocated objects.
  *
+ * To keep the profiler cheap enough to be left on, it can sample only one in
+ * every N operations of each thread. The other operations go straight to the
+ * implementation, and sampled ones are accounted N times.
+ *
  * Alternative designs considered:
  *
  * - Use an off-the-shelf profiler such as mutrace. This is not a viable option
@@ -65,13 +70,6 @@
 #include "qemu/rcu.h"
 #include "qemu/xxhash.h"
 
-enum QSPType {
-    QSP_MUTEX,
-    QSP_BQL_MUTEX,
-    QSP_REC_MUTEX,
-    QSP_CONDVAR,
-};
-
 struct QSPCallSite {
     const void *obj;
     const char *file; /* i.e. __FILE__; shortened later */
@@ -107,6 +105,13 @@ static size_t qsp_qemu_path_len;
 /* the address of qsp_thread gives us a unique 'thread ID' */
 static __thread int qsp_thread;
 
+/* profile one in every qsp_sample_period operations of each thread */
+static unsigned int qsp_sample_period = 1;
+static __thread unsigned int qsp_sample_countdown;
+
+/* whether the primitives that use qsp_external_sample() are profiled */
+bool qsp_external_enabled;
+
 /*
  * Call sites are the same for all threads, so we track them in a separate hash
  * table to save memory.
@@ -122,6 +127,9 @@ static const char * const qsp_typenames[] = {
     [QSP_BQL_MUTEX] = "BQL mutex",
     [QSP_REC_MUTEX] = "rec_mutex",
     [QSP_CONDVAR]   = "condvar",
+    [QSP_CO_MUTEX]  = "co_mutex",
+    [QSP_CO_RWLOCK] = "co_rwlock",
+    [QSP_AIO_CONTEXT] = "AioContext",
 };
 
 QemuMutexLockFunc qemu_bql_mutex_lock_func = qemu_mutex_lock_impl;
@@ -132,6 +140,7 @@ QemuRecMutexTrylockFunc qemu_rec_mutex_trylock_func =
     qemu_rec_mutex_trylock_impl;
 QemuCondWaitFunc qemu_cond_wait_func = qemu_cond_wait_impl;
 QemuCondTimedWaitFunc qemu_cond_timedwait_func = qemu_cond_timedwait_impl;
+QemuRecMutexLockFunc qemu_aio_context_lock_func = qemu_rec_mutex_lock_impl;
 
 /*
  * It pays off to _not_ hash callsite->file; hashing a string is slow, and
@@ -340,21 +349,39 @@ static QSPEntry *qsp_entry_get(const void *obj, const char *file, int line,
     return qsp_entry_find(&qsp_ht, &orig, hash);
 }
 
+/*
+ * Returns the number of operations that the current one stands for, or 0
+ * if it must not be profiled.
+ */
+static inline unsigned int qsp_sample(void)
+{
+    unsigned int period = qatomic_read(&qsp_sample_period);
+
+    if (likely(qsp_sample_countdown)) {
+        qsp_sample_countdown--;
+        return 0;
+    }
+    qsp_sample_countdown = period - 1;
+    return period;
+}
+
 /*
  * @e is in the global hash table; it is only written to by the current thread,
  * so we write to it atomically (as in "write once") to prevent torn reads.
  */
-static inline void do_qsp_entry_record(QSPEntry *e, int64_t delta, bool acq)
+static inline void do_qsp_entry_record(QSPEntry *e, int64_t delta,
+                                       unsigned int weight, bool acq)
 {
-    qatomic_set_u64(&e->ns, e->ns + delta);
+    qatomic_set_u64(&e->ns, e->ns + delta * weight);
     if (acq) {
-        qatomic_set_u64(&e->n_acqs, e->n_acqs + 1);
+        qatomic_set_u64(&e->n_acqs, e->n_acqs + weight);
     }
 }
 
-static inline void qsp_entry_record(QSPEntry *e, int64_t delta)
+static inline void qsp_entry_record(QSPEntry *e, int64_t delta,
+                                    unsigned int weight)
 {
-    do_qsp_entry_record(e, delta, true);
+    do_qsp_entry_record(e, delta, weight, true);
 }
 
 #define QSP_GEN_VOID(type_, qsp_t_, func_, impl_)                       \
@@ -362,13 +389,18 @@ static inline void qsp_entry_record(QSPEntry *e, int64_t delta)
     {                                                                   \
         QSPEntry *e;                                                    \
         int64_t t0, t1;                                                 \
+        unsigned int weight = qsp_sample();                             \
                                                                         \
+        if (!weight) {                                                  \
+            impl_(obj, file, line);                                     \
+            return;                                                     \
+        }                                                               \
         t0 = get_clock();                                               \
         impl_(obj, file, line);                                         \
         t1 = get_clock();                                               \
                                                                         \
         e = qsp_entry_get(obj, file, line, qsp_t_);                     \
-        qsp_entry_record(e, t1 - t0);                                   \
+        qsp_entry_record(e, t1 - t0, weight);                           \
     }
 
 #define QSP_GEN_RET1(type_, qsp_t_, func_, impl_)                       \
@@ -376,14 +408,18 @@ static inline void qsp_entry_record(QSPEntry *e, int64_t delta)
     {                                                                   \
         QSPEntry *e;                                                    \
         int64_t t0, t1;                                                 \
+        unsigned int weight = qsp_sample();                             \
         int err;                                                        \
                                                                         \
+        if (!weight) {                                                  \
+            return impl_(obj, file, line);                              \
+        }                                                               \
         t0 = get_clock();                                               \
         err = impl_(obj, file, line);                                   \
         t1 = get_clock();                                               \
                                                                         \
         e = qsp_entry_get(obj, file, line, qsp_t_);                     \
-        do_qsp_entry_record(e, t1 - t0, !err);                          \
+        do_qsp_entry_record(e, t1 - t0, weight, !err);                  \
         return err;                                                     \
     }
 
@@ -395,6 +431,8 @@ QSP_GEN_VOID(QemuRecMutex, QSP_REC_MUTEX, qsp_rec_mutex_lock,
              qemu_rec_mutex_lock_impl)
 QSP_GEN_RET1(QemuRecMutex, QSP_REC_MUTEX, qsp_rec_mutex_trylock,
              qemu_rec_mutex_trylock_impl)
+QSP_GEN_VOID(QemuRecMutex, QSP_AIO_CONTEXT, qsp_aio_context_lock,
+             qemu_rec_mutex_lock_impl)
 
 #undef QSP_GEN_RET1
 #undef QSP_GEN_VOID
@@ -404,13 +442,18 @@ qsp_cond_wait(QemuCond *cond, QemuMutex *mutex, const char *file, int line)
 {
     QSPEntry *e;
     int64_t t0, t1;
+    unsigned int weight = qsp_sample();
 
+    if (!weight) {
+        qemu_cond_wait_impl(cond, mutex, file, line);
+        return;
+    }
     t0 = get_clock();
     qemu_cond_wait_impl(cond, mutex, file, line);
     t1 = get_clock();
 
     e = qsp_entry_get(cond, file, line, QSP_CONDVAR);
-    qsp_entry_record(e, t1 - t0);
+    qsp_entry_record(e, t1 - t0, weight);
 }
 
 static bool
@@ -419,14 +462,18 @@ qsp_cond_timedwait(QemuCond *cond, QemuMutex *mutex, int ms,
 {
     QSPEntry *e;
     int64_t t0, t1;
+    unsigned int weight = qsp_sample();
     bool ret;
 
+    if (!weight) {
+        return qemu_cond_timedwait_impl(cond, mutex, ms, file, line);
+    }
     t0 = get_clock();
     ret = qemu_cond_timedwait_impl(cond, mutex, ms, file, line);
     t1 = get_clock();
 
     e = qsp_entry_get(cond, file, line, QSP_CONDVAR);
-    qsp_entry_record(e, t1 - t0);
+    qsp_entry_record(e, t1 - t0, weight);
     return ret;
 }
 
@@ -444,6 +491,8 @@ void qsp_enable(void)
     qatomic_set(&qemu_rec_mutex_trylock_func, qsp_rec_mutex_trylock);
     qatomic_set(&qemu_cond_wait_func, qsp_cond_wait);
     qatomic_set(&qemu_cond_timedwait_func, qsp_cond_timedwait);
+    qatomic_set(&qemu_aio_context_lock_func, qsp_aio_context_lock);
+    qatomic_set(&qsp_external_enabled, true);
 }
 
 void qsp_disable(void)
@@ -455,6 +504,34 @@ void qsp_disable(void)
     qatomic_set(&qemu_rec_mutex_trylock_func, qemu_rec_mutex_trylock_impl);
     qatomic_set(&qemu_cond_wait_func, qemu_cond_wait_impl);
     qatomic_set(&qemu_cond_timedwait_func, qemu_cond_timedwait_impl);
+    qatomic_set(&qemu_aio_context_lock_func, qemu_rec_mutex_lock_impl);
+    qatomic_set(&qsp_external_enabled, false);
+}
+
+unsigned int qsp_external_sample_slow(void)
+{
+    return qsp_sample();
+}
+
+/*
+ * Coroutines can move to another thread while they wait; looking up the
+ * entry here, out of line, ensures it belongs to the current thread.
+ */
+void qsp_external_record(const void *obj, const char *file, int line,
+                         enum QSPType type, int64_t ns, unsigned int weight)
+{
+    qsp_entry_record(qsp_entry_get(obj, file, line, type), ns, weight);
+}
+
+unsigned int qsp_get_sample_period(void)
+{
+    return qatomic_read(&qsp_sample_period);
+}
+
+void qsp_set_sample_period(unsigned int period)
+{
+    g_assert(period > 0);
+    qatomic_set(&qsp_sample_period, period);
 }
 
 static gint qsp_tree_cmp(gconstpointer ap, gconstpointer bp, gpointer up)
@@ -658,20 +735,10 @@ static char *qsp_at(const QSPCallSite *callsite)
     return g_string_free(s, FALSE);
 }
 
-struct QSPReportEntry {
-    const void *obj;
-    char *callsite_at;
-    const char *typename;
-    double time_s;
-    double ns_avg;
-    uint64_t n_acqs;
-    unsigned int n_objs;
-};
-typedef struct QSPReportEntry QSPReportEntry;
-
 struct QSPReport {
     QSPReportEntry *entries;
     size_t n_entries;
+    size_t alloc_n_entries;
     size_t max_n_entries;
 };
 typedef struct QSPReport QSPReport;
@@ -685,6 +752,12 @@ static gboolean qsp_tree_report(gpointer key, gpointer value, gpointer udata)
     if (report->n_entries == report->max_n_entries) {
         return TRUE;
     }
+    if (report->n_entries == report->alloc_n_entries) {
+        report->alloc_n_entries = MIN(MAX(report->alloc_n_entries * 2, 16),
+                                      report->max_n_entries);
+        report->entries = g_renew(QSPReportEntry, report->entries,
+                                  report->alloc_n_entries);
+    }
     entry = &report->entries[report->n_entries];
     report->n_entries++;
 
@@ -692,6 +765,7 @@ static gboolean qsp_tree_report(gpointer key, gpointer value, gpointer udata)
     entry->n_objs = e->n_objs;
     entry->callsite_at = qsp_at(e->callsite);
     entry->typename = qsp_typenames[e->callsite->type];
+    entry->ns = e->ns;
     entry->time_s = e->ns * 1e-9;
     entry->n_acqs = e->n_acqs;
     entry->ns_avg = e->n_acqs ? e->ns / e->n_acqs : 0;
@@ -753,36 +827,43 @@ static void pr_report(const QSPReport *rep)
     g_free(dashes);
 }
 
-static void report_destroy(QSPReport *rep)
+void qsp_report_entries_free(QSPReportEntry *entries, size_t n_entries)
 {
     size_t i;
 
-    for (i = 0; i < rep->n_entries; i++) {
-        QSPReportEntry *e = &rep->entries[i];
-
-        g_free(e->callsite_at);
+    for (i = 0; i < n_entries; i++) {
+        g_free(entries[i].callsite_at);
     }
-    g_free(rep->entries);
+    g_free(entries);
 }
 
-void qsp_report(size_t max, enum QSPSortBy sort_by,
-                bool callsite_coalesce)
+QSPReportEntry *qsp_report_entries(size_t max, enum QSPSortBy sort_by,
+                                   bool callsite_coalesce, size_t *n_entries)
 {
     GTree *tree = g_tree_new_full(qsp_tree_cmp, &sort_by, g_free, NULL);
-    QSPReport rep;
+    QSPReport rep = {
+        .max_n_entries = max,
+    };
 
     qsp_init();
 
-    rep.entries = g_new0(QSPReportEntry, max);
-    rep.n_entries = 0;
-    rep.max_n_entries = max;
-
     qsp_mktree(tree, callsite_coalesce);
     g_tree_foreach(tree, qsp_tree_report, &rep);
     g_tree_destroy(tree);
 
+    *n_entries = rep.n_entries;
+    return rep.entries;
+}
+
+void qsp_report(size_t max, enum QSPSortBy sort_by,
+                bool callsite_coalesce)
+{
+    QSPReport rep;
+
+    rep.entries = qsp_report_entries(max, sort_by, callsite_coalesce,
+                                     &rep.n_entries);
     pr_report(&rep);
-    report_destroy(&rep);
+    qsp_report_entries_free(rep.entries, rep.n_entries);
 }
 
 static void qsp_snapshot_destroy(QSPSnapshot *snap)
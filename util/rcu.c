@@ -182,6 +182,8 @@ static struct rcu_head dummy;
 static struct rcu_head *head = &dummy, **tail = &dummy.next;
 static int rcu_call_count;
 static QemuEvent rcu_call_ready_event;
+/* Number of drain_call_rcu() callers, which don't want batching delays */
+static int rcu_call_expedite;
 
 static void enqueue(struct rcu_head *node)
 {
@@ -246,7 +248,8 @@ static void *call_rcu_thread(void *opaque)
          * Fetch rcu_call_count now, we only must process elements that were
          * added before synchronize_rcu() starts.
          */
-        while (n == 0 || (n < RCU_CALL_MIN_SIZE && ++tries <= 5)) {
+        while (n == 0 || (n < RCU_CALL_MIN_SIZE &&
+                          !qatomic_read(&rcu_call_expedite) && ++tries <= 5)) {
             g_usleep(10000);
             if (n == 0) {
                 qemu_event_reset(&rcu_call_ready_event);
@@ -339,8 +342,10 @@ void drain_call_rcu(void)
      * assumed.
      */
 
+    qatomic_inc(&rcu_call_expedite);
     call_rcu1(&rcu_drain.rcu, drain_rcu_callback);
     qemu_event_wait(&rcu_drain.drain_complete_event);
+    qatomic_dec(&rcu_call_expedite);
 
     if (locked) {
         qemu_mutex_lock_iothread();
@@ -14,6 +14,17 @@
 #include <linux/membarrier.h>
 #include <sys/syscall.h>
 
+/* Added in Linux 4.14, older headers don't have them */
+#define QEMU_MEMBARRIER_CMD_PRIVATE_EXPEDITED           (1 << 3)
+#define QEMU_MEMBARRIER_CMD_REGISTER_PRIVATE_EXPEDITED  (1 << 4)
+
+/*
+ * MEMBARRIER_CMD_SHARED waits for a scheduler grace period on all CPUs,
+ * which takes milliseconds.  The private expedited command only IPIs the
+ * CPUs running threads of this process, so use it when available.
+ */
+static int membarrier_cmd = MEMBARRIER_CMD_SHARED;
+
 static int
 membarrier(int cmd, int flags)
 {
@@ -26,7 +37,7 @@ void smp_mb_global(void)
 #if defined CONFIG_WIN32
     FlushProcessWriteBuffers();
 #elif defined CONFIG_LINUX
-    membarrier(MEMBARRIER_CMD_SHARED, 0);
+    membarrier(membarrier_cmd, 0);
 #else
 #error --enable-membarrier is not supported on this operating system.
 #endif
@@ -46,5 +57,9 @@ void smp_mb_global_init(void)
         error_report("Please upgrade your system to a newer version of Linux");
         exit(1);
     }
+    if ((ret & QEMU_MEMBARRIER_CMD_PRIVATE_EXPEDITED) &&
+        membarrier(QEMU_MEMBARRIER_CMD_REGISTER_PRIVATE_EXPEDITED, 0) == 0) {
+        membarrier_cmd = QEMU_MEMBARRIER_CMD_PRIVATE_EXPEDITED;
+    }
 #endif
 }
@@ -24,6 +24,12 @@
 
 static void do_spawn_thread(ThreadPool *pool);
 
+/*
+ * Threads that bulk requests leave to latency sensitive ones, so that a
+ * flush or a discard never waits for a pool full of slow reads and writes.
+ */
+#define THREAD_POOL_LATENCY_RESERVE 4
+
 typedef struct ThreadPoolElement ThreadPoolElement;
 
 enum ThreadState {
@@ -43,6 +49,7 @@ struct ThreadPoolElement {
      * of state and ret are ordered with memory barriers.
      */
     enum ThreadState state;
+    ThreadPoolPriority prio;
     int ret;
 
     /* Access to this list is protected by lock.  */
@@ -57,7 +64,7 @@ struct ThreadPool {
     QEMUBH *completion_bh;
     QemuMutex lock;
     QemuCond worker_stopped;
-    QemuSemaphore sem;
+    QemuCond request_cond;
     int max_threads;
     QEMUBH *new_thread_bh;
 
@@ -65,17 +72,45 @@ struct ThreadPool {
     QLIST_HEAD(, ThreadPoolElement) head;
 
     /* The following variables are protected by lock.  */
-    QTAILQ_HEAD(, ThreadPoolElement) request_list;
+    QTAILQ_HEAD(, ThreadPoolElement) request_list[THREAD_POOL_PRIO__MAX];
+    int queued;
+    int bulk_threads;    /* threads running a bulk request */
     int cur_threads;
     int idle_threads;
     int new_threads;     /* backlog of threads we need to create */
     int pending_threads; /* threads created but not running yet */
     bool stopping;
+    ThreadPoolStats stats;
 };
 
+/*
+ * Take the next request a worker may run, latency sensitive ones first.
+ * Called with lock taken.
+ */
+static ThreadPoolElement *thread_pool_dequeue(ThreadPool *pool)
+{
+    ThreadPoolElement *req;
+
+    req = QTAILQ_FIRST(&pool->request_list[THREAD_POOL_PRIO_LATENCY]);
+    if (!req && pool->bulk_threads <
+        pool->max_threads - THREAD_POOL_LATENCY_RESERVE) {
+        req = QTAILQ_FIRST(&pool->request_list[THREAD_POOL_PRIO_BULK]);
+    }
+    if (req) {
+        QTAILQ_REMOVE(&pool->request_list[req->prio], req, reqs);
+        pool->queued--;
+        if (req->prio == THREAD_POOL_PRIO_BULK) {
+            pool->bulk_threads++;
+        }
+        req->state = THREAD_ACTIVE;
+    }
+    return req;
+}
+
 static void *worker_thread(void *opaque)
 {
     ThreadPool *pool = opaque;
+    bool woken = true;
 
     qemu_mutex_lock(&pool->lock);
     pool->pending_threads--;
@@ -85,31 +120,40 @@ static void *worker_thread(void *opaque)
         ThreadPoolElement *req;
         int ret;
 
-        do {
+        req = thread_pool_dequeue(pool);
+        if (!req) {
+            /*
+             * Only go to sleep once the queues are drained, so that busy
+             * workers take requests in a row without a wakeup each.
+             */
             pool->idle_threads++;
-            qemu_mutex_unlock(&pool->lock);
-            ret = qemu_sem_timedwait(&pool->sem, 10000);
-            qemu_mutex_lock(&pool->lock);
+            woken = qemu_cond_timedwait(&pool->request_cond, &pool->lock,
+                                        10000);
             pool->idle_threads--;
-        } while (ret == -1 && !QTAILQ_EMPTY(&pool->request_list));
-        if (ret == -1 || pool->stopping) {
-            break;
+            if (!woken && !pool->queued) {
+                break;
+            }
+            continue;
         }
-
-        req = QTAILQ_FIRST(&pool->request_list);
-        QTAILQ_REMOVE(&pool->request_list, req, reqs);
-        req->state = THREAD_ACTIVE;
+        if (!woken) {
+            pool->stats.batched++;
+        }
+        woken = false;
         qemu_mutex_unlock(&pool->lock);
 
         ret = req->func(req->arg);
 
+        qemu_mutex_lock(&pool->lock);
+        if (req->prio == THREAD_POOL_PRIO_BULK) {
+            pool->bulk_threads--;
+        }
+        pool->stats.completed++;
+
         req->ret = ret;
         /* Write ret before state.  */
         smp_wmb();
         req->state = THREAD_DONE;
 
-        qemu_mutex_lock(&pool->lock);
-
         qemu_bh_schedule(pool->completion_bh);
     }
 
@@ -211,20 +255,16 @@ static void thread_pool_cancel(BlockAIOCB *acb)
     trace_thread_pool_cancel(elem, elem->common.opaque);
 
     QEMU_LOCK_GUARD(&pool->lock);
-    if (elem->state == THREAD_QUEUED &&
-        /* No thread has yet started working on elem. we can try to "steal"
-         * the item from the worker if we can get a signal from the
-         * semaphore.  Because this is non-blocking, we can do it with
-         * the lock taken and ensure that elem will remain THREAD_QUEUED.
-         */
-        qemu_sem_timedwait(&pool->sem, 0) == 0) {
-        QTAILQ_REMOVE(&pool->request_list, elem, reqs);
+    if (elem->state == THREAD_QUEUED) {
+        /* No thread has yet started working on elem, steal it.  */
+        QTAILQ_REMOVE(&pool->request_list[elem->prio], elem, reqs);
+        pool->queued--;
+        pool->stats.canceled++;
         qemu_bh_schedule(pool->completion_bh);
 
         elem->state = THREAD_DONE;
         elem->ret = -ECANCELED;
     }
-
 }
 
 static AioContext *thread_pool_get_aio_context(BlockAIOCB *acb)
@@ -240,8 +280,8 @@ static const AIOCBInfo thread_pool_aiocb_info = {
     .get_aio_context    = thread_pool_get_aio_context,
 };
 
-BlockAIOCB *thread_pool_submit_aio(ThreadPool *pool,
-        ThreadPoolFunc *func, void *arg,
+BlockAIOCB *thread_pool_submit_aio_prio(ThreadPool *pool,
+        ThreadPoolPriority prio, ThreadPoolFunc *func, void *arg,
         BlockCompletionFunc *cb, void *opaque)
 {
     ThreadPoolElement *req;
@@ -250,22 +290,39 @@ BlockAIOCB *thread_pool_submit_aio(ThreadPool *pool,
     req->func = func;
     req->arg = arg;
     req->state = THREAD_QUEUED;
+    req->prio = prio;
     req->pool = pool;
 
     QLIST_INSERT_HEAD(&pool->head, req, all);
 
-    trace_thread_pool_submit(pool, req, arg);
+    trace_thread_pool_submit(pool, req, arg, prio);
 
     qemu_mutex_lock(&pool->lock);
     if (pool->idle_threads == 0 && pool->cur_threads < pool->max_threads) {
         spawn_thread(pool);
     }
-    QTAILQ_INSERT_TAIL(&pool->request_list, req, reqs);
+    QTAILQ_INSERT_TAIL(&pool->request_list[prio], req, reqs);
+    pool->queued++;
+    pool->stats.submitted[prio]++;
+    pool->stats.max_queued = MAX(pool->stats.max_queued, pool->queued);
+
+    /* Workers that are still busy will find the request by themselves */
+    if (pool->idle_threads) {
+        pool->stats.wakeups++;
+        qemu_cond_signal(&pool->request_cond);
+    }
     qemu_mutex_unlock(&pool->lock);
-    qemu_sem_post(&pool->sem);
     return &req->common;
 }
 
+BlockAIOCB *thread_pool_submit_aio(ThreadPool *pool,
+        ThreadPoolFunc *func, void *arg,
+        BlockCompletionFunc *cb, void *opaque)
+{
+    return thread_pool_submit_aio_prio(pool, THREAD_POOL_PRIO_BULK,
+                                       func, arg, cb, opaque);
+}
+
 typedef struct ThreadPoolCo {
     Coroutine *co;
     int ret;
@@ -279,21 +336,34 @@ static void thread_pool_co_cb(void *opaque, int ret)
     aio_co_wake(co->co);
 }
 
-int coroutine_fn thread_pool_submit_co(ThreadPool *pool, ThreadPoolFunc *func,
-                                       void *arg)
+int coroutine_fn thread_pool_submit_co_prio(ThreadPool *pool,
+                                            ThreadPoolPriority prio,
+                                            ThreadPoolFunc *func, void *arg)
 {
     ThreadPoolCo tpc = { .co = qemu_coroutine_self(), .ret = -EINPROGRESS };
     assert(qemu_in_coroutine());
-    thread_pool_submit_aio(pool, func, arg, thread_pool_co_cb, &tpc);
+    thread_pool_submit_aio_prio(pool, prio, func, arg, thread_pool_co_cb, &tpc);
     qemu_coroutine_yield();
     return tpc.ret;
 }
 
+int coroutine_fn thread_pool_submit_co(ThreadPool *pool, ThreadPoolFunc *func,
+                                       void *arg)
+{
+    return thread_pool_submit_co_prio(pool, THREAD_POOL_PRIO_BULK, func, arg);
+}
+
 void thread_pool_submit(ThreadPool *pool, ThreadPoolFunc *func, void *arg)
 {
     thread_pool_submit_aio(pool, func, arg, NULL, NULL);
 }
 
+void thread_pool_get_stats(ThreadPool *pool, ThreadPoolStats *stats)
+{
+    QEMU_LOCK_GUARD(&pool->lock);
+    *stats = pool->stats;
+}
+
 static void thread_pool_init_one(ThreadPool *pool, AioContext *ctx)
 {
     if (!ctx) {
@@ -305,12 +375,13 @@ static void thread_pool_init_one(ThreadPool *pool, AioContext *ctx)
     pool->completion_bh = aio_bh_new(ctx, thread_pool_completion_bh, pool);
     qemu_mutex_init(&pool->lock);
     qemu_cond_init(&pool->worker_stopped);
-    qemu_sem_init(&pool->sem, 0);
+    qemu_cond_init(&pool->request_cond);
     pool->max_threads = 64;
     pool->new_thread_bh = aio_bh_new(ctx, spawn_thread_bh_fn, pool);
 
     QLIST_INIT(&pool->head);
-    QTAILQ_INIT(&pool->request_list);
+    QTAILQ_INIT(&pool->request_list[THREAD_POOL_PRIO_LATENCY]);
+    QTAILQ_INIT(&pool->request_list[THREAD_POOL_PRIO_BULK]);
 }
 
 ThreadPool *thread_pool_new(AioContext *ctx)
@@ -338,14 +409,14 @@ void thread_pool_free(ThreadPool *pool)
     /* Wait for worker threads to terminate */
     pool->stopping = true;
     while (pool->cur_threads > 0) {
-        qemu_sem_post(&pool->sem);
+        qemu_cond_broadcast(&pool->request_cond);
         qemu_cond_wait(&pool->worker_stopped, &pool->lock);
     }
 
     qemu_mutex_unlock(&pool->lock);
 
     qemu_bh_delete(pool->completion_bh);
-    qemu_sem_destroy(&pool->sem);
+    qemu_cond_destroy(&pool->request_cond);
     qemu_cond_destroy(&pool->worker_stopped);
     qemu_mutex_destroy(&pool->lock);
     g_free(pool);
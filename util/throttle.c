@@ -484,6 +484,102 @@ void throttle_account(ThrottleState *ts, bool is_write, uint64_t size)
     }
 }
 
+/* Add @ops and @bytes to the levels of the limited buckets of type
+ * @is_write.  Negative values take them back.
+ */
+static void throttle_account_lease(ThrottleState *ts, bool is_write,
+                                   double ops, double bytes)
+{
+    const BucketType bucket_types_size[2][2] = {
+        { THROTTLE_BPS_TOTAL, THROTTLE_BPS_READ },
+        { THROTTLE_BPS_TOTAL, THROTTLE_BPS_WRITE }
+    };
+    const BucketType bucket_types_units[2][2] = {
+        { THROTTLE_OPS_TOTAL, THROTTLE_OPS_READ },
+        { THROTTLE_OPS_TOTAL, THROTTLE_OPS_WRITE }
+    };
+    unsigned i, j;
+
+    for (i = 0; i < 2; i++) {
+        LeakyBucket *bkts[2] = {
+            &ts->cfg.buckets[bucket_types_size[is_write][i]],
+            &ts->cfg.buckets[bucket_types_units[is_write][i]],
+        };
+        double amounts[2] = { bytes, ops };
+
+        for (j = 0; j < 2; j++) {
+            if (!bkts[j]->avg) {
+                continue;
+            }
+            bkts[j]->level = MAX(bkts[j]->level + amounts[j], 0);
+            if (bkts[j]->burst_length > 1) {
+                bkts[j]->burst_level = MAX(bkts[j]->burst_level + amounts[j],
+                                           0);
+            }
+        }
+    }
+}
+
+/* Hand out ahead of time the I/O of one type that the limits allow in
+ * @ns nanoseconds, so that the caller can spend it without coming back.
+ * The lease is accounted right away.  It only comes out of spare
+ * capacity: nothing is handed out if it would make the next operation
+ * wait.
+ *
+ * @clock_type: the clock used by @ts
+ * @is_write:   the type of operation (read/write)
+ * @ns:         how long the I/O in the lease would take at the limits
+ * @ops:        the number of operations in the lease, INT_MAX if unlimited
+ * @bytes:      the number of bytes in the lease, INT_MAX if unlimited
+ * @ret:        true if a lease was handed out
+ */
+bool throttle_lease(ThrottleState *ts, QEMUClockType clock_type,
+                    bool is_write, int64_t ns, int *ops, int *bytes)
+{
+    const BucketType bucket_types_size[2][2] = {
+        { THROTTLE_BPS_TOTAL, THROTTLE_BPS_READ },
+        { THROTTLE_BPS_TOTAL, THROTTLE_BPS_WRITE }
+    };
+    const BucketType bucket_types_units[2][2] = {
+        { THROTTLE_OPS_TOTAL, THROTTLE_OPS_READ },
+        { THROTTLE_OPS_TOTAL, THROTTLE_OPS_WRITE }
+    };
+    double lease_ops = INT_MAX, lease_bytes = INT_MAX;
+    int64_t next_timestamp;
+    unsigned i;
+
+    for (i = 0; i < 2; i++) {
+        LeakyBucket *bkt;
+
+        bkt = &ts->cfg.buckets[bucket_types_size[is_write][i]];
+        if (bkt->avg) {
+            lease_bytes = MIN(lease_bytes, (double) bkt->avg * ns /
+                                           NANOSECONDS_PER_SECOND);
+        }
+
+        bkt = &ts->cfg.buckets[bucket_types_units[is_write][i]];
+        if (bkt->avg) {
+            lease_ops = MIN(lease_ops, (double) bkt->avg * ns /
+                                       NANOSECONDS_PER_SECOND);
+        }
+    }
+
+    *ops = lease_ops;
+    *bytes = lease_bytes;
+    if (*ops < 1 || *bytes < 1) {
+        return false;
+    }
+
+    throttle_account_lease(ts, is_write, *ops, *bytes);
+    if (throttle_compute_timer(ts, is_write, qemu_clock_get_ns(clock_type),
+                               &next_timestamp)) {
+        throttle_account_lease(ts, is_write, -*ops, -*bytes);
+        return false;
+    }
+
+    return true;
+}
+
 /* return a ThrottleConfig based on the options in a ThrottleLimits
  *
  * @arg:    the ThrottleLimits object to read from
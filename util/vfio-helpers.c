@@ -23,6 +23,7 @@
 #include "qemu/event_notifier.h"
 #include "qemu/vfio-helpers.h"
 #include "qemu/lockable.h"
+#include "qemu/units.h"
 #include "trace.h"
 
 #define QEMU_VFIO_DEBUG 0
@@ -191,37 +192,85 @@ void qemu_vfio_pci_unmap_bar(QEMUVFIOState *s, int index, void *bar,
 /**
  * Initialize device IRQ with @irq_type and register an event notifier.
  */
-int qemu_vfio_pci_init_irq(QEMUVFIOState *s, EventNotifier *e,
-                           int irq_type, Error **errp)
+static int qemu_vfio_pci_get_irq_info(QEMUVFIOState *s, int irq_type,
+                                      struct vfio_irq_info *irq_info,
+                                      Error **errp)
+{
+    *irq_info = (struct vfio_irq_info) {
+        .argsz = sizeof(*irq_info),
+        .index = irq_type,
+    };
+    if (ioctl(s->device, VFIO_DEVICE_GET_IRQ_INFO, irq_info)) {
+        error_setg_errno(errp, errno, "Failed to get device interrupt info");
+        return -errno;
+    }
+    if (!(irq_info->flags & VFIO_IRQ_INFO_EVENTFD)) {
+        error_setg(errp, "Device interrupt doesn't support eventfd");
+        return -EINVAL;
+    }
+    return 0;
+}
+
+/* Return the number of interrupt vectors of @irq_type, or -errno */
+int qemu_vfio_pci_get_irq_count(QEMUVFIOState *s, int irq_type, Error **errp)
 {
+    struct vfio_irq_info irq_info;
     int r;
+
+    r = qemu_vfio_pci_get_irq_info(s, irq_type, &irq_info, errp);
+    if (r) {
+        return r;
+    }
+    return MIN(irq_info.count, INT_MAX);
+}
+
+/*
+ * Route the first @count vectors of @irq_type to the event notifiers in @e.
+ * Vectors that were set up before are torn down first, because the number
+ * of enabled MSI-X vectors cannot change while they are in use.
+ */
+int qemu_vfio_pci_init_irqs(QEMUVFIOState *s, EventNotifier **e,
+                            unsigned count, int irq_type, Error **errp)
+{
+    int r;
+    unsigned i;
     struct vfio_irq_set *irq_set;
     size_t irq_set_size;
-    struct vfio_irq_info irq_info = { .argsz = sizeof(irq_info) };
+    struct vfio_irq_info irq_info;
 
-    irq_info.index = irq_type;
-    if (ioctl(s->device, VFIO_DEVICE_GET_IRQ_INFO, &irq_info)) {
-        error_setg_errno(errp, errno, "Failed to get device interrupt info");
-        return -errno;
+    r = qemu_vfio_pci_get_irq_info(s, irq_type, &irq_info, errp);
+    if (r) {
+        return r;
     }
-    if (!(irq_info.flags & VFIO_IRQ_INFO_EVENTFD)) {
-        error_setg(errp, "Device interrupt doesn't support eventfd");
+    if (count > irq_info.count) {
+        error_setg(errp, "Device has only %u interrupt vectors, %u requested",
+                   irq_info.count, count);
         return -EINVAL;
     }
 
-    irq_set_size = sizeof(*irq_set) + sizeof(int);
+    irq_set_size = sizeof(*irq_set) + count * sizeof(int);
     irq_set = g_malloc0(irq_set_size);
 
-    /* Get to a known IRQ state */
+    /* Get to a known IRQ state; this fails harmlessly if none is set up */
+    *irq_set = (struct vfio_irq_set) {
+        .argsz = sizeof(*irq_set),
+        .flags = VFIO_IRQ_SET_DATA_NONE | VFIO_IRQ_SET_ACTION_TRIGGER,
+        .index = irq_info.index,
+        .start = 0,
+        .count = 0,
+    };
+    ioctl(s->device, VFIO_DEVICE_SET_IRQS, irq_set);
+
     *irq_set = (struct vfio_irq_set) {
         .argsz = irq_set_size,
         .flags = VFIO_IRQ_SET_DATA_EVENTFD | VFIO_IRQ_SET_ACTION_TRIGGER,
         .index = irq_info.index,
         .start = 0,
-        .count = 1,
+        .count = count,
     };
-
-    *(int *)&irq_set->data = event_notifier_get_fd(e);
+    for (i = 0; i < count; i++) {
+        ((int *)&irq_set->data)[i] = event_notifier_get_fd(e[i]);
+    }
     r = ioctl(s->device, VFIO_DEVICE_SET_IRQS, irq_set);
     g_free(irq_set);
     if (r) {
@@ -231,6 +280,12 @@ int qemu_vfio_pci_init_irq(QEMUVFIOState *s, EventNotifier *e,
     return 0;
 }
 
+int qemu_vfio_pci_init_irq(QEMUVFIOState *s, EventNotifier *e,
+                           int irq_type, Error **errp)
+{
+    return qemu_vfio_pci_init_irqs(s, &e, 1, irq_type, errp);
+}
+
 static int qemu_vfio_pci_read_config(QEMUVFIOState *s, void *buf,
                                      int size, int ofs)
 {
@@ -688,22 +743,55 @@ static bool qemu_vfio_verify_mappings(QEMUVFIOState *s)
     return true;
 }
 
+/*
+ * The IOMMU can only use its large pages if the IOVA has the same offset
+ * into them as the host address, which for guest RAM backed by huge pages
+ * is what makes them physically contiguous.  Fixed mappings are long-lived
+ * and mostly large, so spending a little IOVA space on this is cheap.
+ */
+static uint64_t qemu_vfio_iova_alignment(size_t size)
+{
+    if (size >= 1 * GiB) {
+        return 1 * GiB;
+    } else if (size >= 2 * MiB) {
+        return 2 * MiB;
+    }
+    return qemu_real_host_page_size;
+}
+
 static int
-qemu_vfio_find_fixed_iova(QEMUVFIOState *s, size_t size, uint64_t *iova)
+qemu_vfio_find_fixed_iova(QEMUVFIOState *s, void *host, size_t size,
+                          uint64_t *iova)
 {
+    uint64_t align = qemu_vfio_iova_alignment(size);
+    uint64_t host_offset = (uintptr_t)host & (align - 1);
     int i;
 
     for (i = 0; i < s->nb_iova_ranges; i++) {
+        uint64_t start;
+
         if (s->usable_iova_ranges[i].end < s->low_water_mark) {
             continue;
         }
         s->low_water_mark =
             MAX(s->low_water_mark, s->usable_iova_ranges[i].start);
 
-        if (s->usable_iova_ranges[i].end - s->low_water_mark + 1 >= size ||
-            s->usable_iova_ranges[i].end - s->low_water_mark + 1 == 0) {
-            *iova = s->low_water_mark;
-            s->low_water_mark += size;
+        start = ROUND_UP(s->low_water_mark - host_offset, align) + host_offset;
+        if (start < s->low_water_mark) {
+            start += align;
+        }
+        if (start > s->usable_iova_ranges[i].end) {
+            continue;
+        }
+        if (start + size > s->high_water_mark) {
+            /* Would run into the temporary mappings */
+            return -ENOMEM;
+        }
+
+        if (s->usable_iova_ranges[i].end - start + 1 >= size ||
+            s->usable_iova_ranges[i].end - start + 1 == 0) {
+            *iova = start;
+            s->low_water_mark = start + size;
             return 0;
         }
     }
@@ -758,7 +846,7 @@ int qemu_vfio_dma_map(QEMUVFIOState *s, void *host, size_t size,
             goto out;
         }
         if (!temporary) {
-            if (qemu_vfio_find_fixed_iova(s, size, &iova0)) {
+            if (qemu_vfio_find_fixed_iova(s, host, size, &iova0)) {
                 ret = -ENOMEM;
                 goto out;
             }
@@ -26,7 +26,10 @@
  * protocol messages over the UNIX domain socket.
  *
  * When virtqueues are set up libvhost-user calls set_watch() to monitor kick
- * fds. These fds are also handled in the VuServer->ctx AioContext.
+ * fds. These fds are also handled in the VuServer->ctx AioContext, unless
+ * the device gave the virtqueue its own AioContext in VuServer->queue_ctx.
+ * The kick handler and the requests it starts then run in that AioContext,
+ * and remove_watch() hops there so that it never races with the handler.
  *
  * Both vu_client_trip() and kick fd monitoring can be stopped by shutting down
  * the socket connection. Shutting down the socket connection causes
@@ -74,6 +77,110 @@ static void panic_cb(VuDev *vu_dev, const char *buf)
     error_report("vu_panic: %s", buf);
 }
 
+static void kick_handler(void *opaque);
+
+/*
+ * Wait until every request has been completed and its virtqueue notified.
+ * Completions may run in other threads, so the handshake on wait_idle
+ * makes sure that exactly one of them wakes us, or none if we saw
+ * in_flight reach zero ourselves.
+ */
+static void coroutine_fn vu_wait_idle(VuServer *server)
+{
+    for (;;) {
+        qatomic_set(&server->wait_idle, true);
+        smp_mb();
+        if (!qatomic_read(&server->in_flight)) {
+            if (!qatomic_xchg(&server->wait_idle, false)) {
+                /* A completion has already taken the wakeup */
+                qemu_coroutine_yield();
+            }
+            return;
+        }
+        qemu_coroutine_yield();
+    }
+}
+
+/* Messages after which libvhost-user may unmap guest memory */
+static bool vu_msg_unmaps_memory(VhostUserMsg *vmsg)
+{
+    switch (vmsg->request) {
+    case VHOST_USER_SET_MEM_TABLE:
+    case VHOST_USER_REM_MEM_REG:
+    case VHOST_USER_SET_LOG_BASE:
+        return true;
+    default:
+        return false;
+    }
+}
+
+/*
+ * Virtqueues with their own AioContext run concurrently with message
+ * processing.  Before libvhost-user replaces the memory regions or the
+ * log that they use, stop their kick handlers, make sure that none is
+ * still running by visiting each AioContext, and let the device drain
+ * the requests in flight.
+ */
+static void coroutine_fn vu_queues_quiesce(VuServer *server)
+{
+    AioContext *home_ctx = qemu_get_current_aio_context();
+    VuFdWatch *vu_fd_watch;
+    int i, j;
+
+    if (!server->queue_ctx) {
+        return;
+    }
+
+    qemu_mutex_lock(&server->watches_lock);
+    QTAILQ_FOREACH(vu_fd_watch, &server->vu_fd_watches, next) {
+        if (vu_fd_watch->ctx) {
+            aio_set_fd_handler(vu_fd_watch->ctx, vu_fd_watch->fd, true,
+                               NULL, NULL, NULL, vu_fd_watch);
+        }
+    }
+    qemu_mutex_unlock(&server->watches_lock);
+
+    for (i = 0; i < server->max_queues; i++) {
+        AioContext *ctx = server->queue_ctx[i];
+
+        for (j = 0; j < i && server->queue_ctx[j] != ctx; j++) {
+            /* only visit each AioContext once */
+        }
+        if (ctx && j == i && ctx != home_ctx) {
+            aio_co_reschedule_self(ctx);
+        }
+    }
+    if (qemu_get_current_aio_context() != home_ctx) {
+        aio_co_reschedule_self(home_ctx);
+    }
+
+    if (server->drained) {
+        server->drained(server, true);
+    }
+    /* Draining the node misses requests that still have to notify */
+    vu_wait_idle(server);
+    server->queues_quiesced = true;
+}
+
+static void coroutine_fn vu_queues_resume(VuServer *server)
+{
+    VuFdWatch *vu_fd_watch;
+
+    server->queues_quiesced = false;
+    if (server->drained) {
+        server->drained(server, false);
+    }
+
+    qemu_mutex_lock(&server->watches_lock);
+    QTAILQ_FOREACH(vu_fd_watch, &server->vu_fd_watches, next) {
+        if (vu_fd_watch->ctx) {
+            aio_set_fd_handler(vu_fd_watch->ctx, vu_fd_watch->fd, true,
+                               kick_handler, NULL, NULL, vu_fd_watch);
+        }
+    }
+    qemu_mutex_unlock(&server->watches_lock);
+}
+
 static bool coroutine_fn
 vu_message_read(VuDev *vu_dev, int conn_fd, VhostUserMsg *vmsg)
 {
@@ -160,6 +267,9 @@ vu_message_read(VuDev *vu_dev, int conn_fd, VhostUserMsg *vmsg)
         }
     }
 
+    if (vu_msg_unmaps_memory(vmsg)) {
+        vu_queues_quiesce(server);
+    }
     return true;
 
 fail:
@@ -174,9 +284,16 @@ static coroutine_fn void vu_client_trip(void *opaque)
     VuDev *vu_dev = &server->vu_dev;
 
     while (!vu_dev->broken && vu_dispatch(vu_dev)) {
-        /* Keep running */
+        if (server->queues_quiesced) {
+            vu_queues_resume(server);
+        }
+    }
+    if (server->queues_quiesced) {
+        vu_queues_resume(server);
     }
 
+    /* Requests still use the virtqueues and guest memory */
+    vu_wait_idle(server);
     vu_deinit(vu_dev);
 
     /* vu_deinit() should have called remove_watch() */
@@ -217,6 +334,24 @@ static void kick_handler(void *opaque)
     }
 }
 
+/* Return the AioContext of the virtqueue with kick fd @fd, if it has one */
+static AioContext *vu_kick_fd_queue_ctx(VuServer *server, int fd)
+{
+    VuDev *vu_dev = &server->vu_dev;
+    int i;
+
+    if (!server->queue_ctx) {
+        return NULL;
+    }
+    for (i = 0; i < vu_dev->max_queues; i++) {
+        if (vu_dev->vq[i].kick_fd == fd) {
+            return server->queue_ctx[i];
+        }
+    }
+    return NULL;
+}
+
+/* Called with watches_lock held */
 static VuFdWatch *find_vu_fd_watch(VuServer *server, int fd)
 {
 
@@ -239,6 +374,7 @@ set_watch(VuDev *vu_dev, int fd, int vu_evt,
     g_assert(fd >= 0);
     g_assert(cb);
 
+    qemu_mutex_lock(&server->watches_lock);
     VuFdWatch *vu_fd_watch = find_vu_fd_watch(server, fd);
 
     if (!vu_fd_watch) {
@@ -248,12 +384,14 @@ set_watch(VuDev *vu_dev, int fd, int vu_evt,
 
         vu_fd_watch->fd = fd;
         vu_fd_watch->cb = cb;
-        qemu_set_nonblock(fd);
-        aio_set_fd_handler(server->ioc->ctx, fd, true, kick_handler,
-                           NULL, NULL, vu_fd_watch);
+        vu_fd_watch->ctx = vu_kick_fd_queue_ctx(server, fd);
         vu_fd_watch->vu_dev = vu_dev;
         vu_fd_watch->pvt = pvt;
+        qemu_set_nonblock(fd);
+        aio_set_fd_handler(vu_fd_watch->ctx ?: server->ioc->ctx, fd, true,
+                           kick_handler, NULL, NULL, vu_fd_watch);
     }
+    qemu_mutex_unlock(&server->watches_lock);
 }
 
 
@@ -265,14 +403,36 @@ static void remove_watch(VuDev *vu_dev, int fd)
 
     server = container_of(vu_dev, VuServer, vu_dev);
 
+    qemu_mutex_lock(&server->watches_lock);
     VuFdWatch *vu_fd_watch = find_vu_fd_watch(server, fd);
 
     if (!vu_fd_watch) {
+        qemu_mutex_unlock(&server->watches_lock);
         return;
     }
-    aio_set_fd_handler(server->ioc->ctx, fd, true, NULL, NULL, NULL, NULL);
-
     QTAILQ_REMOVE(&server->vu_fd_watches, vu_fd_watch, next);
+    qemu_mutex_unlock(&server->watches_lock);
+
+    if (vu_fd_watch->ctx &&
+        vu_fd_watch->ctx != qemu_get_current_aio_context()) {
+        /*
+         * libvhost-user may reuse the virtqueue as soon as we return, so
+         * make sure that its kick handler is not running in the other
+         * thread.  Message processing runs in vu_client_trip(), so we can
+         * simply move there for a moment.
+         */
+        AioContext *home_ctx = qemu_get_current_aio_context();
+
+        assert(qemu_in_coroutine());
+        aio_co_reschedule_self(vu_fd_watch->ctx);
+        aio_set_fd_handler(vu_fd_watch->ctx, fd, true,
+                           NULL, NULL, NULL, NULL);
+        aio_co_reschedule_self(home_ctx);
+    } else {
+        aio_set_fd_handler(vu_fd_watch->ctx ?: server->ioc->ctx, fd, true,
+                           NULL, NULL, NULL, NULL);
+    }
+
     g_free(vu_fd_watch);
 }
 
@@ -332,10 +492,13 @@ void vhost_user_server_stop(VuServer *server)
     if (server->sioc) {
         VuFdWatch *vu_fd_watch;
 
+        qemu_mutex_lock(&server->watches_lock);
         QTAILQ_FOREACH(vu_fd_watch, &server->vu_fd_watches, next) {
-            aio_set_fd_handler(server->ctx, vu_fd_watch->fd, true,
+            aio_set_fd_handler(vu_fd_watch->ctx ?: server->ctx,
+                               vu_fd_watch->fd, true,
                                NULL, NULL, NULL, vu_fd_watch);
         }
+        qemu_mutex_unlock(&server->watches_lock);
 
         qio_channel_shutdown(server->ioc, QIO_CHANNEL_SHUTDOWN_BOTH, NULL);
 
@@ -348,6 +511,40 @@ void vhost_user_server_stop(VuServer *server)
         qio_net_listener_disconnect(server->listener);
         object_unref(OBJECT(server->listener));
     }
+
+    qemu_mutex_destroy(&server->watches_lock);
+}
+
+/*
+ * Count a request from the time it is popped from its virtqueue until it
+ * has been pushed back and the virtqueue notified.  May be called in any
+ * virtqueue's AioContext.
+ */
+void vhost_user_server_inc_in_flight(VuServer *server)
+{
+    qatomic_inc(&server->in_flight);
+}
+
+void vhost_user_server_dec_in_flight(VuServer *server)
+{
+    if (qatomic_fetch_dec(&server->in_flight) == 1 &&
+        qatomic_xchg(&server->wait_idle, false)) {
+        aio_co_wake(server->co_trip);
+    }
+}
+
+/*
+ * Process virtqueue i in @queue_ctx[i] instead of in the server's AioContext
+ * when the entry is not NULL.  @drained is called with @begin true to wait
+ * for the requests in flight before guest memory is unmapped, and with
+ * @begin false afterwards.  Must be called before a client connects.
+ */
+void vhost_user_server_set_queue_ctx(VuServer *server, AioContext **queue_ctx,
+                                     VuServerDrainedFn *drained)
+{
+    assert(!server->sioc);
+    server->queue_ctx = queue_ctx;
+    server->drained = drained;
 }
 
 /*
@@ -375,10 +572,15 @@ void vhost_user_server_attach_aio_context(VuServer *server, AioContext *ctx)
 
     qio_channel_attach_aio_context(server->ioc, ctx);
 
+    qemu_mutex_lock(&server->watches_lock);
     QTAILQ_FOREACH(vu_fd_watch, &server->vu_fd_watches, next) {
+        if (vu_fd_watch->ctx) {
+            continue;
+        }
         aio_set_fd_handler(ctx, vu_fd_watch->fd, true, kick_handler, NULL,
                            NULL, vu_fd_watch);
     }
+    qemu_mutex_unlock(&server->watches_lock);
 
     aio_co_schedule(ctx, server->co_trip);
 }
@@ -389,10 +591,15 @@ void vhost_user_server_detach_aio_context(VuServer *server)
     if (server->sioc) {
         VuFdWatch *vu_fd_watch;
 
+        qemu_mutex_lock(&server->watches_lock);
         QTAILQ_FOREACH(vu_fd_watch, &server->vu_fd_watches, next) {
+            if (vu_fd_watch->ctx) {
+                continue;
+            }
             aio_set_fd_handler(server->ctx, vu_fd_watch->fd, true,
                                NULL, NULL, NULL, vu_fd_watch);
         }
+        qemu_mutex_unlock(&server->watches_lock);
 
         qio_channel_detach_aio_context(server->ioc);
     }
@@ -442,5 +649,6 @@ bool vhost_user_server_start(VuServer *server,
                                      NULL);
 
     QTAILQ_INIT(&server->vu_fd_watches);
+    qemu_mutex_init(&server->watches_lock);
     return true;
 }